@@ -0,0 +1,32 @@
+# - Try to find the nghttp2 library.
+# Once done this will define
+#
+#  NGHTTP2_FOUND - system has nghttp2
+#  NGHTTP2_INCLUDE_DIR - the nghttp2 include directory
+#  NGHTTP2_LIBRARIES - Link these to use nghttp2
+#
+
+# use pkg-config to get the directories and then use these values
+# in the FIND_PATH() and FIND_LIBRARY() calls
+find_package(PkgConfig)
+pkg_check_modules(PC_NGHTTP2 QUIET libnghttp2)
+
+find_path(NGHTTP2_INCLUDE_DIR NAMES nghttp2/nghttp2.h
+  PATHS
+  ${PC_NGHTTP2_INCLUDEDIR}
+  ${PC_NGHTTP2_INCLUDE_DIRS}
+)
+
+find_library(NGHTTP2_LIBRARY NAMES nghttp2
+  PATHS
+  ${PC_NGHTTP2_LIBDIR}
+  ${PC_NGHTTP2_LIBRARY_DIRS}
+)
+
+set(NGHTTP2_LIBRARIES ${NGHTTP2_LIBRARY})
+
+include(FindPackageHandleStandardArgs)
+find_package_handle_standard_args(Nghttp2 DEFAULT_MSG NGHTTP2_LIBRARY NGHTTP2_INCLUDE_DIR)
+
+# show the NGHTTP2_INCLUDE_DIR and NGHTTP2_LIBRARY variables only in the advanced view
+mark_as_advanced(NGHTTP2_INCLUDE_DIR NGHTTP2_LIBRARY)
@@ -0,0 +1,78 @@
+# Build only the plugins used by a configuration file
+# ===================================================
+#
+#   cmake -DFLB_PLUGINS_CONFIG=/etc/fluent-bit/fluent-bit.conf ..
+#
+# The [INPUT], [FILTER] and [OUTPUT] sections of the file, and of the files
+# it includes with @INCLUDE, are scanned for their 'Name' and every other
+# built-in plugin is disabled. The emitter input is always built, filters
+# and the stream processor use it internally. Unused code is dropped at
+# link time.
+
+function(FLB_PLUGINS_CONFIG_SCAN file)
+  if(NOT EXISTS "${file}")
+    message(FATAL_ERROR "FLB_PLUGINS_CONFIG: cannot read '${file}'")
+  endif()
+
+  get_filename_component(dir "${file}" DIRECTORY)
+  file(STRINGS "${file}" lines)
+  set(section "")
+  set(used ${FLB_PLUGINS_USED})
+
+  foreach(line ${lines})
+    string(STRIP "${line}" line)
+    if(line MATCHES "^\\[([A-Za-z_]+)\\]")
+      string(TOUPPER "${CMAKE_MATCH_1}" section)
+    elseif(line MATCHES "^@[Ii][Nn][Cc][Ll][Uu][Dd][Ee][ \t]+(.+)$")
+      set(inc "${CMAKE_MATCH_1}")
+      if(NOT IS_ABSOLUTE "${inc}")
+        set(inc "${dir}/${inc}")
+      endif()
+      set(FLB_PLUGINS_USED ${used})
+      FLB_PLUGINS_CONFIG_SCAN("${inc}")
+      set(used ${FLB_PLUGINS_USED})
+    elseif(line MATCHES "^[Nn][Aa][Mm][Ee][ \t]+([A-Za-z0-9_-]+)")
+      string(TOUPPER "${CMAKE_MATCH_1}" name)
+      string(REPLACE "-" "_" name "${name}")
+      if(section STREQUAL "INPUT")
+        list(APPEND used "FLB_IN_${name}")
+      elseif(section STREQUAL "FILTER")
+        list(APPEND used "FLB_FILTER_${name}")
+      elseif(section STREQUAL "OUTPUT")
+        list(APPEND used "FLB_OUT_${name}")
+      endif()
+    endif()
+  endforeach()
+
+  set(FLB_PLUGINS_USED ${used} PARENT_SCOPE)
+endfunction()
+
+set(FLB_PLUGINS_USED FLB_IN_EMITTER)
+FLB_PLUGINS_CONFIG_SCAN("${FLB_PLUGINS_CONFIG}")
+
+get_cmake_property(vars CACHE_VARIABLES)
+foreach(var ${vars})
+  if(var MATCHES "^FLB_(IN|OUT|FILTER)_[A-Z0-9_]+$")
+    list(FIND FLB_PLUGINS_USED ${var} pos)
+    if(pos EQUAL -1)
+      set(${var} No)
+    else()
+      set(${var} Yes)
+    endif()
+  endif()
+endforeach()
+
+foreach(var ${FLB_PLUGINS_USED})
+  list(FIND vars ${var} pos)
+  if(pos EQUAL -1)
+    message(WARNING "FLB_PLUGINS_CONFIG: no built-in plugin for ${var}")
+  endif()
+endforeach()
+message(STATUS "Plugins from ${FLB_PLUGINS_CONFIG}: ${FLB_PLUGINS_USED}")
+
+# Drop the code not referenced by the selected plugins
+if(CMAKE_C_COMPILER_ID MATCHES "GNU|Clang" AND NOT APPLE)
+  set(CMAKE_C_FLAGS "${CMAKE_C_FLAGS} -ffunction-sections -fdata-sections")
+  set(CMAKE_EXE_LINKER_FLAGS "${CMAKE_EXE_LINKER_FLAGS} -Wl,--gc-sections")
+  set(CMAKE_SHARED_LINKER_FLAGS "${CMAKE_SHARED_LINKER_FLAGS} -Wl,--gc-sections")
+endif()
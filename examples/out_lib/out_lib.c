@@ -21,7 +21,7 @@
 #include <fluent-bit.h>
 #include <msgpack.h>
 
-int my_stdout_json(void* data, size_t size)
+int my_stdout_json(void* data, size_t size, void* cb_data)
 {
     printf("[%s]",__FUNCTION__);
     printf("%s",(char*)data);
@@ -31,16 +31,43 @@ int my_stdout_json(void* data, size_t size)
     return 0;
 }
 
-int my_stdout_msgpack(void* data, size_t size)
+int my_stdout_msgpack(void* data, size_t size, void* cb_data)
 {
+    size_t off = 0;
+    msgpack_unpacked result;
+
     printf("[%s]",__FUNCTION__);
-    msgpack_object_print(stdout, *(msgpack_object*)data);
+    msgpack_unpacked_init(&result);
+    if (msgpack_unpack_next(&result, data, size, &off)) {
+        msgpack_object_print(stdout, result.data);
+    }
+    msgpack_unpacked_destroy(&result);
     printf("\n");
 
     flb_lib_free(data);
     return 0;
 }
 
+/* The whole flush at once, the records are not copied one by one */
+int my_stdout_chunk(void* data, size_t size, void* cb_data)
+{
+    size_t off = 0;
+    msgpack_unpacked result;
+    struct flb_lib_chunk *chunk = data;
+
+    printf("[%s] tag=%s records=%i\n", __FUNCTION__,
+           chunk->tag, chunk->records);
+    msgpack_unpacked_init(&result);
+    while (msgpack_unpack_next(&result, chunk->data, chunk->size, &off)) {
+        msgpack_object_print(stdout, result.data);
+        printf("\n");
+    }
+    msgpack_unpacked_destroy(&result);
+
+    flb_lib_free(chunk);
+    return 0;
+}
+
 int main()
 {
     int i;
@@ -49,6 +76,7 @@ int main()
     flb_ctx_t *ctx;
     int in_ffd;
     int out_ffd;
+    struct flb_lib_out_cb cb;
 
     /* Initialize library */
     ctx = flb_create();
@@ -61,16 +89,27 @@ int main()
 
     /* Register my callback function */
 
+    cb.data = NULL;
+
     /* JSON format */
-    out_ffd = flb_output(ctx, "lib", my_stdout_json);
+    cb.cb = my_stdout_json;
+    out_ffd = flb_output(ctx, "lib", &cb);
     flb_output_set(ctx, out_ffd, "match", "test", "format", "json", NULL);
 
     /* Msgpack format */
     /*
-    out_ffd = flb_output(ctx, "lib", my_stdout_msgpack);
+    cb.cb = my_stdout_msgpack;
+    out_ffd = flb_output(ctx, "lib", &cb);
     flb_output_set(ctx, out_ffd, "match", "test", NULL);
     */
 
+    /* Chunk format */
+    /*
+    cb.cb = my_stdout_chunk;
+    out_ffd = flb_output(ctx, "lib", &cb);
+    flb_output_set(ctx, out_ffd, "match", "test", "format", "chunk", NULL);
+    */
+
     /* Start the background worker */
     flb_start(ctx);
 
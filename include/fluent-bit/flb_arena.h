@@ -0,0 +1,90 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef FLB_ARENA_H
+#define FLB_ARENA_H
+
+#include <fluent-bit/flb_info.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Arena allocator: short-lived memory is carved from large blocks and
+ * released in one shot, there is no per-allocation free. The core binds an
+ * arena to the filters chain of a chunk (flb_arena_current()) and another
+ * one to every output flush co-routine (flb_output_arena()), so plugins can
+ * take their temporary buffers from there instead of flb_malloc()/flb_free()
+ * pairs.
+ */
+#define FLB_ARENA_BLOCK_SIZE   16384
+#define FLB_ARENA_ALIGN        16
+
+struct flb_arena_block {
+    size_t size;                    /* usable bytes              */
+    size_t used;                    /* bytes given out           */
+    struct flb_arena_block *next;   /* older block               */
+    char data[] __attribute__((aligned(FLB_ARENA_ALIGN)));
+};
+
+struct flb_arena {
+    size_t block_size;              /* default size of a block   */
+    struct flb_arena_block *head;   /* block in use              */
+    struct flb_arena_block *first;  /* kept by flb_arena_reset() */
+    void *last;                     /* last allocation, if it can grow */
+
+    /* statistics */
+    uint64_t allocs;                /* allocations served        */
+    uint64_t blocks;                /* blocks requested          */
+    size_t size;                    /* bytes reserved in blocks  */
+    size_t peak;                    /* highest 'size' value      */
+};
+
+/*
+ * Growable buffer on top of an arena, flb_arena_buf_write() is a
+ * msgpack_packer write callback. Without an arena it uses the heap and
+ * must be released with flb_arena_buf_destroy().
+ */
+struct flb_arena_buf {
+    struct flb_arena *arena;
+    char *data;
+    size_t size;
+    size_t alloc;
+};
+
+struct flb_arena *flb_arena_create(size_t block_size);
+void flb_arena_destroy(struct flb_arena *arena);
+void flb_arena_reset(struct flb_arena *arena);
+
+void *flb_arena_alloc(struct flb_arena *arena, size_t size);
+void *flb_arena_calloc(struct flb_arena *arena, size_t n, size_t size);
+void *flb_arena_realloc(struct flb_arena *arena, void *ptr,
+                        size_t old_size, size_t size);
+char *flb_arena_strndup(struct flb_arena *arena, const char *s, size_t len);
+
+void flb_arena_buf_init(struct flb_arena_buf *buf, struct flb_arena *arena);
+int flb_arena_buf_write(void *data, const char *s, size_t len);
+void flb_arena_buf_destroy(struct flb_arena_buf *buf);
+
+/* Arena of the filters chain running in the calling thread, or NULL */
+struct flb_arena *flb_arena_current();
+struct flb_arena *flb_arena_enter();
+void flb_arena_leave(struct flb_arena *prev);
+void flb_arena_thread_exit();
+
+#endif
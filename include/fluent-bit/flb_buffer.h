@@ -27,15 +27,34 @@
 #include <monkey/mk_core.h>
 #include <fluent-bit/flb_config.h>
 #include <fluent-bit/flb_pipe.h>
+#include <fluent-bit/flb_ring.h>
 
 /* Worker event loop event type */
-#define FLB_BUFFER_EV_MNG     1024
-#define FLB_BUFFER_EV_ADD     1025
-#define FLB_BUFFER_EV_DEL     1026
-#define FLB_BUFFER_EV_DEL_REF 1027
-#define FLB_BUFFER_EV_MOV     1028
+#define FLB_BUFFER_EV_NOTIFY  1024
+
+/* Number of requests a worker queue can hold */
+#define FLB_BUFFER_QUEUE_SIZE 1024
 
 /* Macros to handle events into Buffering event loops */
+/*
+ * Sync modes (service 'Buffer_Sync'):
+ *
+ * - none  : chunks are written to the page cache, the kernel decides when
+ *           they reach the disk. A crash may lose any chunk not yet written
+ *           back.
+ * - normal: group commit, every 'Buffer_Sync_Interval' milliseconds a worker
+ *           do a fdatasync(2) of all the chunks it created since the last
+ *           commit and just then promote them to the outgoing queue. A crash
+ *           loses at most one commit window.
+ * - full  : every chunk is synced before being promoted, nothing acknowledged
+ *           by the buffer is lost on a crash.
+ */
+#define FLB_BUFFER_SYNC_NONE      0
+#define FLB_BUFFER_SYNC_NORMAL    1
+#define FLB_BUFFER_SYNC_FULL      2
+
+#define FLB_BUFFER_SYNC_INTERVAL  1000  /* milliseconds */
+
 #define FLB_BUFFER_EV_QCHUNK_PUSH  1
 #define FLB_BUFFER_EV_QCHUNK_POP   2
 
@@ -70,18 +89,25 @@ struct flb_buffer_worker {
      * event mapping: the event loop handle 'struct mk_event' types, we
      * set a new one per channel.
      */
-    struct mk_event e_mng;
-    struct mk_event e_add;
-    struct mk_event e_del;
-    struct mk_event e_del_ref;
-    struct mk_event e_mov;
-
-    /* channels */
-    flb_pipefd_t ch_mng[2];     /* management channel                    */
-    flb_pipefd_t ch_add[2];     /* add buffer channe                     */
-    flb_pipefd_t ch_del[2];     /* remove buffer chunk channel           */
-    flb_pipefd_t ch_del_ref[2]; /* remove buffer chunk reference channel */
-    flb_pipefd_t ch_mov[2];     /* move/promote a buffer chunk           */
+    struct mk_event e_notify;
+    struct mk_event e_sync;
+
+    /*
+     * Requests queues: the engine thread is the only producer and the
+     * worker the only consumer. The worker is woken up through 'ch_notify'
+     * only when it's waiting for events, so a burst of requests costs a
+     * single notification.
+     */
+    struct flb_ring *q_add;     /* store a buffer chunk                  */
+    struct flb_ring *q_del_ref; /* remove buffer chunk reference         */
+    struct flb_ring *q_retry;   /* save retry state of a reference       */
+    flb_pipefd_t ch_notify[2];  /* wake up channel (eventfd on Linux)    */
+    int idle;                   /* worker is waiting for events          */
+    int stop;                   /* stop request                          */
+
+    /* group commit (Buffer_Sync normal) */
+    int sync_fd;                /* commit timer                          */
+    struct mk_list sync_queue;  /* chunks waiting for the next commit    */
 
     /* event loop */
     struct mk_event_loop *evl;
@@ -91,8 +117,23 @@ struct flb_buffer_worker {
     struct flb_buffer *parent;
 };
 
+/* A chunk written by a worker, waiting for the next group commit */
+struct flb_buffer_sync {
+    int fd;                 /* chunk file descriptor  */
+    uint64_t routes;        /* suggested routes       */
+    char *name;             /* chunk file name        */
+    struct mk_list _head;   /* link to worker->sync_queue */
+};
+
 struct flb_buffer {
     char *path;
+    int sync;                  /* sync mode: FLB_BUFFER_SYNC_*           */
+    int sync_interval;         /* group commit interval (milliseconds)   */
+    int compress;              /* compress chunks at rest                */
+    int index_fd;              /* outgoing queue index (append only)     */
+    time_t index_time;         /* index load time                        */
+    void *index_known;         /* chunks known by the index (flb_hash)   */
+    void *index_dir;           /* background check cursor (DIR)          */
     int workers_n;             /* total number of workers */
     int worker_lru;            /* Last-Recent-Used worker */
     void *qworker;             /* queue chunk nodes  */
@@ -123,8 +164,11 @@ struct flb_buffer *flb_buffer_create(char *path, int workers,
 void flb_buffer_destroy(struct flb_buffer *ctx);
 
 int flb_buffer_start(struct flb_buffer *ctx);
+int flb_buffer_worker_push(struct flb_buffer_worker *worker,
+                           struct flb_ring *queue, void *data);
 int flb_buffer_stop(struct flb_buffer *ctx);
 int flb_buffer_engine_event(struct flb_buffer *ctx, uint32_t event);
+int flb_buffer_sync_path(char *path);
 
 #endif /* !FLB_BUFFER_H*/
 #endif /* !FLB_HAVE_BUFFERING */
@@ -37,36 +37,73 @@
 #define FLB_BUFFER_ERROR        -1
 #define FLB_BUFFER_NOTFOUND   -404
 
+/*
+ * Compressed chunk files (service 'Buffer_Compress') starts with a small
+ * header: the magic bytes followed by the original size as a 32 bits big
+ * endian number, then the LZF stream. A MessagePack chunk always starts
+ * with an array so it cannot be confused with the magic.
+ */
+#define FLB_BUFFER_CHUNK_LZF_MAGIC   "FLZ1"
+#define FLB_BUFFER_CHUNK_LZF_HEADER  8
+
 struct flb_buffer_chunk {
     void *data;
     size_t size;
+    uint8_t compress;       /* compress data before storing it */
     uint64_t routes;        /* bitmask routes */
+    int attemps;            /* retry state: attemps           */
+    time_t retry_at;        /* retry state: next retry time   */
     uint8_t tmp_len;
     int buf_worker;
     char tmp[128];          /* temporal ref: Tag/output_instance */
     char hash_hex[42];
 };
 
+/* Structure used to validate and obtain Chunk information */
+struct chunk_info {
+    char hash_str[41];
+    uint64_t routes;
+    int worker_id;
+    uint8_t full_scan;
+    char *tag;
+};
+
+int chunk_info(char *filename, struct chunk_info *info);
+
+void flb_buffer_chunk_id(void *data, size_t size, char *hash_hex);
+int flb_buffer_chunk_verify(char *hash_hex, void *data, size_t size);
+
 int flb_buffer_chunk_add(struct flb_buffer_worker *worker,
-                         struct mk_event *event, char **filename);
+                         struct flb_buffer_chunk *chunk, char **filename);
 int flb_buffer_chunk_delete(struct flb_buffer_worker *worker,
-                            struct mk_event *event);
+                            struct flb_buffer_chunk *chunk);
 int flb_buffer_chunk_delete_ref(struct flb_buffer_worker *worker,
-                                struct mk_event *event);
+                                struct flb_buffer_chunk *chunk);
 
 int flb_buffer_chunk_push(struct flb_buffer *ctx, void *data,
                           size_t size, char *tag, uint64_t routes,
-                          char *hash_hex);
+                          char *hash_hex, void **map, uint64_t *stored);
 
 int flb_buffer_chunk_pop(struct flb_buffer *ctx, int thread_id,
                          struct flb_task *task);
 
+int flb_buffer_chunk_retry(struct flb_buffer *ctx, struct flb_task *task,
+                           struct flb_output_instance *o_ins,
+                           int attemps, time_t retry_at);
+int flb_buffer_chunk_retry_save(struct flb_buffer_worker *worker,
+                                struct flb_buffer_chunk *chunk);
+int flb_buffer_chunk_retry_load(struct flb_buffer *ctx, char *name,
+                                uint64_t routes,
+                                struct flb_task_retry_state **states);
+
 int flb_buffer_chunk_mov(int type, char *name, uint64_t routes,
                          struct flb_buffer_worker *worker);
 
 int flb_buffer_chunk_real_move(struct flb_buffer_worker *worker,
-                               struct mk_event *event);
+                               struct flb_buffer_request *req);
 int flb_buffer_chunk_scan(struct flb_buffer *ctx);
+uint64_t flb_buffer_chunk_routes(struct flb_buffer *ctx, char *name);
+void *flb_buffer_chunk_decompress(void *buf, size_t size, size_t *out_size);
 
 #endif
 
@@ -0,0 +1,62 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <fluent-bit/flb_info.h>
+
+#ifdef FLB_HAVE_BUFFERING
+
+#ifndef FLB_BUFFER_INDEX_H
+#define FLB_BUFFER_INDEX_H
+
+#include <fluent-bit/flb_buffer.h>
+
+/*
+ * The outgoing queue index is an append-only text file, one record per
+ * line:
+ *
+ *   V version                      : format version (first line)
+ *   O mask_id name                 : output instance
+ *   A hash routes size chunk_name  : chunk added to outgoing/
+ *   R hash mask_id                 : a route of the chunk was delivered
+ *   D hash                         : chunk deleted
+ *
+ * it's read once at start time and written again with the live entries
+ * only. Chunk files are still the source of truth: entries with a missing
+ * file are dropped when loaded and files not found in the index are
+ * recovered by a background check.
+ */
+#define FLB_BUFFER_INDEX_FILE     "outgoing.index"
+#define FLB_BUFFER_INDEX_VERSION  1
+
+/* Background check: directory entries per round and round interval (ms) */
+#define FLB_BUFFER_INDEX_CHECK_BATCH  256
+#define FLB_BUFFER_INDEX_CHECK_MS     50
+
+int flb_buffer_index_load(struct flb_buffer *ctx);
+int flb_buffer_index_rewrite(struct flb_buffer *ctx);
+int flb_buffer_index_check(struct flb_buffer *ctx);
+void flb_buffer_index_check_end(struct flb_buffer *ctx);
+
+int flb_buffer_index_add(struct flb_buffer *ctx, char *name, uint64_t routes);
+int flb_buffer_index_route(struct flb_buffer *ctx, char *hash,
+                           uint64_t mask_id);
+int flb_buffer_index_del(struct flb_buffer *ctx, char *hash);
+
+#endif
+#endif /* !FLB_HAVE_BUFFERING */
@@ -45,8 +45,12 @@ struct flb_buffer_qchunk {
     char *tag;                 /* Tag (offset of file_path position)   */
     uint64_t routes;           /* All pending destinations             */
     char *data;                /* chunk data, after mmap(2)            */
+    int mapped;                /* data is a mapping (not compressed)   */
     size_t size;               /* data size                            */
+    size_t file_size;          /* expected chunk file size (0: any)    */
     char hash_str[41];         /* buffer hash (taken from filename     */
+    int retries_n;             /* number of saved retry states         */
+    struct flb_task_retry_state *retries; /* saved retry states        */
     struct mk_list _head;      /* Link to buffer head at ctx->queue    */
 };
 
@@ -57,6 +61,10 @@ struct flb_buffer_qworker {
     int ch_manager[2];         /* channel to signal worker */
     struct mk_event_loop *evl; /* event loop               */
     struct mk_list queue;      /* chunks queue             */
+
+    /* index background check */
+    int check_fd;              /* check timer              */
+    struct mk_event e_check;
 };
 
 int flb_buffer_qchunk_signal(uint64_t type, uint64_t val,
@@ -0,0 +1,53 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <fluent-bit/flb_info.h>
+
+#ifdef FLB_HAVE_BUFFERING
+
+#ifndef FLB_BUFFER_QUOTA_H
+#define FLB_BUFFER_QUOTA_H
+
+#include <monkey/mk_core.h>
+#include <fluent-bit/flb_buffer.h>
+#include <fluent-bit/flb_output.h>
+
+/*
+ * Per output disk quota (output property 'storage.total_limit_size'). Every
+ * output instance with a limit keeps the list of buffer chunks stored for
+ * it, oldest first, and the sum of their sizes. The accounting is only done
+ * by the engine thread.
+ */
+struct flb_buffer_quota_chunk {
+    char hash_hex[41];      /* chunk hash               */
+    int worker_id;          /* buffer worker owning it  */
+    size_t size;            /* chunk size               */
+    struct mk_list _head;   /* link to o_ins->fs_chunks */
+};
+
+uint64_t flb_buffer_quota_reserve(struct flb_buffer *ctx, char *hash_hex,
+                                  size_t size, uint64_t routes,
+                                  int worker_id);
+void flb_buffer_quota_release(struct flb_output_instance *o_ins,
+                              char *hash_hex);
+int flb_buffer_quota_scan(struct flb_buffer *ctx);
+void flb_buffer_quota_destroy(struct flb_buffer *ctx);
+
+#endif
+#endif /* !FLB_HAVE_BUFFERING */
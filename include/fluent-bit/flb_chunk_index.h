@@ -0,0 +1,65 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef FLB_CHUNK_INDEX_H
+#define FLB_CHUNK_INDEX_H
+
+#include <fluent-bit/flb_info.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Chunk index: a sidecar of a msgpack chunk built while records are being
+ * appended. It keeps the offset of every record and the range of their
+ * timestamps, so consumers can count, split or slice the chunk without
+ * unpacking it again.
+ *
+ * An index is only valid for the bytes it covered, 'records' is -1 when
+ * the content is not known (e.g: a chunk loaded from the buffer).
+ */
+struct flb_chunk_index {
+    int records;                 /* number of records, -1 if unknown  */
+    int slots;                   /* allocated entries of 'offsets'    */
+    size_t bytes;                /* chunk bytes covered by the index  */
+    uint32_t *offsets;           /* start of each record in the chunk */
+    time_t tm_min;               /* oldest record timestamp (seconds) */
+    time_t tm_max;               /* newest record timestamp (seconds) */
+};
+
+void flb_chunk_index_init(struct flb_chunk_index *idx);
+void flb_chunk_index_reset(struct flb_chunk_index *idx);
+void flb_chunk_index_invalidate(struct flb_chunk_index *idx);
+void flb_chunk_index_move(struct flb_chunk_index *dst,
+                          struct flb_chunk_index *src);
+int flb_chunk_index_append(struct flb_chunk_index *idx,
+                           const char *buf, size_t size);
+int flb_chunk_index_range(struct flb_chunk_index *idx, int from, int n,
+                          size_t *off, size_t *bytes);
+int flb_chunk_index_count(struct flb_chunk_index *idx,
+                          void *buf, size_t size);
+
+/* Is the index usable for a chunk of 'size' bytes ? */
+static inline int flb_chunk_index_valid(struct flb_chunk_index *idx,
+                                        size_t size)
+{
+    return (idx->records >= 0 && idx->bytes == size);
+}
+
+#endif
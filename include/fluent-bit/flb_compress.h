@@ -0,0 +1,87 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef FLB_COMPRESS_H
+#define FLB_COMPRESS_H
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_config.h>
+#include <fluent-bit/flb_pipe.h>
+#include <fluent-bit/flb_thread.h>
+#include <monkey/mk_core.h>
+
+#include <pthread.h>
+
+/* Service defaults */
+#define FLB_COMPRESS_WORKERS     2
+#define FLB_COMPRESS_BLOCK_SIZE  0
+
+/* Buffers smaller than this are compressed in place */
+#define FLB_COMPRESS_INLINE_MAX  (64 * 1024)
+
+/*
+ * Compression service: output plugins hand their payload to a pool of
+ * worker threads, the flush co-routine yields and it's resumed by its
+ * event loop once the compressed data is ready.
+ *
+ * When a block size is set, buffers larger than it are split and the
+ * blocks are compressed in parallel. The result is a sequence of gzip
+ * members that any gzip reader must handle (RFC 1952, section 2.2).
+ */
+struct flb_compress {
+    int workers;
+    size_t block_size;
+    int stop;
+    pthread_t *tids;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct mk_list queue;      /* blocks waiting for a worker */
+    struct flb_config *config;
+};
+
+struct flb_compress_block {
+    void *in_data;
+    size_t in_len;
+    void *out_data;
+    size_t out_len;
+    int ret;
+    struct flb_compress_job *job;
+    struct mk_list _head;
+};
+
+/*
+ * A compression request. The first two fields follow the layout of
+ * struct flb_upstream_conn, so the event loops resume the co-routine
+ * for FLB_ENGINE_EV_THREAD events as they do for network events.
+ */
+struct flb_compress_job {
+    struct mk_event event;
+    struct flb_thread *thread;
+
+    int pending;               /* blocks not yet compressed */
+    int blocks_n;
+    struct flb_compress_block *blocks;
+    flb_pipefd_t ch[2];        /* the last block notifies through here */
+};
+
+int flb_compress_gzip(struct flb_config *config, void *in_data, size_t in_len,
+                      void **out_data, size_t *out_len);
+void flb_compress_exit(struct flb_config *config);
+
+#endif
@@ -27,6 +27,8 @@
 #include <fluent-bit/flb_pipe.h>
 #include <fluent-bit/flb_log.h>
 #include <fluent-bit/flb_task_map.h>
+#include <fluent-bit/flb_slab.h>
+#include <fluent-bit/flb_engine_channel.h>
 
 #ifdef FLB_HAVE_TLS
 #include <fluent-bit/flb_io_tls.h>
@@ -37,10 +39,24 @@
 #define FLB_FLUSH_LIBCO         2
 
 #define FLB_CONFIG_FLUSH_SECS   5
+#define FLB_CONFIG_GRACE_SECS   5
 #define FLB_CONFIG_HTTP_LISTEN  "0.0.0.0"
 #define FLB_CONFIG_HTTP_PORT    "2020"
 #define FLB_CONFIG_DEFAULT_TAG  "fluent_bit"
 
+/* Threads initializing independent plugin instances at startup */
+#define FLB_CONFIG_INIT_WORKERS 4
+
+/* Tasks in flight, the map starts small and grows up to this limit */
+#define FLB_CONFIG_TASKS_MAX    2048
+
+/* Health check defaults */
+#define FLB_CONFIG_HC_PERIOD                60
+#define FLB_CONFIG_HC_ERRORS_COUNT          5
+#define FLB_CONFIG_HC_RETRY_FAILURE_COUNT   5
+#define FLB_CONFIG_HC_TASKS_USAGE           90
+#define FLB_CONFIG_HC_STALL_TIMEOUT         60
+
 /* Property configuration: key/value for an input/output instance */
 struct flb_config_prop {
     char *key;
@@ -59,10 +75,62 @@ struct flb_config {
     int flush_method;         /* Flush method set at build time */
 
     int daemon;               /* Run as a daemon ?              */
-    flb_pipefd_t shutdown_fd; /* Shutdown FD, 5 seconds         */
+
+    /*
+     * Global memory budget: 'mem_total_limit' is an optional limit for the
+     * memory used by all input instances (buffers, dyntags and in-flight
+     * tasks), 'mem_total' is the current usage, 'mem_total_peak' its
+     * highest value and 'mem_paused' the number of instances paused because
+     * of the budget.
+     */
+    size_t mem_total_limit;
+    size_t mem_total;
+    size_t mem_total_peak;
+    int mem_paused;
+
+    /* Memory pool (flb_mem_pool.c): region size, 0 = no pool */
+    size_t mem_pool;
+    int mem_pool_hugepages;
+
+    /* Parallel init of network outputs and some filters, 1 = serial */
+    int init_workers;
+
+    /* Compression service (flb_compress.c) */
+    int compress_workers;
+    size_t compress_block_size;
+    void *compress_ctx;
+
+    /* DNS resolver (flb_dns.c), 0 workers = resolve in place */
+    int dns_workers;
+    int dns_cache_ttl;
+    void *dns_ctx;
+
+    /* Upstream connections warm-up (flb_upstream.c) */
+    void *upstream_warm_ctx;
+
+    /* Filters pool (flb_filter_pool.c), 0 = filters run on append */
+    int filter_workers;
+    void *filter_pool;
+
+    /* CPUs for the engine and the threads without their own affinity */
+    struct flb_worker_cpus *cpu_affinity;
+
+    /*
+     * Engine shards (flb_engine_shard.c): engine loops of the service, the
+     * main configuration keeps their context. A shard has its own
+     * configuration, 'shard_parent' is the main one.
+     */
+    int engine_shards;
+    int shard_id;
+    struct flb_config *shard_parent;
+    void *shards_ctx;
+
+    int grace;                /* Shutdown grace (seconds)       */
+    flb_pipefd_t shutdown_fd; /* Shutdown drain timer FD        */
 
 #ifdef FLB_HAVE_STATS
-    int stats_fd;             /* Stats FD, 1 second             */
+    char *stats_path;         /* Shared memory stats segment    */
+    struct mk_event stats_event;
     struct flb_stats *stats_ctx;
 #endif
 
@@ -73,6 +141,7 @@ struct flb_config {
     pthread_t worker;            /* worker tid */
     flb_pipefd_t ch_data[2];     /* pipe to communicate caller with worker */
     flb_pipefd_t ch_manager[2];  /* channel to administrate fluent bit     */
+    struct flb_engine_channel *ch_engine; /* batched manager events        */
     flb_pipefd_t ch_notif[2];    /* channel to receive notifications       */
 
     /* Channel event loop (just for ch_notif) */
@@ -86,6 +155,11 @@ struct flb_config {
      */
     char *conf_path;
 
+    /* Hot reload (flb_reload.c): absolute path of the configuration file */
+    int hot_reload;
+    char *conf_file;
+    void *reload_ctx;
+
     /* Event */
     struct mk_event event_flush;
     struct mk_event event_shutdown;
@@ -93,11 +167,9 @@ struct flb_config {
     /* Collectors */
     struct mk_list collectors;
 
-    /* Plugins references */
-    struct mk_list in_plugins;
+    /* Plugins references, built-in ones are in the flb_plugins.h tables */
     struct mk_list parser_plugins;      /* not yet implemented */
-    struct mk_list filter_plugins;
-    struct mk_list out_plugins;
+    struct mk_list out_plugins;         /* proxy plugins */
 
     /* Inputs instances */
     struct mk_list inputs;
@@ -107,9 +179,22 @@ struct flb_config {
 
     /* Outputs instances */
     struct mk_list outputs;             /* list of output plugins   */
+    struct mk_list outputs_retired;     /* removed by a reload, draining */
 
-    /* Filter instances */
+    /*
+     * Filter instances: the threads running the chain out of the engine
+     * hold 'filters_lock' for reading, a reload replaces it for writing.
+     * It covers the outputs list too, a reload adds and retires outputs.
+     */
     struct mk_list filters;
+    pthread_rwlock_t filters_lock;
+
+    /* Routes cache: tag -> filters and outputs (flb_router.c) */
+    void *router_cache;
+    int router_gen;                     /* bumped on every invalidation */
+
+    /* Interned tags of dyntags and tasks (flb_tag.c) */
+    struct flb_tag_table *tags;
 
     struct mk_event_loop *evl;          /* the event loop (mk_core) */
 
@@ -122,6 +207,7 @@ struct flb_config {
     /* Logging */
     char *log_file;
     struct flb_log *log;
+    int log_rate_limit;    /* messages per second and call site */
 
     /* Parser Conf */
     char *parsers_file;
@@ -135,10 +221,8 @@ struct flb_config {
     /* Workers: threads spawn using flb_worker_create() */
     struct mk_list workers;
 
-    /* Metrics exporter */
-#ifdef FLB_HAVE_METRICS
-    void *metrics;
-#endif
+    /* /proc files shared by the inputs (flb_procfs_get()) */
+    struct mk_list procfs_files;
 
     /* HTTP Server */
 #ifdef FLB_HAVE_HTTP_SERVER
@@ -146,12 +230,30 @@ struct flb_config {
     char *http_port;          /* HTTP Port / TCP number */
     char *http_listen;        /* Interface Address      */
     void *http_ctx;           /* Monkey HTTP context    */
+
+    /* Pipeline health check thresholds (/api/v1/health), 0 disables */
+    int health_check;
+    int hc_period;                /* window of the error counts (sec)  */
+    int hc_errors_count;          /* output errors in the window       */
+    int hc_retry_failure_count;   /* exhausted retries in the window   */
+    int hc_tasks_usage;           /* percent of the tasks map in use   */
+    size_t hc_backlog_size;       /* bytes buffered by inputs + tasks  */
+    int hc_retries_pending;       /* retries waiting to run            */
+    int hc_stall_timeout;         /* seconds without engine ticks      */
+#endif
+
+#ifdef FLB_HAVE_METRICS
+    int task_trace;               /* trace one task every N (0: off)   */
+    struct flb_task_traces *task_traces;
 #endif
 
 #ifdef FLB_HAVE_BUFFERING
     struct flb_buffer *buffer_ctx;
     int buffer_workers;
     char *buffer_path;
+    int buffer_sync;              /* sync mode: FLB_BUFFER_SYNC_*      */
+    int buffer_sync_interval;     /* group commit interval (ms)        */
+    int buffer_compress;          /* compress chunks at rest           */
 #endif
 
     /* Embedded SQL Database support (SQLite3) */
@@ -164,6 +266,11 @@ struct flb_config {
     struct mk_list luajit_list;
 #endif
 
+    /* Stream processor tasks ([STREAM_TASK]) */
+#ifdef FLB_HAVE_STREAM_PROCESSOR
+    struct mk_list stream_tasks;
+#endif
+
     /*
      * Input table-id: table to keep a reference of thread-IDs used by the
      * input plugins.
@@ -172,7 +279,26 @@ struct flb_config {
 
     void *sched;
 
-    struct flb_task_map tasks_map[2048];
+    /*
+     * Tasks map: the task of every ID, a bitmap of the IDs in use and the
+     * lowest word of the bitmap that may have a free ID. It grows on
+     * demand up to 'tasks_max' entries, see flb_task.c.
+     */
+    struct flb_task_map *tasks_map;
+    uint64_t *tasks_bitmap;
+    int tasks_map_size;
+    int tasks_map_hint;
+    int tasks_max;
+
+    /* Caches of the task structures, see flb_task_slabs_create() */
+    struct flb_slab *task_slab;
+    struct flb_slab *route_slab;
+    struct flb_slab *retry_slab;
+    struct flb_slab *thread_slab;   /* output co-routines */
+
+    int tasks_count;              /* tasks in the map                  */
+    int retries_pending;          /* retries scheduled or in a backlog */
+    time_t engine_heartbeat;      /* last tick of the flush timer      */
 };
 
 #define FLB_CONFIG_LOG_LEVEL(c) (c->log->level)
@@ -196,19 +322,48 @@ enum conf_type {
 };
 
 #define FLB_CONF_STR_FLUSH    "Flush"
+#define FLB_CONF_STR_GRACE    "Grace"
 #define FLB_CONF_STR_DAEMON   "Daemon"
 #define FLB_CONF_STR_LOGFILE  "Log_File"
 #define FLB_CONF_STR_LOGLEVEL "Log_Level"
+#define FLB_CONF_STR_LOGRATELIMIT "Log_Rate_Limit"
 #define FLB_CONF_STR_PARSERS_FILE "Parsers_File"
 #define FLB_CONF_STR_PLUGINS_FILE "Plugins_File"
+#define FLB_CONF_STR_MEM_TOTAL_LIMIT "Mem_Total_Limit"
+#define FLB_CONF_STR_MEM_POOL     "Mem_Pool"
+#define FLB_CONF_STR_MEM_POOL_HUGEPAGES "Mem_Pool_Hugepages"
+#define FLB_CONF_STR_INIT_WORKERS "Init_Workers"
+#define FLB_CONF_STR_TASKS_MAX    "Tasks_Max"
+#define FLB_CONF_STR_COMPRESS_WORKERS "Compress_Workers"
+#define FLB_CONF_STR_COMPRESS_BLOCK_SIZE "Compress_Block_Size"
+#define FLB_CONF_STR_FILTER_WORKERS "Filter_Workers"
+#define FLB_CONF_STR_DNS_WORKERS  "DNS_Workers"
+#define FLB_CONF_STR_DNS_CACHE_TTL "DNS_Cache_TTL"
+#define FLB_CONF_STR_CPU_AFFINITY "CPU_Affinity"
+#define FLB_CONF_STR_ENGINE_SHARDS "Engine_Shards"
+#define FLB_CONF_STR_TASK_TRACE   "Task_Trace"
+#define FLB_CONF_STR_STATS_PATH   "Stats_Path"
+#define FLB_CONF_STR_HOT_RELOAD   "Hot_Reload"
+
 #ifdef FLB_HAVE_HTTP_SERVER
 #define FLB_CONF_STR_HTTP_SERVER  "HTTP_Server"
 #define FLB_CONF_STR_HTTP_LISTEN  "HTTP_Listen"
 #define FLB_CONF_STR_HTTP_PORT    "HTTP_Port"
+#define FLB_CONF_STR_HEALTH_CHECK "Health_Check"
+#define FLB_CONF_STR_HC_PERIOD    "HC_Period"
+#define FLB_CONF_STR_HC_ERRORS_COUNT "HC_Errors_Count"
+#define FLB_CONF_STR_HC_RETRY_FAILURE_COUNT "HC_Retry_Failure_Count"
+#define FLB_CONF_STR_HC_TASKS_USAGE "HC_Tasks_Usage"
+#define FLB_CONF_STR_HC_BACKLOG_SIZE "HC_Backlog_Size"
+#define FLB_CONF_STR_HC_RETRIES_PENDING "HC_Retries_Pending"
+#define FLB_CONF_STR_HC_STALL_TIMEOUT "HC_Stall_Timeout"
 #endif /* FLB_HAVE_HTTP_SERVER */
 #ifdef FLB_HAVE_BUFFERING
 #define FLB_CONF_STR_BUF_PATH     "Buffer_Path"
 #define FLB_CONF_STR_BUF_WORKERS  "Buffer_Workers"
+#define FLB_CONF_STR_BUF_SYNC     "Buffer_Sync"
+#define FLB_CONF_STR_BUF_SYNC_INTERVAL "Buffer_Sync_Interval"
+#define FLB_CONF_STR_BUF_COMPRESS "Buffer_Compress"
 #endif /*FLB_HAVE_BUFFERING*/
 
 
@@ -0,0 +1,36 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef FLB_CRC32C_H
+#define FLB_CRC32C_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * CRC-32C (Castagnoli): it uses the SSE4.2 crc32 instruction when the CPU
+ * have it (checked at run time) or the ARMv8 CRC extension when enabled at
+ * build time, otherwise a table based implementation.
+ *
+ * The 'crc' argument allows to continue a previous value, start with 0.
+ */
+uint32_t flb_crc32c(uint32_t crc, const void *data, size_t len);
+uint32_t flb_crc32c_sw(uint32_t crc, const void *data, size_t len);
+
+#endif
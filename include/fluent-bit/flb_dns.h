@@ -0,0 +1,107 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef FLB_DNS_H
+#define FLB_DNS_H
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_config.h>
+#include <fluent-bit/flb_pipe.h>
+#include <fluent-bit/flb_socket.h>
+#include <monkey/mk_core.h>
+
+#include <time.h>
+#include <pthread.h>
+
+/* Service defaults */
+#define FLB_DNS_WORKERS     1
+#define FLB_DNS_CACHE_TTL   30      /* seconds, 0 = no cache */
+
+/* Addresses kept from a single lookup */
+#define FLB_DNS_ADDRS_MAX   16
+
+/*
+ * DNS resolver: getaddrinfo() blocks, so lookups made from a flush
+ * co-routine are handed to a pool of resolver threads, the co-routine
+ * yields and it's resumed by its event loop once the addresses are
+ * ready. Outside of a co-routine the caller resolves in place.
+ *
+ * The addresses of an upstream are cached for 'DNS_Cache_TTL' seconds,
+ * getaddrinfo() does not report the record TTL. New connections rotate
+ * across the cached addresses.
+ */
+struct flb_dns {
+    int workers;
+    int stop;
+    pthread_t *tids;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct mk_list queue;      /* lookups waiting for a worker */
+    struct flb_config *config;
+};
+
+struct flb_dns_addr {
+    int family;
+    socklen_t len;
+    struct sockaddr_storage addr;
+};
+
+/* Addresses of an upstream host */
+struct flb_dns_cache {
+    int count;
+    unsigned int next;         /* address for the next connection */
+    time_t expire;
+    struct flb_dns_addr *addrs;
+};
+
+struct flb_thread;
+
+/*
+ * A lookup request. The first two fields follow the layout of struct
+ * flb_upstream_conn, so the event loops resume the co-routine for
+ * FLB_ENGINE_EV_THREAD events as they do for network events.
+ */
+struct flb_dns_job {
+    struct mk_event event;
+    struct flb_thread *thread;
+
+    char *host;
+    char port[8];
+    int family;
+    int ret;                   /* getaddrinfo() return value */
+    int count;
+    struct flb_dns_addr *addrs;
+    flb_pipefd_t ch[2];        /* the worker notifies through here */
+    struct mk_list _head;
+};
+
+int flb_dns_resolve(struct flb_config *config, char *host, int port,
+                    int family, struct flb_thread *th,
+                    struct mk_event_loop *evl,
+                    struct flb_dns_addr **addrs, int *count);
+
+int flb_dns_cache_get(struct flb_config *config, struct flb_dns_cache *cache,
+                      pthread_mutex_t *lock, char *host, int port,
+                      int family, struct flb_thread *th,
+                      struct mk_event_loop *evl, struct flb_dns_addr *addr);
+void flb_dns_cache_destroy(struct flb_dns_cache *cache);
+
+void flb_dns_exit(struct flb_config *config);
+
+#endif
@@ -26,6 +26,8 @@
 #include <fluent-bit/flb_input.h>
 #include <fluent-bit/flb_output.h>
 
+struct flb_output_instance;
+
 /* Types of events handled by the Server engine */
 #define FLB_ENGINE_EV_CORE          MK_EVENT_NOTIFICATION
 #define FLB_ENGINE_EV_CUSTOM        MK_EVENT_CUSTOM
@@ -39,6 +41,7 @@
 #define FLB_ENGINE_EV_STOP      FLB_BITS_U64_SET(1, 3) /* Requested to stop */
 #define FLB_ENGINE_EV_SHUTDOWN  FLB_BITS_U64_SET(1, 4) /* Engine shutdown   */
 #define FLB_ENGINE_EV_STATS     FLB_BITS_U64_SET(1, 5) /* Collect stats     */
+#define FLB_ENGINE_EV_RELOAD    FLB_BITS_U64_SET(1, 6) /* Reload config     */
 
 /* Similar to engine events, but used as return values */
 #define FLB_ENGINE_STARTED      FLB_BITS_U64_LOW(FLB_ENGINE_EV_STARTED)
@@ -46,6 +49,7 @@
 #define FLB_ENGINE_STOP         FLB_BITS_U64_LOW(FLB_ENGINE_EV_STOP)
 #define FLB_ENGINE_SHUTDOWN     FLB_BITS_U64_LOW(FLB_ENGINE_EV_SHUTDOWN)
 #define FLB_ENGINE_STATS        FLB_BITS_U64_LOW(FLB_ENGINE_EV_STATS)
+#define FLB_ENGINE_RELOAD       FLB_BITS_U64_LOW(FLB_ENGINE_EV_RELOAD)
 
 /* Engine signals: Task, it only refer to the type */
 #define FLB_ENGINE_TASK         2
@@ -62,5 +66,11 @@ int flb_engine_flush(struct flb_config *config,
 int flb_engine_exit(struct flb_config *config);
 int flb_engine_shutdown(struct flb_config *config);
 int flb_engine_destroy_tasks(struct mk_list *tasks);
+int flb_engine_output_flush_timer(struct flb_output_instance *o_ins,
+                                  struct flb_config *config);
+
+void flb_engine_evl_init();
+void flb_engine_evl_set(struct mk_event_loop *evl);
+struct mk_event_loop *flb_engine_evl_get();
 
 #endif
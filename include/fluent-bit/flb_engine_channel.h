@@ -0,0 +1,80 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef FLB_ENGINE_CHANNEL_H
+#define FLB_ENGINE_CHANNEL_H
+
+#include <stdint.h>
+#include <monkey/mk_core.h>
+#include <fluent-bit/flb_pipe.h>
+
+/*
+ * Engine channel: events for the engine manager (task returns, input
+ * thread completions, buffer events, stop requests) are 64 bits messages.
+ * Instead of writing each one to the manager pipe, producers push them
+ * into a lock-free multi-producer / single-consumer queue and only ring a
+ * doorbell (an eventfd on Linux) when the engine is not already scheduled
+ * to drain it. The engine consumes the doorbell once and processes all
+ * queued events in a batch.
+ *
+ * If the queue is full the event is written to the manager pipe instead.
+ */
+
+#define FLB_ENGINE_CHANNEL_SIZE   4096   /* queued events                */
+#define FLB_ENGINE_CHANNEL_BATCH  64     /* events popped at once        */
+#define FLB_ENGINE_CHANNEL_CACHE_LINE  64
+
+struct flb_engine_channel_cell {
+    uint32_t seq;
+    uint64_t val;
+};
+
+struct flb_engine_channel {
+    /* Doorbell event in the engine loop, it must be the first member */
+    struct mk_event event;
+
+    flb_pipefd_t doorbell[2];          /* eventfd: both ends are the same */
+    uint32_t mask;                     /* cells - 1                       */
+    struct flb_engine_channel_cell *cells;
+
+    /* next position to reserve, shared by the producers */
+    uint32_t head __attribute__((aligned(FLB_ENGINE_CHANNEL_CACHE_LINE)));
+
+    /* set once a producer rang the doorbell, cleared by the consumer */
+    int armed __attribute__((aligned(FLB_ENGINE_CHANNEL_CACHE_LINE)));
+
+    /* consumer position, only used by the engine thread */
+    uint32_t tail __attribute__((aligned(FLB_ENGINE_CHANNEL_CACHE_LINE)));
+};
+
+struct flb_config;
+
+struct flb_engine_channel *flb_engine_channel_create(struct mk_event_loop *evl,
+                                                     uint32_t size);
+void flb_engine_channel_destroy(struct flb_engine_channel *ch);
+
+int flb_engine_channel_push(struct flb_engine_channel *ch, uint64_t val);
+void flb_engine_channel_ack(struct flb_engine_channel *ch);
+int flb_engine_channel_pop(struct flb_engine_channel *ch,
+                           uint64_t *vals, int max);
+void flb_engine_channel_wake(struct flb_engine_channel *ch);
+
+int flb_engine_notify(struct flb_config *config, uint64_t val);
+
+#endif
@@ -27,12 +27,24 @@
 
 int flb_engine_dispatch(uint64_t id, struct flb_input_instance *in,
                         struct flb_config *config);
+int flb_engine_dispatch_dyntag(uint64_t id, struct flb_input_dyntag *dt,
+                               struct flb_config *config);
+int flb_engine_dispatch_filtered(struct flb_input_instance *in,
+                                 struct flb_config *config);
+int flb_engine_dispatch_pending(struct flb_output_instance *o_ins,
+                                struct flb_config *config);
 int flb_engine_dispatch_retry(struct flb_task_retry *retry,
                               struct flb_config *config);
+int flb_engine_dispatch_coalesced(struct flb_output_instance *o_ins,
+                                  struct flb_config *config);
+int flb_engine_dispatch_backlog(struct flb_output_instance *o_ins,
+                                struct flb_config *config);
 int flb_engine_dispatch_direct(uint64_t id,
                                struct flb_input_instance *in,
                                char *buf, size_t size,
                                char *tag, uint64_t routes,
                                char *hash_str,
+                               struct flb_task_retry_state *retries,
+                               int retries_n,
                                struct flb_config *config);
 #endif
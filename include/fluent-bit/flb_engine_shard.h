@@ -0,0 +1,80 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef FLB_ENGINE_SHARD_H
+#define FLB_ENGINE_SHARD_H
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_config.h>
+
+#include <pthread.h>
+
+/*
+ * Engine shards: with 'Engine_Shards' greater than one, the service runs
+ * that many engine loops, each one in its own thread. The main engine is
+ * shard 0, every other shard has a configuration of its own holding its
+ * event loop, scheduler, tasks map and a copy of the filters and outputs,
+ * so the upstream connections of an output are not shared either.
+ *
+ * The inputs are spread over the shards in round robin, or assigned with
+ * their 'shard' property, and moved to the configuration of their shard
+ * before they are initialized. Settings and resources kept by the service
+ * (log, parsers, CPU affinity, memory pool, HTTP server) stay in the main
+ * configuration.
+ */
+
+/* Shard status */
+#define FLB_ENGINE_SHARD_NEW      0
+#define FLB_ENGINE_SHARD_RUNNING  1
+#define FLB_ENGINE_SHARD_FAILED   2
+
+struct flb_engine_shard {
+    int id;
+    int status;
+    int started;                    /* the thread was spawned          */
+    pthread_t tid;
+    struct flb_config *config;      /* NULL once the shard released it */
+};
+
+struct flb_engine_shards {
+    int count;                      /* shards, without the main engine */
+    int stopping;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct flb_engine_shard *shards;
+};
+
+int flb_engine_shards_create(struct flb_config *config);
+int flb_engine_shards_start(struct flb_config *config);
+void flb_engine_shard_ready(struct flb_config *config, int ok);
+void flb_engine_shard_detach(struct flb_config *config);
+void flb_engine_shards_stop(struct flb_config *config);
+void flb_engine_shards_exit(struct flb_config *config);
+void flb_engine_shards_destroy(struct flb_config *config);
+
+/*
+ * Walk the configuration of every engine: flb_engine_shards_lock() returns
+ * the number of engines, flb_engine_shard_get() the configuration of one
+ * of them (0 is the main one) or NULL if it was released already.
+ */
+int flb_engine_shards_lock(struct flb_config *config);
+void flb_engine_shards_unlock(struct flb_config *config);
+struct flb_config *flb_engine_shard_get(struct flb_config *config, int i);
+
+#endif
@@ -21,16 +21,53 @@
 #define FLB_FILTER_H
 
 #include <fluent-bit/flb_config.h>
+
+#ifdef FLB_HAVE_METRICS
+#include <fluent-bit/flb_metrics.h>
+#endif
+
 #include <msgpack.h>
+#include <pthread.h>
 
 #define FLB_FILTER_MODIFIED 1
 #define FLB_FILTER_NOTOUCH  2
 
+/* Plugin flags */
+#define FLB_FILTER_INIT_PARALLEL  1  /* cb_init only sets up its own context */
+#define FLB_FILTER_THREAD_SAFE    2  /* callbacks can run concurrently     */
+
 struct flb_input_instance;
 struct flb_filter_instance;
+struct flb_filter_pushdown;
+
+/*
+ * Decoded records: filters implementing the 'cb_filter_batch' callback
+ * receive the records already unpacked, the chunk is decoded once for the
+ * whole filters chain and encoded back just once at the end.
+ *
+ * A filter can modify a record replacing its 'map' object (memory for new
+ * objects must be taken with flb_filter_batch_alloc()) or discard it by
+ * setting 'drop'. A filter replacing 'ts' or 'map' must set 'raw' to NULL:
+ * records that still have their raw bytes are copied as is when the batch
+ * is encoded, only the modified ones are packed again.
+ */
+struct flb_filter_record {
+    int drop;                       /* skip when encoding     */
+    msgpack_object ts;              /* record timestamp       */
+    msgpack_object map;             /* record content         */
+    char *raw;                      /* original bytes or NULL */
+    size_t raw_size;
+};
+
+struct flb_filter_batch {
+    int count;                          /* number of records  */
+    int size;                           /* allocated slots    */
+    struct flb_filter_record *records;  /* records array      */
+    msgpack_zone *zone;                 /* objects memory     */
+};
 
 struct flb_filter_plugin {
-    int flags;             /* Flags (not available at the moment */
+    int flags;             /* Flags: FLB_FILTER_INIT_PARALLEL, ... */
     char *name;            /* Filter short name            */
     char *description;     /* Description                  */
 
@@ -40,6 +77,19 @@ struct flb_filter_plugin {
                       void **, size_t *,
                       struct flb_filter_instance *,
                       void *, struct flb_config *);
+
+    /* Optional: filter over decoded records, takes precedence on cb_filter */
+    int (*cb_filter_batch) (struct flb_filter_batch *, char *, int,
+                            struct flb_filter_instance *,
+                            void *, struct flb_config *);
+
+    /*
+     * Optional: rules the inputs apply before building the records, see
+     * flb_filter_pushdown.h. A plugin implementing it never modifies the
+     * records, it can only drop them.
+     */
+    int (*cb_pushdown) (struct flb_filter_pushdown *,
+                        struct flb_filter_instance *, void *);
     int (*cb_exit) (void *, struct flb_config *);
 
     struct mk_list _head;  /* Link to parent list (config->filters) */
@@ -53,8 +103,21 @@ struct flb_filter_instance {
     void *data;
     struct flb_filter_plugin *p;   /* original plugin          */
     struct mk_list properties;     /* config properties        */
+    pthread_mutex_t lock;          /* filters pool: serialize  */
     struct mk_list _head;          /* link to config->filters  */
 
+#ifdef FLB_HAVE_METRICS
+    struct flb_metrics *metrics;   /* registered by the plugin */
+
+    /* Handles of the core metrics, resolved on creation */
+    struct flb_metric *m_records_in;
+    struct flb_metric *m_records_out;
+    struct flb_metric *m_bytes_in;
+    struct flb_metric *m_bytes_out;
+    struct flb_metric *m_drop_records;
+    struct flb_metric *m_time;
+#endif
+
     /* Keep a reference to the original context this instance belongs to */
     struct flb_config *config;
 };
@@ -62,13 +125,36 @@ struct flb_filter_instance {
 int flb_filter_set_property(struct flb_filter_instance *filter, char *k, char *v);
 char *flb_filter_get_property(char *key, struct flb_filter_instance *i);
 
+/* Built-in plugins, NULL terminated */
+extern struct flb_filter_plugin *const flb_filter_plugins[];
+
 struct flb_filter_instance *flb_filter_new(struct flb_config *config,
                                            char *filter, void *data);
+struct flb_filter_instance *flb_filter_new_detached(struct flb_config *config,
+                                                    char *filter, void *data,
+                                                    struct mk_list *list);
+int flb_filter_instance_init(struct flb_filter_instance *ins,
+                             struct flb_config *config);
+int flb_filter_instance_equal(struct flb_filter_instance *a,
+                              struct flb_filter_instance *b);
+void flb_filter_instance_destroy(struct flb_filter_instance *ins, int exit);
+void flb_filter_chain_swap(struct flb_config *config,
+                           struct flb_filter_instance **chain, int n,
+                           struct mk_list *removed);
 void flb_filter_exit(struct flb_config *config);
 void flb_filter_do(msgpack_sbuffer *mp_sbuf, msgpack_packer *mp_pck,
                    void *data, size_t bytes,
                    char *tag, int tag_len,
                    struct flb_config *config);
+int flb_filter_do_threaded(msgpack_sbuffer *mp_sbuf, msgpack_packer *mp_pck,
+                           void *data, size_t bytes,
+                           char *tag, int tag_len,
+                           struct flb_config *config);
+void flb_filter_do_locked(msgpack_sbuffer *mp_sbuf, msgpack_packer *mp_pck,
+                          void *data, size_t bytes,
+                          char *tag, int tag_len,
+                          struct flb_config *config);
+void *flb_filter_batch_alloc(struct flb_filter_batch *batch, size_t size);
 void flb_filter_initialize_all(struct flb_config *config);
 void flb_filter_set_context(struct flb_filter_instance *ins, void *context);
 
@@ -0,0 +1,85 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef FLB_FILTER_POOL_H
+#define FLB_FILTER_POOL_H
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_config.h>
+#include <fluent-bit/flb_pipe.h>
+#include <fluent-bit/flb_task.h>
+#include <fluent-bit/flb_chunk_index.h>
+#include <monkey/mk_core.h>
+#include <msgpack.h>
+
+#include <pthread.h>
+
+/*
+ * Filters pool: when 'Filter_Workers' is set, the filters chain does not
+ * run when records are appended to the input buffers; once a chunk is
+ * sealed into a task, the task waits in the FLB_TASK_FILTERING state while
+ * a worker thread runs the chain over the whole chunk.
+ *
+ * Every worker owns a queue of jobs, new jobs are spread over the queues
+ * in round robin. A worker takes the oldest job of its own queue and, when
+ * it has nothing to do, steals the newest job from the queue of another
+ * worker. Filtered tasks are handed back to the engine, which starts them
+ * in creation order for each tag.
+ */
+struct flb_filter_job {
+    int done;                       /* set by the worker once filtered */
+    struct flb_task *task;
+    msgpack_sbuffer mp_sbuf;        /* task buffer while it's filtered */
+    struct flb_chunk_index index;   /* records of the filtered buffer  */
+    struct mk_list _head;
+};
+
+struct flb_filter_worker {
+    pthread_t tid;
+    pthread_mutex_t lock;
+    struct mk_list jobs;            /* queued jobs, oldest first       */
+    struct flb_filter_pool *pool;
+};
+
+struct flb_filter_pool {
+    /* Engine loop event for filtered tasks, it must be the first member */
+    struct mk_event event;
+
+    int workers;
+    int next;                       /* round robin of new jobs         */
+    int stop;
+    int queued;                     /* jobs not yet taken by a worker  */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    flb_pipefd_t ch[2];             /* workers -> engine               */
+    struct flb_filter_worker *w;
+    struct flb_config *config;
+};
+
+static inline int flb_filter_job_done(struct flb_filter_job *job)
+{
+    return __atomic_load_n(&job->done, __ATOMIC_ACQUIRE);
+}
+
+int flb_filter_pool_create(struct flb_config *config);
+int flb_filter_pool_submit(struct flb_task *task, struct flb_config *config);
+void flb_filter_pool_release(struct flb_task *task);
+void flb_filter_pool_exit(struct flb_config *config);
+
+#endif
@@ -0,0 +1,102 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef FLB_FILTER_PUSHDOWN_H
+#define FLB_FILTER_PUSHDOWN_H
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_config.h>
+
+#include <stddef.h>
+
+/*
+ * Pushdown: the records an input would build and the filters chain of its
+ * tag would drop anyway can be discarded before they are parsed, packed
+ * and buffered. The input keeps a context per tag and asks it for every
+ * line or parsed record:
+ *
+ * - a tag with no destination drops everything, unless the stream
+ *   processor or a filter that is not a pure dropper (e.g. rewrite_tag)
+ *   still wants the records.
+ *
+ * - the filters at the head of the chain implementing 'cb_pushdown' export
+ *   their Exclude rules: a record is dropped when a field has a string
+ *   value matching one of them. The rules of a filter are ordered, the
+ *   first one on a field the input can not resolve stops the filter.
+ *
+ * Only drops that are certain are taken, the filters still run over the
+ * records that are kept. Rules are resolved again when the chain or the
+ * routes change (config->router_gen).
+ */
+
+struct flb_regex;
+struct flb_input_instance;
+
+struct flb_filter_pushdown_rule {
+    int group;                      /* filter the rule comes from */
+    int key_len;
+    char *key;                      /* first level field          */
+    struct flb_regex *regex;        /* owned by the filter        */
+};
+
+struct flb_filter_pushdown {
+    int off;                        /* disabled for the instance   */
+    int gen;                        /* router_gen of the rules     */
+    int drop;                       /* no destination for the tag  */
+    int group;                      /* filter adding rules         */
+    int rules_len;
+    int rules_size;
+    struct flb_filter_pushdown_rule *rules;
+
+    /* Records of the context: tag and the field of the raw lines */
+    char *tag;
+    int tag_len;
+    char *key;
+    int key_len;
+    struct flb_input_instance *ins;
+};
+
+/*
+ * Value of a field of the record being built: it returns FLB_TRUE and sets
+ * 'val' when the field has a string value.
+ */
+typedef int (*flb_filter_pushdown_get)(void *data, char *key, int key_len,
+                                       char **val, size_t *val_len);
+
+void flb_filter_pushdown_init(struct flb_filter_pushdown *pd,
+                              struct flb_input_instance *ins,
+                              char *tag, int tag_len,
+                              char *key, int key_len);
+void flb_filter_pushdown_destroy(struct flb_filter_pushdown *pd);
+
+/* Used by the filter plugins from 'cb_pushdown' */
+int flb_filter_pushdown_add(struct flb_filter_pushdown *pd,
+                            char *key, int key_len,
+                            struct flb_regex *regex);
+
+/* They return FLB_TRUE if the record must be discarded */
+int flb_filter_pushdown_tag(struct flb_filter_pushdown *pd);
+int flb_filter_pushdown_line(struct flb_filter_pushdown *pd,
+                             char *line, size_t len);
+int flb_filter_pushdown_pack(struct flb_filter_pushdown *pd,
+                             char *buf, size_t size);
+int flb_filter_pushdown_fields(struct flb_filter_pushdown *pd,
+                               flb_filter_pushdown_get get, void *data);
+
+#endif
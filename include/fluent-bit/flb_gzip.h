@@ -0,0 +1,68 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef FLB_GZIP_H
+#define FLB_GZIP_H
+
+#include <fluent-bit/flb_info.h>
+#include <miniz/miniz.h>
+
+#include <stddef.h>
+
+/*
+ * Streaming gzip encoder. Data can be written in as many pieces as needed
+ * (e.g. one record at a time), the compressed output is kept in a buffer
+ * that grows on demand and is handed to the caller on finish.
+ */
+struct flb_gzip {
+    mz_stream strm;
+    mz_ulong crc;              /* CRC32 of the uncompressed data */
+    size_t in_len;             /* uncompressed bytes written */
+    char *buf;                 /* gzip header + deflate stream + footer */
+    size_t size;
+};
+
+int flb_gzip_init(struct flb_gzip *gz, size_t size_hint);
+int flb_gzip_write(struct flb_gzip *gz, const void *data, size_t len);
+int flb_gzip_finish(struct flb_gzip *gz, void **out_data, size_t *out_len);
+void flb_gzip_destroy(struct flb_gzip *gz);
+
+/* Compress a buffer in one go, the output must be released with flb_free() */
+int flb_gzip_compress(void *in_data, size_t in_len,
+                      void **out_data, size_t *out_len);
+
+/*
+ * Streaming gzip decoder. The compressed data is read in pieces of the size
+ * the caller can handle, so the whole uncompressed content is never held in
+ * memory. Concatenated members are decoded as a single stream.
+ */
+struct flb_gunzip {
+    mz_stream strm;
+    int state;
+    int inflating;             /* the inflate stream is initialized */
+    mz_ulong crc;              /* CRC32 of the current member */
+    size_t out_len;            /* uncompressed bytes of the current member */
+};
+
+int flb_gunzip_init(struct flb_gunzip *gz, const void *data, size_t len);
+int flb_gunzip_read(struct flb_gunzip *gz, void *buf, size_t size,
+                    size_t *out_len);
+void flb_gunzip_destroy(struct flb_gunzip *gz);
+
+#endif
@@ -31,40 +31,64 @@
 #define FLB_HASH_EVICT_OLDER      1
 #define FLB_HASH_EVICT_LESS_USED  2
 #define FLB_HASH_EVICT_RANDOM     3
+#define FLB_HASH_EVICT_LRU        4
 
+/*
+ * Entries live in a single allocation with their key and value, their
+ * address never changes: callers may keep the value pointer until the
+ * entry is deleted, replaced or evicted.
+ */
 struct flb_hash_entry {
     time_t created;
     uint64_t hits;
+    uint32_t hash;
+    size_t size;                  /* memory used by the entry */
     char *key;
     size_t key_len;
     char *val;
     size_t val_size;
-    struct flb_hash_table *table; /* link to parent flb_hash_table */
-    struct mk_list _head;         /* link to flb_hash_table->chains */
     struct mk_list _head_parent;  /* link to flb_hash->entries */
 };
 
-struct flb_hash_table {
-    int count;
-    struct mk_list chains;
-};
-
+/*
+ * Open addressing table: one metadata byte per slot ('ctrl') tells if the
+ * slot is empty, deleted or full, a full slot stores 7 bits of the hash.
+ * Lookups compare a group of 16 metadata bytes at once and only touch the
+ * entries whose bits match. The table grows by itself.
+ */
 struct flb_hash {
     int evict_mode;
     int max_entries;
     int total_count;
-    size_t size;
+    int deleted;                  /* tombstones in 'ctrl' */
+    size_t size;                  /* slots, power of two */
+    size_t max_size;              /* memory limit in bytes, 0 = none */
+    size_t total_size;
+    int ttl;                      /* seconds, 0 = entries never expire */
+
+    /* stats */
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t expired;
+    uint64_t evictions;
+
+    /* insertion order, or recency order for FLB_HASH_EVICT_LRU */
     struct mk_list entries;
-    struct flb_hash_table *table;
+    uint8_t *ctrl;
+    struct flb_hash_entry **slots;
 };
 
 struct flb_hash *flb_hash_create(int evict_mode, size_t size, int max_entries);
 void flb_hash_destroy(struct flb_hash *ht);
+void flb_hash_set_max_size(struct flb_hash *ht, size_t max_size);
+void flb_hash_set_ttl(struct flb_hash *ht, int ttl);
 
 int flb_hash_add(struct flb_hash *ht, char *key, int key_len,
                  char *val, size_t val_size);
 int flb_hash_get(struct flb_hash *ht, char *key, int key_len,
                  char **out_buf, size_t *out_size);
+int flb_hash_get_stale(struct flb_hash *ht, char *key, int key_len,
+                       char **out_buf, size_t *out_size);
 int flb_hash_get_by_id(struct flb_hash *ht, int id, char *key, char **out_buf,
                        size_t *out_size);
 int flb_hash_del(struct flb_hash *ht, char *key);
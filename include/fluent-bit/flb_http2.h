@@ -0,0 +1,107 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef FLB_HTTP2_H
+#define FLB_HTTP2_H
+
+#include <fluent-bit/flb_info.h>
+
+#ifdef FLB_HAVE_HTTP2
+
+#include <monkey/mk_core.h>
+#include <fluent-bit/flb_pipe.h>
+#include <fluent-bit/flb_thread.h>
+#include <fluent-bit/flb_upstream.h>
+
+#include <nghttp2/nghttp2.h>
+
+/* Session status */
+#define FLB_HTTP2_IDLE          0  /* not connected               */
+#define FLB_HTTP2_CONNECTING    1  /* a co-routine is connecting  */
+#define FLB_HTTP2_READY         2  /* connected, streams can flow */
+
+/* Stream status */
+#define FLB_HTTP2_STREAM_PENDING  0
+#define FLB_HTTP2_STREAM_DONE     1
+#define FLB_HTTP2_STREAM_FAILED   2
+
+/* Stream and connection flow control window announced to the server */
+#define FLB_HTTP2_WINDOW_SIZE   (1024 * 1024)
+
+struct flb_http_client;
+
+/*
+ * HTTP/2 connection of an upstream. There is one per event loop (engine or
+ * output worker) and the requests of all the flush co-routines running in
+ * that loop are multiplexed on it as streams.
+ *
+ * The co-routines only submit requests and wait; the socket is read and
+ * written by the session event handler, which runs in the event loop and
+ * resumes every co-routine whose stream was completed.
+ */
+struct flb_http2_session {
+    int status;                       /* FLB_HTTP2_IDLE, CONNECTING, READY */
+    int users;                        /* clients holding the connection    */
+    time_t ts_idle;                   /* last time the streams went to 0   */
+    nghttp2_session *ngh;
+
+    /* Shared connection, plugins get it from flb_upstream_conn_get() */
+    struct flb_upstream_conn u_conn;
+
+    /* Output nghttp2 serialized and the socket did not take yet */
+    char *wbuf;
+    size_t wbuf_pos;
+    size_t wbuf_len;
+    size_t wbuf_size;
+
+    /* Wake up the loop when a co-routine completes streams by itself */
+    int wake_pending;
+    flb_pipefd_t ch_wake[2];
+    struct mk_event wake_event;
+
+    struct mk_list streams;           /* requests in flight               */
+    struct mk_list done;              /* completed, co-routine to resume  */
+    struct mk_list _head;             /* link to flb_upstream->h2_sessions */
+};
+
+/* Request of an HTTP client */
+struct flb_http2_stream {
+    int32_t id;
+    int status;                       /* FLB_HTTP2_STREAM_ */
+    struct flb_thread *th;            /* co-routine waiting for it */
+    struct flb_http_client *c;        /* NULL once the client is gone */
+
+    /* Request body, read by nghttp2 as DATA frames are sent */
+    char *body;
+    size_t body_len;
+    size_t body_pos;
+
+    struct mk_list _head;             /* link to session streams or done */
+};
+
+struct flb_upstream_conn *flb_http2_conn_get(struct flb_upstream *u);
+int flb_http2_conn_release(struct flb_upstream_conn *u_conn);
+void flb_http2_sessions_destroy(struct flb_upstream *u);
+
+int flb_http2_send(struct flb_http_client *c, size_t *bytes);
+int flb_http2_recv(struct flb_http_client *c);
+void flb_http2_client_destroy(struct flb_http_client *c);
+
+#endif /* FLB_HAVE_HTTP2 */
+#endif
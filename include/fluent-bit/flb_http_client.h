@@ -37,6 +37,12 @@
 /* HTTP Flags */
 #define FLB_HTTP_10          1
 #define FLB_HTTP_11          2
+#define FLB_HTTP_CHUNKED     4  /* request body sent with flb_http_body_write() */
+#define FLB_HTTP_20          8  /* request sent as a HTTP/2 stream */
+
+/* Chunked request body: room for the chunk size line and the last chunk */
+#define FLB_HTTP_CHUNK_HEAD     10  /* up to 8 hex digits + CRLF */
+#define FLB_HTTP_CHUNK_TAIL      7  /* CRLF + "0\r\n\r\n"     */
 
 /* Proxy */
 #define FLB_HTTP_PROXY_NONE       0
@@ -80,6 +86,8 @@ struct flb_http_proxy {
 };
 
 /* Set a request type */
+struct flb_http2_stream;
+
 struct flb_http_client {
     /* Upstream connection */
     struct flb_upstream_conn *u_conn;
@@ -94,6 +102,20 @@ struct flb_http_client {
     int body_len;
     char *body_buf;
 
+    /*
+     * Chunked request body: the headers go out with the first write and
+     * the data is buffered so every chunk sent is up to FLB_HTTP_DATA_CHUNK
+     * bytes long.
+     */
+    int headers_sent;
+    size_t bytes_sent;
+    size_t chunk_len;
+    char *chunk_buf;
+
+    /* HTTP/2: the body is buffered in 'chunk_buf' and sent with the stream */
+    size_t chunk_size;
+    struct flb_http2_stream *h2;
+
     /* Proxy */
     struct flb_http_proxy proxy;
 
@@ -111,7 +133,11 @@ int flb_http_add_header(struct flb_http_client *c,
                         char *key, size_t key_len,
                         char *val, size_t val_len);
 int flb_http_basic_auth(struct flb_http_client *c, char *user, char *passwd);
+int flb_http_body_write(struct flb_http_client *c, const void *data,
+                        size_t len);
 int flb_http_do(struct flb_http_client *c, size_t *bytes);
+int flb_http_send(struct flb_http_client *c, size_t *bytes);
+int flb_http_recv(struct flb_http_client *c);
 void flb_http_client_destroy(struct flb_http_client *c);
 int flb_http_buffer_size(struct flb_http_client *c, size_t size);
 size_t flb_http_buffer_available(struct flb_http_client *c);
@@ -31,6 +31,9 @@
 #include <fluent-bit/flb_filter.h>
 #include <fluent-bit/flb_thread.h>
 #include <fluent-bit/flb_mp.h>
+#include <fluent-bit/flb_chunk_index.h>
+#include <fluent-bit/flb_priority.h>
+#include <fluent-bit/flb_probes.h>
 
 #ifdef FLB_HAVE_METRICS
 #include <fluent-bit/flb_metrics.h>
@@ -49,12 +52,49 @@
 #define FLB_INPUT_NET         4   /* input address may set host and port   */
 #define FLB_INPUT_DYN_TAG     64  /* the plugin generate it own tags       */
 #define FLB_INPUT_THREAD     128  /* plugin requires a thread on callbacks */
+#define FLB_INPUT_RUNNER     256  /* collectors can run in their own thread */
 
 /* Input status */
 #define FLB_INPUT_RUNNING     1
 #define FLB_INPUT_PAUSED      0
 
+/*
+ * Input buffers are handed to the engine in chunks: once a buffer reaches
+ * FLB_INPUT_CHUNK_SIZE bytes it's sealed and a task is created right away
+ * instead of waiting for the next flush. Instances can set lower limits
+ * through the 'flush_bytes' and 'flush_records' properties.
+ *
+ * A chunk buffer is not allocated at its full size: it starts small and
+ * doubles (from the memory pool when it's set) until it's sealed. Most
+ * instances and dyntags flush far less than a chunk per interval, taking
+ * FLB_INPUT_CHUNK_SIZE bytes up front for each of them would cost 2MB per
+ * tag. The seal bounds the growth, the largest copy is half a chunk.
+ */
+#define FLB_INPUT_CHUNK_SIZE  2048000
+
 struct flb_input_instance;
+struct flb_input_dyntag;
+struct flb_input_runner;
+
+int flb_input_chunk_seal(struct flb_input_instance *in,
+                         struct flb_input_dyntag *dt);
+
+/* Notify the plugin it cannot append more data or that it can again */
+void flb_input_plugin_pause(struct flb_input_instance *in);
+void flb_input_plugin_resume(struct flb_input_instance *in);
+
+/* Current time for a record, with the instance 'time_precision' */
+struct flb_time;
+int flb_input_time_get(struct flb_input_instance *in, struct flb_time *tm);
+int flb_input_pack_time_now(struct flb_input_instance *in,
+                            msgpack_packer *mp_pck);
+
+int flb_input_mem_pause(struct flb_config *config);
+int flb_input_mem_resume(struct flb_config *config);
+void flb_input_queue_pause(struct flb_input_instance *in);
+int flb_input_queue_resume(struct flb_config *config);
+void flb_input_rate_consume(struct flb_input_instance *in,
+                            char *buf, size_t bytes, int records);
 
 struct flb_input_plugin {
     int flags;
@@ -118,11 +158,15 @@ struct flb_input_dyntag {
     int busy;   /* buffer is being flushed        */
     int lock;   /* cannot longer append more data */
 
-    /* Tag */
+    /* Tag: 'tag' and 'tag_len' point to the interned tag */
     int tag_len;
     char *tag;
+    struct flb_tag *itag;
 
     /* MessagePack */
+    struct flb_chunk_index mp_index;  /* records of the buffer */
+    int mp_buf_write_records;  /* records being written, -1 if unknown */
+    int mp_buf_write_filtered; /* records went through the filters    */
     size_t mp_buf_write_size;
     msgpack_sbuffer mp_sbuf;   /* msgpack sbuffer */
     msgpack_packer mp_pck;     /* msgpack packer  */
@@ -130,6 +174,9 @@ struct flb_input_dyntag {
     /* Link to parent list on flb_input_instance */
     struct mk_list _head;
 
+    /* Link to the interned tag dyntags list (lookup index) */
+    struct mk_list _head_tag;
+
     struct flb_input_instance *in;
 };
 
@@ -140,6 +187,21 @@ struct flb_input_dyntag {
  * An instance try to contain plugin data separating what is fixed data
  * and the variable one that is generated when the plugin is invoked.
  */
+/*
+ * Rate limit of an instance: one token bucket for the records and one for
+ * the bytes, refilled at the configured rate per second and holding up to
+ * 'burst' seconds of it. Accepted data may take the buckets into debt, the
+ * instance stays paused until it's paid back.
+ */
+struct flb_input_rate {
+    double records;                      /* records per second, 0: off */
+    double bytes;                        /* bytes per second, 0: off   */
+    double burst;                        /* capacity, in seconds       */
+    double tk_records;                   /* available record tokens    */
+    double tk_bytes;                     /* available byte tokens      */
+    uint64_t last;                       /* last refill (usec)         */
+};
+
 struct flb_input_instance {
     /*
      * The instance flags are derivated from the fixed plugin flags. This
@@ -155,6 +217,11 @@ struct flb_input_instance {
     int id;                              /* instance id                  */
     flb_pipefd_t channel[2];             /* pipe(2) channel              */
     int threaded;                        /* bool / Threaded instance ?   */
+    int run_threaded;                    /* bool / 'threaded' property   */
+    int pushdown;                        /* bool / 'pushdown' property   */
+    int shard;                           /* engine shard, -1: any        */
+    struct flb_input_runner *runner;     /* collectors thread, if any    */
+    struct flb_worker_cpus *cpus;        /* 'cpu_affinity' of threads    */
     char name[16];                       /* numbered name (cpu -> cpu.0) */
     void *context;                       /* plugin configuration context */
     struct flb_input_plugin *p;          /* original plugin              */
@@ -181,11 +248,12 @@ struct flb_input_instance {
     struct flb_net_host host;
 
     /* MessagePack buffers: the plugin use these contexts to append records */
-    int mp_records;
+    struct flb_chunk_index mp_index;
+    int mp_buf_write_records;         /* records being written, -1: unknown */
+    int mp_buf_write_filtered;        /* records went through the filters */
     size_t mp_buf_write_size;
     msgpack_packer  mp_pck;
     msgpack_sbuffer mp_sbuf;
-    msgpack_zone  *mp_zone;
 
     /*
      * Buffers counter: it count the total of memory used by fixed and dynamic
@@ -193,6 +261,32 @@ struct flb_input_instance {
      */
     size_t mp_total_buf_size;
 
+    /*
+     * Bytes owned by tasks created from this instance which are still in
+     * flight. Together with mp_total_buf_size it's the instance share of the
+     * global memory budget (service 'Mem_Total_Limit').
+     */
+    size_t mp_tasks_size;
+
+    /* Set when the instance was paused by the global memory budget */
+    int mem_paused;
+
+    /* Set when the instance was paused by a full output inflight queue */
+    int queue_paused;
+
+    /* Set when the instance was paused by its rate limit */
+    int rate_paused;
+
+    /* Token buckets of the 'rate_limit.*' properties */
+    struct flb_input_rate rate;
+
+    /*
+     * Priority class of the records (low, normal or high): higher classes
+     * are dispatched first and take more turns in the output queues, full
+     * queues pause the lower classes first.
+     */
+    int priority;
+
     /*
      * Buffer limit: optional limit set by configuration so this input instance
      * cannot exceed more than mp_buf_limit (bytes unit).
@@ -207,6 +301,20 @@ struct flb_input_instance {
      */
     size_t mp_buf_limit;
 
+    /* Stack size for the collector co-routines (threaded instances) */
+    size_t coro_stack_size;
+
+    /*
+     * Size-triggered flush: a buffer that reaches 'flush_bytes' or
+     * 'flush_records' is dispatched right away without waiting for the
+     * service Flush. Zero means no limit.
+     */
+    size_t flush_bytes;
+    int flush_records;
+
+    /* Records timestamps precision, FLB_TIME_PRECISE by default */
+    int time_precision;
+
     /* Define the buf status:
      *
      * - FLB_INPUT_RUNNING -> can append more data
@@ -221,13 +329,14 @@ struct flb_input_instance {
      */
     void *data;
 
-#ifdef FLB_HAVE_STATS
-    int stats_fd;
-#endif
-
     struct mk_list _head;                /* link to config->inputs     */
     struct mk_list routes;               /* flb_router_path's list     */
     struct mk_list dyntags;              /* dyntag nodes               */
+
+    /* Records emitted from other threads, see flb_input_dyntag_emit() */
+    pthread_mutex_t emit_lock;
+    struct mk_list emit_queue;
+
     struct mk_list properties;           /* properties / configuration */
     struct mk_list collectors;           /* collectors                 */
 
@@ -241,6 +350,9 @@ struct flb_input_instance {
 
 #ifdef FLB_HAVE_METRICS
     struct flb_metrics *metrics;         /* metrics                    */
+    struct flb_metric *m_records;        /* handles of core metrics    */
+    struct flb_metric *m_bytes;
+    struct flb_metric *m_drop_records;   /* discarded by pushdown      */
 #endif
 
     /* Keep a reference to the original context this instance belongs to */
@@ -251,6 +363,7 @@ struct flb_input_collector {
     int id;                              /* collector id               */
     int type;                            /* collector type             */
     int running;                         /* is running ? (True/False)  */
+    int rate_held;                       /* stopped by the rate limit  */
 
     /* FLB_COLLECT_FD_EVENT */
     flb_pipefd_t fd_event;               /* fd being watched           */
@@ -400,6 +513,7 @@ static FLB_INLINE void input_pre_cb_collect()
     struct flb_thread *th     = libco_in_param.th;
 
     co_switch(th->caller);
+    flb_mem_scope_set(FLB_MEM_INPUT);
     coll->cb_collect(coll->instance, config, coll->instance->context);
 }
 
@@ -416,8 +530,16 @@ struct flb_thread *flb_input_thread_collect(struct flb_input_collector *coll,
     }
 
     th->caller = co_active();
-    th->callee = co_create(FLB_THREAD_STACK_SIZE,
-                           input_pre_cb_collect, &stack_size);
+    th->stack_request = coll->instance->coro_stack_size;
+    th->callee = flb_thread_stack_create(th->stack_request,
+                                         input_pre_cb_collect, &stack_size);
+    if (!th->callee) {
+        flb_errno();
+        flb_input_thread_destroy_id(((struct flb_input_thread *)
+                                     FLB_THREAD_DATA(th))->id, config);
+        return NULL;
+    }
+    th->stack_size = stack_size;
 
 #ifdef FLB_HAVE_VALGRIND
     th->valgrind_stack_id = VALGRIND_STACK_REGISTER(th->callee,
@@ -460,7 +582,7 @@ static inline void flb_input_return(struct flb_thread *th) {
      * We put together the return value with the task_id on the 32 bits at right
      */
     val = FLB_BITS_U64_SET(3 /* FLB_ENGINE_IN_THREAD */, in_th->id);
-    n = flb_pipe_w(in_th->config->ch_manager[1], &val, sizeof(val));
+    n = flb_engine_notify(in_th->config, val);
     if (n == -1) {
         flb_errno();
     }
@@ -488,11 +610,21 @@ static inline int flb_input_buf_paused(struct flb_input_instance *i)
     return FLB_FALSE;
 }
 
+static inline int flb_input_rate_limited(struct flb_input_instance *in)
+{
+    if (in->rate.records > 0 || in->rate.bytes > 0) {
+        return FLB_TRUE;
+    }
+
+    return FLB_FALSE;
+}
+
 static inline int flb_input_buf_size_set(struct flb_input_instance *in)
 {
     size_t total = 0;
     struct mk_list *head;
     struct flb_input_dyntag *dtp;
+    struct flb_config *config = in->config;
 
     /* Itearate each dyntag structure and count total bytes */
     mk_list_foreach(head, &in->dyntags) {
@@ -500,19 +632,29 @@ static inline int flb_input_buf_size_set(struct flb_input_instance *in)
         total += dtp->mp_sbuf.size;
     }
 
-    total += in->mp_sbuf.size;
+    /* The buffer of a threaded instance belongs to its runner */
+    if (!in->runner) {
+        total += in->mp_sbuf.size;
+    }
+
+    /* Update the global usage with the difference */
+    config->mem_total -= in->mp_total_buf_size;
+    config->mem_total += total;
     in->mp_total_buf_size = total;
+    if (config->mem_total > config->mem_total_peak) {
+        config->mem_total_peak = config->mem_total;
+    }
 
-    if (flb_input_buf_overlimit(in) == FLB_FALSE &&
+    if (flb_input_buf_overlimit(in) == FLB_FALSE && in->mem_paused == FLB_FALSE &&
+        in->queue_paused == FLB_FALSE && in->rate_paused == FLB_FALSE &&
         flb_input_buf_paused(in) && in->config->is_running == FLB_TRUE) {
         in->mp_buf_status = FLB_INPUT_RUNNING;
-        if (in->p->cb_resume) {
-            in->p->cb_resume(in->context, in->config);
-            flb_debug("[input] %s resume (mem buf overlimit)",
-                      in->name);
-
-        }
+        flb_input_plugin_resume(in);
+        flb_debug("[input] %s resume (mem buf overlimit)", in->name);
+    }
 
+    if (config->mem_paused > 0 && config->mem_total < config->mem_total_limit) {
+        flb_input_mem_resume(config);
     }
 
     return 0;
@@ -526,14 +668,18 @@ static inline int flb_input_buf_check(struct flb_input_instance *i)
         flb_debug("[input] %s paused (mem buf overlimit)",
                  i->name);
         if (!flb_input_buf_paused(i)) {
-            if (i->p->cb_pause) {
-                i->p->cb_pause(i->context, i->config);
-            }
+            flb_input_plugin_pause(i);
         }
         i->mp_buf_status = FLB_INPUT_PAUSED;
         return FLB_TRUE;
     }
 
+    if (i->config->mem_total_limit > 0 &&
+        i->config->mem_total >= i->config->mem_total_limit) {
+        flb_input_mem_pause(i->config);
+        return flb_input_buf_paused(i);
+    }
+
     return FLB_FALSE;
 }
 
@@ -549,10 +695,31 @@ static inline int flb_input_buf_check(struct flb_input_instance *i)
  * These functions aims to keep track when each buffer is being modified and
  * the number of bytes that have changed.
  */
+/* Check if a buffer must be sealed and dispatched */
+static inline int flb_input_chunk_full(struct flb_input_instance *in,
+                                       size_t size, int records)
+{
+    if (size >= FLB_INPUT_CHUNK_SIZE) {
+        return FLB_TRUE;
+    }
+
+    if (in->flush_bytes > 0 && size >= in->flush_bytes) {
+        return FLB_TRUE;
+    }
+
+    if (in->flush_records > 0 && records >= in->flush_records) {
+        return FLB_TRUE;
+    }
+
+    return FLB_FALSE;
+}
+
 static inline void flb_input_buf_write_start(struct flb_input_instance *i)
 {
     /* Save the current size of the buffer before an incoming modification */
     i->mp_buf_write_size = i->mp_sbuf.size;
+    i->mp_buf_write_records = -1;
+    i->mp_buf_write_filtered = FLB_FALSE;
 }
 
 static inline void flb_input_buf_write_end(struct flb_input_instance *i)
@@ -568,12 +735,23 @@ static inline void flb_input_buf_write_end(struct flb_input_instance *i)
     if (bytes == 0) {
         return;
     }
+    FLB_PROBE3(input_append, i->name, i->tag, bytes);
+
+    /* Threaded instance: its runner hands the records to the engine */
+    if (i->runner) {
+        return;
+    }
 
 #ifdef FLB_HAVE_METRICS
-    records = flb_mp_count(i->mp_sbuf.data + i->mp_buf_write_size, bytes);
-    if (records > 0) {
-        flb_metrics_sum(FLB_METRIC_N_RECORDS, records, i->metrics);
-        flb_metrics_sum(FLB_METRIC_N_BYTES, bytes, i->metrics);
+    if (i->mp_buf_write_records >= 0) {
+        records = i->mp_buf_write_records;
+    }
+    else {
+        records = flb_mp_count(i->mp_sbuf.data + i->mp_buf_write_size, bytes);
+    }
+    if (records > 0 && i->metrics) {
+        flb_metric_sum(i->m_records, records);
+        flb_metric_sum(i->m_bytes, bytes);
     }
 #endif
 
@@ -584,11 +762,31 @@ static inline void flb_input_buf_write_end(struct flb_input_instance *i)
         return;
     }
 
-    /* Call the filter handler */
-    buf = i->mp_sbuf.data + i->mp_buf_write_size;
-    flb_filter_do(&i->mp_sbuf, &i->mp_pck,
-                  buf, bytes,
-                  i->tag, i->tag_len, i->config);
+    /* Take the tokens of the new records from the rate limit */
+    if (flb_input_rate_limited(i)) {
+        flb_input_rate_consume(i, i->mp_sbuf.data + i->mp_buf_write_size,
+                               bytes, i->mp_buf_write_records);
+    }
+
+    /*
+     * Call the filter handler, unless a worker thread already did it or
+     * the filters pool takes the chunk once it's sealed.
+     */
+    if (i->mp_buf_write_filtered == FLB_FALSE && !i->config->filter_pool) {
+        buf = i->mp_sbuf.data + i->mp_buf_write_size;
+        flb_filter_do(&i->mp_sbuf, &i->mp_pck,
+                      buf, bytes,
+                      i->tag, i->tag_len, i->config);
+    }
+
+    /* Index the records that remain after the filters */
+    flb_chunk_index_append(&i->mp_index, i->mp_sbuf.data, i->mp_sbuf.size);
+
+    /* A full chunk is dispatched right away */
+    if (flb_input_chunk_full(i, i->mp_sbuf.size,
+                             i->mp_index.records) == FLB_TRUE) {
+        flb_input_chunk_seal(i, NULL);
+    }
 
     /*
      * Update buffer size counter: this kind of input instance have just
@@ -605,6 +803,8 @@ static inline void flb_input_dbuf_write_start(struct flb_input_dyntag *dt)
 {
     /* Save the current size of the buffer before an incoming modification */
     dt->mp_buf_write_size = dt->mp_sbuf.size;
+    dt->mp_buf_write_records = -1;
+    dt->mp_buf_write_filtered = FLB_FALSE;
 }
 
 static inline void flb_input_dbuf_write_end(struct flb_input_dyntag *dt)
@@ -621,6 +821,7 @@ static inline void flb_input_dbuf_write_end(struct flb_input_dyntag *dt)
     if (bytes == 0) {
         return;
     }
+    FLB_PROBE3(input_append, in->name, dt->tag, bytes);
 
     if (flb_input_buf_paused(in) == FLB_TRUE) {
         dt->mp_sbuf.size = dt->mp_buf_write_size;
@@ -629,19 +830,39 @@ static inline void flb_input_dbuf_write_end(struct flb_input_dyntag *dt)
         return;
     }
 
+    /* Take the tokens of the new records from the rate limit */
+    if (flb_input_rate_limited(in)) {
+        flb_input_rate_consume(in, dt->mp_sbuf.data + dt->mp_buf_write_size,
+                               bytes, dt->mp_buf_write_records);
+    }
+
 #ifdef FLB_HAVE_METRICS
-    records = flb_mp_count(dt->mp_sbuf.data + dt->mp_buf_write_size, bytes);
-    if (records > 0) {
-        flb_metrics_sum(FLB_METRIC_N_RECORDS, records, in->metrics);
-        flb_metrics_sum(FLB_METRIC_N_BYTES, bytes, in->metrics);
+    if (dt->mp_buf_write_records >= 0) {
+        records = dt->mp_buf_write_records;
+    }
+    else {
+        records = flb_mp_count(dt->mp_sbuf.data + dt->mp_buf_write_size,
+                               bytes);
+    }
+    if (records > 0 && in->metrics) {
+        flb_metric_sum(in->m_records, records);
+        flb_metric_sum(in->m_bytes, bytes);
     }
 #endif
 
-    /* Call the filter handler */
-    buf = dt->mp_sbuf.data + dt->mp_buf_write_size;
-    flb_filter_do(&dt->mp_sbuf, &dt->mp_pck,
-                  buf, bytes,
-                  dt->tag, dt->tag_len, dt->in->config);
+    /*
+     * Call the filter handler, unless a worker thread already did it or
+     * the filters pool takes the chunk once it's sealed.
+     */
+    if (dt->mp_buf_write_filtered == FLB_FALSE && !in->config->filter_pool) {
+        buf = dt->mp_sbuf.data + dt->mp_buf_write_size;
+        flb_filter_do(&dt->mp_sbuf, &dt->mp_pck,
+                      buf, bytes,
+                      dt->tag, dt->tag_len, dt->in->config);
+    }
+
+    /* Index the records that remain after the filters */
+    flb_chunk_index_append(&dt->mp_index, dt->mp_sbuf.data, dt->mp_sbuf.size);
 
     /* Itearate each dyntag structure and count total bytes */
     flb_input_buf_size_set(in);
@@ -659,6 +880,9 @@ static inline void FLB_INPUT_RETURN()
     flb_thread_return(th);
 }
 
+/* Built-in plugins, NULL terminated */
+extern struct flb_input_plugin *const flb_in_plugins[];
+
 int flb_input_register_all(struct flb_config *config);
 struct flb_input_instance *flb_input_new(struct flb_config *config,
                                          char *input, void *data);
@@ -692,6 +916,8 @@ int flb_input_set_collector_socket(struct flb_input_instance *in,
                                    flb_pipefd_t fd,
                                    struct flb_config *config);
 int flb_input_collector_running(int coll_id, struct flb_input_instance *in);
+int flb_input_instance_init(struct flb_input_instance *in,
+                            struct flb_config *config);
 void flb_input_initialize_all(struct flb_config *config);
 void flb_input_pre_run_all(struct flb_config *config);
 void flb_input_exit_all(struct flb_config *config);
@@ -700,12 +926,24 @@ void flb_input_exit_all(struct flb_config *config);
 struct flb_input_dyntag *flb_input_dyntag_create(struct flb_input_instance *in,
                                                  char *tag, int tag_len);
 int flb_input_dyntag_destroy(struct flb_input_dyntag *dt);
+struct flb_input_dyntag *flb_input_dyntag_get(char *tag, size_t tag_len,
+                                              struct flb_input_instance *in);
 int flb_input_dyntag_append_obj(struct flb_input_instance *in,
                                 char *tag, size_t tag_len,
                                 msgpack_object data);
 int flb_input_dyntag_append_raw(struct flb_input_instance *in,
                                 char *tag, size_t tag_len,
                                 void *buf, size_t buf_size);
+int flb_input_dyntag_append_records(struct flb_input_instance *in,
+                                    char *tag, size_t tag_len,
+                                    void *buf, size_t buf_size, int records);
+int flb_input_dyntag_append_filtered(struct flb_input_instance *in,
+                                     char *tag, size_t tag_len,
+                                     void *buf, size_t buf_size, int records);
+int flb_input_dyntag_emit(struct flb_input_instance *in,
+                          char *tag, size_t tag_len,
+                          void *buf, size_t buf_size, int records);
+int flb_input_emit_flush(struct flb_input_instance *in);
 void *flb_input_flush(struct flb_input_instance *i_ins, size_t *size);
 void *flb_input_dyntag_flush(struct flb_input_dyntag *dt, size_t *size);
 void flb_input_dyntag_exit(struct flb_input_instance *in);
@@ -0,0 +1,71 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef FLB_INPUT_RUNNER_H
+#define FLB_INPUT_RUNNER_H
+
+#include <monkey/mk_core.h>
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_pipe.h>
+#include <fluent-bit/flb_ring.h>
+#include <fluent-bit/flb_input.h>
+
+/* Chunks a runner can have queued for the engine thread */
+#define FLB_INPUT_RUNNER_QUEUE   64
+
+/* Messages sent through the runner control channel */
+#define FLB_INPUT_RUNNER_STOP    0
+#define FLB_INPUT_RUNNER_PAUSE   1
+#define FLB_INPUT_RUNNER_RESUME  2
+
+/*
+ * Input runner: instances with the 'threaded' property (and a plugin
+ * flagged with FLB_INPUT_RUNNER) get their collectors registered in the
+ * event loop of a dedicated thread instead of the engine loop. In that
+ * thread the instance msgpack buffer is private: once the events of a loop
+ * iteration are processed, its content is taken as a chunk and handed to
+ * the engine through a single-producer / single-consumer ring. The engine
+ * appends the chunks to a dynamic tag buffer of the instance tag.
+ *
+ * The plugin pause and resume callbacks run in the runner thread too.
+ */
+struct flb_input_runner {
+    /* Engine loop event for queued chunks, it must be the first member */
+    struct mk_event event;
+
+    int paused;                          /* engine side state        */
+    int stop;
+    pthread_t tid;                       /* thread ID                */
+    struct mk_event e_ctl;               /* runner loop: control     */
+    flb_pipefd_t ch_ctl[2];              /* engine -> runner         */
+    flb_pipefd_t ch_chunks[2];           /* runner -> engine         */
+    struct flb_ring *queue;              /* chunks for the engine    */
+    struct mk_event_loop *evl;           /* runner event loop        */
+
+    struct flb_input_instance *in;       /* parent input instance    */
+    struct flb_config *config;
+};
+
+struct flb_input_runner *flb_input_runner_create(struct flb_input_instance *in);
+int flb_input_runner_start(struct flb_input_runner *runner);
+void flb_input_runner_pause(struct flb_input_runner *runner);
+void flb_input_runner_resume(struct flb_input_runner *runner);
+void flb_input_runner_destroy(struct flb_input_runner *runner);
+
+#endif
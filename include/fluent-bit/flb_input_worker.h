@@ -0,0 +1,114 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+
+#ifndef FLB_INPUT_WORKER_H
+#define FLB_INPUT_WORKER_H
+
+#include <monkey/mk_core.h>
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_pipe.h>
+#include <fluent-bit/flb_ring.h>
+#include <fluent-bit/flb_input.h>
+#include <fluent-bit/flb_network.h>
+
+/* Chunks a worker can have queued for the engine thread */
+#define FLB_INPUT_WORKER_QUEUE   64
+
+/* Messages sent through the worker control channel */
+#define FLB_INPUT_WORKER_STOP    0
+#define FLB_INPUT_WORKER_PAUSE   1
+#define FLB_INPUT_WORKER_RESUME  2
+
+/*
+ * Records produced by a worker for one tag, a NULL tag means the instance
+ * tag (plugins without dynamic tags).
+ */
+struct flb_input_worker_chunk {
+    char *tag;
+    int tag_len;
+    int records;
+    int filtered;                        /* filters ran in the worker */
+    char *data;
+    size_t size;
+    size_t alloc;
+    struct mk_list _head;
+};
+
+/*
+ * Network input worker: a thread with its own event loop and its own
+ * listening socket, all the workers of an instance bind the same address
+ * with SO_REUSEPORT and the kernel balances the new connections (or the
+ * datagrams of a UDP worker). The plugin runs its connections in the
+ * worker loop and appends the records with flb_input_worker_append(), they
+ * are handed to the engine thread as chunks once the events of a loop
+ * iteration are processed. Only the engine thread writes to the instance
+ * buffers, if every filter matching the tag is thread safe the records are
+ * filtered by the worker before handing the chunk.
+ */
+struct flb_input_worker {
+    /* Engine loop event for queued chunks, it must be the first member */
+    struct mk_event event;
+
+    int id;                              /* worker number            */
+    int paused;                          /* engine side state        */
+    int stop;
+    pthread_t tid;                       /* thread ID                */
+    flb_sockfd_t server_fd;              /* listening socket         */
+    struct mk_event e_server;            /* worker loop: new clients */
+    struct mk_event e_ctl;               /* worker loop: control     */
+    flb_pipefd_t ch_ctl[2];              /* engine -> worker         */
+    flb_pipefd_t ch_chunks[2];           /* worker -> engine         */
+    struct flb_ring *queue;              /* chunks for the engine    */
+    struct mk_list chunks;               /* chunks being filled      */
+    struct mk_event_loop *evl;           /* worker event loop        */
+
+    /* Plugin context of the worker and its callbacks */
+    void *data;
+    int  (*cb_accept) (void *);
+    void (*cb_pause) (void *);
+    void (*cb_resume) (void *);
+    void (*cb_exit) (void *);
+
+    struct flb_input_instance *in;       /* parent input instance    */
+    struct flb_config *config;
+    struct mk_list _head;                /* link to the plugin list  */
+};
+
+struct flb_input_worker *flb_input_worker_create(struct flb_input_instance *in,
+                                                 int id, char *listen,
+                                                 char *port);
+struct flb_input_worker *flb_input_worker_create_udp(struct flb_input_instance *in,
+                                                     int id, char *listen,
+                                                     char *port);
+int flb_input_worker_start(struct flb_input_worker *worker, void *data,
+                           int (*cb_accept) (void *),
+                           void (*cb_pause) (void *),
+                           void (*cb_resume) (void *),
+                           void (*cb_exit) (void *));
+int flb_input_worker_append(struct flb_input_worker *worker,
+                            char *tag, int tag_len,
+                            void *buf, size_t size, int records);
+void flb_input_worker_chunk_filter(struct flb_input_instance *in,
+                                   struct flb_input_worker_chunk *chunk);
+void flb_input_worker_pause(struct flb_input_worker *worker);
+void flb_input_worker_resume(struct flb_input_worker *worker);
+void flb_input_worker_destroy(struct flb_input_worker *worker);
+
+#endif
@@ -20,6 +20,7 @@
 #ifndef FLB_IO_H
 #define FLB_IO_H
 
+#include <sys/uio.h>
 #include <monkey/mk_core.h>
 
 #include <fluent-bit/flb_info.h>
@@ -39,12 +40,20 @@
 
 /* Other features */
 #define FLB_IO_IPV6       16  /* network I/O uses IPv6                  */
+#define FLB_IO_UNIX      128  /* the host is a unix socket path         */
+
+/* Maximum TLS record payload, vectored writes are coalesced up to it */
+#define FLB_IO_TLS_RECORD  16384
 
 int flb_io_net_connect(struct flb_upstream_conn *u_conn,
                        struct flb_thread *th);
 
 int flb_io_net_write(struct flb_upstream_conn *u, void *data,
                      size_t len, size_t *out_len);
+int flb_io_net_writev(struct flb_upstream_conn *u,
+                      struct iovec *iov, int iovcnt, size_t *out_len);
 ssize_t flb_io_net_read(struct flb_upstream_conn *u, void *buf, size_t len);
+int flb_io_net_send_fd(struct flb_upstream_conn *u_conn, void *data,
+                       size_t len, int fd);
 
 #endif
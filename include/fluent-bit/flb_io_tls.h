@@ -28,12 +28,19 @@
 #include <mbedtls/ssl.h>
 #include <mbedtls/entropy.h>
 #include <mbedtls/ctr_drbg.h>
+#include <monkey/mk_core.h>
+
+#include <pthread.h>
 
 #define FLB_TLS_CA_ROOT          1
 #define FLB_TLS_CERT             2
 #define FLB_TLS_PRIV_KEY         4
 
-/* mbedTLS library context */
+/*
+ * mbedTLS library context. The SSL configuration is built once and shared
+ * by all the sessions. Contexts taken with flb_tls_context_get() are also
+ * shared by the instances with the same settings, 'users' counts them.
+ */
 struct flb_tls_context {
     int verify;                    /* FLB_TRUE | FLB_FALSE      */
     int debug;                     /* mbedtls debug level       */
@@ -44,20 +51,57 @@ struct flb_tls_context {
     mbedtls_dhm_context dhm;
     mbedtls_entropy_context entropy;
     mbedtls_ctr_drbg_context ctr_drbg;
+    pthread_mutex_t rng_lock;      /* sessions of several threads */
+    int conf_set;
+    mbedtls_ssl_config conf;       /* client configuration      */
+    mbedtls_ssl_config conf_h2;    /* same, ALPN offers HTTP/2  */
+
+    /* Shared contexts */
+    int users;
+    char *ca_path;
+    char *ca_file;
+    char *crt_file;
+    char *key_file;
+    char *key_passwd;
+    struct mk_list _head;
 };
 
-/* TLS connected session */
+/* Socket read ahead of a session, a couple of full records */
+#define FLB_TLS_READ_AHEAD       (32 * 1024)
+
+/*
+ * TLS connected session. mbedtls asks the socket for a record header and
+ * then for its body, reads are served from 'rbuf' so a single system call
+ * brings in all the records available.
+ */
 struct flb_tls_session {
     struct mbedtls_ssl_context ssl;
-    struct mbedtls_ssl_config conf;
+    mbedtls_net_context *net;
+    size_t rbuf_pos;
+    size_t rbuf_len;
+    unsigned char rbuf[FLB_TLS_READ_AHEAD];
 };
 
+struct flb_metrics;
+
 /* TLS instance, library context + active sessions */
 struct flb_tls {
     struct flb_tls_context *context;
+
+    /* Handshake metrics of the owner instance, optional */
+    struct flb_metrics *metrics;
 };
 
-struct flb_tls_context *flb_tls_context_new();
+struct flb_tls_context *flb_tls_context_new(int verify,
+                                            int debug,
+                                            char *ca_path,
+                                            char *ca_file, char *crt_file,
+                                            char *key_file, char *key_passwd);
+struct flb_tls_context *flb_tls_context_get(int verify,
+                                            int debug,
+                                            char *ca_path,
+                                            char *ca_file, char *crt_file,
+                                            char *key_file, char *key_passwd);
 void flb_tls_context_destroy(struct flb_tls_context *ctx);
 int flb_tls_session_destroy(struct flb_tls_session *session);
 int net_io_tls_handshake(void *u_conn, void *th);
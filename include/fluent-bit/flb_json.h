@@ -0,0 +1,56 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef FLB_JSON_H
+#define FLB_JSON_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * JSON to msgpack conversion used by flb_pack.c, in two stages like
+ * simdjson does:
+ *
+ * - flb_json_scan(): structural indexing. The input is classified 64 bytes at
+ *   a time into bit masks of quotes, backslashes and brackets (SSE2 on
+ *   x86_64), escaped quotes and string ranges are resolved with bit
+ *   operations so only the brackets outside strings are visited. It finds
+ *   where the root values end and can be resumed when more data arrives.
+ *
+ * - flb_json_parse(): one pass over the input that validates the values and
+ *   packs them. String contents are kept as they are (escape sequences are
+ *   not decoded), map and array headers are written when the container
+ *   closes.
+ */
+
+/* Resumable state of the structural scan */
+struct flb_json_scan {
+    size_t pos;          /* next byte to scan                        */
+    size_t end;          /* end of the last complete root value      */
+    int depth;           /* nesting level at 'pos'                   */
+    uint64_t escaped;    /* first byte at 'pos' is escaped ? (0 / 1) */
+    uint64_t string;     /* all ones if 'pos' is inside a string     */
+};
+
+void flb_json_scan_init(struct flb_json_scan *scan);
+int flb_json_scan(const char *js, size_t len, struct flb_json_scan *scan);
+int flb_json_parse(const char *js, size_t len,
+                   char **out_buf, size_t *out_size);
+
+#endif
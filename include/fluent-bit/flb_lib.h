@@ -36,6 +36,22 @@ struct flb_lib_out_cb {
     void *data;
 };
 
+/*
+ * With the out_lib 'chunk' format the callback gets a whole flush at once:
+ * 'record' points to this structure and 'size' is the chunk size. 'data'
+ * holds the records as they are in the engine, msgpack arrays of
+ * [timestamp, map]. The structure, the data and the tag are a single
+ * allocation owned by the callback, it must be released with
+ * flb_lib_free(chunk).
+ */
+struct flb_lib_chunk {
+    char *tag;
+    int tag_len;
+    int records;
+    size_t size;
+    char *data;
+};
+
 /* For Fluent Bit library callers, we only export the following symbols */
 typedef struct flb_lib_ctx         flb_ctx_t;
 
@@ -49,6 +65,7 @@ FLB_EXPORT int flb_output_set(flb_ctx_t *ctx, int ffd, ...);
 FLB_EXPORT int flb_filter_set(flb_ctx_t *ctx, int ffd, ...);
 FLB_EXPORT int flb_service_set(flb_ctx_t *ctx, ...);
 FLB_EXPORT int  flb_lib_free(void *data);
+FLB_EXPORT void *flb_lib_alloc(size_t size);
 FLB_EXPORT double flb_time_now();
 
 /* start stop the engine */
@@ -57,6 +74,10 @@ FLB_EXPORT int flb_stop(flb_ctx_t *ctx);
 
 /* data ingestion for "lib" input instance */
 FLB_EXPORT int flb_lib_push(flb_ctx_t *ctx, int ffd, void *data, size_t len);
+FLB_EXPORT int flb_lib_push_msgpack(flb_ctx_t *ctx, int ffd,
+                                    void *data, size_t len);
+FLB_EXPORT int flb_lib_push_batch(flb_ctx_t *ctx, int ffd,
+                                  void *data, size_t len);
 FLB_EXPORT int flb_lib_config_file(flb_ctx_t *ctx, char *path);
 
 #endif
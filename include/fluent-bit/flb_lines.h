@@ -0,0 +1,34 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef FLB_LINES_H
+#define FLB_LINES_H
+
+#include <stddef.h>
+
+/*
+ * Newline scanner: it stores in 'offsets' the position of every '\n' found
+ * in 'buf', up to 'max' entries, and returns the number of entries. The
+ * buffer is compared 32 or 16 bytes at a time using AVX2 (checked at run
+ * time), SSE2 or NEON, otherwise byte by byte.
+ */
+int flb_lines_scan(const char *buf, size_t len, size_t *offsets, int max);
+int flb_lines_scan_sw(const char *buf, size_t len, size_t *offsets, int max);
+
+#endif
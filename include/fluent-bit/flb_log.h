@@ -29,6 +29,7 @@
 #include <fluent-bit/flb_config.h>
 #include <inttypes.h>
 #include <errno.h>
+#include <time.h>
 
 /* FIXME: this extern should be auto-populated from flb_thread_storage.h */
 extern FLB_TLS_DEFINE(struct flb_log, flb_log_ctx)
@@ -49,16 +50,53 @@ extern FLB_TLS_DEFINE(struct flb_log, flb_log_ctx)
 #define FLB_LOG_EVENT    MK_EVENT_NOTIFICATION
 #define FLB_LOG_MNG      1024
 
+/* Messages queued for the collector, power of two */
+#define FLB_LOG_RING_SIZE     512
+
+/* Default messages per second and call site, 0 disables the limit */
+#define FLB_LOG_RATE_LIMIT    20
+
+/* Identical messages of a call site are folded during this period */
+#define FLB_LOG_DEDUP_PERIOD  10
+
+struct flb_log_ring;
+
 /* Logging main context */
 struct flb_log {
     struct mk_event event;     /* worker event for manager */
+    struct mk_event ev_wake;   /* messages queued in ring  */
     flb_pipefd_t ch_mng[2];    /* worker channel manager   */
+    flb_pipefd_t ch_wake[2];   /* wake up the collector    */
     uint16_t type;             /* log type                 */
     uint16_t level;            /* level                    */
     char *out;                 /* FLB_LOG_FILE or FLB_LOG_SOCKET */
     pthread_t tid;             /* thread ID   */
     struct flb_worker *worker; /* non-real worker reference */
     struct mk_event_loop *evl;
+
+    /*
+     * Messages are queued in a lock-free ring, written by any thread and
+     * read by the collector. The collector is only woken up when it's
+     * idle, a full ring drops messages and counts them.
+     */
+    struct flb_log_ring *ring;
+    int wake_pending;          /* a wake up is in the pipe */
+    uint64_t dropped;          /* messages lost, ring full */
+    int rate_limit;            /* per call site and second */
+};
+
+/*
+ * State of a logging call site, every flb_error(), flb_warn()... has its
+ * own. It folds identical messages and limits the rate of a storm.
+ */
+struct flb_log_site {
+    char lock;
+    time_t window;             /* second of 'count'        */
+    uint32_t count;            /* messages in the window   */
+    uint32_t suppressed;       /* over the rate limit      */
+    uint64_t hash;             /* last message printed     */
+    time_t hash_time;
+    uint32_t repeats;          /* folded into the last one */
 };
 
 static inline int flb_log_check(int l) {
@@ -81,34 +119,38 @@ int flb_log_set_file(struct flb_config *config, char *out);
 
 int flb_log_stop(struct flb_log *log, struct flb_config *config);
 void flb_log_print(int type, const char *file, int line, const char *fmt, ...);
+void flb_log_print_site(struct flb_log_site *site, int type,
+                        const char *file, int line, const char *fmt, ...);
+
+/* Logging macros, one flb_log_site per call site */
+#define flb_log_site_print(type, file, line, fmt, ...)               \
+    do {                                                             \
+        static struct flb_log_site _flb_site;                        \
+        if (flb_log_check(type))                                     \
+            flb_log_print_site(&_flb_site, type, file, line,         \
+                               fmt, ##__VA_ARGS__);                  \
+    } while (0)
 
-/* Logging macros */
 #define flb_error(fmt, ...)                                          \
-    if (flb_log_check(FLB_LOG_ERROR))                                \
-        flb_log_print(FLB_LOG_ERROR, NULL, 0, fmt, ##__VA_ARGS__)
+    flb_log_site_print(FLB_LOG_ERROR, NULL, 0, fmt, ##__VA_ARGS__)
 
 #define flb_warn(fmt, ...)                                           \
-    if (flb_log_check(FLB_LOG_WARN))                                 \
-        flb_log_print(FLB_LOG_WARN, NULL, 0, fmt, ##__VA_ARGS__)
+    flb_log_site_print(FLB_LOG_WARN, NULL, 0, fmt, ##__VA_ARGS__)
 
 #define flb_info(fmt, ...)                                           \
-    if (flb_log_check(FLB_LOG_INFO))                                 \
-        flb_log_print(FLB_LOG_INFO, NULL, 0, fmt, ##__VA_ARGS__)
+    flb_log_site_print(FLB_LOG_INFO, NULL, 0, fmt, ##__VA_ARGS__)
 
-#define flb_debug(fmt, ...)                                         \
-    if (flb_log_check(FLB_LOG_DEBUG))                               \
-        flb_log_print(FLB_LOG_DEBUG, NULL, 0, fmt, ##__VA_ARGS__)
+#define flb_debug(fmt, ...)                                          \
+    flb_log_site_print(FLB_LOG_DEBUG, NULL, 0, fmt, ##__VA_ARGS__)
 
 #ifdef FLB_HAVE_TRACE
-#define flb_trace(fmt, ...)                                             \
-    if (flb_log_check(FLB_LOG_TRACE))                                   \
-        flb_log_print(FLB_LOG_TRACE, __FILE__, __LINE__,                \
-                      fmt, ##__VA_ARGS__)
+#define flb_trace(fmt, ...)                                          \
+    flb_log_site_print(FLB_LOG_TRACE, __FILE__, __LINE__,            \
+                       fmt, ##__VA_ARGS__)
 #else
 #define flb_trace(fmt, ...)  do {} while(0)
 #endif
 
-int flb_log_worker_init(void *data);
 int flb_errno_print(int errnum, const char *file, int line);
 
 #ifdef __FILENAME__
@@ -21,11 +21,17 @@
 #define FLB_LUAJIT_H
 
 #include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_config.h>
 
 #include <lauxlib.h>
 #include <lua.h>
 #include <lualib.h>
 
+#include <msgpack.h>
+
+/* Nested tables deeper than this are packed as nil (e.g. cycles) */
+#define FLB_LUAJIT_MAX_DEPTH  64
+
 /* Lua Context */
 struct flb_luajit {
     lua_State *state;      /* LuaJIT VM environment   */
@@ -38,4 +44,9 @@ int flb_luajit_load_script(struct flb_luajit *lj, char *script);
 void flb_luajit_destroy(struct flb_luajit *lj);
 int flb_luajit_destroy_all(struct flb_config *ctx);
 
+/* msgpack <-> Lua values */
+void flb_luajit_pushmsgpack(lua_State *l, msgpack_object *o);
+int flb_luajit_tomsgpack(lua_State *l, msgpack_packer *pck, int index);
+int flb_luajit_arraylen(lua_State *l, int index);
+
 #endif
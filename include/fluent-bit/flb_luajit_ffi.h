@@ -0,0 +1,97 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef FLB_LUAJIT_FFI_H
+#define FLB_LUAJIT_FFI_H
+
+#include <fluent-bit/flb_luajit.h>
+#include <msgpack.h>
+
+/*
+ * Record view for LuaJIT FFI scripts: the script reads the fields straight
+ * from the msgpack buffer and modifications are kept aside, only the
+ * entries that changed are encoded again.
+ */
+
+/* Value types seen by the scripts */
+#define FLB_LUAJIT_NIL      0
+#define FLB_LUAJIT_BOOL     1
+#define FLB_LUAJIT_NUMBER   2
+#define FLB_LUAJIT_STRING   3
+#define FLB_LUAJIT_OBJECT   4   /* array, map or ext: raw msgpack */
+
+struct flb_luajit_rec;
+
+struct flb_luajit_val {
+    int type;
+    double num;
+    const char *str;
+    size_t len;
+};
+
+/* Accessors, reached by the scripts through function pointers */
+struct flb_luajit_api {
+    int (*get)(struct flb_luajit_rec *, const char *, size_t,
+               struct flb_luajit_val *);
+    int (*size)(struct flb_luajit_rec *);
+    int (*entry)(struct flb_luajit_rec *, int,
+                 struct flb_luajit_val *, struct flb_luajit_val *);
+    int (*set)(struct flb_luajit_rec *, const char *, size_t,
+               struct flb_luajit_val *);
+    int (*remove)(struct flb_luajit_rec *, const char *, size_t);
+};
+
+struct flb_luajit_entry {
+    int removed;
+    int local;               /* stored in 'sets' instead of the record */
+    int key_len;             /* -1 if the key is not a string */
+    size_t key;              /* offsets from the base buffer */
+    size_t obj;
+    size_t obj_size;         /* key and value */
+    size_t val;
+};
+
+struct flb_luajit_rec {
+    const struct flb_luajit_api *api;  /* must be first, see the prelude */
+
+    const char *map;
+    size_t map_size;
+
+    int indexed;
+    int count;
+    int live;
+    int entries_size;
+    struct flb_luajit_entry *entries;
+
+    /* builder */
+    int modified;
+    msgpack_sbuffer sets;
+    msgpack_packer sets_pck;
+};
+
+int flb_luajit_ffi_init(lua_State *l);
+int flb_luajit_ffi_bind(lua_State *l, struct flb_luajit_rec *rec);
+
+struct flb_luajit_rec *flb_luajit_rec_create();
+void flb_luajit_rec_destroy(struct flb_luajit_rec *rec);
+void flb_luajit_rec_reset(struct flb_luajit_rec *rec,
+                          const char *map, size_t size);
+int flb_luajit_rec_pack(struct flb_luajit_rec *rec, msgpack_sbuffer *sbuf);
+
+#endif
@@ -0,0 +1,38 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef FLB_LZF_H
+#define FLB_LZF_H
+
+#include <stddef.h>
+
+/*
+ * A small and fast LZ77 codec using the LZF stream format: it only needs a
+ * hash table on the stack to compress and no memory at all to decompress.
+ */
+
+/* Worst case size of a compressed buffer */
+#define FLB_LZF_BOUND(size)  ((size) + ((size) / 32) + 1)
+
+size_t flb_lzf_compress(const void *in_data, size_t in_len,
+                        void *out_data, size_t out_len);
+size_t flb_lzf_decompress(const void *in_data, size_t in_len,
+                          void *out_data, size_t out_len);
+
+#endif
@@ -33,6 +33,71 @@
 
 #include <stdlib.h>
 
+/*
+ * Memory accounting (FLB_MEM_ACCOUNTING): every allocation done through
+ * the wrappers below is charged to the subsystem of the running code, the
+ * scope is set by the core when it calls into an input collector, a
+ * parser, a filter, an output flush, the upstream I/O or the kubernetes
+ * metadata cache. Without the build option the scopes are no-ops.
+ */
+#define FLB_MEM_CORE         0
+#define FLB_MEM_INPUT        1
+#define FLB_MEM_PARSER       2
+#define FLB_MEM_FILTER       3
+#define FLB_MEM_OUTPUT       4
+#define FLB_MEM_UPSTREAM     5
+#define FLB_MEM_KUBERNETES   6
+#define FLB_MEM_SUBSYSTEMS   7
+
+/* Keep the scope of the running code, see FLB_MEM_SCOPE_ENTER() */
+#define FLB_MEM_SCOPE_KEEP  -1
+
+#ifdef FLB_HAVE_MEM_ACCOUNTING
+#include <stdint.h>
+
+struct flb_mem_usage {
+    uint64_t live;                  /* bytes currently allocated     */
+    uint64_t peak;                  /* highest 'live' value          */
+    uint64_t allocs;                /* number of allocations         */
+    uint64_t frees;                 /* number of releases            */
+};
+
+extern __thread int flb_mem_scope_id;
+
+void flb_mem_acct_alloc(void *ptr, size_t size);
+void *flb_mem_acct_take(void *ptr);
+void flb_mem_acct_resize(void *block, void *ptr, size_t size);
+void flb_mem_acct_free(void *ptr);
+void flb_mem_acct_get(int id, struct flb_mem_usage *out);
+char *flb_mem_subsystem_name(int id);
+
+/* Set the subsystem charged by the calling thread, returns the previous */
+static inline int flb_mem_scope_set(int id)
+{
+    int prev = flb_mem_scope_id;
+
+    if (id != FLB_MEM_SCOPE_KEEP) {
+        flb_mem_scope_id = id;
+    }
+    return prev;
+}
+
+#define FLB_MEM_SCOPE_ENTER(id) int _flb_mem_scope = flb_mem_scope_set(id)
+#define FLB_MEM_SCOPE_LEAVE()   flb_mem_scope_set(_flb_mem_scope)
+
+#else
+
+#define flb_mem_acct_alloc(ptr, size)       do {} while (0)
+#define flb_mem_acct_take(ptr)              NULL
+#define flb_mem_acct_resize(block, ptr, size) (void) (block)
+#define flb_mem_acct_free(ptr)              do {} while (0)
+#define flb_mem_scope_set(id)               do {} while (0)
+
+#define FLB_MEM_SCOPE_ENTER(id)             do {} while (0)
+#define FLB_MEM_SCOPE_LEAVE()               do {} while (0)
+
+#endif /* FLB_HAVE_MEM_ACCOUNTING */
+
 /*
  * The following memory handling wrappers, aims to simplify the way to use
  * the default memory allocator from the libc or an alternative one as Jemalloc.
@@ -50,6 +115,19 @@
     #define ALLOCSZ_ATTR(x,...)
 #endif
 
+/*
+ * Blocks of the memory pool (flb_mem_pool.h) are released and resized by
+ * the pool, the region is empty when there is no pool.
+ */
+extern char *flb_mem_pool_start;
+extern char *flb_mem_pool_end;
+
+void flb_mem_pool_free(void *ptr);
+void *flb_mem_pool_resize(void *ptr, size_t size);
+
+#define flb_mem_pool_owns(ptr)                                          \
+    ((char *) (ptr) >= flb_mem_pool_start && (char *) (ptr) < flb_mem_pool_end)
+
 static inline ALLOCSZ_ATTR(1)
 void *flb_malloc(const size_t size) {
     void *aux;
@@ -58,6 +136,7 @@ void *flb_malloc(const size_t size) {
     if (flb_unlikely(!aux && size)) {
         return NULL;
     }
+    flb_mem_acct_alloc(aux, size);
 
     return aux;
 }
@@ -70,6 +149,7 @@ void *flb_calloc(size_t n, const size_t size) {
     if (flb_unlikely(!buf)) {
         return NULL;
     }
+    flb_mem_acct_alloc(buf, n * size);
 
     return buf;
 }
@@ -78,8 +158,16 @@ static inline ALLOCSZ_ATTR(2)
 void *flb_realloc(void *ptr, const size_t size)
 {
     void *aux;
+    void *block;
 
+    if (flb_unlikely(flb_mem_pool_owns(ptr))) {
+        return flb_mem_pool_resize(ptr, size);
+    }
+
+    /* The old address is released by realloc(), unlink it first */
+    block = flb_mem_acct_take(ptr);
     aux = realloc(ptr, size);
+    flb_mem_acct_resize(block, aux, size);
     if (flb_unlikely(!aux && size)) {
         return NULL;
     }
@@ -88,6 +176,11 @@ void *flb_realloc(void *ptr, const size_t size)
 }
 
 static inline void flb_free(void *ptr) {
+    if (flb_unlikely(flb_mem_pool_owns(ptr))) {
+        flb_mem_pool_free(ptr);
+        return;
+    }
+    flb_mem_acct_free(ptr);
     free(ptr);
 }
 
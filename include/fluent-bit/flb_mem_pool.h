@@ -0,0 +1,72 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef FLB_MEM_POOL_H
+#define FLB_MEM_POOL_H
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Memory pool ('Mem_Pool' service setting): a region reserved and faulted
+ * in at startup, optionally on huge pages, from which the input chunk
+ * buffers and the flush arenas are carved. Blocks are powers of two from
+ * 4KB to 4MB handed out by a buddy allocator; bigger requests, or the ones
+ * the pool cannot serve, fall back to flb_malloc().
+ *
+ * flb_free() and flb_realloc() recognize the pool blocks, a buffer is
+ * released the usual way wherever it ends. Only a buffer that is never
+ * given to the plain libc free()/realloc() can come from the pool, e.g.
+ * msgpack_sbuffer_write() reallocs with libc: the sbuffers of the chunks
+ * use flb_mem_pool_sbuffer_write() instead.
+ *
+ * There is one pool per process, it's shared by the contexts that set it.
+ */
+#define FLB_MEM_POOL_MIN_ORDER   12      /* 4KB blocks */
+#define FLB_MEM_POOL_MAX_ORDER   22      /* 4MB blocks */
+
+/* Huge pages of the pool region (Mem_Pool_Hugepages) */
+#define FLB_MEM_POOL_HUGE_OFF          0
+#define FLB_MEM_POOL_HUGE_TRANSPARENT  1 /* madvise(MADV_HUGEPAGE)     */
+#define FLB_MEM_POOL_HUGE_EXPLICIT     2 /* MAP_HUGETLB, reserved pages */
+
+struct flb_mem_pool_usage {
+    size_t size;                 /* bytes of the region               */
+    size_t used;                 /* bytes of the blocks given out     */
+    size_t peak;                 /* highest 'used' value              */
+    uint64_t fallbacks;          /* requests served by flb_malloc()   */
+    int hugepages;               /* FLB_MEM_POOL_HUGE_* in use        */
+};
+
+int flb_mem_pool_create(size_t size, int hugepages);
+void flb_mem_pool_destroy();
+int flb_mem_pool_hugepages(char *str);
+void flb_mem_pool_usage(struct flb_mem_pool_usage *out);
+
+/* Blocks are released with flb_free() and resized with flb_realloc() */
+void *flb_mem_pool_alloc(size_t size);
+size_t flb_mem_pool_block_size(void *ptr);
+
+/* msgpack_sbuffer_write() growing the buffer from the pool */
+int flb_mem_pool_sbuffer_write(void *data, const char *buf, size_t len);
+
+#endif
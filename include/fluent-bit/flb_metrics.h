@@ -24,9 +24,15 @@
 #ifndef FLB_METRICS_H
 #define FLB_METRICS_H
 
+#include <fluent-bit/flb_sds.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
 /* Metrics IDs for general purpose (used by core and Plugins */
 #define FLB_METRIC_N_RECORDS   0
 #define FLB_METRIC_N_BYTES     1
+#define FLB_METRIC_N_DROPPED   2
 
 #define FLB_METRIC_OUT_OK_RECORDS     10
 #define FLB_METRIC_OUT_OK_BYTES       11
@@ -34,28 +40,175 @@
 #define FLB_METRIC_OUT_RETRY          13
 #define FLB_METRIC_OUT_RETRY_FAILED   14
 
+/* Output buffer quota (storage.total_limit_size) */
+#define FLB_METRIC_OUT_FS_SIZE            15
+#define FLB_METRIC_OUT_FS_EVICTED         16
+#define FLB_METRIC_OUT_FS_EVICTED_BYTES   17
+#define FLB_METRIC_OUT_FS_REJECTED        18
+
+/* Filters: every instance has these, plugins register their own above 100 */
+#define FLB_METRIC_FILTER_IN_RECORDS      30
+#define FLB_METRIC_FILTER_OUT_RECORDS     31
+#define FLB_METRIC_FILTER_IN_BYTES        32
+#define FLB_METRIC_FILTER_OUT_BYTES       33
+#define FLB_METRIC_FILTER_DROP_RECORDS    34
+#define FLB_METRIC_FILTER_TIME            35
+
+/* Output latency histograms */
+#define FLB_METRIC_OUT_FLUSH_TIME         19
+#define FLB_METRIC_OUT_TASK_AGE           20
+#define FLB_METRIC_OUT_RETRY_WAIT         21
+
+/* Output TLS handshakes, resumed ones are abbreviated */
+#define FLB_METRIC_OUT_TLS_HANDSHAKES     22
+#define FLB_METRIC_OUT_TLS_RESUMED        23
+#define FLB_METRIC_OUT_TLS_HANDSHAKE_TIME 24
+
+/* Metric types */
+#define FLB_METRIC_COUNTER     0
+#define FLB_METRIC_HISTOGRAM   1
+
+/*
+ * Histogram buckets have a fixed log scale: the upper bound of the bucket
+ * 'i' is (FLB_METRIC_HIST_BASE << i) microseconds, from 250us up to ~131
+ * seconds. The last slot counts the values above the last bound.
+ */
+#define FLB_METRIC_HIST_BASE      250
+#define FLB_METRIC_HIST_BUCKETS   20
+
+struct flb_metric_hist {
+    uint64_t sum;                                /* microseconds */
+    uint64_t buckets[FLB_METRIC_HIST_BUCKETS + 1];
+};
+
+/*
+ * Counters are summed in per-thread slots: every thread adds to its own
+ * cache line and the slots are only aggregated when the value is read by
+ * an exporter. Threads beyond FLB_METRIC_SLOTS share slots, the additions
+ * are atomic so sharing is still correct.
+ */
+#define FLB_METRIC_SLOTS          8
+
+struct flb_metric_slot {
+    uint64_t val;
+    char pad[64 - sizeof(uint64_t)];
+};
+
 struct flb_metric {
     int id;
+    int type;
     int title_len;
     char title[32];
-    size_t val;
+    uint64_t val;                  /* gauges: the value set             */
+    struct flb_metric_slot *slots; /* counters: allocated on first sum  */
+    struct flb_metric_hist *hist;
     struct mk_list _head;
 };
 
+/* Direct access for the small IDs used by the core */
+#define FLB_METRICS_DIRECT_IDS    64
+
 struct flb_metrics {
     int title_len;         /* Title string length */
     char title[32];        /* Title or id for this metrics context */
     int count;             /* Total count of metrics registered */
     struct mk_list list;   /* Head of metrics list */
+    struct flb_metric *ids[FLB_METRICS_DIRECT_IDS];
+
+    /*
+     * Labelled children, e.g: one context per file tailed by an input. On a
+     * child 'title' is the label name, shared by all the children of the
+     * parent, and 'label' the label value.
+     */
+    char *label;
+    int children_count;
+    struct mk_list children;
+    struct flb_metrics *parent;
+    struct mk_list _head;  /* link to parent->children */
+
+    /*
+     * The HTTP server reads the contexts from its own thread, the lock of
+     * the parent context protects the lists of the parent and its children.
+     */
+    pthread_mutex_t lock;
 };
 
+/* Monotonic clock in microseconds, to measure latencies */
+static inline uint64_t flb_metrics_clock()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1000000ULL) + (ts.tv_nsec / 1000);
+}
+
+int flb_metrics_slot_assign();
+struct flb_metric_slot *flb_metric_slots(struct flb_metric *m);
+
+#ifdef FLB_HAVE_C_TLS
+extern __thread int flb_metrics_slot_id;
+
+/* Slot of the calling thread, assigned on its first update */
+static inline int flb_metrics_slot()
+{
+    if (flb_metrics_slot_id == 0) {
+        flb_metrics_slot_id = flb_metrics_slot_assign() + 1;
+    }
+    return flb_metrics_slot_id - 1;
+}
+#else
+static inline int flb_metrics_slot()
+{
+    return (int) (((uintptr_t) pthread_self() >> 8) % FLB_METRIC_SLOTS);
+}
+#endif
+
+/*
+ * Hot path: update a metric through its handle, the handles are resolved
+ * once with flb_metrics_get_id() when the metrics are registered.
+ */
+static inline void flb_metric_sum(struct flb_metric *m, uint64_t val)
+{
+    struct flb_metric_slot *slots;
+
+    slots = __atomic_load_n(&m->slots, __ATOMIC_ACQUIRE);
+    if (!slots) {
+        slots = flb_metric_slots(m);
+        if (!slots) {
+            __atomic_add_fetch(&m->val, val, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+    __atomic_add_fetch(&slots[flb_metrics_slot()].val, val, __ATOMIC_RELAXED);
+}
+
+/* Gauges have a single writer, the value is replaced */
+static inline void flb_metric_set(struct flb_metric *m, uint64_t val)
+{
+    __atomic_store_n(&m->val, val, __ATOMIC_RELAXED);
+}
+
+void flb_metric_observe(struct flb_metric *m, uint64_t usec);
+uint64_t flb_metric_value(struct flb_metric *m);
+
 struct flb_metrics *flb_metrics_create(char *title);
+struct flb_metrics *flb_metrics_create_child(char *title, char *label,
+                                             struct flb_metrics *parent);
 struct flb_metric *flb_metrics_get_id(int id, struct flb_metrics *metrics);
 int flb_metrics_add(int id, char *title, struct flb_metrics *metrics);
+int flb_metrics_add_histogram(int id, char *title,
+                              struct flb_metrics *metrics);
+int flb_metrics_observe(int id, uint64_t usec, struct flb_metrics *metrics);
+int flb_metrics_hist_bucket(uint64_t usec);
+double flb_metrics_hist_quantile(struct flb_metric *m, double q);
 int flb_metrics_sum(int id, size_t val, struct flb_metrics *metrics);
+int flb_metrics_set(int id, size_t val, struct flb_metrics *metrics);
 int flb_metrics_print(struct flb_metrics *metrics);
 int flb_metrics_dump_values(char **out_buf, size_t *out_size,
                             struct flb_metrics *me);
+flb_sds_t flb_metrics_prometheus(flb_sds_t sds, char *kind,
+                                 struct flb_metrics *me,
+                                 char *time_str, int time_len);
 int flb_metrics_destroy(struct flb_metrics *metrics);
 
 #endif
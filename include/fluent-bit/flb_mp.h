@@ -25,4 +25,54 @@
 int flb_mp_count(void *data, size_t bytes);
 int flb_mp_count_zone(void *data, size_t bytes, msgpack_zone *zone);
 
+/*
+ * Pools of unpack contexts and zones, one per thread. A context taken with
+ * flb_mp_unpacker_get() is used with flb_mp_unpack_next(): its zone is
+ * cleared between objects instead of being released and created again as
+ * msgpack_unpack_next() does. Once returned with flb_mp_unpacker_put(), it
+ * keeps the zone memory for the next user of the same thread.
+ *
+ * Objects unpacked from a context are valid until the next call or put.
+ */
+#define FLB_MP_POOL_SIZE  8
+
+msgpack_unpacked *flb_mp_unpacker_get();
+void flb_mp_unpacker_put(msgpack_unpacked *result);
+int flb_mp_unpack_next(msgpack_unpacked *result,
+                       const char *data, size_t size, size_t *off);
+msgpack_zone *flb_mp_zone_get();
+void flb_mp_zone_put(msgpack_zone *zone);
+void flb_mp_thread_exit();
+
+/*
+ * Helpers to walk serialized msgpack without unpacking it: they let callers
+ * copy untouched entries of a record as raw byte ranges and only re-encode
+ * the ones they change.
+ */
+
+/* Size in bytes of the object at 'buf' (including nested objects) */
+int flb_mp_object_size(const char *buf, size_t size, size_t *out);
+
+/* Map header: number of entries and header length */
+int flb_mp_map_header(const char *buf, size_t size,
+                      uint32_t *count, size_t *hdr_size);
+
+/* Array header: number of entries and header length */
+int flb_mp_array_header(const char *buf, size_t size,
+                        uint32_t *count, size_t *hdr_size);
+
+/* String object: body and length, the object size is set in 'obj_size' */
+int flb_mp_str(const char *buf, size_t size,
+               const char **str, uint32_t *len, size_t *obj_size);
+
+/* Map key: a string or binary object, same as flb_mp_str() */
+int flb_mp_key(const char *buf, size_t size,
+               const char **key, uint32_t *len, size_t *obj_size);
+
+/* Number of [timestamp, map] records in 'buf', -1 if it's not valid */
+int flb_mp_records_check(const char *buf, size_t size);
+
+/* Write a map header in its shortest form, returns the bytes written (<= 5) */
+int flb_mp_map_header_write(char *buf, uint32_t count);
+
 #endif
@@ -33,21 +33,89 @@
 #include <fluent-bit/flb_bits.h>
 #include <fluent-bit/flb_io.h>
 #include <fluent-bit/flb_stats.h>
+#include <fluent-bit/flb_probes.h>
 #include <fluent-bit/flb_config.h>
 #include <fluent-bit/flb_network.h>
 #include <fluent-bit/flb_engine.h>
 #include <fluent-bit/flb_task.h>
+#include <fluent-bit/flb_priority.h>
 #include <fluent-bit/flb_thread.h>
 #include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_arena.h>
 #include <fluent-bit/flb_str.h>
+#include <fluent-bit/flb_upstream_group.h>
 
 /* Output plugin masks */
 #define FLB_OUTPUT_NET          32  /* output address may set host and port */
+#define FLB_OUTPUT_KEEPALIVE    64  /* keepalive is on unless disabled      */
+#define FLB_OUTPUT_SHARDS      256  /* instances can run in engine shards   */
+#define FLB_OUTPUT_HTTP2       512  /* HTTP requests can use HTTP/2 streams */
 #define FLB_OUTPUT_PLUGIN_CORE   0
 #define FLB_OUTPUT_PLUGIN_PROXY  1
 
+/*
+ * Backlog dispatch policies (backlog.policy): how retries and buffered
+ * chunks (the backlog) are flushed while fresh data is being delivered.
+ *
+ * - fifo      : backlog flushes start as soon as they are ready.
+ * - live_first: backlog flushes start only when no fresh data is being
+ *               flushed by the instance.
+ * - weighted  : one backlog flush every 'backlog.ratio' fresh flushes.
+ */
+#define FLB_OUTPUT_BACKLOG_FIFO        0
+#define FLB_OUTPUT_BACKLOG_LIVE_FIRST  1
+#define FLB_OUTPUT_BACKLOG_WEIGHTED    2
+
+#define FLB_OUTPUT_BACKLOG_RATIO       4
+
+/* Default 'max_inflight_queue', times 'max_inflight' */
+#define FLB_OUTPUT_INFLIGHT_QUEUE      4
+
+/* Default 'max_inflight_queue' without 'max_inflight' (open circuit) */
+#define FLB_OUTPUT_CIRCUIT_QUEUE       64
+
+/* Circuit breaker states */
+#define FLB_OUTPUT_CIRCUIT_CLOSED      0
+#define FLB_OUTPUT_CIRCUIT_OPEN        1
+#define FLB_OUTPUT_CIRCUIT_HALF_OPEN   2
+
+/* Default seconds between the probes of an open circuit */
+#define FLB_OUTPUT_CIRCUIT_PROBE       10
+
+/* Buffer quota policies (storage.limit_policy) */
+#define FLB_OUTPUT_FS_DROP_OLDEST  0
+#define FLB_OUTPUT_FS_REJECT       1
+
+/* Coalesced flushes: max tasks and default size of a flush */
+#define FLB_OUTPUT_COALESCE_MAX   256
+#define FLB_OUTPUT_COALESCE_SIZE  1048576
+
+/*
+ * Adaptive coalescing: default target flush latency in milliseconds, the
+ * lower bounds default to the configured window and size over the ratio,
+ * an increase adds the span over the steps.
+ */
+#define FLB_OUTPUT_ADAPTIVE_LATENCY  1000
+#define FLB_OUTPUT_ADAPTIVE_RATIO    16
+#define FLB_OUTPUT_ADAPTIVE_STEPS    16
+
 struct flb_output_instance;
 
+/*
+ * Chunk of a coalesced flush, see cb_flush_multi(). The plugin may set
+ * 'ret' to the result of this chunk, otherwise (-1) it gets the result
+ * of the whole flush.
+ */
+struct flb_output_chunk {
+    void *data;
+    size_t bytes;
+    char *tag;
+    int tag_len;
+    struct flb_input_instance *i_ins;
+    struct flb_chunk_index *index;     /* records index, NULL if invalid */
+    int ret;
+};
+
 struct flb_output_plugin {
     /*
      * The type defines if this is a core-based plugin or it's handled by
@@ -94,6 +162,15 @@ struct flb_output_plugin {
                       void *,
                       struct flb_config *);
 
+    /*
+     * Optional: flush the chunks of several tasks at once. It's only used
+     * by instances with 'coalesce.window' set, retries still go through
+     * cb_flush().
+     */
+    void (*cb_flush_multi) (struct flb_output_chunk *, int,
+                            void *,
+                            struct flb_config *);
+
     /* Exit */
     int (*cb_exit) (void *, struct flb_config *);
 
@@ -110,6 +187,7 @@ struct flb_output_plugin {
  */
 struct flb_output_instance {
     uint64_t mask_id;                    /* internal bitmask for routing */
+    int id;                              /* instance id of the plugin    */
     char name[16];                       /* numbered name (cpu -> cpu.0) */
     int flags;                           /* inherit flags from plugin    */
     struct flb_output_plugin *p;         /* original plugin              */
@@ -120,6 +198,114 @@ struct flb_output_instance {
     int use_tls;                         /* bool, try to use TLS for I/O */
     char *match;                         /* match rule for tag/routing   */
 
+    /* Upstream keepalive (connections pooling) */
+    int keepalive;                       /* bool, recycle connections ?  */
+    int keepalive_idle_timeout;          /* max idle time in seconds     */
+    int keepalive_max_recycle;           /* max times a conn is reused   */
+    int keepalive_min_idle;              /* warm connections to keep     */
+    int http2;                           /* bool, requests as h2 streams */
+
+    /*
+     * Output workers: if 'workers' is greater than zero, the flush
+     * co-routines of this instance are resumed by a pool of POSIX threads,
+     * each one with it own event loop, instead of the engine event loop.
+     */
+    int workers;                         /* number of workers threads    */
+    struct mk_list *workers_next;        /* next worker (round robin)    */
+    struct mk_list workers_pool;         /* list of flb_output_worker    */
+    struct flb_worker_cpus *cpus;        /* 'cpu_affinity' of workers    */
+
+    size_t coro_stack_size;              /* flush co-routine stack size  */
+
+    /*
+     * Optional flush interval: if set, new tasks routed to this instance
+     * are not flushed right away, they wait in the 'pending' list for the
+     * instance timer instead of using the global service Flush.
+     */
+    int flush;                           /* flush interval in seconds    */
+    struct mk_list pending;              /* list of flb_task_route       */
+
+    /*
+     * Backlog dispatch: retries and buffered chunks that cannot start yet
+     * due to the policy or the 'backlog.max_flushes' limit wait in the
+     * backlog lists, they are started when a flush of the instance ends.
+     */
+    int backlog_policy;                  /* FLB_OUTPUT_BACKLOG_*         */
+    int backlog_ratio;                   /* fresh flushes per backlog    */
+    int backlog_max;                     /* max backlog flushes (0: any) */
+    int backlog_running;                 /* backlog flushes running      */
+    int live_running;                    /* fresh flushes running        */
+    int live_credit;                     /* fresh flushes since backlog  */
+    struct flb_priority_queue backlog_routes; /* of flb_task_route   */
+    struct mk_list backlog_retries;      /* list of flb_task_retry       */
+
+    /*
+     * Concurrency limit: with 'max_inflight' set, at most that many
+     * flushes run at the same time, new task routes wait in the
+     * 'inflight_queue' for a free slot, a FIFO per priority class. When
+     * the queue reaches 'max_inflight_queue' the inputs of the queued
+     * tasks are paused until it drains to the half: low priority inputs
+     * are paused from the half of the limit, high ones at one and a half.
+     */
+    int max_inflight;                    /* max flushes running (0: any) */
+    int max_inflight_queue;              /* queued routes to pause inputs*/
+    int inflight_full;                   /* inputs paused by the queue   */
+    int inflight_pause_at;               /* lowest pause threshold hit   */
+    struct flb_priority_queue inflight_queue; /* of flb_task_route       */
+
+    /*
+     * Circuit breaker: once 'circuit.failures' flushes in a row asked for
+     * a retry the circuit opens and the instance has no free flush slot,
+     * new routes, buffered chunks and due retries wait in its queues with
+     * no connection attempts. Every 'circuit.probe_interval' seconds it
+     * goes half-open and lets a single flush through, its success closes
+     * the circuit.
+     */
+    int circuit_failures;                /* failures to open (0: off)    */
+    int circuit_probe;                   /* seconds between probes       */
+    int circuit_state;                   /* FLB_OUTPUT_CIRCUIT_*         */
+    int circuit_count;                   /* failed flushes in a row      */
+    struct flb_sched_timer *circuit_timer; /* pending probe, if any      */
+
+    /*
+     * Coalescing: if the plugin implements cb_flush_multi() and
+     * 'coalesce.window' is set, new task routes wait in the 'coalesce'
+     * list up to that many milliseconds, or until they hold
+     * 'coalesce.max_size' bytes, and then they are flushed together.
+     */
+    int coalesce_window;                 /* milliseconds (0: disabled)   */
+    size_t coalesce_max_size;            /* bytes to flush right away    */
+    size_t coalesce_size;                /* bytes of the waiting routes  */
+    int coalesce_count;                  /* routes in 'coalesce'         */
+    struct flb_sched_timer *coalesce_timer; /* pending window, if any    */
+    struct mk_list coalesce;             /* list of flb_task_route       */
+
+    /*
+     * Adaptive coalescing ('coalesce.adaptive'): the window and size above
+     * are tuned AIMD style after every flush. They grow by a step while
+     * flushes succeed under 'coalesce.latency_target' and are halved on a
+     * retry or a slower flush, within the 'coalesce.min_*' bounds and the
+     * configured 'coalesce.window' and 'coalesce.max_size'.
+     */
+    int coalesce_adaptive;               /* bool, tune window and size ? */
+    int coalesce_latency;                /* target flush latency (ms)    */
+    int coalesce_window_min;             /* milliseconds                 */
+    int coalesce_window_max;             /* milliseconds                 */
+    size_t coalesce_size_min;            /* bytes                        */
+    size_t coalesce_size_max;            /* bytes                        */
+    uint64_t coalesce_cut;               /* last decrease, monotonic usec*/
+
+#ifdef FLB_HAVE_BUFFERING
+    /*
+     * Buffer quota: 'fs_limit' caps the bytes of buffer chunks stored on
+     * disk for this instance, 'fs_chunks' list them oldest first.
+     */
+    size_t fs_limit;                     /* storage.total_limit_size     */
+    int fs_limit_policy;                 /* FLB_OUTPUT_FS_*              */
+    size_t fs_size;                      /* bytes currently buffered     */
+    struct mk_list fs_chunks;            /* flb_buffer_quota_chunk nodes */
+#endif
+
 #ifdef FLB_HAVE_TLS
     int tls_verify;                      /* Verify certs (default: true) */
     int tls_debug;                       /* mbedtls debug level          */
@@ -166,10 +352,6 @@ struct flb_output_instance {
      */
     struct mk_list th_queue;
 
-#ifdef FLB_HAVE_STATS
-    int stats_fd;
-#endif
-
 #ifdef FLB_HAVE_TLS
     struct flb_tls tls;
 #else
@@ -177,16 +359,33 @@ struct flb_output_instance {
 #endif
 
     struct mk_list properties;           /* properties / configuration   */
-    struct mk_list _head;                /* link to config->inputs       */
+    struct mk_list props_set;            /* every property set, in order */
+    struct mk_list _head;                /* link to config->outputs      */
 
 #ifdef FLB_HAVE_METRICS
     struct flb_metrics *metrics;         /* metrics                      */
+
+    /* Handles of the metrics updated on every flush */
+    struct flb_metric *m_ok_records;
+    struct flb_metric *m_ok_bytes;
+    struct flb_metric *m_errors;
+    struct flb_metric *m_flush_time;
+    struct flb_metric *m_task_age;
 #endif
 
     /* Keep a reference to the original context this instance belongs to */
     struct flb_config *config;
 };
 
+/* Monotonic clock in microseconds, to measure the flush latency */
+static inline uint64_t flb_output_clock()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1000000ULL) + (ts.tv_nsec / 1000);
+}
+
 struct flb_output_thread {
     int id;                            /* out-thread ID      */
     void *buffer;                      /* output buffer      */
@@ -194,6 +393,27 @@ struct flb_output_thread {
     struct flb_config *config;         /* FLB context        */
     struct flb_output_instance *o_ins; /* output instance    */
     struct flb_thread *parent;         /* parent thread addr */
+
+    /*
+     * When running in an output worker, the return value is not notified
+     * by the co-routine itself but by the worker once the co-routine
+     * yielded, so the engine never releases a running co-routine.
+     */
+    int backlog;                       /* retry or buffer flush? */
+    int worker;                        /* run by a worker ?      */
+    int ret_pending;                   /* return value pending ? */
+    uint64_t ret_event;                /* engine event to notify */
+
+    struct flb_arena *arena;           /* flush temporaries  */
+
+    /* Coalesced flush: chunks and tasks, the first one is 'task' */
+    int chunks_num;
+    struct flb_output_chunk *chunks;
+    struct flb_task **tasks;
+
+    uint64_t start;                    /* flush start, monotonic usec */
+    uint64_t latency;                  /* flush duration, usec        */
+
     struct mk_list _head;              /* Link to struct flb_task->threads */
 };
 
@@ -225,6 +445,18 @@ static FLB_INLINE int flb_output_thread_destroy_id(int id, struct flb_task *task
 
     mk_list_del(&out_th->_head);
     thread = out_th->parent;
+    flb_arena_destroy(out_th->arena);
+    if (out_th->chunks) {
+        flb_free(out_th->chunks);
+        flb_free(out_th->tasks);
+    }
+
+    if (out_th->backlog == FLB_TRUE) {
+        out_th->o_ins->backlog_running--;
+    }
+    else {
+        out_th->o_ins->live_running--;
+    }
 
     flb_thread_destroy(thread);
     task->users--;
@@ -262,6 +494,8 @@ struct flb_libco_out_params {
     void *out_context;
     struct flb_config *config;
     struct flb_output_plugin *out_plugin;
+    struct flb_output_chunk *chunks;
+    int chunks_num;
     struct flb_thread *th;
 };
 
@@ -272,7 +506,8 @@ static FLB_INLINE void output_params_set(struct flb_thread *th,
                               char *tag, int tag_len,
                               struct flb_input_instance *i_ins,
                               struct flb_output_plugin *out_plugin,
-                              void *out_context, struct flb_config *config)
+                              void *out_context, struct flb_config *config,
+                              struct flb_output_chunk *chunks, int chunks_num)
 {
     /* Callback parameters in order */
     libco_param.data        = data;
@@ -283,6 +518,8 @@ static FLB_INLINE void output_params_set(struct flb_thread *th,
     libco_param.out_context = out_context;
     libco_param.config      = config;
     libco_param.out_plugin  = out_plugin;
+    libco_param.chunks      = chunks;
+    libco_param.chunks_num  = chunks_num;
 
     libco_param.th = th;
     co_switch(th->callee);
@@ -298,7 +535,10 @@ static FLB_INLINE void output_pre_cb_flush()
     struct flb_output_plugin *out_p  = libco_param.out_plugin;
     void *out_context                = libco_param.out_context;
     struct flb_config *config        = libco_param.config;
+    struct flb_output_chunk *chunks  = libco_param.chunks;
+    int chunks_num                   = libco_param.chunks_num;
     struct flb_thread *th            = libco_param.th;
+    struct flb_output_thread *out_th;
 
     /*
      * Until this point the th->callee already set the variables, so we
@@ -307,25 +547,79 @@ static FLB_INLINE void output_pre_cb_flush()
      */
     co_switch(th->caller);
 
+    /* The flush duration is measured from the first resume */
+    out_th = (struct flb_output_thread *) FLB_THREAD_DATA(th);
+    out_th->start = flb_output_clock();
+    FLB_PROBE3(flush_start, out_th->o_ins->name, out_th->task->id, bytes);
+
+#ifdef FLB_HAVE_METRICS
+    if (out_th->task->trace) {
+        flb_task_trace_event(out_th->task->trace, FLB_TASK_TRACE_FLUSH,
+                             out_th->o_ins->name, 0, 0);
+    }
+#endif
+
     /* Continue, we will resume later */
+    flb_mem_scope_set(FLB_MEM_OUTPUT);
+    if (chunks) {
+        out_p->cb_flush_multi(chunks, chunks_num, out_context, config);
+        return;
+    }
     out_p->cb_flush(data, bytes, tag, tag_len, i_ins, out_context, config);
 }
 
+/*
+ * Arena of the running flush co-routine, it's created on first use and
+ * released with the co-routine. It must only be called from cb_flush():
+ * buffers that outlive the flush can't come from here.
+ */
+static FLB_INLINE struct flb_arena *flb_output_arena()
+{
+    struct flb_thread *th;
+    struct flb_output_thread *out_th;
+
+    th = (struct flb_thread *) pthread_getspecific(flb_thread_key);
+    out_th = (struct flb_output_thread *) FLB_THREAD_DATA(th);
+    if (!out_th->arena) {
+        out_th->arena = flb_arena_create(FLB_ARENA_BLOCK_SIZE);
+    }
+    return out_th->arena;
+}
+
+/*
+ * Records index of the chunk being flushed, NULL if it does not cover the
+ * 'bytes' received by cb_flush(). Same as flb_output_arena(), it must only
+ * be called from cb_flush().
+ */
+static FLB_INLINE struct flb_chunk_index *flb_output_chunk_index(size_t bytes)
+{
+    struct flb_thread *th;
+    struct flb_output_thread *out_th;
+
+    th = (struct flb_thread *) pthread_getspecific(flb_thread_key);
+    out_th = (struct flb_output_thread *) FLB_THREAD_DATA(th);
+    if (!flb_chunk_index_valid(&out_th->task->index, bytes)) {
+        return NULL;
+    }
+    return &out_th->task->index;
+}
+
 static FLB_INLINE
-struct flb_thread *flb_output_thread(struct flb_task *task,
-                                     struct flb_input_instance *i_ins,
-                                     struct flb_output_instance *o_ins,
-                                     struct flb_config *config,
-                                     void *buf, size_t size,
-                                     char *tag, int tag_len)
+struct flb_thread *output_thread_create(struct flb_task *task,
+                                        struct flb_input_instance *i_ins,
+                                        struct flb_output_instance *o_ins,
+                                        struct flb_config *config,
+                                        void *buf, size_t size,
+                                        char *tag, int tag_len,
+                                        struct flb_output_chunk *chunks,
+                                        int chunks_num)
 {
     size_t stack_size;
     struct flb_output_thread *out_th;
     struct flb_thread *th;
 
     /* Create a new thread */
-    th = flb_thread_new(sizeof(struct flb_output_thread),
-                        cb_output_thread_destroy);
+    th = flb_thread_slab_new(config->thread_slab);
     if (!th) {
         return NULL;
     }
@@ -348,10 +642,24 @@ struct flb_thread *flb_output_thread(struct flb_task *task,
     out_th->buffer  = buf;
     out_th->config  = config;
     out_th->parent  = th;
+    out_th->backlog = FLB_FALSE;
+    out_th->worker  = FLB_FALSE;
+    out_th->ret_pending = FLB_FALSE;
+    out_th->arena   = NULL;
+    out_th->chunks_num = 0;
+    out_th->chunks  = NULL;
+    out_th->tasks   = NULL;
 
     th->caller = co_active();
-    th->callee = co_create(FLB_THREAD_STACK_SIZE,
-                           output_pre_cb_flush, &stack_size);
+    th->stack_request = o_ins->coro_stack_size;
+    th->callee = flb_thread_stack_create(th->stack_request,
+                                         output_pre_cb_flush, &stack_size);
+    if (!th->callee) {
+        flb_errno();
+        flb_slab_free(config->thread_slab, th);
+        return NULL;
+    }
+    th->stack_size = stack_size;
 
 #ifdef FLB_HAVE_VALGRIND
     th->valgrind_stack_id = VALGRIND_STACK_REGISTER(th->callee,
@@ -367,12 +675,73 @@ struct flb_thread *flb_output_thread(struct flb_task *task,
                       i_ins,
                       o_ins->p,
                       o_ins->context,
-                      config);
+                      config,
+                      chunks, chunks_num);
+    return th;
+}
+
+static FLB_INLINE
+struct flb_thread *flb_output_thread(struct flb_task *task,
+                                     struct flb_input_instance *i_ins,
+                                     struct flb_output_instance *o_ins,
+                                     struct flb_config *config,
+                                     void *buf, size_t size,
+                                     char *tag, int tag_len)
+{
+    return output_thread_create(task, i_ins, o_ins, config,
+                                buf, size, tag, tag_len, NULL, 0);
+}
+
+/*
+ * Flush co-routine of a coalesced flush, it's linked to the first task.
+ * On success it owns the 'chunks' and 'tasks' arrays.
+ */
+static FLB_INLINE
+struct flb_thread *flb_output_thread_multi(struct flb_task **tasks,
+                                           struct flb_output_chunk *chunks,
+                                           int chunks_num,
+                                           struct flb_output_instance *o_ins,
+                                           struct flb_config *config)
+{
+    struct flb_thread *th;
+    struct flb_output_thread *out_th;
+
+    th = output_thread_create(tasks[0], chunks[0].i_ins, o_ins, config,
+                              chunks[0].data, chunks[0].bytes,
+                              chunks[0].tag, chunks[0].tag_len,
+                              chunks, chunks_num);
+    if (!th) {
+        return NULL;
+    }
+
+    out_th = (struct flb_output_thread *) FLB_THREAD_DATA(th);
+    out_th->chunks_num = chunks_num;
+    out_th->chunks = chunks;
+    out_th->tasks = tasks;
+
     return th;
 }
 
 #elif defined FLB_HAVE_FLUSH_PTHREADS
 
+/*
+ * Records index of the chunk being flushed, NULL if it does not cover the
+ * 'bytes' received by cb_flush(). Same as flb_output_arena(), it must only
+ * be called from cb_flush().
+ */
+static FLB_INLINE struct flb_chunk_index *flb_output_chunk_index(size_t bytes)
+{
+    struct flb_thread *th;
+    struct flb_output_thread *out_th;
+
+    th = (struct flb_thread *) pthread_getspecific(flb_thread_key);
+    out_th = (struct flb_output_thread *) FLB_THREAD_DATA(th);
+    if (!flb_chunk_index_valid(&out_th->task->index, bytes)) {
+        return NULL;
+    }
+    return &out_th->task->index;
+}
+
 static FLB_INLINE
 struct flb_thread *flb_output_thread(struct flb_task *task,
                                      struct flb_input_instance *i_ins,
@@ -406,6 +775,35 @@ struct flb_thread *flb_output_thread(struct flb_task *task,
 
 #endif
 
+#ifdef FLB_HAVE_METRICS
+/* Metrics of the flush result of a task */
+static inline void output_return_metrics(struct flb_output_instance *o_ins,
+                                         struct flb_task *task, int ret,
+                                         uint64_t now)
+{
+    int records;
+
+    if (ret == FLB_OK) {
+        records = flb_chunk_index_count(&task->index,
+                                        task->buf, task->size);
+        flb_metric_sum(o_ins->m_ok_records, records);
+        flb_metric_sum(o_ins->m_ok_bytes, task->size);
+
+        /* From the task creation to its delivery by this output */
+        flb_metric_observe(o_ins->m_task_age, now - task->created);
+    }
+    else if (ret == FLB_ERROR) {
+        flb_metric_sum(o_ins->m_errors, 1);
+    }
+    else if (ret == FLB_RETRY) {
+        /*
+         * Counting retries is happening in the event loop/scheduler side
+         * since it also needs to count if some retry fails to re-schedule.
+         */
+    }
+}
+#endif
+
 /*
  * This function is used by the output plugins to return. It's mandatory
  * as it will take care to signal the event loop letting know the flush
@@ -421,12 +819,40 @@ static inline void flb_output_return(int ret, struct flb_thread *th) {
     struct flb_task *task;
     struct flb_output_thread *out_th;
 #ifdef FLB_HAVE_METRICS
-    int records;
+    uint64_t now;
+    struct flb_output_instance *o_ins;
 #endif
 
     out_th = (struct flb_output_thread *) FLB_THREAD_DATA(th);
     task = out_th->task;
 
+    /*
+     * Chunks of a coalesced flush without their own result take the flush
+     * one, the engine is notified about the first one.
+     */
+    if (out_th->chunks) {
+        for (n = 0; n < out_th->chunks_num; n++) {
+            if (out_th->chunks[n].ret == -1) {
+                out_th->chunks[n].ret = ret;
+            }
+        }
+        ret = out_th->chunks[0].ret;
+    }
+    out_th->latency = flb_output_clock() - out_th->start;
+
+#ifdef FLB_HAVE_METRICS
+    /* Recorded before the engine is notified, it can destroy the task */
+    if (task->trace) {
+        flb_task_trace_event(task->trace, FLB_TASK_TRACE_RETURN,
+                             out_th->o_ins->name, ret,
+                             flb_metrics_clock() - out_th->start);
+    }
+    FLB_PROBE4(flush_end, out_th->o_ins->name, task->id, ret,
+               flb_metrics_clock() - out_th->start);
+#else
+    FLB_PROBE4(flush_end, out_th->o_ins->name, task->id, ret, 0);
+#endif
+
     /*
      * To compose the signal event the relevant info is:
      *
@@ -439,28 +865,28 @@ static inline void flb_output_return(int ret, struct flb_thread *th) {
     set = FLB_TASK_SET(ret, task->id, out_th->id);
     val = FLB_BITS_U64_SET(2 /* FLB_ENGINE_TASK */, set);
 
-    n = flb_pipe_w(task->config->ch_manager[1], &val, sizeof(val));
-    if (n == -1) {
-        flb_errno();
+    if (out_th->worker == FLB_TRUE) {
+        /* The output worker will notify the engine */
+        out_th->ret_event = val;
+        out_th->ret_pending = FLB_TRUE;
+    }
+    else {
+        n = flb_engine_notify(task->config, val);
+        if (n == -1) {
+            flb_errno();
+        }
     }
 
 #ifdef FLB_HAVE_METRICS
     if (out_th->o_ins->metrics) {
-        if (ret == FLB_OK) {
-            records = flb_mp_count(task->buf, task->size);
-            flb_metrics_sum(FLB_METRIC_OUT_OK_RECORDS, records,
-                            out_th->o_ins->metrics);
-            flb_metrics_sum(FLB_METRIC_OUT_OK_BYTES, task->size,
-                            out_th->o_ins->metrics);
-        }
-        else if (ret == FLB_ERROR) {
-            flb_metrics_sum(FLB_METRIC_OUT_ERROR, 1, out_th->o_ins->metrics);
-        }
-        else if (ret == FLB_RETRY) {
-            /*
-             * Counting retries is happening in the event loop/scheduler side
-             * since it also needs to count if some retry fails to re-schedule.
-             */
+        o_ins = out_th->o_ins;
+        now = flb_metrics_clock();
+        flb_metric_observe(o_ins->m_flush_time, now - out_th->start);
+
+        output_return_metrics(o_ins, task, ret, now);
+        for (n = 1; n < out_th->chunks_num; n++) {
+            output_return_metrics(o_ins, out_th->tasks[n],
+                                  out_th->chunks[n].ret, now);
         }
     }
 #endif
@@ -482,15 +908,41 @@ static inline void flb_output_return_do(int x)
     flb_output_return_do(x);                                            \
     return
 
+/* Built-in plugins, NULL terminated */
+extern struct flb_output_plugin *const flb_out_plugins[];
+
 struct flb_output_instance *flb_output_new(struct flb_config *config,
                                            char *output, void *data);
+struct flb_output_instance *flb_output_new_detached(struct flb_config *config,
+                                                    char *output, void *data,
+                                                    struct mk_list *list);
+int flb_output_instance_equal(struct flb_output_instance *a,
+                              struct flb_output_instance *b);
+int flb_output_instance_init(struct flb_output_instance *ins,
+                             struct flb_config *config);
+void flb_output_instance_exit(struct flb_output_instance *ins,
+                              struct flb_config *config);
+void flb_output_swap(struct flb_config *config,
+                     struct flb_output_instance **outs, int n);
+int flb_output_retired_cleanup(struct flb_config *config);
 
 int flb_output_set_property(struct flb_output_instance *out, char *k, char *v);
 char *flb_output_get_property(char *key, struct flb_output_instance *o_ins);
+void flb_output_upstream_set(struct flb_upstream *u,
+                             struct flb_output_instance *o_ins);
+void flb_output_thread_resume(struct flb_thread *th);
+int flb_output_upstream_group(struct flb_output_instance *o_ins,
+                              struct flb_config *config,
+                              int default_port, int flags, void *tls,
+                              struct flb_upstream_group **out);
 
 void flb_output_pre_run(struct flb_config *config);
 void flb_output_exit(struct flb_config *config);
 void flb_output_set_context(struct flb_output_instance *ins, void *context);
+void flb_output_circuit_update(struct flb_output_instance *ins, int ret,
+                               struct flb_config *config);
+void flb_output_coalesce_update(struct flb_output_instance *ins, int ret,
+                                uint64_t start, uint64_t latency);
 int flb_output_instance_destroy(struct flb_output_instance *ins);
 int flb_output_init(struct flb_config *config);
 int flb_output_check(struct flb_config *config);
@@ -0,0 +1,54 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef FLB_OUTPUT_WORKER_H
+#define FLB_OUTPUT_WORKER_H
+
+#include <monkey/mk_core.h>
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_pipe.h>
+#include <fluent-bit/flb_config.h>
+#include <fluent-bit/flb_output.h>
+#include <fluent-bit/flb_thread.h>
+
+/* Message sent through the worker channel to request the worker exit */
+#define FLB_OUTPUT_WORKER_STOP   0
+
+struct flb_output_worker {
+    /* Channel event, it must be the first member */
+    struct mk_event event;
+
+    int id;                              /* worker number          */
+    pthread_t tid;                       /* thread ID              */
+    flb_pipefd_t ch_events[2];           /* requests channel       */
+    struct mk_event_loop *evl;           /* worker event loop      */
+    struct flb_output_instance *o_ins;   /* parent output instance */
+    struct flb_config *config;           /* FLB context            */
+
+    struct mk_list _head;                /* link to o_ins->workers_pool */
+};
+
+int flb_output_worker_start(struct flb_output_instance *ins);
+void flb_output_worker_stop(struct flb_output_instance *ins);
+void flb_output_worker_destroy(struct flb_output_instance *ins);
+int flb_output_worker_dispatch(struct flb_output_instance *ins,
+                               struct flb_thread *th);
+void flb_output_worker_exit(struct flb_config *config);
+
+#endif
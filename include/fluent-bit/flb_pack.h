@@ -22,16 +22,13 @@
 
 #include <fluent-bit/flb_info.h>
 #include <fluent-bit/flb_sds.h>
-#include <jsmn/jsmn.h>
+#include <fluent-bit/flb_json.h>
 #include <msgpack.h>
 
 struct flb_pack_state {
-    int multiple;         /* support multiple jsons? */
-    int tokens_count;     /* number of parsed tokens */
-    int tokens_size;      /* array size of tokens    */
-    int last_byte;        /* last byte of a full msg */
-    jsmntok_t *tokens;    /* tokens array            */
-    jsmn_parser parser;   /* parser state            */
+    int multiple;               /* support multiple jsons? */
+    int last_byte;              /* last byte of a full msg */
+    struct flb_json_scan scan;  /* structural scan state   */
 };
 
 int flb_pack_json(char *js, size_t len, char **buffer, size_t *size);
@@ -50,6 +47,7 @@ char* flb_msgpack_to_json_str(size_t size, msgpack_object *obj);
 int flb_msgpack_raw_to_json_str(char *buf, size_t buf_size,
                                 char **out_buf, size_t *out_size);
 flb_sds_t flb_msgpack_raw_to_json_sds(void *in_buf, size_t in_size);
+int flb_msgpack_to_json_sds(flb_sds_t *s, msgpack_object *obj);
 
 int flb_pack_time_now(msgpack_packer *pck);
 int flb_msgpack_expand_map(char *map_data, size_t map_size,
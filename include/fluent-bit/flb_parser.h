@@ -26,9 +26,14 @@
 #include <fluent-bit/flb_config.h>
 #include <fluent-bit/flb_time.h>
 #include <msgpack.h>
+#include <pthread.h>
+
+#define FLB_PARSER_TIME_CACHE_SIZE  64
 
 #define FLB_PARSER_REGEX 1
 #define FLB_PARSER_JSON  2
+#define FLB_PARSER_LOGFMT 3
+#define FLB_PARSER_LTSV  4
 
 struct flb_parser_types {
     char *key;
@@ -36,6 +41,28 @@ struct flb_parser_types {
     int type;
 };
 
+/* Named capture of a regex parser, resolved when the parser is created */
+struct flb_parser_capture {
+    int group;            /* regex group number            */
+    int type;             /* cast type, zero if none       */
+    int is_time;          /* group holds the record time   */
+    char *name;           /* group name (not packed)       */
+    int name_len;
+    char *key;            /* group name packed as msgpack  */
+    int key_size;
+};
+
+/*
+ * Last time string resolved by strptime(3): 'key' holds the bytes consumed
+ * by the format (up to the seconds) plus the byte that follows them.
+ */
+struct flb_parser_time_cache {
+    pthread_mutex_t lock;
+    int consumed;         /* bytes consumed by strptime(3) */
+    char key[FLB_PARSER_TIME_CACHE_SIZE];
+    struct tm tm;
+};
+
 struct flb_parser {
     /* configuration */
     int type;             /* parser type */
@@ -56,7 +83,15 @@ struct flb_parser {
     int time_with_year;   /* do time_fmt consider a year (%Y) ? */
     char *time_fmt_year;
     int time_with_tz;     /* do time_fmt consider a timezone ?  */
-    struct flb_regex *regex;
+    int time_fast;        /* time_fmt handled by the built-in scanner */
+    struct flb_parser_time_cache time_cache;
+    struct flb_regex *regex;  /* NULL until compiled if loaded lazily */
+    int regex_failed;         /* lazy compilation failed            */
+    struct flb_parser_capture *captures;  /* regex capture map */
+    int captures_len;
+    int *types_table;     /* perfect hash of 'types', index + 1 */
+    uint32_t types_mask;
+    uint32_t types_seed;
     struct mk_list _head;
 };
 
@@ -98,9 +133,8 @@ int flb_parser_frac_tzone(char *str, int len, double *frac, int *tmdiff);
 int flb_parser_time_lookup(char *time, size_t tsize, time_t now,
                            struct flb_parser *parser,
                            struct tm *tm, double *ns);
-int flb_parser_typecast(char *key, int key_len,
-                        char *val, int val_len,
-                        msgpack_packer *pck,
-                        struct flb_parser_types *types,
-                        int types_len);
+int flb_parser_type_lookup(struct flb_parser *parser, char *key, int key_len);
+int flb_parser_typecast_value(char *key, int type,
+                              char *val, int val_len,
+                              msgpack_packer *pck);
 #endif
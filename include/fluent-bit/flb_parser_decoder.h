@@ -23,6 +23,7 @@
 #include <fluent-bit/flb_info.h>
 #include <fluent-bit/flb_sds.h>
 #include <monkey/mk_core.h>
+#include <pthread.h>
 
 /* Decoder behavior */
 #define FLB_PARSER_DEC_DEFAULT  0  /* results place as separate keys    */
@@ -52,6 +53,7 @@ struct flb_parser_dec_rule {
 struct flb_parser_dec {
     flb_sds_t key;
     flb_sds_t buffer;        /* temporal buffer for decoding work */
+    pthread_mutex_t lock;    /* owner of 'buffer'                 */
     int add_extra_keys;      /* if type == FLB_PARSER_DEC_DEFAULT, flag is True */
     struct mk_list rules;    /* list head for decoder key rules */
     struct mk_list _head;    /* link to parser->decoders */
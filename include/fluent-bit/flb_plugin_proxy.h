@@ -31,6 +31,51 @@
 /* Proxies available */
 #define FLB_PROXY_GOLANG          11
 
+/*
+ * Registration flags: a plugin setting FLB_PROXY_OUTPUT_WORKERS can be
+ * flushed from the output workers ('Workers' property), its flush callbacks
+ * may run at the same time from different threads.
+ */
+#define FLB_PROXY_OUTPUT_WORKERS  128
+
+/*
+ * Batch flush
+ * ===========
+ *
+ * A Go output plugin exporting FLBPluginFlushBatch() receives the chunks
+ * of many flushes in a single call instead of one FLBPluginFlush() call
+ * per chunk:
+ *
+ *   int FLBPluginFlushBatch(struct flb_proxy_chunk *chunks, int count);
+ *
+ * Flushes are queued while the previous call is running, the next call
+ * takes all of them (up to FLB_PROXY_BATCH_MAX), an idle plugin is called
+ * right away with a single chunk. The calls are made from a dedicated
+ * thread, never concurrently.
+ *
+ * Lifetime: 'data' and 'tag' point to the buffers of the tasks, they are
+ * not copied and they are valid only until FLBPluginFlushBatch() returns.
+ * The plugin must not modify them and must copy anything it keeps (e.g:
+ * C.GoBytes()); a slice over the memory (unsafe.Slice) can be used during
+ * the call only.
+ *
+ * 'records' is the number of records in 'data', known by the engine so
+ * the plugin can size its output without decoding first. The plugin sets
+ * 'ret' of every chunk to FLB_OK, FLB_RETRY or FLB_ERROR, the chunks left
+ * as FLB_PROXY_RET_UNSET take the return value of the call.
+ */
+#define FLB_PROXY_BATCH_MAX       256
+#define FLB_PROXY_RET_UNSET       -1
+
+struct flb_proxy_chunk {
+    void *data;               /* msgpack records (read-only)                 */
+    size_t size;              /* bytes in 'data'                             */
+    int records;              /* number of records in 'data'                 */
+    int tag_len;              /* tag length                                  */
+    char *tag;                /* tag, NULL terminated                        */
+    int ret;                  /* FLB_OK, FLB_RETRY or FLB_ERROR              */
+};
+
 struct flb_plugin_proxy_def {
     /* Fields populated once remote flb_cb_register() is called */
     int type;                 /* defined by FLB_PROXY_[INPUT|OUTPUT]_PLUGIN  */
@@ -0,0 +1,59 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef FLB_PRIORITY_H
+#define FLB_PRIORITY_H
+
+#include <monkey/mk_core.h>
+
+/* Priority classes of the data ingested by an input instance */
+#define FLB_PRIORITY_LOW       0
+#define FLB_PRIORITY_NORMAL    1
+#define FLB_PRIORITY_HIGH      2
+#define FLB_PRIORITY_CLASSES   3
+
+/*
+ * Routes waiting for a flush slot, one FIFO per priority class. They are
+ * taken by weighted round robin: every class gets as many turns in a
+ * round as its weight (1, 2 and 4 from low to high), so higher classes
+ * go first without starving the lower ones.
+ */
+struct flb_priority_queue {
+    int count;                               /* entries in all classes */
+    int current;                             /* class being served     */
+    int turns;                               /* turns left to 'current'*/
+    struct mk_list lists[FLB_PRIORITY_CLASSES];
+};
+
+int flb_priority_parse(const char *str);
+const char *flb_priority_name(int priority);
+
+void flb_priority_queue_init(struct flb_priority_queue *q);
+void flb_priority_queue_add(struct flb_priority_queue *q,
+                            struct mk_list *head, int priority);
+void flb_priority_queue_del(struct flb_priority_queue *q,
+                            struct mk_list *head);
+struct mk_list *flb_priority_queue_pop(struct flb_priority_queue *q);
+
+static inline int flb_priority_queue_empty(struct flb_priority_queue *q)
+{
+    return (q->count == 0);
+}
+
+#endif
@@ -0,0 +1,74 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef FLB_PROBES_H
+#define FLB_PROBES_H
+
+#include <fluent-bit/flb_info.h>
+
+/*
+ * USDT static probes
+ * ==================
+ *
+ * With FLB_USDT=On the probes below are compiled as SystemTap SDT notes
+ * (sys/sdt.h): a single nop at the probe site plus an ELF note, perf,
+ * bpftrace or stap attach to them at runtime, e.g:
+ *
+ *   bpftrace -e 'usdt:./bin/fluent-bit:fluentbit:flush_end
+ *                { @[str(arg0)] = hist(arg3); }'
+ *
+ * Without the option they expand to nothing. The names and arguments are
+ * a stable interface:
+ *
+ *   input_append      (char *input, char *tag, size_t bytes)
+ *   engine_dispatch   (char *input, char *tag, size_t bytes)
+ *   task_create       (int task_id, char *tag, size_t bytes)
+ *   task_destroy      (int task_id, char *tag, uint64_t age_usec)
+ *   flush_start       (char *output, int task_id, size_t bytes)
+ *   flush_end         (char *output, int task_id, int ret, uint64_t usec)
+ *   retry_schedule    (char *output, int task_id, int attempt, int seconds)
+ *   upstream_connect  (char *host, int port, int fd, int ret)
+ *   net_write         (int fd, size_t bytes, int ret)
+ *
+ * The time arguments are only computed when metrics are enabled,
+ * otherwise they are zero.
+ */
+
+#ifdef FLB_HAVE_USDT
+
+#include <sys/sdt.h>
+
+#define FLB_PROBE1(name, a)                     \
+    DTRACE_PROBE1(fluentbit, name, a)
+#define FLB_PROBE2(name, a, b)                  \
+    DTRACE_PROBE2(fluentbit, name, a, b)
+#define FLB_PROBE3(name, a, b, c)               \
+    DTRACE_PROBE3(fluentbit, name, a, b, c)
+#define FLB_PROBE4(name, a, b, c, d)            \
+    DTRACE_PROBE4(fluentbit, name, a, b, c, d)
+
+#else
+
+#define FLB_PROBE1(name, a)           do {} while (0)
+#define FLB_PROBE2(name, a, b)        do {} while (0)
+#define FLB_PROBE3(name, a, b, c)     do {} while (0)
+#define FLB_PROBE4(name, a, b, c, d)  do {} while (0)
+
+#endif /* FLB_HAVE_USDT */
+#endif /* FLB_PROBES_H */
@@ -0,0 +1,132 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef FLB_PROCFS_H
+#define FLB_PROCFS_H
+
+#include <fluent-bit/flb_info.h>
+#include <monkey/mk_core.h>
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct flb_config;
+
+/* Default read buffer, it grows up to the file size */
+#define FLB_PROCFS_BUF_SIZE    4096
+
+/* A shared file is read once for the inputs that sample it within 100ms */
+#define FLB_PROCFS_SAMPLE_NS   100000000ULL
+
+/*
+ * A /proc file kept open: every read is a pread(2) at offset zero, the
+ * kernel renders the content again and there is no open/close per sample.
+ */
+struct flb_procfs_file {
+    int fd;
+    char *path;
+    char *buf;                /* last content, NUL terminated */
+    size_t buf_size;
+    size_t len;               /* bytes of the last read       */
+    uint64_t sampled;         /* monotonic time of last read  */
+    int users;                /* inputs sharing the file      */
+    struct mk_list _head;     /* link to config->procfs_files */
+};
+
+struct flb_procfs_file *flb_procfs_file_open(const char *path);
+void flb_procfs_file_close(struct flb_procfs_file *file);
+char *flb_procfs_file_read(struct flb_procfs_file *file, size_t *size);
+
+/* Shared files, registered in the configuration context */
+struct flb_procfs_file *flb_procfs_get(struct flb_config *config,
+                                       const char *path);
+void flb_procfs_put(struct flb_config *config, struct flb_procfs_file *file);
+char *flb_procfs_sample(struct flb_procfs_file *file, size_t *size);
+void flb_procfs_exit(struct flb_config *config);
+
+/*
+ * Parsing helpers, the buffers returned by the read functions are NUL
+ * terminated so the scans stop at the end of the content.
+ */
+
+/* Skip blanks and parse an unsigned integer, 'p' is moved past it */
+static inline uint64_t flb_procfs_u64(char **p)
+{
+    uint64_t val = 0;
+    char *s = *p;
+
+    while (*s == ' ' || *s == '\t') {
+        s++;
+    }
+    while (*s >= '0' && *s <= '9') {
+        val = (val * 10) + (*s - '0');
+        s++;
+    }
+
+    *p = s;
+    return val;
+}
+
+/* Same as flb_procfs_u64() for values that can be negative */
+static inline int64_t flb_procfs_i64(char **p)
+{
+    int neg = 0;
+    int64_t val;
+    char *s = *p;
+
+    while (*s == ' ' || *s == '\t') {
+        s++;
+    }
+    if (*s == '-') {
+        neg = 1;
+        s++;
+    }
+    val = (int64_t) flb_procfs_u64(&s);
+
+    *p = s;
+    return neg ? -val : val;
+}
+
+/* Skip 'n' blank separated fields */
+static inline char *flb_procfs_skip(char *p, int n)
+{
+    while (n-- > 0) {
+        while (*p == ' ' || *p == '\t') {
+            p++;
+        }
+        while (*p && *p != ' ' && *p != '\t' && *p != '\n') {
+            p++;
+        }
+    }
+    return p;
+}
+
+/* Start of the next line, or the end of the content */
+static inline char *flb_procfs_next_line(char *p)
+{
+    while (*p && *p != '\n') {
+        p++;
+    }
+    if (*p == '\n') {
+        p++;
+    }
+    return p;
+}
+
+#endif
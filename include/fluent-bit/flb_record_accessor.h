@@ -0,0 +1,74 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+
+#ifndef FLB_RECORD_ACCESSOR_H
+#define FLB_RECORD_ACCESSOR_H
+
+#include <fluent-bit/flb_info.h>
+#include <msgpack.h>
+
+/*
+ * Record accessor: a key path is compiled once into a list of steps that
+ * are applied to a record map to find a value, e.g:
+ *
+ *   $log                         first level key 'log'
+ *   $kubernetes['labels']['app'] nested maps
+ *   $items[0]['name']            array element, then a map key
+ *
+ * A pattern that does not start with '$' is a single first level key
+ * taken as it is. Lookups return a reference into the record, nothing is
+ * copied.
+ */
+#define FLB_RA_KEY    0               /* map key step   */
+#define FLB_RA_INDEX  1               /* array index    */
+
+struct flb_ra_step {
+    int type;
+    int len;                          /* key length             */
+    char *key;                        /* key (FLB_RA_KEY)       */
+    int index;                        /* index (FLB_RA_INDEX)   */
+
+    /*
+     * Position the key was found at last time, records of the same source
+     * use to keep their keys in the same order so it's tried first. It's
+     * only a hint: a stale value costs a regular scan.
+     */
+    int hint;
+};
+
+struct flb_record_accessor {
+    char *pattern;
+    int steps_len;
+    struct flb_ra_step *steps;
+};
+
+struct flb_record_accessor *flb_ra_create(char *pattern);
+void flb_ra_destroy(struct flb_record_accessor *ra);
+msgpack_object *flb_ra_get(struct flb_record_accessor *ra, msgpack_object map);
+int flb_ra_get_str(struct flb_record_accessor *ra, msgpack_object map,
+                   char **str, int *len);
+
+/* Is the pattern a plain first level key ? */
+static inline int flb_ra_is_first_level(struct flb_record_accessor *ra)
+{
+    return (ra->steps_len == 1 && ra->steps[0].type == FLB_RA_KEY);
+}
+
+#endif
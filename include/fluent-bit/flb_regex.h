@@ -29,9 +29,21 @@
 
 #include <onigmo.h>
 
+/* Max length of the literal used to prefilter the subjects */
+#define FLB_REGEX_LITERAL   32
+
 struct flb_regex {
     unsigned char *pattern;
     OnigRegex regex;
+
+    /* Literal that any match must contain, zero length if unknown */
+    int literal_len;
+    unsigned char literal[FLB_REGEX_LITERAL];
+
+    /* Shared patterns (flb_regex_get), guarded by the compile lock */
+    char *key;
+    int refs;
+    struct flb_regex *next;
 };
 
 struct flb_regex_search {
@@ -46,14 +58,24 @@ struct flb_regex_search {
 
 int flb_regex_init();
 struct flb_regex *flb_regex_create(unsigned char *pattern);
+struct flb_regex *flb_regex_get(unsigned char *pattern);
+void flb_regex_put(struct flb_regex *r);
 ssize_t flb_regex_do(struct flb_regex *r, unsigned char *str, size_t slen,
                      struct flb_regex_search *result);
+int flb_regex_match(struct flb_regex *r, unsigned char *str, size_t slen);
 int flb_regex_parse(struct flb_regex *r, struct flb_regex_search *result,
                     void (*cb_match) (unsigned char *,          /* name  */
                                       unsigned char *, size_t,  /* value */
                                       void *),                  /* caller data */
                     void *data);
+int flb_regex_foreach_name(struct flb_regex *r,
+                           int (*cb_name) (unsigned char *, size_t, /* name */
+                                           int,                     /* group */
+                                           void *),                 /* data */
+                           void *data);
+void flb_regex_results_release(struct flb_regex_search *result);
 int flb_regex_destroy(struct flb_regex *r);
+void flb_regex_thread_exit();
 void flb_regex_exit();
 
 #endif
@@ -0,0 +1,62 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef FLB_RELOAD_H
+#define FLB_RELOAD_H
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_config.h>
+#include <fluent-bit/flb_sds.h>
+
+/* Milliseconds between checks of the outputs retired and still draining */
+#define FLB_RELOAD_DRAIN_CHECK  1000
+
+/*
+ * Hot reload: with 'Hot_Reload On' a SIGHUP or a POST to /api/v1/reload
+ * re-reads the configuration file and applies it from the engine thread.
+ *
+ * The [FILTER] chain is rebuilt: filters whose plugin, match rule and
+ * properties did not change keep their running instance (and its caches),
+ * the new ones are initialized while the old chain keeps running and the
+ * chains are swapped at once. If a new filter fails to start the reload
+ * is aborted and the running chain is kept.
+ *
+ * The [OUTPUT] sections are applied the same way: unchanged outputs keep
+ * their instance, upstream connections and pending tasks, new ones are
+ * started before the swap and the inputs are routed to the new list. A
+ * removed output is retired: it gets no new task, the ones it holds are
+ * still flushed (retries included) and it is stopped once drained. With
+ * the filesystem buffer the chunks store the routes, outputs are fixed.
+ *
+ * Inputs own the buffered chunks and file offsets: they are never
+ * restarted. Changes in the [SERVICE] or [INPUT] sections (and [OUTPUT]
+ * with the filesystem buffer) are reported and require a restart.
+ */
+struct flb_reload {
+    flb_sds_t signature;       /* sections a reload can not apply, at start */
+    int reloads;               /* applied                                 */
+    int failures;              /* aborted                                 */
+};
+
+int flb_reload_init(struct flb_config *config);
+void flb_reload_exit(struct flb_config *config);
+int flb_reload_request(struct flb_config *config);
+int flb_reload(struct flb_config *config);
+
+#endif
@@ -0,0 +1,53 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef FLB_RING_H
+#define FLB_RING_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Lock-free single-producer / single-consumer ring buffer of fixed size
+ * slots: one thread pushes and one thread pops. Messages are copied in
+ * and out of the slots, no memory is allocated after creation.
+ */
+
+#define FLB_RING_CACHE_LINE  64
+
+struct flb_ring {
+    size_t slot_size;
+    uint32_t mask;                  /* slots - 1, slots is a power of two */
+    char *slots;
+
+    /* producer position, only written by the producer */
+    uint32_t head __attribute__((aligned(FLB_RING_CACHE_LINE)));
+
+    /* consumer position, only written by the consumer */
+    uint32_t tail __attribute__((aligned(FLB_RING_CACHE_LINE)));
+};
+
+struct flb_ring *flb_ring_create(size_t slot_size, uint32_t slots);
+void flb_ring_destroy(struct flb_ring *ring);
+
+int flb_ring_push(struct flb_ring *ring, void *data);
+int flb_ring_pop(struct flb_ring *ring, void *data);
+int flb_ring_empty(struct flb_ring *ring);
+
+#endif
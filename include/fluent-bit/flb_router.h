@@ -22,13 +22,35 @@
 
 #include <fluent-bit/flb_output.h>
 
+/* Routes cache: hash table size and max number of cached tags */
+#define FLB_ROUTER_CACHE_SIZE         1024
+#define FLB_ROUTER_CACHE_MAX_ENTRIES  16384
+
+struct flb_filter_instance;
+
 struct flb_router_path {
     struct flb_output_instance *ins;
     struct mk_list _head;
 };
 
+/*
+ * A cache entry holds the result of matching a tag against every filter
+ * and output instance: the chain of filters to apply (in order) and the
+ * bitmask of the destination outputs.
+ */
+struct flb_router_cache_entry {
+    uint64_t routes_mask;                   /* outputs mask_id's */
+    int filters_count;                      /* number of filters */
+    struct flb_filter_instance *filters[];  /* filters chain     */
+};
+
 int flb_router_match(const char *tag, const char *match);
 int flb_router_io_set(struct flb_config *config);
+int flb_router_io_update(struct flb_config *config);
 void flb_router_exit(struct flb_config *config);
 
+struct flb_router_cache_entry *flb_router_cache_get(char *tag, int tag_len,
+                                                    struct flb_config *config);
+void flb_router_cache_invalidate(struct flb_config *config);
+
 #endif
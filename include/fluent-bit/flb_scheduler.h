@@ -25,14 +25,27 @@
 #include <fluent-bit/flb_task.h>
 #include <fluent-bit/flb_output.h>
 
+#include <time.h>
+
 /* Sched contstants */
 #define FLB_SCHED_CAP            2000
 #define FLB_SCHED_BASE           5
-#define FLB_SCHED_REQUEST_FRAME  10
+
+/*
+ * Timer wheel: retries and custom timers are placed into the slots of a
+ * hashed wheel driven by a single timer that ticks every
+ * FLB_SCHED_WHEEL_TICK milliseconds. Timers beyond one wheel turn wait
+ * in their slot for the remaining 'rounds'.
+ */
+#define FLB_SCHED_WHEEL_TICK     100   /* milliseconds per slot     */
+#define FLB_SCHED_WHEEL_SLOTS    512   /* ~51 seconds per turn      */
+
+/* Size of the table used to lookup requests by their data reference */
+#define FLB_SCHED_REQUEST_HASH   256
 
 /* Timer types */
-#define FLB_SCHED_TIMER_REQUEST  1  /* timerfd             */
-#define FLB_SCHED_TIMER_FRAME    2  /* timer frame checker */
+#define FLB_SCHED_TIMER_REQUEST  1  /* retry request                 */
+#define FLB_SCHED_TIMER_FRAME    2  /* timer wheel tick              */
 #define FLB_SCHED_TIMER_CUSTOM   3  /* one-shot timer, custom needs */
 
 /*
@@ -50,54 +63,50 @@ struct flb_sched_timer {
     void *data;
 
     /*
-     * Custom timer specific data:
+     * Timer wheel position:
      *
-     * - timer_fd = timer file descriptor
-     * - cb       = callback to be triggerd upon expiration
+     * - slot   = wheel slot index, -1 if the timer is not scheduled
+     * - rounds = wheel turns left before the timer expires
      */
-    int timer_fd;
+    int slot;
+    int rounds;
+
+    /* Custom timer callback, triggered upon expiration */
     void (*cb)(struct flb_config *, void *);
 
     /* Parent context */
     struct flb_config *config;
 
+    struct mk_list _head_slot;  /* link to flb_sched->wheel[slot] */
+
     /* link to flb_sched->timers */
     struct mk_list _head;
 };
 
 /* Struct representing a FLB_SCHED_TIMER_REQUEST */
 struct flb_sched_request {
-    flb_pipefd_t fd;
     time_t created;
     time_t timeout;
     void *data;
     struct flb_sched_timer *timer; /* parent timer linked from */
-    struct mk_list _head;          /* link to flb_sched->[requests|wait] */
+    struct mk_list _head;          /* link to flb_sched->requests[hash] */
 };
 
 /* Scheduler context */
 struct flb_sched {
 
     /*
-     * Scheduler lists:
+     * Scheduler requests:
      *
      * The scheduler is used to issue 'retries' of flush requests when these
      * cannot be processed and the output plugins ask for a retry.
      *
-     * If a retry have not reached a limit and is allowed, it needs to be
-     * queued:
-     *
-     *  - For retries that will happen within the next 60 seconds, they are
-     *    placed in the 'requests' list and a timeout is registered with
-     *    the operating system (timerfd).
-     *
-     *  - For retries that will happen 'after' 60 seconds, they are queued
-     *    into the requests_wait' list. They stay there until their
-     *    flush time happens within the next 60 seconds, so they are moved
-     *    to the sched_requests list and a further timeout is created.
+     * If a retry have not reached a limit and is allowed, its timer is
+     * placed into the wheel and the request is linked into a small table
+     * hashed by the request 'data', so it can be invalidated without
+     * walking every pending retry.
      */
-    struct mk_list requests;
-    struct mk_list requests_wait;
+    struct mk_list requests[FLB_SCHED_REQUEST_HASH];
 
     /* Timers: list of timers for different purposes */
     struct mk_list timers;
@@ -108,7 +117,17 @@ struct flb_sched {
      */
     struct mk_list timers_drop;
 
-    /* Frame timer context */
+    /*
+     * Timer wheel: 'wheel_ticks' is the number of ticks processed since
+     * 'wheel_start', the wheel catches up with the clock on every tick
+     * notification.
+     */
+    int wheel_pos;                                 /* current slot    */
+    uint64_t wheel_ticks;                          /* ticks processed */
+    struct timespec wheel_start;                   /* monotonic start */
+    struct mk_list wheel[FLB_SCHED_WHEEL_SLOTS];   /* pending timers  */
+
+    /* Wheel tick timer context */
     flb_pipefd_t frame_fd;
 
     struct flb_config *config;
@@ -116,6 +135,8 @@ struct flb_sched {
 
 int flb_sched_request_create(struct flb_config *config,
                              void *data, int tries);
+int flb_sched_request_restore(struct flb_config *config,
+                              void *data, int tries, time_t retry_at);
 int flb_sched_request_destroy(struct flb_config *config,
                               struct flb_sched_request *req);
 int flb_sched_event_handler(struct flb_config *config, struct mk_event *event);
@@ -127,11 +148,18 @@ struct flb_sched_timer *flb_sched_timer_create(struct flb_sched *sched);
 int flb_sched_timer_destroy(struct flb_sched_timer *timer);
 
 int flb_sched_request_invalidate(struct flb_config *config, void *data);
+int flb_sched_request_expedite(struct flb_config *config);
 
 
 int flb_sched_timer_cb_create(struct flb_config *config, int ms,
                               void (*cb)(struct flb_config *, void *),
                               void *data);
+struct flb_sched_timer *flb_sched_timer_cb_add(struct flb_config *config,
+                                               int ms,
+                                               void (*cb)(struct flb_config *,
+                                                          void *),
+                                               void *data);
+int flb_sched_timer_cb_cancel(struct flb_config *config, void *data);
 int flb_sched_timer_cb_disable(struct flb_sched_timer *timer);
 int flb_sched_timer_cb_destroy(struct flb_sched_timer *timer);
 void flb_sched_timer_invalidate(struct flb_sched_timer *timer);
@@ -33,8 +33,22 @@
 
 #define FLB_SDS_HEADER_SIZE (sizeof(uint64_t) + sizeof(uint64_t))
 
+/*
+ * Short strings (tags, keys, header values) get at least FLB_SDS_SMALL
+ * bytes of room, so building them piece by piece does not realloc.
+ */
+#define FLB_SDS_SMALL       (48 - FLB_SDS_HEADER_SIZE - 1)
+
+/*
+ * Flag set in 'alloc' for strings carved from an arena: they grow inside
+ * the arena and are released with it, flb_sds_destroy() does nothing.
+ */
+#define FLB_SDS_ARENA       (1ULL << 63)
+
 typedef char *flb_sds_t;
 
+struct flb_arena;
+
 struct flb_sds {
     uint64_t len;        /* used */
     uint64_t alloc;      /* excluding the header and null terminator */
@@ -55,15 +69,12 @@ static inline void flb_sds_len_set(flb_sds_t s, size_t len)
 
 static inline size_t flb_sds_alloc(flb_sds_t s)
 {
-    return FLB_SDS_HEADER(s)->alloc;
+    return FLB_SDS_HEADER(s)->alloc & ~FLB_SDS_ARENA;
 }
 
 static inline size_t flb_sds_avail(flb_sds_t s)
 {
-    struct flb_sds *h;
-
-    h = FLB_SDS_HEADER(s);
-    return (h->alloc - h->len);
+    return (flb_sds_alloc(s) - flb_sds_len(s));
 }
 
 static inline int flb_sds_cmp(flb_sds_t s, char *str, int len)
@@ -78,10 +89,28 @@ static inline int flb_sds_cmp(flb_sds_t s, char *str, int len)
 flb_sds_t flb_sds_create(char *str);
 flb_sds_t flb_sds_create_len(char *str, int len);
 flb_sds_t flb_sds_create_size(size_t size);
+flb_sds_t flb_sds_create_arena(struct flb_arena *arena, char *str, int len);
+flb_sds_t flb_sds_create_size_arena(struct flb_arena *arena, size_t size);
 flb_sds_t flb_sds_cat(flb_sds_t s, char *str, int len);
 flb_sds_t flb_sds_increase(flb_sds_t s, size_t len);
 flb_sds_t flb_sds_copy(flb_sds_t s, char *str, int len);
 
 int flb_sds_destroy(flb_sds_t s);
 
+/*
+ * Make room for 'len' more bytes. The buffer at least doubles its size so
+ * appending many small pieces don't realloc for each one of them.
+ */
+static inline flb_sds_t flb_sds_reserve(flb_sds_t s, size_t len)
+{
+    size_t alloc;
+
+    if (flb_sds_avail(s) >= len) {
+        return s;
+    }
+
+    alloc = flb_sds_alloc(s);
+    return flb_sds_increase(s, len > alloc ? len : alloc);
+}
+
 #endif
@@ -0,0 +1,57 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef FLB_SLAB_H
+#define FLB_SLAB_H
+
+#include <monkey/mk_core.h>
+#include <fluent-bit/flb_info.h>
+#include <stddef.h>
+
+/*
+ * Slab cache: objects of a fixed size are carved from pages of 'per_page'
+ * objects and recycled through a free list, alloc and free are constant
+ * time and pages are only released when the cache is destroyed. Objects
+ * are aligned to a cache line and are not initialized.
+ *
+ * A cache is not thread safe, the core ones are only used by the engine
+ * thread.
+ */
+#define FLB_SLAB_ALIGN   64
+
+struct flb_slab {
+    char *name;
+    size_t size;                 /* object size, FLB_SLAB_ALIGN multiple */
+    int per_page;                /* objects per page                     */
+    int max;                     /* objects limit, zero for none         */
+
+    int objects;                 /* objects in the pages                 */
+    int used;                    /* objects given out                    */
+    int peak;                    /* highest 'used' value                 */
+    void *free;                  /* list of free objects                 */
+    struct mk_list pages;
+};
+
+struct flb_slab *flb_slab_create(char *name, size_t size, int per_page,
+                                 int max);
+void flb_slab_destroy(struct flb_slab *slab);
+void *flb_slab_alloc(struct flb_slab *slab);
+void flb_slab_free(struct flb_slab *slab, void *ptr);
+
+#endif
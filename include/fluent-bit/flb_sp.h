@@ -0,0 +1,194 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+
+#ifndef FLB_SP_H
+#define FLB_SP_H
+
+#include <fluent-bit/flb_info.h>
+
+#ifdef FLB_HAVE_STREAM_PROCESSOR
+
+#include <stdint.h>
+#include <time.h>
+#include <monkey/mk_core.h>
+#include <msgpack.h>
+
+/*
+ * Stream processor: continuous queries over the records that reach the
+ * outputs, e.g:
+ *
+ *   CREATE STREAM errors WITH (tag='app.errors') AS
+ *     SELECT host, COUNT(*) AS errors, AVG(latency) FROM TAG:'app.*'
+ *     WHERE status >= 500 WINDOW TUMBLING (10 SECOND) GROUP BY host;
+ *
+ * A query is compiled once (flb_sp_parser.c): the keys it uses become
+ * record accessors and the WHERE clause a tree evaluated right over the
+ * msgpack records of every chunk. The results are appended as new records
+ * with the tag of the stream through an emitter input instance.
+ */
+
+#define FLB_SP_MAX_GROUPS     10000    /* groups kept by a window        */
+
+/* Sources of a query: FROM TAG:'pattern' or FROM STREAM:input_name */
+#define FLB_SP_FROM_TAG       0
+#define FLB_SP_FROM_STREAM    1
+
+/* Functions of the selected keys */
+#define FLB_SP_KEY            0        /* plain key, no function         */
+#define FLB_SP_COUNT          1
+#define FLB_SP_SUM            2
+#define FLB_SP_AVG            3
+#define FLB_SP_MIN            4
+#define FLB_SP_MAX            5
+
+/* Literal values of the WHERE conditions */
+#define FLB_SP_NULL           0
+#define FLB_SP_BOOL           1
+#define FLB_SP_INT            2
+#define FLB_SP_FLOAT          3
+#define FLB_SP_STRING         4
+
+/* Expression nodes */
+#define FLB_SP_EXP_AND        0
+#define FLB_SP_EXP_OR         1
+#define FLB_SP_EXP_NOT        2
+#define FLB_SP_EXP_CMP        3        /* key <op> literal               */
+#define FLB_SP_EXP_NULL       4        /* key IS NULL                    */
+
+/* Comparison operators */
+#define FLB_SP_EQ             0
+#define FLB_SP_NEQ            1
+#define FLB_SP_LT             2
+#define FLB_SP_LTE            3
+#define FLB_SP_GT             4
+#define FLB_SP_GTE            5
+
+struct flb_record_accessor;
+struct flb_input_instance;
+struct flb_config;
+struct flb_hash;
+struct flb_time;
+
+struct flb_sp_value {
+    int type;
+    int64_t i;                          /* FLB_SP_INT, FLB_SP_BOOL   */
+    double f;                           /* FLB_SP_FLOAT              */
+    int len;                            /* FLB_SP_STRING             */
+    char *s;
+};
+
+struct flb_sp_exp {
+    int type;
+    int op;                             /* FLB_SP_EXP_CMP operator   */
+    struct flb_record_accessor *ra;     /* CMP and NULL nodes        */
+    struct flb_sp_value val;            /* CMP literal               */
+    struct flb_sp_exp *left;
+    struct flb_sp_exp *right;           /* AND/OR                    */
+};
+
+/* A selected key, or a GROUP BY key */
+struct flb_sp_cmd_key {
+    int func;                           /* FLB_SP_KEY, FLB_SP_COUNT..*/
+    char *name;                         /* key pattern, NULL: '*'    */
+    struct flb_record_accessor *ra;
+    int group;                          /* GROUP BY index of a key   */
+    int out_len;
+    char *out;                          /* name in the results       */
+    struct mk_list _head;
+};
+
+/* A compiled query */
+struct flb_sp_cmd {
+    char *stream_name;                  /* CREATE STREAM <name>      */
+    char *tag;                          /* WITH (tag='...')          */
+    int source_type;                    /* FLB_SP_FROM_*             */
+    char *source;
+    int select_all;                     /* SELECT *                  */
+    int keys_len;
+    struct mk_list keys;
+    int aggregate;                      /* functions or GROUP BY     */
+    struct flb_sp_exp *where;
+    int window;                         /* tumbling window, seconds  */
+    int group_by_len;
+    struct mk_list group_by;
+};
+
+/* Per group state of every selected key */
+struct flb_sp_agg {
+    uint64_t count;
+    int is_float;                       /* a float value was seen    */
+    int64_t isum;
+    double fsum;
+    double min;
+    double max;
+};
+
+struct flb_sp_group {
+    int key_len;
+    char *key;                          /* msgpack GROUP BY values   */
+    struct flb_sp_agg *aggs;
+    struct mk_list _head;
+};
+
+struct flb_sp_task {
+    char *name;
+    char *query;
+    struct flb_sp_cmd *cmd;
+
+    int tag_len;
+    char *tag;                          /* tag of the results        */
+    struct flb_input_instance *ins;     /* emitter of the results    */
+
+    /* groups of the current window, or chunk */
+    int groups;
+    uint64_t overflow;                  /* records over the groups   */
+    time_t window_start;
+    struct flb_hash *ht;
+    struct mk_list list;
+
+    /* scratch buffers: selected values, group keys and results */
+    msgpack_object **vals;
+    msgpack_sbuffer key_sbuf;
+    msgpack_packer key_pck;
+    msgpack_sbuffer out_sbuf;
+    msgpack_packer out_pck;
+
+    struct mk_list _head;
+};
+
+struct flb_sp_cmd *flb_sp_cmd_create(char *query);
+void flb_sp_cmd_destroy(struct flb_sp_cmd *cmd);
+
+struct flb_sp_task *flb_sp_task_create(struct flb_config *config,
+                                       char *name, char *query);
+void flb_sp_task_destroy(struct flb_sp_task *task);
+int flb_sp_task_process(struct flb_sp_task *task,
+                        struct flb_input_instance *in,
+                        char *tag, int tag_len,
+                        char *buf, size_t size);
+int flb_sp_task_flush(struct flb_sp_task *task, struct flb_time *tm);
+
+int flb_sp_do(struct flb_config *config, struct flb_input_instance *in,
+              char *tag, int tag_len, char *buf, size_t size);
+int flb_sp_start(struct flb_config *config);
+void flb_sp_exit(struct flb_config *config);
+
+#endif /* FLB_HAVE_STREAM_PROCESSOR */
+#endif
@@ -17,133 +17,145 @@
  *  limitations under the License.
  */
 
-#ifdef FLB_HAVE_STATS
-
 #ifndef FLB_STATS_H
 #define FLB_STATS_H
 
-#include <monkey/mk_core.h>
-#include <fluent-bit/flb_info.h>
-#include <fluent-bit/flb_pipe.h>
-#include <fluent-bit/flb_utils.h>
-#include <fluent-bit/flb_config.h>
-#include <fluent-bit/flb_output.h>
-
-#define FLB_STATS_SIZE          60  /* Datapoints buffer size */
-
-#define FLB_STATS_USERVER        1  /* Unix socket server        */
-#define FLB_STATS_USERVER_C      2  /* Unix socket server client */
-#define FLB_STATS_USERVER_PRINT  3  /* Write statistics          */
-#define FLB_STATS_INPUT_PLUGIN   4  /* Input plugin type         */
-#define FLB_STATS_OUTPUT_PLUGIN  5  /* Output plugin type        */
-
-#define FLB_STATS_USERVER_PATH   "/tmp/fluentbit.sock"
+#include <stdint.h>
+#include <stddef.h>
 
 /*
- * Unix Socket Server: the Stats interface launch a TCP unix socket
- * domain server, for every connected client the interface will dispatch
- * a summary of statistics in JSON format every five seconds. The following
- * structures holds the server info and the connection references:
+ * Shared memory statistics
+ * ========================
+ *
+ * When 'Stats_Path' is set, the engine maps a file (usually under /dev/shm)
+ * and publishes the counters of every input, filter and output instance
+ * into it once per second. External tools map the file read-only and read
+ * it at any time, nothing is sent to them and Fluent Bit does not know
+ * they exist.
+ *
+ * The layout is stable: fields are only appended in the reserved space and
+ * any incompatible change increments FLB_STATS_VERSION. All the integers
+ * are in the host byte order.
  *
- * struct flb_stats_userver:   linked from flb_stats, represents the userver
- *                             context;
+ *   offset 0     struct flb_stats_header   (64 bytes)
+ *   offset 64    struct flb_stats_entry    (128 bytes) x header.entries
  *
- * struct flb_stats_userver_c: represents a client connected to our userver.
+ * Every entry is protected by a sequence lock. The writer increments 'seq'
+ * (odd: update in progress), writes the values and increments it again.
+ * A reader copies the entry and retries when 'seq' was odd or changed
+ * during the copy, flb_stats_entry_read() implements it and can be copied
+ * as is by the readers.
  *
- * struct flb_stats_userver_t: the timer context to deliver data to clients.
+ * The value slots of an entry depend on its type:
+ *
+ *   type      values
+ *   input     records, bytes
+ *   filter    records_in, records_out, bytes_in, bytes_out,
+ *             drop_records, time_usec
+ *   output    proc_records, proc_bytes, errors, retries, retries_failed
+ *
+ * All of them are counters since the start of the process.
  */
 
-/* Unix server client context */
-struct flb_stats_userver_c {
-    struct mk_event event;
-    int fd;
-    struct mk_list _head;
-};
-
-/* Unix server timer: used to write data to clients */
-struct flb_stats_userver_t {
-    struct mk_event event;
-    int fd;
-};
-
-/* Unix server context */
-struct flb_stats_userver {
-    struct mk_event event;
-    int fd;
-
-    struct mk_list clients;
-    struct flb_stats_userver_t *timer;
+#define FLB_STATS_MAGIC          0x53424c46    /* "FLBS" */
+#define FLB_STATS_VERSION        1
+#define FLB_STATS_VALUES         8
+#define FLB_STATS_NAME_SIZE      32
+
+/* Entry types */
+#define FLB_STATS_INPUT          1
+#define FLB_STATS_FILTER         2
+#define FLB_STATS_OUTPUT         3
+
+/* Value slots: inputs */
+#define FLB_STATS_IN_RECORDS             0
+#define FLB_STATS_IN_BYTES               1
+
+/* Value slots: filters */
+#define FLB_STATS_FILTER_RECORDS_IN      0
+#define FLB_STATS_FILTER_RECORDS_OUT     1
+#define FLB_STATS_FILTER_BYTES_IN        2
+#define FLB_STATS_FILTER_BYTES_OUT       3
+#define FLB_STATS_FILTER_DROP_RECORDS    4
+#define FLB_STATS_FILTER_TIME            5
+
+/* Value slots: outputs */
+#define FLB_STATS_OUT_RECORDS            0
+#define FLB_STATS_OUT_BYTES              1
+#define FLB_STATS_OUT_ERRORS             2
+#define FLB_STATS_OUT_RETRIES            3
+#define FLB_STATS_OUT_RETRIES_FAILED     4
+
+struct flb_stats_header {
+    uint32_t magic;                    /* FLB_STATS_MAGIC               */
+    uint16_t version;                  /* FLB_STATS_VERSION             */
+    uint16_t header_size;              /* sizeof(struct flb_stats_header) */
+    uint32_t entry_size;               /* sizeof(struct flb_stats_entry)  */
+    uint32_t entries;                  /* number of entries             */
+    uint32_t pid;                      /* writer process                */
+    uint32_t reserved0;
+    uint64_t start_time;               /* unix time of the start        */
+    uint64_t update_time;              /* unix time of the last publish */
+    uint8_t  reserved[24];
 };
 
-struct flb_stats_datapoint {
-    time_t  time;
-    ssize_t events;
-    ssize_t bytes;
+struct flb_stats_entry {
+    uint32_t seq;                      /* sequence lock                 */
+    uint16_t type;                     /* FLB_STATS_INPUT, ...          */
+    uint16_t n_values;                 /* value slots in use            */
+    char name[FLB_STATS_NAME_SIZE];    /* instance name, e.g: tail.0    */
+    uint64_t values[FLB_STATS_VALUES];
+    uint64_t update_time;              /* unix time of the last publish */
+    uint8_t  reserved[16];
 };
 
-/* Statistics for input plugins */
-struct flb_stats_in_plugin {
-    struct mk_event event;
-    flb_pipefd_t pipe[2];
-    int n_data;
+/* Consistent copy of an entry, returns the number of value slots */
+static inline int flb_stats_entry_read(struct flb_stats_entry *entry,
+                                       struct flb_stats_entry *out)
+{
+    uint32_t seq;
+
+    do {
+        seq = __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            continue;
+        }
+        __builtin_memcpy(out, entry, sizeof(struct flb_stats_entry));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) ||
+             seq != __atomic_load_n(&entry->seq, __ATOMIC_RELAXED));
+
+    out->seq = seq;
+    return out->n_values;
+}
 
-    struct flb_stats_datapoint data[FLB_STATS_SIZE];
-    struct flb_input_plugin *plugin;
-    struct mk_list _head;
-};
+#ifdef FLB_HAVE_STATS
 
-/* Statistics for output plugins */
-struct flb_stats_out_plugin {
-    struct mk_event event;
-    flb_pipefd_t pipe[2];
-    int n_data;
-    struct flb_stats_datapoint data[FLB_STATS_SIZE];
-    struct flb_output_plugin *plugin;
-    struct mk_list _head;
-};
+struct flb_config;
 
 struct flb_stats {
-    struct mk_event event;
-
-    struct mk_event_loop *evl;
-    struct flb_config *config;
-    pthread_t worker_tid;
-
-    /* Unix server */
-    int ch_manager[2];
-    struct flb_stats_userver *userver;
-
-    /* References to components that can deliver statistics */
-    struct mk_list in_plugins;
-    struct mk_list out_plugins;
+    int fd;                            /* segment file                  */
+    char *path;
+    size_t size;
+    struct flb_stats_header *header;   /* mapped segment                */
+    struct flb_stats_entry *entries;
+    int timer_fd;                      /* publish timer, engine loop    */
 };
 
-/* Simple function to update the stats counters */
-static inline void flb_stats_update(int stats_fd,
-                                    ssize_t bytes, ssize_t events)
-{
-    struct flb_stats_datapoint d;
-
-    d.time   = time(NULL);
-    d.bytes  = bytes;
-    d.events = events;
-
-    write(stats_fd, &d, sizeof(struct flb_stats_datapoint));
-}
+struct flb_stats *flb_stats_segment_create(char *path, int entries);
+void flb_stats_segment_destroy(struct flb_stats *stats);
+void flb_stats_entry_write(struct flb_stats_entry *entry, uint64_t *values,
+                           int n, uint64_t now);
 
 int flb_stats_init(struct flb_config *config);
 int flb_stats_exit(struct flb_config *config);
 int flb_stats_collect(struct flb_config *config);
-int flb_stats_register(struct mk_event_loop *evl, struct flb_config *config);
 
-#endif /* FLB_STATS_H */
 #else
 
 /* A dummy define to avoid some macros conditions into the core */
 #define flb_stats_init(a) do{} while(0)
 #define flb_stats_exit(a) do{} while(0)
-#define flb_stats_update(a, b, c) do {} while(0)
-#define flb_stats_reset(a) do {} while(0)
-#define flb_stats_register(a, b) do{} while(0)
 
-#endif /* FLB_HAVE_STATS  */
+#endif /* FLB_HAVE_STATS */
+#endif /* FLB_STATS_H */
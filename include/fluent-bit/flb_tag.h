@@ -0,0 +1,75 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+
+#ifndef FLB_TAG_H
+#define FLB_TAG_H
+
+#include <monkey/mk_core.h>
+#include <fluent-bit/flb_info.h>
+#include <stdint.h>
+
+/*
+ * Interned tags: every distinct tag in the pipeline is stored once, with
+ * its length, hash and the routes of the outputs it matches. Dyntags and
+ * tasks hold a reference to the same entry, so two tags are the same if
+ * their pointers are equal. The dyntags are also linked to their tag, it
+ * works as the index to find the dyntag of an input instance by tag.
+ *
+ * The table is owned by the engine thread and it is not thread safe.
+ */
+#define FLB_TAG_TABLE_SIZE   256           /* initial buckets, power of 2 */
+
+struct flb_config;
+
+struct flb_tag {
+    int len;                     /* name length                         */
+    int refs;                    /* dyntags and tasks using it          */
+    uint32_t hash;
+    int routes_gen;              /* router generation of 'routes_mask'  */
+    uint64_t routes_mask;        /* outputs mask_id's matching the tag  */
+    struct mk_list dyntags;      /* dyntags of any input using the tag  */
+    struct mk_list _head;        /* link to the table bucket            */
+    char name[];                 /* NULL terminated                     */
+};
+
+struct flb_tag_table {
+    int size;                    /* buckets, power of 2                 */
+    int count;                   /* tags in the table                   */
+    struct mk_list *buckets;
+};
+
+int flb_tag_table_create(struct flb_config *config);
+void flb_tag_table_destroy(struct flb_config *config);
+
+struct flb_tag *flb_tag_lookup(struct flb_config *config,
+                               const char *name, int len);
+struct flb_tag *flb_tag_get(struct flb_config *config,
+                            const char *name, int len);
+void flb_tag_release(struct flb_config *config, struct flb_tag *tag);
+int flb_tag_routes(struct flb_config *config, struct flb_tag *tag,
+                   uint64_t *mask);
+
+static FLB_INLINE struct flb_tag *flb_tag_ref(struct flb_tag *tag)
+{
+    tag->refs++;
+    return tag;
+}
+
+#endif
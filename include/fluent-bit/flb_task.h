@@ -24,10 +24,19 @@
 #include <fluent-bit/flb_info.h>
 #include <fluent-bit/flb_buffer.h>
 #include <fluent-bit/flb_input.h>
+#include <fluent-bit/flb_tag.h>
+#include <fluent-bit/flb_chunk_index.h>
+
+#ifdef FLB_HAVE_METRICS
+#include <fluent-bit/flb_task_trace.h>
+#endif
+
+#include <time.h>
 
 /* Task status */
 #define FLB_TASK_NEW      0
 #define FLB_TASK_RUNNING  1
+#define FLB_TASK_FILTERING 2  /* waiting for the filters pool */
 
 /*
  * Macro helpers to determinate return value, task_id and thread_id. When an
@@ -53,6 +62,21 @@
 
 struct flb_task_route {
     struct flb_output_instance *out;
+    struct flb_task *task;              /* parent task                   */
+
+    /*
+     * If the output instance have its own flush interval, the route waits
+     * in the output 'pending' list until the next output flush. Routes of
+     * buffered chunks may wait in the output 'backlog_routes' list instead,
+     * routes over the output 'max_inflight' in its 'inflight_queue' and
+     * routes waiting for a coalesced flush in its 'coalesce' list (same
+     * link).
+     */
+    int pending;
+    int backlog;
+    int queued;
+    int coalesced;
+    struct mk_list _head_pending;      /* link to flb_output_instance   */
     struct mk_list _head;
 };
 
@@ -68,9 +92,21 @@ struct flb_task_retry {
     int attemps;                        /* number of attemps, default 1 */
     struct flb_output_instance *o_ins;  /* route that we are retrying   */
     struct flb_task *parent;            /* parent task reference        */
+    int backlog;                        /* waiting in the output backlog*/
+    struct mk_list _head_backlog;       /* link to o_ins backlog_retries*/
     struct mk_list _head;               /* link to parent task list     */
 };
 
+/*
+ * Retry state of a route saved by the buffer, it's restored when a chunk is
+ * loaded again so the backoff continues after a restart.
+ */
+struct flb_task_retry_state {
+    uint64_t mask_id;                   /* output instance mask_id      */
+    int attemps;                        /* number of attemps            */
+    time_t retry_at;                    /* next retry (unix time)       */
+};
+
 /* A task takes a buffer and sync input and output instances to handle it */
 struct flb_task {
     int id;                             /* task id                   */
@@ -81,14 +117,20 @@ struct flb_task {
     int n_threads;                      /* number number of threads  */
     int users;                          /* number of users (threads) */
     int destinations;                   /* number of output dests    */
-    char *tag;                          /* original tag              */
+    char *tag;                          /* original tag (interned)   */
+    int tag_len;                        /* tag length                */
+    struct flb_tag *itag;               /* interned tag reference    */
     char *buf;                          /* buffer                    */
     size_t size;                        /* buffer data size          */
+    struct flb_chunk_index index;       /* records index of buf      */
+    size_t mem_size;                    /* bytes held from mem budget */
+    struct flb_filter_job *filter_job;  /* filters pool job, if any  */
 #ifdef FLB_HAVE_BUFFERING
     int worker_id;                      /* Buffer worker that owns this task */
     int qchunk_id;                      /* qchunk id if it comes from buffer */
-    unsigned char hash_sha1[20];        /* SHA1(buf)                         */
-    char hash_hex[41];                  /* Hex string for hash_sha1          */
+    int chunk_mapped;                   /* buf is a mapped chunk file        */
+    uint64_t fs_routes;                 /* routes stored in the buffer chunk */
+    char hash_hex[41];                  /* buffer chunk id (hex string)      */
 #endif
     struct flb_input_dyntag *dt;        /* dyntag node (if applies)      */
     struct flb_input_instance *i_ins;   /* input instance                */
@@ -98,6 +140,11 @@ struct flb_task {
     struct mk_list _head;               /* link to input_instance        */
     struct flb_config *config;          /* parent flb config             */
 
+#ifdef FLB_HAVE_METRICS
+    uint64_t created;                   /* monotonic usec, task age      */
+    struct flb_task_trace *trace;       /* lifecycle trace, if sampled   */
+#endif
+
 #ifdef FLB_HAVE_FLUSH_PTHREADS
     pthread_mutex_t mutex_threads;
 #endif
@@ -120,10 +167,19 @@ struct flb_task *flb_task_create_direct(uint64_t ref_id,
                                         struct flb_config *config);
 
 void flb_task_destroy(struct flb_task *task);
+void flb_task_buf_update(struct flb_task *task, char *buf, size_t size,
+                         size_t alloc, struct flb_chunk_index *index);
+
+int flb_task_slabs_create(struct flb_config *config);
+void flb_task_slabs_destroy(struct flb_config *config);
+int flb_task_map_limit(struct flb_config *config);
+void flb_task_map_destroy(struct flb_config *config);
 
 struct flb_task_retry *flb_task_retry_create(struct flb_task *task,
                                              void *data);
 void flb_task_retry_destroy(struct flb_task_retry *retry);
 int flb_task_retry_clean(struct flb_task *task, void *data);
+int flb_task_retry_restore(struct flb_task *task,
+                           struct flb_task_retry_state *states, int n);
 
 #endif
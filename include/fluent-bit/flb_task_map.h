@@ -22,6 +22,12 @@
 
 #include <inttypes.h>
 
+/* Task IDs are packed in 14 bits of the engine events, see FLB_TASK_SET() */
+#define FLB_TASK_MAP_LIMIT    16384
+
+/* First allocation of the map, it doubles when it's full */
+#define FLB_TASK_MAP_INITIAL  256
+
 struct flb_task_map {
     void    *task;
 };
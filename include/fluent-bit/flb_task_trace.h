@@ -0,0 +1,99 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef FLB_TASK_TRACE_H
+#define FLB_TASK_TRACE_H
+
+#include <fluent-bit/flb_info.h>
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#define FLB_TASK_TRACE_EVENTS   32   /* events kept per task     */
+#define FLB_TASK_TRACE_RING     64   /* finished traces kept     */
+#define FLB_TASK_TRACE_NAME     32
+
+/* Lifecycle events */
+#define FLB_TASK_TRACE_CREATE   0    /* task created                  */
+#define FLB_TASK_TRACE_FLUSH    1    /* an output starts the flush    */
+#define FLB_TASK_TRACE_RETURN   2    /* the output returned           */
+#define FLB_TASK_TRACE_RETRY    3    /* a retry has been scheduled    */
+#define FLB_TASK_TRACE_DESTROY  4    /* task destroyed                */
+
+struct flb_task_trace_event {
+    int type;
+    int ret;                         /* RETURN: status, RETRY: attempt */
+    uint64_t usec;                   /* since the task creation        */
+    uint64_t value;                  /* RETURN: flush, RETRY: backoff  */
+    char output[FLB_TASK_TRACE_NAME];
+};
+
+/*
+ * Trace of a sampled task. The events are appended by the engine and by
+ * the output workers, when the task is destroyed the time is split in:
+ *
+ * - wait   : the routes waiting for a flush to start, from the creation
+ *            or from the end of a retry backoff.
+ * - output : the flushes, from their first resume to the return.
+ * - backoff: the retry delays requested to the scheduler.
+ *
+ * The routes run concurrently so the sum can be greater than the total.
+ */
+struct flb_task_trace {
+    uint64_t id;                     /* sequence of the sampled tasks  */
+    uint64_t created;                /* monotonic usec                 */
+    uint64_t total_usec;
+    uint64_t wait_usec;
+    uint64_t output_usec;
+    uint64_t backoff_usec;
+    int retries;
+    size_t size;
+    char *tag;
+    char input[FLB_TASK_TRACE_NAME];
+    int n_events;
+    int dropped;                     /* events beyond the limit        */
+    struct flb_task_trace_event events[FLB_TASK_TRACE_EVENTS];
+    pthread_mutex_t lock;
+};
+
+/* Sampling state and the ring of the last finished traces */
+struct flb_task_traces {
+    int sample;                      /* trace one task every 'sample'  */
+    uint64_t count;                  /* tasks seen                     */
+    uint64_t traced;                 /* traces started                 */
+    int head;
+    int size;
+    struct flb_task_trace *ring[FLB_TASK_TRACE_RING];
+    pthread_mutex_t lock;
+};
+
+struct flb_task_traces *flb_task_traces_create(int sample);
+void flb_task_traces_destroy(struct flb_task_traces *ctx);
+int flb_task_traces_dump(struct flb_task_traces *ctx,
+                         char **out_buf, size_t *out_size);
+
+struct flb_task_trace *flb_task_trace_start(struct flb_task_traces *ctx);
+void flb_task_trace_event(struct flb_task_trace *trace, int type,
+                          char *output, int ret, uint64_t value);
+void flb_task_trace_end(struct flb_task_traces *ctx,
+                        struct flb_task_trace *trace,
+                        char *tag, char *input, size_t size);
+
+#endif
@@ -24,6 +24,7 @@
 #include <fluent-bit/flb_mem.h>
 #include <fluent-bit/flb_macros.h>
 #include <fluent-bit/flb_log.h>
+#include <fluent-bit/flb_slab.h>
 
 #include <monkey/mk_core.h>
 
@@ -44,8 +45,11 @@ struct flb_thread {
     /* libco 'contexts' */
     cothread_t caller;
     cothread_t callee;
+    size_t stack_request;          /* requested stack size      */
+    size_t stack_size;             /* real size of callee stack */
 
     void *data;
+    struct flb_slab *slab;         /* owner cache, NULL if malloc'ed */
 
     /*
      * Callback invoked before the thread is destroyed. Used to release
@@ -55,10 +59,23 @@ struct flb_thread {
 };
 
 #define FLB_THREAD_STACK_SIZE      ((3 * PTHREAD_STACK_MIN) / 2)
+#define FLB_THREAD_STACK_MIN       8192
 #define FLB_THREAD_DATA(th)        (((char *) th) + sizeof(struct flb_thread))
 
+/*
+ * Max number of released co-routine stacks kept around to be reused by
+ * new threads, beyond this limit stacks are freed.
+ */
+#define FLB_THREAD_POOL_SIZE       256
+
 FLB_EXPORT pthread_key_t flb_thread_key;
 
+cothread_t flb_thread_stack_create(size_t size, void (*entry)(void),
+                                   size_t *out_size);
+void flb_thread_stack_release(cothread_t stack, size_t size,
+                              size_t real_size);
+void flb_thread_pool_exit();
+
 static FLB_INLINE void flb_thread_prepare()
 {
     pthread_key_create(&flb_thread_key, NULL);
@@ -66,7 +83,10 @@ static FLB_INLINE void flb_thread_prepare()
 
 static FLB_INLINE void flb_thread_yield(struct flb_thread *th, int ended)
 {
+    FLB_MEM_SCOPE_ENTER(FLB_MEM_SCOPE_KEEP);
+
     co_switch(th->caller);
+    FLB_MEM_SCOPE_LEAVE();
 }
 
 static FLB_INLINE void flb_thread_destroy(struct flb_thread *th)
@@ -80,8 +100,13 @@ static FLB_INLINE void flb_thread_destroy(struct flb_thread *th)
     VALGRIND_STACK_DEREGISTER(th->valgrind_stack_id);
 #endif
 
-    co_delete(th->callee);
-    flb_free(th);
+    flb_thread_stack_release(th->callee, th->stack_request, th->stack_size);
+    if (th->slab) {
+        flb_slab_free(th->slab, th);
+    }
+    else {
+        flb_free(th);
+    }
 }
 
 #define flb_thread_return(th) co_switch(th->caller)
@@ -100,8 +125,11 @@ static FLB_INLINE void flb_thread_resume(struct flb_thread *th)
      * the cleanup required.
      */
 
+    FLB_MEM_SCOPE_ENTER(FLB_MEM_SCOPE_KEEP);
+
     th->caller = co_active();
     co_switch(th->callee);
+    FLB_MEM_SCOPE_LEAVE();
 }
 
 static FLB_INLINE struct flb_thread *flb_thread_new(size_t data_size,
@@ -120,6 +148,10 @@ static FLB_INLINE struct flb_thread *flb_thread_new(size_t data_size,
 
     th = (struct flb_thread *) p;
     th->cb_destroy = NULL;
+    th->callee = NULL;
+    th->stack_request = 0;
+    th->stack_size = 0;
+    th->slab = NULL;
 
     flb_trace("[thread %p] created (custom data at %p, size=%lu",
               th, FLB_THREAD_DATA(th), data_size);
@@ -127,4 +159,26 @@ static FLB_INLINE struct flb_thread *flb_thread_new(size_t data_size,
     return th;
 }
 
+/* Same as flb_thread_new(), the thread and its data come from a cache */
+static FLB_INLINE struct flb_thread *flb_thread_slab_new(struct flb_slab *slab)
+{
+    struct flb_thread *th;
+
+    th = (struct flb_thread *) flb_slab_alloc(slab);
+    if (!th) {
+        flb_errno();
+        return NULL;
+    }
+
+    th->cb_destroy = NULL;
+    th->callee = NULL;
+    th->stack_request = 0;
+    th->stack_size = 0;
+    th->slab = slab;
+
+    flb_trace("[thread %p] created from cache %s", th, slab->name);
+
+    return th;
+}
+
 #endif
@@ -24,6 +24,7 @@
 #include <fluent-bit/flb_time_utils.h>
 
 #include <time.h>
+#include <stdint.h>
 #include <msgpack.h>
 struct flb_time {
     struct timespec tm;
@@ -72,11 +73,35 @@ static inline void flb_time_from_double(struct flb_time *dst, double d)
     dst->tm.tv_nsec = (d - dst->tm.tv_sec) * 1000000000L;
 }
 
+/* Monotonic clock in microseconds, to measure durations */
+static inline uint64_t flb_time_usec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1000000ULL) + (ts.tv_nsec / 1000);
+}
+
+/*
+ * Precision of the timestamps an input gives to its records ('time_precision'
+ * property). The clock read per record is a measurable cost at high rates,
+ * inputs that don't need sub-millisecond timestamps can use a coarse clock
+ * (kernel tick resolution, a few ms) or the time taken once per event loop
+ * iteration of the calling thread.
+ */
+#define FLB_TIME_PRECISE   0        /* clock read per record (default)  */
+#define FLB_TIME_COARSE    1        /* coarse clock read per record     */
+#define FLB_TIME_LOOP      2        /* once per event loop iteration    */
+
 int flb_time_get(struct flb_time *tm);
+int flb_time_get_precision(struct flb_time *tm, int precision);
+int flb_time_precision(char *str);
+void flb_time_loop_update();
 double flb_time_to_double(struct flb_time *tm);
 int flb_time_diff(struct flb_time *time1,
                   struct flb_time *time0, struct flb_time *result);
 int flb_time_append_to_msgpack(struct flb_time *tm, msgpack_packer *pk, int fmt);
+int flb_time_msgpack_to_time(struct flb_time *time, msgpack_object *obj);
 int flb_time_pop_from_msgpack(struct flb_time *time, msgpack_unpacked *upk,
                               msgpack_object **map);
 
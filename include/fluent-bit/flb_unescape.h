@@ -0,0 +1,58 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef FLB_UNESCAPE_H
+#define FLB_UNESCAPE_H
+
+#include <stddef.h>
+
+/*
+ * Unescape modes:
+ *
+ * - CONTROL: \n \t \r \b \f \v \a become control characters, the backslash
+ *   of any other sequence is removed.
+ * - KEEP_CONTROL: control sequences are kept escaped, the backslash of any
+ *   other sequence is removed.
+ * - UTF8: \x, \u, \U and octal sequences are converted to UTF-8, escaped
+ *   quotes, slashes and backslashes are kept. Non-ASCII bytes must be valid
+ *   UTF-8, invalid ones are dropped.
+ */
+#define FLB_UNESCAPE_CONTROL       0
+#define FLB_UNESCAPE_KEEP_CONTROL  1
+#define FLB_UNESCAPE_UTF8          2
+
+/*
+ * Number of leading bytes of 'buf' that flb_unescape() copies as they are.
+ * When it is 'len' the string can be used directly, no copy is needed. The
+ * buffer is checked 16 bytes at a time with SSE2 or NEON, otherwise eight
+ * bytes at a time.
+ */
+size_t flb_unescape_span(const char *buf, size_t len, int mode);
+size_t flb_unescape_span_sw(const char *buf, size_t len, int mode);
+
+/* Returns FLB_TRUE if 'buf' is valid UTF-8 */
+int flb_utf8_valid(const char *buf, size_t len);
+
+/*
+ * Unescape 'len' bytes of 'in' into 'out', which must have room for
+ * 'len' + 1 bytes. The result is NULL terminated, its length is returned.
+ */
+size_t flb_unescape(const char *in, size_t len, char *out, int mode);
+
+#endif
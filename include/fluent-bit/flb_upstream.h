@@ -26,10 +26,23 @@
 #include <fluent-bit/flb_info.h>
 #include <fluent-bit/flb_socket.h>
 #include <fluent-bit/flb_config.h>
+#include <fluent-bit/flb_dns.h>
 
 #ifdef FLB_HAVE_TLS
 #include <mbedtls/net.h>
+#include <mbedtls/ssl.h>
 #endif
+
+#include <time.h>
+
+/* Keepalive defaults */
+#define FLB_UPSTREAM_KA_IDLE_TIMEOUT   30    /* seconds */
+#define FLB_UPSTREAM_KA_MAX_RECYCLE  2000    /* times a conn can be reused */
+
+/* Warm-up defaults */
+#define FLB_UPSTREAM_WARM_INTERVAL   2000    /* health check, milliseconds */
+#define FLB_UPSTREAM_WARM_TIMEOUT      10    /* connect timeout, seconds   */
+
 /*
  * Upstream creation FLAGS set by Fluent Bit sub-components
  * ========================================================
@@ -51,6 +64,9 @@ struct flb_upstream {
 
     int n_connections;
 
+    /* Addresses of 'tcp_host', new connections rotate across them */
+    struct flb_dns_cache dns;
+
     /*
      * An upstream handler may keep open up to 'max_connections' of
      * TCP connections. A value minor or equal to zero means it will
@@ -72,14 +88,56 @@ struct flb_upstream {
      */
     struct mk_list busy_queue;
 
+    /*
+     * Keepalive: when enabled, a released connection is not closed but
+     * moved back to the 'av_queue' so it can be recycled by the next
+     * request. An idle connection is not re-used if it has been sitting
+     * in the queue for more than 'ka_idle_timeout' seconds, and a single
+     * connection cannot be recycled more than 'ka_max_recycle' times
+     * (zero or less means no limit).
+     */
+    int ka_enabled;
+    int ka_idle_timeout;
+    int ka_max_recycle;
+
+    /*
+     * Warm-up: with keepalive enabled, the upstream can ask to always have
+     * 'warm_min_idle' connections ready in the 'av_queue'. They are checked
+     * by a scheduler timer and (re)connected by the warm-up thread, so a
+     * flush after an idle period doesn't pay the connect and TLS handshake.
+     */
+    int warm_min_idle;
+    int warm_queued;                  /* waiting for the warm-up thread */
+    struct mk_list _head_warm;        /* link to flb_upstream_warm      */
+    struct mk_list _head_warm_queue;  /* link to the warm-up queue      */
+
+    /*
+     * HTTP/2: the requests of the HTTP clients are streams multiplexed on
+     * a single connection per event loop, see flb_http2.c.
+     */
+    int http2;
+    struct mk_list h2_sessions;       /* list of flb_http2_session      */
+
 #ifdef FLB_HAVE_TLS
     /* context with mbedTLS data to handle certificates and keys */
     struct flb_tls *tls;
+
+    /*
+     * Session of the last full TLS handshake with the server, new
+     * connections offer it so they can do an abbreviated handshake
+     * (session ID or ticket) instead of a full one.
+     */
+    int tls_resume_set;
+    mbedtls_ssl_session tls_resume;
 #endif
 
-#ifdef FLB_HAVE_FLUSH_PTHREADS
+    /*
+     * Connections queues can be accessed by the engine and by the output
+     * workers threads at the same time, the mutex protects them.
+     */
     pthread_mutex_t mutex_queue;
-#endif
+
+    struct flb_config *config;
 };
 
 /* Upstream TCP connection */
@@ -87,9 +145,17 @@ struct flb_upstream_conn {
     struct mk_event event;
     struct flb_thread *thread;
 
+    /* Event loop where the connection events are registered */
+    struct mk_event_loop *evl;
+
     flb_sockfd_t fd;
     int connect_count;
 
+    /* Keepalive */
+    int recycle;          /* can be returned to the pool on release ?  */
+    int ka_count;         /* number of times the connection was reused */
+    time_t ts_available;  /* time when it was moved to the 'av_queue'  */
+
     /* Upstream parent */
     struct flb_upstream *u;
 
@@ -100,6 +166,9 @@ struct flb_upstream_conn {
      */
     struct mk_list _head;
 
+    /* HTTP/2 session the connection belongs to, if any */
+    void *h2;
+
 #ifdef FLB_HAVE_TLS
     /* Each TCP connections using TLS needs a session */
     struct flb_tls_session *tls_session;
@@ -108,12 +177,36 @@ struct flb_upstream_conn {
 
 };
 
+/*
+ * Warm-up service: upstreams with 'warm_min_idle' set are linked here. The
+ * scheduler timer runs in the engine thread and queues the upstreams
+ * missing idle connections, the warm-up thread connects them.
+ */
+struct flb_upstream_warm {
+    int stop;
+    int started;
+    pthread_t tid;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct mk_list upstreams;         /* upstreams with warm-up enabled */
+    struct mk_list queue;             /* upstreams to be warmed up      */
+    struct flb_upstream *current;     /* upstream being connected       */
+    struct flb_config *config;
+};
+
 struct flb_upstream *flb_upstream_create(struct flb_config *config,
                                          char *host, int port, int flags,
                                          void *tls);
 int flb_upstream_destroy(struct flb_upstream *u);
+void flb_upstream_set_keepalive(struct flb_upstream *u, int enabled,
+                                int idle_timeout, int max_recycle);
+int flb_upstream_set_warm(struct flb_upstream *u, int min_idle);
+int flb_upstream_set_http2(struct flb_upstream *u, int enabled);
+int flb_upstream_warm_start(struct flb_config *config);
+void flb_upstream_warm_exit(struct flb_config *config);
 
 struct flb_upstream_conn *flb_upstream_conn_get(struct flb_upstream *u);
 int flb_upstream_conn_release(struct flb_upstream_conn *u_conn);
+int flb_upstream_conn_recycle(struct flb_upstream_conn *u_conn, int val);
 
 #endif
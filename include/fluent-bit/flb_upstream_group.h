@@ -0,0 +1,124 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef FLB_UPSTREAM_GROUP_H
+#define FLB_UPSTREAM_GROUP_H
+
+#include <monkey/mk_core.h>
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_config.h>
+#include <fluent-bit/flb_upstream.h>
+
+#ifdef FLB_HAVE_TLS
+#include <fluent-bit/flb_io_tls.h>
+#endif
+
+#include <pthread.h>
+#include <time.h>
+
+/* Node selection */
+#define FLB_UPSTREAM_GROUP_ROUND_ROBIN     0
+#define FLB_UPSTREAM_GROUP_LEAST_INFLIGHT  1
+#define FLB_UPSTREAM_GROUP_WEIGHTED        2
+
+/* Health defaults */
+#define FLB_UPSTREAM_GROUP_MAX_FAILS       3    /* consecutive failures */
+#define FLB_UPSTREAM_GROUP_EJECT_TIME     30    /* seconds */
+
+/* A node of the group, every node has its own connections pool */
+struct flb_upstream_node {
+    int weight;
+    int inflight;              /* requests in progress */
+    int fails;                 /* consecutive failures */
+    int current;               /* smooth weighted round robin state */
+    int down;                  /* last heartbeat failed */
+    time_t ejected_until;      /* not selected until then */
+    char *name;                /* node name, upstream files only */
+    struct mk_list properties; /* [NODE] properties, flb_config_prop */
+    void *data;                /* plugin context for the node */
+    struct flb_upstream *u;
+
+#ifdef FLB_HAVE_TLS
+    struct flb_tls tls;        /* TLS context set in the [NODE] section */
+#endif
+
+    struct mk_list _head;
+};
+
+/*
+ * Upstream group: a list of nodes serving the same destination. Every
+ * request takes a node with flb_upstream_group_node_get() and gives it
+ * back with flb_upstream_group_node_release(), telling if the node
+ * failed. A node that fails 'max_fails' times in a row is left out for
+ * 'eject_time' seconds.
+ */
+struct flb_upstream_group {
+    int mode;
+    int max_fails;
+    int eject_time;
+    int nodes_count;
+    char *name;                        /* upstream files only */
+    struct flb_upstream_node *last;    /* round robin cursor */
+    struct mk_list nodes;
+
+    /*
+     * Heartbeat: a thread connects to every node each 'hb_interval'
+     * seconds, a node that does not accept the connection is marked as
+     * down and not selected until a later heartbeat succeeds.
+     */
+    int hb_interval;
+    int hb_running;
+    pthread_t hb_thread;
+    pthread_cond_t hb_cond;
+
+    /* Nodes are picked by the engine and by the output workers */
+    pthread_mutex_t mutex;
+};
+
+struct flb_upstream_group *flb_upstream_group_create(int mode);
+void flb_upstream_group_destroy(struct flb_upstream_group *g);
+int flb_upstream_group_mode(char *str);
+
+struct flb_upstream_node *flb_upstream_group_add(struct flb_upstream_group *g,
+                                                 struct flb_config *config,
+                                                 char *host, int port,
+                                                 int weight, int flags,
+                                                 void *tls);
+int flb_upstream_group_add_list(struct flb_upstream_group *g,
+                                struct flb_config *config,
+                                char *list, int default_port,
+                                int flags, void *tls);
+
+struct flb_upstream_group *flb_upstream_group_conf_file(struct flb_config *config,
+                                                       char *file,
+                                                       int default_port,
+                                                       int flags, void *tls);
+char *flb_upstream_node_get_property(char *key,
+                                     struct flb_upstream_node *node);
+
+int flb_upstream_group_heartbeat_start(struct flb_upstream_group *g,
+                                       int interval);
+
+struct flb_upstream_node *flb_upstream_group_node_get(struct flb_upstream_group *g);
+void flb_upstream_group_node_release(struct flb_upstream_group *g,
+                                     struct flb_upstream_node *node,
+                                     int failed);
+
+#endif
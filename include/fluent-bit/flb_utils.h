@@ -23,6 +23,7 @@
 #include <fluent-bit/flb_info.h>
 #include <fluent-bit/flb_pipe.h>
 #include <fluent-bit/flb_config.h>
+#include <fluent-bit/flb_sds.h>
 
 struct flb_split_entry {
     char *value;
@@ -54,6 +55,7 @@ void flb_utils_bytes_to_human_readable_size(size_t bytes,
 int flb_utils_time_split(char *time, int *sec, long *nsec);
 int flb_utils_write_str(char *buf, int *off, size_t size,
                         char *str, size_t str_len);
+int flb_utils_write_str_sds(flb_sds_t *s, char *str, size_t str_len);
 int flb_utils_write_str_buf(char *str, size_t str_len, char **out, size_t *out_size);
 
 #endif
@@ -0,0 +1,54 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef FLB_VRING_H
+#define FLB_VRING_H
+
+#include <stddef.h>
+
+/*
+ * Virtual ring buffer: the same memory pages are mapped twice, one after
+ * the other, so any window of up to 'size' bytes starting inside the ring
+ * is contiguous. Consuming data from the front only moves the 'head', the
+ * pending bytes are never copied.
+ *
+ * If the double mapping is not available the ring is a plain heap buffer
+ * and consumed data is moved to the front (mirrored == FLB_FALSE).
+ *
+ * The number of bytes stored is tracked by the caller.
+ */
+struct flb_vring {
+    char *data;        /* base address            */
+    size_t size;       /* ring size (page aligned) */
+    size_t head;       /* start of pending data   */
+    int mirrored;      /* double mapped ?         */
+};
+
+int flb_vring_create(struct flb_vring *ring, size_t size);
+void flb_vring_destroy(struct flb_vring *ring);
+int flb_vring_resize(struct flb_vring *ring, size_t size, size_t len);
+void flb_vring_consume(struct flb_vring *ring, size_t bytes, size_t len);
+
+/* Start of the pending data, 'size' bytes can be accessed from here */
+static inline char *flb_vring_start(struct flb_vring *ring)
+{
+    return ring->data + ring->head;
+}
+
+#endif
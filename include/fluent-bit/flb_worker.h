@@ -21,9 +21,25 @@
 #define FLB_WORKER_H
 
 #include <fluent-bit/flb_config.h>
+#include <msgpack.h>
+#include <pthread.h>
 
 struct flb_config;
 
+/* Highest CPU number accepted in an affinity list */
+#define FLB_WORKER_CPUS_MAX   1024
+
+/*
+ * Set of CPUs a thread can run on, parsed from a list like '0-3,8'. Memory
+ * is allocated on the NUMA node of the CPU that touches it first, so the
+ * buffers and arenas a pinned thread creates for itself are node local.
+ */
+struct flb_worker_cpus {
+    int count;                                  /* CPUs in the set      */
+    char *list;                                 /* original list        */
+    unsigned char mask[FLB_WORKER_CPUS_MAX / 8];
+};
+
 struct flb_worker {
     struct mk_event event;
 
@@ -32,8 +48,11 @@ struct flb_worker {
     void *data;                /* opaque data */
     pthread_t tid;             /* thread ID   */
 
-    /* Logging */
-    int log[2];
+    /* Placement and reporting */
+    char role[32];             /* e.g: 'log', 'output:http.0'  */
+    int os_tid;                /* kernel thread ID             */
+    int running;
+    struct flb_worker_cpus *cpus;
 
     /* Runtime context */
     void *config;
@@ -46,8 +65,18 @@ int flb_worker_init(struct flb_config *config);
 struct flb_worker *flb_worker_get();
 int flb_worker_create(void (*func) (void *), void *arg, pthread_t *tid,
                       struct flb_config *config);
+int flb_worker_create_role(void (*func) (void *), void *arg, pthread_t *tid,
+                           const char *role, struct flb_worker_cpus *cpus,
+                           struct flb_config *config);
 struct flb_worker *flb_worker_lookup(pthread_t tid, struct flb_config *config);
+void flb_worker_run_all(void (*func) (void *), void **args, int n, int max,
+                        struct flb_config *config);
 int flb_worker_exit(struct flb_config *config);
 int flb_worker_log_level(struct flb_worker *worker);
+void flb_worker_pack(struct flb_config *config, msgpack_packer *mp_pck);
+
+struct flb_worker_cpus *flb_worker_cpus_create(const char *list);
+void flb_worker_cpus_destroy(struct flb_worker_cpus *cpus);
+int flb_worker_cpus_apply(struct flb_worker_cpus *cpus);
 
 #endif
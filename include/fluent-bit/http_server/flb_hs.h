@@ -24,24 +24,9 @@
 #include <fluent-bit/flb_config.h>
 #include <monkey/mk_lib.h>
 
-/*
- * HTTP buffers that contains certain cached data to be used
- * by end-points.
- */
-struct flb_hs_buf {
-    int users;
-    char *data;
-    size_t size;
-
-    char *raw_data;
-    size_t raw_size;
-    struct mk_list _head;
-};
-
 struct flb_hs {
     mk_ctx_t *ctx;             /* Monkey HTTP Context */
     int vid;                   /* Virtual Host ID     */
-    int qid;                   /* Message Queue ID    */
 
     pthread_t tid;             /* Server Thread */
     struct flb_config *config; /* Fluent Bit context */
@@ -49,11 +34,16 @@ struct flb_hs {
     /* end-point: root */
     size_t ep_root_size;
     char *ep_root_buf;
+
+    /* end-point: health, output counters at the start of the windows */
+    pthread_mutex_t hc_lock;
+    time_t hc_window;
+    uint64_t hc_errors[2];
+    uint64_t hc_retry_failures[2];
 };
 
 struct flb_hs *flb_hs_create(char *listen, char *tcp_port,
                              struct flb_config *config);
-int flb_hs_push_metrics(struct flb_hs *hs, void *data, size_t size);
 int flb_hs_destroy(struct flb_hs *ctx);
 int flb_hs_start(struct flb_hs *hs);
 
@@ -0,0 +1,130 @@
+/*
+  libco.aarch64
+  license: public domain
+*/
+
+/*
+  AAPCS64: the context switch saves the callee-saved registers only,
+  x19-x28, the frame pointer (x29), the link register (x30), sp and the
+  low halves of v8-v15 (d8-d15). The context sits at the bottom of the
+  memory block and the stack grows down from its top, like amd64.c.
+*/
+
+#define LIBCO_C
+#include "libco.h"
+#include "settings.h"
+
+#include <stdlib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+  context layout (8 bytes words):
+    [0] sp  [1] x30  [2..11] x19-x28  [12] x29  [13] unused  [14..21] d8-d15
+  a new context starts at co_entrypoint() with the entry point in x19
+*/
+static thread_local unsigned long co_active_buffer[64];
+static thread_local cothread_t co_active_handle = 0;
+
+#if defined(__APPLE__)
+  #define CO_SYMBOL(name) "_" #name
+  #define CO_TYPE(name)
+  #define CO_SIZE(name)
+#else
+  #define CO_SYMBOL(name) #name
+  #define CO_TYPE(name) ".type " #name ", %function\n"
+  #define CO_SIZE(name) ".size " #name ", .-" #name "\n"
+#endif
+
+/* x0: context to resume, x1: context to save */
+void flb_co_swap_aarch64(cothread_t, cothread_t);
+
+__asm__(
+  ".text\n"
+  ".p2align 4\n"
+  ".globl " CO_SYMBOL(flb_co_swap_aarch64) "\n"
+#if !defined(__APPLE__)
+  ".hidden flb_co_swap_aarch64\n"
+#endif
+  CO_TYPE(flb_co_swap_aarch64)
+  CO_SYMBOL(flb_co_swap_aarch64) ":\n"
+  "  mov  x16, sp\n"
+  "  stp  x16, x30, [x1]\n"
+  "  ldp  x16, x30, [x0]\n"
+  "  mov  sp, x16\n"
+  "  stp  x19, x20, [x1, #16]\n"
+  "  ldp  x19, x20, [x0, #16]\n"
+  "  stp  x21, x22, [x1, #32]\n"
+  "  ldp  x21, x22, [x0, #32]\n"
+  "  stp  x23, x24, [x1, #48]\n"
+  "  ldp  x23, x24, [x0, #48]\n"
+  "  stp  x25, x26, [x1, #64]\n"
+  "  ldp  x25, x26, [x0, #64]\n"
+  "  stp  x27, x28, [x1, #80]\n"
+  "  ldp  x27, x28, [x0, #80]\n"
+  "  str  x29, [x1, #96]\n"
+  "  ldr  x29, [x0, #96]\n"
+  "  stp  d8,  d9,  [x1, #112]\n"
+  "  ldp  d8,  d9,  [x0, #112]\n"
+  "  stp  d10, d11, [x1, #128]\n"
+  "  ldp  d10, d11, [x0, #128]\n"
+  "  stp  d12, d13, [x1, #144]\n"
+  "  ldp  d12, d13, [x0, #144]\n"
+  "  stp  d14, d15, [x1, #160]\n"
+  "  ldp  d14, d15, [x0, #160]\n"
+  "  br   x30\n"
+  CO_SIZE(flb_co_swap_aarch64)
+);
+
+/* first switch into a context: x0 still holds its handle */
+static void co_entrypoint(cothread_t handle) {
+  unsigned long* buffer = (unsigned long*)handle;
+  void (*entrypoint)(void) = (void (*)(void))buffer[2];
+  entrypoint();
+  abort();  /* called only if cothread_t entrypoint returns */
+}
+
+cothread_t co_active() {
+  if(!co_active_handle) co_active_handle = &co_active_buffer;
+  return co_active_handle;
+}
+
+cothread_t co_derive(void *memory, unsigned int size,
+                     void (*entrypoint)(void)) {
+  unsigned long* handle;
+  if(!co_active_handle) co_active_handle = &co_active_buffer;
+
+  if((handle = (unsigned long*)memory)) {
+    unsigned long* p = (unsigned long*)((unsigned char*)handle + (size & ~15));
+    handle[0]  = (unsigned long)p;               /* sp, 16 bytes aligned */
+    handle[1]  = (unsigned long)co_entrypoint;   /* x30                  */
+    handle[2]  = (unsigned long)entrypoint;      /* x19                  */
+    handle[12] = 0;                              /* x29, end of frames   */
+  }
+
+  return handle;
+}
+
+cothread_t co_create(unsigned int size, void (*entrypoint)(void),
+                     size_t *out_size) {
+  size += 512;  /* allocate additional space for storage */
+  size &= ~15;  /* align stack to 16-byte boundary */
+  *out_size = size;
+
+  return co_derive(malloc(size), size, entrypoint);
+}
+
+void co_delete(cothread_t handle) {
+  free(handle);
+}
+
+void co_switch(cothread_t handle) {
+  cothread_t co_previous_handle = co_active_handle;
+  flb_co_swap_aarch64(co_active_handle = handle, co_previous_handle);
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -39,6 +39,15 @@ cothread_t co_create(unsigned int heapsize, void (*coentry)(void),
   return (cothread_t)CreateFiber(heapsize, co_thunk, (void*)coentry);
 }
 
+/* contexts owning more than a plain memory block can't be derived */
+cothread_t co_derive(void *memory, unsigned int size,
+                     void (*entrypoint)(void)) {
+  (void) memory;
+  (void) size;
+  (void) entrypoint;
+  return 0;
+}
+
 void co_delete(cothread_t cothread) {
   DeleteFiber(cothread);
 }
@@ -17,8 +17,10 @@ typedef void* cothread_t;
 
 cothread_t co_active();
 cothread_t co_create(unsigned int, void (*)(void), size_t *);
+cothread_t co_derive(void *, unsigned int, void (*)(void));
 void co_delete(cothread_t);
 void co_switch(cothread_t);
+const char *co_method();  /* name of the backend in use */
 
 #ifdef __cplusplus
 }
@@ -84,6 +84,15 @@ cothread_t co_create(unsigned int size, void (*coentry)(void),
   return (cothread_t)thread;
 }
 
+/* contexts owning more than a plain memory block can't be derived */
+cothread_t co_derive(void *memory, unsigned int size,
+                     void (*entrypoint)(void)) {
+  (void) memory;
+  (void) size;
+  (void) entrypoint;
+  return 0;
+}
+
 void co_delete(cothread_t cothread) {
   if(cothread) {
     if(((cothread_struct*)cothread)->stack) {
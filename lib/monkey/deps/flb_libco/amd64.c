@@ -126,8 +126,8 @@ cothread_t co_active() {
   return co_active_handle;
 }
 
-cothread_t co_create(unsigned int size, void (*entrypoint)(void),
-                     size_t *out_size){
+cothread_t co_derive(void *memory, unsigned int size,
+                     void (*entrypoint)(void)) {
   cothread_t handle;
   if(!co_swap) {
     co_init();
@@ -135,11 +135,8 @@ cothread_t co_create(unsigned int size, void (*entrypoint)(void),
   }
 
   if(!co_active_handle) co_active_handle = &co_active_buffer;
-  size += 512;  /* allocate additional space for storage */
-  size &= ~15;  /* align stack to 16-byte boundary */
-  *out_size = size;
 
-  if((handle = (cothread_t)malloc(size))) {
+  if((handle = (cothread_t)memory)) {
     long long *p = (long long*)((char*)handle + size);  /* seek to top of stack */
     *--p = (long long)crash;                            /* crash if entrypoint returns */
     *--p = (long long)entrypoint;                       /* start of function */
@@ -149,6 +146,15 @@ cothread_t co_create(unsigned int size, void (*entrypoint)(void),
   return handle;
 }
 
+cothread_t co_create(unsigned int size, void (*entrypoint)(void),
+                     size_t *out_size){
+  size += 512;  /* allocate additional space for storage */
+  size &= ~15;  /* align stack to 16-byte boundary */
+  *out_size = size;
+
+  return co_derive(malloc(size), size, entrypoint);
+}
+
 void co_delete(cothread_t handle) {
   free(handle);
 }
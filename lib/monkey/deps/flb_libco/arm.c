@@ -46,19 +46,16 @@ cothread_t co_active() {
   return co_active_handle;
 }
 
-cothread_t co_create(unsigned int size, void (*entrypoint)(void),
-                     size_t *out_size) {
+cothread_t co_derive(void *memory, unsigned int size,
+                     void (*entrypoint)(void)) {
   unsigned long* handle = 0;
   if(!co_swap) {
     co_init();
     co_swap = (void (*)(cothread_t, cothread_t))co_swap_function;
   }
   if(!co_active_handle) co_active_handle = &co_active_buffer;
-  size += 256;
-  size &= ~15;
-  *out_size = size;
 
-  if(handle = (unsigned long*)malloc(size)) {
+  if(handle = (unsigned long*)memory) {
     unsigned long* p = (unsigned long*)((unsigned char*)handle + size);
     handle[8] = (unsigned long)p;
     handle[9] = (unsigned long)entrypoint;
@@ -67,6 +64,15 @@ cothread_t co_create(unsigned int size, void (*entrypoint)(void),
   return handle;
 }
 
+cothread_t co_create(unsigned int size, void (*entrypoint)(void),
+                     size_t *out_size) {
+  size += 256;
+  size &= ~15;
+  *out_size = size;
+
+  return co_derive(malloc(size), size, entrypoint);
+}
+
 void co_delete(cothread_t handle) {
   free(handle);
 }
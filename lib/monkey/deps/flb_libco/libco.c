@@ -7,30 +7,54 @@
   #pragma clang diagnostic ignored "-Wparentheses"
 #endif
 
-#if defined(__clang__) || defined(__GNUC__)
+/*
+  LIBCO_FORCE_SJLJ / LIBCO_FORCE_UCONTEXT select a portable backend on any
+  processor, e.g. to compare them with the assembly one
+*/
+#if defined(LIBCO_FORCE_UCONTEXT)
+  #define LIBCO_METHOD "ucontext"
+  #include "ucontext.c"
+#elif defined(LIBCO_FORCE_SJLJ)
+  #define LIBCO_METHOD "sjlj"
+  #include "sjlj.c"
+#elif defined(__clang__) || defined(__GNUC__)
   #if defined(__i386__)
+    #define LIBCO_METHOD "x86"
     #include "x86.c"
   #elif defined(__amd64__)
+    #define LIBCO_METHOD "amd64"
     #include "amd64.c"
   #elif defined(__arm__)
+    #define LIBCO_METHOD "arm"
     #include "arm.c"
   #elif defined(__aarch64__)
-    #include "sjlj.c"
+    #define LIBCO_METHOD "aarch64"
+    #include "aarch64.c"
   #elif defined(_ARCH_PPC)
+    #define LIBCO_METHOD "ppc"
     #include "ppc.c"
   #elif defined(_WIN32)
+    #define LIBCO_METHOD "fiber"
     #include "fiber.c"
   #else
+    #define LIBCO_METHOD "sjlj"
     #include "sjlj.c"
   #endif
 #elif defined(_MSC_VER)
   #if defined(_M_IX86)
+    #define LIBCO_METHOD "x86"
     #include "x86.c"
   #elif defined(_M_AMD64)
+    #define LIBCO_METHOD "amd64"
     #include "amd64.c"
   #else
+    #define LIBCO_METHOD "fiber"
     #include "fiber.c"
   #endif
 #else
   #error "libco: unsupported processor, compiler or operating system"
 #endif
+
+const char *co_method() {
+  return LIBCO_METHOD;
+}
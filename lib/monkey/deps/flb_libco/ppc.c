@@ -279,7 +279,8 @@ static uint32_t* co_create_(unsigned size, uintptr_t entry) {
   return t;
 }
 
-cothread_t co_create(unsigned int size, void (*entry_)(void)) {
+cothread_t co_create(unsigned int size, void (*entry_)(void),
+                     size_t *out_size) {
   uintptr_t entry = (uintptr_t)entry_;
   uint32_t* t = 0;
 
@@ -289,6 +290,7 @@ cothread_t co_create(unsigned int size, void (*entry_)(void)) {
     t = co_create_(size, entry);
   }
 
+  *out_size = size;
   if(t) {
     uintptr_t sp;
     int shift;
@@ -329,6 +331,15 @@ cothread_t co_create(unsigned int size, void (*entry_)(void)) {
   return t;
 }
 
+/* contexts owning more than a plain memory block can't be derived */
+cothread_t co_derive(void *memory, unsigned int size,
+                     void (*entrypoint)(void)) {
+  (void) memory;
+  (void) size;
+  (void) entrypoint;
+  return 0;
+}
+
 void co_delete(cothread_t t) {
   free(t);
 }
@@ -22,6 +22,7 @@
 #define _BSD_SOURCE
 #include <stdlib.h>
 #include <ucontext.h>
+#include "settings.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -53,6 +54,15 @@ cothread_t co_create(unsigned int heapsize, void (*coentry)(void),
   return (cothread_t)thread;
 }
 
+/* contexts owning more than a plain memory block can't be derived */
+cothread_t co_derive(void *memory, unsigned int size,
+                     void (*entrypoint)(void)) {
+  (void) memory;
+  (void) size;
+  (void) entrypoint;
+  return 0;
+}
+
 void co_delete(cothread_t cothread) {
   if(cothread) {
     if(((ucontext_t*)cothread)->uc_stack.ss_sp) { free(((ucontext_t*)cothread)->uc_stack.ss_sp); }
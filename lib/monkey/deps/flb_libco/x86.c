@@ -80,19 +80,16 @@ cothread_t co_active() {
   return co_active_handle;
 }
 
-cothread_t co_create(unsigned int size, void (*entrypoint)(void),
-                     size_t *out_size) {
+cothread_t co_derive(void *memory, unsigned int size,
+                     void (*entrypoint)(void)) {
   cothread_t handle;
   if(!co_swap) {
     co_init();
     co_swap = (void (fastcall*)(cothread_t, cothread_t))co_swap_function;
   }
   if(!co_active_handle) co_active_handle = &co_active_buffer;
-  size += 256;  /* allocate additional space for storage */
-  size &= ~15;  /* align stack to 16-byte boundary */
-  *out_size = size;
 
-  if(handle = (cothread_t)malloc(size)) {
+  if(handle = (cothread_t)memory) {
     long *p = (long*)((char*)handle + size);  /* seek to top of stack */
     *--p = (long)crash;                       /* crash if entrypoint returns */
     *--p = (long)entrypoint;                  /* start of function */
@@ -102,6 +99,15 @@ cothread_t co_create(unsigned int size, void (*entrypoint)(void),
   return handle;
 }
 
+cothread_t co_create(unsigned int size, void (*entrypoint)(void),
+                     size_t *out_size) {
+  size += 256;  /* allocate additional space for storage */
+  size &= ~15;  /* align stack to 16-byte boundary */
+  *out_size = size;
+
+  return co_derive(malloc(size), size, entrypoint);
+}
+
 void co_delete(cothread_t handle) {
   free(handle);
 }
@@ -0,0 +1,694 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <stdio.h>
+#include <float.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_str.h>
+#include <fluent-bit/flb_filter.h>
+#include <fluent-bit/flb_input.h>
+#include <fluent-bit/flb_utils.h>
+#include <fluent-bit/flb_log.h>
+#include <fluent-bit/flb_hash.h>
+#include <fluent-bit/flb_time.h>
+#include <fluent-bit/flb_scheduler.h>
+#include <msgpack.h>
+
+#include "aggregate.h"
+
+static msgpack_object *map_get(msgpack_object *map, struct agg_key *key)
+{
+    uint32_t i;
+    msgpack_object *k;
+
+    for (i = 0; i < map->via.map.size; i++) {
+        k = &map->via.map.ptr[i].key;
+        if (k->type == MSGPACK_OBJECT_STR &&
+            k->via.str.size == key->len &&
+            memcmp(k->via.str.ptr, key->name, key->len) == 0) {
+            return &map->via.map.ptr[i].val;
+        }
+    }
+
+    return NULL;
+}
+
+/* Numeric value of an object, numbers in strings are accepted */
+static int value_get(msgpack_object *o, double *val)
+{
+    int len;
+    char *end;
+    char tmp[64];
+
+    switch (o->type) {
+    case MSGPACK_OBJECT_POSITIVE_INTEGER:
+        *val = (double) o->via.u64;
+        return 0;
+    case MSGPACK_OBJECT_NEGATIVE_INTEGER:
+        *val = (double) o->via.i64;
+        return 0;
+    case MSGPACK_OBJECT_FLOAT32:
+    case MSGPACK_OBJECT_FLOAT64:
+        *val = o->via.f64;
+        return 0;
+    case MSGPACK_OBJECT_STR:
+        len = o->via.str.size;
+        if (len == 0 || len >= sizeof(tmp)) {
+            return -1;
+        }
+        memcpy(tmp, o->via.str.ptr, len);
+        tmp[len] = '\0';
+        *val = strtod(tmp, &end);
+        if (*end != '\0') {
+            return -1;
+        }
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+static struct agg_window *window_create(time_t start)
+{
+    struct agg_window *w;
+
+    w = flb_calloc(1, sizeof(struct agg_window));
+    if (!w) {
+        flb_errno();
+        return NULL;
+    }
+    w->start = start;
+    mk_list_init(&w->list);
+
+    w->ht = flb_hash_create(FLB_HASH_EVICT_NONE, 256, 0);
+    if (!w->ht) {
+        flb_free(w);
+        return NULL;
+    }
+
+    return w;
+}
+
+static void window_destroy(struct agg_window *w)
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct agg_group *g;
+
+    mk_list_foreach_safe(head, tmp, &w->list) {
+        g = mk_list_entry(head, struct agg_group, _head);
+        mk_list_del(&g->_head);
+        flb_free(g);
+    }
+    flb_hash_destroy(w->ht);
+    flb_free(w);
+}
+
+/* A group, its statistics, histograms and key share one allocation */
+static struct agg_group *group_create(struct agg_ctx *ctx,
+                                      struct agg_window *w,
+                                      char *key, int key_len)
+{
+    int i;
+    int ret;
+    size_t size;
+    uint64_t *buckets;
+    struct agg_group *g;
+
+    size = sizeof(struct agg_group) +
+        (sizeof(struct agg_value) * ctx->values_len) + key_len;
+    if (ctx->buckets_len > 0) {
+        size += sizeof(uint64_t) * (ctx->buckets_len + 1) * ctx->values_len;
+    }
+
+    g = flb_calloc(1, size);
+    if (!g) {
+        flb_errno();
+        return NULL;
+    }
+
+    g->values = (struct agg_value *) (g + 1);
+    buckets = (uint64_t *) (g->values + ctx->values_len);
+    for (i = 0; i < ctx->values_len; i++) {
+        g->values[i].min = DBL_MAX;
+        g->values[i].max = -DBL_MAX;
+        if (ctx->buckets_len > 0) {
+            g->values[i].buckets = buckets;
+            buckets += ctx->buckets_len + 1;
+        }
+    }
+    g->key = (char *) buckets;
+    g->key_len = key_len;
+    memcpy(g->key, key, key_len);
+
+    ret = flb_hash_add(w->ht, g->key, g->key_len, (char *) &g, sizeof(g));
+    if (ret == -1) {
+        flb_free(g);
+        return NULL;
+    }
+    mk_list_add(&g->_head, &w->list);
+    w->groups++;
+
+    return g;
+}
+
+static void value_add(struct agg_ctx *ctx, struct agg_value *v, double val)
+{
+    int i;
+
+    v->count++;
+    v->sum += val;
+    if (val < v->min) {
+        v->min = val;
+    }
+    if (val > v->max) {
+        v->max = val;
+    }
+
+    if (!v->buckets) {
+        return;
+    }
+
+    /* the last counter is the +Inf bucket */
+    for (i = 0; i < ctx->buckets_len; i++) {
+        if (val <= ctx->buckets[i]) {
+            break;
+        }
+    }
+    v->buckets[i]++;
+}
+
+/* Add a record to its group, 'key' is a scratch buffer */
+static void record_add(struct agg_ctx *ctx, msgpack_object *map,
+                       msgpack_sbuffer *key, msgpack_packer *key_pck)
+{
+    int i;
+    double val;
+    char *buf;
+    size_t size;
+    msgpack_object *o;
+    struct agg_group *g;
+    struct agg_window *w = ctx->window;
+
+    key->size = 0;
+    msgpack_pack_array(key_pck, ctx->group_by_len);
+    for (i = 0; i < ctx->group_by_len; i++) {
+        o = map_get(map, &ctx->group_by[i]);
+        if (o) {
+            msgpack_pack_object(key_pck, *o);
+        }
+        else {
+            msgpack_pack_nil(key_pck);
+        }
+    }
+
+    if (flb_hash_get(w->ht, key->data, key->size, &buf, &size) >= 0) {
+        memcpy(&g, buf, sizeof(g));
+    }
+    else if (w->groups >= ctx->max_groups) {
+        w->overflow++;
+        return;
+    }
+    else {
+        g = group_create(ctx, w, key->data, key->size);
+        if (!g) {
+            w->overflow++;
+            return;
+        }
+    }
+
+    g->count++;
+    for (i = 0; i < ctx->values_len; i++) {
+        o = map_get(map, &ctx->values[i]);
+        if (o && value_get(o, &val) == 0) {
+            value_add(ctx, &g->values[i], val);
+        }
+    }
+}
+
+static void pack_key_suffix(msgpack_packer *pck, struct agg_key *key,
+                            char *suffix)
+{
+    int len;
+
+    len = strlen(suffix);
+    msgpack_pack_str(pck, key->len + len);
+    msgpack_pack_str_body(pck, key->name, key->len);
+    msgpack_pack_str_body(pck, suffix, len);
+}
+
+/*
+ * Pack the record of a group:
+ *
+ *   {<group_by keys>, "count": N,
+ *    "<key>_count", "<key>_sum", "<key>_min", "<key>_max",
+ *    "<key>_buckets": {"<bound>": N, ..., "+Inf": N}}
+ */
+static void group_pack(struct agg_ctx *ctx, struct agg_group *g,
+                       struct flb_time *tm, msgpack_packer *pck)
+{
+    int i;
+    int j;
+    int len;
+    int entries;
+    uint64_t cumulative;
+    char tmp[32];
+    size_t off = 0;
+    msgpack_unpacked result;
+    msgpack_object *vals;
+    struct agg_value *v;
+
+    msgpack_pack_array(pck, 2);
+    flb_time_append_to_msgpack(tm, pck, 0);
+
+    entries = ctx->group_by_len + 1;
+    for (i = 0; i < ctx->values_len; i++) {
+        if (g->values[i].count > 0) {
+            entries += (ctx->buckets_len > 0) ? 5 : 4;
+        }
+    }
+    msgpack_pack_map(pck, entries);
+
+    msgpack_unpacked_init(&result);
+    msgpack_unpack_next(&result, g->key, g->key_len, &off);
+    vals = result.data.via.array.ptr;
+    for (i = 0; i < ctx->group_by_len; i++) {
+        msgpack_pack_str(pck, ctx->group_by[i].len);
+        msgpack_pack_str_body(pck, ctx->group_by[i].name,
+                              ctx->group_by[i].len);
+        msgpack_pack_object(pck, vals[i]);
+    }
+    msgpack_unpacked_destroy(&result);
+
+    msgpack_pack_str(pck, 5);
+    msgpack_pack_str_body(pck, "count", 5);
+    msgpack_pack_uint64(pck, g->count);
+
+    for (i = 0; i < ctx->values_len; i++) {
+        v = &g->values[i];
+        if (v->count == 0) {
+            continue;
+        }
+
+        pack_key_suffix(pck, &ctx->values[i], "_count");
+        msgpack_pack_uint64(pck, v->count);
+        pack_key_suffix(pck, &ctx->values[i], "_sum");
+        msgpack_pack_double(pck, v->sum);
+        pack_key_suffix(pck, &ctx->values[i], "_min");
+        msgpack_pack_double(pck, v->min);
+        pack_key_suffix(pck, &ctx->values[i], "_max");
+        msgpack_pack_double(pck, v->max);
+
+        if (ctx->buckets_len == 0) {
+            continue;
+        }
+
+        /* cumulative counters, like Prometheus histograms */
+        pack_key_suffix(pck, &ctx->values[i], "_buckets");
+        msgpack_pack_map(pck, ctx->buckets_len + 1);
+        cumulative = 0;
+        for (j = 0; j <= ctx->buckets_len; j++) {
+            if (j < ctx->buckets_len) {
+                len = snprintf(tmp, sizeof(tmp), "%g", ctx->buckets[j]);
+            }
+            else {
+                len = snprintf(tmp, sizeof(tmp), "+Inf");
+            }
+            cumulative += v->buckets[j];
+            msgpack_pack_str(pck, len);
+            msgpack_pack_str_body(pck, tmp, len);
+            msgpack_pack_uint64(pck, cumulative);
+        }
+    }
+}
+
+/* Milliseconds until the end of a window */
+static int window_remaining_ms(struct agg_ctx *ctx, struct agg_window *w)
+{
+    int64_t ms;
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    ms = ((int64_t) (w->start + ctx->window_sec) * 1000) -
+        (((int64_t) tv.tv_sec * 1000) + (tv.tv_usec / 1000));
+    if (ms < 1) {
+        ms = 1;
+    }
+
+    return (int) ms;
+}
+
+/*
+ * End of a window: the groups are taken out of the filter and emitted as
+ * records, then the timer is armed for the next window. It runs on the
+ * engine thread, the records are appended to the emitter instance and skip
+ * the filters.
+ */
+static void cb_agg_tick(struct flb_config *config, void *data)
+{
+    int ms;
+    struct mk_list *head;
+    struct flb_time tm;
+    struct agg_group *g;
+    struct agg_window *w;
+    struct agg_window *next;
+    struct agg_ctx *ctx = data;
+    msgpack_sbuffer mp_sbuf;
+    msgpack_packer mp_pck;
+
+    /* Windows are contiguous, the timer firing late does not shift them */
+    next = window_create(ctx->window->start + ctx->window_sec);
+    if (!next) {
+        next = ctx->window;
+        goto next_timer;
+    }
+
+    pthread_mutex_lock(&ctx->lock);
+    w = ctx->window;
+    ctx->window = next;
+    pthread_mutex_unlock(&ctx->lock);
+
+    if (w->groups > 0) {
+        flb_time_set(&tm, w->start, 0);
+        msgpack_sbuffer_init(&mp_sbuf);
+        msgpack_packer_init(&mp_pck, &mp_sbuf, msgpack_sbuffer_write);
+        mk_list_foreach(head, &w->list) {
+            g = mk_list_entry(head, struct agg_group, _head);
+            group_pack(ctx, g, &tm, &mp_pck);
+        }
+        flb_input_dyntag_append_filtered(ctx->ins, ctx->tag, ctx->tag_len,
+                                         mp_sbuf.data, mp_sbuf.size,
+                                         w->groups);
+        msgpack_sbuffer_destroy(&mp_sbuf);
+    }
+
+    if (w->overflow > 0) {
+        flb_warn("[filter_aggregate] %lu records not aggregated, "
+                 "max_groups=%i reached", w->overflow, ctx->max_groups);
+    }
+    window_destroy(w);
+
+ next_timer:
+    if (config->is_running == FLB_FALSE) {
+        return;
+    }
+
+    ms = window_remaining_ms(ctx, next);
+    if (flb_sched_timer_cb_create(config, ms, cb_agg_tick, ctx) == -1) {
+        flb_error("[filter_aggregate] cannot schedule the window timer");
+    }
+}
+
+static int cb_agg_filter_batch(struct flb_filter_batch *batch,
+                               char *tag, int tag_len,
+                               struct flb_filter_instance *f_ins,
+                               void *context,
+                               struct flb_config *config)
+{
+    int i;
+    int dropped = 0;
+    struct flb_filter_record *rec;
+    struct agg_ctx *ctx = context;
+    msgpack_sbuffer key;
+    msgpack_packer key_pck;
+    (void) f_ins;
+    (void) config;
+
+    msgpack_sbuffer_init(&key);
+    msgpack_packer_init(&key_pck, &key, msgpack_sbuffer_write);
+
+    pthread_mutex_lock(&ctx->lock);
+    for (i = 0; i < batch->count; i++) {
+        rec = &batch->records[i];
+        if (rec->drop == FLB_TRUE || rec->map.type != MSGPACK_OBJECT_MAP) {
+            continue;
+        }
+
+        record_add(ctx, &rec->map, &key, &key_pck);
+        if (ctx->keep_records == FLB_FALSE) {
+            rec->drop = FLB_TRUE;
+            dropped++;
+        }
+    }
+    pthread_mutex_unlock(&ctx->lock);
+
+    msgpack_sbuffer_destroy(&key);
+
+    if (dropped == 0) {
+        return FLB_FILTER_NOTOUCH;
+    }
+
+    return FLB_FILTER_MODIFIED;
+}
+
+/* Read the keys listed by all the 'name' properties, space separated */
+static int set_keys(struct flb_filter_instance *f_ins, char *name,
+                    struct agg_key **out, int *out_len)
+{
+    int n = 0;
+    struct mk_list *head;
+    struct mk_list *s_head;
+    struct mk_list *split;
+    struct flb_split_entry *sentry;
+    struct flb_config_prop *prop;
+    struct agg_key *keys = NULL;
+    struct agg_key *tmp;
+
+    mk_list_foreach(head, &f_ins->properties) {
+        prop = mk_list_entry(head, struct flb_config_prop, _head);
+        if (strcasecmp(prop->key, name) != 0) {
+            continue;
+        }
+
+        split = flb_utils_split(prop->val, ' ', -1);
+        if (!split) {
+            continue;
+        }
+        mk_list_foreach(s_head, split) {
+            sentry = mk_list_entry(s_head, struct flb_split_entry, _head);
+            tmp = flb_realloc(keys, sizeof(struct agg_key) * (n + 1));
+            if (!tmp) {
+                flb_errno();
+                flb_utils_split_free(split);
+                *out = keys;
+                *out_len = n;
+                return -1;
+            }
+            keys = tmp;
+            keys[n].name = flb_strndup(sentry->value, sentry->len);
+            keys[n].len = sentry->len;
+            n++;
+        }
+        flb_utils_split_free(split);
+    }
+
+    *out = keys;
+    *out_len = n;
+    return 0;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+
+    return (x > y) - (x < y);
+}
+
+static int set_buckets(struct agg_ctx *ctx, char *str)
+{
+    char *end;
+    struct mk_list *head;
+    struct mk_list *split;
+    struct flb_split_entry *sentry;
+
+    split = flb_utils_split(str, ' ', -1);
+    if (!split) {
+        return -1;
+    }
+
+    mk_list_foreach(head, split) {
+        sentry = mk_list_entry(head, struct flb_split_entry, _head);
+        if (ctx->buckets_len == AGG_BUCKETS_MAX) {
+            flb_error("[filter_aggregate] up to %i buckets are supported",
+                      AGG_BUCKETS_MAX);
+            flb_utils_split_free(split);
+            return -1;
+        }
+        ctx->buckets[ctx->buckets_len] = strtod(sentry->value, &end);
+        if (end == sentry->value) {
+            flb_error("[filter_aggregate] invalid bucket '%s'",
+                      sentry->value);
+            flb_utils_split_free(split);
+            return -1;
+        }
+        ctx->buckets_len++;
+    }
+    flb_utils_split_free(split);
+
+    qsort(ctx->buckets, ctx->buckets_len, sizeof(double), cmp_double);
+    return 0;
+}
+
+static int configure(struct agg_ctx *ctx, struct flb_filter_instance *f_ins)
+{
+    char *tmp;
+
+    if (set_keys(f_ins, "group_by", &ctx->group_by,
+                 &ctx->group_by_len) == -1 ||
+        set_keys(f_ins, "value_key", &ctx->values,
+                 &ctx->values_len) == -1) {
+        return -1;
+    }
+
+    tmp = flb_filter_get_property("buckets", f_ins);
+    if (tmp) {
+        if (ctx->values_len == 0) {
+            flb_error("[filter_aggregate] 'buckets' requires 'value_key'");
+            return -1;
+        }
+        if (set_buckets(ctx, tmp) == -1) {
+            return -1;
+        }
+    }
+
+    ctx->window_sec = AGG_DEFAULT_WINDOW;
+    tmp = flb_filter_get_property("window", f_ins);
+    if (tmp) {
+        ctx->window_sec = atoi(tmp);
+        if (ctx->window_sec <= 0) {
+            flb_error("[filter_aggregate] invalid window '%s'", tmp);
+            return -1;
+        }
+    }
+
+    ctx->max_groups = AGG_DEFAULT_MAX_GROUPS;
+    tmp = flb_filter_get_property("max_groups", f_ins);
+    if (tmp && atoi(tmp) > 0) {
+        ctx->max_groups = atoi(tmp);
+    }
+
+    ctx->keep_records = FLB_FALSE;
+    tmp = flb_filter_get_property("keep_records", f_ins);
+    if (tmp) {
+        ctx->keep_records = flb_utils_bool(tmp);
+    }
+
+    tmp = flb_filter_get_property("tag", f_ins);
+    ctx->tag = flb_strdup(tmp ? tmp : AGG_DEFAULT_TAG);
+    ctx->tag_len = strlen(ctx->tag);
+
+    return 0;
+}
+
+static void ctx_destroy(struct agg_ctx *ctx)
+{
+    int i;
+
+    for (i = 0; i < ctx->group_by_len; i++) {
+        flb_free(ctx->group_by[i].name);
+    }
+    flb_free(ctx->group_by);
+    for (i = 0; i < ctx->values_len; i++) {
+        flb_free(ctx->values[i].name);
+    }
+    flb_free(ctx->values);
+    if (ctx->window) {
+        window_destroy(ctx->window);
+    }
+    flb_free(ctx->tag);
+    pthread_mutex_destroy(&ctx->lock);
+    flb_free(ctx);
+}
+
+static int cb_agg_init(struct flb_filter_instance *f_ins,
+                       struct flb_config *config,
+                       void *data)
+{
+    int ret;
+    time_t now;
+    struct agg_ctx *ctx;
+
+    ctx = flb_calloc(1, sizeof(struct agg_ctx));
+    if (!ctx) {
+        flb_errno();
+        return -1;
+    }
+    pthread_mutex_init(&ctx->lock, NULL);
+
+    if (configure(ctx, f_ins) == -1) {
+        ctx_destroy(ctx);
+        return -1;
+    }
+
+    /* Tumbling windows aligned to multiples of their length */
+    now = time(NULL);
+    ctx->window = window_create(now - (now % ctx->window_sec));
+    if (!ctx->window) {
+        ctx_destroy(ctx);
+        return -1;
+    }
+
+    /* The aggregates enter the pipeline through their own input */
+    ctx->ins = flb_input_new(config, "emitter", NULL);
+    if (!ctx->ins) {
+        flb_error("[filter_aggregate] cannot create the emitter input");
+        ctx_destroy(ctx);
+        return -1;
+    }
+    if (flb_input_instance_init(ctx->ins, config) == -1) {
+        ctx_destroy(ctx);
+        return -1;
+    }
+
+    ret = flb_sched_timer_cb_create(config,
+                                    window_remaining_ms(ctx, ctx->window),
+                                    cb_agg_tick, ctx);
+    if (ret == -1) {
+        flb_error("[filter_aggregate] cannot schedule the window timer");
+        ctx_destroy(ctx);
+        return -1;
+    }
+
+    flb_filter_set_context(f_ins, ctx);
+    return 0;
+}
+
+static int cb_agg_exit(void *data, struct flb_config *config)
+{
+    struct agg_ctx *ctx = data;
+
+    flb_sched_timer_cb_cancel(config, ctx);
+    ctx_destroy(ctx);
+    return 0;
+}
+
+struct flb_filter_plugin filter_aggregate_plugin = {
+    .name         = "aggregate",
+    .description  = "aggregate records into metrics over time windows",
+    .cb_init      = cb_agg_init,
+    .cb_filter_batch = cb_agg_filter_batch,
+    .cb_exit      = cb_agg_exit,
+    .flags        = FLB_FILTER_THREAD_SAFE
+};
@@ -0,0 +1,95 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef FLB_FILTER_AGGREGATE_H
+#define FLB_FILTER_AGGREGATE_H
+
+#include <time.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <monkey/mk_core.h>
+
+#define AGG_DEFAULT_WINDOW      60
+#define AGG_DEFAULT_TAG         "aggregated"
+#define AGG_DEFAULT_MAX_GROUPS  10000
+#define AGG_BUCKETS_MAX         32
+
+struct flb_hash;
+struct flb_input_instance;
+
+/* A first level key of the records */
+struct agg_key {
+    int len;
+    char *name;
+};
+
+/* Statistics of a value key inside a group */
+struct agg_value {
+    uint64_t count;
+    double sum;
+    double min;
+    double max;
+    uint64_t *buckets;          /* buckets_len + 1 counters, or NULL */
+};
+
+/*
+ * Group: records with the same values for the 'Group_By' keys. The key is
+ * the msgpack serialization of those values.
+ */
+struct agg_group {
+    uint64_t count;
+    int key_len;
+    char *key;
+    struct agg_value *values;
+    struct mk_list _head;
+};
+
+/* Groups of a window */
+struct agg_window {
+    time_t start;
+    int groups;
+    uint64_t overflow;          /* records not aggregated: too many groups */
+    struct flb_hash *ht;        /* key -> group */
+    struct mk_list list;
+};
+
+struct agg_ctx {
+    int group_by_len;
+    struct agg_key *group_by;
+    int values_len;
+    struct agg_key *values;
+
+    /* histogram upper bounds, sorted */
+    int buckets_len;
+    double buckets[AGG_BUCKETS_MAX];
+
+    int window_sec;
+    int max_groups;
+    int keep_records;
+
+    int tag_len;
+    char *tag;
+    struct flb_input_instance *ins;     /* emitter of the aggregates */
+
+    /* the window is updated by the filter threads, emitted by the timer */
+    pthread_mutex_t lock;
+    struct agg_window *window;
+};
+
+#endif
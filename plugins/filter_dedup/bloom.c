@@ -0,0 +1,122 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_log.h>
+
+#include "bloom.h"
+
+/* Size a generation for 'entries' entries with a false positive rate */
+struct dedup_bloom *bloom_create(uint64_t entries, double fp_rate)
+{
+    double m;
+    size_t words;
+    struct dedup_bloom *b;
+
+    b = flb_calloc(1, sizeof(struct dedup_bloom));
+    if (!b) {
+        flb_errno();
+        return NULL;
+    }
+
+    m = ceil(-((double) entries * log(fp_rate)) / (M_LN2 * M_LN2));
+    b->bits = (uint64_t) m;
+    if (b->bits < 64) {
+        b->bits = 64;
+    }
+    b->k = (int) round(((double) b->bits / entries) * M_LN2);
+    if (b->k < 1) {
+        b->k = 1;
+    }
+
+    words = (b->bits + 63) / 64;
+    b->gen[0] = flb_calloc(words, sizeof(uint64_t));
+    b->gen[1] = flb_calloc(words, sizeof(uint64_t));
+    if (!b->gen[0] || !b->gen[1]) {
+        flb_errno();
+        bloom_destroy(b);
+        return NULL;
+    }
+
+    return b;
+}
+
+/*
+ * Check if an entry is known and add it to the current generation. The
+ * positions are derived from two hashes (Kirsch-Mitzenmacher). Returns
+ * FLB_TRUE if the entry was (probably) seen before.
+ */
+int bloom_test_add(struct dedup_bloom *b, uint64_t h1, uint64_t h2)
+{
+    int i;
+    int cur_hits = 0;
+    int old_hits = 0;
+    uint64_t pos;
+    uint64_t bit;
+    uint64_t *cur;
+    uint64_t *old;
+
+    cur = b->gen[b->cur];
+    old = b->gen[b->cur ^ 1];
+
+    for (i = 0; i < b->k; i++) {
+        pos = (h1 + (uint64_t) i * h2) % b->bits;
+        bit = 1ULL << (pos & 63);
+
+        if (cur[pos >> 6] & bit) {
+            cur_hits++;
+        }
+        else {
+            cur[pos >> 6] |= bit;
+        }
+
+        if (old[pos >> 6] & bit) {
+            old_hits++;
+        }
+    }
+
+    if (cur_hits == b->k || old_hits == b->k) {
+        return FLB_TRUE;
+    }
+
+    return FLB_FALSE;
+}
+
+void bloom_rotate(struct dedup_bloom *b)
+{
+    b->cur ^= 1;
+    memset(b->gen[b->cur], '\0', ((b->bits + 63) / 64) * sizeof(uint64_t));
+}
+
+/* Memory used by both generations */
+size_t bloom_size(struct dedup_bloom *b)
+{
+    return 2 * ((b->bits + 63) / 64) * sizeof(uint64_t);
+}
+
+void bloom_destroy(struct dedup_bloom *b)
+{
+    flb_free(b->gen[0]);
+    flb_free(b->gen[1]);
+    flb_free(b);
+}
@@ -0,0 +1,45 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef FLB_FILTER_DEDUP_BLOOM_H
+#define FLB_FILTER_DEDUP_BLOOM_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Rotating bloom filter: two generations of the same size, lookups check
+ * both and insertions go to the current one. When a generation is rotated
+ * the oldest is cleared and becomes the current one, so an entry is known
+ * for at least one rotation period and the memory is fixed.
+ */
+struct dedup_bloom {
+    int k;                      /* hash functions per entry    */
+    uint64_t bits;              /* bits of every generation    */
+    int cur;                    /* current generation          */
+    uint64_t *gen[2];
+};
+
+struct dedup_bloom *bloom_create(uint64_t entries, double fp_rate);
+int bloom_test_add(struct dedup_bloom *b, uint64_t h1, uint64_t h2);
+void bloom_rotate(struct dedup_bloom *b);
+size_t bloom_size(struct dedup_bloom *b);
+void bloom_destroy(struct dedup_bloom *b);
+
+#endif
@@ -0,0 +1,374 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_str.h>
+#include <fluent-bit/flb_filter.h>
+#include <fluent-bit/flb_utils.h>
+#include <fluent-bit/flb_log.h>
+#include <msgpack.h>
+
+#include "dedup.h"
+#include "bloom.h"
+
+#define FNV_OFFSET  0xcbf29ce484222325ULL
+#define FNV_PRIME   0x100000001b3ULL
+
+static inline uint64_t fnv_add(uint64_t h, const void *buf, size_t len)
+{
+    size_t i;
+    const unsigned char *p = buf;
+
+    for (i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= FNV_PRIME;
+    }
+
+    return h;
+}
+
+static inline uint64_t fnv_add_u64(uint64_t h, uint64_t v)
+{
+    int i;
+
+    /* fixed byte order */
+    for (i = 0; i < 8; i++) {
+        h ^= (v >> (i * 8)) & 0xff;
+        h *= FNV_PRIME;
+    }
+
+    return h;
+}
+
+static inline uint64_t mix(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+
+    return h;
+}
+
+/* Hash the content of an object, the type is part of the hash */
+static uint64_t hash_object(uint64_t h, msgpack_object *o)
+{
+    uint32_t i;
+
+    h = fnv_add_u64(h, o->type);
+
+    switch (o->type) {
+    case MSGPACK_OBJECT_BOOLEAN:
+        return fnv_add_u64(h, o->via.boolean);
+    case MSGPACK_OBJECT_POSITIVE_INTEGER:
+    case MSGPACK_OBJECT_NEGATIVE_INTEGER:
+        return fnv_add_u64(h, o->via.u64);
+    case MSGPACK_OBJECT_FLOAT32:
+    case MSGPACK_OBJECT_FLOAT64:
+        return fnv_add(h, &o->via.f64, sizeof(double));
+    case MSGPACK_OBJECT_STR:
+        h = fnv_add_u64(h, o->via.str.size);
+        return fnv_add(h, o->via.str.ptr, o->via.str.size);
+    case MSGPACK_OBJECT_BIN:
+        h = fnv_add_u64(h, o->via.bin.size);
+        return fnv_add(h, o->via.bin.ptr, o->via.bin.size);
+    case MSGPACK_OBJECT_EXT:
+        h = fnv_add_u64(h, o->via.ext.type);
+        h = fnv_add_u64(h, o->via.ext.size);
+        return fnv_add(h, o->via.ext.ptr, o->via.ext.size);
+    case MSGPACK_OBJECT_ARRAY:
+        h = fnv_add_u64(h, o->via.array.size);
+        for (i = 0; i < o->via.array.size; i++) {
+            h = hash_object(h, &o->via.array.ptr[i]);
+        }
+        return h;
+    case MSGPACK_OBJECT_MAP:
+        h = fnv_add_u64(h, o->via.map.size);
+        for (i = 0; i < o->via.map.size; i++) {
+            h = hash_object(h, &o->via.map.ptr[i].key);
+            h = hash_object(h, &o->via.map.ptr[i].val);
+        }
+        return h;
+    default:
+        return h;
+    }
+}
+
+static msgpack_object *map_get(msgpack_object *map, struct dedup_key *key)
+{
+    uint32_t i;
+    msgpack_object *k;
+
+    for (i = 0; i < map->via.map.size; i++) {
+        k = &map->via.map.ptr[i].key;
+        if (k->type == MSGPACK_OBJECT_STR &&
+            k->via.str.size == key->len &&
+            memcmp(k->via.str.ptr, key->name, key->len) == 0) {
+            return &map->via.map.ptr[i].val;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Hash the identity of a record: the tag plus the configured keys, or the
+ * whole record when no keys are set. Returns -1 if the record has none of
+ * the keys, these records are never considered duplicates.
+ */
+static int record_hash(struct dedup_ctx *ctx, char *tag, int tag_len,
+                       msgpack_object *map, uint64_t *out)
+{
+    int i;
+    int found = 0;
+    uint64_t h;
+    msgpack_object *val;
+
+    if (map->type != MSGPACK_OBJECT_MAP) {
+        return -1;
+    }
+
+    h = fnv_add(FNV_OFFSET, tag, tag_len);
+    if (ctx->keys_len == 0) {
+        *out = hash_object(h, map);
+        return 0;
+    }
+
+    for (i = 0; i < ctx->keys_len; i++) {
+        val = map_get(map, &ctx->keys[i]);
+        if (!val) {
+            h = fnv_add_u64(h, 0);
+            continue;
+        }
+        h = fnv_add_u64(h, 1);
+        h = hash_object(h, val);
+        found++;
+    }
+
+    if (found == 0) {
+        return -1;
+    }
+
+    *out = h;
+    return 0;
+}
+
+static int set_keys(struct dedup_ctx *ctx, struct flb_filter_instance *f_ins)
+{
+    int i = 0;
+    struct mk_list *head;
+    struct flb_config_prop *prop;
+
+    mk_list_foreach(head, &f_ins->properties) {
+        prop = mk_list_entry(head, struct flb_config_prop, _head);
+        if (strcasecmp(prop->key, "key") == 0) {
+            ctx->keys_len++;
+        }
+    }
+
+    if (ctx->keys_len == 0) {
+        return 0;
+    }
+
+    ctx->keys = flb_calloc(ctx->keys_len, sizeof(struct dedup_key));
+    if (!ctx->keys) {
+        flb_errno();
+        return -1;
+    }
+
+    mk_list_foreach(head, &f_ins->properties) {
+        prop = mk_list_entry(head, struct flb_config_prop, _head);
+        if (strcasecmp(prop->key, "key") != 0) {
+            continue;
+        }
+        ctx->keys[i].name = flb_strdup(prop->val);
+        ctx->keys[i].len = strlen(prop->val);
+        i++;
+    }
+
+    return 0;
+}
+
+static int configure(struct dedup_ctx *ctx, struct flb_filter_instance *f_ins)
+{
+    char *tmp;
+    char *end;
+    long records;
+    double fp_rate;
+
+    if (set_keys(ctx, f_ins) == -1) {
+        return -1;
+    }
+
+    ctx->window = DEDUP_DEFAULT_WINDOW;
+    tmp = flb_filter_get_property("window", f_ins);
+    if (tmp) {
+        ctx->window = atoi(tmp);
+        if (ctx->window <= 0) {
+            flb_error("[filter_dedup] invalid window '%s'", tmp);
+            return -1;
+        }
+    }
+
+    records = DEDUP_DEFAULT_MAX_RECORDS;
+    tmp = flb_filter_get_property("max_records", f_ins);
+    if (tmp) {
+        records = atol(tmp);
+        if (records <= 0) {
+            flb_error("[filter_dedup] invalid max_records '%s'", tmp);
+            return -1;
+        }
+    }
+
+    fp_rate = DEDUP_DEFAULT_FP_RATE;
+    tmp = flb_filter_get_property("false_positive_rate", f_ins);
+    if (tmp) {
+        fp_rate = strtod(tmp, &end);
+        if (end == tmp || *end != '\0' || fp_rate <= 0 || fp_rate >= 1) {
+            flb_error("[filter_dedup] invalid false_positive_rate '%s', "
+                      "expected a value between 0 and 1", tmp);
+            return -1;
+        }
+    }
+
+    ctx->bloom = bloom_create(records, fp_rate);
+    if (!ctx->bloom) {
+        return -1;
+    }
+
+    flb_debug("[filter_dedup] window=%is max_records=%li "
+              "false_positive_rate=%g memory=%lu bytes",
+              ctx->window, records, fp_rate, bloom_size(ctx->bloom));
+
+    return 0;
+}
+
+static void ctx_destroy(struct dedup_ctx *ctx)
+{
+    int i;
+
+    for (i = 0; i < ctx->keys_len; i++) {
+        flb_free(ctx->keys[i].name);
+    }
+    flb_free(ctx->keys);
+    if (ctx->bloom) {
+        bloom_destroy(ctx->bloom);
+    }
+    pthread_mutex_destroy(&ctx->lock);
+    flb_free(ctx);
+}
+
+static int cb_dedup_init(struct flb_filter_instance *f_ins,
+                         struct flb_config *config,
+                         void *data)
+{
+    struct dedup_ctx *ctx;
+
+    ctx = flb_calloc(1, sizeof(struct dedup_ctx));
+    if (!ctx) {
+        flb_errno();
+        return -1;
+    }
+    pthread_mutex_init(&ctx->lock, NULL);
+
+    if (configure(ctx, f_ins) == -1) {
+        ctx_destroy(ctx);
+        return -1;
+    }
+    ctx->rotate_at = time(NULL) + ctx->window;
+
+    flb_filter_set_context(f_ins, ctx);
+    return 0;
+}
+
+static int cb_dedup_filter_batch(struct flb_filter_batch *batch,
+                                 char *tag, int tag_len,
+                                 struct flb_filter_instance *f_ins,
+                                 void *context,
+                                 struct flb_config *config)
+{
+    int i;
+    int dropped = 0;
+    time_t now;
+    uint64_t h;
+    struct flb_filter_record *rec;
+    struct dedup_ctx *ctx = context;
+    (void) f_ins;
+    (void) config;
+
+    now = time(NULL);
+
+    pthread_mutex_lock(&ctx->lock);
+    if (now >= ctx->rotate_at) {
+        bloom_rotate(ctx->bloom);
+
+        /* a generation idle for two windows knows nothing still valid */
+        if (now >= ctx->rotate_at + ctx->window) {
+            bloom_rotate(ctx->bloom);
+        }
+        ctx->rotate_at = now + ctx->window;
+    }
+
+    for (i = 0; i < batch->count; i++) {
+        rec = &batch->records[i];
+        if (rec->drop == FLB_TRUE) {
+            continue;
+        }
+
+        if (record_hash(ctx, tag, tag_len, &rec->map, &h) == -1) {
+            continue;
+        }
+
+        if (bloom_test_add(ctx->bloom, mix(h),
+                           mix(h ^ 0x9e3779b97f4a7c15ULL) | 1) == FLB_TRUE) {
+            rec->drop = FLB_TRUE;
+            dropped++;
+        }
+    }
+    pthread_mutex_unlock(&ctx->lock);
+
+    if (dropped == 0) {
+        return FLB_FILTER_NOTOUCH;
+    }
+
+    return FLB_FILTER_MODIFIED;
+}
+
+static int cb_dedup_exit(void *data, struct flb_config *config)
+{
+    struct dedup_ctx *ctx = data;
+
+    ctx_destroy(ctx);
+    return 0;
+}
+
+struct flb_filter_plugin filter_dedup_plugin = {
+    .name         = "dedup",
+    .description  = "drop duplicated records",
+    .cb_init      = cb_dedup_init,
+    .cb_filter_batch = cb_dedup_filter_batch,
+    .cb_exit      = cb_dedup_exit,
+    .flags        = FLB_FILTER_THREAD_SAFE
+};
@@ -0,0 +1,50 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef FLB_FILTER_DEDUP_H
+#define FLB_FILTER_DEDUP_H
+
+#include <time.h>
+#include <pthread.h>
+
+#define DEDUP_DEFAULT_WINDOW       60
+#define DEDUP_DEFAULT_MAX_RECORDS  100000
+#define DEDUP_DEFAULT_FP_RATE      0.001
+
+struct dedup_bloom;
+
+struct dedup_key {
+    int len;
+    char *name;
+};
+
+struct dedup_ctx {
+    /* keys hashed to identify a record, the whole record if none */
+    int keys_len;
+    struct dedup_key *keys;
+
+    int window;                 /* seconds between rotations */
+    time_t rotate_at;
+
+    /* the filter can run in several threads */
+    pthread_mutex_t lock;
+    struct dedup_bloom *bloom;
+};
+
+#endif
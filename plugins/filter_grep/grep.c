@@ -26,17 +26,49 @@
 #include <fluent-bit/flb_filter.h>
 #include <fluent-bit/flb_utils.h>
 #include <fluent-bit/flb_pack.h>
+#include <fluent-bit/flb_mp.h>
 #include <fluent-bit/flb_regex.h>
+#include <fluent-bit/flb_record_accessor.h>
+#include <fluent-bit/flb_filter_pushdown.h>
 #include <msgpack.h>
 
 #include "grep.h"
 
+static void matcher_destroy(struct grep_ctx *ctx)
+{
+    int i;
+    struct grep_field *f;
+
+    for (i = 0; i < ctx->fields_len; i++) {
+        f = &ctx->fields[i];
+        if (f->merged && (f->excludes_len > 1)) {
+            flb_regex_destroy(f->merged);
+        }
+        if (f->ra) {
+            flb_ra_destroy(f->ra);
+        }
+        flb_free(f->excludes);
+    }
+    flb_free(ctx->fields);
+    flb_free(ctx->order);
+    flb_free(ctx->rules_arr);
+
+    ctx->fields = NULL;
+    ctx->order = NULL;
+    ctx->rules_arr = NULL;
+    ctx->fields_len = 0;
+    ctx->first_level_len = 0;
+    ctx->rules_len = 0;
+}
+
 static void delete_rules(struct grep_ctx *ctx)
 {
     struct mk_list *tmp;
     struct mk_list *head;
     struct grep_rule *rule;
 
+    matcher_destroy(ctx);
+
     mk_list_foreach_safe(head, tmp, &ctx->rules) {
         rule = mk_list_entry(head, struct grep_rule, _head);
         flb_free(rule->field);
@@ -47,6 +79,184 @@ static void delete_rules(struct grep_ctx *ctx)
     }
 }
 
+/*
+ * A pattern can be part of an alternation only if it does not refer to
+ * its own groups by number (backreferences, subexpression calls and
+ * conditionals) and has no comments that could swallow the closing group.
+ */
+static int pattern_mergeable(char *p)
+{
+    for (; *p; p++) {
+        if (*p == '#') {
+            return FLB_FALSE;
+        }
+        if (*p == '(' && p[1] == '?' && p[2] == '(') {
+            return FLB_FALSE;
+        }
+        if (*p != '\\' || !p[1]) {
+            continue;
+        }
+        p++;
+        if ((*p >= '0' && *p <= '9') || *p == 'k' || *p == 'g') {
+            return FLB_FALSE;
+        }
+    }
+
+    return FLB_TRUE;
+}
+
+/* Compile the Exclude rules of a field as '(?:p1)|(?:p2)|...' */
+static struct flb_regex *merge_excludes(struct grep_field *f)
+{
+    int i;
+    int len;
+    size_t size = 1;
+    char *p;
+    char *pattern;
+    char *buf;
+    struct flb_regex *regex;
+
+    for (i = 0; i < f->excludes_len; i++) {
+        pattern = f->excludes[i]->regex_pattern;
+        if (pattern_mergeable(pattern) == FLB_FALSE) {
+            return NULL;
+        }
+        size += strlen(pattern) + 5;
+    }
+
+    buf = flb_malloc(size);
+    if (!buf) {
+        flb_errno();
+        return NULL;
+    }
+
+    p = buf;
+    for (i = 0; i < f->excludes_len; i++) {
+        pattern = f->excludes[i]->regex_pattern;
+        len = strlen(pattern);
+
+        /* flb_regex_create() strips the slashes of a single pattern */
+        if (len > 1 && pattern[0] == '/' && pattern[len - 1] == '/') {
+            pattern++;
+            len -= 2;
+        }
+
+        if (i > 0) {
+            *p++ = '|';
+        }
+        memcpy(p, "(?:", 3);
+        memcpy(p + 3, pattern, len);
+        p += len + 3;
+        *p++ = ')';
+    }
+    *p = '\0';
+
+    regex = flb_regex_create((unsigned char *) buf);
+    flb_free(buf);
+
+    return regex;
+}
+
+/*
+ * Build the matcher. Rules after the first Regex rule are never evaluated
+ * (the Regex rule always decides) so they are left out, the remaining ones
+ * are grouped by the field they test.
+ */
+static int matcher_create(struct grep_ctx *ctx)
+{
+    int i;
+    int n = 0;
+    struct mk_list *head;
+    struct grep_rule *rule;
+    struct grep_field *f;
+
+    mk_list_foreach(head, &ctx->rules) {
+        n++;
+        rule = mk_list_entry(head, struct grep_rule, _head);
+        if (rule->type == GREP_REGEX) {
+            break;
+        }
+    }
+    if (n < mk_list_size(&ctx->rules)) {
+        flb_warn("[filter_grep] %i rule(s) after the first Regex rule are "
+                 "never evaluated", mk_list_size(&ctx->rules) - n);
+    }
+    if (n == 0) {
+        return 0;
+    }
+
+    ctx->rules_arr = flb_calloc(n, sizeof(struct grep_rule *));
+    ctx->fields = flb_calloc(n, sizeof(struct grep_field));
+    ctx->order = flb_calloc(n, sizeof(struct grep_field *));
+    if (!ctx->rules_arr || !ctx->fields || !ctx->order) {
+        flb_errno();
+        matcher_destroy(ctx);
+        return -1;
+    }
+
+    /* Group the rules by field */
+    mk_list_foreach(head, &ctx->rules) {
+        if (ctx->rules_len == n) {
+            break;
+        }
+        rule = mk_list_entry(head, struct grep_rule, _head);
+        rule->pos = ctx->rules_len;
+        ctx->rules_arr[ctx->rules_len++] = rule;
+
+        f = NULL;
+        for (i = 0; i < ctx->fields_len; i++) {
+            if (strcmp(ctx->fields[i].ra->pattern, rule->field) == 0) {
+                f = &ctx->fields[i];
+                break;
+            }
+        }
+        if (!f) {
+            f = &ctx->fields[ctx->fields_len];
+            ctx->order[ctx->fields_len] = f;
+            ctx->fields_len++;
+
+            /* Nested fields ($a['b']) are resolved by the record accessor */
+            f->ra = flb_ra_create(rule->field);
+            if (!f->ra) {
+                flb_error("[filter_grep] invalid field '%s'", rule->field);
+                matcher_destroy(ctx);
+                return -1;
+            }
+            if (flb_ra_is_first_level(f->ra)) {
+                f->name = f->ra->steps[0].key;
+                f->name_len = f->ra->steps[0].len;
+                ctx->first_level_len++;
+            }
+            f->first = rule->pos;
+            f->last_exclude = -1;
+            f->excludes = flb_calloc(n, sizeof(struct grep_rule *));
+            if (!f->excludes) {
+                flb_errno();
+                matcher_destroy(ctx);
+                return -1;
+            }
+        }
+        rule->f = f;
+
+        if (rule->type == GREP_EXCLUDE) {
+            f->excludes[f->excludes_len++] = rule;
+            f->last_exclude = rule->pos;
+        }
+    }
+
+    for (i = 0; i < ctx->fields_len; i++) {
+        f = &ctx->fields[i];
+        if (f->excludes_len == 1) {
+            f->merged = f->excludes[0]->regex;
+        }
+        else if (f->excludes_len > 1) {
+            f->merged = merge_excludes(f);
+        }
+    }
+
+    return 0;
+}
+
 static int set_rules(struct grep_ctx *ctx, struct flb_filter_instance *f_ins)
 {
     struct mk_list *head;
@@ -116,95 +326,212 @@ static int set_rules(struct grep_ctx *ctx, struct flb_filter_instance *f_ins)
     return 0;
 }
 
-/* Given a msgpack record, do some filter action based on the defined rules */
-static inline int grep_filter_data(msgpack_object map, struct grep_ctx *ctx)
+static int field_cmp(const void *a, const void *b)
+{
+    uint64_t x;
+    uint64_t y;
+    struct grep_field *fa = *(struct grep_field **) a;
+    struct grep_field *fb = *(struct grep_field **) b;
+
+    /* hits / evals, higher first */
+    x = fa->hits * (fb->evals + 1);
+    y = fb->hits * (fa->evals + 1);
+    if (x > y) {
+        return -1;
+    }
+    if (x < y) {
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Exclude rules are tested most selective field first: put the fields that
+ * dropped more records in front and decay the counters so the order
+ * follows changes in the data.
+ */
+static void sort_fields(struct grep_ctx *ctx)
+{
+    int i;
+    struct grep_field *f;
+
+    qsort(ctx->order, ctx->fields_len, sizeof(struct grep_field *),
+          field_cmp);
+
+    for (i = 0; i < ctx->fields_len; i++) {
+        f = &ctx->fields[i];
+        f->evals /= 2;
+        f->hits /= 2;
+    }
+}
+
+static inline void field_set(struct grep_field *f, msgpack_object *v)
+{
+    /* a value must be a string */
+    if (v->type == MSGPACK_OBJECT_STR) {
+        f->val = (char *) v->via.str.ptr;
+        f->val_len = v->via.str.size;
+        f->status = GREP_FIELD_STRING;
+    }
+    else if (v->type == MSGPACK_OBJECT_BIN) {
+        f->val = (char *) v->via.bin.ptr;
+        f->val_len = v->via.bin.size;
+        f->status = GREP_FIELD_STRING;
+    }
+    else {
+        f->status = GREP_FIELD_OTHER;
+    }
+}
+
+/*
+ * Find the values of every field referenced by the rules: first level keys
+ * in one pass over the record, nested ones through their record accessor.
+ */
+static inline void lookup_fields(msgpack_object map, struct grep_ctx *ctx)
 {
     int i;
+    int j;
     int klen;
-    int vlen;
+    int found = 0;
     char *key;
-    char *val;
-    ssize_t ret;
     msgpack_object *k;
     msgpack_object *v;
-    struct mk_list *head;
-    struct grep_rule *rule;
+    struct grep_field *f;
 
-    /* For each rule, validate against map fields */
-    mk_list_foreach(head, &ctx->rules) {
-        rule = mk_list_entry(head, struct grep_rule, _head);
+    for (i = 0; i < ctx->fields_len; i++) {
+        ctx->fields[i].status = GREP_FIELD_MISSING;
+    }
 
-        /* Lookup target key/value */
-        for (i = 0; i < map.via.map.size; i++) {
-            k = &map.via.map.ptr[i].key;
+    for (i = 0; i < map.via.map.size && found < ctx->first_level_len; i++) {
+        k = &map.via.map.ptr[i].key;
 
-            if (k->type != MSGPACK_OBJECT_BIN &&
-                k->type != MSGPACK_OBJECT_STR) {
+        if (k->type == MSGPACK_OBJECT_STR) {
+            key  = (char *) k->via.str.ptr;
+            klen = k->via.str.size;
+        }
+        else if (k->type == MSGPACK_OBJECT_BIN) {
+            key = (char *) k->via.bin.ptr;
+            klen = k->via.bin.size;
+        }
+        else {
+            continue;
+        }
+
+        for (j = 0; j < ctx->fields_len; j++) {
+            f = &ctx->fields[j];
+            if (!f->name || f->status != GREP_FIELD_MISSING ||
+                f->name_len != klen || memcmp(key, f->name, klen) != 0) {
                 continue;
             }
 
-            if (k->type == MSGPACK_OBJECT_STR) {
-                key  = (char *) k->via.str.ptr;
-                klen = k->via.str.size;
-            }
-            else {
-                key = (char *) k->via.bin.ptr;
-                klen = k->via.bin.size;
-            }
+            field_set(f, &map.via.map.ptr[i].val);
+            found++;
+            break;
+        }
+    }
 
-            if (rule->field_len == klen &&
-                strncmp(key, rule->field, klen) == 0) {
-                break;
-            }
+    if (ctx->first_level_len == ctx->fields_len) {
+        return;
+    }
 
-            k = NULL;
+    for (i = 0; i < ctx->fields_len; i++) {
+        f = &ctx->fields[i];
+        if (f->name) {
+            continue;
         }
-
-        /* If the key don't exists, take an action */
-        if (!k) {
-            if (rule->type == GREP_REGEX) {
-                return GREP_RET_EXCLUDE;
-            }
-            else if (rule->type == GREP_EXCLUDE) {
-                return GREP_RET_KEEP;
-            }
+        v = flb_ra_get(f->ra, map);
+        if (v) {
+            field_set(f, v);
         }
+    }
+}
 
-        /* Based on the value of the key, do the regex */
-        v = &map.via.map.ptr[i].val;
+static inline int rule_match(struct flb_regex *regex, struct grep_field *f)
+{
+    return flb_regex_match(regex, (unsigned char *) f->val, f->val_len) > 0;
+}
 
-        /* a value must be a string */
-        if (v->type == MSGPACK_OBJECT_STR) {
-            val  = (char *)v->via.str.ptr;
-            vlen = v->via.str.size;
-        }
-        else if(v->type == MSGPACK_OBJECT_BIN) {
-            val  = (char *)v->via.bin.ptr;
-            vlen = v->via.bin.size;
-        }
-        else {
-            return GREP_RET_EXCLUDE;
+/*
+ * Given a msgpack record, do some filter action based on the defined rules.
+ *
+ * The rules are applied in order and the first one that decides wins: a
+ * missing field keeps the record for an Exclude rule and drops it for a
+ * Regex rule, a value that is not a string always drops it, a match on an
+ * Exclude rule drops it and a Regex rule keeps it only on match.
+ *
+ * Once the fields are resolved the first rule that decides because of its
+ * field (the 'cut') is known, and every Exclude rule before it can only
+ * drop the record on match: those are tested in any order, one regex per
+ * field when they could be merged.
+ */
+static inline int grep_filter_data(msgpack_object map, struct grep_ctx *ctx)
+{
+    int i;
+    int j;
+    int cut;
+    struct grep_rule *rule;
+    struct grep_field *f;
+
+    if (ctx->rules_len == 0) {
+        return GREP_RET_KEEP;
+    }
+
+    if (++ctx->records % GREP_SORT_RECORDS == 0) {
+        sort_fields(ctx);
+    }
+
+    lookup_fields(map, ctx);
+
+    cut = ctx->rules_len;
+    for (i = 0; i < ctx->fields_len; i++) {
+        f = &ctx->fields[i];
+        if (f->status != GREP_FIELD_STRING && f->first < cut) {
+            cut = f->first;
         }
+    }
 
-        struct flb_regex_search result;
+    for (i = 0; i < ctx->fields_len; i++) {
+        f = ctx->order[i];
+        if (f->excludes_len == 0 || f->excludes[0]->pos >= cut) {
+            continue;
+        }
 
-        ret = flb_regex_do(rule->regex,
-                           (unsigned char *) val, vlen, &result);
-        if (ret != 0) { /* no match */
-            if (rule->type == GREP_REGEX) {
+        f->evals++;
+        if (f->merged && f->last_exclude < cut) {
+            if (rule_match(f->merged, f)) {
+                f->hits++;
                 return GREP_RET_EXCLUDE;
             }
+            continue;
         }
-        else {
-            if (rule->type == GREP_EXCLUDE) {
+
+        for (j = 0; j < f->excludes_len && f->excludes[j]->pos < cut; j++) {
+            if (rule_match(f->excludes[j]->regex, f)) {
+                f->hits++;
                 return GREP_RET_EXCLUDE;
             }
-            else {
-                return GREP_RET_KEEP;
-            }
         }
     }
 
+    /* No Exclude rule matched, the rule at the cut decides */
+    if (cut < ctx->rules_len) {
+        rule = ctx->rules_arr[cut];
+        if (rule->type == GREP_EXCLUDE &&
+            rule->f->status == GREP_FIELD_MISSING) {
+            return GREP_RET_KEEP;
+        }
+        return GREP_RET_EXCLUDE;
+    }
+
+    /* The last rule may be a Regex rule */
+    rule = ctx->rules_arr[ctx->rules_len - 1];
+    if (rule->type == GREP_REGEX) {
+        if (rule_match(rule->regex, rule->f)) {
+            return GREP_RET_KEEP;
+        }
+        return GREP_RET_EXCLUDE;
+    }
+
     return GREP_RET_KEEP;
 }
 
@@ -216,7 +543,7 @@ static int cb_grep_init(struct flb_filter_instance *f_ins,
     struct grep_ctx *ctx;
 
     /* Create context */
-    ctx = flb_malloc(sizeof(struct grep_ctx));
+    ctx = flb_calloc(1, sizeof(struct grep_ctx));
     if (!ctx) {
         flb_errno();
         return -1;
@@ -230,6 +557,13 @@ static int cb_grep_init(struct flb_filter_instance *f_ins,
         return -1;
     }
 
+    ret = matcher_create(ctx);
+    if (ret == -1) {
+        delete_rules(ctx);
+        flb_free(ctx);
+        return -1;
+    }
+
     /* Set our context */
     flb_filter_set_context(f_ins, ctx);
     return 0;
@@ -245,7 +579,7 @@ static int cb_grep_filter(void *data, size_t bytes,
     int ret;
     int old_size = 0;
     int new_size = 0;
-    msgpack_unpacked result;
+    msgpack_unpacked *result;
     msgpack_object map;
     msgpack_object root;
     size_t off = 0;
@@ -259,9 +593,14 @@ static int cb_grep_filter(void *data, size_t bytes,
     msgpack_packer_init(&tmp_pck, &tmp_sbuf, msgpack_sbuffer_write);
 
     /* Iterate each item array and apply rules */
-    msgpack_unpacked_init(&result);
-    while (msgpack_unpack_next(&result, data, bytes, &off)) {
-        root = result.data;
+    result = flb_mp_unpacker_get();
+    if (!result) {
+        msgpack_sbuffer_destroy(&tmp_sbuf);
+        return FLB_FILTER_NOTOUCH;
+    }
+    while (flb_mp_unpack_next(result, data, bytes, &off) ==
+           MSGPACK_UNPACK_SUCCESS) {
+        root = result->data;
         if (root.type != MSGPACK_OBJECT_ARRAY) {
             continue;
         }
@@ -280,7 +619,7 @@ static int cb_grep_filter(void *data, size_t bytes,
             /* Do nothing */
         }
     }
-    msgpack_unpacked_destroy(&result);
+    flb_mp_unpacker_put(result);
 
     /* we keep everything ? */
     if (old_size == new_size) {
@@ -296,6 +635,98 @@ static int cb_grep_filter(void *data, size_t bytes,
     return FLB_FILTER_MODIFIED;
 }
 
+static int cb_grep_filter_batch(struct flb_filter_batch *batch,
+                                char *tag, int tag_len,
+                                struct flb_filter_instance *f_ins,
+                                void *context,
+                                struct flb_config *config)
+{
+    int i;
+    int ret;
+    int dropped = 0;
+    struct flb_filter_record *rec;
+    (void) f_ins;
+    (void) config;
+
+    for (i = 0; i < batch->count; i++) {
+        rec = &batch->records[i];
+        if (rec->drop == FLB_TRUE) {
+            continue;
+        }
+
+        ret = grep_filter_data(rec->map, context);
+        if (ret == GREP_RET_EXCLUDE) {
+            rec->drop = FLB_TRUE;
+            dropped++;
+        }
+    }
+
+    if (dropped == 0) {
+        return FLB_FILTER_NOTOUCH;
+    }
+
+    return FLB_FILTER_MODIFIED;
+}
+
+/*
+ * Export the Exclude rules at the head of the list on first level fields,
+ * the inputs drop a record when one of them matches. The rules of a field
+ * that are all there go as the merged regex.
+ */
+static int cb_grep_pushdown(struct flb_filter_pushdown *pd,
+                            struct flb_filter_instance *f_ins,
+                            void *context)
+{
+    int i;
+    int j;
+    int ret;
+    struct grep_ctx *ctx = context;
+    struct grep_rule *rule;
+    struct grep_field *f;
+    (void) f_ins;
+
+    if (!ctx) {
+        return -1;
+    }
+
+    i = 0;
+    while (i < ctx->rules_len) {
+        rule = ctx->rules_arr[i];
+        f = rule->f;
+        if (rule->type != GREP_EXCLUDE || !f->name) {
+            break;
+        }
+
+        /* Run of rules on the same field */
+        for (j = i + 1; j < ctx->rules_len; j++) {
+            if (ctx->rules_arr[j]->type != GREP_EXCLUDE ||
+                ctx->rules_arr[j]->f != f) {
+                break;
+            }
+        }
+
+        if (f->merged && j - i == f->excludes_len) {
+            ret = flb_filter_pushdown_add(pd, f->name, f->name_len,
+                                          f->merged);
+            if (ret == -1) {
+                return -1;
+            }
+            i = j;
+            continue;
+        }
+
+        for (; i < j; i++) {
+            ret = flb_filter_pushdown_add(pd, f->name, f->name_len,
+                                          ctx->rules_arr[i]->regex);
+            if (ret == -1) {
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
 static int cb_grep_exit(void *data, struct flb_config *config)
 {
     struct grep_ctx *ctx = data;
@@ -310,6 +741,8 @@ struct flb_filter_plugin filter_grep_plugin = {
     .description  = "grep events by specified field values",
     .cb_init      = cb_grep_init,
     .cb_filter    = cb_grep_filter,
+    .cb_filter_batch = cb_grep_filter_batch,
+    .cb_pushdown  = cb_grep_pushdown,
     .cb_exit      = cb_grep_exit,
-    .flags        = 0
+    .flags        = FLB_FILTER_THREAD_SAFE
 };
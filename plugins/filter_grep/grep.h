@@ -28,16 +28,65 @@
 #define GREP_RET_KEEP     0
 #define GREP_RET_EXCLUDE  1
 
+/* field lookup status, set for every record */
+#define GREP_FIELD_MISSING  0
+#define GREP_FIELD_STRING   1
+#define GREP_FIELD_OTHER    2
+
+/* re-order the fields by selectivity every N records */
+#define GREP_SORT_RECORDS   1024
+
+struct grep_rule;
+struct flb_record_accessor;
+
+/*
+ * A field referenced by the rules: it's looked up once per record and its
+ * Exclude rules are merged into a single regular expression when possible.
+ */
+struct grep_field {
+    int name_len;
+    char *name;                 /* first level key, or NULL if nested */
+    struct flb_record_accessor *ra;
+    int first;                  /* position of the first rule on the field */
+    int last_exclude;           /* position of the last Exclude rule */
+    int excludes_len;
+    struct grep_rule **excludes;
+    struct flb_regex *merged;   /* Exclude rules as one regex, or NULL */
+
+    /* selectivity of the Exclude rules */
+    uint64_t evals;
+    uint64_t hits;
+
+    /* value found in the current record */
+    int status;
+    int val_len;
+    char *val;
+};
+
 struct grep_ctx {
     struct mk_list rules;
+
+    /*
+     * Matcher: the rules evaluated for a record, it stops at the first
+     * Regex rule because that one always decides.
+     */
+    int rules_len;
+    struct grep_rule **rules_arr;
+    int fields_len;
+    int first_level_len;        /* fields found by the record keys scan */
+    struct grep_field *fields;
+    struct grep_field **order;  /* fields, most selective first */
+    uint64_t records;
 };
 
 struct grep_rule {
     int type;
+    int pos;
     int field_len;
     char *field;
     char *regex_pattern;
     struct flb_regex *regex;
+    struct grep_field *f;
     struct mk_list _head;
 };
 
@@ -0,0 +1,264 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_log.h>
+#include <fluent-bit/flb_hash.h>
+
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <msgpack.h>
+
+#include "kube_conf.h"
+#include "kube_meta.h"
+#include "kube_lookup.h"
+#include "kube_cache.h"
+
+#define CACHE_MAGIC      "flb_kube_cache"
+#define CACHE_MAGIC_LEN  (sizeof(CACHE_MAGIC) - 1)
+
+/* Snapshot header: ["flb_kube_cache", version] */
+static int header_check(msgpack_object *o)
+{
+    msgpack_object *a;
+
+    if (o->type != MSGPACK_OBJECT_ARRAY || o->via.array.size != 2) {
+        return -1;
+    }
+
+    a = o->via.array.ptr;
+    if (a[0].type != MSGPACK_OBJECT_STR ||
+        a[0].via.str.size != CACHE_MAGIC_LEN ||
+        strncmp(a[0].via.str.ptr, CACHE_MAGIC, CACHE_MAGIC_LEN) != 0) {
+        return -1;
+    }
+
+    if (a[1].type != MSGPACK_OBJECT_POSITIVE_INTEGER ||
+        a[1].via.u64 != FLB_KUBE_CACHE_VERSION) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Entry: [cache key, creation time, metadata] */
+static int entry_restore(struct flb_kube *ctx, msgpack_object *o)
+{
+    int id;
+    msgpack_object *a;
+
+    if (o->type != MSGPACK_OBJECT_ARRAY || o->via.array.size != 3) {
+        return -1;
+    }
+
+    a = o->via.array.ptr;
+    if (a[0].type != MSGPACK_OBJECT_STR ||
+        a[1].type != MSGPACK_OBJECT_POSITIVE_INTEGER ||
+        a[2].type != MSGPACK_OBJECT_BIN) {
+        return -1;
+    }
+
+    id = flb_hash_add(ctx->hash_table,
+                      (char *) a[0].via.str.ptr, a[0].via.str.size,
+                      (char *) a[2].via.bin.ptr, a[2].via.bin.size);
+    if (id < 0) {
+        return -1;
+    }
+    ctx->hash_table->slots[id]->created = (time_t) a[1].via.u64;
+
+    /* Refresh it in the background the first time it's used */
+    if (ctx->restored) {
+        flb_hash_add(ctx->restored,
+                     (char *) a[0].via.str.ptr, a[0].via.str.size, "", 1);
+    }
+
+    return 0;
+}
+
+int flb_kube_cache_load(struct flb_kube *ctx)
+{
+    int ret;
+    int n = 0;
+    char *buf;
+    size_t off = 0;
+    size_t size;
+    msgpack_unpacked result;
+
+    if (access(ctx->cache_file, F_OK) != 0) {
+        flb_debug("[filter_kube] no metadata cache snapshot at %s",
+                  ctx->cache_file);
+        return 0;
+    }
+
+    ret = flb_kube_file_read(ctx->cache_file, &buf, &size);
+    if (ret == -1) {
+        flb_warn("[filter_kube] cannot read metadata cache snapshot %s",
+                 ctx->cache_file);
+        return -1;
+    }
+
+    if (ctx->lookup_async == FLB_TRUE) {
+        ctx->restored = flb_hash_create(FLB_HASH_EVICT_NONE,
+                                        FLB_HASH_TABLE_SIZE, -1);
+    }
+
+    msgpack_unpacked_init(&result);
+    ret = msgpack_unpack_next(&result, buf, size, &off);
+    if (ret != MSGPACK_UNPACK_SUCCESS || header_check(&result.data) != 0) {
+        flb_warn("[filter_kube] invalid metadata cache snapshot %s, "
+                 "ignoring it", ctx->cache_file);
+        msgpack_unpacked_destroy(&result);
+        flb_free(buf);
+        return -1;
+    }
+
+    while (msgpack_unpack_next(&result, buf, size, &off) ==
+           MSGPACK_UNPACK_SUCCESS) {
+        if (entry_restore(ctx, &result.data) == 0) {
+            n++;
+        }
+    }
+    msgpack_unpacked_destroy(&result);
+    flb_free(buf);
+
+    if (ctx->restored && ctx->restored->total_count == 0) {
+        flb_hash_destroy(ctx->restored);
+        ctx->restored = NULL;
+    }
+
+    ctx->cache_saved = time(NULL);
+    flb_info("[filter_kube] metadata of %i pods restored from %s",
+             n, ctx->cache_file);
+
+    return n;
+}
+
+/* Write the cache to a temporary file then move it over the snapshot */
+int flb_kube_cache_save(struct flb_kube *ctx)
+{
+    int ret;
+    size_t len;
+    char *path;
+    FILE *fp;
+    struct mk_list *head;
+    struct flb_hash_entry *entry;
+    msgpack_sbuffer mp_sbuf;
+    msgpack_packer mp_pck;
+
+    msgpack_sbuffer_init(&mp_sbuf);
+    msgpack_packer_init(&mp_pck, &mp_sbuf, msgpack_sbuffer_write);
+
+    msgpack_pack_array(&mp_pck, 2);
+    msgpack_pack_str(&mp_pck, CACHE_MAGIC_LEN);
+    msgpack_pack_str_body(&mp_pck, CACHE_MAGIC, CACHE_MAGIC_LEN);
+    msgpack_pack_uint32(&mp_pck, FLB_KUBE_CACHE_VERSION);
+
+    mk_list_foreach(head, &ctx->hash_table->entries) {
+        entry = mk_list_entry(head, struct flb_hash_entry, _head_parent);
+        msgpack_pack_array(&mp_pck, 3);
+        msgpack_pack_str(&mp_pck, entry->key_len);
+        msgpack_pack_str_body(&mp_pck, entry->key, entry->key_len);
+        msgpack_pack_uint64(&mp_pck, entry->created);
+        msgpack_pack_bin(&mp_pck, entry->val_size);
+        msgpack_pack_bin_body(&mp_pck, entry->val, entry->val_size);
+    }
+
+    len = strlen(ctx->cache_file);
+    path = flb_malloc(len + 5);
+    if (!path) {
+        flb_errno();
+        msgpack_sbuffer_destroy(&mp_sbuf);
+        return -1;
+    }
+    snprintf(path, len + 5, "%s.tmp", ctx->cache_file);
+
+    ret = -1;
+    fp = fopen(path, "w");
+    if (fp) {
+        if (fwrite(mp_sbuf.data, mp_sbuf.size, 1, fp) == 1) {
+            ret = 0;
+        }
+        if (fclose(fp) != 0) {
+            ret = -1;
+        }
+    }
+    if (ret == 0) {
+        ret = rename(path, ctx->cache_file);
+    }
+
+    if (ret == -1) {
+        flb_errno();
+        flb_warn("[filter_kube] cannot write metadata cache snapshot %s",
+                 ctx->cache_file);
+        unlink(path);
+    }
+    else {
+        flb_debug("[filter_kube] metadata of %i pods saved to %s",
+                  ctx->hash_table->total_count, ctx->cache_file);
+        ctx->cache_dirty = FLB_FALSE;
+    }
+    ctx->cache_saved = time(NULL);
+
+    flb_free(path);
+    msgpack_sbuffer_destroy(&mp_sbuf);
+
+    return ret;
+}
+
+/* Snapshot the cache if it was modified since the last one */
+void flb_kube_cache_sync(struct flb_kube *ctx)
+{
+    if (!ctx->cache_file || ctx->cache_dirty == FLB_FALSE) {
+        return;
+    }
+
+    if (time(NULL) - ctx->cache_saved < FLB_KUBE_CACHE_SYNC) {
+        return;
+    }
+
+    flb_kube_cache_save(ctx);
+}
+
+/* First use of a restored entry: queue its refresh */
+void flb_kube_cache_revalidate(struct flb_kube *ctx,
+                               struct flb_kube_meta *meta)
+{
+    int ret;
+    char *val;
+    size_t size;
+
+    ret = flb_hash_get(ctx->restored, meta->cache_key, meta->cache_key_len,
+                       &val, &size);
+    if (ret == -1) {
+        return;
+    }
+    flb_hash_del(ctx->restored, meta->cache_key);
+
+    if (ctx->lookup) {
+        flb_kube_lookup_refresh(ctx, meta);
+    }
+
+    /* Every restored entry was used */
+    if (ctx->restored->total_count == 0) {
+        flb_hash_destroy(ctx->restored);
+        ctx->restored = NULL;
+    }
+}
@@ -0,0 +1,45 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef FLB_FILTER_KUBE_CACHE_H
+#define FLB_FILTER_KUBE_CACHE_H
+
+#include "kube_meta.h"
+
+/* Snapshot format version, older or newer snapshots are ignored */
+#define FLB_KUBE_CACHE_VERSION  1
+
+/* Seconds between two snapshots of a modified cache */
+#define FLB_KUBE_CACHE_SYNC     60
+
+/*
+ * Metadata cache snapshot ('kube_meta_cache_file'): the cache is written to
+ * a local file periodically and on exit, and loaded back on start so a
+ * restart does not trigger an API server lookup for every pod of the node.
+ * Restored entries keep their creation time so the TTL still applies. With
+ * asynchronous lookups each restored entry is used right away and refreshed
+ * by the lookup worker the first time it's used.
+ */
+int flb_kube_cache_load(struct flb_kube *ctx);
+int flb_kube_cache_save(struct flb_kube *ctx);
+void flb_kube_cache_sync(struct flb_kube *ctx);
+void flb_kube_cache_revalidate(struct flb_kube *ctx,
+                               struct flb_kube_meta *meta);
+
+#endif
@@ -23,6 +23,7 @@
 #include <fluent-bit/flb_str.h>
 #include <fluent-bit/flb_filter.h>
 #include <fluent-bit/flb_hash.h>
+#include <fluent-bit/flb_metrics.h>
 #include <fluent-bit/flb_utils.h>
 #include <fluent-bit/flb_parser.h>
 #include <fluent-bit/flb_http_client.h>
@@ -33,6 +34,8 @@
 
 #include "kube_meta.h"
 #include "kube_conf.h"
+#include "kube_lookup.h"
+#include "kube_cache.h"
 
 struct flb_kube *flb_kube_conf_create(struct flb_filter_instance *i,
                                       struct flb_config *config)
@@ -51,6 +54,7 @@ struct flb_kube *flb_kube_conf_create(struct flb_filter_instance *i,
         return NULL;
     }
     ctx->config = config;
+    ctx->ins = i;
     ctx->merge_log = FLB_FALSE;
     ctx->annotations = FLB_TRUE;
     ctx->dummy_meta = FLB_FALSE;
@@ -186,13 +190,49 @@ struct flb_kube *flb_kube_conf_create(struct flb_filter_instance *i,
              ctx->api_https ? "https" : "http",
              ctx->api_host, ctx->api_port);
 
-    ctx->hash_table = flb_hash_create(FLB_HASH_EVICT_RANDOM,
-                                      FLB_HASH_TABLE_SIZE,
-                                      FLB_HASH_TABLE_SIZE);
+    /* Metadata cache: memory limit and time to live */
+    tmp = flb_filter_get_property("kube_meta_cache_size", i);
+    ret = flb_utils_size_to_bytes(tmp ? tmp : FLB_KUBE_CACHE_SIZE);
+    if (ret <= 0) {
+        flb_error("[filter_kube] invalid kube_meta_cache_size=%s, using "
+                  "default", tmp);
+        ret = flb_utils_size_to_bytes(FLB_KUBE_CACHE_SIZE);
+    }
+    ctx->cache_size = ret;
+
+    ctx->cache_ttl = 0;
+    tmp = flb_filter_get_property("kube_meta_cache_ttl", i);
+    if (tmp) {
+        ctx->cache_ttl = flb_utils_time_to_seconds(tmp);
+        if (ctx->cache_ttl < 0) {
+            ctx->cache_ttl = 0;
+        }
+    }
+
+    ctx->hash_table = flb_hash_create(FLB_HASH_EVICT_LRU,
+                                      FLB_HASH_TABLE_SIZE, -1);
     if (!ctx->hash_table) {
         flb_kube_conf_destroy(ctx);
         return NULL;
     }
+    flb_hash_set_max_size(ctx->hash_table, ctx->cache_size);
+    flb_hash_set_ttl(ctx->hash_table, ctx->cache_ttl);
+
+#ifdef FLB_HAVE_METRICS
+    if (i->metrics) {
+        flb_metrics_add(FLB_KUBE_METRIC_CACHE_HITS, "cache_hits", i->metrics);
+        flb_metrics_add(FLB_KUBE_METRIC_CACHE_MISSES, "cache_misses",
+                        i->metrics);
+        flb_metrics_add(FLB_KUBE_METRIC_CACHE_EXPIRED, "cache_expired",
+                        i->metrics);
+        flb_metrics_add(FLB_KUBE_METRIC_CACHE_EVICTIONS, "cache_evictions",
+                        i->metrics);
+        flb_metrics_add(FLB_KUBE_METRIC_CACHE_ENTRIES, "cache_entries",
+                        i->metrics);
+        flb_metrics_add(FLB_KUBE_METRIC_CACHE_BYTES, "cache_bytes",
+                        i->metrics);
+    }
+#endif
 
     /* Include Kubernetes Annotations in the final record */
     tmp = flb_filter_get_property("annotations", i);
@@ -272,6 +312,26 @@ struct flb_kube *flb_kube_conf_create(struct flb_filter_instance *i,
         }
     }
 
+    /* Metadata cache snapshot for warm restarts */
+    tmp = flb_filter_get_property("kube_meta_cache_file", i);
+    if (tmp) {
+        ctx->cache_file = flb_strdup(tmp);
+    }
+
+    /* Asynchronous API server lookups */
+    tmp = flb_filter_get_property("kube_meta_async", i);
+    if (tmp) {
+        ctx->lookup_async = flb_utils_bool(tmp);
+    }
+
+    tmp = flb_filter_get_property("kube_meta_wait", i);
+    if (tmp) {
+        ctx->lookup_wait = atoi(tmp);
+        if (ctx->lookup_wait < 0) {
+            ctx->lookup_wait = 0;
+        }
+    }
+
     /* Generate dummy metadata (only for test/dev purposes) */
     tmp = flb_filter_get_property("dummy_meta", i);
     if (tmp) {
@@ -289,9 +349,19 @@ void flb_kube_conf_destroy(struct flb_kube *ctx)
         return;
     }
 
+    /* Stop the lookup worker before releasing what it uses */
+    flb_kube_lookup_stop(ctx);
+
     if (ctx->hash_table) {
+        if (ctx->cache_file && ctx->cache_dirty == FLB_TRUE) {
+            flb_kube_cache_save(ctx);
+        }
         flb_hash_destroy(ctx->hash_table);
     }
+    if (ctx->restored) {
+        flb_hash_destroy(ctx->restored);
+    }
+    flb_free(ctx->cache_file);
 
     if (ctx->merge_log == FLB_TRUE) {
         flb_free(ctx->unesc_buf);
@@ -303,7 +373,7 @@ void flb_kube_conf_destroy(struct flb_kube *ctx)
 
     /* Destroy regex content only if a parser was not defined */
     if (ctx->parser == NULL) {
-        flb_regex_destroy(ctx->regex);
+        flb_regex_put(ctx->regex);
     }
 
     flb_free(ctx->api_host);
@@ -34,9 +34,20 @@
  *
  *  tag -> regex: pod name, container ID, container name, etc
  *
- * By default, we define a hash table for 256 entries.
+ * The hash table has 256 slots, the number of entries is bounded by the
+ * memory they use (kube_meta_cache_size), least recently used pods are
+ * evicted first. Entries can expire after kube_meta_cache_ttl seconds.
  */
 #define FLB_HASH_TABLE_SIZE 256
+#define FLB_KUBE_CACHE_SIZE "8M"
+
+/* Metrics */
+#define FLB_KUBE_METRIC_CACHE_HITS       100
+#define FLB_KUBE_METRIC_CACHE_MISSES     101
+#define FLB_KUBE_METRIC_CACHE_EXPIRED    102
+#define FLB_KUBE_METRIC_CACHE_EVICTIONS  103
+#define FLB_KUBE_METRIC_CACHE_ENTRIES    104
+#define FLB_KUBE_METRIC_CACHE_BYTES      105
 
 /*
  * When merging nested JSON strings from Docker logs, we need a temporal
@@ -81,6 +92,7 @@ struct flb_kube {
     size_t unesc_buf_size;
     size_t unesc_buf_len;
     char *unesc_buf;
+    char *unesc_str;          /* unesc_buf or the original string */
 
     /* JSON key (default 'log') */
     int merge_json_key_len;
@@ -114,8 +126,24 @@ struct flb_kube {
     char *auth;
     size_t auth_len;
 
+    /* Metadata cache */
+    size_t cache_size;
+    int cache_ttl;
+
+    /* Metadata cache snapshot */
+    char *cache_file;
+    int cache_dirty;           /* entries added since the last one   */
+    time_t cache_saved;        /* time of the last one               */
+    struct flb_hash *restored; /* restored entries not used yet      */
+
+    /* Asynchronous API server lookups */
+    int lookup_async;
+    int lookup_wait;           /* milliseconds */
+    struct flb_kube_lookup *lookup;
+
     struct flb_tls tls;
     struct flb_config *config;
+    struct flb_filter_instance *ins;
     struct flb_hash *hash_table;
     struct flb_upstream *upstream;
 };
@@ -0,0 +1,396 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_log.h>
+#include <fluent-bit/flb_str.h>
+#include <fluent-bit/flb_hash.h>
+#include <fluent-bit/flb_worker.h>
+
+#include <time.h>
+#include <errno.h>
+
+#include "kube_conf.h"
+#include "kube_meta.h"
+#include "kube_lookup.h"
+
+static inline int meta_str_dup(char **dst, char *src, int len)
+{
+    if (!src) {
+        *dst = NULL;
+        return 0;
+    }
+
+    *dst = flb_strndup(src, len);
+    if (!*dst) {
+        flb_errno();
+        return -1;
+    }
+    return 0;
+}
+
+static void request_destroy(struct flb_kube_request *r)
+{
+    flb_kube_meta_release(&r->meta);
+    if (r->buf) {
+        flb_free(r->buf);
+    }
+    flb_free(r);
+}
+
+/* The request keeps its own copy of the meta, it outlives the record */
+static struct flb_kube_request *request_create(struct flb_kube_meta *meta)
+{
+    int ret = 0;
+    struct flb_kube_meta *m;
+    struct flb_kube_request *r;
+
+    r = flb_calloc(1, sizeof(struct flb_kube_request));
+    if (!r) {
+        flb_errno();
+        return NULL;
+    }
+
+    m = &r->meta;
+    *m = *meta;
+    m->arena = NULL;
+
+    ret |= meta_str_dup(&m->namespace, meta->namespace, meta->namespace_len);
+    ret |= meta_str_dup(&m->podname, meta->podname, meta->podname_len);
+    ret |= meta_str_dup(&m->container_name, meta->container_name,
+                        meta->container_name_len);
+    ret |= meta_str_dup(&m->docker_id, meta->docker_id, meta->docker_id_len);
+    ret |= meta_str_dup(&m->container_hash, meta->container_hash,
+                        meta->container_hash_len);
+    ret |= meta_str_dup(&m->cache_key, meta->cache_key, meta->cache_key_len);
+    if (ret != 0) {
+        request_destroy(r);
+        return NULL;
+    }
+
+    return r;
+}
+
+static void lookup_worker(void *data)
+{
+    struct flb_kube *ctx = data;
+    struct flb_kube_lookup *lk = ctx->lookup;
+    struct flb_kube_request *r;
+
+    flb_debug("[filter_kube] lookup worker started");
+    flb_mem_scope_set(FLB_MEM_KUBERNETES);
+
+    pthread_mutex_lock(&lk->mutex);
+    while (1) {
+        while (lk->exit == FLB_FALSE && mk_list_is_empty(&lk->queue) == 0) {
+            pthread_cond_wait(&lk->cond, &lk->mutex);
+        }
+        if (lk->exit == FLB_TRUE) {
+            break;
+        }
+
+        r = mk_list_entry_first(&lk->queue, struct flb_kube_request, _head);
+        mk_list_del(&r->_head);
+        pthread_mutex_unlock(&lk->mutex);
+
+        r->ret = flb_kube_meta_fetch(ctx, &r->meta, &r->buf, &r->size);
+
+        pthread_mutex_lock(&lk->mutex);
+        mk_list_add(&r->_head, &lk->done);
+        __atomic_add_fetch(&lk->completed, 1, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&lk->done_cond);
+    }
+    pthread_mutex_unlock(&lk->mutex);
+
+    flb_debug("[filter_kube] lookup worker stopped");
+}
+
+/* Returns FLB_TRUE if a lookup for the meta cache key is queued */
+static int lookup_in_flight(struct flb_kube_lookup *lk,
+                            struct flb_kube_meta *meta, time_t *failed)
+{
+    int ret;
+    char *val;
+    size_t size;
+    time_t t;
+
+    ret = flb_hash_get(lk->pending, meta->cache_key, meta->cache_key_len,
+                       &val, &size);
+    if (ret == -1) {
+        *failed = 0;
+        return FLB_FALSE;
+    }
+
+    memcpy(&t, val, sizeof(time_t));
+    *failed = t;
+
+    return (t == 0) ? FLB_TRUE : FLB_FALSE;
+}
+
+/* Forget failed lookups, they are retried on the next miss */
+static void pending_purge(struct flb_kube_lookup *lk)
+{
+    time_t t;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct flb_hash_entry *entry;
+
+    mk_list_foreach_safe(head, tmp, &lk->pending->entries) {
+        entry = mk_list_entry(head, struct flb_hash_entry, _head_parent);
+        memcpy(&t, entry->val, sizeof(time_t));
+        if (t != 0) {
+            flb_hash_del(lk->pending, entry->key);
+        }
+    }
+}
+
+/* Queue a lookup for the meta unless one is running or failed recently */
+static int lookup_queue(struct flb_kube *ctx, struct flb_kube_meta *meta)
+{
+    int ret;
+    time_t t;
+    struct flb_kube_request *r;
+    struct flb_kube_lookup *lk = ctx->lookup;
+
+    ret = lookup_in_flight(lk, meta, &t);
+    if (ret == FLB_TRUE) {
+        return FLB_TRUE;
+    }
+
+    if (t != 0) {
+        if (time(NULL) - t < FLB_KUBE_LOOKUP_RETRY) {
+            return FLB_FALSE;
+        }
+    }
+    else if (lk->pending->total_count >= FLB_KUBE_LOOKUP_MAX) {
+        pending_purge(lk);
+        if (lk->pending->total_count >= FLB_KUBE_LOOKUP_MAX) {
+            flb_debug("[filter_kube] lookup queue full, skipping %s",
+                      meta->cache_key);
+            return FLB_FALSE;
+        }
+    }
+
+    r = request_create(meta);
+    if (!r) {
+        return FLB_FALSE;
+    }
+
+    t = 0;
+    ret = flb_hash_add(lk->pending, meta->cache_key, meta->cache_key_len,
+                       (char *) &t, sizeof(time_t));
+    if (ret == -1) {
+        request_destroy(r);
+        return FLB_FALSE;
+    }
+
+    pthread_mutex_lock(&lk->mutex);
+    mk_list_add(&r->_head, &lk->queue);
+    pthread_cond_signal(&lk->cond);
+    pthread_mutex_unlock(&lk->mutex);
+
+    return FLB_TRUE;
+}
+
+/* Refresh the metadata of a pod in the background */
+int flb_kube_lookup_refresh(struct flb_kube *ctx, struct flb_kube_meta *meta)
+{
+    if (!meta->cache_key) {
+        return FLB_FALSE;
+    }
+
+    return lookup_queue(ctx, meta);
+}
+
+/* Move the completed lookups into the metadata cache */
+void flb_kube_lookup_drain(struct flb_kube *ctx)
+{
+    time_t now;
+    struct mk_list done;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct flb_kube_request *r;
+    struct flb_kube_lookup *lk = ctx->lookup;
+
+    if (__atomic_load_n(&lk->completed, __ATOMIC_ACQUIRE) == 0) {
+        return;
+    }
+
+    mk_list_init(&done);
+    pthread_mutex_lock(&lk->mutex);
+    mk_list_foreach_safe(head, tmp, &lk->done) {
+        r = mk_list_entry(head, struct flb_kube_request, _head);
+        mk_list_del(&r->_head);
+        mk_list_add(&r->_head, &done);
+    }
+    __atomic_store_n(&lk->completed, 0, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&lk->mutex);
+
+    now = time(NULL);
+    mk_list_foreach_safe(head, tmp, &done) {
+        r = mk_list_entry(head, struct flb_kube_request, _head);
+        mk_list_del(&r->_head);
+
+        if (r->ret == 0) {
+            flb_hash_add(ctx->hash_table,
+                         r->meta.cache_key, r->meta.cache_key_len,
+                         r->buf, r->size);
+            flb_hash_del(lk->pending, r->meta.cache_key);
+            if (ctx->restored) {
+                flb_hash_del(ctx->restored, r->meta.cache_key);
+            }
+            ctx->cache_dirty = FLB_TRUE;
+        }
+        else {
+            flb_hash_add(lk->pending, r->meta.cache_key, r->meta.cache_key_len,
+                         (char *) &now, sizeof(time_t));
+        }
+        request_destroy(r);
+    }
+}
+
+/*
+ * Metadata for a cache miss: queue the lookup and wait up to 'kube_meta_wait'
+ * milliseconds for it. If it's not ready the expired metadata is used if
+ * any, otherwise the record goes without metadata.
+ */
+int flb_kube_lookup_get(struct flb_kube *ctx, struct flb_kube_meta *meta,
+                        char **out_buf, size_t *out_size)
+{
+    int id;
+    int ret;
+    int err = 0;
+    time_t failed;
+    struct timespec ts;
+    struct flb_kube_lookup *lk = ctx->lookup;
+
+    if (!meta->cache_key) {
+        return -1;
+    }
+
+    ret = lookup_queue(ctx, meta);
+    if (ret == FLB_TRUE && ctx->lookup_wait > 0) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec  += ctx->lookup_wait / 1000;
+        ts.tv_nsec += (ctx->lookup_wait % 1000) * 1000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+
+        while (ret == FLB_TRUE && err != ETIMEDOUT) {
+            pthread_mutex_lock(&lk->mutex);
+            while (lk->completed == 0 && err != ETIMEDOUT) {
+                err = pthread_cond_timedwait(&lk->done_cond, &lk->mutex, &ts);
+            }
+            pthread_mutex_unlock(&lk->mutex);
+
+            flb_kube_lookup_drain(ctx);
+            ret = lookup_in_flight(lk, meta, &failed);
+        }
+    }
+
+    id = flb_hash_get(ctx->hash_table, meta->cache_key, meta->cache_key_len,
+                      out_buf, out_size);
+    if (id >= 0) {
+        return id;
+    }
+
+    return flb_hash_get_stale(ctx->hash_table,
+                              meta->cache_key, meta->cache_key_len,
+                              out_buf, out_size);
+}
+
+int flb_kube_lookup_start(struct flb_kube *ctx)
+{
+    int ret;
+    struct flb_kube_lookup *lk;
+
+    lk = flb_calloc(1, sizeof(struct flb_kube_lookup));
+    if (!lk) {
+        flb_errno();
+        return -1;
+    }
+    pthread_mutex_init(&lk->mutex, NULL);
+    pthread_cond_init(&lk->cond, NULL);
+    pthread_cond_init(&lk->done_cond, NULL);
+    mk_list_init(&lk->queue);
+    mk_list_init(&lk->done);
+    ctx->lookup = lk;
+
+    lk->pending = flb_hash_create(FLB_HASH_EVICT_NONE, FLB_KUBE_LOOKUP_MAX, -1);
+    if (!lk->pending) {
+        flb_kube_lookup_stop(ctx);
+        return -1;
+    }
+
+    ret = flb_worker_create(lookup_worker, ctx, &lk->tid, ctx->config);
+    if (ret == -1) {
+        flb_error("[filter_kube] could not spawn lookup worker");
+        lk->tid = 0;
+        flb_kube_lookup_stop(ctx);
+        return -1;
+    }
+
+    flb_info("[filter_kube] asynchronous API server lookups, wait=%ims",
+             ctx->lookup_wait);
+    return 0;
+}
+
+void flb_kube_lookup_stop(struct flb_kube *ctx)
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct flb_kube_request *r;
+    struct flb_kube_lookup *lk = ctx->lookup;
+
+    if (!lk) {
+        return;
+    }
+
+    if (lk->tid) {
+        pthread_mutex_lock(&lk->mutex);
+        lk->exit = FLB_TRUE;
+        pthread_cond_signal(&lk->cond);
+        pthread_mutex_unlock(&lk->mutex);
+        pthread_join(lk->tid, NULL);
+    }
+
+    mk_list_foreach_safe(head, tmp, &lk->queue) {
+        r = mk_list_entry(head, struct flb_kube_request, _head);
+        mk_list_del(&r->_head);
+        request_destroy(r);
+    }
+    mk_list_foreach_safe(head, tmp, &lk->done) {
+        r = mk_list_entry(head, struct flb_kube_request, _head);
+        mk_list_del(&r->_head);
+        request_destroy(r);
+    }
+
+    if (lk->pending) {
+        flb_hash_destroy(lk->pending);
+    }
+    pthread_cond_destroy(&lk->done_cond);
+    pthread_cond_destroy(&lk->cond);
+    pthread_mutex_destroy(&lk->mutex);
+    flb_free(lk);
+    ctx->lookup = NULL;
+}
@@ -0,0 +1,70 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+
+#ifndef FLB_FILTER_KUBE_LOOKUP_H
+#define FLB_FILTER_KUBE_LOOKUP_H
+
+#include <pthread.h>
+#include <fluent-bit/flb_hash.h>
+
+#include "kube_meta.h"
+
+/* Max number of pods being looked up (queued, in flight or failed) */
+#define FLB_KUBE_LOOKUP_MAX    256
+
+/* Seconds to wait before retrying a failed lookup */
+#define FLB_KUBE_LOOKUP_RETRY  5
+
+/*
+ * Asynchronous API server lookups: a cache miss queues a request for the
+ * pod and the lookup worker fetches its metadata with blocking HTTP calls,
+ * out of the engine thread. Completed requests are moved into the metadata
+ * cache by the filter, so the cache is only used by the engine thread.
+ */
+struct flb_kube_request {
+    int ret;                        /* fetch result           */
+    char *buf;                      /* merged metadata        */
+    size_t size;
+    struct flb_kube_meta meta;      /* owned copy of the meta */
+    struct mk_list _head;           /* link to queue or done  */
+};
+
+struct flb_kube_lookup {
+    int exit;
+    int completed;                  /* requests in 'done'         */
+    pthread_t tid;                  /* worker thread ID           */
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;            /* worker: new request        */
+    pthread_cond_t done_cond;       /* filter: request completed  */
+    struct mk_list queue;
+    struct mk_list done;
+
+    /* cache key -> time of the last failure, 0 while queued */
+    struct flb_hash *pending;
+};
+
+int flb_kube_lookup_start(struct flb_kube *ctx);
+void flb_kube_lookup_stop(struct flb_kube *ctx);
+void flb_kube_lookup_drain(struct flb_kube *ctx);
+int flb_kube_lookup_refresh(struct flb_kube *ctx, struct flb_kube_meta *meta);
+int flb_kube_lookup_get(struct flb_kube *ctx, struct flb_kube_meta *meta,
+                        char **out_buf, size_t *out_size);
+
+#endif
@@ -18,12 +18,15 @@
  */
 
 #include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_arena.h>
 #include <fluent-bit/flb_hash.h>
 #include <fluent-bit/flb_regex.h>
 #include <fluent-bit/flb_io.h>
 #include <fluent-bit/flb_upstream.h>
 #include <fluent-bit/flb_http_client.h>
 #include <fluent-bit/flb_pack.h>
+#include <fluent-bit/flb_metrics.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -33,8 +36,10 @@
 #include "kube_conf.h"
 #include "kube_meta.h"
 #include "kube_property.h"
+#include "kube_lookup.h"
+#include "kube_cache.h"
 
-static int file_to_buffer(char *path, char **out_buf, size_t *out_size)
+int flb_kube_file_read(char *path, char **out_buf, size_t *out_size)
 {
     int ret;
     char *buf;
@@ -86,7 +91,7 @@ static int get_local_pod_info(struct flb_kube *ctx)
     char *hostname;
 
     /* Get the namespace name */
-    ret = file_to_buffer(FLB_KUBE_NAMESPACE, &ns, &ns_size);
+    ret = flb_kube_file_read(FLB_KUBE_NAMESPACE, &ns, &ns_size);
     if (ret == -1) {
         /*
          * If it fails, it's just informational, as likely the caller
@@ -97,7 +102,7 @@ static int get_local_pod_info(struct flb_kube *ctx)
     }
 
     /* If a namespace was recognized, a token is mandatory */
-    ret = file_to_buffer(ctx->token_file, &tk, &tk_size);
+    ret = flb_kube_file_read(ctx->token_file, &tk, &tk_size);
     if (ret == -1) {
         flb_warn("[filter_kube] cannot open %s", FLB_KUBE_TOKEN);
     }
@@ -210,37 +215,46 @@ static int get_api_server_info(struct flb_kube *ctx,
     return 0;
 }
 
+/* Strings of the metadata live in the arena of the filter when there is one */
+static char *meta_strndup(struct flb_kube_meta *meta, char *s, size_t len)
+{
+    if (meta->arena) {
+        return flb_arena_strndup(meta->arena, s, len);
+    }
+    return flb_strndup(s, len);
+}
+
 static void cb_results(unsigned char *name, unsigned char *value,
                        size_t vlen, void *data)
 {
     struct flb_kube_meta *meta = data;
 
     if (meta->podname == NULL && strcmp((char *) name, "pod_name") == 0) {
-        meta->podname = flb_strndup((char *) value, vlen);
+        meta->podname = meta_strndup(meta, (char *) value, vlen);
         meta->podname_len = vlen;
         meta->fields++;
     }
     else if (meta->namespace == NULL &&
              strcmp((char *) name, "namespace_name") == 0) {
-        meta->namespace = flb_strndup((char *) value, vlen);
+        meta->namespace = meta_strndup(meta, (char *) value, vlen);
         meta->namespace_len = vlen;
         meta->fields++;
     }
     else if (meta->container_name == NULL &&
              strcmp((char *) name, "container_name") == 0) {
-        meta->container_name = flb_strndup((char *) value, vlen);
+        meta->container_name = meta_strndup(meta, (char *) value, vlen);
         meta->container_name_len = vlen;
         meta->skip++;
     }
     else if (meta->docker_id == NULL &&
              strcmp((char *) name, "docker_id") == 0) {
-        meta->docker_id = flb_strndup((char *) value, vlen);
+        meta->docker_id = meta_strndup(meta, (char *) value, vlen);
         meta->docker_id_len = vlen;
         meta->skip++;
     }
     else if (meta->container_hash == NULL &&
              strcmp((char *) name, "container_hash") == 0) {
-        meta->container_hash = flb_strndup((char *) value, vlen);
+        meta->container_hash = meta_strndup(meta, (char *) value, vlen);
         meta->container_hash_len = vlen;
         meta->skip++;
     }
@@ -499,6 +513,7 @@ static inline int extract_meta(struct flb_kube *ctx, char *tag, int tag_len,
 
     /* Reset meta context */
     memset(meta, '\0', sizeof(struct flb_kube_meta));
+    meta->arena = flb_arena_current();
 
     /* Journald */
     if (ctx->use_journal == FLB_TRUE) {
@@ -557,7 +572,13 @@ static inline int extract_meta(struct flb_kube *ctx, char *tag, int tag_len,
     /* Compose API server cache key */
     if (meta->podname && meta->namespace) {
         meta->cache_key_len = meta->podname_len + meta->namespace_len + 1;
-        meta->cache_key = flb_malloc(meta->cache_key_len + 1);
+        if (meta->arena) {
+            meta->cache_key = flb_arena_alloc(meta->arena,
+                                              meta->cache_key_len + 1);
+        }
+        else {
+            meta->cache_key = flb_malloc(meta->cache_key_len + 1);
+        }
         if (!meta->cache_key) {
             flb_errno();
             return -1;
@@ -585,10 +606,11 @@ static inline int extract_meta(struct flb_kube *ctx, char *tag, int tag_len,
 
 /*
  * Given a fixed meta data (namespace and podname), get API server information
- * and merge buffers.
+ * and merge buffers. It does blocking HTTP calls, with asynchronous lookups
+ * it runs in the lookup worker.
  */
-static int get_and_merge_meta(struct flb_kube *ctx, struct flb_kube_meta *meta,
-                              char **out_buf, size_t *out_size)
+int flb_kube_meta_fetch(struct flb_kube *ctx, struct flb_kube_meta *meta,
+                        char **out_buf, size_t *out_size)
 {
     int ret;
     char *api_buf;
@@ -698,6 +720,11 @@ int flb_kube_meta_init(struct flb_kube *ctx, struct flb_config *config)
         return 0;
     }
 
+    /* Start with the metadata of the previous run */
+    if (ctx->cache_file) {
+        flb_kube_cache_load(ctx);
+    }
+
     /* Gather local info */
     ret = get_local_pod_info(ctx);
     if (ret == FLB_TRUE) {
@@ -731,12 +758,34 @@ int flb_kube_meta_init(struct flb_kube *ctx, struct flb_config *config)
     return 0;
 }
 
-int flb_kube_meta_get(struct flb_kube *ctx,
-                      char *tag, int tag_len,
-                      char *data, size_t data_size,
-                      char **out_buf, size_t *out_size,
-                      struct flb_kube_meta *meta,
-                      struct flb_kube_props *props)
+/* Publish the metadata cache counters on the filter instance metrics */
+static inline void cache_metrics(struct flb_kube *ctx)
+{
+#ifdef FLB_HAVE_METRICS
+    struct flb_hash *ht = ctx->hash_table;
+    struct flb_metrics *metrics = ctx->ins->metrics;
+
+    if (!metrics) {
+        return;
+    }
+
+    flb_metrics_set(FLB_KUBE_METRIC_CACHE_HITS, ht->hits, metrics);
+    flb_metrics_set(FLB_KUBE_METRIC_CACHE_MISSES, ht->misses, metrics);
+    flb_metrics_set(FLB_KUBE_METRIC_CACHE_EXPIRED, ht->expired, metrics);
+    flb_metrics_set(FLB_KUBE_METRIC_CACHE_EVICTIONS, ht->evictions, metrics);
+    flb_metrics_set(FLB_KUBE_METRIC_CACHE_ENTRIES, ht->total_count, metrics);
+    flb_metrics_set(FLB_KUBE_METRIC_CACHE_BYTES, ht->total_size, metrics);
+#else
+    (void) ctx;
+#endif
+}
+
+static int kube_meta_get(struct flb_kube *ctx,
+                         char *tag, int tag_len,
+                         char *data, size_t data_size,
+                         char **out_buf, size_t *out_size,
+                         struct flb_kube_meta *meta,
+                         struct flb_kube_props *props)
 {
     int id;
     int ret;
@@ -756,22 +805,48 @@ int flb_kube_meta_get(struct flb_kube *ctx,
         return -1;
     }
 
+    /* Take the metadata fetched by the lookup worker */
+    if (ctx->lookup) {
+        flb_kube_lookup_drain(ctx);
+    }
+
     /* Check if we have some data associated to the cache key */
     ret = flb_hash_get(ctx->hash_table,
                        meta->cache_key, meta->cache_key_len,
                        &hash_meta_buf, &hash_meta_size);
-    if (ret == -1) {
+    if (ret >= 0 && ctx->restored) {
+        flb_kube_cache_revalidate(ctx, meta);
+    }
+    else if (ret == -1 && ctx->lookup) {
+        ret = flb_kube_lookup_get(ctx, meta, &hash_meta_buf, &hash_meta_size);
+        if (ret == -1) {
+            cache_metrics(ctx);
+            return -1;
+        }
+    }
+    else if (ret == -1) {
         /* Retrieve API server meta and merge with local meta */
-        ret = get_and_merge_meta(ctx, meta,
+        ret = flb_kube_meta_fetch(ctx, meta,
                                  &hash_meta_buf, &hash_meta_size);
         if (ret == -1) {
-            return -1;
+            /* API server unavailable: keep using expired metadata if any */
+            ret = flb_hash_get_stale(ctx->hash_table,
+                                     meta->cache_key, meta->cache_key_len,
+                                     &hash_meta_buf, &hash_meta_size);
+            if (ret == -1) {
+                cache_metrics(ctx);
+                return -1;
+            }
+            flb_debug("[filter_kube] using expired metadata for %s",
+                      meta->cache_key);
+            goto cached;
         }
 
         id = flb_hash_add(ctx->hash_table,
                           meta->cache_key, meta->cache_key_len,
                           hash_meta_buf, hash_meta_size);
         if (id >= 0) {
+            ctx->cache_dirty = FLB_TRUE;
             /*
              * Release the original buffer created on extract_meta() as a new
              * copy have been generated into the hash table, then re-set
@@ -783,6 +858,10 @@ int flb_kube_meta_get(struct flb_kube *ctx,
         }
     }
 
+ cached:
+    cache_metrics(ctx);
+    flb_kube_cache_sync(ctx);
+
     /*
      * The retrieved buffer may have two serialized items:
      *
@@ -813,10 +892,35 @@ int flb_kube_meta_get(struct flb_kube *ctx,
     return 0;
 }
 
+/* The metadata and its cache are charged to the kubernetes subsystem */
+int flb_kube_meta_get(struct flb_kube *ctx,
+                      char *tag, int tag_len,
+                      char *data, size_t data_size,
+                      char **out_buf, size_t *out_size,
+                      struct flb_kube_meta *meta,
+                      struct flb_kube_props *props)
+{
+    int ret;
+    FLB_MEM_SCOPE_ENTER(FLB_MEM_KUBERNETES);
+
+    ret = kube_meta_get(ctx, tag, tag_len, data, data_size,
+                        out_buf, out_size, meta, props);
+    FLB_MEM_SCOPE_LEAVE();
+    return ret;
+}
+
 int flb_kube_meta_release(struct flb_kube_meta *meta)
 {
     int r = 0;
 
+    /* Arena strings are released by the filters chain */
+    if (meta->arena) {
+        r += (meta->namespace != NULL) + (meta->podname != NULL) +
+            (meta->container_name != NULL) + (meta->docker_id != NULL) +
+            (meta->container_hash != NULL);
+        return r;
+    }
+
     if (meta->namespace) {
         flb_free(meta->namespace);
         r++;
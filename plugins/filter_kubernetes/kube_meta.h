@@ -23,6 +23,7 @@
 #include "kube_props.h"
 
 struct flb_kube;
+struct flb_arena;
 
 struct flb_kube_meta {
     int fields;
@@ -43,6 +44,8 @@ struct flb_kube_meta {
     char *container_hash;   /* set only on Systemd mode */
 
     char *cache_key;
+
+    struct flb_arena *arena;  /* strings owner, if NULL they are on the heap */
 };
 
 /* Constant Kubernetes paths */
@@ -53,8 +56,10 @@ struct flb_kube_meta {
 #define FLB_KUBE_API_PORT 443
 #define FLB_KUBE_API_FMT "/api/v1/namespaces/%s/pods/%s"
 
+int flb_kube_file_read(char *path, char **out_buf, size_t *out_size);
 int flb_kube_meta_init(struct flb_kube *ctx, struct flb_config *config);
-int flb_kube_meta_fetch(struct flb_kube *ctx);
+int flb_kube_meta_fetch(struct flb_kube *ctx, struct flb_kube_meta *meta,
+                        char **out_buf, size_t *out_size);
 int flb_kube_meta_get(struct flb_kube *ctx,
                       char *tag, int tag_len,
                       char *data, size_t data_size,
@@ -28,10 +28,10 @@ int flb_kube_regex_init(struct flb_kube *ctx)
     /* If a custom parser is not set, use the defaults */
     if (!ctx->parser) {
         if (ctx->use_journal == FLB_TRUE) {
-            ctx->regex = flb_regex_create((unsigned char *) KUBE_JOURNAL_TO_REGEX);
+            ctx->regex = flb_regex_get((unsigned char *) KUBE_JOURNAL_TO_REGEX);
         }
         else {
-            ctx->regex = flb_regex_create((unsigned char *) KUBE_TAG_TO_REGEX);
+            ctx->regex = flb_regex_get((unsigned char *) KUBE_TAG_TO_REGEX);
         }
     }
 
@@ -20,10 +20,14 @@
 #include <fluent-bit/flb_filter.h>
 #include <fluent-bit/flb_utils.h>
 #include <fluent-bit/flb_pack.h>
+#include <fluent-bit/flb_mp.h>
 #include <fluent-bit/flb_parser.h>
+#include <fluent-bit/flb_arena.h>
+#include <fluent-bit/flb_unescape.h>
 
 #include "kube_conf.h"
 #include "kube_meta.h"
+#include "kube_lookup.h"
 #include "kube_regex.h"
 #include "kube_property.h"
 
@@ -35,36 +39,7 @@
 #define MERGE_PARSED      1 /* merge parsed string (log_buf)             */
 #define MERGE_BINARY      2 /* merge direct binary object (v)            */
 
-static int unescape_string(char *buf, int buf_len, char **unesc_buf)
-{
-    int i = 0;
-    int j = 0;
-    char *p;
-    char n;
-
-    p = *unesc_buf;
-    while (i < buf_len) {
-        if (buf[i] == '\\') {
-            if (i + 1 < buf_len) {
-                n = buf[i + 1];
-                if (n != 'a' && n != 'b' &&
-                    n != 't' && n != 'n' &&
-                    n != 'v' && n != 'f' &&
-                    n != 'r') {
-                    i++;
-                }
-            }
-            else {
-                i++;
-            }
-        }
-        p[j++] = buf[i++];
-    }
-    p[j] = '\0';
-    return j;
-}
-
-static int merge_log_handler(msgpack_object o,
+static int merge_log_handler(const char *str, int str_size,
                              struct flb_parser *parser,
                              void **out_buf, size_t *out_size,
                              struct flb_time *log_time,
@@ -83,8 +58,8 @@ static int merge_log_handler(msgpack_object o,
     ctx->unesc_buf_len = 0;
 
     /* Allocate more space if required */
-    if (o.via.str.size >= ctx->unesc_buf_size) {
-        new_size = o.via.str.size + 1;
+    if (str_size >= ctx->unesc_buf_size) {
+        new_size = str_size + 1;
         tmp = flb_realloc(ctx->unesc_buf, new_size);
         if (tmp) {
             ctx->unesc_buf = tmp;
@@ -100,16 +75,15 @@ static int merge_log_handler(msgpack_object o,
      * Check where to cut the string if common ending bytes like \r or \n
      * exists.
      */
-    size = o.via.str.size;
+    size = str_size;
     for (i = size - 1; i > 0; i--) {
-        if (o.via.str.ptr[i] == '\n') {
+        if (str[i] == '\n') {
             size -= 1;
             i--;
             continue;
         }
 
-        if (o.via.str.ptr[i - 1] == '\\' &&
-            (o.via.str.ptr[i] == 'n' || o.via.str.ptr[i] == 'r')) {
+        if (str[i - 1] == '\\' && (str[i] == 'n' || str[i] == 'r')) {
             size -= 2;
             i--;
         }
@@ -118,14 +92,24 @@ static int merge_log_handler(msgpack_object o,
         }
     }
 
-    /* Unescape application string */
-    unesc_len = unescape_string((char *) o.via.str.ptr,
-                                size, &ctx->unesc_buf);
-    ctx->unesc_buf_len = unesc_len;
+    /*
+     * Unescape application string, most logs have nothing to unescape and
+     * are used in place.
+     */
+    if (flb_unescape_span(str, size, FLB_UNESCAPE_KEEP_CONTROL) == size) {
+        ctx->unesc_str = (char *) str;
+        ctx->unesc_buf_len = size;
+    }
+    else {
+        ctx->unesc_str = ctx->unesc_buf;
+        ctx->unesc_buf_len = flb_unescape(str, size, ctx->unesc_buf,
+                                          FLB_UNESCAPE_KEEP_CONTROL);
+    }
+    unesc_len = ctx->unesc_buf_len;
 
     ret = -1;
     if (parser) {
-        ret = flb_parser_do(parser, ctx->unesc_buf, unesc_len,
+        ret = flb_parser_do(parser, ctx->unesc_str, unesc_len,
                             out_buf, out_size, log_time);
         if (ret >= 0) {
             if (flb_time_to_double(log_time) == 0) {
@@ -135,7 +119,7 @@ static int merge_log_handler(msgpack_object o,
         }
     }
     else {
-        ret = flb_pack_json(ctx->unesc_buf, unesc_len,
+        ret = flb_pack_json(ctx->unesc_str, unesc_len,
                             (char **) out_buf, out_size);
     }
 
@@ -178,210 +162,230 @@ static int cb_kube_init(struct flb_filter_instance *f_ins,
      */
     flb_kube_meta_init(ctx, config);
 
+    /* Move the API server lookups out of the engine thread */
+    if (ctx->lookup_async == FLB_TRUE && ctx->dummy_meta == FLB_FALSE) {
+        ret = flb_kube_lookup_start(ctx);
+        if (ret == -1) {
+            flb_warn("[filter_kube] using synchronous API server lookups");
+        }
+    }
+
     return 0;
 }
 
-static int pack_map_content(msgpack_packer *pck, msgpack_sbuffer *sbuf,
-                            msgpack_object source_map,
-                            char *kube_buf, size_t kube_size,
-                            struct flb_kube_meta *meta,
-                            struct flb_parser *parser,
-                            struct flb_kube *ctx)
+/*
+ * Compose the 'kubernetes' key and its value: the entries of the cached
+ * metadata map are copied as they are and the container fields taken from
+ * the Tag are appended. It's done once per chunk (once per record with
+ * Journald) so records get the whole fragment with a single copy.
+ */
+static int pack_kube_fragment(struct flb_arena_buf *sbuf,
+                              char *kube_buf, size_t kube_size,
+                              struct flb_kube_meta *meta)
 {
-    int i;
-    int map_size;
+    int ret;
+    uint32_t count;
+    size_t hdr;
+    msgpack_packer pck;
+
+    ret = flb_mp_map_header(kube_buf, kube_size, &count, &hdr);
+    if (ret == -1) {
+        return -1;
+    }
+
+    msgpack_packer_init(&pck, sbuf, flb_arena_buf_write);
+    msgpack_pack_str(&pck, 10);
+    msgpack_pack_str_body(&pck, "kubernetes", 10);
+    msgpack_pack_map(&pck, count + meta->skip);
+    flb_arena_buf_write(sbuf, kube_buf + hdr, kube_size - hdr);
+
+    if (meta->container_name != NULL) {
+        msgpack_pack_str(&pck, 14);
+        msgpack_pack_str_body(&pck, "container_name", 14);
+        msgpack_pack_str(&pck, meta->container_name_len);
+        msgpack_pack_str_body(&pck, meta->container_name,
+                              meta->container_name_len);
+    }
+    if (meta->docker_id != NULL) {
+        msgpack_pack_str(&pck, 9);
+        msgpack_pack_str_body(&pck, "docker_id", 9);
+        msgpack_pack_str(&pck, meta->docker_id_len);
+        msgpack_pack_str_body(&pck, meta->docker_id,
+                              meta->docker_id_len);
+    }
+    if (meta->container_hash != NULL) {
+        msgpack_pack_str(&pck, 14);
+        msgpack_pack_str_body(&pck, "container_hash", 14);
+        msgpack_pack_str(&pck, meta->container_hash_len);
+        msgpack_pack_str_body(&pck, meta->container_hash,
+                              meta->container_hash_len);
+    }
+
+    return 0;
+}
+
+/*
+ * Pack a record [time, map] appending the merged log and the Kubernetes
+ * fragment. The record is not unpacked: the time and the map entries are
+ * copied as raw bytes, only the 'log' value is re-packed when it was
+ * unescaped, and the merged log entries are spliced from the parser output.
+ */
+static int pack_record(msgpack_packer *pck, msgpack_sbuffer *sbuf,
+                       const char *rec, size_t rec_size,
+                       struct flb_arena_buf *kube, struct flb_parser *parser,
+                       struct flb_kube *ctx)
+{
+    int ret;
+    uint32_t i;
+    uint32_t count;
+    uint32_t new_count;
+    uint32_t log_count = 0;
+    uint32_t len;
     int merge_status = -1;
-    int new_map_size = 0;
-    int log_index = -1;
-    int log_buf_entries = 0;
-    size_t off = 0;
-    void *log_buf = NULL;
+    size_t hdr;
+    size_t size;
+    size_t time_size;
+    size_t map_size;
+    size_t log_hdr = 0;
     size_t log_size = 0;
-    msgpack_unpacked result;
-    msgpack_object k;
-    msgpack_object v;
-    msgpack_object root;
+    void *log_buf = NULL;
+    const char *str;
+    const char *p;
+    const char *end;
+    const char *map;
+    const char *entries;
+    const char *log_val = NULL;
+    const char *log_entries = NULL;
+    size_t log_val_size = 0;
     struct flb_time log_time = {0};
 
-    /* Original map size */
-    map_size = source_map.via.map.size;
+    /* Records are a fixed array of two entries: time and map */
+    if (rec_size < 1 || (unsigned char) rec[0] != 0x92) {
+        return -1;
+    }
+    ret = flb_mp_object_size(rec + 1, rec_size - 1, &time_size);
+    if (ret == -1) {
+        return -1;
+    }
+
+    map = rec + 1 + time_size;
+    map_size = rec_size - 1 - time_size;
+    ret = flb_mp_map_header(map, map_size, &count, &hdr);
+    if (ret == -1) {
+        return -1;
+    }
+    entries = map + hdr;
+    end = map + map_size;
 
     /* If merge_log is enabled, we need to lookup the 'log' field */
     if (ctx->merge_log == FLB_TRUE) {
-        for (i = 0; i < map_size; i++) {
-            k = source_map.via.map.ptr[i].key;
-
-            /* Validate 'log' field */
-            if (k.via.str.size == 3 &&
-                strncmp(k.via.str.ptr, "log", 3) == 0) {
-                log_index = i;
+        p = entries;
+        for (i = 0; i < count; i++) {
+            if (flb_mp_str(p, end - p, &str, &len, &size) == 0 &&
+                len == 3 && strncmp(str, "log", 3) == 0) {
+                log_val = p + size;
+                ret = flb_mp_object_size(log_val, end - log_val,
+                                         &log_val_size);
+                if (ret == -1) {
+                    return -1;
+                }
                 break;
             }
+            if (flb_mp_object_size(p, end - p, &size) == -1) {
+                return -1;
+            }
+            p += size;
+            if (flb_mp_object_size(p, end - p, &size) == -1) {
+                return -1;
+            }
+            p += size;
         }
     }
 
-    if (flb_time_to_double(&log_time) == 0) {
-        flb_time_get(&log_time);
-    }
-
     /*
-     * If a log_index exists, the application log content inside the Docker JSON
-     * map is a escaped string. Proceed to reserve a temporal buffer and create
-     * an unescaped version.
+     * If a 'log' field exists, the application log content inside the Docker
+     * JSON map is a escaped string. Proceed to reserve a temporal buffer and
+     * create an unescaped version.
      */
-    if (log_index != -1) {
-        v = source_map.via.map.ptr[log_index].val;
-        if (v.type == MSGPACK_OBJECT_STR) {
-            merge_status = merge_log_handler(v, parser,
+    if (log_val) {
+        if (flb_mp_str(log_val, log_val_size, &str, &len, &size) == 0) {
+            merge_status = merge_log_handler(str, len, parser,
                                              &log_buf, &log_size, &log_time,
                                              ctx);
+            if (merge_status == MERGE_PARSED) {
+                ret = flb_mp_map_header(log_buf, log_size,
+                                        &log_count, &log_hdr);
+                if (ret == -1) {
+                    /* not a map, e.g: a JSON array */
+                    merge_status = MERGE_UNESCAPED;
+                    log_count = 0;
+                }
+                else {
+                    log_entries = (char *) log_buf + log_hdr;
+                    log_size -= log_hdr;
+                }
+            }
         }
-        else if (v.type == MSGPACK_OBJECT_MAP) {
+        else if (flb_mp_map_header(log_val, log_val_size,
+                                   &log_count, &log_hdr) == 0) {
             /* This is the easiest way, no extra processing required */
             merge_status = MERGE_BINARY;
+            log_entries = log_val + log_hdr;
+            log_size = log_val_size - log_hdr;
         }
     }
-    else {
-
-    }
 
     /* Determinate the size of the new map */
-    new_map_size = map_size;
-
-    /* If a merged json exists, check the number of entries in that new map */
-    if (log_index != -1) {
-        if (merge_status == MERGE_PARSED) {
-            off = 0;
-            msgpack_unpacked_init(&result);
-            msgpack_unpack_next(&result, log_buf, log_size, &off);
-            root = result.data;
-            log_buf_entries = root.via.map.size;
-            msgpack_unpacked_destroy(&result);
+    new_count = count;
+    if (log_count > 0) {
+        if (ctx->merge_json_key != NULL) {
+            /* One new key that will hold the original log entries */
+            new_count++;
         }
-        else if (merge_status == MERGE_BINARY) {
-            /* object 'v' represents the original binary log */
-            log_buf_entries = v.via.map.size;
+        else {
+            new_count += log_count;
         }
     }
-
-    /* Kubernetes metadata */
-    if (kube_buf && kube_size > 0) {
-        new_map_size++;
+    if (kube->size > 0) {
+        new_count++;
     }
 
-    /* Start packaging the final map */
-    if (ctx->merge_json_key != NULL) {
-        /* Make room for one new key that will hold the original log entries */
-        new_map_size++;
+    msgpack_pack_array(pck, 2);
+    msgpack_sbuffer_write(sbuf, rec + 1, time_size);
+    msgpack_pack_map(pck, new_count);
+
+    /*
+     * Original map: if the 'log' field was unescaped, re-pack the new string
+     * version to avoid multiple escape sequences in outgoing plugins.
+     */
+    if (merge_status == MERGE_UNESCAPED || merge_status == MERGE_PARSED) {
+        msgpack_sbuffer_write(sbuf, entries, log_val - entries);
+        msgpack_pack_str(pck, ctx->unesc_buf_len);
+        msgpack_pack_str_body(pck, ctx->unesc_str, ctx->unesc_buf_len);
+        p = log_val + log_val_size;
+        msgpack_sbuffer_write(sbuf, p, end - p);
     }
     else {
-        new_map_size += log_buf_entries;
-    }
-    msgpack_pack_map(pck, new_map_size);
-
-    /* Original map */
-    for (i = 0; i < map_size; i++) {
-        k = source_map.via.map.ptr[i].key;
-        v = source_map.via.map.ptr[i].val;
-
-        /*
-         * If the original 'log' field was unescaped and converted to
-         * msgpack properly, re-pack the new string version to avoid
-         * multiple escape sequences in outgoing plugins.
-         */
-        if (log_index == i &&
-            (merge_status == MERGE_UNESCAPED || merge_status == MERGE_PARSED)) {
-            msgpack_pack_object(pck, k);
-            msgpack_pack_str(pck, ctx->unesc_buf_len);
-            msgpack_pack_str_body(pck, ctx->unesc_buf, ctx->unesc_buf_len);
-        }
-        else { /* MERGE_BINARY ? */
-            msgpack_pack_object(pck, k);
-            msgpack_pack_object(pck, v);
-        }
+        msgpack_sbuffer_write(sbuf, entries, end - entries);
     }
 
     /* Merge Log */
-    if (log_index != -1) {
-        if (merge_status == MERGE_PARSED) {
-            if (ctx->merge_json_key && log_buf_entries > 0) {
-                msgpack_pack_str(pck, ctx->merge_json_key_len);
-                msgpack_pack_str_body(pck, ctx->merge_json_key,
-                                      ctx->merge_json_key_len);
-                msgpack_pack_map(pck, log_buf_entries);
-            }
-
-            off = 0;
-            msgpack_unpacked_init(&result);
-            msgpack_unpack_next(&result, log_buf, log_size, &off);
-            root = result.data;
-            for (i = 0; i < log_buf_entries; i++) {
-                k = root.via.map.ptr[i].key;
-                v = root.via.map.ptr[i].val;
-                msgpack_pack_object(pck, k);
-                msgpack_pack_object(pck, v);
-            }
-            msgpack_unpacked_destroy(&result);
-            flb_free(log_buf);
-        }
-        else if (merge_status == MERGE_BINARY) {
-            msgpack_object bin_map;
-            bin_map = source_map.via.map.ptr[log_index].val;
-            for (i = 0; i < bin_map.via.map.size; i++) {
-                k = bin_map.via.map.ptr[i].key;
-                v = bin_map.via.map.ptr[i].val;
-                msgpack_pack_object(pck, k);
-                msgpack_pack_object(pck, v);
-            }
+    if (log_count > 0) {
+        if (ctx->merge_json_key != NULL) {
+            msgpack_pack_str(pck, ctx->merge_json_key_len);
+            msgpack_pack_str_body(pck, ctx->merge_json_key,
+                                  ctx->merge_json_key_len);
+            msgpack_pack_map(pck, log_count);
         }
+        msgpack_sbuffer_write(sbuf, log_entries, log_size);
+    }
+    if (log_buf) {
+        flb_free(log_buf);
     }
 
     /* Kubernetes */
-    if (kube_buf && kube_size > 0) {
-        msgpack_pack_str(pck, 10);
-        msgpack_pack_str_body(pck, "kubernetes", 10);
-
-        off = 0;
-        msgpack_unpacked_init(&result);
-        msgpack_unpack_next(&result, kube_buf, kube_size, &off);
-        root = result.data;
-
-        /* root points to a map, calc the final size */
-        map_size = root.via.map.size;
-        map_size += meta->skip;
-
-        /* Pack cached kube buf entries */
-        msgpack_pack_map(pck, map_size);
-        for (i = 0; i < root.via.map.size; i++) {
-            k = root.via.map.ptr[i].key;
-            v = root.via.map.ptr[i].val;
-            msgpack_pack_object(pck, k);
-            msgpack_pack_object(pck, v);
-        }
-        msgpack_unpacked_destroy(&result);
-
-        /* Pack meta */
-        if (meta->container_name != NULL) {
-            msgpack_pack_str(pck, 14);
-            msgpack_pack_str_body(pck, "container_name", 14);
-            msgpack_pack_str(pck, meta->container_name_len);
-            msgpack_pack_str_body(pck, meta->container_name,
-                                  meta->container_name_len);
-        }
-        if (meta->docker_id != NULL) {
-            msgpack_pack_str(pck, 9);
-            msgpack_pack_str_body(pck, "docker_id", 9);
-            msgpack_pack_str(pck, meta->docker_id_len);
-            msgpack_pack_str_body(pck, meta->docker_id,
-                                  meta->docker_id_len);
-        }
-        if (meta->container_hash != NULL) {
-            msgpack_pack_str(pck, 14);
-            msgpack_pack_str_body(pck, "container_hash", 14);
-            msgpack_pack_str(pck, meta->container_hash_len);
-            msgpack_pack_str_body(pck, meta->container_hash,
-                                  meta->container_hash_len);
-        }
+    if (kube->size > 0) {
+        msgpack_sbuffer_write(sbuf, kube->data, kube->size);
     }
 
     return 0;
@@ -395,14 +399,12 @@ static int cb_kube_filter(void *data, size_t bytes,
                           struct flb_config *config)
 {
     int ret;
-    size_t pre = 0;
     size_t off = 0;
+    size_t rec_size;
+    char *rec;
     char *cache_buf = NULL;
     size_t cache_size = 0;
-    msgpack_unpacked result;
-    msgpack_object time;
-    msgpack_object map;
-    msgpack_object root;
+    struct flb_arena_buf kube_sbuf;
     msgpack_sbuffer tmp_sbuf;
     msgpack_packer tmp_pck;
     struct flb_parser *parser = NULL;
@@ -412,6 +414,9 @@ static int cb_kube_filter(void *data, size_t bytes,
     (void) f_ins;
     (void) config;
 
+    /* The fragment is only needed while the chunk is packed */
+    flb_arena_buf_init(&kube_sbuf, flb_arena_current());
+
     if (ctx->use_journal == FLB_FALSE) {
         /* Check if we have some cached metadata for the incoming events */
         ret = flb_kube_meta_get(ctx,
@@ -419,6 +424,7 @@ static int cb_kube_filter(void *data, size_t bytes,
                                 data, bytes,
                                 &cache_buf, &cache_size, &meta, &props);
         if (ret == -1) {
+            flb_kube_meta_release(&meta);
             flb_kube_prop_destroy(&props);
             return FLB_FILTER_NOTOUCH;
         }
@@ -430,22 +436,39 @@ static int cb_kube_filter(void *data, size_t bytes,
         if (props.exclude == FLB_TRUE) {
             *out_buf   = NULL;
             *out_bytes = 0;
+            if (ctx->dummy_meta == FLB_TRUE) {
+                flb_free(cache_buf);
+            }
+            flb_kube_meta_release(&meta);
             flb_kube_prop_destroy(&props);
             return FLB_FILTER_MODIFIED;
         }
+
+        /* All records come from the same container */
+        ret = pack_kube_fragment(&kube_sbuf, cache_buf, cache_size, &meta);
+        if (ctx->dummy_meta == FLB_TRUE) {
+            flb_free(cache_buf);
+        }
+        flb_kube_meta_release(&meta);
+        flb_kube_prop_destroy(&props);
+        if (ret == -1) {
+            flb_arena_buf_destroy(&kube_sbuf);
+            return FLB_FILTER_NOTOUCH;
+        }
     }
 
     /* Create temporal msgpack buffer */
     msgpack_sbuffer_init(&tmp_sbuf);
     msgpack_packer_init(&tmp_pck, &tmp_sbuf, msgpack_sbuffer_write);
 
-    /* Iterate each item array and append meta */
-    msgpack_unpacked_init(&result);
-    while (msgpack_unpack_next(&result, data, bytes, &off)) {
-        root = result.data;
-        if (root.type != MSGPACK_OBJECT_ARRAY) {
-            continue;
+    /* Iterate each record and append meta */
+    while (off < bytes) {
+        ret = flb_mp_object_size((char *) data + off, bytes - off, &rec_size);
+        if (ret == -1) {
+            break;
         }
+        rec = (char *) data + off;
+        off += rec_size;
 
         /*
          * Journal entries can be origined by different Pods, so we are forced
@@ -457,15 +480,17 @@ static int cb_kube_filter(void *data, size_t bytes,
         if (ctx->use_journal == FLB_TRUE) {
             parser = NULL;
             cache_buf = NULL;
+            kube_sbuf.size = 0;
             memset(&props, '\0', sizeof(struct flb_kube_props));
 
             ret = flb_kube_meta_get(ctx,
                                     tag, tag_len,
-                                    data + pre, off - pre,
+                                    rec, rec_size,
                                     &cache_buf, &cache_size, &meta, &props);
             if (ret == -1) {
                 msgpack_sbuffer_destroy(&tmp_sbuf);
-                msgpack_unpacked_destroy(&result);
+                flb_arena_buf_destroy(&kube_sbuf);
+                flb_kube_meta_release(&meta);
                 flb_kube_prop_destroy(&props);
                 return FLB_FILTER_NOTOUCH;
             }
@@ -474,58 +499,40 @@ static int cb_kube_filter(void *data, size_t bytes,
                 parser = flb_parser_get(props.parser, config);
             }
 
-            if (props.exclude == FLB_TRUE) {
-                /* Skip this record */
-                continue;
+            ret = 0;
+            if (props.exclude == FLB_FALSE) {
+                ret = pack_kube_fragment(&kube_sbuf, cache_buf, cache_size,
+                                         &meta);
             }
-
-            pre = off;
-        }
-
-        /* get time and map */
-        time = root.via.array.ptr[0];
-        map  = root.via.array.ptr[1];
-
-        /* Compose the new array */
-        msgpack_pack_array(&tmp_pck, 2);
-        msgpack_pack_object(&tmp_pck, time);
-
-        ret = pack_map_content(&tmp_pck, &tmp_sbuf,
-                               map,
-                               cache_buf, cache_size,
-                               &meta, parser, ctx);
-        if (ret != 0) {
-            msgpack_sbuffer_destroy(&tmp_sbuf);
-            msgpack_unpacked_destroy(&result);
             if (ctx->dummy_meta == FLB_TRUE) {
                 flb_free(cache_buf);
             }
-
             flb_kube_meta_release(&meta);
-            flb_kube_prop_destroy(&props);
-            return FLB_FILTER_NOTOUCH;
+
+            if (props.exclude == FLB_TRUE || ret == -1) {
+                /* Skip this record */
+                flb_kube_prop_destroy(&props);
+                continue;
+            }
         }
 
+        ret = pack_record(&tmp_pck, &tmp_sbuf, rec, rec_size,
+                          &kube_sbuf, parser, ctx);
         if (ctx->use_journal == FLB_TRUE) {
-            flb_kube_meta_release(&meta);
+            flb_kube_prop_destroy(&props);
+        }
+        if (ret != 0) {
+            msgpack_sbuffer_destroy(&tmp_sbuf);
+            flb_arena_buf_destroy(&kube_sbuf);
+            return FLB_FILTER_NOTOUCH;
         }
     }
-    msgpack_unpacked_destroy(&result);
-
-    /* Release meta fields */
-    if (ctx->use_journal == FLB_FALSE) {
-        flb_kube_meta_release(&meta);
-    }
+    flb_arena_buf_destroy(&kube_sbuf);
 
     /* link new buffers */
     *out_buf   = tmp_sbuf.data;
     *out_bytes = tmp_sbuf.size;
 
-    if (ctx->dummy_meta == FLB_TRUE) {
-        flb_free(cache_buf);
-    }
-
-    flb_kube_prop_destroy(&props);
     return FLB_FILTER_MODIFIED;
 }
 
@@ -545,5 +552,5 @@ struct flb_filter_plugin filter_kubernetes_plugin = {
     .cb_init      = cb_kube_init,
     .cb_filter    = cb_kube_filter,
     .cb_exit      = cb_kube_exit,
-    .flags        = 0
+    .flags        = FLB_FILTER_INIT_PARALLEL
 };
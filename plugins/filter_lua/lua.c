@@ -20,6 +20,8 @@
 #include <fluent-bit/flb_info.h>
 #include <fluent-bit/flb_filter.h>
 #include <fluent-bit/flb_luajit.h>
+#include <fluent-bit/flb_luajit_ffi.h>
+#include <fluent-bit/flb_mp.h>
 #include <fluent-bit/flb_utils.h>
 #include <fluent-bit/flb_pack.h>
 #include <fluent-bit/flb_sds.h>
@@ -61,17 +63,12 @@ int is_valid_map(char *data, size_t bytes)
 }
 
 /*
- * This function is similar to flb_msgpack_to_json_str() but it have
- * two main differences:
- *
- * - use a pre-allocated buffer to perform the decoding operation
- * - use flb_sds_t data type instead of normal char *
+ * Convert the record map to JSON reusing the pre-allocated decode buffer,
+ * it grows as needed and keeps its size for the next records.
  */
 int msgpack_map_to_json(struct lua_filter *lf, msgpack_object *obj)
 {
     int ret;
-    size_t size;
-    flb_sds_t tmp;
 
     if (obj == NULL) {
         return -1;
@@ -80,27 +77,12 @@ int msgpack_map_to_json(struct lua_filter *lf, msgpack_object *obj)
     /* Reset length */
     flb_sds_len_set(lf->buffer, 0);
 
-    while (1) {
-        /* Get buffer size */
-        size = flb_sds_alloc(lf->buffer);
-
-        /* Decode from msgpack to json */
-        ret = flb_msgpack_to_json(lf->buffer, size, obj);
-        if (ret <= 0) {
-            /* buffer is too small */
-            tmp = flb_sds_increase(lf->buffer, LUA_BUFFER_CHUNK);
-            if (tmp) {
-                lf->buffer = tmp;
-            }
-            else {
-                flb_error("[filter_lua] cannot adjust decode buffer size");
-                flb_errno();
-                return -1;
-            }
-        }
-        else {
-            break;
-        }
+    /* Decode from msgpack to json */
+    ret = flb_msgpack_to_json_sds(&lf->buffer, obj);
+    if (ret == -1) {
+        flb_error("[filter_lua] cannot adjust decode buffer size");
+        flb_errno();
+        return -1;
     }
 
     return 0;
@@ -142,6 +124,16 @@ static int cb_lua_init(struct flb_filter_instance *f_ins,
     }
     ctx->lua = lj;
 
+    /* FFI record view, set before the script so it can use 'flb' */
+    if (ctx->record_type == LUA_RECORD_FFI) {
+        ctx->rec = flb_luajit_rec_create();
+        if (!ctx->rec || flb_luajit_ffi_init(lj->state) == -1) {
+            lua_config_destroy(ctx);
+            return -1;
+        }
+        ctx->rec_ref = flb_luajit_ffi_bind(lj->state, ctx->rec);
+    }
+
     /* Load Script */
     ret = flb_luajit_load_script(ctx->lua, ctx->script);
     if (ret == -1) {
@@ -163,6 +155,205 @@ static int cb_lua_init(struct flb_filter_instance *f_ins,
     return 0;
 }
 
+/* Get the raw map of a serialized [time, map] record */
+static int record_map(const char *buf, size_t size,
+                      const char **map, size_t *map_size)
+{
+    size_t hdr;
+    size_t obj_size;
+    unsigned char c = buf[0];
+
+    if ((c & 0xf0) == 0x90) {
+        hdr = 1;
+    }
+    else if (c == 0xdc) {
+        hdr = 3;
+    }
+    else if (c == 0xdd) {
+        hdr = 5;
+    }
+    else {
+        return -1;
+    }
+
+    /* skip the time */
+    if (flb_mp_object_size(buf + hdr, size - hdr, &obj_size) == -1) {
+        return -1;
+    }
+    hdr += obj_size;
+
+    if (flb_mp_object_size(buf + hdr, size - hdr, &obj_size) == -1) {
+        return -1;
+    }
+
+    *map = buf + hdr;
+    *map_size = obj_size;
+    return 0;
+}
+
+/*
+ * Check the record returned by the script, it's at the top of the stack.
+ * On success the record is left in 'pack_data' for JSON records.
+ */
+static int lua_record_check(struct lua_filter *ctx,
+                            char **pack_data, size_t *pack_size)
+{
+    int ret;
+    size_t len;
+    const char *l_record;
+    lua_State *l = ctx->lua->state;
+
+    /* Modifications were done through the record view */
+    if (ctx->record_type == LUA_RECORD_FFI) {
+        return 0;
+    }
+
+    if (ctx->record_type == LUA_RECORD_TABLE) {
+        /* Must be a non empty table that is not a sequence */
+        if (lua_type(l, -1) != LUA_TTABLE ||
+            flb_luajit_arraylen(l, -1) != -1) {
+            flb_error("[filter_lua] invalid table map returned at %s(), %s",
+                      ctx->call, ctx->script);
+            return -1;
+        }
+        lua_pushnil(l);
+        if (lua_next(l, -2) == 0) {
+            flb_error("[filter_lua] invalid table map returned at %s(), %s",
+                      ctx->call, ctx->script);
+            return -1;
+        }
+        lua_pop(l, 2);
+        return 0;
+    }
+
+    /* Record: must be a JSON Map if it was modified */
+    l_record = lua_tolstring(l, -1, &len);
+    if (len == 0 || l_record == NULL) {
+        flb_error("[filter_lua] invalid record value for "
+                  "return code 1 at %s(), %s",
+                  ctx->call, ctx->script);
+        return -1;
+    }
+
+    /* Convert JSON to msgpack */
+    ret = flb_pack_json((char *) l_record, len, pack_data, pack_size);
+    if (ret == -1) {
+        flb_error("[filter_lua] invalid JSON at %s(), %s",
+                  ctx->call, ctx->script);
+        return -1;
+    }
+
+    ret = is_valid_map(*pack_data, *pack_size);
+    if (ret == FLB_FALSE) {
+        flb_error("[filter_lua] invalid JSON map returned at %s(), %s",
+                  ctx->call, ctx->script);
+        flb_free(*pack_data);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Batch mode: the function is called once per chunk with an array of
+ * timestamps and an array of records,
+ *
+ *   code, timestamps, records = call(tag, timestamps, records)
+ *
+ * code -1 drops every record, 0 keeps the chunk as it is and 1 replaces
+ * it with the returned arrays. A missing timestamp is set to the current
+ * time and entries that are not tables are dropped.
+ */
+static int lua_filter_batch(void *data, size_t bytes, char *tag,
+                            void **out_buf, size_t *out_bytes,
+                            struct lua_filter *ctx)
+{
+    int i;
+    int n = 0;
+    int l_code;
+    size_t off = 0;
+    msgpack_object *p;
+    msgpack_unpacked result;
+    msgpack_sbuffer tmp_sbuf;
+    msgpack_packer tmp_pck;
+    struct flb_time t;
+    lua_State *l = ctx->lua->state;
+
+    lua_getglobal(l, ctx->call);
+    lua_pushstring(l, tag);
+    lua_newtable(l);
+    lua_newtable(l);
+
+    msgpack_unpacked_init(&result);
+    while (msgpack_unpack_next(&result, data, bytes, &off)) {
+        if (result.data.type != MSGPACK_OBJECT_ARRAY) {
+            continue;
+        }
+        flb_time_pop_from_msgpack(&t, &result, &p);
+
+        n++;
+        lua_pushnumber(l, flb_time_to_double(&t));
+        lua_rawseti(l, -3, n);
+        flb_luajit_pushmsgpack(l, p);
+        lua_rawseti(l, -2, n);
+    }
+    msgpack_unpacked_destroy(&result);
+
+    lua_call(l, 3, 3);
+
+    l_code = (int) lua_tointeger(l, -3);
+    if (l_code == 0) {
+        lua_pop(l, 3);
+        return FLB_FILTER_NOTOUCH;
+    }
+    else if (l_code != -1 && l_code != 1) {
+        flb_error("[filter_lua] unexpected Lua script return code %i, "
+                  "original records will be kept." , l_code);
+        lua_pop(l, 3);
+        return FLB_FILTER_NOTOUCH;
+    }
+    else if (l_code == 1 &&
+             (lua_type(l, -2) != LUA_TTABLE || lua_type(l, -1) != LUA_TTABLE)) {
+        flb_error("[filter_lua] invalid arrays returned at %s(), %s",
+                  ctx->call, ctx->script);
+        lua_pop(l, 3);
+        return FLB_FILTER_NOTOUCH;
+    }
+
+    msgpack_sbuffer_init(&tmp_sbuf);
+    msgpack_packer_init(&tmp_pck, &tmp_sbuf, msgpack_sbuffer_write);
+
+    n = (l_code == 1) ? lua_objlen(l, -1) : 0;
+    for (i = 1; i <= n; i++) {
+        lua_rawgeti(l, -1, i);
+        if (lua_type(l, -1) != LUA_TTABLE) {
+            lua_pop(l, 1);
+            continue;
+        }
+
+        lua_rawgeti(l, -3, i);
+        if (lua_type(l, -1) == LUA_TNUMBER) {
+            flb_time_from_double(&t, lua_tonumber(l, -1));
+        }
+        else {
+            flb_time_get(&t);
+        }
+        lua_pop(l, 1);
+
+        msgpack_pack_array(&tmp_pck, 2);
+        flb_time_append_to_msgpack(&t, &tmp_pck, 0);
+        flb_luajit_tomsgpack(l, &tmp_pck, -1);
+        lua_pop(l, 1);
+    }
+    lua_pop(l, 3);
+
+    /* link new buffers */
+    *out_buf   = tmp_sbuf.data;
+    *out_bytes = tmp_sbuf.size;
+
+    return FLB_FILTER_MODIFIED;
+}
+
 static int cb_lua_filter(void *data, size_t bytes,
                          char *tag, int tag_len,
                          void **out_buf, size_t *out_bytes,
@@ -171,8 +362,10 @@ static int cb_lua_filter(void *data, size_t bytes,
                          struct flb_config *config)
 {
     int ret;
-    size_t len;
     size_t off = 0;
+    size_t prev_off = 0;
+    size_t map_size;
+    const char *map;
     (void) f_ins;
     (void) config;
     double ts;
@@ -181,14 +374,18 @@ static int cb_lua_filter(void *data, size_t bytes,
     msgpack_unpacked result;
     msgpack_sbuffer tmp_sbuf;
     msgpack_packer tmp_pck;
-    char *pack_data;
-    size_t pack_size;
+    char *pack_data = NULL;
+    size_t pack_size = 0;
     struct flb_time t;
     struct lua_filter *ctx = filter_context;
+    lua_State *l = ctx->lua->state;
     /* Lua return values */
     int l_code;
     double l_timestamp;
-    char *l_record;
+
+    if (ctx->batch == FLB_TRUE) {
+        return lua_filter_batch(data, bytes, tag, out_buf, out_bytes, ctx);
+    }
 
     /* Create temporal msgpack buffer */
     msgpack_sbuffer_init(&tmp_sbuf);
@@ -202,75 +399,61 @@ static int cb_lua_filter(void *data, size_t bytes,
         flb_time_pop_from_msgpack(&t, &result, &p);
         ts = flb_time_to_double(&t);
 
-        /* Decode from msgpack to JSON */
-        ret = msgpack_map_to_json(ctx, p);
-        if (ret == -1) {
-            msgpack_sbuffer_destroy(&tmp_sbuf);
-            msgpack_unpacked_destroy(&result);
-            return FLB_FILTER_NOTOUCH;
-        }
-
         /* Prepare function call, pass 3 arguments, expect 3 return values */
-        lua_getglobal(ctx->lua->state, ctx->call);
-        lua_pushstring(ctx->lua->state, tag);
-        lua_pushnumber(ctx->lua->state, ts);
-        lua_pushstring(ctx->lua->state, ctx->buffer);
-        lua_call(ctx->lua->state, 3, 3);
-
-        /* Initialize Return values */
-        l_code = 0;
-        l_timestamp = ts;
-        l_record = ctx->buffer;
-        len = flb_sds_len(ctx->buffer);
-
-        /* Record: must be a JSON Map if it was modified */
-        l_record = (char *) lua_tolstring(ctx->lua->state, -1, &len);
-        lua_pop(ctx->lua->state, 1);
-
-        l_timestamp = (double) lua_tonumber(ctx->lua->state, -1);
-        lua_pop(ctx->lua->state, 1);
+        lua_getglobal(l, ctx->call);
+        lua_pushstring(l, tag);
+        lua_pushnumber(l, ts);
 
-        l_code = (int) lua_tointeger(ctx->lua->state, -1);
-        lua_pop(ctx->lua->state, 1);
-
-        /* Validations */
-        if (l_code == 1) {
-            /* Must be a valid string */
-            if (len == 0 || l_record == NULL) {
-                flb_error("[filter_lua] invalid record value for "
-                          "return code 1 at %s(), %s",
-                          ctx->call, ctx->script);
+        if (ctx->record_type == LUA_RECORD_TABLE) {
+            flb_luajit_pushmsgpack(l, p);
+        }
+        else if (ctx->record_type == LUA_RECORD_FFI) {
+            ret = record_map((char *) data + prev_off, off - prev_off,
+                             &map, &map_size);
+            if (ret == -1) {
+                lua_pop(l, 3);
                 msgpack_sbuffer_destroy(&tmp_sbuf);
                 msgpack_unpacked_destroy(&result);
                 return FLB_FILTER_NOTOUCH;
             }
-
-            /* Convert JSON to msgpack */
-            ret = flb_pack_json(l_record, len, &pack_data, &pack_size);
+            flb_luajit_rec_reset(ctx->rec, map, map_size);
+            lua_rawgeti(l, LUA_REGISTRYINDEX, ctx->rec_ref);
+        }
+        else {
+            /* Decode from msgpack to JSON */
+            ret = msgpack_map_to_json(ctx, p);
             if (ret == -1) {
-                flb_error("[filter_lua] invalid JSON at %s(), %s",
-                          ctx->call, ctx->script);
+                lua_pop(l, 3);
                 msgpack_sbuffer_destroy(&tmp_sbuf);
                 msgpack_unpacked_destroy(&result);
                 return FLB_FILTER_NOTOUCH;
             }
+            lua_pushlstring(l, ctx->buffer, flb_sds_len(ctx->buffer));
+        }
+        lua_call(l, 3, 3);
+
+        l_code = (int) lua_tointeger(l, -3);
+        l_timestamp = (double) lua_tonumber(l, -2);
 
-            ret = is_valid_map(pack_data, pack_size);
-            if (ret == FLB_FALSE) {
-                flb_error("[filter_lua] invalid JSON map returned at %s(), %s",
-                          ctx->call, ctx->script);
+        /* Validations */
+        if (l_code == 1) {
+            ret = lua_record_check(ctx, &pack_data, &pack_size);
+            if (ret == -1) {
+                lua_pop(l, 3);
                 msgpack_sbuffer_destroy(&tmp_sbuf);
                 msgpack_unpacked_destroy(&result);
-                flb_free(pack_data);
                 return FLB_FILTER_NOTOUCH;
             }
         }
 
         if (l_code == -1) { /* Skip record */
+            lua_pop(l, 3);
+            prev_off = off;
             continue;
         }
-        else if (l_code == 0) { /* Keep record, repack */
-            msgpack_pack_object(&tmp_pck, root);
+        else if (l_code == 0) { /* Keep record, copy it as it is */
+            msgpack_sbuffer_write(&tmp_sbuf, (char *) data + prev_off,
+                                  off - prev_off);
         }
         else if (l_code == 1) { /* Modified, pack new data */
             /* main array */
@@ -280,15 +463,25 @@ static int cb_lua_filter(void *data, size_t bytes,
             flb_time_from_double(&t, l_timestamp);
             flb_time_append_to_msgpack(&t, &tmp_pck, 0);
 
-            /* Pack json map as string */
-            msgpack_sbuffer_write(&tmp_sbuf, pack_data, pack_size);
-            flb_free(pack_data);
+            /* Pack the new map */
+            if (ctx->record_type == LUA_RECORD_TABLE) {
+                flb_luajit_tomsgpack(l, &tmp_pck, -1);
+            }
+            else if (ctx->record_type == LUA_RECORD_FFI) {
+                flb_luajit_rec_pack(ctx->rec, &tmp_sbuf);
+            }
+            else {
+                msgpack_sbuffer_write(&tmp_sbuf, pack_data, pack_size);
+                flb_free(pack_data);
+            }
         }
         else { /* Unexpected return code, keep original content */
             flb_error("[filter_lua] unexpected Lua script return code %i, "
                       "original record will be kept." , l_code);
             msgpack_pack_object(&tmp_pck, root);
         }
+        lua_pop(l, 3);
+        prev_off = off;
     }
     msgpack_unpacked_destroy(&result);
 
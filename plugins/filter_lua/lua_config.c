@@ -21,6 +21,7 @@
 #include <fluent-bit/flb_mem.h>
 #include <fluent-bit/flb_log.h>
 #include <fluent-bit/flb_sds.h>
+#include <fluent-bit/flb_utils.h>
 
 #include "lua_config.h"
 
@@ -80,6 +81,35 @@ struct lua_filter *lua_config_create(struct flb_filter_instance *ins,
         return NULL;
     }
 
+    /* Config: record_type */
+    lf->record_type = LUA_RECORD_TABLE;
+    tmp = flb_filter_get_property("record_type", ins);
+    if (tmp) {
+        if (strcasecmp(tmp, "json") == 0) {
+            lf->record_type = LUA_RECORD_JSON;
+        }
+        else if (strcasecmp(tmp, "ffi") == 0) {
+            lf->record_type = LUA_RECORD_FFI;
+        }
+        else if (strcasecmp(tmp, "table") != 0) {
+            flb_error("[filter_lua] invalid record_type '%s'", tmp);
+            lua_config_destroy(lf);
+            return NULL;
+        }
+    }
+
+    /* Config: batch */
+    lf->batch = FLB_FALSE;
+    tmp = flb_filter_get_property("batch", ins);
+    if (tmp) {
+        lf->batch = flb_utils_bool(tmp);
+    }
+    if (lf->batch == FLB_TRUE && lf->record_type != LUA_RECORD_TABLE) {
+        flb_error("[filter_lua] batch mode requires record_type table");
+        lua_config_destroy(lf);
+        return NULL;
+    }
+
     lf->buffer = flb_sds_create_size(LUA_BUFFER_CHUNK);
     if (!lf->buffer) {
         flb_error("[filter_lua] could not allocate decode buffer");
@@ -105,5 +135,8 @@ void lua_config_destroy(struct lua_filter *lf)
     if (lf->buffer) {
         flb_sds_destroy(lf->buffer);
     }
+    if (lf->rec) {
+        flb_luajit_rec_destroy(lf->rec);
+    }
     flb_free(lf);
 }
@@ -23,15 +23,25 @@
 #include <fluent-bit/flb_info.h>
 #include <fluent-bit/flb_filter.h>
 #include <fluent-bit/flb_luajit.h>
+#include <fluent-bit/flb_luajit_ffi.h>
 #include <fluent-bit/flb_sds.h>
 
 #define LUA_BUFFER_CHUNK    1024*8  /* 8K should be enough to get started */
 
+/* How records are passed to the script */
+#define LUA_RECORD_TABLE    0  /* Lua tables (default) */
+#define LUA_RECORD_JSON     1  /* JSON strings, as older versions did */
+#define LUA_RECORD_FFI      2  /* LuaJIT FFI view of the raw record */
+
 struct lua_filter {
     flb_sds_t script;       /* lua script path */
     flb_sds_t call;         /* function name   */
     flb_sds_t buffer;       /* json dec buffer */
+    int record_type;        /* LUA_RECORD_*    */
+    int batch;              /* one call per chunk */
     struct flb_luajit *lua; /* state context   */
+    struct flb_luajit_rec *rec;  /* FFI record view    */
+    int rec_ref;                 /* its cdata, registry */
 };
 
 struct lua_filter *lua_config_create(struct flb_filter_instance *ins,
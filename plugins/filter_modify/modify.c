@@ -27,6 +27,8 @@
 #include <fluent-bit/flb_filter.h>
 #include <fluent-bit/flb_utils.h>
 #include <fluent-bit/flb_pack.h>
+#include <fluent-bit/flb_mp.h>
+#include <fluent-bit/flb_hash.h>
 #include <msgpack.h>
 
 #include "modify.h"
@@ -52,6 +54,16 @@ static void teardown(struct filter_modify_ctx *ctx)
         mk_list_del(&rule->_head);
         flb_free(rule);
     }
+
+    if (ctx->keys_hash) {
+        flb_hash_destroy(ctx->keys_hash);
+        ctx->keys_hash = NULL;
+    }
+    flb_free(ctx->keys);
+    flb_free(ctx->hits);
+    ctx->keys = NULL;
+    ctx->hits = NULL;
+    ctx->keys_cnt = 0;
 }
 
 static void helper_pack_string(msgpack_packer * packer, const char *str, int len)
@@ -122,151 +134,208 @@ static int setup(struct filter_modify_ctx *ctx,
     return 0;
 }
 
-static inline bool kv_key_matches(msgpack_object_kv * kv,
-                                  struct modify_rule *rule)
+/* Compile the rules into the execution plan */
+static int plan_create(struct filter_modify_ctx *ctx)
 {
+    int i;
+    int id;
+    int total;
+    char *val;
+    size_t size;
+    struct mk_list *head;
+    struct mk_list *lists[2];
+    struct modify_rule *rule;
 
-    char *key;
-    int klen;
-
-    msgpack_object *obj = &kv->key;
-
-    if (obj->type == MSGPACK_OBJECT_BIN) {
-        key = (char *) obj->via.bin.ptr;
-        klen = obj->via.bin.size;
-    }
-    else if (obj->type == MSGPACK_OBJECT_STR) {
-        key = (char *) obj->via.str.ptr;
-        klen = obj->via.str.size;
-    }
-    else {
-        return false;
+    total = ctx->rename_key_rules_cnt + ctx->add_key_rules_cnt;
+    if (total == 0) {
+        return 0;
     }
 
-    return ((rule->key_len == klen) && (strncmp(rule->key, key, klen) == 0)
-        );
-}
+    ctx->keys = flb_calloc(total, sizeof(struct modify_key));
+    if (!ctx->keys) {
+        flb_errno();
+        return -1;
+    }
 
-static inline bool not_kv_key_matches(msgpack_object_kv * kv,
-                                      struct modify_rule *rule)
-{
-    return !kv_key_matches(kv, rule);
-}
+    ctx->keys_hash = flb_hash_create(FLB_HASH_EVICT_NONE, total, -1);
+    if (!ctx->keys_hash) {
+        return -1;
+    }
 
-static inline int map_count_records_matching_rule(msgpack_object * map,
-                                                  struct modify_rule *rule)
-{
-    int i;
-    int count = 0;
+    lists[0] = &ctx->rename_key_rules;
+    lists[1] = &ctx->add_key_rules;
+    for (i = 0; i < 2; i++) {
+        mk_list_foreach(head, lists[i]) {
+            rule = mk_list_entry(head, struct modify_rule, _head);
+            id = flb_hash_get(ctx->keys_hash, rule->key, rule->key_len,
+                              &val, &size);
+            if (id == -1) {
+                rule->idx = ctx->keys_cnt++;
+                id = flb_hash_add(ctx->keys_hash, rule->key, rule->key_len,
+                                  (char *) &rule->idx, sizeof(int));
+                if (id == -1) {
+                    return -1;
+                }
+            }
+            else {
+                memcpy(&rule->idx, val, sizeof(int));
+            }
 
-    for (i = 0; i < map->via.map.size; i++) {
-        if (kv_key_matches(&map->via.map.ptr[i], rule)) {
-            count++;
+            /* If many rules rename the same key, the last one wins */
+            if (i == 0) {
+                ctx->keys[rule->idx].rename = rule;
+            }
         }
     }
-    return count;
+
+    return 0;
 }
 
-static inline int count_rules_not_matched(msgpack_object * map,
-                                          struct mk_list *rules)
+static inline struct modify_key *plan_lookup(struct filter_modify_ctx *ctx,
+                                             const char *key, int key_len)
 {
-    struct mk_list *head;
-    struct modify_rule *rule;
-
-    size_t counter = 0;
-
-    mk_list_foreach(head, rules) {
-        rule = mk_list_entry(head, struct modify_rule, _head);
-        if (map_count_records_matching_rule(map, rule) == 0) {
-            counter++;
-        }
+    int id;
+    int idx;
+    char *val;
+    size_t size;
+
+    id = flb_hash_get(ctx->keys_hash, (char *) key, key_len, &val, &size);
+    if (id == -1) {
+        return NULL;
     }
+    memcpy(&idx, val, sizeof(int));
 
-    return counter;
+    return &ctx->keys[idx];
 }
 
-static inline void pack_map_with_rename(msgpack_packer * packer,
-                                        msgpack_object * map,
-                                        struct mk_list *rules)
+/*
+ * Scan the keys of a record map once: mark the keys named by the rules
+ * and collect the ones to rename. Returns the number of changes the
+ * rules do on the record, or -1 if the map is not valid.
+ */
+static int record_scan(struct filter_modify_ctx *ctx,
+                       const char *map, size_t map_size,
+                       uint32_t *count, size_t *hdr,
+                       int *n_hits, int *n_adds)
 {
     int i;
+    int ret;
+    int hits = 0;
+    int adds = 0;
+    int new_size;
+    uint32_t len;
+    size_t size;
+    const char *key;
+    const char *p;
+    const char *end = map + map_size;
     struct mk_list *head;
+    struct modify_key *k;
+    struct modify_hit *tmp;
     struct modify_rule *rule;
-    struct modify_rule *matched_rule;
-    bool matched;
 
-    for (i = 0; i < map->via.map.size; i++) {
+    ret = flb_mp_map_header(map, map_size, count, hdr);
+    if (ret == -1) {
+        return -1;
+    }
 
-        matched = false;
+    for (i = 0; i < ctx->keys_cnt; i++) {
+        ctx->keys[i].present = FLB_FALSE;
+    }
 
-        mk_list_foreach(head, rules) {
-            rule = mk_list_entry(head, struct modify_rule, _head);
-            if (kv_key_matches(&map->via.map.ptr[i], rule)) {
-                matched = true;
-                matched_rule = rule;
+    p = map + *hdr;
+    for (i = 0; i < *count; i++) {
+        ret = flb_mp_key(p, end - p, &key, &len, &size);
+        if (ret == 0) {
+            k = plan_lookup(ctx, key, len);
+        }
+        else {
+            k = NULL;
+            if (flb_mp_object_size(p, end - p, &size) == -1) {
+                return -1;
             }
         }
 
-        if (matched) {
-            helper_pack_string(packer, matched_rule->val, matched_rule->val_len);
-        }
-        else {
-            msgpack_pack_object(packer, map->via.map.ptr[i].key);
+        if (k) {
+            k->present = FLB_TRUE;
+            if (k->rename) {
+                if (hits == ctx->hits_size) {
+                    new_size = ctx->hits_size ? ctx->hits_size * 2 : 8;
+                    tmp = flb_realloc(ctx->hits,
+                                      new_size * sizeof(struct modify_hit));
+                    if (!tmp) {
+                        flb_errno();
+                        return -1;
+                    }
+                    ctx->hits = tmp;
+                    ctx->hits_size = new_size;
+                }
+                ctx->hits[hits].key = p;
+                ctx->hits[hits].size = size;
+                ctx->hits[hits].rule = k->rename;
+                hits++;
+            }
         }
-        msgpack_pack_object(packer, map->via.map.ptr[i].val);
+        p += size;
 
+        if (flb_mp_object_size(p, end - p, &size) == -1) {
+            return -1;
+        }
+        p += size;
     }
-}
-
-static inline void pack_map_with_missing_keys(msgpack_packer * packer,
-                                              msgpack_object * map,
-                                              struct mk_list *rules)
-{
-
-    struct mk_list *head;
-    struct modify_rule *rule;
 
-    mk_list_foreach(head, rules) {
+    /* Missing keys with defaults */
+    mk_list_foreach(head, &ctx->add_key_rules) {
         rule = mk_list_entry(head, struct modify_rule, _head);
-        if (map_count_records_matching_rule(map, rule) == 0) {
-            helper_pack_string(packer, rule->key, rule->key_len);
-            helper_pack_string(packer, rule->val, rule->val_len);
+        if (ctx->keys[rule->idx].present == FLB_FALSE) {
+            adds++;
         }
     }
+
+    *n_hits = hits;
+    *n_adds = adds;
+    return hits + adds;
 }
 
-static inline void apply_modifying_rules(msgpack_packer * packer,
-                                         msgpack_object * root,
-                                         struct filter_modify_ctx *ctx)
+/* Pack the record renaming the collected keys and adding the missing ones */
+static void record_pack(struct filter_modify_ctx *ctx,
+                        msgpack_packer *packer, msgpack_sbuffer *sbuf,
+                        const char *ts, size_t ts_size,
+                        const char *map, size_t map_size,
+                        uint32_t count, size_t hdr, int n_hits, int n_adds)
 {
-    msgpack_object ts = root->via.array.ptr[0];
-    msgpack_object map = root->via.array.ptr[1];
-
-    // TODO: We can scan for both rules and if they both come back 0 we can
-    // return without rewriting
+    int i;
+    const char *p;
+    struct mk_list *head;
+    struct modify_hit *hit;
+    struct modify_rule *rule;
 
-    int total_records =
-        map.via.map.size + count_rules_not_matched(&map, &ctx->add_key_rules);
+    flb_debug("[filter_modify] Input map size %d elements, output map size "
+              "%d elements", count, count + n_adds);
 
-    // * Record array init(2)
     msgpack_pack_array(packer, 2);
+    msgpack_sbuffer_write(sbuf, ts, ts_size);
+    msgpack_pack_map(packer, count + n_adds);
+
+    /* Entries from the input map with items renamed */
+    p = map + hdr;
+    for (i = 0; i < n_hits; i++) {
+        hit = &ctx->hits[i];
+        msgpack_sbuffer_write(sbuf, p, hit->key - p);
+        helper_pack_string(packer, hit->rule->val, hit->rule->val_len);
+        p = hit->key + hit->size;
+    }
+    msgpack_sbuffer_write(sbuf, p, (map + map_size) - p);
 
-    // * * Record array item 1/2
-    msgpack_pack_object(packer, ts);
-
-    flb_debug
-        ("[filter_modify] Input map size %d elements, output map size %d elements",
-         map.via.map.size, total_records);
-
-    // * * Record array item 2/2
-    msgpack_pack_map(packer, total_records);
-
-    // * * * Add from input map to new map with items renamed
-    pack_map_with_rename(packer, &map, &ctx->rename_key_rules);
-
-    // * * * Add missing keys with defaults to new map
-    pack_map_with_missing_keys(packer, &map, &ctx->add_key_rules);
-
+    /* Add missing keys with defaults */
+    if (n_adds > 0) {
+        mk_list_foreach(head, &ctx->add_key_rules) {
+            rule = mk_list_entry(head, struct modify_rule, _head);
+            if (ctx->keys[rule->idx].present == FLB_FALSE) {
+                helper_pack_string(packer, rule->key, rule->key_len);
+                helper_pack_string(packer, rule->val, rule->val_len);
+            }
+        }
+    }
 }
 
 static int cb_modify_init(struct flb_filter_instance *f_ins,
@@ -275,7 +344,7 @@ static int cb_modify_init(struct flb_filter_instance *f_ins,
     struct filter_modify_ctx *ctx;
 
     // Create context
-    ctx = flb_malloc(sizeof(struct filter_modify_ctx));
+    ctx = flb_calloc(1, sizeof(struct filter_modify_ctx));
     if (!ctx) {
         flb_errno();
         return -1;
@@ -289,6 +358,12 @@ static int cb_modify_init(struct flb_filter_instance *f_ins,
         return -1;
     }
 
+    if (plan_create(ctx) < 0) {
+        teardown(ctx);
+        flb_free(ctx);
+        return -1;
+    }
+
     // Set context
     flb_filter_set_context(f_ins, ctx);
     return 0;
@@ -300,18 +375,26 @@ static int cb_modify_filter(void *data, size_t bytes,
                             struct flb_filter_instance *f_ins,
                             void *context, struct flb_config *config)
 {
-    msgpack_unpacked result;
+    int ret;
+    int n_hits;
+    int n_adds;
+    int modified = FLB_FALSE;
+    uint32_t count;
+    size_t hdr;
     size_t off = 0;
+    size_t rec_size;
+    size_t ts_size;
+    const char *rec;
+    const char *map;
+    msgpack_sbuffer buffer;
+    msgpack_packer packer;
+    struct filter_modify_ctx *ctx = context;
     (void) f_ins;
     (void) config;
 
-    struct filter_modify_ctx *ctx = context;
-
-    msgpack_sbuffer buffer;
-    msgpack_sbuffer_init(&buffer);
-
-    msgpack_packer packer;
-    msgpack_packer_init(&packer, &buffer, msgpack_sbuffer_write);
+    if (ctx->keys_cnt == 0) {
+        return FLB_FILTER_NOTOUCH;
+    }
 
     // Records come in the format,
     //
@@ -320,17 +403,48 @@ static int cb_modify_filter(void *data, size_t bytes,
     //
     // Example record,
     // [1123123, {"Mem.total"=>4050908, "Mem.used"=>476576, "Mem.free"=>3574332 } ]
+    //
+    // Records are walked without unpacking them, the ones no rule changes
+    // are copied as they are. If no record changes the chunk is untouched.
+
+    while (off < bytes) {
+        rec = (char *) data + off;
+        ret = flb_mp_object_size(rec, bytes - off, &rec_size);
+        if (ret == -1) {
+            break;
+        }
+        off += rec_size;
+
+        ret = 0;
+        if ((unsigned char) rec[0] == 0x92 &&
+            flb_mp_object_size(rec + 1, rec_size - 1, &ts_size) == 0) {
+            map = rec + 1 + ts_size;
+            ret = record_scan(ctx, map, rec_size - 1 - ts_size,
+                              &count, &hdr, &n_hits, &n_adds);
+        }
 
-    msgpack_unpacked_init(&result);
-    while (msgpack_unpack_next(&result, data, bytes, &off)) {
-        if (result.data.type == MSGPACK_OBJECT_ARRAY) {
-            apply_modifying_rules(&packer, &result.data, ctx);
+        if (ret <= 0) {
+            if (modified == FLB_TRUE) {
+                msgpack_sbuffer_write(&buffer, rec, rec_size);
+            }
+            continue;
         }
-        else {
-            msgpack_pack_object(&packer, result.data);
+
+        if (modified == FLB_FALSE) {
+            /* Start the new chunk with the untouched records */
+            msgpack_sbuffer_init(&buffer);
+            msgpack_packer_init(&packer, &buffer, msgpack_sbuffer_write);
+            msgpack_sbuffer_write(&buffer, data, rec - (char *) data);
+            modified = FLB_TRUE;
         }
+
+        record_pack(ctx, &packer, &buffer, rec + 1, ts_size,
+                    map, rec_size - 1 - ts_size, count, hdr, n_hits, n_adds);
+    }
+
+    if (modified == FLB_FALSE) {
+        return FLB_FILTER_NOTOUCH;
     }
-    msgpack_unpacked_destroy(&result);
 
     *out_buf = buffer.data;
     *out_size = buffer.size;
@@ -20,18 +20,49 @@
 #ifndef FLB_FILTER_MODIFY_H
 #define FLB_FILTER_MODIFY_H
 
+#include <fluent-bit/flb_hash.h>
+
+/*
+ * Execution plan: the rules are compiled into one entry per distinct key
+ * they name, indexed by a hash table, so a record is checked against all
+ * the rules with a single scan of its keys.
+ */
+struct modify_key
+{
+    int present;                   /* key found in the current record */
+    struct modify_rule *rename;    /* effective rename rule, if any   */
+};
+
+/* A key of the current record that gets renamed */
+struct modify_hit
+{
+    const char *key;               /* raw key object */
+    size_t size;
+    struct modify_rule *rule;
+};
+
 struct filter_modify_ctx
 {
     int add_key_rules_cnt;
     int rename_key_rules_cnt;
     struct mk_list add_key_rules;
     struct mk_list rename_key_rules;
+
+    /* execution plan */
+    int keys_cnt;
+    struct modify_key *keys;
+    struct flb_hash *keys_hash;    /* rule key -> index in 'keys' */
+
+    /* renamed keys of the current record */
+    int hits_size;
+    struct modify_hit *hits;
 };
 
 struct modify_rule
 {
     int key_len;
     int val_len;
+    int idx;                       /* index of the key in the plan */
     char *key;
     char *val;
     struct mk_list _head;
@@ -27,6 +27,7 @@
 #include <fluent-bit/flb_filter.h>
 #include <fluent-bit/flb_utils.h>
 #include <fluent-bit/flb_pack.h>
+#include <fluent-bit/flb_mp.h>
 #include <msgpack.h>
 
 #include "nest.h"
@@ -141,189 +142,200 @@ static void helper_pack_string(msgpack_packer * packer, const char *str,
     }
 }
 
-static inline void map_pack_each_fn(msgpack_packer * packer,
-                                    msgpack_object * map,
-                                    struct filter_nest_ctx *ctx,
-                                    bool(*f) (msgpack_object_kv * kv,
-                                              struct filter_nest_ctx * ctx)
-    )
+static inline bool is_key_to_nest(const char *key, uint32_t klen,
+                                  struct filter_nest_ctx *ctx)
 {
-    int i;
-
-    for (i = 0; i < map->via.map.size; i++) {
-        if ((*f) (&map->via.map.ptr[i], ctx)) {
-            msgpack_pack_object(packer, map->via.map.ptr[i].key);
-            msgpack_pack_object(packer, map->via.map.ptr[i].val);
-        }
+    if (ctx->wildcard_is_dynamic) {
+        // This will positively match "ABC123" with wildcard "ABC*"
+        return (klen >= ctx->wildcard_len &&
+                memcmp(key, ctx->wildcard, ctx->wildcard_len) == 0);
+    }
+    else {
+        // This will positively match "ABC" with wildcard "ABC"
+        return (klen == ctx->wildcard_len &&
+                memcmp(key, ctx->wildcard, klen) == 0);
     }
 }
 
-static inline int map_count_fn(msgpack_object * map,
-                               struct filter_nest_ctx *ctx,
-                               bool(*f) (msgpack_object_kv * kv,
-                                         struct filter_nest_ctx * ctx)
-    )
+static inline bool is_key_to_lift(const char *key, uint32_t klen,
+                                  struct filter_nest_ctx *ctx)
 {
-    int i;
-    int count = 0;
-
-    for (i = 0; i < map->via.map.size; i++) {
-        if ((*f) (&map->via.map.ptr[i], ctx)) {
-            count++;
-        }
-    }
-    return count;
+    return (klen == ctx->nested_under_len &&
+            memcmp(key, ctx->nested_under, klen) == 0);
 }
 
-static inline bool is_kv_to_nest(msgpack_object_kv * kv,
-                                 struct filter_nest_ctx *ctx)
+static struct nest_span *span_get(struct filter_nest_ctx *ctx, int n)
 {
-
-    char *key;
-    int klen;
-
-    msgpack_object *obj = &kv->key;
-
-    if (obj->type == MSGPACK_OBJECT_BIN) {
-        key = (char *) obj->via.bin.ptr;
-        klen = obj->via.bin.size;
-    }
-    else if (obj->type == MSGPACK_OBJECT_STR) {
-        key = (char *) obj->via.str.ptr;
-        klen = obj->via.str.size;
-    }
-    else {
-        // If the key is not something we can match on then we leave it alone
-        return false;
+    int new_size;
+    struct nest_span *tmp;
+
+    if (n == ctx->spans_size) {
+        new_size = ctx->spans_size ? ctx->spans_size * 2 : 16;
+        tmp = flb_realloc(ctx->spans, new_size * sizeof(struct nest_span));
+        if (!tmp) {
+            flb_errno();
+            return NULL;
+        }
+        ctx->spans = tmp;
+        ctx->spans_size = new_size;
     }
 
-    if (ctx->wildcard_is_dynamic) {
-        // This will positively match "ABC123" with wildcard "ABC*" 
-        return (strncmp(key, ctx->wildcard, ctx->wildcard_len) == 0);
-    }
-    else {
-        // This will positively match "ABC" with wildcard "ABC" 
-        return ((ctx->wildcard_len == klen) &&
-                (strncmp(key, ctx->wildcard, klen) == 0)
-            );
-    }
+    return &ctx->spans[n];
 }
 
-static inline bool is_not_kv_to_nest(msgpack_object_kv * kv,
-                                     struct filter_nest_ctx *ctx)
+/*
+ * Scan the map entries once and collect the key/value pairs to nest or
+ * lift as raw byte ranges. Returns the number of pairs found, or -1 if the
+ * map is not valid.
+ */
+static int map_scan(struct filter_nest_ctx *ctx,
+                    const char *map, size_t map_size,
+                    uint32_t *count, size_t *hdr, uint32_t *lift_count)
 {
-    return !is_kv_to_nest(kv, ctx);
-}
+    int n = 0;
+    int ret;
+    uint32_t i;
+    uint32_t klen;
+    uint32_t vcount;
+    size_t ksize;
+    size_t vsize;
+    size_t vhdr;
+    const char *key;
+    const char *val;
+    const char *start;
+    const char *p;
+    const char *end = map + map_size;
+    struct nest_span *span;
+
+    ret = flb_mp_map_header(map, map_size, count, hdr);
+    if (ret == -1) {
+        return -1;
+    }
 
-static inline bool is_kv_to_lift(msgpack_object_kv * kv,
-                                 struct filter_nest_ctx *ctx)
-{
+    *lift_count = 0;
+    p = map + *hdr;
+    for (i = 0; i < *count; i++) {
+        start = p;
 
-    char *key;
-    int klen;
-    bool match;
+        // If the key is not something we can match on then we leave it alone
+        ret = flb_mp_key(p, end - p, &key, &klen, &ksize);
+        if (ret == -1 && flb_mp_object_size(p, end - p, &ksize) == -1) {
+            return -1;
+        }
+        p += ksize;
 
-    msgpack_object *obj = &kv->key;
+        val = p;
+        if (flb_mp_object_size(p, end - p, &vsize) == -1) {
+            return -1;
+        }
+        p += vsize;
 
-    if (obj->type == MSGPACK_OBJECT_BIN) {
-        key = (char *) obj->via.bin.ptr;
-        klen = obj->via.bin.size;
-    }
-    else if (obj->type == MSGPACK_OBJECT_STR) {
-        key = (char *) obj->via.str.ptr;
-        klen = obj->via.str.size;
-    }
-    else {
-        // If the key is not something we can match on then we leave it alone
-        return false;
-    }
+        if (ret == -1) {
+            continue;
+        }
 
-    match = ((ctx->nested_under_len == klen) &&
-             (strncmp(key, ctx->nested_under, klen) == 0));
+        if (ctx->operation == NEST) {
+            if (!is_key_to_nest(key, klen, ctx)) {
+                continue;
+            }
+        }
+        else {
+            if (!is_key_to_lift(key, klen, ctx)) {
+                continue;
+            }
+            if (flb_mp_map_header(val, vsize, &vcount, &vhdr) == -1) {
+                flb_warn("[filter_nest] Value of key '%.*s' is not a map. "
+                         "Will not attempt to lift from here", klen, key);
+                continue;
+            }
+        }
 
-    if (match && (kv->val.type != MSGPACK_OBJECT_MAP)) {
-        flb_warn
-            ("[filter_nest] Value of key '%s' is not a map. Will not attempt to lift from here",
-             key);
-        return false;
-    }
-    else {
-        return match;
+        span = span_get(ctx, n);
+        if (!span) {
+            return -1;
+        }
+        span->start = start;
+        span->size = p - start;
+        if (ctx->operation == LIFT) {
+            span->entries = val + vhdr;
+            span->entries_size = vsize - vhdr;
+            span->count = vcount;
+            *lift_count += vcount;
+        }
+        n++;
     }
-}
 
-static inline bool is_not_kv_to_lift(msgpack_object_kv * kv,
-                                     struct filter_nest_ctx *ctx)
-{
-    return !is_kv_to_lift(kv, ctx);
+    return n;
 }
 
-static inline int count_items_to_lift(msgpack_object * map,
-                                      struct filter_nest_ctx *ctx)
+/* Copy the map entries that are not in the spans */
+static inline void pack_unmatched(msgpack_sbuffer *sbuf,
+                                  const char *entries, const char *end,
+                                  struct nest_span *spans, int n)
 {
     int i;
-    int count = 0;
-    msgpack_object_kv *kv;
+    const char *p = entries;
 
-    for (i = 0; i < map->via.map.size; i++) {
-        kv = &map->via.map.ptr[i];
-        if (is_kv_to_lift(kv, ctx)) {
-            count = count + kv->val.via.map.size;
-        }
+    for (i = 0; i < n; i++) {
+        msgpack_sbuffer_write(sbuf, p, spans[i].start - p);
+        p = spans[i].start + spans[i].size;
     }
-    return count;
+    msgpack_sbuffer_write(sbuf, p, end - p);
 }
 
-static inline void pack_map(msgpack_packer * packer, msgpack_object * map,
-                            struct filter_nest_ctx *ctx)
+/* Copy the entries of a nested map, prefixing their keys if required */
+static inline void pack_lifted(msgpack_packer *packer, msgpack_sbuffer *sbuf,
+                               struct nest_span *span,
+                               struct filter_nest_ctx *ctx)
 {
-    int i;
-
-    msgpack_object *key;
-
-    for (i = 0; i < map->via.map.size; i++) {
-        key = &map->via.map.ptr[i].key;
+    int ret;
+    uint32_t i;
+    uint32_t klen;
+    size_t ksize;
+    size_t vsize;
+    const char *key;
+    const char *p = span->entries;
+    const char *end = span->entries + span->entries_size;
+
+    if (!ctx->use_prefix) {
+        msgpack_sbuffer_write(sbuf, span->entries, span->entries_size);
+        return;
+    }
 
-        if (ctx->use_prefix) {
-            msgpack_pack_str(packer, ctx->prefix_with_len + key->via.str.size);
-            msgpack_pack_str_body(packer, ctx->prefix_with, ctx->prefix_with_len);
-            msgpack_pack_str_body(packer, key->via.str.ptr, key->via.str.size);
+    for (i = 0; i < span->count; i++) {
+        ret = flb_mp_key(p, end - p, &key, &klen, &ksize);
+        if (ret == 0) {
+            msgpack_pack_str(packer, ctx->prefix_with_len + klen);
+            msgpack_pack_str_body(packer, ctx->prefix_with,
+                                  ctx->prefix_with_len);
+            msgpack_pack_str_body(packer, key, klen);
         }
         else {
-            msgpack_pack_object(packer, *key);
+            flb_mp_object_size(p, end - p, &ksize);
+            msgpack_sbuffer_write(sbuf, p, ksize);
         }
-        msgpack_pack_object(packer, map->via.map.ptr[i].val);
-    }
-}
+        p += ksize;
 
-static inline void map_lift_each_fn(msgpack_packer * packer,
-                                    msgpack_object * map,
-                                    struct filter_nest_ctx *ctx,
-                                    bool(*f) (msgpack_object_kv * kv,
-                                              struct filter_nest_ctx * ctx)
-    )
-{
-    int i;
-    msgpack_object_kv *kv;
-
-    for (i = 0; i < map->via.map.size; i++) {
-        kv = &map->via.map.ptr[i];
-        if ((*f) (kv, ctx)) {
-            pack_map(packer, &kv->val, ctx);
-        }
+        flb_mp_object_size(p, end - p, &vsize);
+        msgpack_sbuffer_write(sbuf, p, vsize);
+        p += vsize;
     }
 }
 
 static inline int apply_lifting_rules(msgpack_packer * packer,
-                                      msgpack_object * root,
+                                      msgpack_sbuffer * sbuf,
+                                      const char *ts, size_t ts_size,
+                                      const char *map, size_t map_size,
                                       struct filter_nest_ctx *ctx)
 {
-    msgpack_object ts = root->via.array.ptr[0];
-    msgpack_object map = root->via.array.ptr[1];
-
-    int items_to_lift = map_count_fn(&map, ctx, &is_kv_to_lift);
+    int i;
+    int items_to_lift;
+    uint32_t count;
+    uint32_t lift_count;
+    size_t hdr;
 
-    if (items_to_lift == 0) {
+    items_to_lift = map_scan(ctx, map, map_size, &count, &hdr, &lift_count);
+    if (items_to_lift <= 0) {
         flb_debug("[filter_nest] Lift : No match found for %s", ctx->nested_under);
         return 0;
     }
@@ -332,62 +344,69 @@ static inline int apply_lifting_rules(msgpack_packer * packer,
     //   current size
     //   - number of maps to lift
     //   + number of element inside maps to lift
-    int toplevel_items =
-        (map.via.map.size - items_to_lift) + count_items_to_lift(&map, ctx);
+    int toplevel_items = (count - items_to_lift) + lift_count;
 
     flb_debug
         ("[filter_nest] Lift : Outer map size is %d, will be %d, lifting %d record(s)",
-         map.via.map.size, toplevel_items, items_to_lift);
+         count, toplevel_items, items_to_lift);
 
     // * Record array init(2)
     msgpack_pack_array(packer, 2);
 
     // * * Record array item 1/2
-    msgpack_pack_object(packer, ts);
+    msgpack_sbuffer_write(sbuf, ts, ts_size);
 
     // * * Record array item 2/2
     // * * Create a new map with top-level number of items
     msgpack_pack_map(packer, (size_t) toplevel_items);
 
-    // * * Pack all current top-level items excluding the nested_under keys
-    map_pack_each_fn(packer, &map, ctx, &is_not_kv_to_lift);
+    // * * Copy all current top-level items excluding the nested_under keys
+    pack_unmatched(sbuf, map + hdr, map + map_size,
+                   ctx->spans, items_to_lift);
 
-    // * * Lift and pack all elements in nested_under keys
-    map_lift_each_fn(packer, &map, ctx, &is_kv_to_lift);
+    // * * Lift and copy all elements in nested_under keys
+    for (i = 0; i < items_to_lift; i++) {
+        pack_lifted(packer, sbuf, &ctx->spans[i], ctx);
+    }
 
     return 1;
 }
 
 static inline int apply_nesting_rules(msgpack_packer * packer,
-                                      msgpack_object * root,
+                                      msgpack_sbuffer * sbuf,
+                                      const char *ts, size_t ts_size,
+                                      const char *map, size_t map_size,
                                       struct filter_nest_ctx *ctx)
 {
-    msgpack_object ts = root->via.array.ptr[0];
-    msgpack_object map = root->via.array.ptr[1];
-
-    size_t items_to_nest = map_count_fn(&map, ctx, &is_kv_to_nest);
+    int i;
+    int items_to_nest;
+    uint32_t count;
+    uint32_t lift_count;
+    size_t hdr;
 
-    if (items_to_nest == 0) {
+    items_to_nest = map_scan(ctx, map, map_size, &count, &hdr, &lift_count);
+    if (items_to_nest <= 0) {
         flb_debug("[filter_nest] Nest : No match found for %s", ctx->wildcard);
         return 0;
     }
 
-    size_t toplevel_items = (map.via.map.size - items_to_nest + 1);
+    size_t toplevel_items = (count - items_to_nest + 1);
 
     flb_debug
         ("[filter_nest] Nest : Outer map size is %d, will be %d, nested map size will be %d",
-         map.via.map.size, toplevel_items, items_to_nest);
+         count, toplevel_items, items_to_nest);
 
     // * Record array init(2)
     msgpack_pack_array(packer, 2);
 
     // * * Record array item 1/2
-    msgpack_pack_object(packer, ts);
+    msgpack_sbuffer_write(sbuf, ts, ts_size);
 
     // * * Record array item 2/2
     // * * Create a new map with toplevel items +1 for nested map
     msgpack_pack_map(packer, toplevel_items);
-    map_pack_each_fn(packer, &map, ctx, &is_not_kv_to_nest);
+    pack_unmatched(sbuf, map + hdr, map + map_size,
+                   ctx->spans, items_to_nest);
 
     // * * * Pack the nested map key
     helper_pack_string(packer, ctx->nesting_key, ctx->nesting_key_len);
@@ -395,8 +414,10 @@ static inline int apply_nesting_rules(msgpack_packer * packer,
     // * * * Create the nest map value
     msgpack_pack_map(packer, items_to_nest);
 
-    // * * * * Pack the nested items
-    map_pack_each_fn(packer, &map, ctx, &is_kv_to_nest);
+    // * * * * Copy the nested items
+    for (i = 0; i < items_to_nest; i++) {
+        msgpack_sbuffer_write(sbuf, ctx->spans[i].start, ctx->spans[i].size);
+    }
 
     return 1;
 }
@@ -406,7 +427,7 @@ static int cb_nest_init(struct flb_filter_instance *f_ins,
 {
     struct filter_nest_ctx *ctx;
 
-    ctx = flb_malloc(sizeof(struct filter_nest_ctx));
+    ctx = flb_calloc(1, sizeof(struct filter_nest_ctx));
     if (!ctx) {
         flb_errno();
         return -1;
@@ -427,8 +448,12 @@ static int cb_nest_filter(void *data, size_t bytes,
                           struct flb_filter_instance *f_ins,
                           void *context, struct flb_config *config)
 {
-    msgpack_unpacked result;
+    int ret;
     size_t off = 0;
+    size_t rec_size;
+    size_t ts_size;
+    const char *rec;
+    const char *map;
     (void) f_ins;
     (void) config;
 
@@ -436,10 +461,7 @@ static int cb_nest_filter(void *data, size_t bytes,
     int modified_records = 0;
 
     msgpack_sbuffer buffer;
-    msgpack_sbuffer_init(&buffer);
-
     msgpack_packer packer;
-    msgpack_packer_init(&packer, &buffer, msgpack_sbuffer_write);
 
     // Records come in the format,
     //
@@ -448,35 +470,63 @@ static int cb_nest_filter(void *data, size_t bytes,
     //
     // Example record,
     // [1123123, {"Mem.total"=>4050908, "Mem.used"=>476576, "Mem.free"=>3574332 } ]
+    //
+    // Records are not unpacked: the entries are copied as raw byte ranges
+    // and only the map headers are written again. Records without matches
+    // are copied as they are.
+
+    while (off < bytes) {
+        rec = (char *) data + off;
+        ret = flb_mp_object_size(rec, bytes - off, &rec_size);
+        if (ret == -1) {
+            break;
+        }
+        off += rec_size;
 
-    msgpack_unpacked_init(&result);
-    while (msgpack_unpack_next(&result, data, bytes, &off)) {
-        if (result.data.type == MSGPACK_OBJECT_ARRAY) {
+        if (modified_records == 0) {
+            /* Start the new chunk with the untouched records */
+            msgpack_sbuffer_init(&buffer);
+            msgpack_packer_init(&packer, &buffer, msgpack_sbuffer_write);
+            msgpack_sbuffer_write(&buffer, data, rec - (char *) data);
+        }
+
+        ret = 0;
+        if ((unsigned char) rec[0] == 0x92 &&
+            flb_mp_object_size(rec + 1, rec_size - 1, &ts_size) == 0) {
+            map = rec + 1 + ts_size;
             if (ctx->operation == NEST) {
-                modified_records +=
-                    apply_nesting_rules(&packer, &result.data, ctx);
+                ret = apply_nesting_rules(&packer, &buffer, rec + 1, ts_size,
+                                          map, rec_size - 1 - ts_size, ctx);
             }
             else {
-                modified_records +=
-                    apply_lifting_rules(&packer, &result.data, ctx);
+                ret = apply_lifting_rules(&packer, &buffer, rec + 1, ts_size,
+                                          map, rec_size - 1 - ts_size, ctx);
             }
         }
         else {
             flb_debug("[filter_nest] Record is NOT an array, skipping");
-            msgpack_pack_object(&packer, result.data);
         }
-    }
-    msgpack_unpacked_destroy(&result);
 
-    *out_buf = buffer.data;
-    *out_size = buffer.size;
+        if (ret == 0) {
+            if (modified_records == 0) {
+                msgpack_sbuffer_destroy(&buffer);
+            }
+            else {
+                msgpack_sbuffer_write(&buffer, rec, rec_size);
+            }
+            continue;
+        }
+        modified_records += ret;
+    }
 
     if (modified_records == 0) {
         return FLB_FILTER_NOTOUCH;
     }
-    else {
-        return FLB_FILTER_MODIFIED;
-    }
+
+    *out_buf = buffer.data;
+    *out_size = buffer.size;
+
+    return FLB_FILTER_MODIFIED;
 }
 
 static int cb_nest_exit(void *data, struct flb_config *config)
@@ -487,6 +537,7 @@ static int cb_nest_exit(void *data, struct flb_config *config)
     flb_free(ctx->wildcard);
     flb_free(ctx->nested_under);
     flb_free(ctx->prefix_with);
+    flb_free(ctx->spans);
     flb_free(ctx);
     return 0;
 }
@@ -25,6 +25,19 @@ enum FILTER_NEST_OPERATION {
   LIFT
 };
 
+/*
+ * A key/value pair of the current record to nest or lift, as a raw byte
+ * range of the record. For lift, the entries of the nested map too.
+ */
+struct nest_span
+{
+    const char *start;
+    size_t size;
+    const char *entries;
+    size_t entries_size;
+    uint32_t count;
+};
+
 struct filter_nest_ctx
 {
     enum FILTER_NEST_OPERATION operation;
@@ -40,6 +53,9 @@ struct filter_nest_ctx
     char *prefix_with;
     int prefix_with_len;
     bool use_prefix;
+    // matches of the current record
+    int spans_size;
+    struct nest_span *spans;
 };
 
 #endif
@@ -23,6 +23,7 @@
 #include <fluent-bit/flb_time.h>
 #include <fluent-bit/flb_mem.h>
 #include <fluent-bit/flb_pack.h>
+#include <fluent-bit/flb_mp.h>
 #include <msgpack.h>
 
 #include <string.h>
@@ -50,7 +51,8 @@ static int msgpackobj2char(msgpack_object *obj,
 }
 
 static int add_parser(char *parser, struct filter_parser_ctx *ctx,
-                       struct flb_config *config)
+                      struct flb_filter_instance *f_ins,
+                      struct flb_config *config)
 {
     struct flb_parser *p;
     struct filter_parser *fp;
@@ -60,13 +62,32 @@ static int add_parser(char *parser, struct filter_parser_ctx *ctx,
         return -1;
     }
 
-    fp = flb_malloc(sizeof(struct filter_parser));
+    fp = flb_calloc(1, sizeof(struct filter_parser));
     if (!fp) {
         flb_errno();
         return -1;
     }
 
+    fp->id = ctx->parsers_num++;
     fp->parser = p;
+
+#ifdef FLB_HAVE_METRICS
+    if (f_ins->metrics) {
+        fp->metrics = flb_metrics_create_child("parser", parser,
+                                               f_ins->metrics);
+    }
+    if (fp->metrics) {
+        flb_metrics_add(FLB_FILTER_PARSER_METRIC_ATTEMPTS, "attempts",
+                        fp->metrics);
+        flb_metrics_add(FLB_FILTER_PARSER_METRIC_FAILURES, "failures",
+                        fp->metrics);
+        fp->m_attempts = flb_metrics_get_id(FLB_FILTER_PARSER_METRIC_ATTEMPTS,
+                                            fp->metrics);
+        fp->m_failures = flb_metrics_get_id(FLB_FILTER_PARSER_METRIC_FAILURES,
+                                            fp->metrics);
+    }
+#endif
+
     mk_list_add(&fp->_head, &ctx->parsers);
     return 0;
 }
@@ -81,6 +102,11 @@ static int delete_parsers(struct filter_parser_ctx *ctx)
     mk_list_foreach_safe(head, tmp, &ctx->parsers) {
         fp = mk_list_entry(head, struct filter_parser, _head);
         mk_list_del(&fp->_head);
+#ifdef FLB_HAVE_METRICS
+        if (fp->metrics) {
+            flb_metrics_destroy(fp->metrics);
+        }
+#endif
         flb_free(fp);
         c++;
     }
@@ -88,12 +114,27 @@ static int delete_parsers(struct filter_parser_ctx *ctx)
     return c;
 }
 
+static void ctx_destroy(struct filter_parser_ctx *ctx)
+{
+    delete_parsers(ctx);
+    if (ctx->memo) {
+        flb_hash_destroy(ctx->memo);
+    }
+    flb_free(ctx->order);
+    flb_free(ctx->key_name);
+    flb_free(ctx);
+}
+
 static int configure(struct filter_parser_ctx *ctx,
                      struct flb_filter_instance *f_ins,
                      struct flb_config *config)
 {
+    int i = 0;
     int ret;
     char *tmp;
+    struct mk_list *head;
+    struct flb_config_prop *prop;
+    struct filter_parser *fp;
 
     ctx->key_name = NULL;
     ctx->reserve_data = FLB_FALSE;
@@ -110,12 +151,16 @@ static int configure(struct filter_parser_ctx *ctx,
         return -1;
     }
 
-    /* Parsers */
-    tmp = flb_filter_get_property("parser", f_ins);
-    if (tmp) {
-        ret = add_parser(tmp, ctx, config);
+    /* Parsers: tried in the order they are set */
+    mk_list_foreach(head, &f_ins->properties) {
+        prop = mk_list_entry(head, struct flb_config_prop, _head);
+        if (strcasecmp(prop->key, "parser") != 0) {
+            continue;
+        }
+        ret = add_parser(prop->val, ctx, f_ins, config);
         if (ret == -1) {
-            flb_error("[filter_parser] requested parser '%s' not found", tmp);
+            flb_error("[filter_parser] requested parser '%s' not found",
+                      prop->val);
         }
     }
 
@@ -124,6 +169,16 @@ static int configure(struct filter_parser_ctx *ctx,
         return -1;
     }
 
+    ctx->order = flb_malloc(sizeof(struct filter_parser *) * ctx->parsers_num);
+    if (!ctx->order) {
+        flb_errno();
+        return -1;
+    }
+    mk_list_foreach(head, &ctx->parsers) {
+        fp = mk_list_entry(head, struct filter_parser, _head);
+        ctx->order[i++] = fp;
+    }
+
     /* Reserve data */
     tmp = flb_filter_get_property("reserve_data", f_ins);
     if (tmp) {
@@ -136,9 +191,125 @@ static int configure(struct filter_parser_ctx *ctx,
         ctx->preserve_key = flb_utils_bool(tmp);
     }
 
+    /* Adaptive order, only useful with more than one parser */
+    tmp = flb_filter_get_property("adaptive_order", f_ins);
+    if (tmp && flb_utils_bool(tmp) && ctx->parsers_num > 1) {
+        ctx->adaptive = FLB_TRUE;
+        ctx->memo = flb_hash_create(FLB_HASH_EVICT_LRU,
+                                    FLB_FILTER_PARSER_MEMO_SIZE,
+                                    FLB_FILTER_PARSER_MEMO_SIZE);
+        if (!ctx->memo) {
+            return -1;
+        }
+    }
+
     return 0;
 }
 
+/*
+ * Sort the parsers by decreasing number of matches. The counts are halved
+ * on each sort so the order follows changes in the stream.
+ */
+static void parsers_reorder(struct filter_parser_ctx *ctx)
+{
+    int i;
+    int j;
+    struct filter_parser *fp;
+
+    for (i = 1; i < ctx->parsers_num; i++) {
+        fp = ctx->order[i];
+        for (j = i; j > 0 && ctx->order[j - 1]->hits < fp->hits; j--) {
+            ctx->order[j] = ctx->order[j - 1];
+        }
+        ctx->order[j] = fp;
+    }
+
+    for (i = 0; i < ctx->parsers_num; i++) {
+        ctx->order[i]->hits /= 2;
+    }
+}
+
+/* Last parser that matched a record of the tag, -1 if unknown */
+static int memo_get(struct filter_parser_ctx *ctx, char *tag, int tag_len)
+{
+    int id;
+    int ret;
+    char *val;
+    size_t size;
+
+    ret = flb_hash_get(ctx->memo, tag, tag_len, &val, &size);
+    if (ret == -1 || size != sizeof(int)) {
+        return -1;
+    }
+    memcpy(&id, val, sizeof(int));
+
+    return id;
+}
+
+static inline int parser_try(struct filter_parser *fp,
+                             char *val_str, int val_len,
+                             char **out_buf, size_t *out_size,
+                             struct flb_time *parsed_time)
+{
+    int ret;
+
+    ret = flb_parser_do(fp->parser, val_str, val_len,
+                        (void **) out_buf, out_size, parsed_time);
+#ifdef FLB_HAVE_METRICS
+    if (fp->metrics) {
+        flb_metric_sum(fp->m_attempts, 1);
+        if (ret < 0) {
+            flb_metric_sum(fp->m_failures, 1);
+        }
+    }
+#endif
+    if (ret >= 0) {
+        fp->hits++;
+    }
+
+    return ret;
+}
+
+/*
+ * Parse a value with the first parser that matches, starting with the
+ * parser 'first' if set. Returns the id of the matching parser or -1.
+ */
+static int parse_value(struct filter_parser_ctx *ctx, int first,
+                       char *val_str, int val_len,
+                       char **out_buf, size_t *out_size,
+                       struct flb_time *parsed_time)
+{
+    int i;
+    struct filter_parser *fp;
+
+    if (first >= 0) {
+        for (i = 0; i < ctx->parsers_num; i++) {
+            fp = ctx->order[i];
+            if (fp->id != first) {
+                continue;
+            }
+            if (parser_try(fp, val_str, val_len,
+                           out_buf, out_size, parsed_time) >= 0) {
+                return fp->id;
+            }
+            break;
+        }
+    }
+
+    for (i = 0; i < ctx->parsers_num; i++) {
+        fp = ctx->order[i];
+        if (fp->id == first) {
+            continue;
+        }
+        if (parser_try(fp, val_str, val_len,
+                       out_buf, out_size, parsed_time) >= 0) {
+            return fp->id;
+        }
+    }
+
+    return -1;
+}
+
 static int cb_parser_init(struct flb_filter_instance *f_ins,
                           struct flb_config *config,
                           void *data)
@@ -150,14 +321,14 @@ static int cb_parser_init(struct flb_filter_instance *f_ins,
     struct filter_parser_ctx *ctx = NULL;
 
     /* Create context */
-    ctx = flb_malloc(sizeof(struct filter_parser_ctx));
+    ctx = flb_calloc(1, sizeof(struct filter_parser_ctx));
     if (!ctx) {
         flb_errno();
         return -1;
     }
 
     if ( configure(ctx, f_ins, config) < 0 ){
-        flb_free(ctx);
+        ctx_destroy(ctx);
         return -1;
     }
 
@@ -173,9 +344,12 @@ static int cb_parser_filter(void *data, size_t bytes,
                             void *context,
                             struct flb_config *config)
 {
+    int id;
+    int memo = -1;
+    int memo_tag = -1;
     int continue_parsing;
     struct filter_parser_ctx *ctx = context;
-    msgpack_unpacked result;
+    msgpack_unpacked *result;
     size_t off = 0;
     (void) f_ins;
     (void) config;
@@ -199,22 +373,32 @@ static int cb_parser_filter(void *data, size_t bytes,
     msgpack_object_kv **append_arr = NULL;
     size_t            append_arr_len;
     int                append_arr_i;
-    struct mk_list *head;
-    struct filter_parser *fp;
 
     /* Create temporal msgpack buffer */
     msgpack_sbuffer_init(&tmp_sbuf);
     msgpack_packer_init(&tmp_pck, &tmp_sbuf, msgpack_sbuffer_write);
 
-    msgpack_unpacked_init(&result);
-    while (msgpack_unpack_next(&result, data, bytes, &off)) {
+    result = flb_mp_unpacker_get();
+    if (!result) {
+        msgpack_sbuffer_destroy(&tmp_sbuf);
+        return FLB_FILTER_NOTOUCH;
+    }
+
+    /* Start with the parser that matched the last record of the tag */
+    if (ctx->adaptive) {
+        memo = memo_get(ctx, tag, tag_len);
+        memo_tag = memo;
+    }
+
+    while (flb_mp_unpack_next(result, data, bytes, &off) ==
+           MSGPACK_UNPACK_SUCCESS) {
         out_buf = NULL;
         append_arr_i = 0;
 
-        if (result.data.type != MSGPACK_OBJECT_ARRAY) {
+        if (result->data.type != MSGPACK_OBJECT_ARRAY) {
             continue;
         }
-        flb_time_pop_from_msgpack(&tm, &result, &obj);
+        flb_time_pop_from_msgpack(&tm, result, &obj);
         if (obj->type == MSGPACK_OBJECT_MAP) {
             map_num = obj->via.map.size;
             if (ctx->reserve_data) {
@@ -222,7 +406,7 @@ static int cb_parser_filter(void *data, size_t bytes,
                 append_arr = flb_malloc(sizeof(msgpack_object_kv*) * append_arr_len);
                 if (!append_arr) {
                     flb_errno();
-                    msgpack_unpacked_destroy(&result);
+                    flb_mp_unpacker_put(result);
                     msgpack_sbuffer_destroy(&tmp_sbuf);
                     return FLB_FILTER_NOTOUCH;
                 }
@@ -243,7 +427,7 @@ static int cb_parser_filter(void *data, size_t bytes,
                     /* key is not string */
                     continue;
                 }
-                if (key_len == ctx->key_name_len &&
+                if (out_buf == NULL && key_len == ctx->key_name_len &&
                     !strncmp(key_str, ctx->key_name, key_len)) {
                     if ( msgpackobj2char(&kv->val, &val_str, &val_len) < 0 ) {
                         /* val is not string */
@@ -251,28 +435,29 @@ static int cb_parser_filter(void *data, size_t bytes,
                     }
 
                     /* Lookup parser */
-                    mk_list_foreach(head, &ctx->parsers) {
-                        fp = mk_list_entry(head, struct filter_parser, _head);
-
-                        ret = flb_parser_do(fp->parser, val_str, val_len,
-                                            (void **) &out_buf, &out_size,
-                                            &parsed_time);
-                        if (ret >= 0) {
-                            if (flb_time_to_double(&parsed_time) != 0) {
-                                flb_time_copy(&tm, &parsed_time);
-                            }
-                            if (ctx->reserve_data) {
-                                if (!ctx->preserve_key) {
-                                    append_arr_i--;
-                                    append_arr_len--;
-                                    append_arr[append_arr_i] = NULL;
-                                }
+                    id = parse_value(ctx, memo, val_str, val_len,
+                                     &out_buf, &out_size, &parsed_time);
+                    if (id >= 0) {
+                        if (ctx->adaptive) {
+                            memo = id;
+                            if (++ctx->records %
+                                FLB_FILTER_PARSER_REORDER == 0) {
+                                parsers_reorder(ctx);
                             }
-                            else {
-                                continue_parsing = FLB_FALSE;
-                                break;
+                        }
+                        if (flb_time_to_double(&parsed_time) != 0) {
+                            flb_time_copy(&tm, &parsed_time);
+                        }
+                        if (ctx->reserve_data) {
+                            if (!ctx->preserve_key) {
+                                append_arr_i--;
+                                append_arr_len--;
+                                append_arr[append_arr_i] = NULL;
                             }
                         }
+                        else {
+                            continue_parsing = FLB_FALSE;
+                        }
                     }
                 }
             }
@@ -290,7 +475,7 @@ static int cb_parser_filter(void *data, size_t bytes,
                     if (ret == -1) {
                         flb_error("[filter_parser] cannot expand map");
                         flb_free(append_arr);
-                        msgpack_unpacked_destroy(&result);
+                        flb_mp_unpacker_put(result);
                         return FLB_FILTER_NOTOUCH;
                     }
 
@@ -304,7 +489,7 @@ static int cb_parser_filter(void *data, size_t bytes,
             }
             else {
                 /* re-use original data*/
-                msgpack_pack_object(&tmp_pck, result.data);
+                msgpack_pack_object(&tmp_pck, result->data);
             }
             flb_free(append_arr);
             append_arr = NULL;
@@ -313,7 +498,11 @@ static int cb_parser_filter(void *data, size_t bytes,
             continue;
         }
     }
-    msgpack_unpacked_destroy(&result);
+    flb_mp_unpacker_put(result);
+
+    if (memo != memo_tag) {
+        flb_hash_add(ctx->memo, tag, tag_len, (char *) &memo, sizeof(int));
+    }
 
     if (ret == FLB_FILTER_NOTOUCH) {
         /* Destroy the buffer to avoid more overhead */
@@ -333,8 +522,7 @@ static int cb_parser_exit(void *data, struct flb_config *config)
     struct filter_parser_ctx *ctx = data;
 
     if (ctx != NULL) {
-        delete_parsers(ctx);
-        flb_free(ctx);
+        ctx_destroy(ctx);
     }
     return 0;
 }
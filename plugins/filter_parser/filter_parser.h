@@ -21,9 +21,31 @@
 #define FLB_FILTER_PARSER_H
 
 #include <fluent-bit/flb_parser.h>
+#include <fluent-bit/flb_hash.h>
+
+#ifdef FLB_HAVE_METRICS
+#include <fluent-bit/flb_metrics.h>
+
+/* Metrics of each parser, labelled with the parser name */
+#define FLB_FILTER_PARSER_METRIC_ATTEMPTS   100
+#define FLB_FILTER_PARSER_METRIC_FAILURES   101
+#endif
+
+/* Adaptive order: parsed records between two sorts of the parsers */
+#define FLB_FILTER_PARSER_REORDER   1024
+
+/* Adaptive order: tags remembered with their last matching parser */
+#define FLB_FILTER_PARSER_MEMO_SIZE 256
 
 struct filter_parser {
+    int id;                             /* position in the config  */
+    uint64_t hits;                      /* matches, decayed        */
     struct flb_parser *parser;
+#ifdef FLB_HAVE_METRICS
+    struct flb_metrics *metrics;
+    struct flb_metric *m_attempts;
+    struct flb_metric *m_failures;
+#endif
     struct mk_list _head;
 };
 
@@ -33,6 +55,16 @@ struct filter_parser_ctx {
     int    reserve_data;
     int    preserve_key;
 
+    /*
+     * Adaptive order: the parsers are tried by decreasing number of
+     * matches, after the last one that matched a record of the tag.
+     */
+    int adaptive;
+    uint64_t records;                   /* records parsed          */
+    struct flb_hash *memo;              /* tag -> parser id        */
+
+    int parsers_num;
+    struct filter_parser **order;       /* parsers, attempts order */
     struct mk_list parsers;
 };
 
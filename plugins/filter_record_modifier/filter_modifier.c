@@ -23,6 +23,9 @@
 #include <fluent-bit/flb_utils.h>
 #include <fluent-bit/flb_mem.h>
 #include <fluent-bit/flb_time.h>
+#include <fluent-bit/flb_mp.h>
+
+#include <ctype.h>
 
 #include <msgpack.h>
 #include "filter_modifier.h"
@@ -144,9 +147,113 @@ static int delete_list(struct record_modifier_ctx *ctx)
         flb_free(record);
     }
 
+    if (ctx->keys_hash) {
+        flb_hash_destroy(ctx->keys_hash);
+    }
+    flb_free(ctx->dynamic_keys);
+    flb_free(ctx->key_buf);
+    flb_free(ctx->records_buf);
+    flb_free(ctx->spans);
+
+    return 0;
+}
+
+/* Pack the 'Record' pairs once, they are appended as is to every record */
+static int records_prepare(struct record_modifier_ctx *ctx)
+{
+    struct mk_list *head;
+    struct modifier_record *mod_rec;
+    msgpack_sbuffer sbuf;
+    msgpack_packer pck;
+
+    if (ctx->records_num == 0) {
+        return 0;
+    }
+
+    msgpack_sbuffer_init(&sbuf);
+    msgpack_packer_init(&pck, &sbuf, msgpack_sbuffer_write);
+
+    mk_list_foreach(head, &ctx->records) {
+        mod_rec = mk_list_entry(head, struct modifier_record,  _head);
+        msgpack_pack_str(&pck, mod_rec->key_len);
+        msgpack_pack_str_body(&pck, mod_rec->key, mod_rec->key_len);
+        msgpack_pack_str(&pck, mod_rec->val_len);
+        msgpack_pack_str_body(&pck, mod_rec->val, mod_rec->val_len);
+    }
+
+    ctx->records_buf = sbuf.data;
+    ctx->records_size = sbuf.size;
     return 0;
 }
 
+/*
+ * Index the 'Remove_key' or 'Whitelist_key' entries: exact keys go to a
+ * hash table and 'prefix*' keys to a short array. Keys are compared case
+ * insensitive, the hash table holds them lowercase.
+ */
+static int keys_prepare(struct record_modifier_ctx *ctx)
+{
+    int i;
+    int id;
+    int total;
+    struct mk_list *head;
+    struct mk_list *check;
+    struct modifier_key *mod_key;
+
+    if (ctx->remove_keys_num > 0) {
+        check = &ctx->remove_keys;
+        total = ctx->remove_keys_num;
+        ctx->is_to_delete = FLB_TRUE;
+    }
+    else if (ctx->whitelist_keys_num > 0) {
+        check = &ctx->whitelist_keys;
+        total = ctx->whitelist_keys_num;
+        ctx->is_to_delete = FLB_FALSE;
+    }
+    else {
+        return 0;
+    }
+
+    ctx->keys_hash = flb_hash_create(FLB_HASH_EVICT_NONE, total, -1);
+    ctx->dynamic_keys = flb_malloc(sizeof(struct modifier_key *) * total);
+    if (!ctx->keys_hash || !ctx->dynamic_keys) {
+        flb_errno();
+        return -1;
+    }
+
+    mk_list_foreach(head, check) {
+        mod_key = mk_list_entry(head, struct modifier_key,  _head);
+        if (mod_key->dynamic_key == FLB_TRUE) {
+            ctx->dynamic_keys[ctx->dynamic_keys_num++] = mod_key;
+        }
+        else if (mod_key->key_len > ctx->keys_max_len) {
+            ctx->keys_max_len = mod_key->key_len;
+        }
+    }
+
+    ctx->key_buf = flb_malloc(ctx->keys_max_len + 1);
+    if (!ctx->key_buf) {
+        flb_errno();
+        return -1;
+    }
+
+    mk_list_foreach(head, check) {
+        mod_key = mk_list_entry(head, struct modifier_key,  _head);
+        if (mod_key->dynamic_key == FLB_TRUE) {
+            continue;
+        }
+        for (i = 0; i < mod_key->key_len; i++) {
+            ctx->key_buf[i] = tolower(mod_key->key[i]);
+        }
+        id = flb_hash_add(ctx->keys_hash, ctx->key_buf, mod_key->key_len,
+                          "1", 1);
+        if (id == -1) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
 
 static int cb_modifier_init(struct flb_filter_instance *f_ins,
                                 struct flb_config *config,
@@ -155,7 +262,7 @@ static int cb_modifier_init(struct flb_filter_instance *f_ins,
     struct record_modifier_ctx *ctx = NULL;
 
     /* Create context */
-    ctx = flb_malloc(sizeof(struct record_modifier_ctx));
+    ctx = flb_calloc(1, sizeof(struct record_modifier_ctx));
     if (!ctx) {
         flb_errno();
         return -1;
@@ -164,8 +271,10 @@ static int cb_modifier_init(struct flb_filter_instance *f_ins,
     mk_list_init(&ctx->remove_keys);
     mk_list_init(&ctx->whitelist_keys);
 
-    if ( configure(ctx, f_ins) < 0 ){
+    if (configure(ctx, f_ins) < 0 ||
+        records_prepare(ctx) < 0 || keys_prepare(ctx) < 0) {
         delete_list(ctx);
+        flb_free(ctx);
         return -1;
     }
 
@@ -174,74 +283,125 @@ static int cb_modifier_init(struct flb_filter_instance *f_ins,
     return 0;
 }
 
-static int make_bool_map(struct record_modifier_ctx *ctx, msgpack_object *map,
-                             bool_map_t *bool_map, int map_num)
+static inline int key_match(struct record_modifier_ctx *ctx,
+                            const char *key, uint32_t key_len)
 {
-    struct mk_list *tmp;
-    struct mk_list *head;
-    struct mk_list *check = NULL;
-    msgpack_object_kv *kv;
+    int i;
+    char *val;
+    size_t size;
     struct modifier_key *mod_key;
 
-    char result;
-    char is_to_delete;
-    msgpack_object *key;
-    int ret = map_num;
-    int i;
+    if (key_len > 0 && key_len <= ctx->keys_max_len) {
+        for (i = 0; i < key_len; i++) {
+            ctx->key_buf[i] = tolower(key[i]);
+        }
+        if (flb_hash_get(ctx->keys_hash, ctx->key_buf, key_len,
+                         &val, &size) != -1) {
+            return FLB_TRUE;
+        }
+    }
 
-    for (i=0; i<map_num; i++) {
-        bool_map[i] = TO_BE_REMAINED;
+    for (i = 0; i < ctx->dynamic_keys_num; i++) {
+        mod_key = ctx->dynamic_keys[i];
+        if (key_len >= mod_key->key_len &&
+            strncasecmp(key, mod_key->key, mod_key->key_len) == 0) {
+            return FLB_TRUE;
+        }
     }
-    bool_map[map_num] = TAIL_OF_ARRAY;/* tail of map */
 
-    if (ctx->remove_keys_num > 0) {
-        check = &(ctx->remove_keys);
-        is_to_delete = FLB_TRUE;
+    return FLB_FALSE;
+}
+
+static inline struct modifier_span *span_get(struct record_modifier_ctx *ctx,
+                                             int n)
+{
+    int new_size;
+    struct modifier_span *tmp;
+
+    if (n == ctx->spans_size) {
+        new_size = ctx->spans_size ? ctx->spans_size * 2 : 16;
+        tmp = flb_realloc(ctx->spans, new_size * sizeof(struct modifier_span));
+        if (!tmp) {
+            flb_errno();
+            return NULL;
+        }
+        ctx->spans = tmp;
+        ctx->spans_size = new_size;
     }
-    else if(ctx->whitelist_keys_num > 0) {
-        check = &(ctx->whitelist_keys);
-        is_to_delete = FLB_FALSE;
+
+    return &ctx->spans[n];
+}
+
+/*
+ * Scan the keys of a record map and collect the entries to remove as raw
+ * byte ranges. Returns the number of entries removed, or -1 if the map is
+ * not valid.
+ */
+static int record_scan(struct record_modifier_ctx *ctx,
+                       const char *map, size_t map_size,
+                       uint32_t *count, size_t *hdr)
+{
+    int n = 0;
+    int ret;
+    int result;
+    uint32_t i;
+    uint32_t key_len;
+    size_t key_size;
+    size_t val_size;
+    const char *key;
+    const char *start;
+    const char *p;
+    const char *end = map + map_size;
+    struct modifier_span *span;
+
+    ret = flb_mp_map_header(map, map_size, count, hdr);
+    if (ret == -1) {
+        return -1;
     }
 
-    if (check != NULL){
-        kv = map->via.map.ptr;
-        for(i=0; i<map_num; i++){
-            key = &(kv+i)->key;
-            result = FLB_FALSE;
-
-            mk_list_foreach_safe(head, tmp, check) {
-                mod_key = mk_list_entry(head, struct modifier_key,  _head);
-                if (key->via.bin.size != mod_key->key_len &&
-                    key->via.str.size != mod_key->key_len &&
-                    mod_key->dynamic_key == FLB_FALSE) {
-                    continue;
-                }
-                if (key->via.bin.size < mod_key->key_len &&
-                    key->via.str.size < mod_key->key_len &&
-                    mod_key->dynamic_key == FLB_TRUE) {
-                    continue;
-                }
-                if ((key->type == MSGPACK_OBJECT_BIN &&
-                     !strncasecmp(key->via.bin.ptr, mod_key->key,
-                                  mod_key->key_len)) ||
-                    (key->type == MSGPACK_OBJECT_STR &&
-                     !strncasecmp(key->via.str.ptr, mod_key->key,
-                                  mod_key->key_len))
-                    ) {
-                    result = FLB_TRUE;
-                    break;
-                }
-            }
-            if (result == is_to_delete) {
-                bool_map[i] = TO_BE_REMOVED;
-                ret--;
-            }
+    if (!ctx->keys_hash) {
+        return 0;
+    }
+
+    p = map + *hdr;
+    for (i = 0; i < *count; i++) {
+        start = p;
+
+        ret = flb_mp_key(p, end - p, &key, &key_len, &key_size);
+        if (ret == -1 && flb_mp_object_size(p, end - p, &key_size) == -1) {
+            return -1;
+        }
+        p += key_size;
+        if (flb_mp_object_size(p, end - p, &val_size) == -1) {
+            return -1;
+        }
+        p += val_size;
+
+        result = FLB_FALSE;
+        if (ret == 0) {
+            result = key_match(ctx, key, key_len);
+        }
+        if (result != ctx->is_to_delete) {
+            continue;
         }
+
+        span = span_get(ctx, n);
+        if (!span) {
+            return -1;
+        }
+        span->start = start;
+        span->size = p - start;
+        n++;
     }
 
-    return ret;
+    return n;
 }
 
+/*
+ * Records are not unpacked: the kept entries are copied as raw byte ranges,
+ * the map header is written with the new number of entries and the 'Record'
+ * pairs are appended from the buffer packed at init.
+ */
 static int cb_modifier_filter(void *data, size_t bytes,
                                   char *tag, int tag_len,
                                   void **out_buf, size_t *out_size,
@@ -251,88 +411,80 @@ static int cb_modifier_filter(void *data, size_t bytes,
 {
     struct record_modifier_ctx *ctx = context;
     char is_modified = FLB_FALSE;
-    size_t off = 0;
     int i;
-    int removed_map_num  = 0;
-    int map_num          = 0;
-    bool_map_t bool_map[128];
+    int removed;
+    uint32_t count;
+    uint32_t new_count;
+    size_t off = 0;
+    size_t hdr;
+    size_t rec_size;
+    size_t ts_size;
+    const char *rec;
+    const char *map;
+    const char *p;
+    const char *end;
     (void) f_ins;
     (void) config;
-    struct flb_time tm;
-    struct modifier_record *mod_rec;
     msgpack_sbuffer tmp_sbuf;
     msgpack_packer tmp_pck;
-    msgpack_unpacked result;
-    msgpack_object  *obj;
-    msgpack_object_kv *kv;
-    struct mk_list *tmp;
-    struct mk_list *head;
-
-    /* Create temporal msgpack buffer */
-    msgpack_sbuffer_init(&tmp_sbuf);
-    msgpack_packer_init(&tmp_pck, &tmp_sbuf, msgpack_sbuffer_write);
 
-    /* Iterate each item to know map number */
-    msgpack_unpacked_init(&result);
-    while (msgpack_unpack_next(&result, data, bytes, &off)) {
-        map_num = 0;
-        removed_map_num = 0;
-        if (result.data.type != MSGPACK_OBJECT_ARRAY) {
-            continue;
+    while (off < bytes) {
+        rec = (char *) data + off;
+        if (flb_mp_object_size(rec, bytes - off, &rec_size) == -1) {
+            break;
         }
-
-        flb_time_pop_from_msgpack(&tm, &result, &obj);
-
-        /* grep keys */
-        if (obj->type == MSGPACK_OBJECT_MAP) {
-            map_num = obj->via.map.size;
-            removed_map_num = make_bool_map(ctx, obj,
-                                            bool_map, obj->via.map.size);
+        off += rec_size;
+
+        removed = -1;
+        if ((unsigned char) rec[0] == 0x92 &&
+            flb_mp_object_size(rec + 1, rec_size - 1, &ts_size) == 0) {
+            map = rec + 1 + ts_size;
+            removed = record_scan(ctx, map, rec_size - 1 - ts_size,
+                                  &count, &hdr);
         }
-        else {
+
+        /* Nothing to do on this record */
+        if (removed == -1 || (removed == 0 && ctx->records_num == 0)) {
+            if (is_modified == FLB_TRUE) {
+                msgpack_sbuffer_write(&tmp_sbuf, rec, rec_size);
+            }
             continue;
         }
 
-        if (removed_map_num != map_num) {
+        if (is_modified == FLB_FALSE) {
+            /* Start the new chunk with the untouched records */
+            msgpack_sbuffer_init(&tmp_sbuf);
+            msgpack_packer_init(&tmp_pck, &tmp_sbuf, msgpack_sbuffer_write);
+            msgpack_sbuffer_write(&tmp_sbuf, data, rec - (char *) data);
             is_modified = FLB_TRUE;
         }
 
-        removed_map_num += ctx->records_num;
-        if (removed_map_num <= 0) {
+        new_count = count - removed + ctx->records_num;
+        if (new_count == 0) {
             continue;
         }
 
-        msgpack_pack_array(&tmp_pck, 2);
-        flb_time_append_to_msgpack(&tm, &tmp_pck, 0);
+        /* array header and timestamp */
+        msgpack_sbuffer_write(&tmp_sbuf, rec, 1 + ts_size);
+        msgpack_pack_map(&tmp_pck, new_count);
 
-        msgpack_pack_map(&tmp_pck, removed_map_num);
-        kv = obj->via.map.ptr;
-        for(i=0; bool_map[i] != TAIL_OF_ARRAY; i++) {
-            if (bool_map[i] == TO_BE_REMAINED) {
-                msgpack_pack_object(&tmp_pck, (kv+i)->key);
-                msgpack_pack_object(&tmp_pck, (kv+i)->val);
-            }
+        /* kept entries */
+        p = map + hdr;
+        end = rec + rec_size;
+        for (i = 0; i < removed; i++) {
+            msgpack_sbuffer_write(&tmp_sbuf, p, ctx->spans[i].start - p);
+            p = ctx->spans[i].start + ctx->spans[i].size;
         }
+        msgpack_sbuffer_write(&tmp_sbuf, p, end - p);
 
         /* append record */
         if (ctx->records_num > 0) {
-            is_modified = FLB_TRUE;
-            mk_list_foreach_safe(head, tmp, &ctx->records) {
-                mod_rec = mk_list_entry(head, struct modifier_record,  _head);
-                msgpack_pack_str(&tmp_pck, mod_rec->key_len);
-                msgpack_pack_str_body(&tmp_pck,
-                                      mod_rec->key, mod_rec->key_len);
-                msgpack_pack_str(&tmp_pck, mod_rec->val_len);
-                msgpack_pack_str_body(&tmp_pck,
-                                      mod_rec->val, mod_rec->val_len);
-            }
+            msgpack_sbuffer_write(&tmp_sbuf,
+                                  ctx->records_buf, ctx->records_size);
         }
     }
-    msgpack_unpacked_destroy(&result);
 
     if (is_modified != FLB_TRUE) {
-        /* Destroy the buffer to avoid more overhead */
-        msgpack_sbuffer_destroy(&tmp_sbuf);
         return FLB_FILTER_NOTOUCH;
     }
 
@@ -20,6 +20,8 @@
 #ifndef FLB_FILTER_RECORD_MODIFIER_H
 #define FLB_FILTER_RECORD_MODIFIER_H
 
+#include <fluent-bit/flb_hash.h>
+
 struct modifier_record {
     char *key;
     char *val;
@@ -35,6 +37,12 @@ struct modifier_key {
     struct mk_list _head;
 };
 
+/* A range of a record map that is not copied to the output */
+struct modifier_span {
+    const char *start;
+    size_t size;
+};
+
 struct record_modifier_ctx {
     int records_num;
     int remove_keys_num;
@@ -42,13 +50,21 @@ struct record_modifier_ctx {
     struct mk_list records;
     struct mk_list remove_keys;
     struct mk_list whitelist_keys;
-};
 
-typedef enum {
-    TO_BE_REMOVED = 0,
-    TO_BE_REMAINED = 1,
-    TAIL_OF_ARRAY = 2
-} bool_map_t;
+    /* 'Record' pairs, packed once and appended to every record */
+    char *records_buf;
+    size_t records_size;
+
+    /* 'Remove_key' or 'Whitelist_key' entries */
+    int is_to_delete;
+    struct flb_hash *keys_hash;         /* exact keys         */
+    struct modifier_key **dynamic_keys; /* 'prefix*' keys     */
+    int dynamic_keys_num;
+    int keys_max_len;                   /* longest exact key  */
+    char *key_buf;                      /* lookup key buffer  */
 
+    int spans_size;
+    struct modifier_span *spans;
+};
 
 #endif /* FLB_FILTER_RECORD_MODIFIER_H */
@@ -0,0 +1,568 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+
+/*
+ * Rewrite Tag: records matching a rule are emitted again under a new tag,
+ * so they are routed to other outputs. Each 'Rule' property has the form
+ *
+ *     Rule  $KEY  REGEX  NEW_TAG  KEEP
+ *
+ * KEY is a record accessor pattern, REGEX is matched against its value (no
+ * spaces, use \s) and NEW_TAG may reference $TAG, $TAG[n] and the capture
+ * groups $0 to $9. KEEP tells if the original record continues under its
+ * own tag. The first matching rule wins.
+ *
+ * The new records enter the pipeline through an emitter input and skip the
+ * filters, a rule never sees its own output. Filters placed after this one
+ * do not apply to the re-tagged records either, it should be the last one.
+ * 'Emitter_Priority' sets the priority class of the emitter input.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_str.h>
+#include <fluent-bit/flb_filter.h>
+#include <fluent-bit/flb_input.h>
+#include <fluent-bit/flb_utils.h>
+#include <fluent-bit/flb_log.h>
+#include <fluent-bit/flb_regex.h>
+#include <fluent-bit/flb_record_accessor.h>
+#include <msgpack.h>
+
+#include "rewrite_tag.h"
+
+static int part_add(struct rewrite_rule *rule, int type, int n,
+                    char *str, int len)
+{
+    struct rewrite_part *tmp;
+    struct rewrite_part *p;
+
+    tmp = flb_realloc(rule->parts,
+                      sizeof(struct rewrite_part) * (rule->parts_len + 1));
+    if (!tmp) {
+        flb_errno();
+        return -1;
+    }
+    rule->parts = tmp;
+
+    p = &rule->parts[rule->parts_len];
+    p->type = type;
+    p->n = n;
+    p->len = len;
+    p->str = NULL;
+    if (type == REWRITE_PART_STR) {
+        p->str = flb_strndup(str, len);
+        if (!p->str) {
+            return -1;
+        }
+    }
+    rule->parts_len++;
+
+    return 0;
+}
+
+/* Split the new tag template in literal text and references */
+static int template_compile(struct rewrite_rule *rule, char *tpl, int len)
+{
+    int i = 0;
+    int n;
+    int lit = 0;
+    char *end;
+
+    while (i < len) {
+        if (tpl[i] != '$') {
+            i++;
+            continue;
+        }
+
+        if (i > lit &&
+            part_add(rule, REWRITE_PART_STR, 0, tpl + lit, i - lit) == -1) {
+            return -1;
+        }
+
+        if (i + 1 < len && tpl[i + 1] >= '0' && tpl[i + 1] <= '9') {
+            if (part_add(rule, REWRITE_PART_GROUP, tpl[i + 1] - '0',
+                         NULL, 0) == -1) {
+                return -1;
+            }
+            i += 2;
+        }
+        else if (len - i >= 4 && strncmp(tpl + i + 1, "TAG", 3) == 0) {
+            i += 4;
+            if (i < len && tpl[i] == '[') {
+                n = strtol(tpl + i + 1, &end, 10);
+                if (end == tpl + i + 1 || *end != ']' || n < 0) {
+                    flb_error("[filter_rewrite_tag] invalid tag reference "
+                              "in '%s'", tpl);
+                    return -1;
+                }
+                if (part_add(rule, REWRITE_PART_TAG_N, n, NULL, 0) == -1) {
+                    return -1;
+                }
+                i = (end - tpl) + 1;
+            }
+            else if (part_add(rule, REWRITE_PART_TAG, 0, NULL, 0) == -1) {
+                return -1;
+            }
+        }
+        else {
+            /* a lone '$' is literal */
+            lit = i;
+            i++;
+            continue;
+        }
+        lit = i;
+    }
+
+    if (len > lit &&
+        part_add(rule, REWRITE_PART_STR, 0, tpl + lit, len - lit) == -1) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int rule_create(struct rewrite_rule *rule, char *def)
+{
+    int ret = -1;
+    int n = 0;
+    struct mk_list *head;
+    struct mk_list *split;
+    struct flb_split_entry *f[4];
+
+    split = flb_utils_split(def, ' ', 0);
+    if (!split) {
+        return -1;
+    }
+
+    if (mk_list_size(split) != 4) {
+        flb_error("[filter_rewrite_tag] invalid rule '%s', expected "
+                  "'$KEY REGEX NEW_TAG KEEP'", def);
+        goto out;
+    }
+    mk_list_foreach(head, split) {
+        f[n++] = mk_list_entry(head, struct flb_split_entry, _head);
+    }
+
+    rule->ra = flb_ra_create(f[0]->value);
+    if (!rule->ra) {
+        flb_error("[filter_rewrite_tag] invalid key '%s'", f[0]->value);
+        goto out;
+    }
+
+    rule->regex = flb_regex_get((unsigned char *) f[1]->value);
+    if (!rule->regex) {
+        flb_error("[filter_rewrite_tag] invalid regex '%s'", f[1]->value);
+        goto out;
+    }
+
+    if (f[2]->len >= REWRITE_TAG_MAX) {
+        flb_error("[filter_rewrite_tag] new tag '%s' too long", f[2]->value);
+        goto out;
+    }
+    if (template_compile(rule, f[2]->value, f[2]->len) == -1) {
+        goto out;
+    }
+
+    rule->keep = flb_utils_bool(f[3]->value);
+    ret = 0;
+
+ out:
+    flb_utils_split_free(split);
+    return ret;
+}
+
+static void rule_destroy(struct rewrite_rule *rule)
+{
+    int i;
+
+    for (i = 0; i < rule->parts_len; i++) {
+        flb_free(rule->parts[i].str);
+    }
+    flb_free(rule->parts);
+    if (rule->regex) {
+        flb_regex_put(rule->regex);
+    }
+    if (rule->ra) {
+        flb_ra_destroy(rule->ra);
+    }
+}
+
+static void ctx_destroy(struct rewrite_ctx *ctx)
+{
+    int i;
+
+    for (i = 0; i < ctx->rules_len; i++) {
+        rule_destroy(&ctx->rules[i]);
+    }
+    flb_free(ctx->rules);
+    flb_free(ctx);
+}
+
+static int configure(struct rewrite_ctx *ctx,
+                     struct flb_filter_instance *f_ins)
+{
+    int n = 0;
+    struct mk_list *head;
+    struct flb_config_prop *prop;
+
+    mk_list_foreach(head, &f_ins->properties) {
+        prop = mk_list_entry(head, struct flb_config_prop, _head);
+        if (strcasecmp(prop->key, "rule") == 0) {
+            n++;
+        }
+    }
+    if (n == 0) {
+        flb_error("[filter_rewrite_tag] no rules defined");
+        return -1;
+    }
+
+    ctx->rules = flb_calloc(n, sizeof(struct rewrite_rule));
+    if (!ctx->rules) {
+        flb_errno();
+        return -1;
+    }
+
+    mk_list_foreach(head, &f_ins->properties) {
+        prop = mk_list_entry(head, struct flb_config_prop, _head);
+        if (strcasecmp(prop->key, "rule") != 0) {
+            continue;
+        }
+        /* count it first, a half built rule is released by ctx_destroy() */
+        ctx->rules_len++;
+        if (rule_create(&ctx->rules[ctx->rules_len - 1], prop->val) == -1) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Value of the rule key as a string, numbers are formatted */
+static int subject_get(msgpack_object *o, char *tmp, int size,
+                       char **out, int *out_len)
+{
+    int len;
+
+    switch (o->type) {
+    case MSGPACK_OBJECT_STR:
+        *out = (char *) o->via.str.ptr;
+        *out_len = o->via.str.size;
+        return 0;
+    case MSGPACK_OBJECT_BIN:
+        *out = (char *) o->via.bin.ptr;
+        *out_len = o->via.bin.size;
+        return 0;
+    case MSGPACK_OBJECT_POSITIVE_INTEGER:
+        len = snprintf(tmp, size, "%" PRIu64, o->via.u64);
+        break;
+    case MSGPACK_OBJECT_NEGATIVE_INTEGER:
+        len = snprintf(tmp, size, "%" PRId64, o->via.i64);
+        break;
+    case MSGPACK_OBJECT_FLOAT32:
+    case MSGPACK_OBJECT_FLOAT64:
+        len = snprintf(tmp, size, "%g", o->via.f64);
+        break;
+    case MSGPACK_OBJECT_BOOLEAN:
+        len = snprintf(tmp, size, "%s", o->via.boolean ? "true" : "false");
+        break;
+    default:
+        return -1;
+    }
+
+    *out = tmp;
+    *out_len = len;
+    return 0;
+}
+
+/* n-th dot separated field of the tag */
+static int tag_field(char *tag, int tag_len, int n, char **out)
+{
+    int i;
+    int start = 0;
+
+    for (i = 0; i <= tag_len; i++) {
+        if (i < tag_len && tag[i] != '.') {
+            continue;
+        }
+        if (n == 0) {
+            *out = tag + start;
+            return i - start;
+        }
+        n--;
+        start = i + 1;
+    }
+
+    return 0;
+}
+
+/* Compose the new tag, returns its length or -1 when it does not fit */
+static int tag_compose(struct rewrite_rule *rule, char *tag, int tag_len,
+                       char *subject, struct flb_regex_search *search,
+                       char *buf)
+{
+    int i;
+    int len;
+    int off = 0;
+    char *str;
+    struct rewrite_part *p;
+    OnigRegion *region = search->region;
+
+    for (i = 0; i < rule->parts_len; i++) {
+        p = &rule->parts[i];
+        str = NULL;
+        len = 0;
+
+        switch (p->type) {
+        case REWRITE_PART_STR:
+            str = p->str;
+            len = p->len;
+            break;
+        case REWRITE_PART_TAG:
+            str = tag;
+            len = tag_len;
+            break;
+        case REWRITE_PART_TAG_N:
+            len = tag_field(tag, tag_len, p->n, &str);
+            break;
+        case REWRITE_PART_GROUP:
+            if (region && p->n < region->num_regs &&
+                region->beg[p->n] >= 0) {
+                str = subject + region->beg[p->n];
+                len = region->end[p->n] - region->beg[p->n];
+            }
+            break;
+        }
+
+        if (off + len >= REWRITE_TAG_MAX) {
+            return -1;
+        }
+        if (len > 0) {
+            memcpy(buf + off, str, len);
+            off += len;
+        }
+    }
+
+    return off;
+}
+
+/* The first matching rule, the new tag is composed into 'buf' */
+static struct rewrite_rule *rule_match(struct rewrite_ctx *ctx,
+                                       msgpack_object *map,
+                                       char *tag, int tag_len,
+                                       char *buf, int *buf_len)
+{
+    int i;
+    int len;
+    int ret;
+    char *subject;
+    char tmp[64];
+    msgpack_object *o;
+    struct rewrite_rule *rule;
+    struct flb_regex_search search;
+
+    for (i = 0; i < ctx->rules_len; i++) {
+        rule = &ctx->rules[i];
+
+        o = flb_ra_get(rule->ra, *map);
+        if (!o || subject_get(o, tmp, sizeof(tmp), &subject, &len) == -1) {
+            continue;
+        }
+
+        search.region = NULL;
+        ret = flb_regex_do(rule->regex, (unsigned char *) subject, len,
+                           &search);
+        if (ret == -1) {
+            continue;
+        }
+
+        *buf_len = tag_compose(rule, tag, tag_len, subject, &search, buf);
+        flb_regex_results_release(&search);
+        if (*buf_len <= 0) {
+            flb_warn("[filter_rewrite_tag] cannot compose a new tag for "
+                     "a record of '%.*s'", tag_len, tag);
+            return NULL;
+        }
+
+        return rule;
+    }
+
+    return NULL;
+}
+
+static struct rewrite_out *out_get(struct rewrite_out *outs, int *outs_len,
+                                   char *tag, int tag_len,
+                                   struct rewrite_ctx *ctx)
+{
+    int i;
+    struct rewrite_out *out;
+
+    for (i = 0; i < *outs_len; i++) {
+        out = &outs[i];
+        if (out->tag_len == tag_len && memcmp(out->tag, tag, tag_len) == 0) {
+            return out;
+        }
+    }
+
+    /* too many distinct tags, emit what is held so far */
+    if (*outs_len == REWRITE_OUT_MAX) {
+        for (i = 0; i < *outs_len; i++) {
+            out = &outs[i];
+            flb_input_dyntag_emit(ctx->ins, out->tag, out->tag_len,
+                                  out->sbuf.data, out->sbuf.size,
+                                  out->records);
+            msgpack_sbuffer_destroy(&out->sbuf);
+        }
+        *outs_len = 0;
+    }
+
+    out = &outs[(*outs_len)++];
+    out->records = 0;
+    out->tag_len = tag_len;
+    memcpy(out->tag, tag, tag_len);
+    msgpack_sbuffer_init(&out->sbuf);
+    msgpack_packer_init(&out->pck, &out->sbuf, msgpack_sbuffer_write);
+
+    return out;
+}
+
+static int cb_rewrite_filter_batch(struct flb_filter_batch *batch,
+                                   char *tag, int tag_len,
+                                   struct flb_filter_instance *f_ins,
+                                   void *context,
+                                   struct flb_config *config)
+{
+    int i;
+    int new_len;
+    int outs_len = 0;
+    int dropped = 0;
+    char new_tag[REWRITE_TAG_MAX];
+    struct rewrite_out outs[REWRITE_OUT_MAX];
+    struct rewrite_out *out;
+    struct rewrite_rule *rule;
+    struct flb_filter_record *rec;
+    struct rewrite_ctx *ctx = context;
+    (void) f_ins;
+    (void) config;
+
+    for (i = 0; i < batch->count; i++) {
+        rec = &batch->records[i];
+        if (rec->drop == FLB_TRUE) {
+            continue;
+        }
+
+        rule = rule_match(ctx, &rec->map, tag, tag_len, new_tag, &new_len);
+        if (!rule) {
+            continue;
+        }
+
+        out = out_get(outs, &outs_len, new_tag, new_len, ctx);
+
+        /* untouched records are copied as they arrived */
+        if (rec->raw) {
+            msgpack_sbuffer_write(&out->sbuf, rec->raw, rec->raw_size);
+        }
+        else {
+            msgpack_pack_array(&out->pck, 2);
+            msgpack_pack_object(&out->pck, rec->ts);
+            msgpack_pack_object(&out->pck, rec->map);
+        }
+        out->records++;
+
+        if (rule->keep == FLB_FALSE) {
+            rec->drop = FLB_TRUE;
+            dropped++;
+        }
+    }
+
+    for (i = 0; i < outs_len; i++) {
+        out = &outs[i];
+        flb_input_dyntag_emit(ctx->ins, out->tag, out->tag_len,
+                              out->sbuf.data, out->sbuf.size, out->records);
+        msgpack_sbuffer_destroy(&out->sbuf);
+    }
+
+    if (dropped == 0) {
+        return FLB_FILTER_NOTOUCH;
+    }
+
+    return FLB_FILTER_MODIFIED;
+}
+
+static int cb_rewrite_init(struct flb_filter_instance *f_ins,
+                           struct flb_config *config,
+                           void *data)
+{
+    char *tmp;
+    struct rewrite_ctx *ctx;
+
+    ctx = flb_calloc(1, sizeof(struct rewrite_ctx));
+    if (!ctx) {
+        flb_errno();
+        return -1;
+    }
+
+    if (configure(ctx, f_ins) == -1) {
+        ctx_destroy(ctx);
+        return -1;
+    }
+
+    /* The re-tagged records enter the pipeline through their own input */
+    ctx->ins = flb_input_new(config, "emitter", NULL);
+    if (!ctx->ins) {
+        flb_error("[filter_rewrite_tag] cannot create the emitter input");
+        ctx_destroy(ctx);
+        return -1;
+    }
+
+    tmp = flb_filter_get_property("emitter_priority", f_ins);
+    if (tmp && flb_input_set_property(ctx->ins, "priority", tmp) == -1) {
+        ctx_destroy(ctx);
+        return -1;
+    }
+    if (flb_input_instance_init(ctx->ins, config) == -1) {
+        ctx_destroy(ctx);
+        return -1;
+    }
+
+    flb_filter_set_context(f_ins, ctx);
+    return 0;
+}
+
+static int cb_rewrite_exit(void *data, struct flb_config *config)
+{
+    struct rewrite_ctx *ctx = data;
+
+    ctx_destroy(ctx);
+    return 0;
+}
+
+struct flb_filter_plugin filter_rewrite_tag_plugin = {
+    .name         = "rewrite_tag",
+    .description  = "re-emit records under a new tag",
+    .cb_init      = cb_rewrite_init,
+    .cb_filter_batch = cb_rewrite_filter_batch,
+    .cb_exit      = cb_rewrite_exit,
+    .flags        = FLB_FILTER_THREAD_SAFE
+};
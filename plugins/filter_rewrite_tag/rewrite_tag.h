@@ -0,0 +1,70 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+
+#ifndef FLB_FILTER_REWRITE_TAG_H
+#define FLB_FILTER_REWRITE_TAG_H
+
+#include <msgpack.h>
+
+#define REWRITE_TAG_MAX      256    /* longest new tag                    */
+#define REWRITE_OUT_MAX      16     /* distinct new tags held per batch   */
+
+/* Parts of a new tag template */
+#define REWRITE_PART_STR     0      /* literal text                       */
+#define REWRITE_PART_TAG     1      /* $TAG: the original tag             */
+#define REWRITE_PART_TAG_N   2      /* $TAG[n]: n-th dot separated field  */
+#define REWRITE_PART_GROUP   3      /* $n: n-th capture group of the rule */
+
+struct flb_regex;
+struct flb_record_accessor;
+struct flb_input_instance;
+
+struct rewrite_part {
+    int type;
+    int n;
+    int len;
+    char *str;
+};
+
+/* Rule: $KEY REGEX NEW_TAG KEEP */
+struct rewrite_rule {
+    int keep;
+    struct flb_record_accessor *ra;
+    struct flb_regex *regex;
+    int parts_len;
+    struct rewrite_part *parts;
+};
+
+/* Records re-tagged by a batch, grouped by their new tag */
+struct rewrite_out {
+    int records;
+    int tag_len;
+    char tag[REWRITE_TAG_MAX];
+    msgpack_sbuffer sbuf;
+    msgpack_packer pck;
+};
+
+struct rewrite_ctx {
+    int rules_len;
+    struct rewrite_rule *rules;
+    struct flb_input_instance *ins;     /* emitter of the new records */
+};
+
+#endif
@@ -0,0 +1,369 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_str.h>
+#include <fluent-bit/flb_filter.h>
+#include <fluent-bit/flb_utils.h>
+#include <fluent-bit/flb_log.h>
+#include <fluent-bit/flb_regex.h>
+#include <msgpack.h>
+
+#include "sampling.h"
+
+/* Random numbers state, every thread running the filter has its own */
+static __thread uint64_t rnd_state;
+
+static inline uint64_t rnd_next()
+{
+    uint64_t x;
+
+    if (rnd_state == 0) {
+        rnd_state = (uint64_t) time(NULL) ^ (uint64_t) (uintptr_t) &rnd_state;
+        rnd_state |= 1;
+    }
+
+    /* xorshift64* */
+    x = rnd_state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    rnd_state = x;
+
+    return x * 0x2545f4914f6cdd1dULL;
+}
+
+/*
+ * FNV-1a with a final mix: the result does not depend on the host, so every
+ * collector takes the same decision for the same key value.
+ */
+static uint64_t hash_value(const char *buf, size_t len)
+{
+    size_t i;
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    for (i = 0; i < len; i++) {
+        h ^= (unsigned char) buf[i];
+        h *= 0x100000001b3ULL;
+    }
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+
+    return h;
+}
+
+/* Lookup a first level key of a record */
+static msgpack_object *map_get(msgpack_object *map, char *key, int key_len)
+{
+    uint32_t i;
+    msgpack_object *k;
+
+    if (map->type != MSGPACK_OBJECT_MAP) {
+        return NULL;
+    }
+
+    for (i = 0; i < map->via.map.size; i++) {
+        k = &map->via.map.ptr[i].key;
+        if (k->type == MSGPACK_OBJECT_STR &&
+            k->via.str.size == key_len &&
+            memcmp(k->via.str.ptr, key, key_len) == 0) {
+            return &map->via.map.ptr[i].val;
+        }
+    }
+
+    return NULL;
+}
+
+/* Hash the value of the sampling key, returns -1 if it can't be used */
+static int hash_key(struct sampling_ctx *ctx, msgpack_object *map,
+                    uint64_t *hash)
+{
+    int i;
+    char num[8];
+    uint64_t u;
+    msgpack_object *val;
+
+    val = map_get(map, ctx->hash_key, ctx->hash_key_len);
+    if (!val) {
+        return -1;
+    }
+
+    switch (val->type) {
+    case MSGPACK_OBJECT_STR:
+        *hash = hash_value(val->via.str.ptr, val->via.str.size);
+        return 0;
+    case MSGPACK_OBJECT_BIN:
+        *hash = hash_value(val->via.bin.ptr, val->via.bin.size);
+        return 0;
+    case MSGPACK_OBJECT_POSITIVE_INTEGER:
+    case MSGPACK_OBJECT_NEGATIVE_INTEGER:
+        /* fixed byte order */
+        u = val->via.u64;
+        for (i = 0; i < 8; i++) {
+            num[i] = (char) (u >> (i * 8));
+        }
+        *hash = hash_value(num, sizeof(num));
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+static int is_error(struct sampling_ctx *ctx, msgpack_object *map)
+{
+    msgpack_object *val;
+
+    val = map_get(map, ctx->error_key, ctx->error_key_len);
+    if (!val || val->type != MSGPACK_OBJECT_STR) {
+        return FLB_FALSE;
+    }
+
+    if (flb_regex_match(ctx->error_regex,
+                        (unsigned char *) val->via.str.ptr,
+                        val->via.str.size) == 1) {
+        return FLB_TRUE;
+    }
+
+    return FLB_FALSE;
+}
+
+static inline int sample_keep(struct sampling_ctx *ctx, msgpack_object *map)
+{
+    uint64_t h;
+
+    if (ctx->mode == SAMPLING_HASH && hash_key(ctx, map, &h) == 0) {
+        return h < ctx->threshold;
+    }
+
+    /* random, or a record without a usable key */
+    return rnd_next() < ctx->threshold;
+}
+
+static int configure(struct sampling_ctx *ctx,
+                     struct flb_filter_instance *f_ins)
+{
+    char *tmp;
+    char *end;
+    char *pattern;
+
+    ctx->mode = SAMPLING_RANDOM;
+    tmp = flb_filter_get_property("mode", f_ins);
+    if (tmp) {
+        if (strcasecmp(tmp, "random") == 0) {
+            ctx->mode = SAMPLING_RANDOM;
+        }
+        else if (strcasecmp(tmp, "hash") == 0) {
+            ctx->mode = SAMPLING_HASH;
+        }
+        else if (strcasecmp(tmp, "tail") == 0) {
+            ctx->mode = SAMPLING_TAIL;
+        }
+        else {
+            flb_error("[filter_sampling] invalid mode '%s'", tmp);
+            return -1;
+        }
+    }
+
+    ctx->rate = SAMPLING_DEFAULT_RATE;
+    tmp = flb_filter_get_property("rate", f_ins);
+    if (tmp) {
+        ctx->rate = strtod(tmp, &end);
+        if (end == tmp || *end != '\0' || ctx->rate < 0 || ctx->rate > 1) {
+            flb_error("[filter_sampling] invalid rate '%s', "
+                      "expected a value between 0 and 1", tmp);
+            return -1;
+        }
+    }
+
+    if (ctx->rate >= 1) {
+        ctx->threshold = UINT64_MAX;
+    }
+    else {
+        ctx->threshold = (uint64_t) (ctx->rate * 18446744073709551616.0);
+    }
+
+    tmp = flb_filter_get_property("hash_key", f_ins);
+    if (tmp) {
+        ctx->hash_key = flb_strdup(tmp);
+        ctx->hash_key_len = strlen(tmp);
+    }
+    else if (ctx->mode == SAMPLING_HASH) {
+        flb_error("[filter_sampling] mode 'hash' requires 'hash_key'");
+        return -1;
+    }
+
+    if (ctx->mode != SAMPLING_TAIL) {
+        return 0;
+    }
+
+    tmp = flb_filter_get_property("error_key", f_ins);
+    ctx->error_key = flb_strdup(tmp ? tmp : SAMPLING_DEFAULT_ERROR_KEY);
+    ctx->error_key_len = strlen(ctx->error_key);
+
+    pattern = flb_filter_get_property("error_regex", f_ins);
+    if (!pattern) {
+        pattern = SAMPLING_DEFAULT_ERROR_REGEX;
+    }
+    ctx->error_regex = flb_regex_get((unsigned char *) pattern);
+    if (!ctx->error_regex) {
+        flb_error("[filter_sampling] invalid error_regex '%s'", pattern);
+        return -1;
+    }
+
+    ctx->window = SAMPLING_DEFAULT_WINDOW;
+    tmp = flb_filter_get_property("window", f_ins);
+    if (tmp) {
+        ctx->window = atoi(tmp);
+        if (ctx->window < 0) {
+            flb_error("[filter_sampling] invalid window '%s'", tmp);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void ctx_destroy(struct sampling_ctx *ctx)
+{
+    if (ctx->error_regex) {
+        flb_regex_put(ctx->error_regex);
+    }
+    flb_free(ctx->hash_key);
+    flb_free(ctx->error_key);
+    flb_free(ctx);
+}
+
+static int cb_sampling_init(struct flb_filter_instance *f_ins,
+                            struct flb_config *config,
+                            void *data)
+{
+    struct sampling_ctx *ctx;
+
+    ctx = flb_calloc(1, sizeof(struct sampling_ctx));
+    if (!ctx) {
+        flb_errno();
+        return -1;
+    }
+
+    if (configure(ctx, f_ins) == -1) {
+        ctx_destroy(ctx);
+        return -1;
+    }
+
+    flb_filter_set_context(f_ins, ctx);
+    return 0;
+}
+
+/*
+ * Tail sampling: a chunk with an error record is kept entirely, so the
+ * records that lead to the error are not lost, and every record is kept
+ * until 'window' seconds after the last error. Out of the windows the
+ * records are sampled randomly.
+ */
+static int tail_window_open(struct sampling_ctx *ctx,
+                            struct flb_filter_batch *batch, time_t now)
+{
+    int i;
+    int found = FLB_FALSE;
+    time_t end;
+
+    for (i = 0; i < batch->count; i++) {
+        if (batch->records[i].drop == FLB_FALSE &&
+            is_error(ctx, &batch->records[i].map) == FLB_TRUE) {
+            found = FLB_TRUE;
+            break;
+        }
+    }
+
+    end = __atomic_load_n(&ctx->window_end, __ATOMIC_RELAXED);
+    if (found == FLB_TRUE) {
+        if (end < now + ctx->window) {
+            __atomic_store_n(&ctx->window_end, now + ctx->window,
+                             __ATOMIC_RELAXED);
+        }
+        return FLB_TRUE;
+    }
+
+    return now < end;
+}
+
+static int cb_sampling_filter_batch(struct flb_filter_batch *batch,
+                                    char *tag, int tag_len,
+                                    struct flb_filter_instance *f_ins,
+                                    void *context,
+                                    struct flb_config *config)
+{
+    int i;
+    int dropped = 0;
+    struct flb_filter_record *rec;
+    struct sampling_ctx *ctx = context;
+    (void) f_ins;
+    (void) config;
+
+    if (ctx->mode == SAMPLING_TAIL &&
+        tail_window_open(ctx, batch, time(NULL)) == FLB_TRUE) {
+        return FLB_FILTER_NOTOUCH;
+    }
+
+    /* Kept records are not touched, their raw bytes are copied as is */
+    for (i = 0; i < batch->count; i++) {
+        rec = &batch->records[i];
+        if (rec->drop == FLB_TRUE) {
+            continue;
+        }
+
+        if (!sample_keep(ctx, &rec->map)) {
+            rec->drop = FLB_TRUE;
+            dropped++;
+        }
+    }
+
+    if (dropped == 0) {
+        return FLB_FILTER_NOTOUCH;
+    }
+
+    return FLB_FILTER_MODIFIED;
+}
+
+static int cb_sampling_exit(void *data, struct flb_config *config)
+{
+    struct sampling_ctx *ctx = data;
+
+    ctx_destroy(ctx);
+    return 0;
+}
+
+struct flb_filter_plugin filter_sampling_plugin = {
+    .name         = "sampling",
+    .description  = "keep a sample of the records",
+    .cb_init      = cb_sampling_init,
+    .cb_filter_batch = cb_sampling_filter_batch,
+    .cb_exit      = cb_sampling_exit,
+    .flags        = FLB_FILTER_THREAD_SAFE
+};
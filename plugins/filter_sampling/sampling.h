@@ -0,0 +1,56 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef FLB_FILTER_SAMPLING_H
+#define FLB_FILTER_SAMPLING_H
+
+#include <stdint.h>
+
+/* sampling modes */
+#define SAMPLING_RANDOM   0     /* every record kept with probability 'rate' */
+#define SAMPLING_HASH     1     /* decision taken on the hash of a key value */
+#define SAMPLING_TAIL     2     /* random, everything kept around errors     */
+
+#define SAMPLING_DEFAULT_RATE         0.1
+#define SAMPLING_DEFAULT_ERROR_KEY    "level"
+#define SAMPLING_DEFAULT_ERROR_REGEX  "(?i)^(error|err|fatal|crit|critical)$"
+#define SAMPLING_DEFAULT_WINDOW       10
+
+struct flb_regex;
+
+struct sampling_ctx {
+    int mode;
+    double rate;
+
+    /* records are kept if their 64 bits hash is below the threshold */
+    uint64_t threshold;
+
+    /* hash mode: first level key */
+    int hash_key_len;
+    char *hash_key;
+
+    /* tail mode: records matching the error rule open a window */
+    int error_key_len;
+    char *error_key;
+    struct flb_regex *error_regex;
+    int window;
+    time_t window_end;          /* atomic: records kept until this time */
+};
+
+#endif
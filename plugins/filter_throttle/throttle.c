@@ -28,6 +28,8 @@
 #include <fluent-bit/flb_pack.h>
 #include <fluent-bit/flb_log.h>
 #include <fluent-bit/flb_time.h>
+#include <fluent-bit/flb_mp.h>
+#include <fluent-bit/flb_scheduler.h>
 #include <msgpack.h>
 #include "stdlib.h"
 
@@ -63,41 +65,172 @@ static bool apply_suffix (double *x, char suffix_char)
   return true;
 }
 
-
-void *time_ticker(void *args)
+/*
+ * Advance the windows one interval. The timer runs on the engine thread
+ * and only moves the tick, every window catches up when it is used.
+ */
+static void cb_throttle_tick(struct flb_config *config, void *data)
 {
-    struct ticker *t = args;
-    struct flb_time ftm;
-    long timestamp;
-
-    while (!t->done) {
-        flb_time_get(&ftm);
-        timestamp = flb_time_to_double(&ftm);
-        window_add(t->ctx->hash, timestamp, 0);
+    int ret;
+    uint64_t tick;
+    struct flb_filter_throttle_ctx *ctx = data;
 
-        t->ctx->hash->current_timestamp = timestamp;
+    tick = __atomic_add_fetch(&ctx->tick, 1, __ATOMIC_RELEASE);
 
-        if (t->ctx->print_status) {
-            flb_info("[filter_throttle] %i: limit is %0.2f per %s with window size of %i, current rate is: %i per interval", timestamp, t->ctx->max_rate, t->ctx->slide_interval, t->ctx->window_size, t->ctx->hash->total / t->ctx->hash->size);
+    if (ctx->print_status) {
+        window_update(ctx->window, tick);
+        flb_info("[filter_throttle] %i: limit is %0.2f per %s with window size of %i, current rate is: %i per interval",
+                 (int) time(NULL), ctx->max_rate, ctx->slide_interval,
+                 ctx->window_size, (int) (ctx->window->total / ctx->window->size));
+        if (ctx->keys) {
+            flb_info("[filter_throttle] %i keys tracked",
+                     ctx->keys->total_count);
         }
-        sleep(t->seconds);
     }
 
-    return NULL;
+    if (config->is_running == FLB_FALSE) {
+        return;
+    }
+
+    ret = flb_sched_timer_cb_create(config, ctx->interval_ms,
+                                    cb_throttle_tick, ctx);
+    if (ret == -1) {
+        flb_error("[filter_throttle] cannot schedule the window timer");
+    }
 }
 
 /* Given a msgpack record, do some filter action based on the defined rules */
-static inline int throttle_data(struct flb_filter_throttle_ctx *ctx)
+static inline int throttle_data(struct flb_filter_throttle_ctx *ctx,
+                                struct throttle_window *tw, uint64_t tick)
 {
-    if ((ctx->hash->total / (double) ctx->hash->size) >= ctx->max_rate) {
+    window_update(tw, tick);
+
+    if ((tw->total / (double) tw->size) >= ctx->max_rate) {
         return THROTTLE_RET_DROP;
     }
 
-    window_add(ctx->hash, ctx->hash->current_timestamp, 1);
+    window_add(tw, 1);
 
     return THROTTLE_RET_KEEP;
 }
 
+/* Window of a key value, created when the key is seen for the first time */
+static struct throttle_window *throttle_window_get(struct flb_filter_throttle_ctx *ctx,
+                                                   const char *key, size_t len)
+{
+    int id;
+    char *val;
+    size_t size;
+
+    id = flb_hash_get(ctx->keys, (char *) key, len, &val, &size);
+    if (id == -1) {
+        /* the least recently used key is evicted when the table is full */
+        id = flb_hash_add(ctx->keys, (char *) key, len, (char *) ctx->tmpl,
+                          window_bytes(ctx->window_size));
+        if (id == -1 ||
+            flb_hash_get(ctx->keys, (char *) key, len, &val, &size) == -1) {
+            return ctx->window;
+        }
+    }
+
+    return (struct throttle_window *) val;
+}
+
+/*
+ * Find the key value in a record map, '*val' is set to the serialized
+ * value. Returns -1 if the record does not have the key.
+ */
+static int throttle_key_lookup(struct flb_filter_throttle_ctx *ctx,
+                               const char *map, size_t map_size,
+                               const char **val, size_t *val_size)
+{
+    int i;
+    int ret;
+    int found;
+    uint32_t j;
+    uint32_t count;
+    uint32_t klen;
+    size_t hdr;
+    size_t ksize;
+    size_t vsize;
+    const char *key;
+    const char *p;
+    const char *end;
+
+    for (i = 0; i < ctx->key_parts; i++) {
+        if (flb_mp_map_header(map, map_size, &count, &hdr) == -1) {
+            return -1;
+        }
+
+        found = FLB_FALSE;
+        p = map + hdr;
+        end = map + map_size;
+        for (j = 0; j < count; j++) {
+            ret = flb_mp_key(p, end - p, &key, &klen, &ksize);
+            if (ret == -1 && flb_mp_object_size(p, end - p, &ksize) == -1) {
+                return -1;
+            }
+            p += ksize;
+            if (flb_mp_object_size(p, end - p, &vsize) == -1) {
+                return -1;
+            }
+            if (ret == 0 && klen == ctx->key_path_len[i] &&
+                memcmp(key, ctx->key_path[i], klen) == 0) {
+                found = FLB_TRUE;
+                break;
+            }
+            p += vsize;
+        }
+
+        if (found == FLB_FALSE) {
+            return -1;
+        }
+        map = p;
+        map_size = vsize;
+    }
+
+    *val = map;
+    *val_size = map_size;
+    return 0;
+}
+
+static int configure_key(struct flb_filter_throttle_ctx *ctx, char *key)
+{
+    int i = 0;
+    struct mk_list *head;
+    struct mk_list *split;
+    struct flb_split_entry *sentry;
+
+    if (strcasecmp(key, THROTTLE_KEY_TAG) == 0) {
+        ctx->key_tag = FLB_TRUE;
+        return 0;
+    }
+
+    split = flb_utils_split(key, '.', -1);
+    if (!split) {
+        return -1;
+    }
+
+    ctx->key_parts = mk_list_size(split);
+    ctx->key_path = flb_calloc(ctx->key_parts, sizeof(char *));
+    ctx->key_path_len = flb_calloc(ctx->key_parts, sizeof(int));
+    if (!ctx->key_path || !ctx->key_path_len) {
+        flb_errno();
+        flb_utils_split_free(split);
+        return -1;
+    }
+
+    mk_list_foreach(head, split) {
+        sentry = mk_list_entry(head, struct flb_split_entry, _head);
+        ctx->key_path[i] = flb_strndup(sentry->value, sentry->len);
+        ctx->key_path_len[i] = sentry->len;
+        i++;
+    }
+    flb_utils_split_free(split);
+
+    return 0;
+}
+
 static int configure(struct flb_filter_throttle_ctx *ctx, struct flb_filter_instance *f_ins)
 {
     char *str = NULL;
@@ -136,12 +269,26 @@ static int configure(struct flb_filter_throttle_ctx *ctx, struct flb_filter_inst
     } else {
         ctx->slide_interval = THROTTLE_DEFAULT_INTERVAL;
     }
+
+    /* maximum number of key values tracked */
+    str = flb_filter_get_property("key_limit", f_ins);
+    if (str != NULL && atoi(str) > 0) {
+        ctx->key_limit = atoi(str);
+    } else {
+        ctx->key_limit = THROTTLE_DEFAULT_KEY_LIMIT;
+    }
+
+    /* throttle every value of a key on its own */
+    str = flb_filter_get_property("key", f_ins);
+    if (str != NULL && configure_key(ctx, str) == -1) {
+        return -1;
+    }
+
     return 0;
 }
 
-static int parse_duration(char *interval)
+static double parse_duration(char *interval)
 {
-    double seconds = 0.0;
     double s;
     char *p;
 
@@ -153,10 +300,27 @@ static int parse_duration(char *interval)
           || ! apply_suffix (&s, *p))
         {
             flb_warn("[filter_throttle] invalid time interval %s falling back to default: 1 second", interval);
+            return 1;
         }
 
-      seconds += s;
-      return seconds;
+    return s;
+}
+
+static void throttle_ctx_destroy(struct flb_filter_throttle_ctx *ctx)
+{
+    int i;
+
+    if (ctx->keys) {
+        flb_hash_destroy(ctx->keys);
+    }
+    for (i = 0; i < ctx->key_parts && ctx->key_path; i++) {
+        flb_free(ctx->key_path[i]);
+    }
+    flb_free(ctx->key_path);
+    flb_free(ctx->key_path_len);
+    flb_free(ctx->window);
+    flb_free(ctx->tmpl);
+    flb_free(ctx);
 }
 
 static int cb_throttle_init(struct flb_filter_instance *f_ins,
@@ -165,33 +329,53 @@ static int cb_throttle_init(struct flb_filter_instance *f_ins,
 {
     int ret;
     struct flb_filter_throttle_ctx *ctx;
-    pthread_t tid;
-    struct ticker *ticker_ctx;
 
     /* Create context */
-    ctx = flb_malloc(sizeof(struct flb_filter_throttle_ctx));
+    ctx = flb_calloc(1, sizeof(struct flb_filter_throttle_ctx));
     if (!ctx) {
         flb_errno();
         return -1;
     }
+    ctx->config = config;
 
     /* parse plugin configuration  */
     ret = configure(ctx, f_ins);
     if (ret == -1) {
-        flb_free(ctx);
+        throttle_ctx_destroy(ctx);
         return -1;
     }
 
-    ctx->hash = window_create(ctx->window_size);
+    ctx->window = flb_malloc(window_bytes(ctx->window_size));
+    ctx->tmpl = flb_malloc(window_bytes(ctx->window_size));
+    if (!ctx->window || !ctx->tmpl) {
+        flb_errno();
+        throttle_ctx_destroy(ctx);
+        return -1;
+    }
+    window_init(ctx->window, ctx->window_size, 0);
+    window_init(ctx->tmpl, ctx->window_size, 0);
+
+    if (ctx->key_tag == FLB_TRUE || ctx->key_parts > 0) {
+        ctx->keys = flb_hash_create(FLB_HASH_EVICT_LRU, ctx->key_limit,
+                                    ctx->key_limit);
+        if (!ctx->keys) {
+            throttle_ctx_destroy(ctx);
+            return -1;
+        }
+    }
+
+    /* Slide the windows from the engine scheduler */
+    ctx->interval_ms = parse_duration(ctx->slide_interval) * 1000;
+    ret = flb_sched_timer_cb_create(config, ctx->interval_ms,
+                                    cb_throttle_tick, ctx);
+    if (ret == -1) {
+        flb_error("[filter_throttle] cannot schedule the window timer");
+        throttle_ctx_destroy(ctx);
+        return -1;
+    }
 
     /* Set our context */
     flb_filter_set_context(f_ins, ctx);
-
-    ticker_ctx = flb_malloc(sizeof(struct ticker));
-    ticker_ctx->ctx = ctx;
-    ticker_ctx->done = false;
-    ticker_ctx->seconds = parse_duration(ctx->slide_interval);
-    pthread_create(&tid, NULL, &time_ticker, ticker_ctx);
     return 0;
 }
 
@@ -203,46 +387,62 @@ static int cb_throttle_filter(void *data, size_t bytes,
                           struct flb_config *config)
 {
     int ret;
-    int old_size = 0;
-    int new_size = 0;
-    msgpack_unpacked result;
-    msgpack_object root;
+    int dropped = 0;
+    uint64_t tick;
     size_t off = 0;
+    size_t rec_size;
+    size_t ts_size;
+    size_t val_size;
+    const char *rec;
+    const char *val;
     (void) f_ins;
     (void) config;
+    struct flb_filter_throttle_ctx *ctx = context;
+    struct throttle_window *tw;
+    struct throttle_window *tw_default;
     msgpack_sbuffer tmp_sbuf;
-    msgpack_packer tmp_pck;
 
-    /* Create temporal msgpack buffer */
-    msgpack_sbuffer_init(&tmp_sbuf);
-    msgpack_packer_init(&tmp_pck, &tmp_sbuf, msgpack_sbuffer_write);
+    tick = __atomic_load_n(&ctx->tick, __ATOMIC_ACQUIRE);
 
+    tw_default = ctx->window;
+    if (ctx->key_tag == FLB_TRUE) {
+        tw_default = throttle_window_get(ctx, tag, tag_len);
+    }
 
-    /* Iterate each item array and apply rules */
-    msgpack_unpacked_init(&result);
-    while (msgpack_unpack_next(&result, data, bytes, &off)) {
-        root = result.data;
-        if (root.type != MSGPACK_OBJECT_ARRAY) {
-            continue;
+    /* Iterate each record, the kept ones are copied as they are */
+    while (off < bytes) {
+        rec = (char *) data + off;
+        if (flb_mp_object_size(rec, bytes - off, &rec_size) == -1) {
+            break;
+        }
+        off += rec_size;
+
+        tw = tw_default;
+        if (ctx->key_parts > 0 && (unsigned char) rec[0] == 0x92 &&
+            flb_mp_object_size(rec + 1, rec_size - 1, &ts_size) == 0 &&
+            throttle_key_lookup(ctx, rec + 1 + ts_size,
+                                rec_size - 1 - ts_size,
+                                &val, &val_size) == 0) {
+            tw = throttle_window_get(ctx, val, val_size);
         }
 
-        old_size++;
-
-        ret = throttle_data(context);
+        ret = throttle_data(ctx, tw, tick);
         if (ret == THROTTLE_RET_KEEP) {
-            msgpack_pack_object(&tmp_pck, root);
-            new_size++;
+            if (dropped > 0) {
+                msgpack_sbuffer_write(&tmp_sbuf, rec, rec_size);
+            }
+            continue;
         }
-        else if (ret == THROTTLE_RET_DROP) {
-            /* Do nothing */
+
+        if (dropped == 0) {
+            msgpack_sbuffer_init(&tmp_sbuf);
+            msgpack_sbuffer_write(&tmp_sbuf, data, rec - (char *) data);
         }
+        dropped++;
     }
-    msgpack_unpacked_destroy(&result);
 
     /* we keep everything ? */
-    if (old_size == new_size) {
-        /* Destroy the buffer to avoid more overhead */
-        msgpack_sbuffer_destroy(&tmp_sbuf);
+    if (dropped == 0) {
         return FLB_FILTER_NOTOUCH;
     }
 
@@ -257,7 +457,7 @@ static int cb_throttle_exit(void *data, struct flb_config *config)
 {
     struct flb_filter_throttle_ctx *ctx = data;
 
-    flb_free(ctx);
+    throttle_ctx_destroy(ctx);
     return 0;
 }
 
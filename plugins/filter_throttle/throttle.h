@@ -20,6 +20,10 @@
 #ifndef FLB_FILTER_THROTTLE_H
 #define FLB_FILTER_THROTTLE_H
 
+#include <fluent-bit/flb_hash.h>
+
+#include "window.h"
+
 /* actions */
 #define THROTTLE_RET_KEEP  0
 #define THROTTLE_RET_DROP  1
@@ -29,21 +33,40 @@
 #define THROTTLE_DEFAULT_WINDOW  5
 #define THROTTLE_DEFAULT_INTERVAL  "1"
 #define THROTTLE_DEFAULT_STATUS FLB_FALSE;
+#define THROTTLE_DEFAULT_KEY_LIMIT 1024
+
+/* 'key' set to the record tag */
+#define THROTTLE_KEY_TAG "$tag"
 
 struct flb_filter_throttle_ctx {
     double    max_rate;
     unsigned int    window_size;
     char  *slide_interval;
+    int interval_ms;
     int print_status;
 
-    /* internal */
-    struct throttle_window *hash;
-};
+    /*
+     * Optional 'key': a window is kept for every value of the key, either
+     * the tag or a record field ('a.b' looks into nested maps). Records
+     * without the key share the default window.
+     */
+    int key_tag;
+    int key_parts;
+    char **key_path;
+    int *key_path_len;
+    int key_limit;
+    struct flb_hash *keys;         /* key value => window, LRU */
+
+    /*
+     * Number of intervals elapsed, advanced by a scheduler timer on the
+     * engine thread. Windows catch up with it when they are used.
+     */
+    uint64_t tick;
 
-struct ticker {
-    struct flb_filter_throttle_ctx *ctx;
-    bool done;
-    double seconds;
+    /* internal */
+    struct throttle_window *window;  /* default window */
+    struct throttle_window *tmpl;    /* empty window for new keys */
+    struct flb_config *config;
 };
 
 #endif
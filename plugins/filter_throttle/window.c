@@ -17,80 +17,38 @@
  *  limitations under the License.
  */
 
-#include <stdio.h>
-#include <sys/types.h>
-#include <fluent-bit/flb_time.h>
-#include <fluent-bit/flb_mem.h>
-#include <fluent-bit/flb_log.h>
+#include <string.h>
 
 #include "window.h"
-#include "throttle.h"
-
-
-struct throttle_window *window_create(size_t size) {
-    struct throttle_window *tw;
-
-    if (size <= 0) {
-        return NULL;
-    }
-
-    tw = flb_malloc(sizeof(struct throttle_window));
-    if (!tw) {
-        flb_errno();
-        return NULL;
-    }
 
+void window_init(struct throttle_window *tw, unsigned size, uint64_t tick)
+{
+    memset(tw, '\0', window_bytes(size));
     tw->size = size;
-    tw->total = 0;
-    tw->current_timestamp = 0;
-    tw->max_index = -1;
-    tw->table = flb_calloc(size, sizeof(struct throttle_pane));
-    if (!tw->table) {
-        flb_errno();
-        flb_free(tw);
-        return NULL;
-    }
-
-    return tw;
+    tw->tick = tick;
 }
 
+/* Move the window to 'tick', clearing the panes of the missed intervals */
+void window_update(struct throttle_window *tw, uint64_t tick)
+{
+    uint64_t t;
+    unsigned idx;
 
-int window_get(struct throttle_window *tw, long timestamp) {
-    int i;
-    for (i=0; i< tw->size; i++ ) {
-        if (tw->table[i].timestamp == timestamp) {
-            return i;
-        }
+    if (tick <= tw->tick) {
+        return;
     }
-    return NOT_FOUND;
-}
-
-
-int window_add(struct throttle_window *tw, long timestamp, int val) {
-    int i, index, size;
-    int sum = 0;
-    tw->current_timestamp = timestamp;
-
-    size = tw->size;
-    index = window_get(tw, timestamp);
 
-    if (index == NOT_FOUND) {
-        if (size - 1 == tw->max_index) {
-            /* window must be shifted */
-            tw->max_index = -1;
-        }
-        tw->max_index += 1;
-        tw->table[tw->max_index].timestamp= timestamp;
-        tw->table[tw->max_index].counter = val;
-    } else {
-        tw->table[index].counter += val;
+    if (tick - tw->tick >= tw->size) {
+        memset(tw->panes, '\0', sizeof(uint64_t) * tw->size);
+        tw->total = 0;
+        tw->tick = tick;
+        return;
     }
 
-    for (i=0; i < tw->size; i++ ) {
-        sum += tw->table[i].counter;
-        flb_debug("timestamp: %i, value: %i", tw->table[i].timestamp, tw->table[i].counter);
+    for (t = tw->tick + 1; t <= tick; t++) {
+        idx = t % tw->size;
+        tw->total -= tw->panes[idx];
+        tw->panes[idx] = 0;
     }
-    tw->total = sum;
-    flb_debug("total: %i", tw->total);
-    return 0;
+    tw->tick = tick;
 }
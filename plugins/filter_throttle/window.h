@@ -17,21 +17,33 @@
  *  limitations under the License.
  */
 
-#define NOT_FOUND -1
+#ifndef FLB_FILTER_THROTTLE_WINDOW_H
+#define FLB_FILTER_THROTTLE_WINDOW_H
 
-struct throttle_pane {
-    long timestamp;
-    long counter;
-};
+#include <stdint.h>
 
+/*
+ * Sliding window: 'size' panes, one per interval. The pane in use is the
+ * one of the last tick seen by the window, panes of the ticks it missed
+ * are cleared when the window catches up.
+ */
 struct throttle_window {
-    long current_timestamp;
+    uint64_t tick;               /* tick of the current pane */
+    uint64_t total;              /* sum of all panes         */
     unsigned size;
-    unsigned total;
-    pthread_mutex_t result_mutex;
-    int max_index;
-    struct throttle_pane *table;
+    uint64_t panes[];
 };
 
-struct throttle_window *window_create(size_t size);
-int window_add(struct throttle_window *tw, long timestamp, int val);
+#define window_bytes(size) \
+    (sizeof(struct throttle_window) + (sizeof(uint64_t) * (size)))
+
+void window_init(struct throttle_window *tw, unsigned size, uint64_t tick);
+void window_update(struct throttle_window *tw, uint64_t tick);
+
+static inline void window_add(struct throttle_window *tw, int val)
+{
+    tw->panes[tw->tick % tw->size] += val;
+    tw->total += val;
+}
+
+#endif
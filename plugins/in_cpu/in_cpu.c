@@ -22,6 +22,7 @@
 #include <fluent-bit/flb_config.h>
 #include <fluent-bit/flb_stats.h>
 #include <fluent-bit/flb_pack.h>
+#include <fluent-bit/flb_procfs.h>
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -83,19 +84,18 @@ static inline void snapshots_switch(struct cpu_stats *cstats)
 }
 
 /* Retrieve CPU load from the system (through ProcFS) */
-static inline double proc_cpu_load(int cpus, struct cpu_stats *cstats)
+static inline double proc_cpu_load(int cpus, struct cpu_stats *cstats,
+                                   struct flb_procfs_file *stat)
 {
     int i;
-    int ret;
-    char line[255];
-    size_t len = 0;
-    char *fmt;
-    FILE *f;
+    int len;
+    char *p;
+    char *name;
     struct cpu_snapshot *s;
     struct cpu_snapshot *snap_arr;
 
-    f = fopen("/proc/stat", "r");
-    if (f == NULL) {
+    p = flb_procfs_sample(stat, NULL);
+    if (!p) {
         return -1;
     }
 
@@ -106,54 +106,33 @@ static inline double proc_cpu_load(int cpus, struct cpu_stats *cstats)
         snap_arr = cstats->snap_b;
     }
 
-    /* Always read (n_cpus + 1) lines */
+    /* Always read (n_cpus + 1) lines: 'cpu' and 'cpuN' */
     for (i = 0; i <= cpus; i++) {
-        if (fgets(line, sizeof(line) - 1, f)) {
-            len = strlen(line);
-            if (line[len - 1] == '\n') {
-                line[--len] = 0;
-                if (len && line[len - 1] == '\r') {
-                    line[--len] = 0;
-                }
-            }
+        if (strncmp(p, "cpu", 3) != 0) {
+            return (i == 0) ? -1 : 0;
+        }
 
-            s = &snap_arr[i];
-            if (i == 0) {
-                fmt = " cpu  %lu %lu %lu %lu %lu";
-                ret = sscanf(line,
-                             fmt,
-                             &s->v_user,
-                             &s->v_nice,
-                             &s->v_system,
-                             &s->v_idle,
-                             &s->v_iowait);
-                if (ret < 5) {
-                    fclose(f);
-                    return -1;
-                }
-            }
-            else {
-                fmt = " %s %lu %lu %lu %lu %lu";
-                ret = sscanf(line,
-                             fmt,
-                             &s->v_cpuid,
-                             &s->v_user,
-                             &s->v_nice,
-                             &s->v_system,
-                             &s->v_idle,
-                             &s->v_iowait);
-                if (ret <= 5) {
-                    fclose(f);
-                    return -1;
-                }
+        s = &snap_arr[i];
+        name = p;
+        p = flb_procfs_skip(p, 1);
+        if (i > 0) {
+            len = p - name;
+            if (len > sizeof(s->v_cpuid) - 1) {
+                len = sizeof(s->v_cpuid) - 1;
             }
+            memcpy(s->v_cpuid, name, len);
+            s->v_cpuid[len] = '\0';
         }
-        else {
-            break;
-        }
+
+        s->v_user   = flb_procfs_u64(&p);
+        s->v_nice   = flb_procfs_u64(&p);
+        s->v_system = flb_procfs_u64(&p);
+        s->v_idle   = flb_procfs_u64(&p);
+        s->v_iowait = flb_procfs_u64(&p);
+
+        p = flb_procfs_next_line(p);
     }
 
-    fclose(f);
     return 0;
 }
 
@@ -195,10 +174,23 @@ static int in_cpu_init(struct flb_input_instance *in,
         return -1;
     }
 
+    /* /proc/stat stays open, it's shared with other inputs */
+    ctx->stat = flb_procfs_get(config, "/proc/stat");
+    if (!ctx->stat) {
+        flb_error("[cpu] Could not open /proc/stat");
+        flb_free(ctx->cstats.snap_a);
+        flb_free(ctx->cstats.snap_b);
+        flb_free(ctx);
+        return -1;
+    }
+
     /* Get CPU load, ready to be updated once fired the calc callback */
-    ret = proc_cpu_load(ctx->n_processors, &ctx->cstats);
+    ret = proc_cpu_load(ctx->n_processors, &ctx->cstats, ctx->stat);
     if (ret != 0) {
         flb_error("[cpu] Could not obtain CPU data");
+        flb_procfs_put(config, ctx->stat);
+        flb_free(ctx->cstats.snap_a);
+        flb_free(ctx->cstats.snap_b);
         flb_free(ctx);
         return -1;
     }
@@ -314,7 +306,7 @@ int in_cpu_collect(struct flb_input_instance *i_ins,
     (void) config;
 
     /* Get the current CPU usage */
-    ret = proc_cpu_load(ctx->n_processors, cstats);
+    ret = proc_cpu_load(ctx->n_processors, cstats, ctx->stat);
     if (ret != 0) {
         return -1;
     }
@@ -361,8 +353,6 @@ int in_cpu_collect(struct flb_input_instance *i_ins,
 
     flb_input_buf_write_end(i_ins);
 
-    flb_stats_update(in_cpu_plugin.stats_fd, 0, 1);
-
     return 0;
 }
 
@@ -389,6 +379,8 @@ static int in_cpu_exit(void *data, struct flb_config *config)
     flb_free(cs->snap_a);
     flb_free(cs->snap_b);
 
+    flb_procfs_put(config, ctx->stat);
+
     /* done */
     flb_free(ctx);
 
@@ -23,6 +23,7 @@
 #include <fluent-bit/flb_config.h>
 #include <fluent-bit/flb_input.h>
 #include <fluent-bit/flb_utils.h>
+#include <fluent-bit/flb_procfs.h>
 
 /* Default collection time: every 1 second (0 nanoseconds) */
 #define DEFAULT_INTERVAL_SEC    1
@@ -74,6 +75,7 @@ struct flb_in_cpu_config {
     int interval_sec;    /* interval collection time (Second) */
     int interval_nsec;   /* interval collection time (Nanosecond) */
     struct cpu_stats cstats;
+    struct flb_procfs_file *stat;  /* /proc/stat */
     struct flb_input_instance *i_ins;
 };
 
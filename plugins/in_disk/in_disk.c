@@ -23,6 +23,7 @@
 #include <fluent-bit/flb_error.h>
 #include <fluent-bit/flb_str.h>
 #include <fluent-bit/flb_pack.h>
+#include <fluent-bit/flb_procfs.h>
 
 #include <msgpack.h>
 
@@ -32,88 +33,64 @@
 
 #include "in_disk.h"
 
-static char* shift_line(const char *line, char separator, int *idx,
-                        char *buf, int buf_size)
-{
-    char pack_mode = FLB_FALSE;
-    int  idx_buf = 0;
-
-    while(1) {
-        if (line[*idx] == '\0') {
-            /* end of line */
-            return NULL;
-        }
-        else if (line[*idx] != separator) {
-            pack_mode = FLB_TRUE;
-            buf[idx_buf] = line[*idx];
-            idx_buf++;
-
-            if (idx_buf >= buf_size) {
-                buf[idx_buf-1] = '\0';
-                return NULL;
-            }
-        }
-        else if (pack_mode == FLB_TRUE) {
-            buf[idx_buf] = '\0';
-            return buf;
-        }
-        *idx += 1;
-    }
-}
-
-
-#define LINE_SIZE 256
-#define BUF_SIZE  32
+/*
+ * /proc/diskstats, one line per device:
+ *
+ *   major minor name reads merged sectors_read ms writes merged
+ *   sectors_written ...
+ */
 static int update_disk_stats(struct flb_in_disk_config *ctx)
 {
-    char line[LINE_SIZE] = {0};
-    char buf[BUF_SIZE] = {0};
-    char skip_line = FLB_FALSE;
-    uint64_t temp_total = 0;
-    FILE *fp  = NULL;
-    int  i_line   = 0;
-    int  i_entry = 0;
-    int  i_field = 0;
-
-    fp = fopen("/proc/diskstats", "r");
-    if (fp == NULL) {
-        perror("fopen");
+    int i_entry = 0;
+    char *p;
+    char *name;
+    char *end;
+    char c;
+    uint64_t temp_total;
+
+    p = flb_procfs_sample(ctx->diskstats, NULL);
+    if (!p) {
+        flb_errno();
         return -1;
     }
 
-    while(fgets(line, LINE_SIZE-1, fp) != NULL) {
-        i_line = 0;
-        i_field = 0;
-        skip_line = FLB_FALSE;
-        while(skip_line != FLB_TRUE &&
-              shift_line(line, ' ', &i_line, buf, BUF_SIZE-1) != NULL) {
-            i_field++;
-            switch(i_field) {
-            case 3: /* device name */
-                if (ctx->dev_name != NULL && strstr(buf, ctx->dev_name) == NULL) {
-                    skip_line = FLB_TRUE;
-                }
-                break;
-            case 6: /* sectors read */
-                temp_total = strtoull(buf, NULL, 10);
-                ctx->prev_read_total[i_entry] = ctx->read_total[i_entry];
-                ctx->read_total[i_entry] = temp_total;
-                break;
-            case 10: /* sectors written */
-                temp_total = strtoull(buf, NULL, 10);
-                ctx->prev_write_total[i_entry] = ctx->write_total[i_entry];
-                ctx->write_total[i_entry] = temp_total;
-
-                skip_line = FLB_TRUE;
-                break;
-            default:
+    while (*p && i_entry < ctx->entry) {
+        /* device name */
+        p = flb_procfs_skip(p, 2);
+        while (*p == ' ') {
+            p++;
+        }
+        name = p;
+        end = flb_procfs_skip(p, 1);
+
+        if (ctx->dev_name != NULL) {
+            c = *end;
+            *end = '\0';
+            if (strstr(name, ctx->dev_name) == NULL) {
+                *end = c;
+                p = flb_procfs_next_line(end);
+                i_entry++;
                 continue;
             }
+            *end = c;
         }
+
+        /* sectors read */
+        p = flb_procfs_skip(end, 2);
+        temp_total = flb_procfs_u64(&p);
+        ctx->prev_read_total[i_entry] = ctx->read_total[i_entry];
+        ctx->read_total[i_entry] = temp_total;
+
+        /* sectors written */
+        p = flb_procfs_skip(p, 3);
+        temp_total = flb_procfs_u64(&p);
+        ctx->prev_write_total[i_entry] = ctx->write_total[i_entry];
+        ctx->write_total[i_entry] = temp_total;
+
+        p = flb_procfs_next_line(p);
         i_entry++;
     }
 
-    fclose(fp);
     return 0;
 }
 
@@ -185,27 +162,28 @@ static int in_disk_collect(struct flb_input_instance *i_ins,
     return 0;
 }
 
-static int get_diskstats_entries(void)
+static int get_diskstats_entries(struct flb_in_disk_config *ctx)
 {
-    char line[LINE_SIZE] = {0};
-    int   ret = 0;
-    FILE *fp = NULL;
+    int ret = 0;
+    char *p;
 
-    fp = fopen("/proc/diskstats", "r");
-    if (fp == NULL) {
-        perror("fopen");
+    p = flb_procfs_sample(ctx->diskstats, NULL);
+    if (!p) {
+        flb_errno();
         return 0;
     }
-    while(fgets(line, LINE_SIZE-1, fp) != NULL) {
+
+    while (*p) {
+        p = flb_procfs_next_line(p);
         ret++;
     }
 
-    fclose(fp);
     return ret;
 }
 
 static int configure(struct flb_in_disk_config *disk_config,
-                               struct flb_input_instance *in)
+                     struct flb_input_instance *in,
+                     struct flb_config *config)
 {
     (void) *in;
     char *pval = NULL;
@@ -243,7 +221,13 @@ static int configure(struct flb_in_disk_config *disk_config,
         disk_config->dev_name = NULL;
     }
 
-    entry = get_diskstats_entries();
+    /* /proc/diskstats stays open, it's shared with other inputs */
+    disk_config->diskstats = flb_procfs_get(config, "/proc/diskstats");
+    if (!disk_config->diskstats) {
+        return -1;
+    }
+
+    entry = get_diskstats_entries(disk_config);
     if (entry == 0) {
         /* no entry to count */
         return -1;
@@ -285,9 +269,11 @@ static int in_disk_init(struct flb_input_instance *in,
     disk_config->write_total = NULL;
     disk_config->prev_read_total = NULL;
     disk_config->prev_write_total = NULL;
+    disk_config->dev_name = NULL;
+    disk_config->diskstats = NULL;
 
     /* Initialize head config */
-    ret = configure(disk_config, in);
+    ret = configure(disk_config, in, config);
     if (ret < 0) {
         goto init_error;
     }
@@ -310,6 +296,10 @@ static int in_disk_init(struct flb_input_instance *in,
     flb_free(disk_config->write_total);
     flb_free(disk_config->prev_read_total);
     flb_free(disk_config->prev_write_total);
+    flb_free(disk_config->dev_name);
+    if (disk_config->diskstats) {
+        flb_procfs_put(config, disk_config->diskstats);
+    }
     flb_free(disk_config);
     return -1;
 }
@@ -324,6 +314,7 @@ static int in_disk_exit(void *data, struct flb_config *config)
     flb_free(disk_config->prev_read_total);
     flb_free(disk_config->prev_write_total);
     flb_free(disk_config->dev_name);
+    flb_procfs_put(config, disk_config->diskstats);
     flb_free(disk_config);
     return 0;
 }
@@ -35,6 +35,7 @@ struct flb_in_disk_config {
     uint64_t *prev_read_total;
     uint64_t *prev_write_total;
     char     *dev_name;
+    struct flb_procfs_file *diskstats;
     int      entry;
     int      interval_sec;
     int      interval_nsec;
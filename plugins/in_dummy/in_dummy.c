@@ -20,6 +20,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
+#include <inttypes.h>
+#include <sys/stat.h>
 
 #include <msgpack.h>
 #include <fluent-bit/flb_input.h>
@@ -27,35 +29,107 @@
 #include <fluent-bit/flb_error.h>
 #include <fluent-bit/flb_time.h>
 #include <fluent-bit/flb_pack.h>
+#include <fluent-bit/flb_utils.h>
 
 #include "in_dummy.h"
 
+/* xorshift64*: cheap pseudo random numbers for the randomized fields */
+static inline uint64_t random_next(struct flb_in_dummy_config *ctx)
+{
+    uint64_t x = ctx->random_seed;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    ctx->random_seed = x;
+
+    /* Keep it positive for consumers of signed integers */
+    return (x * 2685821657736338717ULL) >> 1;
+}
+
+/* Write a random value into the uint64 placeholder of a record */
+static inline void random_set(struct flb_in_dummy_config *ctx, char *p)
+{
+    int i;
+    uint64_t val;
+
+    val = random_next(ctx);
+    for (i = 7; i >= 0; i--) {
+        p[i] = (char) (val & 0xff);
+        val >>= 8;
+    }
+}
 
 /* cb_collect callback */
 static int in_dummy_collect(struct flb_input_instance *i_ins,
                              struct flb_config *config, void *in_context)
 {
-    size_t off = 0;
-    size_t start = 0;
-    msgpack_unpacked result;
+    int i;
+    int j;
+    int n;
+    size_t off;
+    struct flb_time tm;
+    struct flb_in_dummy_sample *s;
     struct flb_in_dummy_config *ctx = in_context;
-    char* pack = ctx->ref_msgpack;
-    int pack_size = ctx->ref_msgpack_size;
 
-    msgpack_unpacked_init(&result);
+    /* Records generated while paused would be discarded */
+    if (flb_input_buf_paused(i_ins) == FLB_TRUE) {
+        return 0;
+    }
+
+    n = ctx->batch;
+    if (ctx->total > 0 && ctx->count + n > ctx->total) {
+        n = ctx->total - ctx->count;
+    }
+    if (n <= 0) {
+        return 0;
+    }
+
+    /* Records of a batch share the clock read */
+    if (ctx->fixed_time == FLB_FALSE) {
+        flb_input_time_get(i_ins, &tm);
+    }
+
     flb_input_buf_write_start(i_ins);
+    for (i = 0; i < n; i++) {
+        s = &ctx->samples[ctx->sample];
 
-    while (msgpack_unpack_next(&result, pack, pack_size, &off)) {
-        if (result.data.type == MSGPACK_OBJECT_MAP) {
-            /* { map => val, map => val, map => val } */
-            msgpack_pack_array(&i_ins->mp_pck, 2);
-            flb_pack_time_now(&i_ins->mp_pck);
-            msgpack_pack_str_body(&i_ins->mp_pck, pack + start, off - start);
+        msgpack_pack_array(&i_ins->mp_pck, 2);
+        if (ctx->fixed_time == FLB_TRUE) {
+            flb_time_append_to_msgpack(&ctx->tm, &i_ins->mp_pck, 0);
+            ctx->tm.tm.tv_nsec += ctx->step;
+            while (ctx->tm.tm.tv_nsec >= 1000000000L) {
+                ctx->tm.tm.tv_nsec -= 1000000000L;
+                ctx->tm.tm.tv_sec++;
+            }
+        }
+        else {
+            flb_time_append_to_msgpack(&tm, &i_ins->mp_pck, 0);
+        }
+
+        /* The pre-packed map, then its randomized values */
+        off = i_ins->mp_sbuf.size;
+        msgpack_pack_str_body(&i_ins->mp_pck,
+                              ctx->ref_msgpack + s->off, s->size);
+        for (j = 0; j < s->random_num; j++) {
+            random_set(ctx, i_ins->mp_sbuf.data + off +
+                       ctx->random_off[s->random_start + j]);
+        }
+
+        ctx->sample++;
+        if (ctx->sample == ctx->samples_num) {
+            ctx->sample = 0;
         }
-        start = off;
     }
+    i_ins->mp_buf_write_records = n;
     flb_input_buf_write_end(i_ins);
-    msgpack_unpacked_destroy(&result);
+
+    ctx->count += n;
+    if (ctx->total > 0 && ctx->count >= ctx->total) {
+        flb_info("[in_dummy] %" PRIu64 " records generated, stopping",
+                 ctx->count);
+        flb_input_collector_pause(ctx->coll_fd, i_ins);
+    }
 
     return 0;
 }
@@ -64,10 +138,182 @@ static int config_destroy(struct flb_in_dummy_config *ctx)
 {
     flb_free(ctx->dummy_message);
     flb_free(ctx->ref_msgpack);
+    flb_free(ctx->samples);
+    flb_free(ctx->random_off);
     flb_free(ctx);
     return 0;
 }
 
+static int random_key(struct mk_list *keys, msgpack_object *key)
+{
+    struct mk_list *head;
+    struct flb_split_entry *entry;
+
+    if (!keys || key->type != MSGPACK_OBJECT_STR) {
+        return FLB_FALSE;
+    }
+
+    mk_list_foreach(head, keys) {
+        entry = mk_list_entry(head, struct flb_split_entry, _head);
+        if (entry->len == key->via.str.size &&
+            strncmp(entry->value, key->via.str.ptr, entry->len) == 0) {
+            return FLB_TRUE;
+        }
+    }
+
+    return FLB_FALSE;
+}
+
+/*
+ * Add the maps of a packed buffer to the samples. The values of the keys
+ * to randomize are packed as a fixed size uint64, their offsets are kept
+ * so the collector can overwrite them in each copy of the map.
+ */
+static int samples_add(struct flb_in_dummy_config *ctx,
+                       msgpack_sbuffer *sbuf, char *buf, size_t size,
+                       struct mk_list *keys)
+{
+    int i;
+    size_t off = 0;
+    size_t map_off;
+    void *tmp;
+    char placeholder[DUMMY_RANDOM_SIZE] = { (char) 0xcf };
+    msgpack_object *map;
+    msgpack_packer pck;
+    msgpack_unpacked result;
+    struct flb_in_dummy_sample *s;
+
+    msgpack_packer_init(&pck, sbuf, msgpack_sbuffer_write);
+    msgpack_unpacked_init(&result);
+    while (msgpack_unpack_next(&result, buf, size, &off)) {
+        map = &result.data;
+        if (map->type != MSGPACK_OBJECT_MAP) {
+            continue;
+        }
+
+        tmp = flb_realloc(ctx->samples, sizeof(struct flb_in_dummy_sample) *
+                          (ctx->samples_num + 1));
+        if (!tmp) {
+            flb_errno();
+            msgpack_unpacked_destroy(&result);
+            return -1;
+        }
+        ctx->samples = tmp;
+        s = &ctx->samples[ctx->samples_num++];
+        s->random_start = ctx->random_num;
+        s->random_num = 0;
+
+        map_off = sbuf->size;
+        msgpack_pack_map(&pck, map->via.map.size);
+        for (i = 0; i < map->via.map.size; i++) {
+            msgpack_pack_object(&pck, map->via.map.ptr[i].key);
+            if (random_key(keys, &map->via.map.ptr[i].key) == FLB_FALSE) {
+                msgpack_pack_object(&pck, map->via.map.ptr[i].val);
+                continue;
+            }
+
+            tmp = flb_realloc(ctx->random_off,
+                              sizeof(size_t) * (ctx->random_num + 1));
+            if (!tmp) {
+                flb_errno();
+                msgpack_unpacked_destroy(&result);
+                return -1;
+            }
+            ctx->random_off = tmp;
+            msgpack_sbuffer_write(sbuf, placeholder, DUMMY_RANDOM_SIZE);
+            ctx->random_off[ctx->random_num++] = sbuf->size - map_off -
+                                                 (DUMMY_RANDOM_SIZE - 1);
+            s->random_num++;
+        }
+        s->off = map_off;
+        s->size = sbuf->size - map_off;
+    }
+    msgpack_unpacked_destroy(&result);
+
+    return 0;
+}
+
+static int samples_json(struct flb_in_dummy_config *ctx,
+                        msgpack_sbuffer *sbuf, char *js, size_t len,
+                        struct mk_list *keys)
+{
+    int ret;
+    char *buf;
+    size_t size;
+
+    ret = flb_pack_json(js, len, &buf, &size);
+    if (ret != 0) {
+        return -1;
+    }
+
+    ret = samples_add(ctx, sbuf, buf, size, keys);
+    flb_free(buf);
+
+    return ret;
+}
+
+/* Samples file: one JSON map per line */
+static int samples_file(struct flb_in_dummy_config *ctx,
+                        msgpack_sbuffer *sbuf, char *path,
+                        struct mk_list *keys)
+{
+    int ret = 0;
+    char *buf;
+    char *p;
+    char *end;
+    char *eol;
+    FILE *fp;
+    struct stat st;
+
+    fp = fopen(path, "r");
+    if (!fp) {
+        flb_errno();
+        flb_error("[in_dummy] cannot open samples file %s", path);
+        return -1;
+    }
+
+    if (fstat(fileno(fp), &st) != 0 || st.st_size == 0) {
+        flb_error("[in_dummy] samples file %s is empty", path);
+        fclose(fp);
+        return -1;
+    }
+
+    buf = flb_malloc(st.st_size);
+    if (!buf) {
+        flb_errno();
+        fclose(fp);
+        return -1;
+    }
+    if (fread(buf, st.st_size, 1, fp) != 1) {
+        flb_errno();
+        flb_free(buf);
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+
+    p = buf;
+    end = buf + st.st_size;
+    while (p < end) {
+        eol = memchr(p, '\n', end - p);
+        if (!eol) {
+            eol = end;
+        }
+        if (eol - p > 0 && !(eol - p == 1 && *p == '\r')) {
+            ret = samples_json(ctx, sbuf, p, eol - p, keys);
+            if (ret != 0) {
+                flb_error("[in_dummy] invalid sample in %s: %.*s",
+                          path, (int) (eol - p), p);
+                break;
+            }
+        }
+        p = eol + 1;
+    }
+    flb_free(buf);
+
+    return ret;
+}
+
 /* Set plugin configuration */
 static int configure(struct flb_in_dummy_config *ctx,
                      struct flb_input_instance *in,
@@ -76,8 +322,8 @@ static int configure(struct flb_in_dummy_config *ctx,
     char *str = NULL;
     int  ret = -1;
     long val  = 0;
-
-    ctx->ref_msgpack = NULL;
+    struct mk_list *keys = NULL;
+    msgpack_sbuffer sbuf;
 
     /* samples */
     str = flb_input_get_property("dummy", in);
@@ -99,26 +345,70 @@ static int configure(struct flb_in_dummy_config *ctx,
         tm->tv_nsec = 1000000000 / val;
     }
 
-    ret = flb_pack_json(ctx->dummy_message,
-                  ctx->dummy_message_len,
-                  &ctx->ref_msgpack, &ctx->ref_msgpack_size);
-    if (ret != 0) {
-        flb_warn("[in_dummy] Data is incomplete. Use default string.");
+    /* records per collect */
+    ctx->batch = 1;
+    str = flb_input_get_property("batch", in);
+    if (str != NULL && (ctx->batch = atoi(str)) <= 0) {
+        flb_error("[in_dummy] invalid batch");
+        return -1;
+    }
 
-        flb_free(ctx->dummy_message);
-        ctx->dummy_message = flb_strdup(DEFAULT_DUMMY_MESSAGE);
-        ctx->dummy_message_len = strlen(ctx->dummy_message);
+    /* records to generate */
+    str = flb_input_get_property("samples", in);
+    if (str != NULL) {
+        ctx->total = strtoull(str, NULL, 10);
+    }
 
-        ret = flb_pack_json(ctx->dummy_message,
-                            ctx->dummy_message_len,
-                            &ctx->ref_msgpack, &ctx->ref_msgpack_size);
-        if (ret != 0) {
-            flb_error("[in_dummy] Unexpected error");
-            return -1;
+    /* fixed start time, the records get evenly spaced timestamps */
+    str = flb_input_get_property("start_time", in);
+    if (str != NULL) {
+        ctx->fixed_time = FLB_TRUE;
+        flb_time_from_double(&ctx->tm, atof(str));
+        ctx->step = (tm->tv_sec * 1000000000L + tm->tv_nsec) / ctx->batch;
+    }
+
+    /* top level keys with random values */
+    str = flb_input_get_property("random_fields", in);
+    if (str != NULL) {
+        keys = flb_utils_split(str, ' ', 256);
+    }
+    ctx->random_seed = flb_time_usec() | 1;
+
+    msgpack_sbuffer_init(&sbuf);
+    str = flb_input_get_property("samples_file", in);
+    if (str != NULL) {
+        ret = samples_file(ctx, &sbuf, str, keys);
+    }
+    else {
+        ret = samples_json(ctx, &sbuf, ctx->dummy_message,
+                           ctx->dummy_message_len, keys);
+        if (ret != 0 || ctx->samples_num == 0) {
+            flb_warn("[in_dummy] Data is incomplete. Use default string.");
+
+            flb_free(ctx->dummy_message);
+            ctx->dummy_message = flb_strdup(DEFAULT_DUMMY_MESSAGE);
+            ctx->dummy_message_len = strlen(ctx->dummy_message);
+
+            ret = samples_json(ctx, &sbuf, ctx->dummy_message,
+                               ctx->dummy_message_len, keys);
+            if (ret != 0) {
+                flb_error("[in_dummy] Unexpected error");
+            }
         }
     }
+    if (keys) {
+        flb_utils_split_free(keys);
+    }
 
-    return 0;
+    if (ret == 0 && ctx->samples_num == 0) {
+        flb_error("[in_dummy] no sample records");
+        ret = -1;
+    }
+
+    ctx->ref_msgpack = sbuf.data;
+    ctx->ref_msgpack_size = sbuf.size;
+
+    return ret;
 }
 
 /* Initialize plugin */
@@ -130,7 +420,7 @@ static int in_dummy_init(struct flb_input_instance *in,
     struct timespec tm;
 
     /* Allocate space for the configuration */
-    ctx = flb_malloc(sizeof(struct flb_in_dummy_config));
+    ctx = flb_calloc(1, sizeof(struct flb_in_dummy_config));
     if (ctx == NULL) {
         return -1;
     }
@@ -174,5 +464,6 @@ struct flb_input_plugin in_dummy_plugin = {
     .cb_pre_run   = NULL,
     .cb_collect   = in_dummy_collect,
     .cb_flush_buf = NULL,
-    .cb_exit      = in_dummy_exit
+    .cb_exit      = in_dummy_exit,
+    .flags        = FLB_INPUT_RUNNER
 };
@@ -20,13 +20,47 @@
 #ifndef FLB_IN_DUMMY_H
 #define FLB_IN_DUMMY_H
 
+#include <fluent-bit/flb_time.h>
+
 #define DEFAULT_DUMMY_MESSAGE "{\"message\":\"dummy\"}"
+
+/* Size of a randomized value: msgpack uint64, marker + 8 bytes */
+#define DUMMY_RANDOM_SIZE     9
+
+/* A sample record: a packed map, reused as is by every record */
+struct flb_in_dummy_sample {
+    size_t off;                 /* map offset in ref_msgpack       */
+    size_t size;                /* map size                        */
+    int random_start;           /* first entry in random_off       */
+    int random_num;             /* number of randomized values     */
+};
+
 struct flb_in_dummy_config {
     char *dummy_message;
     int    dummy_message_len;
 
+    /* Packed maps of the samples */
     char *ref_msgpack;
     size_t ref_msgpack_size;
+    struct flb_in_dummy_sample *samples;
+    int samples_num;
+    int sample;                 /* next sample to emit             */
+
+    /* Offsets of the randomized values, relative to their map */
+    size_t *random_off;
+    int random_num;
+    uint64_t random_seed;
+
+    int batch;                  /* records per collect             */
+    uint64_t total;             /* records to generate, 0: no end  */
+    uint64_t count;             /* records generated               */
+
+    /* Fixed start time: each record is 'step' nanoseconds later */
+    int fixed_time;
+    struct flb_time tm;
+    long step;
+
+    int coll_fd;
 };
 
 extern struct flb_input_plugin in_dummy_plugin;
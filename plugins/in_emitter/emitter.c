@@ -0,0 +1,56 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_input.h>
+#include <fluent-bit/flb_config.h>
+
+/*
+ * Emitter: an input without collectors. Other components (e.g. filters
+ * producing new records) create an instance and append records to it with
+ * the dyntag interface, the records are routed by their own tag.
+ */
+static int cb_emitter_init(struct flb_input_instance *in,
+                           struct flb_config *config, void *data)
+{
+    (void) config;
+    (void) data;
+
+    flb_input_set_context(in, NULL);
+    return 0;
+}
+
+static int cb_emitter_exit(void *data, struct flb_config *config)
+{
+    (void) data;
+    (void) config;
+
+    return 0;
+}
+
+struct flb_input_plugin in_emitter_plugin = {
+    .name         = "emitter",
+    .description  = "Records emitted by other plugins",
+    .cb_init      = cb_emitter_init,
+    .cb_pre_run   = NULL,
+    .cb_collect   = NULL,
+    .cb_flush_buf = NULL,
+    .cb_exit      = cb_emitter_exit,
+    .flags        = FLB_INPUT_DYN_TAG
+};
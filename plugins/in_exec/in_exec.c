@@ -25,14 +25,66 @@
 #include <fluent-bit/flb_stats.h>
 #include <fluent-bit/flb_pack.h>
 #include <fluent-bit/flb_parser.h>
+#include <fluent-bit/flb_mem_pool.h>
 #include <msgpack.h>
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
 
 #include "in_exec.h"
 
+/* Pack one line of the command output, 'buf' is NULL terminated */
+static void exec_line(struct flb_input_instance *i_ins,
+                      struct flb_in_exec_config *exec_config,
+                      char *buf, size_t str_len)
+{
+    /* variables for parser */
+    int parser_ret = -1;
+    void *out_buf = NULL;
+    size_t out_size = 0;
+    struct flb_time out_time;
+
+    if (exec_config->parser) {
+        flb_time_zero(&out_time);
+        parser_ret = flb_parser_do(exec_config->parser, buf, str_len,
+                                   &out_buf, &out_size, &out_time);
+        if (parser_ret >= 0) {
+            if (flb_time_to_double(&out_time) == 0.0) {
+                flb_time_get(&out_time);
+            }
+
+            flb_input_buf_write_start(i_ins);
+
+            msgpack_pack_array(&i_ins->mp_pck, 2);
+            flb_time_append_to_msgpack(&out_time, &i_ins->mp_pck, 0);
+            flb_mem_pool_sbuffer_write(&i_ins->mp_sbuf, out_buf, out_size);
+
+            flb_input_buf_write_end(i_ins);
+            flb_free(out_buf);
+        }
+    }
+    else {
+        flb_input_buf_write_start(i_ins);
+
+        msgpack_pack_array(&i_ins->mp_pck, 2);
+        flb_pack_time_now(&i_ins->mp_pck);
+        msgpack_pack_map(&i_ins->mp_pck, 1);
+
+        msgpack_pack_str(&i_ins->mp_pck, 4);
+        msgpack_pack_str_body(&i_ins->mp_pck, "exec", 4);
+        msgpack_pack_str(&i_ins->mp_pck, str_len);
+        msgpack_pack_str_body(&i_ins->mp_pck, buf, str_len);
+
+        flb_input_buf_write_end(i_ins);
+    }
+}
+
 /* cb_collect callback */
 static int in_exec_collect(struct flb_input_instance *i_ins,
                            struct flb_config *config, void *in_context)
@@ -43,70 +95,214 @@ static int in_exec_collect(struct flb_input_instance *i_ins,
     char buf[DEFAULT_BUF_SIZE] = {0};
     struct flb_in_exec_config *exec_config = in_context;
 
-    /* variables for parser */
-    int parser_ret = -1;
-    void *out_buf = NULL;
-    size_t out_size = 0;
-    struct flb_time out_time;
-    
     cmdp = popen(exec_config->cmd, "r");
     if (cmdp == NULL) {
         flb_debug("[in_exec] %s failed", exec_config->cmd);
         goto collect_end;
     }
 
-    if (exec_config->parser) {
-        while (fgets(buf, DEFAULT_BUF_SIZE - 1,cmdp) != NULL) {
-            str_len = strlen(buf);
-            buf[str_len-1] = '\0'; /* chomp */
-
-            parser_ret = flb_parser_do(exec_config->parser, buf, str_len-1,
-                                &out_buf, &out_size, &out_time);
-            if (parser_ret >= 0) {
-                if (flb_time_to_double(&out_time) == 0.0) {
-                    flb_time_get(&out_time);
-                }
-
-                flb_input_buf_write_start(i_ins);
-
-                msgpack_pack_array(&i_ins->mp_pck, 2);
-                flb_time_append_to_msgpack(&out_time, &i_ins->mp_pck, 0);
-                msgpack_sbuffer_write(&i_ins->mp_sbuf, out_buf, out_size);
-                
-                flb_input_buf_write_end(i_ins);
-                flb_free(out_buf);
+    while (fgets(buf, DEFAULT_BUF_SIZE - 1,cmdp) != NULL) {
+        str_len = strlen(buf);
+        if (str_len > 0 && buf[str_len - 1] == '\n') {
+            buf[--str_len] = '\0'; /* chomp */
+        }
+        exec_line(i_ins, exec_config, buf, str_len);
+    }
+
+    ret = 0; /* success */
+
+ collect_end:
+    if(cmdp != NULL){
+        pclose(cmdp);
+    }
+
+    return ret;
+}
+
+/* Persistent mode: start the command with its standard output on a pipe */
+static int exec_start(struct flb_in_exec_config *ctx)
+{
+    int fd[2];
+    int null_fd;
+    pid_t pid;
+
+    if (pipe(fd) == -1) {
+        flb_errno();
+        return -1;
+    }
+    fcntl(fd[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fd[1], F_SETFD, FD_CLOEXEC);
+
+    pid = fork();
+    if (pid == -1) {
+        flb_errno();
+        close(fd[0]);
+        close(fd[1]);
+        return -1;
+    }
+
+    if (pid == 0) {
+        /* Own process group: the shell and its children are stopped together */
+        setpgid(0, 0);
+        signal(SIGPIPE, SIG_DFL);
+        dup2(fd[1], STDOUT_FILENO);
+        null_fd = open("/dev/null", O_RDONLY);
+        if (null_fd != -1) {
+            dup2(null_fd, STDIN_FILENO);
+        }
+        execl("/bin/sh", "sh", "-c", ctx->cmd, (char *) NULL);
+        _exit(127);
+    }
+    setpgid(pid, pid);
+    close(fd[1]);
+
+    /* The collector is bound to the first descriptor, it is kept */
+    if (ctx->fd == -1) {
+        ctx->fd = fd[0];
+    }
+    else {
+        dup2(fd[0], ctx->fd);
+        close(fd[0]);
+        fcntl(ctx->fd, F_SETFD, FD_CLOEXEC);
+    }
+    fcntl(ctx->fd, F_SETFL, fcntl(ctx->fd, F_GETFL) | O_NONBLOCK);
+
+    ctx->pid = pid;
+    ctx->started = time(NULL);
+    ctx->buf_len = 0;
+    flb_debug("[in_exec] started '%s', pid=%i", ctx->cmd, pid);
+
+    return 0;
+}
+
+/* Terminate the command if it is still running and collect its status */
+static int exec_stop(struct flb_in_exec_config *ctx)
+{
+    int i;
+    int status = 0;
+    pid_t ret;
+
+    if (ctx->pid == -1) {
+        return 0;
+    }
+
+    ret = waitpid(ctx->pid, &status, WNOHANG);
+    if (ret == 0) {
+        kill(-ctx->pid, SIGTERM);
+        for (i = 0; i < 100; i++) {
+            ret = waitpid(ctx->pid, &status, WNOHANG);
+            if (ret != 0) {
+                break;
             }
+            usleep(10000);
+        }
+        if (ret == 0) {
+            kill(-ctx->pid, SIGKILL);
+            waitpid(ctx->pid, &status, 0);
         }
     }
-    else{
-        while (fgets(buf, DEFAULT_BUF_SIZE - 1,cmdp) != NULL) {
-            str_len = strlen(buf);
-            buf[str_len-1] = '\0'; /* chomp */
+    ctx->pid = -1;
 
-            flb_input_buf_write_start(i_ins);
-            
-            msgpack_pack_array(&i_ins->mp_pck, 2);
-            flb_pack_time_now(&i_ins->mp_pck);
-            msgpack_pack_map(&i_ins->mp_pck, 1);
+    return status;
+}
 
-            msgpack_pack_str(&i_ins->mp_pck, 4);
-            msgpack_pack_str_body(&i_ins->mp_pck, "exec", 4);
-            msgpack_pack_str(&i_ins->mp_pck, str_len-1);
-            msgpack_pack_str_body(&i_ins->mp_pck,
-                                  buf, str_len-1);
+/* Persistent mode: lines of the command output, as they come */
+static int in_exec_read(struct flb_input_instance *i_ins,
+                        struct flb_config *config, void *in_context)
+{
+    int status;
+    ssize_t bytes;
+    char *p;
+    char *nl;
+    char *end;
+    time_t now;
+    struct flb_in_exec_config *ctx = in_context;
+    (void) config;
+
+    bytes = read(ctx->fd, ctx->buf + ctx->buf_len,
+                 ctx->buf_size - ctx->buf_len);
+    if (bytes == -1 && (errno == EAGAIN || errno == EINTR)) {
+        return 0;
+    }
 
-            flb_input_buf_write_end(i_ins);
+    if (bytes > 0) {
+        ctx->buf_len += bytes;
+        p = ctx->buf;
+        end = ctx->buf + ctx->buf_len;
+        while ((nl = memchr(p, '\n', end - p))) {
+            *nl = '\0';
+            exec_line(i_ins, ctx, p, nl - p);
+            p = nl + 1;
         }
+
+        /* No room left: the line is split */
+        if (p == ctx->buf && ctx->buf_len == ctx->buf_size) {
+            flb_warn("[in_exec] line longer than %zu bytes, split",
+                     ctx->buf_size);
+            ctx->buf[ctx->buf_len] = '\0';
+            exec_line(i_ins, ctx, ctx->buf, ctx->buf_len);
+            p = end;
+        }
+
+        ctx->buf_len = end - p;
+        memmove(ctx->buf, p, ctx->buf_len);
+        return 0;
     }
 
-    ret = 0; /* success */
+    /* End of the output: the command is gone or closed it */
+    if (ctx->buf_len > 0) {
+        ctx->buf[ctx->buf_len] = '\0';
+        exec_line(i_ins, ctx, ctx->buf, ctx->buf_len);
+        ctx->buf_len = 0;
+    }
+    flb_input_collector_pause(ctx->coll_id, i_ins);
 
- collect_end:
-    if(cmdp != NULL){
-        pclose(cmdp);
+    status = exec_stop(ctx);
+    now = time(NULL);
+    if (now - ctx->started >= ctx->backoff_max) {
+        ctx->backoff = 1;
     }
-    
-    return ret;
+    ctx->restart_at = now + ctx->backoff;
+
+    if (WIFSIGNALED(status)) {
+        flb_warn("[in_exec] '%s' killed by signal %i, restarting in %i "
+                 "seconds", ctx->cmd, WTERMSIG(status), ctx->backoff);
+    }
+    else {
+        flb_warn("[in_exec] '%s' exited with status %i, restarting in %i "
+                 "seconds", ctx->cmd, WEXITSTATUS(status), ctx->backoff);
+    }
+
+    ctx->backoff *= 2;
+    if (ctx->backoff > ctx->backoff_max) {
+        ctx->backoff = ctx->backoff_max;
+    }
+
+    return 0;
+}
+
+/* Persistent mode: start the command again once its wait is over */
+static int in_exec_restart(struct flb_input_instance *i_ins,
+                           struct flb_config *config, void *in_context)
+{
+    time_t now;
+    struct flb_in_exec_config *ctx = in_context;
+    (void) config;
+
+    now = time(NULL);
+    if (ctx->pid != -1 || now < ctx->restart_at) {
+        return 0;
+    }
+
+    if (exec_start(ctx) == -1) {
+        ctx->restart_at = now + ctx->backoff;
+        return -1;
+    }
+    if (!ctx->paused) {
+        flb_input_collector_resume(ctx->coll_id, i_ins);
+    }
+
+    return 0;
 }
 
 /* read config file and*/
@@ -128,6 +324,34 @@ static int in_exec_config_read(struct flb_in_exec_config *exec_config,
     }
     exec_config->cmd = cmd;
 
+    exec_config->mode = FLB_IN_EXEC_INTERVAL;
+    pval = flb_input_get_property("mode", in);
+    if (pval != NULL) {
+        if (strcasecmp(pval, "persistent") == 0) {
+            exec_config->mode = FLB_IN_EXEC_PERSISTENT;
+        }
+        else if (strcasecmp(pval, "interval") != 0) {
+            flb_error("[in_exec] invalid mode '%s'", pval);
+            return -1;
+        }
+    }
+
+    exec_config->buf_size = DEFAULT_LINE_SIZE;
+    pval = flb_input_get_property("buf_size", in);
+    if (pval != NULL) {
+        if (flb_utils_size_to_bytes(pval) <= 0) {
+            flb_error("[in_exec] invalid buf_size '%s'", pval);
+            return -1;
+        }
+        exec_config->buf_size = flb_utils_size_to_bytes(pval);
+    }
+
+    exec_config->backoff_max = DEFAULT_BACKOFF_MAX;
+    pval = flb_input_get_property("restart_backoff_max", in);
+    if (pval != NULL && atoi(pval) > 0) {
+        exec_config->backoff_max = atoi(pval);
+    }
+
     pval = flb_input_get_property("parser", in);
     if (pval != NULL) {
         exec_config->parser = flb_parser_get(pval, config);
@@ -168,6 +392,11 @@ static int in_exec_config_read(struct flb_in_exec_config *exec_config,
 static void delete_exec_config(struct flb_in_exec_config *exec_config)
 {
     if (exec_config) {
+        exec_stop(exec_config);
+        if (exec_config->fd != -1) {
+            close(exec_config->fd);
+        }
+        flb_free(exec_config->buf);
         flb_free(exec_config);
     }
 }
@@ -182,12 +411,15 @@ static int in_exec_init(struct flb_input_instance *in,
     int interval_nsec = 0;
 
     /* Allocate space for the configuration */
-    exec_config = flb_malloc(sizeof(struct flb_in_exec_config));
+    exec_config = flb_calloc(1, sizeof(struct flb_in_exec_config));
     if (exec_config == NULL) {
         return -1;
     }
     exec_config->parser = NULL;
-    
+    exec_config->pid = -1;
+    exec_config->fd = -1;
+    exec_config->ins = in;
+
     /* Initialize exec config */
     ret = in_exec_config_read(exec_config, in, config, &interval_sec, &interval_nsec);
     if (ret < 0) {
@@ -196,6 +428,35 @@ static int in_exec_init(struct flb_input_instance *in,
 
     flb_input_set_context(in, exec_config);
 
+    if (exec_config->mode == FLB_IN_EXEC_PERSISTENT) {
+        exec_config->buf = flb_malloc(exec_config->buf_size + 1);
+        if (!exec_config->buf) {
+            flb_errno();
+            goto init_error;
+        }
+        exec_config->backoff = 1;
+        if (exec_start(exec_config) == -1) {
+            flb_error("[in_exec] could not start '%s'", exec_config->cmd);
+            goto init_error;
+        }
+
+        ret = flb_input_set_collector_event(in, in_exec_read,
+                                            exec_config->fd, config);
+        if (ret < 0) {
+            flb_error("could not set collector for exec input plugin");
+            goto init_error;
+        }
+        exec_config->coll_id = ret;
+
+        /* Restarts are checked every second */
+        ret = flb_input_set_collector_time(in, in_exec_restart, 1, 0, config);
+        if (ret < 0) {
+            flb_error("could not set collector for exec input plugin");
+            goto init_error;
+        }
+        return 0;
+    }
+
     ret = flb_input_set_collector_time(in,
                                        in_exec_collect,
                                        interval_sec,
@@ -204,6 +465,7 @@ static int in_exec_init(struct flb_input_instance *in,
         flb_error("could not set collector for exec input plugin");
         goto init_error;
     }
+    exec_config->coll_id = ret;
 
     return 0;
 
@@ -213,6 +475,35 @@ static int in_exec_init(struct flb_input_instance *in,
     return -1;
 }
 
+/*
+ * The instance cannot append more data: in persistent mode the command
+ * blocks on its full pipe meanwhile, nothing is lost.
+ */
+static void in_exec_pause(void *data, struct flb_config *config)
+{
+    struct flb_in_exec_config *ctx = data;
+    (void) config;
+
+    ctx->paused = FLB_TRUE;
+    if (flb_input_collector_running(ctx->coll_id, ctx->ins)) {
+        flb_input_collector_pause(ctx->coll_id, ctx->ins);
+    }
+}
+
+static void in_exec_resume(void *data, struct flb_config *config)
+{
+    struct flb_in_exec_config *ctx = data;
+    (void) config;
+
+    ctx->paused = FLB_FALSE;
+    if (ctx->mode == FLB_IN_EXEC_PERSISTENT && ctx->pid == -1) {
+        return;
+    }
+    if (!flb_input_collector_running(ctx->coll_id, ctx->ins)) {
+        flb_input_collector_resume(ctx->coll_id, ctx->ins);
+    }
+}
+
 int in_exec_exit(void *data, struct flb_config *config)
 {
     (void) *config;
@@ -230,5 +521,8 @@ struct flb_input_plugin in_exec_plugin = {
     .cb_pre_run   = NULL,
     .cb_collect   = in_exec_collect,
     .cb_flush_buf = NULL,
-    .cb_exit      = in_exec_exit
+    .cb_pause     = in_exec_pause,
+    .cb_resume    = in_exec_resume,
+    .cb_exit      = in_exec_exit,
+    .flags        = FLB_INPUT_RUNNER
 };
@@ -26,13 +26,42 @@
 
 #include <msgpack.h>
 
+#include <sys/types.h>
+#include <time.h>
+
 #define DEFAULT_BUF_SIZE      4096
 #define DEFAULT_INTERVAL_SEC  1
 #define DEFAULT_INTERVAL_NSEC 0
 
+/* Persistent mode */
+#define DEFAULT_LINE_SIZE     32768  /* longest line, longer ones are split */
+#define DEFAULT_BACKOFF_MAX   60     /* seconds between restarts, at most  */
+
+#define FLB_IN_EXEC_INTERVAL    0    /* run the command every interval     */
+#define FLB_IN_EXEC_PERSISTENT  1    /* run it once, read it as it writes  */
+
 struct flb_in_exec_config {
     char  *cmd;
     struct flb_parser  *parser;
+    int mode;
+    int coll_id;                /* collector of the output            */
+    int paused;                 /* the instance cannot append data    */
+
+    /*
+     * Persistent mode: the command is started once and its standard output
+     * is read from the event loop. When it exits it is started again, the
+     * wait doubles on each quick exit, up to 'backoff_max'.
+     */
+    pid_t pid;                  /* -1 when the command is not running */
+    int fd;                     /* read end of its standard output    */
+    char *buf;                  /* partial line                       */
+    size_t buf_len;
+    size_t buf_size;
+    time_t started;
+    time_t restart_at;
+    int backoff;
+    int backoff_max;
+    struct flb_input_instance *ins;
 };
 
 extern struct flb_input_plugin in_exec_plugin;
@@ -76,6 +76,11 @@ static int in_fw_collect(struct flb_input_instance *i_ins,
     struct fw_conn *conn;
     (void) i_ins;
 
+    /* Stale event, new connections are accepted once resumed */
+    if (ctx->paused == FLB_TRUE) {
+        return 0;
+    }
+
     /* Accept the new connection */
     fd = flb_net_accept(ctx->server_fd);
     if (fd == -1) {
@@ -91,6 +96,106 @@ static int in_fw_collect(struct flb_input_instance *i_ins,
     return 0;
 }
 
+/*
+ * Listener workers callbacks, they run in the worker thread on the worker
+ * copy of the context.
+ */
+static int fw_worker_accept(void *data)
+{
+    struct flb_in_fw_config *ctx = data;
+
+    return in_fw_collect(ctx->in, NULL, ctx);
+}
+
+static void fw_worker_pause(void *data)
+{
+    struct flb_in_fw_config *ctx = data;
+
+    fw_conn_pause_all(ctx);
+    ctx->paused = FLB_TRUE;
+}
+
+static void fw_worker_resume(void *data)
+{
+    struct flb_in_fw_config *ctx = data;
+
+    ctx->paused = FLB_FALSE;
+    fw_conn_resume_all(ctx);
+}
+
+static void fw_worker_exit(void *data)
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct fw_conn *conn;
+    struct flb_in_fw_config *ctx = data;
+
+    mk_list_foreach_safe(head, tmp, &ctx->connections) {
+        conn = mk_list_entry(head, struct fw_conn, _head);
+        fw_conn_del(conn);
+    }
+    flb_free(ctx);
+}
+
+static void fw_workers_destroy(struct flb_in_fw_config *ctx)
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct flb_input_worker *worker;
+
+    mk_list_foreach_safe(head, tmp, &ctx->worker_list) {
+        worker = mk_list_entry(head, struct flb_input_worker, _head);
+        mk_list_del(&worker->_head);
+        flb_input_worker_destroy(worker);
+    }
+}
+
+/*
+ * Start the listener workers: every worker binds the address on its own
+ * socket and reads the connections it accepts in its own thread.
+ */
+static int fw_workers_start(struct flb_in_fw_config *ctx)
+{
+    int i;
+    int ret;
+    struct flb_in_fw_config *w_ctx;
+    struct flb_input_worker *worker;
+
+    for (i = 0; i < ctx->workers; i++) {
+        worker = flb_input_worker_create(ctx->in, i,
+                                         ctx->listen, ctx->tcp_port);
+        if (!worker) {
+            return -1;
+        }
+        mk_list_add(&worker->_head, &ctx->worker_list);
+
+        w_ctx = flb_malloc(sizeof(struct flb_in_fw_config));
+        if (!w_ctx) {
+            flb_errno();
+            return -1;
+        }
+        memcpy(w_ctx, ctx, sizeof(struct flb_in_fw_config));
+        w_ctx->server_fd = worker->server_fd;
+        w_ctx->coll_id = -1;
+        w_ctx->paused = FLB_FALSE;
+        w_ctx->evl = worker->evl;
+        w_ctx->worker = worker;
+        mk_list_init(&w_ctx->connections);
+        mk_list_init(&w_ctx->worker_list);
+
+        ret = flb_input_worker_start(worker, w_ctx,
+                                     fw_worker_accept,
+                                     fw_worker_pause,
+                                     fw_worker_resume,
+                                     fw_worker_exit);
+        if (ret == -1) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
 /* Initialize plugin */
 static int in_fw_init(struct flb_input_instance *in,
                       struct flb_config *config, void *data)
@@ -105,11 +210,28 @@ static int in_fw_init(struct flb_input_instance *in,
         return -1;
     }
     ctx->in = in;
+    ctx->paused = FLB_FALSE;
     mk_list_init(&ctx->connections);
+    mk_list_init(&ctx->worker_list);
 
     /* Set the context */
     flb_input_set_context(in, ctx);
 
+    /* Listener workers, the engine thread does not listen */
+    if (ctx->workers > 0) {
+        ret = fw_workers_start(ctx);
+        if (ret == -1) {
+            flb_error("[in_fw] could not start workers on %s:%s",
+                      ctx->listen, ctx->tcp_port);
+            fw_workers_destroy(ctx);
+            fw_config_destroy(ctx);
+            return -1;
+        }
+        flb_info("[in_fw] binding %s:%s with %i workers",
+                 ctx->listen, ctx->tcp_port, ctx->workers);
+        return 0;
+    }
+
     /* Unix Socket mode */
     if (ctx->unix_path) {
         ret = fw_unix_create(ctx);
@@ -148,10 +270,60 @@ static int in_fw_init(struct flb_input_instance *in,
         fw_config_destroy(ctx);
         return -1;
     }
+    ctx->coll_id = ret;
 
     return 0;
 }
 
+static void in_fw_pause(void *data, struct flb_config *config)
+{
+    struct mk_list *head;
+    struct flb_input_worker *worker;
+    struct flb_in_fw_config *ctx = data;
+
+    if (ctx->paused == FLB_TRUE) {
+        return;
+    }
+
+    if (ctx->workers > 0) {
+        mk_list_foreach(head, &ctx->worker_list) {
+            worker = mk_list_entry(head, struct flb_input_worker, _head);
+            flb_input_worker_pause(worker);
+        }
+        ctx->paused = FLB_TRUE;
+        return;
+    }
+
+    /* Stop accepting and reading until the instance is resumed */
+    flb_input_collector_pause(ctx->coll_id, ctx->in);
+    fw_conn_pause_all(ctx);
+    ctx->paused = FLB_TRUE;
+}
+
+static void in_fw_resume(void *data, struct flb_config *config)
+{
+    struct mk_list *head;
+    struct flb_input_worker *worker;
+    struct flb_in_fw_config *ctx = data;
+
+    if (ctx->paused == FLB_FALSE) {
+        return;
+    }
+
+    if (ctx->workers > 0) {
+        ctx->paused = FLB_FALSE;
+        mk_list_foreach(head, &ctx->worker_list) {
+            worker = mk_list_entry(head, struct flb_input_worker, _head);
+            flb_input_worker_resume(worker);
+        }
+        return;
+    }
+
+    ctx->paused = FLB_FALSE;
+    fw_conn_resume_all(ctx);
+    flb_input_collector_resume(ctx->coll_id, ctx->in);
+}
+
 int in_fw_exit(void *data, struct flb_config *config)
 {
     struct mk_list *tmp;
@@ -160,6 +332,8 @@ int in_fw_exit(void *data, struct flb_config *config)
     struct flb_in_fw_config *ctx = data;
     struct fw_conn *conn;
 
+    fw_workers_destroy(ctx);
+
     mk_list_foreach_safe(head, tmp, &ctx->connections) {
         conn = mk_list_entry(head, struct fw_conn, _head);
         fw_conn_del(conn);
@@ -177,6 +351,8 @@ struct flb_input_plugin in_forward_plugin = {
     .cb_pre_run   = NULL,
     .cb_collect   = in_fw_collect,
     .cb_flush_buf = NULL,
+    .cb_pause     = in_fw_pause,
+    .cb_resume    = in_fw_resume,
     .cb_exit      = in_fw_exit,
     .flags        = FLB_INPUT_NET | FLB_INPUT_DYN_TAG
 };
@@ -22,9 +22,13 @@
 
 #include <msgpack.h>
 #include <fluent-bit/flb_input.h>
+#include <fluent-bit/flb_input_worker.h>
 
 struct flb_in_fw_config {
     int server_fd;               /* TCP server file descriptor  */
+    int coll_id;                 /* Server collector id         */
+    int paused;                  /* Connections are not read    */
+    int workers;                 /* Listener threads            */
     size_t buffer_max_size;      /* Max Buffer size             */
     size_t buffer_chunk_size;    /* Chunk allocation size       */
 
@@ -38,6 +42,13 @@ struct flb_in_fw_config {
     struct mk_list connections;    /* List of active connections */
     struct mk_event_loop *evl;     /* Event loop file descriptor */
     struct flb_input_instance *in; /* Input plugin instace       */
+
+    /*
+     * Listener workers. Each worker runs a copy of this context with its
+     * own event loop and connections, 'worker' is only set on the copies.
+     */
+    struct mk_list worker_list;
+    struct flb_input_worker *worker;
 };
 
 #endif
@@ -88,6 +88,19 @@ struct flb_in_fw_config *fw_config_init(struct flb_input_instance *i_ins)
         config->buffer_max_size  = flb_utils_size_to_bytes(buffer_size);
     }
 
+    /* Listener threads */
+    p = flb_input_get_property("workers", i_ins);
+    if (p) {
+        config->workers = atoi(p);
+        if (config->workers < 0) {
+            config->workers = 0;
+        }
+    }
+    if (config->workers > 0 && config->unix_path) {
+        flb_warn("[in_fw] workers are not supported with unix_path");
+        config->workers = 0;
+    }
+
     if (!config->unix_path) {
         flb_debug("[in_fw] Listen='%s' TCP_Port=%s",
                   config->listen, config->tcp_port);
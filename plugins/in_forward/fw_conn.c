@@ -21,10 +21,70 @@
 #include <fluent-bit/flb_engine.h>
 #include <fluent-bit/flb_network.h>
 
+#include <sys/socket.h>
+
 #include "fw.h"
 #include "fw_prot.h"
 #include "fw_conn.h"
 
+/*
+ * Read from a unix socket connection, the memory file descriptors that
+ * come along are queued for their markers.
+ */
+static int fw_conn_recv(struct fw_conn *conn, char *buf, int size)
+{
+    int i;
+    int n;
+    int fd;
+    int overflow = FLB_FALSE;
+    ssize_t bytes;
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * FW_CONN_FDS)];
+        struct cmsghdr align;
+    } ctl;
+
+    iov.iov_base = buf;
+    iov.iov_len = size;
+
+    memset(&msg, '\0', sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+
+    bytes = recvmsg(conn->fd, &msg, MSG_CMSG_CLOEXEC);
+    if (bytes <= 0) {
+        return bytes;
+    }
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (i = 0; i < n; i++) {
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            if (conn->fds_len == FW_CONN_FDS) {
+                close(fd);
+                overflow = FLB_TRUE;
+                continue;
+            }
+            conn->fds[conn->fds_len++] = fd;
+        }
+    }
+
+    /* A file without its place in the queue can't be matched anymore */
+    if (overflow == FLB_TRUE || (msg.msg_flags & MSG_CTRUNC)) {
+        flb_warn("[in_fw] fd=%i too many memory files pending", conn->fd);
+        return -1;
+    }
+
+    return bytes;
+}
+
 /* Callback invoked every time an event is triggered for a connection */
 int fw_conn_event(void *data)
 {
@@ -37,7 +97,22 @@ int fw_conn_event(void *data)
     struct fw_conn *conn = data;
     struct flb_in_fw_config *ctx = conn->ctx;
 
+    /* Stale event from a connection removed by a pause */
+    if (ctx->paused == FLB_TRUE) {
+        return 0;
+    }
+
     event = &conn->event;
+    if (event->mask & MK_EVENT_WRITE) {
+        /*
+         * Resumed with pending data in the buffer: process it and go back
+         * to wait for read events only.
+         */
+        mk_event_add(ctx->evl, conn->fd, FLB_ENGINE_EV_CUSTOM,
+                     MK_EVENT_READ, conn);
+        return fw_prot_process(conn);
+    }
+
     if (event->mask & MK_EVENT_READ) {
         available = (conn->buf_size - conn->buf_len);
         if (available < 1) {
@@ -62,8 +137,13 @@ int fw_conn_event(void *data)
             available = (conn->buf_size - conn->buf_len);
         }
 
-        bytes = read(conn->fd,
-                     conn->buf + conn->buf_len, available);
+        if (ctx->unix_path) {
+            bytes = fw_conn_recv(conn, conn->buf + conn->buf_len, available);
+        }
+        else {
+            bytes = read(conn->fd,
+                         conn->buf + conn->buf_len, available);
+        }
 
         if (bytes > 0) {
             flb_trace("[in_fw] read()=%i pre_len=%i now_len=%i",
@@ -114,8 +194,8 @@ struct fw_conn *fw_conn_add(int fd, struct flb_in_fw_config *ctx)
     conn->fd      = fd;
     conn->ctx     = ctx;
     conn->buf_len = 0;
-    conn->rest    = 0;
     conn->status  = FW_NEW;
+    conn->fds_len = 0;
 
     /* Allocate read buffer */
     conn->buf = flb_malloc(ctx->buffer_chunk_size);
@@ -143,14 +223,63 @@ struct fw_conn *fw_conn_add(int fd, struct flb_in_fw_config *ctx)
     return conn;
 }
 
+/*
+ * Stop reading from the connections: data queued by the senders stays in
+ * the kernel socket buffers and the TCP window pushes back on them.
+ */
+int fw_conn_pause_all(struct flb_in_fw_config *ctx)
+{
+    struct mk_list *head;
+    struct fw_conn *conn;
+
+    mk_list_foreach(head, &ctx->connections) {
+        conn = mk_list_entry(head, struct fw_conn, _head);
+        mk_event_del(ctx->evl, &conn->event);
+    }
+
+    return 0;
+}
+
+/* Register the connections back, the ones with pending data get processed */
+int fw_conn_resume_all(struct flb_in_fw_config *ctx)
+{
+    int ret;
+    int mask;
+    struct mk_list *head;
+    struct fw_conn *conn;
+
+    mk_list_foreach(head, &ctx->connections) {
+        conn = mk_list_entry(head, struct fw_conn, _head);
+
+        mask = MK_EVENT_READ;
+        if (conn->buf_len > 0) {
+            mask |= MK_EVENT_WRITE;
+        }
+
+        ret = mk_event_add(ctx->evl, conn->fd, FLB_ENGINE_EV_CUSTOM,
+                           mask, conn);
+        if (ret == -1) {
+            flb_error("[in_fw] fd=%i could not resume connection",
+                      conn->fd);
+        }
+    }
+
+    return 0;
+}
+
 int fw_conn_del(struct fw_conn *conn)
 {
+    int i;
+
     /* Unregister the file descriptior from the event-loop */
     mk_event_del(conn->ctx->evl, &conn->event);
 
     /* Release resources */
     mk_list_del(&conn->_head);
     close(conn->fd);
+    for (i = 0; i < conn->fds_len; i++) {
+        close(conn->fds[i]);
+    }
     flb_free(conn->buf);
     flb_free(conn);
 
@@ -22,6 +22,14 @@
 
 #define FLB_IN_FW_CHUNK 32768
 
+/*
+ * Unix socket connections: a message can come in a memory file, the
+ * stream has this marker byte with the file descriptor attached. It's
+ * FLB_FORWARD_MEMFD_MARK of out_forward.
+ */
+#define FW_MEMFD_MARK   0xc1
+#define FW_CONN_FDS     16
+
 enum {
     FW_NEW        = 1,  /* it's a new connection                */
     FW_CONNECTED  = 2,  /* MQTT connection per protocol spec OK */
@@ -42,7 +50,10 @@ struct fw_conn {
     char *buf;                       /* Buffer data                       */
     int  buf_len;                    /* Data length                       */
     int  buf_size;                   /* Buffer size                       */
-    size_t rest;                     /* Unpacking offset                  */
+
+    /* Memory files received, in the order of their markers */
+    int fds[FW_CONN_FDS];
+    int fds_len;
 
     struct flb_input_instance *in;   /* Parent plugin instance            */
     struct flb_in_fw_config *ctx;    /* Plugin configuration context      */
@@ -52,5 +63,7 @@ struct fw_conn {
 
 struct fw_conn *fw_conn_add(int fd, struct flb_in_fw_config *ctx);
 int fw_conn_del(struct fw_conn *conn);
+int fw_conn_pause_all(struct flb_in_fw_config *ctx);
+int fw_conn_resume_all(struct flb_in_fw_config *ctx);
 
 #endif
@@ -17,268 +17,529 @@
  *  limitations under the License.
  */
 
+#define _GNU_SOURCE
+
 #include <msgpack.h>
 
 #include <fluent-bit/flb_input.h>
 #include <fluent-bit/flb_config.h>
+#include <fluent-bit/flb_mp.h>
 #include <fluent-bit/flb_pack.h>
 #include <fluent-bit/flb_utils.h>
+#include <fluent-bit/flb_gzip.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "fw.h"
 #include "fw_prot.h"
 #include "fw_conn.h"
 
-/* Try parsing rounds up-to 32 bytes */
-#define EACH_RECV_SIZE 32
+/* Message mode records up to this size are composed on the stack */
+#define FW_RECORD_STACK 1024
 
-static int fw_process_array(struct flb_input_instance *in,
-                            char *tag, int tag_len,
-                            msgpack_object *arr)
+/* Connections of a listener worker hand their records to the engine */
+static inline int fw_append(struct fw_conn *conn, char *tag, int tag_len,
+                            char *buf, size_t size, int records)
 {
-    int i;
-    msgpack_object entry;
-
-    for (i = 0; i < arr->via.array.size; i++) {
-        entry = arr->via.array.ptr[i];
-        flb_input_dyntag_append_obj(in, tag, tag_len, entry);
+    if (conn->ctx->worker) {
+        return flb_input_worker_append(conn->ctx->worker, tag, tag_len,
+                                       buf, size, records);
     }
 
-    return i;
+    return flb_input_dyntag_append_records(conn->in, tag, tag_len,
+                                           buf, size, records);
 }
 
-static size_t receiver_recv(struct fw_conn *conn, char *buf, size_t try_size) {
-    size_t off;
-    size_t actual_size;
+static inline int fw_paused(struct fw_conn *conn)
+{
+    if (conn->ctx->worker) {
+        return conn->ctx->paused;
+    }
 
-    off = conn->buf_len - conn->rest;
-    actual_size = try_size;
+    return flb_input_buf_paused(conn->in);
+}
 
-    if (actual_size > conn->rest) {
-        actual_size = conn->rest;
-    }
+/* Event time: a positive integer, a float or an extension (EventTime) */
+static inline int fw_is_time(unsigned char c)
+{
+    return (c <= 0x7f || (c >= 0xcc && c <= 0xcf) ||
+            c == 0xca || c == 0xcb ||
+            (c >= 0xc7 && c <= 0xc9) || (c >= 0xd4 && c <= 0xd8));
+}
 
-    memcpy(buf, conn->buf + off, actual_size);
-    conn->rest -= actual_size;
+static inline int fw_is_array(unsigned char c)
+{
+    return ((c & 0xf0) == 0x90 || c == 0xdc || c == 0xdd);
+}
 
-    return actual_size;
+static inline int fw_is_str_bin(unsigned char c)
+{
+    return ((c & 0xe0) == 0xa0 || (c >= 0xd9 && c <= 0xdb) ||
+            (c >= 0xc4 && c <= 0xc6));
 }
 
-static size_t receiver_to_unpacker(struct fw_conn *conn, size_t request_size,
-                                   msgpack_unpacker *unpacker)
+/*
+ * Check that a buffer is a sequence of [time, map] entries without
+ * unpacking it. Scanning stops at an incomplete entry, 'consumed' is set
+ * to the bytes of the complete ones. Returns their number or -1.
+ */
+static int fw_entries_scan(char *buf, size_t size, size_t *consumed)
 {
-    size_t recv_len;
+    int records = 0;
+    uint32_t count;
+    size_t off = 0;
+    size_t end;
+    size_t hdr;
+    size_t len;
+
+    while (off < size) {
+        if (flb_mp_object_size(buf + off, size - off, &len) == -1) {
+            break;
+        }
+        end = off + len;
+
+        if (flb_mp_array_header(buf + off, end - off, &count, &hdr) == -1 ||
+            count != 2) {
+            return -1;
+        }
+        off += hdr;
 
-    /* make sure there's enough room, or expand the unpacker accordingly */
-    if (msgpack_unpacker_buffer_capacity(unpacker) < request_size) {
-        msgpack_unpacker_reserve_buffer(unpacker, request_size);
-        assert(msgpack_unpacker_buffer_capacity(unpacker) >= request_size);
+        /* time */
+        if (off >= end || !fw_is_time((unsigned char) buf[off]) ||
+            flb_mp_object_size(buf + off, end - off, &len) == -1) {
+            return -1;
+        }
+        off += len;
+
+        /* record */
+        if (flb_mp_map_header(buf + off, end - off, &count, &hdr) == -1 ||
+            flb_mp_object_size(buf + off, end - off, &len) == -1 ||
+            off + len != end) {
+            return -1;
+        }
+        off = end;
+        records++;
     }
-    recv_len = receiver_recv(conn, msgpack_unpacker_buffer(unpacker),
-                             request_size);
-    msgpack_unpacker_buffer_consumed(unpacker, recv_len);
 
-    return recv_len;
+    *consumed = off;
+    return records;
 }
 
-int fw_prot_process(struct fw_conn *conn)
+/* All the buffer must be made of complete entries */
+static int fw_entries_check(char *buf, size_t size)
 {
-    int ret;
-    int stag_len;
-    int c = 0;
-    char *stag;
-    size_t bytes;
-    size_t buf_off = 0;
-    size_t recv_len;
-    msgpack_object tag;
-    msgpack_object entry;
-    msgpack_object map;
-    msgpack_object root;
-    msgpack_unpacked result;
-    msgpack_unpacker *unp;
-    size_t all_used = 0;
-
-    /*
-     * [tag, time, record]
-     * [tag, [[time,record], [time,record], ...]]
-     */
-
-    unp = msgpack_unpacker_new(1024);
-    msgpack_unpacked_init(&result);
-    conn->rest = conn->buf_len;
+    int records;
+    size_t consumed;
 
-    while (1) {
-        recv_len = receiver_to_unpacker(conn, EACH_RECV_SIZE, unp);
-        if (recv_len == 0) {
-            /* No more data */
-            msgpack_unpacker_free(unp);
-            msgpack_unpacked_destroy(&result);
-
-            /* Adjust buffer data */
-            if (all_used > 0) {
-                memmove(conn->buf, conn->buf + all_used,
-                        conn->buf_len - all_used);
-                conn->buf_len -= all_used;
-            }
+    records = fw_entries_scan(buf, size, &consumed);
+    if (records == -1 || consumed != size) {
+        return -1;
+    }
 
-            return 0;
-        }
+    return records;
+}
+
+/*
+ * Look for the 'compressed' option of a PackedForward message, returns
+ * FLB_TRUE for gzip, FLB_FALSE if not set or 'text', -1 otherwise.
+ */
+static int fw_option_gzip(char *p, char *end)
+{
+    uint32_t i;
+    uint32_t count;
+    uint32_t key_len;
+    uint32_t val_len;
+    size_t hdr;
+    size_t len;
+    const char *key;
+    const char *val;
+
+    if (flb_mp_map_header(p, end - p, &count, &hdr) == -1) {
+        return FLB_FALSE;
+    }
+    p += hdr;
 
-        /* Always summarize the total number of bytes requested to parse */
-        buf_off += recv_len;
-
-        ret = msgpack_unpacker_next_with_size(unp, &result, &bytes);
-        while (ret == MSGPACK_UNPACK_SUCCESS) {
-            /*
-             * For buffering optimization we always want to know the total
-             * number of bytes involved on the new object returned. Despites
-             * buf_off always know the given bytes, it's likely we used a bit
-             * less. This 'all_used' field keep a reference per object so
-             * when returning to the caller we can adjust the source buffer
-             * and deprecated consumed data.
-             *
-             * The 'last_parsed' field is Fluent Bit specific and is documented
-             * in:
-             *
-             *  lib/msgpack-c/include/msgpack/unpack.h
-             *
-             * Other references:
-             *
-             *  https://github.com/msgpack/msgpack-c/issues/514
-             */
-            all_used += bytes;
-
-
-            /* Map the array */
-            root = result.data;
-
-            if (root.type != MSGPACK_OBJECT_ARRAY) {
-                flb_debug("[in_fw] parser: expecting an array (type=%i), skip.",
-                          root.type);
-                msgpack_unpacked_destroy(&result);
-                msgpack_unpacker_free(unp);
+    for (i = 0; i < count; i++) {
+        if (flb_mp_str(p, end - p, &key, &key_len, &len) == -1) {
+            /* not a string key, skip the pair */
+            if (flb_mp_object_size(p, end - p, &len) == -1) {
                 return -1;
             }
-
-            if (root.via.array.size < 2) {
-                flb_debug("[in_fw] parser: array of invalid size, skip.");
-                msgpack_unpacked_destroy(&result);
-                msgpack_unpacker_free(unp);
+            p += len;
+            if (flb_mp_object_size(p, end - p, &len) == -1) {
                 return -1;
             }
+            p += len;
+            continue;
+        }
+        p += len;
 
-            /* Get the tag */
-            tag = root.via.array.ptr[0];
-            if (tag.type != MSGPACK_OBJECT_STR) {
-                flb_debug("[in_fw] parser: invalid tag format, skip.");
-                msgpack_unpacked_destroy(&result);
-                msgpack_unpacker_free(unp);
+        if (key_len == 10 && strncmp(key, "compressed", 10) == 0) {
+            if (flb_mp_str(p, end - p, &val, &val_len, &len) == -1) {
                 return -1;
             }
+            if (val_len == 4 && strncmp(val, "gzip", 4) == 0) {
+                return FLB_TRUE;
+            }
+            if (val_len == 4 && strncmp(val, "text", 4) == 0) {
+                return FLB_FALSE;
+            }
+            flb_warn("[in_fw] unsupported compression '%.*s'",
+                     (int) val_len, val);
+            return -1;
+        }
+
+        if (flb_mp_object_size(p, end - p, &len) == -1) {
+            return -1;
+        }
+        p += len;
+    }
+
+    return FLB_FALSE;
+}
+
+/*
+ * CompressedPackedForward: the entries are inflated a piece at a time into
+ * a buffer of the connection chunk size and the complete ones are appended
+ * as they show up. The buffer only grows, up to the connection maximum
+ * size, when a single entry does not fit in it.
+ */
+static int fw_process_gzip(struct fw_conn *conn, char *tag, uint32_t tag_len,
+                           char *data, size_t len)
+{
+    int ret = 0;
+    int records;
+    char *buf;
+    char *tmp;
+    size_t size;
+    size_t used = 0;
+    size_t out_len;
+    size_t consumed;
+    struct flb_gunzip gz;
+    struct flb_in_fw_config *ctx = conn->ctx;
+
+    size = ctx->buffer_chunk_size;
+    buf = flb_malloc(size);
+    if (!buf) {
+        flb_errno();
+        return -1;
+    }
+    flb_gunzip_init(&gz, data, len);
 
-            stag     = (char *) tag.via.str.ptr;
-            stag_len = tag.via.str.size;
+    while (1) {
+        if (flb_gunzip_read(&gz, buf + used, size - used, &out_len) == -1) {
+            flb_warn("[in_fw] invalid gzip data in PackedForward message");
+            ret = -1;
+            break;
+        }
+        used += out_len;
 
-            entry = root.via.array.ptr[1];
-            if (entry.type == MSGPACK_OBJECT_ARRAY) {
-                /* Forward format 1: [tag, [[time, map], ...]] */
-                fw_process_array(conn->in, stag, stag_len, &entry);
+        records = fw_entries_scan(buf, used, &consumed);
+        if (records == -1) {
+            flb_warn("[in_fw] invalid entries in PackedForward message");
+            ret = -1;
+            break;
+        }
+        if (records > 0) {
+            fw_append(conn, tag, tag_len, buf, consumed, records);
+            memmove(buf, buf + consumed, used - consumed);
+            used -= consumed;
+        }
+
+        /* End of the compressed data */
+        if (out_len == 0 && used < size) {
+            if (used > 0) {
+                flb_warn("[in_fw] incomplete entry in PackedForward message");
+                ret = -1;
+            }
+            break;
+        }
+
+        if (used == size) {
+            if (size >= ctx->buffer_max_size) {
+                flb_warn("[in_fw] PackedForward entry exceeds "
+                         "buffer_max_size, skip.");
+                ret = -1;
+                break;
+            }
+            size *= 2;
+            if (size > ctx->buffer_max_size) {
+                size = ctx->buffer_max_size;
+            }
+            tmp = flb_realloc(buf, size);
+            if (!tmp) {
+                flb_errno();
+                ret = -1;
+                break;
             }
-            else if (entry.type == MSGPACK_OBJECT_POSITIVE_INTEGER ||
-                     entry.type == MSGPACK_OBJECT_EXT) {
-
-                /* Forward format 2: [tag, time, map] */
-                map = root.via.array.ptr[2];
-                if (map.type != MSGPACK_OBJECT_MAP) {
-                    flb_warn("[in_fw] invalid data format, map expected");
-                    msgpack_unpacked_destroy(&result);
-                    msgpack_unpacker_free(unp);
-                    return -1;
-                }
-
-                /* Compose the new array */
-                struct msgpack_sbuffer mp_sbuf;
-                struct msgpack_packer mp_pck;
-                msgpack_unpacked r_out;
-                size_t off = 0;
-
-                msgpack_sbuffer_init(&mp_sbuf);
-                msgpack_packer_init(&mp_pck, &mp_sbuf, msgpack_sbuffer_write);
-
-                msgpack_pack_array(&mp_pck, 2);
-                msgpack_pack_object(&mp_pck, entry);
-                msgpack_pack_object(&mp_pck, map);
-
-                /* sbuffer to msgpack object */
-                msgpack_unpacked_init(&r_out);
-                ret = msgpack_unpack_next(&r_out,
-                                          mp_sbuf.data,
-                                          mp_sbuf.size,
-                                          &off);
-                if (ret != MSGPACK_UNPACK_SUCCESS) {
-                    msgpack_unpacked_destroy(&result);
-                    msgpack_unpacker_free(unp);
-                    return -1;
-                }
-
-                /* Register data object */
-                entry = r_out.data;
-                flb_input_dyntag_append_obj(conn->in,
-                                            stag, stag_len,
-                                            entry);
-
-                msgpack_unpacked_destroy(&r_out);
-                msgpack_sbuffer_destroy(&mp_sbuf);
-                c++;
+            buf = tmp;
+        }
+    }
+
+    flb_gunzip_destroy(&gz);
+    flb_free(buf);
+
+    return ret;
+}
+
+/*
+ * Process one message, the entries are appended to the tag buffer as they
+ * came in the message when possible:
+ *
+ *   Message:        [tag, time, record, (option)]
+ *   Forward:        [tag, [[time, record], ...], (option)]
+ *   PackedForward:  [tag, "[time, record]...", (option)]
+ */
+static int fw_process_message(struct fw_conn *conn, char *msg, size_t size)
+{
+    int ret;
+    int records;
+    char *tag;
+    char *data;
+    char *end = msg + size;
+    char *p;
+    char stack[FW_RECORD_STACK];
+    uint32_t tag_len;
+    uint32_t count;
+    uint32_t len;
+    size_t hdr;
+    size_t t_size;
+    size_t m_size;
+    size_t obj_size;
+    unsigned char c;
+
+    if (flb_mp_array_header(msg, size, &count, &hdr) == -1) {
+        flb_debug("[in_fw] parser: expecting an array, skip.");
+        return -1;
+    }
+    if (count < 2) {
+        flb_debug("[in_fw] parser: array of invalid size, skip.");
+        return -1;
+    }
+    p = msg + hdr;
+
+    /* Get the tag */
+    if (flb_mp_str(p, end - p, (const char **) &tag, &tag_len,
+                   &obj_size) == -1) {
+        flb_debug("[in_fw] parser: invalid tag format, skip.");
+        return -1;
+    }
+    p += obj_size;
+
+    c = (unsigned char) *p;
+    if (fw_is_array(c)) {
+        /* Forward: the entries are contiguous after the array header */
+        if (flb_mp_array_header(p, end - p, &count, &hdr) == -1 ||
+            flb_mp_object_size(p, end - p, &obj_size) == -1) {
+            return -1;
+        }
+        data = p + hdr;
+        len = obj_size - hdr;
+        records = fw_entries_check(data, len);
+        if (records != count) {
+            flb_warn("[in_fw] invalid entries in Forward message");
+            return -1;
+        }
+    }
+    else if (fw_is_str_bin(c)) {
+        /* PackedForward: the entries are the string body */
+        if (flb_mp_key(p, end - p, (const char **) &data, &len,
+                       &obj_size) == -1) {
+            return -1;
+        }
+        p += obj_size;
+
+        if (count >= 3) {
+            ret = fw_option_gzip(p, end);
+            if (ret == -1) {
+                return -1;
             }
-            else if (entry.type == MSGPACK_OBJECT_STR ||
-                     entry.type == MSGPACK_OBJECT_BIN) {
-                /* PackedForward Mode */
-                char *data = NULL;
-                size_t len = 0;
-
-                if (entry.type == MSGPACK_OBJECT_STR) {
-                    data = (char *) entry.via.str.ptr;
-                    len = entry.via.str.size;
-                }
-                else if (entry.type == MSGPACK_OBJECT_BIN) {
-                    data = (char *) entry.via.bin.ptr;
-                    len = entry.via.bin.size;
-                }
-
-                if (data) {
-                    flb_input_dyntag_append_raw(conn->in,
-                                                stag, stag_len,
-                                                data, len);
-                }
+            if (ret == FLB_TRUE) {
+                return fw_process_gzip(conn, tag, tag_len, data, len);
             }
-            else {
-                flb_warn("[in_fw] invalid data format, type=%i",
-                         entry.type);
-                msgpack_unpacked_destroy(&result);
-                msgpack_unpacker_free(unp);
+        }
+
+        records = fw_entries_check(data, len);
+        if (records == -1) {
+            flb_warn("[in_fw] invalid entries in PackedForward message");
+            return -1;
+        }
+    }
+    else if (fw_is_time(c)) {
+        /* Message: compose [time, record] from the raw objects */
+        if (count < 3 ||
+            flb_mp_object_size(p, end - p, &t_size) == -1 ||
+            flb_mp_map_header(p + t_size, end - p - t_size,
+                              &count, &hdr) == -1 ||
+            flb_mp_object_size(p + t_size, end - p - t_size,
+                               &m_size) == -1) {
+            flb_warn("[in_fw] invalid data format, map expected");
+            return -1;
+        }
+
+        len = 1 + t_size + m_size;
+        data = stack;
+        if (len > sizeof(stack)) {
+            data = flb_malloc(len);
+            if (!data) {
+                flb_errno();
                 return -1;
             }
+        }
+        data[0] = (char) 0x92;
+        memcpy(data + 1, p, t_size + m_size);
 
-            ret = msgpack_unpacker_next(unp, &result);
+        ret = fw_append(conn, tag, tag_len, data, len, 1);
+        if (data != stack) {
+            flb_free(data);
         }
+        return ret;
+    }
+    else {
+        flb_warn("[in_fw] invalid data format, type=%i", c);
+        return -1;
+    }
+
+    if (len == 0) {
+        return 0;
     }
-    msgpack_unpacked_destroy(&result);
-    msgpack_unpacker_free(unp);
 
-    switch (ret) {
-    case MSGPACK_UNPACK_EXTRA_BYTES:
-        flb_error("[in_fw] MSGPACK_UNPACK_EXTRA_BYTES");
+    return fw_append(conn, tag, tag_len, data, len, records);
+}
+
+/*
+ * A message handed over by out_forward in a sealed memory file: the file
+ * is mapped and its entries are appended from there.
+ */
+static int fw_process_memfd(struct fw_conn *conn)
+{
+    int fd;
+    int ret = 0;
+    char *map;
+    size_t off = 0;
+    size_t len;
+    size_t size;
+    struct stat st;
+
+    if (conn->fds_len == 0) {
+        flb_warn("[in_fw] memory file marker without a file, skip.");
         return -1;
-    case MSGPACK_UNPACK_CONTINUE:
-        flb_trace("[in_fw] MSGPACK_UNPACK_CONTINUE");
-        return 1;
-    case MSGPACK_UNPACK_PARSE_ERROR:
-        flb_debug("[in_fw] err=MSGPACK_UNPACK_PARSE_ERROR");
+    }
+    fd = conn->fds[0];
+    conn->fds_len--;
+    memmove(conn->fds, conn->fds + 1, conn->fds_len * sizeof(int));
+
+#ifdef F_GET_SEALS
+    /* A file that can shrink while mapped would fault the reader */
+    ret = fcntl(fd, F_GET_SEALS);
+    if (ret == -1 || !(ret & F_SEAL_SHRINK)) {
+        flb_warn("[in_fw] memory file is not sealed, skip.");
+        close(fd);
         return -1;
-    case MSGPACK_UNPACK_NOMEM_ERROR:
-        flb_error("[in_fw] err=MSGPACK_UNPACK_NOMEM_ERROR");
+    }
+    ret = 0;
+#endif
+
+    if (fstat(fd, &st) == -1) {
+        flb_errno();
+        close(fd);
+        return -1;
+    }
+    size = st.st_size;
+    if (size == 0 || size > conn->ctx->buffer_max_size) {
+        flb_warn("[in_fw] fd=%i memory file of %zu bytes exceeds limit "
+                 "(%zu bytes), skip.", conn->fd, size,
+                 conn->ctx->buffer_max_size);
+        close(fd);
         return -1;
-    };
+    }
+
+    map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        flb_errno();
+        return -1;
+    }
+
+    while (off < size) {
+        if (!fw_is_array((unsigned char) map[off]) ||
+            flb_mp_object_size(map + off, size - off, &len) == -1) {
+            flb_warn("[in_fw] invalid message in memory file, skip.");
+            ret = -1;
+            break;
+        }
+        if (fw_process_message(conn, map + off, len) == -1) {
+            ret = -1;
+        }
+        off += len;
+    }
+    munmap(map, size);
+
+    return ret;
+}
+
+/*
+ * Process the complete messages in the connection buffer. Messages are
+ * located and validated with a light scan of the msgpack headers and
+ * their entries are appended as raw bytes, they are not unpacked and
+ * packed again. An incomplete message waits in the buffer for more data.
+ */
+int fw_prot_process(struct fw_conn *conn)
+{
+    int ret = 0;
+    size_t off = 0;
+    size_t size;
+
+    while (off < conn->buf_len) {
+        /*
+         * The instance was paused while processing the previous message:
+         * keep the remaining data in the connection buffer, it will be
+         * processed once the input is resumed.
+         */
+        if (fw_paused(conn) == FLB_TRUE) {
+            break;
+        }
+
+        /* The message is in a memory file */
+        if ((unsigned char) conn->buf[off] == FW_MEMFD_MARK &&
+            conn->ctx->unix_path) {
+            if (fw_process_memfd(conn) == -1) {
+                ret = -1;
+            }
+            off++;
+            continue;
+        }
+
+        /* Without framing there is no way to find the next message */
+        if (!fw_is_array((unsigned char) conn->buf[off])) {
+            flb_debug("[in_fw] parser: expecting an array (type=%i), skip.",
+                      (unsigned char) conn->buf[off]);
+            off = conn->buf_len;
+            ret = -1;
+            break;
+        }
+
+        /* Incomplete message */
+        if (flb_mp_object_size(conn->buf + off, conn->buf_len - off,
+                               &size) == -1) {
+            break;
+        }
+
+        /* An invalid message is skipped */
+        if (fw_process_message(conn, conn->buf + off, size) == -1) {
+            ret = -1;
+        }
+        off += size;
+    }
+
+    /* Adjust buffer data */
+    if (off > 0) {
+        memmove(conn->buf, conn->buf + off, conn->buf_len - off);
+        conn->buf_len -= off;
+    }
 
-    return 0;
+    return ret;
 }
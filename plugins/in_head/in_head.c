@@ -153,7 +153,6 @@ static int single_value_per_record(struct flb_input_instance *i_ins,
     ret = 0;
 
     flb_input_buf_write_end(i_ins);
-    flb_stats_update(in_head_plugin.stats_fd, 0, 1);
 
     return ret;
 
@@ -220,7 +219,6 @@ static int split_lines_per_record(struct flb_input_instance *i_ins,
     }
 
     flb_input_buf_write_end(i_ins);
-    flb_stats_update(in_head_plugin.stats_fd, 0, 1);
 
     fclose(fp);
     return 0;
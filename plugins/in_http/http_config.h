@@ -17,9 +17,12 @@
  *  limitations under the License.
  */
 
-#ifndef FLB_IN_HTTP_INFO_H
-#define FLB_IN_HTTP_INFO_H
+#ifndef FLB_IN_HTTP_CONFIG_H
+#define FLB_IN_HTTP_CONFIG_H
 
-#define FLB_HTTP_CONF_PATH  "@IN_HTTP_CONF_PATH@"
+#include "in_http.h"
+
+struct flb_in_http_config *http_config_init(struct flb_input_instance *i_ins);
+int http_config_destroy(struct flb_in_http_config *config);
 
 #endif
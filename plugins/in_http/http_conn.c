@@ -0,0 +1,167 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_engine.h>
+#include <fluent-bit/flb_network.h>
+
+#include "in_http.h"
+#include "http_conn.h"
+#include "http_prot.h"
+
+/* Callback invoked every time an event is triggered for a connection */
+int http_conn_event(void *data)
+{
+    int ret;
+    int bytes;
+    int available;
+    int size;
+    char *tmp;
+    struct mk_event *event;
+    struct http_conn *conn = data;
+    struct flb_in_http_config *ctx = conn->ctx;
+
+    event = &conn->event;
+    if (event->mask & MK_EVENT_READ) {
+        available = (conn->buf_size - conn->buf_len);
+        if (available < 1) {
+            if (conn->buf_size >= ctx->buffer_max_size) {
+                flb_debug("[in_http] fd=%i request exceeds buffer_max_size "
+                          "(%lu KB)", event->fd, ctx->buffer_max_size / 1024);
+                http_prot_respond(conn, 413, FLB_FALSE);
+                http_conn_del(conn);
+                return -1;
+            }
+
+            size = conn->buf_size + ctx->buffer_chunk_size;
+            if (size > ctx->buffer_max_size) {
+                size = ctx->buffer_max_size;
+            }
+            tmp = flb_realloc(conn->buf_data, size);
+            if (!tmp) {
+                flb_errno();
+                return -1;
+            }
+            flb_trace("[in_http] fd=%i buffer realloc %i -> %i",
+                      event->fd, conn->buf_size, size);
+
+            conn->buf_data = tmp;
+            conn->buf_size = size;
+            available = (conn->buf_size - conn->buf_len);
+        }
+
+        /* Read data */
+        bytes = read(conn->fd,
+                     conn->buf_data + conn->buf_len, available);
+        if (bytes <= 0) {
+            flb_trace("[in_http] fd=%i closed connection", event->fd);
+            http_conn_del(conn);
+            return -1;
+        }
+        conn->buf_len += bytes;
+
+        /* Complete requests are answered, the connection may be closed */
+        ret = http_prot_handle(conn);
+        if (ret == -1) {
+            http_conn_del(conn);
+            return -1;
+        }
+        return bytes;
+    }
+
+    if (event->mask & MK_EVENT_CLOSE) {
+        flb_trace("[in_http] fd=%i hangup", event->fd);
+        http_conn_del(conn);
+        return -1;
+    }
+    return 0;
+}
+
+struct http_conn *http_conn_add(int fd, struct flb_in_http_config *ctx)
+{
+    int ret;
+    struct http_conn *conn;
+    struct mk_event *event;
+
+    conn = flb_calloc(1, sizeof(struct http_conn));
+    if (!conn) {
+        flb_errno();
+        close(fd);
+        return NULL;
+    }
+
+    /* Set data for the event-loop */
+    event = &conn->event;
+    MK_EVENT_NEW(event);
+    event->fd           = fd;
+    event->type         = FLB_ENGINE_EV_CUSTOM;
+    event->handler      = http_conn_event;
+
+    /* Connection info */
+    conn->fd  = fd;
+    conn->ctx = ctx;
+    conn->in  = ctx->in;
+
+    conn->buf_data = flb_malloc(ctx->buffer_chunk_size);
+    if (!conn->buf_data) {
+        flb_errno();
+        flb_error("[in_http] could not allocate new connection");
+        close(fd);
+        flb_free(conn);
+        return NULL;
+    }
+    conn->buf_size = ctx->buffer_chunk_size;
+
+    msgpack_sbuffer_init(&conn->mp_sbuf);
+    msgpack_packer_init(&conn->mp_pck, &conn->mp_sbuf, msgpack_sbuffer_write);
+
+    /* Register instance into the event loop */
+    ret = mk_event_add(ctx->evl, fd, FLB_ENGINE_EV_CUSTOM, MK_EVENT_READ, conn);
+    if (ret == -1) {
+        flb_error("[in_http] could not register new connection");
+        close(fd);
+        msgpack_sbuffer_destroy(&conn->mp_sbuf);
+        flb_free(conn->buf_data);
+        flb_free(conn);
+        return NULL;
+    }
+
+    mk_list_add(&conn->_head, &ctx->connections);
+
+    return conn;
+}
+
+int http_conn_del(struct http_conn *conn)
+{
+    struct flb_in_http_config *ctx;
+
+    ctx = conn->ctx;
+
+    /* Unregister the file descriptior from the event-loop */
+    mk_event_del(ctx->evl, &conn->event);
+
+    /* Release resources */
+    mk_list_del(&conn->_head);
+    close(conn->fd);
+    msgpack_sbuffer_destroy(&conn->mp_sbuf);
+    flb_free(conn->buf_data);
+    flb_free(conn);
+
+    return 0;
+}
@@ -0,0 +1,52 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef FLB_IN_HTTP_CONN_H
+#define FLB_IN_HTTP_CONN_H
+
+#include <msgpack.h>
+#include <fluent-bit/flb_input.h>
+
+#include "in_http.h"
+
+/* Respresents a client connection, requests can be pipelined on it */
+struct http_conn {
+    struct mk_event event;            /* Built-in event data for mk_events */
+    int fd;                           /* Socket file descriptor            */
+    int continued;                    /* '100 Continue' sent for request   */
+
+    /* Buffer */
+    char *buf_data;                   /* Buffer data                       */
+    int  buf_len;                     /* Data length                       */
+    int  buf_size;                    /* Buffer size                       */
+
+    struct flb_input_instance *in;    /* Parent plugin instance            */
+    struct flb_in_http_config *ctx;   /* Plugin configuration context      */
+
+    /* Records of a listener worker, handed to the engine thread */
+    msgpack_sbuffer mp_sbuf;
+    msgpack_packer mp_pck;
+
+    struct mk_list _head;
+};
+
+struct http_conn *http_conn_add(int fd, struct flb_in_http_config *ctx);
+int http_conn_del(struct http_conn *conn);
+
+#endif
@@ -0,0 +1,941 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <ctype.h>
+#include <strings.h>
+#include <msgpack.h>
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_input.h>
+#include <fluent-bit/flb_mp.h>
+#include <fluent-bit/flb_time.h>
+#include <fluent-bit/flb_json.h>
+#include <fluent-bit/flb_lines.h>
+#include <fluent-bit/flb_gzip.h>
+
+#include "in_http.h"
+#include "http_conn.h"
+#include "http_prot.h"
+
+/* Line breaks located per scan in NDJSON bodies */
+#define HTTP_LINES 256
+
+static inline int token_eq(char *str, size_t len, char *lit)
+{
+    size_t n = strlen(lit);
+
+    return (len == n && strncasecmp(str, lit, n) == 0);
+}
+
+static inline int hex_value(int c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    return (tolower(c) - 'a') + 10;
+}
+
+static char *status_text(int status)
+{
+    switch (status) {
+    case 100:
+        return "Continue";
+    case 201:
+        return "Created";
+    case 400:
+        return "Bad Request";
+    case 405:
+        return "Method Not Allowed";
+    case 411:
+        return "Length Required";
+    case 413:
+        return "Payload Too Large";
+    case 415:
+        return "Unsupported Media Type";
+    case 429:
+        return "Too Many Requests";
+    case 501:
+        return "Not Implemented";
+    case 505:
+        return "HTTP Version Not Supported";
+    }
+    return "Internal Server Error";
+}
+
+static int body_format(char *val, size_t len)
+{
+    char *p;
+
+    /* media type parameters, e.g: 'charset=utf-8', are ignored */
+    p = memchr(val, ';', len);
+    if (p) {
+        len = p - val;
+    }
+    while (len > 0 && (val[len - 1] == ' ' || val[len - 1] == '\t')) {
+        len--;
+    }
+
+    if (token_eq(val, len, "application/json")) {
+        return HTTP_BODY_JSON;
+    }
+    else if (token_eq(val, len, "application/x-ndjson") ||
+             token_eq(val, len, "application/ndjson") ||
+             token_eq(val, len, "application/jsonlines") ||
+             token_eq(val, len, "application/x-jsonlines")) {
+        return HTTP_BODY_NDJSON;
+    }
+    else if (token_eq(val, len, "application/msgpack") ||
+             token_eq(val, len, "application/x-msgpack")) {
+        return HTTP_BODY_MSGPACK;
+    }
+
+    return HTTP_BODY_UNKNOWN;
+}
+
+static int parse_request_line(char *line, size_t len, struct http_request *req)
+{
+    char *p;
+    char *end = line + len;
+
+    p = memchr(line, ' ', len);
+    if (!p || p == line) {
+        return 400;
+    }
+    req->method = line;
+    req->method_len = p - line;
+
+    line = p + 1;
+    p = memchr(line, ' ', end - line);
+    if (!p || p == line) {
+        return 400;
+    }
+    req->uri = line;
+    req->uri_len = p - line;
+
+    line = p + 1;
+    if (token_eq(line, end - line, "HTTP/1.1")) {
+        req->keepalive = FLB_TRUE;
+    }
+    else if (token_eq(line, end - line, "HTTP/1.0")) {
+        req->keepalive = FLB_FALSE;
+    }
+    else if ((end - line) > 5 && strncmp(line, "HTTP/", 5) == 0) {
+        return 505;
+    }
+    else {
+        return 400;
+    }
+
+    return HTTP_REQ_OK;
+}
+
+static int parse_header(char *line, size_t len, size_t max_size,
+                        struct http_request *req)
+{
+    char *p;
+    char *key;
+    char *val;
+    size_t key_len;
+    size_t val_len;
+    int64_t n;
+
+    p = memchr(line, ':', len);
+    if (!p || p == line) {
+        return 400;
+    }
+    key = line;
+    key_len = p - line;
+
+    val = p + 1;
+    val_len = (line + len) - val;
+    while (val_len > 0 && (*val == ' ' || *val == '\t')) {
+        val++;
+        val_len--;
+    }
+    while (val_len > 0 && (val[val_len - 1] == ' ' ||
+                           val[val_len - 1] == '\t')) {
+        val_len--;
+    }
+
+    if (token_eq(key, key_len, "content-length")) {
+        if (val_len == 0) {
+            return 400;
+        }
+        n = 0;
+        for (p = val; p < val + val_len; p++) {
+            if (!isdigit((unsigned char) *p)) {
+                return 400;
+            }
+            n = (n * 10) + (*p - '0');
+            if (n > (int64_t) max_size) {
+                return 413;
+            }
+        }
+        req->content_length = n;
+    }
+    else if (token_eq(key, key_len, "content-type")) {
+        req->format = body_format(val, val_len);
+    }
+    else if (token_eq(key, key_len, "content-encoding")) {
+        if (token_eq(val, val_len, "gzip") ||
+            token_eq(val, val_len, "x-gzip")) {
+            req->gzip = FLB_TRUE;
+        }
+        else if (!token_eq(val, val_len, "identity")) {
+            req->format = HTTP_BODY_UNKNOWN;
+        }
+    }
+    else if (token_eq(key, key_len, "transfer-encoding")) {
+        if (token_eq(val, val_len, "chunked")) {
+            req->chunked = FLB_TRUE;
+        }
+        else if (!token_eq(val, val_len, "identity")) {
+            return 501;
+        }
+    }
+    else if (token_eq(key, key_len, "connection")) {
+        if (token_eq(val, val_len, "close")) {
+            req->keepalive = FLB_FALSE;
+        }
+        else if (token_eq(val, val_len, "keep-alive")) {
+            req->keepalive = FLB_TRUE;
+        }
+    }
+    else if (token_eq(key, key_len, "expect")) {
+        if (token_eq(val, val_len, "100-continue")) {
+            req->expect = FLB_TRUE;
+        }
+    }
+
+    return HTTP_REQ_OK;
+}
+
+/*
+ * Chunked body: the chunks are validated first and the data is moved in
+ * place, right after the headers, only once the last chunk arrived. A
+ * partial body is scanned again on the next read but only the chunk size
+ * lines are visited.
+ */
+static int parse_chunked(char *buf, size_t size, size_t max_size,
+                         struct http_request *req)
+{
+    int digits;
+    char *p = buf;
+    char *end = buf + size;
+    char *eol;
+    char *out;
+    size_t len;
+    size_t chunk;
+    size_t total = 0;
+
+    while (1) {
+        eol = memchr(p, '\n', end - p);
+        if (!eol) {
+            return HTTP_REQ_PENDING;
+        }
+
+        chunk = 0;
+        digits = 0;
+        while (p < eol && isxdigit((unsigned char) *p)) {
+            chunk = (chunk * 16) + hex_value(*p);
+            if (chunk > max_size) {
+                return 413;
+            }
+            p++;
+            digits++;
+        }
+        if (digits == 0) {
+            return 400;
+        }
+
+        /* chunk extensions are ignored */
+        p = eol + 1;
+        if (chunk == 0) {
+            break;
+        }
+
+        total += chunk;
+        if (total > max_size) {
+            return 413;
+        }
+        if ((size_t) (end - p) < chunk + 1) {
+            return HTTP_REQ_PENDING;
+        }
+        p += chunk;
+        if (*p == '\r') {
+            if (p + 1 >= end) {
+                return HTTP_REQ_PENDING;
+            }
+            p++;
+        }
+        if (*p != '\n') {
+            return 400;
+        }
+        p++;
+    }
+
+    /* The trailer section ends with an empty line */
+    while (1) {
+        eol = memchr(p, '\n', end - p);
+        if (!eol) {
+            return HTTP_REQ_PENDING;
+        }
+        len = eol - p;
+        if (len > 0 && p[len - 1] == '\r') {
+            len--;
+        }
+        p = eol + 1;
+        if (len == 0) {
+            break;
+        }
+    }
+    req->size = req->header_size + (p - buf);
+
+    /* Join the chunks */
+    out = buf;
+    p = buf;
+    while (1) {
+        eol = memchr(p, '\n', end - p);
+        chunk = 0;
+        while (p < eol && isxdigit((unsigned char) *p)) {
+            chunk = (chunk * 16) + hex_value(*p);
+            p++;
+        }
+        p = eol + 1;
+        if (chunk == 0) {
+            break;
+        }
+        memmove(out, p, chunk);
+        out += chunk;
+        p += chunk;
+        if (*p == '\r') {
+            p++;
+        }
+        p++;
+    }
+
+    req->body = buf;
+    req->body_len = out - buf;
+    return HTTP_REQ_OK;
+}
+
+/*
+ * Parse the request at the start of the buffer. It returns HTTP_REQ_OK
+ * once the request is complete, HTTP_REQ_PENDING if more data is needed
+ * or the status of the error to reply with, the connection can't be used
+ * after an error. Once the headers are complete 'header_size' is set even
+ * if the body is pending.
+ */
+int http_prot_parse(char *buf, size_t size, size_t max_size,
+                    struct http_request *req)
+{
+    int ret;
+    int first = FLB_TRUE;
+    char *p = buf;
+    char *end = buf + size;
+    char *eol;
+    char *line;
+    size_t len;
+
+    memset(req, '\0', sizeof(struct http_request));
+    req->content_length = -1;
+    req->format = HTTP_BODY_JSON;
+
+    while (1) {
+        eol = memchr(p, '\n', end - p);
+        if (!eol) {
+            return HTTP_REQ_PENDING;
+        }
+
+        line = p;
+        len = eol - p;
+        if (len > 0 && line[len - 1] == '\r') {
+            len--;
+        }
+        p = eol + 1;
+
+        if (first == FLB_TRUE) {
+            /* empty lines before the request line are ignored */
+            if (len == 0) {
+                continue;
+            }
+            ret = parse_request_line(line, len, req);
+            first = FLB_FALSE;
+        }
+        else if (len == 0) {
+            break;
+        }
+        else {
+            ret = parse_header(line, len, max_size, req);
+        }
+
+        if (ret != HTTP_REQ_OK) {
+            return ret;
+        }
+    }
+    req->header_size = p - buf;
+
+    if (req->chunked == FLB_TRUE) {
+        return parse_chunked(p, end - p, max_size, req);
+    }
+
+    len = (req->content_length > 0) ? req->content_length : 0;
+    if (req->header_size + len > size) {
+        return HTTP_REQ_PENDING;
+    }
+
+    req->body = p;
+    req->body_len = len;
+    req->size = req->header_size + len;
+    return HTTP_REQ_OK;
+}
+
+int http_prot_respond(struct http_conn *conn, int status, int keepalive)
+{
+    int len;
+    int ret;
+    int off = 0;
+    char buf[256];
+
+    if (status == 100) {
+        len = snprintf(buf, sizeof(buf), "HTTP/1.1 100 Continue\r\n\r\n");
+    }
+    else {
+        len = snprintf(buf, sizeof(buf),
+                       "HTTP/1.1 %i %s\r\n"
+                       "Content-Length: 0\r\n"
+                       "%s%s\r\n",
+                       status, status_text(status),
+                       status == 429 ? "Retry-After: 1\r\n" : "",
+                       keepalive ? "" : "Connection: close\r\n");
+    }
+
+    /* The answer is small, a short write means the client is not reading */
+    while (off < len) {
+        ret = write(conn->fd, buf + off, len - off);
+        if (ret <= 0) {
+            flb_debug("[in_http] fd=%i could not write response", conn->fd);
+            return -1;
+        }
+        off += ret;
+    }
+
+    return 0;
+}
+
+/*
+ * The records of a request are packed straight into the buffer of its tag
+ * or, from a listener worker, into the connection buffer that is handed to
+ * the engine thread.
+ */
+static inline msgpack_packer *records_start(struct http_conn *conn,
+                                            char *tag, int tag_len,
+                                            struct flb_input_dyntag **dt)
+{
+    if (conn->ctx->worker) {
+        msgpack_sbuffer_clear(&conn->mp_sbuf);
+        return &conn->mp_pck;
+    }
+
+    *dt = flb_input_dyntag_get(tag, tag_len, conn->in);
+    if (!*dt) {
+        return NULL;
+    }
+    flb_input_dbuf_write_start(*dt);
+    return &(*dt)->mp_pck;
+}
+
+static inline int records_end(struct http_conn *conn, char *tag, int tag_len,
+                              struct flb_input_dyntag *dt, int records)
+{
+    struct flb_input_instance *in = conn->in;
+
+    if (conn->ctx->worker) {
+        if (conn->mp_sbuf.size == 0) {
+            return 0;
+        }
+        return flb_input_worker_append(conn->ctx->worker, tag, tag_len,
+                                       conn->mp_sbuf.data, conn->mp_sbuf.size,
+                                       records);
+    }
+
+    dt->mp_buf_write_records = records;
+    flb_input_dbuf_write_end(dt);
+
+    /* Seal full buffers, no more data can be appended */
+    if (flb_input_chunk_full(in, dt->mp_sbuf.size,
+                             dt->mp_index.records) == FLB_TRUE) {
+        dt->lock = FLB_TRUE;
+        flb_input_chunk_seal(in, dt);
+    }
+    return 0;
+}
+
+/* Event time: a positive integer, a float or an extension (EventTime) */
+static inline int is_time(unsigned char c)
+{
+    return (c <= 0x7f || (c >= 0xcc && c <= 0xcf) ||
+            c == 0xca || c == 0xcb ||
+            (c >= 0xc7 && c <= 0xc9) || (c >= 0xd4 && c <= 0xd8));
+}
+
+/* A [time, map] entry, it's appended as it is */
+static int is_entry(char *buf, size_t size)
+{
+    uint32_t count;
+    size_t hdr;
+    size_t len;
+
+    if (flb_mp_array_header(buf, size, &count, &hdr) == -1 || count != 2) {
+        return FLB_FALSE;
+    }
+    buf += hdr;
+    size -= hdr;
+
+    if (size == 0 || !is_time((unsigned char) buf[0]) ||
+        flb_mp_object_size(buf, size, &len) == -1) {
+        return FLB_FALSE;
+    }
+
+    return (flb_mp_map_header(buf + len, size - len, &count, &hdr) == 0);
+}
+
+static inline void pack_value(msgpack_packer *mp_pck, struct flb_time *tm,
+                              char *buf, size_t len)
+{
+    uint32_t count;
+    size_t hdr;
+
+    msgpack_pack_array(mp_pck, 2);
+    flb_time_append_to_msgpack(tm, mp_pck, 0);
+
+    /* maps are the records, any other value goes under 'msg' */
+    if (flb_mp_map_header(buf, len, &count, &hdr) == -1) {
+        msgpack_pack_map(mp_pck, 1);
+        msgpack_pack_str(mp_pck, 3);
+        msgpack_pack_str_body(mp_pck, "msg", 3);
+    }
+    mp_pck->callback(mp_pck->data, buf, len);
+}
+
+/*
+ * Pack the root values of a msgpack buffer as records, the elements of a
+ * root array are records on their own. With 'entries' the [time, map]
+ * arrays keep their time.
+ */
+static int pack_roots(msgpack_packer *mp_pck, struct flb_time *tm,
+                      char *buf, size_t size, int entries)
+{
+    int records = 0;
+    uint32_t i;
+    uint32_t count;
+    size_t off = 0;
+    size_t end;
+    size_t len;
+    size_t hdr;
+
+    while (off < size) {
+        if (flb_mp_object_size(buf + off, size - off, &len) == -1) {
+            break;
+        }
+        end = off + len;
+
+        if (entries && is_entry(buf + off, len)) {
+            mp_pck->callback(mp_pck->data, buf + off, len);
+            records++;
+        }
+        else if (flb_mp_array_header(buf + off, len, &count, &hdr) == 0) {
+            off += hdr;
+            for (i = 0; i < count; i++) {
+                flb_mp_object_size(buf + off, end - off, &len);
+                if (entries && is_entry(buf + off, len)) {
+                    mp_pck->callback(mp_pck->data, buf + off, len);
+                }
+                else {
+                    pack_value(mp_pck, tm, buf + off, len);
+                }
+                off += len;
+                records++;
+            }
+        }
+        else {
+            pack_value(mp_pck, tm, buf + off, len);
+            records++;
+        }
+        off = end;
+    }
+
+    return records;
+}
+
+static int process_json(struct http_conn *conn, char *tag, int tag_len,
+                        char *body, size_t size)
+{
+    int ret;
+    int records;
+    char *out;
+    size_t out_size;
+    struct flb_time tm;
+    struct flb_input_dyntag *dt = NULL;
+    msgpack_packer *mp_pck;
+
+    ret = flb_json_parse(body, size, &out, &out_size);
+    if (ret <= 0) {
+        flb_debug("[in_http] invalid JSON body");
+        return 400;
+    }
+
+    mp_pck = records_start(conn, tag, tag_len, &dt);
+    if (!mp_pck) {
+        flb_free(out);
+        return 500;
+    }
+
+    flb_time_get(&tm);
+    records = pack_roots(mp_pck, &tm, out, out_size, FLB_FALSE);
+    records_end(conn, tag, tag_len, dt, records);
+    flb_free(out);
+
+    return 201;
+}
+
+/* One JSON value per line, invalid lines are skipped */
+static int process_ndjson(struct http_conn *conn, char *tag, int tag_len,
+                          char *body, size_t size)
+{
+    int i;
+    int n;
+    int ret;
+    int records = 0;
+    char *data = body;
+    char *end = body + size;
+    char *base;
+    char *line;
+    char *out;
+    size_t len;
+    size_t out_size;
+    size_t offsets[HTTP_LINES];
+    struct flb_time tm;
+    struct flb_input_dyntag *dt = NULL;
+    msgpack_packer *mp_pck;
+
+    mp_pck = records_start(conn, tag, tag_len, &dt);
+    if (!mp_pck) {
+        return 500;
+    }
+    flb_time_get(&tm);
+
+    while (data < end) {
+        n = flb_lines_scan(data, end - data, offsets, HTTP_LINES);
+        if (n == 0) {
+            /* the last line does not need a line break */
+            offsets[0] = end - data;
+            n = 1;
+        }
+
+        base = data;
+        for (i = 0; i < n; i++) {
+            line = data;
+            len = (base + offsets[i]) - line;
+            data = base + offsets[i] + 1;
+
+            if (len > 0 && line[len - 1] == '\r') {
+                len--;
+            }
+            if (len == 0) {
+                continue;
+            }
+
+            ret = flb_json_parse(line, len, &out, &out_size);
+            if (ret <= 0) {
+                flb_debug("[in_http] invalid JSON line, skipping");
+                continue;
+            }
+            records += pack_roots(mp_pck, &tm, out, out_size, FLB_FALSE);
+            flb_free(out);
+        }
+    }
+
+    records_end(conn, tag, tag_len, dt, records);
+    return 201;
+}
+
+static int process_msgpack(struct http_conn *conn, char *tag, int tag_len,
+                           char *body, size_t size)
+{
+    int records;
+    size_t off = 0;
+    size_t len;
+    struct flb_time tm;
+    struct flb_input_dyntag *dt = NULL;
+    msgpack_packer *mp_pck;
+
+    /* The whole body must be made of complete values */
+    while (off < size) {
+        if (flb_mp_object_size(body + off, size - off, &len) == -1) {
+            flb_debug("[in_http] invalid msgpack body");
+            return 400;
+        }
+        off += len;
+    }
+
+    mp_pck = records_start(conn, tag, tag_len, &dt);
+    if (!mp_pck) {
+        return 500;
+    }
+
+    flb_time_get(&tm);
+    records = pack_roots(mp_pck, &tm, body, size, FLB_TRUE);
+    records_end(conn, tag, tag_len, dt, records);
+
+    return 201;
+}
+
+/* Inflate a gzip body, it returns 0 or the HTTP status of the error */
+static int body_gunzip(struct flb_in_http_config *ctx, char *data, size_t len,
+                       char **out_buf, size_t *out_size)
+{
+    int ret = 0;
+    char *buf;
+    char *tmp;
+    size_t size;
+    size_t max;
+    size_t used = 0;
+    size_t out_len;
+    struct flb_gunzip gz;
+
+    max = ctx->buffer_max_size * FLB_IN_HTTP_GZIP_RATIO;
+    size = len * 4;
+    if (size < ctx->buffer_chunk_size) {
+        size = ctx->buffer_chunk_size;
+    }
+    if (size > max) {
+        size = max;
+    }
+
+    buf = flb_malloc(size);
+    if (!buf) {
+        flb_errno();
+        return 500;
+    }
+    flb_gunzip_init(&gz, data, len);
+
+    while (1) {
+        if (used == size) {
+            if (size >= max) {
+                ret = 413;
+                break;
+            }
+            size = (size * 2 > max) ? max : size * 2;
+            tmp = flb_realloc(buf, size);
+            if (!tmp) {
+                flb_errno();
+                ret = 500;
+                break;
+            }
+            buf = tmp;
+        }
+
+        if (flb_gunzip_read(&gz, buf + used, size - used, &out_len) == -1) {
+            ret = 400;
+            break;
+        }
+        if (out_len == 0) {
+            break;
+        }
+        used += out_len;
+    }
+    flb_gunzip_destroy(&gz);
+
+    if (ret != 0) {
+        flb_debug("[in_http] could not inflate gzip body (%i)", ret);
+        flb_free(buf);
+        return ret;
+    }
+
+    *out_buf = buf;
+    *out_size = used;
+    return 0;
+}
+
+/*
+ * The tag is the URI path without the leading slash, the other slashes
+ * become dots: '/app/logs' is tagged 'app.logs'. It's set in place.
+ */
+static int request_tag(struct http_request *req, char **tag, int *tag_len)
+{
+    size_t i;
+    size_t len;
+    char *p;
+
+    p = memchr(req->uri, '?', req->uri_len);
+    len = p ? (size_t) (p - req->uri) : req->uri_len;
+
+    p = req->uri;
+    while (len > 0 && *p == '/') {
+        p++;
+        len--;
+    }
+    while (len > 0 && p[len - 1] == '/') {
+        len--;
+    }
+    if (len == 0) {
+        return -1;
+    }
+
+    for (i = 0; i < len; i++) {
+        if (p[i] == '/') {
+            p[i] = '.';
+        }
+        else if (!isalnum((unsigned char) p[i]) &&
+                 p[i] != '.' && p[i] != '_' && p[i] != '-') {
+            return 400;
+        }
+    }
+
+    *tag = p;
+    *tag_len = len;
+    return 0;
+}
+
+static inline int http_paused(struct http_conn *conn)
+{
+    if (conn->ctx->worker) {
+        return conn->ctx->paused;
+    }
+
+    return (conn->ctx->paused || flb_input_buf_paused(conn->in));
+}
+
+static int process_request(struct http_conn *conn, struct http_request *req)
+{
+    int ret;
+    int status;
+    int tag_len;
+    char *tag;
+    char *body;
+    size_t size;
+    char *gz_buf = NULL;
+    struct flb_input_instance *in = conn->in;
+
+    if (!token_eq(req->method, req->method_len, "POST") &&
+        !token_eq(req->method, req->method_len, "PUT")) {
+        return 405;
+    }
+    if (req->chunked == FLB_FALSE && req->content_length == -1) {
+        return 411;
+    }
+    if (req->format == HTTP_BODY_UNKNOWN) {
+        return 415;
+    }
+    if (http_paused(conn)) {
+        return 429;
+    }
+
+    ret = request_tag(req, &tag, &tag_len);
+    if (ret == -1) {
+        tag = in->tag;
+        tag_len = in->tag_len;
+    }
+    else if (ret != 0) {
+        return ret;
+    }
+
+    body = req->body;
+    size = req->body_len;
+    if (req->gzip == FLB_TRUE && size > 0) {
+        ret = body_gunzip(conn->ctx, body, size, &gz_buf, &size);
+        if (ret != 0) {
+            return ret;
+        }
+        body = gz_buf;
+    }
+
+    if (size == 0) {
+        status = 400;
+    }
+    else if (req->format == HTTP_BODY_NDJSON) {
+        status = process_ndjson(conn, tag, tag_len, body, size);
+    }
+    else if (req->format == HTTP_BODY_MSGPACK) {
+        status = process_msgpack(conn, tag, tag_len, body, size);
+    }
+    else {
+        status = process_json(conn, tag, tag_len, body, size);
+    }
+
+    if (gz_buf) {
+        flb_free(gz_buf);
+    }
+    return status;
+}
+
+/*
+ * Answer the complete requests of the connection buffer, pipelined ones
+ * included. It returns -1 if the connection must be closed.
+ */
+int http_prot_handle(struct http_conn *conn)
+{
+    int ret;
+    int status;
+    int keepalive;
+    struct http_request req;
+    struct flb_in_http_config *ctx = conn->ctx;
+
+    while (conn->buf_len > 0) {
+        ret = http_prot_parse(conn->buf_data, conn->buf_len,
+                              ctx->buffer_max_size, &req);
+        if (ret == HTTP_REQ_PENDING) {
+            /* The client waits for a go-ahead before sending the body */
+            if (req.header_size > 0 && req.expect == FLB_TRUE &&
+                conn->continued == FLB_FALSE) {
+                if (http_paused(conn)) {
+                    http_prot_respond(conn, 429, FLB_FALSE);
+                    return -1;
+                }
+                if (http_prot_respond(conn, 100, FLB_TRUE) == -1) {
+                    return -1;
+                }
+                conn->continued = FLB_TRUE;
+            }
+            return 0;
+        }
+        else if (ret != HTTP_REQ_OK) {
+            flb_debug("[in_http] fd=%i invalid request (%i)", conn->fd, ret);
+            http_prot_respond(conn, ret, FLB_FALSE);
+            return -1;
+        }
+
+        status = process_request(conn, &req);
+        keepalive = req.keepalive;
+        conn->continued = FLB_FALSE;
+
+        /* Drop the request */
+        memmove(conn->buf_data, conn->buf_data + req.size,
+                conn->buf_len - req.size);
+        conn->buf_len -= req.size;
+
+        ret = http_prot_respond(conn, status, keepalive);
+        if (ret == -1 || keepalive == FLB_FALSE) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,60 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef FLB_IN_HTTP_PROT_H
+#define FLB_IN_HTTP_PROT_H
+
+#include "http_conn.h"
+
+/* Request parser results, errors are the HTTP status to reply with */
+#define HTTP_REQ_OK          0
+#define HTTP_REQ_PENDING     1
+
+/* Body formats, from the Content-Type header */
+#define HTTP_BODY_JSON       0   /* JSON values, arrays are unwrapped */
+#define HTTP_BODY_NDJSON     1   /* one JSON value per line           */
+#define HTTP_BODY_MSGPACK    2   /* msgpack maps or [time, map]       */
+#define HTTP_BODY_UNKNOWN   -1
+
+/* A request found in the connection buffer */
+struct http_request {
+    char *method;
+    size_t method_len;
+    char *uri;
+    size_t uri_len;
+
+    int keepalive;            /* the connection stays open      */
+    int expect;               /* 'Expect: 100-continue'         */
+    int chunked;              /* chunked transfer encoding      */
+    int gzip;                 /* gzip content encoding          */
+    int format;               /* body format                    */
+    int64_t content_length;   /* -1 if not set                  */
+
+    size_t header_size;       /* request line and headers       */
+    char *body;               /* body, de-chunked               */
+    size_t body_len;
+    size_t size;              /* bytes of the request on wire   */
+};
+
+int http_prot_parse(char *buf, size_t size, size_t max_size,
+                    struct http_request *req);
+int http_prot_respond(struct http_conn *conn, int status, int keepalive);
+int http_prot_handle(struct http_conn *conn);
+
+#endif
@@ -17,56 +17,274 @@
  *  limitations under the License.
  */
 
-#include <monkey/monkey.h>
-#include <fluent-bit/flb_input.h>
-#include <fluent-bit/flb_config.h>
 #include <msgpack.h>
-
-#include <stdio.h>
-#include <stdlib.h>
-#include <unistd.h>
+#include <fluent-bit/flb_input.h>
+#include <fluent-bit/flb_network.h>
 
 #include "in_http.h"
-#include "in_http_info.h"
+#include "http_conn.h"
+#include "http_config.h"
 
-/* Init CPU input */
-int in_http_init(struct flb_config *config)
+/*
+ * HTTP input: records are sent with POST (or PUT) requests, the body is
+ * JSON, NDJSON or msgpack (Content-Type) and can be gzip compressed
+ * (Content-Encoding). The URI path sets the tag. The connections are kept
+ * open and while the instance is paused the requests are answered with
+ * '429 Too Many Requests'.
+ */
+static int in_http_collect(struct flb_input_instance *in,
+                           struct flb_config *config, void *in_context)
 {
-    mk_config = mk_server_init();
-    mk_config->server_conf_file = FLB_HTTP_CONFIG;
-    mk_config->path_config      = FLB_HTTP_CONF_PATH;
-    mk_config->sites_conf_dir   = FLB_HTTP_SITES;
-    mk_config->mimes_conf_file  = FLB_HTTP_MIMES;
-    mk_server_setup();
+    int fd;
+    struct flb_in_http_config *ctx = in_context;
+    struct http_conn *conn;
 
+    /* Accept the new connection */
+    fd = flb_net_accept(ctx->server_fd);
+    if (fd == -1) {
+        flb_error("[in_http] could not accept new connection");
+        return -1;
+    }
+
+    flb_trace("[in_http] new TCP connection arrived FD=%i", fd);
+    conn = http_conn_add(fd, ctx);
+    if (!conn) {
+        return -1;
+    }
     return 0;
 }
 
-/* Callback invoked after setup but before to join the main loop */
-int in_http_pre_run(void *in_context, struct flb_config *config)
+/*
+ * Listener workers callbacks, they run in the worker thread on the worker
+ * copy of the context.
+ */
+static int http_worker_accept(void *data)
+{
+    struct flb_in_http_config *ctx = data;
+
+    return in_http_collect(ctx->in, NULL, ctx);
+}
+
+static void http_worker_pause(void *data)
+{
+    struct flb_in_http_config *ctx = data;
+
+    ctx->paused = FLB_TRUE;
+}
+
+static void http_worker_resume(void *data)
+{
+    struct flb_in_http_config *ctx = data;
+
+    ctx->paused = FLB_FALSE;
+}
+
+static void http_worker_exit(void *data)
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct http_conn *conn;
+    struct flb_in_http_config *ctx = data;
+
+    mk_list_foreach_safe(head, tmp, &ctx->connections) {
+        conn = mk_list_entry(head, struct http_conn, _head);
+        http_conn_del(conn);
+    }
+    flb_free(ctx);
+}
+
+static void http_workers_destroy(struct flb_in_http_config *ctx)
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct flb_input_worker *worker;
+
+    mk_list_foreach_safe(head, tmp, &ctx->worker_list) {
+        worker = mk_list_entry(head, struct flb_input_worker, _head);
+        mk_list_del(&worker->_head);
+        flb_input_worker_destroy(worker);
+    }
+}
+
+/*
+ * Start the listener workers: every worker binds the address on its own
+ * socket and reads the connections it accepts in its own thread.
+ */
+static int http_workers_start(struct flb_in_http_config *ctx)
 {
-    /* EXPERIMENTAL!!! */
-    mk_server_loop();
+    int i;
+    int ret;
+    struct flb_in_http_config *w_ctx;
+    struct flb_input_worker *worker;
+
+    for (i = 0; i < ctx->workers; i++) {
+        worker = flb_input_worker_create(ctx->in, i,
+                                         ctx->listen, ctx->tcp_port);
+        if (!worker) {
+            return -1;
+        }
+        mk_list_add(&worker->_head, &ctx->worker_list);
+
+        w_ctx = flb_malloc(sizeof(struct flb_in_http_config));
+        if (!w_ctx) {
+            flb_errno();
+            return -1;
+        }
+        memcpy(w_ctx, ctx, sizeof(struct flb_in_http_config));
+        w_ctx->server_fd = worker->server_fd;
+        w_ctx->coll_id = -1;
+        w_ctx->paused = FLB_FALSE;
+        w_ctx->evl = worker->evl;
+        w_ctx->worker = worker;
+        mk_list_init(&w_ctx->connections);
+        mk_list_init(&w_ctx->worker_list);
+
+        ret = flb_input_worker_start(worker, w_ctx,
+                                     http_worker_accept,
+                                     http_worker_pause,
+                                     http_worker_resume,
+                                     http_worker_exit);
+        if (ret == -1) {
+            return -1;
+        }
+    }
+
     return 0;
 }
 
-/* Callback to gather CPU usage between now and previous snapshot */
-int in_http_collect(struct flb_config *config, void *in_context)
+/* Initialize plugin */
+static int in_http_init(struct flb_input_instance *in,
+                        struct flb_config *config, void *data)
 {
+    int ret;
+    struct flb_in_http_config *ctx;
+    (void) data;
+
+    /* Allocate space for the configuration */
+    ctx = http_config_init(in);
+    if (!ctx) {
+        return -1;
+    }
+    ctx->in = in;
+    ctx->paused = FLB_FALSE;
+    mk_list_init(&ctx->connections);
+    mk_list_init(&ctx->worker_list);
+
+    /* Set the context */
+    flb_input_set_context(in, ctx);
+
+    /* Listener workers, the engine thread does not listen */
+    if (ctx->workers > 0) {
+        ret = http_workers_start(ctx);
+        if (ret == -1) {
+            flb_error("[in_http] could not start workers on %s:%s",
+                      ctx->listen, ctx->tcp_port);
+            http_workers_destroy(ctx);
+            http_config_destroy(ctx);
+            return -1;
+        }
+        flb_info("[in_http] binding %s:%s with %i workers",
+                 ctx->listen, ctx->tcp_port, ctx->workers);
+        return 0;
+    }
+
+    /* Create HTTP server */
+    ctx->server_fd = flb_net_server(ctx->tcp_port, ctx->listen);
+    if (ctx->server_fd > 0) {
+        flb_info("[in_http] binding %s:%s", ctx->listen, ctx->tcp_port);
+    }
+    else {
+        flb_error("[in_http] could not bind address %s:%s. Aborting",
+                  ctx->listen, ctx->tcp_port);
+        http_config_destroy(ctx);
+        return -1;
+    }
+    flb_net_socket_nonblocking(ctx->server_fd);
+
+    ctx->evl = config->evl;
+
+    /* Collect upon new connections */
+    ret = flb_input_set_collector_socket(in,
+                                         in_http_collect,
+                                         ctx->server_fd,
+                                         config);
+    if (ret == -1) {
+        flb_error("[in_http] could not set collector");
+        http_config_destroy(ctx);
+        return -1;
+    }
+    ctx->coll_id = ret;
+
     return 0;
 }
 
-void *in_http_flush(void *in_context, int *size)
+/*
+ * Connections are still read while paused: the requests are answered with
+ * '429 Too Many Requests' so the clients retry them later.
+ */
+static void in_http_pause(void *data, struct flb_config *config)
+{
+    struct mk_list *head;
+    struct flb_input_worker *worker;
+    struct flb_in_http_config *ctx = data;
+
+    if (ctx->paused == FLB_TRUE) {
+        return;
+    }
+
+    mk_list_foreach(head, &ctx->worker_list) {
+        worker = mk_list_entry(head, struct flb_input_worker, _head);
+        flb_input_worker_pause(worker);
+    }
+    ctx->paused = FLB_TRUE;
+}
+
+static void in_http_resume(void *data, struct flb_config *config)
 {
-    return NULL;
+    struct mk_list *head;
+    struct flb_input_worker *worker;
+    struct flb_in_http_config *ctx = data;
+
+    if (ctx->paused == FLB_FALSE) {
+        return;
+    }
+
+    ctx->paused = FLB_FALSE;
+    mk_list_foreach(head, &ctx->worker_list) {
+        worker = mk_list_entry(head, struct flb_input_worker, _head);
+        flb_input_worker_resume(worker);
+    }
+}
+
+static int in_http_exit(void *data, struct flb_config *config)
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    (void) *config;
+    struct flb_in_http_config *ctx = data;
+    struct http_conn *conn;
+
+    http_workers_destroy(ctx);
+
+    mk_list_foreach_safe(head, tmp, &ctx->connections) {
+        conn = mk_list_entry(head, struct http_conn, _head);
+        http_conn_del(conn);
+    }
+
+    http_config_destroy(ctx);
+    return 0;
 }
 
 /* Plugin reference */
 struct flb_input_plugin in_http_plugin = {
     .name         = "http",
-    .description  = "HTTP Service",
+    .description  = "HTTP",
     .cb_init      = in_http_init,
-    .cb_pre_run   = in_http_pre_run,
+    .cb_pre_run   = NULL,
     .cb_collect   = in_http_collect,
-    .cb_flush_buf = in_http_flush
+    .cb_flush_buf = NULL,
+    .cb_pause     = in_http_pause,
+    .cb_resume    = in_http_resume,
+    .cb_exit      = in_http_exit,
+    .flags        = FLB_INPUT_NET | FLB_INPUT_DYN_TAG
 };
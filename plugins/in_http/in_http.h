@@ -20,20 +20,40 @@
 #ifndef FLB_IN_HTTP_H
 #define FLB_IN_HTTP_H
 
-#include <fluent-bit/flb_config.h>
+#include <msgpack.h>
 #include <fluent-bit/flb_input.h>
-#include <fluent-bit/flb_utils.h>
+#include <fluent-bit/flb_input_worker.h>
 
-/* Default configuration for the HTTP server */
-#define FLB_HTTP_CONFIG    "in_http.conf"
-#define FLB_HTTP_SITES     "sites/"
-#define FLB_HTTP_MIMES     "mimetypes.conf"
+/* Defaults */
+#define FLB_IN_HTTP_PORT       "9880"
+#define FLB_IN_HTTP_CHUNK      32768             /* 32KB */
+#define FLB_IN_HTTP_MAX        (4 * 1024 * 1024) /* 4MB  */
 
-struct flb_in_http_config {
+/* A gzip body can't inflate to more than this times buffer_max_size */
+#define FLB_IN_HTTP_GZIP_RATIO 16
 
-    /* MessagePack buffers */
-    msgpack_packer  mp_pck;
-    msgpack_sbuffer mp_sbuf;
+struct flb_in_http_config {
+    int server_fd;               /* TCP server file descriptor  */
+    int coll_id;                 /* Server collector id         */
+    int paused;                  /* Requests are refused (429)  */
+    int workers;                 /* Listener threads            */
+    size_t buffer_max_size;      /* Max request size            */
+    size_t buffer_chunk_size;    /* Chunk allocation size       */
+
+    /* Network */
+    char *listen;                /* Listen interface            */
+    char *tcp_port;              /* TCP Port                    */
+
+    struct mk_list connections;    /* List of active connections */
+    struct mk_event_loop *evl;     /* Event loop file descriptor */
+    struct flb_input_instance *in; /* Input plugin instace       */
+
+    /*
+     * Listener workers. Each worker runs a copy of this context with its
+     * own event loop and connections, 'worker' is only set on the copies.
+     */
+    struct mk_list worker_list;
+    struct flb_input_worker *worker;
 };
 
 extern struct flb_input_plugin in_http_plugin;
@@ -41,133 +41,100 @@
 struct flb_input_plugin in_kmsg_plugin;
 
 /*
- * Note: Functions timeval_diff() and in_kmsg_boot_time() are based
- * on syslog-ng-3.5 source code.
+ * Realtime of the monotonic clock origin. The kernel stamps the records
+ * with the monotonic clock, this offset follows the wall clock changes.
  */
-static inline uint64_t timeval_diff(struct timeval *t1, struct timeval *t2)
+static int boot_time(struct timespec *boot_time)
 {
-    return ((uint64_t) t1->tv_sec - (uint64_t) t2->tv_sec) * KMSG_USEC_PER_SEC +
-        ((uint64_t) t1->tv_usec - (uint64_t) t2->tv_usec);
-}
-
-static int boot_time(struct timeval *boot_time)
-{
-    int fd, pos = 0;
-    int bytes;
-    uint64_t tdiff;
-    char buf[256];
-    struct timeval curr_time;
+    struct timespec real;
+    struct timespec mono;
 
-    fd = open("/proc/uptime", O_RDONLY);
-    if (fd == -1) {
+    if (clock_gettime(CLOCK_REALTIME, &real) == -1 ||
+        clock_gettime(CLOCK_MONOTONIC, &mono) == -1) {
+        flb_errno();
         return -1;
     }
 
-    bytes = read(fd, buf, sizeof(buf));
-    if (bytes <= 0) {
-        close(fd);
-        return -1;
+    boot_time->tv_sec = real.tv_sec - mono.tv_sec;
+    boot_time->tv_nsec = real.tv_nsec - mono.tv_nsec;
+    if (boot_time->tv_nsec < 0) {
+        boot_time->tv_sec--;
+        boot_time->tv_nsec += 1000000000L;
     }
 
-    close(fd);
-    gettimeofday(&curr_time, NULL);
+    return 0;
+}
 
-    /* Read the seconds part */
-    while (pos < bytes && buf[pos] != '.') {
-        if (isdigit(buf[pos])) {
-            boot_time->tv_sec = boot_time->tv_sec * 10 + ((buf[pos]) - '0');
-        }
-        else {
-            boot_time->tv_sec = 0;
-            return 0;
-        }
-        pos++;
-    }
-    pos++;
+/* Read a decimal number, at least one digit */
+static inline int parse_u64(char **p, char *end, uint64_t *val)
+{
+    char *s = *p;
+    uint64_t v = 0;
 
-    /* Then the microsecond part */
-    while (pos < bytes && buf[pos] != ' ') {
-        if (isdigit(buf[pos])) {
-            boot_time->tv_usec = boot_time->tv_usec * 10 + ((buf[pos]) - '0');
-        }
-        else {
-            boot_time->tv_sec = 0;
-            boot_time->tv_usec = 0;
-            return 0;
-        }
-        pos++;
+    while (s < end && *s >= '0' && *s <= '9') {
+        v = v * 10 + (*s - '0');
+        s++;
+    }
+    if (s == *p) {
+        return -1;
     }
 
-    tdiff = timeval_diff(&curr_time, boot_time);
-    boot_time->tv_sec  = tdiff / KMSG_USEC_PER_SEC;
-    boot_time->tv_usec = tdiff % KMSG_USEC_PER_SEC;
-
+    *val = v;
+    *p = s;
     return 0;
 }
 
-static inline int process_line(char *line,
+/*
+ * A record is 'priority,sequence,timestamp,flags[,...];message\n', the
+ * message can be followed by ' KEY=value' continuation lines.
+ */
+static inline int process_line(char *line, size_t len,
                                struct flb_input_instance *i_ins,
                                struct flb_in_kmsg_config *ctx)
 {
     char priority;           /* log priority                */
     uint64_t sequence;       /* sequence number             */
-    struct timeval tv;       /* time value                  */
-    int line_len;
+    uint64_t usec;           /* monotonic timestamp         */
     uint64_t val;
+    long nsec;
+    size_t line_len;
     char *p = line;
-    char *end = NULL;
+    char *end = line + len;
+    char *msg;
+    char *eol;
+    struct timeval tv;       /* time value                  */
     struct flb_time ts;
 
-    /* Increase buffer position */
-    ctx->buffer_id++;
-
-    errno = 0;
-    val = strtol(p, &end, 10);
-    if ((errno == ERANGE && (val == INT_MAX || val == INT_MIN))
-        || (errno != 0 && val == 0)) {
-        goto fail;
-    }
-
     /* Priority */
+    if (parse_u64(&p, end, &val) == -1 || p == end || *p++ != ',') {
+        return -1;
+    }
     priority = FLB_KLOG_PRI(val);
 
     /* Sequence */
-    p = strchr(p, ',');
-    if (!p) {
-        goto fail;
-    }
-    p++;
-
-    val = strtol(p, &end, 10);
-    if ((errno == ERANGE && (val == INT_MAX || val == INT_MIN))
-        || (errno != 0 && val == 0)) {
-        goto fail;
+    if (parse_u64(&p, end, &sequence) == -1 || p == end || *p++ != ',') {
+        return -1;
     }
 
-    sequence = val;
-    p = ++end;
-
     /* Timestamp */
-    val = strtol(p, &end, 10);
-    if ((errno == ERANGE && (val == INT_MAX || val == INT_MIN))
-        || (errno != 0 && val == 0)) {
-        goto fail;
+    if (parse_u64(&p, end, &usec) == -1) {
+        return -1;
     }
+    tv.tv_sec  = usec / KMSG_USEC_PER_SEC;
+    tv.tv_usec = usec % KMSG_USEC_PER_SEC;
 
-    tv.tv_sec  = val/1000000;
-    tv.tv_usec = val - (tv.tv_sec * 1000000);
-
-    flb_time_set(&ts, ctx->boot_time.tv_sec + tv.tv_sec, tv.tv_usec * 1000);
+    nsec = ctx->boot_time.tv_nsec + tv.tv_usec * 1000;
+    flb_time_set(&ts, ctx->boot_time.tv_sec + tv.tv_sec + nsec / 1000000000L,
+                 nsec % 1000000000L);
 
-    /* Now process the human readable message */
-    p = strchr(p, ';');
-    if (!p) {
-        goto fail;
+    /* Now process the human readable message, up to the first newline */
+    msg = memchr(p, ';', end - p);
+    if (!msg) {
+        return -1;
     }
-    p++;
-
-    line_len = strlen(p);
-    flb_input_buf_write_start(i_ins);
+    msg++;
+    eol = memchr(msg, '\n', end - msg);
+    line_len = (eol ? eol : end) - msg;
 
     /*
      * Store the new data into the MessagePack buffer,
@@ -195,61 +162,64 @@ static inline int process_line(char *line,
 
     msgpack_pack_str(&i_ins->mp_pck, 3);
     msgpack_pack_str_body(&i_ins->mp_pck, "msg", 3);
-    msgpack_pack_str(&i_ins->mp_pck, line_len - 1);
-    msgpack_pack_str_body(&i_ins->mp_pck, p, line_len - 1);
-
-    flb_input_buf_write_end(i_ins);
+    msgpack_pack_str(&i_ins->mp_pck, line_len);
+    msgpack_pack_str_body(&i_ins->mp_pck, msg, line_len);
 
-    flb_trace("[in_kmsg] pri=%i seq=%" PRIu64 " ts=%ld sec=%ld usec=%ld '%s'",
+    flb_trace("[in_kmsg] pri=%i seq=%" PRIu64 " sec=%ld usec=%ld '%.*s'",
               priority,
               sequence,
-              ts,
               (long int) tv.tv_sec,
               (long int) tv.tv_usec,
-              (const char *) p);
+              (int) line_len, msg);
 
     return 0;
-
- fail:
-    ctx->buffer_id--;
-    return -1;
 }
 
-/* Callback triggered when some Kernel Log buffer msgs are available */
+/*
+ * Callback triggered when some Kernel Log buffer msgs are available. Every
+ * read() returns one record: up to KMSG_READ_BUDGET of them are drained
+ * and appended as a single batch, the rest waits for the next wakeup.
+ */
 static int in_kmsg_collect(struct flb_input_instance *i_ins,
                            struct flb_config *config, void *in_context)
 {
-    int ret;
-    int bytes;
+    int i;
+    int records = 0;
+    ssize_t bytes;
     struct flb_in_kmsg_config *ctx = in_context;
+    (void) config;
 
-    bytes = read(ctx->fd, ctx->buf_data, ctx->buf_size - 1);
-    if (bytes == -1) {
-        if (errno == -EPIPE) {
-            return -1;
-        }
-        return 0;
-    }
-    else if (bytes == 0) {
-        flb_errno();
-        return 0;
-    }
-    ctx->buf_len += bytes;
+    /* The wall clock offset is the same for the whole batch */
+    boot_time(&ctx->boot_time);
 
-    /* Always set a delimiter to avoid buffer trash */
-    ctx->buf_data[ctx->buf_len] = '\0';
+    flb_input_buf_write_start(i_ins);
 
-    /* Check if our buffer is full */
-    if (ctx->buffer_id + 1 == KMSG_BUFFER_SIZE) {
-        ret = flb_engine_flush(config, &in_kmsg_plugin);
-        if (ret == -1) {
-            ctx->buffer_id = 0;
+    for (i = 0; i < KMSG_READ_BUDGET; i++) {
+        bytes = read(ctx->fd, ctx->buf_data, ctx->buf_size);
+        if (bytes == -1) {
+            if (errno == EPIPE) {
+                /* The ring buffer overwrote records we did not read */
+                flb_warn("[in_kmsg] kernel records lost, buffer overrun");
+                continue;
+            }
+            if (errno != EAGAIN && errno != EINTR) {
+                flb_errno();
+            }
+            break;
+        }
+        else if (bytes == 0) {
+            break;
+        }
+
+        if (process_line(ctx->buf_data, bytes, i_ins, ctx) == 0) {
+            records++;
         }
     }
 
-    /* Process and enqueue the received line */
-    process_line(ctx->buf_data, i_ins, ctx);
-    ctx->buf_len = 0;
+    if (records > 0) {
+        i_ins->mp_buf_write_records = records;
+    }
+    flb_input_buf_write_end(i_ins);
 
     return 0;
 }
@@ -275,14 +245,13 @@ int in_kmsg_init(struct flb_input_instance *in,
         flb_free(ctx);
         return -1;
     }
-    ctx->buf_len = 0;
     ctx->buf_size = FLB_KMSG_BUF_SIZE;
 
     /* set context */
     flb_input_set_context(in, ctx);
 
     /* open device */
-    fd = open(FLB_KMSG_DEV, O_RDONLY);
+    fd = open(FLB_KMSG_DEV, O_RDONLY | O_NONBLOCK);
     if (fd == -1) {
         flb_errno();
         flb_free(ctx);
@@ -294,6 +263,8 @@ int in_kmsg_init(struct flb_input_instance *in,
     ret = boot_time(&ctx->boot_time);
     if (ret == -1) {
         flb_error("Could not get system boot time for kmsg input plugin");
+        close(fd);
+        flb_free(ctx->buf_data);
         flb_free(ctx);
         return -1;
     }
@@ -21,9 +21,11 @@
 #define FLB_IN_KMSG
 
 #include <stdint.h>
+#include <time.h>
 
 #define FLB_KMSG_DEV        "/dev/kmsg"
-#define FLB_KMSG_BUF_SIZE   4096
+/* Largest record, CONSOLE_EXT_LOG_MAX in the kernel */
+#define FLB_KMSG_BUF_SIZE   8192
 
 /* Alert levels, taken from util-linux sources */
 #define FLB_KLOG_EMERG      0
@@ -38,19 +40,17 @@
 #define FLB_KLOG_PRIMASK    0x07
 #define FLB_KLOG_PRI(p)     ((p) & FLB_KLOG_PRIMASK)
 
-#define KMSG_BUFFER_SIZE   256
+/* Records read on each wakeup, the rest waits for the next one */
+#define KMSG_READ_BUDGET   256
 #define KMSG_USEC_PER_SEC  1000000
 
 struct flb_in_kmsg_config {
     int fd;                    /* descriptor -> FLB_KMSG_DEV */
-    struct timeval boot_time;  /* System boot time           */
-
-    /* Line processing */
-    int buffer_id;
+    struct timespec boot_time; /* Realtime of the monotonic  */
+                               /* clock origin, per batch    */
 
     /* Buffer */
     char *buf_data;
-    size_t buf_len;
     size_t buf_size;
 };
 
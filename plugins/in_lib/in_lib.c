@@ -28,6 +28,7 @@
 #include <fluent-bit/flb_config.h>
 #include <fluent-bit/flb_pack.h>
 #include <fluent-bit/flb_error.h>
+#include <fluent-bit/flb_mem_pool.h>
 #include "in_lib.h"
 
 static int in_lib_collect(struct flb_input_instance *i_ins,
@@ -74,29 +75,122 @@ static int in_lib_collect(struct flb_input_instance *i_ins,
     ret = flb_pack_json_state(ctx->buf_data, ctx->buf_len,
                               &pack, &out_size, &ctx->state);
     if (ret == FLB_ERR_JSON_PART) {
-        flb_warn("lib data incomplete, waiting for more data...");
+        flb_debug("lib data incomplete, waiting for more data...");
         return 0;
     }
     else if (ret == FLB_ERR_JSON_INVAL) {
         flb_warn("lib data invalid");
         flb_pack_state_reset(&ctx->state);
         flb_pack_state_init(&ctx->state);
+        ctx->buf_len = 0;
         return -1;
     }
-    ctx->buf_len = 0;
+
+    /*
+     * A read(2) can end in the middle of a message pushed by the caller,
+     * keep the bytes after the last complete one for the next round.
+     */
+    ctx->buf_len -= ctx->state.last_byte;
+    memmove(ctx->buf_data, ctx->buf_data + ctx->state.last_byte,
+            ctx->buf_len);
 
     /* Mark the start of a 'buffer write' operation */
     flb_input_buf_write_start(i_ins);
-    ret = msgpack_sbuffer_write(&ctx->i_ins->mp_sbuf, pack, out_size);
+    ret = flb_mem_pool_sbuffer_write(&ctx->i_ins->mp_sbuf, pack, out_size);
     flb_input_buf_write_end(i_ins);
     flb_free(pack);
 
-    flb_pack_state_reset(&ctx->state);
-    flb_pack_state_init(&ctx->state);
-
     return ret;
 }
 
+/* Append the queued msgpack records to the instance buffer */
+static int in_lib_collect_mp(struct flb_input_instance *i_ins,
+                             struct flb_config *config, void *in_context)
+{
+    int ret;
+    char tmp[64];
+    struct mk_list *tmp_head;
+    struct mk_list *head;
+    struct mk_list queue;
+    struct flb_in_lib_mp *mp;
+    struct flb_in_lib_config *ctx = in_context;
+
+    ret = flb_pipe_r(ctx->ch_mp[0], tmp, sizeof(tmp));
+    if (ret == -1) {
+        flb_errno();
+        return -1;
+    }
+
+    /* Take the whole queue, the callers can keep pushing meanwhile */
+    mk_list_init(&queue);
+    pthread_mutex_lock(&ctx->mp_lock);
+    if (mk_list_is_empty(&ctx->mp_queue) != 0) {
+        mk_list_cat(&ctx->mp_queue, &queue);
+        mk_list_init(&ctx->mp_queue);
+    }
+    ctx->mp_bytes = 0;
+    pthread_mutex_unlock(&ctx->mp_lock);
+
+    flb_input_buf_write_start(i_ins);
+    mk_list_foreach_safe(head, tmp_head, &queue) {
+        mp = mk_list_entry(head, struct flb_in_lib_mp, _head);
+        flb_mem_pool_sbuffer_write(&i_ins->mp_sbuf, mp->buf, mp->size);
+        mk_list_del(&mp->_head);
+        flb_free(mp->buf);
+        flb_free(mp);
+    }
+    flb_input_buf_write_end(i_ins);
+
+    return 0;
+}
+
+/*
+ * Queue msgpack records pushed by the library caller, it runs in the
+ * caller thread. On success the buffer is owned by the plugin.
+ */
+static int in_lib_ingest(void *in_context, void *data, size_t size)
+{
+    int ret;
+    int empty;
+    char val = 1;
+    struct flb_in_lib_mp *mp;
+    struct flb_in_lib_config *ctx = in_context;
+
+    mp = flb_malloc(sizeof(struct flb_in_lib_mp));
+    if (!mp) {
+        flb_errno();
+        return -1;
+    }
+    mp->buf = data;
+    mp->size = size;
+
+    pthread_mutex_lock(&ctx->mp_lock);
+    if (ctx->mp_bytes + size > LIB_MP_QUEUE_MAX) {
+        pthread_mutex_unlock(&ctx->mp_lock);
+        flb_free(mp);
+        return -1;
+    }
+    empty = (mk_list_is_empty(&ctx->mp_queue) == 0);
+    mk_list_add(&mp->_head, &ctx->mp_queue);
+    ctx->mp_bytes += size;
+
+    /* Wake up the collector once per batch */
+    if (empty) {
+        ret = flb_pipe_w(ctx->ch_mp[1], &val, sizeof(val));
+        if (ret == -1) {
+            flb_errno();
+            mk_list_del(&mp->_head);
+            ctx->mp_bytes -= size;
+            pthread_mutex_unlock(&ctx->mp_lock);
+            flb_free(mp);
+            return -1;
+        }
+    }
+    pthread_mutex_unlock(&ctx->mp_lock);
+
+    return 0;
+}
+
 /* Initialize plugin */
 int in_lib_init(struct flb_input_instance *in,
                 struct flb_config *config, void *data)
@@ -142,6 +236,30 @@ int in_lib_init(struct flb_input_instance *in,
         return -1;
     }
 
+    /* Msgpack records queue */
+    mk_list_init(&ctx->mp_queue);
+    ctx->mp_bytes = 0;
+    pthread_mutex_init(&ctx->mp_lock, NULL);
+    ret = flb_pipe_create(ctx->ch_mp);
+    if (ret == -1) {
+        flb_errno();
+        flb_free(ctx->buf_data);
+        flb_free(ctx);
+        return -1;
+    }
+
+    ret = flb_input_set_collector_event(in,
+                                        in_lib_collect_mp,
+                                        ctx->ch_mp[0],
+                                        config);
+    if (ret == -1) {
+        flb_error("Could not set msgpack collector for LIB input plugin");
+        flb_pipe_destroy(ctx->ch_mp);
+        flb_free(ctx->buf_data);
+        flb_free(ctx);
+        return -1;
+    }
+
     flb_pack_state_init(&ctx->state);
     return 0;
 }
@@ -149,6 +267,9 @@ int in_lib_init(struct flb_input_instance *in,
 static int in_lib_exit(void *data, struct flb_config *config)
 {
     (void) config;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct flb_in_lib_mp *mp;
     struct flb_in_lib_config *ctx = data;
     struct flb_pack_state *s;
 
@@ -157,9 +278,16 @@ static int in_lib_exit(void *data, struct flb_config *config)
     }
 
     s = &ctx->state;
-    if (s->tokens) {
-        flb_free(s->tokens);
+    flb_pack_state_reset(s);
+
+    mk_list_foreach_safe(head, tmp, &ctx->mp_queue) {
+        mp = mk_list_entry(head, struct flb_in_lib_mp, _head);
+        mk_list_del(&mp->_head);
+        flb_free(mp->buf);
+        flb_free(mp);
     }
+    flb_pipe_destroy(ctx->ch_mp);
+    pthread_mutex_destroy(&ctx->mp_lock);
 
     flb_free(ctx);
     return 0;
@@ -172,7 +300,7 @@ struct flb_input_plugin in_lib_plugin = {
     .cb_init      = in_lib_init,
     .cb_pre_run   = NULL,
     .cb_collect   = NULL,
-    .cb_ingest    = NULL,
+    .cb_ingest    = in_lib_ingest,
     .cb_flush_buf = NULL,
     .cb_exit      = in_lib_exit
 };
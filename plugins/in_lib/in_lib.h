@@ -24,8 +24,22 @@
 #include <fluent-bit/flb_input.h>
 #include <fluent-bit/flb_pack.h>
 
+#include <fluent-bit/flb_pipe.h>
+
+#include <pthread.h>
+
 #define LIB_BUF_CHUNK   65536
 
+/* Msgpack bytes that can wait in the queue for the engine */
+#define LIB_MP_QUEUE_MAX  (64 * 1024 * 1024)
+
+/* Msgpack records pushed with flb_lib_push_msgpack() or _batch() */
+struct flb_in_lib_mp {
+    char *buf;
+    size_t size;
+    struct mk_list _head;
+};
+
 /* Library input configuration & context */
 struct flb_in_lib_config {
     int fd;                     /* instance input channel  */
@@ -33,6 +47,16 @@ struct flb_in_lib_config {
     int buf_len;                /* read buffer length      */
     char *buf_data;             /* the real buffer         */
 
+    /*
+     * Msgpack records don't go through the pipe: the buffers are queued by
+     * the caller thread and the pipe 'ch_mp' only wakes up the collector
+     * when the queue was empty.
+     */
+    flb_pipefd_t ch_mp[2];
+    size_t mp_bytes;            /* bytes in the queue      */
+    struct mk_list mp_queue;
+    pthread_mutex_t mp_lock;
+
     struct flb_pack_state state;
     struct flb_input_instance *i_ins;
 };
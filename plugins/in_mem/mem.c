@@ -42,6 +42,7 @@ struct flb_in_mem_config {
     int    interval_sec;
     int    interval_nsec;
     pid_t  pid;
+    struct flb_procfs_file *pid_stat;  /* /proc/PID/stat */
 };
 
 struct flb_in_mem_info {
@@ -130,6 +131,7 @@ static int in_mem_init(struct flb_input_instance *in,
     }
     ctx->idx = 0;
     ctx->pid = 0;
+    ctx->pid_stat = NULL;
     ctx->page_size = sysconf(_SC_PAGESIZE);
 
     /* Collection time setting */
@@ -146,6 +148,11 @@ static int in_mem_init(struct flb_input_instance *in,
     tmp = flb_input_get_property("pid", in);
     if (tmp) {
         ctx->pid = atoi(tmp);
+        ctx->pid_stat = proc_stat_open(ctx->pid);
+        if (!ctx->pid_stat) {
+            flb_warn("[in_mem] could not measure PID %i", ctx->pid);
+            ctx->pid = 0;
+        }
     }
 
     /* Set the context */
@@ -175,9 +182,11 @@ static int in_mem_collect(struct flb_input_instance *i_ins,
     struct flb_in_mem_info info;
 
     if (ctx->pid) {
-        task = proc_stat(ctx->pid, ctx->page_size);
+        task = proc_stat(ctx->pid_stat, ctx->page_size);
         if (!task) {
             flb_warn("[in_mem] could not measure PID %i", ctx->pid);
+            flb_procfs_file_close(ctx->pid_stat);
+            ctx->pid_stat = NULL;
             ctx->pid = 0;
         }
     }
@@ -250,7 +259,6 @@ static int in_mem_collect(struct flb_input_instance *i_ins,
     ++ctx->idx;
 
     flb_input_buf_write_end(i_ins);
-    flb_stats_update(in_mem_plugin.stats_fd, 0, 1);
     return 0;
 }
 
@@ -259,6 +267,10 @@ static int in_mem_exit(void *data, struct flb_config *config)
     (void) *config;
     struct flb_in_mem_config *ctx = data;
 
+    if (ctx->pid_stat) {
+        flb_procfs_file_close(ctx->pid_stat);
+    }
+
     /* done */
     flb_free(ctx);
 
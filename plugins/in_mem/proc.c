@@ -23,6 +23,7 @@
 #include <string.h>
 
 #include <fluent-bit/flb_input.h>
+#include <fluent-bit/flb_procfs.h>
 #include "proc.h"
 
 static char *human_readable_size(long size)
@@ -50,112 +51,89 @@ static char *human_readable_size(long size)
     return buf;
 }
 
-/* Read file content into a memory buffer */
-static char *file_to_buffer(const char *path)
+/* Open /proc/PID/stat, it's kept open and read again on every sample */
+struct flb_procfs_file *proc_stat_open(pid_t pid)
 {
-    FILE *fp;
-    char *buffer;
-    long bytes;
-
-    if (!(fp = fopen(path, "r"))) {
-        flb_errno();
-        return NULL;
-    }
-
-    buffer = flb_malloc(PROC_STAT_BUF_SIZE);
-    if (!buffer) {
-        fclose(fp);
-        flb_errno();
-        return NULL;
-    }
+    int ret;
+    char pid_path[PROC_PID_SIZE];
 
-    bytes = fread(buffer, PROC_STAT_BUF_SIZE, 1, fp);
-    if (bytes < 0) {
-        flb_free(buffer);
-        fclose(fp);
+    ret = snprintf(pid_path, PROC_PID_SIZE, "/proc/%i/stat", pid);
+    if (ret < 0) {
         flb_errno();
         return NULL;
     }
 
-    fclose(fp);
-    return buffer;
+    return flb_procfs_file_open(pid_path);
 }
 
-
-struct proc_task *proc_stat(pid_t pid, int page_size)
+struct proc_task *proc_stat(struct flb_procfs_file *file, int page_size)
 {
-    int ret;
-    char *p, *q;
+    char *p;
+    char *q;
     char *buf;
-    char pid_path[PROC_PID_SIZE];
+    size_t len;
     struct proc_task *t;
 
-    t = flb_calloc(1, sizeof(struct proc_task));
-    if (!t) {
-        flb_errno();
+    buf = flb_procfs_file_read(file, NULL);
+    if (!buf) {
         return NULL;
     }
 
-    /* Compose path for /proc/PID/stat */
-    ret = snprintf(pid_path, PROC_PID_SIZE, "/proc/%i/stat", pid);
-    if (ret < 0) {
+    t = flb_calloc(1, sizeof(struct proc_task));
+    if (!t) {
         flb_errno();
         return NULL;
     }
 
-    buf = file_to_buffer(pid_path);
-    if (!buf) {
-        flb_free(t);
-        return NULL;
-    }
-
-    sscanf(buf, "%d", &t->pid);
+    p = buf;
+    t->pid = flb_procfs_u64(&p);
 
     /*
-     * workaround for process with spaces in the name, so we dont screw up
-     * sscanf(3).
+     * The process name can have spaces and parenthesis, it ends on the
+     * last ')' of the line.
      */
-    p = buf;
-    while (*p != '(') {
-        p++;
+    p = strchr(p, '(');
+    q = strrchr(buf, ')');
+    if (!p || !q || q < p) {
+        flb_free(t);
+        return NULL;
     }
     p++;
-
-    q = p;
-    while (*q != ')') q++;
-    strncpy(t->comm, p, q - p);
+    len = q - p;
+    if (len > sizeof(t->comm) - 1) {
+        len = sizeof(t->comm) - 1;
+    }
+    strncpy(t->comm, p, len);
     q += 2;
 
     /* Read pending values */
-    sscanf(q, PROC_STAT_FORMAT,
-           &t->state,
-           &t->ppid,
-           &t->pgrp,
-           &t->session,
-           &t->tty_nr,
-           &t->tpgid,
-           &t->flags,
-           &t->minflt,
-           &t->cminflt,
-           &t->majflt,
-           &t->cmajflt,
-           &t->utime,
-           &t->stime,
-           &t->cutime,
-           &t->cstime,
-           &t->priority,
-           &t->nice,
-           &t->num_threads,
-           &t->itrealvalue,
-           &t->starttime,
-           &t->vsize,
-           &t->rss);
+    t->state = *q++;
+    t->ppid        = flb_procfs_i64(&q);
+    t->pgrp        = flb_procfs_i64(&q);
+    t->session     = flb_procfs_i64(&q);
+    t->tty_nr      = flb_procfs_i64(&q);
+    t->tpgid       = flb_procfs_i64(&q);
+    t->flags       = flb_procfs_u64(&q);
+    t->minflt      = flb_procfs_u64(&q);
+    t->cminflt     = flb_procfs_u64(&q);
+    t->majflt      = flb_procfs_u64(&q);
+    t->cmajflt     = flb_procfs_u64(&q);
+    t->utime       = flb_procfs_u64(&q);
+    t->stime       = flb_procfs_u64(&q);
+    t->cutime      = flb_procfs_i64(&q);
+    t->cstime      = flb_procfs_i64(&q);
+    t->priority    = flb_procfs_i64(&q);
+    t->nice        = flb_procfs_i64(&q);
+    t->num_threads = flb_procfs_i64(&q);
+    t->itrealvalue = flb_procfs_i64(&q);
+    t->starttime   = flb_procfs_u64(&q);
+    t->vsize       = flb_procfs_u64(&q);
+    t->rss         = flb_procfs_i64(&q);
 
     /* Internal conversion */
     t->proc_rss    = (t->rss * page_size);
     t->proc_rss_hr = human_readable_size(t->proc_rss);
 
-    flb_free(buf);
     return t;
 }
 
@@ -20,15 +20,10 @@
 #ifndef IN_MEM_PROC_H
 #define IN_MEM_PROC_H
 
-#define PROC_PID_SIZE      1024
-#define PROC_STAT_BUF_SIZE 1024
+#include <sys/types.h>
+#include <fluent-bit/flb_procfs.h>
 
-/*
- * This 'stat' format omits the first two fields, due to the nature
- * of sscanf(3) and whitespaces, programs with spaces in the name can
- * screw up when scanning the information.
- */
-#define PROC_STAT_FORMAT "%c %d %d %d %d %d %lu %lu %lu %lu %lu %lu %lu %ld %ld %ld %ld %ld %ld %lu %lu %ld"
+#define PROC_PID_SIZE      1024
 
 /* Our tast struct to read the /proc/PID/stat values */
 struct proc_task {
@@ -62,7 +57,8 @@ struct proc_task {
     char   *proc_rss_hr;       /* RSS in human readable format  */
 };
 
-struct proc_task *proc_stat(pid_t pid, int page_size);
+struct flb_procfs_file *proc_stat_open(pid_t pid);
+struct proc_task *proc_stat(struct flb_procfs_file *file, int page_size);
 void proc_free(struct proc_task *t);
 
 #endif
@@ -38,7 +38,6 @@ static int in_mqtt_init(struct flb_input_instance *in,
     if (!ctx) {
         return -1;
     }
-    ctx->msgp_len = 0;
 
     /* Set the context */
     flb_input_set_context(in, ctx);
@@ -117,5 +116,5 @@ struct flb_input_plugin in_mqtt_plugin = {
     .cb_collect   = in_mqtt_collect,
     .cb_flush_buf = NULL,
     .cb_exit      = in_mqtt_exit,
-    .flags        = FLB_INPUT_NET,
+    .flags        = FLB_INPUT_NET | FLB_INPUT_DYN_TAG,
 };
@@ -20,7 +20,9 @@
 #ifndef FLB_IN_MQTT_H
 #define FLB_IN_MQTT_H
 
-#define MQTT_MSGP_BUF_SIZE 8192
+/* Connection buffer defaults */
+#define MQTT_BUFFER_CHUNK  4096              /* 4KB */
+#define MQTT_BUFFER_MAX    (1024 * 1024)     /* 1MB */
 
 struct flb_in_mqtt_config {
     int server_fd;                     /* TCP server file descriptor  */
@@ -28,8 +30,9 @@ struct flb_in_mqtt_config {
     char *listen;                      /* Listen interface            */
     char *tcp_port;                    /* TCP Port                    */
 
-    int msgp_len;                      /* msgpack data length         */
-    char msgp[MQTT_MSGP_BUF_SIZE];     /* msgpack static buffer       */
+    int tag_from_topic;                /* Records tagged by topic     */
+    size_t buffer_chunk_size;          /* Connection buffer increment */
+    size_t buffer_max_size;            /* Max size of a packet        */
     struct flb_input_instance *i_ins;  /* plugin input instance       */
     struct mk_event_loop *evl;         /* Event loop file descriptor  */
 };
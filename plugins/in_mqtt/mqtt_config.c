@@ -28,6 +28,7 @@ struct flb_in_mqtt_config *mqtt_config_init(struct flb_input_instance *i_ins)
 {
     char tmp[16];
     char *listen;
+    char *p;
     struct flb_in_mqtt_config *config;
 
     config = flb_malloc(sizeof(struct flb_in_mqtt_config));
@@ -44,7 +45,7 @@ struct flb_in_mqtt_config *mqtt_config_init(struct flb_input_instance *i_ins)
         }
     }
     else {
-        config->listen = i_ins->host.listen;
+        config->listen = flb_strdup(i_ins->host.listen);
     }
 
     /* Listener TCP Port */
@@ -56,6 +57,32 @@ struct flb_in_mqtt_config *mqtt_config_init(struct flb_input_instance *i_ins)
         config->tcp_port = flb_strdup(tmp);
     }
 
+    /* Connection buffer, it grows up to the largest packet */
+    p = flb_input_get_property("buffer_chunk_size", i_ins);
+    if (p && flb_utils_size_to_bytes(p) > 0) {
+        config->buffer_chunk_size = flb_utils_size_to_bytes(p);
+    }
+    else {
+        config->buffer_chunk_size = MQTT_BUFFER_CHUNK;
+    }
+
+    p = flb_input_get_property("buffer_max_size", i_ins);
+    if (p && flb_utils_size_to_bytes(p) > 0) {
+        config->buffer_max_size = flb_utils_size_to_bytes(p);
+    }
+    else {
+        config->buffer_max_size = MQTT_BUFFER_MAX;
+    }
+    if (config->buffer_max_size < config->buffer_chunk_size) {
+        config->buffer_max_size = config->buffer_chunk_size;
+    }
+
+    /* The topic of a message is the tag of its record */
+    p = flb_input_get_property("tag_from_topic", i_ins);
+    if (p) {
+        config->tag_from_topic = flb_utils_bool(p);
+    }
+
     flb_debug("[in_mqtt] Listen='%s' TCP_Port=%s",
               config->listen, config->tcp_port);
 
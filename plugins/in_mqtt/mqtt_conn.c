@@ -31,12 +31,38 @@ int mqtt_conn_event(void *data)
     int ret;
     int bytes;
     int available;
+    int size;
+    unsigned char *tmp;
     struct mk_event *event;
     struct mqtt_conn *conn = data;
+    struct flb_in_mqtt_config *ctx = conn->ctx;
 
     event = &conn->event;
     if (event->mask & MK_EVENT_READ) {
-        available = sizeof(conn->buf) - conn->buf_len;
+        /* The buffer is full with a partial packet */
+        available = conn->buf_size - conn->buf_len;
+        if (available < 1) {
+            if (conn->buf_size >= ctx->buffer_max_size) {
+                flb_warn("[in_mqtt] [fd=%i] packet exceeds buffer_max_size "
+                         "(%lu bytes)", event->fd, ctx->buffer_max_size);
+                mqtt_conn_del(conn);
+                return -1;
+            }
+
+            size = conn->buf_size * 2;
+            if (size > ctx->buffer_max_size) {
+                size = ctx->buffer_max_size;
+            }
+            tmp = flb_realloc(conn->buf, size);
+            if (!tmp) {
+                flb_errno();
+                mqtt_conn_del(conn);
+                return -1;
+            }
+            conn->buf = tmp;
+            conn->buf_size = size;
+            available = conn->buf_size - conn->buf_len;
+        }
 
         bytes = read(conn->fd,
                      conn->buf + conn->buf_len, available);
@@ -85,16 +111,24 @@ struct mqtt_conn *mqtt_conn_add(int fd, struct flb_in_mqtt_config *ctx)
     /* Connection info */
     conn->fd      = fd;
     conn->ctx     = ctx;
-    conn->buf_pos = 0;
     conn->buf_len = 0;
-    conn->buf_frame_end = 0;
     conn->status  = MQTT_NEW;
 
+    conn->buf = flb_malloc(ctx->buffer_chunk_size);
+    if (!conn->buf) {
+        flb_errno();
+        close(fd);
+        flb_free(conn);
+        return NULL;
+    }
+    conn->buf_size = ctx->buffer_chunk_size;
+
     /* Register instance into the event loop */
     ret = mk_event_add(ctx->evl, fd, FLB_ENGINE_EV_CUSTOM, MK_EVENT_READ, conn);
     if (ret == -1) {
         flb_error("[mqtt] could not register new connection");
         close(fd);
+        flb_free(conn->buf);
         flb_free(conn);
         return NULL;
     }
@@ -109,6 +143,7 @@ int mqtt_conn_del(struct mqtt_conn *conn)
 
     /* Release resources */
     close(conn->fd);
+    flb_free(conn->buf);
     flb_free(conn);
 
     return 0;
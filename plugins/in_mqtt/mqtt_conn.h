@@ -31,12 +31,9 @@ struct mqtt_conn {
     struct mk_event event;           /* Built-in event data for mk_events */
     int fd;                          /* Socket file descriptor            */
     int status;                      /* Connection status                 */
-    int packet_type;                 /* MQTT packet type                  */
-    int packet_length;
-    int  buf_frame_end;              /* Frame end position                */
-    int  buf_pos;                    /* Index position                    */
     int  buf_len;                    /* Buffer content length             */
-    unsigned char buf[1024];         /* Buffer data                       */
+    int  buf_size;                   /* Buffer size                       */
+    unsigned char *buf;              /* Buffer data                       */
     struct flb_in_mqtt_config *ctx;  /* Plugin configuration context      */
 };
 
@@ -20,65 +20,34 @@
 #include <fluent-bit/flb_info.h>
 #include <fluent-bit/flb_input.h>
 #include <fluent-bit/flb_config.h>
-#include <fluent-bit/flb_pack.h>
+#include <fluent-bit/flb_json.h>
+#include <fluent-bit/flb_mp.h>
+#include <fluent-bit/flb_time.h>
 #include <fluent-bit/flb_utils.h>
 
 #include <msgpack.h>
 
-
 #include "mqtt.h"
 #include "mqtt_prot.h"
 
-#define BUFC()          conn->buf[conn->buf_pos]
-#define BUF_AVAIL()     conn->buf_len - conn->buf_pos
 #define BIT_SET(a, b)   ((a) |= (1 << (b)))
-#define BIT_CHECK(a, b) ((a) & (1 << (b)))
 
-/*
-static inline void print_hex(struct mqtt_conn *conn)
-{
-    int x;
-
-    printf("\n--------HEX--------> ");
-    printf("buf_pos=%i buf_len=%i\n", conn->buf_pos, conn->buf_len);
-    for (x = conn->buf_pos; x < conn->buf_len; x++) {
-        printf("%x ", conn->buf[x]);
-    }
-    printf("\n--------------------\n\n");
-}
-
-static inline void print_str(struct mqtt_conn *conn)
-{
-    int x;
-
-    printf("\n--------HEX--------> ");
-    printf("buf_pos=%i buf_len=%i\n", conn->buf_pos, conn->buf_len);
-    for (x = conn->buf_pos; x < conn->buf_len; x++) {
-        printf("%c", conn->buf[x]);
-    }
-    printf("\n--------------------\n\n");
-}
-*/
+/* Acknowledges queued during one read, written at once */
+#define MQTT_ACKS_SIZE  256
 
 /*
- * It drop the current packet from the buffer, it move the remaining bytes
- * from right-to-left and adjust the new length.
+ * State of one pass over the connection buffer: the records of consecutive
+ * PUBLISH packets with the same tag are packed in a single buffer write.
  */
-static inline int mqtt_packet_drop(struct mqtt_conn *conn)
-{
-    int move_bytes;
-
-    move_bytes = conn->buf_pos + 1;
-    memmove(conn->buf,
-            conn->buf + move_bytes,
-            conn->buf_len - move_bytes);
-
-    conn->buf_frame_end = 0;
-    conn->buf_len -= move_bytes;
-    conn->buf_pos  = 0;
-
-    return 0;
-}
+struct mqtt_batch {
+    struct flb_time tm;
+    char *tag;
+    int tag_len;
+    int records;
+    struct flb_input_dyntag *dt;
+    int acks_len;
+    char acks[MQTT_ACKS_SIZE];
+};
 
 /*
  * It writes the packet control header which includes the packet type
@@ -108,68 +77,146 @@ static inline int mqtt_packet_header(int type, int length, char *buf)
     return i;
 }
 
-/* Collect a buffer of JSON data and convert it to Fluent Bit format */
-static int mqtt_data_append(char *topic, size_t topic_len,
-                            char *msg, int msg_len,
-                            void *in_context)
+static int mqtt_acks_flush(struct mqtt_conn *conn, struct mqtt_batch *batch)
 {
-    int i;
     int ret;
-    int n_size;
-    size_t out;
-    size_t off = 0;
-    char *pack;
-    msgpack_object root;
-    msgpack_unpacked result;
-    struct flb_in_mqtt_config *ctx = in_context;
-
-    /* Convert our incoming JSON to MsgPack */
-    ret = flb_pack_json(msg, msg_len, &pack, &out);
-    if (ret != 0) {
-        flb_warn("MQTT Packet incomplete or is not JSON");
-        return -1;
+
+    if (batch->acks_len == 0) {
+        return 0;
     }
 
-    off = 0;
-    msgpack_unpacked_init(&result);
-    if (!msgpack_unpack_next(&result, pack, out, &off)) {
-        msgpack_unpacked_destroy(&result);
-        return -1;
+    ret = write(conn->event.fd, batch->acks, batch->acks_len);
+    batch->acks_len = 0;
+    return ret;
+}
+
+/* Queue a PUBACK, PUBREC or PUBCOMP reply for a packet identifier */
+static void mqtt_ack(struct mqtt_conn *conn, struct mqtt_batch *batch,
+                     int type, uint16_t packet_id)
+{
+    char *buf;
+
+    if (batch->acks_len + 4 > MQTT_ACKS_SIZE) {
+        mqtt_acks_flush(conn, batch);
     }
 
-    if (result.data.type != MSGPACK_OBJECT_MAP){
-        msgpack_unpacked_destroy(&result);
-        return -1;
+    buf = batch->acks + batch->acks_len;
+    mqtt_packet_header(type, 2, buf);
+    buf[2] = (packet_id >> 8);
+    buf[3] = (packet_id & 0xff);
+    batch->acks_len += 4;
+}
+
+/* Close the buffer write of the current tag */
+static void mqtt_batch_end(struct mqtt_batch *batch,
+                           struct flb_in_mqtt_config *ctx)
+{
+    struct flb_input_dyntag *dt = batch->dt;
+
+    if (!dt) {
+        return;
     }
-    root = result.data;
 
-    /* Mark the start of a 'buffer write' operation */
-    flb_input_buf_write_start(ctx->i_ins);
+    dt->mp_buf_write_records = batch->records;
+    flb_input_dbuf_write_end(dt);
 
-    msgpack_pack_array(&ctx->i_ins->mp_pck, 2);
-    flb_pack_time_now(&ctx->i_ins->mp_pck);
+    /* Seal full buffers, no more data can be appended */
+    if (flb_input_chunk_full(ctx->i_ins, dt->mp_sbuf.size,
+                             dt->mp_index.records) == FLB_TRUE) {
+        dt->lock = FLB_TRUE;
+        flb_input_chunk_seal(ctx->i_ins, dt);
+    }
 
-    n_size = root.via.map.size;
-    msgpack_pack_map(&ctx->i_ins->mp_pck, n_size + 1);
-    msgpack_pack_str(&ctx->i_ins->mp_pck, 5);
-    msgpack_pack_str_body(&ctx->i_ins->mp_pck, "topic", 5);
-    msgpack_pack_str(&ctx->i_ins->mp_pck, topic_len);
-    msgpack_pack_str_body(&ctx->i_ins->mp_pck, topic, topic_len);
+    batch->dt = NULL;
+    batch->records = 0;
+}
 
-    /* Re-pack original KVs */
-    for (i = 0; i < n_size; i++) {
-        msgpack_pack_object(&ctx->i_ins->mp_pck, root.via.map.ptr[i].key);
-        msgpack_pack_object(&ctx->i_ins->mp_pck, root.via.map.ptr[i].val);
+/* Buffer of a tag, the current one is kept while the tag repeats */
+static struct flb_input_dyntag *mqtt_batch_get(struct mqtt_batch *batch,
+                                               struct flb_in_mqtt_config *ctx,
+                                               char *tag, int tag_len)
+{
+    if (batch->dt && batch->tag_len == tag_len &&
+        memcmp(batch->tag, tag, tag_len) == 0) {
+        return batch->dt;
     }
 
-    /* End of buffer write */
-    flb_input_buf_write_end(ctx->i_ins);
+    mqtt_batch_end(batch, ctx);
 
-    msgpack_unpacked_destroy(&result);
-    flb_free(pack);
-    return 0;
+    batch->dt = flb_input_dyntag_get(tag, tag_len, ctx->i_ins);
+    if (!batch->dt) {
+        return NULL;
+    }
+    flb_input_dbuf_write_start(batch->dt);
+    batch->tag = tag;
+    batch->tag_len = tag_len;
+
+    return batch->dt;
 }
 
+/*
+ * Pack a JSON map payload as a record with the 'topic' key first. The
+ * payload is parsed where it sits in the connection buffer and the packed
+ * map body is copied as it is.
+ */
+static int mqtt_data_append(struct mqtt_conn *conn, struct mqtt_batch *batch,
+                            char *topic, int topic_len,
+                            char *msg, int msg_len)
+{
+    int ret;
+    int len;
+    char *out;
+    char hdr_buf[5];
+    size_t out_size;
+    size_t hdr;
+    uint32_t count;
+    struct flb_input_dyntag *dt;
+    struct flb_in_mqtt_config *ctx = conn->ctx;
+    msgpack_packer *mp_pck;
+
+    ret = flb_json_parse(msg, msg_len, &out, &out_size);
+    if (ret <= 0) {
+        flb_warn("[in_mqtt] [fd=%i] MQTT packet payload is not JSON",
+                 conn->event.fd);
+        return -1;
+    }
+
+    if (ret != 1 ||
+        flb_mp_map_header(out, out_size, &count, &hdr) == -1) {
+        flb_warn("[in_mqtt] [fd=%i] MQTT packet payload is not a JSON map",
+                 conn->event.fd);
+        flb_free(out);
+        return -1;
+    }
+
+    if (ctx->tag_from_topic == FLB_TRUE) {
+        dt = mqtt_batch_get(batch, ctx, topic, topic_len);
+    }
+    else {
+        dt = mqtt_batch_get(batch, ctx,
+                            ctx->i_ins->tag, ctx->i_ins->tag_len);
+    }
+    if (!dt) {
+        flb_free(out);
+        return -1;
+    }
+    mp_pck = &dt->mp_pck;
+
+    msgpack_pack_array(mp_pck, 2);
+    flb_time_append_to_msgpack(&batch->tm, mp_pck, 0);
+
+    len = flb_mp_map_header_write(hdr_buf, count + 1);
+    mp_pck->callback(mp_pck->data, hdr_buf, len);
+    msgpack_pack_str(mp_pck, 5);
+    msgpack_pack_str_body(mp_pck, "topic", 5);
+    msgpack_pack_str(mp_pck, topic_len);
+    msgpack_pack_str_body(mp_pck, topic, topic_len);
+    mp_pck->callback(mp_pck->data, out + hdr, out_size - hdr);
+    batch->records++;
+
+    flb_free(out);
+    return 0;
+}
 
 /*
  * Handle a CONNECT request control packet:
@@ -196,193 +243,189 @@ static int mqtt_handle_connect(struct mqtt_conn *conn)
 }
 
 /*
- * Handle a PUBLISH control packet
+ * Handle a PUBLISH control packet, 'buf' points to the variable header and
+ * 'length' is the remaining length of the packet.
  */
-static int mqtt_handle_publish(struct mqtt_conn *conn)
+static int mqtt_handle_publish(struct mqtt_conn *conn,
+                               struct mqtt_batch *batch, uint8_t flags,
+                               unsigned char *buf, int length)
 {
-    int topic;
+    int pos;
     int topic_len;
     uint8_t qos;
-    uint16_t hlen;
     uint16_t packet_id;
-    char buf[4];
 
     /*
      * DUP: we skip duplicated messages.
      * QOS: We process this.
      * Retain: skipped
      */
-
-    qos = ((conn->buf[0] >> 1) & 0x03);
-    conn->buf_pos++;
+    qos = ((flags >> 1) & 0x03);
+    if (qos > MQTT_QOS_LEV2 || length < 2) {
+        return MQTT_ERROR;
+    }
 
     /* Topic */
-    hlen = BUFC() << 8;
-    conn->buf_pos++;
-    hlen |= BUFC();
-    conn->buf_pos++;
-    topic     = conn->buf_pos;
-    topic_len = hlen;
-    conn->buf_pos += hlen;
+    topic_len = (buf[0] << 8) | buf[1];
+    pos = 2 + topic_len;
+    if (pos > length) {
+        return MQTT_ERROR;
+    }
 
     /* Check QOS flag and respond if required */
     if (qos > MQTT_QOS_LEV0) {
+        if (pos + 2 > length) {
+            return MQTT_ERROR;
+        }
+
         /* Packet Identifier */
-        packet_id = BUFC() << 8;
-        conn->buf_pos++;
-        packet_id |= BUFC();
-        conn->buf_pos++;
+        packet_id = (buf[pos] << 8) | buf[pos + 1];
+        pos += 2;
 
         if (qos == MQTT_QOS_LEV1) {
-            mqtt_packet_header(MQTT_PUBACK, 2 , (char *) &buf);
+            mqtt_ack(conn, batch, MQTT_PUBACK, packet_id);
         }
-        else if (qos == MQTT_QOS_LEV2) {
-            mqtt_packet_header(MQTT_PUBREC, 2 , (char *) &buf);
+        else {
+            mqtt_ack(conn, batch, MQTT_PUBREC, packet_id);
         }
-        /* Set the identifier that we are replying to */
-        buf[2] = (packet_id & 0xf0) >> 4;
-        buf[3] = (packet_id & 0xf);
-        write(conn->event.fd, buf, 4);
     }
 
     /* Message */
-    mqtt_data_append((char *) (conn->buf + topic), topic_len,
-                     (char *) (conn->buf + conn->buf_pos),
-                     conn->buf_frame_end - conn->buf_pos + 1,
-                     conn->ctx);
+    mqtt_data_append(conn, batch,
+                     (char *) buf + 2, topic_len,
+                     (char *) buf + pos, length - pos);
 
-    flb_trace("[in_mqtt] [fd=%i] CMD PUBLISH",
-              conn->event.fd);
-    return 0;
+    flb_trace("[in_mqtt] [fd=%i] CMD PUBLISH", conn->event.fd);
+    return MQTT_OK;
 }
 
-/* Handle a PINGREQ control packet */
-static int mqtt_handle_ping(struct mqtt_conn *conn)
+/* Handle a PUBREL control packet, the QoS 2 flow ends with PUBCOMP */
+static int mqtt_handle_pubrel(struct mqtt_conn *conn,
+                              struct mqtt_batch *batch,
+                              unsigned char *buf, int length)
 {
-    int ret;
-    char buf[2] = {0, 0};
+    uint16_t packet_id;
 
-    mqtt_packet_header(MQTT_PINGRESP, 2 , (char *) &buf);
+    if (length < 2) {
+        return MQTT_ERROR;
+    }
 
-    /* write PINGRESP message */
-    ret = write(conn->event.fd, buf, 2);
+    packet_id = (buf[0] << 8) | buf[1];
+    mqtt_ack(conn, batch, MQTT_PUBCOMP, packet_id);
 
-    flb_trace("[in_mqtt] [fd=%i] CMD PING (pong=%i bytes)",
-              conn->event.fd, ret);
-    return ret;
+    flb_trace("[in_mqtt] [fd=%i] CMD PUBREL", conn->event.fd);
+    return MQTT_OK;
 }
 
+/* Handle a PINGREQ control packet */
+static int mqtt_handle_ping(struct mqtt_conn *conn, struct mqtt_batch *batch)
+{
+    if (batch->acks_len + 2 > MQTT_ACKS_SIZE) {
+        mqtt_acks_flush(conn, batch);
+    }
+
+    /* PINGRESP has no remaining length */
+    batch->acks_len += mqtt_packet_header(MQTT_PINGRESP, 0,
+                                          batch->acks + batch->acks_len);
+
+    flb_trace("[in_mqtt] [fd=%i] CMD PING", conn->event.fd);
+    return MQTT_OK;
+}
+
+/*
+ * Process every complete control packet in the connection buffer. The
+ * packets are handled where they are, the remaining partial packet is moved
+ * to the start of the buffer once the pass is done.
+ */
 int mqtt_prot_parser(struct mqtt_conn *conn)
 {
-    int bytes = 0;
-    int length = 0;
-    int pos = conn->buf_pos;
+    int i;
+    int ret = MQTT_OK;
+    int type;
     int mult;
+    int length;
+    int off = 0;
+    int pos;
+    unsigned char *buf = conn->buf;
+    struct mqtt_batch batch;
+
+    batch.dt = NULL;
+    batch.records = 0;
+    batch.acks_len = 0;
+    flb_time_get(&batch.tm);
+
+    while (off + 2 <= conn->buf_len) {
+        /* As the connection is new we expect a MQTT_CONNECT request */
+        type = buf[off] >> 4;
+        if (conn->status == MQTT_NEW && type != MQTT_CONNECT) {
+            flb_trace("[in_mqtt] [fd=%i] error, expecting MQTT_CONNECT",
+                      conn->event.fd);
+            ret = MQTT_ERROR;
+            break;
+        }
 
-    for (; conn->buf_pos < conn->buf_len; conn->buf_pos++) {
-        if (conn->status & (MQTT_NEW | MQTT_NEXT)) {
-            /*
-             * Do we have at least the Control Packet fixed header
-             * and the remaining length byte field ?
-             */
-            if (BUF_AVAIL() < 2) {
-                conn->buf_pos = pos;
-                flb_trace("[in_mqtt] [fd=%i] Need more data at %s:%i",
-                          conn->event.fd, __FILENAME__, __LINE__);
-                return MQTT_MORE;
-            }
-
-            /* As the connection is new we expect a MQTT_CONNECT request */
-            conn->packet_type = BUFC() >> 4;
-            if (conn->status == MQTT_NEW && conn->packet_type != MQTT_CONNECT) {
-                flb_trace("[in_mqtt] [fd=%i] error, expecting MQTT_CONNECT",
-                          conn->event.fd);
-                return MQTT_ERROR;
-            }
-            conn->packet_length = conn->buf_pos;
-            conn->buf_pos++;
-
-            /* Get the remaining length */
-            mult   = 1;
-            length = 0;
-            bytes  = 0;
-            do {
-                if (conn->buf_pos + 1 > conn->buf_len) {
-                    conn->buf_pos = pos;
-                    flb_trace("[in_mqtt] [fd=%i] Need more data at %s:%i",
-                              conn->event.fd, __FILENAME__, __LINE__);
-                    return MQTT_MORE;
-                }
-
-                bytes++;
-                length += (BUFC() & 127) * mult;
-                mult *= 128;
-                if (mult > 128*128*128) {
-                    return MQTT_ERROR;
-                }
-
-                if (length + 2 > (conn->buf_len - pos)) {
-                    conn->buf_pos = pos;
-                    flb_trace("[in_mqtt] [fd=%i] Need more data at %s:%i",
-                              conn->event.fd, __FILENAME__, __LINE__);
-                    return MQTT_MORE;
-                }
-
-                if ((BUFC() & 128) == 0) {
-                    if (conn->buf_len - 2 < length) {
-                        conn->buf_pos = pos;
-                        flb_trace("[in_mqtt] [fd=%i] Need more data at %s:%i",
-                                  conn->event.fd, __FILENAME__, __LINE__);
-                        return MQTT_MORE;
-                    }
-                    else {
-                        conn->buf_frame_end = conn->buf_pos + length;
-                        break;
-                    }
-                }
-
-                if (conn->buf_pos + 1 < conn->buf_len) {
-                    conn->buf_pos++;
-                }
-                else {
-                    conn->buf_pos = pos;
-                    flb_trace("[in_mqtt] [fd=%i] Need more data at %s:%i",
-                              conn->event.fd, __FILENAME__, __LINE__);
-                    return MQTT_MORE;
-                }
-            } while (1);
-
-            conn->buf_pos += bytes - 1;
-            conn->packet_length = length;
-
-            /* At this point we have a full control packet in place */
-            if (conn->packet_type == MQTT_CONNECT) {
-                mqtt_handle_connect(conn);
-            }
-            else if (conn->packet_type == MQTT_PUBLISH) {
-                mqtt_handle_publish(conn);
-            }
-            else if (conn->packet_type == MQTT_PINGREQ) {
-                mqtt_handle_ping(conn);
-            }
-            else if (conn->packet_type == MQTT_DISCONNECT) {
-                flb_trace("[in_mqtt] [fd=%i] CMD DISCONNECT",
-                          conn->event.fd);
-                return MQTT_HANGUP;
-            }
-            else {
+        /* Remaining length, up to 4 bytes */
+        pos = off + 1;
+        mult = 1;
+        length = 0;
+        for (i = 0; i < 4 && pos < conn->buf_len; i++) {
+            length += (buf[pos] & 127) * mult;
+            mult *= 128;
+            if ((buf[pos++] & 128) == 0) {
+                break;
             }
+        }
+        if (i == 4) {
+            ret = MQTT_ERROR;
+            break;
+        }
+        if ((buf[pos - 1] & 128) || pos + length > conn->buf_len) {
+            flb_trace("[in_mqtt] [fd=%i] Need more data at %s:%i",
+                      conn->event.fd, __FILENAME__, __LINE__);
+            ret = MQTT_MORE;
+            break;
+        }
 
-            /* Prepare for next round */
+        /* At this point we have a full control packet in place */
+        if (type == MQTT_CONNECT) {
+            mqtt_handle_connect(conn);
             conn->status = MQTT_NEXT;
-            conn->buf_pos = conn->buf_frame_end;
-            mqtt_packet_drop(conn);
+        }
+        else if (type == MQTT_PUBLISH) {
+            ret = mqtt_handle_publish(conn, &batch, buf[off] & 0x0f,
+                                      buf + pos, length);
+        }
+        else if (type == MQTT_PUBREL) {
+            ret = mqtt_handle_pubrel(conn, &batch, buf + pos, length);
+        }
+        else if (type == MQTT_PINGREQ) {
+            ret = mqtt_handle_ping(conn, &batch);
+        }
+        else if (type == MQTT_DISCONNECT) {
+            flb_trace("[in_mqtt] [fd=%i] CMD DISCONNECT",
+                      conn->event.fd);
+            ret = MQTT_HANGUP;
+        }
+        if (ret != MQTT_OK) {
+            break;
+        }
 
-            if (conn->buf_len > 0) {
-                conn->buf_pos = -1;
-            }
+        off = pos + length;
+    }
+
+    mqtt_batch_end(&batch, conn->ctx);
+    mqtt_acks_flush(conn, &batch);
+
+    /* Keep the partial packet */
+    if (off > 0) {
+        if (off < conn->buf_len) {
+            memmove(buf, buf + off, conn->buf_len - off);
         }
+        conn->buf_len -= off;
     }
-    conn->buf_pos--;
-    return 0;
+
+    if (ret == MQTT_MORE) {
+        return MQTT_OK;
+    }
+    return ret;
 }
@@ -21,6 +21,7 @@
 #include <fluent-bit/flb_config.h>
 #include <fluent-bit/flb_utils.h>
 #include <fluent-bit/flb_pack.h>
+#include <fluent-bit/flb_procfs.h>
 #include <msgpack.h>
 
 #include <stdio.h>
@@ -47,8 +48,12 @@ struct entry_define entry_name_linux[] = {
     {"tx.compressepd", FLB_FALSE}
 };
 
-static int config_destroy(struct flb_in_netif_config *ctx)
+static int config_destroy(struct flb_in_netif_config *ctx,
+                          struct flb_config *config)
 {
+    if (ctx->dev) {
+        flb_procfs_put(config, ctx->dev);
+    }
     flb_free(ctx->entry);
     flb_free(ctx);
     return 0;
@@ -61,7 +66,7 @@ static int in_netif_exit(void *data, struct flb_config *config)
     struct flb_in_netif_config *ctx = data;
 
     /* Destroy context */
-    config_destroy(ctx);
+    config_destroy(ctx, config);
 
     return 0;
 }
@@ -143,53 +148,40 @@ static int configure(struct flb_in_netif_config *ctx,
     return 0;
 }
 
-static inline int is_specific_interface(struct flb_in_netif_config *ctx,
-                                        char* interface)
-{
-    if (ctx->interface != NULL && !strncmp(ctx->interface, interface, ctx->interface_len)) {
-        return FLB_TRUE;
-    }
-    return FLB_FALSE;
-}
-
-static int parse_proc_line(char *line,
-                           struct flb_in_netif_config *ctx)
+/*
+ * /proc/net/dev, after two header lines one line per interface:
+ *
+ *   name: rx_bytes rx_packets ... tx_bytes tx_packets ...
+ *
+ * the counters can follow the colon without a space.
+ */
+static int parse_proc_dev(char *p, struct flb_in_netif_config *ctx)
 {
-    struct mk_list *head = NULL;
-    struct mk_list *split = NULL;
-    struct flb_split_entry *sentry = NULL;
+    int i;
+    char *name;
 
-    int i = 0;
-    int entry_num;
-    
-    split = flb_utils_split(line, ' ', 256);
-    entry_num = mk_list_size(split);
-    if (entry_num != ctx->entry_len + 1) {
-        flb_utils_split_free(split);
-        return -1;
-    }
+    while (*p) {
+        while (*p == ' ') {
+            p++;
+        }
+        name = p;
+        while (*p && *p != ':' && *p != '\n') {
+            p++;
+        }
 
-    mk_list_foreach(head, split) {
-        sentry = mk_list_entry(head, struct flb_split_entry ,_head);
-        if (i==0) {
-            /* interface name */
-            if( is_specific_interface(ctx, sentry->value)){
-                i++;
-                continue;
-            }
-            else {
-                /* skip this line */
-                flb_utils_split_free(split);
-                return -1;
+        if (*p == ':' && p - name == ctx->interface_len &&
+            strncmp(name, ctx->interface, ctx->interface_len) == 0) {
+            p++;
+            for (i = 0; i < ctx->entry_len; i++) {
+                ctx->entry[i].now = flb_procfs_u64(&p);
             }
+            return 0;
         }
-        ctx->entry[i-1].now = strtoul(sentry->value ,NULL ,10);
-        i++;
-    }
 
-    flb_utils_split_free(split);
+        p = flb_procfs_next_line(p);
+    }
 
-    return 0;
+    return -1;
 }
 
 static inline uint64_t calc_diff(struct netif_entry *entry)
@@ -207,21 +199,18 @@ static int in_netif_collect_linux(struct flb_input_instance *i_ins,
                            struct flb_config *config, void *in_context)
 {
     struct flb_in_netif_config *ctx = in_context;
-    FILE *fp = NULL;
-    char line[LINE_LEN] = {0};
+    char *buf;
     char key_name[LINE_LEN] = {0};
     int  key_len;
     int i;
     int entry_len = ctx->entry_len;
 
-    fp = fopen("/proc/net/dev", "r");
-    if (fp == NULL) {
-        flb_error("[in_netif]fopen error\n");
+    buf = flb_procfs_sample(ctx->dev, NULL);
+    if (!buf) {
+        flb_error("[in_netif] read error on /proc/net/dev");
         return -1;
     }
-    while(fgets(line, LINE_LEN-1, fp) != NULL){
-        parse_proc_line(line, ctx);
-    }
+    parse_proc_dev(buf, ctx);
 
     if ( ctx->first_snapshot == FLB_TRUE ){   /* if in_netif are called for the first time, assign prev with now */
         for(i=0; i<entry_len; i++) {
@@ -252,7 +241,6 @@ static int in_netif_collect_linux(struct flb_input_instance *i_ins,
         flb_input_buf_write_end(i_ins);
     }
 
-    fclose(fp);
     return 0;
 }
 
@@ -280,7 +268,15 @@ static int in_netif_init(struct flb_input_instance *in,
     }
 
     if (configure(ctx, in, &interval_sec, &interval_nsec) < 0) {
-        config_destroy(ctx);
+        config_destroy(ctx, config);
+        return -1;
+    }
+
+    /* /proc/net/dev stays open, it's shared with other inputs */
+    ctx->dev = flb_procfs_get(config, "/proc/net/dev");
+    if (!ctx->dev) {
+        flb_error("[in_netif] could not open /proc/net/dev");
+        config_destroy(ctx, config);
         return -1;
     }
 
@@ -295,7 +291,7 @@ static int in_netif_init(struct flb_input_instance *in,
                                        config);
     if (ret == -1) {
         flb_error("Could not set collector for Proc input plugin");
-        config_destroy(ctx);
+        config_destroy(ctx, config);
         return -1;
     }
 
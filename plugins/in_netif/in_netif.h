@@ -57,6 +57,8 @@ struct flb_in_netif_config {
     int entry_len;
 
     int map_num;
+
+    struct flb_procfs_file *dev;   /* /proc/net/dev */
 };
 
 extern struct flb_input_plugin in_netif_plugin;
@@ -20,6 +20,8 @@
 #include <fluent-bit/flb_info.h>
 #include <fluent-bit/flb_config.h>
 #include <fluent-bit/flb_pack.h>
+#include <fluent-bit/flb_time.h>
+#include <fluent-bit/flb_procfs.h>
 #include <msgpack.h>
 
 #include <stdio.h>
@@ -28,7 +30,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <signal.h>
-#include <glob.h>
+#include <fnmatch.h>
 #include <libgen.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -98,62 +100,6 @@ struct flb_in_proc_mem_offset mem_linux[] = {
 
 
 
-static pid_t get_pid_from_procname_linux(const char* proc)
-{
-    pid_t ret = -1;
-    glob_t glb;
-    int i;
-    int fd = -1;
-    long ret_scan = -1;
-    int ret_glb = -1;
-    ssize_t count;
-
-    char  cmdname[FLB_CMD_LEN];
-    char* bname = NULL;
-
-    ret_glb = glob("/proc/*/cmdline", 0 ,NULL, &glb);
-    if (ret_glb != 0) {
-        switch(ret_glb){
-        case GLOB_NOSPACE:
-            flb_warn("[%s] glob: no space", FLB_IN_PROC_NAME);
-            break;
-        case GLOB_NOMATCH:
-            flb_warn("[%s] glob: no match", FLB_IN_PROC_NAME);
-            break;
-        case GLOB_ABORTED:
-            flb_warn("[%s] glob: aborted", FLB_IN_PROC_NAME);
-            break;
-        default:
-            flb_warn("[%s] glob: other error", FLB_IN_PROC_NAME);
-        }
-        return ret;
-    }
-
-    for (i = 0; i < glb.gl_pathc; i++) {
-        fd = open(glb.gl_pathv[i], O_RDONLY);
-        if (fd < 0) {
-            continue;
-        }
-        count = read(fd, &cmdname, FLB_CMD_LEN);
-        if (count <= 0){
-            close(fd);
-            continue;
-        }
-        cmdname[FLB_CMD_LEN-1] = '\0';
-        bname = basename(cmdname);
-
-        if (strncmp(proc, (const char*)bname, FLB_CMD_LEN) == 0) {
-            sscanf((const char*)glb.gl_pathv[i],"/proc/%ld/cmdline",&ret_scan);
-            ret = (pid_t)ret_scan;
-            close(fd);
-            break;
-        }
-        close(fd);
-    }
-    globfree(&glb);
-    return ret;
-}
-
 static int configure(struct flb_in_proc_config *ctx,
                      struct flb_input_instance *in)
 {
@@ -218,231 +164,385 @@ static int configure(struct flb_in_proc_config *ctx,
         strncpy(ctx->proc_name, pval, FLB_CMD_LEN);
         ctx->proc_name[FLB_CMD_LEN-1] = '\0';
         ctx->len_proc_name = strlen(ctx->proc_name);
+
+        /* A name pattern tracks every matching process */
+        if (strpbrk(ctx->proc_name, "*?[")) {
+            ctx->pattern = FLB_TRUE;
+        }
     }
 
     return 0;
 }
 
-static int get_pid_status(pid_t pid)
+/* Basename of argv[0], read once when a process is found */
+static int proc_cmdname(pid_t pid, char *buf, size_t size)
 {
-    int ret =  kill(pid, 0);
-    return ((ret != ESRCH)  && (ret != EPERM) && (ret != ESRCH));
+    int fd;
+    ssize_t count;
+    char path[64];
+    char *bname;
+
+    snprintf(path, sizeof(path), "/proc/%d/cmdline", pid);
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    count = read(fd, buf, size - 1);
+    close(fd);
+    if (count <= 0) {
+        return -1;
+    }
+    buf[count] = '\0';
+
+    bname = basename(buf);
+    if (bname != buf) {
+        memmove(buf, bname, strlen(bname) + 1);
+    }
+    return 0;
 }
 
-static int generate_record_linux(struct flb_input_instance *i_ins,
-                           struct flb_config *config, void *in_context,
-                           struct flb_in_proc_mem_linux *mem_stat,
-                           uint64_t fds)
+static int proc_name_match(struct flb_in_proc_config *ctx, char *name)
 {
-    struct flb_in_proc_config *ctx = in_context;
-    int i;
-    int map_num = 3;    /* 3 = alive, proc_name, pid */
+    if (ctx->pattern == FLB_TRUE) {
+        return (fnmatch(ctx->proc_name, name, 0) == 0);
+    }
+    return (strncmp(ctx->proc_name, name, FLB_CMD_LEN) == 0);
+}
 
-    if (ctx->alive == FLB_TRUE && ctx->alert == FLB_TRUE) {
-        return 0;
+static inline struct mk_list *proc_bucket(struct flb_in_proc_config *ctx,
+                                          pid_t pid)
+{
+    return &ctx->procs[pid % FLB_PROC_BUCKETS];
+}
+
+static struct flb_in_proc_entry *proc_lookup(struct flb_in_proc_config *ctx,
+                                             pid_t pid)
+{
+    struct mk_list *head;
+    struct flb_in_proc_entry *entry;
+
+    mk_list_foreach(head, proc_bucket(ctx, pid)) {
+        entry = mk_list_entry(head, struct flb_in_proc_entry, _head);
+        if (entry->pid == pid) {
+            return entry;
+        }
     }
+    return NULL;
+}
 
-    if (ctx->mem == FLB_TRUE) {
-        map_num += sizeof(mem_linux)/sizeof(struct flb_in_proc_mem_offset)-1;
+static void proc_entry_destroy(struct flb_in_proc_entry *entry)
+{
+    mk_list_del(&entry->_head);
+    if (entry->status) {
+        flb_procfs_file_close(entry->status);
     }
-    if (ctx->fds == FLB_TRUE) {
-        map_num++;
+    flb_free(entry);
+}
+
+/*
+ * A new PID: its name is checked once, the processes that don't match are
+ * remembered so they are not checked again on the next scans.
+ */
+static struct flb_in_proc_entry *proc_entry_create(struct flb_in_proc_config *ctx,
+                                                   pid_t pid)
+{
+    char path[64];
+    char cmdname[FLB_CMD_LEN];
+    struct flb_in_proc_entry *entry;
+
+    entry = flb_calloc(1, sizeof(struct flb_in_proc_entry));
+    if (!entry) {
+        flb_errno();
+        return NULL;
+    }
+    entry->pid = pid;
+
+    if (proc_cmdname(pid, cmdname, sizeof(cmdname)) == 0 &&
+        proc_name_match(ctx, cmdname)) {
+        entry->matched = FLB_TRUE;
+        if (ctx->mem == FLB_TRUE) {
+            snprintf(path, sizeof(path), "/proc/%d/status", pid);
+            entry->status = flb_procfs_file_open(path);
+        }
     }
+    mk_list_add(&entry->_head, proc_bucket(ctx, pid));
 
-    /*
-     * Store the new data into the MessagePack buffer,
-     */
+    return entry;
+}
 
-    /* Mark the start of a 'buffer write' operation */
-    flb_input_buf_write_start(i_ins);
+/*
+ * One pass over /proc: new PIDs are checked, the PIDs that are gone are
+ * dropped. The directory stream stays open and is rewound on every scan.
+ */
+static int proc_scan(struct flb_in_proc_config *ctx)
+{
+    int i;
+    int matched = 0;
+    pid_t pid;
+    char *p;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct dirent *dent;
+    struct flb_in_proc_entry *entry;
+
+    if (!ctx->proc_dir) {
+        ctx->proc_dir = opendir("/proc");
+        if (!ctx->proc_dir) {
+            flb_errno();
+            return -1;
+        }
+    }
+    else {
+        rewinddir(ctx->proc_dir);
+    }
+    ctx->scan_id++;
 
-    msgpack_pack_array(&i_ins->mp_pck, 2);
-    flb_pack_time_now(&i_ins->mp_pck);
+    while ((dent = readdir(ctx->proc_dir)) != NULL) {
+        if (dent->d_name[0] < '1' || dent->d_name[0] > '9') {
+            continue;
+        }
+        p = dent->d_name;
+        pid = flb_procfs_u64(&p);
+        if (*p != '\0') {
+            continue;
+        }
 
-    /* 3 = alive, proc_name, pid */
-    msgpack_pack_map(&i_ins->mp_pck, map_num);
+        entry = proc_lookup(ctx, pid);
+        if (!entry) {
+            entry = proc_entry_create(ctx, pid);
+            if (!entry) {
+                continue;
+            }
+        }
+        entry->scan_id = ctx->scan_id;
+        if (entry->matched == FLB_TRUE) {
+            matched++;
+        }
+    }
 
-    /* Status */
-    msgpack_pack_str(&i_ins->mp_pck, 5);
-    msgpack_pack_str_body(&i_ins->mp_pck, "alive", 5);
+    /* Processes that are gone */
+    for (i = 0; i < FLB_PROC_BUCKETS; i++) {
+        mk_list_foreach_safe(head, tmp, &ctx->procs[i]) {
+            entry = mk_list_entry(head, struct flb_in_proc_entry, _head);
+            if (entry->scan_id != ctx->scan_id) {
+                proc_entry_destroy(entry);
+            }
+        }
+    }
+
+    return matched;
+}
+
+static void pack_str(msgpack_packer *mp_pck, char *str, int len)
+{
+    msgpack_pack_str(mp_pck, len);
+    msgpack_pack_str_body(mp_pck, str, len);
+}
+
+static int generate_record_linux(struct flb_input_instance *i_ins,
+                                 struct flb_in_proc_config *ctx,
+                                 struct flb_time *tm, pid_t pid, int alive,
+                                 struct flb_in_proc_mem_linux *mem_stat,
+                                 uint64_t fds)
+{
+    int i;
+    int map_num = 3;    /* 3 = alive, proc_name, pid */
+    char *str;
+    uint64_t *val;
+    msgpack_packer *mp_pck = &i_ins->mp_pck;
+
+    if (alive && ctx->mem == FLB_TRUE) {
+        map_num += sizeof(mem_linux)/sizeof(struct flb_in_proc_mem_offset)-1;
+    }
+    if (alive && ctx->fds == FLB_TRUE) {
+        map_num++;
+    }
+
+    msgpack_pack_array(mp_pck, 2);
+    flb_time_append_to_msgpack(tm, mp_pck, 0);
+    msgpack_pack_map(mp_pck, map_num);
 
-    if (ctx->alive) {
-        msgpack_pack_true(&i_ins->mp_pck);
+    /* Status */
+    pack_str(mp_pck, "alive", 5);
+    if (alive) {
+        msgpack_pack_true(mp_pck);
     }
     else {
-        msgpack_pack_false(&i_ins->mp_pck);
+        msgpack_pack_false(mp_pck);
     }
 
     /* proc name */
-    msgpack_pack_str(&i_ins->mp_pck, strlen("proc_name"));
-    msgpack_pack_str_body(&i_ins->mp_pck, "proc_name", strlen("proc_name"));
-    msgpack_pack_str(&i_ins->mp_pck, ctx->len_proc_name);
-    msgpack_pack_str_body(&i_ins->mp_pck, ctx->proc_name, ctx->len_proc_name);
+    pack_str(mp_pck, "proc_name", 9);
+    pack_str(mp_pck, ctx->proc_name, ctx->len_proc_name);
 
     /* pid */
-    msgpack_pack_str(&i_ins->mp_pck, strlen("pid"));
-    msgpack_pack_str_body(&i_ins->mp_pck, "pid", strlen("pid"));
-    msgpack_pack_int64(&i_ins->mp_pck, ctx->pid);
+    pack_str(mp_pck, "pid", 3);
+    msgpack_pack_int64(mp_pck, pid);
 
     /* memory */
-    if (ctx->mem == FLB_TRUE) {
-        char *str = NULL;
-        uint64_t *val = NULL;
-        for(i=0; mem_linux[i].key != NULL; i++) {
+    if (alive && ctx->mem == FLB_TRUE) {
+        for (i = 0; mem_linux[i].key != NULL; i++) {
             str = mem_linux[i].msgpack_key;
             val = (uint64_t*)((char*)mem_stat + mem_linux[i].offset);
-            msgpack_pack_str(&i_ins->mp_pck, strlen(str));
-            msgpack_pack_str_body(&i_ins->mp_pck, str, strlen(str));
-            msgpack_pack_uint64(&i_ins->mp_pck, *val);
+            pack_str(mp_pck, str, strlen(str));
+            msgpack_pack_uint64(mp_pck, *val);
         }
     }
 
     /* file descriptor */
-    if (ctx->fds == FLB_TRUE) {
-        msgpack_pack_str(&i_ins->mp_pck, strlen("fd"));
-        msgpack_pack_str_body(&i_ins->mp_pck, "fd", strlen("fd"));
-        msgpack_pack_uint64(&i_ins->mp_pck, fds);
+    if (alive && ctx->fds == FLB_TRUE) {
+        pack_str(mp_pck, "fd", 2);
+        msgpack_pack_uint64(mp_pck, fds);
     }
 
-    flb_input_buf_write_end(i_ins);
-
     return 0;
 }
 
-static void update_alive(struct flb_in_proc_config *ctx)
-{
-    if (ctx->pid >= 0 && get_pid_status(ctx->pid)) {
-        ctx->alive = FLB_TRUE;
-    }
-    else {
-        ctx->alive = FLB_FALSE;
-    }
-}
-
 static void mem_linux_clear(struct flb_in_proc_mem_linux *mem_stat)
 {
-    int i;
-    uint64_t *temp = NULL;
-    for (i=0;mem_linux[i].key != NULL;i++) {
-        temp   = (uint64_t*)((char*)mem_stat + mem_linux[i].offset);
-        *temp  = 0;
-    }
+    memset(mem_stat, '\0', sizeof(struct flb_in_proc_mem_linux));
 }
 
-static int update_mem_linux(struct flb_in_proc_config *ctx,
+/*
+ * /proc/PID/status, the 'Vm' lines:
+ *
+ *   VmPeak:	   14860 kB
+ */
+static int update_mem_linux(struct flb_in_proc_entry *entry,
                             struct flb_in_proc_mem_linux *mem_stat)
 {
-    int ret  = -1;
     int i;
-    char path[PATH_MAX] = {0};
-    char str_name[32] = {0};
-    char *line = NULL;
-    char *fmt = NULL;
-    char *buf = NULL;
-    ssize_t count;
-    size_t len = 256;
-    uint64_t mem_size;
-    uint64_t *temp = NULL;
-    FILE *fp  = NULL;
-
-    snprintf(path, sizeof(path), "/proc/%d/status",ctx->pid);
-    fp = fopen(path, "r");
+    int len;
+    char *p;
+    char *key;
+    uint64_t *temp;
 
-    if (fp == NULL) {
-        flb_error("[%s] %s open error",FLB_IN_PROC_NAME, path);
-        mem_linux_clear(mem_stat);
+    mem_linux_clear(mem_stat);
+    if (!entry->status) {
         return -1;
     }
 
-    line = (char*)flb_malloc(len);
-    while(1) {
-        count = getline(&line, &len, fp);
-        if (count < 0) {
-            break;
-        }
+    p = flb_procfs_file_read(entry->status, NULL);
+    if (!p) {
+        return -1;
+    }
 
-        /* VmPeak:	   14860 kB */
-        fmt = "Vm%s"; /* e.g. "Peak:" */
-        memset(str_name, '\0', sizeof(str_name));
-        ret = sscanf(line, fmt, str_name);
-        if (ret < 1) {
+    while (*p) {
+        if (p[0] != 'V' || p[1] != 'm') {
+            p = flb_procfs_next_line(p);
             continue;
         }
-        /* replace : -> NULL char*/
-        if ((buf = strchr(str_name, ':')) != NULL) {
-            *buf = '\0';
-        }
 
-        /* calcurate size */
-        mem_size = 0;
-        for (i=0;line[i] != '\0';i++) {
-            if (line[i] >= 0x30 && line[i] <= 0x39 /* is number*/) {
-                mem_size *= 10;
-                mem_size += line[i] - 0x30;
-            }
+        key = p + 2;
+        p = key;
+        while (*p && *p != ':' && *p != '\n') {
+            p++;
         }
-
-        for (i=0;mem_linux[i].key != NULL;i++) {
-            if (!strcmp(str_name, mem_linux[i].key)) {
-                temp   = (uint64_t*)((char*)mem_stat + mem_linux[i].offset);
-                *temp  = mem_size * 1000; /* kB size */
+        if (*p != ':') {
+            p = flb_procfs_next_line(p);
+            continue;
+        }
+        len = p - key;
+        p++;
+
+        for (i = 0; mem_linux[i].key != NULL; i++) {
+            if (strncmp(key, mem_linux[i].key, len) == 0 &&
+                mem_linux[i].key[len] == '\0') {
+                temp  = (uint64_t*)((char*)mem_stat + mem_linux[i].offset);
+                *temp = flb_procfs_u64(&p) * 1000; /* kB size */
                 break;
             }
         }
+        p = flb_procfs_next_line(p);
     }
-    flb_free(line);
-    fclose(fp);
-    return ret;
+
+    return 0;
 }
 
-static int update_fds_linux(struct flb_in_proc_config *ctx,
-                            uint64_t *fds)
+static int update_fds_linux(pid_t pid, uint64_t *fds)
 {
     DIR *dirp = NULL;
     struct dirent *entry = NULL;
-    char path[PATH_MAX] = {0};
+    char path[64];
 
     *fds = 0;
 
-    snprintf(path, sizeof(path), "/proc/%d/fd", ctx->pid);
+    snprintf(path, sizeof(path), "/proc/%d/fd", pid);
     dirp = opendir(path);
     if (dirp == NULL) {
-        perror("opendir");
-        flb_error("[%s] opendir error %s",FLB_IN_PROC_NAME, path);
+        flb_debug("[%s] opendir error %s", FLB_IN_PROC_NAME, path);
         return -1;
     }
 
-    entry = readdir(dirp);
-    while(entry != NULL) {
-        *fds += 1;/* should we check entry->d_name ? */
-        entry = readdir(dirp);
+    while ((entry = readdir(dirp)) != NULL) {
+        if (entry->d_name[0] != '.') {
+            *fds += 1;
+        }
     }
-    *fds -= 2; /* '.' and '..' */
     closedir(dirp);
 
     return 0;
 }
 
 static int in_proc_collect_linux(struct flb_input_instance *i_ins,
-                           struct flb_config *config, void *in_context)
+                                 struct flb_config *config, void *in_context)
 {
+    int i;
+    int ret;
+    int alive = 0;
+    uint64_t fds = 0;
+    struct mk_list *head;
+    struct flb_time tm;
+    struct flb_in_proc_entry *entry;
     struct flb_in_proc_config *ctx = in_context;
     struct flb_in_proc_mem_linux mem;
-    uint64_t  fds = 0;
-    if (ctx->proc_name != NULL){
-        ctx->pid = get_pid_from_procname_linux(ctx->proc_name);
-        update_alive(ctx);
-
-        if (ctx->mem == FLB_TRUE && ctx->alive == FLB_TRUE) {
-            mem_linux_clear(&mem);
-            update_mem_linux(ctx, &mem);
-        }
-        if (ctx->fds == FLB_TRUE && ctx->alive == FLB_TRUE) {
-            update_fds_linux(ctx, &fds);
+
+    if (ctx->proc_name == NULL) {
+        return 0;
+    }
+
+    ret = proc_scan(ctx);
+    if (ret == -1) {
+        return -1;
+    }
+
+    /* The alert mode only reports missing processes */
+    if (ret > 0 && ctx->alert == FLB_TRUE) {
+        return 0;
+    }
+
+    flb_time_get(&tm);
+    flb_input_buf_write_start(i_ins);
+
+    for (i = 0; i < FLB_PROC_BUCKETS && ret > 0; i++) {
+        mk_list_foreach(head, &ctx->procs[i]) {
+            entry = mk_list_entry(head, struct flb_in_proc_entry, _head);
+            if (entry->matched == FLB_FALSE) {
+                continue;
+            }
+
+            if (ctx->mem == FLB_TRUE) {
+                if (update_mem_linux(entry, &mem) == -1) {
+                    /* the process is gone */
+                    continue;
+                }
+            }
+            if (ctx->fds == FLB_TRUE) {
+                update_fds_linux(entry->pid, &fds);
+            }
+
+            generate_record_linux(i_ins, ctx, &tm, entry->pid, FLB_TRUE,
+                                  &mem, fds);
+            alive++;
         }
-        generate_record_linux(i_ins, config, in_context, &mem, fds);
     }
 
+    if (alive == 0) {
+        generate_record_linux(i_ins, ctx, &tm, -1, FLB_FALSE, NULL, 0);
+    }
+
+    flb_input_buf_write_end(i_ins);
+
     return 0;
 }
 
@@ -452,9 +552,31 @@ static int in_proc_collect(struct flb_input_instance *i_ins,
     return in_proc_collect_linux(i_ins, config, in_context);
 }
 
+static void in_proc_destroy(struct flb_in_proc_config *ctx)
+{
+    int i;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct flb_in_proc_entry *entry;
+
+    for (i = 0; i < FLB_PROC_BUCKETS; i++) {
+        mk_list_foreach_safe(head, tmp, &ctx->procs[i]) {
+            entry = mk_list_entry(head, struct flb_in_proc_entry, _head);
+            proc_entry_destroy(entry);
+        }
+    }
+
+    if (ctx->proc_dir) {
+        closedir(ctx->proc_dir);
+    }
+    flb_free(ctx->proc_name);
+    flb_free(ctx);
+}
+
 static int in_proc_init(struct flb_input_instance *in,
                           struct flb_config *config, void *data)
 {
+    int i;
     int ret;
 
     struct flb_in_proc_config *ctx = NULL;
@@ -470,13 +592,16 @@ static int in_proc_init(struct flb_input_instance *in,
     ctx->mem   = FLB_TRUE;
     ctx->fds   = FLB_TRUE;
     ctx->proc_name = NULL;
-    ctx->pid = -1;
+    ctx->pattern = FLB_FALSE;
+    for (i = 0; i < FLB_PROC_BUCKETS; i++) {
+        mk_list_init(&ctx->procs[i]);
+    }
 
     configure(ctx, in);
 
     if (ctx->proc_name == NULL) {
         flb_error("[%s] \"proc_name\" is NULL", FLB_IN_PROC_NAME);
-        flb_free(ctx);
+        in_proc_destroy(ctx);
         return -1;
     }
 
@@ -491,7 +616,7 @@ static int in_proc_init(struct flb_input_instance *in,
                                        config);
     if (ret == -1) {
         flb_error("Could not set collector for Proc input plugin");
-        flb_free(ctx);
+        in_proc_destroy(ctx);
         return -1;
     }
 
@@ -504,8 +629,7 @@ static int in_proc_exit(void *data, struct flb_config *config)
     struct flb_in_proc_config *ctx = data;
 
     /* Destroy context */
-    flb_free(ctx->proc_name);
-    flb_free(ctx);
+    in_proc_destroy(ctx);
 
     return 0;
 }
@@ -22,6 +22,7 @@
 
 #include <stdint.h>
 #include <unistd.h>
+#include <dirent.h>
 #include <fluent-bit/flb_input.h>
 #include <msgpack.h>
 
@@ -31,6 +32,9 @@
 #define FLB_CMD_LEN 256
 #define FLB_IN_PROC_NAME "in_proc"
 
+/* Tracked PIDs hash table size */
+#define FLB_PROC_BUCKETS 1024
+
 struct flb_in_proc_mem_linux {
     uint64_t vmpeak;
     uint64_t vmsize;
@@ -51,14 +55,27 @@ struct flb_in_proc_mem_offset {
     size_t offset;
 };
 
+/* A PID found on /proc, the status of matching processes is kept open */
+struct flb_in_proc_entry {
+    pid_t pid;
+    int matched;                     /* the name matches proc_name  */
+    uint64_t scan_id;                /* last scan that found it     */
+    struct flb_procfs_file *status;  /* /proc/PID/status            */
+    struct mk_list _head;
+};
+
 struct flb_in_proc_config {
     uint8_t  alert;
-    uint8_t  alive;
 
-    /* Checking process */
+    /* Checking process: a name or a pattern (fnmatch(3)) */
     char*  proc_name;
-    pid_t  pid;
     size_t len_proc_name;
+    int    pattern;
+
+    /* Tracked PIDs */
+    DIR *proc_dir;
+    uint64_t scan_id;
+    struct mk_list procs[FLB_PROC_BUCKETS];
 
     /* Time interval check */
     int interval_sec;
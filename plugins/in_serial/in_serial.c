@@ -143,10 +143,16 @@ static int in_serial_collect(struct flb_input_instance *in,
         len = ctx->buf_len;
         hits = 0;
 
+        /*
+         * Bytes dropped at the front move the data under the JSON pack
+         * state, it must scan again.
+         */
+
         /* Handle FTDI handshake */
         if (ctx->buf_data[0] == '\0') {
             consume_bytes(ctx->buf_data, 1, ctx->buf_len);
             ctx->buf_len--;
+            flb_pack_state_reset(&ctx->pack_state);
         }
 
         /* Strip CR or LF if found at first byte */
@@ -156,6 +162,7 @@ static int in_serial_collect(struct flb_input_instance *in,
                       ctx->buf_data[0]);
             consume_bytes(ctx->buf_data, 1, ctx->buf_len);
             ctx->buf_len--;
+            flb_pack_state_reset(&ctx->pack_state);
         }
 
         /* Handle the case when a Separator is set */
@@ -209,13 +216,10 @@ static int in_serial_collect(struct flb_input_instance *in,
             process_pack(ctx, pack, out_size);
             flb_free(pack);
 
+            /* the pack state follows the consumed bytes */
             consume_bytes(ctx->buf_data, ctx->pack_state.last_byte, ctx->buf_len);
             ctx->buf_len -= ctx->pack_state.last_byte;
             ctx->buf_data[ctx->buf_len] = '\0';
-
-            flb_pack_state_reset(&ctx->pack_state);
-            flb_pack_state_init(&ctx->pack_state);
-            ctx->pack_state.multiple = FLB_TRUE;
         }
         else {
             /* Process and enqueue the received line */
@@ -337,5 +341,6 @@ struct flb_input_plugin in_serial_plugin = {
     .cb_pre_run   = NULL,
     .cb_collect   = in_serial_collect,
     .cb_flush_buf = NULL,
-    .cb_exit      = in_serial_exit
+    .cb_exit      = in_serial_exit,
+    .flags        = FLB_INPUT_RUNNER
 };
@@ -26,6 +26,7 @@
 #include <fluent-bit/flb_time.h>
 #include <fluent-bit/flb_parser.h>
 #include <fluent-bit/flb_error.h>
+#include <fluent-bit/flb_mem_pool.h>
 
 #include <msgpack.h>
 
@@ -78,7 +79,7 @@ static inline int pack_regex(struct flb_in_stdin_config *ctx,
 
     msgpack_pack_array(&ctx->i_in->mp_pck, 2);
     flb_time_append_to_msgpack(t, &ctx->i_in->mp_pck, 0);
-    msgpack_sbuffer_write(&ctx->i_in->mp_sbuf, data, data_size);
+    flb_mem_pool_sbuffer_write(&ctx->i_in->mp_sbuf, data, data_size);
 
     flb_input_buf_write_end(ctx->i_in);
 
@@ -134,14 +135,11 @@ static int in_stdin_collect(struct flb_input_instance *i_ins,
 
             pack_json(ctx, pack, pack_size);
 
+            /* the pack state follows the consumed bytes */
             consume_bytes(ctx->buf, ctx->pack_state.last_byte, ctx->buf_len);
             ctx->buf_len -= ctx->pack_state.last_byte;
             ctx->buf[ctx->buf_len] = '\0';
 
-            flb_pack_state_reset(&ctx->pack_state);
-            flb_pack_state_init(&ctx->pack_state);
-            ctx->pack_state.multiple = FLB_TRUE;
-
             flb_free(pack);
 
             return 0;
@@ -29,12 +29,17 @@
 #include <fluent-bit/flb_error.h>
 #include <fluent-bit/flb_utils.h>
 #include <fluent-bit/flb_stats.h>
+#include <fluent-bit/flb_input_worker.h>
+#ifdef FLB_HAVE_METRICS
+#include <fluent-bit/flb_metrics.h>
+#endif
 
 #include "syslog.h"
 #include "syslog_conf.h"
 #include "syslog_server.h"
 #include "syslog_conn.h"
 #include "syslog_prot.h"
+#include "syslog_udp.h"
 
 /* cb_collect callback */
 static int in_syslog_collect_tcp(struct flb_input_instance *i_ins,
@@ -68,20 +73,107 @@ static int in_syslog_collect_tcp(struct flb_input_instance *i_ins,
 static int in_syslog_collect_udp(struct flb_input_instance *i_ins,
                                  struct flb_config *config, void *in_context)
 {
-    int bytes;
-    char buf[1024];
     struct flb_syslog *ctx = in_context;
     (void) i_ins;
 
-    bytes = recvfrom(ctx->server_fd, buf, sizeof(buf) - 1, 0, NULL, NULL);
-    if (bytes > 0) {
-        buf[bytes] = '\0';
-        syslog_prot_process_udp(buf, bytes, ctx);
+    syslog_udp_read(ctx);
+    return 0;
+}
+
+/*
+ * Listener workers callbacks, they run in the worker thread on the worker
+ * copy of the context. While paused the worker does not watch its socket,
+ * new datagrams wait in the kernel buffer.
+ */
+static int syslog_worker_read(void *data)
+{
+    struct flb_syslog *ctx = data;
+
+    return syslog_udp_read(ctx);
+}
+
+static void syslog_worker_pause(void *data)
+{
+    (void) data;
+}
+
+static void syslog_worker_resume(void *data)
+{
+    (void) data;
+}
+
+static void syslog_worker_exit(void *data)
+{
+    struct flb_syslog *ctx = data;
+
+    if (ctx->udp) {
+        syslog_udp_destroy(ctx->udp);
     }
-    else {
-        flb_errno();
+    flb_free(ctx);
+}
+
+static void syslog_workers_destroy(struct flb_syslog *ctx)
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct flb_input_worker *worker;
+
+    mk_list_foreach_safe(head, tmp, &ctx->worker_list) {
+        worker = mk_list_entry(head, struct flb_input_worker, _head);
+        mk_list_del(&worker->_head);
+        flb_input_worker_destroy(worker);
     }
+}
+
+/*
+ * Start the listener workers: every worker binds the address on its own
+ * socket and receives its share of the datagrams in its own thread.
+ */
+static int syslog_workers_start(struct flb_syslog *ctx)
+{
+    int i;
+    int ret;
+    struct flb_syslog *w_ctx;
+    struct flb_input_worker *worker;
+
+    for (i = 0; i < ctx->workers; i++) {
+        worker = flb_input_worker_create_udp(ctx->i_ins, i,
+                                             ctx->listen, ctx->tcp_port);
+        if (!worker) {
+            return -1;
+        }
+        mk_list_add(&worker->_head, &ctx->worker_list);
 
+        w_ctx = flb_malloc(sizeof(struct flb_syslog));
+        if (!w_ctx) {
+            flb_errno();
+            return -1;
+        }
+        memcpy(w_ctx, ctx, sizeof(struct flb_syslog));
+        w_ctx->server_fd = worker->server_fd;
+        w_ctx->evl = worker->evl;
+        w_ctx->worker = worker;
+        mk_list_init(&w_ctx->connections);
+        mk_list_init(&w_ctx->worker_list);
+
+        w_ctx->udp = syslog_udp_create(w_ctx);
+        if (!w_ctx->udp) {
+            flb_free(w_ctx);
+            return -1;
+        }
+
+        ret = flb_input_worker_start(worker, w_ctx,
+                                     syslog_worker_read,
+                                     syslog_worker_pause,
+                                     syslog_worker_resume,
+                                     syslog_worker_exit);
+        if (ret == -1) {
+            return -1;
+        }
+    }
+
+    flb_info("[in_syslog] UDP server binding %s:%s, %i workers",
+             ctx->listen, ctx->tcp_port, ctx->workers);
     return 0;
 }
 
@@ -106,6 +198,28 @@ static int in_syslog_init(struct flb_input_instance *in,
         return -1;
     }
 
+#ifdef FLB_HAVE_METRICS
+    if (in->metrics) {
+        flb_metrics_add(FLB_SYSLOG_METRIC_DROPS, "kernel_drops", in->metrics);
+    }
+#endif
+
+    /* Set context */
+    flb_input_set_context(in, ctx);
+
+    /* Listener workers, the engine thread does not receive */
+    if (ctx->workers > 0) {
+        ret = syslog_workers_start(ctx);
+        if (ret == -1) {
+            flb_error("[in_syslog] could not start workers on %s:%s",
+                      ctx->listen, ctx->tcp_port);
+            syslog_workers_destroy(ctx);
+            syslog_conf_destroy(ctx);
+            return -1;
+        }
+        return 0;
+    }
+
     /* Create Unix Socket */
     ret = syslog_server_create(ctx);
     if (ret == -1) {
@@ -113,9 +227,6 @@ static int in_syslog_init(struct flb_input_instance *in,
         return -1;
     }
 
-    /* Set context */
-    flb_input_set_context(in, ctx);
-
     /* Collect events for every opened connection to our socket */
     if (ctx->mode == FLB_SYSLOG_UNIX_TCP ||
         ctx->mode == FLB_SYSLOG_TCP) {
@@ -125,6 +236,11 @@ static int in_syslog_init(struct flb_input_instance *in,
                                              config);
     }
     else {
+        ctx->udp = syslog_udp_create(ctx);
+        if (!ctx->udp) {
+            syslog_conf_destroy(ctx);
+            return -1;
+        }
         ret = flb_input_set_collector_socket(in,
                                              in_syslog_collect_udp,
                                              ctx->server_fd,
@@ -133,18 +249,52 @@ static int in_syslog_init(struct flb_input_instance *in,
 
     if (ret == -1) {
         flb_error("[in_syslog] Could not set collector");
+        if (ctx->udp) {
+            syslog_udp_destroy(ctx->udp);
+        }
         syslog_conf_destroy(ctx);
+        return -1;
     }
 
     return 0;
 }
 
+static void in_syslog_pause(void *data, struct flb_config *config)
+{
+    struct mk_list *head;
+    struct flb_input_worker *worker;
+    struct flb_syslog *ctx = data;
+    (void) config;
+
+    mk_list_foreach(head, &ctx->worker_list) {
+        worker = mk_list_entry(head, struct flb_input_worker, _head);
+        flb_input_worker_pause(worker);
+    }
+}
+
+static void in_syslog_resume(void *data, struct flb_config *config)
+{
+    struct mk_list *head;
+    struct flb_input_worker *worker;
+    struct flb_syslog *ctx = data;
+    (void) config;
+
+    mk_list_foreach(head, &ctx->worker_list) {
+        worker = mk_list_entry(head, struct flb_input_worker, _head);
+        flb_input_worker_resume(worker);
+    }
+}
+
 static int in_syslog_exit(void *data, struct flb_config *config)
 {
     struct flb_syslog *ctx = data;
     (void) config;
 
+    syslog_workers_destroy(ctx);
     syslog_conn_exit(ctx);
+    if (ctx->udp) {
+        syslog_udp_destroy(ctx->udp);
+    }
     syslog_conf_destroy(ctx);
 
     return 0;
@@ -158,6 +308,8 @@ struct flb_input_plugin in_syslog_plugin = {
     .cb_pre_run   = NULL,
     .cb_collect   = NULL,
     .cb_flush_buf = NULL,
+    .cb_pause     = in_syslog_pause,
+    .cb_resume    = in_syslog_resume,
     .cb_exit      = in_syslog_exit,
     .flags        = FLB_INPUT_NET
 };
@@ -22,21 +22,31 @@
 
 #include <fluent-bit/flb_info.h>
 #include <fluent-bit/flb_input.h>
+#include <fluent-bit/flb_input_worker.h>
 
 /* Syslog modes */
 #define FLB_SYSLOG_UNIX_TCP  1
 #define FLB_SYSLOG_UNIX_UDP  2
 #define FLB_SYSLOG_TCP       3
+#define FLB_SYSLOG_UDP       4
 
 /* 32KB chunk size */
 #define FLB_SYSLOG_CHUNK   32768
 
+/* Datagrams received per system call */
+#define FLB_SYSLOG_UDP_BATCH  64
+
+/* Metrics */
+#define FLB_SYSLOG_METRIC_DROPS  10   /* datagrams dropped by the kernel */
+
+struct syslog_udp;
+
 /* Context / Config*/
 struct flb_syslog {
-    /* Listening mode: unix udp, unix tcp or normal tcp */
+    /* Listening mode: unix udp, unix tcp, tcp or udp */
     int mode;
 
-    /* TCP Network mode */
+    /* Network modes */
     char *listen;
     char *tcp_port;
 
@@ -48,7 +58,17 @@ struct flb_syslog {
     size_t buffer_max_size;
     size_t buffer_chunk_size;
 
+    /* UDP modes: kernel receive buffer and batch receive state */
+    size_t receive_buffer_size;
+    struct syslog_udp *udp;
+
+    /* Listener workers (udp mode) */
+    int workers;
+    struct mk_list worker_list;
+    struct flb_input_worker *worker;
+
     /* Configuration */
+    int parser_format;               /* built-in parser or regex   */
     struct flb_parser *parser;
 
     /* List for connections and event loop */
@@ -17,6 +17,8 @@
  *  limitations under the License.
  */
 
+#include <stdlib.h>
+
 #include <fluent-bit/flb_info.h>
 #include <fluent-bit/flb_config.h>
 #include <fluent-bit/flb_input.h>
@@ -28,6 +30,7 @@
 #include "syslog.h"
 #include "syslog_server.h"
 #include "syslog_conf.h"
+#include "syslog_parser.h"
 
 struct flb_syslog *syslog_conf_create(struct flb_input_instance *i_ins,
                                       struct flb_config *config)
@@ -43,9 +46,11 @@ struct flb_syslog *syslog_conf_create(struct flb_input_instance *i_ins,
     }
     ctx->evl = config->evl;
     ctx->i_ins = i_ins;
+    ctx->server_fd = -1;
     mk_list_init(&ctx->connections);
+    mk_list_init(&ctx->worker_list);
 
-    /* Syslog mode: unix_udp, unix_tcp, or tcp */
+    /* Syslog mode: unix_udp, unix_tcp, tcp or udp */
     tmp = flb_input_get_property("mode", i_ins);
     if (tmp) {
         if (strcasecmp(tmp, "unix_tcp") == 0) {
@@ -57,6 +62,9 @@ struct flb_syslog *syslog_conf_create(struct flb_input_instance *i_ins,
         else if (strcasecmp(tmp, "tcp") == 0) {
             ctx->mode = FLB_SYSLOG_TCP;
         }
+        else if (strcasecmp(tmp, "udp") == 0) {
+            ctx->mode = FLB_SYSLOG_UDP;
+        }
         else {
             flb_error("[in_syslog] Unknown syslog mode %s", tmp);
             flb_free(ctx);
@@ -67,8 +75,8 @@ struct flb_syslog *syslog_conf_create(struct flb_input_instance *i_ins,
         ctx->mode = FLB_SYSLOG_UNIX_UDP;
     }
 
-    /* Check if TCP mode was requested */
-    if (ctx->mode == FLB_SYSLOG_TCP) {
+    /* Check if a network mode was requested */
+    if (ctx->mode == FLB_SYSLOG_TCP || ctx->mode == FLB_SYSLOG_UDP) {
         /* Listen interface */
         if (!i_ins->host.listen) {
             tmp = flb_input_get_property("listen", i_ins);
@@ -83,7 +91,7 @@ struct flb_syslog *syslog_conf_create(struct flb_input_instance *i_ins,
             ctx->listen = flb_strdup(i_ins->host.listen);
         }
 
-        /* TCP port */
+        /* Port */
         if (i_ins->host.port == 0) {
             ctx->tcp_port = flb_strdup("5140");
         }
@@ -119,21 +127,63 @@ struct flb_syslog *syslog_conf_create(struct flb_input_instance *i_ins,
         ctx->buffer_max_size  = flb_utils_size_to_bytes(tmp);
     }
 
+    /* Kernel receive buffer of the UDP sockets, system default if unset */
+    tmp = flb_input_get_property("receive_buffer_size", i_ins);
+    if (tmp) {
+        ctx->receive_buffer_size = flb_utils_size_to_bytes(tmp);
+    }
+
+    /* Listener workers, each one with its own socket */
+    tmp = flb_input_get_property("workers", i_ins);
+    if (tmp) {
+        ctx->workers = atoi(tmp);
+        if (ctx->workers < 0) {
+            ctx->workers = 0;
+        }
+        if (ctx->workers > 0 && ctx->mode != FLB_SYSLOG_UDP) {
+            flb_warn("[in_syslog] workers are only supported in udp mode");
+            ctx->workers = 0;
+        }
+    }
+
+    /* Built-in parser */
+    tmp = flb_input_get_property("parser_format", i_ins);
+    if (tmp) {
+        ctx->parser_format = syslog_parser_format(tmp);
+        if (ctx->parser_format == -1) {
+            flb_error("[in_syslog] unknown parser_format '%s'", tmp);
+            syslog_conf_destroy(ctx);
+            return NULL;
+        }
+        return ctx;
+    }
+
     /* Parser */
+    ctx->parser_format = FLB_SYSLOG_FMT_REGEX;
     tmp = flb_input_get_property("parser", i_ins);
     if (tmp) {
         ctx->parser = flb_parser_get(tmp, config);
     }
     else {
-        if (ctx->mode == FLB_SYSLOG_TCP) {
+        /*
+         * Default parsers, when the parsers file is not loaded the
+         * built-in parser of the same format is used.
+         */
+        if (ctx->mode == FLB_SYSLOG_TCP || ctx->mode == FLB_SYSLOG_UDP) {
             ctx->parser = flb_parser_get("syslog-rfc5424", config);
+            if (!ctx->parser) {
+                ctx->parser_format = FLB_SYSLOG_FMT_RFC5424;
+            }
         }
         else {
             ctx->parser = flb_parser_get("syslog-rfc3164-local", config);
+            if (!ctx->parser) {
+                ctx->parser_format = FLB_SYSLOG_FMT_RFC3164_LOCAL;
+            }
         }
     }
 
-    if (!ctx->parser) {
+    if (!ctx->parser && ctx->parser_format == FLB_SYSLOG_FMT_REGEX) {
         flb_error("[in_syslog] parser not set");
         syslog_conf_destroy(ctx);
         return NULL;
@@ -127,6 +127,8 @@ struct syslog_conn *syslog_conn_add(int fd, struct flb_syslog *ctx)
         return NULL;
     }
     conn->buf_size = ctx->buffer_chunk_size;
+    flb_filter_pushdown_init(&conn->pushdown, ctx->i_ins,
+                             ctx->i_ins->tag, ctx->i_ins->tag_len, NULL, 0);
 
     /* Register instance into the event loop */
     ret = mk_event_add(ctx->evl, fd, FLB_ENGINE_EV_CUSTOM, MK_EVENT_READ, conn);
@@ -151,6 +153,7 @@ int syslog_conn_del(struct syslog_conn *conn)
     /* Release resources */
     mk_list_del(&conn->_head);
     close(conn->fd);
+    flb_filter_pushdown_destroy(&conn->pushdown);
     flb_free(conn->buf_data);
     flb_free(conn);
 
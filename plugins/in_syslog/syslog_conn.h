@@ -22,6 +22,7 @@
 
 #include <fluent-bit/flb_info.h>
 #include <fluent-bit/flb_config.h>
+#include <fluent-bit/flb_filter_pushdown.h>
 
 #include "syslog.h"
 
@@ -38,6 +39,7 @@ struct syslog_conn {
     size_t buf_parsed;               /* Parsed buffer (offset)            */
     struct flb_input_instance *in;   /* Parent plugin instance            */
     struct flb_syslog *ctx;          /* Plugin configuration context      */
+    struct flb_filter_pushdown pushdown; /* Filters rules of the tag      */
 
     struct mk_list _head;
 };
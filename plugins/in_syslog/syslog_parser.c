@@ -0,0 +1,563 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_time.h>
+
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <msgpack.h>
+
+#include "syslog_parser.h"
+
+/*
+ * Built-in parsers: the fields are located in place and packed straight
+ * to the output, no memory is allocated. The records have the same keys,
+ * in the same order, as the regular expressions of the default parsers
+ * configuration (syslog-rfc5424, syslog-rfc3164 and syslog-rfc3164-local),
+ * all the values are strings and the 'time' key is kept.
+ */
+
+enum {
+    SL_PRI = 0,
+    SL_TIME,
+    SL_HOST,
+    SL_IDENT,
+    SL_PID,
+    SL_MSGID,
+    SL_EXTRADATA,
+    SL_MESSAGE,
+    SL_FIELDS
+};
+
+static const char *sl_keys[SL_FIELDS] = {
+    "pri", "time", "host", "ident", "pid", "msgid", "extradata", "message"
+};
+
+struct sl_field {
+    char *buf;
+    int len;
+};
+
+int syslog_parser_format(char *str)
+{
+    if (strcasecmp(str, "rfc5424") == 0) {
+        return FLB_SYSLOG_FMT_RFC5424;
+    }
+    else if (strcasecmp(str, "rfc3164") == 0) {
+        return FLB_SYSLOG_FMT_RFC3164;
+    }
+    else if (strcasecmp(str, "rfc3164-local") == 0) {
+        return FLB_SYSLOG_FMT_RFC3164_LOCAL;
+    }
+
+    return -1;
+}
+
+static inline int is_digit(char c)
+{
+    return (c >= '0' && c <= '9');
+}
+
+static inline int read_num(char *p, char *end, int digits, int *out)
+{
+    int i;
+    int val = 0;
+
+    if (end - p < digits) {
+        return -1;
+    }
+
+    for (i = 0; i < digits; i++) {
+        if (!is_digit(p[i])) {
+            return -1;
+        }
+        val = (val * 10) + (p[i] - '0');
+    }
+
+    *out = val;
+    return 0;
+}
+
+/* Days since the epoch of a date of the proleptic Gregorian calendar */
+static inline int64_t days_from_civil(int y, int m, int d)
+{
+    int era;
+    unsigned int yoe;
+    unsigned int doy;
+    unsigned int doe;
+
+    y -= (m <= 2);
+    era = (y >= 0 ? y : y - 399) / 400;
+    yoe = (unsigned int) (y - era * 400);
+    doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+
+    return (int64_t) era * 146097 + (int64_t) doe - 719468;
+}
+
+static inline void set_time(struct flb_time *tm, int y, int mo, int d,
+                            int h, int mi, int s, long ns, int offset)
+{
+    tm->tm.tv_sec = (days_from_civil(y, mo, d) * 86400) +
+                    (h * 3600) + (mi * 60) + s - offset;
+    tm->tm.tv_nsec = ns;
+}
+
+/* RFC3339 timestamp, e.g: 2003-10-11T22:14:15.003Z or 22:14:15-07:00 */
+static int time_rfc3339(char *p, int len, struct flb_time *tm)
+{
+    int y;
+    int mo;
+    int d;
+    int h;
+    int mi;
+    int s;
+    int oh;
+    int om;
+    int sign;
+    int digits;
+    int offset = 0;
+    long ns = 0;
+    char *end = p + len;
+
+    if (len < 20 ||
+        read_num(p, end, 4, &y) == -1 || p[4] != '-' ||
+        read_num(p + 5, end, 2, &mo) == -1 || p[7] != '-' ||
+        read_num(p + 8, end, 2, &d) == -1 || (p[10] != 'T' && p[10] != 't') ||
+        read_num(p + 11, end, 2, &h) == -1 || p[13] != ':' ||
+        read_num(p + 14, end, 2, &mi) == -1 || p[16] != ':' ||
+        read_num(p + 17, end, 2, &s) == -1) {
+        return -1;
+    }
+    p += 19;
+
+    /* Fractional seconds, nanoseconds precision */
+    if (p < end && *p == '.') {
+        p++;
+        digits = 0;
+        while (p < end && is_digit(*p)) {
+            if (digits < 9) {
+                ns = (ns * 10) + (*p - '0');
+                digits++;
+            }
+            p++;
+        }
+        if (digits == 0) {
+            return -1;
+        }
+        while (digits < 9) {
+            ns *= 10;
+            digits++;
+        }
+    }
+
+    if (p >= end) {
+        return -1;
+    }
+    if (*p == 'Z' || *p == 'z') {
+        p++;
+    }
+    else if (*p == '+' || *p == '-') {
+        sign = (*p == '-') ? -1 : 1;
+        if (read_num(p + 1, end, 2, &oh) == -1 || p[3] != ':' ||
+            read_num(p + 4, end, 2, &om) == -1) {
+            return -1;
+        }
+        offset = sign * ((oh * 3600) + (om * 60));
+        p += 6;
+    }
+    else {
+        return -1;
+    }
+
+    if (p != end || mo < 1 || mo > 12 || d < 1 || d > 31 ||
+        h > 23 || mi > 59 || s > 60) {
+        return -1;
+    }
+
+    set_time(tm, y, mo, d, h, mi, s, ns, offset);
+    return 0;
+}
+
+/* RFC3164 timestamp, e.g: Oct 11 22:14:15, in UTC of the current year */
+static int time_rfc3164(char *p, int len, struct flb_time *tm)
+{
+    int i;
+    int mo = -1;
+    int d;
+    int h;
+    int mi;
+    int s;
+    char *end = p + len;
+    time_t now;
+    struct tm now_tm;
+    static const char *months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+
+    if (len < 14) {
+        return -1;
+    }
+
+    for (i = 0; i < 12; i++) {
+        if (memcmp(p, months + (i * 3), 3) == 0) {
+            mo = i + 1;
+            break;
+        }
+    }
+    if (mo == -1 || p[3] != ' ') {
+        return -1;
+    }
+    p += 4;
+
+    /* The day is padded with a space or a zero */
+    if (*p == ' ') {
+        p++;
+    }
+    if (is_digit(p[0]) && p[1] == ' ') {
+        d = p[0] - '0';
+        p += 2;
+    }
+    else if (read_num(p, end, 2, &d) == 0 && p[2] == ' ') {
+        p += 3;
+    }
+    else {
+        return -1;
+    }
+
+    if (end - p != 8 ||
+        read_num(p, end, 2, &h) == -1 || p[2] != ':' ||
+        read_num(p + 3, end, 2, &mi) == -1 || p[5] != ':' ||
+        read_num(p + 6, end, 2, &s) == -1) {
+        return -1;
+    }
+
+    if (d < 1 || d > 31 || h > 23 || mi > 59 || s > 60) {
+        return -1;
+    }
+
+    now = time(NULL);
+    gmtime_r(&now, &now_tm);
+    set_time(tm, now_tm.tm_year + 1900, mo, d, h, mi, s, 0, 0);
+
+    return 0;
+}
+
+/* <PRI> */
+static inline char *parse_pri(char *p, char *end, struct sl_field *f)
+{
+    char *start;
+
+    if (p >= end || *p != '<') {
+        return NULL;
+    }
+
+    start = ++p;
+    while (p < end && is_digit(*p) && p - start < 5) {
+        p++;
+    }
+    if (p == start || p >= end || *p != '>') {
+        return NULL;
+    }
+
+    f->buf = start;
+    f->len = p - start;
+    return p + 1;
+}
+
+/* A field up to the next space, the returned position skips the space */
+static inline char *parse_token(char *p, char *end, struct sl_field *f)
+{
+    char *sp;
+
+    sp = memchr(p, ' ', end - p);
+    if (!sp) {
+        return NULL;
+    }
+
+    f->buf = p;
+    f->len = sp - p;
+    return sp + 1;
+}
+
+/*
+ * RFC5424 structured data: the nil value or one or more elements. Inside
+ * a quoted parameter value '"', '\' and ']' are escaped with a backslash.
+ */
+static inline char *parse_sd(char *p, char *end, struct sl_field *f)
+{
+    int quoted;
+    char *start = p;
+
+    if (p < end && *p == '-') {
+        f->buf = p;
+        f->len = 1;
+        return p + 1;
+    }
+
+    while (p < end && *p == '[') {
+        quoted = FLB_FALSE;
+        for (p++; p < end; p++) {
+            if (quoted == FLB_TRUE) {
+                if (*p == '\\') {
+                    p++;
+                }
+                else if (*p == '"') {
+                    quoted = FLB_FALSE;
+                }
+            }
+            else if (*p == '"') {
+                quoted = FLB_TRUE;
+            }
+            else if (*p == ']') {
+                break;
+            }
+        }
+        if (p >= end) {
+            return NULL;
+        }
+        p++;
+    }
+
+    if (p == start) {
+        return NULL;
+    }
+
+    f->buf = start;
+    f->len = p - start;
+    return p;
+}
+
+static int parse_rfc5424(char *p, char *end, struct sl_field *fields,
+                         struct flb_time *tm)
+{
+    int i;
+    char *start;
+
+    p = parse_pri(p, end, &fields[SL_PRI]);
+    if (!p) {
+        return -1;
+    }
+
+    /* VERSION */
+    start = p;
+    while (p < end && is_digit(*p) && p - start < 3) {
+        p++;
+    }
+    if (p == start || p >= end || *p != ' ') {
+        return -1;
+    }
+    p++;
+
+    for (i = SL_TIME; i <= SL_MSGID; i++) {
+        p = parse_token(p, end, &fields[i]);
+        if (!p || fields[i].len == 0) {
+            return -1;
+        }
+    }
+
+    p = parse_sd(p, end, &fields[SL_EXTRADATA]);
+    if (!p) {
+        return -1;
+    }
+
+    /* The message is optional, it may start with an UTF-8 BOM */
+    if (p < end) {
+        if (*p != ' ') {
+            return -1;
+        }
+        p++;
+        if (end - p >= 3 && memcmp(p, "\xEF\xBB\xBF", 3) == 0) {
+            p += 3;
+        }
+    }
+    fields[SL_MESSAGE].buf = p;
+    fields[SL_MESSAGE].len = end - p;
+
+    /* Nil or invalid timestamp: the record gets the current time */
+    if (time_rfc3339(fields[SL_TIME].buf, fields[SL_TIME].len, tm) == -1) {
+        flb_time_get(tm);
+    }
+
+    return 0;
+}
+
+static inline int is_ident(char c)
+{
+    return ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+            is_digit(c) || c == '_' || c == '/' || c == '.' || c == '-');
+}
+
+static int parse_rfc3164(char *p, char *end, int host,
+                         struct sl_field *fields, struct flb_time *tm)
+{
+    char *start;
+    char *colon;
+    struct sl_field tmp;
+
+    p = parse_pri(p, end, &fields[SL_PRI]);
+    if (!p) {
+        return -1;
+    }
+
+    /* Timestamp: three words, the first two may be apart by two spaces */
+    start = p;
+    p = parse_token(p, end, &tmp);
+    if (!p) {
+        return -1;
+    }
+    if (p < end && *p == ' ') {
+        p++;
+    }
+    p = parse_token(p, end, &tmp);
+    if (!p) {
+        return -1;
+    }
+    p = parse_token(p, end, &tmp);
+    if (!p) {
+        return -1;
+    }
+    fields[SL_TIME].buf = start;
+    fields[SL_TIME].len = (tmp.buf + tmp.len) - start;
+
+    if (host == FLB_TRUE) {
+        p = parse_token(p, end, &fields[SL_HOST]);
+        if (!p) {
+            return -1;
+        }
+    }
+
+    /* TAG[PID]: */
+    fields[SL_IDENT].buf = p;
+    while (p < end && is_ident(*p)) {
+        p++;
+    }
+    fields[SL_IDENT].len = p - fields[SL_IDENT].buf;
+
+    fields[SL_PID].buf = p;
+    fields[SL_PID].len = 0;
+    if (p < end && *p == '[') {
+        start = p + 1;
+        for (p = start; p < end && is_digit(*p); p++);
+        if (p > start && p < end && *p == ']') {
+            fields[SL_PID].buf = start;
+            fields[SL_PID].len = p - start;
+            p++;
+        }
+        else {
+            p = start - 1;
+        }
+    }
+
+    colon = memchr(p, ':', end - p);
+    if (colon) {
+        p = colon + 1;
+    }
+    while (p < end && *p == ' ') {
+        p++;
+    }
+    fields[SL_MESSAGE].buf = p;
+    fields[SL_MESSAGE].len = end - p;
+
+    if (time_rfc3164(fields[SL_TIME].buf, fields[SL_TIME].len, tm) == -1) {
+        flb_time_get(tm);
+    }
+
+    return 0;
+}
+
+/* Value of a field for the filters pushdown */
+static int fields_get(void *data, char *key, int key_len,
+                      char **val, size_t *val_len)
+{
+    int i;
+    struct sl_field *fields = data;
+
+    for (i = 0; i < SL_FIELDS; i++) {
+        if (strncmp(sl_keys[i], key, key_len) != 0 ||
+            sl_keys[i][key_len] != '\0') {
+            continue;
+        }
+        if (!fields[i].buf) {
+            return FLB_FALSE;
+        }
+        *val = fields[i].buf;
+        *val_len = fields[i].len;
+        return FLB_TRUE;
+    }
+
+    return FLB_FALSE;
+}
+
+/*
+ * Parse a message and pack the record, returns -1 if the message does not
+ * follow the format and 1 if the filters would discard the record.
+ */
+int syslog_parser_pack(int format, char *buf, size_t size,
+                       struct flb_filter_pushdown *pd,
+                       msgpack_packer *mp_pck)
+{
+    int i;
+    int ret;
+    int n = 0;
+    int len;
+    struct flb_time tm;
+    struct sl_field fields[SL_FIELDS];
+
+    memset(fields, 0, sizeof(fields));
+
+    if (format == FLB_SYSLOG_FMT_RFC5424) {
+        ret = parse_rfc5424(buf, buf + size, fields, &tm);
+    }
+    else {
+        ret = parse_rfc3164(buf, buf + size,
+                            format == FLB_SYSLOG_FMT_RFC3164,
+                            fields, &tm);
+    }
+    if (ret == -1) {
+        return -1;
+    }
+
+    if (flb_filter_pushdown_fields(pd, fields_get, fields) == FLB_TRUE) {
+        return 1;
+    }
+
+    for (i = 0; i < SL_FIELDS; i++) {
+        if (fields[i].buf) {
+            n++;
+        }
+    }
+
+    msgpack_pack_array(mp_pck, 2);
+    flb_time_append_to_msgpack(&tm, mp_pck, 0);
+    msgpack_pack_map(mp_pck, n);
+    for (i = 0; i < SL_FIELDS; i++) {
+        if (!fields[i].buf) {
+            continue;
+        }
+        len = strlen(sl_keys[i]);
+        msgpack_pack_str(mp_pck, len);
+        msgpack_pack_str_body(mp_pck, sl_keys[i], len);
+        msgpack_pack_str(mp_pck, fields[i].len);
+        msgpack_pack_str_body(mp_pck, fields[i].buf, fields[i].len);
+    }
+
+    return 0;
+}
@@ -0,0 +1,39 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+
+#ifndef FLB_IN_SYSLOG_PARSER_H
+#define FLB_IN_SYSLOG_PARSER_H
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_filter_pushdown.h>
+#include <msgpack.h>
+
+/* Built-in parsers, 'parser_format' property */
+#define FLB_SYSLOG_FMT_REGEX          0   /* a parser from the configuration */
+#define FLB_SYSLOG_FMT_RFC5424        1
+#define FLB_SYSLOG_FMT_RFC3164        2
+#define FLB_SYSLOG_FMT_RFC3164_LOCAL  3   /* RFC3164 without hostname       */
+
+int syslog_parser_format(char *str);
+int syslog_parser_pack(int format, char *buf, size_t size,
+                       struct flb_filter_pushdown *pd,
+                       msgpack_packer *mp_pck);
+
+#endif
@@ -24,93 +24,147 @@
 
 #include "syslog.h"
 #include "syslog_conn.h"
+#include "syslog_parser.h"
 
 static inline void consume_bytes(char *buf, int bytes, int length)
 {
     memmove(buf, buf + bytes, length - bytes);
 }
 
-static inline int pack_line(msgpack_sbuffer *mp_sbuf, msgpack_packer *mp_pck,
+static inline int pack_line(msgpack_packer *mp_pck,
                             struct flb_time *time, char *data, size_t data_size)
 {
     msgpack_pack_array(mp_pck, 2);
     flb_time_append_to_msgpack(time, mp_pck, 0);
-    msgpack_sbuffer_write(mp_sbuf, data, data_size);
+    mp_pck->callback(mp_pck->data, data, data_size);
     return 0;
 }
 
-int syslog_prot_process(struct syslog_conn *conn)
+/*
+ * Parse a message and pack its record, it returns 1 if the filters would
+ * discard the record (nothing is packed).
+ */
+static int process_message(char *buf, size_t size, msgpack_packer *mp_pck,
+                           struct flb_filter_pushdown *pd,
+                           struct flb_syslog *ctx)
 {
-    int len;
     int ret;
-    char *p;
-    char *eof;
-    char *end;
     void *out_buf;
     size_t out_size;
-    struct flb_time out_time;
-    struct flb_syslog *ctx = conn->ctx;
+    struct flb_time out_time = {0};
 
-    msgpack_sbuffer *out_sbuf;
-    msgpack_packer *out_pck;
+    if (flb_filter_pushdown_tag(pd) == FLB_TRUE) {
+        return 1;
+    }
+
+    if (ctx->parser_format != FLB_SYSLOG_FMT_REGEX) {
+        ret = syslog_parser_pack(ctx->parser_format, buf, size, pd, mp_pck);
+        if (ret == -1) {
+            flb_warn("[in_syslog] error parsing log message");
+        }
+        return ret;
+    }
+
+    ret = flb_parser_do(ctx->parser, buf, size,
+                        &out_buf, &out_size, &out_time);
+    if (ret < 0) {
+        flb_warn("[in_syslog] error parsing log message");
+        return -1;
+    }
+
+    if (flb_filter_pushdown_pack(pd, out_buf, out_size) == FLB_TRUE) {
+        flb_free(out_buf);
+        return 1;
+    }
+
+    if (flb_time_to_double(&out_time) == 0) {
+        flb_input_time_get(ctx->i_ins, &out_time);
+    }
+    pack_line(mp_pck, &out_time, out_buf, out_size);
+    flb_free(out_buf);
 
-    out_sbuf = &conn->in->mp_sbuf;
-    out_pck  = &conn->in->mp_pck;
+    return 0;
+}
 
+/*
+ * Messages over a stream are terminated by a new line (or a NULL byte),
+ * a frame starting with a digit is prefixed by the length of the message
+ * instead (octet counting, RFC 6587). The complete messages are consumed,
+ * an incomplete one waits in the buffer for more data.
+ */
+int syslog_prot_process(struct syslog_conn *conn)
+{
+    size_t len;
+    size_t frame;
+    char *p;
+    char *q;
+    char *end;
+    char *eol;
+    char *nul;
+    char *msg;
+    struct flb_syslog *ctx = conn->ctx;
+    msgpack_packer *out_pck;
+
+    out_pck = &conn->in->mp_pck;
     flb_input_buf_write_start(conn->in);
 
-    eof = p = conn->buf_data;
+    p = conn->buf_data;
     end = conn->buf_data + conn->buf_len;
 
-    /* Always parse while some remaining bytes exists */
-    while (eof < end) {
-
-        /* Lookup the ending byte */
-        eof = conn->buf_data + conn->buf_parsed;
-        while (*eof != '\n' && *eof != '\0' && eof < end) {
-            eof++;
+    while (p < end) {
+        /* Separators left between messages */
+        if (*p == '\n' || *p == '\r' || *p == '\0' || *p == ' ') {
+            p++;
+            continue;
         }
 
-        /* Incomplete message */
-        if (eof == end || (*eof != '\n' && *eof != '\0')) {
-            return 0;
+        msg = NULL;
+        if (*p >= '0' && *p <= '9') {
+            /* MSG-LEN SP SYSLOG-MSG, otherwise the frame is taken as a line */
+            frame = 0;
+            for (q = p; q < end && *q >= '0' && *q <= '9' && q - p < 10; q++) {
+                frame = (frame * 10) + (*q - '0');
+            }
+            if (q >= end) {
+                break;
+            }
+            if (*q == ' ') {
+                if ((size_t) (end - q - 1) < frame) {
+                    break;
+                }
+                msg = q + 1;
+                len = frame;
+                p = msg + frame;
+            }
         }
 
-        /* No data ? */
-        len = (eof - p);
-        if (len == 0) {
-            consume_bytes(conn->buf_data, 1, conn->buf_len);
-            conn->buf_len--;
-            conn->buf_parsed = 0;
-            conn->buf_data[conn->buf_len] = '\0';
-            end = conn->buf_data + conn->buf_len;
-
-            if (conn->buf_len == 0) {
-                return 0;
+        if (!msg) {
+            eol = memchr(p, '\n', end - p);
+            nul = memchr(p, '\0', (eol ? eol : end) - p);
+            if (nul) {
+                eol = nul;
             }
-
-            continue;
+            if (!eol) {
+                break;
+            }
+            msg = p;
+            len = eol - p;
+            p = eol + 1;
         }
 
-        /* Process the string */
-        ret = flb_parser_do(ctx->parser, p, len,
-                            &out_buf, &out_size, &out_time);
-        if (ret >= 0) {
-            pack_line(out_sbuf, out_pck, &out_time,
-                      out_buf, out_size);
-            flb_free(out_buf);
+        while (len > 0 && (msg[len - 1] == '\n' || msg[len - 1] == '\r')) {
+            len--;
         }
-        else {
-            flb_warn("[in_syslog] error parsing log message");
+        if (len > 0) {
+            process_message(msg, len, out_pck, &conn->pushdown, ctx);
         }
-
-        conn->buf_parsed += len + 1;
-        end = conn->buf_data + conn->buf_len;
-        eof = p = conn->buf_data + conn->buf_parsed;
     }
 
-    consume_bytes(conn->buf_data, conn->buf_parsed, conn->buf_len);
-    conn->buf_len -= conn->buf_parsed;
+    len = p - conn->buf_data;
+    if (len > 0) {
+        consume_bytes(conn->buf_data, len, conn->buf_len);
+        conn->buf_len -= len;
+    }
     conn->buf_parsed = 0;
     conn->buf_data[conn->buf_len] = '\0';
 
@@ -119,36 +173,10 @@ int syslog_prot_process(struct syslog_conn *conn)
     return 0;
 }
 
-int syslog_prot_process_udp(char *buf, size_t size, struct flb_syslog *ctx)
+/* Parse a datagram and pack the record, the caller owns the buffer */
+int syslog_prot_process_udp(char *buf, size_t size, msgpack_packer *mp_pck,
+                            struct flb_filter_pushdown *pd,
+                            struct flb_syslog *ctx)
 {
-    int ret;
-    void *out_buf;
-    size_t out_size;
-    struct flb_time out_time = {0};
-    msgpack_sbuffer *out_sbuf;
-    msgpack_packer *out_pck;
-
-    out_sbuf = &ctx->i_ins->mp_sbuf;
-    out_pck  = &ctx->i_ins->mp_pck;
-
-    flb_input_buf_write_start(ctx->i_ins);
-
-    ret = flb_parser_do(ctx->parser, buf, size,
-                        &out_buf, &out_size, &out_time);
-    if (ret >= 0) {
-        if (flb_time_to_double(&out_time) == 0) {
-            flb_time_get(&out_time);
-        }
-        pack_line(out_sbuf, out_pck, &out_time,
-                  out_buf, out_size);
-        flb_free(out_buf);
-    }
-    else {
-        flb_warn("[in_syslog] error parsing log message");
-        return -1;
-    }
-
-    flb_input_buf_write_end(ctx->i_ins);
-
-    return 0;
+    return process_message(buf, size, mp_pck, pd, ctx);
 }
@@ -91,6 +91,22 @@ static int syslog_server_net_create(struct flb_syslog *ctx)
     return 0;
 }
 
+static int syslog_server_udp_create(struct flb_syslog *ctx)
+{
+    ctx->server_fd = flb_net_server_udp(ctx->tcp_port, ctx->listen);
+    if (ctx->server_fd > 0) {
+        flb_info("[in_syslog] UDP server binding %s:%s",
+                 ctx->listen, ctx->tcp_port);
+    }
+    else {
+        flb_error("[in_syslog] could not bind address %s:%s. Aborting",
+                  ctx->listen, ctx->tcp_port);
+        return -1;
+    }
+
+    return 0;
+}
+
 int syslog_server_create(struct flb_syslog *ctx)
 {
     int ret;
@@ -98,6 +114,9 @@ int syslog_server_create(struct flb_syslog *ctx)
     if (ctx->mode == FLB_SYSLOG_TCP) {
         ret = syslog_server_net_create(ctx);
     }
+    else if (ctx->mode == FLB_SYSLOG_UDP) {
+        ret = syslog_server_udp_create(ctx);
+    }
     else {
         ret = syslog_server_unix_create(ctx);
     }
@@ -122,7 +141,9 @@ int syslog_server_destroy(struct flb_syslog *ctx)
         flb_free(ctx->tcp_port);
     }
 
-    close(ctx->server_fd);
+    if (ctx->server_fd > 0) {
+        close(ctx->server_fd);
+    }
 
     return 0;
 }
@@ -0,0 +1,271 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+
+#define _GNU_SOURCE
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_log.h>
+#include <fluent-bit/flb_input.h>
+#include <fluent-bit/flb_network.h>
+#include <fluent-bit/flb_input_worker.h>
+#ifdef FLB_HAVE_METRICS
+#include <fluent-bit/flb_metrics.h>
+#endif
+
+#include <errno.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "syslog.h"
+#include "syslog_prot.h"
+#include "syslog_udp.h"
+
+struct syslog_udp *syslog_udp_create(struct flb_syslog *ctx)
+{
+    int i;
+    int ret;
+    struct syslog_udp *udp;
+#ifdef SO_RXQ_OVFL
+    int on = 1;
+#endif
+
+    udp = flb_calloc(1, sizeof(struct syslog_udp));
+    if (!udp) {
+        flb_errno();
+        return NULL;
+    }
+    udp->count = FLB_SYSLOG_UDP_BATCH;
+    udp->size = ctx->buffer_chunk_size;
+    msgpack_sbuffer_init(&udp->mp_sbuf);
+    msgpack_packer_init(&udp->mp_pck, &udp->mp_sbuf, msgpack_sbuffer_write);
+    flb_filter_pushdown_init(&udp->pushdown, ctx->i_ins,
+                             ctx->i_ins->tag, ctx->i_ins->tag_len, NULL, 0);
+
+    udp->buf = flb_malloc(udp->count * (udp->size + 1));
+    udp->msgs = flb_calloc(udp->count, sizeof(struct mmsghdr));
+    udp->iov = flb_calloc(udp->count, sizeof(struct iovec));
+    if (!udp->buf || !udp->msgs || !udp->iov) {
+        flb_errno();
+        syslog_udp_destroy(udp);
+        return NULL;
+    }
+
+#ifdef SO_RXQ_OVFL
+    /* The kernel reports its drops counter along with the datagrams */
+    ret = setsockopt(ctx->server_fd, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on));
+    if (ret == 0) {
+        udp->cmsg_size = CMSG_SPACE(sizeof(uint32_t));
+        udp->cmsg = flb_calloc(udp->count, udp->cmsg_size);
+        if (!udp->cmsg) {
+            flb_errno();
+            syslog_udp_destroy(udp);
+            return NULL;
+        }
+    }
+#endif
+
+    for (i = 0; i < udp->count; i++) {
+        udp->iov[i].iov_base = udp->buf + (i * (udp->size + 1));
+        udp->iov[i].iov_len = udp->size;
+        udp->msgs[i].msg_hdr.msg_iov = &udp->iov[i];
+        udp->msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    if (ctx->receive_buffer_size > 0) {
+        ret = flb_net_socket_rcvbuf(ctx->server_fd, ctx->receive_buffer_size);
+        if (ret == -1) {
+            flb_warn("[in_syslog] could not set the receive buffer size");
+        }
+    }
+
+    return udp;
+}
+
+/* Read a batch of datagrams, returns the number of datagrams read */
+static int udp_recv(flb_sockfd_t fd, struct syslog_udp *udp)
+{
+    int i;
+    int n;
+    struct msghdr *hdr;
+#ifndef FLB_HAVE_RECVMMSG
+    ssize_t bytes = 0;
+#endif
+
+    for (i = 0; i < udp->count; i++) {
+        hdr = &udp->msgs[i].msg_hdr;
+        hdr->msg_name = NULL;
+        hdr->msg_namelen = 0;
+        hdr->msg_flags = 0;
+        if (udp->cmsg) {
+            hdr->msg_control = udp->cmsg + (i * udp->cmsg_size);
+            hdr->msg_controllen = udp->cmsg_size;
+        }
+    }
+
+#ifdef FLB_HAVE_RECVMMSG
+    n = recvmmsg(fd, udp->msgs, udp->count, MSG_DONTWAIT, NULL);
+#else
+    for (n = 0; n < udp->count; n++) {
+        bytes = recvmsg(fd, &udp->msgs[n].msg_hdr, MSG_DONTWAIT);
+        if (bytes == -1) {
+            break;
+        }
+        udp->msgs[n].msg_len = bytes;
+    }
+    if (n == 0 && bytes == -1) {
+        n = -1;
+    }
+#endif
+
+    if (n == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return 0;
+        }
+        flb_errno();
+    }
+
+    return n;
+}
+
+/* Account the datagrams dropped by the kernel since the last batch */
+static void udp_drops(struct flb_syslog *ctx, struct msghdr *hdr)
+{
+#ifdef SO_RXQ_OVFL
+    uint32_t val;
+    uint32_t diff;
+    struct cmsghdr *cm;
+    struct syslog_udp *udp = ctx->udp;
+#ifdef FLB_HAVE_METRICS
+    struct flb_metric *m;
+#endif
+
+    if (!udp->cmsg) {
+        return;
+    }
+
+    for (cm = CMSG_FIRSTHDR(hdr); cm; cm = CMSG_NXTHDR(hdr, cm)) {
+        if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SO_RXQ_OVFL) {
+            continue;
+        }
+
+        memcpy(&val, CMSG_DATA(cm), sizeof(val));
+        diff = val - udp->drops;
+        if (diff == 0) {
+            return;
+        }
+        udp->drops = val;
+        flb_debug("[in_syslog] %u datagrams dropped by the kernel", diff);
+
+#ifdef FLB_HAVE_METRICS
+        /* Workers share the instance metric */
+        if (ctx->i_ins->metrics) {
+            m = flb_metrics_get_id(FLB_SYSLOG_METRIC_DROPS,
+                                   ctx->i_ins->metrics);
+            if (m) {
+                flb_metric_sum(m, diff);
+            }
+        }
+#endif
+        return;
+    }
+#endif
+}
+
+/*
+ * Read the datagrams ready on the socket and pack them in one go, into the
+ * instance buffer or, for a listener worker, into the chunk handed to the
+ * engine thread.
+ */
+int syslog_udp_read(struct flb_syslog *ctx)
+{
+    int i;
+    int n;
+    int ret;
+    int records = 0;
+    char *data;
+    size_t len;
+    msgpack_packer *mp_pck;
+    struct syslog_udp *udp = ctx->udp;
+
+    n = udp_recv(ctx->server_fd, udp);
+    if (n <= 0) {
+        return n;
+    }
+
+    if (!ctx->worker) {
+        flb_input_buf_write_start(ctx->i_ins);
+        mp_pck = &ctx->i_ins->mp_pck;
+    }
+    else {
+        msgpack_sbuffer_clear(&udp->mp_sbuf);
+        mp_pck = &udp->mp_pck;
+    }
+
+    for (i = 0; i < n; i++) {
+        data = udp->iov[i].iov_base;
+        len = udp->msgs[i].msg_len;
+
+        if (udp->msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+            flb_debug("[in_syslog] datagram truncated to %lu bytes",
+                      udp->size);
+        }
+
+        /* Some senders terminate the message */
+        while (len > 0 && (data[len - 1] == '\n' || data[len - 1] == '\0')) {
+            len--;
+        }
+        if (len == 0) {
+            continue;
+        }
+        data[len] = '\0';
+
+        ret = syslog_prot_process_udp(data, len, mp_pck,
+                                      &udp->pushdown, ctx);
+        if (ret == 0) {
+            records++;
+        }
+    }
+
+    /* The counter of the last datagram covers the whole batch */
+    udp_drops(ctx, &udp->msgs[n - 1].msg_hdr);
+
+    if (!ctx->worker) {
+        flb_input_buf_write_end(ctx->i_ins);
+    }
+    else if (records > 0) {
+        flb_input_worker_append(ctx->worker, NULL, 0,
+                                udp->mp_sbuf.data, udp->mp_sbuf.size, records);
+    }
+
+    return n;
+}
+
+void syslog_udp_destroy(struct syslog_udp *udp)
+{
+    msgpack_sbuffer_destroy(&udp->mp_sbuf);
+    flb_filter_pushdown_destroy(&udp->pushdown);
+    flb_free(udp->buf);
+    flb_free(udp->msgs);
+    flb_free(udp->iov);
+    flb_free(udp->cmsg);
+    flb_free(udp);
+}
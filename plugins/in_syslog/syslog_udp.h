@@ -0,0 +1,67 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+
+#ifndef FLB_IN_SYSLOG_UDP_H
+#define FLB_IN_SYSLOG_UDP_H
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_filter_pushdown.h>
+#include <msgpack.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "syslog.h"
+
+#ifndef FLB_HAVE_RECVMMSG
+/* Same layout as the Linux structure, datagrams are read one by one */
+struct mmsghdr {
+    struct msghdr msg_hdr;
+    unsigned int msg_len;
+};
+#endif
+
+/*
+ * Batch receive state of a UDP socket: every datagram of a batch has its
+ * own slot in 'buf' and its own control data, used to get the number of
+ * datagrams dropped by the kernel.
+ */
+struct syslog_udp {
+    int count;                       /* datagrams per batch               */
+    size_t size;                     /* maximum datagram size             */
+    char *buf;                       /* count slots of size + 1 bytes     */
+    struct mmsghdr *msgs;
+    struct iovec *iov;
+    char *cmsg;                      /* control data, count slots         */
+    size_t cmsg_size;
+    uint32_t drops;                  /* last kernel drops counter         */
+
+    /* Records of a listener worker, handed to the engine thread */
+    msgpack_sbuffer mp_sbuf;
+    msgpack_packer mp_pck;
+
+    struct flb_filter_pushdown pushdown; /* filters rules of the tag     */
+};
+
+struct syslog_udp *syslog_udp_create(struct flb_syslog *ctx);
+int syslog_udp_read(struct flb_syslog *ctx);
+void syslog_udp_destroy(struct syslog_udp *udp);
+
+#endif
@@ -63,41 +63,110 @@ static int tag_compose(char *tag, char *unit_name,
     return 0;
 }
 
+/*
+ * Close the buffer write of the current tag. The records are packed
+ * straight into the dyntag buffer so they are not copied again.
+ */
+static void journal_batch_end(struct flb_systemd_config *ctx,
+                              struct flb_input_dyntag *dt, int records)
+{
+    dt->mp_buf_write_records = records;
+    flb_input_dbuf_write_end(dt);
+
+    /* Seal full buffers, no more data can be appended */
+    if (flb_input_chunk_full(ctx->i_ins, dt->mp_sbuf.size,
+                             dt->mp_index.records) == FLB_TRUE) {
+        dt->lock = FLB_TRUE;
+        flb_input_chunk_seal(ctx->i_ins, dt);
+    }
+}
+
+/* Pack the fields of the current entry, returns the bytes written */
+static size_t journal_entry_pack(struct flb_systemd_config *ctx,
+                                 struct flb_input_dyntag *dt)
+{
+    uint32_t entries = 0;
+    size_t off;
+    size_t map;
+    size_t length;
+    char *sep;
+    char *key;
+    char hdr[5];
+    unsigned char *p;
+    time_t sec;
+    long nsec;
+    uint64_t usec;
+    const void *data;
+    struct flb_time tm;
+    msgpack_packer *mp_pck = &dt->mp_pck;
+
+    off = dt->mp_sbuf.size;
+
+    /* Set time */
+    sd_journal_get_realtime_usec(ctx->j, &usec);
+    sec = usec / 1000000;
+    nsec = (usec % 1000000) * 1000;
+    flb_time_set(&tm, sec, nsec);
+
+    msgpack_pack_array(mp_pck, 2);
+    flb_time_append_to_msgpack(&tm, mp_pck, 0);
+
+    /*
+     * The fields are enumerated once: the map is opened with a 32 bits
+     * header that is set once the number of fields is known.
+     */
+    map = dt->mp_sbuf.size;
+    hdr[0] = 0xdf;
+    mp_pck->callback(mp_pck->data, hdr, 5);
+
+    sd_journal_restart_data(ctx->j);
+    while (sd_journal_enumerate_data(ctx->j, &data, &length) > 0) {
+        key = (char *) data;
+        sep = memchr(key, '=', length);
+        if (!sep) {
+            continue;
+        }
+
+        msgpack_pack_str(mp_pck, sep - key);
+        msgpack_pack_str_body(mp_pck, key, sep - key);
+        msgpack_pack_str(mp_pck, length - (sep - key) - 1);
+        msgpack_pack_str_body(mp_pck, sep + 1, length - (sep - key) - 1);
+        entries++;
+    }
+
+    p = (unsigned char *) dt->mp_sbuf.data + map + 1;
+    p[0] = (entries >> 24) & 0xff;
+    p[1] = (entries >> 16) & 0xff;
+    p[2] = (entries >> 8) & 0xff;
+    p[3] = entries & 0xff;
+
+    return dt->mp_sbuf.size - off;
+}
+
 static int in_systemd_collect(struct flb_input_instance *i_ins,
                               struct flb_config *config, void *in_context)
 {
     int ret;
     int ret_j;
-    int len;
-    int entries = 0;
     int rows = 0;
-    time_t sec;
-    long nsec;
-    uint64_t usec;
+    int records = 0;
+    size_t bytes = 0;
     size_t length;
-    char *sep;
-    char *key;
-    char *val;
     char *tag;
-    char *last_tag = NULL;
     char *cursor = NULL;
-    size_t last_tag_len;
+    char last_tag[PATH_MAX];
+    size_t last_tag_len = 0;
     size_t tag_len;
     char out_tag[PATH_MAX];
     const void *data;
     struct flb_systemd_config *ctx = in_context;
-    struct flb_time tm;
-    msgpack_sbuffer mp_sbuf;
-    msgpack_packer mp_pck;
+    struct flb_input_dyntag *dt = NULL;
 
     /* Restricted by mem_buf_limit */
     if (flb_input_buf_paused(i_ins) == FLB_TRUE) {
         return FLB_SYSTEMD_BUSY;
     }
 
-    msgpack_sbuffer_init(&mp_sbuf);
-    msgpack_packer_init(&mp_pck, &mp_sbuf, msgpack_sbuffer_write);
-
     /*
      * if there are not pending records from a previous round, likely we got
      * some changes in the journal, otherwise go ahead and continue reading
@@ -113,14 +182,13 @@ static int in_systemd_collect(struct flb_input_instance *i_ins,
     while ((ret_j = sd_journal_next(ctx->j)) > 0) {
         /* If the tag is composed dynamically, gather the Systemd Unit name */
         if (ctx->dynamic_tag) {
+            tag = out_tag;
             ret = sd_journal_get_data(ctx->j, "_SYSTEMD_UNIT", &data, &length);
             if (ret == 0) {
-                tag = out_tag;
                 tag_compose(ctx->i_ins->tag, (char *) data + 14, length - 14,
                             &tag, &tag_len);
             }
             else {
-                tag = out_tag;
                 tag_compose(ctx->i_ins->tag,
                             FLB_SYSTEMD_UNKNOWN, sizeof(FLB_SYSTEMD_UNKNOWN) - 1,
                             &tag, &tag_len);
@@ -131,102 +199,57 @@ static int in_systemd_collect(struct flb_input_instance *i_ins,
             tag_len = ctx->i_ins->tag_len;
         }
 
-        if (last_tag == NULL) {
-            last_tag = tag;
-            last_tag_len = tag_len;
-        }
-
-        /* Set time */
-        sd_journal_get_realtime_usec(ctx->j, &usec);
-        sec = usec / 1000000;
-        nsec = (usec % 1000000) * 1000;
-        flb_time_set(&tm, sec, nsec);
-
-        /* Count the number of entries in the record */
-        entries = 0;
-        while (sd_journal_enumerate_data(ctx->j, &data, &length)) {
-            entries++;
-        }
-        sd_journal_restart_data(ctx->j);
-
         /*
-         * The new incoming record can have a different tag than previous one,
-         * so a new msgpack buffer is required. We ingest the data and prepare
-         * a new buffer.
+         * Consecutive entries of the same unit share a buffer write, a new
+         * tag closes the current one.
          */
-        if (mp_sbuf.size > 0 &&
-            ((last_tag_len != tag_len) || (strncmp(last_tag, tag, tag_len) != 0))) {
-            flb_input_dyntag_append_raw(ctx->i_ins,
-                                        tag, tag_len,
-                                        mp_sbuf.data,
-                                        mp_sbuf.size);
-            msgpack_sbuffer_destroy(&mp_sbuf);
-            msgpack_sbuffer_init(&mp_sbuf);
-
-            last_tag = tag;
+        if (!dt || last_tag_len != tag_len ||
+            memcmp(last_tag, tag, tag_len) != 0) {
+            if (dt) {
+                journal_batch_end(ctx, dt, records);
+                records = 0;
+            }
+
+            dt = flb_input_dyntag_get(tag, tag_len, ctx->i_ins);
+            if (!dt) {
+                ret_j = -1;
+                break;
+            }
+            flb_input_dbuf_write_start(dt);
+            memcpy(last_tag, tag, tag_len);
             last_tag_len = tag_len;
         }
 
-        /* Prepare buffer and write map content */
-        msgpack_pack_array(&mp_pck, 2);
-        flb_time_append_to_msgpack(&tm, &mp_pck, 0);
-
-        msgpack_pack_map(&mp_pck, entries);
-        while (sd_journal_enumerate_data(ctx->j, &data, &length)) {
-            key = (char *) data;
-            sep = strchr(key, '=');
-            len = (sep - key);
-            msgpack_pack_str(&mp_pck, len);
-            msgpack_pack_str_body(&mp_pck, key, len);
-
-            val = sep + 1;
-            len = length - (sep - key) - 1;
-            msgpack_pack_str(&mp_pck,  len);
-            msgpack_pack_str_body(&mp_pck, val, len);
-        }
+        bytes += journal_entry_pack(ctx, dt);
+        records++;
         rows++;
 
         /*
          * Some journals can have too much data, pause if we have processed
-         * more than 1MB. Journal will resume later.
+         * more than the read budget. Journal will resume later.
          */
-        if (mp_sbuf.size > 1024000) {
-            flb_input_dyntag_append_raw(ctx->i_ins,
-                                        tag, tag_len,
-                                        mp_sbuf.data,
-                                        mp_sbuf.size);
-            msgpack_sbuffer_destroy(&mp_sbuf);
-            msgpack_sbuffer_init(&mp_sbuf);
-            last_tag = tag;
-            last_tag_len = tag_len;
+        if (bytes > FLB_SYSTEMD_BUF_MAX || rows >= ctx->max_entries) {
             ret_j = -1;
             break;
         }
+    }
 
-        if (rows >= ctx->max_entries) {
-            ret_j = -1;
-            break;
-        }
+    if (dt) {
+        journal_batch_end(ctx, dt, records);
     }
 
-    /* Save cursor */
-    if (ctx->db) {
+    /* Keep the cursor, it's committed by the database sync */
+    if (ctx->db && rows > 0) {
         sd_journal_get_cursor(ctx->j, &cursor);
         if (cursor) {
-            flb_systemd_db_set_cursor(ctx, cursor);
-            flb_free(cursor);
+            flb_free(ctx->cursor);
+            ctx->cursor = cursor;
+            if (ctx->db_sync_interval == 0) {
+                flb_systemd_db_sync(ctx);
+            }
         }
     }
 
-    /* Write any pending data into the buffer */
-    if (mp_sbuf.size > 0) {
-        flb_input_dyntag_append_raw(ctx->i_ins,
-                                    tag, tag_len,
-                                    mp_sbuf.data,
-                                    mp_sbuf.size);
-    }
-    msgpack_sbuffer_destroy(&mp_sbuf);
-
     /* the journal is empty, no more records */
     if (ret_j == 0) {
         ctx->pending_records = FLB_FALSE;
@@ -242,6 +265,27 @@ static int in_systemd_collect(struct flb_input_instance *i_ins,
     return FLB_SYSTEMD_MORE;
 }
 
+/*
+ * Journal events and the pending records timer. When the read budget is
+ * used up the channel manager is signaled, so the reading goes on in the
+ * next event loop round instead of waiting for the timer.
+ */
+static int in_systemd_collect_journal(struct flb_input_instance *i_ins,
+                                      struct flb_config *config,
+                                      void *in_context)
+{
+    int ret;
+    uint64_t val = 0xc002;
+    struct flb_systemd_config *ctx = in_context;
+
+    ret = in_systemd_collect(i_ins, config, in_context);
+    if (ret == FLB_SYSTEMD_MORE && ctx->signaled == FLB_FALSE) {
+        ctx->signaled = FLB_TRUE;
+        write(ctx->ch_manager[1], &val, sizeof(uint64_t));
+    }
+    return 0;
+}
+
 static int in_systemd_collect_archive(struct flb_input_instance *i_ins,
                                       struct flb_config *config, void *in_context)
 {
@@ -255,12 +299,18 @@ static int in_systemd_collect_archive(struct flb_input_instance *i_ins,
         flb_errno();
         return -1;
     }
+    ctx->signaled = FLB_FALSE;
+
+    /* Catching up after the archive was read */
+    if (ctx->coll_fd_journal != -1) {
+        return in_systemd_collect_journal(i_ins, config, in_context);
+    }
 
     ret = in_systemd_collect(i_ins, config, in_context);
     if (ret == FLB_SYSTEMD_OK) {
         /* Events collector: journald events */
         ret = flb_input_set_collector_event(i_ins,
-                                            in_systemd_collect,
+                                            in_systemd_collect_journal,
                                             ctx->fd,
                                             config);
         if (ret == -1) {
@@ -273,7 +323,7 @@ static int in_systemd_collect_archive(struct flb_input_instance *i_ins,
 
         /* Timer to collect pending events */
         ret = flb_input_set_collector_time(i_ins,
-                                           in_systemd_collect,
+                                           in_systemd_collect_journal,
                                            1, 0,
                                            config);
         if (ret == -1) {
@@ -289,6 +339,7 @@ static int in_systemd_collect_archive(struct flb_input_instance *i_ins,
     }
 
     /* If FLB_SYSTEMD_NONE or FLB_SYSTEMD_MORE, keep trying */
+    ctx->signaled = FLB_TRUE;
     write(ctx->ch_manager[1], &val, sizeof(uint64_t));
 
     return 0;
@@ -318,6 +369,18 @@ static int in_systemd_init(struct flb_input_instance *in,
     }
     ctx->coll_fd_archive = ret;
 
+    /* Commit the cursor periodically */
+    if (ctx->db && ctx->db_sync_interval > 0) {
+        ret = flb_input_set_collector_time(in, flb_systemd_db_sync_callback,
+                                           ctx->db_sync_interval, 0,
+                                           config);
+        if (ret == -1) {
+            flb_systemd_config_destroy(ctx);
+            return -1;
+        }
+        ctx->coll_fd_db_sync = ret;
+    }
+
     return 0;
 }
 
@@ -331,6 +394,7 @@ static int in_systemd_pre_run(struct flb_input_instance *i_ins,
     (void) config;
 
     /* Insert a dummy event into the channel manager */
+    ctx->signaled = FLB_TRUE;
     n = write(ctx->ch_manager[1], &val, sizeof(val));
     if (n == -1) {
         flb_errno();
@@ -375,6 +439,11 @@ static int in_systemd_exit(void *data, struct flb_config *config)
     (void) *config;
     struct flb_systemd_config *ctx = data;
 
+    /* Last read cursor */
+    if (ctx->db) {
+        flb_systemd_db_sync(ctx);
+    }
+
     flb_systemd_config_destroy(ctx);
     return 0;
 }
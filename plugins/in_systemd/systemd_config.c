@@ -47,6 +47,11 @@ struct flb_systemd_config *flb_systemd_config_create(struct flb_input_instance *
         return NULL;
     }
 
+    ctx->coll_fd_journal = -1;
+    ctx->coll_fd_pending = -1;
+    ctx->coll_fd_db_sync = -1;
+    ctx->db_sync_interval = FLB_SYSTEMD_DB_SYNC;
+
     /* Create the channel manager */
     ret = pipe(ctx->ch_manager);
     if (ret == -1) {
@@ -113,6 +118,15 @@ struct flb_systemd_config *flb_systemd_config_create(struct flb_input_instance *
         }
     }
 
+    tmp = flb_input_get_property("db.sync_interval", i_ins);
+    if (tmp) {
+        ctx->db_sync_interval = atoi(tmp);
+        if (ctx->db_sync_interval < 0) {
+            flb_error("[in_systemd] invalid database 'db.sync_interval' value");
+            ctx->db_sync_interval = FLB_SYSTEMD_DB_SYNC;
+        }
+    }
+
     /* Max number of entries per notification */
     tmp = flb_input_get_property("max_entries", i_ins);
     if (tmp) {
@@ -203,6 +217,10 @@ int flb_systemd_config_destroy(struct flb_systemd_config *ctx)
         flb_systemd_db_close(ctx->db);
     }
 
+    if (ctx->cursor) {
+        flb_free(ctx->cursor);
+    }
+
     close(ctx->ch_manager[0]);
     close(ctx->ch_manager[1]);
 
@@ -36,23 +36,29 @@
 #define FLB_SYSTEMD_UNIT     "_SYSTEMD_UNIT"
 #define FLB_SYSTEMD_UNKNOWN  "unknown"
 #define FLB_SYSTEND_ENTRIES  5000
+#define FLB_SYSTEMD_BUF_MAX  1024000  /* bytes read per collect          */
+#define FLB_SYSTEMD_DB_SYNC  1        /* commit the cursor every second  */
 
 /* Input configuration & context */
 struct flb_systemd_config {
     /* Journal */
     int fd;          /* Journal file descriptor */
     sd_journal *j;   /* Journal context */
-    char *cursor;
+    char *cursor;    /* last read cursor, not committed yet */
     char *path;
     int pending_records;
+    int signaled;    /* the channel manager has a pending event */
 
     /* Internal */
     int ch_manager[2];         /* pipe: channel manager    */
     int coll_fd_archive;       /* archive collector        */
     int coll_fd_journal;       /* journal, events mode     */
     int coll_fd_pending;       /* pending records          */
+    int coll_fd_db_sync;       /* cursor commits           */
     int dynamic_tag;
     int max_entries;
+    int db_sync_interval;      /* seconds between commits, 0 = every read */
+    int db_cursor_row;         /* the cursor row exists    */
     struct flb_sqldb *db;
     struct flb_input_instance *i_ins;
 };
@@ -74,36 +74,74 @@ int flb_systemd_db_set_cursor(struct flb_systemd_config *ctx, char *cursor)
 {
     int ret;
     char query[PATH_MAX];
-    struct query_status qs = {0};
-
-    /* Check if the file exists */
-    memset(&qs, '\0', sizeof(qs));
-    ret = flb_sqldb_query(ctx->db,
-                          SQL_GET_CURSOR, cb_cursor_check, &qs);
 
-    if (qs.rows == 0) {
-        /* Register the cursor */
+    /* The row is known from the cursor lookup at start */
+    if (ctx->db_cursor_row == FLB_FALSE) {
         snprintf(query, sizeof(query) - 1,
                  SQL_INSERT_CURSOR,
                  cursor, time(NULL));
-        ret = flb_sqldb_query(ctx->db,
-                              query, NULL, NULL);
-        if (ret == FLB_ERROR) {
-            return -1;
-        }
-        return 0;
+    }
+    else {
+        snprintf(query, sizeof(query) - 1,
+                 SQL_UPDATE_CURSOR,
+                 cursor, time(NULL));
     }
 
-    /* Register the cursor */
-    flb_free(qs.cursor);
-    snprintf(query, sizeof(query) - 1,
-             SQL_UPDATE_CURSOR,
-             cursor, time(NULL));
     ret = flb_sqldb_query(ctx->db,
                           query, NULL, NULL);
     if (ret == FLB_ERROR) {
         return -1;
     }
+    ctx->db_cursor_row = FLB_TRUE;
+    return 0;
+}
+
+/*
+ * Commit the last read cursor in its own transaction. Reading only keeps
+ * the cursor in memory, so the database is written once per interval and
+ * not once per read.
+ */
+int flb_systemd_db_sync(struct flb_systemd_config *ctx)
+{
+    int ret;
+
+    if (!ctx->cursor) {
+        return 0;
+    }
+
+    ret = flb_sqldb_query(ctx->db, SQL_BEGIN, NULL, NULL);
+    if (ret != FLB_OK) {
+        return -1;
+    }
+
+    ret = flb_systemd_db_set_cursor(ctx, ctx->cursor);
+    if (ret == -1) {
+        flb_error("[in_systemd:db] could not update cursor");
+        flb_sqldb_query(ctx->db, SQL_ROLLBACK, NULL, NULL);
+        return -1;
+    }
+
+    ret = flb_sqldb_query(ctx->db, SQL_COMMIT, NULL, NULL);
+    if (ret != FLB_OK) {
+        flb_sqldb_query(ctx->db, SQL_ROLLBACK, NULL, NULL);
+        return -1;
+    }
+
+    /* The cursor is now in the database */
+    flb_free(ctx->cursor);
+    ctx->cursor = NULL;
+
+    return 0;
+}
+
+/* cb_collect callback: commit the pending cursor */
+int flb_systemd_db_sync_callback(struct flb_input_instance *i_ins,
+                                 struct flb_config *config, void *context)
+{
+    (void) i_ins;
+    (void) config;
+
+    flb_systemd_db_sync(context);
     return 0;
 }
 
@@ -120,6 +158,8 @@ char *flb_systemd_db_get_cursor(struct flb_systemd_config *ctx)
     }
 
     if (qs.rows > 0) {
+        ctx->db_cursor_row = FLB_TRUE;
+
         /* cursor must be freed by the caller */
         return qs.cursor;
     }
@@ -42,10 +42,17 @@
 #define SQL_UPDATE_CURSOR \
     "UPDATE in_systemd_cursor SET cursor='%s', updated=%lu;"
 
+#define SQL_BEGIN       "BEGIN TRANSACTION;"
+#define SQL_COMMIT      "COMMIT;"
+#define SQL_ROLLBACK    "ROLLBACK;"
+
 struct flb_sqldb *flb_systemd_db_open(char *path, struct flb_input_instance *in,
                                       struct flb_config *config);
 int flb_systemd_db_close(struct flb_sqldb *db);
 int flb_systemd_db_set_cursor(struct flb_systemd_config *ctx, char *cursor);
 char *flb_systemd_db_get_cursor(struct flb_systemd_config *ctx);
+int flb_systemd_db_sync(struct flb_systemd_config *ctx);
+int flb_systemd_db_sync_callback(struct flb_input_instance *i_ins,
+                                 struct flb_config *config, void *context);
 
 #endif
@@ -38,6 +38,7 @@
 #include "tail_signal.h"
 #include "tail_config.h"
 #include "tail_multiline.h"
+#include "tail_thread.h"
 
 static inline int consume_byte(int fd)
 {
@@ -54,6 +55,76 @@ static inline int consume_byte(int fd)
     return 0;
 }
 
+static int cmp_lag(const void *a, const void *b)
+{
+    struct flb_tail_file *fa = *(struct flb_tail_file **) a;
+    struct flb_tail_file *fb = *(struct flb_tail_file **) b;
+
+    if (fa->lag == fb->lag) {
+        return 0;
+    }
+    return (fa->lag > fb->lag) ? -1 : 1;
+}
+
+/*
+ * Set the order the files are read on this cycle: files take turns to be
+ * the first one, or with 'read_priority lag' the ones most behind go first.
+ * The order matters once the engine pause the input in the middle of a
+ * cycle.
+ */
+static void in_tail_order_files(struct flb_tail_config *ctx,
+                                struct mk_list *files)
+{
+    int i;
+    int n = 0;
+    struct stat st;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct flb_tail_file *file;
+    struct flb_tail_file **sorted;
+
+    if (mk_list_is_empty(files) == 0) {
+        return;
+    }
+
+    if (ctx->read_lag_first == FLB_FALSE) {
+        head = files->next;
+        mk_list_del(head);
+        mk_list_add(head, files);
+        return;
+    }
+
+    mk_list_foreach(head, files) {
+        file = mk_list_entry(head, struct flb_tail_file, _head);
+        if (file->tail_mode == FLB_TAIL_EVENT) {
+            file->lag = file->pending_bytes;
+        }
+        else if (fstat(file->fd, &st) == 0) {
+            file->lag = st.st_size - flb_tail_file_pos(file);
+        }
+        n++;
+    }
+
+    sorted = flb_malloc(sizeof(struct flb_tail_file *) * n);
+    if (!sorted) {
+        flb_errno();
+        return;
+    }
+
+    i = 0;
+    mk_list_foreach_safe(head, tmp, files) {
+        file = mk_list_entry(head, struct flb_tail_file, _head);
+        sorted[i++] = file;
+        mk_list_del(&file->_head);
+    }
+
+    qsort(sorted, n, sizeof(struct flb_tail_file *), cmp_lag);
+    for (i = 0; i < n; i++) {
+        mk_list_add(&sorted[i]->_head, files);
+    }
+    flb_free(sorted);
+}
+
 /* cb_collect callback */
 static int in_tail_collect_pending(struct flb_input_instance *i_ins,
                                    struct flb_config *config, void *in_context)
@@ -66,12 +137,20 @@ static int in_tail_collect_pending(struct flb_input_instance *i_ins,
     struct flb_tail_file *file;
     struct stat st;
 
-    /* Iterate promoted event files with pending bytes */
+    /* Read promoted event files with pending bytes */
+    in_tail_order_files(ctx, &ctx->files_event);
+    mk_list_foreach(head, &ctx->files_event) {
+        file = mk_list_entry(head, struct flb_tail_file, _head);
+        file->chunk_pending = (file->pending_bytes > 0);
+    }
+    flb_tail_thread_chunks(ctx, &ctx->files_event);
+
     mk_list_foreach_safe(head, tmp, &ctx->files_event) {
         file = mk_list_entry(head, struct flb_tail_file, _head);
-        if (file->pending_bytes <= 0) {
+        if (file->chunk_pending == FLB_FALSE) {
             continue;
         }
+        file->chunk_pending = FLB_FALSE;
 
         /* Gather current file size */
         ret = fstat(file->fd, &st);
@@ -81,7 +160,7 @@ static int in_tail_collect_pending(struct flb_input_instance *i_ins,
             continue;
         }
 
-        ret = flb_tail_file_chunk(file);
+        ret = file->chunk_ret;
         switch (ret) {
         case FLB_TAIL_ERROR:
             /* Could not longer read the file */
@@ -93,8 +172,8 @@ static int in_tail_collect_pending(struct flb_input_instance *i_ins,
              * Adjust counter to verify if we need a further read(2) later.
              * For more details refer to tail_fs_inotify.c:96.
              */
-            if (file->offset < st.st_size) {
-                file->pending_bytes = (st.st_size - file->offset);
+            if (flb_tail_file_pos(file) < st.st_size) {
+                file->pending_bytes = (st.st_size - flb_tail_file_pos(file));
                 active++;
             }
             else {
@@ -124,9 +203,17 @@ static int in_tail_collect_static(struct flb_input_instance *i_ins,
     struct flb_tail_file *file;
 
     /* Do a data chunk collection for each file */
+    in_tail_order_files(ctx, &ctx->files_static);
+    mk_list_foreach(head, &ctx->files_static) {
+        file = mk_list_entry(head, struct flb_tail_file, _head);
+        file->chunk_pending = FLB_TRUE;
+    }
+    flb_tail_thread_chunks(ctx, &ctx->files_static);
+
     mk_list_foreach_safe(head, tmp, &ctx->files_static) {
         file = mk_list_entry(head, struct flb_tail_file, _head);
-        ret = flb_tail_file_chunk(file);
+        file->chunk_pending = FLB_FALSE;
+        ret = file->chunk_ret;
         switch (ret) {
         case FLB_TAIL_ERROR:
             /* Could not longer read the file */
@@ -163,10 +250,22 @@ static int in_tail_collect_static(struct flb_input_instance *i_ins,
 int in_tail_collect_event(void *file, struct flb_config *config)
 {
     int ret;
+    struct stat st;
     struct flb_tail_file *f = file;
+    struct flb_tail_config *ctx = f->config;
 
     flb_debug("[in_tail] file=%s event", f->name);
 
+    /* With reader threads, files are read in batches as pending bytes */
+    if (ctx->threads > 1) {
+        ret = fstat(f->fd, &st);
+        if (ret == 0 && flb_tail_file_pos(f) < st.st_size) {
+            f->pending_bytes = (st.st_size - flb_tail_file_pos(f));
+            tail_signal_pending(ctx);
+        }
+        return FLB_TAIL_OK;
+    }
+
     ret = flb_tail_file_chunk(f);
     switch (ret) {
     case FLB_TAIL_ERROR:
@@ -195,6 +294,15 @@ static int in_tail_init(struct flb_input_instance *in,
     }
     ctx->i_ins = in;
 
+    /* Start reader threads */
+    if (ctx->threads > 1) {
+        ret = flb_tail_thread_start(ctx);
+        if (ret == -1) {
+            flb_tail_config_destroy(ctx);
+            return -1;
+        }
+    }
+
     /* Initialize file-system watcher */
     ret = flb_tail_fs_init(in, ctx, config);
     if (ret == -1) {
@@ -261,6 +369,18 @@ static int in_tail_init(struct flb_input_instance *in,
         ctx->coll_fd_mult_flush = ret;
     }
 
+    /* Register callback to commit file offsets into the database */
+    if (ctx->db && ctx->db_sync_interval > 0) {
+        ret = flb_input_set_collector_time(in, flb_tail_db_sync_callback,
+                                           ctx->db_sync_interval, 0,
+                                           config);
+        if (ret == -1) {
+            flb_tail_config_destroy(ctx);
+            return -1;
+        }
+        ctx->coll_fd_db_sync = ret;
+    }
+
     return 0;
 }
 
@@ -283,7 +403,13 @@ static int in_tail_exit(void *data, struct flb_config *config)
         flb_utils_split_free(ctx->exclude_list);
     }
 
+    /* Commit the last offsets */
+    if (ctx->db) {
+        flb_tail_db_sync(ctx);
+    }
+
     flb_tail_file_remove_all(ctx);
+    flb_tail_fs_exit(ctx);
     flb_tail_config_destroy(ctx);
 
     return 0;
@@ -37,6 +37,17 @@
 #define FLB_TAIL_CHUNK        32*1024 /* buffer chunk = 32KB            */
 #define FLB_TAIL_REFRESH      60      /* refresh every 60 seconds       */
 #define FLB_TAIL_ROTATE_WAIT  5       /* time to monitor after rotation */
+#define FLB_TAIL_DB_SYNC      1       /* commit offsets every second    */
+#define FLB_TAIL_LINES        256     /* lines found per scan           */
+#define FLB_TAIL_MMAP_CHUNK   4*1024*1024 /* mmap window = 4MB          */
+#define FLB_TAIL_HASH_SIZE    1024    /* slots of the files index       */
+#define FLB_TAIL_GZIP_PATTERN "*.gz"  /* files decoded as gzip          */
+
+/* Per file metrics, refreshed every 'refresh_interval' */
+#define FLB_TAIL_METRIC_LAG    0    /* bytes behind the file size     */
+#define FLB_TAIL_METRIC_BYTES  1    /* bytes read per second          */
+#define FLB_TAIL_METRIC_LINES  2    /* lines processed per second     */
+#define FLB_TAIL_METRIC_IDLE   3    /* seconds since the last read    */
 
 int in_tail_collect_event(void *file, struct flb_config *config);
 
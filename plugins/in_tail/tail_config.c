@@ -29,6 +29,8 @@
 #include "tail_config.h"
 #include "tail_scan.h"
 #include "tail_multiline.h"
+#include "tail_docker.h"
+#include "tail_thread.h"
 
 struct flb_tail_config *flb_tail_config_create(struct flb_input_instance *i_ins,
                                                struct flb_config *config)
@@ -49,7 +51,16 @@ struct flb_tail_config *flb_tail_config_create(struct flb_input_instance *i_ins,
     ctx->dynamic_tag = FLB_FALSE;
     ctx->ignore_older = 0;
     ctx->skip_long_lines = FLB_FALSE;
+    ctx->read_mmap = FLB_FALSE;
+    ctx->read_budget_bytes = 0;
+    ctx->read_budget_lines = 0;
+    ctx->read_lag_first = FLB_FALSE;
+    ctx->docker_mode = FLB_TAIL_DOCKER_OFF;
+    ctx->threads = 1;
+    mk_list_init(&ctx->readers);
     ctx->db_sync = -1;
+    ctx->db_sync_interval = FLB_TAIL_DB_SYNC;
+    ctx->db_journal_mode = "WAL";
 
     /* Create the channel manager */
     ret = pipe(ctx->ch_manager);
@@ -88,6 +99,12 @@ struct flb_tail_config *flb_tail_config_create(struct flb_input_instance *i_ins,
     ctx->exclude_path = flb_input_get_property("exclude_path", i_ins);
     ctx->exclude_list = NULL;
 
+    /* Config: file names pattern of gzip compressed files */
+    ctx->gzip_pattern = flb_input_get_property("gzip_pattern", i_ins);
+    if (!ctx->gzip_pattern) {
+        ctx->gzip_pattern = FLB_TAIL_GZIP_PATTERN;
+    }
+
     /* Config: key for unstructured log */
     tmp = flb_input_get_property("key", i_ins);
     if (tmp) {
@@ -211,6 +228,80 @@ struct flb_tail_config *flb_tail_config_create(struct flb_input_instance *i_ins,
         ctx->skip_long_lines = flb_utils_bool(tmp);
     }
 
+    /* Config: how static files are read: 'read' or 'mmap' */
+    tmp = flb_input_get_property("read_mode", i_ins);
+    if (tmp) {
+        if (strcasecmp(tmp, "mmap") == 0) {
+            ctx->read_mmap = FLB_TRUE;
+        }
+        else if (strcasecmp(tmp, "read") != 0) {
+            flb_error("[in_tail] invalid 'read_mode' value, using 'read'");
+        }
+    }
+
+    /* Config: per file budget on each collection cycle */
+    tmp = flb_input_get_property("read_budget_bytes", i_ins);
+    if (tmp) {
+        bytes = flb_utils_size_to_bytes(tmp);
+        if (bytes < 0) {
+            flb_error("[in_tail] invalid 'read_budget_bytes' value");
+        }
+        else {
+            ctx->read_budget_bytes = (size_t) bytes;
+        }
+    }
+
+    tmp = flb_input_get_property("read_budget_lines", i_ins);
+    if (tmp) {
+        ctx->read_budget_lines = atoi(tmp);
+        if (ctx->read_budget_lines < 0) {
+            flb_error("[in_tail] invalid 'read_budget_lines' value");
+            ctx->read_budget_lines = 0;
+        }
+    }
+
+    /* Config: order of the files on each cycle: 'rr' or 'lag' */
+    tmp = flb_input_get_property("read_priority", i_ins);
+    if (tmp) {
+        if (strcasecmp(tmp, "lag") == 0) {
+            ctx->read_lag_first = FLB_TRUE;
+        }
+        else if (strcasecmp(tmp, "rr") != 0) {
+            flb_error("[in_tail] invalid 'read_priority' value, using 'rr'");
+        }
+    }
+
+    /* Config: native decoding of container logs: 'off', 'docker' or 'cri' */
+    tmp = flb_input_get_property("docker_mode", i_ins);
+    if (tmp) {
+        if (strcasecmp(tmp, "docker") == 0 || strcasecmp(tmp, "on") == 0) {
+            ctx->docker_mode = FLB_TAIL_DOCKER_JSON;
+        }
+        else if (strcasecmp(tmp, "cri") == 0) {
+            ctx->docker_mode = FLB_TAIL_DOCKER_CRI;
+        }
+        else if (strcasecmp(tmp, "off") != 0) {
+            flb_error("[in_tail] invalid 'docker_mode' value, using 'off'");
+        }
+    }
+
+    /* Config: number of reader threads */
+    tmp = flb_input_get_property("threads", i_ins);
+    if (tmp) {
+        ctx->threads = atoi(tmp);
+        if (ctx->threads < 1) {
+            flb_error("[in_tail] invalid 'threads' value, using 1");
+            ctx->threads = 1;
+        }
+    }
+
+    /* Multiline records are appended while reading, not in the readers */
+    if (ctx->threads > 1 && ctx->multiline == FLB_TRUE) {
+        flb_warn("[in_tail] 'threads' is not supported with multiline, "
+                 "using 1");
+        ctx->threads = 1;
+    }
+
     /* Validate buffer limit */
     if (ctx->buf_chunk_size > ctx->buf_max_size) {
         flb_error("[in_tail] buffer_max_size must be >= buffer_chunk");
@@ -232,8 +323,18 @@ struct flb_tail_config *flb_tail_config_create(struct flb_input_instance *i_ins,
     mk_list_init(&ctx->files_static);
     mk_list_init(&ctx->files_event);
     mk_list_init(&ctx->files_rotated);
+    mk_list_init(&ctx->files_deleted);
+    mk_list_init(&ctx->watch_dirs);
+    ctx->scan_pending = FLB_TRUE;
     ctx->db = NULL;
 
+    ctx->files_hash = flb_hash_create(FLB_HASH_EVICT_NONE,
+                                      FLB_TAIL_HASH_SIZE, -1);
+    if (!ctx->files_hash) {
+        flb_free(ctx);
+        return NULL;
+    }
+
     /* Check if it should use dynamic tags */
     tmp = strchr(i_ins->tag, '*');
     if (tmp) {
@@ -261,6 +362,30 @@ struct flb_tail_config *flb_tail_config_create(struct flb_input_instance *i_ins,
         }
     }
 
+    tmp = flb_input_get_property("db.sync_interval", i_ins);
+    if (tmp) {
+        ctx->db_sync_interval = atoi(tmp);
+        if (ctx->db_sync_interval < 0) {
+            flb_error("[in_tail] invalid database 'db.sync_interval' value");
+            ctx->db_sync_interval = FLB_TAIL_DB_SYNC;
+        }
+    }
+
+    tmp = flb_input_get_property("db.journal_mode", i_ins);
+    if (tmp) {
+        if (strcasecmp(tmp, "wal") == 0 ||
+            strcasecmp(tmp, "delete") == 0 ||
+            strcasecmp(tmp, "truncate") == 0 ||
+            strcasecmp(tmp, "persist") == 0 ||
+            strcasecmp(tmp, "memory") == 0 ||
+            strcasecmp(tmp, "off") == 0) {
+            ctx->db_journal_mode = tmp;
+        }
+        else {
+            flb_error("[in_tail] invalid database 'db.journal_mode' value");
+        }
+    }
+
     /* Initialize database */
     tmp = flb_input_get_property("db", i_ins);
     if (tmp) {
@@ -275,6 +400,7 @@ struct flb_tail_config *flb_tail_config_create(struct flb_input_instance *i_ins,
 
 int flb_tail_config_destroy(struct flb_tail_config *config)
 {
+    flb_tail_thread_stop(config);
     flb_tail_mult_destroy(config);
 
     /* Close pipe ends */
@@ -287,6 +413,10 @@ int flb_tail_config_destroy(struct flb_tail_config *config)
         flb_tail_db_close(config->db);
     }
 
+    if (config->files_hash) {
+        flb_hash_destroy(config->files_hash);
+    }
+
     if (config->key != NULL) {
         flb_free(config->key);
     }
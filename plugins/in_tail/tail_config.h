@@ -20,10 +20,13 @@
 #ifndef FLB_TAIL_CONFIG_H
 #define FLB_TAIL_CONFIG_H
 
+#include <pthread.h>
+
 #include <fluent-bit/flb_info.h>
 #include <fluent-bit/flb_input.h>
 #include <fluent-bit/flb_parser.h>
 #include <fluent-bit/flb_macros.h>
+#include <fluent-bit/flb_hash.h>
 
 struct flb_tail_config {
     int fd_notify;             /* inotify fd               */
@@ -40,6 +43,7 @@ struct flb_tail_config {
     int coll_fd_rotated;
     int coll_fd_pending;
     int coll_fd_mult_flush;
+    int coll_fd_db_sync;
 
     /* Backend collectors */
     int coll_fd_fs1;           /* used by fs_inotify & fs_stat */
@@ -54,15 +58,23 @@ struct flb_tail_config {
     time_t last_pending;       /* last time a 'pending signal' was emitted' */
     char *path;                /* lookup path (glob)           */
     char *exclude_path;        /* exclude path                 */
+    char *gzip_pattern;        /* names of compressed files    */
     char *path_key;            /* key name of file path        */
     int   path_key_len;        /* length of key name           */
     char *key;                 /* key for unstructured record  */
     int   key_len;             /* length of key ^              */
     int   skip_long_lines;     /* skip long lines              */
+    int   read_mmap;           /* map static files ?           */
+    size_t read_budget_bytes;  /* bytes per file and cycle, 0=a chunk */
+    int   read_budget_lines;   /* lines per file and cycle, 0=no limit */
+    int   read_lag_first;      /* read files most behind first ?      */
+    int   docker_mode;         /* native docker/cri decoding          */
 
     /* Database */
     struct flb_sqldb *db;
     int db_sync;
+    int db_sync_interval;      /* seconds between commits, 0 = every read */
+    char *db_journal_mode;     /* sqlite journal mode         */
 
     /* Parser / Format */
     struct flb_parser *parser;
@@ -70,16 +82,35 @@ struct flb_tail_config {
     /* Multiline */
     int multiline;             /* multiline enabled ?  */
     int multiline_flush;       /* multiline flush/wait */
-    struct flb_parser *mult_parser_firstline;
-    struct mk_list mult_parsers;
+    struct flb_tail_mult *mult_firstline;  /* start rule            */
+    struct mk_list mult_parsers;           /* continuation rules    */
+    struct mk_list mult_pending;           /* files by flush deadline */
 
     /* Lists head for files consumed statically (read) and by events (inotify) */
     struct mk_list files_static;
     struct mk_list files_event;
 
+    /* Index of the files above by name, used to lookup new scan entries */
+    struct flb_hash *files_hash;
+
+    /* Directories watched for new files (fs_inotify only) */
+    int scan_pending;          /* full re-scan required ?  */
+    struct mk_list watch_dirs;
+
     /* List of rotated files that needs to be removed after 'rotate_wait' */
     struct mk_list files_rotated;
 
+    /* Deleted files, used to resume their compressed copy (tail_gzip.c) */
+    struct mk_list files_deleted;
+
+    /* Reader threads (tail_thread.c) */
+    int threads;               /* number of readers, 1 = none   */
+    int th_running;            /* readers still in the batch    */
+    pthread_mutex_t th_mutex;
+    pthread_cond_t th_cond;
+    struct mk_list *th_files;  /* list of files being read      */
+    struct mk_list readers;
+
     /* List of shell patterns used to exclude certain file names */
     struct mk_list *exclude_list;
 
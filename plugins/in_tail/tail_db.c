@@ -56,6 +56,17 @@ struct flb_sqldb *flb_tail_db_open(char *path,
         return NULL;
     }
 
+    if (ctx->db_journal_mode) {
+        snprintf(tmp, sizeof(tmp) - 1, SQL_PRAGMA_JOURNAL_MODE,
+                 ctx->db_journal_mode);
+        ret = flb_sqldb_query(db, tmp, NULL, NULL);
+        if (ret != FLB_OK) {
+            flb_error("[in_tail:db] could not set pragma 'journal_mode'");
+            flb_sqldb_close(db);
+            return NULL;
+        }
+    }
+
     if (ctx->db_sync >= 0) {
         snprintf(tmp, sizeof(tmp) - 1, SQL_PRAGMA_SYNC,
                  ctx->db_sync);
@@ -116,17 +127,18 @@ int flb_tail_db_file_set(struct flb_tail_file *file,
 
         /* Get the database ID for this file */
         file->db_id = flb_sqldb_last_id(ctx->db);
+        file->db_offset = 0;
         return 0;
     }
 
     file->db_id  = qs.id;
     file->offset = qs.offset;
+    file->db_offset = qs.offset;
     return 0;
 }
 
-/* Update offset */
-int flb_tail_db_file_offset(struct flb_tail_file *file,
-                            struct flb_tail_config *ctx)
+static int db_file_offset(struct flb_tail_file *file,
+                          struct flb_tail_config *ctx)
 {
     int ret;
     char query[PATH_MAX];
@@ -144,6 +156,108 @@ int flb_tail_db_file_offset(struct flb_tail_file *file,
     return 0;
 }
 
+/* Update offset */
+int flb_tail_db_file_offset(struct flb_tail_file *file,
+                            struct flb_tail_config *ctx)
+{
+    int ret;
+
+    if (file->offset == file->db_offset) {
+        return 0;
+    }
+
+    ret = db_file_offset(file, ctx);
+    if (ret == -1) {
+        return -1;
+    }
+    file->db_offset = file->offset;
+
+    return 0;
+}
+
+static int db_sync_list(struct mk_list *list, struct flb_tail_config *ctx,
+                        int commit)
+{
+    int ret;
+    int count = 0;
+    struct mk_list *head;
+    struct flb_tail_file *file;
+
+    mk_list_foreach(head, list) {
+        file = mk_list_entry(head, struct flb_tail_file, _head);
+        if (file->offset == file->db_offset) {
+            continue;
+        }
+
+        if (commit == FLB_TRUE) {
+            file->db_offset = file->offset;
+            continue;
+        }
+
+        ret = db_file_offset(file, ctx);
+        if (ret == -1) {
+            return -1;
+        }
+        count++;
+    }
+
+    return count;
+}
+
+/*
+ * Write the offsets of every file that moved since the last sync in a
+ * single transaction, so the journal is synced once per interval and not
+ * once per read.
+ */
+int flb_tail_db_sync(struct flb_tail_config *ctx)
+{
+    int ret;
+    int count;
+
+    ret = flb_sqldb_query(ctx->db, SQL_BEGIN, NULL, NULL);
+    if (ret != FLB_OK) {
+        return -1;
+    }
+
+    count = db_sync_list(&ctx->files_static, ctx, FLB_FALSE);
+    if (count >= 0) {
+        ret = db_sync_list(&ctx->files_event, ctx, FLB_FALSE);
+        count = (ret == -1) ? -1 : count + ret;
+    }
+
+    if (count == -1) {
+        flb_error("[in_tail:db] could not update offsets");
+        flb_sqldb_query(ctx->db, SQL_ROLLBACK, NULL, NULL);
+        return -1;
+    }
+
+    ret = flb_sqldb_query(ctx->db, SQL_COMMIT, NULL, NULL);
+    if (ret != FLB_OK) {
+        flb_sqldb_query(ctx->db, SQL_ROLLBACK, NULL, NULL);
+        return -1;
+    }
+
+    /* Offsets are now in the database */
+    db_sync_list(&ctx->files_static, ctx, FLB_TRUE);
+    db_sync_list(&ctx->files_event, ctx, FLB_TRUE);
+
+    if (count > 0) {
+        flb_trace("[in_tail:db] %i offsets committed", count);
+    }
+    return count;
+}
+
+/* cb_collect callback: commit pending offsets */
+int flb_tail_db_sync_callback(struct flb_input_instance *i_ins,
+                              struct flb_config *config, void *context)
+{
+    (void) i_ins;
+    (void) config;
+
+    flb_tail_db_sync(context);
+    return 0;
+}
+
 /* Mark a file as rotated */
 int flb_tail_db_file_rotate(char *new_name,
                             struct flb_tail_file *file,
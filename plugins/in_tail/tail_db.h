@@ -35,6 +35,9 @@ int flb_tail_db_file_set(struct flb_tail_file *file,
                          struct flb_tail_config *ctx);
 int flb_tail_db_file_offset(struct flb_tail_file *file,
                             struct flb_tail_config *ctx);
+int flb_tail_db_sync(struct flb_tail_config *ctx);
+int flb_tail_db_sync_callback(struct flb_input_instance *i_ins,
+                              struct flb_config *config, void *context);
 int flb_tail_db_file_rotate(char *new_name,
                             struct flb_tail_file *file,
                             struct flb_tail_config *ctx);
@@ -0,0 +1,700 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <string.h>
+#include <stdint.h>
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_log.h>
+#include <fluent-bit/flb_input.h>
+#include <fluent-bit/flb_time.h>
+
+#include "tail_config.h"
+#include "tail_docker.h"
+
+/*
+ * Docker (json-file log driver) and CRI log lines are decoded here without
+ * the JSON parser and the 'escaped' decoder: each line is scanned once and
+ * its fields are packed directly as msgpack.
+ *
+ * Runtimes split long messages: a partial docker line have a 'log' that
+ * does not end with a line break, a partial CRI line is flagged 'P'. The
+ * parts are joined in 'dock_buf' of the file until the last one arrives.
+ */
+
+struct dock_field {
+    char *key;
+    int key_len;
+    char *val;
+    int val_len;
+    int escaped;
+};
+
+static inline char *dock_skip_ws(char *p, char *end)
+{
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) {
+        p++;
+    }
+    return p;
+}
+
+/* Find the closing quote of a JSON string, 'p' is next to the opening one */
+static char *dock_string_end(char *p, char *end, int *escaped)
+{
+    char *q;
+
+    q = memchr(p, '"', end - p);
+    if (!q) {
+        return NULL;
+    }
+
+    /* Most strings have no escape sequences */
+    if (!memchr(p, '\\', q - p)) {
+        return q;
+    }
+
+    *escaped = FLB_TRUE;
+    while (p < end) {
+        if (*p == '\\') {
+            p += 2;
+            continue;
+        }
+        if (*p == '"') {
+            return p;
+        }
+        p++;
+    }
+
+    return NULL;
+}
+
+static inline int dock_hex4(char *p, char *end, uint32_t *out)
+{
+    int i;
+    char c;
+    uint32_t val = 0;
+
+    if (end - p < 4) {
+        return -1;
+    }
+
+    for (i = 0; i < 4; i++) {
+        c = p[i];
+        val <<= 4;
+        if (c >= '0' && c <= '9') {
+            val |= c - '0';
+        }
+        else if (c >= 'a' && c <= 'f') {
+            val |= c - 'a' + 10;
+        }
+        else if (c >= 'A' && c <= 'F') {
+            val |= c - 'A' + 10;
+        }
+        else {
+            return -1;
+        }
+    }
+    *out = val;
+
+    return 0;
+}
+
+static inline int dock_utf8(uint32_t c, char *out)
+{
+    if (c < 0x80) {
+        out[0] = c;
+        return 1;
+    }
+    else if (c < 0x800) {
+        out[0] = 0xc0 | (c >> 6);
+        out[1] = 0x80 | (c & 0x3f);
+        return 2;
+    }
+    else if (c < 0x10000) {
+        out[0] = 0xe0 | (c >> 12);
+        out[1] = 0x80 | ((c >> 6) & 0x3f);
+        out[2] = 0x80 | (c & 0x3f);
+        return 3;
+    }
+
+    out[0] = 0xf0 | (c >> 18);
+    out[1] = 0x80 | ((c >> 12) & 0x3f);
+    out[2] = 0x80 | ((c >> 6) & 0x3f);
+    out[3] = 0x80 | (c & 0x3f);
+    return 4;
+}
+
+/*
+ * Unescape a JSON string into 'out', the result is never longer than the
+ * source. It returns the new length or -1 on an invalid sequence.
+ */
+static int dock_unescape(char *src, int len, char *out)
+{
+    uint32_t c;
+    uint32_t low;
+    char *p;
+    char *o = out;
+    char *end = src + len;
+
+    while (src < end) {
+        p = memchr(src, '\\', end - src);
+        if (!p) {
+            memcpy(o, src, end - src);
+            o += (end - src);
+            break;
+        }
+        memcpy(o, src, p - src);
+        o += (p - src);
+        src = p + 1;
+        if (src >= end) {
+            return -1;
+        }
+
+        switch (*src) {
+        case '"':
+        case '\\':
+        case '/':
+            *o++ = *src;
+            break;
+        case 'b':
+            *o++ = '\b';
+            break;
+        case 'f':
+            *o++ = '\f';
+            break;
+        case 'n':
+            *o++ = '\n';
+            break;
+        case 'r':
+            *o++ = '\r';
+            break;
+        case 't':
+            *o++ = '\t';
+            break;
+        case 'u':
+            if (dock_hex4(src + 1, end, &c) == -1) {
+                return -1;
+            }
+            src += 4;
+
+            /* Surrogate pair */
+            if (c >= 0xd800 && c <= 0xdbff && end - src >= 7 &&
+                src[1] == '\\' && src[2] == 'u' &&
+                dock_hex4(src + 3, end, &low) == 0 &&
+                low >= 0xdc00 && low <= 0xdfff) {
+                c = 0x10000 + ((c - 0xd800) << 10) + (low - 0xdc00);
+                src += 6;
+            }
+            o += dock_utf8(c, o);
+            break;
+        default:
+            return -1;
+        }
+        src++;
+    }
+
+    return (o - out);
+}
+
+static inline int dock_digits(char *p, int n)
+{
+    int i;
+    int val = 0;
+
+    for (i = 0; i < n; i++) {
+        if (p[i] < '0' || p[i] > '9') {
+            return -1;
+        }
+        val = (val * 10) + (p[i] - '0');
+    }
+
+    return val;
+}
+
+/* Parse a RFC3339 timestamp, e.g: 2018-06-01T10:20:30.123456789Z */
+static int dock_time(char *p, int len, struct flb_time *tm)
+{
+    int n;
+    int y;
+    int era;
+    int yoe;
+    int doy;
+    int doe;
+    int year;
+    int mon;
+    int day;
+    int hour;
+    int min;
+    int sec;
+    int off = 0;
+    long nsec = 0;
+    int64_t days;
+    char *end = p + len;
+
+    if (len < 20 || p[4] != '-' || p[7] != '-' ||
+        (p[10] != 'T' && p[10] != 't') || p[13] != ':' || p[16] != ':') {
+        return -1;
+    }
+
+    year = dock_digits(p, 4);
+    mon  = dock_digits(p + 5, 2);
+    day  = dock_digits(p + 8, 2);
+    hour = dock_digits(p + 11, 2);
+    min  = dock_digits(p + 14, 2);
+    sec  = dock_digits(p + 17, 2);
+    if (year < 0 || mon < 1 || mon > 12 || day < 1 || day > 31 ||
+        hour < 0 || hour > 23 || min < 0 || min > 59 || sec < 0 || sec > 60) {
+        return -1;
+    }
+    p += 19;
+
+    /* Fraction of seconds, up to nanoseconds */
+    if (*p == '.') {
+        p++;
+        n = 0;
+        while (p < end && *p >= '0' && *p <= '9') {
+            if (n < 9) {
+                nsec = (nsec * 10) + (*p - '0');
+                n++;
+            }
+            p++;
+        }
+        if (n == 0) {
+            return -1;
+        }
+        while (n < 9) {
+            nsec *= 10;
+            n++;
+        }
+    }
+
+    /* Time zone: 'Z' or +hh:mm */
+    if (p >= end) {
+        return -1;
+    }
+    if (*p == 'Z' || *p == 'z') {
+        p++;
+    }
+    else if (*p == '+' || *p == '-') {
+        if (end - p < 6 || p[3] != ':') {
+            return -1;
+        }
+        n = dock_digits(p + 1, 2);
+        off = dock_digits(p + 4, 2);
+        if (n < 0 || off < 0) {
+            return -1;
+        }
+        off = (n * 3600) + (off * 60);
+        if (*p == '-') {
+            off = -off;
+        }
+        p += 6;
+    }
+    else {
+        return -1;
+    }
+
+    if (p != end) {
+        return -1;
+    }
+
+    /* Days since the epoch (proleptic gregorian calendar) */
+    y = year - (mon <= 2);
+    era = y / 400;
+    yoe = y - (era * 400);
+    doy = (153 * (mon + (mon > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    doe = (yoe * 365) + (yoe / 4) - (yoe / 100) + doy;
+    days = ((int64_t) era * 146097) + doe - 719468;
+
+    tm->tm.tv_sec = (days * 86400) + (hour * 3600) + (min * 60) + sec - off;
+    tm->tm.tv_nsec = nsec;
+
+    return 0;
+}
+
+static int dock_buf_reserve(struct flb_tail_file *file, size_t size)
+{
+    size_t new_size;
+    char *tmp;
+
+    if (file->dock_len + size <= file->dock_size) {
+        return 0;
+    }
+
+    new_size = file->dock_len + size;
+    if (new_size < file->dock_size * 2) {
+        new_size = file->dock_size * 2;
+    }
+
+    tmp = flb_realloc(file->dock_buf, new_size);
+    if (!tmp) {
+        flb_errno();
+        return -1;
+    }
+    file->dock_buf = tmp;
+    file->dock_size = new_size;
+
+    return 0;
+}
+
+static inline void dock_pack_str(msgpack_packer *mp_pck, char *str, int len)
+{
+    msgpack_pack_str(mp_pck, len);
+    msgpack_pack_str_body(mp_pck, str, len);
+}
+
+/* Remember the time and stream of a partial message */
+static void dock_partial(struct flb_tail_file *file, struct flb_time *tm,
+                         char *stream, int stream_len)
+{
+    if (stream_len > (int) sizeof(file->dock_stream)) {
+        stream_len = (int) sizeof(file->dock_stream);
+    }
+    memcpy(file->dock_stream, stream, stream_len);
+    file->dock_stream_len = stream_len;
+    file->dock_time = *tm;
+}
+
+static inline int dock_older(struct flb_tail_config *ctx, time_t now,
+                             struct flb_time *tm)
+{
+    if (ctx->ignore_older > 0 && (now - ctx->ignore_older) > tm->tm.tv_sec) {
+        return FLB_TRUE;
+    }
+    return FLB_FALSE;
+}
+
+/* {"log":"message\n","stream":"stdout","time":"2018-06-01T10:20:30.1Z"} */
+static int dock_json(char *buf, int len, time_t now,
+                     struct flb_tail_file *file,
+                     msgpack_sbuffer *mp_sbuf, msgpack_packer *mp_pck)
+{
+    int i;
+    int n = 0;
+    int ret;
+    int log = -1;
+    int tm = -1;
+    int stream = -1;
+    int log_len;
+    size_t need = 0;
+    size_t off;
+    char *p;
+    char *q;
+    char *end = buf + len;
+    struct flb_time out_time;
+    struct dock_field f[FLB_TAIL_DOCKER_FIELDS];
+    struct flb_tail_config *ctx = file->config;
+
+    p = dock_skip_ws(buf, end);
+    if (p >= end || *p != '{') {
+        return FLB_TAIL_DOCKER_NA;
+    }
+    p++;
+
+    /* Only objects of string values are handled, e.g: no 'attrs' */
+    while (1) {
+        p = dock_skip_ws(p, end);
+        if (p >= end || *p != '"' || n == FLB_TAIL_DOCKER_FIELDS) {
+            return FLB_TAIL_DOCKER_NA;
+        }
+
+        ret = FLB_FALSE;
+        q = dock_string_end(p + 1, end, &ret);
+        if (!q || ret == FLB_TRUE) {
+            return FLB_TAIL_DOCKER_NA;
+        }
+        f[n].key = p + 1;
+        f[n].key_len = q - p - 1;
+
+        p = dock_skip_ws(q + 1, end);
+        if (p >= end || *p != ':') {
+            return FLB_TAIL_DOCKER_NA;
+        }
+        p = dock_skip_ws(p + 1, end);
+        if (p >= end || *p != '"') {
+            return FLB_TAIL_DOCKER_NA;
+        }
+
+        f[n].escaped = FLB_FALSE;
+        q = dock_string_end(p + 1, end, &f[n].escaped);
+        if (!q) {
+            return FLB_TAIL_DOCKER_NA;
+        }
+        f[n].val = p + 1;
+        f[n].val_len = q - p - 1;
+        if (f[n].escaped == FLB_TRUE) {
+            need += f[n].val_len;
+        }
+
+        if (f[n].key_len == 3 && memcmp(f[n].key, "log", 3) == 0) {
+            log = n;
+        }
+        else if (f[n].key_len == 4 && memcmp(f[n].key, "time", 4) == 0) {
+            tm = n;
+        }
+        else if (f[n].key_len == 6 && memcmp(f[n].key, "stream", 6) == 0) {
+            stream = n;
+        }
+        n++;
+
+        p = dock_skip_ws(q + 1, end);
+        if (p >= end) {
+            return FLB_TAIL_DOCKER_NA;
+        }
+        if (*p == ',') {
+            p++;
+            continue;
+        }
+        if (*p == '}') {
+            break;
+        }
+        return FLB_TAIL_DOCKER_NA;
+    }
+
+    p = dock_skip_ws(p + 1, end);
+    if (p != end || log == -1) {
+        return FLB_TAIL_DOCKER_NA;
+    }
+
+    if (tm == -1 || dock_time(f[tm].val, f[tm].val_len, &out_time) == -1) {
+        flb_input_time_get(ctx->i_ins, &out_time);
+    }
+
+    if (dock_older(ctx, now, &out_time) == FLB_TRUE) {
+        file->dock_len = 0;
+        return FLB_TAIL_DOCKER_DONE;
+    }
+
+    /* The message is appended to the previous parts, if any */
+    ret = dock_buf_reserve(file, need + f[log].val_len);
+    if (ret == -1) {
+        return FLB_TAIL_DOCKER_NA;
+    }
+
+    off = file->dock_len;
+    if (f[log].escaped == FLB_TRUE) {
+        log_len = dock_unescape(f[log].val, f[log].val_len,
+                                file->dock_buf + off);
+        if (log_len == -1) {
+            return FLB_TAIL_DOCKER_NA;
+        }
+    }
+    else {
+        memcpy(file->dock_buf + off, f[log].val, f[log].val_len);
+        log_len = f[log].val_len;
+    }
+    log_len += off;
+
+    /* Partial message ? */
+    if (log_len > off && file->dock_buf[log_len - 1] != '\n' &&
+        log_len < ctx->buf_max_size) {
+        file->dock_len = log_len;
+        if (stream >= 0) {
+            dock_partial(file, &out_time, f[stream].val, f[stream].val_len);
+        }
+        else {
+            dock_partial(file, &out_time, NULL, 0);
+        }
+        return FLB_TAIL_DOCKER_MORE;
+    }
+
+    /* Other escaped values use the space after the message */
+    p = file->dock_buf + log_len;
+    for (i = 0; i < n; i++) {
+        if (i == log || f[i].escaped == FLB_FALSE) {
+            continue;
+        }
+        ret = dock_unescape(f[i].val, f[i].val_len, p);
+        if (ret == -1) {
+            return FLB_TAIL_DOCKER_NA;
+        }
+        f[i].val = p;
+        f[i].val_len = ret;
+        p += ret;
+    }
+    f[log].val = file->dock_buf;
+    f[log].val_len = log_len;
+
+    msgpack_pack_array(mp_pck, 2);
+    flb_time_append_to_msgpack(&out_time, mp_pck, 0);
+    msgpack_pack_map(mp_pck, n + (ctx->path_key != NULL));
+    if (ctx->path_key != NULL) {
+        dock_pack_str(mp_pck, ctx->path_key, ctx->path_key_len);
+        dock_pack_str(mp_pck, file->name, file->name_len);
+    }
+    for (i = 0; i < n; i++) {
+        dock_pack_str(mp_pck, f[i].key, f[i].key_len);
+        dock_pack_str(mp_pck, f[i].val, f[i].val_len);
+    }
+    file->dock_len = 0;
+
+    return FLB_TAIL_DOCKER_DONE;
+}
+
+/* 2018-06-01T10:20:30.123456789Z stdout F message */
+static int dock_cri(char *buf, int len, time_t now,
+                    struct flb_tail_file *file,
+                    msgpack_sbuffer *mp_sbuf, msgpack_packer *mp_pck)
+{
+    int ret;
+    int tm_len;
+    int stream_len;
+    int tag_len;
+    int msg_len;
+    char *p;
+    char *stream;
+    char *tag;
+    char *msg;
+    char *end = buf + len;
+    struct flb_time out_time;
+    struct flb_tail_config *ctx = file->config;
+
+    p = memchr(buf, ' ', len);
+    if (!p) {
+        return FLB_TAIL_DOCKER_NA;
+    }
+    tm_len = p - buf;
+    if (dock_time(buf, tm_len, &out_time) == -1) {
+        return FLB_TAIL_DOCKER_NA;
+    }
+
+    stream = p + 1;
+    p = memchr(stream, ' ', end - stream);
+    if (!p) {
+        return FLB_TAIL_DOCKER_NA;
+    }
+    stream_len = p - stream;
+
+    tag = p + 1;
+    p = memchr(tag, ' ', end - tag);
+    if (p) {
+        tag_len = p - tag;
+        msg = p + 1;
+    }
+    else {
+        tag_len = end - tag;
+        msg = end;
+    }
+    if (stream_len == 0 || tag_len == 0) {
+        return FLB_TAIL_DOCKER_NA;
+    }
+    msg_len = end - msg;
+
+    if (dock_older(ctx, now, &out_time) == FLB_TRUE) {
+        file->dock_len = 0;
+        return FLB_TAIL_DOCKER_DONE;
+    }
+
+    ret = dock_buf_reserve(file, msg_len);
+    if (ret == -1) {
+        return FLB_TAIL_DOCKER_NA;
+    }
+    memcpy(file->dock_buf + file->dock_len, msg, msg_len);
+    file->dock_len += msg_len;
+
+    /* Partial message ? */
+    if (tag[0] == 'P' && file->dock_len < ctx->buf_max_size) {
+        dock_partial(file, &out_time, stream, stream_len);
+        return FLB_TAIL_DOCKER_MORE;
+    }
+
+    msgpack_pack_array(mp_pck, 2);
+    flb_time_append_to_msgpack(&out_time, mp_pck, 0);
+    msgpack_pack_map(mp_pck, 4 + (ctx->path_key != NULL));
+    if (ctx->path_key != NULL) {
+        dock_pack_str(mp_pck, ctx->path_key, ctx->path_key_len);
+        dock_pack_str(mp_pck, file->name, file->name_len);
+    }
+    dock_pack_str(mp_pck, "time", 4);
+    dock_pack_str(mp_pck, buf, tm_len);
+    dock_pack_str(mp_pck, "stream", 6);
+    dock_pack_str(mp_pck, stream, stream_len);
+    dock_pack_str(mp_pck, "logtag", 6);
+    dock_pack_str(mp_pck, tag, tag_len);
+    dock_pack_str(mp_pck, ctx->key, ctx->key_len);
+    dock_pack_str(mp_pck, file->dock_buf, file->dock_len);
+    file->dock_len = 0;
+
+    return FLB_TAIL_DOCKER_DONE;
+}
+
+/*
+ * Decode a docker or CRI line, it returns FLB_TAIL_DOCKER_NA if the line
+ * does not have the expected format so it can be processed as usual.
+ */
+int flb_tail_docker_process(char *buf, int len, time_t now,
+                            struct flb_tail_file *file,
+                            msgpack_sbuffer *mp_sbuf, msgpack_packer *mp_pck)
+{
+    if (file->config->docker_mode == FLB_TAIL_DOCKER_CRI) {
+        return dock_cri(buf, len, now, file, mp_sbuf, mp_pck);
+    }
+
+    return dock_json(buf, len, now, file, mp_sbuf, mp_pck);
+}
+
+/* Flush a partial message still buffered, the file is going away */
+void flb_tail_docker_flush(struct flb_tail_file *file)
+{
+    msgpack_sbuffer mp_sbuf;
+    msgpack_packer mp_pck;
+    struct flb_tail_config *ctx = file->config;
+
+    if (file->dock_len == 0) {
+        return;
+    }
+
+    msgpack_sbuffer_init(&mp_sbuf);
+    msgpack_packer_init(&mp_pck, &mp_sbuf, msgpack_sbuffer_write);
+
+    msgpack_pack_array(&mp_pck, 2);
+    flb_time_append_to_msgpack(&file->dock_time, &mp_pck, 0);
+    msgpack_pack_map(&mp_pck, 2 + (ctx->path_key != NULL));
+    if (ctx->path_key != NULL) {
+        dock_pack_str(&mp_pck, ctx->path_key, ctx->path_key_len);
+        dock_pack_str(&mp_pck, file->name, file->name_len);
+    }
+    if (ctx->docker_mode == FLB_TAIL_DOCKER_CRI) {
+        dock_pack_str(&mp_pck, ctx->key, ctx->key_len);
+    }
+    else {
+        dock_pack_str(&mp_pck, "log", 3);
+    }
+    dock_pack_str(&mp_pck, file->dock_buf, file->dock_len);
+    dock_pack_str(&mp_pck, "stream", 6);
+    dock_pack_str(&mp_pck, file->dock_stream, file->dock_stream_len);
+
+    flb_input_dyntag_append_raw(ctx->i_ins,
+                                file->tag_buf,
+                                file->tag_len,
+                                mp_sbuf.data,
+                                mp_sbuf.size);
+    msgpack_sbuffer_destroy(&mp_sbuf);
+    file->dock_len = 0;
+}
+
+void flb_tail_docker_destroy(struct flb_tail_file *file)
+{
+    flb_tail_docker_flush(file);
+    if (file->dock_buf) {
+        flb_free(file->dock_buf);
+        file->dock_buf = NULL;
+    }
+}
@@ -0,0 +1,48 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef FLB_TAIL_DOCKER_H
+#define FLB_TAIL_DOCKER_H
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_time.h>
+#include <msgpack.h>
+
+#include "tail_config.h"
+#include "tail_file_internal.h"
+
+/* Formats decoded natively, property 'docker_mode' */
+#define FLB_TAIL_DOCKER_OFF     0
+#define FLB_TAIL_DOCKER_JSON    1   /* {"log":"..","stream":"..","time":".."} */
+#define FLB_TAIL_DOCKER_CRI     2   /* time stream flag message               */
+
+/* Return values */
+#define FLB_TAIL_DOCKER_NA     -1   /* not a docker/cri line   */
+#define FLB_TAIL_DOCKER_DONE    0   /* record packed           */
+#define FLB_TAIL_DOCKER_MORE    1   /* partial line, buffered  */
+
+#define FLB_TAIL_DOCKER_FIELDS  8   /* max keys of a json line */
+
+int flb_tail_docker_process(char *buf, int len, time_t now,
+                            struct flb_tail_file *file,
+                            msgpack_sbuffer *mp_sbuf, msgpack_packer *mp_pck);
+void flb_tail_docker_flush(struct flb_tail_file *file);
+void flb_tail_docker_destroy(struct flb_tail_file *file);
+
+#endif
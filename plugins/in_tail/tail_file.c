@@ -19,13 +19,16 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <time.h>
+#include <fnmatch.h>
 
 #include <fluent-bit/flb_info.h>
 #include <fluent-bit/flb_input.h>
 #include <fluent-bit/flb_parser.h>
+#include <fluent-bit/flb_lines.h>
 
 #include "tail.h"
 #include "tail_file.h"
@@ -34,11 +37,8 @@
 #include "tail_signal.h"
 #include "tail_multiline.h"
 #include "tail_scan.h"
-
-static inline void consume_bytes(char *buf, int bytes, int length)
-{
-    memmove(buf, buf + bytes, length - bytes);
-}
+#include "tail_gzip.h"
+#include "tail_docker.h"
 
 static int unpack_and_pack(msgpack_packer *pck, msgpack_object *root,
                            char *key, size_t key_len,
@@ -163,36 +163,131 @@ int flb_tail_file_pack_line(msgpack_sbuffer *mp_sbuf, msgpack_packer *mp_pck,
     return 0;
 }
 
-static int process_content(struct flb_tail_file *file, off_t *bytes)
+/*
+ * Pack a batch of raw lines (no parser or multiline), 'offsets' are the
+ * positions of the line breaks relative to 'base' and 'data' the start of
+ * the first line. It returns the number of lines, the ones discarded by the
+ * filters pushdown included.
+ */
+static int pack_lines(msgpack_sbuffer *mp_sbuf, msgpack_packer *mp_pck,
+                      char *base, char *data, size_t *offsets, int n,
+                      struct flb_tail_file *file)
+{
+    int i;
+    int lines = 0;
+    size_t len;
+    char *p;
+    struct flb_time out_time;
+
+    /* Lines of the same read get the same timestamp */
+    flb_input_time_get(file->config->i_ins, &out_time);
+
+    for (i = 0; i < n; i++) {
+        p = base + offsets[i];
+        len = (p - data);
+        if (len > 0) {
+            if (flb_filter_pushdown_line(&file->pushdown,
+                                         data, len) == FLB_FALSE) {
+                flb_tail_file_pack_line(mp_sbuf, mp_pck, &out_time,
+                                        data, len, file);
+            }
+            lines++;
+        }
+        data = p + 1;
+    }
+
+    return lines;
+}
+
+/*
+ * Split and pack the lines found in 'buf' into 'out_sbuf', it returns the
+ * number of lines. With multiline enabled some records are appended to the
+ * input instance directly.
+ */
+static int process_content(struct flb_tail_file *file,
+                           char *buf, size_t buf_len, off_t *bytes,
+                           msgpack_sbuffer *out_sbuf)
 {
     int len;
     int lines = 0;
     int ret;
+    int raw;
+    int i = 0;
+    int n = 0;
+    int count;
+    int budget = -1;
     off_t processed_bytes = 0;
+    size_t offsets[FLB_TAIL_LINES];
     char *data;
+    char *base = NULL;
     char *end;
     char *p;
     void *out_buf;
     size_t out_size;
     time_t now = time(NULL);
     struct flb_time out_time = {};
-    msgpack_sbuffer mp_sbuf;
     msgpack_packer mp_pck;
-    msgpack_sbuffer *out_sbuf;
     msgpack_packer *out_pck;
     struct flb_tail_config *ctx = file->config;
 
-    /* Create a temporal msgpack buffer */
-    msgpack_sbuffer_init(&mp_sbuf);
-    msgpack_packer_init(&mp_pck, &mp_sbuf, msgpack_sbuffer_write);
-    out_sbuf = &mp_sbuf;
-    out_pck  = &mp_pck;
+    msgpack_packer_init(&mp_pck, out_sbuf, msgpack_sbuffer_write);
+    out_pck = &mp_pck;
+
+#ifdef FLB_HAVE_REGEX
+    raw = (!ctx->parser && ctx->multiline == FLB_FALSE &&
+           ctx->docker_mode == FLB_TAIL_DOCKER_OFF);
+#else
+    raw = (ctx->docker_mode == FLB_TAIL_DOCKER_OFF);
+#endif
+
+    /* Lines left in the budget of this cycle, -1 means no limit */
+    if (ctx->read_budget_lines > 0) {
+        budget = file->budget_lines;
+    }
 
     /* Parse the data content */
-    data = file->buf_data;
-    end = data + file->buf_len;
-    while ((p = memchr(data, '\n', end - data))) {
+    data = buf;
+    end = data + buf_len;
+    while (1) {
+        if (budget == 0) {
+            file->budget_cut = FLB_TRUE;
+            break;
+        }
+
+        /* Find the next batch of line breaks */
+        if (i == n) {
+            base = data;
+            n = flb_lines_scan(data, end - data, offsets, FLB_TAIL_LINES);
+            i = 0;
+            if (n == 0) {
+                break;
+            }
+        }
+
+        /* Raw lines are packed in a batch */
+        if (raw == FLB_TRUE && file->skip_next == FLB_FALSE) {
+            count = n - i;
+            if (budget > 0 && count > budget) {
+                count = budget;
+            }
+            lines += pack_lines(out_sbuf, out_pck, base, data,
+                                offsets + i, count, file);
+            p = base + offsets[i + count - 1] + 1;
+            processed_bytes += (p - data);
+            data = p;
+            i += count;
+            if (budget > 0) {
+                budget -= count;
+            }
+            file->parsed = 0;
+            continue;
+        }
+
+        p = base + offsets[i++];
         len = (p - data);
+        if (budget > 0) {
+            budget--;
+        }
 
         if (file->skip_next == FLB_TRUE) {
             data += len + 1;
@@ -208,9 +303,23 @@ static int process_content(struct flb_tail_file *file, off_t *bytes)
             continue;
         }
 
+        /* Nothing to parse if the tag has no destination */
+        if (flb_filter_pushdown_tag(&file->pushdown) == FLB_TRUE) {
+            goto go_next;
+        }
+
         /* Reset time for each line */
         flb_time_zero(&out_time);
 
+        /* Docker and CRI lines, others continue below */
+        if (ctx->docker_mode != FLB_TAIL_DOCKER_OFF) {
+            ret = flb_tail_docker_process(data, len, now, file,
+                                          out_sbuf, out_pck);
+            if (ret != FLB_TAIL_DOCKER_NA) {
+                goto go_next;
+            }
+        }
+
 #ifdef FLB_HAVE_REGEX
         if (ctx->parser) {
             /* Common parser (non-multiline) */
@@ -218,7 +327,7 @@ static int process_content(struct flb_tail_file *file, off_t *bytes)
                                 &out_buf, &out_size, &out_time);
             if (ret >= 0) {
                 if (flb_time_to_double(&out_time) == 0) {
-                    flb_time_get(&out_time);
+                    flb_input_time_get(file->config->i_ins, &out_time);
                 }
 
                 if (ctx->ignore_older > 0) {
@@ -233,13 +342,20 @@ static int process_content(struct flb_tail_file *file, off_t *bytes)
                     flb_tail_mult_flush(out_sbuf, out_pck, file, ctx);
                 }
 
+                if (flb_filter_pushdown_pack(&file->pushdown,
+                                             out_buf, out_size) == FLB_TRUE) {
+                    flb_free(out_buf);
+                    goto go_next;
+                }
+
                 pack_line_map(out_sbuf, out_pck, &out_time,
                               (char**) &out_buf, &out_size, file);
                 flb_free(out_buf);
             }
-            else {
+            else if (flb_filter_pushdown_line(&file->pushdown,
+                                              data, len) == FLB_FALSE) {
                 /* Parser failed, pack raw text */
-                flb_time_get(&out_time);
+                flb_input_time_get(file->config->i_ins, &out_time);
                 flb_tail_file_pack_line(out_sbuf, out_pck, &out_time,
                                         data, len, file);
             }
@@ -252,8 +368,12 @@ static int process_content(struct flb_tail_file *file, off_t *bytes)
             if (ret == FLB_TAIL_MULT_NA) {
 
                 flb_tail_mult_flush(out_sbuf, out_pck, file, ctx);
+                if (flb_filter_pushdown_line(&file->pushdown,
+                                             data, len) == FLB_TRUE) {
+                    goto go_next;
+                }
 
-                flb_time_get(&out_time);
+                flb_input_time_get(file->config->i_ins, &out_time);
                 flb_tail_file_pack_line(out_sbuf, out_pck, &out_time,
                                         data, len, file);
             }
@@ -265,13 +385,14 @@ static int process_content(struct flb_tail_file *file, off_t *bytes)
                 /* Finalized */
             }
         }
-        else {
-            flb_time_get(&out_time);
+        else if (flb_filter_pushdown_line(&file->pushdown,
+                                          data, len) == FLB_FALSE) {
+            flb_input_time_get(file->config->i_ins, &out_time);
             flb_tail_file_pack_line(out_sbuf, out_pck, &out_time,
                                     data, len, file);
         }
 #else
-        flb_time_get(&out_time);
+        flb_input_time_get(file->config->i_ins, &out_time);
         flb_tail_file_pack_line(out_sbuf, out_pck, &out_time,
                                 data, len, file);
 #endif
@@ -283,19 +404,100 @@ static int process_content(struct flb_tail_file *file, off_t *bytes)
         file->parsed = 0;
         lines++;
     }
-    file->parsed = file->buf_len;
+    file->parsed = buf_len;
     *bytes = processed_bytes;
 
-    /* Append the temporal buffer to a dyntag, then release it */
-    flb_input_dyntag_append_raw(ctx->i_ins,
-                                file->tag_buf,
-                                file->tag_len,
-                                out_sbuf->data,
-                                out_sbuf->size);
-    msgpack_sbuffer_destroy(out_sbuf);
+#ifdef FLB_HAVE_METRICS
+    if (lines > 0) {
+        file->m_lines += lines;
+        file->m_read = now;
+    }
+#endif
+
+    if (budget >= 0) {
+        file->budget_lines = budget;
+    }
+
     return lines;
 }
 
+#ifdef FLB_HAVE_METRICS
+static void file_metrics_create(struct flb_tail_file *file)
+{
+    struct flb_metrics *metrics;
+    struct flb_input_instance *i_ins = file->config->i_ins;
+
+    if (!i_ins->metrics) {
+        return;
+    }
+
+    metrics = flb_metrics_create_child("file", file->name, i_ins->metrics);
+    if (!metrics) {
+        return;
+    }
+    flb_metrics_add(FLB_TAIL_METRIC_LAG, "lag_bytes", metrics);
+    flb_metrics_add(FLB_TAIL_METRIC_BYTES, "read_bytes_sec", metrics);
+    flb_metrics_add(FLB_TAIL_METRIC_LINES, "lines_sec", metrics);
+    flb_metrics_add(FLB_TAIL_METRIC_IDLE, "idle_sec", metrics);
+    file->metrics = metrics;
+}
+
+static void file_metrics_update(struct flb_tail_file *file, time_t now)
+{
+    int ret;
+    off_t lag = 0;
+    off_t pos;
+    time_t elapsed;
+    struct stat st;
+    struct flb_metrics *m = file->metrics;
+
+    if (!m) {
+        return;
+    }
+
+    ret = fstat(file->fd, &st);
+    if (ret == 0) {
+        pos = flb_tail_file_pos(file);
+        if (st.st_size > pos) {
+            lag = st.st_size - pos;
+        }
+    }
+    flb_metrics_set(FLB_TAIL_METRIC_LAG, lag, m);
+
+    elapsed = now - file->m_time;
+    if (elapsed > 0) {
+        if (file->offset >= file->m_offset_last) {
+            flb_metrics_set(FLB_TAIL_METRIC_BYTES,
+                            (file->offset - file->m_offset_last) / elapsed, m);
+        }
+        flb_metrics_set(FLB_TAIL_METRIC_LINES,
+                        (file->m_lines - file->m_lines_last) / elapsed, m);
+        file->m_offset_last = file->offset;
+        file->m_lines_last = file->m_lines;
+        file->m_time = now;
+    }
+    flb_metrics_set(FLB_TAIL_METRIC_IDLE, now - file->m_read, m);
+}
+
+/* Refresh the metrics of every file, one fstat(2) per file */
+void flb_tail_file_metrics(struct flb_tail_config *ctx)
+{
+    time_t now;
+    struct mk_list *head;
+    struct flb_tail_file *file;
+
+    now = time(NULL);
+    mk_list_foreach(head, &ctx->files_static) {
+        file = mk_list_entry(head, struct flb_tail_file, _head);
+        file_metrics_update(file, now);
+    }
+    mk_list_foreach(head, &ctx->files_event) {
+        file = mk_list_entry(head, struct flb_tail_file, _head);
+        file_metrics_update(file, now);
+    }
+}
+#endif
+
 static inline void drop_bytes(char *buf, size_t len, int pos, int bytes)
 {
     memmove(buf + pos,
@@ -375,28 +577,80 @@ static int tag_compose(char *tag, char *fname, char **out_buf, size_t *out_size)
     return 0;
 }
 
+/*
+ * Bytes of the file read so far, to be compared with its size. For
+ * compressed files 'offset' is in decompressed space.
+ */
+off_t flb_tail_file_pos(struct flb_tail_file *file)
+{
+    if (file->gz) {
+        return file->gz->raw_offset;
+    }
+    return file->offset;
+}
+
+/* The file was truncated, read it again from the beginning */
+int flb_tail_file_truncated(struct flb_tail_file *file)
+{
+    off_t offset;
+
+    offset = lseek(file->fd, 0, SEEK_SET);
+    if (offset == -1) {
+        flb_errno();
+        return -1;
+    }
+
+    flb_debug("[in_tail] truncated %s", file->name);
+    file->offset = offset;
+    file->buf_len = 0;
+    if (file->gz) {
+        flb_tail_gz_reset(file);
+    }
+
+    /* Update offset in the database file */
+    if (file->config->db) {
+        flb_tail_db_file_offset(file, file->config);
+    }
+
+    return 0;
+}
+
 int flb_tail_file_exists(char *f, struct flb_tail_config *ctx)
+{
+    int ret;
+    size_t out_size;
+    char *out_buf;
+
+    ret = flb_hash_get(ctx->files_hash, f, strlen(f), &out_buf, &out_size);
+    if (ret == -1) {
+        return FLB_FALSE;
+    }
+
+    return FLB_TRUE;
+}
+
+/* Lookup a monitored file by inode, used to detect renamed entries */
+struct flb_tail_file *flb_tail_file_lookup_inode(ino_t inode,
+                                                 struct flb_tail_config *ctx)
 {
     struct mk_list *head;
     struct flb_tail_file *file;
 
-    /* Iterate static list */
     mk_list_foreach(head, &ctx->files_static) {
         file = mk_list_entry(head, struct flb_tail_file, _head);
-        if (strcmp(file->name, f) == 0) {
-            return FLB_TRUE;
+        if (file->inode == inode) {
+            return file;
         }
     }
 
-    /* Iterate dynamic list */
     mk_list_foreach(head, &ctx->files_event) {
         file = mk_list_entry(head, struct flb_tail_file, _head);
-        if (strcmp(file->name, f) == 0) {
-            return FLB_TRUE;
+        if (file->inode == inode) {
+            return file;
         }
     }
 
-    return FLB_FALSE;
+    return NULL;
 }
 
 int flb_tail_file_append(char *path, struct stat *st, int mode,
@@ -408,7 +662,6 @@ int flb_tail_file_append(char *path, struct stat *st, int mode,
     char *p;
     char out_tmp[PATH_MAX];
     size_t out_size;
-    struct mk_list *head;
     struct flb_tail_file *file;
 
     if (!S_ISREG(st->st_mode)) {
@@ -416,17 +669,8 @@ int flb_tail_file_append(char *path, struct stat *st, int mode,
     }
 
     /* Double check this file is not already being monitored */
-    mk_list_foreach(head, &ctx->files_static) {
-        file = mk_list_entry(head, struct flb_tail_file, _head);
-        if (strcmp(path, file->name) == 0) {
-            return -1;
-        }
-    }
-    mk_list_foreach(head, &ctx->files_event) {
-        file = mk_list_entry(head, struct flb_tail_file, _head);
-        if (strcmp(path, file->name) == 0) {
-            return -1;
-        }
+    if (flb_tail_file_exists(path, ctx) == FLB_TRUE) {
+        return -1;
     }
 
     fd = open(path, O_RDONLY);
@@ -465,19 +709,54 @@ int flb_tail_file_append(char *path, struct stat *st, int mode,
     file->mult_skipping = FLB_FALSE;
     file->mult_sbuf.data = NULL;
     file->db_id     = 0;
+    file->db_offset = 0;
+    file->th_id     = st->st_ino % ctx->threads;
+    file->chunk_pending = FLB_FALSE;
+    file->chunk_filtered = FLB_FALSE;
     file->skip_next = FLB_FALSE;
     file->skip_warn = FLB_FALSE;
+    file->budget_bytes = 0;
+    file->budget_lines = 0;
+    file->budget_cut = FLB_FALSE;
+    file->lag = 0;
+    file->gz = NULL;
+    file->dock_buf = NULL;
+    file->dock_len = 0;
+    file->dock_size = 0;
+    file->dock_stream_len = 0;
+#ifdef FLB_HAVE_METRICS
+    file->metrics = NULL;
+    file->m_lines = 0;
+    file->m_lines_last = 0;
+    file->m_offset_last = 0;
+    file->m_time = time(NULL);
+    file->m_read = file->m_time;
+#endif
 
     /* Local buffer */
-    file->buf_size = ctx->buf_chunk_size;
-    file->buf_data = flb_malloc(file->buf_size);
-    if (!file->buf_data) {
-        flb_errno();
+    ret = flb_vring_create(&file->buf_ring, ctx->buf_chunk_size);
+    if (ret == -1) {
         close(fd);
         flb_free(file->name);
         flb_free(file);
         return -1;
     }
+    file->buf_size = file->buf_ring.size;
+    file->buf_data = flb_vring_start(&file->buf_ring);
+
+    /* Compressed file ? */
+    p = strrchr(path, '/');
+    p = p ? p + 1 : path;
+    if (fnmatch(ctx->gzip_pattern, p, 0) == 0) {
+        ret = flb_tail_gz_create(file);
+        if (ret == -1) {
+            close(fd);
+            flb_vring_destroy(&file->buf_ring);
+            flb_free(file->name);
+            flb_free(file);
+            return -1;
+        }
+    }
 
     /* Initialize (optional) dynamic tag */
     if (ctx->dynamic_tag == FLB_TRUE) {
@@ -492,11 +771,15 @@ int flb_tail_file_append(char *path, struct stat *st, int mode,
         file->tag_len = strlen(ctx->i_ins->tag);
         file->tag_buf = flb_strdup(ctx->i_ins->tag);
     }
+    flb_filter_pushdown_init(&file->pushdown, ctx->i_ins,
+                             file->tag_buf, file->tag_len,
+                             ctx->key, ctx->key_len);
 
     /* Register this file into the fs_event monitoring */
     ret = flb_tail_fs_add(file);
     if (ret == -1) {
         flb_error("[in_tail] could not register file into fs_events");
+        flb_vring_destroy(&file->buf_ring);
         flb_free(file->name);
         flb_free(file);
         return -1;
@@ -508,6 +791,11 @@ int flb_tail_file_append(char *path, struct stat *st, int mode,
     else if (mode == FLB_TAIL_EVENT) {
         mk_list_add(&file->_head, &ctx->files_event);
     }
+    flb_hash_add(ctx->files_hash, file->name, file->name_len,
+                 (char *) &file, sizeof(file));
+#ifdef FLB_HAVE_METRICS
+    file_metrics_create(file);
+#endif
 
     /*
      * Register or update the file entry, likely if the entry already exists
@@ -517,8 +805,14 @@ int flb_tail_file_append(char *path, struct stat *st, int mode,
         flb_tail_db_file_set(file, ctx);
     }
 
-    /* Seek if required */
-    if (file->offset > 0) {
+    /* Seek if required, compressed files are decoded up to the offset */
+    if (file->offset > 0 && file->gz) {
+        file->gz->skip = file->offset;
+    }
+    else if (file->gz) {
+        flb_tail_gz_source(file);
+    }
+    else if (file->offset > 0) {
         offset = lseek(file->fd, file->offset, SEEK_SET);
         if (offset == -1) {
             flb_errno();
@@ -533,18 +827,33 @@ int flb_tail_file_append(char *path, struct stat *st, int mode,
 
 void flb_tail_file_remove(struct flb_tail_file *file)
 {
+    /* Do not lose an offset not committed yet */
+    if (file->config->db) {
+        flb_tail_db_file_offset(file, file->config);
+    }
+
     if (file->rotated > 0) {
         mk_list_del(&file->_rotate_head);
     }
 
+    flb_tail_mult_pending_del(file);
+    flb_tail_docker_destroy(file);
+#ifdef FLB_HAVE_METRICS
+    if (file->metrics) {
+        flb_metrics_destroy(file->metrics);
+    }
+#endif
     mk_list_del(&file->_head);
+    flb_hash_del(file->config->files_hash, file->name);
     flb_tail_fs_remove(file);
     close(file->fd);
     if (file->tag_buf) {
         flb_free(file->tag_buf);
     }
+    flb_filter_pushdown_destroy(&file->pushdown);
 
-    flb_free(file->buf_data);
+    flb_vring_destroy(&file->buf_ring);
+    flb_tail_gz_destroy(file);
     flb_free(file->name);
     flb_free(file);
 }
@@ -567,24 +876,156 @@ int flb_tail_file_remove_all(struct flb_tail_config *ctx)
         flb_tail_file_remove(file);
         count++;
     }
+    flb_tail_gz_deleted_purge(ctx, FLB_TRUE);
 
     return count;
 }
 
-int flb_tail_file_chunk(struct flb_tail_file *file)
+/*
+ * Static files in 'read_mode mmap': lines are processed straight from a
+ * mapping of the file, a window of FLB_TAIL_MMAP_CHUNK bytes at a time.
+ * The pages behind the cursor are released from the page cache once
+ * consumed. It returns -1 if the chunk must be read through read(2), e.g.
+ * a line longer than the window.
+ */
+static int file_chunk_mmap(struct flb_tail_file *file, msgpack_sbuffer *sbuf)
+{
+    int ret;
+    long page;
+    off_t start;
+    off_t delta;
+    off_t processed_bytes;
+    size_t map_len;
+    char *map;
+    struct stat st;
+
+    ret = fstat(file->fd, &st);
+    if (ret == -1) {
+        flb_errno();
+        return -1;
+    }
+
+    if (file->offset >= st.st_size) {
+        return FLB_TAIL_WAIT;
+    }
+
+    /* Map offsets must be page aligned */
+    page = sysconf(_SC_PAGESIZE);
+    start = file->offset - (file->offset % page);
+    delta = file->offset - start;
+    map_len = st.st_size - start;
+    if (map_len > FLB_TAIL_MMAP_CHUNK + delta) {
+        map_len = FLB_TAIL_MMAP_CHUNK + delta;
+    }
+    if (file->config->read_budget_bytes > 0 &&
+        map_len > file->budget_bytes + delta) {
+        map_len = file->budget_bytes + delta;
+    }
+
+    map = mmap(NULL, map_len, PROT_READ, MAP_PRIVATE, file->fd, start);
+    if (map == MAP_FAILED) {
+        flb_errno();
+        return -1;
+    }
+    madvise(map, map_len, MADV_SEQUENTIAL);
+
+    ret = process_content(file, map + delta, map_len - delta,
+                          &processed_bytes, sbuf);
+    munmap(map, map_len);
+    if (ret < 0) {
+        return -1;
+    }
+
+    /* Nothing is buffered, the next read starts at the new offset */
+    file->budget_cut = FLB_FALSE;
+
+    if (processed_bytes == 0) {
+        /* Incomplete last line, it's read once the file is promoted */
+        if (start + map_len == st.st_size) {
+            return FLB_TAIL_WAIT;
+        }
+        return -1;
+    }
+
+    flb_debug("[in_tail] file=%s mmap read=%lu lines=%i",
+              file->name, processed_bytes, ret);
+
+#ifdef POSIX_FADV_DONTNEED
+    posix_fadvise(file->fd, start, delta + processed_bytes,
+                  POSIX_FADV_DONTNEED);
+#endif
+
+    /* Keep the file position in sync for read(2) */
+    file->offset += processed_bytes;
+    lseek(file->fd, file->offset, SEEK_SET);
+
+    if (file->config->read_budget_bytes > 0) {
+        file->budget_bytes -= processed_bytes;
+    }
+
+    return FLB_TAIL_OK;
+}
+
+/* Process the lines buffered for the file, 'bytes' is the size just read */
+static int file_chunk_process(struct flb_tail_file *file, ssize_t bytes,
+                              msgpack_sbuffer *sbuf)
+{
+    int ret;
+    off_t processed_bytes;
+
+    /* Now that we have some data in the buffer, call the data processor
+     * which aims to cut lines and register the entries into the engine.
+     *
+     * The returned value is the absolute offset the file must be seek
+     * now. It may need to get back a few bytes at the beginning of a new
+     * line.
+     */
+    ret = process_content(file, file->buf_data, file->buf_len,
+                          &processed_bytes, sbuf);
+    if (ret >= 0) {
+        flb_debug("[in_tail] file=%s read=%lu lines=%i",
+                  file->name, bytes, ret);
+    }
+    else {
+        flb_debug("[in_tail] file=%s ERROR", file->name);
+        return -1;
+    }
+
+    /* Adjust the file offset and buffer, pending bytes are not moved */
+    file->offset += processed_bytes;
+    flb_vring_consume(&file->buf_ring, processed_bytes, file->buf_len);
+    file->buf_len -= processed_bytes;
+    file->buf_data = flb_vring_start(&file->buf_ring);
+    file->buf_data[file->buf_len] = '\0';
+
+    return 0;
+}
+
+static int file_chunk_read(struct flb_tail_file *file, msgpack_sbuffer *sbuf)
 {
     int ret;
-    char *tmp;
     size_t size;
     off_t capacity;
-    off_t processed_bytes;
     ssize_t bytes;
-    struct flb_tail_config *ctx;
+    struct flb_tail_config *ctx = file->config;
 
-    /* Check if we the engine issued a pause */
-    ctx = file->config;
-    if (flb_input_buf_paused(ctx->i_ins) == FLB_TRUE) {
-        return FLB_TAIL_BUSY;
+    /* The line budget of the last cycle left complete lines buffered */
+    if (file->budget_cut == FLB_TRUE) {
+        file->budget_cut = FLB_FALSE;
+        ret = file_chunk_process(file, 0, sbuf);
+        if (ret == -1) {
+            return FLB_TAIL_ERROR;
+        }
+        return FLB_TAIL_OK;
+    }
+
+    /* Nothing pending in the buffer, the static file can be mapped */
+    if (ctx->read_mmap == FLB_TRUE && file->tail_mode == FLB_TAIL_STATIC &&
+        file->buf_len == 0 && file->skip_next == FLB_FALSE && !file->gz) {
+        ret = file_chunk_mmap(file, sbuf);
+        if (ret != -1) {
+            return ret;
+        }
     }
 
     capacity = (file->buf_size - file->buf_len) - 1;
@@ -618,15 +1059,14 @@ int flb_tail_file_chunk(struct flb_tail_file *file)
             }
 
             /* Increase the buffer size */
-            tmp = flb_realloc(file->buf_data, size);
-            if (tmp) {
+            ret = flb_vring_resize(&file->buf_ring, size, file->buf_len);
+            if (ret == 0) {
                 flb_trace("[in_tail] file=%s increase buffer size %lu => %lu bytes",
-                          file->name, file->buf_size, size);
-                file->buf_data = tmp;
-                file->buf_size = size;
+                          file->name, file->buf_size, file->buf_ring.size);
+                file->buf_data = flb_vring_start(&file->buf_ring);
+                file->buf_size = file->buf_ring.size;
             }
             else {
-                flb_errno();
                 flb_error("[in_tail] cannot increase buffer size for %s, "
                           "skipping file.", file->name);
                 return FLB_TAIL_ERROR;
@@ -635,38 +1075,29 @@ int flb_tail_file_chunk(struct flb_tail_file *file)
         capacity = (file->buf_size - file->buf_len) - 1;
     }
 
-    bytes = read(file->fd, file->buf_data + file->buf_len, capacity);
+    if (ctx->read_budget_bytes > 0 && capacity > file->budget_bytes) {
+        capacity = file->budget_bytes;
+    }
+
+    if (file->gz) {
+        bytes = flb_tail_gz_read(file, file->buf_data + file->buf_len,
+                                 capacity);
+    }
+    else {
+        bytes = read(file->fd, file->buf_data + file->buf_len, capacity);
+    }
     if (bytes > 0) {
         /* we read some data, let the content processor take care of it */
         file->buf_len += bytes;
         file->buf_data[file->buf_len] = '\0';
 
-        /* Now that we have some data in the buffer, call the data processor
-         * which aims to cut lines and register the entries into the engine.
-         *
-         * The returned value is the absolute offset the file must be seek
-         * now. It may need to get back a few bytes at the beginning of a new
-         * line.
-         */
-        ret = process_content(file, &processed_bytes);
-        if (ret >= 0) {
-            flb_debug("[in_tail] file=%s read=%lu lines=%i",
-                      file->name, bytes, ret);
-        }
-        else {
-            flb_debug("[in_tail] file=%s ERROR", file->name);
-            return FLB_TAIL_ERROR;
+        if (ctx->read_budget_bytes > 0) {
+            file->budget_bytes -= bytes;
         }
 
-
-        /* Adjust the file offset and buffer */
-        file->offset += processed_bytes;
-        consume_bytes(file->buf_data, processed_bytes, file->buf_len);
-        file->buf_len -= processed_bytes;
-        file->buf_data[file->buf_len] = '\0';
-
-        if (file->config->db) {
-            flb_tail_db_file_offset(file, file->config);
+        ret = file_chunk_process(file, bytes, sbuf);
+        if (ret == -1) {
+            return FLB_TAIL_ERROR;
         }
 
         /* Data was consumed but likely some bytes still remain */
@@ -686,6 +1117,100 @@ int flb_tail_file_chunk(struct flb_tail_file *file)
     return FLB_TAIL_ERROR;
 }
 
+/*
+ * Read the next chunks of the file and pack its lines into 'sbuf'. It only
+ * touches the file context, so reader threads can run it for different
+ * files at the same time (see tail_thread.c).
+ *
+ * Without a budget one chunk is read per collection cycle, otherwise the
+ * file is read until it consumed 'read_budget_bytes' or processed
+ * 'read_budget_lines', so a busy file can not delay the others.
+ */
+int flb_tail_file_chunk_read(struct flb_tail_file *file, msgpack_sbuffer *sbuf)
+{
+    int ret;
+    struct flb_tail_config *ctx = file->config;
+
+    file->budget_bytes = ctx->read_budget_bytes;
+    file->budget_lines = ctx->read_budget_lines;
+
+    do {
+        ret = file_chunk_read(file, sbuf);
+        if (file->budget_cut == FLB_TRUE) {
+            break;
+        }
+    } while (ret == FLB_TAIL_OK && file->budget_bytes > 0);
+
+    return ret;
+}
+
+/* Engine side of a chunk: append the packed records and release 'sbuf' */
+void flb_tail_file_chunk_commit(struct flb_tail_file *file,
+                                msgpack_sbuffer *sbuf)
+{
+    struct flb_tail_config *ctx = file->config;
+
+    if (sbuf->size > 0 && file->chunk_filtered == FLB_TRUE) {
+        flb_input_dyntag_append_filtered(ctx->i_ins,
+                                         file->tag_buf,
+                                         file->tag_len,
+                                         sbuf->data,
+                                         sbuf->size, -1);
+    }
+    else if (sbuf->size > 0) {
+        flb_input_dyntag_append_raw(ctx->i_ins,
+                                    file->tag_buf,
+                                    file->tag_len,
+                                    sbuf->data,
+                                    sbuf->size);
+    }
+    msgpack_sbuffer_destroy(sbuf);
+    file->chunk_filtered = FLB_FALSE;
+
+    /* Offsets are committed every 'db.sync_interval' seconds */
+    if (ctx->db && ctx->db_sync_interval == 0) {
+        flb_tail_db_file_offset(file, ctx);
+    }
+}
+
+int flb_tail_file_chunk(struct flb_tail_file *file)
+{
+    int ret;
+    msgpack_sbuffer sbuf;
+    struct flb_tail_config *ctx = file->config;
+
+    /* Check if we the engine issued a pause */
+    if (flb_input_buf_paused(ctx->i_ins) == FLB_TRUE) {
+        return FLB_TAIL_BUSY;
+    }
+
+    msgpack_sbuffer_init(&sbuf);
+    ret = flb_tail_file_chunk_read(file, &sbuf);
+    flb_tail_file_chunk_commit(file, &sbuf);
+
+    return ret;
+}
+
+/*
+ * The file was deleted, likely compressed after a rotation. The descriptor
+ * is still valid, so read what was not shipped yet before removing it.
+ */
+void flb_tail_file_drain(struct flb_tail_file *file)
+{
+    int ret;
+
+    do {
+        ret = flb_tail_file_chunk(file);
+    } while (ret == FLB_TAIL_OK);
+
+    if (ret == FLB_TAIL_BUSY) {
+        flb_warn("[in_tail] file=%s deleted while the input is paused, "
+                 "unread data is lost", file->name);
+    }
+
+    flb_tail_gz_deleted(file);
+}
+
 int flb_tail_file_to_event(struct flb_tail_file *file)
 {
     int ret;
@@ -699,8 +1224,8 @@ int flb_tail_file_to_event(struct flb_tail_file *file)
         return -1;
     }
 
-    if (file->offset < st.st_size) {
-        file->pending_bytes = (st.st_size - file->offset);
+    if (flb_tail_file_pos(file) < st.st_size) {
+        file->pending_bytes = (st.st_size - flb_tail_file_pos(file));
         tail_signal_pending(file->config);
     }
     else {
@@ -827,6 +1352,7 @@ int flb_tail_file_rotated(struct flb_tail_file *file)
 
     /* Rotate the file in the database */
     if (file->config->db) {
+        flb_tail_db_file_offset(file, file->config);
         ret = flb_tail_db_file_rotate(name, file, file->config);
         if (ret == -1) {
             flb_error("[in_tail] could not rotate file %s->%s in database",
@@ -834,9 +1360,19 @@ int flb_tail_file_rotated(struct flb_tail_file *file)
         }
     }
 
-    /* Update local file entry */
+    /* Update local file entry and the index */
+    flb_hash_del(ctx->files_hash, file->name);
     tmp        = file->name;
     file->name = name;
+    file->name_len = strlen(name);
+    flb_hash_add(ctx->files_hash, file->name, file->name_len,
+                 (char *) &file, sizeof(file));
+#ifdef FLB_HAVE_METRICS
+    if (file->metrics) {
+        flb_metrics_destroy(file->metrics);
+        file_metrics_create(file);
+    }
+#endif
     if (file->rotated == 0) {
         file->rotated = time(NULL);
         mk_list_add(&file->_rotate_head, &file->config->files_rotated);
@@ -874,6 +1410,7 @@ int flb_tail_file_rotated_purge(struct flb_input_instance *i_ins,
             count++;
         }
     }
+    flb_tail_gz_deleted_purge(ctx, FLB_FALSE);
 
     return count;
 }
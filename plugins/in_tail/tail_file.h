@@ -33,14 +33,26 @@
 
 int flb_tail_file_to_event(struct flb_tail_file *file);
 int flb_tail_file_chunk(struct flb_tail_file *file);
+int flb_tail_file_chunk_read(struct flb_tail_file *file, msgpack_sbuffer *sbuf);
+void flb_tail_file_chunk_commit(struct flb_tail_file *file,
+                                msgpack_sbuffer *sbuf);
 int flb_tail_file_append(char *path, struct stat *st, int mode,
                          struct flb_tail_config *ctx);
+off_t flb_tail_file_pos(struct flb_tail_file *file);
+int flb_tail_file_truncated(struct flb_tail_file *file);
 int flb_tail_file_exists(char *f, struct flb_tail_config *ctx);
+struct flb_tail_file *flb_tail_file_lookup_inode(ino_t inode,
+                                                 struct flb_tail_config *ctx);
 void flb_tail_file_remove(struct flb_tail_file *file);
 int flb_tail_file_remove_all(struct flb_tail_config *ctx);
+void flb_tail_file_drain(struct flb_tail_file *file);
 char *flb_tail_file_name(struct flb_tail_file *file);
 int flb_tail_file_rotated(struct flb_tail_file *file);
 int flb_tail_file_rotated_purge(struct flb_input_instance *i_ins,
                                 struct flb_config *config, void *context);
 
+#ifdef FLB_HAVE_METRICS
+void flb_tail_file_metrics(struct flb_tail_config *ctx);
+#endif
+
 #endif
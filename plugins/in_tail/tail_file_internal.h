@@ -21,6 +21,10 @@
 #define FLB_TAIL_INTERNAL_H
 
 #include <fluent-bit/flb_input.h>
+#include <fluent-bit/flb_vring.h>
+#include <fluent-bit/flb_time.h>
+#include <fluent-bit/flb_metrics.h>
+#include <fluent-bit/flb_filter_pushdown.h>
 
 #include "tail.h"
 #include "tail_config.h"
@@ -43,9 +47,11 @@ struct flb_tail_file {
     /* dynamic tag for this file */
     int tag_len;
     char *tag_buf;
+    struct flb_filter_pushdown pushdown;  /* filters rules of the tag */
 
     /* multiline status */
-    time_t mult_flush_timeout;  /* time when multiline started           */
+    time_t mult_flush_timeout;  /* deadline to flush the message, 0=none */
+    struct mk_list _mult_head;  /* link to ctx->mult_pending             */
     int mult_firstline;         /* bool: mult firstline found ?          */
     int mult_skipping;          /* skipping because ignode_older than ?  */
     int mult_keys;              /* total number of buffered keys         */
@@ -53,11 +59,20 @@ struct flb_tail_file {
     msgpack_packer mult_pck;    /* temporal msgpack packer               */
     struct flb_time mult_time;  /* multiline time parsed from first line */
 
+    /* docker/cri partial message (tail_docker.c) */
+    char *dock_buf;             /* joined parts of the message           */
+    size_t dock_len;
+    size_t dock_size;
+    int dock_stream_len;
+    char dock_stream[8];        /* stream of the last part               */
+    struct flb_time dock_time;  /* time of the last part                 */
+
     /* buffering */
     off_t parsed;
     off_t buf_len;
     size_t buf_size;
-    char *buf_data;
+    char *buf_data;             /* pending data, start of buf_ring       */
+    struct flb_vring buf_ring;
 
     /*
      * Long-lines handling: this flag is enabled when a previous line was
@@ -74,8 +89,35 @@ struct flb_tail_file {
     /* Opaque data type for specific fs-event backend data */
     void *fs_backend;
 
+    /* gzip decoder, compressed files only (tail_gzip.c) */
+    struct flb_tail_gz *gz;
+
+    /* reader thread */
+    int th_id;                  /* reader owning the file                */
+    int chunk_pending;          /* bool: chunk requested to the reader   */
+    int chunk_ret;              /* result of the chunk read              */
+    int chunk_filtered;         /* bool: the reader ran the filters      */
+    msgpack_sbuffer chunk_sbuf; /* records packed by the reader          */
+
+    /* read budget of the current collection cycle */
+    size_t budget_bytes;        /* bytes left to read                    */
+    int budget_lines;           /* lines left to process                 */
+    int budget_cut;             /* bool: lines left in the buffer        */
+    off_t lag;                  /* bytes behind, used to sort readers    */
+
+#ifdef FLB_HAVE_METRICS
+    /* metrics, refreshed every 'refresh_interval' (no per line updates) */
+    struct flb_metrics *metrics;
+    size_t m_lines;             /* lines processed                       */
+    size_t m_lines_last;        /* lines processed at the last refresh   */
+    off_t m_offset_last;        /* offset at the last refresh            */
+    time_t m_time;              /* time of the last refresh              */
+    time_t m_read;              /* time of the last read                 */
+#endif
+
     /* database reference */
     uint64_t db_id;
+    off_t db_offset;           /* last offset committed to the database */
 
     /* reference */
     int tail_mode;
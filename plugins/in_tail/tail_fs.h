@@ -30,6 +30,7 @@ int flb_tail_fs_init(struct flb_input_instance *in,
                      struct flb_tail_config *ctx, struct flb_config *config);
 int flb_tail_fs_add(struct flb_tail_file *file);
 int flb_tail_fs_remove(struct flb_tail_file *file);
+int flb_tail_fs_add_dir(char *path, struct flb_tail_config *ctx);
 int flb_tail_fs_exit(struct flb_tail_config *ctx);
 void flb_tail_fs_pause(struct flb_tail_config *ctx);
 void flb_tail_fs_resume(struct flb_tail_config *ctx);
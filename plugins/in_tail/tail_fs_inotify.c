@@ -31,32 +31,82 @@
 #include "tail_file.h"
 #include "tail_db.h"
 #include "tail_signal.h"
+#include "tail_scan.h"
 
 #include <limits.h>
 #include <fcntl.h>
 
-static int tail_fs_event(struct flb_input_instance *i_ins,
-                         struct flb_config *config, void *in_context)
+/* A directory watched for new files */
+struct fs_inotify_dir {
+    int wd;
+    char *path;
+    struct mk_list _head;
+};
+
+static struct fs_inotify_dir *fs_dir_lookup(struct flb_tail_config *ctx,
+                                            int wd)
+{
+    struct mk_list *head;
+    struct fs_inotify_dir *dir;
+
+    mk_list_foreach(head, &ctx->watch_dirs) {
+        dir = mk_list_entry(head, struct fs_inotify_dir, _head);
+        if (dir->wd == wd) {
+            return dir;
+        }
+    }
+
+    return NULL;
+}
+
+static void fs_dir_destroy(struct fs_inotify_dir *dir)
+{
+    mk_list_del(&dir->_head);
+    flb_free(dir->path);
+    flb_free(dir);
+}
+
+/* An entry was created or moved into a watched directory */
+static int tail_fs_dir_event(struct flb_tail_config *ctx,
+                             struct fs_inotify_dir *dir,
+                             struct inotify_event *ev)
+{
+    int ret;
+
+    if (ev->mask & IN_IGNORED) {
+        /* Directory is gone, let the next re-scan look for it again */
+        flb_debug("[in_tail] stop watching directory %s", dir->path);
+        fs_dir_destroy(dir);
+        ctx->scan_pending = FLB_TRUE;
+        return 0;
+    }
+
+    if (ev->len == 0 || (ev->mask & IN_ISDIR)) {
+        return 0;
+    }
+
+    ret = flb_tail_scan_entry(dir->path, ev->name, ctx);
+    if (ret > 0) {
+        tail_signal_manager(ctx);
+    }
+
+    return 0;
+}
+
+static int tail_fs_file_event(struct flb_tail_config *ctx,
+                              struct flb_config *config,
+                              struct inotify_event *ev)
 {
     int ret;
-    off_t offset;
     struct mk_list *head;
     struct mk_list *tmp;
-    struct flb_tail_config *ctx = in_context;
     struct flb_tail_file *file = NULL;
-    struct inotify_event ev;
     struct stat st;
 
-    /* Read the event */
-    ret  = read(ctx->fd_notify, &ev, sizeof(struct inotify_event));
-    if (ret < 1) {
-        return -1;
-    }
-
     /* Lookup watched file */
     mk_list_foreach_safe(head, tmp, &ctx->files_event) {
         file = mk_list_entry(head, struct flb_tail_file, _head);
-        if (file->watch_fd != ev.wd) {
+        if (file->watch_fd != ev->wd) {
             file = NULL;
             continue;
         }
@@ -68,12 +118,12 @@ static int tail_fs_event(struct flb_input_instance *i_ins,
     }
 
     /* Check if the file was rotated */
-    if (ev.mask & IN_MOVE_SELF) {
+    if (ev->mask & IN_MOVE_SELF) {
         flb_tail_file_rotated(file);
     }
 
     /* File was removed ? */
-    if (ev.mask & IN_ATTRIB) {
+    if (ev->mask & IN_ATTRIB) {
         ret = fstat(file->fd, &st);
         if (ret == -1) {
             flb_debug("[in_tail] error stat(2) %s, removing", file->name);
@@ -84,18 +134,20 @@ static int tail_fs_event(struct flb_input_instance *i_ins,
         /* Check if the file have been deleted */
         if (st.st_nlink == 0) {
             flb_debug("[in_tail] removed %s", file->name);
+            flb_tail_file_drain(file);
             flb_tail_file_remove(file);
             return 0;
         }
     }
 
-    if (ev.mask & IN_IGNORED) {
+    if (ev->mask & IN_IGNORED) {
         flb_debug("[in_tail] removed %s", file->name);
+        flb_tail_file_drain(file);
         flb_tail_file_remove(file);
         return 0;
     }
 
-    if (ev.mask & IN_MODIFY) {
+    if (ev->mask & IN_MODIFY) {
         /*
          * The file was modified, check how many new bytes do
          * we have.
@@ -107,21 +159,11 @@ static int tail_fs_event(struct flb_input_instance *i_ins,
         }
 
         /* Check if the file was truncated */
-        if (file->offset > st.st_size) {
-            offset = lseek(file->fd, 0, SEEK_SET);
-            if (offset == -1) {
-                flb_errno();
+        if (flb_tail_file_pos(file) > st.st_size) {
+            ret = flb_tail_file_truncated(file);
+            if (ret == -1) {
                 return -1;
             }
-
-            flb_debug("[in_tail] truncated %s", file->name);
-            file->offset = offset;
-            file->buf_len = 0;
-
-            /* Update offset in the database file */
-            if (ctx->db) {
-                flb_tail_db_file_offset(file, ctx);
-            }
         }
 
         /* Collect the data */
@@ -141,8 +183,8 @@ static int tail_fs_event(struct flb_input_instance *i_ins,
              * read(2) operation, that might kill performance. Just let's
              * wait a second and do a good job.
              */
-            if (file->offset < st.st_size) {
-                file->pending_bytes = (st.st_size - file->offset);
+            if (flb_tail_file_pos(file) < st.st_size) {
+                file->pending_bytes = (st.st_size - flb_tail_file_pos(file));
                 tail_signal_pending(ctx);
             }
             else {
@@ -155,6 +197,47 @@ static int tail_fs_event(struct flb_input_instance *i_ins,
     return 0;
 }
 
+static int tail_fs_event(struct flb_input_instance *i_ins,
+                         struct flb_config *config, void *in_context)
+{
+    int ret = 0;
+    char *p;
+    ssize_t bytes;
+    char buf[4096]
+        __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    struct flb_tail_config *ctx = in_context;
+    struct fs_inotify_dir *dir;
+    struct inotify_event *ev;
+
+    /* Read the pending events, entries of directories carry a name */
+    bytes = read(ctx->fd_notify, buf, sizeof(buf));
+    if (bytes < 1) {
+        return -1;
+    }
+
+    for (p = buf; p < buf + bytes;
+         p += sizeof(struct inotify_event) + ev->len) {
+        ev = (struct inotify_event *) p;
+
+        /* Some events were lost, only a full re-scan can recover them */
+        if (ev->mask & IN_Q_OVERFLOW) {
+            flb_warn("[in_tail] inotify queue overflow");
+            ctx->scan_pending = FLB_TRUE;
+            continue;
+        }
+
+        dir = fs_dir_lookup(ctx, ev->wd);
+        if (dir) {
+            ret = tail_fs_dir_event(ctx, dir, ev);
+        }
+        else {
+            ret = tail_fs_file_event(ctx, config, ev);
+        }
+    }
+
+    return ret;
+}
+
 /* File System events based on Inotify(2). Linux >= 2.6.32 is suggested */
 int flb_tail_fs_init(struct flb_input_instance *in,
                      struct flb_tail_config *ctx, struct flb_config *config)
@@ -229,8 +312,65 @@ int flb_tail_fs_remove(struct flb_tail_file *file)
     return 0;
 }
 
+/*
+ * Watch a directory for new entries, they are matched against the path
+ * pattern as soon as they are created instead of waiting for a re-scan.
+ */
+int flb_tail_fs_add_dir(char *path, struct flb_tail_config *ctx)
+{
+    int wd;
+    struct mk_list *head;
+    struct fs_inotify_dir *dir;
+
+    mk_list_foreach(head, &ctx->watch_dirs) {
+        dir = mk_list_entry(head, struct fs_inotify_dir, _head);
+        if (strcmp(dir->path, path) == 0) {
+            return 0;
+        }
+    }
+
+    wd = inotify_add_watch(ctx->fd_notify, path,
+                           IN_CREATE | IN_MOVED_TO | IN_ONLYDIR);
+    if (wd == -1) {
+        flb_errno();
+        return -1;
+    }
+
+    /* Same directory through a different path */
+    if (fs_dir_lookup(ctx, wd)) {
+        return 0;
+    }
+
+    dir = flb_malloc(sizeof(struct fs_inotify_dir));
+    if (!dir) {
+        flb_errno();
+        inotify_rm_watch(ctx->fd_notify, wd);
+        return -1;
+    }
+    dir->wd = wd;
+    dir->path = flb_strdup(path);
+    if (!dir->path) {
+        flb_free(dir);
+        inotify_rm_watch(ctx->fd_notify, wd);
+        return -1;
+    }
+    mk_list_add(&dir->_head, &ctx->watch_dirs);
+
+    flb_debug("[in_tail] watching directory %s", path);
+    return 0;
+}
+
 int flb_tail_fs_exit(struct flb_tail_config *ctx)
 {
-    (void) ctx;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct fs_inotify_dir *dir;
+
+    mk_list_foreach_safe(head, tmp, &ctx->watch_dirs) {
+        dir = mk_list_entry(head, struct fs_inotify_dir, _head);
+        inotify_rm_watch(ctx->fd_notify, dir->wd);
+        fs_dir_destroy(dir);
+    }
+
     return 0;
 }
@@ -82,7 +82,6 @@ static int tail_fs_check(struct flb_input_instance *i_ins,
                          struct flb_config *config, void *in_context)
 {
     int ret;
-    off_t offset;
     char *name;
     struct mk_list *tmp;
     struct mk_list *head;
@@ -106,6 +105,7 @@ static int tail_fs_check(struct flb_input_instance *i_ins,
         /* Check if the file have been deleted */
         if (st.st_nlink == 0) {
             flb_debug("[in_tail] deleted %s", file->name);
+            flb_tail_file_drain(file);
             flb_tail_file_remove(file);
             continue;
         }
@@ -129,26 +129,16 @@ static int tail_fs_check(struct flb_input_instance *i_ins,
         flb_free(name);
 
         /* Check if the file was truncated */
-        if (file->offset > st.st_size) {
-            offset = lseek(file->fd, 0, SEEK_SET);
-            if (offset == -1) {
-                flb_errno();
+        if (flb_tail_file_pos(file) > st.st_size) {
+            ret = flb_tail_file_truncated(file);
+            if (ret == -1) {
                 return -1;
             }
-
-            flb_debug("[in_tail] truncated %s", file->name);
-            file->offset = offset;
-            file->buf_len = 0;
             memcpy(&fst->st, &st, sizeof(struct stat));
-
-            /* Update offset in database file */
-            if (ctx->db) {
-                flb_tail_db_file_offset(file, ctx);
-            }
         }
 
-        if (file->offset < st.st_size) {
-            file->pending_bytes = (st.st_size - file->offset);
+        if (flb_tail_file_pos(file) < st.st_size) {
+            file->pending_bytes = (st.st_size - flb_tail_file_pos(file));
             tail_signal_pending(ctx);
         }
         else {
@@ -227,6 +217,14 @@ int flb_tail_fs_remove(struct flb_tail_file *file)
     return 0;
 }
 
+/* Directories are not watched, new files are found by the re-scan */
+int flb_tail_fs_add_dir(char *path, struct flb_tail_config *ctx)
+{
+    (void) path;
+    (void) ctx;
+    return -1;
+}
+
 int flb_tail_fs_exit(struct flb_tail_config *ctx)
 {
     (void) ctx;
@@ -0,0 +1,423 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_log.h>
+
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+
+#include "tail_file.h"
+#include "tail_gzip.h"
+#include "tail_signal.h"
+
+/* Header flags, RFC 1952 */
+#define GZ_FHCRC     0x02
+#define GZ_FEXTRA    0x04
+#define GZ_FNAME     0x08
+#define GZ_FCOMMENT  0x10
+
+/* Read more compressed data after the bytes not consumed yet */
+static ssize_t gz_fill(struct flb_tail_gz *gz, int fd)
+{
+    ssize_t bytes;
+
+    if (gz->strm.next_in != gz->in) {
+        memmove(gz->in, gz->strm.next_in, gz->strm.avail_in);
+        gz->strm.next_in = gz->in;
+    }
+
+    if (gz->strm.avail_in == FLB_TAIL_GZ_BUF) {
+        return 0;
+    }
+
+    bytes = read(fd, gz->in + gz->strm.avail_in,
+                 FLB_TAIL_GZ_BUF - gz->strm.avail_in);
+    if (bytes > 0) {
+        gz->strm.avail_in += bytes;
+        gz->raw_offset += bytes;
+    }
+
+    return bytes;
+}
+
+/* Find the end of a null terminated header field starting at 'pos' */
+static int gz_skip_string(struct flb_tail_gz *gz, size_t *pos)
+{
+    unsigned char *p;
+
+    if (*pos >= gz->strm.avail_in) {
+        return -1;
+    }
+
+    p = memchr(gz->strm.next_in + *pos, '\0', gz->strm.avail_in - *pos);
+    if (!p) {
+        return -1;
+    }
+    *pos = (p - gz->strm.next_in) + 1;
+
+    return 0;
+}
+
+/*
+ * Get the length of the member header available in the input buffer, 0 if
+ * more data is required and -1 if it's not a gzip member.
+ */
+static int gz_header_len(struct flb_tail_gz *gz)
+{
+    int flags;
+    size_t pos = 10;
+    const unsigned char *h = gz->strm.next_in;
+
+    if (gz->strm.avail_in < 10) {
+        return 0;
+    }
+
+    if (h[0] != 0x1f || h[1] != 0x8b || h[2] != 8) {
+        return -1;
+    }
+    flags = h[3];
+
+    if (flags & GZ_FEXTRA) {
+        if (gz->strm.avail_in < pos + 2) {
+            return 0;
+        }
+        pos += 2 + (h[pos] | (h[pos + 1] << 8));
+    }
+    if ((flags & GZ_FNAME) && gz_skip_string(gz, &pos) == -1) {
+        return 0;
+    }
+    if ((flags & GZ_FCOMMENT) && gz_skip_string(gz, &pos) == -1) {
+        return 0;
+    }
+    if (flags & GZ_FHCRC) {
+        pos += 2;
+    }
+
+    if (gz->strm.avail_in < pos) {
+        return 0;
+    }
+
+    return pos;
+}
+
+static int gz_member_start(struct flb_tail_file *file, struct flb_tail_gz *gz)
+{
+    int len;
+    int ret;
+    ssize_t bytes;
+
+    while ((len = gz_header_len(gz)) == 0) {
+        bytes = gz_fill(gz, file->fd);
+        if (bytes == 0) {
+            /* A header larger than the buffer is not expected */
+            if (gz->strm.avail_in == FLB_TAIL_GZ_BUF) {
+                return -1;
+            }
+            return 0;
+        }
+        else if (bytes == -1) {
+            flb_errno();
+            return -1;
+        }
+    }
+
+    if (len == -1) {
+        /* Trailing garbage (e.g: zero padding) after a member */
+        if (gz->strm_init == FLB_TRUE) {
+            gz->state = FLB_TAIL_GZ_END;
+            return 0;
+        }
+        flb_error("[in_tail] file=%s is not a gzip file", file->name);
+        return -1;
+    }
+
+    gz->strm.next_in += len;
+    gz->strm.avail_in -= len;
+
+    if (gz->strm_init == FLB_TRUE) {
+        mz_inflateEnd(&gz->strm);
+    }
+
+    /* Raw deflate, the gzip framing is handled here */
+    ret = mz_inflateInit2(&gz->strm, -MZ_DEFAULT_WINDOW_BITS);
+    if (ret != MZ_OK) {
+        return -1;
+    }
+    gz->strm_init = FLB_TRUE;
+    gz->state = FLB_TAIL_GZ_DATA;
+
+    return len;
+}
+
+int flb_tail_gz_create(struct flb_tail_file *file)
+{
+    struct flb_tail_gz *gz;
+
+    gz = flb_calloc(1, sizeof(struct flb_tail_gz));
+    if (!gz) {
+        flb_errno();
+        return -1;
+    }
+    gz->state = FLB_TAIL_GZ_HEADER;
+    gz->strm.next_in = gz->in;
+    file->gz = gz;
+
+    flb_debug("[in_tail] file=%s is gzip compressed", file->name);
+    return 0;
+}
+
+void flb_tail_gz_destroy(struct flb_tail_file *file)
+{
+    struct flb_tail_gz *gz = file->gz;
+
+    if (!gz) {
+        return;
+    }
+
+    if (gz->strm_init == FLB_TRUE) {
+        mz_inflateEnd(&gz->strm);
+    }
+    flb_free(gz);
+    file->gz = NULL;
+}
+
+/* The file was truncated, decode it again from the beginning */
+void flb_tail_gz_reset(struct flb_tail_file *file)
+{
+    struct flb_tail_gz *gz = file->gz;
+
+    if (gz->strm_init == FLB_TRUE) {
+        mz_inflateEnd(&gz->strm);
+    }
+    memset(&gz->strm, '\0', sizeof(mz_stream));
+    gz->strm.next_in = gz->in;
+    gz->strm_init = FLB_FALSE;
+    gz->state = FLB_TAIL_GZ_HEADER;
+    gz->raw_offset = 0;
+    gz->skip = 0;
+}
+
+/*
+ * Works like read(2) over the decompressed content: it returns the bytes
+ * written into 'buf', 0 if there is no more data available and -1 on error.
+ */
+ssize_t flb_tail_gz_read(struct flb_tail_file *file, char *buf, size_t size)
+{
+    int ret;
+    size_t out;
+    size_t drop;
+    ssize_t bytes;
+    struct flb_tail_gz *gz = file->gz;
+
+    /* The original file is still being read, the offset is not known yet */
+    if (gz->wait_source == FLB_TRUE) {
+        return 0;
+    }
+
+    while (1) {
+        if (gz->state == FLB_TAIL_GZ_END) {
+            return 0;
+        }
+
+        if (gz->state == FLB_TAIL_GZ_HEADER) {
+            ret = gz_member_start(file, gz);
+            if (ret <= 0) {
+                return ret;
+            }
+            continue;
+        }
+
+        if (gz->state == FLB_TAIL_GZ_TRAILER) {
+            /* crc32 and size of the member, next member may follow */
+            while (gz->strm.avail_in < 8) {
+                bytes = gz_fill(gz, file->fd);
+                if (bytes <= 0) {
+                    return bytes;
+                }
+            }
+            gz->strm.next_in += 8;
+            gz->strm.avail_in -= 8;
+            gz->state = FLB_TAIL_GZ_HEADER;
+            continue;
+        }
+
+        if (gz->strm.avail_in == 0) {
+            bytes = gz_fill(gz, file->fd);
+            if (bytes <= 0) {
+                return bytes;
+            }
+        }
+
+        gz->strm.next_out = (unsigned char *) buf;
+        gz->strm.avail_out = size;
+        ret = mz_inflate(&gz->strm, MZ_NO_FLUSH);
+        if (ret == MZ_STREAM_END) {
+            gz->state = FLB_TAIL_GZ_TRAILER;
+        }
+        else if (ret != MZ_OK && ret != MZ_BUF_ERROR) {
+            flb_error("[in_tail] file=%s gzip data error (%i)",
+                      file->name, ret);
+            return -1;
+        }
+        out = size - gz->strm.avail_out;
+
+        /* Content already processed before a restart */
+        if (gz->skip > 0) {
+            drop = (gz->skip < out) ? gz->skip : out;
+            memmove(buf, buf + drop, out - drop);
+            out -= drop;
+            gz->skip -= drop;
+        }
+
+        if (out > 0) {
+            return out;
+        }
+    }
+
+    return 0;
+}
+
+/* Get the name of the uncompressed file, NULL if it's not a '.gz' name */
+static char *gz_source_name(char *name, size_t len)
+{
+    char *source;
+
+    if (len <= 3 || strcmp(name + len - 3, ".gz") != 0) {
+        return NULL;
+    }
+
+    source = flb_malloc(len - 2);
+    if (!source) {
+        flb_errno();
+        return NULL;
+    }
+    memcpy(source, name, len - 3);
+    source[len - 3] = '\0';
+
+    return source;
+}
+
+/*
+ * A compressed file without a previous offset was registered, check if its
+ * uncompressed version is being tailed or was just deleted.
+ */
+void flb_tail_gz_source(struct flb_tail_file *file)
+{
+    char *source;
+    struct mk_list *head;
+    struct flb_tail_gz_deleted *del;
+    struct flb_tail_config *ctx = file->config;
+
+    source = gz_source_name(file->name, file->name_len);
+    if (!source) {
+        return;
+    }
+
+    if (flb_tail_file_exists(source, ctx) == FLB_TRUE) {
+        flb_debug("[in_tail] file=%s waits for %s", file->name, source);
+        file->gz->wait_source = FLB_TRUE;
+        flb_free(source);
+        return;
+    }
+
+    mk_list_foreach(head, &ctx->files_deleted) {
+        del = mk_list_entry(head, struct flb_tail_gz_deleted, _head);
+        if (strcmp(del->name, source) == 0) {
+            flb_debug("[in_tail] file=%s resume %s at offset=%lu",
+                      file->name, source, del->offset);
+            file->offset = del->offset;
+            file->gz->skip = del->offset;
+            break;
+        }
+    }
+    flb_free(source);
+}
+
+/* A tailed file was deleted, remember where it was left */
+void flb_tail_gz_deleted(struct flb_tail_file *file)
+{
+    int ret;
+    int len;
+    char *out_buf;
+    size_t out_size;
+    char name[PATH_MAX];
+    struct flb_tail_file *gz_file;
+    struct flb_tail_gz_deleted *del;
+    struct flb_tail_config *ctx = file->config;
+
+    if (file->gz) {
+        return;
+    }
+
+    /* Is the compressed copy waiting for us ? */
+    len = snprintf(name, sizeof(name), "%s.gz", file->name);
+    if (len > 0 && len < sizeof(name)) {
+        ret = flb_hash_get(ctx->files_hash, name, len, &out_buf, &out_size);
+        if (ret != -1) {
+            memcpy(&gz_file, out_buf, sizeof(gz_file));
+            if (gz_file->gz && gz_file->gz->wait_source == FLB_TRUE) {
+                flb_debug("[in_tail] file=%s resume %s at offset=%lu",
+                          gz_file->name, file->name, file->offset);
+                gz_file->gz->wait_source = FLB_FALSE;
+                gz_file->gz->skip = file->offset;
+                gz_file->offset = file->offset;
+                gz_file->pending_bytes = 1;
+                tail_signal_pending(ctx);
+            }
+            return;
+        }
+    }
+
+    del = flb_malloc(sizeof(struct flb_tail_gz_deleted));
+    if (!del) {
+        flb_errno();
+        return;
+    }
+    del->name = flb_strdup(file->name);
+    if (!del->name) {
+        flb_free(del);
+        return;
+    }
+    del->offset = file->offset;
+    del->time = time(NULL);
+    mk_list_add(&del->_head, &ctx->files_deleted);
+}
+
+/* Forget the deleted files older than 'rotate_wait' */
+void flb_tail_gz_deleted_purge(struct flb_tail_config *ctx, int all)
+{
+    time_t now;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct flb_tail_gz_deleted *del;
+
+    now = time(NULL);
+    mk_list_foreach_safe(head, tmp, &ctx->files_deleted) {
+        del = mk_list_entry(head, struct flb_tail_gz_deleted, _head);
+        if (all == FLB_FALSE && del->time + ctx->rotate_wait > now) {
+            continue;
+        }
+        mk_list_del(&del->_head);
+        flb_free(del->name);
+        flb_free(del);
+    }
+}
@@ -0,0 +1,73 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef FLB_TAIL_GZIP_H
+#define FLB_TAIL_GZIP_H
+
+#include <sys/types.h>
+#include <miniz/miniz.h>
+
+#include "tail_file_internal.h"
+
+#define FLB_TAIL_GZ_BUF     64 * 1024  /* compressed input buffer */
+
+/* Decoder states */
+#define FLB_TAIL_GZ_HEADER   0  /* waiting a member header     */
+#define FLB_TAIL_GZ_DATA     1  /* inflating the member data   */
+#define FLB_TAIL_GZ_TRAILER  2  /* waiting the crc32 and size  */
+#define FLB_TAIL_GZ_END      3  /* no more members in the file */
+
+/*
+ * Streaming gzip decoder of a tailed file. The file 'offset' and the
+ * offset stored in the database are in decompressed space, since a gzip
+ * stream can not be seek, resuming a file means decode it again and
+ * discard the first 'skip' bytes.
+ */
+struct flb_tail_gz {
+    int state;
+    int strm_init;             /* bool: inflate stream initialized ? */
+    int wait_source;           /* bool: uncompressed file still read */
+    off_t raw_offset;          /* compressed bytes read from the file */
+    off_t skip;                /* decompressed bytes to discard       */
+    mz_stream strm;
+    unsigned char in[FLB_TAIL_GZ_BUF];
+};
+
+/*
+ * A tailed file that was deleted, logrotate compress a rotated file into
+ * 'name.gz' and delete it after. When the compressed copy is tailed too its
+ * content is decoded from the offset the original file reached.
+ */
+struct flb_tail_gz_deleted {
+    char *name;
+    off_t offset;
+    time_t time;
+    struct mk_list _head;
+};
+
+int flb_tail_gz_create(struct flb_tail_file *file);
+void flb_tail_gz_destroy(struct flb_tail_file *file);
+void flb_tail_gz_reset(struct flb_tail_file *file);
+ssize_t flb_tail_gz_read(struct flb_tail_file *file, char *buf, size_t size);
+
+void flb_tail_gz_source(struct flb_tail_file *file);
+void flb_tail_gz_deleted(struct flb_tail_file *file);
+void flb_tail_gz_deleted_purge(struct flb_tail_config *ctx, int all);
+
+#endif
@@ -20,26 +20,422 @@
 #include <fluent-bit/flb_info.h>
 #include <fluent-bit/flb_config.h>
 
+#include <ctype.h>
+
 #include "tail_config.h"
 #include "tail_multiline.h"
 
-static int tail_mult_append(struct flb_parser *parser,
-                            struct flb_tail_config *ctx)
+/*
+ * Rule prechecks
+ * --------------
+ * Most multiline rules are anchored patterns that start with a literal or a
+ * simple class, e.g: '^\[', '^\d{4}-' or '^(?<time>[A-Z][a-z]{2} ...'. From
+ * the pattern we get the set of bytes a matching line can start with plus
+ * its literal prefix. Anything not understood here disables the precheck of
+ * the rule, the regex always has the last word.
+ */
+
+static void mult_class_set(unsigned char *first, int c, int negate)
+{
+    int i;
+    unsigned char set[128] = {0};
+
+    for (i = 0; i < 128; i++) {
+        switch (c) {
+        case 'd':
+            set[i] = (i >= '0' && i <= '9');
+            break;
+        case 'h':
+            set[i] = isxdigit(i) ? 1 : 0;
+            break;
+        case 's':
+            set[i] = (i == ' ' || (i >= '\t' && i <= '\r'));
+            break;
+        case 'w':
+            set[i] = (isalnum(i) || i == '_');
+            break;
+        }
+        if (set[i] != negate) {
+            first[i] = 1;
+        }
+    }
+
+    /* Unicode digits, spaces and letters */
+    for (i = 128; i < 256; i++) {
+        first[i] = 1;
+    }
+}
+
+/* Translate a simple escape to a byte, -1 if it's not a literal */
+static int mult_escape(int c)
+{
+    switch (c) {
+    case 't':
+        return '\t';
+    case 'n':
+        return '\n';
+    case 'r':
+        return '\r';
+    case 'f':
+        return '\f';
+    case 'v':
+        return '\v';
+    case 'e':
+        return 0x1b;
+    case 'a':
+        return 0x07;
+    }
+
+    if (c > 0 && c < 128 && ispunct(c)) {
+        return c;
+    }
+    return -1;
+}
+
+/* Parse a bracket expression, it returns the bytes consumed or -1 */
+static int mult_bracket(char *p, char *end, unsigned char *first)
+{
+    int i;
+    int c;
+    int to;
+    int negate = FLB_FALSE;
+    char *start = p;
+    unsigned char set[256] = {0};
+
+    p++;
+    if (p < end && *p == '^') {
+        negate = FLB_TRUE;
+        p++;
+    }
+
+    if (p < end && *p == ']') {
+        set[']'] = 1;
+        p++;
+    }
+
+    while (p < end && *p != ']') {
+        c = (unsigned char) *p;
+
+        /* Nested classes, POSIX brackets and intersections */
+        if (c == '[' || (c == '&' && p + 1 < end && p[1] == '&') || c >= 128) {
+            return -1;
+        }
+
+        if (c == '\\') {
+            if (p + 1 >= end) {
+                return -1;
+            }
+            c = (unsigned char) p[1];
+            if (strchr("dhsw", c)) {
+                mult_class_set(set, c, FLB_FALSE);
+                p += 2;
+                continue;
+            }
+            c = mult_escape(c);
+            if (c == -1) {
+                return -1;
+            }
+            p++;
+        }
+        p++;
+
+        /* Range */
+        if (p + 1 < end && *p == '-' && p[1] != ']') {
+            to = (unsigned char) p[1];
+            if (to == '\\' || to == '[' || to >= 128 || to < c) {
+                return -1;
+            }
+            for (i = c; i <= to; i++) {
+                set[i] = 1;
+            }
+            p += 2;
+            continue;
+        }
+        set[c] = 1;
+    }
+
+    if (p >= end) {
+        return -1;
+    }
+
+    for (i = 0; i < 256; i++) {
+        if (i >= 128 && negate == FLB_TRUE) {
+            first[i] = 1;
+        }
+        else if (i < 128 && set[i] != negate) {
+            first[i] = 1;
+        }
+        else if (i >= 128 && set[i]) {
+            first[i] = 1;
+        }
+    }
+
+    return (p - start) + 1;
+}
+
+/*
+ * Parse one atom of the pattern: 'lit' gets the byte if it's a literal and
+ * 'first' (optional) the bytes it can match. It returns the bytes consumed,
+ * -1 if the atom is not handled.
+ */
+static int mult_atom(char *p, char *end, unsigned char *first, int *lit)
+{
+    int c;
+    unsigned char set[256] = {0};
+
+    *lit = -1;
+    if (p >= end) {
+        return -1;
+    }
+
+    if (!first) {
+        first = set;
+    }
+
+    c = (unsigned char) *p;
+    if (c == '[') {
+        return mult_bracket(p, end, first);
+    }
+
+    if (c == '\\') {
+        if (p + 1 >= end) {
+            return -1;
+        }
+        c = (unsigned char) p[1];
+        if (strchr("dhsw", c)) {
+            mult_class_set(first, c, FLB_FALSE);
+            return 2;
+        }
+        if (strchr("DHSW", c)) {
+            mult_class_set(first, tolower(c), FLB_TRUE);
+            return 2;
+        }
+        c = mult_escape(c);
+        if (c == -1) {
+            return -1;
+        }
+        *lit = c;
+        first[c] = 1;
+        return 2;
+    }
+
+    /* Meta characters and multibyte sequences */
+    if (c >= 128 || strchr(".()[]{}*+?^$|", c)) {
+        return -1;
+    }
+
+    *lit = c;
+    first[c] = 1;
+    return 1;
+}
+
+/* Check if the quantifier at 'p' allows zero repetitions */
+static int mult_optional(char *p, char *end)
+{
+    if (p >= end) {
+        return FLB_FALSE;
+    }
+
+    if (*p == '?' || *p == '*') {
+        return FLB_TRUE;
+    }
+
+    if (*p == '{' && p + 1 < end && (p[1] == '0' || p[1] == ',')) {
+        return FLB_TRUE;
+    }
+
+    return FLB_FALSE;
+}
+
+/* Given the opening of a group, check if the whole group is optional */
+static int mult_group_optional(char *p, char *end)
+{
+    int depth = 0;
+
+    for (; p < end; p++) {
+        if (*p == '\\') {
+            p++;
+            continue;
+        }
+        if (*p == '[') {
+            /* Skip the class, a ']' right after the opening is a literal */
+            p += (p + 1 < end && p[1] == '^') ? 2 : 1;
+            if (p < end && *p == ']') {
+                p++;
+            }
+            while (p < end && *p != ']') {
+                if (*p == '\\') {
+                    p++;
+                }
+                p++;
+            }
+            continue;
+        }
+        if (*p == '(') {
+            depth++;
+        }
+        else if (*p == ')') {
+            depth--;
+            if (depth == 0) {
+                return mult_optional(p + 1, end);
+            }
+        }
+    }
+
+    /* Unbalanced */
+    return FLB_TRUE;
+}
+
+static void mult_compile(struct flb_tail_mult *mp)
+{
+    int n;
+    int lit;
+    size_t len;
+    char *p;
+    char *end;
+    struct flb_parser *parser = mp->parser;
+
+    mp->check = FLB_FALSE;
+    mp->prefix_len = 0;
+    memset(mp->first, '\0', sizeof(mp->first));
+
+    if (parser->type != FLB_PARSER_REGEX || !parser->p_regex) {
+        return;
+    }
+
+    p = parser->p_regex;
+    len = strlen(p);
+    end = p + len;
+    if (len > 1 && p[0] == '/' && p[len - 1] == '/') {
+        p++;
+        end--;
+    }
+
+    /* Alternations are not handled, the pattern must be anchored */
+    if (memchr(p, '|', end - p) || p >= end || *p != '^') {
+        return;
+    }
+    p++;
+
+    /* Step into the groups that wrap the first atom */
+    while (p < end && *p == '(') {
+        if (mult_group_optional(p, end) == FLB_TRUE) {
+            return;
+        }
+
+        if (p + 1 < end && p[1] != '?') {
+            p++;
+        }
+        else if (p + 2 < end && p[2] == ':') {
+            p += 3;
+        }
+        else if (p + 3 < end && p[2] == '<' && p[3] != '=' && p[3] != '!') {
+            p = memchr(p, '>', end - p);
+            if (!p) {
+                return;
+            }
+            p++;
+        }
+        else {
+            /* Options, look-arounds, atomic groups... */
+            return;
+        }
+    }
+
+    n = mult_atom(p, end, mp->first, &lit);
+    if (n <= 0 || mult_optional(p + n, end) == FLB_TRUE) {
+        memset(mp->first, '\0', sizeof(mp->first));
+        return;
+    }
+    mp->check = FLB_TRUE;
+
+    /* Literal prefix */
+    while (lit != -1 && mp->prefix_len < FLB_TAIL_MULT_PREFIX) {
+        p += n;
+        if (p < end && strchr("?*+{", *p)) {
+            /* The atom is repeated, it's only granted once with '+' */
+            if (*p == '+') {
+                mp->prefix[mp->prefix_len++] = lit;
+            }
+            break;
+        }
+        mp->prefix[mp->prefix_len++] = lit;
+
+        n = mult_atom(p, end, NULL, &lit);
+        if (n <= 0) {
+            break;
+        }
+    }
+
+    flb_debug("[in_tail] multiline: parser '%s' precheck prefix='%.*s'",
+              parser->name, mp->prefix_len, mp->prefix);
+}
+
+/* Check if a line could match the rule */
+static inline int mult_precheck(struct flb_tail_mult *mp, char *buf, int len)
+{
+    if (mp->check == FLB_FALSE) {
+        return FLB_TRUE;
+    }
+
+    if (len <= 0 || !mp->first[(unsigned char) buf[0]]) {
+        return FLB_FALSE;
+    }
+
+    if (len < mp->prefix_len || memcmp(buf, mp->prefix, mp->prefix_len) != 0) {
+        return FLB_FALSE;
+    }
+
+    return FLB_TRUE;
+}
+
+static struct flb_tail_mult *tail_mult_rule(struct flb_parser *parser)
 {
     struct flb_tail_mult *mp;
 
     mp = flb_malloc(sizeof(struct flb_tail_mult));
     if (!mp) {
         flb_errno();
-        return -1;
+        return NULL;
     }
 
     mp->parser = parser;
+    mult_compile(mp);
+
+    return mp;
+}
+
+static int tail_mult_append(struct flb_parser *parser,
+                            struct flb_tail_config *ctx)
+{
+    struct flb_tail_mult *mp;
+
+    mp = tail_mult_rule(parser);
+    if (!mp) {
+        return -1;
+    }
     mk_list_add(&mp->_head, &ctx->mult_parsers);
 
     return 0;
 }
 
+/* Keep the file in the flush queue, deadlines are always increasing */
+static inline void mult_pending_add(time_t deadline,
+                                    struct flb_tail_file *file,
+                                    struct flb_tail_config *ctx)
+{
+    file->mult_flush_timeout = deadline;
+    mk_list_add(&file->_mult_head, &ctx->mult_pending);
+}
+
+void flb_tail_mult_pending_del(struct flb_tail_file *file)
+{
+    if (file->mult_flush_timeout > 0) {
+        mk_list_del(&file->_mult_head);
+        file->mult_flush_timeout = 0;
+    }
+}
+
 int flb_tail_mult_create(struct flb_tail_config *ctx,
                          struct flb_input_instance *i_ins,
                          struct flb_config *config)
@@ -50,6 +446,9 @@ int flb_tail_mult_create(struct flb_tail_config *ctx,
     struct flb_parser *parser;
     struct flb_config_prop *p;
 
+    mk_list_init(&ctx->mult_parsers);
+    mk_list_init(&ctx->mult_pending);
+
     tmp = flb_input_get_property("multiline_flush", i_ins);
     if (!tmp) {
         ctx->multiline_flush = FLB_TAIL_MULT_FLUSH;
@@ -73,8 +472,10 @@ int flb_tail_mult_create(struct flb_tail_config *ctx,
         return -1;
     }
 
-    ctx->mult_parser_firstline = parser;
-    mk_list_init(&ctx->mult_parsers);
+    ctx->mult_firstline = tail_mult_rule(parser);
+    if (!ctx->mult_firstline) {
+        return -1;
+    }
 
     /* Read all multiline rules */
     mk_list_foreach(head, &i_ins->properties) {
@@ -123,6 +524,10 @@ int flb_tail_mult_destroy(struct flb_tail_config *ctx)
         flb_free(mp);
     }
 
+    if (ctx->mult_firstline) {
+        flb_free(ctx->mult_firstline);
+    }
+
     return 0;
 }
 
@@ -139,7 +544,7 @@ static int pack_line(char *data, size_t data_size, struct flb_tail_file *file,
 
     msgpack_sbuffer_init(&mp_sbuf);
     msgpack_packer_init(&mp_pck, &mp_sbuf, msgpack_sbuffer_write);
-    flb_time_get(&out_time);
+    flb_input_time_get(ctx->i_ins, &out_time);
 
     flb_tail_file_pack_line(&mp_sbuf, &mp_pck, &out_time, data, data_size, file);
     flb_input_dyntag_append_raw(ctx->i_ins,
@@ -185,7 +590,7 @@ int flb_tail_mult_process_first(time_t now,
 
     /* Validate obtained time, if not set, set the current time */
     if (flb_time_to_double(out_time) == 0) {
-        flb_time_get(out_time);
+        flb_input_time_get(ctx->i_ins, out_time);
     }
 
     /* Should we skip this multiline record ? */
@@ -210,7 +615,8 @@ int flb_tail_mult_process_first(time_t now,
      * concern is that we don't know what's the real size of the memory
      * allocated, so we assume it's just 'out_size'.
      */
-    file->mult_flush_timeout = now + (ctx->multiline_flush - 1);
+    flb_tail_mult_pending_del(file);
+    mult_pending_add(now + (ctx->multiline_flush - 1), file, ctx);
     file->mult_sbuf.data = buf;
     file->mult_sbuf.size = size;
     file->mult_sbuf.alloc = size;
@@ -263,9 +669,12 @@ int flb_tail_mult_process_content(time_t now,
     msgpack_unpacked result;
 
     /* Always check if this line is the beginning of a new multiline message */
-    ret = flb_parser_do(ctx->mult_parser_firstline,
-                        buf, len,
-                        &out_buf, &out_size, &out_time);
+    ret = -1;
+    if (mult_precheck(ctx->mult_firstline, buf, len) == FLB_TRUE) {
+        ret = flb_parser_do(ctx->mult_firstline->parser,
+                            buf, len,
+                            &out_buf, &out_size, &out_time);
+    }
     if (ret >= 0) {
         flb_tail_mult_process_first(now, out_buf, out_size, &out_time,
                                     file, ctx);
@@ -283,6 +692,10 @@ int flb_tail_mult_process_content(time_t now,
     out_buf = NULL;
     mk_list_foreach(head, &ctx->mult_parsers) {
         mult_parser = mk_list_entry(head, struct flb_tail_mult, _head);
+        if (mult_precheck(mult_parser, buf, len) == FLB_FALSE) {
+            mult_parser = NULL;
+            continue;
+        }
 
         /* Process line text with current parser */
         out_buf = NULL;
@@ -438,49 +851,54 @@ int flb_tail_mult_flush(msgpack_sbuffer *mp_sbuf, msgpack_packer *mp_pck,
     file->mult_firstline = FLB_FALSE;
     file->mult_skipping = FLB_FALSE;
     file->mult_keys = 0;
-    file->mult_flush_timeout = 0;
+    flb_tail_mult_pending_del(file);
     msgpack_sbuffer_destroy(&file->mult_sbuf);
     flb_time_zero(&file->mult_time);
 
     return 0;
 }
 
+/*
+ * Flush the messages that reached their deadline: files are queued in the
+ * order their message started, so only the expired ones are visited.
+ */
 int flb_tail_mult_pending_flush(struct flb_input_instance *i_ins,
                                 struct flb_config *config, void *context)
 {
     time_t now;
     msgpack_sbuffer mp_sbuf;
     msgpack_packer mp_pck;
+    struct mk_list *tmp;
     struct mk_list *head;
     struct flb_tail_file *file;
     struct flb_tail_config *ctx = context;
 
     now = time(NULL);
 
-    /* Iterate promoted event files with pending bytes */
-    mk_list_foreach(head, &ctx->files_event) {
-        file = mk_list_entry(head, struct flb_tail_file, _head);
-
+    mk_list_foreach_safe(head, tmp, &ctx->mult_pending) {
+        file = mk_list_entry(head, struct flb_tail_file, _mult_head);
         if (file->mult_flush_timeout > now) {
-            continue;
+            break;
         }
 
-        if (file->mult_firstline == FLB_FALSE) {
-            if (file->mult_sbuf.data == NULL || file->mult_sbuf.size <= 0) {
-                continue;
-            }
+        /* Static files are still being read, the message may continue */
+        if (file->tail_mode != FLB_TAIL_EVENT) {
+            continue;
         }
 
         msgpack_sbuffer_init(&mp_sbuf);
         msgpack_packer_init(&mp_pck, &mp_sbuf, msgpack_sbuffer_write);
 
         flb_tail_mult_flush(&mp_sbuf, &mp_pck, file, ctx);
-
-        flb_input_dyntag_append_raw(i_ins,
-                                    file->tag_buf,
-                                    file->tag_len,
-                                    mp_sbuf.data,
-                                    mp_sbuf.size);
+        flb_tail_mult_pending_del(file);
+
+        if (mp_sbuf.size > 0) {
+            flb_input_dyntag_append_raw(i_ins,
+                                        file->tag_buf,
+                                        file->tag_len,
+                                        mp_sbuf.data,
+                                        mp_sbuf.size);
+        }
         msgpack_sbuffer_destroy(&mp_sbuf);
     }
 
@@ -30,9 +30,19 @@
 #define FLB_TAIL_MULT_DONE   0   /* finished a multiline stream */
 #define FLB_TAIL_MULT_MORE   1   /* expect more lines to come   */
 #define FLB_TAIL_MULT_FLUSH  4   /* max flush time for multiline */
+#define FLB_TAIL_MULT_PREFIX 32   /* max literal prefix of a rule */
 
+/*
+ * A multiline rule: the parser plus a precheck compiled from its pattern. A
+ * line that does not start with 'prefix' or with one of the 'first' bytes
+ * can not match, so the regex is not executed.
+ */
 struct flb_tail_mult {
     struct flb_parser *parser;
+    int check;                          /* precheck available ? */
+    int prefix_len;
+    char prefix[FLB_TAIL_MULT_PREFIX];  /* literal prefix       */
+    unsigned char first[256];           /* valid first bytes    */
     struct mk_list _head;
 };
 
@@ -51,6 +61,7 @@ int flb_tail_mult_flush(msgpack_sbuffer *mp_sbuf,
                         struct flb_tail_file *file,
                         struct flb_tail_config *ctx);
 
+void flb_tail_mult_pending_del(struct flb_tail_file *file);
 int flb_tail_mult_pending_flush(struct flb_input_instance *i_ins,
                                 struct flb_config *config, void *context);
 
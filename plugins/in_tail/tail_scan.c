@@ -20,6 +20,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <limits.h>
 #include <glob.h>
 #include <fnmatch.h>
 
@@ -30,6 +31,7 @@
 #include "tail_file.h"
 #include "tail_signal.h"
 #include "tail_config.h"
+#include "tail_fs.h"
 
 /* Define missing GLOB_TILDE if not exists */
 #ifndef GLOB_TILDE
@@ -198,6 +200,110 @@ static int tail_is_excluded(char *name, struct flb_tail_config *ctx)
     return FLB_FALSE;
 }
 
+/*
+ * Register a watch on every directory the path pattern can match. When the
+ * directory part is a plain path, the watch catches every new file and the
+ * periodic re-scan is not required anymore.
+ */
+static int tail_scan_dirs(const char *path, struct flb_tail_config *ctx)
+{
+    int i;
+    int ret;
+    int watched = 0;
+    char *p;
+    char dir[PATH_MAX];
+    glob_t globbuf;
+
+    p = strrchr(path, '/');
+    if (!p) {
+        snprintf(dir, sizeof(dir) - 1, ".");
+    }
+    else if (p == path) {
+        snprintf(dir, sizeof(dir) - 1, "/");
+    }
+    else {
+        snprintf(dir, sizeof(dir) - 1, "%.*s", (int) (p - path), path);
+    }
+
+    globbuf.gl_pathv = NULL;
+    ret = do_glob(dir, GLOB_TILDE | GLOB_ONLYDIR, NULL, &globbuf);
+    if (ret != 0) {
+        ctx->scan_pending = FLB_TRUE;
+        return -1;
+    }
+
+    for (i = 0; i < globbuf.gl_pathc; i++) {
+        ret = flb_tail_fs_add_dir(globbuf.gl_pathv[i], ctx);
+        if (ret == 0) {
+            watched++;
+        }
+    }
+    globfree(&globbuf);
+
+    /* New directories can only be discovered through a re-scan */
+    if (watched != i || strpbrk(dir, "*?[") != NULL) {
+        ctx->scan_pending = FLB_TRUE;
+    }
+    else {
+        ctx->scan_pending = FLB_FALSE;
+    }
+
+    return watched;
+}
+
+/*
+ * A new entry 'name' was reported inside the watched directory 'dir', check
+ * it against the path pattern and register it. It returns 1 if the file was
+ * appended.
+ */
+int flb_tail_scan_entry(char *dir, char *name, struct flb_tail_config *ctx)
+{
+    int ret;
+    char *pattern;
+    char path[PATH_MAX];
+    struct stat st;
+
+    pattern = strrchr(ctx->path, '/');
+    if (pattern) {
+        pattern++;
+    }
+    else {
+        pattern = ctx->path;
+    }
+
+    if (fnmatch(pattern, name, FNM_PERIOD) != 0) {
+        return 0;
+    }
+
+    ret = snprintf(path, sizeof(path), "%s/%s", dir, name);
+    if (ret < 0 || ret >= sizeof(path)) {
+        return -1;
+    }
+
+    if (tail_is_excluded(path, ctx) == FLB_TRUE ||
+        flb_tail_file_exists(path, ctx) == FLB_TRUE) {
+        return 0;
+    }
+
+    ret = stat(path, &st);
+    if (ret == -1 || !S_ISREG(st.st_mode)) {
+        return 0;
+    }
+
+    /* A monitored file renamed in place, its own watch handle the rotation */
+    if (flb_tail_file_lookup_inode(st.st_ino, ctx)) {
+        return 0;
+    }
+
+    flb_debug("[in_tail] append new file: %s", path);
+    ret = flb_tail_file_append(path, &st, FLB_TAIL_STATIC, ctx);
+    if (ret == -1) {
+        return -1;
+    }
+
+    return 1;
+}
+
 /* Scan a path, register the entries and return how many */
 int flb_tail_scan(const char *path, struct flb_tail_config *ctx)
 {
@@ -214,6 +320,9 @@ int flb_tail_scan(const char *path, struct flb_tail_config *ctx)
         tail_exclude_generate(ctx);
     }
 
+    /* Watch the directories before the glob, so no new file is missed */
+    tail_scan_dirs(path, ctx);
+
     /* Safe reset for globfree() */
     globbuf.gl_pathv = NULL;
 
@@ -271,7 +380,8 @@ int flb_tail_scan(const char *path, struct flb_tail_config *ctx)
 
 /*
  * Triggered by refresh_interval, it re-scan the path looking for new files
- * that match the original path pattern.
+ * that match the original path pattern. It's skipped when the directory
+ * watches already cover the whole pattern.
  */
 int flb_tail_scan_callback(struct flb_input_instance *i_ins,
                            struct flb_config *config, void *context)
@@ -284,6 +394,18 @@ int flb_tail_scan_callback(struct flb_input_instance *i_ins,
     struct flb_tail_config *ctx = context;
     (void) config;
 
+#ifdef FLB_HAVE_METRICS
+    flb_tail_file_metrics(ctx);
+#endif
+
+    /* New files are reported by the directory watches */
+    if (ctx->scan_pending == FLB_FALSE) {
+        return 0;
+    }
+
+    /* Watch directories created since the last scan */
+    tail_scan_dirs(ctx->path, ctx);
+
     /* Scan the path */
     ret = do_glob(ctx->path, GLOB_TILDE, NULL, &globbuf);
     if (ret != 0) {
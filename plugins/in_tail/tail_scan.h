@@ -23,6 +23,7 @@
 #include "tail_config.h"
 
 int flb_tail_scan(const char *path, struct flb_tail_config *ctx);
+int flb_tail_scan_entry(char *dir, char *name, struct flb_tail_config *ctx);
 int flb_tail_scan_callback(struct flb_input_instance *i_ins,
                            struct flb_config *config, void *context);
 
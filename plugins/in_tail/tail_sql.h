@@ -52,4 +52,11 @@
 
 #define SQL_PRAGMA_SYNC                         \
     "PRAGMA synchronous=%i;"
+
+#define SQL_PRAGMA_JOURNAL_MODE                 \
+    "PRAGMA journal_mode=%s;"
+
+#define SQL_BEGIN       "BEGIN TRANSACTION;"
+#define SQL_COMMIT      "COMMIT;"
+#define SQL_ROLLBACK    "ROLLBACK;"
 #endif
@@ -0,0 +1,250 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_log.h>
+#include <fluent-bit/flb_pipe.h>
+#include <fluent-bit/flb_input.h>
+#include <fluent-bit/flb_filter.h>
+#include <fluent-bit/flb_arena.h>
+#include <fluent-bit/flb_mp.h>
+#ifdef FLB_HAVE_REGEX
+#include <fluent-bit/flb_regex.h>
+#endif
+#include <fluent-bit/flb_worker.h>
+
+#include "tail.h"
+#include "tail_file.h"
+#include "tail_config.h"
+#include "tail_thread.h"
+
+/*
+ * Run the filters chain over the records read, the engine thread only
+ * appends them. It's skipped if a filter for the tag is not thread safe.
+ */
+static void reader_filter(struct flb_tail_file *file)
+{
+    int ret;
+    msgpack_packer mp_pck;
+    msgpack_sbuffer *sbuf = &file->chunk_sbuf;
+    struct flb_tail_config *ctx = file->config;
+
+    if (sbuf->size == 0) {
+        return;
+    }
+
+    msgpack_packer_init(&mp_pck, sbuf, msgpack_sbuffer_write);
+    ret = flb_filter_do_threaded(sbuf, &mp_pck, sbuf->data, sbuf->size,
+                                 file->tag_buf, file->tag_len,
+                                 ctx->i_ins->config);
+    if (ret == 0) {
+        file->chunk_filtered = FLB_TRUE;
+    }
+}
+
+/* Read the chunks of the files of this reader found in the current batch */
+static void reader_run(struct flb_tail_thread *th)
+{
+    struct mk_list *head;
+    struct flb_tail_file *file;
+    struct flb_tail_config *ctx = th->ctx;
+
+    mk_list_foreach(head, ctx->th_files) {
+        file = mk_list_entry(head, struct flb_tail_file, _head);
+        if (file->chunk_pending == FLB_FALSE || file->th_id != th->id) {
+            continue;
+        }
+        file->chunk_ret = flb_tail_file_chunk_read(file, &file->chunk_sbuf);
+        reader_filter(file);
+    }
+
+    pthread_mutex_lock(&ctx->th_mutex);
+    ctx->th_running--;
+    if (ctx->th_running == 0) {
+        pthread_cond_signal(&ctx->th_cond);
+    }
+    pthread_mutex_unlock(&ctx->th_mutex);
+}
+
+static void reader_loop(void *data)
+{
+    int n;
+    uint64_t val;
+    struct flb_tail_thread *th = data;
+
+    flb_debug("[in_tail] reader #%i started", th->id);
+
+    while (1) {
+        n = flb_pipe_r(th->ch[0], &val, sizeof(val));
+        if (n <= 0) {
+            flb_errno();
+            break;
+        }
+
+        if (val == FLB_TAIL_THREAD_STOP) {
+            break;
+        }
+        reader_run(th);
+    }
+
+    /* Release the memory the filters kept for this thread */
+    flb_arena_thread_exit();
+    flb_mp_thread_exit();
+#ifdef FLB_HAVE_REGEX
+    flb_regex_thread_exit();
+#endif
+
+    flb_debug("[in_tail] reader #%i stopped", th->id);
+}
+
+int flb_tail_thread_start(struct flb_tail_config *ctx)
+{
+    int i;
+    int ret;
+    char role[32];
+    struct flb_tail_thread *th;
+
+    pthread_mutex_init(&ctx->th_mutex, NULL);
+    pthread_cond_init(&ctx->th_cond, NULL);
+
+    for (i = 0; i < ctx->threads; i++) {
+        th = flb_calloc(1, sizeof(struct flb_tail_thread));
+        if (!th) {
+            flb_errno();
+            flb_tail_thread_stop(ctx);
+            return -1;
+        }
+        th->id = i;
+        th->ctx = ctx;
+
+        ret = flb_pipe_create(th->ch);
+        if (ret == -1) {
+            flb_free(th);
+            flb_tail_thread_stop(ctx);
+            return -1;
+        }
+        mk_list_add(&th->_head, &ctx->readers);
+
+        snprintf(role, sizeof(role) - 1, "input:%s", ctx->i_ins->name);
+        ret = flb_worker_create_role(reader_loop, th, &th->tid, role,
+                                     ctx->i_ins->cpus, ctx->i_ins->config);
+        if (ret == -1) {
+            flb_error("[in_tail] could not spawn reader #%i", i);
+            th->tid = 0;
+            flb_tail_thread_stop(ctx);
+            return -1;
+        }
+    }
+
+    flb_info("[in_tail] started %i reader threads", ctx->threads);
+    return 0;
+}
+
+void flb_tail_thread_stop(struct flb_tail_config *ctx)
+{
+    int n;
+    uint64_t val = FLB_TAIL_THREAD_STOP;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct flb_tail_thread *th;
+
+    mk_list_foreach_safe(head, tmp, &ctx->readers) {
+        th = mk_list_entry(head, struct flb_tail_thread, _head);
+        if (th->tid) {
+            n = flb_pipe_w(th->ch[1], &val, sizeof(val));
+            if (n == -1) {
+                flb_errno();
+            }
+            pthread_join(th->tid, NULL);
+        }
+        flb_pipe_destroy(th->ch);
+        mk_list_del(&th->_head);
+        flb_free(th);
+    }
+}
+
+/*
+ * Read a chunk of every file in 'list' marked with 'chunk_pending', the
+ * result is left in file->chunk_ret. Without reader threads the files are
+ * read one by one.
+ */
+void flb_tail_thread_chunks(struct flb_tail_config *ctx, struct mk_list *list)
+{
+    int n;
+    int busy;
+    uint64_t val = FLB_TAIL_THREAD_RUN;
+    struct mk_list *head;
+    struct flb_tail_file *file;
+    struct flb_tail_thread *th;
+
+    busy = flb_input_buf_paused(ctx->i_ins);
+    if (busy == FLB_TRUE || mk_list_is_empty(&ctx->readers) == 0) {
+        mk_list_foreach(head, list) {
+            file = mk_list_entry(head, struct flb_tail_file, _head);
+            if (file->chunk_pending == FLB_FALSE) {
+                continue;
+            }
+            if (busy == FLB_TRUE) {
+                file->chunk_ret = FLB_TAIL_BUSY;
+            }
+            else {
+                file->chunk_ret = flb_tail_file_chunk(file);
+            }
+        }
+        return;
+    }
+
+    mk_list_foreach(head, list) {
+        file = mk_list_entry(head, struct flb_tail_file, _head);
+        if (file->chunk_pending == FLB_TRUE) {
+            msgpack_sbuffer_init(&file->chunk_sbuf);
+            file->chunk_ret = FLB_TAIL_BUSY;
+        }
+    }
+
+    /* Start the readers and wait for them */
+    ctx->th_files = list;
+    ctx->th_running = ctx->threads;
+    mk_list_foreach(head, &ctx->readers) {
+        th = mk_list_entry(head, struct flb_tail_thread, _head);
+        n = flb_pipe_w(th->ch[1], &val, sizeof(val));
+        if (n == -1) {
+            flb_errno();
+            pthread_mutex_lock(&ctx->th_mutex);
+            ctx->th_running--;
+            pthread_mutex_unlock(&ctx->th_mutex);
+        }
+    }
+
+    pthread_mutex_lock(&ctx->th_mutex);
+    while (ctx->th_running > 0) {
+        pthread_cond_wait(&ctx->th_cond, &ctx->th_mutex);
+    }
+    pthread_mutex_unlock(&ctx->th_mutex);
+    ctx->th_files = NULL;
+
+    /* Append the records in the engine thread */
+    mk_list_foreach(head, list) {
+        file = mk_list_entry(head, struct flb_tail_file, _head);
+        if (file->chunk_pending == FLB_TRUE) {
+            flb_tail_file_chunk_commit(file, &file->chunk_sbuf);
+        }
+    }
+}
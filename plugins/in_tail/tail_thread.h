@@ -0,0 +1,52 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef FLB_TAIL_THREAD_H
+#define FLB_TAIL_THREAD_H
+
+#include <pthread.h>
+#include <fluent-bit/flb_pipe.h>
+
+#include "tail_config.h"
+
+/* Message sent through the reader channel to request the thread exit */
+#define FLB_TAIL_THREAD_STOP   0
+#define FLB_TAIL_THREAD_RUN    1
+
+/*
+ * Reader thread: with 'threads' greater than one, files are sharded across
+ * the readers by inode. When a collector has a set of files to read, every
+ * reader reads, splits, parses and packs the chunks of its own files in
+ * parallel, the engine thread waits until all of them are done and then
+ * appends the packed records, so the engine side buffers are only used
+ * by the engine thread.
+ */
+struct flb_tail_thread {
+    int id;                         /* reader number        */
+    pthread_t tid;                  /* thread ID            */
+    flb_pipefd_t ch[2];             /* requests channel     */
+    struct flb_tail_config *ctx;    /* plugin context       */
+    struct mk_list _head;           /* link to ctx->readers */
+};
+
+int flb_tail_thread_start(struct flb_tail_config *ctx);
+void flb_tail_thread_stop(struct flb_tail_config *ctx);
+void flb_tail_thread_chunks(struct flb_tail_config *ctx, struct mk_list *list);
+
+#endif
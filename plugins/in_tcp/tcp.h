@@ -22,9 +22,19 @@
 
 #include <msgpack.h>
 #include <fluent-bit/flb_input.h>
+#include <fluent-bit/flb_input_worker.h>
+
+/* Formats of the incoming data */
+#define FLB_TCP_FMT_JSON    0   /* JSON values, any framing      */
+#define FLB_TCP_FMT_NDJSON  1   /* one JSON value per line       */
+#define FLB_TCP_FMT_NONE    2   /* raw lines, packed as 'log'    */
 
 struct flb_in_tcp_config {
     int server_fd;                 /* TCP server file descriptor  */
+    int coll_id;                   /* Server collector id         */
+    int paused;                    /* Connections are not read    */
+    int workers;                   /* Listener threads            */
+    int format;                    /* Format of the data          */
     size_t buffer_size;            /* Buffer size for each reader */
     size_t chunk_size;             /* Chunk allocation size       */
     char *listen;                  /* Listen interface            */
@@ -32,6 +42,13 @@ struct flb_in_tcp_config {
     struct mk_list connections;    /* List of active connections  */
     struct mk_event_loop *evl;     /* Event loop file descriptor  */
     struct flb_input_instance *in; /* Input plugin instace        */
+
+    /*
+     * Listener workers. Each worker runs a copy of this context with its
+     * own event loop and connections, 'worker' is only set on the copies.
+     */
+    struct mk_list worker_list;
+    struct flb_input_worker *worker;
 };
 
 #endif
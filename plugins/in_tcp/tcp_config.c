@@ -19,6 +19,7 @@
 
 #include <stdlib.h>
 #include <fluent-bit/flb_utils.h>
+#include <fluent-bit/flb_socket.h>
 
 #include "tcp.h"
 #include "tcp_conn.h"
@@ -30,10 +31,13 @@ struct flb_in_tcp_config *tcp_config_init(struct flb_input_instance *i_ins)
     char *listen;
     char *buffer_size;
     char *chunk_size;
+    char *workers;
+    char *format;
     struct flb_in_tcp_config *config;
 
     config = flb_malloc(sizeof(struct flb_in_tcp_config));
     memset(config, '\0', sizeof(struct flb_in_tcp_config));
+    config->server_fd = -1;
 
     /* Listen interface (if not set, defaults to 0.0.0.0) */
     if (!i_ins->host.listen) {
@@ -78,6 +82,31 @@ struct flb_in_tcp_config *tcp_config_init(struct flb_input_instance *i_ins)
         config->buffer_size  = (atoi(buffer_size) * 1024);
     }
 
+    /* Data format */
+    format = flb_input_get_property("format", i_ins);
+    if (!format || strcasecmp(format, "json") == 0) {
+        config->format = FLB_TCP_FMT_JSON;
+    }
+    else if (strcasecmp(format, "ndjson") == 0) {
+        config->format = FLB_TCP_FMT_NDJSON;
+    }
+    else if (strcasecmp(format, "none") == 0) {
+        config->format = FLB_TCP_FMT_NONE;
+    }
+    else {
+        flb_warn("[in_tcp] unknown format '%s', using json", format);
+        config->format = FLB_TCP_FMT_JSON;
+    }
+
+    /* Listener threads */
+    workers = flb_input_get_property("workers", i_ins);
+    if (workers) {
+        config->workers = atoi(workers);
+        if (config->workers < 0) {
+            config->workers = 0;
+        }
+    }
+
     flb_debug("[in_tcp] Listen='%s' TCP_Port=%s",
               config->listen, config->tcp_port);
 
@@ -86,6 +115,9 @@ struct flb_in_tcp_config *tcp_config_init(struct flb_input_instance *i_ins)
 
 int tcp_config_destroy(struct flb_in_tcp_config *config)
 {
+    if (config->server_fd > 0) {
+        flb_socket_close(config->server_fd);
+    }
     flb_free(config->listen);
     flb_free(config->tcp_port);
     flb_free(config);
@@ -23,6 +23,9 @@
 #include <fluent-bit/flb_network.h>
 #include <fluent-bit/flb_pack.h>
 #include <fluent-bit/flb_error.h>
+#include <fluent-bit/flb_mp.h>
+#include <fluent-bit/flb_json.h>
+#include <fluent-bit/flb_lines.h>
 
 #include "tcp.h"
 #include "tcp_conn.h"
@@ -32,38 +35,169 @@ static inline void consume_bytes(char *buf, int bytes, int length)
     memmove(buf, buf + bytes, length - bytes);
 }
 
-static inline int process_pack(struct tcp_conn *conn,
+/*
+ * Wrap the values packed by the JSON parser as records, maps are copied as
+ * they are and any other value goes under the 'msg' key. Maps the filters
+ * would discard are skipped.
+ */
+static inline int pack_records(struct tcp_conn *conn, msgpack_packer *mp_pck,
                                char *pack, size_t size)
 {
+    int ret;
+    int records = 0;
+    uint32_t count;
     size_t off = 0;
-    msgpack_unpacked result;
-    msgpack_object entry;
+    size_t len;
+    size_t hdr;
 
-    flb_input_buf_write_start(conn->in);
+    while (off < size) {
+        if (flb_mp_object_size(pack + off, size - off, &len) == -1) {
+            break;
+        }
 
-    /* First pack the results, iterate concatenated messages */
-    msgpack_unpacked_init(&result);
-    while (msgpack_unpack_next(&result, pack, size, &off)) {
-        entry = result.data;
+        ret = flb_mp_map_header(pack + off, len, &count, &hdr);
+        if (ret == 0 &&
+            flb_filter_pushdown_pack(&conn->pushdown,
+                                     pack + off, len) == FLB_TRUE) {
+            off += len;
+            continue;
+        }
 
-        msgpack_pack_array(&conn->in->mp_pck, 2);
-        flb_pack_time_now(&conn->in->mp_pck);
+        msgpack_pack_array(mp_pck, 2);
+        flb_input_pack_time_now(conn->in, mp_pck);
 
-        if (entry.type == MSGPACK_OBJECT_MAP) {
-            msgpack_pack_object(&conn->in->mp_pck, entry);
+        if (ret == -1) {
+            msgpack_pack_map(mp_pck, 1);
+            msgpack_pack_str(mp_pck, 3);
+            msgpack_pack_str_body(mp_pck, "msg", 3);
         }
-        else {
-            msgpack_pack_map(&conn->in->mp_pck, 1);
-            msgpack_pack_str(&conn->in->mp_pck, 3);
-            msgpack_pack_str_body(&conn->in->mp_pck, "msg", 3);
-            msgpack_pack_object(&conn->in->mp_pck, entry);
+        mp_pck->callback(mp_pck->data, pack + off, len);
+
+        off += len;
+        records++;
+    }
+
+    return records;
+}
+
+/*
+ * Records go to the instance buffer or, from a listener worker, to the
+ * connection buffer that is handed to the engine thread.
+ */
+static inline msgpack_packer *records_start(struct tcp_conn *conn)
+{
+    if (!conn->ctx->worker) {
+        flb_input_buf_write_start(conn->in);
+        return &conn->in->mp_pck;
+    }
+
+    msgpack_sbuffer_clear(&conn->mp_sbuf);
+    return &conn->mp_pck;
+}
+
+static inline int records_end(struct tcp_conn *conn, int records)
+{
+    if (!conn->ctx->worker) {
+        flb_input_buf_write_end(conn->in);
+        return 0;
+    }
+
+    if (conn->mp_sbuf.size == 0) {
+        return 0;
+    }
+    return flb_input_worker_append(conn->ctx->worker, NULL, 0,
+                                   conn->mp_sbuf.data, conn->mp_sbuf.size,
+                                   records);
+}
+
+static inline int process_pack(struct tcp_conn *conn,
+                               char *pack, size_t size)
+{
+    int records;
+    msgpack_packer *mp_pck;
+
+    mp_pck = records_start(conn);
+    records = pack_records(conn, mp_pck, pack, size);
+    return records_end(conn, records);
+}
+
+/*
+ * Line formats: the line breaks are located first and every complete line
+ * is handled on its own, a JSON line is parsed once. Only the last partial
+ * line stays in the connection buffer.
+ */
+static int process_lines(struct tcp_conn *conn)
+{
+    int i;
+    int n;
+    int ret;
+    int records = 0;
+    char *data = conn->buf_data;
+    char *end = conn->buf_data + conn->buf_len;
+    char *base;
+    char *line;
+    char *out;
+    size_t len;
+    size_t out_size;
+    size_t offsets[FLB_IN_TCP_LINES];
+    msgpack_packer *mp_pck;
+
+    mp_pck = records_start(conn);
+
+    while ((n = flb_lines_scan(data, end - data, offsets,
+                               FLB_IN_TCP_LINES)) > 0) {
+        base = data;
+        for (i = 0; i < n; i++) {
+            line = data;
+            len = (base + offsets[i]) - line;
+            data = base + offsets[i] + 1;
+
+            if (len > 0 && line[len - 1] == '\r') {
+                len--;
+            }
+            if (len == 0) {
+                continue;
+            }
+
+            if (conn->ctx->format == FLB_TCP_FMT_NONE) {
+                if (flb_filter_pushdown_line(&conn->pushdown,
+                                             line, len) == FLB_TRUE) {
+                    continue;
+                }
+                msgpack_pack_array(mp_pck, 2);
+                flb_input_pack_time_now(conn->in, mp_pck);
+                msgpack_pack_map(mp_pck, 1);
+                msgpack_pack_str(mp_pck, 3);
+                msgpack_pack_str_body(mp_pck, "log", 3);
+                msgpack_pack_str(mp_pck, len);
+                msgpack_pack_str_body(mp_pck, line, len);
+                records++;
+                continue;
+            }
+
+            if (flb_filter_pushdown_tag(&conn->pushdown) == FLB_TRUE) {
+                continue;
+            }
+            ret = flb_json_parse(line, len, &out, &out_size);
+            if (ret <= 0) {
+                flb_debug("[in_tcp] invalid JSON line, skipping");
+                continue;
+            }
+            records += pack_records(conn, mp_pck, out, out_size);
+            flb_free(out);
         }
     }
-    flb_input_buf_write_end(conn->in);
 
-    msgpack_unpacked_destroy(&result);
+    records_end(conn, records);
 
-    return 0;
+    /* Keep the partial line */
+    len = data - conn->buf_data;
+    if (len > 0) {
+        consume_bytes(conn->buf_data, len, conn->buf_len);
+        conn->buf_len -= len;
+    }
+
+    return records;
 }
 
 /* Callback invoked every time an event is triggered for a connection */
@@ -78,6 +212,11 @@ int tcp_conn_event(void *data)
     struct tcp_conn *conn = data;
     struct flb_in_tcp_config *ctx = conn->ctx;
 
+    /* Stale event from a connection removed by a pause */
+    if (ctx->paused == FLB_TRUE) {
+        return 0;
+    }
+
     event = &conn->event;
     if (event->mask & MK_EVENT_READ) {
         available = (conn->buf_size - conn->buf_len);
@@ -115,16 +254,18 @@ int tcp_conn_event(void *data)
         flb_trace("[in_tcp] read()=%i pre_len=%i now_len=%i",
                   bytes, conn->buf_len, conn->buf_len + bytes);
         conn->buf_len += bytes;
-        conn->buf_data[conn->buf_len] = '\0';
 
-        /* Strip CR or LF if found at first byte */
-        if (conn->buf_data[0] == '\r' || conn->buf_data[0] == '\n') {
-            /* Skip message with one byte with CR or LF */
-            flb_trace("[in_tcp] skip one byte message with ASCII code=%i",
-                      conn->buf_data[0]);
-            consume_bytes(conn->buf_data, 1, conn->buf_len);
-            conn->buf_len--;
+        if (ctx->format != FLB_TCP_FMT_JSON) {
+            process_lines(conn);
+            return bytes;
         }
+        conn->buf_data[conn->buf_len] = '\0';
+
+        /*
+         * Leading CR or LF bytes are skipped by the JSON scanner, the buffer
+         * must not be moved here: the pack state resumes from where the
+         * previous read stopped.
+         */
 
         /* JSON Format handler */
         char *pack;
@@ -150,14 +291,11 @@ int tcp_conn_event(void *data)
          */
         process_pack(conn, pack, out_size);
 
+        /* the pack state follows the consumed bytes */
         consume_bytes(conn->buf_data, conn->pack_state.last_byte, conn->buf_len);
         conn->buf_len -= conn->pack_state.last_byte;
         conn->buf_data[conn->buf_len] = '\0';
 
-        flb_pack_state_reset(&conn->pack_state);
-        flb_pack_state_init(&conn->pack_state);
-        conn->pack_state.multiple = FLB_TRUE;
-
         flb_free(pack);
         return bytes;
     }
@@ -211,6 +349,13 @@ struct tcp_conn *tcp_conn_add(int fd, struct flb_in_tcp_config *ctx)
     flb_pack_state_init(&conn->pack_state);
     conn->pack_state.multiple = FLB_TRUE;
 
+    /* Records of format 'none' have the line under the 'log' key */
+    flb_filter_pushdown_init(&conn->pushdown, ctx->in,
+                             ctx->in->tag, ctx->in->tag_len, "log", 3);
+
+    msgpack_sbuffer_init(&conn->mp_sbuf);
+    msgpack_packer_init(&conn->mp_pck, &conn->mp_sbuf, msgpack_sbuffer_write);
+
     /* Register instance into the event loop */
     ret = mk_event_add(ctx->evl, fd, FLB_ENGINE_EV_CUSTOM, MK_EVENT_READ, conn);
     if (ret == -1) {
@@ -226,6 +371,42 @@ struct tcp_conn *tcp_conn_add(int fd, struct flb_in_tcp_config *ctx)
     return conn;
 }
 
+/*
+ * Stop reading from the connections: data queued by the senders stays in
+ * the kernel socket buffers and the TCP window pushes back on them.
+ */
+int tcp_conn_pause_all(struct flb_in_tcp_config *ctx)
+{
+    struct mk_list *head;
+    struct tcp_conn *conn;
+
+    mk_list_foreach(head, &ctx->connections) {
+        conn = mk_list_entry(head, struct tcp_conn, _head);
+        mk_event_del(ctx->evl, &conn->event);
+    }
+
+    return 0;
+}
+
+int tcp_conn_resume_all(struct flb_in_tcp_config *ctx)
+{
+    int ret;
+    struct mk_list *head;
+    struct tcp_conn *conn;
+
+    mk_list_foreach(head, &ctx->connections) {
+        conn = mk_list_entry(head, struct tcp_conn, _head);
+        ret = mk_event_add(ctx->evl, conn->fd, FLB_ENGINE_EV_CUSTOM,
+                           MK_EVENT_READ, conn);
+        if (ret == -1) {
+            flb_error("[in_tcp] fd=%i could not resume connection",
+                      conn->fd);
+        }
+    }
+
+    return 0;
+}
+
 int tcp_conn_del(struct tcp_conn *conn)
 {
     struct flb_in_tcp_config *ctx;
@@ -233,6 +414,8 @@ int tcp_conn_del(struct tcp_conn *conn)
     ctx = conn->ctx;
 
     flb_pack_state_reset(&conn->pack_state);
+    flb_filter_pushdown_destroy(&conn->pushdown);
+    msgpack_sbuffer_destroy(&conn->mp_sbuf);
 
     /* Unregister the file descriptior from the event-loop */
     mk_event_del(ctx->evl, &conn->event);
@@ -21,9 +21,13 @@
 #define FLB_IN_TCP_CONN_H
 
 #include <fluent-bit/flb_pack.h>
+#include <fluent-bit/flb_filter_pushdown.h>
 
 #define FLB_IN_TCP_CHUNK 32768
 
+/* Line breaks located per scan in the line formats */
+#define FLB_IN_TCP_LINES 256
+
 enum {
     TCP_NEW        = 1,  /* it's a new connection                */
     TCP_CONNECTED  = 2,  /* MQTT connection per protocol spec OK */
@@ -49,11 +53,18 @@ struct tcp_conn {
     struct flb_input_instance *in;    /* Parent plugin instance            */
     struct flb_in_tcp_config *ctx;    /* Plugin configuration context      */
     struct flb_pack_state pack_state; /* Internal JSON parser              */
+    struct flb_filter_pushdown pushdown; /* Filters rules of the tag       */
+
+    /* Records of a listener worker, handed to the engine thread */
+    msgpack_sbuffer mp_sbuf;
+    msgpack_packer mp_pck;
 
     struct mk_list _head;
 };
 
 struct tcp_conn *tcp_conn_add(int fd, struct flb_in_tcp_config *ctx);
 int tcp_conn_del(struct tcp_conn *conn);
+int tcp_conn_pause_all(struct flb_in_tcp_config *ctx);
+int tcp_conn_resume_all(struct flb_in_tcp_config *ctx);
 
 #endif
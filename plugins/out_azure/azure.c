@@ -44,193 +44,310 @@ static int cb_azure_init(struct flb_output_instance *ins,
     return 0;
 }
 
-int azure_format(void *in_buf, size_t in_bytes,
-                  char **out_buf, size_t *out_size,
-                  struct flb_azure *ctx)
+static inline int json_cat(flb_sds_t *buf, char *str, int len)
+{
+    flb_sds_t tmp;
+
+    tmp = flb_sds_cat(*buf, str, len);
+    if (!tmp) {
+        return -1;
+    }
+    *buf = tmp;
+    return 0;
+}
+
+/* Append one record to 'buf' as a JSON map, the time key goes first */
+static int azure_record(struct flb_azure *ctx, flb_sds_t *buf,
+                        struct flb_time *tm, msgpack_object *map)
 {
     int i;
-    int array_size = 0;
-    int map_size;
+    int len;
+    char tmp[64];
+
+    if (json_cat(buf, "{\"", 2) == -1 ||
+        flb_utils_write_str_sds(buf, ctx->time_key,
+                                flb_sds_len(ctx->time_key)) == -1) {
+        return -1;
+    }
+
+    len = snprintf(tmp, sizeof(tmp) - 1, "\":%f", flb_time_to_double(tm));
+    if (json_cat(buf, tmp, len) == -1) {
+        return -1;
+    }
+
+    for (i = 0; i < map->via.map.size; i++) {
+        if (json_cat(buf, ",", 1) == -1 ||
+            flb_msgpack_to_json_sds(buf, &map->via.map.ptr[i].key) == -1 ||
+            json_cat(buf, ":", 1) == -1 ||
+            flb_msgpack_to_json_sds(buf, &map->via.map.ptr[i].val) == -1) {
+            return -1;
+        }
+    }
+
+    return json_cat(buf, "}", 1);
+}
+
+/*
+ * Encode the records straight into one buffer. The payloads are JSON
+ * arrays laid out one after the other: a new one starts when a record
+ * would take the current one over 'payload_max'.
+ */
+static int azure_format(struct flb_azure *ctx, void *data, size_t bytes,
+                        flb_sds_t *out_buf,
+                        struct azure_request **out_reqs, int *out_num,
+                        struct flb_arena *arena)
+{
+    int ret;
+    int dropped = 0;
+    int reqs_num = 1;
+    int reqs_size = 4;
     size_t off = 0;
-    double t;
-    struct flb_time tm;
+    size_t sep;
+    size_t rec_len;
+    size_t req_size = sizeof(struct azure_request);
+    flb_sds_t buf;
     msgpack_unpacked result;
     msgpack_object root;
-    msgpack_object *obj;
-    msgpack_object map;
-    msgpack_object k;
-    msgpack_object v;
-    msgpack_sbuffer mp_sbuf;
-    msgpack_packer mp_pck;
-    msgpack_sbuffer tmp_sbuf;
-    msgpack_packer tmp_pck;
-    flb_sds_t record;
-
-    /* Count number of items */
-    msgpack_unpacked_init(&result);
-    while (msgpack_unpack_next(&result, in_buf, in_bytes, &off)) {
-        array_size++;
+    msgpack_object *map;
+    struct flb_time tm;
+    struct azure_request *reqs;
+    struct azure_request *r;
+
+    reqs = flb_arena_calloc(arena, reqs_size, req_size);
+    if (!reqs) {
+        return -1;
     }
-    msgpack_unpacked_destroy(&result);
-    msgpack_unpacked_init(&result);
+    r = &reqs[0];
 
-    /* Create temporal msgpack buffer */
-    msgpack_sbuffer_init(&mp_sbuf);
-    msgpack_packer_init(&mp_pck, &mp_sbuf, msgpack_sbuffer_write);
-    msgpack_pack_array(&mp_pck, array_size);
+    /* JSON is rarely over one and a half times the msgpack size */
+    buf = flb_sds_create_size(bytes * 1.5);
+    if (!buf) {
+        flb_errno();
+        return -1;
+    }
 
-    off = 0;
-    while (msgpack_unpack_next(&result, in_buf, in_bytes, &off)) {
+    msgpack_unpacked_init(&result);
+    while (msgpack_unpack_next(&result, data, bytes, &off)) {
         root = result.data;
+        if (root.type != MSGPACK_OBJECT_ARRAY || root.via.array.size != 2 ||
+            root.via.array.ptr[1].type != MSGPACK_OBJECT_MAP) {
+            continue;
+        }
+        flb_time_pop_from_msgpack(&tm, &result, &map);
 
-        /* Get timestamp */
-        flb_time_pop_from_msgpack(&tm, &result, &obj);
-        t = flb_time_to_double(&tm);
-
-        /* Create temporal msgpack buffer */
-        msgpack_sbuffer_init(&tmp_sbuf);
-        msgpack_packer_init(&tmp_pck, &tmp_sbuf, msgpack_sbuffer_write);
-
-        map = root.via.array.ptr[1];
-        map_size = map.via.map.size;
+        sep = flb_sds_len(buf);
+        ret = json_cat(&buf, r->records == 0 ? "[" : ",", 1);
+        if (ret == 0) {
+            ret = azure_record(ctx, &buf, &tm, map);
+        }
+        if (ret == -1) {
+            goto error;
+        }
 
-        msgpack_pack_map(&mp_pck, map_size + 1);
+        /* With its brackets a record over the limit is never accepted */
+        rec_len = flb_sds_len(buf) - sep - 1;
+        if (rec_len + 2 > ctx->payload_max) {
+            flb_sds_len_set(buf, sep);
+            dropped++;
+            continue;
+        }
 
-        /* Append the time key */
-        msgpack_pack_str(&mp_pck, flb_sds_len(ctx->time_key));
-        msgpack_pack_str_body(&mp_pck,
-                              ctx->time_key,
-                              flb_sds_len(ctx->time_key));
-        msgpack_pack_double(&mp_pck, t);
+        if (r->records > 0 &&
+            flb_sds_len(buf) + 1 - r->off > ctx->payload_max) {
+            /* The separator closes the payload, the record opens the next */
+            if (json_cat(&buf, "]", 1) == -1) {
+                goto error;
+            }
+            memmove(buf + sep + 2, buf + sep + 1, rec_len);
+            buf[sep] = ']';
+            buf[sep + 1] = '[';
+            r->len = sep + 1 - r->off;
+
+            if (reqs_num == reqs_size) {
+                reqs = flb_arena_realloc(arena, reqs, reqs_size * req_size,
+                                         reqs_size * 2 * req_size);
+                if (!reqs) {
+                    goto error;
+                }
+                reqs_size *= 2;
+            }
+            r = &reqs[reqs_num++];
+            memset(r, '\0', sizeof(struct azure_request));
+            r->off = sep + 1;
+        }
+        r->records++;
+    }
+    msgpack_unpacked_destroy(&result);
 
-        /* Append original map k/v */
-        for (i = 0; i < map_size; i++) {
-            k = map.via.map.ptr[i].key;
-            v = map.via.map.ptr[i].val;
+    if (dropped > 0) {
+        flb_warn("[out_azure] %i records over max_payload_size dropped",
+                 dropped);
+    }
 
-            msgpack_pack_object(&tmp_pck, k);
-            msgpack_pack_object(&tmp_pck, v);
+    if (r->records > 0) {
+        if (json_cat(&buf, "]", 1) == -1) {
+            flb_sds_destroy(buf);
+            return -1;
         }
-        msgpack_sbuffer_write(&mp_sbuf, tmp_sbuf.data, tmp_sbuf.size);
-        msgpack_sbuffer_destroy(&tmp_sbuf);
+        r->len = flb_sds_len(buf) - r->off;
+    }
+    else {
+        reqs_num--;
     }
 
-    record = flb_msgpack_raw_to_json_sds(mp_sbuf.data, mp_sbuf.size);
-    if (!record) {
-        flb_errno();
-        msgpack_sbuffer_destroy(&mp_sbuf);
-        msgpack_unpacked_destroy(&result);
+    *out_buf = buf;
+    *out_reqs = reqs;
+    *out_num = reqs_num;
+    return 0;
+
+ error:
+    msgpack_unpacked_destroy(&result);
+    flb_sds_destroy(buf);
+    return -1;
+}
+
+/* Base64 HMAC-SHA256 of the canonical request, signed with the cached key */
+static int azure_sign(struct flb_azure *ctx, size_t content_length,
+                      char *date, char *out, size_t size, size_t *olen)
+{
+    int len;
+    char str_hash[256];
+    unsigned char hmac_hash[32];
+
+    len = snprintf(str_hash, sizeof(str_hash),
+                   "POST\n%zu\napplication/json\nx-ms-date:%s\n"
+                   FLB_AZURE_RESOURCE, content_length, date);
+    if (len < 0 || len >= sizeof(str_hash)) {
         return -1;
     }
 
-    msgpack_sbuffer_destroy(&mp_sbuf);
-    msgpack_unpacked_destroy(&result);
+    if (mbedtls_md_hmac_reset(&ctx->hmac) != 0 ||
+        mbedtls_md_hmac_update(&ctx->hmac, (unsigned char *) str_hash,
+                               len) != 0 ||
+        mbedtls_md_hmac_finish(&ctx->hmac, hmac_hash) != 0) {
+        return -1;
+    }
 
-    *out_buf = record;
-    *out_size = flb_sds_len(record);
+    if (mbedtls_base64_encode((unsigned char *) out, size, olen,
+                              hmac_hash, sizeof(hmac_hash)) != 0) {
+        return -1;
+    }
 
     return 0;
 }
 
 static int build_headers(struct flb_http_client *c,
-                         size_t content_length,
-                         struct flb_azure *ctx)
+                         size_t content_length, char *date,
+                         struct flb_azure *ctx, struct flb_arena *arena)
 {
-    int len;
-    char *auth;
-    char tmp[256];
-    time_t t;
+    int ret;
     size_t size;
     size_t olen;
-    flb_sds_t rfc1123date;
-    flb_sds_t str_hash;
-    struct tm tm = {0};
-    unsigned char hmac_hash[32] = {0};
-    mbedtls_md_context_t mctx;
-
-    /* Format Date */
-    rfc1123date = flb_sds_create_size(32);
-    if (!rfc1123date) {
-        flb_errno();
-        return -1;
-    }
+    size_t prefix_len;
+    char *auth;
 
-    t = time(NULL);
-    if (!gmtime_r(&t, &tm)) {
-        flb_errno();
-        flb_sds_destroy(rfc1123date);
-        return -1;
-    }
-    size = strftime(rfc1123date,
-                    flb_sds_alloc(rfc1123date) - 1,
-                    "%a, %d %b %Y %H:%M:%S GMT", &tm);
-    if (size <= 0) {
-        flb_errno();
-        flb_sds_destroy(rfc1123date);
+    /* Authorization: 'SharedKey <customer_id>:<signature>' */
+    prefix_len = flb_sds_len(ctx->auth_prefix);
+    size = prefix_len + 64;
+    auth = flb_arena_alloc(arena, size);
+    if (!auth) {
         return -1;
     }
-    flb_sds_len_set(rfc1123date, size);
+    memcpy(auth, ctx->auth_prefix, prefix_len);
 
-    /* Compose source string for the hash */
-    str_hash = flb_sds_create_size(256);
-    if (!str_hash) {
-        flb_errno();
-        flb_sds_destroy(rfc1123date);
+    ret = azure_sign(ctx, content_length, date,
+                     auth + prefix_len, size - prefix_len, &olen);
+    if (ret == -1) {
         return -1;
     }
 
-    len = snprintf(tmp, sizeof(tmp) - 1, "%zu\n", content_length);
-    flb_sds_cat(str_hash, "POST\n", 5);
-    flb_sds_cat(str_hash, tmp, len);
-    flb_sds_cat(str_hash, "application/json\n", 17);
-    flb_sds_cat(str_hash, "x-ms-date:", 10);
-    flb_sds_cat(str_hash, rfc1123date, flb_sds_len(rfc1123date));
-    flb_sds_cat(str_hash, "\n", 1);
-    flb_sds_cat(str_hash, FLB_AZURE_RESOURCE, sizeof(FLB_AZURE_RESOURCE) - 1);
-
-    /* Authorization signature */
-    mbedtls_md_init(&mctx);
-    mbedtls_md_setup(&mctx, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256) , 1);
-    mbedtls_md_hmac_starts(&mctx, (unsigned char *) ctx->dec_shared_key,
-                           flb_sds_len(ctx->dec_shared_key));
-    mbedtls_md_hmac_update(&mctx, (unsigned char *) str_hash,
-                           flb_sds_len(str_hash));
-    mbedtls_md_hmac_finish(&mctx, hmac_hash);
-    mbedtls_md_free(&mctx);
-
-    /* Encoded hash */
-    mbedtls_base64_encode((unsigned char *) &tmp, sizeof(tmp) - 1, &olen,
-                          hmac_hash, sizeof(hmac_hash));
-    tmp[olen] = '\0';
-
     /* Append headers */
     flb_http_add_header(c, "User-Agent", 10, "Fluent-Bit", 10);
     flb_http_add_header(c, "Log-Type", 8,
                         ctx->log_type, flb_sds_len(ctx->log_type));
     flb_http_add_header(c, "Content-Type", 12, "application/json", 16);
-    flb_http_add_header(c, "x-ms-date", 9, rfc1123date,
-                        flb_sds_len(rfc1123date));
+    flb_http_add_header(c, "x-ms-date", 9, date, strlen(date));
+    flb_http_add_header(c, "Authorization", 13, auth, prefix_len + olen);
 
-    size = 32 + flb_sds_len(ctx->customer_id) + olen;
-    auth = flb_malloc(size);
-    if (!auth) {
-        flb_errno();
-        flb_sds_destroy(rfc1123date);
-        flb_sds_destroy(str_hash);
-        return -1;
+    return 0;
+}
+
+/* Send a post without waiting for its response */
+static void azure_send(struct flb_azure *ctx, struct azure_request *r,
+                       flb_sds_t buf, char *date, struct flb_arena *arena)
+{
+    int ret;
+    size_t b_sent;
+
+    r->status = FLB_RETRY;
+
+    /* Get upstream connection */
+    r->u_conn = flb_upstream_conn_get(ctx->u);
+    if (!r->u_conn) {
+        return;
     }
 
+    /* Compose HTTP Client request */
+    r->c = flb_http_client(r->u_conn, FLB_HTTP_POST, ctx->uri,
+                           buf + r->off, r->len, NULL, 0, NULL, 0);
+    if (!r->c) {
+        flb_upstream_conn_release(r->u_conn);
+        r->u_conn = NULL;
+        return;
+    }
+    flb_http_buffer_size(r->c, FLB_HTTP_DATA_SIZE_MAX);
+
+    /* Append headers and Azure signature */
+    ret = build_headers(r->c, r->len, date, ctx, arena);
+    if (ret == -1) {
+        flb_error("[out_azure] error composing signature");
+        r->status = FLB_ERROR;
+    }
+    else {
+        ret = flb_http_send(r->c, &b_sent);
+        if (ret == 0) {
+            return;
+        }
+        flb_warn("[out_azure] http_do=%i", ret);
+    }
 
-    len = snprintf(auth, size, "SharedKey %s:%s",
-                   ctx->customer_id, tmp);
-    flb_http_add_header(c, "Authorization", 13, auth, len);
+    flb_http_client_destroy(r->c);
+    flb_upstream_conn_release(r->u_conn);
+    r->c = NULL;
+    r->u_conn = NULL;
+}
 
-    /* release resources */
-    flb_sds_destroy(rfc1123date);
-    flb_sds_destroy(str_hash);
-    flb_free(auth);
+/* Read the response of a post and release its resources */
+static void azure_recv(struct flb_azure *ctx, struct azure_request *r)
+{
+    int ret;
+    struct flb_http_client *c = r->c;
 
-    return 0;
+    if (!c) {
+        return;
+    }
+
+    ret = flb_http_recv(c);
+    if (ret != 0) {
+        flb_warn("[out_azure] http_do=%i", ret);
+    }
+    else if (c->resp.status >= 200 && c->resp.status <= 299) {
+        flb_info("[out_azure] customer_id=%s, HTTP status=%i",
+                 ctx->customer_id, c->resp.status);
+        r->status = FLB_OK;
+    }
+    else if (c->resp.payload_size > 0) {
+        flb_warn("[out_azure] http_status=%i:\n%s",
+                 c->resp.status, c->resp.payload);
+    }
+    else {
+        flb_warn("[out_azure] http_status=%i", c->resp.status);
+    }
+
+    flb_http_client_destroy(c);
+    flb_upstream_conn_release(r->u_conn);
+    r->c = NULL;
+    r->u_conn = NULL;
 }
 
 static void cb_azure_flush(void *data, size_t bytes,
@@ -239,80 +356,74 @@ static void cb_azure_flush(void *data, size_t bytes,
                             void *out_context,
                             struct flb_config *config)
 {
+    int i;
+    int j;
+    int n;
     int ret;
-    size_t b_sent;
-    char *buf_data;
-    size_t buf_size;
+    int reqs_num;
+    int status = FLB_OK;
+    time_t t;
+    size_t size;
+    char date[64];
+    struct tm tm;
     struct flb_azure *ctx = out_context;
-    struct flb_upstream_conn *u_conn;
-    struct flb_http_client *c;
-    flb_sds_t payload;
+    struct flb_arena *arena;
+    struct azure_request *reqs;
+    flb_sds_t buf;
     (void) i_ins;
     (void) config;
 
-    /* Get upstream connection */
-    u_conn = flb_upstream_conn_get(ctx->u);
-    if (!u_conn) {
-        FLB_OUTPUT_RETURN(FLB_RETRY);
-    }
+    arena = flb_output_arena();
 
-    /* Convert binary logs into a JSON payload */
-    ret = azure_format(data, bytes, &buf_data, &buf_size, ctx);
+    /* Convert binary logs into the JSON payloads */
+    ret = azure_format(ctx, data, bytes, &buf, &reqs, &reqs_num, arena);
     if (ret == -1) {
-        flb_upstream_conn_release(u_conn);
         FLB_OUTPUT_RETURN(FLB_ERROR);
     }
-    payload = (flb_sds_t) buf_data;
-
-    /* Compose HTTP Client request */
-    c = flb_http_client(u_conn, FLB_HTTP_POST, ctx->uri,
-                        buf_data, buf_size, NULL, 0, NULL, 0);
-    flb_http_buffer_size(c, FLB_HTTP_DATA_SIZE_MAX);
-
-    /* Append headers and Azure signature */
-    ret = build_headers(c, flb_sds_len(payload), ctx);
-    if (ret == -1) {
-        flb_error("[out_azure] error composing signature");
-        flb_sds_destroy(payload);
-        flb_http_client_destroy(c);
-        flb_upstream_conn_release(u_conn);
-        FLB_OUTPUT_RETURN(FLB_ERROR);
+    if (reqs_num == 0) {
+        flb_sds_destroy(buf);
+        FLB_OUTPUT_RETURN(FLB_OK);
     }
 
-    ret = flb_http_do(c, &b_sent);
-    if (ret != 0) {
-        flb_warn("[out_azure] http_do=%i", ret);
-        goto retry;
+    /* Every post of the flush is signed with the same date */
+    t = time(NULL);
+    if (!gmtime_r(&t, &tm)) {
+        flb_errno();
+        flb_sds_destroy(buf);
+        FLB_OUTPUT_RETURN(FLB_RETRY);
     }
-    else {
-        if (c->resp.status >= 200 && c->resp.status <= 299) {
-            flb_info("[out_azure] customer_id=%s, HTTP status=%i",
-                     ctx->customer_id, c->resp.status);
+    size = strftime(date, sizeof(date) - 1, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (size == 0) {
+        flb_sds_destroy(buf);
+        FLB_OUTPUT_RETURN(FLB_RETRY);
+    }
+
+    /*
+     * Posts go by groups of FLB_AZURE_CONCURRENCY: all of them are sent
+     * before reading any response. The whole chunk is retried on a failure,
+     * so no group is sent after a failed one.
+     */
+    for (i = 0; i < reqs_num && status == FLB_OK; i += FLB_AZURE_CONCURRENCY) {
+        n = reqs_num - i;
+        if (n > FLB_AZURE_CONCURRENCY) {
+            n = FLB_AZURE_CONCURRENCY;
         }
-        else {
-            if (c->resp.payload_size > 0) {
-                flb_warn("[out_azure] http_status=%i:\n%s",
-                         c->resp.status, c->resp.payload);
+        for (j = 0; j < n; j++) {
+            azure_send(ctx, &reqs[i + j], buf, date, arena);
+        }
+        for (j = 0; j < n; j++) {
+            azure_recv(ctx, &reqs[i + j]);
+            if (reqs[i + j].status == FLB_ERROR) {
+                status = FLB_ERROR;
             }
-            else {
-                flb_warn("[out_azure] http_status=%i", c->resp.status);
+            else if (reqs[i + j].status != FLB_OK && status == FLB_OK) {
+                status = FLB_RETRY;
             }
-            goto retry;
         }
     }
 
-    /* Cleanup */
-    flb_http_client_destroy(c);
-    flb_sds_destroy(payload);
-    flb_upstream_conn_release(u_conn);
-    FLB_OUTPUT_RETURN(FLB_OK);
-
-    /* Issue a retry */
- retry:
-    flb_http_client_destroy(c);
-    flb_sds_destroy(payload);
-    flb_upstream_conn_release(u_conn);
-    FLB_OUTPUT_RETURN(FLB_RETRY);
+    flb_sds_destroy(buf);
+    FLB_OUTPUT_RETURN(status);
 }
 
 static int cb_azure_exit(void *data, struct flb_config *config)
@@ -331,5 +442,5 @@ struct flb_output_plugin out_azure_plugin = {
     .cb_exit      = cb_azure_exit,
 
     /* Plugin flags */
-    .flags          = FLB_OUTPUT_NET | FLB_IO_TLS,
+    .flags          = FLB_OUTPUT_NET | FLB_IO_TLS | FLB_OUTPUT_SHARDS,
 };
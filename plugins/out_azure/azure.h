@@ -27,9 +27,16 @@
 #define FLB_AZURE_LOG_TYPE           "fluentbit"
 #define FLB_AZURE_TIME_KEY           "@timestamp"
 
+/* Data Collector API limit of a single post */
+#define FLB_AZURE_PAYLOAD_MAX        (30 * 1024 * 1024)
+
+/* Posts of a flush in flight at the same time */
+#define FLB_AZURE_CONCURRENCY        4
+
 #include <fluent-bit/flb_info.h>
 #include <fluent-bit/flb_output.h>
 #include <fluent-bit/flb_sds.h>
+#include <mbedtls/md.h>
 
 struct flb_azure {
     /* account setup */
@@ -37,6 +44,8 @@ struct flb_azure {
     flb_sds_t log_type;
     flb_sds_t shared_key;
     flb_sds_t dec_shared_key;
+    flb_sds_t auth_prefix;          /* 'SharedKey <customer_id>:' */
+    mbedtls_md_context_t hmac;      /* HMAC-SHA256 keyed with the shared key */
 
     /* networking */
     int port;
@@ -45,9 +54,20 @@ struct flb_azure {
 
     /* records */
     flb_sds_t time_key;
+    size_t payload_max;
 
     /* Upstream connection to the backend server */
     struct flb_upstream *u;
 };
 
+/* One post of a flush, its payload is a range of the flush buffer */
+struct azure_request {
+    size_t off;
+    size_t len;
+    int records;
+    int status;
+    struct flb_upstream_conn *u_conn;
+    struct flb_http_client *c;
+};
+
 #endif
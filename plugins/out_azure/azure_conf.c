@@ -20,6 +20,7 @@
 #include "azure.h"
 #include "azure_conf.h"
 
+#include <fluent-bit/flb_utils.h>
 #include <mbedtls/base64.h>
 
 struct flb_azure *flb_azure_conf_create(struct flb_output_instance *ins,
@@ -28,6 +29,7 @@ struct flb_azure *flb_azure_conf_create(struct flb_output_instance *ins,
     int ret;
     size_t size;
     size_t olen;
+    ssize_t bytes;
     char *tmp;
     char *cid = NULL;
     struct flb_upstream *upstream;
@@ -81,6 +83,21 @@ struct flb_azure *flb_azure_conf_create(struct flb_output_instance *ins,
     }
     flb_sds_len_set(ctx->dec_shared_key, olen);
 
+    /* The keyed HMAC state is reused by every signature */
+    mbedtls_md_init(&ctx->hmac);
+    ret = mbedtls_md_setup(&ctx->hmac,
+                           mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 1);
+    if (ret == 0) {
+        ret = mbedtls_md_hmac_starts(&ctx->hmac,
+                                     (unsigned char *) ctx->dec_shared_key,
+                                     olen);
+    }
+    if (ret != 0) {
+        flb_error("[out_azure] cannot initialize the signature context");
+        flb_azure_conf_destroy(ctx);
+        return NULL;
+    }
+
     /* config: 'log_type' */
     tmp = flb_output_get_property("log_type", ins);
     if (tmp) {
@@ -107,6 +124,20 @@ struct flb_azure *flb_azure_conf_create(struct flb_output_instance *ins,
         return NULL;
     }
 
+    /* config: 'max_payload_size' */
+    ctx->payload_max = FLB_AZURE_PAYLOAD_MAX;
+    tmp = flb_output_get_property("max_payload_size", ins);
+    if (tmp) {
+        bytes = flb_utils_size_to_bytes(tmp);
+        if (bytes <= 0 || bytes > FLB_AZURE_PAYLOAD_MAX) {
+            flb_warn("[out_azure] invalid max_payload_size=%s, using %i",
+                     tmp, FLB_AZURE_PAYLOAD_MAX);
+        }
+        else {
+            ctx->payload_max = bytes;
+        }
+    }
+
     /* Validate hostname given by command line or 'Host' property */
     if (!ins->host.name && !cid) {
         flb_error("[out_azure] property 'customer_id' is not defined");
@@ -134,6 +165,18 @@ struct flb_azure *flb_azure_conf_create(struct flb_output_instance *ins,
         }
     }
 
+    /* Authorization header up to the signature */
+    ctx->auth_prefix = flb_sds_create_size(32 + flb_sds_len(ctx->customer_id));
+    if (!ctx->auth_prefix) {
+        flb_errno();
+        flb_azure_conf_destroy(ctx);
+        return NULL;
+    }
+    flb_sds_cat(ctx->auth_prefix, "SharedKey ", 10);
+    flb_sds_cat(ctx->auth_prefix, ctx->customer_id,
+                flb_sds_len(ctx->customer_id));
+    flb_sds_cat(ctx->auth_prefix, ":", 1);
+
     /* Compose real host */
     ctx->host = flb_sds_create_size(256);
     if (!ctx->host) {
@@ -179,6 +222,7 @@ struct flb_azure *flb_azure_conf_create(struct flb_output_instance *ins,
         return NULL;
     }
     ctx->u = upstream;
+    flb_output_upstream_set(ctx->u, ins);
 
     /* Compose uri */
     ctx->uri = flb_sds_create_size(1024);
@@ -213,6 +257,10 @@ int flb_azure_conf_destroy(struct flb_azure *ctx)
     if (ctx->shared_key) {
         flb_sds_destroy(ctx->shared_key);
     }
+    if (ctx->auth_prefix) {
+        flb_sds_destroy(ctx->auth_prefix);
+    }
+    mbedtls_md_free(&ctx->hmac);
     if (ctx->log_type) {
         flb_sds_destroy(ctx->log_type);
     }
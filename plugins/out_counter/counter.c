@@ -98,5 +98,5 @@ struct flb_output_plugin out_counter_plugin = {
     .cb_init      = cb_counter_init,
     .cb_flush     = cb_counter_flush,
     .cb_exit      = cb_counter_exit,
-    .flags        = 0,
+    .flags        = FLB_OUTPUT_SHARDS,
 };
@@ -24,6 +24,8 @@
 #include <fluent-bit/flb_http_client.h>
 #include <fluent-bit/flb_pack.h>
 #include <fluent-bit/flb_time.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_compress.h>
 #include <msgpack.h>
 
 #include <time.h>
@@ -35,175 +37,110 @@
 
 struct flb_output_plugin out_es_plugin;
 
-static inline void es_pack_map_content(msgpack_packer *tmp_pck, msgpack_object map)
-{
-    int i;
-    char *ptr_key = NULL;
-    char buf_key[256];
-    msgpack_object *k;
-    msgpack_object *v;
-
-    for (i = 0; i < map.via.map.size; i++) {
-        k = &map.via.map.ptr[i].key;
-        v = &map.via.map.ptr[i].val;
-        ptr_key = NULL;
-
-        /* Store key */
-        char *key_ptr = NULL;
-        size_t key_size = 0;
-
-        if (k->type == MSGPACK_OBJECT_BIN) {
-            key_ptr  = (char *) k->via.bin.ptr;
-            key_size = k->via.bin.size;
-        }
-        else if (k->type == MSGPACK_OBJECT_STR) {
-            key_ptr  = (char *) k->via.str.ptr;
-            key_size = k->via.str.size;
-        }
-
-        if (key_size < (sizeof(buf_key) - 1)) {
-            memcpy(buf_key, key_ptr, key_size);
-            buf_key[key_size] = '\0';
-            ptr_key = buf_key;
-        }
-        else {
-            /* Long map keys have a performance penalty */
-            ptr_key = flb_malloc(key_size + 1);
-            memcpy(ptr_key, key_ptr, key_size);
-            ptr_key[key_size] = '\0';
-        }
-
-        /*
-         * Sanitize key name, Elastic Search 2.x don't allow dots
-         * in field names:
-         *
-         *   https://goo.gl/R5NMTr
-         */
-        char *p   = ptr_key;
-        char *end = ptr_key + key_size;
-        while (p != end) {
-            if (*p == '.') *p = '_';
-            p++;
-        }
-
-        /* Append the key */
-        msgpack_pack_str(tmp_pck, key_size);
-        msgpack_pack_str_body(tmp_pck, ptr_key, key_size);
-
-        /* Release temporal key if was allocated */
-        if (ptr_key && ptr_key != buf_key) {
-            flb_free(ptr_key);
-        }
-        ptr_key = NULL;
-
-        /*
-         * The value can be any data type, if it's a map we need to
-         * sanitize to avoid dots.
-         */
-        if (v->type == MSGPACK_OBJECT_MAP) {
-            msgpack_pack_map(tmp_pck, v->via.map.size);
-            es_pack_map_content(tmp_pck, *v);
-        }
-        else {
-            msgpack_pack_object(tmp_pck, *v);
-        }
-    }
-}
-
 /*
  * Convert the internal Fluent Bit data representation to the required
  * one by Elasticsearch.
  *
- * 'Sadly' this process involves to convert from Msgpack to JSON.
+ * Records are encoded as JSON straight into the bulk buffer: the buffer is
+ * sized once for the chunk and records are unpacked into a zone that is
+ * reused, so there are no allocations per record. The time string is only
+ * formatted again when the second changes, the logstash index and its
+ * action line when the day or hour of 'logstash_dateformat' changes.
+ *
+ * The documents of the chunk are appended to 'bulk'. When 'retry' is set
+ * only its pending records are encoded. If 'items' is set it gets the
+ * chunk, the position and the action line offset of every document, the
+ * list is allocated from the flush arena ('items_size' is its capacity).
  */
-static char *elasticsearch_format(void *data, size_t bytes,
-                                  char *tag, int tag_len, int *out_size,
-                                  struct flb_elasticsearch *ctx)
+static int elasticsearch_format(flb_sds_t *bulk,
+                                struct flb_output_chunk *chunk, int chunk_id,
+                                struct es_retry *retry,
+                                struct es_bulk_item **items,
+                                int *items_num, int *items_size,
+                                int *records,
+                                struct flb_arena *arena,
+                                struct flb_elasticsearch *ctx)
 {
     int ret;
+    int err;
+    int rec = 0;
+    void *data = chunk->data;
+    size_t bytes = chunk->bytes;
+    char *tag = chunk->tag;
+    int tag_len = chunk->tag_len;
+    struct es_bulk_item *tmp;
     int len;
-    int map_size;
     int index_len;
     size_t s;
     size_t off = 0;
+    size_t id_off = 0;
+    size_t doc_off;
+    size_t time_len = 0;
+    time_t last_sec = -1;
+    time_t last_bucket = -1;
     char *p;
-    char *buf;
-    char *es_index;
+    char *j_index;
     char logstash_index[256];
     char time_formatted[256];
-    char es_uuid[37];
-    msgpack_unpacked result;
+    char es_uuid[ES_BULK_ID_LEN + 1];
+    char l_index[ES_BULK_HEADER];
+    msgpack_zone *zone;
     msgpack_object root;
-    msgpack_object map;
-    msgpack_object *obj;
-    char *json_buf;
-    size_t json_size;
-    char j_index[ES_BULK_HEADER];
-    struct es_bulk *bulk;
+    msgpack_object *map;
     struct tm tm;
     struct flb_time tms;
-    msgpack_sbuffer tmp_sbuf;
-    msgpack_packer tmp_pck;
     uint16_t hash[8];
 
-    /* Iterate the original buffer and perform adjustments */
-    msgpack_unpacked_init(&result);
-
-    /* Perform some format validation */
-    ret = msgpack_unpack_next(&result, data, bytes, &off);
-    if (!ret) {
-        msgpack_unpacked_destroy(&result);
-        return NULL;
-    }
-
-    /* We 'should' get an array */
-    if (result.data.type != MSGPACK_OBJECT_ARRAY) {
-        /*
-         * If we got a different format, we assume the caller knows what he is
-         * doing, we just duplicate the content in a new buffer and cleanup.
-         */
-        msgpack_unpacked_destroy(&result);
-        return NULL;
-    }
-
-    root = result.data;
-    if (root.via.array.size == 0) {
-        return NULL;
-    }
-
-    /* Create the bulk composer */
-    bulk = es_bulk_create();
-    if (!bulk) {
-        return NULL;
+    zone = msgpack_zone_new(MSGPACK_ZONE_CHUNK_SIZE);
+    if (!zone) {
+        return -1;
     }
 
-    off = 0;
-
-    msgpack_unpacked_destroy(&result);
-    msgpack_unpacked_init(&result);
-
     if (ctx->logstash_format == FLB_TRUE) {
         memcpy(logstash_index, ctx->logstash_prefix, ctx->logstash_prefix_len);
         logstash_index[ctx->logstash_prefix_len] = '\0';
     }
 
-    /* If logstash format and id generation is disabled, pre-generate index line for all records. */
-    if (ctx->logstash_format == FLB_FALSE && ctx->generate_id == FLB_FALSE) {
-        index_len = snprintf(j_index,
-                             ES_BULK_HEADER,
-                             ES_BULK_INDEX_FMT,
-                             ctx->index, ctx->type);
-    }
+    /* Without logstash format the action line is the same for all records */
+    j_index = ctx->action;
+    index_len = ctx->action_len;
 
-    while (msgpack_unpack_next(&result, data, bytes, &off)) {
-        if (result.data.type != MSGPACK_OBJECT_ARRAY) {
-            continue;
+    while (1) {
+        ret = msgpack_unpack(data, bytes, &off, zone, &root);
+        if (ret != MSGPACK_UNPACK_SUCCESS &&
+            ret != MSGPACK_UNPACK_EXTRA_BYTES) {
+            break;
         }
 
         /* Each array must have two entries: time and record */
-        root = result.data;
-        if (root.via.array.size != 2) {
-            continue;
+        if (root.type != MSGPACK_OBJECT_ARRAY || root.via.array.size != 2 ||
+            root.via.array.ptr[1].type != MSGPACK_OBJECT_MAP ||
+            flb_time_msgpack_to_time(&tms, &root.via.array.ptr[0]) == -1) {
+            goto next;
+        }
+        map = &root.via.array.ptr[1];
+
+        if (retry && (rec >= retry->records || !retry->pending[rec])) {
+            goto next;
+        }
+
+        if (items) {
+            if (*items_num == *items_size) {
+                *items_size = *items_size ? *items_size * 2 : 64;
+                tmp = flb_arena_realloc(arena, *items,
+                                        *items_num * sizeof(struct es_bulk_item),
+                                        *items_size * sizeof(struct es_bulk_item));
+                if (!tmp) {
+                    flb_errno();
+                    msgpack_zone_free(zone);
+                    return -1;
+                }
+                *items = tmp;
+            }
+            (*items)[*items_num].chunk = chunk_id;
+            (*items)[*items_num].record = rec;
+            (*items)[*items_num].offset = flb_sds_len(*bulk);
+            (*items_num)++;
         }
 
         /*
@@ -211,118 +148,98 @@ static char *elasticsearch_format(void *data, size_t bytes,
          * milliseconds unit, not nanoseconds, so we take our nsec value and
          * change it representation.
          */
-        flb_time_pop_from_msgpack(&tms, &result, &obj);
         tms.tm.tv_nsec = (tms.tm.tv_nsec / 1000000);
 
-        map   = root.via.array.ptr[1];
-        map_size = map.via.map.size;
-
-        /* Create temporal msgpack buffer */
-        msgpack_sbuffer_init(&tmp_sbuf);
-        msgpack_packer_init(&tmp_pck, &tmp_sbuf, msgpack_sbuffer_write);
-
-        if (ctx->include_tag_key == FLB_TRUE) {
-            map_size++;
+        if (tms.tm.tv_sec != last_sec) {
+            last_sec = tms.tm.tv_sec;
+
+            /* Format the time */
+            gmtime_r(&tms.tm.tv_sec, &tm);
+            time_len = strftime(time_formatted, sizeof(time_formatted) - 8,
+                                ctx->time_key_format, &tm);
+
+            if (ctx->logstash_format == FLB_TRUE &&
+                tms.tm.tv_sec / ctx->logstash_bucket != last_bucket) {
+                last_bucket = tms.tm.tv_sec / ctx->logstash_bucket;
+
+                /* Compose Index header */
+                p = logstash_index + ctx->logstash_prefix_len;
+                *p++ = '-';
+
+                len = p - logstash_index;
+                s = strftime(p, sizeof(logstash_index) - len - 1,
+                             ctx->logstash_dateformat, &tm);
+                p += s;
+                *p++ = '\0';
+
+                index_len = snprintf(l_index, sizeof(l_index),
+                                     ctx->generate_id ?
+                                     ES_BULK_INDEX_FMT_ID : ES_BULK_INDEX_FMT,
+                                     logstash_index, ctx->type);
+                if (index_len >= sizeof(l_index)) {
+                    index_len = sizeof(l_index) - 1;
+                }
+                j_index = l_index;
+            }
         }
+        len = snprintf(time_formatted + time_len, 8,
+                       ".%03" PRIu64 "Z", (uint64_t) tms.tm.tv_nsec);
 
-        /* Set the new map size */
-        msgpack_pack_map(&tmp_pck, map_size + 1);
-
-        /* Append the time key */
-        msgpack_pack_str(&tmp_pck, ctx->time_key_len);
-        msgpack_pack_str_body(&tmp_pck, ctx->time_key, ctx->time_key_len);
-
-        /* Format the time */
-        gmtime_r(&tms.tm.tv_sec, &tm);
-        s = strftime(time_formatted, sizeof(time_formatted) - 1,
-                     ctx->time_key_format, &tm);
-        len = snprintf(time_formatted + s, sizeof(time_formatted) - 1 - s,
-                       ".%" PRIu64 "Z", (uint64_t) tms.tm.tv_nsec);
-
-        s += len;
-        msgpack_pack_str(&tmp_pck, s);
-        msgpack_pack_str_body(&tmp_pck, time_formatted, s);
-
-        es_index = ctx->index;
-        if (ctx->logstash_format == FLB_TRUE) {
-            /* Compose Index header */
-            p = logstash_index + ctx->logstash_prefix_len;
-            *p++ = '-';
-
-            len = p - logstash_index;
-            s = strftime(p, sizeof(logstash_index) - len - 1,
-                         ctx->logstash_dateformat, &tm);
-            p += s;
-            *p++ = '\0';
-            es_index = logstash_index;
-            if (ctx->generate_id == FLB_FALSE) {
-                index_len = snprintf(j_index,
-                                     ES_BULK_HEADER,
-                                     ES_BULK_INDEX_FMT,
-                                     es_index, ctx->type);
-            }
+        /* Action line, the _id placeholder is filled after the document */
+        err = es_bulk_cat(bulk, j_index, index_len);
+        if (ctx->generate_id == FLB_TRUE) {
+            id_off = flb_sds_len(*bulk);
+            err |= es_bulk_cat(bulk, "00000000-0000-0000-0000-000000000000",
+                               ES_BULK_ID_LEN);
+            err |= es_bulk_cat(bulk, ES_BULK_ID_END,
+                               sizeof(ES_BULK_ID_END) - 1);
         }
 
-        /* Tag Key */
+        /* Document: time key, tag key and the record entries */
+        doc_off = flb_sds_len(*bulk);
+        err |= es_bulk_cat(bulk, ctx->doc_time_key,
+                           flb_sds_len(ctx->doc_time_key));
+        err |= es_bulk_cat(bulk, time_formatted, time_len + len);
+        err |= es_bulk_cat(bulk, "\"", 1);
         if (ctx->include_tag_key == FLB_TRUE) {
-            msgpack_pack_str(&tmp_pck, ctx->tag_key_len);
-            msgpack_pack_str_body(&tmp_pck, ctx->tag_key, ctx->tag_key_len);
-            msgpack_pack_str(&tmp_pck, tag_len);
-            msgpack_pack_str_body(&tmp_pck, tag, tag_len);
+            err |= es_bulk_cat(bulk, ctx->doc_tag_key,
+                               flb_sds_len(ctx->doc_tag_key));
+            err |= es_bulk_cat(bulk, "\"", 1);
+            err |= flb_utils_write_str_sds(bulk, tag, tag_len);
+            err |= es_bulk_cat(bulk, "\"", 1);
         }
 
         /*
-         * The map_content routine iterate over each Key/Value pair found in
-         * the map and do some sanitization for the key names.
-         *
          * Elasticsearch have a restriction that key names cannot contain
          * a dot; if some dot is found, it's replaced with an underscore.
          */
-        es_pack_map_content(&tmp_pck, map);
+        err |= es_bulk_map_content(bulk, map, FLB_FALSE);
+        err |= es_bulk_cat(bulk, "}\n", 2);
+        if (err != 0) {
+            /* We likely ran out of memory, abort here */
+            msgpack_zone_free(zone);
+            return -1;
+        }
 
         if (ctx->generate_id == FLB_TRUE) {
-            MurmurHash3_x64_128(tmp_sbuf.data, tmp_sbuf.size, 42, hash);
+            MurmurHash3_x64_128(*bulk + doc_off,
+                                flb_sds_len(*bulk) - doc_off - 1, 42, hash);
             snprintf(es_uuid, sizeof(es_uuid), "%04x%04x-%04x-%04x-%04x-%04x%04x%04x",
                      hash[0], hash[1], hash[2], hash[3], hash[4], hash[5], hash[6], hash[7]);
-            index_len = snprintf(j_index,
-                                 ES_BULK_HEADER,
-                                 ES_BULK_INDEX_FMT_ID,
-                                 es_index, ctx->type, es_uuid);
-        }
-
-        /* Convert msgpack to JSON */
-        ret = flb_msgpack_raw_to_json_str(tmp_sbuf.data, tmp_sbuf.size,
-                                          &json_buf, &json_size);
-        msgpack_sbuffer_destroy(&tmp_sbuf);
-        if (ret != 0) {
-            msgpack_unpacked_destroy(&result);
-            es_bulk_destroy(bulk);
-            return NULL;
+            memcpy(*bulk + id_off, es_uuid, ES_BULK_ID_LEN);
         }
 
-        /* Append JSON on Index buf */
-        ret = es_bulk_append(bulk, j_index, index_len, json_buf, json_size);
-        flb_free(json_buf);
-        if (ret == -1) {
-            /* We likely ran out of memory, abort here */
-            msgpack_unpacked_destroy(&result);
-            *out_size = 0;
-            es_bulk_destroy(bulk);
-            return NULL;
+    next:
+        rec++;
+        msgpack_zone_clear(zone);
+        if (ret == MSGPACK_UNPACK_SUCCESS) {
+            break;
         }
     }
-    msgpack_unpacked_destroy(&result);
-
-    *out_size = bulk->len;
-    buf = bulk->ptr;
+    msgpack_zone_free(zone);
+    *records = rec;
 
-    /*
-     * Note: we don't destroy the bulk as we need to keep the allocated
-     * buffer with the data. Instead we just release the bulk context and
-     * return the bulk->ptr buffer
-     */
-    flb_free(bulk);
-    return buf;
+    return 0;
 }
 
 int cb_es_init(struct flb_output_instance *ins,
@@ -349,184 +266,576 @@ static int elasticsearch_error_check(struct flb_http_client *c)
 {
     int i;
     int ret;
-    int check = FLB_TRUE;
-    char *out_buf;
-    size_t off = 0;
-    size_t out_size;
-    msgpack_unpacked result;
-    msgpack_object root;
-    msgpack_object key;
-    msgpack_object val;
+    int len = 0;
+    int max;
+    char pos[ES_BULK_ERRORS_MAX * 12];
+    struct es_bulk_errors errors;
 
     /*
-     * Check if our payload is complete: there is such situations where
-     * the Elasticsearch HTTP response body is bigger than the HTTP client
-     * buffer so payload can be incomplete.
+     * The payload can be incomplete when the response body is bigger than
+     * the HTTP client buffer: the 'errors' flag comes first so the check
+     * still works, only the list of failed items may be cut.
      */
-    /* Convert JSON payload to msgpack */
-    ret = flb_pack_json(c->resp.payload, c->resp.payload_size,
-                        &out_buf, &out_size);
-    if (ret == -1) {
-        /* Is this an incomplete HTTP Request ? */
-        if (c->resp.payload_size <= 0) {
-            return FLB_TRUE;
-        }
-
-        /* Lookup error field */
-        if (strstr(c->resp.payload, "\"errors\":false,\"items\":[")) {
-            return FLB_FALSE;
-        }
+    ret = es_bulk_response(c->resp.payload, c->resp.payload_size, NULL, 0,
+                           &errors);
+    if (ret == FLB_FALSE) {
+        return FLB_FALSE;
+    }
 
-        flb_error("[out_es] could not pack/validate JSON response\n%s",
+    if (errors.failed == 0) {
+        flb_error("[out_es] bulk request failed\n%s",
                   c->resp.payload);
         return FLB_TRUE;
     }
 
-    /* Lookup error field */
-    msgpack_unpacked_init(&result);
-    ret = msgpack_unpack_next(&result, out_buf, out_size, &off);
-    if (!ret) {
-        return FLB_TRUE;
+    max = errors.failed < ES_BULK_ERRORS_MAX ? errors.failed :
+        ES_BULK_ERRORS_MAX;
+    for (i = 0; i < max; i++) {
+        len += snprintf(pos + len, sizeof(pos) - len, "%s%i",
+                        i > 0 ? "," : "", errors.positions[i]);
     }
 
-    root = result.data;
-    if (root.type != MSGPACK_OBJECT_MAP) {
-        flb_error("[out_es] unexpected payload type=%i",
-                  root.type);
-        check = FLB_TRUE;
-        goto done;
-    }
+    flb_warn("[out_es] %i of %i items failed, positions %s%s, first error: "
+             "%.*s", errors.failed, errors.items, pos,
+             errors.failed > max ? ",..." : "",
+             (int) errors.reason_len, errors.reason ? errors.reason : "");
+    return FLB_TRUE;
+}
 
-    for (i = 0; i < root.via.map.size; i++) {
-        key = root.via.map.ptr[i].key;
-        if (key.type != MSGPACK_OBJECT_STR) {
-            flb_error("[out_es] unexpected key type=%i",
-                      key.type);
-            check = FLB_TRUE;
-            goto done;
-        }
+/* Append the rejected documents to the dead letter file, as bulk lines */
+static int elasticsearch_dead_letter(struct flb_elasticsearch *ctx,
+                                     flb_sds_t bulk, struct es_request *r,
+                                     struct es_bulk_item *items)
+{
+    int i;
+    size_t end;
+    FILE *fp;
+
+    fp = fopen(ctx->dead_letter_file, "a");
+    if (!fp) {
+        flb_errno();
+        flb_error("[out_es] cannot open dead letter file %s",
+                  ctx->dead_letter_file);
+        return -1;
+    }
 
-        if (key.via.str.size != 6) {
+    for (i = 0; i < r->items; i++) {
+        if (r->state[i] != ES_BULK_ITEM_FAILED) {
             continue;
         }
+        end = (i + 1 < r->items) ? items[i + 1].offset : r->off + r->len;
+        if (fwrite(bulk + items[i].offset, end - items[i].offset, 1,
+                   fp) != 1) {
+            flb_errno();
+            fclose(fp);
+            return -1;
+        }
+    }
 
-        if (strncmp(key.via.str.ptr, "errors", 6) == 0) {
-            val = root.via.map.ptr[i].val;
-            if (val.type != MSGPACK_OBJECT_BOOLEAN) {
-                flb_error("[out_es] unexpected 'error' value type=%i",
-                          val.type);
-                check = FLB_TRUE;
-                goto done;
+    if (fclose(fp) != 0) {
+        flb_errno();
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Split the bulk buffer in requests of at most 'bulk_max_docs' documents
+ * and 'bulk_max_bytes' bytes, a single document over the limit still gets
+ * its own request. Without limits, or without the items, the whole buffer
+ * is the only request and it is set in 'single'.
+ */
+static struct es_request *elasticsearch_split(struct flb_elasticsearch *ctx,
+                                              flb_sds_t bulk,
+                                              struct es_bulk_item *items,
+                                              int items_num,
+                                              struct flb_arena *arena,
+                                              struct es_request *single,
+                                              int *reqs_num)
+{
+    int i;
+    int n;
+    int pass;
+    int docs = 0;
+    size_t size;
+    size_t len = 0;
+    struct es_request *reqs = single;
+    struct es_request *r = NULL;
+
+    memset(single, '\0', sizeof(struct es_request));
+    single->items = items_num;
+    single->len = flb_sds_len(bulk);
+    *reqs_num = 1;
+
+    if (!items || items_num == 0 ||
+        (ctx->bulk_max_bytes == 0 && ctx->bulk_max_docs == 0)) {
+        return single;
+    }
+
+    /* First pass counts the requests, the second one fills them */
+    for (pass = 0; pass < 2; pass++) {
+        n = 0;
+        for (i = 0; i < items_num; i++) {
+            size = ((i + 1 < items_num) ? items[i + 1].offset :
+                    flb_sds_len(bulk)) - items[i].offset;
+
+            if (n == 0 ||
+                (ctx->bulk_max_docs > 0 && docs == ctx->bulk_max_docs) ||
+                (ctx->bulk_max_bytes > 0 &&
+                 len + size > ctx->bulk_max_bytes)) {
+                if (pass == 1) {
+                    r = &reqs[n];
+                    memset(r, '\0', sizeof(struct es_request));
+                    r->item = i;
+                    r->off = items[i].offset;
+                }
+                n++;
+                docs = 0;
+                len = 0;
             }
+            docs++;
+            len += size;
+            if (pass == 1) {
+                r->items++;
+                r->len += size;
+            }
+        }
 
-            /* If error == false, we are OK (no errors = FLB_FALSE) */
-            if (val.via.boolean) {
-                /* there is an error */
-                check = FLB_TRUE;
-                goto done;
+        if (pass == 0) {
+            if (n == 1) {
+                return single;
             }
-            else {
-                /* no errors */
-                check = FLB_FALSE;
-                goto done;
+            reqs = flb_arena_alloc(arena, n * sizeof(struct es_request));
+            if (!reqs) {
+                return NULL;
             }
         }
     }
 
- done:
-    flb_free(out_buf);
-    msgpack_unpacked_destroy(&result);
-    return check;
+    *reqs_num = n;
+    return reqs;
 }
 
-void cb_es_flush(void *data, size_t bytes,
-                 char *tag, int tag_len,
-                 struct flb_input_instance *i_ins, void *out_context,
-                 struct flb_config *config)
+/* Compose and send a request on its own connection, without the response */
+static void elasticsearch_send(struct flb_elasticsearch *ctx,
+                               struct es_request *r, flb_sds_t bulk,
+                               struct flb_config *config)
 {
     int ret;
-    int bytes_out;
-    char *pack;
     size_t b_sent;
-    struct flb_elasticsearch *ctx = out_context;
-    struct flb_upstream_conn *u_conn;
-    struct flb_http_client *c;
-    (void) i_ins;
-    (void) tag;
-    (void) tag_len;
-
-    /* Get upstream connection */
-    u_conn = flb_upstream_conn_get(ctx->u);
-    if (!u_conn) {
-        FLB_OUTPUT_RETURN(FLB_RETRY);
+    void *body;
+    size_t body_len;
+    struct flb_upstream *u = ctx->u;
+
+    r->status = ES_REQ_RETRY;
+
+    body = bulk + r->off;
+    body_len = r->len;
+    if (ctx->compress_gzip == FLB_TRUE) {
+        if (flb_compress_gzip(config, body, body_len,
+                              &r->body, &r->body_len) == -1) {
+            flb_error("[out_es] cannot gzip the bulk request");
+            return;
+        }
+        body = r->body;
+        body_len = r->body_len;
     }
 
-    /* Convert format */
-    pack = elasticsearch_format(data, bytes, tag, tag_len, &bytes_out, ctx);
-    if (!pack) {
-        flb_upstream_conn_release(u_conn);
-        FLB_OUTPUT_RETURN(FLB_ERROR);
+    /* Get upstream connection, from the next node if there are many */
+    if (ctx->ug) {
+        r->node = flb_upstream_group_node_get(ctx->ug);
+        u = r->node->u;
+    }
+    r->u_conn = flb_upstream_conn_get(u);
+    if (!r->u_conn) {
+        return;
     }
 
     /* Compose HTTP Client request */
-    c = flb_http_client(u_conn, FLB_HTTP_POST, ctx->uri,
-                        pack, bytes_out, NULL, 0, NULL, 0);
+    r->c = flb_http_client(r->u_conn, FLB_HTTP_POST, ctx->uri,
+                           body, body_len, NULL, 0, NULL, 0);
 
-    flb_http_buffer_size(c, ctx->buffer_size);
+    flb_http_buffer_size(r->c, ctx->buffer_size);
 
-    flb_http_add_header(c, "User-Agent", 10, "Fluent-Bit", 10);
-    flb_http_add_header(c, "Content-Type", 12, "application/x-ndjson", 20);
+    flb_http_add_header(r->c, "User-Agent", 10, "Fluent-Bit", 10);
+    flb_http_add_header(r->c, "Content-Type", 12, "application/x-ndjson", 20);
+    if (r->body) {
+        flb_http_add_header(r->c, "Content-Encoding", 16, "gzip", 4);
+    }
 
     if (ctx->http_user && ctx->http_passwd) {
-        flb_http_basic_auth(c, ctx->http_user, ctx->http_passwd);
+        flb_http_basic_auth(r->c, ctx->http_user, ctx->http_passwd);
     }
 
-    ret = flb_http_do(c, &b_sent);
+    ret = flb_http_send(r->c, &b_sent);
     if (ret != 0) {
         flb_warn("[out_es] http_do=%i", ret);
-        goto retry;
+        flb_http_client_destroy(r->c);
+        r->c = NULL;
     }
-    else {
+}
+
+/* Read the response of a request and release its resources */
+static void elasticsearch_recv(struct flb_elasticsearch *ctx,
+                               struct es_request *r,
+                               struct flb_arena *arena)
+{
+    int ret = -1;
+    struct es_bulk_errors errors;
+
+    if (r->c) {
+        ret = flb_http_recv(r->c);
+        if (ret != 0) {
+            flb_warn("[out_es] http_do=%i", ret);
+        }
+    }
+    if (r->node) {
+        /* Network errors and 5xx count against the node */
+        flb_upstream_group_node_release(ctx->ug, r->node,
+                                        ret != 0 || r->c->resp.status >= 500);
+    }
+
+    if (ret == 0) {
         /* The request was issued successfully, validate the 'error' field */
-        flb_debug("[out_es] HTTP Status=%i", c->resp.status);
-        if (c->resp.status != 200) {
-            goto retry;
+        flb_debug("[out_es] HTTP Status=%i", r->c->resp.status);
+        if (r->c->resp.status == 200 && r->c->resp.payload_size > 0) {
+            /* Scan the response for the 'errors' flag */
+            if (elasticsearch_error_check(r->c) == FLB_FALSE) {
+                flb_debug("[out_es Elasticsearch response\n%s",
+                          r->c->resp.payload);
+                r->status = ES_REQ_OK;
+            }
+            else if (ctx->partial_retry == FLB_TRUE && arena) {
+                /* we got an error, keep the state of every item */
+                flb_debug("[out_es] Elasticsearch error\n%s",
+                          r->c->resp.payload);
+                r->state = flb_arena_alloc(arena, r->items);
+                if (r->state) {
+                    memset(r->state, ES_BULK_ITEM_RETRY, r->items);
+                    es_bulk_response(r->c->resp.payload,
+                                     r->c->resp.payload_size,
+                                     r->state, r->items, &errors);
+                    if (errors.items > 0) {
+                        r->status = ES_REQ_PARTIAL;
+                    }
+                }
+            }
+        }
+    }
+
+    /* Cleanup */
+    if (r->c) {
+        flb_http_client_destroy(r->c);
+    }
+    flb_free(r->body);
+    if (r->u_conn) {
+        flb_upstream_conn_release(r->u_conn);
+    }
+}
+
+/* Set the same result to all the chunks of the flush */
+static inline void elasticsearch_chunks_ret(struct flb_output_chunk *chunks,
+                                            int chunks_num, int ret)
+{
+    int i;
+
+    for (i = 0; i < chunks_num; i++) {
+        chunks[i].ret = ret;
+    }
+}
+
+/*
+ * Some requests or some of their items failed: remember which records of
+ * every chunk are still pending so its retry only sends those. Items
+ * rejected for good are dropped (or go to the dead letter file), the ones
+ * missing from a truncated response stay pending, as all the items of a
+ * request that failed. A chunk gets FLB_OK when nothing is left to retry.
+ */
+static void elasticsearch_partial(struct flb_elasticsearch *ctx,
+                                  struct flb_output_chunk *chunks,
+                                  int chunks_num,
+                                  struct es_retry **retries, int *records,
+                                  flb_sds_t bulk,
+                                  struct es_bulk_item *items, int items_num,
+                                  struct es_request *reqs, int reqs_num,
+                                  struct flb_arena *arena)
+{
+    int i;
+    int j;
+    int c;
+    int rec;
+    int state;
+    int total = 0;
+    int dropped = 0;
+    int keep_failed;
+    int *pending;
+    struct es_request *r;
+    struct es_retry *retry;
+
+    pending = flb_arena_alloc(arena, chunks_num * sizeof(int));
+    if (!pending) {
+        elasticsearch_chunks_ret(chunks, chunks_num, FLB_RETRY);
+        return;
+    }
+    memset(pending, '\0', chunks_num * sizeof(int));
+    elasticsearch_chunks_ret(chunks, chunks_num, -1);
+
+    for (i = 0; i < reqs_num; i++) {
+        r = &reqs[i];
+
+        /* If the rejected documents can't be saved they are retried instead */
+        keep_failed = FLB_FALSE;
+        if (r->status == ES_REQ_PARTIAL && ctx->dead_letter_file &&
+            elasticsearch_dead_letter(ctx, bulk, r, items + r->item) == -1) {
+            keep_failed = FLB_TRUE;
         }
 
-        if (c->resp.payload_size > 0) {
-            /*
-             * Elasticsearch payload should be JSON, we convert it to msgpack
-             * and lookup the 'error' field.
-             */
-            ret = elasticsearch_error_check(c);
-            if (ret == FLB_TRUE) {
-                /* we got an error */
-                flb_warn("[out_es] Elasticsearch error\n%s",
-                         c->resp.payload);
-                goto retry;
+        for (j = 0; j < r->items; j++) {
+            c = items[r->item + j].chunk;
+            rec = items[r->item + j].record;
+            if (r->status == ES_REQ_PARTIAL) {
+                state = r->state[j];
+            }
+            else if (r->status == ES_REQ_RETRY) {
+                state = ES_BULK_ITEM_RETRY;
             }
             else {
-                flb_debug("[out_es Elasticsearch response\n%s",
-                          c->resp.payload);
+                state = ES_BULK_ITEM_OK;
             }
+
+            retry = retries[c];
+            if (state == ES_BULK_ITEM_RETRY ||
+                (state == ES_BULK_ITEM_FAILED && keep_failed == FLB_TRUE)) {
+                /* Without a retry state the whole chunk is sent again */
+                if (!retry && chunks[c].ret == -1) {
+                    retry = es_retry_create(ctx, chunks[c].data,
+                                            chunks[c].bytes, records[c]);
+                    retries[c] = retry;
+                }
+                if (!retry) {
+                    chunks[c].ret = FLB_RETRY;
+                    continue;
+                }
+                retry->pending[rec] = FLB_TRUE;
+                pending[c]++;
+                total++;
+                continue;
+            }
+
+            if (state == ES_BULK_ITEM_FAILED) {
+                dropped++;
+            }
+            if (retry) {
+                retry->pending[rec] = FLB_FALSE;
+            }
+        }
+    }
+
+    if (dropped > 0) {
+        flb_warn("[out_es] %i rejected items %s", dropped,
+                 ctx->dead_letter_file ? "saved to the dead letter file" :
+                 "dropped");
+    }
+
+    for (c = 0; c < chunks_num; c++) {
+        if (chunks[c].ret == FLB_RETRY) {
+            continue;
         }
-        else {
-            goto retry;
+        if (pending[c] > 0) {
+            chunks[c].ret = FLB_RETRY;
+            continue;
         }
+        if (retries[c]) {
+            es_retry_destroy(ctx, retries[c]);
+            retries[c] = NULL;
+        }
+        chunks[c].ret = FLB_OK;
     }
 
-    /* Cleanup */
-    flb_http_client_destroy(c);
-    flb_free(pack);
-    flb_upstream_conn_release(u_conn);
-    FLB_OUTPUT_RETURN(FLB_OK);
-
-    /* Issue a retry */
- retry:
-    flb_http_client_destroy(c);
-    flb_free(pack);
-    flb_upstream_conn_release(u_conn);
-    FLB_OUTPUT_RETURN(FLB_RETRY);
+    if (total > 0) {
+        flb_info("[out_es] retrying %i of %i items", total, items_num);
+    }
+}
+
+/* Give back the retry entries still held by this flush */
+static void elasticsearch_retries_release(struct flb_elasticsearch *ctx,
+                                          struct es_retry **retries,
+                                          int chunks_num)
+{
+    int i;
+
+    for (i = 0; i < chunks_num; i++) {
+        if (retries[i]) {
+            es_retry_release(ctx, retries[i]);
+            retries[i] = NULL;
+        }
+    }
+}
+
+/*
+ * Compose the bulk buffer of the chunks, split it in requests and send
+ * them. Every chunk gets its own result.
+ */
+static void elasticsearch_flush(struct flb_elasticsearch *ctx,
+                                struct flb_output_chunk *chunks,
+                                int chunks_num,
+                                struct flb_config *config)
+{
+    int i;
+    int j;
+    int n;
+    int ret;
+    int failed = FLB_FALSE;
+    int records_single = 0;
+    int items_num = 0;
+    int items_size = 0;
+    int reqs_num;
+    int *records = &records_single;
+    size_t size = 0;
+    flb_sds_t pack;
+    struct es_request single;
+    struct es_request *reqs;
+    struct es_retry *retry_single = NULL;
+    struct es_retry **retries = &retry_single;
+    struct es_bulk_item *items = NULL;
+    struct flb_arena *arena = NULL;
+
+    /*
+     * The items are needed to split the chunk and to retry only what
+     * failed. Without an arena a failure retries the whole chunk.
+     */
+    if (ctx->partial_retry == FLB_TRUE ||
+        ctx->bulk_max_bytes > 0 || ctx->bulk_max_docs > 0 ||
+        chunks_num > 1) {
+        arena = flb_output_arena();
+    }
+
+    /* The state of every chunk of a coalesced flush */
+    if (chunks_num > 1) {
+        retries = flb_arena_alloc(arena, chunks_num * sizeof(void *));
+        records = flb_arena_alloc(arena, chunks_num * sizeof(int));
+        if (!retries || !records) {
+            elasticsearch_chunks_ret(chunks, chunks_num, FLB_RETRY);
+            return;
+        }
+    }
+
+    for (i = 0; i < chunks_num; i++) {
+        size += chunks[i].bytes;
+        records[i] = 0;
+        retries[i] = NULL;
+
+        /* A chunk with a partial failure only sends its pending records */
+        if (ctx->partial_retry == FLB_TRUE) {
+            retries[i] = es_retry_lookup(ctx, chunks[i].data,
+                                         chunks[i].bytes);
+        }
+    }
+
+    /* JSON documents plus their action lines are rarely over twice the chunk */
+    pack = es_bulk_create(size * 2 + ES_BULK_CHUNK);
+    if (!pack) {
+        elasticsearch_retries_release(ctx, retries, chunks_num);
+        elasticsearch_chunks_ret(chunks, chunks_num, FLB_ERROR);
+        return;
+    }
+
+    /* Convert format */
+    for (i = 0; i < chunks_num; i++) {
+        ret = elasticsearch_format(&pack, &chunks[i], i, retries[i],
+                                   arena ? &items : NULL,
+                                   &items_num, &items_size, &records[i],
+                                   arena, ctx);
+        if (ret == -1) {
+            break;
+        }
+    }
+    if (ret == -1 || flb_sds_len(pack) == 0) {
+        es_bulk_destroy(pack);
+        elasticsearch_retries_release(ctx, retries, chunks_num);
+        elasticsearch_chunks_ret(chunks, chunks_num, FLB_ERROR);
+        return;
+    }
+
+    reqs = elasticsearch_split(ctx, pack, items, items_num, arena,
+                               &single, &reqs_num);
+    if (!reqs) {
+        es_bulk_destroy(pack);
+        elasticsearch_retries_release(ctx, retries, chunks_num);
+        elasticsearch_chunks_ret(chunks, chunks_num, FLB_RETRY);
+        return;
+    }
+
+    /*
+     * Requests go by groups of 'bulk_concurrency': all of them are sent
+     * before reading any response, so the server indexes them at once.
+     */
+    for (i = 0; i < reqs_num; i += ctx->bulk_concurrency) {
+        n = reqs_num - i;
+        if (n > ctx->bulk_concurrency) {
+            n = ctx->bulk_concurrency;
+        }
+        for (j = 0; j < n; j++) {
+            elasticsearch_send(ctx, &reqs[i + j], pack, config);
+        }
+        for (j = 0; j < n; j++) {
+            elasticsearch_recv(ctx, &reqs[i + j], arena);
+            if (reqs[i + j].status != ES_REQ_OK) {
+                failed = FLB_TRUE;
+            }
+        }
+    }
+
+    if (failed == FLB_FALSE) {
+        for (i = 0; i < chunks_num; i++) {
+            if (retries[i]) {
+                es_retry_destroy(ctx, retries[i]);
+                retries[i] = NULL;
+            }
+        }
+        elasticsearch_chunks_ret(chunks, chunks_num, FLB_OK);
+    }
+    else if (ctx->partial_retry == FLB_TRUE && items) {
+        elasticsearch_partial(ctx, chunks, chunks_num, retries, records,
+                              pack, items, items_num, reqs, reqs_num, arena);
+    }
+    else {
+        /* Issue a retry */
+        elasticsearch_chunks_ret(chunks, chunks_num, FLB_RETRY);
+    }
+
+    elasticsearch_retries_release(ctx, retries, chunks_num);
+    es_bulk_destroy(pack);
+}
+
+void cb_es_flush(void *data, size_t bytes,
+                 char *tag, int tag_len,
+                 struct flb_input_instance *i_ins, void *out_context,
+                 struct flb_config *config)
+{
+    struct flb_output_chunk chunk;
+    struct flb_elasticsearch *ctx = out_context;
+
+    chunk.data    = data;
+    chunk.bytes   = bytes;
+    chunk.tag     = tag;
+    chunk.tag_len = tag_len;
+    chunk.i_ins   = i_ins;
+    chunk.index   = NULL;
+    chunk.ret     = -1;
+
+    elasticsearch_flush(ctx, &chunk, 1, config);
+    FLB_OUTPUT_RETURN(chunk.ret);
+}
+
+/* Coalesced flush: the chunks of several tasks share the bulk requests */
+void cb_es_flush_multi(struct flb_output_chunk *chunks, int chunks_num,
+                       void *out_context, struct flb_config *config)
+{
+    struct flb_elasticsearch *ctx = out_context;
+
+    elasticsearch_flush(ctx, chunks, chunks_num, config);
+    FLB_OUTPUT_RETURN(chunks[0].ret);
 }
 
 int cb_es_exit(void *data, struct flb_config *config)
@@ -544,8 +853,10 @@ struct flb_output_plugin out_es_plugin = {
     .cb_init        = cb_es_init,
     .cb_pre_run     = NULL,
     .cb_flush       = cb_es_flush,
+    .cb_flush_multi = cb_es_flush_multi,
     .cb_exit        = cb_es_exit,
 
     /* Plugin flags */
-    .flags          = FLB_OUTPUT_NET | FLB_IO_OPT_TLS,
+    .flags          = FLB_OUTPUT_NET | FLB_IO_OPT_TLS | FLB_OUTPUT_SHARDS |
+                      FLB_OUTPUT_HTTP2,
 };
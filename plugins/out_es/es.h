@@ -20,6 +20,12 @@
 #ifndef FLB_OUT_ES_H
 #define FLB_OUT_ES_H
 
+#include <fluent-bit/flb_sds.h>
+#include <fluent-bit/flb_upstream_group.h>
+
+#include "es_bulk.h"
+#include "es_retry.h"
+
 #define FLB_ES_DEFAULT_HOST       "127.0.0.1"
 #define FLB_ES_DEFAULT_PORT       92000
 #define FLB_ES_DEFAULT_INDEX      "fluent-bit"
@@ -29,6 +35,7 @@
 #define FLB_ES_DEFAULT_TIME_KEY   "@timestamp"
 #define FLB_ES_DEFAULT_TIME_KEYF  "%Y-%m-%dT%H:%M:%S"
 #define FLB_ES_DEFAULT_TAG_KEY    "_flb-key"
+#define FLB_ES_DEFAULT_BULK_CONC  4
 
 struct flb_elasticsearch {
     /* Elasticsearch index (database) and type (table) */
@@ -41,6 +48,7 @@ struct flb_elasticsearch {
 
     /* HTTP Client Setup */
     size_t buffer_size;
+    int compress_gzip;
 
     /*
      * Logstash compatibility options
@@ -59,6 +67,9 @@ struct flb_elasticsearch {
     int logstash_dateformat_len;
     char *logstash_dateformat;
 
+    /* seconds the formatted date lasts: a day, an hour or 1 (unknown) */
+    int logstash_bucket;
+
     /* time key */
     int time_key_len;
     char *time_key;
@@ -75,8 +86,56 @@ struct flb_elasticsearch {
     /* Elasticsearch HTTP API */
     char uri[256];
 
-    /* Upstream connection to the backend server */
+    /*
+     * Bulk templates, composed at init: the action line when the index is
+     * fixed, and the start of every document up to the time value.
+     */
+    int action_len;
+    char action[ES_BULK_HEADER];
+    flb_sds_t doc_time_key;
+    flb_sds_t doc_tag_key;
+
+    /*
+     * Partial failures: only the rejected records of a chunk are retried,
+     * the ones that will never succeed go to the dead letter file if set.
+     */
+    int partial_retry;
+    char *dead_letter_file;
+    int retries_count;
+    struct mk_list retries;
+    pthread_mutex_t retries_lock;
+
+    /*
+     * Bulk limits: a bigger chunk is split in several requests, sent at the
+     * same time on 'bulk_concurrency' connections. Zero means no limit.
+     */
+    size_t bulk_max_bytes;
+    int bulk_max_docs;
+    int bulk_concurrency;
+
+    /* Upstream connection to the backend server, or the group of nodes */
     struct flb_upstream *u;
+    struct flb_upstream_group *ug;
+};
+
+/* Outcome of a bulk request */
+#define ES_REQ_OK        0
+#define ES_REQ_RETRY     1      /* not indexed, all the items are retried */
+#define ES_REQ_PARTIAL   2      /* some items failed, see 'state'         */
+
+/* Request of a chunk: a range of the bulk buffer and of its items */
+struct es_request {
+    int item;                   /* first item        */
+    int items;                  /* number of items   */
+    size_t off;                 /* bulk buffer range */
+    size_t len;
+    int status;
+    char *state;                /* per item state when partial */
+    void *body;                 /* gzip body or NULL */
+    size_t body_len;
+    struct flb_upstream_node *node;
+    struct flb_upstream_conn *u_conn;
+    struct flb_http_client *c;
 };
 
 #endif
@@ -17,73 +17,365 @@
  *  limitations under the License.
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <fluent-bit.h>
+#include <fluent-bit/flb_pack.h>
 #include "es_bulk.h"
 
-struct es_bulk *es_bulk_create()
+flb_sds_t es_bulk_create(size_t size)
 {
-    struct es_bulk *b;
+    return flb_sds_create_size(size);
+}
+
+void es_bulk_destroy(flb_sds_t bulk)
+{
+    flb_sds_destroy(bulk);
+}
+
+/*
+ * Append a map key. Elasticsearch 2.x don't allow dots in field names,
+ * they are replaced with an underscore:
+ *
+ *   https://goo.gl/R5NMTr
+ */
+static inline int es_bulk_key(flb_sds_t *bulk, msgpack_object *k)
+{
+    size_t i;
+    size_t off;
+    size_t len = 0;
+    char *str = NULL;
+    flb_sds_t buf;
 
-    b = flb_malloc(sizeof(struct es_bulk));
-    if (!b) {
-        perror("calloc");
-        return NULL;
+    if (k->type == MSGPACK_OBJECT_STR) {
+        str = (char *) k->via.str.ptr;
+        len = k->via.str.size;
+    }
+    else if (k->type == MSGPACK_OBJECT_BIN) {
+        str = (char *) k->via.bin.ptr;
+        len = k->via.bin.size;
+    }
+
+    if (es_bulk_cat(bulk, "\"", 1) == -1) {
+        return -1;
     }
 
-    b->ptr = flb_malloc(ES_BULK_CHUNK);
-    if (!b->ptr) {
-        perror("malloc");
-        flb_free(b);
-        return NULL;
+    off = flb_sds_len(*bulk);
+    if (len > 0 && flb_utils_write_str_sds(bulk, str, len) == -1) {
+        return -1;
+    }
+
+    /* escaping never produce a dot, fix the key in place */
+    buf = *bulk;
+    for (i = off; i < flb_sds_len(buf); i++) {
+        if (buf[i] == '.') {
+            buf[i] = '_';
+        }
+    }
+
+    return es_bulk_cat(bulk, "\":", 2);
+}
+
+/*
+ * Append the entries of a map as JSON, 'first' tells if the first entry
+ * starts the object (no separator). Map values are sanitized as well.
+ */
+int es_bulk_map_content(flb_sds_t *bulk, msgpack_object *map, int first)
+{
+    uint32_t i;
+    msgpack_object *v;
+
+    for (i = 0; i < map->via.map.size; i++) {
+        if ((i > 0 || first == FLB_FALSE) && es_bulk_cat(bulk, ", ", 2) == -1) {
+            return -1;
+        }
+
+        if (es_bulk_key(bulk, &map->via.map.ptr[i].key) == -1) {
+            return -1;
+        }
+
+        v = &map->via.map.ptr[i].val;
+        if (v->type == MSGPACK_OBJECT_MAP) {
+            if (es_bulk_cat(bulk, "{", 1) == -1 ||
+                es_bulk_map_content(bulk, v, FLB_TRUE) == -1 ||
+                es_bulk_cat(bulk, "}", 1) == -1) {
+                return -1;
+            }
+        }
+        else if (flb_msgpack_to_json_sds(bulk, v) == -1) {
+            return -1;
+        }
     }
 
-    b->size = ES_BULK_CHUNK;
-    b->len  = 0;
+    return 0;
+}
+
+/*
+ * Bulk response scanner
+ * ---------------------
+ * A bulk response looks like:
+ *
+ *   {"took":30,"errors":false,"items":[{"index":{...,"status":201}}, ...]}
+ *
+ * On success only the 'errors' value is needed, it's read from the first
+ * bytes of the response. Otherwise the response is walked once without
+ * building any object, skipping the values that are not needed and
+ * collecting the items whose status is not 2xx. When a state array is
+ * given, every item seen gets its ES_BULK_ITEM_* state.
+ */
+
+#define ES_BULK_PREFIX     "\"errors\":"
+#define ES_BULK_PREFIX_MAX 128
 
-    return b;
+struct es_scan {
+    const char *p;
+    const char *end;
+};
+
+static inline void scan_ws(struct es_scan *s)
+{
+    while (s->p < s->end &&
+           (*s->p == ' ' || *s->p == '\t' || *s->p == '\r' || *s->p == '\n')) {
+        s->p++;
+    }
 }
 
-void es_bulk_destroy(struct es_bulk *bulk)
+static inline int scan_char(struct es_scan *s, char c)
 {
-    if (bulk->size > 0) {
-        flb_free(bulk->ptr);
+    scan_ws(s);
+    if (s->p < s->end && *s->p == c) {
+        s->p++;
+        return 0;
     }
-    flb_free(bulk);
+    return -1;
 }
 
-int es_bulk_append(struct es_bulk *bulk, char *index, int i_len,
-                   char *json, size_t j_len)
+/* String body as it is, escape sequences are skipped but not decoded */
+static int scan_string(struct es_scan *s, const char **str, size_t *len)
 {
-    int available;
-    int new_size;
-    int required;
-    char *ptr;
-
-    required = j_len + ES_BULK_HEADER + 1;
-    available = (bulk->size - bulk->len);
-
-    if (available < required) {
-        new_size = bulk->size + available + required + ES_BULK_CHUNK;
-        ptr = flb_realloc(bulk->ptr, new_size);
-        if (!ptr) {
-            perror("realloc");
+    const char *start;
+
+    if (scan_char(s, '"') == -1) {
+        return -1;
+    }
+
+    start = s->p;
+    while (s->p < s->end && *s->p != '"') {
+        if (*s->p == '\\') {
+            s->p++;
+        }
+        s->p++;
+    }
+    if (s->p >= s->end) {
+        return -1;
+    }
+
+    *str = start;
+    *len = s->p - start;
+    s->p++;
+    return 0;
+}
+
+/* Skip one value of any type */
+static int scan_skip(struct es_scan *s)
+{
+    int depth = 0;
+    size_t len;
+    const char *str;
+
+    scan_ws(s);
+    do {
+        if (s->p >= s->end) {
             return -1;
         }
-        bulk->ptr  = ptr;
-        bulk->size = new_size;
+
+        switch (*s->p) {
+        case '"':
+            if (scan_string(s, &str, &len) == -1) {
+                return -1;
+            }
+            continue;
+        case '{':
+        case '[':
+            depth++;
+            break;
+        case '}':
+        case ']':
+            depth--;
+            break;
+        default:
+            /* number or literal, or separators inside a container */
+            if (depth == 0) {
+                while (s->p < s->end && *s->p != ',' && *s->p != '}' &&
+                       *s->p != ']' && *s->p != ' ' && *s->p != '\n') {
+                    s->p++;
+                }
+                return 0;
+            }
+        }
+        s->p++;
+    } while (depth > 0);
+
+    return 0;
+}
+
+static inline int scan_key_is(const char *key, size_t len, const char *name)
+{
+    return (len == strlen(name) && memcmp(key, name, len) == 0);
+}
+
+/* One item: {"<action>":{..., "status":<code>, "error":{...}}} */
+static int scan_item(struct es_scan *s, struct es_bulk_errors *errors)
+{
+    int status = 0;
+    int failed = FLB_FALSE;
+    size_t len;
+    const char *key;
+    const char *start;
+
+    if (scan_char(s, '{') == -1 ||
+        scan_string(s, &key, &len) == -1 ||
+        scan_char(s, ':') == -1 ||
+        scan_char(s, '{') == -1) {
+        return -1;
     }
 
-    memcpy(bulk->ptr + bulk->len, index, i_len);
-    bulk->len += i_len;
+    while (scan_char(s, '}') == -1) {
+        scan_char(s, ',');
+        if (scan_string(s, &key, &len) == -1 || scan_char(s, ':') == -1) {
+            return -1;
+        }
+        scan_ws(s);
 
-    memcpy(bulk->ptr + bulk->len, json, j_len);
-    bulk->len += j_len;
-    bulk->ptr[bulk->len] = '\n';
-    bulk->len++;
+        start = s->p;
+        if (scan_skip(s) == -1) {
+            return -1;
+        }
+
+        if (scan_key_is(key, len, "status")) {
+            status = atoi(start);
+        }
+        else if (scan_key_is(key, len, "error")) {
+            failed = FLB_TRUE;
+            if (!errors->reason) {
+                errors->reason = start;
+                errors->reason_len = s->p - start;
+            }
+        }
+    }
+
+    if (scan_char(s, '}') == -1) {
+        return -1;
+    }
+
+    if (status >= 300) {
+        failed = FLB_TRUE;
+    }
+    if (failed == FLB_TRUE) {
+        if (errors->failed < ES_BULK_ERRORS_MAX) {
+            errors->positions[errors->failed] = errors->items;
+        }
+        errors->failed++;
+    }
+
+    if (errors->state && errors->items < errors->state_size) {
+        if (failed == FLB_FALSE) {
+            errors->state[errors->items] = ES_BULK_ITEM_OK;
+        }
+        else if (status == 429 || status >= 500) {
+            errors->state[errors->items] = ES_BULK_ITEM_RETRY;
+        }
+        else {
+            errors->state[errors->items] = ES_BULK_ITEM_FAILED;
+        }
+    }
+    errors->items++;
 
     return 0;
-};
+}
+
+static int scan_items(struct es_scan *s, struct es_bulk_errors *errors)
+{
+    if (scan_char(s, '[') == -1) {
+        return -1;
+    }
+
+    while (scan_char(s, ']') == -1) {
+        scan_char(s, ',');
+        if (scan_item(s, errors) == -1) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Check a bulk response, returns FLB_FALSE if every item succeeded. On
+ * FLB_TRUE 'errors' reports the failed items found, an incomplete or
+ * unexpected response is taken as failed.
+ */
+int es_bulk_response(const char *buf, size_t size,
+                     char *state, int state_size,
+                     struct es_bulk_errors *errors)
+{
+    int ret = FLB_TRUE;
+    size_t len;
+    const char *key;
+    const char *p;
+    struct es_scan s;
+
+    memset(errors, '\0', sizeof(struct es_bulk_errors));
+    errors->state = state;
+    errors->state_size = state_size;
+    if (!buf || size == 0) {
+        return FLB_TRUE;
+    }
+
+    /* Fast path: '"errors":false' at the start of the response */
+    len = size < ES_BULK_PREFIX_MAX ? size : ES_BULK_PREFIX_MAX;
+    p = memmem(buf, len, ES_BULK_PREFIX, sizeof(ES_BULK_PREFIX) - 1);
+    if (p) {
+        p += sizeof(ES_BULK_PREFIX) - 1;
+        if (buf + size - p >= 5 && memcmp(p, "false", 5) == 0) {
+            return FLB_FALSE;
+        }
+    }
+
+    /* Walk the top level keys */
+    s.p = buf;
+    s.end = buf + size;
+    if (scan_char(&s, '{') == -1) {
+        return FLB_TRUE;
+    }
+
+    while (scan_char(&s, '}') == -1) {
+        scan_char(&s, ',');
+        if (scan_string(&s, &key, &len) == -1 || scan_char(&s, ':') == -1) {
+            break;
+        }
+        scan_ws(&s);
+
+        if (scan_key_is(key, len, "errors")) {
+            if (s.end - s.p >= 5 && memcmp(s.p, "false", 5) == 0) {
+                return FLB_FALSE;
+            }
+            ret = FLB_TRUE;
+        }
+        else if (scan_key_is(key, len, "items")) {
+            if (scan_items(&s, errors) == -1) {
+                break;
+            }
+            continue;
+        }
+
+        if (scan_skip(&s) == -1) {
+            break;
+        }
+    }
+
+    return ret;
+}
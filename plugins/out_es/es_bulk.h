@@ -21,21 +21,69 @@
 #define FLB_OUT_ES_BULK_H
 
 #include <inttypes.h>
+#include <string.h>
+
+#include <fluent-bit/flb_sds.h>
+#include <msgpack.h>
 
 #define ES_BULK_CHUNK      4096  /* Size of buffer chunks    */
-#define ES_BULK_HEADER      128  /* ES Bulk API prefix line  */
+#define ES_BULK_HEADER      512  /* ES Bulk API prefix line  */
+#define ES_BULK_ID_LEN       36  /* generated _id length     */
 #define ES_BULK_INDEX_FMT   "{\"index\":{\"_index\":\"%s\",\"_type\":\"%s\"}}\n"
-#define ES_BULK_INDEX_FMT_ID "{\"index\":{\"_index\":\"%s\",\"_type\":\"%s\",\"_id\":\"%s\"}}\n"
 
-struct es_bulk {
-    char *ptr;
-    uint32_t len;
-    uint32_t size;
+/* Action line with an _id, the value is written once the document is known */
+#define ES_BULK_INDEX_FMT_ID "{\"index\":{\"_index\":\"%s\",\"_type\":\"%s\",\"_id\":\""
+#define ES_BULK_ID_END       "\"}}\n"
+
+/* Failed items reported from a bulk response */
+#define ES_BULK_ERRORS_MAX   16
+
+/* Item states, see es_bulk_response() */
+#define ES_BULK_ITEM_OK       0
+#define ES_BULK_ITEM_RETRY    1     /* 429 and 5xx: worth sending again */
+#define ES_BULK_ITEM_FAILED   2     /* rejected, it will fail again     */
+
+struct es_bulk_errors {
+    int items;                             /* items seen               */
+    int failed;                            /* items with an error      */
+    int positions[ES_BULK_ERRORS_MAX];     /* first failed positions   */
+    const char *reason;                    /* first error object (raw) */
+    size_t reason_len;
+    char *state;                           /* optional state per item  */
+    int state_size;
+};
+
+/* A document of the bulk request */
+struct es_bulk_item {
+    int chunk;                             /* chunk of the flush       */
+    int record;                            /* position in the chunk    */
+    size_t offset;                         /* action line offset       */
 };
 
-struct es_bulk *es_bulk_create();
-int es_bulk_append(struct es_bulk *bulk, char *index, int i_len,
-                   char *json, size_t j_len);
-void es_bulk_destroy(struct es_bulk *bulk);
+/*
+ * The bulk request is a sds buffer sized once for the whole chunk, records
+ * are encoded straight into it from their msgpack objects.
+ */
+flb_sds_t es_bulk_create(size_t size);
+void es_bulk_destroy(flb_sds_t bulk);
+int es_bulk_map_content(flb_sds_t *bulk, msgpack_object *map, int first);
+int es_bulk_response(const char *buf, size_t size,
+                     char *state, int state_size,
+                     struct es_bulk_errors *errors);
+
+static inline int es_bulk_cat(flb_sds_t *bulk, const char *str, size_t len)
+{
+    flb_sds_t buf;
+
+    buf = flb_sds_reserve(*bulk, len);
+    if (!buf) {
+        return -1;
+    }
+    memcpy(buf + flb_sds_len(buf), str, len);
+    flb_sds_len_set(buf, flb_sds_len(buf) + len);
+    *bulk = buf;
+
+    return 0;
+}
 
 #endif
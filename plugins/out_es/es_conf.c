@@ -17,6 +17,9 @@
  *  limitations under the License.
  */
 
+#include <stdlib.h>
+#include <string.h>
+
 #include <fluent-bit/flb_info.h>
 #include <fluent-bit/flb_mem.h>
 #include <fluent-bit/flb_utils.h>
@@ -25,6 +28,97 @@
 #include "es.h"
 #include "es_conf.h"
 
+/*
+ * Period the logstash date format changes with: the index name and its
+ * action line are composed once for all the records in the same period.
+ * Conversions finer than the hour, or unknown ones, give one second.
+ */
+static int es_conf_date_bucket(char *fmt)
+{
+    int bucket = 86400;
+
+    while ((fmt = strchr(fmt, '%')) != NULL) {
+        fmt++;
+        if (*fmt == 'E' || *fmt == 'O') {
+            fmt++;
+        }
+        if (*fmt == '\0') {
+            break;
+        }
+
+        if (strchr("YyCGgmbBhdejFDxaAuwUWV%", *fmt)) {
+            /* day or coarser */
+        }
+        else if (strchr("HIklp", *fmt)) {
+            bucket = 3600;
+        }
+        else {
+            return 1;
+        }
+        fmt++;
+    }
+
+    return bucket;
+}
+
+/*
+ * Compose the parts of the bulk request that are the same for every
+ * record: the action line (if the index does not depend on the record
+ * time) and the document keys added by the plugin.
+ */
+static int es_conf_templates(struct flb_elasticsearch *ctx)
+{
+    int ret;
+    flb_sds_t tmp;
+
+    if (ctx->logstash_format == FLB_FALSE) {
+        ctx->action_len = snprintf(ctx->action, sizeof(ctx->action),
+                                   ctx->generate_id ?
+                                   ES_BULK_INDEX_FMT_ID : ES_BULK_INDEX_FMT,
+                                   ctx->index, ctx->type);
+        if (ctx->action_len >= sizeof(ctx->action)) {
+            flb_error("[out_es] index and type names are too long");
+            return -1;
+        }
+    }
+
+    ctx->doc_time_key = flb_sds_create_size(ctx->time_key_len + 8);
+    if (!ctx->doc_time_key) {
+        return -1;
+    }
+    tmp = flb_sds_cat(ctx->doc_time_key, "{\"", 2);
+    ret = flb_utils_write_str_sds(&tmp, ctx->time_key, ctx->time_key_len);
+    ctx->doc_time_key = tmp;
+    if (ret == -1) {
+        return -1;
+    }
+    tmp = flb_sds_cat(ctx->doc_time_key, "\":\"", 3);
+    if (!tmp) {
+        return -1;
+    }
+    ctx->doc_time_key = tmp;
+
+    if (ctx->include_tag_key == FLB_TRUE) {
+        ctx->doc_tag_key = flb_sds_create_size(ctx->tag_key_len + 8);
+        if (!ctx->doc_tag_key) {
+            return -1;
+        }
+        tmp = flb_sds_cat(ctx->doc_tag_key, ", \"", 3);
+        ret = flb_utils_write_str_sds(&tmp, ctx->tag_key, ctx->tag_key_len);
+        ctx->doc_tag_key = tmp;
+        if (ret == -1) {
+            return -1;
+        }
+        tmp = flb_sds_cat(ctx->doc_tag_key, "\":", 2);
+        if (!tmp) {
+            return -1;
+        }
+        ctx->doc_tag_key = tmp;
+    }
+
+    return 0;
+}
+
 struct flb_elasticsearch *flb_es_conf_create(struct flb_output_instance *ins,
                                              struct flb_config *config)
 {
@@ -44,6 +138,8 @@ struct flb_elasticsearch *flb_es_conf_create(struct flb_output_instance *ins,
         flb_errno();
         return NULL;
     }
+    mk_list_init(&ctx->retries);
+    pthread_mutex_init(&ctx->retries_lock, NULL);
 
     if (uri) {
         if (uri->count >= 2) {
@@ -87,6 +183,15 @@ struct flb_elasticsearch *flb_es_conf_create(struct flb_output_instance *ins,
 
     /* Set manual Index and Type */
     ctx->u = upstream;
+    flb_output_upstream_set(ctx->u, ins);
+
+    /* Nodes of the cluster, requests are balanced between them */
+    ret = flb_output_upstream_group(ins, config, 9200, io_flags, &ins->tls,
+                                    &ctx->ug);
+    if (ret == -1) {
+        flb_es_conf_destroy(ctx);
+        return NULL;
+    }
     if (f_index) {
         ctx->index = flb_strdup(f_index->value);
     }
@@ -162,6 +267,9 @@ struct flb_elasticsearch *flb_es_conf_create(struct flb_output_instance *ins,
         ctx->logstash_dateformat = flb_strdup(FLB_ES_DEFAULT_TIME_FMT);
         ctx->logstash_dateformat_len = sizeof(FLB_ES_DEFAULT_TIME_FMT) - 1;
     }
+    if (ctx->logstash_dateformat) {
+        ctx->logstash_bucket = es_conf_date_bucket(ctx->logstash_dateformat);
+    }
 
     /* Time Key */
     tmp = flb_output_get_property("time_key", ins);
@@ -247,6 +355,67 @@ struct flb_elasticsearch *flb_es_conf_create(struct flb_output_instance *ins,
         ctx->generate_id = FLB_FALSE;
     }
 
+    /* Request compression */
+    tmp = flb_output_get_property("compress", ins);
+    if (tmp) {
+        if (strcasecmp(tmp, "gzip") == 0) {
+            ctx->compress_gzip = FLB_TRUE;
+        }
+        else {
+            flb_warn("[out_es] unknown compress=%s, sending uncompressed", tmp);
+        }
+    }
+
+    /* Partial retries */
+    tmp = flb_output_get_property("partial_retry", ins);
+    if (tmp) {
+        ctx->partial_retry = flb_utils_bool(tmp);
+    }
+    else {
+        ctx->partial_retry = FLB_TRUE;
+    }
+
+    tmp = flb_output_get_property("dead_letter_file", ins);
+    if (tmp) {
+        ctx->dead_letter_file = flb_strdup(tmp);
+    }
+
+    /* Bulk limits */
+    tmp = flb_output_get_property("bulk_max_bytes", ins);
+    if (tmp) {
+        ret = flb_utils_size_to_bytes(tmp);
+        if (ret == -1) {
+            flb_error("[out_es] invalid bulk_max_bytes=%s, no limit", tmp);
+        }
+        else {
+            ctx->bulk_max_bytes = (size_t) ret;
+        }
+    }
+
+    tmp = flb_output_get_property("bulk_max_docs", ins);
+    if (tmp) {
+        ctx->bulk_max_docs = atoi(tmp);
+        if (ctx->bulk_max_docs < 0) {
+            ctx->bulk_max_docs = 0;
+        }
+    }
+
+    ctx->bulk_concurrency = FLB_ES_DEFAULT_BULK_CONC;
+    tmp = flb_output_get_property("bulk_concurrency", ins);
+    if (tmp) {
+        ctx->bulk_concurrency = atoi(tmp);
+        if (ctx->bulk_concurrency < 1) {
+            ctx->bulk_concurrency = 1;
+        }
+    }
+
+    ret = es_conf_templates(ctx);
+    if (ret == -1) {
+        flb_error("[out_es] cannot compose bulk templates");
+        flb_es_conf_destroy(ctx);
+        return NULL;
+    }
+
     return ctx;
 }
 
@@ -267,7 +436,23 @@ int flb_es_conf_destroy(struct flb_elasticsearch *ctx)
         flb_free(ctx->tag_key);
     }
 
-    flb_upstream_destroy(ctx->u);
+    if (ctx->doc_time_key) {
+        flb_sds_destroy(ctx->doc_time_key);
+    }
+    if (ctx->doc_tag_key) {
+        flb_sds_destroy(ctx->doc_tag_key);
+    }
+
+    es_retry_destroy_all(ctx);
+    pthread_mutex_destroy(&ctx->retries_lock);
+    flb_free(ctx->dead_letter_file);
+
+    if (ctx->u) {
+        flb_upstream_destroy(ctx->u);
+    }
+    if (ctx->ug) {
+        flb_upstream_group_destroy(ctx->ug);
+    }
     flb_free(ctx);
 
     return 0;
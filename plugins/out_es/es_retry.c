@@ -0,0 +1,151 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_log.h>
+
+#include "es.h"
+#include "es_retry.h"
+#include "murmur3.h"
+
+static inline void retry_hash(void *data, size_t bytes, uint64_t *hash)
+{
+    MurmurHash3_x64_128(data, bytes, 42, hash);
+}
+
+struct es_retry *es_retry_lookup(struct flb_elasticsearch *ctx,
+                                 void *data, size_t bytes)
+{
+    int hashed = FLB_FALSE;
+    uint64_t hash[2];
+    struct mk_list *head;
+    struct es_retry *retry;
+
+    pthread_mutex_lock(&ctx->retries_lock);
+    mk_list_foreach(head, &ctx->retries) {
+        retry = mk_list_entry(head, struct es_retry, _head);
+        if (retry->busy == FLB_TRUE || retry->bytes != bytes) {
+            continue;
+        }
+
+        if (hashed == FLB_FALSE) {
+            retry_hash(data, bytes, hash);
+            hashed = FLB_TRUE;
+        }
+        if (retry->hash[0] == hash[0] && retry->hash[1] == hash[1]) {
+            retry->busy = FLB_TRUE;
+            pthread_mutex_unlock(&ctx->retries_lock);
+            return retry;
+        }
+    }
+    pthread_mutex_unlock(&ctx->retries_lock);
+
+    return NULL;
+}
+
+static void retry_free(struct flb_elasticsearch *ctx, struct es_retry *retry)
+{
+    mk_list_del(&retry->_head);
+    ctx->retries_count--;
+    flb_free(retry->pending);
+    flb_free(retry);
+}
+
+struct es_retry *es_retry_create(struct flb_elasticsearch *ctx,
+                                 void *data, size_t bytes, int records)
+{
+    struct mk_list *head;
+    struct es_retry *retry;
+    struct es_retry *oldest = NULL;
+
+    retry = flb_malloc(sizeof(struct es_retry));
+    if (!retry) {
+        flb_errno();
+        return NULL;
+    }
+
+    retry->pending = flb_calloc(1, records > 0 ? records : 1);
+    if (!retry->pending) {
+        flb_errno();
+        flb_free(retry);
+        return NULL;
+    }
+
+    retry_hash(data, bytes, retry->hash);
+    retry->bytes = bytes;
+    retry->records = records;
+    retry->busy = FLB_TRUE;
+
+    pthread_mutex_lock(&ctx->retries_lock);
+
+    /*
+     * Chunks the engine gave up on are never seen again, the oldest entry
+     * goes first. Entries held by a flush in progress are skipped: with
+     * all of them busy the chunk is sent in full the next time.
+     */
+    if (ctx->retries_count >= ES_RETRY_MAX) {
+        mk_list_foreach(head, &ctx->retries) {
+            oldest = mk_list_entry(head, struct es_retry, _head);
+            if (oldest->busy == FLB_FALSE) {
+                break;
+            }
+            oldest = NULL;
+        }
+        if (!oldest) {
+            pthread_mutex_unlock(&ctx->retries_lock);
+            flb_free(retry->pending);
+            flb_free(retry);
+            return NULL;
+        }
+        retry_free(ctx, oldest);
+    }
+
+    mk_list_add(&retry->_head, &ctx->retries);
+    ctx->retries_count++;
+    pthread_mutex_unlock(&ctx->retries_lock);
+
+    return retry;
+}
+
+void es_retry_release(struct flb_elasticsearch *ctx, struct es_retry *retry)
+{
+    pthread_mutex_lock(&ctx->retries_lock);
+    retry->busy = FLB_FALSE;
+    pthread_mutex_unlock(&ctx->retries_lock);
+}
+
+void es_retry_destroy(struct flb_elasticsearch *ctx, struct es_retry *retry)
+{
+    pthread_mutex_lock(&ctx->retries_lock);
+    retry_free(ctx, retry);
+    pthread_mutex_unlock(&ctx->retries_lock);
+}
+
+void es_retry_destroy_all(struct flb_elasticsearch *ctx)
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct es_retry *retry;
+
+    mk_list_foreach_safe(head, tmp, &ctx->retries) {
+        retry = mk_list_entry(head, struct es_retry, _head);
+        retry_free(ctx, retry);
+    }
+}
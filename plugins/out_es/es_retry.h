@@ -0,0 +1,62 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef FLB_OUT_ES_RETRY_H
+#define FLB_OUT_ES_RETRY_H
+
+#include <fluent-bit/flb_info.h>
+#include <monkey/mk_core.h>
+
+#include <inttypes.h>
+#include <pthread.h>
+
+/* Chunks with a partial failure tracked at the same time */
+#define ES_RETRY_MAX   64
+
+/*
+ * Records of a chunk still pending after a partial bulk failure. The engine
+ * retries the whole chunk, the entry is found again from its content and
+ * only the pending records are sent.
+ *
+ * Flushes run on the output workers too, so the list is guarded by the
+ * context 'retries_lock'. An entry is held by one flush at a time: lookup
+ * and create mark it busy, it is given back with es_retry_release() or
+ * freed by its holder with es_retry_destroy(). Busy entries are never
+ * evicted.
+ */
+struct es_retry {
+    uint64_t hash[2];          /* chunk content */
+    size_t bytes;
+    int records;               /* records in the chunk */
+    char *pending;             /* per record: FLB_TRUE if not indexed yet */
+    int busy;                  /* held by a flush in progress */
+    struct mk_list _head;
+};
+
+struct flb_elasticsearch;
+
+struct es_retry *es_retry_lookup(struct flb_elasticsearch *ctx,
+                                 void *data, size_t bytes);
+struct es_retry *es_retry_create(struct flb_elasticsearch *ctx,
+                                 void *data, size_t bytes, int records);
+void es_retry_release(struct flb_elasticsearch *ctx, struct es_retry *retry);
+void es_retry_destroy(struct flb_elasticsearch *ctx, struct es_retry *retry);
+void es_retry_destroy_all(struct flb_elasticsearch *ctx);
+
+#endif
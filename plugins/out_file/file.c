@@ -22,6 +22,7 @@
 #include <fluent-bit/flb_pack.h>
 #include <fluent-bit/flb_utils.h>
 #include <fluent-bit/flb_time.h>
+#include <fluent-bit/flb_scheduler.h>
 #include <msgpack.h>
 
 #include <stdio.h>
@@ -30,13 +31,8 @@
 #include <fcntl.h>
 
 #include "file.h"
-
-struct flb_file_conf {
-    char *out_file;
-    char *delimiter;
-    char *label_delimiter;
-    int  format;
-};
+#include "file_handle.h"
+#include "file_parquet.h"
 
 static char* check_delimiter(char *str)
 {
@@ -57,6 +53,17 @@ static char* check_delimiter(char *str)
     return NULL;
 }
 
+/* Write the Parquet files due for time rotation */
+static void cb_parquet_timer(struct flb_config *config, void *data)
+{
+    struct flb_file_conf *ctx = data;
+
+    flb_file_parquet_flush(ctx, FLB_FALSE);
+    if (flb_sched_timer_cb_create(config, 1000, cb_parquet_timer, ctx) != 0) {
+        /* Scheduled again by the next flush */
+        ctx->timer = FLB_FALSE;
+    }
+}
 
 static int cb_file_init(struct flb_output_instance *ins,
                         struct flb_config *config,
@@ -77,6 +84,10 @@ static int cb_file_init(struct flb_output_instance *ins,
     conf->format = FLB_OUT_FILE_FMT_JSON;/* default */
     conf->delimiter = NULL;
     conf->label_delimiter = NULL;
+    conf->max_open_files = FLB_OUT_FILE_MAX_OPEN;
+    mk_list_init(&conf->files);
+    mk_list_init(&conf->parquet);
+    pthread_mutex_init(&conf->files_lock, NULL);
 
     /* Optional output file name/path */
     tmp = flb_output_get_property("Path", ins);
@@ -95,6 +106,9 @@ static int cb_file_init(struct flb_output_instance *ins,
         conf->delimiter = "\t";
         conf->label_delimiter = ":";
     }
+    else if (tmp && !strcasecmp(tmp, "parquet")) {
+        conf->format    = FLB_OUT_FILE_FMT_PARQUET;
+    }
 
     tmp = flb_output_get_property("delimiter", ins);
     ret_str = check_delimiter(tmp);
@@ -108,6 +122,53 @@ static int cb_file_init(struct flb_output_instance *ins,
         conf->label_delimiter = ret_str;
     }
 
+    /* Optional, limit of files kept open */
+    tmp = flb_output_get_property("max_open_files", ins);
+    if (tmp && atoi(tmp) > 0) {
+        conf->max_open_files = atoi(tmp);
+    }
+
+    /* Optional, rotation */
+    tmp = flb_output_get_property("rotate_size", ins);
+    if (tmp) {
+        conf->rotate_size = flb_utils_size_to_bytes(tmp);
+        if ((ssize_t) conf->rotate_size < 0) {
+            conf->rotate_size = 0;
+        }
+    }
+
+    tmp = flb_output_get_property("rotate_time", ins);
+    if (tmp) {
+        conf->rotate_time = flb_utils_time_to_seconds(tmp);
+    }
+
+    /* Parquet: buffered records rotate with a size and a time by default */
+    if (conf->format == FLB_OUT_FILE_FMT_PARQUET) {
+        if (!flb_output_get_property("rotate_size", ins)) {
+            conf->rotate_size = FLB_OUT_FILE_PARQUET_SIZE;
+        }
+        if (!flb_output_get_property("rotate_time", ins)) {
+            conf->rotate_time = FLB_OUT_FILE_PARQUET_TIME;
+        }
+
+        conf->time_key = flb_output_get_property("time_key", ins);
+        if (!conf->time_key) {
+            conf->time_key = "time";
+        }
+
+        conf->compress = FLB_TRUE;
+        tmp = flb_output_get_property("compress", ins);
+        if (tmp && !strcasecmp(tmp, "none")) {
+            conf->compress = FLB_FALSE;
+        }
+        else if (tmp && strcasecmp(tmp, "gzip") != 0) {
+            flb_error("[out_file] unknown compress '%s'", tmp);
+            pthread_mutex_destroy(&conf->files_lock);
+            flb_free(conf);
+            return -1;
+        }
+    }
+
     /* Set the context */
     flb_output_set_context(ins, conf);
 
@@ -173,13 +234,14 @@ static void cb_file_flush(void *data, size_t bytes,
                           void *out_context,
                           struct flb_config *config)
 {
-    FILE * fp;
+    int ret = 0;
+    FILE *fp;
     msgpack_unpacked result;
     size_t off = 0;
-    size_t last_off = 0;
-    size_t alloc_size = 0;
+    size_t buf_size = 0;
     char *out_file;
-    char *buf;
+    char *buf = NULL;
+    flb_sds_t json;
     msgpack_object *obj;
     struct flb_file_conf *ctx = out_context;
     struct flb_time tm;
@@ -194,11 +256,36 @@ static void cb_file_flush(void *data, size_t bytes,
         out_file = ctx->out_file;
     }
 
-    /* Open output file with default name as the Tag */
-    fp = fopen(out_file, "a+");
+    if (ctx->format == FLB_OUT_FILE_FMT_PARQUET) {
+        /* The scheduler is not available yet when the plugin starts */
+        if (ctx->rotate_time > 0 && ctx->timer == FLB_FALSE &&
+            flb_sched_timer_cb_create(config, 1000,
+                                      cb_parquet_timer, ctx) == 0) {
+            ctx->timer = FLB_TRUE;
+        }
+        ret = flb_file_parquet_append(ctx, out_file, data, bytes);
+        if (ret == -1) {
+            FLB_OUTPUT_RETURN(FLB_RETRY);
+        }
+        FLB_OUTPUT_RETURN(FLB_OK);
+    }
+
+    /*
+     * Records are formatted in memory and the file gets them with a
+     * single write.
+     */
+    fp = open_memstream(&buf, &buf_size);
     if (fp == NULL) {
         flb_errno();
-        FLB_OUTPUT_RETURN(FLB_ERROR);
+        FLB_OUTPUT_RETURN(FLB_RETRY);
+    }
+
+    json = flb_sds_create_size_arena(flb_output_arena(), 1024);
+    if (!json) {
+        flb_errno();
+        fclose(fp);
+        free(buf);
+        FLB_OUTPUT_RETURN(FLB_RETRY);
     }
 
     /*
@@ -207,25 +294,17 @@ static void cb_file_flush(void *data, size_t bytes,
      */
     msgpack_unpacked_init(&result);
     while (msgpack_unpack_next(&result, data, bytes, &off)) {
-        alloc_size = (off - last_off) + 128; /* JSON is larger than msgpack */
-        last_off = off;
-
         flb_time_pop_from_msgpack(&tm, &result, &obj);
 
         switch (ctx->format){
         case FLB_OUT_FILE_FMT_JSON:
-            buf = flb_msgpack_to_json_str(alloc_size, obj);
-            if (buf) {
+            flb_sds_len_set(json, 0);
+            ret = flb_msgpack_to_json_sds(&json, obj);
+            if (ret == 0) {
                 fprintf(fp, "%s: [%f, %s]\n",
                         tag,
                         flb_time_to_double(&tm),
-                        buf);
-                flb_free(buf);
-            }
-            else {
-                msgpack_unpacked_destroy(&result);
-                fclose(fp);
-                FLB_OUTPUT_RETURN(FLB_RETRY);
+                        json);
             }
             break;
         case FLB_OUT_FILE_FMT_CSV:
@@ -235,10 +314,23 @@ static void cb_file_flush(void *data, size_t bytes,
             ltsv_output(fp, &tm, obj, ctx);
             break;
         }
+
+        if (ret == -1) {
+            break;
+        }
     }
     msgpack_unpacked_destroy(&result);
+    flb_sds_destroy(json);
     fclose(fp);
 
+    if (ret == 0 && buf_size > 0) {
+        ret = flb_file_handle_write(ctx, out_file, buf, buf_size);
+    }
+    free(buf);
+
+    if (ret == -1) {
+        FLB_OUTPUT_RETURN(FLB_RETRY);
+    }
     FLB_OUTPUT_RETURN(FLB_OK);
 }
 
@@ -246,6 +338,13 @@ static int cb_file_exit(void *data, struct flb_config *config)
 {
     struct flb_file_conf *ctx = data;
 
+    if (ctx->format == FLB_OUT_FILE_FMT_PARQUET) {
+        flb_sched_timer_cb_cancel(config, ctx);
+        flb_file_parquet_flush(ctx, FLB_TRUE);
+        flb_file_parquet_destroy_all(ctx);
+    }
+    flb_file_handle_destroy_all(ctx);
+    pthread_mutex_destroy(&ctx->files_lock);
     flb_free(ctx);
 
     return 0;
@@ -20,11 +20,42 @@
 #ifndef FLB_OUT_FILE
 #define FLB_OUT_FILE
 
+#include <fluent-bit/flb_info.h>
+#include <monkey/mk_core.h>
+
+#include <pthread.h>
+
+#define FLB_OUT_FILE_MAX_OPEN   64    /* default limit of open files */
+
 enum {
     FLB_OUT_FILE_FMT_JSON,
     FLB_OUT_FILE_FMT_CSV,
     FLB_OUT_FILE_FMT_LTSV,
+    FLB_OUT_FILE_FMT_PARQUET,
     FLB_OUT_FILE_FMT_OTHER,
 };
 
+struct flb_file_conf {
+    char *out_file;
+    char *delimiter;
+    char *label_delimiter;
+    int  format;
+
+    /* Rotation, zero disables it */
+    size_t rotate_size;               /* bytes */
+    int rotate_time;                  /* seconds */
+
+    /* Parquet format */
+    char *time_key;                   /* name of the timestamp column */
+    int compress;                     /* gzip compressed pages */
+    int timer;                        /* time rotation is scheduled */
+    struct mk_list parquet;           /* struct flb_file_parquet */
+
+    /* Open files cache (struct flb_file_handle) */
+    int max_open_files;
+    int open_files;
+    struct mk_list files;
+    pthread_mutex_t files_lock;
+};
+
 #endif
@@ -0,0 +1,230 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_log.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_str.h>
+
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "file.h"
+#include "file_handle.h"
+
+static void handle_close(struct flb_file_conf *ctx, struct flb_file_handle *h)
+{
+    if (h->fd != -1) {
+        close(h->fd);
+    }
+    mk_list_del(&h->_head);
+    flb_free(h->path);
+    flb_free(h);
+    ctx->open_files--;
+}
+
+static int handle_open(struct flb_file_handle *h)
+{
+    struct stat st;
+
+    h->fd = open(h->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+    if (h->fd == -1) {
+        flb_errno();
+        flb_error("[out_file] cannot open %s", h->path);
+        return -1;
+    }
+
+    if (fstat(h->fd, &st) == -1) {
+        flb_errno();
+        close(h->fd);
+        h->fd = -1;
+        return -1;
+    }
+
+    h->dev = st.st_dev;
+    h->ino = st.st_ino;
+    h->size = st.st_size;
+    h->opened = time(NULL);
+    return 0;
+}
+
+/*
+ * Get the handle of 'path', opening the file if needed. A cached handle
+ * is reopened when the path does not point to the same file anymore
+ * (removed or rotated by an external tool).
+ */
+static struct flb_file_handle *handle_get(struct flb_file_conf *ctx,
+                                          char *path)
+{
+    struct stat st;
+    struct mk_list *head;
+    struct flb_file_handle *h = NULL;
+
+    mk_list_foreach(head, &ctx->files) {
+        h = mk_list_entry(head, struct flb_file_handle, _head);
+        if (strcmp(h->path, path) == 0) {
+            break;
+        }
+        h = NULL;
+    }
+
+    if (h) {
+        if (stat(path, &st) == -1 ||
+            st.st_dev != h->dev || st.st_ino != h->ino) {
+            close(h->fd);
+            if (handle_open(h) == -1) {
+                h->fd = -1;
+                handle_close(ctx, h);
+                return NULL;
+            }
+        }
+
+        /* Most recently used last */
+        mk_list_del(&h->_head);
+        mk_list_add(&h->_head, &ctx->files);
+        return h;
+    }
+
+    h = flb_calloc(1, sizeof(struct flb_file_handle));
+    if (!h) {
+        flb_errno();
+        return NULL;
+    }
+    h->path = flb_strdup(path);
+    if (!h->path || handle_open(h) == -1) {
+        flb_free(h->path);
+        flb_free(h);
+        return NULL;
+    }
+    mk_list_add(&h->_head, &ctx->files);
+    ctx->open_files++;
+
+    /* Close the least recently used files over the limit */
+    while (ctx->open_files > ctx->max_open_files) {
+        handle_close(ctx, mk_list_entry_first(&ctx->files,
+                                              struct flb_file_handle, _head));
+    }
+
+    return h;
+}
+
+/* Move the current file aside as 'path.YYYYmmdd-HHMMSS' and start a new one */
+static int handle_rotate(struct flb_file_handle *h)
+{
+    int i;
+    int len;
+    char name[PATH_MAX];
+    struct tm tm;
+    time_t now = time(NULL);
+
+    localtime_r(&now, &tm);
+    len = snprintf(name, sizeof(name) - 8, "%s.", h->path);
+    len += strftime(name + len, sizeof(name) - 8 - len, "%Y%m%d-%H%M%S", &tm);
+
+    /* More than one rotation in the same second */
+    for (i = 1; access(name, F_OK) == 0 && i < 1000; i++) {
+        snprintf(name + len, 8, ".%i", i);
+    }
+
+    close(h->fd);
+    if (rename(h->path, name) == -1) {
+        flb_errno();
+        flb_error("[out_file] cannot rotate %s", h->path);
+    }
+    else {
+        flb_info("[out_file] rotated %s to %s", h->path, name);
+    }
+
+    return handle_open(h);
+}
+
+static int handle_needs_rotation(struct flb_file_conf *ctx,
+                                 struct flb_file_handle *h, size_t size)
+{
+    if (h->size == 0) {
+        return FLB_FALSE;
+    }
+    if (ctx->rotate_size > 0 && h->size + size > ctx->rotate_size) {
+        return FLB_TRUE;
+    }
+    if (ctx->rotate_time > 0 && time(NULL) - h->opened >= ctx->rotate_time) {
+        return FLB_TRUE;
+    }
+    return FLB_FALSE;
+}
+
+/* Append the buffer to the file of 'path', returns 0 on success */
+int flb_file_handle_write(struct flb_file_conf *ctx, char *path,
+                          char *buf, size_t size)
+{
+    ssize_t ret;
+    size_t off = 0;
+    struct flb_file_handle *h;
+
+    pthread_mutex_lock(&ctx->files_lock);
+
+    h = handle_get(ctx, path);
+    if (!h) {
+        pthread_mutex_unlock(&ctx->files_lock);
+        return -1;
+    }
+
+    if (handle_needs_rotation(ctx, h, size) == FLB_TRUE &&
+        handle_rotate(h) == -1) {
+        h->fd = -1;
+        handle_close(ctx, h);
+        pthread_mutex_unlock(&ctx->files_lock);
+        return -1;
+    }
+
+    while (off < size) {
+        ret = write(h->fd, buf + off, size - off);
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            flb_errno();
+            handle_close(ctx, h);
+            pthread_mutex_unlock(&ctx->files_lock);
+            return -1;
+        }
+        off += ret;
+    }
+    h->size += size;
+
+    pthread_mutex_unlock(&ctx->files_lock);
+    return 0;
+}
+
+void flb_file_handle_destroy_all(struct flb_file_conf *ctx)
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct flb_file_handle *h;
+
+    mk_list_foreach_safe(head, tmp, &ctx->files) {
+        h = mk_list_entry(head, struct flb_file_handle, _head);
+        handle_close(ctx, h);
+    }
+}
@@ -0,0 +1,48 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+
+#ifndef FLB_OUT_FILE_HANDLE_H
+#define FLB_OUT_FILE_HANDLE_H
+
+#include <sys/types.h>
+#include <time.h>
+
+#include "file.h"
+
+/*
+ * An output file kept open across flushes. Handles are listed by use, the
+ * most recent last; the first one is closed when the number of open files
+ * goes over the limit.
+ */
+struct flb_file_handle {
+    int fd;
+    char *path;
+    dev_t dev;                  /* identity of the file when it was opened */
+    ino_t ino;
+    off_t size;
+    time_t opened;              /* reference for time based rotation */
+    struct mk_list _head;
+};
+
+int flb_file_handle_write(struct flb_file_conf *ctx, char *path,
+                          char *buf, size_t size);
+void flb_file_handle_destroy_all(struct flb_file_conf *ctx);
+
+#endif
@@ -0,0 +1,876 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/*
+ * Parquet writer: every file holds a single row group made of one PLAIN
+ * encoded data page per column. The schema is flat, a column per key of
+ * the records map; values of mixed types are stored as strings and maps
+ * or arrays as JSON. The file metadata is serialized with the Thrift
+ * compact protocol.
+ */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_log.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_str.h>
+#include <fluent-bit/flb_sds.h>
+#include <fluent-bit/flb_pack.h>
+#include <fluent-bit/flb_time.h>
+#include <fluent-bit/flb_gzip.h>
+#include <fluent-bit/flb_version.h>
+#include <msgpack.h>
+
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "file.h"
+#include "file_parquet.h"
+
+#define PQ_MAGIC            "PAR1"
+
+/* Parquet physical types */
+#define PQ_BOOLEAN          0
+#define PQ_INT64            2
+#define PQ_DOUBLE           5
+#define PQ_BYTE_ARRAY       6
+
+/* Parquet enums */
+#define PQ_REQUIRED         0
+#define PQ_OPTIONAL         1
+#define PQ_UTF8             0
+#define PQ_TIMESTAMP_MICROS 10
+#define PQ_PLAIN            0
+#define PQ_RLE              3
+#define PQ_UNCOMPRESSED     0
+#define PQ_GZIP             2
+#define PQ_DATA_PAGE        0
+
+/* Thrift compact protocol types */
+#define TC_I32              5
+#define TC_I64              6
+#define TC_BINARY           8
+#define TC_LIST             9
+#define TC_STRUCT           12
+
+/* Inferred column types, a mix of two types promotes to the largest one */
+enum {
+    COL_NULL = 0,
+    COL_BOOL,
+    COL_INT,
+    COL_DOUBLE,
+    COL_STRING,
+};
+
+struct pq_column {
+    const char *name;           /* key, in the records buffer */
+    int name_len;
+    int type;
+    int last;                   /* last row with a value, skip duplicates */
+    char *defs;                 /* definition level of each row */
+    msgpack_sbuffer values;     /* PLAIN encoded values */
+
+    /* Column chunk, once written */
+    uint64_t offset;
+    uint64_t usize;
+    uint64_t csize;
+};
+
+struct pq_file {
+    struct flb_file_conf *ctx;
+    int rows;
+    struct pq_column time;
+    struct pq_column *cols;
+    int cols_num;
+    int cols_full;              /* keys dropped over the columns limit */
+};
+
+/* Thrift compact protocol writer */
+struct pq_thrift {
+    msgpack_sbuffer *buf;
+    int depth;
+    int last[8];                /* last field id of each nested struct */
+};
+
+static inline void buf_byte(msgpack_sbuffer *buf, int c)
+{
+    char b = c;
+
+    msgpack_sbuffer_write(buf, &b, 1);
+}
+
+static inline void buf_le32(msgpack_sbuffer *buf, uint32_t v)
+{
+    char b[4];
+
+    b[0] = v;
+    b[1] = v >> 8;
+    b[2] = v >> 16;
+    b[3] = v >> 24;
+    msgpack_sbuffer_write(buf, b, 4);
+}
+
+static inline void buf_le64(msgpack_sbuffer *buf, uint64_t v)
+{
+    buf_le32(buf, v);
+    buf_le32(buf, v >> 32);
+}
+
+static void buf_varint(msgpack_sbuffer *buf, uint64_t v)
+{
+    while (v >= 0x80) {
+        buf_byte(buf, (v & 0x7f) | 0x80);
+        v >>= 7;
+    }
+    buf_byte(buf, v);
+}
+
+static void tc_begin(struct pq_thrift *t)
+{
+    t->depth++;
+    t->last[t->depth] = 0;
+}
+
+static void tc_end(struct pq_thrift *t)
+{
+    buf_byte(t->buf, 0);
+    t->depth--;
+}
+
+static void tc_field(struct pq_thrift *t, int id, int type)
+{
+    int delta = id - t->last[t->depth];
+
+    if (delta > 0 && delta <= 15) {
+        buf_byte(t->buf, (delta << 4) | type);
+    }
+    else {
+        buf_byte(t->buf, type);
+        buf_varint(t->buf, (uint32_t) ((id << 1) ^ (id >> 31)));
+    }
+    t->last[t->depth] = id;
+}
+
+static void tc_i32(struct pq_thrift *t, int id, int32_t v)
+{
+    tc_field(t, id, TC_I32);
+    buf_varint(t->buf, (uint32_t) (((uint32_t) v << 1) ^ (v >> 31)));
+}
+
+static void tc_i64(struct pq_thrift *t, int id, int64_t v)
+{
+    tc_field(t, id, TC_I64);
+    buf_varint(t->buf, ((uint64_t) v << 1) ^ (v >> 63));
+}
+
+static void tc_binary(struct pq_thrift *t, int id, const char *s, int len)
+{
+    if (id > 0) {
+        tc_field(t, id, TC_BINARY);
+    }
+    buf_varint(t->buf, len);
+    msgpack_sbuffer_write(t->buf, s, len);
+}
+
+static void tc_list(struct pq_thrift *t, int id, int type, int size)
+{
+    tc_field(t, id, TC_LIST);
+    if (size < 15) {
+        buf_byte(t->buf, (size << 4) | type);
+    }
+    else {
+        buf_byte(t->buf, 0xf0 | type);
+        buf_varint(t->buf, size);
+    }
+}
+
+static int col_type(msgpack_object *o)
+{
+    switch (o->type) {
+    case MSGPACK_OBJECT_NIL:
+        return COL_NULL;
+    case MSGPACK_OBJECT_BOOLEAN:
+        return COL_BOOL;
+    case MSGPACK_OBJECT_POSITIVE_INTEGER:
+    case MSGPACK_OBJECT_NEGATIVE_INTEGER:
+        return COL_INT;
+    case MSGPACK_OBJECT_FLOAT32:
+    case MSGPACK_OBJECT_FLOAT64:
+        return COL_DOUBLE;
+    default:
+        return COL_STRING;
+    }
+}
+
+static int col_merge(int a, int b)
+{
+    if (a == COL_NULL || a == b) {
+        return b;
+    }
+    if (b == COL_NULL) {
+        return a;
+    }
+    if ((a == COL_INT && b == COL_DOUBLE) || (a == COL_DOUBLE && b == COL_INT)) {
+        return COL_DOUBLE;
+    }
+    return COL_STRING;
+}
+
+/*
+ * Column of the key at position 'i' of a record. Records of a stream
+ * usually share the order of their keys, so the column at the same
+ * position is tried first.
+ */
+static struct pq_column *col_get(struct pq_file *f, msgpack_object *key,
+                                 int i, int create)
+{
+    int n;
+    const char *name = key->via.str.ptr;
+    int len = key->via.str.size;
+    struct pq_column *c;
+
+    if (i < f->cols_num) {
+        c = &f->cols[i];
+        if (c->name_len == len && memcmp(c->name, name, len) == 0) {
+            return c;
+        }
+    }
+
+    for (n = 0; n < f->cols_num; n++) {
+        c = &f->cols[n];
+        if (c->name_len == len && memcmp(c->name, name, len) == 0) {
+            return c;
+        }
+    }
+
+    if (!create) {
+        return NULL;
+    }
+    if (f->cols_num == FLB_OUT_FILE_PARQUET_COLUMNS) {
+        f->cols_full = FLB_TRUE;
+        return NULL;
+    }
+
+    c = &f->cols[f->cols_num++];
+    c->name = name;
+    c->name_len = len;
+    c->type = COL_NULL;
+    c->last = -1;
+    return c;
+}
+
+static int is_time_key(struct pq_file *f, msgpack_object *key)
+{
+    size_t len = strlen(f->ctx->time_key);
+
+    return key->via.str.size == len &&
+        memcmp(key->via.str.ptr, f->ctx->time_key, len) == 0;
+}
+
+/* First pass: count the rows and infer the columns and their types */
+static void file_schema(struct pq_file *f, char *buf, size_t size)
+{
+    int i;
+    size_t off = 0;
+    msgpack_unpacked result;
+    msgpack_object *obj;
+    msgpack_object_kv *kv;
+    struct flb_time tm;
+    struct pq_column *c;
+
+    msgpack_unpacked_init(&result);
+    while (msgpack_unpack_next(&result, buf, size, &off)) {
+        if (flb_time_pop_from_msgpack(&tm, &result, &obj) != 0) {
+            continue;
+        }
+        f->rows++;
+        if (obj->type != MSGPACK_OBJECT_MAP) {
+            continue;
+        }
+
+        for (i = 0; i < obj->via.map.size; i++) {
+            kv = &obj->via.map.ptr[i];
+            if (kv->key.type != MSGPACK_OBJECT_STR || is_time_key(f, &kv->key)) {
+                continue;
+            }
+            c = col_get(f, &kv->key, i, FLB_TRUE);
+            if (c) {
+                c->type = col_merge(c->type, col_type(&kv->val));
+            }
+        }
+    }
+    msgpack_unpacked_destroy(&result);
+
+    /* Columns with null values only */
+    for (i = 0; i < f->cols_num; i++) {
+        if (f->cols[i].type == COL_NULL) {
+            f->cols[i].type = COL_STRING;
+        }
+    }
+}
+
+static void col_value(struct pq_column *c, msgpack_object *o, flb_sds_t *json)
+{
+    int ret;
+    double d;
+    uint64_t u;
+
+    switch (c->type) {
+    case COL_BOOL:
+        buf_byte(&c->values, o->via.boolean);
+        break;
+    case COL_INT:
+        buf_le64(&c->values, (uint64_t) o->via.i64);
+        break;
+    case COL_DOUBLE:
+        if (o->type == MSGPACK_OBJECT_POSITIVE_INTEGER) {
+            d = (double) o->via.u64;
+        }
+        else if (o->type == MSGPACK_OBJECT_NEGATIVE_INTEGER) {
+            d = (double) o->via.i64;
+        }
+        else {
+            d = o->via.f64;
+        }
+        memcpy(&u, &d, sizeof(u));
+        buf_le64(&c->values, u);
+        break;
+    default:
+        if (o->type == MSGPACK_OBJECT_STR || o->type == MSGPACK_OBJECT_BIN) {
+            buf_le32(&c->values, o->via.str.size);
+            msgpack_sbuffer_write(&c->values, o->via.str.ptr, o->via.str.size);
+            break;
+        }
+        flb_sds_len_set(*json, 0);
+        ret = flb_msgpack_to_json_sds(json, o);
+        if (ret != 0) {
+            flb_sds_len_set(*json, 0);
+        }
+        buf_le32(&c->values, flb_sds_len(*json));
+        msgpack_sbuffer_write(&c->values, *json, flb_sds_len(*json));
+    }
+}
+
+/* Second pass: split the records in the values of each column */
+static int file_columns(struct pq_file *f, char *buf, size_t size)
+{
+    int i;
+    int row = 0;
+    size_t off = 0;
+    flb_sds_t json;
+    msgpack_unpacked result;
+    msgpack_object *obj;
+    msgpack_object_kv *kv;
+    struct flb_time tm;
+    struct pq_column *c;
+
+    for (i = 0; i < f->cols_num; i++) {
+        f->cols[i].defs = flb_calloc(1, f->rows);
+        if (!f->cols[i].defs) {
+            flb_errno();
+            return -1;
+        }
+    }
+
+    json = flb_sds_create_size(256);
+    if (!json) {
+        return -1;
+    }
+
+    msgpack_unpacked_init(&result);
+    while (msgpack_unpack_next(&result, buf, size, &off)) {
+        if (flb_time_pop_from_msgpack(&tm, &result, &obj) != 0) {
+            continue;
+        }
+        buf_le64(&f->time.values,
+                 (uint64_t) tm.tm.tv_sec * 1000000 + tm.tm.tv_nsec / 1000);
+
+        if (obj->type == MSGPACK_OBJECT_MAP) {
+            for (i = 0; i < obj->via.map.size; i++) {
+                kv = &obj->via.map.ptr[i];
+                if (kv->key.type != MSGPACK_OBJECT_STR ||
+                    kv->val.type == MSGPACK_OBJECT_NIL) {
+                    continue;
+                }
+                c = col_get(f, &kv->key, i, FLB_FALSE);
+                if (!c || c->last == row) {
+                    continue;
+                }
+                c->last = row;
+                c->defs[row] = 1;
+                col_value(c, &kv->val, &json);
+            }
+        }
+        row++;
+    }
+    msgpack_unpacked_destroy(&result);
+    flb_sds_destroy(json);
+
+    return 0;
+}
+
+/* Definition levels, RLE runs of the hybrid encoding with bit width 1 */
+static void page_defs(msgpack_sbuffer *page, struct pq_column *c, int rows)
+{
+    int i;
+    int j;
+    size_t len_off;
+    uint32_t len;
+
+    len_off = page->size;
+    buf_le32(page, 0);
+
+    for (i = 0; i < rows; i = j) {
+        for (j = i + 1; j < rows && c->defs[j] == c->defs[i]; j++);
+        buf_varint(page, (uint64_t) (j - i) << 1);
+        buf_byte(page, c->defs[i]);
+    }
+
+    len = page->size - len_off - 4;
+    page->data[len_off] = len;
+    page->data[len_off + 1] = len >> 8;
+    page->data[len_off + 2] = len >> 16;
+    page->data[len_off + 3] = len >> 24;
+}
+
+static void page_values(msgpack_sbuffer *page, struct pq_column *c)
+{
+    size_t i;
+    int bits = 0;
+    int byte = 0;
+
+    if (c->type != COL_BOOL) {
+        msgpack_sbuffer_write(page, c->values.data, c->values.size);
+        return;
+    }
+
+    /* Booleans are bit packed, least significant bit first */
+    for (i = 0; i < c->values.size; i++) {
+        byte |= (c->values.data[i] & 1) << bits;
+        if (++bits == 8) {
+            buf_byte(page, byte);
+            bits = 0;
+            byte = 0;
+        }
+    }
+    if (bits > 0) {
+        buf_byte(page, byte);
+    }
+}
+
+/* Append the column chunk, a single data page, to the file */
+static int file_page(struct pq_file *f, struct pq_column *c,
+                     msgpack_sbuffer *out)
+{
+    int ret;
+    void *zdata = NULL;
+    size_t zsize;
+    char *data;
+    size_t size;
+    msgpack_sbuffer page;
+    msgpack_sbuffer header;
+    struct pq_thrift t = { .buf = &header, .depth = -1 };
+
+    msgpack_sbuffer_init(&page);
+    if (c != &f->time) {
+        page_defs(&page, c, f->rows);
+    }
+    page_values(&page, c);
+
+    data = page.data;
+    size = page.size;
+    if (f->ctx->compress == FLB_TRUE) {
+        ret = flb_gzip_compress(page.data, page.size, &zdata, &zsize);
+        if (ret == -1) {
+            msgpack_sbuffer_destroy(&page);
+            return -1;
+        }
+        data = zdata;
+        size = zsize;
+    }
+
+    /* PageHeader */
+    msgpack_sbuffer_init(&header);
+    tc_begin(&t);
+    tc_i32(&t, 1, PQ_DATA_PAGE);
+    tc_i32(&t, 2, page.size);
+    tc_i32(&t, 3, size);
+    tc_field(&t, 5, TC_STRUCT);
+    tc_begin(&t);
+    tc_i32(&t, 1, f->rows);
+    tc_i32(&t, 2, PQ_PLAIN);
+    tc_i32(&t, 3, PQ_RLE);
+    tc_i32(&t, 4, PQ_RLE);
+    tc_end(&t);
+    tc_end(&t);
+
+    c->offset = out->size;
+    c->usize = header.size + page.size;
+    c->csize = header.size + size;
+    msgpack_sbuffer_write(out, header.data, header.size);
+    msgpack_sbuffer_write(out, data, size);
+
+    msgpack_sbuffer_destroy(&header);
+    msgpack_sbuffer_destroy(&page);
+    flb_free(zdata);
+    return 0;
+}
+
+static int pq_type(struct pq_column *c)
+{
+    switch (c->type) {
+    case COL_BOOL:
+        return PQ_BOOLEAN;
+    case COL_INT:
+        return PQ_INT64;
+    case COL_DOUBLE:
+        return PQ_DOUBLE;
+    default:
+        return PQ_BYTE_ARRAY;
+    }
+}
+
+static void schema_element(struct pq_thrift *t, struct pq_file *f,
+                           struct pq_column *c)
+{
+    tc_begin(t);
+    tc_i32(t, 1, pq_type(c));
+    tc_i32(t, 3, c == &f->time ? PQ_REQUIRED : PQ_OPTIONAL);
+    tc_binary(t, 4, c->name, c->name_len);
+    if (c == &f->time) {
+        tc_i32(t, 6, PQ_TIMESTAMP_MICROS);
+    }
+    else if (c->type == COL_STRING) {
+        tc_i32(t, 6, PQ_UTF8);
+    }
+    tc_end(t);
+}
+
+static void column_chunk(struct pq_thrift *t, struct pq_file *f,
+                         struct pq_column *c)
+{
+    tc_begin(t);
+    tc_i64(t, 2, c->offset);
+    tc_field(t, 3, TC_STRUCT);
+
+    /* ColumnMetaData */
+    tc_begin(t);
+    tc_i32(t, 1, pq_type(c));
+    tc_list(t, 2, TC_I32, 2);
+    buf_varint(t->buf, PQ_PLAIN << 1);
+    buf_varint(t->buf, PQ_RLE << 1);
+    tc_list(t, 3, TC_BINARY, 1);
+    tc_binary(t, 0, c->name, c->name_len);
+    tc_i32(t, 4, f->ctx->compress == FLB_TRUE ? PQ_GZIP : PQ_UNCOMPRESSED);
+    tc_i64(t, 5, f->rows);
+    tc_i64(t, 6, c->usize);
+    tc_i64(t, 7, c->csize);
+    tc_i64(t, 9, c->offset);
+    tc_end(t);
+
+    tc_end(t);
+}
+
+/* FileMetaData, the footer */
+static void file_footer(struct pq_file *f, msgpack_sbuffer *out)
+{
+    int i;
+    uint64_t total;
+    size_t start = out->size;
+    struct pq_thrift t = { .buf = out, .depth = -1 };
+    static const char created_by[] = "fluent-bit version " FLB_VERSION_STR;
+
+    tc_begin(&t);
+    tc_i32(&t, 1, 1);
+
+    /* Schema, the root and its columns */
+    tc_list(&t, 2, TC_STRUCT, f->cols_num + 2);
+    tc_begin(&t);
+    tc_binary(&t, 4, "schema", 6);
+    tc_i32(&t, 5, f->cols_num + 1);
+    tc_end(&t);
+    schema_element(&t, f, &f->time);
+    for (i = 0; i < f->cols_num; i++) {
+        schema_element(&t, f, &f->cols[i]);
+    }
+
+    tc_i64(&t, 3, f->rows);
+
+    /* A single row group */
+    tc_list(&t, 4, TC_STRUCT, 1);
+    tc_begin(&t);
+    tc_list(&t, 1, TC_STRUCT, f->cols_num + 1);
+    total = f->time.usize;
+    column_chunk(&t, f, &f->time);
+    for (i = 0; i < f->cols_num; i++) {
+        column_chunk(&t, f, &f->cols[i]);
+        total += f->cols[i].usize;
+    }
+    tc_i64(&t, 2, total);
+    tc_i64(&t, 3, f->rows);
+    tc_end(&t);
+
+    tc_binary(&t, 6, created_by, sizeof(created_by) - 1);
+    tc_end(&t);
+
+    buf_le32(out, out->size - start);
+    msgpack_sbuffer_write(out, PQ_MAGIC, 4);
+}
+
+static int file_encode(struct flb_file_conf *ctx, char *buf, size_t size,
+                       msgpack_sbuffer *out)
+{
+    int i;
+    int ret = -1;
+    struct pq_file f;
+
+    memset(&f, 0, sizeof(f));
+    f.ctx = ctx;
+    f.time.name = ctx->time_key;
+    f.time.name_len = strlen(ctx->time_key);
+    f.time.type = COL_INT;
+    msgpack_sbuffer_init(&f.time.values);
+
+    f.cols = flb_calloc(FLB_OUT_FILE_PARQUET_COLUMNS, sizeof(struct pq_column));
+    if (!f.cols) {
+        flb_errno();
+        return -1;
+    }
+    for (i = 0; i < FLB_OUT_FILE_PARQUET_COLUMNS; i++) {
+        msgpack_sbuffer_init(&f.cols[i].values);
+    }
+
+    file_schema(&f, buf, size);
+    if (f.rows == 0) {
+        goto exit;
+    }
+    if (f.cols_full == FLB_TRUE) {
+        flb_warn("[out_file] over %i keys, the remaining keys are not stored",
+                 FLB_OUT_FILE_PARQUET_COLUMNS);
+    }
+
+    if (file_columns(&f, buf, size) == -1) {
+        goto exit;
+    }
+
+    msgpack_sbuffer_write(out, PQ_MAGIC, 4);
+    if (file_page(&f, &f.time, out) == -1) {
+        goto exit;
+    }
+    for (i = 0; i < f.cols_num; i++) {
+        if (file_page(&f, &f.cols[i], out) == -1) {
+            goto exit;
+        }
+    }
+    file_footer(&f, out);
+    ret = f.rows;
+
+ exit:
+    msgpack_sbuffer_destroy(&f.time.values);
+    for (i = 0; i < FLB_OUT_FILE_PARQUET_COLUMNS; i++) {
+        msgpack_sbuffer_destroy(&f.cols[i].values);
+        flb_free(f.cols[i].defs);
+    }
+    flb_free(f.cols);
+    return ret;
+}
+
+/*
+ * Write the data to 'path.YYYYmmdd-HHMMSS.parquet'. The file is written
+ * under a temporary name and renamed once complete, readers never see a
+ * partial file.
+ */
+static int file_store(struct flb_file_parquet *p, char *data, size_t size)
+{
+    int i;
+    int fd;
+    int len;
+    ssize_t ret;
+    size_t off = 0;
+    char name[PATH_MAX];
+    char tmp[PATH_MAX + 4];
+    struct tm tm;
+
+    localtime_r(&p->started, &tm);
+    len = snprintf(name, sizeof(name) - 16, "%s.", p->path);
+    len += strftime(name + len, sizeof(name) - 16 - len, "%Y%m%d-%H%M%S", &tm);
+    snprintf(name + len, 16, ".parquet");
+
+    /* More than one file in the same second */
+    for (i = 1; access(name, F_OK) == 0 && i < 1000; i++) {
+        snprintf(name + len, 16, ".%i.parquet", i);
+    }
+    snprintf(tmp, sizeof(tmp), "%s.tmp", name);
+
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd == -1) {
+        flb_errno();
+        flb_error("[out_file] cannot open %s", tmp);
+        return -1;
+    }
+
+    while (off < size) {
+        ret = write(fd, data + off, size - off);
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            flb_errno();
+            close(fd);
+            unlink(tmp);
+            return -1;
+        }
+        off += ret;
+    }
+
+    if (fsync(fd) == -1 || close(fd) == -1 || rename(tmp, name) == -1) {
+        flb_errno();
+        flb_error("[out_file] cannot write %s", name);
+        unlink(tmp);
+        return -1;
+    }
+
+    flb_debug("[out_file] wrote %s (%lu bytes)", name, size);
+    return 0;
+}
+
+/* Write the buffered records of 'p' as a Parquet file */
+static int parquet_write(struct flb_file_conf *ctx, struct flb_file_parquet *p)
+{
+    int ret;
+    msgpack_sbuffer out;
+
+    msgpack_sbuffer_init(&out);
+    ret = file_encode(ctx, p->records.data, p->records.size, &out);
+    if (ret > 0) {
+        ret = file_store(p, out.data, out.size);
+    }
+    msgpack_sbuffer_destroy(&out);
+
+    if (ret == -1) {
+        flb_error("[out_file] cannot write the Parquet file of %s, "
+                  "records are kept buffered", p->path);
+        return -1;
+    }
+
+    msgpack_sbuffer_clear(&p->records);
+    return 0;
+}
+
+static int parquet_due(struct flb_file_conf *ctx, struct flb_file_parquet *p)
+{
+    if (p->records.size == 0) {
+        return FLB_FALSE;
+    }
+    if (ctx->rotate_size > 0 && p->records.size >= ctx->rotate_size) {
+        return FLB_TRUE;
+    }
+    if (ctx->rotate_time > 0 && time(NULL) - p->started >= ctx->rotate_time) {
+        return FLB_TRUE;
+    }
+    return FLB_FALSE;
+}
+
+/* Buffer the records of a chunk for the file of 'path' */
+int flb_file_parquet_append(struct flb_file_conf *ctx, char *path,
+                            char *buf, size_t size)
+{
+    int ret = 0;
+    struct mk_list *head;
+    struct flb_file_parquet *p = NULL;
+
+    pthread_mutex_lock(&ctx->files_lock);
+
+    mk_list_foreach(head, &ctx->parquet) {
+        p = mk_list_entry(head, struct flb_file_parquet, _head);
+        if (strcmp(p->path, path) == 0) {
+            break;
+        }
+        p = NULL;
+    }
+
+    if (!p) {
+        p = flb_calloc(1, sizeof(struct flb_file_parquet));
+        if (!p) {
+            flb_errno();
+            pthread_mutex_unlock(&ctx->files_lock);
+            return -1;
+        }
+        p->path = flb_strdup(path);
+        if (!p->path) {
+            flb_free(p);
+            pthread_mutex_unlock(&ctx->files_lock);
+            return -1;
+        }
+        msgpack_sbuffer_init(&p->records);
+        mk_list_add(&p->_head, &ctx->parquet);
+    }
+
+    if (p->records.size == 0) {
+        p->started = time(NULL);
+    }
+    if (msgpack_sbuffer_write(&p->records, buf, size) != 0) {
+        flb_errno();
+        ret = -1;
+    }
+    else if (parquet_due(ctx, p) == FLB_TRUE &&
+             parquet_write(ctx, p) == -1) {
+        /* Keep the buffer bounded, the chunk is retried */
+        p->records.size -= size;
+        ret = -1;
+    }
+
+    pthread_mutex_unlock(&ctx->files_lock);
+    return ret;
+}
+
+/* Write the files due for rotation, or all of them if 'force' is set */
+void flb_file_parquet_flush(struct flb_file_conf *ctx, int force)
+{
+    struct mk_list *head;
+    struct flb_file_parquet *p;
+
+    pthread_mutex_lock(&ctx->files_lock);
+    mk_list_foreach(head, &ctx->parquet) {
+        p = mk_list_entry(head, struct flb_file_parquet, _head);
+        if (parquet_due(ctx, p) == FLB_TRUE ||
+            (force == FLB_TRUE && p->records.size > 0)) {
+            parquet_write(ctx, p);
+        }
+    }
+    pthread_mutex_unlock(&ctx->files_lock);
+}
+
+void flb_file_parquet_destroy_all(struct flb_file_conf *ctx)
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct flb_file_parquet *p;
+
+    mk_list_foreach_safe(head, tmp, &ctx->parquet) {
+        p = mk_list_entry(head, struct flb_file_parquet, _head);
+        mk_list_del(&p->_head);
+        msgpack_sbuffer_destroy(&p->records);
+        flb_free(p->path);
+        flb_free(p);
+    }
+}
@@ -0,0 +1,52 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef FLB_OUT_FILE_PARQUET_H
+#define FLB_OUT_FILE_PARQUET_H
+
+#include <msgpack.h>
+#include <time.h>
+
+#include "file.h"
+
+/* Defaults of the rotation of Parquet files */
+#define FLB_OUT_FILE_PARQUET_SIZE     (16 * 1024 * 1024)  /* buffered bytes */
+#define FLB_OUT_FILE_PARQUET_TIME     600                 /* seconds */
+
+/* Columns inferred per file, the keys beyond the limit are not stored */
+#define FLB_OUT_FILE_PARQUET_COLUMNS  256
+
+/*
+ * Records buffered for a Parquet file. A Parquet file cannot be appended,
+ * so the records of a path are kept as received until the file is written
+ * in one go, with the schema inferred from all of them.
+ */
+struct flb_file_parquet {
+    char *path;
+    msgpack_sbuffer records;    /* buffered chunks */
+    time_t started;             /* first record buffered */
+    struct mk_list _head;
+};
+
+int flb_file_parquet_append(struct flb_file_conf *ctx, char *path,
+                            char *buf, size_t size);
+void flb_file_parquet_flush(struct flb_file_conf *ctx, int force);
+void flb_file_parquet_destroy_all(struct flb_file_conf *ctx);
+
+#endif
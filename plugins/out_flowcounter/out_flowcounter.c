@@ -246,5 +246,5 @@ struct flb_output_plugin out_flowcounter_plugin = {
     .cb_init      = out_fcount_init,
     .cb_flush     = out_fcount_flush,
     .cb_exit      = out_fcount_exit,
-    .flags        = 0,
+    .flags        = FLB_OUTPUT_SHARDS,
 };
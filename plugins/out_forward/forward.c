@@ -22,12 +22,18 @@
 #include <fluent-bit/flb_utils.h>
 #include <fluent-bit/flb_network.h>
 #include <fluent-bit/flb_time.h>
+#include <fluent-bit/flb_gzip.h>
+#include <fluent-bit/flb_mp.h>
 #include <msgpack.h>
 
 #include "forward.h"
+#include "forward_ack.h"
+#include "forward_memfd.h"
 
 struct flb_output_plugin out_forward_plugin;
 
+int cb_forward_exit(void *data, struct flb_config *config);
+
 #define SECURED_BY "Fluent Bit"
 
 #ifdef FLB_HAVE_TLS
@@ -62,11 +68,9 @@ static inline void print_msgpack_status(int ret, char *context)
     }
 }
 
-#ifdef FLB_HAVE_TLS
-
-/* Read a secure forward msgpack message */
-static int secure_forward_read(struct flb_upstream_conn *u_conn,
-                               char *buf, size_t size, size_t *out_len)
+/* Read a msgpack message: a handshake step or an ack response */
+static int forward_read(struct flb_upstream_conn *u_conn,
+                        char *buf, size_t size, size_t *out_len)
 {
     int ret;
     size_t off;
@@ -96,8 +100,11 @@ static int secure_forward_read(struct flb_upstream_conn *u_conn,
             msgpack_unpacked_destroy(&result);
             *out_len = buf_off;
             return 0;
+        case MSGPACK_UNPACK_CONTINUE:
+            /* Incomplete message, keep reading */
+            break;
         default:
-            print_msgpack_status(ret, "handshake");
+            print_msgpack_status(ret, "response");
             goto error;
         };
     }
@@ -107,6 +114,8 @@ static int secure_forward_read(struct flb_upstream_conn *u_conn,
     return -1;
 }
 
+#ifdef FLB_HAVE_TLS
+
 static void secure_forward_bin_to_hex(uint8_t *buf, size_t len, char *out)
 {
     int i;
@@ -120,7 +129,7 @@ static void secure_forward_bin_to_hex(uint8_t *buf, size_t len, char *out)
 
 static int secure_forward_ping(struct flb_upstream_conn *u_conn,
                                msgpack_object map,
-                               struct flb_out_forward_config *ctx)
+                               struct flb_forward_secure *sec)
 {
     int i;
     int ret;
@@ -156,14 +165,14 @@ static int secure_forward_ping(struct flb_upstream_conn *u_conn,
     /* Compose the shared key */
     mbedtls_sha512_init(&sha512);
     mbedtls_sha512_starts(&sha512, 0);
-    mbedtls_sha512_update(&sha512, ctx->shared_key_salt, 16);
+    mbedtls_sha512_update(&sha512, sec->shared_key_salt, 16);
     mbedtls_sha512_update(&sha512,
-                          (unsigned char *) ctx->self_hostname,
-                          ctx->self_hostname_len);
+                          (unsigned char *) sec->self_hostname,
+                          sec->self_hostname_len);
     mbedtls_sha512_update(&sha512,
                           nonce_data, nonce_size);
-    mbedtls_sha512_update(&sha512, (unsigned char *) ctx->shared_key,
-                          ctx->shared_key_len);
+    mbedtls_sha512_update(&sha512, (unsigned char *) sec->shared_key,
+                          sec->shared_key_len);
     mbedtls_sha512_finish(&sha512, shared_key);
     mbedtls_sha512_free(&sha512);
 
@@ -180,12 +189,12 @@ static int secure_forward_ping(struct flb_upstream_conn *u_conn,
     msgpack_pack_str_body(&mp_pck, "PING", 4);
 
     /* [1] Hostname */
-    msgpack_pack_str(&mp_pck, ctx->self_hostname_len);
-    msgpack_pack_str_body(&mp_pck, ctx->self_hostname, ctx->self_hostname_len);
+    msgpack_pack_str(&mp_pck, sec->self_hostname_len);
+    msgpack_pack_str_body(&mp_pck, sec->self_hostname, sec->self_hostname_len);
 
     /* [2] Shared key salt */
     msgpack_pack_str(&mp_pck, 16);
-    msgpack_pack_str_body(&mp_pck, ctx->shared_key_salt, 16);
+    msgpack_pack_str_body(&mp_pck, sec->shared_key_salt, 16);
 
     /* [3] Shared key in Hexdigest format */
     msgpack_pack_str(&mp_pck, 128);
@@ -212,7 +221,7 @@ static int secure_forward_ping(struct flb_upstream_conn *u_conn,
 }
 
 static int secure_forward_pong(char *buf, int buf_size,
-                               struct flb_out_forward_config *ctx)
+                               struct flb_forward_secure *sec)
 {
     int ret;
     char msg[32] = {};
@@ -266,7 +275,7 @@ static int secure_forward_pong(char *buf, int buf_size,
 }
 
 static int secure_forward_handshake(struct flb_upstream_conn *u_conn,
-                                    struct flb_out_forward_config *ctx)
+                                    struct flb_forward_secure *sec)
 {
     int ret;
     char buf[1024];
@@ -277,7 +286,7 @@ static int secure_forward_handshake(struct flb_upstream_conn *u_conn,
     msgpack_object o;
 
     /* Wait for server HELO */
-    ret = secure_forward_read(u_conn, buf, sizeof(buf) - 1, &out_len);
+    ret = forward_read(u_conn, buf, sizeof(buf) - 1, &out_len);
     if (ret == -1) {
         flb_error("[out_fw] handshake error expecting HELO");
         return -1;
@@ -317,7 +326,7 @@ static int secure_forward_handshake(struct flb_upstream_conn *u_conn,
 
     /* Compose and send PING message */
     o = root.via.array.ptr[1];
-    ret = secure_forward_ping(u_conn, o, ctx);
+    ret = secure_forward_ping(u_conn, o, sec);
     if (ret == -1) {
         flb_error("[out_fw] Failed PING");
         msgpack_unpacked_destroy(&result);
@@ -325,7 +334,7 @@ static int secure_forward_handshake(struct flb_upstream_conn *u_conn,
     }
 
     /* Expect a PONG */
-    ret = secure_forward_read(u_conn, buf, sizeof(buf) - 1, &out_len);
+    ret = forward_read(u_conn, buf, sizeof(buf) - 1, &out_len);
     if (ret == -1) {
         flb_error("[out_fw] handshake error expecting HELO");
         msgpack_unpacked_destroy(&result);
@@ -333,7 +342,7 @@ static int secure_forward_handshake(struct flb_upstream_conn *u_conn,
     }
 
     /* Process PONG */
-    ret = secure_forward_pong(buf, out_len, ctx);
+    ret = secure_forward_pong(buf, out_len, sec);
     if (ret == -1) {
         msgpack_unpacked_destroy(&result);
         return -1;
@@ -343,10 +352,22 @@ static int secure_forward_handshake(struct flb_upstream_conn *u_conn,
     return 0;
 }
 
-static int secure_forward_init(struct flb_out_forward_config *ctx)
+static int secure_forward_init(struct flb_out_forward_config *ctx,
+                               struct flb_forward_secure *sec)
 {
     int ret;
 
+    if (!sec->shared_key) {
+        flb_error("[out_fw] secure mode requires a shared_key");
+        return -1;
+    }
+
+    /* Every destination has its own salt from the same generator */
+    if (ctx->tls_seeded == FLB_TRUE) {
+        mbedtls_ctr_drbg_random(&ctx->tls_ctr_drbg, sec->shared_key_salt, 16);
+        return 0;
+    }
+
     /* Initialize mbedTLS entropy contexts */
     mbedtls_entropy_init(&ctx->tls_entropy);
     mbedtls_ctr_drbg_init(&ctx->tls_ctr_drbg);
@@ -361,19 +382,80 @@ static int secure_forward_init(struct flb_out_forward_config *ctx)
         return -1;
     }
 
+    ctx->tls_seeded = FLB_TRUE;
+
     /* Gernerate shared key salt */
-    mbedtls_ctr_drbg_random(&ctx->tls_ctr_drbg, ctx->shared_key_salt, 16);
+    mbedtls_ctr_drbg_random(&ctx->tls_ctr_drbg, sec->shared_key_salt, 16);
     return 0;
 }
 #endif
 
+/*
+ * Secure Forward settings of a destination. A node of an upstream file
+ * can set its own shared_key and self_hostname, the ones of the instance
+ * are used otherwise. Secure Forward is used on TLS destinations.
+ */
+static int secure_forward_set(struct flb_out_forward_config *ctx,
+                              struct flb_forward_secure *sec,
+                              struct flb_upstream *u,
+                              struct flb_upstream_node *node,
+                              struct flb_output_instance *ins)
+{
+    char *tmp;
+
+    sec->secured = (u->flags & FLB_IO_TLS) ? FLB_TRUE : FLB_FALSE;
+    if (sec->secured == FLB_FALSE) {
+        return 0;
+    }
+
+    /* Shared Key */
+    tmp = node ? flb_upstream_node_get_property("shared_key", node) : NULL;
+    if (!tmp) {
+        tmp = flb_output_get_property("shared_key", ins);
+    }
+    if (tmp) {
+        sec->shared_key = flb_strdup(tmp);
+        sec->shared_key_len = strlen(sec->shared_key);
+    }
+
+    /* Self Hostname */
+    tmp = node ? flb_upstream_node_get_property("self_hostname", node) : NULL;
+    if (!tmp) {
+        tmp = flb_output_get_property("self_hostname", ins);
+    }
+    if (tmp) {
+        sec->self_hostname = flb_strdup(tmp);
+        sec->self_hostname_len = strlen(sec->self_hostname);
+    }
+
+#ifdef FLB_HAVE_TLS
+    return secure_forward_init(ctx, sec);
+#else
+    return 0;
+#endif
+}
+
+static void secure_forward_unset(struct flb_forward_secure *sec)
+{
+    if (sec->shared_key) {
+        flb_free(sec->shared_key);
+    }
+    if (sec->self_hostname) {
+        flb_free(sec->self_hostname);
+    }
+}
+
 int cb_forward_init(struct flb_output_instance *ins, struct flb_config *config,
                     void *data)
 {
+    int ret;
     int io_flags;
     char *tmp;
+    struct mk_list *head;
     struct flb_out_forward_config *ctx;
     struct flb_upstream *upstream;
+    struct flb_upstream_node *node;
+    struct flb_forward_secure *sec;
     (void) data;
 
     ctx = flb_calloc(1, sizeof(struct flb_out_forward_config));
@@ -382,7 +464,6 @@ int cb_forward_init(struct flb_output_instance *ins, struct flb_config *config,
         return -1;
     }
     flb_output_set_context(ins, ctx);
-    ctx->secured = FLB_FALSE;
 
     /* Set default network configuration */
     if (!ins->host.name) {
@@ -396,7 +477,6 @@ int cb_forward_init(struct flb_output_instance *ins, struct flb_config *config,
 #ifdef FLB_HAVE_TLS
     if (ins->use_tls == FLB_TRUE) {
         io_flags = FLB_IO_TLS;
-        ctx->secured = FLB_TRUE;
     }
     else {
         io_flags = FLB_IO_TCP;
@@ -409,64 +489,170 @@ int cb_forward_init(struct flb_output_instance *ins, struct flb_config *config,
         io_flags |= FLB_IO_IPV6;
     }
 
-    /* Prepare an upstream handler */
-    upstream = flb_upstream_create(config,
-                                   ins->host.name,
-                                   ins->host.port,
-                                   io_flags, (void *) &ins->tls);
-    if (!upstream) {
-        flb_free(ctx);
-        return -1;
+    /* Backward compatible timing mode */
+    ctx->time_as_integer = FLB_FALSE;
+    tmp = flb_output_get_property("time_as_integer", ins);
+    if (tmp) {
+        ctx->time_as_integer = flb_utils_bool(tmp);
     }
-    ctx->u = upstream;
 
-    if (ctx->secured == FLB_TRUE) {
-        /* Shared Key */
-        tmp = flb_output_get_property("shared_key", ins);
-        if (tmp) {
-            ctx->shared_key = flb_strdup(tmp);
-            ctx->shared_key_len = strlen(ctx->shared_key);
+    /* Compression (CompressedPackedForward mode) */
+    ctx->compress_gzip = FLB_FALSE;
+    tmp = flb_output_get_property("compress", ins);
+    if (tmp) {
+        if (strcasecmp(tmp, "gzip") == 0) {
+            ctx->compress_gzip = FLB_TRUE;
+        }
+        else {
+            flb_warn("[out_fw] unknown compress=%s, sending uncompressed",
+                     tmp);
         }
+    }
 
-        /* Self Hostname */
-        tmp = flb_output_get_property("self_hostname", ins);
-        if (tmp) {
-            ctx->self_hostname = flb_strdup(tmp);
-            ctx->self_hostname_len = strlen(ctx->self_hostname);
+    /* At-least-once delivery */
+    ctx->require_ack = FLB_FALSE;
+    tmp = flb_output_get_property("require_ack_response", ins);
+    if (tmp) {
+        ctx->require_ack = flb_utils_bool(tmp);
+    }
+
+    ctx->ack_timeout = FLB_FORWARD_ACK_TIMEOUT;
+    tmp = flb_output_get_property("ack_response_timeout", ins);
+    if (tmp && atoi(tmp) > 0) {
+        ctx->ack_timeout = atoi(tmp);
+    }
+
+    ctx->ack_window = FLB_FORWARD_ACK_WINDOW;
+    tmp = flb_output_get_property("ack_window", ins);
+    if (tmp && atoi(tmp) > 0) {
+        ctx->ack_window = atoi(tmp);
+    }
+
+    if (ctx->require_ack == FLB_TRUE && forward_ack_start(ctx) == -1) {
+        cb_forward_exit(ctx, config);
+        return -1;
+    }
+
+    /* Local transport: a unix socket path instead of host and port */
+    tmp = flb_output_get_property("unix_path", ins);
+    if (tmp) {
+        ctx->unix_path = flb_strdup(tmp);
+        if (!ctx->unix_path) {
+            flb_errno();
+            cb_forward_exit(ctx, config);
+            return -1;
         }
+        io_flags = FLB_IO_TCP | FLB_IO_UNIX;
     }
 
-    /* Backward compatible timing mode */
-    ctx->time_as_integer = FLB_FALSE;
-    tmp = flb_output_get_property("time_as_integer", ins);
+    ctx->unix_memfd = FLB_FALSE;
+    tmp = flb_output_get_property("unix_memfd", ins);
     if (tmp) {
-        ctx->time_as_integer = flb_utils_bool(tmp);
+        ctx->unix_memfd = flb_utils_bool(tmp);
+    }
+    if (ctx->unix_memfd == FLB_TRUE && !ctx->unix_path) {
+        flb_warn("[out_fw] unix_memfd requires unix_path, disabled");
+        ctx->unix_memfd = FLB_FALSE;
+    }
+    else if (ctx->unix_memfd == FLB_TRUE &&
+             forward_memfd_available() == FLB_FALSE) {
+        flb_warn("[out_fw] memory files are not supported, "
+                 "unix_memfd disabled");
+        ctx->unix_memfd = FLB_FALSE;
     }
 
-#ifdef FLB_HAVE_TLS
-    /* Initialize Secure Forward mode */
-    if (ctx->secured == FLB_TRUE) {
-        if (!ctx->shared_key) {
-            flb_error("[out_fw] secure mode requires a shared_key");
+    if (ctx->unix_path) {
+        upstream = flb_upstream_create(config, ctx->unix_path, 0,
+                                       io_flags, NULL);
+        if (!upstream) {
+            cb_forward_exit(ctx, config);
             return -1;
         }
-        secure_forward_init(ctx);
+        ctx->u = upstream;
+        flb_output_upstream_set(ctx->u, ins);
+        if (ctx->require_ack == FLB_TRUE) {
+            ctx->u->max_connections = ctx->ack_window;
+        }
+        flb_info("[out_fw] unix://%s%s", ctx->unix_path,
+                 ctx->unix_memfd == FLB_TRUE ? " with memory files" : "");
+        return 0;
+    }
+
+    /* Many aggregators: an upstream file or a list of nodes */
+    ret = flb_output_upstream_group(ins, config, 24224, io_flags,
+                                    &ins->tls, &ctx->ug);
+    if (ret == -1) {
+        cb_forward_exit(ctx, config);
+        return -1;
+    }
+
+    if (ctx->ug) {
+        mk_list_foreach(head, &ctx->ug->nodes) {
+            node = mk_list_entry(head, struct flb_upstream_node, _head);
+            sec = flb_calloc(1, sizeof(struct flb_forward_secure));
+            if (!sec) {
+                flb_errno();
+                cb_forward_exit(ctx, config);
+                return -1;
+            }
+            node->data = sec;
+            if (secure_forward_set(ctx, sec, node->u, node, ins) == -1) {
+                cb_forward_exit(ctx, config);
+                return -1;
+            }
+
+            /* Every unacked chunk keeps a connection busy */
+            if (ctx->require_ack == FLB_TRUE) {
+                node->u->max_connections = ctx->ack_window;
+            }
+        }
+        return 0;
+    }
+
+    /* Prepare an upstream handler */
+    upstream = flb_upstream_create(config,
+                                   ins->host.name,
+                                   ins->host.port,
+                                   io_flags, (void *) &ins->tls);
+    if (!upstream) {
+        cb_forward_exit(ctx, config);
+        return -1;
+    }
+    ctx->u = upstream;
+    flb_output_upstream_set(ctx->u, ins);
+    if (ctx->require_ack == FLB_TRUE) {
+        ctx->u->max_connections = ctx->ack_window;
+    }
+
+    /* Initialize Secure Forward mode */
+    if (secure_forward_set(ctx, &ctx->secure, ctx->u, NULL, ins) == -1) {
+        cb_forward_exit(ctx, config);
+        return -1;
     }
-#endif
 
     return 0;
 }
 
+/*
+ * Count the entries of the chunk and compose the outgoing entries when they
+ * differ from the chunk content. When 'gz' is set the entries are streamed
+ * into the gzip encoder instead, one record at a time on time_as_integer.
+ * If the chunk has a records index ('idx') the entries are not counted.
+ * Returns the number of entries or -1 on compression or memory errors.
+ */
 static int data_compose(void *data, size_t bytes,
                         void **out_buf, size_t *out_size,
+                        struct flb_gzip *gz,
+                        struct flb_chunk_index *idx,
                         struct flb_out_forward_config *ctx)
 {
+    int ret = 0;
     int entries = 0;
     size_t off = 0;
     msgpack_object   *mp_obj;
     msgpack_packer   mp_pck;
     msgpack_sbuffer  mp_sbuf;
-    msgpack_unpacked result;
+    msgpack_unpacked *result;
     struct flb_time tm;
 
 
@@ -474,7 +660,10 @@ static int data_compose(void *data, size_t bytes,
      * time_as_integer means we are using backward compatible mode for
      * servers with old timestamp mode in uint64_t (e.g: Fluentd <= v0.12).
      */
-    msgpack_unpacked_init(&result);
+    result = flb_mp_unpacker_get();
+    if (!result) {
+        return -1;
+    }
     if (ctx->time_as_integer == FLB_TRUE) {
         /*
          * if the case, we need to compose a new outgoing buffer instead
@@ -483,39 +672,65 @@ static int data_compose(void *data, size_t bytes,
         msgpack_sbuffer_init(&mp_sbuf);
         msgpack_packer_init(&mp_pck, &mp_sbuf, msgpack_sbuffer_write);
 
-        while (msgpack_unpack_next(&result, data, bytes, &off)) {
+        while (flb_mp_unpack_next(result, data, bytes, &off) ==
+               MSGPACK_UNPACK_SUCCESS) {
             /* Gather time */
-            flb_time_pop_from_msgpack(&tm, &result, &mp_obj);
+            flb_time_pop_from_msgpack(&tm, result, &mp_obj);
 
             /* Append data */
             msgpack_pack_array(&mp_pck, 2);
             msgpack_pack_uint64(&mp_pck, tm.tm.tv_sec);
             msgpack_pack_object(&mp_pck, *mp_obj);
             entries++;
+
+            if (gz) {
+                ret = flb_gzip_write(gz, mp_sbuf.data, mp_sbuf.size);
+                if (ret == -1) {
+                    break;
+                }
+                msgpack_sbuffer_clear(&mp_sbuf);
+            }
         }
     }
     else {
-        while (msgpack_unpack_next(&result, data, bytes, &off)) {
-            entries++;
+        if (idx) {
+            entries = idx->records;
+        }
+        else {
+            while (flb_mp_unpack_next(result, data, bytes, &off) ==
+                   MSGPACK_UNPACK_SUCCESS) {
+                entries++;
+            }
+        }
+        if (gz) {
+            ret = flb_gzip_write(gz, data, bytes);
         }
     }
 
     /* cleanup */
-    if (ctx->time_as_integer == FLB_TRUE) {
+    if (ctx->time_as_integer == FLB_TRUE && !gz) {
         *out_buf  = mp_sbuf.data;
         *out_size = mp_sbuf.size;
     }
     else {
+        if (ctx->time_as_integer == FLB_TRUE) {
+            msgpack_sbuffer_destroy(&mp_sbuf);
+        }
         *out_buf  = NULL;
         *out_size = 0;
     }
-    msgpack_unpacked_destroy(&result);
+    flb_mp_unpacker_put(result);
 
+    if (ret == -1) {
+        return -1;
+    }
     return entries;
 }
 
 int cb_forward_exit(void *data, struct flb_config *config)
 {
+    struct mk_list *head;
+    struct flb_upstream_node *node;
     struct flb_out_forward_config *ctx = data;
     (void) config;
 
@@ -523,15 +738,35 @@ int cb_forward_exit(void *data, struct flb_config *config)
         return 0;
     }
 
-    if (ctx->shared_key) {
-        flb_free(ctx->shared_key);
+    secure_forward_unset(&ctx->secure);
+    forward_ack_stop(ctx);
+
+    if (ctx->unix_path) {
+        flb_free(ctx->unix_path);
     }
 
-    if (ctx->self_hostname) {
-        flb_free(ctx->self_hostname);
+    if (ctx->ug) {
+        mk_list_foreach(head, &ctx->ug->nodes) {
+            node = mk_list_entry(head, struct flb_upstream_node, _head);
+            if (node->data) {
+                secure_forward_unset(node->data);
+                flb_free(node->data);
+            }
+        }
+        flb_upstream_group_destroy(ctx->ug);
     }
 
-    flb_upstream_destroy(ctx->u);
+    if (ctx->u) {
+        flb_upstream_destroy(ctx->u);
+    }
+
+#ifdef FLB_HAVE_TLS
+    if (ctx->tls_seeded == FLB_TRUE) {
+        mbedtls_ctr_drbg_free(&ctx->tls_ctr_drbg);
+        mbedtls_entropy_free(&ctx->tls_entropy);
+    }
+#endif
+
     flb_free(ctx);
 
     return 0;
@@ -543,27 +778,53 @@ void cb_forward_flush(void *data, size_t bytes,
                       struct flb_config *config)
 {
     int ret = -1;
+    int iov_cnt;
+    int options;
     int entries = 0;
-    size_t total;
+    int own_buf;
+    int chunk_id_len = 0;
+    char chunk_id[FLB_FORWARD_ACK_ID_SIZE];
+    char ack_buf[256];
+    size_t ack_len;
     size_t bytes_sent;
     msgpack_packer   mp_pck;
     msgpack_sbuffer  mp_sbuf;
     void *out_buf = NULL;
     size_t out_size = 0;
+    struct iovec iov[3];
+    struct flb_gzip gz;
+    struct flb_gzip *gz_ptr = NULL;
     struct flb_out_forward_config *ctx = out_context;
+    struct flb_upstream *u = ctx->u;
+    struct flb_upstream_node *node = NULL;
+    struct flb_forward_secure *sec = &ctx->secure;
     struct flb_upstream_conn *u_conn;
+    struct flb_forward_ack ack;
     (void) i_ins;
     (void) config;
 
     flb_debug("[out_forward] request %lu bytes to flush", bytes);
 
-    /* Initialize packager */
-    msgpack_sbuffer_init(&mp_sbuf);
-    msgpack_packer_init(&mp_pck, &mp_sbuf, msgpack_sbuffer_write);
+    /* CompressedPackedForward: the entries are sent as a gzip stream */
+    if (ctx->compress_gzip == FLB_TRUE) {
+        if (flb_gzip_init(&gz, bytes / 4) == -1) {
+            FLB_OUTPUT_RETURN(FLB_RETRY);
+        }
+        gz_ptr = &gz;
+    }
+
+    /* Count number of entries, the chunk index knows them if it's set */
+    entries = data_compose(data, bytes, &out_buf, &out_size, gz_ptr,
+                           flb_output_chunk_index(bytes), ctx);
+    if (entries == -1 ||
+        (gz_ptr && flb_gzip_finish(gz_ptr, &out_buf, &out_size) == -1)) {
+        flb_error("[out_fw] could not compress chunk");
+        flb_gzip_destroy(gz_ptr);
+        FLB_OUTPUT_RETURN(FLB_RETRY);
+    }
 
-    /* Count number of entries, is there a better way to do this ? */
-    entries = data_compose(data, bytes, &out_buf, &out_size, ctx);
-    if (out_buf == NULL && ctx->time_as_integer == FLB_FALSE) {
+    own_buf = (out_buf != NULL);
+    if (out_buf == NULL) {
         out_buf = data;
         out_size = bytes;
     }
@@ -571,74 +832,154 @@ void cb_forward_flush(void *data, size_t bytes,
     flb_debug("[out_fw] %i entries tag='%s' tag_len=%i",
               entries, tag, tag_len);
 
-    /* Output: root array */
-    msgpack_pack_array(&mp_pck, 2);
+    /* Initialize packager */
+    msgpack_sbuffer_init(&mp_sbuf);
+    msgpack_packer_init(&mp_pck, &mp_sbuf, msgpack_sbuffer_write);
+
+    /* At-least-once: the chunk id the server acknowledges */
+    if (ctx->require_ack == FLB_TRUE) {
+        chunk_id_len = forward_ack_chunk_id(ctx, chunk_id);
+        if (chunk_id_len == -1) {
+            msgpack_sbuffer_destroy(&mp_sbuf);
+            if (own_buf == FLB_TRUE) {
+                flb_free(out_buf);
+            }
+            FLB_OUTPUT_RETURN(FLB_RETRY);
+        }
+    }
+
+    /*
+     * Output: root array [tag, entries, option]. The entries are the packed
+     * records or, on the compressed mode, the gzip stream of them. The
+     * option map goes after the records, its bytes start at 'iov[2]'.
+     * Without options the message is just [tag, entries].
+     */
+    options = (ctx->compress_gzip == FLB_TRUE || ctx->require_ack == FLB_TRUE);
+
+    msgpack_pack_array(&mp_pck, options ? 3 : 2);
     msgpack_pack_str(&mp_pck, tag_len);
     msgpack_pack_str_body(&mp_pck, tag, tag_len);
-    msgpack_pack_array(&mp_pck, entries);
+    if (ctx->compress_gzip == FLB_TRUE) {
+        msgpack_pack_bin(&mp_pck, out_size);
+    }
+    else {
+        msgpack_pack_array(&mp_pck, entries);
+    }
+    iov[0].iov_len = mp_sbuf.size;
+    iov_cnt = 2;
+
+    if (options) {
+        msgpack_pack_map(&mp_pck, 1 + ctx->compress_gzip + ctx->require_ack);
+        msgpack_pack_str(&mp_pck, 4);
+        msgpack_pack_str_body(&mp_pck, "size", 4);
+        msgpack_pack_uint64(&mp_pck, entries);
+        if (ctx->compress_gzip == FLB_TRUE) {
+            msgpack_pack_str(&mp_pck, 10);
+            msgpack_pack_str_body(&mp_pck, "compressed", 10);
+            msgpack_pack_str(&mp_pck, 4);
+            msgpack_pack_str_body(&mp_pck, "gzip", 4);
+        }
+        if (ctx->require_ack == FLB_TRUE) {
+            msgpack_pack_str(&mp_pck, 5);
+            msgpack_pack_str_body(&mp_pck, "chunk", 5);
+            msgpack_pack_str(&mp_pck, chunk_id_len);
+            msgpack_pack_str_body(&mp_pck, chunk_id, chunk_id_len);
+        }
+
+        iov[2].iov_base = mp_sbuf.data + iov[0].iov_len;
+        iov[2].iov_len = mp_sbuf.size - iov[0].iov_len;
+        iov_cnt = 3;
+    }
+    iov[0].iov_base = mp_sbuf.data;
+    iov[1].iov_base = out_buf;
+    iov[1].iov_len = out_size;
+
+    /* Get a TCP connection instance, from the next node if there are many */
+    if (ctx->ug) {
+        node = flb_upstream_group_node_get(ctx->ug);
+        u = node->u;
+        sec = node->data;
+    }
 
-    /* Get a TCP connection instance */
-    u_conn = flb_upstream_conn_get(ctx->u);
+    /* With acks, the connections in use are the unacked chunks window */
+    u_conn = flb_upstream_conn_get(u);
     if (!u_conn) {
-        flb_error("[out_fw] no upstream connections available");
-        msgpack_sbuffer_destroy(&mp_sbuf);
-        if (ctx->time_as_integer == FLB_TRUE) {
-            flb_free(out_buf);
+        if (ctx->require_ack == FLB_TRUE) {
+            flb_debug("[out_fw] %s:%i ack window full or no connection, "
+                      "retrying", u->tcp_host, u->tcp_port);
         }
-        FLB_OUTPUT_RETURN(FLB_RETRY);
+        else {
+            flb_error("[out_fw] no upstream connections available to %s:%i",
+                      u->tcp_host, u->tcp_port);
+        }
+        ret = FLB_RETRY;
+        goto exit;
     }
 
-    /* Secure Forward ? */
+    /*
+     * Secure Forward ? A recycled keepalive connection has already been
+     * authenticated, the handshake is only required for new connections.
+     */
 #ifdef FLB_HAVE_TLS
-    if (ctx->secured == FLB_TRUE) {
-        ret = secure_forward_handshake(u_conn, ctx);
+    if (sec->secured == FLB_TRUE && u_conn->ka_count == 0) {
+        ret = secure_forward_handshake(u_conn, sec);
         flb_debug("[out_fw] handshake status = %i", ret);
         if (ret == -1) {
             flb_upstream_conn_release(u_conn);
-            msgpack_sbuffer_destroy(&mp_sbuf);
-            if (ctx->time_as_integer == FLB_TRUE) {
-                flb_free(out_buf);
-            }
-            FLB_OUTPUT_RETURN(FLB_RETRY);
+            ret = FLB_RETRY;
+            goto exit;
         }
     }
 #endif
 
-    /* Write message header */
-    ret = flb_io_net_write(u_conn, mp_sbuf.data, mp_sbuf.size, &bytes_sent);
-    if (ret == -1) {
-        flb_error("[out_fw] could not write chunk header");
-        msgpack_sbuffer_destroy(&mp_sbuf);
-        flb_upstream_conn_release(u_conn);
-        if (ctx->time_as_integer == FLB_TRUE) {
-            flb_free(out_buf);
-        }
-        FLB_OUTPUT_RETURN(FLB_RETRY);
+    /* Write message header, records and options */
+    if (ctx->unix_memfd == FLB_TRUE) {
+        ret = forward_memfd_send(u_conn, iov, iov_cnt, &bytes_sent);
+    }
+    else {
+        ret = flb_io_net_writev(u_conn, iov, iov_cnt, &bytes_sent);
     }
-
-    msgpack_sbuffer_destroy(&mp_sbuf);
-    total = ret;
-
-    /* Write body (records) */
-    ret = flb_io_net_write(u_conn, out_buf, out_size, &bytes_sent);
     if (ret == -1) {
         flb_error("[out_fw] error writing content body");
-        if (ctx->time_as_integer == FLB_TRUE) {
-            flb_free(out_buf);
-        }
         flb_upstream_conn_release(u_conn);
-        FLB_OUTPUT_RETURN(FLB_RETRY);
+        ret = FLB_RETRY;
+        goto exit;
     }
 
-    total += bytes_sent;
+    /*
+     * Wait for the ack. The co-routine yields on the read, other chunks
+     * keep going out on the other connections meanwhile.
+     */
+    if (ctx->require_ack == FLB_TRUE) {
+        forward_ack_watch(ctx, &ack, u_conn->fd);
+        ret = forward_read(u_conn, ack_buf, sizeof(ack_buf), &ack_len);
+        forward_ack_unwatch(ctx, &ack);
+        if (ret == 0) {
+            ret = forward_ack_check(ack_buf, ack_len, chunk_id, chunk_id_len);
+        }
+        if (ret == -1) {
+            flb_error("[out_fw] no valid ack for chunk %s from %s:%i",
+                      chunk_id, u->tcp_host, u->tcp_port);
+            flb_upstream_conn_recycle(u_conn, FLB_FALSE);
+            flb_upstream_conn_release(u_conn);
+            ret = FLB_RETRY;
+            goto exit;
+        }
+    }
     flb_upstream_conn_release(u_conn);
 
-    if (ctx->time_as_integer == FLB_TRUE) {
+    flb_trace("[out_fw] ended write()=%lu bytes", bytes_sent);
+    ret = FLB_OK;
+
+ exit:
+    if (node) {
+        flb_upstream_group_node_release(ctx->ug, node, ret != FLB_OK);
+    }
+    msgpack_sbuffer_destroy(&mp_sbuf);
+    if (own_buf == FLB_TRUE) {
         flb_free(out_buf);
     }
-
-    flb_trace("[out_fw] ended write()=%d bytes", total);
-    FLB_OUTPUT_RETURN(FLB_OK);
+    FLB_OUTPUT_RETURN(ret);
 }
 
 /* Plugin reference */
@@ -649,5 +990,5 @@ struct flb_output_plugin out_forward_plugin = {
     .cb_pre_run   = NULL,
     .cb_flush     = cb_forward_flush,
     .cb_exit      = cb_forward_exit,
-    .flags        = FLB_OUTPUT_NET | FLB_IO_OPT_TLS,
+    .flags        = FLB_OUTPUT_NET | FLB_IO_OPT_TLS | FLB_OUTPUT_SHARDS,
 };
@@ -21,6 +21,13 @@
 #define FLB_OUT_FORWARD
 
 #include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_upstream_group.h>
+#include <monkey/mk_core.h>
+#include <pthread.h>
+
+/* At-least-once delivery defaults */
+#define FLB_FORWARD_ACK_TIMEOUT   190   /* seconds, as Fluentd */
+#define FLB_FORWARD_ACK_WINDOW     16   /* unacked chunks per destination */
 
 #ifdef FLB_HAVE_TLS
 #include <mbedtls/entropy.h>
@@ -28,25 +35,50 @@
 #include <mbedtls/ctr_drbg.h>
 #endif
 
-struct flb_out_forward_config {
+/* Secure Forward settings of a destination: the host or an upstream node */
+struct flb_forward_secure {
     int secured;              /* Using Secure Forward mode ?  */
-    int time_as_integer;      /* Use backward compatible timestamp ? */
-
-    /* config */
     int shared_key_len;       /* shared key length            */
     char *shared_key;         /* shared key                   */
     int self_hostname_len;    /* hostname length              */
     char *self_hostname;      /* hostname used in certificate */
+#ifdef FLB_HAVE_TLS
+    unsigned char shared_key_salt[16];
+#endif
+};
+
+struct flb_out_forward_config {
+    int time_as_integer;      /* Use backward compatible timestamp ? */
+    int compress_gzip;        /* CompressedPackedForward mode ? */
+
+    /* At-least-once delivery (require_ack_response), see forward_ack.c */
+    int require_ack;
+    int ack_timeout;          /* seconds to wait for an ack */
+    int ack_window;           /* unacked chunks in flight per destination */
+    uint32_t ack_seq;         /* chunk ids sequence */
+    int ack_running;
+    pthread_t ack_thread;
+    pthread_mutex_t ack_mutex;
+    pthread_cond_t ack_cond;
+    struct mk_list ack_list;  /* chunks waiting for an ack */
+
+    /* Local transport: unix socket, messages optionally in memory files */
+    char *unix_path;
+    int unix_memfd;
+
+    /* Host/Port destination */
+    struct flb_forward_secure secure;
 
     /* mbedTLS specifics */
 #ifdef FLB_HAVE_TLS
-    unsigned char shared_key_salt[16];
+    int tls_seeded;
     mbedtls_entropy_context tls_entropy;
     mbedtls_ctr_drbg_context tls_ctr_drbg;
 #endif
 
-    /* Upstream handler */
+    /* Upstream handler, or a group of nodes (Upstream or Nodes) */
     struct flb_upstream *u;
+    struct flb_upstream_group *ug;
 };
 
 #endif
@@ -0,0 +1,212 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+
+/*
+ * At-least-once delivery: every chunk carries a 'chunk' id in its option
+ * map and the server answers with {"ack": id} once it has it. Flushes wait
+ * for their ack on their own connection, so a destination keeps up to
+ * 'ack_window' unacked chunks in flight, one per connection. A watchdog
+ * thread shuts down the connections whose ack did not arrive in time, the
+ * pending read fails and the chunk is retried.
+ */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_log.h>
+#include <fluent-bit/flb_time.h>
+#include <msgpack.h>
+#include <mbedtls/base64.h>
+
+#include <sys/socket.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "forward.h"
+#include "forward_ack.h"
+
+/* How often the watchdog looks for expired acks, in milliseconds */
+#define FORWARD_ACK_WATCH_MS   250
+
+static void *forward_ack_worker(void *data)
+{
+    time_t now;
+    struct timespec ts;
+    struct mk_list *head;
+    struct flb_forward_ack *ack;
+    struct flb_out_forward_config *ctx = data;
+
+    pthread_mutex_lock(&ctx->ack_mutex);
+    while (ctx->ack_running == FLB_TRUE) {
+        now = time(NULL);
+        mk_list_foreach(head, &ctx->ack_list) {
+            ack = mk_list_entry(head, struct flb_forward_ack, _head);
+            if (ack->fd != -1 && now >= ack->deadline) {
+                flb_warn("[out_fw] fd=%i no ack after %is, retrying chunk",
+                         ack->fd, ctx->ack_timeout);
+                shutdown(ack->fd, SHUT_RDWR);
+                ack->fd = -1;
+            }
+        }
+
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += FORWARD_ACK_WATCH_MS * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&ctx->ack_cond, &ctx->ack_mutex, &ts);
+    }
+    pthread_mutex_unlock(&ctx->ack_mutex);
+
+    return NULL;
+}
+
+int forward_ack_start(struct flb_out_forward_config *ctx)
+{
+    int ret;
+
+    mk_list_init(&ctx->ack_list);
+    pthread_mutex_init(&ctx->ack_mutex, NULL);
+    pthread_cond_init(&ctx->ack_cond, NULL);
+
+    ctx->ack_running = FLB_TRUE;
+    ret = pthread_create(&ctx->ack_thread, NULL, forward_ack_worker, ctx);
+    if (ret != 0) {
+        flb_error("[out_fw] cannot start ack watchdog");
+        ctx->ack_running = FLB_FALSE;
+        pthread_cond_destroy(&ctx->ack_cond);
+        pthread_mutex_destroy(&ctx->ack_mutex);
+        return -1;
+    }
+
+    return 0;
+}
+
+void forward_ack_stop(struct flb_out_forward_config *ctx)
+{
+    if (ctx->ack_running == FLB_FALSE) {
+        return;
+    }
+
+    pthread_mutex_lock(&ctx->ack_mutex);
+    ctx->ack_running = FLB_FALSE;
+    pthread_cond_signal(&ctx->ack_cond);
+    pthread_mutex_unlock(&ctx->ack_mutex);
+    pthread_join(ctx->ack_thread, NULL);
+
+    pthread_cond_destroy(&ctx->ack_cond);
+    pthread_mutex_destroy(&ctx->ack_mutex);
+}
+
+/*
+ * Compose a new chunk id in 'buf' (FLB_FORWARD_ACK_ID_SIZE bytes): the
+ * time in nanoseconds, a sequence number and the process id, in base64.
+ */
+int forward_ack_chunk_id(struct flb_out_forward_config *ctx, char *buf)
+{
+    int i;
+    uint32_t seq;
+    uint32_t pid;
+    uint64_t ns;
+    size_t len;
+    unsigned char id[16];
+    struct flb_time tm;
+
+    flb_time_get(&tm);
+    ns = (uint64_t) tm.tm.tv_sec * 1000000000ULL + tm.tm.tv_nsec;
+    seq = __sync_fetch_and_add(&ctx->ack_seq, 1);
+    pid = getpid();
+
+    for (i = 0; i < 8; i++) {
+        id[i] = (ns >> (56 - (i * 8))) & 0xff;
+    }
+    for (i = 0; i < 4; i++) {
+        id[8 + i] = (seq >> (24 - (i * 8))) & 0xff;
+        id[12 + i] = (pid >> (24 - (i * 8))) & 0xff;
+    }
+
+    if (mbedtls_base64_encode((unsigned char *) buf, FLB_FORWARD_ACK_ID_SIZE,
+                              &len, id, sizeof(id)) != 0) {
+        return -1;
+    }
+
+    return len;
+}
+
+void forward_ack_watch(struct flb_out_forward_config *ctx,
+                       struct flb_forward_ack *ack, int fd)
+{
+    ack->fd = fd;
+    ack->deadline = time(NULL) + ctx->ack_timeout;
+
+    pthread_mutex_lock(&ctx->ack_mutex);
+    mk_list_add(&ack->_head, &ctx->ack_list);
+    pthread_mutex_unlock(&ctx->ack_mutex);
+}
+
+/* Must be called before the connection is released */
+void forward_ack_unwatch(struct flb_out_forward_config *ctx,
+                         struct flb_forward_ack *ack)
+{
+    pthread_mutex_lock(&ctx->ack_mutex);
+    mk_list_del(&ack->_head);
+    pthread_mutex_unlock(&ctx->ack_mutex);
+}
+
+/* Validate a server response: a map with an 'ack' for the chunk id */
+int forward_ack_check(char *buf, size_t size, char *id, int id_len)
+{
+    int i;
+    int ret = -1;
+    size_t off = 0;
+    msgpack_object k;
+    msgpack_object v;
+    msgpack_object root;
+    msgpack_unpacked result;
+
+    msgpack_unpacked_init(&result);
+    if (msgpack_unpack_next(&result, buf, size, &off) !=
+        MSGPACK_UNPACK_SUCCESS) {
+        msgpack_unpacked_destroy(&result);
+        return -1;
+    }
+
+    root = result.data;
+    if (root.type == MSGPACK_OBJECT_MAP) {
+        for (i = 0; i < root.via.map.size; i++) {
+            k = root.via.map.ptr[i].key;
+            v = root.via.map.ptr[i].val;
+            if (k.type != MSGPACK_OBJECT_STR || k.via.str.size != 3 ||
+                strncmp(k.via.str.ptr, "ack", 3) != 0) {
+                continue;
+            }
+            if ((v.type == MSGPACK_OBJECT_STR ||
+                 v.type == MSGPACK_OBJECT_BIN) &&
+                v.via.str.size == id_len &&
+                memcmp(v.via.str.ptr, id, id_len) == 0) {
+                ret = 0;
+            }
+            break;
+        }
+    }
+
+    msgpack_unpacked_destroy(&result);
+    return ret;
+}
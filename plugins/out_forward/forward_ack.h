@@ -0,0 +1,50 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+
+#ifndef FLB_OUT_FORWARD_ACK_H
+#define FLB_OUT_FORWARD_ACK_H
+
+#include <fluent-bit/flb_info.h>
+#include <monkey/mk_core.h>
+#include <time.h>
+
+#include "forward.h"
+
+/* Chunk ids are 16 bytes, sent in base64 */
+#define FLB_FORWARD_ACK_ID_SIZE   25
+
+/* An unacked chunk: its connection is shut down once the deadline passes */
+struct flb_forward_ack {
+    int fd;
+    time_t deadline;
+    struct mk_list _head;
+};
+
+int forward_ack_start(struct flb_out_forward_config *ctx);
+void forward_ack_stop(struct flb_out_forward_config *ctx);
+
+int forward_ack_chunk_id(struct flb_out_forward_config *ctx, char *buf);
+void forward_ack_watch(struct flb_out_forward_config *ctx,
+                       struct flb_forward_ack *ack, int fd);
+void forward_ack_unwatch(struct flb_out_forward_config *ctx,
+                         struct flb_forward_ack *ack);
+int forward_ack_check(char *buf, size_t size, char *id, int id_len);
+
+#endif
@@ -0,0 +1,139 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/*
+ * Local transport: on a unix socket destination a message can be handed
+ * over in a sealed memory file instead of the socket. The message is
+ * written once into the file and the socket only carries a marker byte
+ * with the file descriptor attached (SCM_RIGHTS), in_forward maps the
+ * file and reads the records in place. The records never go through the
+ * socket buffers, acks still come back on the socket.
+ */
+
+#define _GNU_SOURCE
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_log.h>
+#include <fluent-bit/flb_io.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include "forward_memfd.h"
+
+#if defined(__linux__) && defined(SYS_memfd_create)
+#define FORWARD_MEMFD
+#define FORWARD_MFD_CLOEXEC        0x0001U
+#define FORWARD_MFD_ALLOW_SEALING  0x0002U
+#endif
+
+int forward_memfd_available()
+{
+#ifdef FORWARD_MEMFD
+    return FLB_TRUE;
+#else
+    return FLB_FALSE;
+#endif
+}
+
+#ifdef FORWARD_MEMFD
+/* Write the whole I/O vector to the memory file */
+static int memfd_writev(int fd, struct iovec *iov, int iovcnt, size_t *total)
+{
+    ssize_t bytes;
+
+    *total = 0;
+    while (iovcnt > 0) {
+        bytes = writev(fd, iov, iovcnt);
+        if (bytes == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            flb_errno();
+            return -1;
+        }
+        *total += bytes;
+
+        while (iovcnt > 0 && bytes >= iov->iov_len) {
+            bytes -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *) iov->iov_base + bytes;
+            iov->iov_len -= bytes;
+        }
+    }
+
+    return 0;
+}
+
+int forward_memfd_send(struct flb_upstream_conn *u_conn,
+                       struct iovec *iov, int iovcnt, size_t *out_len)
+{
+    int fd;
+    int ret;
+    size_t total;
+    unsigned char mark = FLB_FORWARD_MEMFD_MARK;
+
+    fd = syscall(SYS_memfd_create, "flb_forward",
+                 FORWARD_MFD_CLOEXEC | FORWARD_MFD_ALLOW_SEALING);
+    if (fd == -1) {
+        flb_errno();
+        return -1;
+    }
+
+    ret = memfd_writev(fd, iov, iovcnt, &total);
+    if (ret == -1) {
+        close(fd);
+        return -1;
+    }
+
+#ifdef F_ADD_SEALS
+    /* The reader maps the file, it must not change under it */
+    ret = fcntl(fd, F_ADD_SEALS,
+                F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+    if (ret == -1) {
+        flb_errno();
+        close(fd);
+        return -1;
+    }
+#endif
+
+    ret = flb_io_net_send_fd(u_conn, &mark, 1, fd);
+    close(fd);
+    if (ret == -1) {
+        return -1;
+    }
+
+    *out_len = total;
+    return 0;
+}
+#else
+int forward_memfd_send(struct flb_upstream_conn *u_conn,
+                       struct iovec *iov, int iovcnt, size_t *out_len)
+{
+    return -1;
+}
+#endif
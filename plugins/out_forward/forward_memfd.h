@@ -0,0 +1,37 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef FLB_OUT_FORWARD_MEMFD_H
+#define FLB_OUT_FORWARD_MEMFD_H
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_upstream.h>
+#include <sys/uio.h>
+
+/*
+ * Marker of a message sent in a memory file. 0xc1 is never used by
+ * msgpack, in_forward can't take it for the start of a message.
+ */
+#define FLB_FORWARD_MEMFD_MARK   0xc1
+
+int forward_memfd_available();
+int forward_memfd_send(struct flb_upstream_conn *u_conn,
+                       struct iovec *iov, int iovcnt, size_t *out_len);
+
+#endif
@@ -23,6 +23,9 @@
 #include <fluent-bit/flb_pack.h>
 #include <fluent-bit/flb_str.h>
 #include <fluent-bit/flb_time.h>
+#include <fluent-bit/flb_compress.h>
+#include <fluent-bit/flb_sds.h>
+#include <fluent-bit/flb_utils.h>
 #include <msgpack.h>
 
 #include <stdio.h>
@@ -50,7 +53,7 @@ static char *msgpack_to_json(struct flb_out_http_config *ctx, char *data, uint64
     msgpack_unpacked result;
     msgpack_object root;
     msgpack_object map;
-    msgpack_sbuffer tmp_sbuf;
+    struct flb_arena_buf tmp_sbuf;
     msgpack_packer tmp_pck;
     msgpack_object *obj;
     struct tm tm;
@@ -64,9 +67,9 @@ static char *msgpack_to_json(struct flb_out_http_config *ctx, char *data, uint64
     msgpack_unpacked_destroy(&result);
     msgpack_unpacked_init(&result);
 
-    /* Create temporal msgpack buffer */
-    msgpack_sbuffer_init(&tmp_sbuf);
-    msgpack_packer_init(&tmp_pck, &tmp_sbuf, msgpack_sbuffer_write);
+    /* Create temporal msgpack buffer, it lives in the flush arena */
+    flb_arena_buf_init(&tmp_sbuf, flb_output_arena());
+    msgpack_packer_init(&tmp_pck, &tmp_sbuf, flb_arena_buf_write);
     msgpack_pack_array(&tmp_pck, array_size);
 
     off = 0;
@@ -157,7 +160,7 @@ static char *msgpack_to_json(struct flb_out_http_config *ctx, char *data, uint64
         }
     }
 
-    msgpack_sbuffer_destroy(&tmp_sbuf);
+    flb_arena_buf_destroy(&tmp_sbuf);
     if (ret != 0) {
         return NULL;
     }
@@ -166,6 +169,129 @@ static char *msgpack_to_json(struct flb_out_http_config *ctx, char *data, uint64
     return json_buf;
 }
 
+static inline int json_cat(flb_sds_t *buf, char *str, int len)
+{
+    flb_sds_t tmp;
+
+    tmp = flb_sds_cat(*buf, str, len);
+    if (!tmp) {
+        return -1;
+    }
+    *buf = tmp;
+    return 0;
+}
+
+/* Append one record to 'buf' as a JSON map, the date goes first */
+static int record_to_json(struct flb_out_http_config *ctx, flb_sds_t *buf,
+                          struct flb_time *tms, msgpack_object *map)
+{
+    int i;
+    int len;
+    size_t s;
+    char tmp[64];
+    struct tm tm;
+
+    if (json_cat(buf, "{\"", 2) == -1 ||
+        flb_utils_write_str_sds(buf, ctx->json_date_key,
+                                ctx->json_date_key_len) == -1) {
+        return -1;
+    }
+
+    switch (ctx->json_date_format) {
+    case FLB_JSON_DATE_ISO8601:
+        gmtime_r(&tms->tm.tv_sec, &tm);
+        s = strftime(tmp, sizeof(tmp) - 1, "\":\"" FLB_JSON_DATE_ISO8601_FMT,
+                     &tm);
+        len = snprintf(tmp + s, sizeof(tmp) - 1 - s,
+                       ".%06" PRIu64 "Z\"", (uint64_t) tms->tm.tv_nsec / 1000);
+        len += s;
+        break;
+    default:
+        len = snprintf(tmp, sizeof(tmp) - 1, "\":%f", flb_time_to_double(tms));
+    }
+    if (json_cat(buf, tmp, len) == -1) {
+        return -1;
+    }
+
+    for (i = 0; i < map->via.map.size; i++) {
+        if (json_cat(buf, ", ", 2) == -1 ||
+            flb_msgpack_to_json_sds(buf, &map->via.map.ptr[i].key) == -1 ||
+            json_cat(buf, ":", 1) == -1 ||
+            flb_msgpack_to_json_sds(buf, &map->via.map.ptr[i].val) == -1) {
+            return -1;
+        }
+    }
+
+    return json_cat(buf, "}", 1);
+}
+
+/*
+ * Chunked transfer: the records are converted to JSON one by one and sent
+ * as they are ready, the body is never held in memory as a whole.
+ */
+static int http_json_stream(struct flb_out_http_config *ctx,
+                            struct flb_http_client *c,
+                            char *data, size_t bytes)
+{
+    int ret = 0;
+    int records = 0;
+    size_t off = 0;
+    flb_sds_t buf;
+    msgpack_unpacked result;
+    msgpack_object root;
+    msgpack_object *obj;
+    struct flb_time tms;
+
+    buf = flb_sds_create_size_arena(flb_output_arena(), 1024);
+    if (!buf) {
+        return -1;
+    }
+
+    if (ctx->out_format == FLB_HTTP_OUT_JSON) {
+        ret = json_cat(&buf, "[", 1);
+    }
+
+    msgpack_unpacked_init(&result);
+    while (ret == 0 && msgpack_unpack_next(&result, data, bytes, &off)) {
+        root = result.data;
+        if (root.type != MSGPACK_OBJECT_ARRAY || root.via.array.size != 2 ||
+            root.via.array.ptr[1].type != MSGPACK_OBJECT_MAP) {
+            continue;
+        }
+
+        if (records > 0 && ctx->out_format == FLB_HTTP_OUT_JSON) {
+            ret = json_cat(&buf, ", ", 2);
+        }
+        else if (records > 0 && ctx->out_format == FLB_HTTP_OUT_JSON_STREAM) {
+            ret = json_cat(&buf, " ", 1);
+        }
+        records++;
+
+        flb_time_pop_from_msgpack(&tms, &result, &obj);
+        ret |= record_to_json(ctx, &buf, &tms, &root.via.array.ptr[1]);
+        if (ret == 0 && ctx->out_format == FLB_HTTP_OUT_JSON_LINES) {
+            ret = json_cat(&buf, "\n", 1);
+        }
+
+        /* hand the data to the client once a chunk worth is ready */
+        if (ret == 0 && flb_sds_len(buf) >= FLB_HTTP_DATA_CHUNK) {
+            ret = flb_http_body_write(c, buf, flb_sds_len(buf));
+            flb_sds_len_set(buf, 0);
+        }
+    }
+    msgpack_unpacked_destroy(&result);
+
+    if (ret == 0 && ctx->out_format == FLB_HTTP_OUT_JSON) {
+        ret = json_cat(&buf, "]", 1);
+    }
+    if (ret == 0 && flb_sds_len(buf) > 0) {
+        ret = flb_http_body_write(c, buf, flb_sds_len(buf));
+    }
+
+    flb_sds_destroy(buf);
+    return ret;
+}
+
 int cb_http_init(struct flb_output_instance *ins, struct flb_config *config,
                      void *data)
 {
@@ -325,6 +451,24 @@ int cb_http_init(struct flb_output_instance *ins, struct flb_config *config,
       flb_info("[out_http] configure to pass tag in header: %s", ctx->header_tag);
     }
 
+    /* Request compression */
+    tmp = flb_output_get_property("compress", ins);
+    if (tmp) {
+        if (strcasecmp(tmp, "gzip") == 0) {
+            ctx->compress_gzip = FLB_TRUE;
+        }
+        else {
+            flb_warn("[out_http] unknown compress=%s, sending uncompressed",
+                     tmp);
+        }
+    }
+
+    /* Stream the JSON formats with chunked transfer encoding */
+    tmp = flb_output_get_property("chunked_transfer", ins);
+    if (tmp) {
+        ctx->chunked = flb_utils_bool(tmp);
+    }
+
     /* Output format */
     ctx->out_format = FLB_HTTP_OUT_MSGPACK;
     tmp = flb_output_get_property("format", ins);
@@ -360,36 +504,66 @@ int cb_http_init(struct flb_output_instance *ins, struct flb_config *config,
     ctx->json_date_key = flb_strdup(tmp ? tmp : "date");
     ctx->json_date_key_len = strlen(ctx->json_date_key);
 
+    /* The proxy gets plain HTTP/1.1 requests */
+    if (ctx->proxy && ins->http2 == FLB_TRUE) {
+        flb_warn("[out_http] 'http2' is ignored when a proxy is set");
+        ins->http2 = FLB_FALSE;
+    }
+
     ctx->u = upstream;
+    flb_output_upstream_set(ctx->u, ins);
     ctx->uri = uri;
     ctx->host = ins->host.name;
     ctx->port = ins->host.port;
 
+    /* Many nodes: requests are balanced between them, not with a proxy */
+    if (ctx->proxy && flb_output_get_property("nodes", ins)) {
+        flb_warn("[out_http] 'nodes' is ignored when a proxy is set");
+    }
+    else if (flb_output_upstream_group(ins, config, ctx->port, io_flags,
+                                       (void *) &ins->tls, &ctx->ug) == -1) {
+        flb_upstream_destroy(ctx->u);
+        flb_free(ctx->uri);
+        flb_free(ctx);
+        return -1;
+    }
+
     /* Set the plugin context */
     flb_output_set_context(ins, ctx);
     return 0;
 }
 
-void cb_http_flush(void *data, size_t bytes,
-                        char *tag, int tag_len,
-                        struct flb_input_instance *i_ins,
-                        void *out_context,
-                        struct flb_config *config)
+/* Send the records in one request, it returns the flush result */
+static int http_post(struct flb_out_http_config *ctx,
+                     void *data, size_t bytes,
+                     char *tag, int tag_len,
+                     struct flb_config *config)
 {
     int ret;
     int out_ret = FLB_OK;
     size_t b_sent;
-    struct flb_out_http_config *ctx = out_context;
     struct flb_upstream *u;
     struct flb_upstream_conn *u_conn;
     struct flb_http_client *c;
     void *body = NULL;
-    uint64_t body_len;
-    (void)i_ins;
-
-    if ((ctx->out_format == FLB_HTTP_OUT_JSON) ||
-        (ctx->out_format == FLB_HTTP_OUT_JSON_STREAM) ||
-        (ctx->out_format == FLB_HTTP_OUT_JSON_LINES)) {
+    void *gz;
+    char *host = ctx->host;
+    int port = ctx->port;
+    struct flb_upstream_node *node = NULL;
+    size_t gz_len;
+    uint64_t body_len = 0;
+    int flags = 0;
+    int json;
+
+    json = (ctx->out_format == FLB_HTTP_OUT_JSON) ||
+           (ctx->out_format == FLB_HTTP_OUT_JSON_STREAM) ||
+           (ctx->out_format == FLB_HTTP_OUT_JSON_LINES);
+
+    /* A compressed body needs to be complete before it's sent */
+    if (json && ctx->chunked == FLB_TRUE && ctx->compress_gzip == FLB_FALSE) {
+        flags = FLB_HTTP_CHUNKED;
+    }
+    else if (json) {
         body = msgpack_to_json(ctx, data, bytes, &body_len);
     }
     else {
@@ -397,28 +571,48 @@ void cb_http_flush(void *data, size_t bytes,
         body_len = bytes;
     }
 
+    if (ctx->compress_gzip == FLB_TRUE && body) {
+        ret = flb_compress_gzip(config, body, body_len, &gz, &gz_len);
+        if (body != data) {
+            flb_free(body);
+        }
+        if (ret == -1) {
+            flb_error("[out_http] cannot gzip the request body");
+            return FLB_RETRY;
+        }
+        body = gz;
+        body_len = gz_len;
+    }
+
     /* Get upstream context and connection */
     u = ctx->u;
+    if (ctx->ug) {
+        node = flb_upstream_group_node_get(ctx->ug);
+        u = node->u;
+        host = u->tcp_host;
+        port = u->tcp_port;
+    }
     u_conn = flb_upstream_conn_get(u);
     if (!u_conn) {
+        if (node) {
+            flb_upstream_group_node_release(ctx->ug, node, FLB_TRUE);
+        }
         if (body != data) {
             flb_free(body);
         }
         flb_error("[out_http] no upstream connections available to %s:%i",
                   u->tcp_host, u->tcp_port);
-        FLB_OUTPUT_RETURN(FLB_RETRY);
+        return FLB_RETRY;
     }
 
     /* Create HTTP client context */
     c = flb_http_client(u_conn, FLB_HTTP_POST, ctx->uri,
                         body, body_len,
-                        ctx->host, ctx->port,
-                        ctx->proxy, 0);
+                        host, port,
+                        ctx->proxy, flags);
 
     /* Append headers */
-    if ((ctx->out_format == FLB_HTTP_OUT_JSON) ||
-        (ctx->out_format == FLB_HTTP_OUT_JSON_STREAM) ||
-        (ctx->out_format == FLB_HTTP_OUT_JSON_LINES)) {
+    if (json) {
         flb_http_add_header(c,
                             FLB_HTTP_CONTENT_TYPE,
                             sizeof(FLB_HTTP_CONTENT_TYPE) - 1,
@@ -433,6 +627,13 @@ void cb_http_flush(void *data, size_t bytes,
                             sizeof(FLB_HTTP_MIME_MSGPACK) - 1);
     }
 
+    if (ctx->compress_gzip == FLB_TRUE) {
+        flb_http_add_header(c,
+                            FLB_HTTP_CONTENT_ENCODING,
+                            sizeof(FLB_HTTP_CONTENT_ENCODING) - 1,
+                            "gzip", 4);
+    }
+
     if (ctx->header_tag) {
         flb_http_add_header(c,
                         ctx->header_tag,
@@ -444,7 +645,23 @@ void cb_http_flush(void *data, size_t bytes,
         flb_http_basic_auth(c, ctx->http_user, ctx->http_passwd);
     }
 
-    ret = flb_http_do(c, &b_sent);
+    ret = 0;
+    if (flags & FLB_HTTP_CHUNKED) {
+        ret = http_json_stream(ctx, c, data, bytes);
+        if (ret != 0) {
+            /* the request is incomplete, the connection can't be reused */
+            flb_upstream_conn_recycle(u_conn, FLB_FALSE);
+        }
+    }
+    if (ret == 0) {
+        ret = flb_http_do(c, &b_sent);
+    }
+    if (node) {
+        /* Network errors and 5xx count against the node */
+        flb_upstream_group_node_release(ctx->ug, node,
+                                        ret != 0 || c->resp.status >= 500);
+    }
+
     if (ret == 0) {
         /*
          * Only allow the following HTTP status:
@@ -459,25 +676,25 @@ void cb_http_flush(void *data, size_t bytes,
          */
         if (c->resp.status < 200 || c->resp.status > 205) {
             flb_error("[out_http] %s:%i, HTTP status=%i",
-                      ctx->host, ctx->port, c->resp.status);
+                      host, port, c->resp.status);
             out_ret = FLB_RETRY;
         }
         else {
             if (c->resp.payload) {
                 flb_info("[out_http] %s:%i, HTTP status=%i\n%s",
-                         ctx->host, ctx->port,
+                         host, port,
                          c->resp.status, c->resp.payload);
             }
             else {
                 flb_info("[out_http] %s:%i, HTTP status=%i",
-                         ctx->host, ctx->port,
+                         host, port,
                          c->resp.status);
             }
         }
     }
     else {
         flb_error("[out_http] could not flush records to %s:%i (http_do=%i)",
-                  ctx->host, ctx->port, ret);
+                  host, port, ret);
         out_ret = FLB_RETRY;
     }
 
@@ -486,13 +703,83 @@ void cb_http_flush(void *data, size_t bytes,
     /* Release the connection */
     flb_upstream_conn_release(u_conn);
 
-    if ((ctx->out_format == FLB_HTTP_OUT_JSON) ||
-        (ctx->out_format == FLB_HTTP_OUT_JSON_STREAM) ||
-        (ctx->out_format == FLB_HTTP_OUT_JSON_LINES)) {
+    if (body != data) {
         flb_free(body);
     }
 
-    FLB_OUTPUT_RETURN(out_ret);
+    return out_ret;
+}
+
+void cb_http_flush(void *data, size_t bytes,
+                        char *tag, int tag_len,
+                        struct flb_input_instance *i_ins,
+                        void *out_context,
+                        struct flb_config *config)
+{
+    int ret;
+    struct flb_out_http_config *ctx = out_context;
+    (void)i_ins;
+
+    ret = http_post(ctx, data, bytes, tag, tag_len, config);
+    FLB_OUTPUT_RETURN(ret);
+}
+
+/*
+ * Coalesced flush: the records of the chunks are concatenated in one
+ * request. With 'header_tag' a request only takes consecutive chunks of
+ * the same tag.
+ */
+void cb_http_flush_multi(struct flb_output_chunk *chunks, int chunks_num,
+                         void *out_context, struct flb_config *config)
+{
+    int i;
+    int j;
+    int k;
+    int ret;
+    char *buf;
+    size_t size;
+    struct flb_out_http_config *ctx = out_context;
+
+    for (i = 0; i < chunks_num; i = j) {
+        size = chunks[i].bytes;
+        for (j = i + 1; j < chunks_num; j++) {
+            if (ctx->header_tag &&
+                (chunks[j].tag_len != chunks[i].tag_len ||
+                 strncmp(chunks[j].tag, chunks[i].tag,
+                         chunks[i].tag_len) != 0)) {
+                break;
+            }
+            size += chunks[j].bytes;
+        }
+
+        if (j - i == 1) {
+            ret = http_post(ctx, chunks[i].data, chunks[i].bytes,
+                            chunks[i].tag, chunks[i].tag_len, config);
+        }
+        else {
+            buf = flb_malloc(size);
+            if (!buf) {
+                flb_errno();
+                ret = FLB_RETRY;
+            }
+            else {
+                size = 0;
+                for (k = i; k < j; k++) {
+                    memcpy(buf + size, chunks[k].data, chunks[k].bytes);
+                    size += chunks[k].bytes;
+                }
+                ret = http_post(ctx, buf, size,
+                                chunks[i].tag, chunks[i].tag_len, config);
+                flb_free(buf);
+            }
+        }
+
+        for (k = i; k < j; k++) {
+            chunks[k].ret = ret;
+        }
+    }
+
+    FLB_OUTPUT_RETURN(chunks[0].ret);
 }
 
 int cb_http_exit(void *data, struct flb_config *config)
@@ -502,6 +789,9 @@ int cb_http_exit(void *data, struct flb_config *config)
     if (ctx->u) {
         flb_upstream_destroy(ctx->u);
     }
+    if (ctx->ug) {
+        flb_upstream_group_destroy(ctx->ug);
+    }
 
     flb_free(ctx->http_user);
     flb_free(ctx->http_passwd);
@@ -521,6 +811,8 @@ struct flb_output_plugin out_http_plugin = {
     .cb_init = cb_http_init,
     .cb_pre_run = NULL,
     .cb_flush = cb_http_flush,
+    .cb_flush_multi = cb_http_flush_multi,
     .cb_exit = cb_http_exit,
-    .flags = FLB_OUTPUT_NET | FLB_IO_OPT_TLS,
+    .flags = FLB_OUTPUT_NET | FLB_IO_OPT_TLS | FLB_OUTPUT_SHARDS |
+             FLB_OUTPUT_HTTP2,
 };
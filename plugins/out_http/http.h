@@ -30,6 +30,7 @@
 #define FLB_JSON_DATE_ISO8601_FMT "%Y-%m-%dT%H:%M:%S"
 
 #define FLB_HTTP_CONTENT_TYPE   "Content-Type"
+#define FLB_HTTP_CONTENT_ENCODING "Content-Encoding"
 #define FLB_HTTP_MIME_MSGPACK   "application/msgpack"
 #define FLB_HTTP_MIME_JSON      "application/json"
 
@@ -45,6 +46,8 @@ struct flb_out_http_config {
 
     /* Output format */
     int out_format;
+    int compress_gzip;
+    int chunked;          /* stream JSON with chunked transfer encoding */
 
     int json_date_format;
     char *json_date_key;
@@ -59,8 +62,9 @@ struct flb_out_http_config {
     char *header_tag;
     size_t headertag_len;
 
-    /* Upstream connection to the backend server */
+    /* Upstream connection to the backend server, or the group of nodes */
     struct flb_upstream *u;
+    struct flb_upstream_group *ug;
 };
 
 #endif
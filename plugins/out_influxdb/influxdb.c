@@ -41,6 +41,193 @@ static int bool_value(char *v);
 static int is_tagged_key(struct flb_influxdb_config *ctx,
                          char *key, int kl, int type);
 
+/* Key of a record entry, returns -1 if it's not a string */
+static inline int influxdb_key(msgpack_object *k, char **key, int *key_len)
+{
+    if (k->type == MSGPACK_OBJECT_STR) {
+        *key = (char *) k->via.str.ptr;
+        *key_len = k->via.str.size;
+    }
+    else if (k->type == MSGPACK_OBJECT_BIN) {
+        *key = (char *) k->via.bin.ptr;
+        *key_len = k->via.bin.size;
+    }
+    else {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Text of a record value, numbers are formatted in 'tmp' (at least 64
+ * bytes). Returns -1 for values that are not written (nil or containers).
+ */
+static inline int influxdb_value(msgpack_object *v, char *tmp,
+                                 char **val, int *val_len, int *quote)
+{
+    *quote = FLB_FALSE;
+
+    switch (v->type) {
+    case MSGPACK_OBJECT_BOOLEAN:
+        if (v->via.boolean) {
+            *val = "TRUE";
+            *val_len = 4;
+        }
+        else {
+            *val = "FALSE";
+            *val_len = 5;
+        }
+        break;
+    case MSGPACK_OBJECT_POSITIVE_INTEGER:
+        *val = tmp;
+        *val_len = influxdb_bulk_format_u64(tmp, v->via.u64);
+        break;
+    case MSGPACK_OBJECT_NEGATIVE_INTEGER:
+        *val = tmp;
+        *val_len = influxdb_bulk_format_i64(tmp, v->via.i64);
+        break;
+    case MSGPACK_OBJECT_FLOAT:
+        *val = tmp;
+        *val_len = snprintf(tmp, 63, "%f", v->via.f64);
+        break;
+    case MSGPACK_OBJECT_STR:
+        *quote = FLB_TRUE;
+        *val = (char *) v->via.str.ptr;
+        *val_len = v->via.str.size;
+        break;
+    case MSGPACK_OBJECT_BIN:
+        *quote = FLB_TRUE;
+        *val = (char *) v->via.bin.ptr;
+        *val_len = v->via.bin.size;
+        break;
+    default:
+        /* Missing values are Null by default in InfluxDB */
+        return -1;
+    }
+
+    return 0;
+}
+
+static inline uint64_t influxdb_tags_hash(char *buf, int len)
+{
+    int i;
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (i = 0; i < len; i++) {
+        hash ^= (unsigned char) buf[i];
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+/*
+ * Write the tag set of a record to the bulk. The signature of the set (its
+ * raw keys and values) is composed first, the escaped text only needs to be
+ * rendered when it's not in the cache.
+ */
+static int influxdb_tags_append(struct flb_influxdb_config *ctx,
+                                struct influxdb_bulk *bulk,
+                                struct influxdb_bulk *sig,
+                                struct influxdb_bulk *tags,
+                                msgpack_object *map)
+{
+    int i;
+    int ret;
+    int quote;
+    int key_len;
+    int val_len;
+    uint32_t len;
+    uint64_t hash;
+    char q;
+    char *key;
+    char *val;
+    char tmp[64];
+    struct influxdb_tags *entry;
+
+    sig->len = 0;
+    tags->len = 0;
+    for (i = 0; i < map->via.map.size; i++) {
+        if (influxdb_key(&map->via.map.ptr[i].key, &key, &key_len) == -1 ||
+            influxdb_value(&map->via.map.ptr[i].val, tmp,
+                           &val, &val_len, &quote) == -1 ||
+            !is_tagged_key(ctx, key, key_len, map->via.map.ptr[i].val.type)) {
+            continue;
+        }
+
+        q = quote;
+        len = key_len;
+        if (influxdb_bulk_append_raw(sig, (char *) &len, sizeof(len)) == -1 ||
+            influxdb_bulk_append_raw(sig, key, key_len) == -1 ||
+            influxdb_bulk_append_raw(sig, &q, 1) == -1) {
+            return -1;
+        }
+        len = val_len;
+        if (influxdb_bulk_append_raw(sig, (char *) &len, sizeof(len)) == -1 ||
+            influxdb_bulk_append_raw(sig, val, val_len) == -1) {
+            return -1;
+        }
+    }
+
+    if (sig->len == 0) {
+        /* no tags */
+        return 0;
+    }
+
+    hash = influxdb_tags_hash(sig->ptr, sig->len);
+    entry = &ctx->tags_cache[hash % FLB_INFLUXDB_TAGS_CACHE];
+
+    pthread_mutex_lock(&ctx->tags_lock);
+    if (entry->str && entry->hash == hash && entry->sig_len == sig->len &&
+        memcmp(entry->sig, sig->ptr, sig->len) == 0) {
+        ret = influxdb_bulk_append_raw(bulk, entry->str, entry->str_len);
+        pthread_mutex_unlock(&ctx->tags_lock);
+        return ret;
+    }
+    pthread_mutex_unlock(&ctx->tags_lock);
+
+    /* Render the tag set */
+    for (i = 0; i < map->via.map.size; i++) {
+        if (influxdb_key(&map->via.map.ptr[i].key, &key, &key_len) == -1 ||
+            influxdb_value(&map->via.map.ptr[i].val, tmp,
+                           &val, &val_len, &quote) == -1 ||
+            !is_tagged_key(ctx, key, key_len, map->via.map.ptr[i].val.type)) {
+            continue;
+        }
+
+        ret = influxdb_bulk_append_kv(tags, ',', key, key_len,
+                                      val, val_len, quote);
+        if (ret == -1) {
+            return -1;
+        }
+    }
+
+    if (sig->len <= FLB_INFLUXDB_TAGS_MAX) {
+        pthread_mutex_lock(&ctx->tags_lock);
+        flb_free(entry->sig);
+        flb_free(entry->str);
+        entry->sig = flb_malloc(sig->len);
+        entry->str = flb_malloc(tags->len);
+        if (entry->sig && entry->str) {
+            memcpy(entry->sig, sig->ptr, sig->len);
+            memcpy(entry->str, tags->ptr, tags->len);
+            entry->hash = hash;
+            entry->sig_len = sig->len;
+            entry->str_len = tags->len;
+        }
+        else {
+            flb_free(entry->sig);
+            flb_free(entry->str);
+            entry->sig = NULL;
+            entry->str = NULL;
+        }
+        pthread_mutex_unlock(&ctx->tags_lock);
+    }
+
+    return influxdb_bulk_append_raw(bulk, tags->ptr, tags->len);
+}
+
 /*
  * Convert the internal Fluent Bit data representation to the required one
  * by InfluxDB.
@@ -51,22 +238,25 @@ static char *influxdb_format(char *tag, int tag_len,
 {
     int i;
     int ret;
-    int n_size;
+    int quote;
+    int key_len;
+    int val_len;
+    int fields;
+    uint32_t line;
     uint64_t seq = 0;
     size_t off = 0;
     char *buf;
-    char *str = NULL;
-    size_t str_size;
-    char tmp[128];
+    char *key;
+    char *val;
+    char tmp[64];
     msgpack_unpacked result;
     msgpack_object root;
     msgpack_object map;
     msgpack_object *obj;
     struct flb_time tm;
     struct influxdb_bulk *bulk = NULL;
-    struct influxdb_bulk *bulk_head = NULL;
-    struct influxdb_bulk *bulk_body = NULL;
-
+    struct influxdb_bulk *sig = NULL;
+    struct influxdb_bulk *tags = NULL;
 
     /* Iterate the original buffer and perform adjustments */
     msgpack_unpacked_init(&result);
@@ -97,13 +287,13 @@ static char *influxdb_format(char *tag, int tag_len,
         goto error;
     }
 
-    bulk_head = influxdb_bulk_create();
-    if (!bulk_head) {
+    sig = influxdb_bulk_create();
+    if (!sig) {
         goto error;
     }
 
-    bulk_body = influxdb_bulk_create();
-    if (!bulk_body) {
+    tags = influxdb_bulk_create();
+    if (!tags) {
         goto error;
     }
 
@@ -121,10 +311,11 @@ static char *influxdb_format(char *tag, int tag_len,
             continue;
         }
 
-
         flb_time_pop_from_msgpack(&tm, &result, &obj);
-        map    = root.via.array.ptr[1];
-        n_size = map.via.map.size + 1;
+        map = root.via.array.ptr[1];
+        if (map.type != MSGPACK_OBJECT_MAP) {
+            continue;
+        }
 
         seq = ctx->seq;
         if (ctx->seq + 1 >= 100000) {
@@ -134,7 +325,10 @@ static char *influxdb_format(char *tag, int tag_len,
             ctx->seq++;
         }
 
-        ret = influxdb_bulk_append_header(bulk_head,
+        /* Start of the line, a record without fields is rolled back */
+        line = bulk->len;
+
+        ret = influxdb_bulk_append_header(bulk,
                                           tag, tag_len,
                                           seq,
                                           ctx->seq_name, ctx->seq_len);
@@ -142,139 +336,50 @@ static char *influxdb_format(char *tag, int tag_len,
             goto error;
         }
 
-        for (i = 0; i < n_size - 1; i++) {
-            msgpack_object *k = &map.via.map.ptr[i].key;
-            msgpack_object *v = &map.via.map.ptr[i].val;
-
-            if (k->type != MSGPACK_OBJECT_BIN && k->type != MSGPACK_OBJECT_STR) {
-                continue;
-            }
-
-            int quote = FLB_FALSE;
-
-            /* key */
-            char *key = NULL;
-            int key_len;
-
-            /* val */
-            char *val = NULL;
-            int val_len;
-
-            if (k->type == MSGPACK_OBJECT_STR) {
-                key = (char *) k->via.str.ptr;
-                key_len = k->via.str.size;
-            }
-            else {
-                key = (char *) k->via.bin.ptr;
-                key_len = k->via.bin.size;
-            }
-
-            /* Store value */
-            if (v->type == MSGPACK_OBJECT_NIL) {
-                /* Missing values are Null by default in InfluxDB */
-                continue;
-            }
-            else if (v->type == MSGPACK_OBJECT_BOOLEAN) {
-                if (v->via.boolean) {
-                    val = "TRUE";
-                    val_len = 4;
-                }
-                else {
-                    val = "FALSE";
-                    val_len = 5;
-                }
-            }
-            else if (v->type == MSGPACK_OBJECT_POSITIVE_INTEGER) {
-                val = tmp;
-                val_len = snprintf(tmp, sizeof(tmp) - 1, "%" PRIu64, v->via.u64);
-            }
-            else if (v->type == MSGPACK_OBJECT_NEGATIVE_INTEGER) {
-                val = tmp;
-                val_len = snprintf(tmp, sizeof(tmp) - 1, "%" PRId64, v->via.i64);
-            }
-            else if (v->type == MSGPACK_OBJECT_FLOAT) {
-                val = tmp;
-                val_len = snprintf(tmp, sizeof(tmp) - 1, "%f", v->via.f64);
-            }
-            else if (v->type == MSGPACK_OBJECT_STR) {
-                /* String value */
-                quote   = FLB_TRUE;
-                val     = (char *) v->via.str.ptr;
-                val_len = v->via.str.size;
-            }
-            else if (v->type == MSGPACK_OBJECT_BIN) {
-                /* Bin value */
-                quote   = FLB_TRUE;
-                val     = (char *) v->via.bin.ptr;
-                val_len = v->via.bin.size;
-            }
+        ret = influxdb_tags_append(ctx, bulk, sig, tags, &map);
+        if (ret == -1) {
+            flb_error("[out_influxdb] cannot append tags");
+            goto error;
+        }
 
-            if (!val || !key) {
+        /* Fields */
+        fields = 0;
+        for (i = 0; i < map.via.map.size; i++) {
+            if (influxdb_key(&map.via.map.ptr[i].key, &key, &key_len) == -1 ||
+                influxdb_value(&map.via.map.ptr[i].val, tmp,
+                               &val, &val_len, &quote) == -1 ||
+                is_tagged_key(ctx, key, key_len,
+                              map.via.map.ptr[i].val.type)) {
                 continue;
             }
 
-            /* is this a string ? */
-            if (quote == FLB_TRUE) {
-                ret = flb_utils_write_str_buf(val, val_len,
-                                              &str, &str_size);
-                if (ret == -1) {
-                    flb_errno();
-                    goto error;
-                }
-
-                val = str;
-                val_len = str_size;
-            }
-
-            if (is_tagged_key(ctx, key, key_len, v->type)) {
-                /* Append key/value data into the bulk_head */
-                ret = influxdb_bulk_append_kv(bulk_head,
-                                              key, key_len,
-                                              val, val_len,
-                                              quote);
-            }
-            else {
-                /* Append key/value data into the bulk_body */
-                ret = influxdb_bulk_append_kv(bulk_body,
-                                              key, key_len,
-                                              val, val_len,
-                                              quote);
-            }
-
-            if (quote == FLB_TRUE) {
-                flb_free(str);
-                str_size = 0;
-            }
-
+            ret = influxdb_bulk_append_kv(bulk, fields == 0 ? ' ' : ',',
+                                          key, key_len,
+                                          val, val_len,
+                                          quote);
             if (ret == -1) {
                 flb_error("[out_influxdb] cannot append key/value");
                 goto error;
             }
+            fields++;
         }
 
         /* Check have data fields */
-        if (bulk_body->len > 0) {
+        if (fields > 0) {
             /* Append the timestamp */
-            ret = influxdb_bulk_append_timestamp(bulk_body, &tm);
+            ret = influxdb_bulk_append_timestamp(bulk, &tm);
             if (ret == -1) {
                 flb_error("[out_influxdb] cannot append timestamp");
                 goto error;
             }
-
-            /* Append collected data to final bulk */
-            if (influxdb_bulk_append_bulk(bulk, bulk_head, '\n') != 0 ||
-                influxdb_bulk_append_bulk(bulk, bulk_body, ' ') != 0) {
-                goto error;
-            }
-        } else {
+        }
+        else {
             flb_error("[out_influxdb] cannot send record, "
                       "because all field is tagged in record");
             /* Following records maybe ok, so continue processing */
+            bulk->len = line;
+            bulk->ptr[bulk->len] = '\0';
         }
-
-        /* Reset bulk_head and bulk_body */
-        bulk_head->len = 0;
-        bulk_body->len = 0;
     }
 
     msgpack_unpacked_destroy(&result);
@@ -288,8 +393,8 @@ static char *influxdb_format(char *tag, int tag_len,
      * return the bulk->ptr buffer
      */
     flb_free(bulk);
-    influxdb_bulk_destroy(bulk_head);
-    influxdb_bulk_destroy(bulk_body);
+    influxdb_bulk_destroy(sig);
+    influxdb_bulk_destroy(tags);
 
     return buf;
 
@@ -297,11 +402,11 @@ error:
     if (bulk != NULL) {
         influxdb_bulk_destroy(bulk);
     }
-    if (bulk_head != NULL) {
-        influxdb_bulk_destroy(bulk_head);
+    if (sig != NULL) {
+        influxdb_bulk_destroy(sig);
     }
-    if (bulk_body != NULL) {
-        influxdb_bulk_destroy(bulk_body);
+    if (tags != NULL) {
+        influxdb_bulk_destroy(tags);
     }
     msgpack_unpacked_destroy(&result);
     return NULL;
@@ -407,8 +512,19 @@ int cb_influxdb_init(struct flb_output_instance *ins, struct flb_config *config,
         return -1;
     }
     ctx->u   = upstream;
+    flb_output_upstream_set(ctx->u, ins);
     ctx->seq = 0;
 
+    ctx->tags_cache = flb_calloc(FLB_INFLUXDB_TAGS_CACHE,
+                                 sizeof(struct influxdb_tags));
+    if (!ctx->tags_cache) {
+        flb_errno();
+        flb_upstream_destroy(ctx->u);
+        flb_free(ctx);
+        return -1;
+    }
+    pthread_mutex_init(&ctx->tags_lock, NULL);
+
     flb_debug("[out_influxdb] host=%s port=%i", ins->host.name, ins->host.port);
     flb_output_set_context(ins, ctx);
 
@@ -481,6 +597,7 @@ void cb_influxdb_flush(void *data, size_t bytes,
 
 int cb_influxdb_exit(void *data, struct flb_config *config)
 {
+    int i;
     struct flb_influxdb_config *ctx = data;
 
     if (ctx->http_user) {
@@ -493,6 +610,13 @@ int cb_influxdb_exit(void *data, struct flb_config *config)
         flb_utils_split_free(ctx->tag_keys);
     }
 
+    for (i = 0; i < FLB_INFLUXDB_TAGS_CACHE; i++) {
+        flb_free(ctx->tags_cache[i].sig);
+        flb_free(ctx->tags_cache[i].str);
+    }
+    flb_free(ctx->tags_cache);
+    pthread_mutex_destroy(&ctx->tags_lock);
+
     flb_upstream_destroy(ctx->u);
     flb_free(ctx->db_name);
     flb_free(ctx->seq_name);
@@ -546,5 +670,5 @@ struct flb_output_plugin out_influxdb_plugin = {
     .cb_pre_run     = NULL,
     .cb_flush     = cb_influxdb_flush,
     .cb_exit      = cb_influxdb_exit,
-    .flags        = FLB_OUTPUT_NET | FLB_IO_OPT_TLS,
+    .flags        = FLB_OUTPUT_NET | FLB_IO_OPT_TLS | FLB_OUTPUT_SHARDS,
 };
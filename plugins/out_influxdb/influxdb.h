@@ -21,10 +21,27 @@
 #define FLB_OUT_INFLUXDB_H
 
 #include <fluent-bit/flb_output.h>
+#include <pthread.h>
 
 #define FLB_INFLUXDB_HOST "127.0.0.1"
 #define FLB_INFLUXDB_PORT 8086
 
+/*
+ * Rendered tag sets: metric streams repeat the same tag keys and values on
+ * every record, the escaped ',key=value' sequence is cached by the raw
+ * keys and values it was rendered from.
+ */
+#define FLB_INFLUXDB_TAGS_CACHE   256   /* slots, direct mapped      */
+#define FLB_INFLUXDB_TAGS_MAX    1024   /* bigger sets aren't cached */
+
+struct influxdb_tags {
+    uint64_t hash;
+    char *sig;                /* raw keys and values of the tag set */
+    int sig_len;
+    char *str;                /* rendered ',key=value' sequence     */
+    int str_len;
+};
+
 struct flb_influxdb_config {
     uint64_t seq;
 
@@ -48,6 +65,10 @@ struct flb_influxdb_config {
     /* tag_keys: space separated list of key */
     struct mk_list *tag_keys;
 
+    /* Tag sets cache, shared by the flushes of the instance */
+    struct influxdb_tags *tags_cache;
+    pthread_mutex_t tags_lock;
+
     /* Upstream connection to the backend server */
     struct flb_upstream *u;
 };
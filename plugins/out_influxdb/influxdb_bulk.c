@@ -22,6 +22,7 @@
 #include <string.h>
 
 #include <fluent-bit.h>
+#include <fluent-bit/flb_utils.h>
 #include "influxdb_bulk.h"
 
 static int influxdb_bulk_buffer(struct influxdb_bulk *bulk, int required)
@@ -32,7 +33,11 @@ static int influxdb_bulk_buffer(struct influxdb_bulk *bulk, int required)
 
     available = (bulk->size - bulk->len);
     if (available < required) {
-        new_size = bulk->size + available + required + INFLUXDB_BULK_CHUNK;
+        /* grow geometrically, a flush appends many small pieces */
+        new_size = bulk->size * 2;
+        if (new_size - bulk->len < required) {
+            new_size = bulk->len + required + INFLUXDB_BULK_CHUNK;
+        }
         ptr = flb_realloc(bulk->ptr, new_size);
         if (!ptr) {
             flb_errno();
@@ -45,6 +50,37 @@ static int influxdb_bulk_buffer(struct influxdb_bulk *bulk, int required)
     return 0;
 }
 
+/* Write the decimal digits of 'val', returns the number of bytes written */
+static inline int bulk_u64(char *buf, uint64_t val)
+{
+    int len;
+    char tmp[20];
+    char *p = tmp + sizeof(tmp);
+
+    do {
+        *--p = '0' + (val % 10);
+        val /= 10;
+    } while (val > 0);
+
+    len = (tmp + sizeof(tmp)) - p;
+    memcpy(buf, p, len);
+    return len;
+}
+
+int influxdb_bulk_format_u64(char *buf, uint64_t val)
+{
+    return bulk_u64(buf, val);
+}
+
+int influxdb_bulk_format_i64(char *buf, int64_t val)
+{
+    if (val < 0) {
+        buf[0] = '-';
+        return 1 + bulk_u64(buf + 1, 0 - (uint64_t) val);
+    }
+    return bulk_u64(buf, val);
+}
+
 struct influxdb_bulk *influxdb_bulk_create()
 {
     struct influxdb_bulk *b;
@@ -83,7 +119,7 @@ int influxdb_bulk_append_header(struct influxdb_bulk *bulk,
     int ret;
     int required;
 
-    required = tag_len + 1 + seq_len + 1 + 32;
+    required = 1 + tag_len + 1 + seq_len + 1 + 32;
 
     /* Make sure we have enough space */
     ret = influxdb_bulk_buffer(bulk, required);
@@ -91,6 +127,12 @@ int influxdb_bulk_append_header(struct influxdb_bulk *bulk,
         return -1;
     }
 
+    /* Every line but the first starts after a line break */
+    if (bulk->len > 0) {
+        bulk->ptr[bulk->len] = '\n';
+        bulk->len++;
+    }
+
     /* Tag, sequence and final space */
     memcpy(bulk->ptr + bulk->len, tag, tag_len);
     bulk->len += tag_len;
@@ -105,8 +147,7 @@ int influxdb_bulk_append_header(struct influxdb_bulk *bulk,
     bulk->ptr[bulk->len] = '=';
     bulk->len++;
 
-    ret = snprintf(bulk->ptr + bulk->len, 32, "%" PRIu64, seq_n);
-    bulk->len += ret;
+    bulk->len += bulk_u64(bulk->ptr + bulk->len, seq_n);
 
     /* Add a NULL byte for debugging purposes */
     bulk->ptr[bulk->len] = '\0';
@@ -114,18 +155,17 @@ int influxdb_bulk_append_header(struct influxdb_bulk *bulk,
     return 0;
 }
 
-int influxdb_bulk_append_kv(struct influxdb_bulk *bulk,
+int influxdb_bulk_append_kv(struct influxdb_bulk *bulk, char separator,
                             char *key, int k_len,
                             char *val, int v_len,
                             int quote)
 {
     int ret;
+    int off;
     int required;
 
-    required = k_len + 1 + v_len + 1 + 1;
-    if (quote) {
-        required += 2;
-    }
+    /* escaping can expand a byte up to six ('\uXXXX') */
+    required = 1 + k_len + 1 + (quote ? (v_len * 6) + 2 : v_len) + 1;
 
     /* Make sure we have enough space */
     ret = influxdb_bulk_buffer(bulk, required);
@@ -133,8 +173,8 @@ int influxdb_bulk_append_kv(struct influxdb_bulk *bulk,
         return -1;
     }
 
-    if (bulk->len > 0) {
-        bulk->ptr[bulk->len] = ',';
+    if (separator) {
+        bulk->ptr[bulk->len] = separator;
         bulk->len++;
     }
 
@@ -146,17 +186,22 @@ int influxdb_bulk_append_kv(struct influxdb_bulk *bulk,
     bulk->ptr[bulk->len] = '=';
     bulk->len++;
 
-    /* value */
+    /* value: strings are quoted and escaped */
     if (quote) {
         bulk->ptr[bulk->len] = '"';
         bulk->len++;
-    }
-    memcpy(bulk->ptr + bulk->len, val, v_len);
-    bulk->len += v_len;
-    if (quote) {
+
+        off = bulk->len;
+        flb_utils_write_str(bulk->ptr, &off, bulk->size - 2, val, v_len);
+        bulk->len = off;
+
         bulk->ptr[bulk->len] = '"';
         bulk->len++;
     }
+    else {
+        memcpy(bulk->ptr + bulk->len, val, v_len);
+        bulk->len += v_len;
+    }
 
     /* Add a NULL byte for debugging purposes */
     bulk->ptr[bulk->len] = '\0';
@@ -164,50 +209,38 @@ int influxdb_bulk_append_kv(struct influxdb_bulk *bulk,
     return 0;
 };
 
+int influxdb_bulk_append_raw(struct influxdb_bulk *bulk,
+                             char *data, int len)
+{
+    if (influxdb_bulk_buffer(bulk, len + 1) != 0) {
+        return -1;
+    }
+
+    memcpy(bulk->ptr + bulk->len, data, len);
+    bulk->len += len;
+    bulk->ptr[bulk->len] = '\0';
+
+    return 0;
+}
+
 int influxdb_bulk_append_timestamp(struct influxdb_bulk *bulk,
                                    struct flb_time *t)
 {
     int ret;
-    int len;
     uint64_t timestamp;
 
     /* Make sure we have enough space */
-    ret = influxdb_bulk_buffer(bulk, 128);
+    ret = influxdb_bulk_buffer(bulk, 32);
     if (ret != 0) {
         return -1;
     }
 
     /* Timestamp is in Nanoseconds */
     timestamp = (t->tm.tv_sec * 1000000000) + t->tm.tv_nsec;
-    len = snprintf(bulk->ptr + bulk->len, 127, " %" PRIu64, timestamp);
-    if (len == -1) {
-        return -1;
-    }
-    bulk->len += len;
+    bulk->ptr[bulk->len] = ' ';
+    bulk->len++;
+    bulk->len += bulk_u64(bulk->ptr + bulk->len, timestamp);
     bulk->ptr[bulk->len] = '\0';
 
     return 0;
 };
-
-int influxdb_bulk_append_bulk(struct influxdb_bulk *bulk_to,
-                              struct influxdb_bulk *bulk_from,
-                              char separator)
-{
-    if (influxdb_bulk_buffer(bulk_to, bulk_from->len + 2) != 0) {
-        return -1;
-    }
-
-    if (bulk_to->len > 0) {
-        bulk_to->ptr[bulk_to->len] = separator;
-        bulk_to->len += 1;
-    }
-
-    memcpy(bulk_to->ptr + bulk_to->len,
-           bulk_from->ptr, bulk_from->len * sizeof(char));
-    bulk_to->len += bulk_from->len;
-
-    /* Add a NULL byte for always terminating with NULL */
-    bulk_to->ptr[bulk_to->len] = '\0';
-
-    return 0;
-};
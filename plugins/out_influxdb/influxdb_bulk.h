@@ -38,17 +38,21 @@ int influxdb_bulk_append_header(struct influxdb_bulk *bulk,
                                 char *tag, int tag_len,
                                 uint64_t seq_n, char *seq, int seq_len);
 
-int influxdb_bulk_append_kv(struct influxdb_bulk *bulk,
+/* 'separator' goes before the key unless it's zero, quoted values are escaped */
+int influxdb_bulk_append_kv(struct influxdb_bulk *bulk, char separator,
                             char *key, int k_len,
                             char *val, int v_len,
                             int quote);
 
-int influxdb_bulk_append_bulk(struct influxdb_bulk *bulk_to,
-                              struct influxdb_bulk *bulk_from,
-                              char separator);
+int influxdb_bulk_append_raw(struct influxdb_bulk *bulk,
+                             char *data, int len);
 
 void influxdb_bulk_destroy(struct influxdb_bulk *bulk);
 int influxdb_bulk_append_timestamp(struct influxdb_bulk *bulk,
                                    struct flb_time *t);
 
+/* Decimal formatters, 'buf' needs room for 21 bytes */
+int influxdb_bulk_format_u64(char *buf, uint64_t val);
+int influxdb_bulk_format_i64(char *buf, int64_t val);
+
 #endif
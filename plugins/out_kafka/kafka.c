@@ -21,6 +21,7 @@
 #include <fluent-bit/flb_output.h>
 #include <fluent-bit/flb_time.h>
 #include <fluent-bit/flb_pack.h>
+#include <fluent-bit/flb_mp.h>
 
 #include "kafka_config.h"
 #include "kafka_topic.h"
@@ -28,6 +29,9 @@
 void cb_kafka_msg(rd_kafka_t *rk, const rd_kafka_message_t *rkmessage,
                   void *opaque)
 {
+    struct flb_kafka *ctx = opaque;
+    struct flb_kafka_arena *arena = rkmessage->_private;
+
     if (rkmessage->err) {
         flb_warn("[out_kafka] message delivery failed: %s",
                  rd_kafka_err2str(rkmessage->err));
@@ -37,6 +41,11 @@ void cb_kafka_msg(rd_kafka_t *rk, const rd_kafka_message_t *rkmessage,
                   "partition %"PRId32")",
                   rkmessage->len, rkmessage->partition);
     }
+
+    /* The payload lives in the flush arena, release it with its last user */
+    if (arena) {
+        flb_kafka_arena_unref(ctx, arena);
+    }
 }
 
 void cb_kafka_logger(const rd_kafka_t *rk, int level,
@@ -65,140 +74,140 @@ static int cb_kafka_init(struct flb_output_instance *ins,
     return 0;
 }
 
-int produce_message(struct flb_time *tm, msgpack_object *map,
-                    struct flb_kafka *ctx, struct flb_config *config)
+/* msgpack writer appending to the arena buffer */
+static int kafka_arena_write(void *data, const char *buf, size_t len)
 {
-    int i;
-    int ret;
-    int size;
-    int queue_full_retries = 0;
-    char *out_buf;
-    size_t out_size;
-    struct flb_kafka_topic *topic = NULL;
-    msgpack_sbuffer mp_sbuf;
-    msgpack_packer mp_pck;
-    msgpack_object key;
-    msgpack_object val;
+    flb_sds_t tmp;
+    flb_sds_t *s = data;
 
-    /* Init temporal buffers */
-    msgpack_sbuffer_init(&mp_sbuf);
-    msgpack_packer_init(&mp_pck, &mp_sbuf, msgpack_sbuffer_write);
+    tmp = flb_sds_cat(*s, (char *) buf, len);
+    if (!tmp) {
+        return -1;
+    }
+    *s = tmp;
+    return 0;
+}
 
-    /* Make room for the timestamp */
-    size = map->via.map.size + 1;
-    msgpack_pack_map(&mp_pck, size);
+/*
+ * Encode one record at the end of the arena: the map gets the timestamp
+ * as its first entry followed by the original ones, written as JSON or
+ * msgpack without building an intermediate copy of the record. The topic
+ * selected by 'topic_key' and the 'message_key_field' value (if any) are
+ * set on the message, both can be nested keys like $a['b'].
+ */
+static int kafka_format_record(struct flb_kafka *ctx, flb_sds_t *buf,
+                               struct flb_time *tm, msgpack_object *map,
+                               struct flb_kafka_topic **topic,
+                               rd_kafka_message_t *msg)
+{
+    int i;
+    int len;
+    char *str;
+    msgpack_object ts_key;
+    msgpack_object ts_val;
+    msgpack_object *key;
+    msgpack_object *val;
+    msgpack_packer mp_pck;
 
-    /* Pack timestamp */
-    msgpack_pack_str(&mp_pck, ctx->timestamp_key_len);
-    msgpack_pack_str_body(&mp_pck,
-                          ctx->timestamp_key, ctx->timestamp_key_len);
-    msgpack_pack_double(&mp_pck, flb_time_to_double(tm));
+    ts_key.type = MSGPACK_OBJECT_STR;
+    ts_key.via.str.ptr = ctx->timestamp_key;
+    ts_key.via.str.size = ctx->timestamp_key_len;
+    ts_val.type = MSGPACK_OBJECT_FLOAT;
+    ts_val.via.f64 = flb_time_to_double(tm);
+
+    if (ctx->format == FLB_KAFKA_FMT_MSGP) {
+        msgpack_packer_init(&mp_pck, buf, kafka_arena_write);
+        if (msgpack_pack_map(&mp_pck, map->via.map.size + 1) != 0 ||
+            msgpack_pack_object(&mp_pck, ts_key) != 0 ||
+            msgpack_pack_object(&mp_pck, ts_val) != 0) {
+            return -1;
+        }
+    }
+    else if (kafka_arena_write(buf, "{", 1) == -1 ||
+             flb_msgpack_to_json_sds(buf, &ts_key) == -1 ||
+             kafka_arena_write(buf, ":", 1) == -1 ||
+             flb_msgpack_to_json_sds(buf, &ts_val) == -1) {
+        return -1;
+    }
 
     for (i = 0; i < map->via.map.size; i++) {
-        key = map->via.map.ptr[i].key;
-        val = map->via.map.ptr[i].val;
-
-        msgpack_pack_object(&mp_pck, key);
-        msgpack_pack_object(&mp_pck, val);
-
-        /* Lookup key/topic */
-        if (ctx->topic_key && !topic && val.type == MSGPACK_OBJECT_STR) {
-            if (key.via.str.size == ctx->topic_key_len &&
-                strncmp(key.via.str.ptr, ctx->topic_key, ctx->topic_key_len) == 0) {
-                topic = flb_kafka_topic_lookup((char *) val.via.str.ptr,
-                                               val.via.str.size,
-                                               ctx);
+        key = &map->via.map.ptr[i].key;
+        val = &map->via.map.ptr[i].val;
+
+        if (ctx->format == FLB_KAFKA_FMT_MSGP) {
+            if (msgpack_pack_object(&mp_pck, *key) != 0 ||
+                msgpack_pack_object(&mp_pck, *val) != 0) {
+                return -1;
             }
         }
+        else if (kafka_arena_write(buf, ", ", 2) == -1 ||
+                 flb_msgpack_to_json_sds(buf, key) == -1 ||
+                 kafka_arena_write(buf, ":", 1) == -1 ||
+                 flb_msgpack_to_json_sds(buf, val) == -1) {
+            return -1;
+        }
     }
 
-    if (ctx->format == FLB_KAFKA_FMT_JSON) {
-        ret = flb_msgpack_raw_to_json_str(mp_sbuf.data, mp_sbuf.size,
-                                          &out_buf, &out_size);
-        if (ret != 0) {
-            flb_error("[out_kafka] error encoding to JSON");
-            msgpack_sbuffer_destroy(&mp_sbuf);
-            return FLB_ERROR;
-        }
+    /* Lookup topic */
+    if (ctx->ra_topic_key &&
+        flb_ra_get_str(ctx->ra_topic_key, *map, &str, &len) == 0) {
+        *topic = flb_kafka_topic_lookup(str, len, ctx);
     }
-    else if (ctx->format == FLB_KAFKA_FMT_MSGP) {
-        out_buf = mp_sbuf.data;
-        out_size = mp_sbuf.size;
+
+    /* Lookup message key, rdkafka keeps its own copy */
+    if (ctx->ra_message_key_field &&
+        flb_ra_get_str(ctx->ra_message_key_field, *map, &str, &len) == 0) {
+        msg->key = str;
+        msg->key_len = len;
     }
 
-    if (!topic) {
-        topic = flb_kafka_topic_default(ctx);
+    if (ctx->format == FLB_KAFKA_FMT_JSON) {
+        return kafka_arena_write(buf, "}", 1);
     }
-    if (!topic) {
-        flb_error("[out_kafka] no default topic found");
-        msgpack_sbuffer_destroy(&mp_sbuf);
-        return FLB_ERROR;
+    return 0;
+}
+
+/*
+ * Hand a run of messages for the same topic to rdkafka, returns FLB_OK or
+ * FLB_RETRY if its queue got full. Enqueued messages reference the arena.
+ */
+static int kafka_produce(struct flb_kafka *ctx, struct flb_kafka_topic *topic,
+                         rd_kafka_message_t *msgs, int count,
+                         struct flb_kafka_arena *arena)
+{
+    int i;
+    int ret;
+
+    /* A new batch is a good time to move to another partition */
+    if (ctx->partitioner == FLB_KAFKA_PART_STICKY) {
+        topic->sticky_left = 0;
     }
 
- retry:
-    if (queue_full_retries >= 10) {
-        if (ctx->format == FLB_KAFKA_FMT_JSON) {
-            flb_free(out_buf);
-        }
-        msgpack_sbuffer_destroy(&mp_sbuf);
-        return FLB_RETRY;
+    __sync_add_and_fetch(&arena->pending, count);
+    ret = rd_kafka_produce_batch(topic->tp, RD_KAFKA_PARTITION_UA, 0,
+                                 msgs, count);
+    if (ret == count) {
+        flb_debug("[out_kafka] enqueued %i messages for topic '%s'",
+                  count, rd_kafka_topic_name(topic->tp));
+        return FLB_OK;
     }
 
-    ret = rd_kafka_produce(topic->tp,
-                           RD_KAFKA_PARTITION_UA,
-                           RD_KAFKA_MSG_F_COPY,
-                           out_buf, out_size,
-                           ctx->message_key, ctx->message_key_len,
-                           NULL);
-    if (ret == -1) {
-        fprintf(stderr,
-                "%% Failed to produce to topic %s: %s\n",
-                rd_kafka_topic_name(topic->tp),
-                rd_kafka_err2str(rd_kafka_last_error()));
-
-        /*
-         * rdkafka queue is full, keep trying 'locally' for a few seconds,
-         * otherwise let the caller to issue a main retry againt the engine.
-         */
-        if (rd_kafka_last_error() == RD_KAFKA_RESP_ERR__QUEUE_FULL) {
+    /* Drop the references of the messages that were not enqueued */
+    __sync_sub_and_fetch(&arena->pending, count - ret);
+
+    for (i = 0; i < count; i++) {
+        if (msgs[i].err == RD_KAFKA_RESP_ERR__QUEUE_FULL) {
             flb_warn("[out_kafka] internal queue is full, "
-                     "retrying in one second");
-
-            /*
-             * If the queue is full, first make sure to discard any further
-             * flush request from the engine. This means 'the caller will
-             * issue a retry at a later time'.
-             */
-            ctx->blocked = FLB_TRUE;
-
-            /*
-             * Next step is to give it some time to the background rdkafka
-             * library to do it own work. By default rdkafka wait 1 second
-             * or up to 10000 messages to be enqueued before delivery.
-             *
-             * If the kafka broker is down we should try a couple of times
-             * to enqueue this message, if we exceed 10 times, we just
-             * issue a full retry of the data chunk.
-             */
-            flb_time_sleep(1000, config);
-
-            /* Issue a re-try */
-            queue_full_retries++;
-            goto retry;
+                     "retrying the chunk later");
+            return FLB_RETRY;
+        }
+        if (msgs[i].err) {
+            flb_error("[out_kafka] failed to produce to topic %s: %s",
+                      rd_kafka_topic_name(topic->tp),
+                      rd_kafka_err2str(msgs[i].err));
         }
-    }
-    else {
-        flb_debug("[out_kafka] enqueued message (%zd bytes) for topic '%s'",
-                  out_size, rd_kafka_topic_name(topic->tp));
-    }
-    ctx->blocked = FLB_FALSE;
-
-    rd_kafka_poll(ctx->producer, 0);
-    if (ctx->format == FLB_KAFKA_FMT_JSON) {
-        flb_free(out_buf);
     }
 
-    msgpack_sbuffer_destroy(&mp_sbuf);
     return FLB_OK;
 }
 
@@ -209,40 +218,103 @@ static void cb_kafka_flush(void *data, size_t bytes,
                            struct flb_config *config)
 {
 
-    int ret;
+    int i;
+    int n = 0;
+    int run;
+    int ret = FLB_OK;
+    int records;
     size_t off = 0;
+    size_t len;
+    char *payload;
     struct flb_kafka *ctx = out_context;
+    struct flb_kafka_topic *topic;
+    struct flb_kafka_topic *def_topic;
+    struct flb_kafka_topic **topics;
+    struct flb_kafka_arena *arena;
     struct flb_time tms;
     msgpack_object *obj;
     msgpack_unpacked result;
+    rd_kafka_message_t *msgs;
+
+    /* Serve delivery reports, it releases the arenas already delivered */
+    rd_kafka_poll(ctx->producer, 0);
 
     /*
-     * If the context is blocked, means rdkafka queue is full and no more
-     * messages can be appended. For our called (Fluent Bit engine) means
-     * that is not possible to work on this now and it need to 'retry'.
+     * rdkafka have it own buffering queue. If the records of this chunk
+     * do not fit, let the engine retry it later instead of enqueueing part
+     * of it and wait for the queue to drain.
      */
-    if (ctx->blocked == FLB_TRUE) {
+    records = flb_mp_count(data, bytes);
+    if (records <= 0) {
+        FLB_OUTPUT_RETURN(FLB_OK);
+    }
+    if (rd_kafka_outq_len(ctx->producer) + records > ctx->queue_max_messages) {
+        flb_debug("[out_kafka] internal queue is full, retrying the chunk");
         FLB_OUTPUT_RETURN(FLB_RETRY);
     }
 
-    /* Iterate the original buffer and perform adjustments */
+    def_topic = flb_kafka_topic_default(ctx);
+    if (!def_topic) {
+        flb_error("[out_kafka] no default topic found");
+        FLB_OUTPUT_RETURN(FLB_ERROR);
+    }
+
+    msgs = flb_calloc(records, sizeof(rd_kafka_message_t));
+    topics = flb_malloc(records * sizeof(struct flb_kafka_topic *));
+    arena = flb_kafka_arena_create(ctx, bytes + (bytes / 2));
+    if (!msgs || !topics || !arena) {
+        flb_errno();
+        flb_free(msgs);
+        flb_free(topics);
+        if (arena) {
+            flb_kafka_arena_unref(ctx, arena);
+        }
+        FLB_OUTPUT_RETURN(FLB_RETRY);
+    }
+
+    /* Encode all the records back to back */
     msgpack_unpacked_init(&result);
-    while (msgpack_unpack_next(&result, data, bytes, &off)) {
+    while (n < records && msgpack_unpack_next(&result, data, bytes, &off)) {
         flb_time_pop_from_msgpack(&tms, &result, &obj);
 
-        ret = produce_message(&tms, obj, ctx, config);
-        if (ret == FLB_ERROR) {
-            msgpack_unpacked_destroy(&result);
-            FLB_OUTPUT_RETURN(FLB_ERROR);
+        topic = NULL;
+        len = flb_sds_len(arena->buf);
+        if (kafka_format_record(ctx, &arena->buf, &tms, obj,
+                                &topic, &msgs[n]) == -1) {
+            flb_error("[out_kafka] error encoding record");
+            ret = FLB_ERROR;
+            break;
         }
-        else if (ret == FLB_RETRY) {
-            msgpack_unpacked_destroy(&result);
-            FLB_OUTPUT_RETURN(FLB_RETRY);
+        msgs[n].len = flb_sds_len(arena->buf) - len;
+        topics[n] = topic ? topic : def_topic;
+        n++;
+    }
+    msgpack_unpacked_destroy(&result);
+
+    /* The arena does not move anymore, point the messages to it */
+    payload = arena->buf;
+    for (i = 0; i < n && ret == FLB_OK; i++) {
+        msgs[i].payload = payload;
+        if (!msgs[i].key) {
+            msgs[i].key = ctx->message_key;
+            msgs[i].key_len = ctx->message_key_len;
         }
+        msgs[i]._private = arena;
+        payload += msgs[i].len;
     }
 
-    msgpack_unpacked_destroy(&result);
-    FLB_OUTPUT_RETURN(FLB_OK);
+    /* Produce consecutive messages for the same topic as one batch */
+    for (i = 0; i < n && ret == FLB_OK; i += run) {
+        for (run = 1; i + run < n && topics[i + run] == topics[i]; run++);
+        ret = kafka_produce(ctx, topics[i], msgs + i, run, arena);
+    }
+
+    flb_kafka_arena_unref(ctx, arena);
+    flb_free(msgs);
+    flb_free(topics);
+
+    rd_kafka_poll(ctx->producer, 0);
+    FLB_OUTPUT_RETURN(ret);
 }
 
 static int cb_kafka_exit(void *data, struct flb_config *config)
@@ -259,5 +331,5 @@ struct flb_output_plugin out_kafka_plugin = {
     .cb_init      = cb_kafka_init,
     .cb_flush     = cb_kafka_flush,
     .cb_exit      = cb_kafka_exit,
-    .flags        = 0
+    .flags        = FLB_OUTPUT_SHARDS
 };
@@ -32,6 +32,7 @@ struct flb_kafka *flb_kafka_conf_create(struct flb_output_instance *ins,
     int ret;
     char *tmp;
     char errstr[512];
+    size_t size;
     struct mk_list *head;
     struct mk_list *topics;
     struct flb_split_entry *entry;
@@ -44,7 +45,9 @@ struct flb_kafka *flb_kafka_conf_create(struct flb_output_instance *ins,
         flb_errno();
         return NULL;
     }
-    ctx->blocked = FLB_FALSE;
+    mk_list_init(&ctx->topics);
+    mk_list_init(&ctx->arenas);
+    pthread_mutex_init(&ctx->arenas_lock, NULL);
 
     /* rdkafka config context */
     ctx->conf = rd_kafka_conf_new();
@@ -97,14 +100,22 @@ struct flb_kafka *flb_kafka_conf_create(struct flb_output_instance *ins,
     }
 
     /* Callback: message delivery */
+    rd_kafka_conf_set_opaque(ctx->conf, ctx);
     rd_kafka_conf_set_dr_msg_cb(ctx->conf, cb_kafka_msg);
 
     /* Callback: log */
     rd_kafka_conf_set_log_cb(ctx->conf, cb_kafka_logger);
 
-    /* Config: Topic_Key */
+    /* Config: Topic_Key, a record key or a path like $a['b'] */
     tmp = flb_output_get_property("topic_key", ins);
     if (tmp) {
+        ctx->ra_topic_key = flb_ra_create(tmp);
+        if (!ctx->ra_topic_key) {
+            flb_error("[out_kafka] invalid topic_key '%s'", tmp);
+            rd_kafka_conf_destroy(ctx->conf);
+            flb_kafka_conf_destroy(ctx);
+            return NULL;
+        }
         ctx->topic_key = flb_strdup(tmp);
         ctx->topic_key_len = strlen(tmp);
     }
@@ -137,6 +148,41 @@ struct flb_kafka *flb_kafka_conf_create(struct flb_output_instance *ins,
         ctx->timestamp_key_len = 0;
     }
 
+    /* Config: Message_Key_Field */
+    tmp = flb_output_get_property("message_key_field", ins);
+    if (tmp) {
+        ctx->ra_message_key_field = flb_ra_create(tmp);
+        if (!ctx->ra_message_key_field) {
+            flb_error("[out_kafka] invalid message_key_field '%s'", tmp);
+            rd_kafka_conf_destroy(ctx->conf);
+            flb_kafka_conf_destroy(ctx);
+            return NULL;
+        }
+        ctx->message_key_field = flb_strdup(tmp);
+        ctx->message_key_field_len = strlen(tmp);
+    }
+
+    /* Config: Partitioner */
+    ctx->partitioner = FLB_KAFKA_PART_DEFAULT;
+    tmp = flb_output_get_property("partitioner", ins);
+    if (tmp) {
+        if (strcasecmp(tmp, "random") == 0) {
+            ctx->partitioner = FLB_KAFKA_PART_RANDOM;
+        }
+        else if (strcasecmp(tmp, "hash") == 0) {
+            ctx->partitioner = FLB_KAFKA_PART_HASH;
+        }
+        else if (strcasecmp(tmp, "sticky") == 0) {
+            ctx->partitioner = FLB_KAFKA_PART_STICKY;
+        }
+        else {
+            flb_error("[out_kafka] invalid partitioner '%s'", tmp);
+            rd_kafka_conf_destroy(ctx->conf);
+            flb_kafka_conf_destroy(ctx);
+            return NULL;
+        }
+    }
+
     /* Config: Timestamp_Key */
     tmp = flb_output_get_property("timestamp_key", ins);
     if (tmp) {
@@ -148,6 +194,28 @@ struct flb_kafka *flb_kafka_conf_create(struct flb_output_instance *ins,
         ctx->timestamp_key_len = strlen(FLB_KAFKA_TS_KEY);
     }
 
+    /* Queue capacity, the configuration is owned by the producer later */
+    size = sizeof(errstr);
+    ret = rd_kafka_conf_get(ctx->conf, "queue.buffering.max.messages",
+                            errstr, &size);
+    if (ret == RD_KAFKA_CONF_OK) {
+        ctx->queue_max_messages = atoi(errstr);
+    }
+    if (ctx->queue_max_messages <= 0) {
+        ctx->queue_max_messages = FLB_KAFKA_QUEUE_MAX;
+    }
+
+    /* A sticky partition is kept for up to one batch */
+    size = sizeof(errstr);
+    ret = rd_kafka_conf_get(ctx->conf, "batch.num.messages",
+                            errstr, &size);
+    if (ret == RD_KAFKA_CONF_OK) {
+        ctx->batch_num_messages = atoi(errstr);
+    }
+    if (ctx->batch_num_messages <= 0) {
+        ctx->batch_num_messages = FLB_KAFKA_BATCH_MAX;
+    }
+
     /* Kafka Producer */
     ctx->producer = rd_kafka_new(RD_KAFKA_PRODUCER, ctx->conf,
                                  errstr, sizeof(errstr));
@@ -159,7 +227,6 @@ struct flb_kafka *flb_kafka_conf_create(struct flb_output_instance *ins,
     }
 
     /* Config: Topic */
-    mk_list_init(&ctx->topics);
     tmp = flb_output_get_property("topics", ins);
     if (!tmp) {
         flb_kafka_topic_create(FLB_KAFKA_TOPIC, ctx);
@@ -187,12 +254,72 @@ struct flb_kafka *flb_kafka_conf_create(struct flb_output_instance *ins,
     return ctx;
 }
 
+struct flb_kafka_arena *flb_kafka_arena_create(struct flb_kafka *ctx,
+                                               size_t size)
+{
+    struct flb_kafka_arena *arena;
+
+    arena = flb_malloc(sizeof(struct flb_kafka_arena));
+    if (!arena) {
+        flb_errno();
+        return NULL;
+    }
+
+    arena->buf = flb_sds_create_size(size);
+    if (!arena->buf) {
+        flb_errno();
+        flb_free(arena);
+        return NULL;
+    }
+
+    /* The flush holds one reference until all messages are enqueued */
+    arena->pending = 1;
+
+    pthread_mutex_lock(&ctx->arenas_lock);
+    mk_list_add(&arena->_head, &ctx->arenas);
+    pthread_mutex_unlock(&ctx->arenas_lock);
+
+    return arena;
+}
+
+static void kafka_arena_destroy(struct flb_kafka_arena *arena)
+{
+    mk_list_del(&arena->_head);
+    flb_sds_destroy(arena->buf);
+    flb_free(arena);
+}
+
+/*
+ * Drop one reference: delivery reports may be served by any thread that
+ * polls the producer, the last one releases the arena.
+ */
+void flb_kafka_arena_unref(struct flb_kafka *ctx,
+                           struct flb_kafka_arena *arena)
+{
+    if (__sync_sub_and_fetch(&arena->pending, 1) > 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&ctx->arenas_lock);
+    kafka_arena_destroy(arena);
+    pthread_mutex_unlock(&ctx->arenas_lock);
+}
+
 int flb_kafka_conf_destroy(struct flb_kafka *ctx)
 {
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct flb_kafka_arena *arena;
+
     if (!ctx) {
         return 0;
     }
 
+    /* Give queued messages a chance to be delivered */
+    if (ctx->producer) {
+        rd_kafka_flush(ctx->producer, FLB_KAFKA_FLUSH_TIMEOUT);
+    }
+
     if (ctx->brokers) {
         flb_free(ctx->brokers);
     }
@@ -203,14 +330,31 @@ int flb_kafka_conf_destroy(struct flb_kafka *ctx)
         rd_kafka_destroy(ctx->producer);
     }
 
+    /* rdkafka dropped the messages still queued, release their payloads */
+    mk_list_foreach_safe(head, tmp, &ctx->arenas) {
+        arena = mk_list_entry(head, struct flb_kafka_arena, _head);
+        kafka_arena_destroy(arena);
+    }
+    pthread_mutex_destroy(&ctx->arenas_lock);
+
     if (ctx->topic_key) {
         flb_free(ctx->topic_key);
     }
+    if (ctx->ra_topic_key) {
+        flb_ra_destroy(ctx->ra_topic_key);
+    }
 
     if (ctx->message_key) {
         flb_free(ctx->message_key);
     }
 
+    if (ctx->message_key_field) {
+        flb_free(ctx->message_key_field);
+    }
+    if (ctx->ra_message_key_field) {
+        flb_ra_destroy(ctx->ra_message_key_field);
+    }
+
     flb_free(ctx);
     return 0;
 }
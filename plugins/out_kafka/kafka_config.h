@@ -22,6 +22,10 @@
 
 #include <fluent-bit/flb_info.h>
 #include <fluent-bit/flb_output.h>
+#include <fluent-bit/flb_sds.h>
+#include <fluent-bit/flb_record_accessor.h>
+
+#include <pthread.h>
 
 #include "rdkafka.h"
 
@@ -31,13 +35,39 @@
 #define FLB_KAFKA_TOPIC     "fluent-bit"
 #define FLB_KAFKA_TS_KEY    "@timestamp"
 
+/* Partitioners */
+#define FLB_KAFKA_PART_DEFAULT  0      /* rdkafka 'partitioner' property */
+#define FLB_KAFKA_PART_RANDOM   1
+#define FLB_KAFKA_PART_HASH     2      /* murmur2 of the key, Java compatible */
+#define FLB_KAFKA_PART_STICKY   3
+#define FLB_KAFKA_QUEUE_MAX 100000     /* queue.buffering.max.messages */
+#define FLB_KAFKA_BATCH_MAX 10000      /* batch.num.messages */
+#define FLB_KAFKA_FLUSH_TIMEOUT 5000   /* exit: wait for deliveries (ms) */
+
 struct flb_kafka_topic {
     int name_len;
     char *name;
+
+    /* Sticky partitioner: current partition and messages left for it */
+    int32_t sticky_partition;
+    int sticky_left;
+    int sticky_batch;
+
     rd_kafka_topic_t *tp;
     struct mk_list _head;
 };
 
+/*
+ * Payloads of one flush are encoded back to back in a single buffer that
+ * rdkafka references without copying. It is released once every message
+ * it holds got its delivery report.
+ */
+struct flb_kafka_arena {
+    int pending;                   /* messages not reported yet */
+    flb_sds_t buf;
+    struct mk_list _head;
+};
+
 struct flb_kafka {
     /* Config Parameters */
     int format;
@@ -46,6 +76,7 @@ struct flb_kafka {
     /* Optional topic key for routing */
     int topic_key_len;
     char *topic_key;
+    struct flb_record_accessor *ra_topic_key;
 
     int timestamp_key_len;
     char *timestamp_key;
@@ -53,20 +84,28 @@ struct flb_kafka {
     int message_key_len;
     char *message_key;
 
+    /* Optional record field used as message key */
+    int message_key_field_len;
+    char *message_key_field;
+    struct flb_record_accessor *ra_message_key_field;
+
+    int partitioner;
+    int batch_num_messages;
+
     /* Head of defined topics by configuration */
     struct mk_list topics;
 
     /*
-     * Blocked Status: since rdkafka have it own buffering queue, there is a
-     * chance that the queue becomes full, when that happens our default
-     * behavior is the following:
-     *
-     * - out_kafka yields and try to continue every second until it succeed. In
-     *   the meanwhile blocked flag gets FLB_TRUE value.
-     * - when flushing more records and blocked == FLB_TRUE, issue
-     *   a retry.
+     * Queue room: rdkafka have it own buffering queue bounded by
+     * 'queue.buffering.max.messages'. Before a chunk is enqueued we check
+     * that all its records fit, otherwise the engine is asked to retry the
+     * chunk later instead of waiting for the queue to drain.
      */
-    int blocked;
+    int queue_max_messages;
+
+    /* Payload buffers still referenced by rdkafka (struct flb_kafka_arena) */
+    struct mk_list arenas;
+    pthread_mutex_t arenas_lock;
 
     /* Internal */
     rd_kafka_t *producer;
@@ -76,5 +115,9 @@ struct flb_kafka {
 struct flb_kafka *flb_kafka_conf_create(struct flb_output_instance *ins,
                                         struct flb_config *config);
 int flb_kafka_conf_destroy(struct flb_kafka *ctx);
+struct flb_kafka_arena *flb_kafka_arena_create(struct flb_kafka *ctx,
+                                               size_t size);
+void flb_kafka_arena_unref(struct flb_kafka *ctx,
+                           struct flb_kafka_arena *arena);
 
 #endif
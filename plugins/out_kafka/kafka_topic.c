@@ -24,22 +24,71 @@
 #include "kafka_config.h"
 #include "rdkafka.h"
 
+/*
+ * Sticky partitioner: messages stick to one available partition until a
+ * batch worth of them was assigned, then another one is picked at random.
+ * Partitions get full batches instead of many tiny ones.
+ */
+static int32_t cb_partitioner_sticky(const rd_kafka_topic_t *rkt,
+                                     const void *key, size_t key_len,
+                                     int32_t partition_cnt,
+                                     void *rkt_opaque, void *msg_opaque)
+{
+    struct flb_kafka_topic *topic = rkt_opaque;
+
+    if (topic->sticky_left <= 0 ||
+        topic->sticky_partition >= partition_cnt ||
+        !rd_kafka_topic_partition_available(rkt, topic->sticky_partition)) {
+        topic->sticky_partition =
+            rd_kafka_msg_partitioner_random(rkt, key, key_len, partition_cnt,
+                                            rkt_opaque, msg_opaque);
+        topic->sticky_left = topic->sticky_batch;
+    }
+
+    topic->sticky_left--;
+    return topic->sticky_partition;
+}
+
 struct flb_kafka_topic *flb_kafka_topic_create(char *name,
                                                struct flb_kafka *ctx)
 {
     rd_kafka_topic_t *tp;
+    rd_kafka_topic_conf_t *conf;
     struct flb_kafka_topic *topic;
 
-    tp = rd_kafka_topic_new(ctx->producer, name, NULL);
-    if (!tp) {
-        flb_error("[out_kafka] failed to create topic: %s",
-                  rd_kafka_err2str(rd_kafka_last_error()));
+    topic = flb_calloc(1, sizeof(struct flb_kafka_topic));
+    if (!topic) {
+        flb_errno();
         return NULL;
     }
+    topic->sticky_batch = ctx->batch_num_messages;
 
-    topic = flb_malloc(sizeof(struct flb_kafka_topic));
-    if (!topic) {
-        flb_errno();
+    /* Topic configuration, it inherits the rdkafka.* topic properties */
+    conf = rd_kafka_default_topic_conf_dup(ctx->producer);
+    if (!conf) {
+        flb_error("[out_kafka] cannot create topic configuration");
+        flb_free(topic);
+        return NULL;
+    }
+    rd_kafka_topic_conf_set_opaque(conf, topic);
+
+    if (ctx->partitioner == FLB_KAFKA_PART_RANDOM) {
+        rd_kafka_topic_conf_set_partitioner_cb(conf,
+                                               rd_kafka_msg_partitioner_random);
+    }
+    else if (ctx->partitioner == FLB_KAFKA_PART_HASH) {
+        rd_kafka_topic_conf_set_partitioner_cb(conf,
+                                    rd_kafka_msg_partitioner_murmur2_random);
+    }
+    else if (ctx->partitioner == FLB_KAFKA_PART_STICKY) {
+        rd_kafka_topic_conf_set_partitioner_cb(conf, cb_partitioner_sticky);
+    }
+
+    tp = rd_kafka_topic_new(ctx->producer, name, conf);
+    if (!tp) {
+        flb_error("[out_kafka] failed to create topic: %s",
+                  rd_kafka_err2str(rd_kafka_last_error()));
+        flb_free(topic);
         return NULL;
     }
 
@@ -22,149 +22,173 @@
 #include <fluent-bit/flb_utils.h>
 #include <fluent-bit/flb_time.h>
 #include <fluent-bit/flb_pack.h>
+#include <fluent-bit/flb_sds.h>
 #include <fluent-bit/flb_http_client.h>
 #include <msgpack.h>
 
 #include "kafka.h"
 #include "kafka_conf.h"
 
+static inline int kafka_rest_cat(flb_sds_t *buf, char *str, int len)
+{
+    flb_sds_t tmp;
+
+    tmp = flb_sds_cat(*buf, str, len);
+    if (!tmp) {
+        flb_errno();
+        return -1;
+    }
+    *buf = tmp;
+    return 0;
+}
+
+/* Append a JSON string */
+static inline int kafka_rest_cat_str(flb_sds_t *buf, char *str, int len)
+{
+    if (kafka_rest_cat(buf, "\"", 1) == -1 ||
+        flb_utils_write_str_sds(buf, str, len) == -1) {
+        return -1;
+    }
+    return kafka_rest_cat(buf, "\"", 1);
+}
+
 /*
- * Convert the internal Fluent Bit data representation to the required
- * one by Kafka REST Proxy.
+ * Append one record of the Kafka REST Proxy 'records' array. The JSON is
+ * written straight from the msgpack record:
+ *
+ *   {"partition": N, "key": "...", "value": {time_key, tag_key, ...}}
  */
-static char *kafka_rest_format(void *data, size_t bytes,
-                               char *tag, int tag_len, size_t *out_size,
-                               struct flb_kafka_rest *ctx)
+static int kafka_rest_format_record(struct flb_kafka_rest *ctx, flb_sds_t *buf,
+                                    char *tag, int tag_len,
+                                    struct flb_time *tms, msgpack_object *map)
 {
     int i;
-    int ret;
     int len;
-    int arr_size = 0;
-    int map_size;
     size_t s;
-    size_t off = 0;
-    char time_formatted[256];
-    msgpack_unpacked result;
-    msgpack_object root;
-    msgpack_object map;
-    msgpack_object *obj;
-    msgpack_object key;
-    msgpack_object val;
-    char *json_buf;
-    size_t json_size;
+    char tmp[256];
     struct tm tm;
-    struct flb_time tms;
-    msgpack_sbuffer mp_sbuf;
-    msgpack_packer mp_pck;
-
-    /* Init temporal buffers */
-    msgpack_sbuffer_init(&mp_sbuf);
-    msgpack_packer_init(&mp_pck, &mp_sbuf, msgpack_sbuffer_write);
 
-    /* Iterate the original buffer and perform adjustments */
-    msgpack_unpacked_init(&result);
-
-    /* Count number of entries */
-    while (msgpack_unpack_next(&result, data, bytes, &off)) {
-        arr_size++;
+    if (kafka_rest_cat(buf, "{", 1) == -1) {
+        return -1;
     }
-    msgpack_unpacked_destroy(&result);
-    off = 0;
-
-    /* Root map */
-    msgpack_pack_map(&mp_pck, 1);
-    msgpack_pack_str(&mp_pck, 7);
-    msgpack_pack_str_body(&mp_pck, "records", 7);
-
-    msgpack_pack_array(&mp_pck, arr_size);
-
-    /* Iterate and compose array content */
-    msgpack_unpacked_init(&result);
-    while (msgpack_unpack_next(&result, data, bytes, &off)) {
-        root = result.data;
-
-        map = root.via.array.ptr[1];
-        map_size = 1;
-
-        flb_time_pop_from_msgpack(&tms, &result, &obj);
 
-        if (ctx->partition >= 0) {
-            map_size++;
-        }
-
-        if (ctx->message_key != NULL) {
-            map_size++;
+    if (ctx->partition >= 0) {
+        len = snprintf(tmp, sizeof(tmp) - 1, "\"partition\":%li,",
+                       ctx->partition);
+        if (kafka_rest_cat(buf, tmp, len) == -1) {
+            return -1;
         }
+    }
 
-        msgpack_pack_map(&mp_pck, map_size);
-        if (ctx->partition >= 0) {
-            msgpack_pack_str(&mp_pck, 9);
-            msgpack_pack_str_body(&mp_pck, "partition", 9);
-            msgpack_pack_int64(&mp_pck, ctx->partition);
+    if (ctx->message_key != NULL) {
+        if (kafka_rest_cat(buf, "\"key\":", 6) == -1 ||
+            kafka_rest_cat_str(buf, ctx->message_key,
+                               ctx->message_key_len) == -1 ||
+            kafka_rest_cat(buf, ",", 1) == -1) {
+            return -1;
         }
+    }
 
+    /* Time key and time formatted */
+    gmtime_r(&tms->tm.tv_sec, &tm);
+    s = strftime(tmp, sizeof(tmp) - 1, ctx->time_key_format, &tm);
+    len = snprintf(tmp + s, sizeof(tmp) - 1 - s,
+                   ".%" PRIu64 "Z", (uint64_t) tms->tm.tv_nsec);
+    s += len;
+
+    if (kafka_rest_cat(buf, "\"value\":{", 9) == -1 ||
+        kafka_rest_cat_str(buf, ctx->time_key, ctx->time_key_len) == -1 ||
+        kafka_rest_cat(buf, ":", 1) == -1 ||
+        kafka_rest_cat_str(buf, tmp, s) == -1) {
+        return -1;
+    }
 
-        if (ctx->message_key != NULL) {
-            msgpack_pack_str(&mp_pck, 3);
-            msgpack_pack_str_body(&mp_pck, "key", 3);
-            msgpack_pack_str(&mp_pck, ctx->message_key_len);
-            msgpack_pack_str_body(&mp_pck, ctx->message_key, ctx->message_key_len);
+    /* Tag Key */
+    if (ctx->include_tag_key == FLB_TRUE) {
+        if (kafka_rest_cat(buf, ",", 1) == -1 ||
+            kafka_rest_cat_str(buf, ctx->tag_key, ctx->tag_key_len) == -1 ||
+            kafka_rest_cat(buf, ":", 1) == -1 ||
+            kafka_rest_cat_str(buf, tag, tag_len) == -1) {
+            return -1;
         }
+    }
 
-        /* Value Map Size */
-        map_size = map.via.map.size;
-        map_size++;
-        if (ctx->include_tag_key == FLB_TRUE) {
-            map_size++;
+    for (i = 0; i < map->via.map.size; i++) {
+        if (kafka_rest_cat(buf, ",", 1) == -1 ||
+            flb_msgpack_to_json_sds(buf, &map->via.map.ptr[i].key) == -1 ||
+            kafka_rest_cat(buf, ":", 1) == -1 ||
+            flb_msgpack_to_json_sds(buf, &map->via.map.ptr[i].val) == -1) {
+            return -1;
         }
+    }
 
-        msgpack_pack_str(&mp_pck, 5);
-        msgpack_pack_str_body(&mp_pck, "value", 5);
-
-        msgpack_pack_map(&mp_pck, map_size);
-
-        /* Time key and time formatted */
-        msgpack_pack_str(&mp_pck, ctx->time_key_len);
-        msgpack_pack_str_body(&mp_pck, ctx->time_key, ctx->time_key_len);
-
-        /* Format the time */
-        gmtime_r(&tms.tm.tv_sec, &tm);
-        s = strftime(time_formatted, sizeof(time_formatted) - 1,
-                     ctx->time_key_format, &tm);
-        len = snprintf(time_formatted + s, sizeof(time_formatted) - 1 - s,
-                       ".%" PRIu64 "Z", (uint64_t) tms.tm.tv_nsec);
-        s += len;
-        msgpack_pack_str(&mp_pck, s);
-        msgpack_pack_str_body(&mp_pck, time_formatted, s);
-
-        /* Tag Key */
-        if (ctx->include_tag_key == FLB_TRUE) {
-            msgpack_pack_str(&mp_pck, ctx->tag_key_len);
-            msgpack_pack_str_body(&mp_pck, ctx->tag_key, ctx->tag_key_len);
-            msgpack_pack_str(&mp_pck, tag_len);
-            msgpack_pack_str_body(&mp_pck, tag, tag_len);
-        }
+    return kafka_rest_cat(buf, "}}", 2);
+}
 
-        for (i = 0; i < map.via.map.size; i++) {
-            key = map.via.map.ptr[i].key;
-            val = map.via.map.ptr[i].val;
+/* Post one request, returns FLB_OK or FLB_RETRY */
+static int kafka_rest_send(struct flb_kafka_rest *ctx,
+                           struct flb_upstream_conn *u_conn,
+                           char *body, size_t size)
+{
+    int ret;
+    int out_ret = FLB_OK;
+    size_t b_sent;
+    struct flb_http_client *c;
 
-            msgpack_pack_object(&mp_pck, key);
-            msgpack_pack_object(&mp_pck, val);
-        }
+    /* Compose HTTP Client request */
+    c = flb_http_client(u_conn, FLB_HTTP_POST, ctx->uri,
+                        body, size, NULL, 0, NULL, 0);
+    if (!c) {
+        return FLB_RETRY;
     }
-    msgpack_unpacked_destroy(&result);
+    flb_http_add_header(c, "User-Agent", 10, "Fluent-Bit", 10);
+    flb_http_add_header(c,
+                        "Content-Type", 12,
+                        "application/vnd.kafka.json.v2+json", 34);
 
-    /* Convert to JSON */
-    ret = flb_msgpack_raw_to_json_str(mp_sbuf.data, mp_sbuf.size,
-                                      &json_buf, &json_size);
-    msgpack_sbuffer_destroy(&mp_sbuf);
+    if (ctx->http_user && ctx->http_passwd) {
+        flb_http_basic_auth(c, ctx->http_user, ctx->http_passwd);
+    }
+
+    ret = flb_http_do(c, &b_sent);
     if (ret != 0) {
-        return NULL;
+        flb_warn("[out_kafka_rest] http_do=%i", ret);
+        out_ret = FLB_RETRY;
+    }
+    else {
+        /* The request was issued successfully, validate the 'error' field */
+        flb_debug("[out_kafka_rest] HTTP Status=%i", c->resp.status);
+        if (c->resp.payload_size > 0) {
+            flb_debug("[out_kafka_rest] Kafka REST response\n%s",
+                      c->resp.payload);
+        }
+        if (c->resp.status != 200 || c->resp.payload_size == 0) {
+            out_ret = FLB_RETRY;
+        }
     }
 
-    *out_size = json_size;
-    return json_buf;
+    flb_http_client_destroy(c);
+    return out_ret;
+}
+
+/*
+ * Send the records written up to 'size' while a new record follows in the
+ * buffer: the two bytes after them are borrowed to close the envelope.
+ */
+static int kafka_rest_send_part(struct flb_kafka_rest *ctx,
+                                struct flb_upstream_conn *u_conn,
+                                flb_sds_t payload, size_t size)
+{
+    int ret;
+    char tmp[2];
+
+    memcpy(tmp, payload + size, 2);
+    payload[size] = ']';
+    payload[size + 1] = '}';
+    ret = kafka_rest_send(ctx, u_conn, payload, size + 2);
+    memcpy(payload + size, tmp, 2);
+
+    return ret;
 }
 
 static int cb_kafka_init(struct flb_output_instance *ins,
@@ -195,79 +219,100 @@ static void cb_kafka_flush(void *data, size_t bytes,
                            void *out_context,
                            struct flb_config *config)
 {
-    int ret;
-    char *js;
-    size_t js_size;
-    size_t b_sent;
-    struct flb_http_client *c;
+    int ret = FLB_OK;
+    int records = 0;
+    size_t off = 0;
+    size_t hdr;
+    size_t prev;
+    size_t len;
+    struct flb_time tms;
     struct flb_upstream_conn *u_conn;
     struct flb_kafka_rest *ctx = out_context;
+    msgpack_unpacked result;
+    msgpack_object root;
+    msgpack_object *obj;
+    flb_sds_t payload;
     (void) i_ins;
-    (void) tag;
-    (void) tag_len;
+    (void) config;
+
+    payload = flb_sds_create_size(ctx->payload_max > 0 &&
+                                  ctx->payload_max < bytes * 1.5 ?
+                                  ctx->payload_max + 1024 : bytes * 1.5);
+    if (!payload) {
+        flb_errno();
+        FLB_OUTPUT_RETURN(FLB_RETRY);
+    }
+    kafka_rest_cat(&payload, "{\"records\":[", 12);
+    hdr = flb_sds_len(payload);
 
     /* Get upstream connection */
     u_conn = flb_upstream_conn_get(ctx->u);
     if (!u_conn) {
+        flb_sds_destroy(payload);
         FLB_OUTPUT_RETURN(FLB_RETRY);
     }
 
-    /* Convert format */
-    js = kafka_rest_format(data, bytes, tag, tag_len, &js_size, ctx);
-    if (!js) {
-        flb_upstream_conn_release(u_conn);
-        FLB_OUTPUT_RETURN(FLB_ERROR);
-    }
+    /*
+     * Records are appended to the envelope and a request is sent once it
+     * holds 'records_max' records or goes over 'payload_max' bytes, a
+     * record bigger than the cap goes in its own request.
+     */
+    msgpack_unpacked_init(&result);
+    while (ret == FLB_OK &&
+           msgpack_unpack_next(&result, data, bytes, &off)) {
+        root = result.data;
+        if (root.type != MSGPACK_OBJECT_ARRAY || root.via.array.size != 2 ||
+            root.via.array.ptr[1].type != MSGPACK_OBJECT_MAP) {
+            continue;
+        }
+        flb_time_pop_from_msgpack(&tms, &result, &obj);
 
-    /* Compose HTTP Client request */
-    c = flb_http_client(u_conn, FLB_HTTP_POST, ctx->uri,
-                        js, js_size, NULL, 0, NULL, 0);
-    flb_http_add_header(c, "User-Agent", 10, "Fluent-Bit", 10);
-    flb_http_add_header(c,
-                        "Content-Type", 12,
-                        "application/vnd.kafka.json.v2+json", 34);
+        if (ctx->records_max > 0 && records == ctx->records_max) {
+            if (kafka_rest_cat(&payload, "]}", 2) == -1) {
+                ret = FLB_RETRY;
+                break;
+            }
+            ret = kafka_rest_send(ctx, u_conn, payload, flb_sds_len(payload));
+            if (ret != FLB_OK) {
+                break;
+            }
+            flb_sds_len_set(payload, hdr);
+            records = 0;
+        }
 
-    if (ctx->http_user && ctx->http_passwd) {
-        flb_http_basic_auth(c, ctx->http_user, ctx->http_passwd);
-    }
+        prev = flb_sds_len(payload);
+        if ((records > 0 && kafka_rest_cat(&payload, ",", 1) == -1) ||
+            kafka_rest_format_record(ctx, &payload, tag, tag_len, &tms,
+                                     &root.via.array.ptr[1]) == -1) {
+            ret = FLB_RETRY;
+            break;
+        }
+        records++;
 
-    ret = flb_http_do(c, &b_sent);
-    if (ret != 0) {
-        flb_warn("[out_kafka_rest] http_do=%i", ret);
-        goto retry;
-    }
-    else {
-        /* The request was issued successfully, validate the 'error' field */
-        flb_debug("[out_kafka_rest] HTTP Status=%i", c->resp.status);
-        if (c->resp.status != 200) {
-            if (c->resp.payload_size > 0) {
-                flb_debug("[out_kafka_rest] Kafka REST response\n%s",
-                          c->resp.payload);
-            }
-            goto retry;
+        len = flb_sds_len(payload);
+        if (ctx->payload_max > 0 && len > ctx->payload_max && records > 1) {
+            ret = kafka_rest_send_part(ctx, u_conn, payload, prev);
+
+            /* the record left starts with the separator */
+            memmove(payload + hdr, payload + prev + 1, len - prev - 1);
+            flb_sds_len_set(payload, hdr + len - prev - 1);
+            records = 1;
         }
+    }
+    msgpack_unpacked_destroy(&result);
 
-        if (c->resp.payload_size > 0) {
-            flb_debug("[out_kafka_rest] Kafka REST response\n%s",
-                      c->resp.payload);
+    if (ret == FLB_OK && records > 0) {
+        if (kafka_rest_cat(&payload, "]}", 2) == -1) {
+            ret = FLB_RETRY;
         }
         else {
-            goto retry;
+            ret = kafka_rest_send(ctx, u_conn, payload, flb_sds_len(payload));
         }
     }
 
-    /* Cleanup */
-    flb_http_client_destroy(c);
-    flb_free(js);
-    flb_upstream_conn_release(u_conn);
-    FLB_OUTPUT_RETURN(FLB_OK);
-
-    /* Issue a retry */
- retry:
-    flb_http_client_destroy(c);
-    flb_free(js);
+    flb_sds_destroy(payload);
     flb_upstream_conn_release(u_conn);
-    FLB_OUTPUT_RETURN(FLB_RETRY);
+    FLB_OUTPUT_RETURN(ret);
 }
 
 int cb_kafka_exit(void *data, struct flb_config *config)
@@ -284,5 +329,6 @@ struct flb_output_plugin out_kafka_rest_plugin = {
     .cb_init      = cb_kafka_init,
     .cb_flush     = cb_kafka_flush,
     .cb_exit      = cb_kafka_exit,
-    .flags        = FLB_OUTPUT_NET | FLB_IO_OPT_TLS,
+    .flags        = FLB_OUTPUT_NET | FLB_OUTPUT_KEEPALIVE | FLB_IO_OPT_TLS |
+                    FLB_OUTPUT_SHARDS,
 };
@@ -51,6 +51,10 @@ struct flb_kafka_rest {
     /* HTTP URI */
     char uri[256];
 
+    /* Request caps, bigger flushes are split (zero is unlimited) */
+    int records_max;
+    size_t payload_max;
+
     /* Upstream connection to the backend server */
     struct flb_upstream *u;
 };
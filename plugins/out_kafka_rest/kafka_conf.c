@@ -75,6 +75,7 @@ struct flb_kafka_rest *flb_kafka_conf_create(struct flb_output_instance *ins,
         return NULL;
     }
     ctx->u = upstream;
+    flb_output_upstream_set(ctx->u, ins);
 
     /* HTTP Auth */
     tmp = flb_output_get_property("http_user", ins);
@@ -180,6 +181,28 @@ struct flb_kafka_rest *flb_kafka_conf_create(struct flb_output_instance *ins,
         ctx->message_key_len = 0;
     }
 
+    /* Maximum records and bytes of a request */
+    tmp = flb_output_get_property("records_max", ins);
+    if (tmp) {
+        ctx->records_max = atoi(tmp);
+        if (ctx->records_max < 0) {
+            flb_error("[out_kafka_rest] invalid records_max '%s'", tmp);
+            flb_kafka_conf_destroy(ctx);
+            return NULL;
+        }
+    }
+
+    tmp = flb_output_get_property("payload_max", ins);
+    if (tmp) {
+        ssize_t size = flb_utils_size_to_bytes(tmp);
+        if (size < 0) {
+            flb_error("[out_kafka_rest] invalid payload_max '%s'", tmp);
+            flb_kafka_conf_destroy(ctx);
+            return NULL;
+        }
+        ctx->payload_max = size;
+    }
+
     return ctx;
 }
 
@@ -24,6 +24,7 @@
 #include <fluent-bit/flb_pack.h>
 #include <fluent-bit/flb_time.h>
 #include <fluent-bit/flb_lib.h>
+#include <fluent-bit/flb_mp.h>
 #include <msgpack.h>
 
 #include "out_lib.h"
@@ -46,6 +47,9 @@ static int configure(struct flb_out_lib_config *ctx,
         else if (strcasecmp(tmp, FLB_FMT_STR_JSON) == 0) {
             ctx->format = FLB_OUT_LIB_FMT_JSON;
         }
+        else if (strcasecmp(tmp, FLB_FMT_STR_CHUNK) == 0) {
+            ctx->format = FLB_OUT_LIB_FMT_CHUNK;
+        }
     }
 
     return 0;
@@ -93,12 +97,62 @@ static int out_lib_init(struct flb_output_instance *ins,
     return 0;
 }
 
+/*
+ * Hand the whole flush to the callback: the chunk is copied once next to
+ * its tag and the records are only counted, not unpacked. A negative
+ * return value from the callback asks for a retry.
+ */
+static int out_lib_flush_chunk(struct flb_out_lib_config *ctx,
+                               void *data, size_t bytes,
+                               char *tag, int tag_len)
+{
+    int ret;
+    int records = 0;
+    size_t off = 0;
+    size_t size;
+    char *p;
+    struct flb_lib_chunk *chunk;
+
+    while (off < bytes) {
+        if (flb_mp_object_size((char *) data + off, bytes - off, &size) == -1) {
+            flb_error("[out_lib] invalid chunk");
+            return FLB_ERROR;
+        }
+        off += size;
+        records++;
+    }
+
+    p = flb_malloc(sizeof(struct flb_lib_chunk) + bytes + tag_len + 1);
+    if (!p) {
+        flb_errno();
+        return FLB_RETRY;
+    }
+
+    chunk = (struct flb_lib_chunk *) p;
+    chunk->data = p + sizeof(struct flb_lib_chunk);
+    chunk->size = bytes;
+    chunk->records = records;
+    chunk->tag = chunk->data + bytes;
+    chunk->tag_len = tag_len;
+    memcpy(chunk->data, data, bytes);
+    memcpy(chunk->tag, tag, tag_len);
+    chunk->tag[tag_len] = '\0';
+
+    ret = ctx->cb_func(chunk, bytes, ctx->cb_data);
+    if (ret < 0) {
+        return FLB_RETRY;
+    }
+
+    return FLB_OK;
+}
+
 static void out_lib_flush(void *data, size_t bytes,
                           char *tag, int tag_len,
                           struct flb_input_instance *i_ins,
                           void *out_context,
                           struct flb_config *config)
 {
+    int ret;
     int len;
     size_t off = 0;
     size_t last_off = 0;
@@ -114,22 +168,26 @@ static void out_lib_flush(void *data, size_t bytes,
     struct flb_out_lib_config *ctx = out_context;
     (void) i_ins;
     (void) config;
-    (void) tag;
-    (void) tag_len;
+
+    if (ctx->format == FLB_OUT_LIB_FMT_CHUNK) {
+        ret = out_lib_flush_chunk(ctx, data, bytes, tag, tag_len);
+        FLB_OUTPUT_RETURN(ret);
+    }
 
     msgpack_unpacked_init(&result);
     while (msgpack_unpack_next(&result, data, bytes, &off)) {
         switch(ctx->format) {
         case FLB_OUT_LIB_FMT_MSGPACK:
-            /* copy raw bytes */
-            data_for_user = flb_malloc(bytes);
+            /* copy the raw bytes of the record */
+            data_size = off - last_off;
+            data_for_user = flb_malloc(data_size);
             if (!data_for_user) {
                 flb_errno();
                 msgpack_unpacked_destroy(&result);
                 FLB_OUTPUT_RETURN(FLB_ERROR);
             }
-            memcpy(data_for_user, &result.data, bytes);
-            data_size = bytes;
+            memcpy(data_for_user, (char *) data + last_off, data_size);
+            last_off = off;
             break;
         case FLB_OUT_LIB_FMT_JSON:
             /* JSON is larger than msgpack */
@@ -183,5 +241,5 @@ struct flb_output_plugin out_lib_plugin = {
     .cb_init      = out_lib_init,
     .cb_flush     = out_lib_flush,
     .cb_exit      = out_lib_exit,
-    .flags        = 0,
+    .flags        = FLB_OUTPUT_SHARDS,
 };
@@ -23,11 +23,13 @@
 enum {
     FLB_OUT_LIB_FMT_MSGPACK = 0,
     FLB_OUT_LIB_FMT_JSON,
+    FLB_OUT_LIB_FMT_CHUNK,
     FLB_OUT_LIB_FMT_ERROR,
 };
 
 #define FLB_FMT_STR_MSGPACK "msgpack"
 #define FLB_FMT_STR_JSON    "json"
+#define FLB_FMT_STR_CHUNK   "chunk"
 
 struct flb_out_lib_config {
     int format;
@@ -17,11 +17,13 @@
  *  limitations under the License.
  */
 
+
 #include <fluent-bit/flb_info.h>
 #include <fluent-bit/flb_output.h>
 #include <fluent-bit/flb_utils.h>
 #include <fluent-bit/flb_pack.h>
 #include <fluent-bit/flb_time.h>
+#include <fluent-bit/flb_sds.h>
 
 #include <stdio.h>
 #include <msgpack.h>
@@ -32,6 +34,7 @@ int cb_nats_init(struct flb_output_instance *ins, struct flb_config *config,
                    void *data)
 {
     int io_flags;
+    char *tmp;
     struct flb_upstream *upstream;
     struct flb_out_nats_config *ctx;
 
@@ -44,7 +47,7 @@ int cb_nats_init(struct flb_output_instance *ins, struct flb_config *config,
     }
 
     /* Allocate plugin context */
-    ctx = flb_malloc(sizeof(struct flb_out_nats_config));
+    ctx = flb_calloc(1, sizeof(struct flb_out_nats_config));
     if (!ctx) {
         perror("malloc");
         return -1;
@@ -59,95 +62,236 @@ int cb_nats_init(struct flb_output_instance *ins, struct flb_config *config,
     upstream = flb_upstream_create(config,
                                    ins->host.name,
                                    ins->host.port,
-                                   FLB_IO_TCP,
+                                   io_flags,
                                    NULL);
     if (!upstream) {
         flb_free(ctx);
         return -1;
     }
+
+    /* Keepalive settings of the instance */
+    flb_output_upstream_set(upstream, ins);
+
     ctx->u   = upstream;
     ctx->ins = ins;
+
+    /* Config: Subject */
+    tmp = flb_output_get_property("subject", ins);
+    if (tmp) {
+        ctx->subject = flb_strdup(tmp);
+        ctx->subject_len = strlen(tmp);
+    }
+
+    /* Config: Message_Per_Record */
+    tmp = flb_output_get_property("message_per_record", ins);
+    if (tmp) {
+        ctx->message_per_record = flb_utils_bool(tmp);
+    }
+
     flb_output_set_context(ins, ctx);
 
     return 0;
 }
 
-static int msgpack_to_json(void *data, size_t bytes,
-                           char *tag, int tag_len,
-                           char **out_json, size_t *out_size)
+static inline int nats_cat(flb_sds_t *buf, char *str, int len)
+{
+    flb_sds_t tmp;
+
+    tmp = flb_sds_cat(*buf, str, len);
+    if (!tmp) {
+        flb_errno();
+        return -1;
+    }
+    *buf = tmp;
+    return 0;
+}
+
+/* Append one record as [time, {"tag": tag, ...}] */
+static int nats_format_record(flb_sds_t *buf, msgpack_object *root,
+                              char *tag, int tag_len)
 {
     int i;
-    int ret;
-    int map_size;
-    size_t off = 0;
-    size_t array_size = 0;
+    struct flb_time tm;
     msgpack_object map;
-    msgpack_object root;
-    msgpack_object m_key;
-    msgpack_object m_val;
-    msgpack_packer   mp_pck;
-    msgpack_sbuffer  mp_sbuf;
+    msgpack_object ts;
+    msgpack_object tag_obj;
+
+    flb_time_msgpack_to_time(&tm, &root->via.array.ptr[0]);
+    map = root->via.array.ptr[1];
+
+    ts.type = MSGPACK_OBJECT_FLOAT;
+    ts.via.f64 = flb_time_to_double(&tm);
+    tag_obj.type = MSGPACK_OBJECT_STR;
+    tag_obj.via.str.ptr = tag;
+    tag_obj.via.str.size = tag_len;
+
+    if (nats_cat(buf, "[", 1) == -1 ||
+        flb_msgpack_to_json_sds(buf, &ts) == -1 ||
+        nats_cat(buf, ", {\"tag\":", 9) == -1 ||
+        flb_msgpack_to_json_sds(buf, &tag_obj) == -1) {
+        return -1;
+    }
+
+    for (i = 0; i < map.via.map.size; i++) {
+        if (nats_cat(buf, ", ", 2) == -1 ||
+            flb_msgpack_to_json_sds(buf, &map.via.map.ptr[i].key) == -1 ||
+            nats_cat(buf, ":", 1) == -1 ||
+            flb_msgpack_to_json_sds(buf, &map.via.map.ptr[i].val) == -1) {
+            return -1;
+        }
+    }
+
+    return nats_cat(buf, "}]", 2);
+}
+
+/* Append a PUB frame with the payload */
+static int nats_pub(flb_sds_t *buf, char *subject, int subject_len,
+                    char *payload, size_t size)
+{
+    int len;
+    char tmp[32];
+
+    len = snprintf(tmp, sizeof(tmp) - 1, " %zu\r\n", size);
+    if (nats_cat(buf, "PUB ", 4) == -1 ||
+        nats_cat(buf, subject, subject_len) == -1 ||
+        nats_cat(buf, tmp, len) == -1 ||
+        nats_cat(buf, payload, size) == -1) {
+        return -1;
+    }
+    return nats_cat(buf, "\r\n", 2);
+}
+
+/*
+ * Compose the PUB frames of the chunk into 'buf': a single message with
+ * the JSON array of all records or one message per record.
+ */
+static int nats_format(struct flb_out_nats_config *ctx, flb_sds_t *buf,
+                       void *data, size_t bytes, char *tag, int tag_len)
+{
+    int ret = 0;
+    int count = 0;
+    size_t off = 0;
+    char *subject = tag;
+    int subject_len = tag_len;
+    flb_sds_t json;
     msgpack_unpacked result;
-    msgpack_object *obj;
-    struct flb_time tm;
-    char *json_buf;
-    size_t json_size;
 
-    /* Iterate the original buffer and perform adjustments */
-    msgpack_unpacked_init(&result);
-    while (msgpack_unpack_next(&result, data, bytes, &off)) {
-        array_size++;
+    if (ctx->subject) {
+        subject = ctx->subject;
+        subject_len = ctx->subject_len;
     }
-    msgpack_unpacked_destroy(&result);
-    msgpack_unpacked_init(&result);
-    off = 0;
 
-    /* Convert MsgPack to JSON */
-    msgpack_sbuffer_init(&mp_sbuf);
-    msgpack_packer_init(&mp_pck, &mp_sbuf, msgpack_sbuffer_write);
-    msgpack_pack_array(&mp_pck, array_size);
+    /* The JSON of the message being composed */
+    json = flb_sds_create_size_arena(flb_output_arena(),
+                                     bytes + (bytes / 2));
+    if (!json) {
+        flb_errno();
+        return -1;
+    }
 
+    msgpack_unpacked_init(&result);
     while (msgpack_unpack_next(&result, data, bytes, &off)) {
-        if (result.data.type != MSGPACK_OBJECT_ARRAY) {
+        if (result.data.type != MSGPACK_OBJECT_ARRAY ||
+            result.data.via.array.size != 2 ||
+            result.data.via.array.ptr[1].type != MSGPACK_OBJECT_MAP) {
             continue;
         }
-        root = result.data;
-
-        flb_time_pop_from_msgpack(&tm, &result, &obj);
-        map    = root.via.array.ptr[1];
-        map_size = map.via.map.size;
 
-        msgpack_pack_array(&mp_pck, 2);
-        msgpack_pack_double(&mp_pck, flb_time_to_double(&tm));
-
-        msgpack_pack_map(&mp_pck, map_size + 1);
-        msgpack_pack_str(&mp_pck, 3);
-        msgpack_pack_str_body(&mp_pck, "tag", 3);
-        msgpack_pack_str(&mp_pck, tag_len);
-        msgpack_pack_str_body(&mp_pck, tag, tag_len);
+        if (ctx->message_per_record == FLB_TRUE) {
+            flb_sds_len_set(json, 0);
+        }
+        else {
+            ret = nats_cat(&json, count > 0 ? ", " : "[", count > 0 ? 2 : 1);
+        }
+        count++;
 
-        for (i = 0; i < map_size; i++) {
-            m_key = map.via.map.ptr[i].key;
-            m_val = map.via.map.ptr[i].val;
+        if (ret == -1 ||
+            nats_format_record(&json, &result.data, tag, tag_len) == -1) {
+            ret = -1;
+            break;
+        }
 
-            msgpack_pack_object(&mp_pck, m_key);
-            msgpack_pack_object(&mp_pck, m_val);
+        if (ctx->message_per_record == FLB_TRUE) {
+            ret = nats_pub(buf, subject, subject_len,
+                           json, flb_sds_len(json));
+            if (ret == -1) {
+                break;
+            }
         }
     }
     msgpack_unpacked_destroy(&result);
 
-    ret = flb_msgpack_raw_to_json_str(mp_sbuf.data, mp_sbuf.size,
-                                      &json_buf, &json_size);
-    msgpack_sbuffer_destroy(&mp_sbuf);
-
-    if (ret != 0) {
-        return -1;
+    if (ret == 0 && ctx->message_per_record == FLB_FALSE) {
+        if (count == 0) {
+            ret = nats_cat(&json, "[", 1);
+        }
+        if (ret == 0) {
+            ret = nats_cat(&json, "]", 1);
+        }
+        if (ret == 0) {
+            ret = nats_pub(buf, subject, subject_len,
+                           json, flb_sds_len(json));
+        }
     }
 
-    *out_json = json_buf;
-    *out_size = json_size;
+    flb_sds_destroy(json);
+    return ret;
+}
 
-    return 0;
+/*
+ * Read the server replies until the PONG of our PING arrives: everything
+ * published before it was processed. Server PINGs are answered on the way
+ * so an idle keepalive connection is not dropped. Returns 0 or -1 if the
+ * connection failed or the server reported an error.
+ */
+static int nats_wait_pong(struct flb_upstream_conn *u_conn)
+{
+    int ret;
+    size_t len = 0;
+    size_t sent;
+    char *p;
+    char *eol;
+    char buf[NATS_READ_SIZE];
+
+    while (1) {
+        if (len == sizeof(buf)) {
+            /* Long line (INFO), only its end matters */
+            len = 0;
+        }
+
+        ret = flb_io_net_read(u_conn, buf + len, sizeof(buf) - len);
+        if (ret <= 0) {
+            flb_error("[out_nats] connection closed while waiting for PONG");
+            return -1;
+        }
+        len += ret;
+
+        p = buf;
+        while ((eol = memchr(p, '\n', len - (p - buf)))) {
+            if (strncmp(p, "PONG", 4) == 0) {
+                return 0;
+            }
+            else if (strncmp(p, "PING", 4) == 0) {
+                ret = flb_io_net_write(u_conn, NATS_PONG,
+                                       sizeof(NATS_PONG) - 1, &sent);
+                if (ret == -1) {
+                    return -1;
+                }
+            }
+            else if (strncmp(p, "-ERR", 4) == 0) {
+                flb_error("[out_nats] server error: %.*s",
+                          (int) (eol - p), p);
+                return -1;
+            }
+            p = eol + 1;
+        }
+
+        /* Keep the incomplete line */
+        len -= (p - buf);
+        memmove(buf, p, len);
+    }
+
+    return -1;
 }
 
 void cb_nats_flush(void *data, size_t bytes,
@@ -158,57 +302,56 @@ void cb_nats_flush(void *data, size_t bytes,
 {
     int ret;
     size_t bytes_sent;
-    size_t json_len;
-    char *json_msg;
-    char *request;
-    int req_len;
+    flb_sds_t request;
     struct flb_out_nats_config *ctx = out_context;
     struct flb_upstream_conn *u_conn;
 
     u_conn = flb_upstream_conn_get(ctx->u);
     if (!u_conn) {
         flb_error("[out_nats] no upstream connections available");
-        FLB_OUTPUT_RETURN(FLB_ERROR);
+        FLB_OUTPUT_RETURN(FLB_RETRY);
     }
 
-    /* Before to flush the content check if we need to start the handshake */
-    ret = flb_io_net_write(u_conn,
-                           NATS_CONNECT,
-                           sizeof(NATS_CONNECT) - 1,
-                           &bytes_sent);
-    if (ret == -1) {
+    request = flb_sds_create_size_arena(flb_output_arena(), bytes * 2);
+    if (!request) {
+        flb_errno();
         flb_upstream_conn_release(u_conn);
         FLB_OUTPUT_RETURN(FLB_RETRY);
     }
 
-    /* Convert original Fluent Bit MsgPack format to JSON */
-    ret = msgpack_to_json(data, bytes, tag, tag_len, &json_msg, &json_len);
+    /*
+     * The whole flush is a single write: the handshake on new connections,
+     * the PUB frames and a PING to know when the server processed them.
+     */
+    ret = 0;
+    if (u_conn->ka_count == 0) {
+        ret = nats_cat(&request, NATS_CONNECT, sizeof(NATS_CONNECT) - 1);
+    }
+    if (ret == 0) {
+        ret = nats_format(ctx, &request, data, bytes, tag, tag_len);
+    }
+    if (ret == 0) {
+        ret = nats_cat(&request, NATS_PING, sizeof(NATS_PING) - 1);
+    }
     if (ret == -1) {
+        flb_error("[out_nats] cannot compose the request");
+        flb_sds_destroy(request);
         flb_upstream_conn_release(u_conn);
         FLB_OUTPUT_RETURN(FLB_ERROR);
     }
 
-    /* Compose the NATS Publish request */
-    request = flb_malloc(json_len + 32);
-    req_len = snprintf(request, json_len + 32, "PUB %s %zu\r\n",
-                       tag, json_len);
-
-    /* Append JSON message and ending CRLF */
-    memcpy(request + req_len, json_msg, json_len);
-    req_len += json_len;
-    request[req_len++] = '\r';
-    request[req_len++] = '\n';
-    flb_free(json_msg);
-
-    ret = flb_io_net_write(u_conn, request, req_len, &bytes_sent);
+    ret = flb_io_net_write(u_conn, request, flb_sds_len(request),
+                           &bytes_sent);
+    flb_sds_destroy(request);
+    if (ret != -1) {
+        ret = nats_wait_pong(u_conn);
+    }
     if (ret == -1) {
-        perror("write");
-        flb_free(request);
+        flb_upstream_conn_recycle(u_conn, FLB_FALSE);
         flb_upstream_conn_release(u_conn);
         FLB_OUTPUT_RETURN(FLB_RETRY);
     }
 
-    flb_free(request);
     flb_upstream_conn_release(u_conn);
     FLB_OUTPUT_RETURN(FLB_OK);
 }
@@ -219,6 +362,9 @@ int cb_nats_exit(void *data, struct flb_config *config)
     struct flb_out_nats_config *ctx = data;
 
     flb_upstream_destroy(ctx->u);
+    if (ctx->subject) {
+        flb_free(ctx->subject);
+    }
     flb_free(ctx);
 
     return 0;
@@ -230,5 +376,5 @@ struct flb_output_plugin out_nats_plugin = {
     .cb_init      = cb_nats_init,
     .cb_flush     = cb_nats_flush,
     .cb_exit      = cb_nats_exit,
-    .flags        = FLB_OUTPUT_NET,
+    .flags        = FLB_OUTPUT_NET | FLB_OUTPUT_SHARDS,
 };
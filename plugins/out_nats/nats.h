@@ -22,9 +22,24 @@
 
 #include <fluent-bit/flb_version.h>
 
+#include <fluent-bit/flb_output.h>
+#include <fluent-bit/flb_upstream.h>
+
 #define NATS_CONNECT "CONNECT {\"verbose\":false,\"pedantic\":false,\"ssl_required\":false,\"name\":\"fluent-bit\",\"lang\":\"c\",\"version\":\"" FLB_VERSION_STR "\"}\r\n"
+#define NATS_PING    "PING\r\n"
+#define NATS_PONG    "PONG\r\n"
+
+/* Size of the buffer used to read the server replies */
+#define NATS_READ_SIZE  1024
 
 struct flb_out_nats_config {
+    /* Publish one message per record instead of one per chunk */
+    int message_per_record;
+
+    /* Fixed subject, the records tag is used if not set */
+    int subject_len;
+    char *subject;
+
     struct flb_output_instance *ins;
     struct flb_upstream *u;
 };
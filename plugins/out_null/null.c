@@ -52,5 +52,5 @@ struct flb_output_plugin out_null_plugin = {
     .description  = "Throws away events",
     .cb_init      = cb_null_init,
     .cb_flush     = cb_null_flush,
-    .flags        = 0,
+    .flags        = FLB_OUTPUT_SHARDS,
 };
@@ -103,5 +103,5 @@ struct flb_output_plugin out_retry_plugin = {
     .cb_init      = cb_retry_init,
     .cb_flush     = cb_retry_flush,
     .cb_exit      = cb_retry_exit,
-    .flags        = 0,
+    .flags        = FLB_OUTPUT_SHARDS,
 };
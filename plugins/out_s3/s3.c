@@ -0,0 +1,984 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_output.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_str.h>
+#include <fluent-bit/flb_sds.h>
+#include <fluent-bit/flb_gzip.h>
+#include <fluent-bit/flb_pack.h>
+#include <fluent-bit/flb_time.h>
+#include <fluent-bit/flb_utils.h>
+#include <fluent-bit/flb_scheduler.h>
+#include <msgpack.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include "s3.h"
+#include "s3_sign.h"
+#include "s3_multipart.h"
+#include "s3_store.h"
+
+#define S3_DATE_FMT  "%Y-%m-%dT%H:%M:%S"
+
+static inline int json_cat(flb_sds_t *buf, char *str, int len)
+{
+    flb_sds_t tmp;
+
+    tmp = flb_sds_cat(*buf, str, len);
+    if (!tmp) {
+        return -1;
+    }
+    *buf = tmp;
+    return 0;
+}
+
+/* Append one record as a JSON line, the date goes first */
+static int record_to_json(struct flb_s3 *ctx, flb_sds_t *buf,
+                          struct flb_time *tms, msgpack_object *map)
+{
+    int i;
+    int len;
+    size_t s;
+    char tmp[64];
+    struct tm tm;
+
+    if (json_cat(buf, "{\"", 2) == -1 ||
+        flb_utils_write_str_sds(buf, ctx->date_key,
+                                strlen(ctx->date_key)) == -1) {
+        return -1;
+    }
+
+    gmtime_r(&tms->tm.tv_sec, &tm);
+    s = strftime(tmp, sizeof(tmp) - 1, "\":\"" S3_DATE_FMT, &tm);
+    len = snprintf(tmp + s, sizeof(tmp) - 1 - s,
+                   ".%06" PRIu64 "Z\"", (uint64_t) tms->tm.tv_nsec / 1000);
+    if (json_cat(buf, tmp, s + len) == -1) {
+        return -1;
+    }
+
+    for (i = 0; i < map->via.map.size; i++) {
+        if (json_cat(buf, ",", 1) == -1 ||
+            flb_msgpack_to_json_sds(buf, &map->via.map.ptr[i].key) == -1 ||
+            json_cat(buf, ":", 1) == -1 ||
+            flb_msgpack_to_json_sds(buf, &map->via.map.ptr[i].val) == -1) {
+            return -1;
+        }
+    }
+
+    return json_cat(buf, "}\n", 2);
+}
+
+static flb_sds_t records_to_json(struct flb_s3 *ctx, char *data, size_t bytes)
+{
+    int ret = 0;
+    size_t off = 0;
+    flb_sds_t buf;
+    msgpack_unpacked result;
+    msgpack_object *obj;
+    struct flb_time tms;
+
+    buf = flb_sds_create_size(bytes + bytes / 2);
+    if (!buf) {
+        flb_errno();
+        return NULL;
+    }
+
+    msgpack_unpacked_init(&result);
+    while (msgpack_unpack_next(&result, data, bytes, &off)) {
+        if (result.data.type != MSGPACK_OBJECT_ARRAY ||
+            result.data.via.array.size != 2) {
+            continue;
+        }
+        flb_time_pop_from_msgpack(&tms, &result, &obj);
+        if (obj->type != MSGPACK_OBJECT_MAP) {
+            continue;
+        }
+        ret = record_to_json(ctx, &buf, &tms, obj);
+        if (ret == -1) {
+            break;
+        }
+    }
+    msgpack_unpacked_destroy(&result);
+
+    if (ret == -1) {
+        flb_sds_destroy(buf);
+        return NULL;
+    }
+    return buf;
+}
+
+static void random_hex(char *out, int len)
+{
+    int i;
+    int fd;
+    int ret = -1;
+    unsigned char bytes[32];
+    static const char digits[] = "0123456789abcdef";
+
+    len = len > sizeof(bytes) ? sizeof(bytes) : len;
+    fd = open("/dev/urandom", O_RDONLY);
+    if (fd != -1) {
+        ret = read(fd, bytes, len);
+        close(fd);
+    }
+    for (i = 0; i < len; i++) {
+        if (ret != len) {
+            bytes[i] = rand();
+        }
+        out[i] = digits[bytes[i] & 0xf];
+    }
+    out[len] = '\0';
+}
+
+/* Append a value substituted in the key template, '%' is not a format */
+static flb_sds_t key_value_cat(flb_sds_t s, char *str, int len)
+{
+    int i;
+
+    for (i = 0; i < len && s; i++) {
+        if (str[i] == '%') {
+            s = flb_s3_cat(s, "%%", 2);
+        }
+        else {
+            s = flb_s3_cat(s, str + i, 1);
+        }
+    }
+    return s;
+}
+
+/*
+ * Object key from 's3_key_format': $TAG, $TAG[n] (part n of the tag split
+ * on dots), $UUID and $INDEX are replaced, then strftime(3) formats the
+ * time, in UTC.
+ */
+static flb_sds_t key_render(struct flb_s3 *ctx, char *tag, time_t now)
+{
+    int n;
+    int len;
+    char *p;
+    char *end;
+    char *field;
+    char tmp[32];
+    size_t size;
+    struct tm tm;
+    flb_sds_t fmt;
+    flb_sds_t key;
+
+    fmt = flb_sds_create_size(256);
+    if (*ctx->key_format != '/') {
+        fmt = flb_s3_cat(fmt, "/", 1);
+    }
+
+    p = ctx->key_format;
+    while (*p && fmt) {
+        if (strncmp(p, "$TAG[", 5) == 0 && isdigit((unsigned char) p[5])) {
+            n = strtol(p + 5, &end, 10);
+            if (*end == ']') {
+                field = tag;
+                while (n > 0 && field) {
+                    field = strchr(field, '.');
+                    if (field) {
+                        field++;
+                    }
+                    n--;
+                }
+                if (field) {
+                    end = strchr(field, '.');
+                    len = end ? end - field : strlen(field);
+                    fmt = key_value_cat(fmt, field, len);
+                }
+                else {
+                    flb_warn("[out_s3] tag %s has no part %s",
+                             tag, p + 4);
+                }
+                p = strchr(p, ']') + 1;
+                continue;
+            }
+        }
+        if (strncmp(p, "$TAG", 4) == 0) {
+            fmt = key_value_cat(fmt, tag, strlen(tag));
+            p += 4;
+        }
+        else if (strncmp(p, "$UUID", 5) == 0) {
+            random_hex(tmp, 16);
+            fmt = flb_s3_cat(fmt, tmp, 16);
+            p += 5;
+        }
+        else if (strncmp(p, "$INDEX", 6) == 0) {
+            len = snprintf(tmp, sizeof(tmp), "%u", ctx->index++);
+            fmt = flb_s3_cat(fmt, tmp, len);
+            p += 6;
+        }
+        else {
+            fmt = flb_s3_cat(fmt, p, 1);
+            p++;
+        }
+    }
+    if (!fmt) {
+        return NULL;
+    }
+
+    gmtime_r(&now, &tm);
+    size = flb_sds_len(fmt) * 2 + 256;
+    key = flb_sds_create_size(size);
+    if (!key) {
+        flb_sds_destroy(fmt);
+        return NULL;
+    }
+    len = strftime(key, size, fmt, &tm);
+    flb_sds_destroy(fmt);
+    if (len == 0) {
+        flb_error("[out_s3] invalid s3_key_format %s", ctx->key_format);
+        flb_sds_destroy(key);
+        return NULL;
+    }
+    flb_sds_len_set(key, len);
+
+    return key;
+}
+
+static void part_destroy(struct flb_s3_part *part, int remove)
+{
+    if (remove) {
+        flb_s3_store_remove(part);
+    }
+    flb_free(part->data);
+    if (part->file) {
+        flb_sds_destroy(part->file);
+    }
+    if (part->key) {
+        flb_sds_destroy(part->key);
+    }
+    flb_free(part);
+}
+
+static void upload_destroy(struct flb_s3_upload *up)
+{
+    int i;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct flb_s3_part *part;
+
+    mk_list_foreach_safe(head, tmp, &up->queue) {
+        part = mk_list_entry(head, struct flb_s3_part, _head);
+        mk_list_del(&part->_head);
+        part_destroy(part, FLB_FALSE);
+    }
+    for (i = 0; i < up->parts; i++) {
+        if (up->etags[i]) {
+            flb_sds_destroy(up->etags[i]);
+        }
+    }
+    flb_free(up->etags);
+    flb_gzip_destroy(&up->gz);
+    if (up->upload_id) {
+        flb_sds_destroy(up->upload_id);
+    }
+    if (up->key) {
+        flb_sds_destroy(up->key);
+    }
+    flb_free(up->tag);
+    flb_free(up);
+}
+
+/* Active upload of a tag, a new one if there is none; lock held */
+static struct flb_s3_upload *upload_get(struct flb_s3 *ctx,
+                                        char *tag, int tag_len)
+{
+    struct mk_list *head;
+    struct flb_s3_upload *up;
+
+    mk_list_foreach(head, &ctx->uploads) {
+        up = mk_list_entry(head, struct flb_s3_upload, _head);
+        if (up->closing == FLB_FALSE && strlen(up->tag) == tag_len &&
+            strncmp(up->tag, tag, tag_len) == 0) {
+            return up;
+        }
+    }
+
+    up = flb_calloc(1, sizeof(struct flb_s3_upload));
+    if (!up) {
+        flb_errno();
+        return NULL;
+    }
+    mk_list_init(&up->queue);
+    up->started = time(NULL);
+    up->tag = flb_strndup(tag, tag_len);
+    if (!up->tag) {
+        flb_free(up);
+        return NULL;
+    }
+    up->key = key_render(ctx, up->tag, up->started);
+    if (!up->key) {
+        upload_destroy(up);
+        return NULL;
+    }
+    mk_list_add(&up->_head, &ctx->uploads);
+    flb_debug("[out_s3] new object %s for tag %s", up->key, up->tag);
+
+    return up;
+}
+
+/* Turn the current gzip member into a part and queue it; lock held */
+static int upload_cut(struct flb_s3 *ctx, struct flb_s3_upload *up)
+{
+    int ret;
+    void *out;
+    size_t size;
+    flb_sds_t *etags;
+    struct flb_s3_part *part;
+
+    if (!up->gz.buf) {
+        return 0;
+    }
+
+    part = flb_calloc(1, sizeof(struct flb_s3_part));
+    if (!part) {
+        flb_errno();
+        return -1;
+    }
+    etags = flb_realloc(up->etags, sizeof(flb_sds_t) * (up->parts + 1));
+    if (!etags) {
+        flb_errno();
+        flb_free(part);
+        return -1;
+    }
+    up->etags = etags;
+
+    ret = flb_gzip_finish(&up->gz, &out, &size);
+    flb_gzip_destroy(&up->gz);
+    if (ret == -1) {
+        flb_error("[out_s3] cannot compress part %i of %s",
+                  up->parts + 1, up->key);
+        flb_free(part);
+        return -1;
+    }
+
+    up->etags[up->parts] = NULL;
+    part->num = ++up->parts;
+    part->data = out;
+    part->size = size;
+    mk_list_add(&part->_head, &up->queue);
+    ctx->buffered += size;
+
+    /* Over the memory limit, the part waits in the store */
+    if (ctx->store_dir && ctx->buffered > ctx->buffer_limit) {
+        flb_s3_store_spill(ctx, up, part);
+    }
+
+    return 0;
+}
+
+/* No more data for the object, it is completed once its parts are sent */
+static void upload_close(struct flb_s3 *ctx, struct flb_s3_upload *up)
+{
+    if (up->closing) {
+        return;
+    }
+    if (upload_cut(ctx, up) == -1) {
+        flb_error("[out_s3] last part of %s is lost", up->key);
+    }
+    up->closing = FLB_TRUE;
+}
+
+/* Compress the records into the current part of an upload; lock held */
+static int upload_write(struct flb_s3 *ctx, struct flb_s3_upload *up,
+                        char *buf, size_t size)
+{
+    if (!up->gz.buf && flb_gzip_init(&up->gz, ctx->part_size) == -1) {
+        return -1;
+    }
+    if (flb_gzip_write(&up->gz, buf, size) == -1) {
+        return -1;
+    }
+    up->size += size;
+
+    if (up->gz.strm.total_out >= ctx->part_size &&
+        upload_cut(ctx, up) == -1) {
+        return -1;
+    }
+    if (up->size >= ctx->file_size || up->parts >= FLB_S3_MAX_PARTS) {
+        upload_close(ctx, up);
+    }
+
+    return 0;
+}
+
+/*
+ * Send what an upload has ready: create it, upload the queued parts and
+ * complete it once closed and drained. Many flushes can pump the same
+ * upload, each one sends a different part. The caller holds a reference
+ * (up->users), it is released here.
+ */
+static void upload_pump(struct flb_s3 *ctx, struct flb_s3_upload *up,
+                        struct flb_upstream *u)
+{
+    int i;
+    int ret;
+    int failed = FLB_FALSE;
+    char *data;
+    size_t size;
+    flb_sds_t id;
+    flb_sds_t etag;
+    struct flb_s3_part *part;
+
+    pthread_mutex_lock(&ctx->lock);
+    while (!up->done && !failed &&
+           (ctx->exiting || up->retry <= time(NULL))) {
+        if (!up->upload_id) {
+            if (mk_list_is_empty(&up->queue) == 0) {
+                /* Nothing was ever written */
+                if (up->closing && up->parts == 0) {
+                    up->done = FLB_TRUE;
+                }
+                break;
+            }
+            if (up->creating) {
+                break;
+            }
+            up->creating = FLB_TRUE;
+            pthread_mutex_unlock(&ctx->lock);
+
+            id = flb_s3_multipart_create(ctx, u, up->key);
+
+            pthread_mutex_lock(&ctx->lock);
+            up->creating = FLB_FALSE;
+            if (!id) {
+                up->retry = time(NULL) + FLB_S3_RETRY_WAIT;
+                failed = FLB_TRUE;
+            }
+            up->upload_id = id;
+            continue;
+        }
+
+        if (mk_list_is_empty(&up->queue) != 0) {
+            part = mk_list_entry_first(&up->queue, struct flb_s3_part, _head);
+            mk_list_del(&part->_head);
+            up->inflight++;
+            pthread_mutex_unlock(&ctx->lock);
+
+            etag = NULL;
+            data = part->data;
+            size = part->size;
+            ret = 0;
+            if (!data) {
+                ret = flb_s3_store_read(part, &data, &size);
+            }
+            if (ret == 0) {
+                etag = flb_s3_multipart_part(ctx, u, up, part->num,
+                                             data, size);
+                if (data != part->data) {
+                    flb_free(data);
+                }
+            }
+
+            pthread_mutex_lock(&ctx->lock);
+            up->inflight--;
+            if (ret == -1) {
+                flb_error("[out_s3] cannot read %s, part %i of %s is lost",
+                          part->file, part->num, up->key);
+                part_destroy(part, FLB_TRUE);
+            }
+            else if (etag) {
+                up->etags[part->num - 1] = etag;
+                if (part->data) {
+                    ctx->buffered -= part->size;
+                }
+                part_destroy(part, FLB_TRUE);
+            }
+            else {
+                mk_list_add(&part->_head, &up->queue);
+                up->retry = time(NULL) + FLB_S3_RETRY_WAIT;
+                failed = FLB_TRUE;
+                if (ctx->store_dir && part->data) {
+                    flb_s3_store_spill(ctx, up, part);
+                }
+            }
+            continue;
+        }
+
+        if (up->closing && up->inflight == 0 && !up->completing) {
+            for (i = 0; i < up->parts && !up->etags[i]; i++);
+            if (i == up->parts) {
+                flb_error("[out_s3] no parts of %s were uploaded", up->key);
+                up->done = FLB_TRUE;
+                break;
+            }
+
+            up->completing = FLB_TRUE;
+            pthread_mutex_unlock(&ctx->lock);
+
+            ret = flb_s3_multipart_complete(ctx, u, up);
+
+            pthread_mutex_lock(&ctx->lock);
+            up->completing = FLB_FALSE;
+            if (ret == 0) {
+                up->done = FLB_TRUE;
+            }
+            else {
+                up->retry = time(NULL) + FLB_S3_RETRY_WAIT;
+                failed = FLB_TRUE;
+            }
+        }
+        break;
+    }
+
+    up->users--;
+    if (up->done && up->users == 0) {
+        mk_list_del(&up->_head);
+        upload_destroy(up);
+    }
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+/*
+ * Stored parts of a previous run: their upload is gone, each one is put as
+ * an object of its own, the key with a '-partN' suffix.
+ */
+static void orphans_pump(struct flb_s3 *ctx, struct flb_upstream *u)
+{
+    int ret;
+    int len;
+    char *data;
+    char suffix[32];
+    size_t size;
+    flb_sds_t key;
+    struct flb_s3_part *part;
+
+    pthread_mutex_lock(&ctx->lock);
+    if (mk_list_is_empty(&ctx->orphans) == 0 ||
+        (!ctx->exiting && ctx->orphans_retry > time(NULL))) {
+        pthread_mutex_unlock(&ctx->lock);
+        return;
+    }
+    part = mk_list_entry_first(&ctx->orphans, struct flb_s3_part, _head);
+    mk_list_del(&part->_head);
+    pthread_mutex_unlock(&ctx->lock);
+
+    len = snprintf(suffix, sizeof(suffix), "-part%i", part->num);
+    key = flb_sds_create_size(flb_sds_len(part->key) + len);
+    if (flb_sds_len(part->key) > 3 &&
+        strcmp(part->key + flb_sds_len(part->key) - 3, ".gz") == 0) {
+        key = flb_s3_cat(key, part->key, flb_sds_len(part->key) - 3);
+        key = flb_s3_cat(key, suffix, len);
+        key = flb_s3_cat(key, ".gz", 3);
+    }
+    else {
+        key = flb_s3_cat(key, part->key, flb_sds_len(part->key));
+        key = flb_s3_cat(key, suffix, len);
+    }
+
+    ret = -1;
+    if (key && flb_s3_store_read(part, &data, &size) == 0) {
+        ret = flb_s3_put_object(ctx, u, key, data, size);
+        flb_free(data);
+    }
+    if (key) {
+        flb_sds_destroy(key);
+    }
+
+    if (ret == 0) {
+        part_destroy(part, FLB_TRUE);
+        return;
+    }
+
+    pthread_mutex_lock(&ctx->lock);
+    mk_list_add(&part->_head, &ctx->orphans);
+    ctx->orphans_retry = time(NULL) + FLB_S3_RETRY_WAIT;
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+/*
+ * Close the uploads open for longer than 'upload_timeout' and send the
+ * parts of the uploads no flush is feeding anymore. It runs out of a
+ * co-routine, on the blocking upstream.
+ */
+static void cb_s3_timer(struct flb_config *config, void *data)
+{
+    int i;
+    int n = 0;
+    time_t now;
+    struct mk_list *head;
+    struct flb_s3_upload *up;
+    struct flb_s3_upload **pending;
+    struct flb_s3 *ctx = data;
+
+    now = time(NULL);
+
+    pthread_mutex_lock(&ctx->lock);
+    pending = flb_malloc(sizeof(struct flb_s3_upload *) *
+                         (mk_list_size(&ctx->uploads) + 1));
+    if (pending) {
+        mk_list_foreach(head, &ctx->uploads) {
+            up = mk_list_entry(head, struct flb_s3_upload, _head);
+            if (now - up->started >= ctx->upload_timeout) {
+                upload_close(ctx, up);
+            }
+            if (up->done || up->retry > now ||
+                (!up->closing && mk_list_is_empty(&up->queue) == 0)) {
+                continue;
+            }
+            up->users++;
+            pending[n++] = up;
+        }
+    }
+    pthread_mutex_unlock(&ctx->lock);
+
+    for (i = 0; i < n; i++) {
+        upload_pump(ctx, pending[i], ctx->u_sync);
+    }
+    flb_free(pending);
+    orphans_pump(ctx, ctx->u_sync);
+
+    if (flb_sched_timer_cb_create(config, 1000, cb_s3_timer, ctx) != 0) {
+        /* Scheduled again by the next flush */
+        ctx->timer = FLB_FALSE;
+    }
+}
+
+static int size_property(struct flb_output_instance *ins, char *name,
+                         size_t def, size_t *out)
+{
+    char *tmp;
+    ssize_t val;
+
+    *out = def;
+    tmp = flb_output_get_property(name, ins);
+    if (!tmp) {
+        return 0;
+    }
+    val = flb_utils_size_to_bytes(tmp);
+    if (val <= 0) {
+        flb_error("[out_s3] invalid %s=%s", name, tmp);
+        return -1;
+    }
+    *out = val;
+    return 0;
+}
+
+static char *env_property(struct flb_output_instance *ins, char *name,
+                          char *env)
+{
+    char *tmp;
+
+    tmp = flb_output_get_property(name, ins);
+    if (!tmp) {
+        tmp = getenv(env);
+    }
+    if (!tmp || !*tmp) {
+        return NULL;
+    }
+    return flb_strdup(tmp);
+}
+
+static void s3_conf_destroy(struct flb_s3 *ctx)
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct flb_s3_part *part;
+
+    mk_list_foreach_safe(head, tmp, &ctx->orphans) {
+        part = mk_list_entry(head, struct flb_s3_part, _head);
+        mk_list_del(&part->_head);
+        part_destroy(part, FLB_FALSE);
+    }
+    if (ctx->u) {
+        flb_upstream_destroy(ctx->u);
+    }
+    if (ctx->u_sync) {
+        flb_upstream_destroy(ctx->u_sync);
+    }
+    flb_free(ctx->bucket);
+    flb_free(ctx->region);
+    flb_free(ctx->access_key);
+    flb_free(ctx->secret_key);
+    flb_free(ctx->session_token);
+    flb_free(ctx->key_format);
+    flb_free(ctx->date_key);
+    flb_free(ctx->store_dir);
+    flb_free(ctx->host);
+    pthread_mutex_destroy(&ctx->lock);
+    flb_free(ctx);
+}
+
+static int cb_s3_init(struct flb_output_instance *ins,
+                      struct flb_config *config, void *data)
+{
+    int io_flags;
+    char *tmp;
+    struct flb_s3 *ctx;
+    (void) data;
+
+    ctx = flb_calloc(1, sizeof(struct flb_s3));
+    if (!ctx) {
+        flb_errno();
+        return -1;
+    }
+    mk_list_init(&ctx->uploads);
+    mk_list_init(&ctx->orphans);
+    pthread_mutex_init(&ctx->lock, NULL);
+
+    tmp = flb_output_get_property("bucket", ins);
+    if (!tmp) {
+        flb_error("[out_s3] 'bucket' is not set");
+        goto error;
+    }
+    ctx->bucket = flb_strdup(tmp);
+
+    tmp = flb_output_get_property("region", ins);
+    ctx->region = flb_strdup(tmp ? tmp : FLB_S3_REGION);
+
+    /* Credentials, the AWS environment variables by default */
+    ctx->access_key = env_property(ins, "access_key_id", "AWS_ACCESS_KEY_ID");
+    ctx->secret_key = env_property(ins, "secret_access_key",
+                                   "AWS_SECRET_ACCESS_KEY");
+    ctx->session_token = env_property(ins, "session_token",
+                                      "AWS_SESSION_TOKEN");
+    if (!ctx->access_key || !ctx->secret_key) {
+        flb_error("[out_s3] no credentials: set access_key_id and "
+                  "secret_access_key or the AWS_ACCESS_KEY_ID and "
+                  "AWS_SECRET_ACCESS_KEY environment variables");
+        goto error;
+    }
+
+    tmp = flb_output_get_property("s3_key_format", ins);
+    ctx->key_format = flb_strdup(tmp ? tmp : FLB_S3_KEY_FORMAT);
+
+    tmp = flb_output_get_property("json_date_key", ins);
+    ctx->date_key = flb_strdup(tmp ? tmp : FLB_S3_DATE_KEY);
+
+    if (size_property(ins, "upload_chunk_size", FLB_S3_PART_SIZE,
+                      &ctx->part_size) == -1 ||
+        size_property(ins, "total_file_size", FLB_S3_FILE_SIZE,
+                      &ctx->file_size) == -1 ||
+        size_property(ins, "buffer_limit", ctx->part_size * 4,
+                      &ctx->buffer_limit) == -1) {
+        goto error;
+    }
+    if (ctx->part_size < FLB_S3_PART_SIZE) {
+        flb_warn("[out_s3] upload_chunk_size is under 5M, the minimum of "
+                 "S3 for all the parts but the last one");
+    }
+
+    ctx->upload_timeout = FLB_S3_UPLOAD_TIMEOUT;
+    tmp = flb_output_get_property("upload_timeout", ins);
+    if (tmp) {
+        ctx->upload_timeout = atoi(tmp);
+        if (ctx->upload_timeout <= 0) {
+            flb_error("[out_s3] invalid upload_timeout=%s", tmp);
+            goto error;
+        }
+    }
+
+    tmp = flb_output_get_property("store_dir", ins);
+    if (tmp) {
+        ctx->store_dir = flb_strdup(tmp);
+        if (flb_s3_store_init(ctx) == -1) {
+            goto error;
+        }
+    }
+
+    /* Endpoint: the regional AWS one unless Host is set */
+    if (ins->host.name) {
+        ctx->host = flb_strdup(ins->host.name);
+    }
+    else {
+        ctx->host = flb_malloc(strlen(ctx->region) + 32);
+        if (ctx->host) {
+            sprintf(ctx->host, "s3.%s.amazonaws.com", ctx->region);
+        }
+    }
+    ctx->port = ins->host.port;
+    if (ctx->port == 0) {
+        ctx->port = ins->use_tls == FLB_TRUE ? 443 : 80;
+    }
+
+#ifdef FLB_HAVE_TLS
+    if (ins->use_tls == FLB_TRUE) {
+        io_flags = FLB_IO_TLS;
+    }
+    else {
+        io_flags = FLB_IO_TCP;
+    }
+#else
+    io_flags = FLB_IO_TCP;
+#endif
+    if (ins->host.ipv6 == FLB_TRUE) {
+        io_flags |= FLB_IO_IPV6;
+    }
+
+    ctx->u = flb_upstream_create(config, ctx->host, ctx->port, io_flags,
+                                 (void *) &ins->tls);
+    ctx->u_sync = flb_upstream_create(config, ctx->host, ctx->port, io_flags,
+                                      (void *) &ins->tls);
+    if (!ctx->u || !ctx->u_sync) {
+        goto error;
+    }
+    flb_output_upstream_set(ctx->u, ins);
+    ctx->u_sync->flags &= ~(FLB_IO_ASYNC);
+
+    flb_info("[out_s3] bucket=%s endpoint=%s:%i part_size=%zu "
+             "file_size=%zu", ctx->bucket, ctx->host, ctx->port,
+             ctx->part_size, ctx->file_size);
+
+    flb_output_set_context(ins, ctx);
+    return 0;
+
+ error:
+    s3_conf_destroy(ctx);
+    return -1;
+}
+
+static void cb_s3_flush(void *data, size_t bytes,
+                        char *tag, int tag_len,
+                        struct flb_input_instance *i_ins,
+                        void *out_context,
+                        struct flb_config *config)
+{
+    int ret;
+    flb_sds_t json;
+    struct flb_s3_upload *up;
+    struct flb_s3 *ctx = out_context;
+    (void) i_ins;
+
+    json = records_to_json(ctx, data, bytes);
+    if (!json) {
+        FLB_OUTPUT_RETURN(FLB_RETRY);
+    }
+
+    pthread_mutex_lock(&ctx->lock);
+
+    /* The scheduler is not available yet when the plugin starts */
+    if (ctx->timer == FLB_FALSE &&
+        flb_sched_timer_cb_create(config, 1000, cb_s3_timer, ctx) == 0) {
+        ctx->timer = FLB_TRUE;
+    }
+
+    /* Without a store, memory is bounded by holding the chunks back */
+    if (!ctx->store_dir && ctx->buffered > ctx->buffer_limit) {
+        pthread_mutex_unlock(&ctx->lock);
+        flb_sds_destroy(json);
+        FLB_OUTPUT_RETURN(FLB_RETRY);
+    }
+
+    up = upload_get(ctx, tag, tag_len);
+    if (!up) {
+        pthread_mutex_unlock(&ctx->lock);
+        flb_sds_destroy(json);
+        FLB_OUTPUT_RETURN(FLB_RETRY);
+    }
+
+    ret = upload_write(ctx, up, json, flb_sds_len(json));
+    flb_sds_destroy(json);
+    if (ret == -1) {
+        pthread_mutex_unlock(&ctx->lock);
+        FLB_OUTPUT_RETURN(FLB_RETRY);
+    }
+    up->users++;
+    pthread_mutex_unlock(&ctx->lock);
+
+    upload_pump(ctx, up, ctx->u);
+    orphans_pump(ctx, ctx->u);
+
+    FLB_OUTPUT_RETURN(FLB_OK);
+}
+
+/*
+ * Close and send every upload. What cannot be sent goes to the store, to
+ * be uploaded on the next start, or is lost without one.
+ */
+static int cb_s3_exit(void *data, struct flb_config *config)
+{
+    int i;
+    int n = 0;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_list *p_tmp;
+    struct mk_list *p_head;
+    struct flb_s3_upload *up;
+    struct flb_s3_upload **pending;
+    struct flb_s3_part *part;
+    struct flb_s3 *ctx = data;
+
+    if (!ctx) {
+        return 0;
+    }
+    if (ctx->timer) {
+        flb_sched_timer_cb_cancel(config, ctx);
+    }
+
+    pthread_mutex_lock(&ctx->lock);
+    ctx->exiting = FLB_TRUE;
+    pending = flb_malloc(sizeof(struct flb_s3_upload *) *
+                         (mk_list_size(&ctx->uploads) + 1));
+    mk_list_foreach(head, &ctx->uploads) {
+        up = mk_list_entry(head, struct flb_s3_upload, _head);
+        upload_close(ctx, up);
+        if (pending) {
+            up->users++;
+            pending[n++] = up;
+        }
+    }
+    pthread_mutex_unlock(&ctx->lock);
+
+    for (i = 0; i < n; i++) {
+        upload_pump(ctx, pending[i], ctx->u_sync);
+    }
+    flb_free(pending);
+
+    /* Uploads which failed: keep the uploaded parts, store the others */
+    mk_list_foreach_safe(head, tmp, &ctx->uploads) {
+        up = mk_list_entry(head, struct flb_s3_upload, _head);
+        for (i = 0; i < up->parts && !up->etags[i]; i++);
+        if (up->upload_id && i < up->parts) {
+            flb_s3_multipart_complete(ctx, ctx->u_sync, up);
+        }
+        mk_list_foreach_safe(p_head, p_tmp, &up->queue) {
+            part = mk_list_entry(p_head, struct flb_s3_part, _head);
+            if (!part->data) {
+                continue;
+            }
+            if (!ctx->store_dir || flb_s3_store_spill(ctx, up, part) == -1) {
+                flb_error("[out_s3] part %i of %s is lost (%zu bytes)",
+                          part->num, up->key, part->size);
+            }
+        }
+        mk_list_del(&up->_head);
+        upload_destroy(up);
+    }
+
+    s3_conf_destroy(ctx);
+    return 0;
+}
+
+struct flb_output_plugin out_s3_plugin = {
+    .name         = "s3",
+    .description  = "Upload to S3 compatible object storage",
+    .cb_init      = cb_s3_init,
+    .cb_flush     = cb_s3_flush,
+    .cb_exit      = cb_s3_exit,
+    .flags        = FLB_OUTPUT_NET | FLB_OUTPUT_KEEPALIVE | FLB_IO_OPT_TLS,
+};
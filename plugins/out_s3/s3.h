@@ -0,0 +1,126 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef FLB_OUT_S3_H
+#define FLB_OUT_S3_H
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_sds.h>
+#include <fluent-bit/flb_gzip.h>
+#include <fluent-bit/flb_upstream.h>
+#include <monkey/mk_core.h>
+
+#include <pthread.h>
+#include <time.h>
+
+/* Defaults */
+#define FLB_S3_REGION          "us-east-1"
+#define FLB_S3_KEY_FORMAT      "/fluent-bit-logs/$TAG/%Y/%m/%d/%H%M%S-$UUID.gz"
+#define FLB_S3_PART_SIZE       (5 * 1024 * 1024)    /* S3 minimum, but last */
+#define FLB_S3_FILE_SIZE       (100 * 1024 * 1024)  /* uncompressed bytes */
+#define FLB_S3_UPLOAD_TIMEOUT  600                  /* seconds */
+#define FLB_S3_DATE_KEY        "date"
+
+/* Seconds before a failed request of an upload is tried again */
+#define FLB_S3_RETRY_WAIT      5
+
+/* Parts of an upload allowed by S3 */
+#define FLB_S3_MAX_PARTS       10000
+
+/*
+ * A part of a multipart upload: a complete gzip member, the object is the
+ * concatenation of them. Parts that cannot be uploaded are kept in memory
+ * or, with 'store_dir', spilled to a file.
+ */
+struct flb_s3_part {
+    int num;                    /* part number */
+    char *data;                 /* in memory, or */
+    size_t size;
+    flb_sds_t file;             /* in the store */
+    flb_sds_t key;              /* stored parts of a previous run */
+    struct mk_list _head;
+};
+
+/*
+ * An object being written: records of a tag are compressed in the current
+ * part until it reaches the part size, then the part is queued and sent
+ * by the flush which filled it. Concurrent flushes upload their parts in
+ * parallel over the upstream connections.
+ */
+struct flb_s3_upload {
+    char *tag;
+    flb_sds_t key;
+    flb_sds_t upload_id;        /* set once the upload is created */
+    time_t started;
+    size_t size;                /* uncompressed bytes of the object */
+
+    struct flb_gzip gz;         /* current part */
+
+    int parts;                  /* part numbers given */
+    flb_sds_t *etags;           /* ETag of the uploaded parts, by number */
+    int inflight;               /* parts being uploaded */
+    struct mk_list queue;       /* parts waiting to be uploaded */
+    time_t retry;               /* no requests before, after a failure */
+
+    int creating;               /* CreateMultipartUpload running */
+    int closing;                /* no more data, complete once drained */
+    int completing;             /* CompleteMultipartUpload running */
+    int done;                   /* completed or dropped */
+    int users;                  /* references held outside of the lock */
+    struct mk_list _head;
+};
+
+struct flb_s3 {
+    char *bucket;
+    char *region;
+    char *access_key;
+    char *secret_key;
+    char *session_token;
+    char *key_format;
+    char *date_key;
+    char *store_dir;
+
+    size_t part_size;
+    size_t file_size;
+    int upload_timeout;
+    size_t buffer_limit;        /* queued parts kept in memory */
+    size_t buffered;
+
+    char *host;                 /* endpoint, as sent in the Host header */
+    int port;
+    unsigned int index;         /* $INDEX of the keys */
+
+    /* Objects being written, and stored parts of a previous run */
+    struct mk_list uploads;
+    struct mk_list orphans;
+    time_t orphans_retry;
+    pthread_mutex_t lock;
+
+    int timer;                  /* upload timeout check is scheduled */
+    int exiting;
+
+    /*
+     * Flushes use the async upstream, the scheduler timer and the exit
+     * callback have no co-routine to yield and use the blocking one.
+     */
+    struct flb_upstream *u;
+    struct flb_upstream *u_sync;
+};
+
+#endif
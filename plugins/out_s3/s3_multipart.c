@@ -0,0 +1,321 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/* S3 requests: multipart uploads and single objects */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_log.h>
+#include <fluent-bit/flb_sds.h>
+#include <fluent-bit/flb_http_client.h>
+#include <fluent-bit/flb_upstream.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#include "s3.h"
+#include "s3_sign.h"
+#include "s3_multipart.h"
+
+#define S3_MIME_GZIP   "application/gzip"
+
+/*
+ * Send a request for the object 'key', the client is returned with the
+ * response or NULL on network errors. The caller releases it with
+ * s3_request_done().
+ */
+static struct flb_http_client *s3_request(struct flb_s3 *ctx,
+                                          struct flb_upstream *u,
+                                          int method, char *key, char *query,
+                                          char *content_type,
+                                          char *body, size_t size)
+{
+    int ret;
+    size_t b_sent;
+    char *str_method;
+    flb_sds_t path;
+    flb_sds_t uri;
+    struct flb_upstream_conn *u_conn;
+    struct flb_http_client *c;
+
+    switch (method) {
+    case FLB_HTTP_POST:
+        str_method = "POST";
+        break;
+    default:
+        str_method = "PUT";
+    }
+
+    /* Path style: /bucket/key */
+    path = flb_sds_create_size(256);
+    path = flb_s3_cat(path, "/", 1);
+    path = flb_s3_uri_encode(path, ctx->bucket, strlen(ctx->bucket),
+                             FLB_FALSE);
+    path = flb_s3_uri_encode(path, key, strlen(key), FLB_TRUE);
+    if (!path) {
+        return NULL;
+    }
+
+    uri = flb_sds_create_size(flb_sds_len(path) + strlen(query) + 2);
+    uri = flb_s3_cat(uri, path, flb_sds_len(path));
+    if (*query) {
+        uri = flb_s3_cat(uri, "?", 1);
+        uri = flb_s3_cat(uri, query, strlen(query));
+    }
+    if (!uri) {
+        flb_sds_destroy(path);
+        return NULL;
+    }
+
+    u_conn = flb_upstream_conn_get(u);
+    if (!u_conn) {
+        flb_error("[out_s3] no upstream connections available to %s:%i",
+                  u->tcp_host, u->tcp_port);
+        flb_sds_destroy(path);
+        flb_sds_destroy(uri);
+        return NULL;
+    }
+
+    c = flb_http_client(u_conn, method, uri, body, size,
+                        u->tcp_host, u->tcp_port, NULL, 0);
+    if (!c) {
+        flb_upstream_conn_release(u_conn);
+        flb_sds_destroy(path);
+        flb_sds_destroy(uri);
+        return NULL;
+    }
+
+    if (content_type) {
+        flb_http_add_header(c, "Content-Type", 12,
+                            content_type, strlen(content_type));
+    }
+
+    if (flb_s3_sign(ctx, c, str_method, path, query, body, size) == -1) {
+        ret = -1;
+    }
+    else {
+        ret = flb_http_do(c, &b_sent);
+    }
+    flb_sds_destroy(path);
+    flb_sds_destroy(uri);
+
+    if (ret != 0) {
+        flb_error("[out_s3] %s %s failed on %s:%i", str_method, key,
+                  u->tcp_host, u->tcp_port);
+        flb_http_client_destroy(c);
+        flb_upstream_conn_release(u_conn);
+        return NULL;
+    }
+
+    if (c->resp.status != 200) {
+        flb_error("[out_s3] %s %s, HTTP status=%i%s%.*s", str_method, key,
+                  c->resp.status, c->resp.payload ? "\n" : "",
+                  c->resp.payload ? (int) c->resp.payload_size : 0,
+                  c->resp.payload ? c->resp.payload : "");
+    }
+
+    return c;
+}
+
+static void s3_request_done(struct flb_http_client *c)
+{
+    struct flb_upstream_conn *u_conn = c->u_conn;
+
+    flb_http_client_destroy(c);
+    flb_upstream_conn_release(u_conn);
+}
+
+/* Value of a XML element or a header of the response */
+static flb_sds_t s3_response_get(char *buf, char *end,
+                                 char *start_tag, char *end_tag)
+{
+    char *p;
+    char *q;
+
+    if (!buf) {
+        return NULL;
+    }
+
+    p = strcasestr(buf, start_tag);
+    if (!p || (end && p >= end)) {
+        return NULL;
+    }
+    p += strlen(start_tag);
+    while (*p == ' ') {
+        p++;
+    }
+
+    q = strstr(p, end_tag);
+    if (!q || (end && q > end)) {
+        return NULL;
+    }
+
+    return flb_sds_create_len(p, q - p);
+}
+
+/* Start a multipart upload, it returns the upload ID */
+flb_sds_t flb_s3_multipart_create(struct flb_s3 *ctx, struct flb_upstream *u,
+                                  char *key)
+{
+    flb_sds_t id = NULL;
+    struct flb_http_client *c;
+
+    c = s3_request(ctx, u, FLB_HTTP_POST, key, "uploads=", S3_MIME_GZIP,
+                   NULL, 0);
+    if (!c) {
+        return NULL;
+    }
+
+    if (c->resp.status == 200) {
+        id = s3_response_get(c->resp.payload, NULL,
+                             "<UploadId>", "</UploadId>");
+        if (!id) {
+            flb_error("[out_s3] no upload ID in the response for %s", key);
+        }
+        else {
+            flb_debug("[out_s3] upload %s started for %s", id, key);
+        }
+    }
+    s3_request_done(c);
+
+    return id;
+}
+
+/* Query string of the requests on an upload, parameters sorted */
+static flb_sds_t upload_query(struct flb_s3_upload *up, int num)
+{
+    char tmp[32];
+    flb_sds_t q;
+
+    q = flb_sds_create_size(64 + flb_sds_len(up->upload_id));
+    if (num > 0) {
+        snprintf(tmp, sizeof(tmp), "partNumber=%i&", num);
+        q = flb_s3_cat(q, tmp, strlen(tmp));
+    }
+    q = flb_s3_cat(q, "uploadId=", 9);
+    q = flb_s3_uri_encode(q, up->upload_id, flb_sds_len(up->upload_id),
+                          FLB_FALSE);
+
+    return q;
+}
+
+/* Upload a part, it returns its ETag */
+flb_sds_t flb_s3_multipart_part(struct flb_s3 *ctx, struct flb_upstream *u,
+                                struct flb_s3_upload *up, int num,
+                                char *data, size_t size)
+{
+    flb_sds_t q;
+    flb_sds_t etag = NULL;
+    struct flb_http_client *c;
+
+    q = upload_query(up, num);
+    if (!q) {
+        return NULL;
+    }
+
+    c = s3_request(ctx, u, FLB_HTTP_PUT, up->key, q, NULL, data, size);
+    flb_sds_destroy(q);
+    if (!c) {
+        return NULL;
+    }
+
+    if (c->resp.status == 200) {
+        etag = s3_response_get(c->resp.data, c->resp.headers_end,
+                               "\r\nETag:", "\r\n");
+        if (!etag) {
+            flb_error("[out_s3] no ETag in the response for part %i of %s",
+                      num, up->key);
+        }
+    }
+    s3_request_done(c);
+
+    return etag;
+}
+
+/* Complete an upload with the parts which were uploaded */
+int flb_s3_multipart_complete(struct flb_s3 *ctx, struct flb_upstream *u,
+                              struct flb_s3_upload *up)
+{
+    int i;
+    int ret = -1;
+    char tmp[64];
+    flb_sds_t q;
+    flb_sds_t body;
+    struct flb_http_client *c;
+
+    body = flb_sds_create_size(64 + up->parts * 96);
+    body = flb_s3_cat(body, "<CompleteMultipartUpload>", 25);
+    for (i = 0; i < up->parts && body; i++) {
+        if (!up->etags[i]) {
+            continue;
+        }
+        snprintf(tmp, sizeof(tmp), "<Part><PartNumber>%i</PartNumber>", i + 1);
+        body = flb_s3_cat(body, tmp, strlen(tmp));
+        body = flb_s3_cat(body, "<ETag>", 6);
+        body = flb_s3_cat(body, up->etags[i], flb_sds_len(up->etags[i]));
+        body = flb_s3_cat(body, "</ETag></Part>", 14);
+    }
+    body = flb_s3_cat(body, "</CompleteMultipartUpload>", 26);
+    if (!body) {
+        return -1;
+    }
+
+    q = upload_query(up, 0);
+    if (!q) {
+        flb_sds_destroy(body);
+        return -1;
+    }
+
+    c = s3_request(ctx, u, FLB_HTTP_POST, up->key, q, NULL,
+                   body, flb_sds_len(body));
+    flb_sds_destroy(q);
+    flb_sds_destroy(body);
+    if (!c) {
+        return -1;
+    }
+
+    /* Errors can come with a 200 status, in the body */
+    if (c->resp.status == 200 &&
+        !(c->resp.payload && strstr(c->resp.payload, "<Error>"))) {
+        flb_info("[out_s3] uploaded %s (%i parts)", up->key, up->parts);
+        ret = 0;
+    }
+    s3_request_done(c);
+
+    return ret;
+}
+
+/* Upload a whole object */
+int flb_s3_put_object(struct flb_s3 *ctx, struct flb_upstream *u,
+                      char *key, char *data, size_t size)
+{
+    int ret = -1;
+    struct flb_http_client *c;
+
+    c = s3_request(ctx, u, FLB_HTTP_PUT, key, "", S3_MIME_GZIP, data, size);
+    if (!c) {
+        return -1;
+    }
+    if (c->resp.status == 200) {
+        flb_info("[out_s3] uploaded %s", key);
+        ret = 0;
+    }
+    s3_request_done(c);
+
+    return ret;
+}
@@ -0,0 +1,38 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef FLB_OUT_S3_MULTIPART_H
+#define FLB_OUT_S3_MULTIPART_H
+
+#include <fluent-bit/flb_sds.h>
+#include <fluent-bit/flb_upstream.h>
+
+#include "s3.h"
+
+flb_sds_t flb_s3_multipart_create(struct flb_s3 *ctx, struct flb_upstream *u,
+                                  char *key);
+flb_sds_t flb_s3_multipart_part(struct flb_s3 *ctx, struct flb_upstream *u,
+                                struct flb_s3_upload *up, int num,
+                                char *data, size_t size);
+int flb_s3_multipart_complete(struct flb_s3 *ctx, struct flb_upstream *u,
+                              struct flb_s3_upload *up);
+int flb_s3_put_object(struct flb_s3 *ctx, struct flb_upstream *u,
+                      char *key, char *data, size_t size);
+
+#endif
@@ -0,0 +1,211 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/* AWS Signature Version 4 of the S3 requests */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_log.h>
+#include <fluent-bit/flb_sds.h>
+#include <fluent-bit/flb_http_client.h>
+
+#include <mbedtls/md.h>
+#include <mbedtls/sha256.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "s3.h"
+#include "s3_sign.h"
+
+#define S3_ALGORITHM       "AWS4-HMAC-SHA256"
+#define S3_SERVICE         "s3"
+#define S3_SIGNED_HEADERS  "host;x-amz-content-sha256;x-amz-date"
+
+/* Append 'str' with the characters out of the unreserved set escaped */
+flb_sds_t flb_s3_uri_encode(flb_sds_t s, const char *str, size_t len,
+                            int slash)
+{
+    size_t i;
+    char c;
+    char hex[4];
+
+    for (i = 0; i < len && s; i++) {
+        c = str[i];
+        if ((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') ||
+            (c >= '0' && c <= '9') || c == '-' || c == '_' || c == '.' ||
+            c == '~' || (c == '/' && slash)) {
+            s = flb_s3_cat(s, &c, 1);
+        }
+        else {
+            snprintf(hex, sizeof(hex), "%%%02X", (unsigned char) c);
+            s = flb_s3_cat(s, hex, 3);
+        }
+    }
+
+    return s;
+}
+
+static void to_hex(unsigned char *in, int len, char *out)
+{
+    int i;
+    static const char digits[] = "0123456789abcdef";
+
+    for (i = 0; i < len; i++) {
+        out[i * 2] = digits[in[i] >> 4];
+        out[i * 2 + 1] = digits[in[i] & 0xf];
+    }
+    out[len * 2] = '\0';
+}
+
+static void sha256_hex(const char *data, size_t size, char *out)
+{
+    unsigned char hash[32];
+
+    mbedtls_sha256_ret((const unsigned char *) data, size, hash, 0);
+    to_hex(hash, sizeof(hash), out);
+}
+
+static int hmac(const unsigned char *key, size_t key_len,
+                const char *data, size_t size, unsigned char *out)
+{
+    return mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256),
+                           key, key_len, (const unsigned char *) data, size,
+                           out);
+}
+
+static inline int header(struct flb_http_client *c, char *key, char *val)
+{
+    return flb_http_add_header(c, key, strlen(key), val, strlen(val));
+}
+
+/*
+ * Sign a request: 'path' and 'query' are given as sent, URI encoded and
+ * with the query parameters sorted. The x-amz-* and Authorization headers
+ * are added to the client.
+ */
+int flb_s3_sign(struct flb_s3 *ctx, struct flb_http_client *c,
+                char *method, char *path, char *query,
+                char *body, size_t size)
+{
+    int len;
+    int ret = -1;
+    char date[17];
+    char day[9];
+    char payload[65];
+    char canonical_hash[65];
+    char host[256];
+    char signature[65];
+    char scope[128];
+    char auth[512];
+    unsigned char key[32];
+    unsigned char secret[256];
+    time_t now;
+    struct tm tm;
+    flb_sds_t s;
+    struct flb_upstream *u = c->u_conn->u;
+
+    now = time(NULL);
+    gmtime_r(&now, &tm);
+    strftime(date, sizeof(date), "%Y%m%dT%H%M%SZ", &tm);
+    memcpy(day, date, 8);
+    day[8] = '\0';
+
+    sha256_hex(body, size, payload);
+    snprintf(host, sizeof(host), "%s:%i", u->tcp_host, u->tcp_port);
+    snprintf(scope, sizeof(scope), "%s/%s/" S3_SERVICE "/aws4_request",
+             day, ctx->region);
+
+    /* Canonical request */
+    s = flb_sds_create_size(512);
+    s = flb_s3_cat(s, method, strlen(method));
+    s = flb_s3_cat(s, "\n", 1);
+    s = flb_s3_cat(s, path, strlen(path));
+    s = flb_s3_cat(s, "\n", 1);
+    s = flb_s3_cat(s, query, strlen(query));
+    s = flb_s3_cat(s, "\nhost:", 6);
+    s = flb_s3_cat(s, host, strlen(host));
+    s = flb_s3_cat(s, "\nx-amz-content-sha256:", 22);
+    s = flb_s3_cat(s, payload, 64);
+    s = flb_s3_cat(s, "\nx-amz-date:", 12);
+    s = flb_s3_cat(s, date, 16);
+    if (ctx->session_token) {
+        s = flb_s3_cat(s, "\nx-amz-security-token:", 22);
+        s = flb_s3_cat(s, ctx->session_token, strlen(ctx->session_token));
+    }
+    s = flb_s3_cat(s, "\n\n", 2);
+    s = flb_s3_cat(s, S3_SIGNED_HEADERS, sizeof(S3_SIGNED_HEADERS) - 1);
+    if (ctx->session_token) {
+        s = flb_s3_cat(s, ";x-amz-security-token", 21);
+    }
+    s = flb_s3_cat(s, "\n", 1);
+    s = flb_s3_cat(s, payload, 64);
+    if (!s) {
+        return -1;
+    }
+    sha256_hex(s, flb_sds_len(s), canonical_hash);
+
+    /* String to sign */
+    flb_sds_len_set(s, 0);
+    s = flb_s3_cat(s, S3_ALGORITHM "\n", sizeof(S3_ALGORITHM));
+    s = flb_s3_cat(s, date, 16);
+    s = flb_s3_cat(s, "\n", 1);
+    s = flb_s3_cat(s, scope, strlen(scope));
+    s = flb_s3_cat(s, "\n", 1);
+    s = flb_s3_cat(s, canonical_hash, 64);
+    if (!s) {
+        return -1;
+    }
+
+    /* Signing key */
+    len = snprintf((char *) secret, sizeof(secret), "AWS4%s", ctx->secret_key);
+    if (len >= sizeof(secret) ||
+        hmac(secret, len, day, 8, key) != 0 ||
+        hmac(key, 32, ctx->region, strlen(ctx->region), key) != 0 ||
+        hmac(key, 32, S3_SERVICE, sizeof(S3_SERVICE) - 1, key) != 0 ||
+        hmac(key, 32, "aws4_request", 12, key) != 0 ||
+        hmac(key, 32, s, flb_sds_len(s), key) != 0) {
+        flb_error("[out_s3] cannot sign the request");
+        goto exit;
+    }
+    to_hex(key, 32, signature);
+
+    len = snprintf(auth, sizeof(auth),
+                   S3_ALGORITHM " Credential=%s/%s, SignedHeaders="
+                   S3_SIGNED_HEADERS "%s, Signature=%s",
+                   ctx->access_key, scope,
+                   ctx->session_token ? ";x-amz-security-token" : "",
+                   signature);
+    if (len >= sizeof(auth)) {
+        goto exit;
+    }
+
+    header(c, "x-amz-date", date);
+    header(c, "x-amz-content-sha256", payload);
+    if (ctx->session_token) {
+        header(c, "x-amz-security-token", ctx->session_token);
+    }
+    header(c, "Authorization", auth);
+    ret = 0;
+
+ exit:
+    memset(secret, 0, sizeof(secret));
+    flb_sds_destroy(s);
+    return ret;
+}
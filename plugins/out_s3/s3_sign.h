@@ -0,0 +1,52 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef FLB_OUT_S3_SIGN_H
+#define FLB_OUT_S3_SIGN_H
+
+#include <fluent-bit/flb_sds.h>
+#include <fluent-bit/flb_http_client.h>
+
+#include "s3.h"
+
+/*
+ * flb_sds_cat() for chained calls: a NULL string is passed along and the
+ * string is released on errors.
+ */
+static inline flb_sds_t flb_s3_cat(flb_sds_t s, const char *str, int len)
+{
+    flb_sds_t tmp;
+
+    if (!s) {
+        return NULL;
+    }
+    tmp = flb_sds_cat(s, (char *) str, len);
+    if (!tmp) {
+        flb_sds_destroy(s);
+    }
+    return tmp;
+}
+
+flb_sds_t flb_s3_uri_encode(flb_sds_t s, const char *str, size_t len,
+                            int slash);
+int flb_s3_sign(struct flb_s3 *ctx, struct flb_http_client *c,
+                char *method, char *path, char *query,
+                char *body, size_t size);
+
+#endif
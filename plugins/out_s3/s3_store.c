@@ -0,0 +1,210 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/*
+ * Local store: parts which cannot be uploaded are moved from memory to
+ * files in 'store_dir'. The files left by a previous run are uploaded as
+ * objects of their own, their multipart upload is gone.
+ */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_log.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_sds.h>
+
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "s3.h"
+#include "s3_store.h"
+
+/* Load the stored parts of a previous run */
+int flb_s3_store_init(struct flb_s3 *ctx)
+{
+    int num;
+    int len;
+    char line[4096];
+    char path[PATH_MAX];
+    FILE *fp;
+    DIR *dir;
+    struct dirent *e;
+    struct flb_s3_part *part;
+
+    if (mkdir(ctx->store_dir, 0700) == -1 && errno != EEXIST) {
+        flb_errno();
+        flb_error("[out_s3] cannot create store_dir %s", ctx->store_dir);
+        return -1;
+    }
+
+    dir = opendir(ctx->store_dir);
+    if (!dir) {
+        flb_errno();
+        return -1;
+    }
+
+    while ((e = readdir(dir))) {
+        len = strlen(e->d_name);
+        if (len <= sizeof(FLB_S3_STORE_EXT) - 1 ||
+            strcmp(e->d_name + len - (sizeof(FLB_S3_STORE_EXT) - 1),
+                   FLB_S3_STORE_EXT) != 0) {
+            continue;
+        }
+
+        snprintf(path, sizeof(path), "%s/%s", ctx->store_dir, e->d_name);
+        fp = fopen(path, "r");
+        if (!fp) {
+            continue;
+        }
+        if (!fgets(line, sizeof(line), fp) ||
+            sscanf(line, FLB_S3_STORE_MAGIC " %i %n", &num, &len) != 1 ||
+            line[strlen(line) - 1] != '\n') {
+            flb_warn("[out_s3] ignoring invalid stored part %s", path);
+            fclose(fp);
+            continue;
+        }
+        fclose(fp);
+
+        part = flb_calloc(1, sizeof(struct flb_s3_part));
+        if (!part) {
+            flb_errno();
+            break;
+        }
+        part->num = num;
+        part->key = flb_sds_create_len(line + len, strlen(line + len) - 1);
+        part->file = flb_sds_create(path);
+        if (!part->key || !part->file) {
+            if (part->key) {
+                flb_sds_destroy(part->key);
+            }
+            if (part->file) {
+                flb_sds_destroy(part->file);
+            }
+            flb_free(part);
+            break;
+        }
+        mk_list_add(&part->_head, &ctx->orphans);
+        flb_info("[out_s3] stored part %i of %s found in %s",
+                 num, part->key, path);
+    }
+    closedir(dir);
+
+    return 0;
+}
+
+/* Move the data of a part from memory to a file */
+int flb_s3_store_spill(struct flb_s3 *ctx, struct flb_s3_upload *up,
+                       struct flb_s3_part *part)
+{
+    int ret;
+    char path[PATH_MAX];
+    FILE *fp;
+    static unsigned int seq = 0;
+
+    snprintf(path, sizeof(path), "%s/%lu-%i-%u" FLB_S3_STORE_EXT,
+             ctx->store_dir, (unsigned long) time(NULL), getpid(), seq++);
+
+    fp = fopen(path, "w");
+    if (!fp) {
+        flb_errno();
+        flb_error("[out_s3] cannot store part %i of %s in %s",
+                  part->num, up->key, path);
+        return -1;
+    }
+    ret = fprintf(fp, FLB_S3_STORE_MAGIC " %i %s\n", part->num, up->key);
+    if (ret < 0 || fwrite(part->data, part->size, 1, fp) != 1) {
+        flb_errno();
+        fclose(fp);
+        unlink(path);
+        return -1;
+    }
+    if (fclose(fp) != 0) {
+        flb_errno();
+        unlink(path);
+        return -1;
+    }
+
+    part->file = flb_sds_create(path);
+    if (!part->file) {
+        unlink(path);
+        return -1;
+    }
+
+    flb_debug("[out_s3] part %i of %s stored in %s", part->num, up->key, path);
+    ctx->buffered -= part->size;
+    flb_free(part->data);
+    part->data = NULL;
+    return 0;
+}
+
+/* Read the data of a stored part, it must be released with flb_free() */
+int flb_s3_store_read(struct flb_s3_part *part, char **data, size_t *size)
+{
+    char *buf;
+    char *p;
+    FILE *fp;
+    struct stat st;
+
+    fp = fopen(part->file, "r");
+    if (!fp) {
+        flb_errno();
+        return -1;
+    }
+    if (fstat(fileno(fp), &st) == -1 || st.st_size == 0) {
+        fclose(fp);
+        return -1;
+    }
+
+    buf = flb_malloc(st.st_size);
+    if (!buf) {
+        flb_errno();
+        fclose(fp);
+        return -1;
+    }
+    if (fread(buf, st.st_size, 1, fp) != 1) {
+        flb_errno();
+        flb_free(buf);
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+
+    /* Skip the header */
+    p = memchr(buf, '\n', st.st_size);
+    if (!p) {
+        flb_free(buf);
+        return -1;
+    }
+    p++;
+    *size = st.st_size - (p - buf);
+    memmove(buf, p, *size);
+    *data = buf;
+
+    return 0;
+}
+
+void flb_s3_store_remove(struct flb_s3_part *part)
+{
+    if (part->file && unlink(part->file) == -1) {
+        flb_errno();
+    }
+}
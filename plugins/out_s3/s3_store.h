@@ -0,0 +1,35 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef FLB_OUT_S3_STORE_H
+#define FLB_OUT_S3_STORE_H
+
+#include "s3.h"
+
+/* Stored parts: 'S3PART <part number> <key>\n' and the part data */
+#define FLB_S3_STORE_MAGIC    "S3PART"
+#define FLB_S3_STORE_EXT      ".part"
+
+int flb_s3_store_init(struct flb_s3 *ctx);
+int flb_s3_store_spill(struct flb_s3 *ctx, struct flb_s3_upload *up,
+                       struct flb_s3_part *part);
+int flb_s3_store_read(struct flb_s3_part *part, char **data, size_t *size);
+void flb_s3_store_remove(struct flb_s3_part *part);
+
+#endif
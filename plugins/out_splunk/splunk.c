@@ -23,6 +23,7 @@
 #include <fluent-bit/flb_pack.h>
 #include <fluent-bit/flb_utils.h>
 #include <fluent-bit/flb_time.h>
+#include <fluent-bit/flb_compress.h>
 #include <msgpack.h>
 
 #include "splunk.h"
@@ -43,103 +44,142 @@ static int cb_splunk_init(struct flb_output_instance *ins,
     return 0;
 }
 
-int splunk_format(void *in_buf, size_t in_bytes,
-                  char **out_buf, size_t *out_size,
-                  struct flb_splunk *ctx)
+static inline int splunk_cat(flb_sds_t *buf, char *str, int len)
 {
-    int i;
-    int map_size;
-    size_t off = 0;
-    double t;
-    struct flb_time tm;
-    msgpack_unpacked result;
-    msgpack_object root;
-    msgpack_object *obj;
-    msgpack_object map;
-    msgpack_object k;
-    msgpack_object v;
-    msgpack_sbuffer mp_sbuf;
-    msgpack_packer mp_pck;
     flb_sds_t tmp;
-    flb_sds_t record;
-    flb_sds_t json_out;
 
-    json_out = flb_sds_create_size(in_bytes * 1.5);
-    if (!json_out) {
+    tmp = flb_sds_cat(*buf, str, len);
+    if (!tmp) {
         flb_errno();
         return -1;
     }
+    *buf = tmp;
+    return 0;
+}
 
-    /* Iterate the original buffer and perform adjustments */
-    msgpack_unpacked_init(&result);
-
-    while (msgpack_unpack_next(&result, in_buf, in_bytes, &off)) {
-        root = result.data;
+/*
+ * Append one record to the payload. Events are wrapped in their envelope
+ * as the JSON is written, raw data is the record JSON (or the 'raw_key'
+ * string) followed by a line break.
+ */
+static int splunk_format_record(struct flb_splunk *ctx, flb_sds_t *buf,
+                                struct flb_time *tm, msgpack_object *map)
+{
+    int i;
+    int len;
+    char tmp[64];
+    msgpack_object *k;
+    msgpack_object *v;
+
+    if (ctx->endpoint == FLB_SPLUNK_ENDPOINT_EVENT) {
+        len = snprintf(tmp, sizeof(tmp) - 1,
+                       "{\"" FLB_SPLUNK_DEFAULT_TIME "\":%f, \""
+                       FLB_SPLUNK_DEFAULT_EVENT "\":",
+                       flb_time_to_double(tm));
+        if (splunk_cat(buf, tmp, len) == -1 ||
+            flb_msgpack_to_json_sds(buf, map) == -1) {
+            return -1;
+        }
+        return splunk_cat(buf, "}", 1);
+    }
 
-        /* Get timestamp */
-        flb_time_pop_from_msgpack(&tm, &result, &obj);
-        t = flb_time_to_double(&tm);
-
-        /* Create temporal msgpack buffer */
-        msgpack_sbuffer_init(&mp_sbuf);
-        msgpack_packer_init(&mp_pck, &mp_sbuf, msgpack_sbuffer_write);
-
-        map = root.via.array.ptr[1];
-        map_size = map.via.map.size;
-
-        msgpack_pack_map(&mp_pck, 2);
-
-        /* Append the time key */
-        msgpack_pack_str(&mp_pck, sizeof(FLB_SPLUNK_DEFAULT_TIME) -1);
-        msgpack_pack_str_body(&mp_pck,
-                              FLB_SPLUNK_DEFAULT_TIME,
-                              sizeof(FLB_SPLUNK_DEFAULT_TIME) - 1);
-        msgpack_pack_double(&mp_pck, t);
-
-        /* Append event key */
-        msgpack_pack_str(&mp_pck, sizeof(FLB_SPLUNK_DEFAULT_EVENT) -1);
-        msgpack_pack_str_body(&mp_pck,
-                              FLB_SPLUNK_DEFAULT_EVENT,
-                              sizeof(FLB_SPLUNK_DEFAULT_EVENT) - 1);
-        msgpack_pack_map(&mp_pck, map_size);
-
-        /* Append k/v */
-        for (i = 0; i < map_size; i++) {
-            k = map.via.map.ptr[i].key;
-            v = map.via.map.ptr[i].val;
-
-            msgpack_pack_object(&mp_pck, k);
-            msgpack_pack_object(&mp_pck, v);
+    /* raw */
+    if (ctx->raw_key && map->type == MSGPACK_OBJECT_MAP) {
+        for (i = 0; i < map->via.map.size; i++) {
+            k = &map->via.map.ptr[i].key;
+            v = &map->via.map.ptr[i].val;
+            if (k->type != MSGPACK_OBJECT_STR ||
+                k->via.str.size != ctx->raw_key_len ||
+                strncmp(k->via.str.ptr, ctx->raw_key, ctx->raw_key_len) != 0) {
+                continue;
+            }
+            if (v->type == MSGPACK_OBJECT_STR) {
+                if (splunk_cat(buf, (char *) v->via.str.ptr,
+                               v->via.str.size) == -1) {
+                    return -1;
+                }
+                return splunk_cat(buf, "\n", 1);
+            }
+            map = v;
+            break;
         }
+    }
 
-        record = flb_msgpack_raw_to_json_sds(mp_sbuf.data, mp_sbuf.size);
-        if (!record) {
-            flb_errno();
-            msgpack_sbuffer_destroy(&mp_sbuf);
-            msgpack_unpacked_destroy(&result);
-            flb_sds_destroy(json_out);
-            return -1;
+    if (flb_msgpack_to_json_sds(buf, map) == -1) {
+        return -1;
+    }
+    return splunk_cat(buf, "\n", 1);
+}
+
+/*
+ * Send one request, returns FLB_OK or FLB_RETRY. 'failed' is set when the
+ * failure is on the server side (network errors and 5xx).
+ */
+static int splunk_send(struct flb_splunk *ctx,
+                       struct flb_upstream_conn *u_conn,
+                       char *data, size_t size, int *failed,
+                       struct flb_config *config)
+{
+    int ret;
+    int out_ret = FLB_OK;
+    size_t b_sent;
+    void *body = data;
+    size_t body_len = size;
+    struct flb_http_client *c;
+
+    if (ctx->compress_gzip == FLB_TRUE &&
+        flb_compress_gzip(config, data, size, &body, &body_len) == -1) {
+        flb_error("[out_splunk] cannot gzip the request body");
+        return FLB_RETRY;
+    }
+
+    /* Compose HTTP Client request */
+    c = flb_http_client(u_conn, FLB_HTTP_POST, ctx->uri,
+                        body, body_len, NULL, 0, NULL, 0);
+    if (!c) {
+        if (body != data) {
+            flb_free(body);
         }
+        return FLB_RETRY;
+    }
+    flb_http_buffer_size(c, FLB_HTTP_DATA_SIZE_MAX);
+    flb_http_add_header(c, "User-Agent", 10, "Fluent-Bit", 10);
+    flb_http_add_header(c, "Authorization", 13,
+                        ctx->auth_header, flb_sds_len(ctx->auth_header));
+    if (ctx->channel) {
+        flb_http_add_header(c, "X-Splunk-Request-Channel", 24,
+                            ctx->channel, strlen(ctx->channel));
+    }
+    if (ctx->compress_gzip == FLB_TRUE) {
+        flb_http_add_header(c, "Content-Encoding", 16, "gzip", 4);
+    }
+
+    ret = flb_http_do(c, &b_sent);
+    if (ret != 0 || c->resp.status >= 500) {
+        *failed = FLB_TRUE;
+    }
 
-        tmp = flb_sds_cat(json_out, record, flb_sds_len(record));
-        flb_sds_destroy(record);
-        if (tmp) {
-            json_out = tmp;
+    if (ret != 0) {
+        flb_warn("[out_splunk] http_do=%i", ret);
+        out_ret = FLB_RETRY;
+    }
+    else if (c->resp.status != 200) {
+        if (c->resp.payload_size > 0) {
+            flb_warn("[out_splunk] http_status=%i:\n%s",
+                     c->resp.status, c->resp.payload);
         }
         else {
-            flb_errno();
-            msgpack_sbuffer_destroy(&mp_sbuf);
-            msgpack_unpacked_destroy(&result);
-            flb_sds_destroy(json_out);
-            return -1;
+            flb_warn("[out_splunk] http_status=%i", c->resp.status);
         }
-        msgpack_sbuffer_destroy(&mp_sbuf);
+        out_ret = FLB_RETRY;
     }
 
-    *out_buf = json_out;
-    *out_size = flb_sds_len(json_out);
+    flb_http_client_destroy(c);
+    if (body != data) {
+        flb_free(body);
+    }
 
-    return 0;
+    return out_ret;
 }
 
 static void cb_splunk_flush(void *data, size_t bytes,
@@ -148,69 +188,89 @@ static void cb_splunk_flush(void *data, size_t bytes,
                             void *out_context,
                             struct flb_config *config)
 {
-    int ret;
-    size_t b_sent;
-    char *buf_data;
-    size_t buf_size;
+    int ret = FLB_OK;
+    int failed = FLB_FALSE;
+    size_t off = 0;
+    size_t prev;
+    size_t len;
+    struct flb_time tm;
     struct flb_splunk *ctx = out_context;
+    struct flb_upstream *u = ctx->u;
+    struct flb_upstream_node *node = NULL;
     struct flb_upstream_conn *u_conn;
-    struct flb_http_client *c;
+    msgpack_unpacked result;
+    msgpack_object root;
+    msgpack_object *obj;
     flb_sds_t payload;
     (void) i_ins;
     (void) config;
 
-    /* Get upstream connection */
-    u_conn = flb_upstream_conn_get(ctx->u);
-    if (!u_conn) {
+    payload = flb_sds_create_size_arena(flb_output_arena(),
+                                        ctx->payload_max > 0 &&
+                                        ctx->payload_max < bytes * 1.5 ?
+                                        ctx->payload_max + 1024 :
+                                        bytes * 1.5);
+    if (!payload) {
+        flb_errno();
         FLB_OUTPUT_RETURN(FLB_RETRY);
     }
 
-    /* Convert binary logs into a JSON payload */
-    ret = splunk_format(data, bytes, &buf_data, &buf_size, ctx);
-    if (ret == -1) {
-        flb_upstream_conn_release(u_conn);
-        FLB_OUTPUT_RETURN(FLB_ERROR);
+    /* Get upstream connection, from the next node if there are many */
+    if (ctx->ug) {
+        node = flb_upstream_group_node_get(ctx->ug);
+        u = node->u;
+    }
+    u_conn = flb_upstream_conn_get(u);
+    if (!u_conn) {
+        if (node) {
+            flb_upstream_group_node_release(ctx->ug, node, FLB_TRUE);
+        }
+        flb_sds_destroy(payload);
+        FLB_OUTPUT_RETURN(FLB_RETRY);
     }
-    payload = (flb_sds_t) buf_data;
 
-    /* Compose HTTP Client request */
-    c = flb_http_client(u_conn, FLB_HTTP_POST, FLB_SPLUNK_DEFAULT_URI,
-                        buf_data, buf_size, NULL, 0, NULL, 0);
-    flb_http_buffer_size(c, FLB_HTTP_DATA_SIZE_MAX);
-    flb_http_add_header(c, "User-Agent", 10, "Fluent-Bit", 10);
+    /*
+     * Records are encoded into the payload and sent once it reaches
+     * 'payload_max', a record bigger than the cap goes in its own request.
+     */
+    msgpack_unpacked_init(&result);
+    while (ret == FLB_OK &&
+           msgpack_unpack_next(&result, data, bytes, &off)) {
+        root = result.data;
+        if (root.type != MSGPACK_OBJECT_ARRAY || root.via.array.size != 2) {
+            continue;
+        }
+        flb_time_pop_from_msgpack(&tm, &result, &obj);
 
-    flb_http_add_header(c, "Authorization", 13,
-                        ctx->auth_header, flb_sds_len(ctx->auth_header));
-    ret = flb_http_do(c, &b_sent);
-    if (ret != 0) {
-        flb_warn("[out_splunk] http_do=%i", ret);
-        goto retry;
-    }
-    else {
-        if (c->resp.status != 200) {
-            if (c->resp.payload_size > 0) {
-                flb_warn("[out_splunk] http_status=%i:\n%s",
-                         c->resp.status, c->resp.payload);
-            }
-            else {
-                flb_warn("[out_splunk] http_status=%i", c->resp.status);
-            }
-            goto retry;
+        prev = flb_sds_len(payload);
+        if (splunk_format_record(ctx, &payload, &tm,
+                                 &root.via.array.ptr[1]) == -1) {
+            ret = FLB_RETRY;
+            break;
+        }
+
+        len = flb_sds_len(payload);
+        if (ctx->payload_max > 0 && len > ctx->payload_max && prev > 0) {
+            ret = splunk_send(ctx, u_conn, payload, prev, &failed, config);
+            memmove(payload, payload + prev, len - prev);
+            flb_sds_len_set(payload, len - prev);
         }
     }
+    msgpack_unpacked_destroy(&result);
 
-    /* Cleanup */
-    flb_http_client_destroy(c);
-    flb_sds_destroy(payload);
-    flb_upstream_conn_release(u_conn);
-    FLB_OUTPUT_RETURN(FLB_OK);
+    if (ret == FLB_OK && flb_sds_len(payload) > 0) {
+        ret = splunk_send(ctx, u_conn, payload, flb_sds_len(payload),
+                          &failed, config);
+    }
+
+    if (node) {
+        /* Network errors and 5xx count against the node */
+        flb_upstream_group_node_release(ctx->ug, node, failed);
+    }
 
-    /* Issue a retry */
- retry:
-    flb_http_client_destroy(c);
     flb_sds_destroy(payload);
     flb_upstream_conn_release(u_conn);
-    FLB_OUTPUT_RETURN(FLB_RETRY);
+    FLB_OUTPUT_RETURN(ret);
 }
 
 static int cb_splunk_exit(void *data, struct flb_config *config)
@@ -229,5 +289,6 @@ struct flb_output_plugin out_splunk_plugin = {
     .cb_exit      = cb_splunk_exit,
 
     /* Plugin flags */
-    .flags          = FLB_OUTPUT_NET | FLB_IO_OPT_TLS,
+    .flags          = FLB_OUTPUT_NET | FLB_IO_OPT_TLS | FLB_OUTPUT_SHARDS |
+                      FLB_OUTPUT_HTTP2,
 };
@@ -23,9 +23,14 @@
 #define FLB_SPLUNK_DEFAULT_HOST       "127.0.0.1"
 #define FLB_SPLUNK_DEFAULT_PORT       8088
 #define FLB_SPLUNK_DEFAULT_URI        "/services/collector/event"
+#define FLB_SPLUNK_RAW_URI            "/services/collector/raw"
 #define FLB_SPLUNK_DEFAULT_TIME       "time"
 #define FLB_SPLUNK_DEFAULT_EVENT      "event"
 
+/* HEC endpoints */
+#define FLB_SPLUNK_ENDPOINT_EVENT     0  /* JSON event envelopes       */
+#define FLB_SPLUNK_ENDPOINT_RAW       1  /* newline delimited raw data */
+
 #include <fluent-bit/flb_info.h>
 #include <fluent-bit/flb_output.h>
 #include <fluent-bit/flb_sds.h>
@@ -38,8 +43,20 @@ struct flb_splunk {
     /* Token Auth */
     flb_sds_t auth_header;
 
-    /* Upstream connection to the backend server */
+    /* Endpoint: event or raw, 'raw_key' selects the value sent as raw */
+    int endpoint;
+    char *uri;
+    char *raw_key;
+    int raw_key_len;
+    char *channel;
+
+    /* Request body: gzip and size cap (zero is unlimited) */
+    int compress_gzip;
+    size_t payload_max;
+
+    /* Upstream connection to the backend server, or the group of nodes */
     struct flb_upstream *u;
+    struct flb_upstream_group *ug;
 };
 
 #endif
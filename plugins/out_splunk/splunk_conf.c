@@ -17,6 +17,10 @@
  *  limitations under the License.
  */
 
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_str.h>
+#include <fluent-bit/flb_utils.h>
+
 #include "splunk.h"
 #include "splunk_conf.h"
 
@@ -70,6 +74,14 @@ struct flb_splunk *flb_splunk_conf_create(struct flb_output_instance *ins,
 
     /* Set manual Index and Type */
     ctx->u = upstream;
+    flb_output_upstream_set(ctx->u, ins);
+
+    /* Many HEC endpoints: requests are balanced between them */
+    if (flb_output_upstream_group(ins, config, FLB_SPLUNK_DEFAULT_PORT,
+                                  io_flags, &ins->tls, &ctx->ug) == -1) {
+        flb_splunk_conf_destroy(ctx);
+        return NULL;
+    }
 
     /* Splunk Auth Token */
     tmp = flb_output_get_property("splunk_token", ins);
@@ -91,6 +103,57 @@ struct flb_splunk *flb_splunk_conf_create(struct flb_output_instance *ins,
         return NULL;
     }
 
+    /* HEC endpoint */
+    ctx->endpoint = FLB_SPLUNK_ENDPOINT_EVENT;
+    tmp = flb_output_get_property("endpoint", ins);
+    if (tmp) {
+        if (strcasecmp(tmp, "raw") == 0) {
+            ctx->endpoint = FLB_SPLUNK_ENDPOINT_RAW;
+        }
+        else if (strcasecmp(tmp, "event") != 0) {
+            flb_error("[out_splunk] invalid endpoint '%s'", tmp);
+            flb_splunk_conf_destroy(ctx);
+            return NULL;
+        }
+    }
+    ctx->uri = (ctx->endpoint == FLB_SPLUNK_ENDPOINT_RAW) ?
+        FLB_SPLUNK_RAW_URI : FLB_SPLUNK_DEFAULT_URI;
+
+    tmp = flb_output_get_property("raw_key", ins);
+    if (tmp) {
+        ctx->raw_key = flb_strdup(tmp);
+        ctx->raw_key_len = strlen(tmp);
+    }
+
+    tmp = flb_output_get_property("channel", ins);
+    if (tmp) {
+        ctx->channel = flb_strdup(tmp);
+    }
+
+    /* Request compression */
+    tmp = flb_output_get_property("compress", ins);
+    if (tmp) {
+        if (strcasecmp(tmp, "gzip") == 0) {
+            ctx->compress_gzip = FLB_TRUE;
+        }
+        else {
+            flb_warn("[out_splunk] unknown compress=%s, sending uncompressed",
+                     tmp);
+        }
+    }
+
+    /* Maximum payload of a request, bigger flushes are split */
+    tmp = flb_output_get_property("payload_max", ins);
+    if (tmp) {
+        ssize_t size = flb_utils_size_to_bytes(tmp);
+        if (size < 0) {
+            flb_error("[out_splunk] invalid payload_max '%s'", tmp);
+            flb_splunk_conf_destroy(ctx);
+            return NULL;
+        }
+        ctx->payload_max = size;
+    }
+
     /* HTTP Auth */
     tmp = flb_output_get_property("http_user", ins);
     if (tmp && ctx->auth_header) {
@@ -129,7 +192,14 @@ int flb_splunk_conf_destroy(struct flb_splunk *ctx)
     if (ctx->http_passwd) {
         flb_free(ctx->http_passwd);
     }
-    flb_upstream_destroy(ctx->u);
+    flb_free(ctx->raw_key);
+    flb_free(ctx->channel);
+    if (ctx->u) {
+        flb_upstream_destroy(ctx->u);
+    }
+    if (ctx->ug) {
+        flb_upstream_group_destroy(ctx->ug);
+    }
     flb_free(ctx);
 
     return 0;
@@ -22,6 +22,7 @@
 #include <fluent-bit/flb_output.h>
 #include <fluent-bit/flb_utils.h>
 #include <fluent-bit/flb_time.h>
+#include <fluent-bit/flb_mp.h>
 #include <msgpack.h>
 
 #include "stdout.h"
@@ -42,7 +43,7 @@ void cb_stdout_flush(void *data, size_t bytes,
                      void *out_context,
                      struct flb_config *config)
 {
-    msgpack_unpacked result;
+    msgpack_unpacked *result;
     size_t off = 0, cnt = 0;
     (void) i_ins;
     (void) out_context;
@@ -50,15 +51,19 @@ void cb_stdout_flush(void *data, size_t bytes,
     struct flb_time tmp;
     msgpack_object *p;
 
-    msgpack_unpacked_init(&result);
-    while (msgpack_unpack_next(&result, data, bytes, &off)) {
+    result = flb_mp_unpacker_get();
+    if (!result) {
+        FLB_OUTPUT_RETURN(FLB_RETRY);
+    }
+    while (flb_mp_unpack_next(result, data, bytes, &off) ==
+           MSGPACK_UNPACK_SUCCESS) {
         printf("[%zd] %s: [", cnt++, tag);
-        flb_time_pop_from_msgpack(&tmp, &result, &p);
+        flb_time_pop_from_msgpack(&tmp, result, &p);
         printf("%"PRIu32".%09lu, ", (uint32_t)tmp.tm.tv_sec, tmp.tm.tv_nsec);
         msgpack_object_print(stdout, *p);
         printf("]\n");
     }
-    msgpack_unpacked_destroy(&result);
+    flb_mp_unpacker_put(result);
 
     FLB_OUTPUT_RETURN(FLB_OK);
 }
@@ -68,5 +73,5 @@ struct flb_output_plugin out_stdout_plugin = {
     .description  = "Prints events to STDOUT",
     .cb_init      = cb_stdout_init,
     .cb_flush     = cb_stdout_flush,
-    .flags        = 0,
+    .flags        = FLB_OUTPUT_SHARDS,
 };
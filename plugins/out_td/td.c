@@ -166,6 +166,7 @@ int cb_td_init(struct flb_output_instance *ins, struct flb_config *config,
         return -1;
     }
     ctx->u = upstream;
+    flb_output_upstream_set(ctx->u, ins);
 
     flb_output_set_context(ins, ctx);
     return 0;
@@ -248,5 +249,5 @@ struct flb_output_plugin out_td_plugin = {
     .cb_pre_run     = NULL,
     .cb_flush       = cb_td_flush,
     .cb_exit        = cb_td_exit,
-    .flags          = FLB_IO_TLS,
+    .flags          = FLB_IO_TLS | FLB_OUTPUT_SHARDS,
 };
@@ -4,7 +4,10 @@
 
    - cb_print   => Print records to the standard output
    - cb_drop    => Drop the record
-   - cb_replace => Replace record content with a new JSON map
+   - cb_replace => Replace record content with a new map
+   - cb_batch   => Batch mode ('batch on'): add a key to every record
+   - cb_ffi     => FFI record view ('record_type ffi'): drop or tag records
+                   reading only the fields that are needed
 
    The key inside each function is to do a proper handling of the
    return values. Each function must return 3 values:
@@ -17,7 +20,8 @@
                  0 record not modified, keep the original
                  1 record was modified, replace content
    - timestamp: Unix timestamp with precision (double)
-   - record   : JSON map with multiple key/val
+   - record   : table with multiple key/val (a JSON string when the
+                filter sets 'record_type json')
 
    Uppon return if code == 1 (modified), then filter_lua plugin
    will replace the original timestamp and record with the returned
@@ -38,9 +42,32 @@ function cb_drop(tag, timestamp, record)
    return -1, 0, 0
 end
 
--- Compose a new JSON map and report it
+-- Compose a new map and report it
 function cb_replace(tag, timestamp, record)
    -- Record modified, so 'code' return value (first parameter) is 1
-   new_record = "{\"new\": 12345, \"old\": " .. record .. "}"
+   new_record = {}
+   new_record["new"] = 12345
+   new_record["old"] = record
    return 1, timestamp, new_record
 end
+
+-- Batch mode: timestamps and records are arrays with a whole chunk, the
+-- same return codes apply to all of them
+function cb_batch(tag, timestamps, records)
+   for i = 1, #records do
+      records[i]["tag"] = tag
+   end
+   return 1, timestamps, records
+end
+
+-- FFI record view: 'record' is not a table but a view over the raw record,
+-- rec:get(key), rec:set(key, value), rec:remove(key), rec:size() and
+-- rec:entry(i) read or modify it in place, code 1 keeps the changes
+function cb_ffi(tag, timestamp, record)
+   local level = record:get("level")
+   if level == "debug" then
+      return -1, 0, 0
+   end
+   record:set("tag", tag)
+   return 1, timestamp, record
+end
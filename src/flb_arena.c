@@ -0,0 +1,311 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_mem_pool.h>
+#include <fluent-bit/flb_log.h>
+#include <fluent-bit/flb_arena.h>
+
+#include <string.h>
+
+#define ARENA_ALIGN(s)  (((s) + FLB_ARENA_ALIGN - 1) & ~(FLB_ARENA_ALIGN - 1))
+
+/*
+ * Allocations over a quarter of the block size get a block of their own,
+ * linked behind the one in use so its free space is not wasted.
+ */
+#define ARENA_LARGE(a, s)  ((s) > (a)->block_size / 4)
+
+/* Arena of the calling thread and the one bound to the running code */
+static __thread struct flb_arena *arena_thread;
+static __thread struct flb_arena *arena_current;
+
+static struct flb_arena_block *block_new(struct flb_arena *arena, size_t size)
+{
+    size_t block;
+    struct flb_arena_block *b;
+
+    /* Blocks come from the memory pool if any, flb_free() releases them */
+    b = flb_mem_pool_alloc(sizeof(struct flb_arena_block) + size);
+    if (!b) {
+        flb_errno();
+        return NULL;
+    }
+
+    /* A pool block is a power of two, its tail is usable too */
+    block = flb_mem_pool_block_size(b);
+    if (block > 0) {
+        size = block - sizeof(struct flb_arena_block);
+    }
+    b->size = size;
+    b->used = 0;
+    b->next = NULL;
+
+    arena->blocks++;
+    arena->size += size;
+    if (arena->size > arena->peak) {
+        arena->peak = arena->size;
+    }
+    return b;
+}
+
+struct flb_arena *flb_arena_create(size_t block_size)
+{
+    struct flb_arena *arena;
+
+    if (block_size == 0) {
+        block_size = FLB_ARENA_BLOCK_SIZE;
+    }
+
+    arena = flb_calloc(1, sizeof(struct flb_arena));
+    if (!arena) {
+        flb_errno();
+        return NULL;
+    }
+    arena->block_size = ARENA_ALIGN(block_size);
+
+    arena->first = block_new(arena, arena->block_size);
+    if (!arena->first) {
+        flb_free(arena);
+        return NULL;
+    }
+    arena->head = arena->first;
+
+    return arena;
+}
+
+/* Release every block but the first one, the arena can be used again */
+void flb_arena_reset(struct flb_arena *arena)
+{
+    struct flb_arena_block *b;
+    struct flb_arena_block *next;
+
+    for (b = arena->head; b != arena->first; b = next) {
+        next = b->next;
+        arena->size -= b->size;
+        flb_free(b);
+    }
+    arena->head = arena->first;
+    arena->first->used = 0;
+    arena->last = NULL;
+}
+
+void flb_arena_destroy(struct flb_arena *arena)
+{
+    if (!arena) {
+        return;
+    }
+
+    flb_arena_reset(arena);
+    flb_free(arena->first);
+    flb_free(arena);
+}
+
+void *flb_arena_alloc(struct flb_arena *arena, size_t size)
+{
+    void *p;
+    struct flb_arena_block *b;
+
+    size = ARENA_ALIGN(size ? size : 1);
+    b = arena->head;
+
+    if (b->size - b->used < size) {
+        if (ARENA_LARGE(arena, size)) {
+            b = block_new(arena, size);
+            if (!b) {
+                return NULL;
+            }
+            b->next = arena->head->next;
+            arena->head->next = b;
+            b->used = size;
+            arena->allocs++;
+            return b->data;
+        }
+
+        b = block_new(arena, arena->block_size);
+        if (!b) {
+            return NULL;
+        }
+        b->next = arena->head;
+        arena->head = b;
+    }
+
+    p = b->data + b->used;
+    b->used += size;
+    arena->last = p;
+    arena->allocs++;
+
+    return p;
+}
+
+void *flb_arena_calloc(struct flb_arena *arena, size_t n, size_t size)
+{
+    void *p;
+
+    p = flb_arena_alloc(arena, n * size);
+    if (p) {
+        memset(p, '\0', n * size);
+    }
+    return p;
+}
+
+/*
+ * The last allocation grows in place while its block has room, anything
+ * else is copied to a new allocation and the old space is kept until the
+ * arena is reset.
+ */
+void *flb_arena_realloc(struct flb_arena *arena, void *ptr,
+                        size_t old_size, size_t size)
+{
+    size_t off;
+    void *p;
+    struct flb_arena_block *b;
+
+    if (!ptr) {
+        return flb_arena_alloc(arena, size);
+    }
+    if (size <= old_size) {
+        return ptr;
+    }
+
+    b = arena->head;
+    if (ptr == arena->last) {
+        off = (char *) ptr - b->data;
+        if (b->size - off >= ARENA_ALIGN(size)) {
+            b->used = off + ARENA_ALIGN(size);
+            return ptr;
+        }
+    }
+
+    p = flb_arena_alloc(arena, size);
+    if (!p) {
+        return NULL;
+    }
+    memcpy(p, ptr, old_size);
+    return p;
+}
+
+char *flb_arena_strndup(struct flb_arena *arena, const char *s, size_t len)
+{
+    char *p;
+
+    p = flb_arena_alloc(arena, len + 1);
+    if (!p) {
+        return NULL;
+    }
+    memcpy(p, s, len);
+    p[len] = '\0';
+    return p;
+}
+
+void flb_arena_buf_init(struct flb_arena_buf *buf, struct flb_arena *arena)
+{
+    buf->arena = arena;
+    buf->data = NULL;
+    buf->size = 0;
+    buf->alloc = 0;
+}
+
+int flb_arena_buf_write(void *data, const char *s, size_t len)
+{
+    size_t size;
+    char *tmp;
+    struct flb_arena_buf *buf = data;
+
+    if (buf->alloc - buf->size < len) {
+        size = buf->alloc ? buf->alloc * 2 : 256;
+        while (size < buf->size + len) {
+            size *= 2;
+        }
+
+        if (buf->arena) {
+            tmp = flb_arena_realloc(buf->arena, buf->data, buf->alloc, size);
+        }
+        else {
+            tmp = flb_realloc(buf->data, size);
+        }
+        if (!tmp) {
+            flb_errno();
+            return -1;
+        }
+        buf->data = tmp;
+        buf->alloc = size;
+    }
+
+    memcpy(buf->data + buf->size, s, len);
+    buf->size += len;
+    return 0;
+}
+
+void flb_arena_buf_destroy(struct flb_arena_buf *buf)
+{
+    if (!buf->arena) {
+        flb_free(buf->data);
+    }
+    buf->data = NULL;
+    buf->size = 0;
+    buf->alloc = 0;
+}
+
+struct flb_arena *flb_arena_current()
+{
+    return arena_current;
+}
+
+/*
+ * Bind the arena of the calling thread to the code about to run, it
+ * returns the previous binding for flb_arena_leave(). Nested calls share
+ * the outer arena, it is reset when the outermost one leaves. If the arena
+ * can't be created the code runs without one.
+ */
+struct flb_arena *flb_arena_enter()
+{
+    struct flb_arena *prev = arena_current;
+
+    if (prev) {
+        return prev;
+    }
+
+    if (!arena_thread) {
+        arena_thread = flb_arena_create(FLB_ARENA_BLOCK_SIZE);
+    }
+    arena_current = arena_thread;
+    return NULL;
+}
+
+void flb_arena_leave(struct flb_arena *prev)
+{
+    if (prev) {
+        return;
+    }
+
+    if (arena_current) {
+        flb_arena_reset(arena_current);
+    }
+    arena_current = NULL;
+}
+
+/* Release the arena of the calling thread */
+void flb_arena_thread_exit()
+{
+    flb_arena_destroy(arena_thread);
+    arena_thread = NULL;
+    arena_current = NULL;
+}
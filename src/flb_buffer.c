@@ -24,9 +24,18 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/syscall.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <dirent.h>
 #include <inttypes.h>
 
+#ifdef __linux__
+#include <linux/limits.h>
+#include <sys/eventfd.h>
+#else
+#include <sys/syslimits.h>
+#endif
+
 #include <monkey/mk_core.h>
 #include <fluent-bit/flb_info.h>
 #include <fluent-bit/flb_mem.h>
@@ -38,6 +47,7 @@
 #include <fluent-bit/flb_buffer.h>
 #include <fluent-bit/flb_buffer_chunk.h>
 #include <fluent-bit/flb_buffer_qchunk.h>
+#include <fluent-bit/flb_buffer_quota.h>
 #include <fluent-bit/flb_utils.h>
 #include <fluent-bit/flb_output.h>
 #include <fluent-bit/flb_worker.h>
@@ -47,6 +57,216 @@ static int pth_buffer_init;
 static pthread_cond_t  pth_buffer_cond;
 static pthread_mutex_t pth_buffer_mutex;
 
+/* Flush a file or directory to the storage */
+int flb_buffer_sync_path(char *path)
+{
+    int fd;
+    int ret;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        flb_errno();
+        return -1;
+    }
+
+    ret = fsync(fd);
+    if (ret == -1) {
+        flb_errno();
+    }
+    close(fd);
+
+    return ret;
+}
+
+/* Queue a stored chunk until the next group commit */
+static int buffer_sync_enqueue(struct flb_buffer_worker *ctx,
+                               char *filename, uint64_t routes)
+{
+    int fd;
+    char path[PATH_MAX];
+    struct flb_buffer_sync *sync;
+
+    snprintf(path, sizeof(path) - 1, "%s/incoming/%s",
+             FLB_BUFFER_PATH(ctx), filename);
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        flb_errno();
+        return -1;
+    }
+
+    sync = flb_malloc(sizeof(struct flb_buffer_sync));
+    if (!sync) {
+        flb_errno();
+        close(fd);
+        return -1;
+    }
+    sync->fd     = fd;
+    sync->routes = routes;
+    sync->name   = filename;
+    mk_list_add(&sync->_head, &ctx->sync_queue);
+
+    return 0;
+}
+
+/*
+ * Group commit: sync every chunk stored since the last commit and promote
+ * them to the outgoing queue. The outgoing directory is synced too so the
+ * renames done since the previous commit are persisted.
+ */
+static int buffer_sync_commit(struct flb_buffer_worker *ctx)
+{
+    int n = 0;
+    int ret;
+    char path[PATH_MAX];
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct flb_buffer_sync *sync;
+
+    mk_list_foreach_safe(head, tmp, &ctx->sync_queue) {
+        sync = mk_list_entry(head, struct flb_buffer_sync, _head);
+
+        ret = fdatasync(sync->fd);
+        if (ret == -1) {
+            flb_errno();
+        }
+        close(sync->fd);
+
+        ret = flb_buffer_chunk_mov(FLB_BUFFER_CHUNK_OUTGOING,
+                                   sync->name, sync->routes, ctx);
+        if (ret == -1) {
+            flb_error("[buffer] could not create request %s", sync->name);
+        }
+
+        mk_list_del(&sync->_head);
+        flb_free(sync->name);
+        flb_free(sync);
+        n++;
+    }
+
+    snprintf(path, sizeof(path) - 1, "%s/outgoing", FLB_BUFFER_PATH(ctx));
+    flb_buffer_sync_path(path);
+
+    if (n > 0) {
+        flb_trace("[buffer: worker %i] commit %i chunks", ctx->id, n);
+    }
+
+    return n;
+}
+
+/* Wake up a worker waiting for events, only the first wake up is notified */
+static void buffer_worker_wakeup(struct flb_buffer_worker *worker)
+{
+    int ret;
+    uint64_t val = 1;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    ret = __atomic_exchange_n(&worker->idle, FLB_FALSE, __ATOMIC_SEQ_CST);
+    if (ret == FLB_TRUE) {
+        ret = flb_pipe_w(worker->ch_notify[1], &val, sizeof(val));
+        if (ret == -1) {
+            flb_errno();
+        }
+    }
+}
+
+/*
+ * Enqueue a request for a buffer worker, this is only called from the
+ * engine thread. If the queue is full it waits until the worker catch up.
+ */
+int flb_buffer_worker_push(struct flb_buffer_worker *worker,
+                           struct flb_ring *queue, void *data)
+{
+    while (flb_ring_push(queue, data) == -1) {
+        buffer_worker_wakeup(worker);
+        usleep(1000);
+    }
+    buffer_worker_wakeup(worker);
+
+    return 0;
+}
+
+/* A buffer chunk was stored by flb_buffer_chunk_push(...) */
+static void buffer_worker_add(struct flb_buffer_worker *ctx,
+                              struct flb_buffer_chunk *chunk)
+{
+    int ret;
+    uint64_t routes;
+    char *filename = NULL;
+    char path[PATH_MAX];
+
+    ret = flb_buffer_chunk_add(ctx, chunk, &filename);
+    if (ret < 0) {
+        return;
+    }
+    routes = ret;
+
+    /* Group commit: promote on the next commit */
+    if (ctx->parent->sync == FLB_BUFFER_SYNC_NORMAL) {
+        ret = buffer_sync_enqueue(ctx, filename, routes);
+        if (ret == 0) {
+            return;
+        }
+    }
+    else if (ctx->parent->sync == FLB_BUFFER_SYNC_FULL) {
+        snprintf(path, sizeof(path) - 1, "%s/incoming/%s",
+                 FLB_BUFFER_PATH(ctx), filename);
+        flb_buffer_sync_path(path);
+    }
+
+    /*
+     * If a buffer chunk have been stored properly, now it must be promoted
+     * to the next 'outgoing' stage.
+     */
+    ret = flb_buffer_chunk_mov(FLB_BUFFER_CHUNK_OUTGOING,
+                               filename, routes, ctx);
+    if (ret == -1) {
+        flb_error("[buffer] could not promote %s", filename);
+    }
+    flb_free(filename);
+}
+
+/*
+ * Process every pending request: new chunks first, so a delivered
+ * reference rarely arrives before its chunk, then released references and
+ * retry states.
+ */
+static void buffer_worker_drain(struct flb_buffer_worker *ctx)
+{
+    int ret;
+    struct flb_buffer_chunk chunk;
+
+    while (flb_ring_pop(ctx->q_add, &chunk) == 0) {
+        buffer_worker_add(ctx, &chunk);
+    }
+
+    while (flb_ring_pop(ctx->q_del_ref, &chunk) == 0) {
+        ret = flb_buffer_chunk_delete_ref(ctx, &chunk);
+        if (ret == FLB_BUFFER_NOTFOUND) {
+            /*
+             * The Buffer Chunk Reference was not found, likely it
+             * tried to find:
+             *
+             *    task/abc/000000000000000000000000000000.A.B.C
+             *
+             * if it was not found could be because the Task have not
+             * been stored yet into the file system. The buffer worker
+             * it's a separate POSIX thread, so in some cases output
+             * plugins may finish before the buffer chunk is promoted
+             * to the 'outgoing queue'.
+             *
+             * Anyways this is not problem, the chunk_delete_ref() already
+             * issued a chunk_miss() call to cleanup this situation.
+             */
+        }
+    }
+
+    /* Retry states, after the references released above */
+    while (flb_ring_pop(ctx->q_retry, &chunk) == 0) {
+        flb_buffer_chunk_retry_save(ctx, &chunk);
+    }
+}
+
 /*
  * This routine runs in a POSIX thread and it aims to listen for requests
  * to store and remove 'buffer chunks'.
@@ -61,9 +281,7 @@ static pthread_mutex_t pth_buffer_mutex;
 static void flb_buffer_worker_init(void *arg)
 {
     int ret;
-    int run = FLB_TRUE;
-    uint64_t routes;
-    char *filename;
+    uint64_t val;
     struct flb_buffer_worker *ctx;
     struct mk_event *event;
 
@@ -73,49 +291,27 @@ static void flb_buffer_worker_init(void *arg)
     ctx->task_id = syscall(__NR_gettid);
 #endif
 
-    MK_EVENT_NEW(&ctx->e_mng);
-    MK_EVENT_NEW(&ctx->e_add);
-    MK_EVENT_NEW(&ctx->e_del);
-    MK_EVENT_NEW(&ctx->e_del_ref);
-
-    /* Register channel manager into the event loop */
-    ret = mk_event_add(ctx->evl, ctx->ch_mng[0],
-                       FLB_BUFFER_EV_MNG, MK_EVENT_READ, &ctx->e_mng);
-    if (ret == -1) {
-        flb_error("[buffer:worker %i] aborting", ctx->id);
-        return;
-    }
-
-    /* Register channel 'add' into the event loop */
-    ret = mk_event_add(ctx->evl, ctx->ch_add[0],
-                       FLB_BUFFER_EV_ADD, MK_EVENT_READ, &ctx->e_add);
-    if (ret == -1) {
-        flb_error("[buffer:worker %i] aborting", ctx->id);
-        return;
-    }
+    MK_EVENT_NEW(&ctx->e_notify);
+    MK_EVENT_NEW(&ctx->e_sync);
 
-    /* Register channel 'del' into the event loop */
-    ret = mk_event_add(ctx->evl, ctx->ch_del[0],
-                       FLB_BUFFER_EV_DEL, MK_EVENT_READ, &ctx->e_del);
+    /* Register the wake up channel into the event loop */
+    ret = mk_event_add(ctx->evl, ctx->ch_notify[0],
+                       FLB_BUFFER_EV_NOTIFY, MK_EVENT_READ, &ctx->e_notify);
     if (ret == -1) {
         flb_error("[buffer:worker %i] aborting", ctx->id);
         return;
     }
 
-    /* Register channel 'del_reference' into the event loop */
-    ret = mk_event_add(ctx->evl, ctx->ch_del_ref[0],
-                       FLB_BUFFER_EV_DEL_REF, MK_EVENT_READ, &ctx->e_del_ref);
-    if (ret == -1) {
-        flb_error("[buffer:worker %i] aborting", ctx->id);
-        return;
-    }
-
-    /* Register channel 'mov' into the event loop */
-    ret = mk_event_add(ctx->evl, ctx->ch_mov[0],
-                       FLB_BUFFER_EV_MOV, MK_EVENT_READ, &ctx->e_mov);
-    if (ret == -1) {
-        flb_error("[buffer:worker %i] aborting", ctx->id);
-        return;
+    /* Group commit timer */
+    if (ctx->parent->sync == FLB_BUFFER_SYNC_NORMAL) {
+        ctx->sync_fd = mk_event_timeout_create(ctx->evl,
+                                               ctx->parent->sync_interval / 1000,
+                                               (ctx->parent->sync_interval % 1000) * 1000000,
+                                               &ctx->e_sync);
+        if (ctx->sync_fd == -1) {
+            flb_error("[buffer:worker %i] aborting", ctx->id);
+            return;
+        }
     }
 
     /* Unlock the conditional */
@@ -126,64 +322,41 @@ static void flb_buffer_worker_init(void *arg)
 
     flb_debug("[buffer: worker %i] ready", ctx->id);
 
-    /* Join into the event loop (start listening for events) */
-    while (run) {
+    while (1) {
+        buffer_worker_drain(ctx);
+        if (__atomic_load_n(&ctx->stop, __ATOMIC_SEQ_CST) == FLB_TRUE) {
+            break;
+        }
+
+        /*
+         * Announce that we are going to wait, then check again: a request
+         * enqueued before the announcement would not notify us.
+         */
+        __atomic_store_n(&ctx->idle, FLB_TRUE, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (!flb_ring_empty(ctx->q_add) || !flb_ring_empty(ctx->q_del_ref) ||
+            !flb_ring_empty(ctx->q_retry) ||
+            __atomic_load_n(&ctx->stop, __ATOMIC_SEQ_CST) == FLB_TRUE) {
+            buffer_worker_wakeup(ctx);
+        }
+
         mk_event_wait(ctx->evl);
         mk_event_foreach(event, ctx->evl) {
-            if (event->type == FLB_BUFFER_EV_MNG) {
-                run = FLB_FALSE;
-            }
-            else if (event->type == FLB_BUFFER_EV_ADD) {
-                /* Read event triggered from flb_buffer_chunk_push(...) */
-                filename = NULL;
-                ret = flb_buffer_chunk_add(ctx, event, &filename);
-                if (ret >= 0) {
-                    /*
-                     * If a buffer chunk have been stored properly, now it
-                     * must be promoted to the next 'outgoing' stage. We do this
-                     * sending a request through the event loop.
-                     *
-                     * Create and enqueue a new request type.
-                     */
-                    routes = ret;
-                    ret = flb_buffer_chunk_mov(FLB_BUFFER_CHUNK_OUTGOING,
-                                               filename, routes, ctx);
-                    if (ret == -1) {
-                        printf("[buffer] could not create request %s\n", filename);
-                        flb_free(filename);
-                        continue;
-                    }
-                }
-                flb_free(filename);
-            }
-            else if (event->type == FLB_BUFFER_EV_DEL) {
-                flb_buffer_chunk_delete(ctx, event);
+            if (event == &ctx->e_sync) {
+                flb_utils_timer_consume(ctx->sync_fd);
+                buffer_sync_commit(ctx);
             }
-            else if (event->type == FLB_BUFFER_EV_DEL_REF) {
-                ret = flb_buffer_chunk_delete_ref(ctx, event);
-                if (ret == FLB_BUFFER_NOTFOUND) {
-                    /*
-                     * The Buffer Chunk Reference was not found, likely it
-                     * tried to find:
-                     *
-                     *    task/abc/000000000000000000000000000000.A.B.C
-                     *
-                     * if it was not found could be because the Task have not
-                     * been stored yet into the file system. The buffer worker
-                     * it's a separate POSIX thread, so in some cases output
-                     * plugins may finish before the buffer chunk is promoted
-                     * to the 'outgoing queue'.
-                     *
-                     * Anyways this is not problem, the chunk_delete_ref() already
-                     * issued a chunk_miss() call to cleanup this situation.
-                     */
+            else if (event->type == FLB_BUFFER_EV_NOTIFY) {
+                ret = flb_pipe_r(ctx->ch_notify[0], &val, sizeof(val));
+                if (ret == -1) {
+                    flb_errno();
                 }
             }
-            else if (event->type == FLB_BUFFER_EV_MOV) {
-                flb_buffer_chunk_real_move(ctx, event);
-            }
         }
     }
+
+    /* Do not leave stored chunks without a sync */
+    buffer_sync_commit(ctx);
 }
 
 void flb_buffer_destroy(struct flb_buffer *ctx)
@@ -197,39 +370,24 @@ void flb_buffer_destroy(struct flb_buffer *ctx)
         worker = mk_list_entry(head, struct flb_buffer_worker, _head);
         pthread_join(worker->tid, NULL);
 
-        /* Management channel */
-        if (worker->ch_mng[0] > 0) {
-            mk_event_del(worker->evl, &worker->e_mng);
-            close(worker->ch_mng[0]);
-            close(worker->ch_mng[1]);
-        }
-
-        /* Add buffer channel */
-        if (worker->ch_add[0] > 0) {
-            mk_event_del(worker->evl, &worker->e_add);
-            close(worker->ch_add[0]);
-            close(worker->ch_add[1]);
-        }
-
-        /* Delete buffer channel */
-        if (worker->ch_del[0] > 0) {
-            mk_event_del(worker->evl, &worker->e_del);
-            close(worker->ch_del[0]);
-            close(worker->ch_del[1]);
+        /* Wake up channel */
+        if (worker->ch_notify[0] > 0) {
+            mk_event_del(worker->evl, &worker->e_notify);
+            close(worker->ch_notify[0]);
+#ifndef __linux__
+            close(worker->ch_notify[1]);
+#endif
         }
 
-        /* Delete reference buffer channel */
-        if (worker->ch_del_ref[0] > 0) {
-            mk_event_del(worker->evl, &worker->e_del_ref);
-            close(worker->ch_del_ref[0]);
-            close(worker->ch_del_ref[1]);
-        }
+        /* Requests queues */
+        flb_ring_destroy(worker->q_add);
+        flb_ring_destroy(worker->q_del_ref);
+        flb_ring_destroy(worker->q_retry);
 
-        /* Move buffer channel */
-        if (worker->ch_mov[0] > 0) {
-            mk_event_del(worker->evl, &worker->e_mov);
-            close(worker->ch_mov[0]);
-            close(worker->ch_mov[1]);
+        /* Group commit timer */
+        if (worker->sync_fd > 0) {
+            mk_event_del(worker->evl, &worker->e_sync);
+            close(worker->sync_fd);
         }
 
         /* Event loop */
@@ -240,6 +398,7 @@ void flb_buffer_destroy(struct flb_buffer *ctx)
         flb_free(worker);
     }
 
+    flb_buffer_quota_destroy(ctx);
     mk_list_del(&ctx->i_ins->_head);
     flb_free(ctx->i_ins);
     flb_free(ctx->path);
@@ -384,6 +543,15 @@ struct flb_buffer *flb_buffer_create(char *path, int workers,
 
     ctx->worker_lru = -1;
     ctx->config     = config;
+    ctx->sync       = config->buffer_sync;
+    ctx->sync_interval = config->buffer_sync_interval;
+    ctx->compress   = config->buffer_compress;
+    ctx->index_fd   = -1;
+    ctx->index_known = NULL;
+    ctx->index_dir  = NULL;
+    if (ctx->sync_interval <= 0) {
+        ctx->sync_interval = FLB_BUFFER_SYNC_INTERVAL;
+    }
     mk_list_init(&ctx->workers);
 
     ctx->workers_n = workers;
@@ -400,43 +568,31 @@ struct flb_buffer *flb_buffer_create(char *path, int workers,
         }
         worker->id = i;
         worker->parent = ctx;
+        worker->sync_fd = -1;
         mk_list_add(&worker->_head, &ctx->workers);
         mk_list_init(&worker->requests);
-
-        /* Management channel */
-        ret = flb_pipe_create(worker->ch_mng);
-        if (ret == -1) {
-            flb_errno();
-            flb_buffer_destroy(ctx);
-            return NULL;
-        }
-
-        /* Add buffer channel */
-        ret = flb_pipe_create(worker->ch_add);
-        if (ret == -1) {
-            flb_errno();
-            flb_buffer_destroy(ctx);
-            return NULL;
-        }
-
-        /* Delete buffer channel */
-        ret = flb_pipe_create(worker->ch_del);
-        if (ret == -1) {
-            flb_errno();
+        mk_list_init(&worker->sync_queue);
+
+        /* Requests queues */
+        worker->q_add = flb_ring_create(sizeof(struct flb_buffer_chunk),
+                                        FLB_BUFFER_QUEUE_SIZE);
+        worker->q_del_ref = flb_ring_create(sizeof(struct flb_buffer_chunk),
+                                            FLB_BUFFER_QUEUE_SIZE);
+        worker->q_retry = flb_ring_create(sizeof(struct flb_buffer_chunk),
+                                          FLB_BUFFER_QUEUE_SIZE);
+        if (!worker->q_add || !worker->q_del_ref || !worker->q_retry) {
             flb_buffer_destroy(ctx);
             return NULL;
         }
 
-        /* Delete reference buffer channel */
-        ret = flb_pipe_create(worker->ch_del_ref);
-        if (ret == -1) {
-            flb_errno();
-            flb_buffer_destroy(ctx);
-            return NULL;
-        }
-
-        /* Move buffer channel */
-        ret = flb_pipe_create(worker->ch_mov);
+        /* Wake up channel */
+#ifdef __linux__
+        worker->ch_notify[0] = eventfd(0, EFD_CLOEXEC);
+        worker->ch_notify[1] = worker->ch_notify[0];
+        ret = worker->ch_notify[0];
+#else
+        ret = flb_pipe_create(worker->ch_notify);
+#endif
         if (ret == -1) {
             flb_errno();
             flb_buffer_destroy(ctx);
@@ -460,6 +616,7 @@ struct flb_buffer *flb_buffer_create(char *path, int workers,
     }
     snprintf(ctx->i_ins->name, sizeof(ctx->i_ins->name) - 1,
              "buffering.0");
+    ctx->i_ins->config = config;
     mk_list_init(&ctx->i_ins->routes);
     mk_list_init(&ctx->i_ins->tasks);
     mk_list_init(&ctx->i_ins->dyntags);
@@ -486,6 +643,27 @@ int flb_buffer_start(struct flb_buffer *ctx)
     pthread_mutex_init(&pth_buffer_mutex, NULL);
     pthread_cond_init(&pth_buffer_cond, NULL);
 
+    /*
+     * Start workers in charge to read existent buffer chunks, they aim
+     * to put them back into the engine for processing.
+     */
+    ret = flb_buffer_qchunk_create(ctx);
+    if (ret == -1) {
+        flb_buffer_destroy(ctx);
+        return -1;
+    }
+
+    /*
+     * Once the path is ready, check if we have some previous buffer chunk
+     * files. This is done before the workers start so the queue index is
+     * ready before they write into it.
+     */
+    ret = flb_buffer_chunk_scan(ctx);
+    if (ret == -1) {
+        flb_buffer_destroy(ctx);
+        return -1;
+    }
+
     /* Start workers in charge to store/delete buffer chunks */
     mk_list_foreach(head, &ctx->workers) {
         worker = mk_list_entry(head, struct flb_buffer_worker, _head);
@@ -494,8 +672,9 @@ int flb_buffer_start(struct flb_buffer *ctx)
         pthread_mutex_lock(&pth_buffer_mutex);
 
         /* Spawn workers */
-        ret = flb_worker_create(flb_buffer_worker_init,
-                                worker, &worker->tid, ctx->config);
+        ret = flb_worker_create_role(flb_buffer_worker_init,
+                                     worker, &worker->tid, "buffer", NULL,
+                                     ctx->config);
 
         /* Block until the child worker is ready */
         while (!pth_buffer_init) {
@@ -511,25 +690,8 @@ int flb_buffer_start(struct flb_buffer *ctx)
         }
     }
 
-    /*
-     * Start workers in charge to read existent buffer chunks, they aim
-     * to put them back into the engine for processing.
-     */
-    ret = flb_buffer_qchunk_create(ctx);
-    if (ret == -1) {
-        flb_buffer_destroy(ctx);
-        return -1;
-    }
-
-    /*
-     * Once the path is ready, check if we have some previous buffer chunk
-     * files.
-     */
-    ret = flb_buffer_chunk_scan(ctx);
-    if (ret == -1) {
-        flb_buffer_destroy(ctx);
-        return -1;
-    }
+    /* Account the chunks found for the outputs quota */
+    flb_buffer_quota_scan(ctx);
 
     /* Start the qchunk worker thread */
     ret = flb_buffer_qchunk_start(ctx);
@@ -544,8 +706,6 @@ int flb_buffer_start(struct flb_buffer *ctx)
 /* Stop buffer workers */
 int flb_buffer_stop(struct flb_buffer *ctx)
 {
-    int n;
-    uint64_t val = 0;
     struct mk_list *head;
     struct flb_buffer_worker *worker;
 
@@ -553,15 +713,13 @@ int flb_buffer_stop(struct flb_buffer *ctx)
     flb_engine_destroy_tasks(&ctx->i_ins->tasks);
 
     /*
-     * Signal the manager of each buffer worker (chunk writers), the signal
-     * will let them stop working and exit.
+     * Request each buffer worker (chunk writers) to stop, they process the
+     * pending requests and exit.
      */
     mk_list_foreach(head, &ctx->workers) {
         worker = mk_list_entry(head, struct flb_buffer_worker, _head);
-        n = flb_pipe_w(worker->ch_mng[1], &val, sizeof(val));
-        if (n == -1) {
-            flb_errno();
-        }
+        __atomic_store_n(&worker->stop, FLB_TRUE, __ATOMIC_SEQ_CST);
+        buffer_worker_wakeup(worker);
     }
 
     /* Stop and destroy the qchunk worker */
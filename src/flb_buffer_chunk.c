@@ -28,10 +28,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <time.h>
+#include <inttypes.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/file.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <dirent.h>
 
 #ifdef __linux__
@@ -45,16 +49,14 @@
 #include <fluent-bit/flb_buffer.h>
 #include <fluent-bit/flb_buffer_chunk.h>
 #include <fluent-bit/flb_buffer_qchunk.h>
+#include <fluent-bit/flb_buffer_index.h>
+#include <fluent-bit/flb_buffer_quota.h>
 #include <fluent-bit/flb_sha1.h>
+#include <fluent-bit/flb_crc32c.h>
+#include <fluent-bit/flb_lzf.h>
 
-/* Local structure used to validate and obtain Chunk information */
-struct chunk_info {
-    char hash_str[41];
-    uint64_t routes;
-    int worker_id;
-    uint8_t full_scan;
-    char *tag;
-};
+/* Sequence number for chunk ids */
+static uint64_t chunk_id_seq;
 
 /* Get a Buffer Worker given it ID */
 static struct flb_buffer_worker *get_worker(struct flb_buffer *ctx, int id)
@@ -166,6 +168,180 @@ int chunk_info(char *filename, struct chunk_info *info)
     return 0;
 }
 
+/*
+ * Compose a chunk id: 40 hex characters, the size of the SHA1 digest used
+ * by previous versions so the filename format does not change:
+ *
+ *   CRC32C(data) (8) + timestamp in nanoseconds (16) + sequence (16)
+ *
+ * the CRC is used to validate the content when the chunk is loaded again,
+ * the rest makes the id unique even for chunks with the same content.
+ */
+void flb_buffer_chunk_id(void *data, size_t size, char *hash_hex)
+{
+    uint32_t crc;
+    uint64_t ns;
+    uint64_t seq;
+    struct timespec ts;
+
+    crc = flb_crc32c(0, data, size);
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ns = ((uint64_t) ts.tv_sec * 1000000000) + ts.tv_nsec;
+    seq = __atomic_add_fetch(&chunk_id_seq, 1, __ATOMIC_RELAXED);
+
+    snprintf(hash_hex, 41, "%08x%016" PRIx64 "%016" PRIx64, crc, ns, seq);
+}
+
+/*
+ * Validate the content of a chunk against its id. Chunks named by previous
+ * versions use the SHA1 of the content, it's only computed when the CRC
+ * does not match. It returns 0 if the content is valid.
+ */
+int flb_buffer_chunk_verify(char *hash_hex, void *data, size_t size)
+{
+    int i;
+    uint32_t crc;
+    char hex[41];
+    unsigned char sha1[20];
+
+    crc = flb_crc32c(0, data, size);
+    snprintf(hex, sizeof(hex), "%08x", crc);
+    if (strncmp(hex, hash_hex, 8) == 0) {
+        return 0;
+    }
+
+    /* Legacy SHA1 id */
+    flb_sha1_encode(data, size, sha1);
+    for (i = 0; i < 20; i++) {
+        sprintf(&hex[i * 2], "%02x", sha1[i]);
+    }
+    if (strncmp(hex, hash_hex, 40) == 0) {
+        return 0;
+    }
+
+    return -1;
+}
+
+/* Compose a chunk filename: ID(chunk.data).routes_id.wID.tag */
+static int chunk_name(char *buf, size_t size, char *hash_hex,
+                      uint64_t routes, int worker_id, char *tag)
+{
+    int ret;
+
+    ret = snprintf(buf, size - 1, "%s.%lu.w%i.%s",
+                   hash_hex, routes, worker_id, tag);
+    if (ret == -1 || ret >= size - 1) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Write a chunk file, it compress the data if that saves some space */
+static int chunk_write_compressed(char *path, void *data, size_t size)
+{
+    int fd;
+    size_t bound;
+    size_t len;
+    size_t c_size;
+    ssize_t w;
+    char *buf;
+    char *p;
+
+    bound = FLB_BUFFER_CHUNK_LZF_HEADER + FLB_LZF_BOUND(size);
+    buf = flb_malloc(bound);
+    if (!buf) {
+        flb_errno();
+        return -1;
+    }
+
+    c_size = 0;
+    if (size <= UINT32_MAX) {
+        c_size = flb_lzf_compress(data, size,
+                                  buf + FLB_BUFFER_CHUNK_LZF_HEADER,
+                                  size - 1);
+    }
+
+    if (c_size > 0) {
+        memcpy(buf, FLB_BUFFER_CHUNK_LZF_MAGIC, 4);
+        buf[4] = (size >> 24) & 0xff;
+        buf[5] = (size >> 16) & 0xff;
+        buf[6] = (size >> 8) & 0xff;
+        buf[7] = size & 0xff;
+        p = buf;
+        len = FLB_BUFFER_CHUNK_LZF_HEADER + c_size;
+    }
+    else {
+        /* Not compressible, store it as is */
+        p = data;
+        len = size;
+    }
+
+    fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0666);
+    if (fd == -1) {
+        flb_errno();
+        flb_free(buf);
+        return -1;
+    }
+
+    while (len > 0) {
+        w = write(fd, p, len);
+        if (w == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            flb_errno();
+            close(fd);
+            unlink(path);
+            flb_free(buf);
+            return -1;
+        }
+        p += w;
+        len -= w;
+    }
+
+    close(fd);
+    flb_free(buf);
+
+    return 0;
+}
+
+/*
+ * If a loaded chunk is compressed, return a new heap buffer with the
+ * original data, otherwise return NULL.
+ */
+void *flb_buffer_chunk_decompress(void *buf, size_t size, size_t *out_size)
+{
+    size_t len;
+    size_t ret;
+    unsigned char *p = buf;
+    char *out;
+
+    if (size < FLB_BUFFER_CHUNK_LZF_HEADER ||
+        memcmp(buf, FLB_BUFFER_CHUNK_LZF_MAGIC, 4) != 0) {
+        return NULL;
+    }
+
+    len = ((size_t) p[4] << 24) | (p[5] << 16) | (p[6] << 8) | p[7];
+    out = flb_malloc(len);
+    if (!out) {
+        flb_errno();
+        return NULL;
+    }
+
+    ret = flb_lzf_decompress(p + FLB_BUFFER_CHUNK_LZF_HEADER,
+                             size - FLB_BUFFER_CHUNK_LZF_HEADER,
+                             out, len);
+    if (ret != len) {
+        flb_error("[buffer] corrupted compressed chunk");
+        flb_free(out);
+        return NULL;
+    }
+
+    *out_size = len;
+    return out;
+}
+
 void request_destroy(struct flb_buffer_request *req)
 {
     mk_list_del(&req->_head);
@@ -298,8 +474,10 @@ static int chunk_miss(struct flb_buffer_worker *worker, uint64_t mask_id,
                       char *hash_hex)
 {
     int ret;
+    uint64_t routes;
     char *target = NULL;
     char *real_name = NULL;
+    char name[PATH_MAX];
     char root_path[PATH_MAX];
     struct chunk_info info;
 
@@ -323,7 +501,19 @@ static int chunk_miss(struct flb_buffer_worker *worker, uint64_t mask_id,
             return -1;
         }
 
-        chunk_remove_route(root_path, target, hash_hex, &info, mask_id);
+        ret = chunk_remove_route(root_path, target, hash_hex, &info, mask_id);
+        if (ret == 0) {
+            routes = (info.routes & ~mask_id);
+            if (routes == 0) {
+                flb_buffer_index_del(worker->parent, hash_hex);
+            }
+            else {
+                /* The chunk was renamed, re-register it */
+                snprintf(name, sizeof(name) - 1, "%s.%lu.w%i.%s",
+                         hash_hex, routes, info.worker_id, info.tag);
+                flb_buffer_index_add(worker->parent, name, routes);
+            }
+        }
         flb_free(real_name);
         flb_free(target);
         return 0;
@@ -352,8 +542,10 @@ static int chunk_miss(struct flb_buffer_worker *worker, uint64_t mask_id,
 }
 
 /*
- * When the Worker (thread) receives a FLB_BUFFER_EV_ADD event, this routine
- * read the request data and store the chunk into the file system.
+ * When the Worker (thread) receives a FLB_BUFFER_EV_ADD event, the chunk
+ * file was already created and filled by flb_buffer_chunk_push(): the task
+ * buffer is a shared mapping of it. Here we just validate the file so it
+ * can be promoted.
  *
  * The buffer chunk filename format is:
  *
@@ -364,43 +556,22 @@ static int chunk_miss(struct flb_buffer_worker *worker, uint64_t mask_id,
  * chunk to the 'outgoing' queue.
  */
 int flb_buffer_chunk_add(struct flb_buffer_worker *worker,
-                         struct mk_event *event, char **filename)
+                         struct flb_buffer_chunk *chunk, char **filename)
 {
-    int fd;
     int ret;
     char *fchunk;
     char target[PATH_MAX];
-    size_t w;
-    FILE *f;
-    struct flb_buffer_chunk chunk;
     struct stat st;
 
-    /* Read the expected chunk reference */
-    ret = flb_pipe_read_all(worker->ch_add[0], &chunk,
-                            sizeof(struct flb_buffer_chunk));
-    if (ret <= 0) {
-        flb_errno();
-        return -1;
-    }
-
-    /*
-     * Chunk file format:
-     *
-     *     SHA1(chunk.data).routes_id.wID.tag
-     */
     fchunk = flb_malloc(PATH_MAX);
     if (!fchunk) {
         flb_errno();
         return -1;
     }
 
-    ret = snprintf(fchunk, PATH_MAX - 1,
-                   "%s.%lu.w%i.%s",
-                   chunk.hash_hex,
-                   chunk.routes,
-                   worker->id, chunk.tmp);
+    ret = chunk_name(fchunk, PATH_MAX, chunk->hash_hex, chunk->routes,
+                     worker->id, chunk->tmp);
     if (ret == -1) {
-        flb_errno();
         flb_free(fchunk);
         return -1;
     }
@@ -414,54 +585,34 @@ int flb_buffer_chunk_add(struct flb_buffer_worker *worker,
         return -1;
     }
 
-    f = fopen(target, "w");
-    if (!f) {
-        flb_errno();
-        flb_free(fchunk);
-        return -1;
-    }
-
-    /* Lock this file */
-    fd = fileno(f);
-    ret = flock(fd, LOCK_EX);
-    if (ret == -1) {
-        flb_errno();
-        fclose(f);
-        flb_free(fchunk);
-        return -1;
-    }
-
-    /* Write data chunk */
-    w = fwrite(chunk.data, chunk.size, 1, f);
-    if (!w) {
-        flb_errno();
-        fclose(f);
-        flb_free(fchunk);
-        return -1;
+    /* Compressed chunks are written here, off the engine thread */
+    if (chunk->compress == FLB_TRUE) {
+        ret = chunk_write_compressed(target, chunk->data, chunk->size);
+        flb_free(chunk->data);
+        if (ret == -1) {
+            flb_error("[buffer] could not store chunk %s", fchunk);
+            flb_free(fchunk);
+            return -1;
+        }
+        *filename = fchunk;
+        return chunk->routes;
     }
 
-    /* Unlock and close */
-    flock(fd, LOCK_UN);
-
     /* Double check target file */
-    ret = fstat(fd, &st);
-    if (ret == -1) {
-        fprintf(stderr, "[buffer] chunk check failed %lu/%lu bytes",
-                st.st_size, chunk.size);
-        fclose(f);
+    ret = stat(target, &st);
+    if (ret == -1 || st.st_size != chunk->size) {
+        flb_error("[buffer] chunk check failed %s", fchunk);
         flb_free(fchunk);
         return -1;
     }
 
-    fclose(f);
     *filename = fchunk;
-    return chunk.routes;
+    return chunk->routes;
 }
 
-
 /* Delete a physical reference of a task chunk */
 int flb_buffer_chunk_delete(struct flb_buffer_worker *worker,
-                            struct mk_event *event)
+                            struct flb_buffer_chunk *chunk)
 {
     int ret;
     int remaining;
@@ -470,25 +621,17 @@ int flb_buffer_chunk_delete(struct flb_buffer_worker *worker,
     char path[PATH_MAX];
     struct mk_list *head;
     struct flb_output_instance *o_ins;
-    struct flb_buffer_chunk chunk;
     struct flb_config *config;
     struct chunk_info info;
     struct stat st;
 
-    /* Read the expected chunk reference */
-    ret = flb_pipe_r(worker->ch_del[0], &chunk, sizeof(struct flb_buffer_chunk));
-    if (ret <= 0) {
-        flb_errno();
-        return -1;
-    }
-
     /* Lookup file */
     snprintf(path, sizeof(path) - 1, "%s/outgoing/",
              FLB_BUFFER_PATH(worker));
-    ret = chunk_find(path, chunk.hash_hex, &target, &real_name);
+    ret = chunk_find(path, chunk->hash_hex, &target, &real_name);
     if (ret != 0) {
         flb_error("[buffer] could not match task %s/%s",
-                  chunk.tmp, chunk.hash_hex);
+                  chunk->tmp, chunk->hash_hex);
         return -1;
     }
 
@@ -535,6 +678,7 @@ int flb_buffer_chunk_delete(struct flb_buffer_worker *worker,
             flb_free(real_name);
             return -1;
         }
+        flb_buffer_index_del(worker->parent, chunk->hash_hex);
     }
 
     flb_free(target);
@@ -546,40 +690,31 @@ int flb_buffer_chunk_delete(struct flb_buffer_worker *worker,
 
 /* Delete a physical reference of a task chunk */
 int flb_buffer_chunk_delete_ref(struct flb_buffer_worker *worker,
-                                struct mk_event *event)
+                                struct flb_buffer_chunk *chunk)
 {
     int ret;
     char *target;
     char *real_name;
     char root_path[PATH_MAX];
-    struct flb_buffer_chunk chunk;
     struct flb_output_instance *o_ins;
 
-    /* Read the expected chunk reference */
-    ret = flb_pipe_read_all(worker->ch_del_ref[0], &chunk,
-                            sizeof(struct flb_buffer_chunk));
-    if (ret <= 0) {
-        flb_errno();
-        return FLB_BUFFER_ERROR;
-    }
-
     /* Compose the absolute directory for the target reference */
     ret = snprintf(root_path, sizeof(root_path) - 1,
                    "%stasks/%s/",
                    FLB_BUFFER_PATH(worker),
-                   chunk.tmp);
+                   chunk->tmp);
     if (ret == -1) {
         flb_errno();
         return FLB_BUFFER_ERROR;
     }
 
     /* Find absolute path for given Hash under task root path */
-    o_ins = chunk.data;
-    ret = chunk_find(root_path, chunk.hash_hex, &target, &real_name);
+    o_ins = chunk->data;
+    ret = chunk_find(root_path, chunk->hash_hex, &target, &real_name);
     if (ret != 0) {
         flb_debug("[buffer] could not match task %s/%s (chunk_miss handler)",
-                  chunk.tmp, chunk.hash_hex);
-        chunk_miss(worker, o_ins->mask_id, chunk.hash_hex);
+                  chunk->tmp, chunk->hash_hex);
+        chunk_miss(worker, o_ins->mask_id, chunk->hash_hex);
         return FLB_BUFFER_NOTFOUND;
     }
 
@@ -593,19 +728,17 @@ int flb_buffer_chunk_delete_ref(struct flb_buffer_worker *worker,
     }
 
     flb_debug("[buffer] removing task %s OK", target);
+    flb_buffer_index_route(worker->parent, chunk->hash_hex, o_ins->mask_id);
 
     flb_free(real_name);
     flb_free(target);
 
     /*
-     * Every time a buffer chunk reference is deleted, we dispatch a
-     * request over the ch_del[] channel on this same worker, which
-     * aims to delete the real buffer chunk if no one else have
-     * a reference to it.
+     * Every time a buffer chunk reference is deleted, we try to delete
+     * the real buffer chunk if no one else have a reference to it.
      */
-    ret = flb_pipe_w(worker->ch_del[1], &chunk, sizeof(struct flb_buffer_chunk));
+    ret = flb_buffer_chunk_delete(worker, chunk);
     if (ret == -1) {
-        flb_errno();
         return FLB_BUFFER_ERROR;
     }
 
@@ -613,17 +746,29 @@ int flb_buffer_chunk_delete_ref(struct flb_buffer_worker *worker,
 }
 
 /*
- * Send a 'chunk create' request to the buffer engine. It return the
- * buffer worker ID that will manage the request.
+ * Store a new chunk: the data is copied once into a memory mapped file in
+ * the 'incoming' queue and a notification is sent to a buffer worker so it
+ * can promote it. The mapping is returned through 'map' and it replaces the
+ * original buffer, the caller must release it with munmap(2). The routes
+ * stored on disk after applying the outputs quota are set in 'stored'.
+ *
+ * It returns the buffer worker ID that will manage the request.
  */
 int flb_buffer_chunk_push(struct flb_buffer *ctx, void *data,
                           size_t size, char *tag, uint64_t routes,
-                          char *hash_hex)
+                          char *hash_hex, void **map, uint64_t *stored)
 {
+    int fd;
     int ret;
+    char name[PATH_MAX];
+    char target[PATH_MAX];
+    void *buf;
     struct flb_buffer_chunk chunk;
     struct flb_buffer_worker *worker = NULL;
 
+    *map = NULL;
+    *stored = 0;
+
     /* The buffer engine may be disabled, check that. */
     if (!ctx) {
         return 0;
@@ -637,9 +782,18 @@ int flb_buffer_chunk_push(struct flb_buffer *ctx, void *data,
         ctx->worker_lru++;
     }
 
+    /* Lookup target worker */
+    worker = get_worker(ctx, ctx->worker_lru);
+
+    /* Outputs quota, the chunk is not stored if no route is left */
+    routes = flb_buffer_quota_reserve(ctx, hash_hex, size, routes,
+                                      worker->id);
+    if (routes == 0) {
+        return ctx->worker_lru;
+    }
+
     /* Compose buffer chunk instruction */
     memset(&chunk, '\0', sizeof(struct flb_buffer_chunk));
-    chunk.data       = data;
     chunk.size       = size;
     chunk.tmp_len    = strlen(tag);
     chunk.routes     = routes;
@@ -648,19 +802,79 @@ int flb_buffer_chunk_push(struct flb_buffer *ctx, void *data,
     memcpy(&chunk.hash_hex, hash_hex, 41);
     chunk.hash_hex[41] = '\0';
 
-    /* Lookup target worker */
-    worker = get_worker(ctx, ctx->worker_lru);
+    /*
+     * Compression: the worker writes the file, the task keeps the original
+     * buffer since it cannot use the file contents as is.
+     */
+    if (ctx->compress == FLB_TRUE) {
+        chunk.compress = FLB_TRUE;
+        chunk.data = flb_malloc(size);
+        if (!chunk.data) {
+            flb_errno();
+            return -1;
+        }
+        memcpy(chunk.data, data, size);
+
+        ret = flb_buffer_worker_push(worker, worker->q_add, &chunk);
+        if (ret == -1) {
+            flb_free(chunk.data);
+            return -1;
+        }
+        *stored = routes;
+        return ctx->worker_lru;
+    }
+
+    ret = chunk_name(name, sizeof(name), chunk.hash_hex, routes,
+                     worker->id, chunk.tmp);
+    if (ret == -1) {
+        return -1;
+    }
+
+    ret = snprintf(target, sizeof(target) - 1, "%s/incoming/%s",
+                   ctx->path, name);
+    if (ret == -1) {
+        flb_errno();
+        return -1;
+    }
 
-    /* Write request through worker channel */
-    ret = flb_pipe_w(worker->ch_add[1], &chunk, sizeof(struct flb_buffer_chunk));
+    /* Create the chunk file and map it */
+    fd = open(target, O_CREAT | O_RDWR | O_TRUNC, 0666);
+    if (fd == -1) {
+        flb_errno();
+        return -1;
+    }
+
+    ret = ftruncate(fd, size);
     if (ret == -1) {
         flb_errno();
+        close(fd);
+        unlink(target);
+        return -1;
+    }
+
+    buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (buf == MAP_FAILED) {
+        flb_errno();
+        unlink(target);
+        return -1;
+    }
+    memcpy(buf, data, size);
+    chunk.data = buf;
+
+    /* Enqueue the request into the worker */
+    ret = flb_buffer_worker_push(worker, worker->q_add, &chunk);
+    if (ret == -1) {
+        munmap(buf, size);
+        unlink(target);
         return -1;
     }
 
     flb_debug("[buffer] created records=%p size=%lu worker=%i",
-              data, size, ctx->worker_lru);
+              buf, size, ctx->worker_lru);
 
+    *map = buf;
+    *stored = routes;
     return ctx->worker_lru;
 }
 
@@ -692,6 +906,12 @@ int flb_buffer_chunk_pop(struct flb_buffer *ctx, int thread_id,
 
     o_ins = out_th->o_ins;
 
+    /* The chunk was not stored for this output (quota) */
+    if (!(task->fs_routes & o_ins->mask_id)) {
+        return 0;
+    }
+    flb_buffer_quota_release(o_ins, task->hash_hex);
+
     /* Compose buffer chunk instruction */
     memset(&chunk, '\0', sizeof(struct flb_buffer_chunk));
     memcpy(&chunk.hash_hex, task->hash_hex, 41);
@@ -701,21 +921,172 @@ int flb_buffer_chunk_pop(struct flb_buffer *ctx, int thread_id,
     chunk.tmp[chunk.tmp_len] = '\0';
     chunk.data = o_ins;
 
-    /* Write request through worker channel */
-    ret = flb_pipe_w(worker->ch_del_ref[1], &chunk, sizeof(struct flb_buffer_chunk));
+    /* Enqueue the request into the worker */
+    ret = flb_buffer_worker_push(worker, worker->q_del_ref, &chunk);
     if (ret == -1) {
-        flb_errno();
         return -1;
     }
 
     return 0;
 }
 
-/* Enqueue a request to move a chunk */
+/*
+ * Send the retry state of a task route to the buffer worker, it's saved in
+ * the task reference file so the backoff survives a restart.
+ */
+int flb_buffer_chunk_retry(struct flb_buffer *ctx, struct flb_task *task,
+                           struct flb_output_instance *o_ins,
+                           int attemps, time_t retry_at)
+{
+    struct flb_buffer_chunk chunk;
+    struct flb_buffer_worker *worker;
+
+    if (!(task->fs_routes & o_ins->mask_id)) {
+        return 0;
+    }
+
+    worker = get_worker(ctx, task->worker_id);
+    if (!worker) {
+        return -1;
+    }
+
+    memset(&chunk, '\0', sizeof(struct flb_buffer_chunk));
+    memcpy(&chunk.hash_hex, task->hash_hex, 41);
+    chunk.hash_hex[41] = '\0';
+    chunk.tmp_len = strlen(o_ins->name);
+    memcpy(&chunk.tmp, o_ins->name, chunk.tmp_len);
+    chunk.tmp[chunk.tmp_len] = '\0';
+    chunk.attemps = attemps;
+    chunk.retry_at = retry_at;
+
+    return flb_buffer_worker_push(worker, worker->q_retry, &chunk);
+}
+
+/*
+ * Write the retry state into the task reference file, the format is
+ * 'attemps retry_at'. A missing reference means the route was delivered
+ * or the chunk was not promoted yet, the state is just skipped.
+ */
+int flb_buffer_chunk_retry_save(struct flb_buffer_worker *worker,
+                                struct flb_buffer_chunk *chunk)
+{
+    int fd;
+    int ret;
+    int len;
+    char *target;
+    char *real_name;
+    char buf[64];
+    char root_path[PATH_MAX];
+
+    snprintf(root_path, sizeof(root_path) - 1, "%stasks/%s/",
+             FLB_BUFFER_PATH(worker), chunk->tmp);
+
+    ret = chunk_find(root_path, chunk->hash_hex, &target, &real_name);
+    if (ret != 0) {
+        flb_debug("[buffer] no task reference for retry %s/%s",
+                  chunk->tmp, chunk->hash_hex);
+        return FLB_BUFFER_NOTFOUND;
+    }
+
+    len = snprintf(buf, sizeof(buf), "%i %li\n",
+                   chunk->attemps, (long) chunk->retry_at);
+
+    fd = open(target, O_WRONLY | O_TRUNC);
+    if (fd == -1) {
+        flb_errno();
+        flb_free(target);
+        flb_free(real_name);
+        return FLB_BUFFER_ERROR;
+    }
+
+    ret = write(fd, buf, len);
+    if (ret != len) {
+        flb_errno();
+    }
+    close(fd);
+
+    flb_free(target);
+    flb_free(real_name);
+
+    return (ret == len) ? FLB_BUFFER_OK : FLB_BUFFER_ERROR;
+}
+
+/*
+ * Read back the retry states saved for the pending routes of a chunk in the
+ * outgoing queue. It returns the number of states found, 'states' must be
+ * released by the caller.
+ */
+int flb_buffer_chunk_retry_load(struct flb_buffer *ctx, char *name,
+                                uint64_t routes,
+                                struct flb_task_retry_state **states)
+{
+    int fd;
+    int n = 0;
+    int max = 0;
+    int ret;
+    int attemps;
+    long retry_at;
+    uint64_t r;
+    char buf[64];
+    char path[PATH_MAX];
+    struct mk_list *head;
+    struct flb_output_instance *o_ins;
+    struct flb_task_retry_state *list = NULL;
+
+    *states = NULL;
+
+    /* One state per route at most */
+    for (r = routes; r != 0; r &= (r - 1)) {
+        max++;
+    }
+
+    mk_list_foreach(head, &ctx->config->outputs) {
+        o_ins = mk_list_entry(head, struct flb_output_instance, _head);
+        if (!(o_ins->mask_id & routes)) {
+            continue;
+        }
+
+        snprintf(path, sizeof(path) - 1, "%stasks/%s/%s",
+                 ctx->path, o_ins->name, name);
+        fd = open(path, O_RDONLY);
+        if (fd == -1) {
+            continue;
+        }
+        ret = read(fd, buf, sizeof(buf) - 1);
+        close(fd);
+
+        /* Empty references have no retry state */
+        if (ret <= 0) {
+            continue;
+        }
+        buf[ret] = '\0';
+
+        ret = sscanf(buf, "%i %li", &attemps, &retry_at);
+        if (ret != 2 || attemps <= 0 || n >= max) {
+            continue;
+        }
+
+        if (!list) {
+            list = flb_malloc(sizeof(struct flb_task_retry_state) * max);
+            if (!list) {
+                flb_errno();
+                return 0;
+            }
+        }
+        list[n].mask_id = o_ins->mask_id;
+        list[n].attemps = attemps;
+        list[n].retry_at = retry_at;
+        n++;
+    }
+
+    *states = list;
+    return n;
+}
+
+/* Move a chunk, this is only called from the buffer worker */
 int flb_buffer_chunk_mov(int type, char *name, uint64_t routes,
                          struct flb_buffer_worker *worker)
 {
-    int ret;
     int len;
     struct flb_buffer_request req = {0};
 
@@ -730,31 +1101,53 @@ int flb_buffer_chunk_mov(int type, char *name, uint64_t routes,
         req.name[len] = '\0';
     }
 
-    /* Do the request */
-    ret = flb_pipe_w(worker->ch_mov[1], &req, sizeof(struct flb_buffer_request));
-    if (ret == -1) {
-        flb_errno();
-        return -1;
-    }
-
-    return 0;
+    return flb_buffer_chunk_real_move(worker, &req);
 }
 
 /*
- * Perform a scan over a buffer path to find buffer chunks not processed. This
- * function is only invoked at start time.
+ * Given a chunk filename in the outgoing queue, find which routes are still
+ * pending: the ones that have a task reference.
  */
-int flb_buffer_chunk_scan(struct flb_buffer *ctx)
+uint64_t flb_buffer_chunk_routes(struct flb_buffer *ctx, char *name)
 {
     int ret;
-    int routes;
-    char src[PATH_MAX];
+    uint64_t routes = 0;
     char task[PATH_MAX];
+    struct mk_list *head;
+    struct flb_output_instance *o_ins;
+    struct stat st;
+
+    mk_list_foreach(head, &ctx->config->outputs) {
+        o_ins = mk_list_entry(head, struct flb_output_instance, _head);
+        snprintf(task, sizeof(task) - 1, "%stasks/%s/%s",
+                 ctx->path, o_ins->name, name);
+
+        /* Check that path exists */
+        ret = stat(task, &st);
+        if (ret == -1) {
+            continue;
+        }
+
+        /* Only regular file, it may contain a retry state */
+        if (!S_ISREG(st.st_mode)) {
+            continue;
+        }
+
+        routes |= o_ins->mask_id;
+    }
+
+    return routes;
+}
+
+/* Scan the outgoing queue directory */
+static int chunk_scan_dir(struct flb_buffer *ctx)
+{
+    int ret;
+    uint64_t routes;
+    char src[PATH_MAX];
     DIR *dir;
     struct chunk_info info;
     struct dirent *ent;
-    struct mk_list *head;
-    struct flb_output_instance *o_ins;
     struct flb_buffer_qchunk *qchunk;
     struct stat st;
 
@@ -801,26 +1194,7 @@ int flb_buffer_chunk_scan(struct flb_buffer *ctx)
          * the chunk was set to go to 3 output destinations and it was just
          * sent to one, we need to process ONLY the remaining ones.
          */
-        routes = 0;
-        mk_list_foreach(head, &ctx->config->outputs) {
-            o_ins = mk_list_entry(head, struct flb_output_instance, _head);
-            snprintf(task, sizeof(task) - 1, "%stasks/%s/%s",
-                     ctx->path, o_ins->name, ent->d_name);
-
-            /* Check that path exists */
-            ret = stat(task, &st);
-            if (ret == -1) {
-                continue;
-            }
-
-            /* Only regular file */
-            if (st.st_size != 0 || (!S_ISREG(st.st_mode))) {
-                continue;
-            }
-
-            routes |= o_ins->mask_id;
-        }
-
+        routes = flb_buffer_chunk_routes(ctx, ent->d_name);
         if (routes > 0) {
             qchunk = flb_buffer_qchunk_add(ctx->qworker, src, routes,
                                            info.tag, info.hash_str);
@@ -828,6 +1202,9 @@ int flb_buffer_chunk_scan(struct flb_buffer *ctx)
                 flb_error("[buffer scan] qchunk error for %s", src);
             }
             else {
+                if (stat(src, &st) == 0) {
+                    qchunk->file_size = st.st_size;
+                }
                 flb_debug("[buffer scan] qchunk added for %s",
                           info.hash_str);
             }
@@ -838,8 +1215,36 @@ int flb_buffer_chunk_scan(struct flb_buffer *ctx)
     return 0;
 }
 
+/*
+ * Find buffer chunks not processed, this function is only invoked at start
+ * time. The outgoing queue is loaded from its index and if it's not usable
+ * the queue directory is scanned. In both cases a new index is written.
+ */
+int flb_buffer_chunk_scan(struct flb_buffer *ctx)
+{
+    int ret;
+
+    ret = flb_buffer_index_load(ctx);
+    if (ret >= 0) {
+        flb_info("[buffer] %i chunk(s) loaded from index", ret);
+    }
+    else {
+        ret = chunk_scan_dir(ctx);
+        if (ret == -1) {
+            return -1;
+        }
+    }
+
+    ret = flb_buffer_index_rewrite(ctx);
+    if (ret == -1) {
+        flb_warn("[buffer] could not write queue index");
+    }
+
+    return 0;
+}
+
 int flb_buffer_chunk_real_move(struct flb_buffer_worker *worker,
-                               struct mk_event *event)
+                               struct flb_buffer_request *req)
 {
     int fd;
     int ret;
@@ -850,23 +1255,24 @@ int flb_buffer_chunk_real_move(struct flb_buffer_worker *worker,
     struct mk_list *head;
     struct flb_config *config = worker->parent->config;
     struct flb_output_instance *o_ins;
-    struct flb_buffer_request req;
-
-    /* Read the expected chunk reference */
-    ret = flb_pipe_r(worker->ch_mov[0], &req, sizeof(struct flb_buffer_request));
-    if (ret <= 0) {
-        flb_errno();
-        return -1;
-    }
 
     /* Move from incoming to outgoing */
-    if (req.type == FLB_BUFFER_CHUNK_OUTGOING) {
+    if (req->type == FLB_BUFFER_CHUNK_OUTGOING) {
         snprintf(from, PATH_MAX - 1,
-                 "%s/incoming/%s", worker->parent->path, req.name);
+                 "%s/incoming/%s", worker->parent->path, req->name);
         snprintf(to, PATH_MAX - 1,
-                 "%s/outgoing/%s", worker->parent->path, req.name);
+                 "%s/outgoing/%s", worker->parent->path, req->name);
         ret = rename(from, to);
         if (ret == -1) {
+            /*
+             * The chunk may have been delivered (and removed) before it
+             * was promoted, e.g: waiting for a group commit.
+             */
+            if (errno == ENOENT) {
+                flb_debug("[buffer] chunk %s delivered before promotion",
+                          req->name);
+                return 0;
+            }
             flb_errno();
             return -1;
         }
@@ -876,7 +1282,7 @@ int flb_buffer_chunk_real_move(struct flb_buffer_worker *worker,
          * (task) to this chunk. A reference is just an empty file in the
          * path 'tasks/PLUGIN_NAME/CHUNK_FILENAME'.
          */
-        ret = sscanf(req.name,
+        ret = sscanf(req->name,
                      "%40s.%lu ",
                      hash, &info_routes);
         if (ret == -1) {
@@ -885,6 +1291,8 @@ int flb_buffer_chunk_real_move(struct flb_buffer_worker *worker,
         }
         hash[40] = '\0';
 
+        flb_buffer_index_add(worker->parent, req->name, info_routes);
+
         /* Find output routes and generate file references */
         mk_list_foreach(head, &config->outputs) {
             o_ins = mk_list_entry(head, struct flb_output_instance, _head);
@@ -893,7 +1301,7 @@ int flb_buffer_chunk_real_move(struct flb_buffer_worker *worker,
                          "%s/tasks/%s/%s",
                          FLB_BUFFER_PATH(worker),
                          o_ins->name,
-                         req.name);
+                         req->name);
 
                 fd = open(to, O_CREAT | O_TRUNC, 0666);
                 if (fd == -1) {
@@ -901,8 +1309,20 @@ int flb_buffer_chunk_real_move(struct flb_buffer_worker *worker,
                     continue;
                 }
                 close(fd);
+
+                if (worker->parent->sync == FLB_BUFFER_SYNC_FULL) {
+                    snprintf(to, PATH_MAX - 1, "%s/tasks/%s",
+                             FLB_BUFFER_PATH(worker), o_ins->name);
+                    flb_buffer_sync_path(to);
+                }
             }
         }
+
+        /* Persist the rename right away */
+        if (worker->parent->sync == FLB_BUFFER_SYNC_FULL) {
+            snprintf(to, PATH_MAX - 1, "%s/outgoing", worker->parent->path);
+            flb_buffer_sync_path(to);
+        }
         return 0;
     }
 
@@ -0,0 +1,555 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <monkey/mk_core.h>
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_str.h>
+
+#ifdef FLB_HAVE_BUFFERING
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <linux/limits.h>
+#else
+#include <sys/syslimits.h>
+#endif
+
+#include <fluent-bit/flb_hash.h>
+#include <fluent-bit/flb_output.h>
+#include <fluent-bit/flb_buffer.h>
+#include <fluent-bit/flb_buffer_chunk.h>
+#include <fluent-bit/flb_buffer_qchunk.h>
+#include <fluent-bit/flb_buffer_index.h>
+
+/* A chunk while the index is replayed */
+struct index_entry {
+    char *name;             /* chunk file name        */
+    uint64_t routes;        /* pending routes         */
+    size_t size;            /* chunk file size        */
+    struct mk_list _head;
+};
+
+static int index_path(struct flb_buffer *ctx, char *buf, size_t size,
+                      char *suffix)
+{
+    int ret;
+
+    ret = snprintf(buf, size - 1, "%s%s%s",
+                   ctx->path, FLB_BUFFER_INDEX_FILE, suffix);
+    if (ret == -1 || ret >= size - 1) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Append a record, every record is written with a single write(2) */
+static int index_write(struct flb_buffer *ctx, char *buf, int len)
+{
+    int ret;
+
+    if (ctx->index_fd == -1) {
+        return -1;
+    }
+
+    if (len <= 0) {
+        return -1;
+    }
+
+    ret = write(ctx->index_fd, buf, len);
+    if (ret != len) {
+        flb_errno();
+        return -1;
+    }
+
+    if (ctx->sync == FLB_BUFFER_SYNC_FULL) {
+        fdatasync(ctx->index_fd);
+    }
+
+    return 0;
+}
+
+/* Check that an output record matches the current configuration */
+static int index_output_check(struct flb_config *config,
+                              uint64_t mask_id, char *name)
+{
+    struct mk_list *head;
+    struct flb_output_instance *o_ins;
+
+    mk_list_foreach(head, &config->outputs) {
+        o_ins = mk_list_entry(head, struct flb_output_instance, _head);
+        if (strcmp(o_ins->name, name) == 0) {
+            if (o_ins->mask_id == mask_id) {
+                return 0;
+            }
+            return -1;
+        }
+    }
+
+    return -1;
+}
+
+static struct index_entry *index_lookup(struct flb_hash *ht, char *hash)
+{
+    int ret;
+    size_t size;
+    char *out;
+    struct index_entry *entry;
+
+    ret = flb_hash_get(ht, hash, 40, &out, &size);
+    if (ret == -1) {
+        return NULL;
+    }
+
+    memcpy(&entry, out, sizeof(entry));
+    return entry;
+}
+
+/* Parse and apply one index record */
+static int index_replay(struct flb_buffer *ctx, char *line,
+                        struct flb_hash *ht, struct mk_list *list,
+                        int *outputs)
+{
+    int ret;
+    int len;
+    uint64_t val;
+    size_t size;
+    char hash[41];
+    struct index_entry *entry;
+
+    switch (line[0]) {
+    case 'V':
+        /* nothing to do, the version was checked before */
+        return 0;
+    case 'O':
+        ret = sscanf(line, "O %" SCNu64 " %n", &val, &len);
+        if (ret != 1) {
+            return -1;
+        }
+        (*outputs)++;
+        return index_output_check(ctx->config, val, line + len);
+    case 'A':
+        ret = sscanf(line, "A %40s %" SCNu64 " %zu %n",
+                     hash, &val, &size, &len);
+        if (ret != 3 || strlen(hash) != 40) {
+            return -1;
+        }
+
+        /* A chunk renamed with new routes is added again */
+        entry = index_lookup(ht, hash);
+        if (!entry) {
+            entry = flb_malloc(sizeof(struct index_entry));
+            if (!entry) {
+                flb_errno();
+                return -1;
+            }
+            mk_list_add(&entry->_head, list);
+            flb_hash_add(ht, hash, 40, (char *) &entry, sizeof(entry));
+        }
+        entry->name   = line + len;
+        entry->routes = val;
+        entry->size   = size;
+        return 0;
+    case 'R':
+        ret = sscanf(line, "R %40s %" SCNu64, hash, &val);
+        if (ret != 2) {
+            return -1;
+        }
+        entry = index_lookup(ht, hash);
+        if (entry) {
+            entry->routes &= ~val;
+        }
+        return 0;
+    case 'D':
+        ret = sscanf(line, "D %40s", hash);
+        if (ret != 1) {
+            return -1;
+        }
+        entry = index_lookup(ht, hash);
+        if (entry) {
+            entry->routes = 0;
+        }
+        return 0;
+    }
+
+    return -1;
+}
+
+/*
+ * Load the outgoing queue from the index file with a single read. It
+ * returns the number of chunks enqueued or -1 if the index is not
+ * available or cannot be trusted, in that case the caller must scan the
+ * queue directories.
+ */
+int flb_buffer_index_load(struct flb_buffer *ctx)
+{
+    int fd;
+    int ret;
+    int count = 0;
+    int outputs = 0;
+    char *p;
+    char *end;
+    char *buf;
+    char path[PATH_MAX];
+    ssize_t bytes;
+    size_t total = 0;
+    struct mk_list list;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct index_entry *entry;
+    struct chunk_info info;
+    struct flb_hash *ht;
+    struct flb_buffer_qchunk *qchunk;
+    struct stat st;
+
+    ret = index_path(ctx, path, sizeof(path), "");
+    if (ret == -1) {
+        return -1;
+    }
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        flb_debug("[buffer index] no index found at %s", path);
+        return -1;
+    }
+
+    ret = fstat(fd, &st);
+    if (ret == -1) {
+        flb_errno();
+        close(fd);
+        return -1;
+    }
+
+    buf = flb_malloc(st.st_size + 1);
+    if (!buf) {
+        flb_errno();
+        close(fd);
+        return -1;
+    }
+
+    while (total < st.st_size) {
+        bytes = read(fd, buf + total, st.st_size - total);
+        if (bytes <= 0) {
+            if (bytes == -1 && errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        total += bytes;
+    }
+    close(fd);
+    buf[total] = '\0';
+
+    ret = snprintf(path, sizeof(path) - 1, "V %i\n", FLB_BUFFER_INDEX_VERSION);
+    if (total < ret || strncmp(buf, path, ret) != 0) {
+        flb_warn("[buffer index] unknown index format, ignoring it");
+        flb_free(buf);
+        return -1;
+    }
+
+    ht = flb_hash_create(FLB_HASH_EVICT_NONE, (total / 128) + 64, 0);
+    if (!ht) {
+        flb_free(buf);
+        return -1;
+    }
+    mk_list_init(&list);
+
+    /* Replay records, a trailing partial record (no new line) is ignored */
+    p = buf;
+    while ((end = strchr(p, '\n'))) {
+        *end = '\0';
+        ret = index_replay(ctx, p, ht, &list, &outputs);
+        if (ret == -1) {
+            break;
+        }
+        p = end + 1;
+    }
+
+    if (ret == -1 || outputs != mk_list_size(&ctx->config->outputs)) {
+        flb_info("[buffer index] index does not match, scanning queue");
+        mk_list_foreach_safe(head, tmp, &list) {
+            entry = mk_list_entry(head, struct index_entry, _head);
+            mk_list_del(&entry->_head);
+            flb_free(entry);
+        }
+        flb_hash_destroy(ht);
+        flb_free(buf);
+        return -1;
+    }
+
+    /* Enqueue pending chunks, file contents are verified when loaded */
+    mk_list_foreach_safe(head, tmp, &list) {
+        entry = mk_list_entry(head, struct index_entry, _head);
+        if (entry->routes > 0 && chunk_info(entry->name, &info) == 0) {
+            snprintf(path, sizeof(path) - 1, "%soutgoing/%s",
+                     ctx->path, entry->name);
+            qchunk = flb_buffer_qchunk_add(ctx->qworker, path, entry->routes,
+                                           info.tag, info.hash_str);
+            if (qchunk) {
+                qchunk->file_size = entry->size;
+                count++;
+            }
+        }
+        mk_list_del(&entry->_head);
+        flb_free(entry);
+    }
+    flb_free(buf);
+
+    /*
+     * Keep the known hashes, the background check use them to find chunks
+     * that were stored but never made it into the index.
+     */
+    ctx->index_known = ht;
+    ctx->index_time  = time(NULL);
+
+    return count;
+}
+
+/*
+ * Write a new index with the current outgoing queue (compaction) and open
+ * it for appending.
+ */
+int flb_buffer_index_rewrite(struct flb_buffer *ctx)
+{
+    int fd;
+    int ret;
+    char *name;
+    char path[PATH_MAX];
+    char tmp[PATH_MAX];
+    FILE *fp;
+    struct mk_list *head;
+    struct flb_output_instance *o_ins;
+    struct flb_buffer_qchunk *qchunk;
+    struct flb_buffer_qworker *qw = ctx->qworker;
+
+    if (index_path(ctx, path, sizeof(path), "") == -1 ||
+        index_path(ctx, tmp, sizeof(tmp), ".tmp") == -1) {
+        return -1;
+    }
+
+    fp = fopen(tmp, "w");
+    if (!fp) {
+        flb_errno();
+        return -1;
+    }
+
+    fprintf(fp, "V %i\n", FLB_BUFFER_INDEX_VERSION);
+    mk_list_foreach(head, &ctx->config->outputs) {
+        o_ins = mk_list_entry(head, struct flb_output_instance, _head);
+        fprintf(fp, "O %" PRIu64 " %s\n", o_ins->mask_id, o_ins->name);
+    }
+
+    mk_list_foreach(head, &qw->queue) {
+        qchunk = mk_list_entry(head, struct flb_buffer_qchunk, _head);
+        name = strrchr(qchunk->file_path, '/') + 1;
+        fprintf(fp, "A %s %" PRIu64 " %zu %s\n",
+                qchunk->hash_str, qchunk->routes, qchunk->file_size, name);
+    }
+
+    ret = fflush(fp);
+    if (ret == 0 && ctx->sync != FLB_BUFFER_SYNC_NONE) {
+        ret = fsync(fileno(fp));
+    }
+    if (ret != 0) {
+        flb_errno();
+        fclose(fp);
+        unlink(tmp);
+        return -1;
+    }
+    fclose(fp);
+
+    ret = rename(tmp, path);
+    if (ret == -1) {
+        flb_errno();
+        unlink(tmp);
+        return -1;
+    }
+
+    if (ctx->sync != FLB_BUFFER_SYNC_NONE) {
+        flb_buffer_sync_path(ctx->path);
+    }
+
+    fd = open(path, O_WRONLY | O_APPEND);
+    if (fd == -1) {
+        flb_errno();
+        return -1;
+    }
+    ctx->index_fd = fd;
+
+    return 0;
+}
+
+/*
+ * Background check: one round over the outgoing directory looking for
+ * chunks that are not in the index (e.g: a crash before the record was
+ * written). This runs in the qchunk worker thread. It returns FLB_TRUE
+ * once the whole directory was checked.
+ */
+int flb_buffer_index_check(struct flb_buffer *ctx)
+{
+    int i;
+    int ret;
+    size_t size;
+    char *out;
+    char path[PATH_MAX];
+    uint64_t routes;
+    DIR *dir;
+    struct dirent *ent;
+    struct chunk_info info;
+    struct flb_buffer_qchunk *qchunk;
+    struct stat st;
+
+    if (!ctx->index_known) {
+        return FLB_TRUE;
+    }
+
+    dir = ctx->index_dir;
+    if (!dir) {
+        snprintf(path, sizeof(path) - 1, "%soutgoing", ctx->path);
+        dir = opendir(path);
+        if (!dir) {
+            flb_errno();
+            flb_buffer_index_check_end(ctx);
+            return FLB_TRUE;
+        }
+        ctx->index_dir = dir;
+    }
+
+    for (i = 0; i < FLB_BUFFER_INDEX_CHECK_BATCH; i++) {
+        ent = readdir(dir);
+        if (!ent) {
+            flb_debug("[buffer index] check done");
+            flb_buffer_index_check_end(ctx);
+            return FLB_TRUE;
+        }
+
+        if (ent->d_name[0] == '.' || ent->d_type != DT_REG) {
+            continue;
+        }
+
+        ret = chunk_info(ent->d_name, &info);
+        if (ret == -1) {
+            continue;
+        }
+
+        ret = flb_hash_get(ctx->index_known, info.hash_str, 40, &out, &size);
+        if (ret >= 0) {
+            continue;
+        }
+
+        /* Chunks created after the index was loaded are live tasks */
+        snprintf(path, sizeof(path) - 1, "%soutgoing/%s",
+                 ctx->path, ent->d_name);
+        ret = stat(path, &st);
+        if (ret == -1 || st.st_mtime >= ctx->index_time) {
+            continue;
+        }
+
+        routes = flb_buffer_chunk_routes(ctx, ent->d_name);
+        if (routes == 0) {
+            continue;
+        }
+
+        qchunk = flb_buffer_qchunk_add(ctx->qworker, path, routes,
+                                       info.tag, info.hash_str);
+        if (!qchunk) {
+            continue;
+        }
+        qchunk->file_size = st.st_size;
+        flb_buffer_index_add(ctx, ent->d_name, routes);
+
+        flb_info("[buffer index] recovered chunk %s", ent->d_name);
+    }
+
+    return FLB_FALSE;
+}
+
+void flb_buffer_index_check_end(struct flb_buffer *ctx)
+{
+    if (ctx->index_dir) {
+        closedir(ctx->index_dir);
+        ctx->index_dir = NULL;
+    }
+    if (ctx->index_known) {
+        flb_hash_destroy(ctx->index_known);
+        ctx->index_known = NULL;
+    }
+}
+
+/* Register a chunk stored in the outgoing queue */
+int flb_buffer_index_add(struct flb_buffer *ctx, char *name, uint64_t routes)
+{
+    int ret;
+    int len;
+    char buf[PATH_MAX + 128];
+    struct stat st;
+
+    if (ctx->index_fd == -1) {
+        return -1;
+    }
+
+    snprintf(buf, sizeof(buf) - 1, "%soutgoing/%s", ctx->path, name);
+    ret = stat(buf, &st);
+    if (ret == -1) {
+        flb_errno();
+        return -1;
+    }
+
+    len = snprintf(buf, sizeof(buf) - 1, "A %.40s %" PRIu64 " %zu %s\n",
+                   name, routes, (size_t) st.st_size, name);
+    if (len >= sizeof(buf) - 1) {
+        return -1;
+    }
+
+    return index_write(ctx, buf, len);
+}
+
+/* A route of a chunk was delivered */
+int flb_buffer_index_route(struct flb_buffer *ctx, char *hash,
+                           uint64_t mask_id)
+{
+    int len;
+    char buf[64];
+
+    len = snprintf(buf, sizeof(buf) - 1, "R %.40s %" PRIu64 "\n",
+                   hash, mask_id);
+    return index_write(ctx, buf, len);
+}
+
+/* A chunk was removed from the outgoing queue */
+int flb_buffer_index_del(struct flb_buffer *ctx, char *hash)
+{
+    int len;
+    char buf[64];
+
+    len = snprintf(buf, sizeof(buf) - 1, "D %.40s\n", hash);
+    return index_write(ctx, buf, len);
+}
+
+#endif /* !FLB_HAVE_BUFFERING */
@@ -23,6 +23,9 @@
 #include <fluent-bit/flb_str.h>
 #include <fluent-bit/flb_buffer.h>
 #include <fluent-bit/flb_buffer_qchunk.h>
+#include <fluent-bit/flb_buffer_chunk.h>
+#include <fluent-bit/flb_buffer_index.h>
+#include <fluent-bit/flb_utils.h>
 #include <fluent-bit/flb_engine_dispatch.h>
 #include <fluent-bit/flb_worker.h>
 
@@ -64,8 +67,12 @@ struct flb_buffer_qchunk *flb_buffer_qchunk_add(struct flb_buffer_qworker *qw,
         return NULL;
     }
     qchunk->id        = 0;
+    qchunk->mapped    = FLB_FALSE;
+    qchunk->file_size = 0;
     qchunk->file_path = flb_strdup(path);
     qchunk->routes    = routes;
+    qchunk->retries   = NULL;
+    qchunk->retries_n = 0;
     memcpy(&qchunk->hash_str, hash_str, 41);
 
     /* Create the Tag using an offset of the path */
@@ -83,8 +90,14 @@ struct flb_buffer_qchunk *flb_buffer_qchunk_add(struct flb_buffer_qworker *qw,
 int flb_buffer_qchunk_delete(struct flb_buffer_qchunk *qchunk)
 {
     if (qchunk->id > 0) {
-        munmap(qchunk->data, qchunk->size);
+        if (qchunk->mapped == FLB_TRUE) {
+            munmap(qchunk->data, qchunk->size);
+        }
+        else {
+            flb_free(qchunk->data);
+        }
     }
+    flb_free(qchunk->retries);
     flb_free(qchunk->file_path);
     mk_list_del(&qchunk->_head);
     flb_free(qchunk);
@@ -98,6 +111,8 @@ static char *qchunk_get_data(struct flb_buffer_qchunk *qchunk, size_t *size)
     int fd;
     int ret;
     char *buf;
+    char *data;
+    size_t data_size;
     struct stat st;
 
     fd = open(qchunk->file_path, O_RDONLY);
@@ -117,6 +132,13 @@ static char *qchunk_get_data(struct flb_buffer_qchunk *qchunk, size_t *size)
         return NULL;
     }
 
+    /* Size registered in the index */
+    if (qchunk->file_size > 0 && st.st_size != qchunk->file_size) {
+        flb_error("[buffer qchunk] size mismatch for %s", qchunk->file_path);
+        close(fd);
+        return NULL;
+    }
+
     buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
     if (buf == MAP_FAILED) {
         perror("mmap");
@@ -125,6 +147,28 @@ static char *qchunk_get_data(struct flb_buffer_qchunk *qchunk, size_t *size)
     }
 
     close(fd);
+
+    /* Compressed chunks are expanded in the heap */
+    data = flb_buffer_chunk_decompress(buf, st.st_size, &data_size);
+    if (data) {
+        munmap(buf, st.st_size);
+        if (flb_buffer_chunk_verify(qchunk->hash_str, data, data_size) != 0) {
+            flb_error("[buffer qchunk] corrupted chunk %s", qchunk->file_path);
+            flb_free(data);
+            return NULL;
+        }
+        qchunk->mapped = FLB_FALSE;
+        *size = data_size;
+        return data;
+    }
+
+    if (flb_buffer_chunk_verify(qchunk->hash_str, buf, st.st_size) != 0) {
+        flb_error("[buffer qchunk] corrupted chunk %s", qchunk->file_path);
+        munmap(buf, st.st_size);
+        return NULL;
+    }
+
+    qchunk->mapped = FLB_TRUE;
     *size = st.st_size;
     return buf;
 }
@@ -167,8 +211,10 @@ static inline int qchunk_event_push_request(struct flb_buffer *ctx)
     int ret = 0;
     uint64_t val;
     uint32_t set = 0;
+    uint64_t routes;
     size_t buf_size;
     char *buf;
+    char *name;
     struct mk_list *tmp;
     struct mk_list *head;
     struct flb_buffer_qchunk *qchunk;
@@ -185,10 +231,34 @@ static inline int qchunk_event_push_request(struct flb_buffer *ctx)
             continue;
         }
 
+        /*
+         * Routes may have been released since the chunk was found (e.g: the
+         * output quota evicted it), do not send it again.
+         */
+        name = strrchr(qchunk->file_path, '/');
+        if (name) {
+            routes = qchunk->routes & flb_buffer_chunk_routes(ctx, name + 1);
+            if (routes == 0) {
+                flb_debug("[buffer qchunk] no pending routes for %s",
+                          qchunk->file_path);
+                flb_buffer_qchunk_delete(qchunk);
+                continue;
+            }
+            qchunk->routes = routes;
+
+            /* Retry state saved in a previous run */
+            flb_free(qchunk->retries);
+            qchunk->retries_n = flb_buffer_chunk_retry_load(ctx, name + 1,
+                                                            routes,
+                                                            &qchunk->retries);
+        }
+
         /* Load into memory */
         buf = qchunk_get_data(qchunk, &buf_size);
         if (!buf) {
             flb_error("[buffer qchunk] could not load %s", qchunk->file_path);
+            flb_buffer_qchunk_delete(qchunk);
+            continue;
         }
 
         /* Obtain an ID for this qchunk */
@@ -216,7 +286,7 @@ static inline int qchunk_event_push_request(struct flb_buffer *ctx)
          */
         set = FLB_BUFFER_EV_SET(FLB_BUFFER_EV_QCHUNK_PUSH, qchunk->id, 0);
         val = FLB_BITS_U64_SET(FLB_ENGINE_BUFFER, set);
-        ret = flb_pipe_w(ctx->config->ch_manager[1], &val, sizeof(val));
+        ret = flb_engine_notify(ctx->config, val);
         if (ret == -1) {
             perror("write");
             flb_error("[buffer qchunk] could not notify engine");
@@ -305,6 +375,14 @@ static void flb_buffer_qchunk_worker(void *data)
     ctx = data;
     qw = ctx->qworker;
 
+    /* Chunks loaded from the index are checked in the background */
+    MK_EVENT_NEW(&qw->e_check);
+    if (ctx->index_known) {
+        qw->check_fd = mk_event_timeout_create(qw->evl, 0,
+                                               FLB_BUFFER_INDEX_CHECK_MS * 1000000,
+                                               &qw->e_check);
+    }
+
     /* Unlock the conditional */
     pthread_mutex_lock(&pth_mutex);
     pth_init = FLB_TRUE;
@@ -315,7 +393,16 @@ static void flb_buffer_qchunk_worker(void *data)
     while (run) {
         mk_event_wait(qw->evl);
         mk_event_foreach(event, qw->evl) {
-            if (event->type == FLB_BUFFER_EVENT) {
+            if (event == &qw->e_check) {
+                flb_utils_timer_consume(qw->check_fd);
+                ret = flb_buffer_index_check(ctx);
+                if (ret == FLB_TRUE) {
+                    mk_event_del(qw->evl, &qw->e_check);
+                    close(qw->check_fd);
+                    qw->check_fd = -1;
+                }
+            }
+            else if (event->type == FLB_BUFFER_EVENT) {
                 /* stop the event loop, thread will be destroyed */
                 ret = qchunk_handle_event(event->fd, event->mask, ctx);
                 if (ret == FLB_BUFFER_QC_STOP) {
@@ -350,6 +437,7 @@ int flb_buffer_qchunk_create(struct flb_buffer *ctx)
         return -1;
     }
     qw->tid = 0;
+    qw->check_fd = -1;
     mk_list_init(&qw->queue);
 
     /* Create an event loop */
@@ -390,6 +478,11 @@ void flb_buffer_qchunk_destroy(struct flb_buffer *ctx)
         flb_buffer_qchunk_delete(qchunk);
     }
 
+    if (qw->check_fd != -1) {
+        close(qw->check_fd);
+    }
+    flb_buffer_index_check_end(ctx);
+
     mk_event_loop_destroy(qw->evl);
     flb_free(qw);
     ctx->qworker = NULL;
@@ -415,8 +508,9 @@ int flb_buffer_qchunk_start(struct flb_buffer *ctx)
     pthread_mutex_lock(&pth_mutex);
 
     /*  Spawn the worker */
-    ret = flb_worker_create(flb_buffer_qchunk_worker,
-                            ctx, &qw->tid, ctx->config);
+    ret = flb_worker_create_role(flb_buffer_qchunk_worker,
+                                 ctx, &qw->tid, "buffer_qchunk", NULL,
+                                 ctx->config);
     if (ret == -1) {
         flb_warn("[buffer qchunk] could not spawn worker");
         pthread_mutex_unlock(&pth_mutex);
@@ -485,6 +579,8 @@ int flb_buffer_qchunk_push(struct flb_buffer *ctx, int id)
                                      qchunk->tag,
                                      qchunk->routes,
                                      qchunk->hash_str,
+                                     qchunk->retries,
+                                     qchunk->retries_n,
                                      ctx->config);
     return ret;
 }
@@ -0,0 +1,318 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <monkey/mk_core.h>
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_log.h>
+
+#ifdef FLB_HAVE_BUFFERING
+
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <fluent-bit/flb_output.h>
+#include <fluent-bit/flb_buffer.h>
+#include <fluent-bit/flb_buffer_chunk.h>
+#include <fluent-bit/flb_buffer_qchunk.h>
+#include <fluent-bit/flb_buffer_quota.h>
+
+#ifdef FLB_HAVE_METRICS
+#include <fluent-bit/flb_metrics.h>
+#endif
+
+/*
+ * The quota only cares about what we put on disk: when a chunk is evicted
+ * or rejected for an output, its route is removed from the chunk file but
+ * the in-memory task (if any) still deliver the records to that output.
+ */
+
+/* Update the 'fs_chunks_size' gauge */
+static inline void quota_size_metric(struct flb_output_instance *o_ins)
+{
+#ifdef FLB_HAVE_METRICS
+    struct flb_metric *m;
+
+    if (!o_ins->metrics) {
+        return;
+    }
+
+    m = flb_metrics_get_id(FLB_METRIC_OUT_FS_SIZE, o_ins->metrics);
+    if (m) {
+        flb_metric_set(m, o_ins->fs_size);
+    }
+#endif
+}
+
+static struct flb_buffer_worker *quota_worker(struct flb_buffer *ctx, int id)
+{
+    struct mk_list *head;
+    struct flb_buffer_worker *worker;
+
+    mk_list_foreach(head, &ctx->workers) {
+        worker = mk_list_entry(head, struct flb_buffer_worker, _head);
+        if (worker->id == id) {
+            return worker;
+        }
+    }
+
+    /* Chunks from a previous run may reference a worker that is gone */
+    return mk_list_entry_first(&ctx->workers, struct flb_buffer_worker, _head);
+}
+
+static int quota_add(struct flb_output_instance *o_ins, char *hash_hex,
+                     size_t size, int worker_id)
+{
+    struct flb_buffer_quota_chunk *qc;
+
+    qc = flb_malloc(sizeof(struct flb_buffer_quota_chunk));
+    if (!qc) {
+        flb_errno();
+        return -1;
+    }
+    memcpy(qc->hash_hex, hash_hex, 40);
+    qc->hash_hex[40] = '\0';
+    qc->worker_id = worker_id;
+    qc->size = size;
+    mk_list_add(&qc->_head, &o_ins->fs_chunks);
+
+    o_ins->fs_size += size;
+    quota_size_metric(o_ins);
+
+    return 0;
+}
+
+static void quota_del(struct flb_output_instance *o_ins,
+                      struct flb_buffer_quota_chunk *qc)
+{
+    o_ins->fs_size -= qc->size;
+    mk_list_del(&qc->_head);
+    flb_free(qc);
+    quota_size_metric(o_ins);
+}
+
+/*
+ * Evict the oldest chunk of an output: the route is released through the
+ * worker that owns the chunk, exactly like a delivered task does.
+ */
+static int quota_evict(struct flb_buffer *ctx,
+                       struct flb_output_instance *o_ins)
+{
+    int ret;
+    struct flb_buffer_chunk chunk;
+    struct flb_buffer_worker *worker;
+    struct flb_buffer_quota_chunk *qc;
+
+    qc = mk_list_entry_first(&o_ins->fs_chunks,
+                             struct flb_buffer_quota_chunk, _head);
+
+    memset(&chunk, '\0', sizeof(struct flb_buffer_chunk));
+    memcpy(&chunk.hash_hex, qc->hash_hex, 41);
+    chunk.tmp_len = strlen(o_ins->name);
+    memcpy(&chunk.tmp, o_ins->name, chunk.tmp_len);
+    chunk.tmp[chunk.tmp_len] = '\0';
+    chunk.data = o_ins;
+
+    worker = quota_worker(ctx, qc->worker_id);
+    ret = flb_buffer_worker_push(worker, worker->q_del_ref, &chunk);
+    if (ret == -1) {
+        return -1;
+    }
+
+    flb_debug("[buffer quota] %s evict chunk %s (%lu bytes)",
+              o_ins->name, qc->hash_hex, qc->size);
+
+#ifdef FLB_HAVE_METRICS
+    flb_metrics_sum(FLB_METRIC_OUT_FS_EVICTED, 1, o_ins->metrics);
+    flb_metrics_sum(FLB_METRIC_OUT_FS_EVICTED_BYTES, qc->size,
+                    o_ins->metrics);
+#endif
+    quota_del(o_ins, qc);
+
+    return 0;
+}
+
+/*
+ * Account a new chunk of 'size' bytes for every output in 'routes' that
+ * have a limit. It returns the routes that can be stored on disk: outputs
+ * using the 'reject' policy (or chunks bigger than the limit) are removed
+ * from the mask, with 'drop_oldest' old chunks are evicted until the new
+ * one fits.
+ */
+uint64_t flb_buffer_quota_reserve(struct flb_buffer *ctx, char *hash_hex,
+                                  size_t size, uint64_t routes,
+                                  int worker_id)
+{
+    int ret;
+    uint64_t stored = routes;
+    struct mk_list *head;
+    struct flb_output_instance *o_ins;
+
+    mk_list_foreach(head, &ctx->config->outputs) {
+        o_ins = mk_list_entry(head, struct flb_output_instance, _head);
+        if (o_ins->fs_limit == 0 || !(o_ins->mask_id & routes)) {
+            continue;
+        }
+
+        if (size > o_ins->fs_limit ||
+            (o_ins->fs_size + size > o_ins->fs_limit &&
+             o_ins->fs_limit_policy == FLB_OUTPUT_FS_REJECT)) {
+            stored &= ~o_ins->mask_id;
+#ifdef FLB_HAVE_METRICS
+            flb_metrics_sum(FLB_METRIC_OUT_FS_REJECTED, 1, o_ins->metrics);
+#endif
+            flb_debug("[buffer quota] %s reject chunk %s, limit reached",
+                      o_ins->name, hash_hex);
+            continue;
+        }
+
+        while (o_ins->fs_size + size > o_ins->fs_limit &&
+               mk_list_is_empty(&o_ins->fs_chunks) != 0) {
+            ret = quota_evict(ctx, o_ins);
+            if (ret == -1) {
+                break;
+            }
+        }
+
+        if (o_ins->fs_size + size > o_ins->fs_limit) {
+            stored &= ~o_ins->mask_id;
+#ifdef FLB_HAVE_METRICS
+            flb_metrics_sum(FLB_METRIC_OUT_FS_REJECTED, 1, o_ins->metrics);
+#endif
+            continue;
+        }
+
+        ret = quota_add(o_ins, hash_hex, size, worker_id);
+        if (ret == -1) {
+            stored &= ~o_ins->mask_id;
+        }
+    }
+
+    return stored;
+}
+
+/* A route of the chunk was delivered: release it space */
+void flb_buffer_quota_release(struct flb_output_instance *o_ins,
+                              char *hash_hex)
+{
+    struct mk_list *head;
+    struct flb_buffer_quota_chunk *qc;
+
+    if (o_ins->fs_limit == 0) {
+        return;
+    }
+
+    /* Chunks are mostly delivered in order, the match is near the head */
+    mk_list_foreach(head, &o_ins->fs_chunks) {
+        qc = mk_list_entry(head, struct flb_buffer_quota_chunk, _head);
+        if (strncmp(qc->hash_hex, hash_hex, 40) == 0) {
+            quota_del(o_ins, qc);
+            return;
+        }
+    }
+}
+
+/*
+ * Account the chunks found in the outgoing queue at start time. It must run
+ * before the qchunk worker starts.
+ */
+int flb_buffer_quota_scan(struct flb_buffer *ctx)
+{
+    int ret;
+    int worker_id;
+    char *name;
+    size_t size;
+    struct stat st;
+    struct mk_list *head;
+    struct mk_list *o_head;
+    struct chunk_info info;
+    struct flb_output_instance *o_ins;
+    struct flb_buffer_qchunk *qchunk;
+    struct flb_buffer_qworker *qw;
+
+    qw = ctx->qworker;
+    mk_list_foreach(head, &qw->queue) {
+        qchunk = mk_list_entry(head, struct flb_buffer_qchunk, _head);
+
+        size = qchunk->file_size;
+        if (size == 0) {
+            ret = stat(qchunk->file_path, &st);
+            if (ret == -1) {
+                continue;
+            }
+            size = st.st_size;
+        }
+
+        worker_id = 0;
+        name = strrchr(qchunk->file_path, '/');
+        if (name && chunk_info(name + 1, &info) == 0) {
+            worker_id = info.worker_id;
+        }
+
+        mk_list_foreach(o_head, &ctx->config->outputs) {
+            o_ins = mk_list_entry(o_head, struct flb_output_instance, _head);
+            if (o_ins->fs_limit == 0 || !(o_ins->mask_id & qchunk->routes)) {
+                continue;
+            }
+            quota_add(o_ins, qchunk->hash_str, size, worker_id);
+        }
+    }
+
+    /* Apply the limits over the backlog */
+    mk_list_foreach(o_head, &ctx->config->outputs) {
+        o_ins = mk_list_entry(o_head, struct flb_output_instance, _head);
+        if (o_ins->fs_limit == 0 || o_ins->fs_size <= o_ins->fs_limit) {
+            continue;
+        }
+
+        flb_warn("[buffer quota] %s has %lu bytes buffered, limit is %lu",
+                 o_ins->name, o_ins->fs_size, o_ins->fs_limit);
+        if (o_ins->fs_limit_policy != FLB_OUTPUT_FS_DROP_OLDEST) {
+            continue;
+        }
+        while (o_ins->fs_size > o_ins->fs_limit) {
+            ret = quota_evict(ctx, o_ins);
+            if (ret == -1) {
+                break;
+            }
+        }
+    }
+
+    return 0;
+}
+
+void flb_buffer_quota_destroy(struct flb_buffer *ctx)
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_list *o_head;
+    struct flb_output_instance *o_ins;
+    struct flb_buffer_quota_chunk *qc;
+
+    mk_list_foreach(o_head, &ctx->config->outputs) {
+        o_ins = mk_list_entry(o_head, struct flb_output_instance, _head);
+        mk_list_foreach_safe(head, tmp, &o_ins->fs_chunks) {
+            qc = mk_list_entry(head, struct flb_buffer_quota_chunk, _head);
+            quota_del(o_ins, qc);
+        }
+    }
+}
+
+#endif /* !FLB_HAVE_BUFFERING */
@@ -0,0 +1,251 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_log.h>
+#include <fluent-bit/flb_mp.h>
+#include <fluent-bit/flb_chunk_index.h>
+
+#include <string.h>
+
+/* Initial number of offsets allocated on first append */
+#define CHUNK_INDEX_SLOTS   64
+
+static inline uint64_t load_be(const unsigned char *p, int n)
+{
+    int i;
+    uint64_t v = 0;
+
+    for (i = 0; i < n; i++) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+/*
+ * Get the seconds of a record timestamp: an integer, a float or the
+ * EventTime extension (fixext 8, type 0). Returns -1 if it's something else.
+ */
+static int record_time(const unsigned char *p, size_t size, time_t *sec)
+{
+    uint32_t u32;
+    uint64_t u64;
+    float f;
+    double d;
+
+    if (size < 1) {
+        return -1;
+    }
+
+    if (p[0] <= 0x7f) {
+        *sec = p[0];
+        return 0;
+    }
+
+    switch (p[0]) {
+    case 0xcc:
+    case 0xcd:
+    case 0xce:
+    case 0xcf:
+        if (size < 1 + (1 << (p[0] - 0xcc))) {
+            return -1;
+        }
+        *sec = (time_t) load_be(p + 1, 1 << (p[0] - 0xcc));
+        return 0;
+    case 0xca:
+        if (size < 5) {
+            return -1;
+        }
+        u32 = (uint32_t) load_be(p + 1, 4);
+        memcpy(&f, &u32, sizeof(f));
+        *sec = (time_t) f;
+        return 0;
+    case 0xcb:
+        if (size < 9) {
+            return -1;
+        }
+        u64 = load_be(p + 1, 8);
+        memcpy(&d, &u64, sizeof(d));
+        *sec = (time_t) d;
+        return 0;
+    case 0xd7:
+        if (size < 10 || p[1] != 0) {
+            return -1;
+        }
+        *sec = (time_t) load_be(p + 2, 4);
+        return 0;
+    }
+
+    return -1;
+}
+
+void flb_chunk_index_init(struct flb_chunk_index *idx)
+{
+    idx->records = 0;
+    idx->slots   = 0;
+    idx->bytes   = 0;
+    idx->offsets = NULL;
+    idx->tm_min  = 0;
+    idx->tm_max  = 0;
+}
+
+/* Forget the indexed records, the offsets array is kept for reuse */
+void flb_chunk_index_reset(struct flb_chunk_index *idx)
+{
+    idx->records = 0;
+    idx->bytes   = 0;
+    idx->tm_min  = 0;
+    idx->tm_max  = 0;
+}
+
+/* Release the index, the chunk content is unknown from now on */
+void flb_chunk_index_invalidate(struct flb_chunk_index *idx)
+{
+    flb_free(idx->offsets);
+    flb_chunk_index_init(idx);
+    idx->records = -1;
+}
+
+/* The index of 'src' is given to 'dst', 'src' starts empty */
+void flb_chunk_index_move(struct flb_chunk_index *dst,
+                          struct flb_chunk_index *src)
+{
+    flb_free(dst->offsets);
+    *dst = *src;
+    flb_chunk_index_init(src);
+}
+
+/*
+ * Index the records appended to the chunk since the last call: 'buf' is the
+ * whole chunk and 'size' its current length. Returns the number of new
+ * records, or -1 if they could not be parsed (the index is invalidated).
+ */
+int flb_chunk_index_append(struct flb_chunk_index *idx,
+                           const char *buf, size_t size)
+{
+    int n = 0;
+    int slots;
+    size_t off;
+    size_t len;
+    size_t hdr;
+    uint32_t count;
+    uint32_t *tmp;
+    time_t sec;
+
+    if (idx->records < 0) {
+        return -1;
+    }
+
+    /* The chunk shrunk (e.g: a paused instance rolled back a write) */
+    if (size < idx->bytes) {
+        flb_chunk_index_invalidate(idx);
+        return -1;
+    }
+
+    /* Offsets are 32 bits, chunks are far below this limit */
+    if (size > UINT32_MAX) {
+        flb_chunk_index_invalidate(idx);
+        return -1;
+    }
+
+    off = idx->bytes;
+    while (off < size) {
+        if (flb_mp_object_size(buf + off, size - off, &len) == -1) {
+            flb_chunk_index_invalidate(idx);
+            return -1;
+        }
+
+        if (idx->records == idx->slots) {
+            slots = idx->slots ? idx->slots * 2 : CHUNK_INDEX_SLOTS;
+            tmp = flb_realloc(idx->offsets, sizeof(uint32_t) * slots);
+            if (!tmp) {
+                flb_errno();
+                flb_chunk_index_invalidate(idx);
+                return -1;
+            }
+            idx->offsets = tmp;
+            idx->slots = slots;
+        }
+        idx->offsets[idx->records] = (uint32_t) off;
+
+        /* Records are [timestamp, map] */
+        if (flb_mp_array_header(buf + off, len, &count, &hdr) == 0 &&
+            count == 2 &&
+            record_time((const unsigned char *) buf + off + hdr,
+                        len - hdr, &sec) == 0) {
+            if (idx->records == 0 || sec < idx->tm_min) {
+                idx->tm_min = sec;
+            }
+            if (idx->records == 0 || sec > idx->tm_max) {
+                idx->tm_max = sec;
+            }
+        }
+
+        idx->records++;
+        off += len;
+        n++;
+    }
+    idx->bytes = size;
+
+    return n;
+}
+
+/*
+ * Byte range of 'n' records starting at record 'from'. The range can be
+ * used to split a chunk or to take a batch of records out of it.
+ */
+int flb_chunk_index_range(struct flb_chunk_index *idx, int from, int n,
+                          size_t *off, size_t *bytes)
+{
+    size_t end;
+
+    if (idx->records < 0 || from < 0 || n < 0 ||
+        from + n > idx->records) {
+        return -1;
+    }
+
+    if (n == 0) {
+        *off = 0;
+        *bytes = 0;
+        return 0;
+    }
+
+    if (from + n == idx->records) {
+        end = idx->bytes;
+    }
+    else {
+        end = idx->offsets[from + n];
+    }
+
+    *off = idx->offsets[from];
+    *bytes = end - *off;
+    return 0;
+}
+
+/* Number of records of a chunk, the index is used when it covers it */
+int flb_chunk_index_count(struct flb_chunk_index *idx,
+                          void *buf, size_t size)
+{
+    if (idx && flb_chunk_index_valid(idx, size)) {
+        return idx->records;
+    }
+
+    return flb_mp_count(buf, size);
+}
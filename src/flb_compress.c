@@ -0,0 +1,361 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_log.h>
+#include <fluent-bit/flb_pipe.h>
+#include <fluent-bit/flb_gzip.h>
+#include <fluent-bit/flb_config.h>
+#include <fluent-bit/flb_engine.h>
+#include <fluent-bit/flb_thread.h>
+#include <fluent-bit/flb_worker.h>
+#include <fluent-bit/flb_compress.h>
+
+#include <string.h>
+
+/* Serialize the creation and release of the pool */
+static pthread_mutex_t compress_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void compress_worker(void *data)
+{
+    int ret;
+    uint64_t val = 1;
+    struct flb_compress *pool = data;
+    struct flb_compress_block *block;
+    struct flb_compress_job *job;
+
+    while (1) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->stop == FLB_FALSE && mk_list_is_empty(&pool->queue) == 0) {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        }
+        if (pool->stop == FLB_TRUE) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        block = mk_list_entry_first(&pool->queue,
+                                    struct flb_compress_block, _head);
+        mk_list_del(&block->_head);
+        pthread_mutex_unlock(&pool->lock);
+
+        block->ret = flb_gzip_compress(block->in_data, block->in_len,
+                                       &block->out_data, &block->out_len);
+
+        /* The job is owned by the caller again once notified */
+        job = block->job;
+        if (__sync_sub_and_fetch(&job->pending, 1) == 0) {
+            ret = flb_pipe_w(job->ch[1], &val, sizeof(val));
+            if (ret == -1) {
+                flb_errno();
+            }
+        }
+    }
+}
+
+static struct flb_compress *compress_pool_create(struct flb_config *config)
+{
+    int i;
+    int ret;
+    struct flb_compress *pool;
+
+    pool = flb_calloc(1, sizeof(struct flb_compress));
+    if (!pool) {
+        flb_errno();
+        return NULL;
+    }
+    pool->workers = config->compress_workers;
+    pool->block_size = config->compress_block_size;
+    pool->config = config;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    mk_list_init(&pool->queue);
+
+    pool->tids = flb_calloc(pool->workers, sizeof(pthread_t));
+    if (!pool->tids) {
+        flb_errno();
+        flb_free(pool);
+        return NULL;
+    }
+
+    for (i = 0; i < pool->workers; i++) {
+        ret = flb_worker_create_role(compress_worker, pool, &pool->tids[i],
+                                     "compress", NULL, config);
+        if (ret == -1) {
+            flb_error("[compress] could not spawn worker #%i", i);
+            break;
+        }
+    }
+
+    /* Run with the workers that could be started */
+    pool->workers = i;
+    if (pool->workers == 0) {
+        flb_free(pool->tids);
+        flb_free(pool);
+        return NULL;
+    }
+
+    flb_debug("[compress] %i workers started", pool->workers);
+    return pool;
+}
+
+/* Get the pool, it's started on the first request that needs it */
+static struct flb_compress *compress_pool_get(struct flb_config *config)
+{
+    struct flb_compress *pool;
+
+    pthread_mutex_lock(&compress_pool_lock);
+    if (!config->compress_ctx && config->compress_workers > 0) {
+        config->compress_ctx = compress_pool_create(config);
+        if (!config->compress_ctx) {
+            /* don't try again, compress in place from now on */
+            config->compress_workers = 0;
+        }
+    }
+    pool = config->compress_ctx;
+    pthread_mutex_unlock(&compress_pool_lock);
+
+    return pool;
+}
+
+static void compress_job_destroy(struct flb_compress_job *job)
+{
+    int i;
+
+    for (i = 0; i < job->blocks_n; i++) {
+        if (job->blocks[i].ret == 0 && job->blocks[i].out_data) {
+            flb_free(job->blocks[i].out_data);
+        }
+    }
+    flb_pipe_destroy(job->ch);
+    flb_free(job);
+}
+
+/*
+ * Wait for the workers. Inside a flush co-routine the read end of the
+ * channel is registered in the event loop that runs it and the co-routine
+ * yields, otherwise (e.g. library or test code) the caller just blocks.
+ */
+static int compress_job_wait(struct flb_compress_job *job)
+{
+    int ret;
+    uint64_t val;
+    struct mk_event_loop *evl;
+    struct flb_thread *th = NULL;
+
+    evl = flb_engine_evl_get();
+#ifdef FLB_HAVE_FLUSH_LIBCO
+    if (evl) {
+        th = (struct flb_thread *) pthread_getspecific(flb_thread_key);
+        if (th && th->callee != co_active()) {
+            th = NULL;
+        }
+    }
+#endif
+
+    if (th) {
+        job->thread = th;
+        MK_EVENT_NEW(&job->event);
+        ret = mk_event_add(evl, job->ch[0],
+                           FLB_ENGINE_EV_THREAD, MK_EVENT_READ, &job->event);
+        if (ret == -1) {
+            return -1;
+        }
+        flb_thread_yield(th, FLB_FALSE);
+        mk_event_del(evl, &job->event);
+    }
+
+    ret = flb_pipe_read_all(job->ch[0], &val, sizeof(val));
+    if (ret <= 0) {
+        flb_errno();
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Enqueue the blocks of a job, returns -1 if the pool is stopping */
+static int compress_job_submit(struct flb_compress *pool,
+                               struct flb_compress_job *job)
+{
+    int i;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->stop == FLB_TRUE) {
+        pthread_mutex_unlock(&pool->lock);
+        return -1;
+    }
+    for (i = 0; i < job->blocks_n; i++) {
+        mk_list_add(&job->blocks[i]._head, &pool->queue);
+    }
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    return 0;
+}
+
+/*
+ * Compress 'in_data' in gzip format, the output must be released with
+ * flb_free(). Small buffers, or any buffer when no workers are set, are
+ * compressed in the calling thread.
+ */
+int flb_compress_gzip(struct flb_config *config, void *in_data, size_t in_len,
+                      void **out_data, size_t *out_len)
+{
+    int i;
+    int ret;
+    int blocks_n = 1;
+    char *buf;
+    size_t off;
+    size_t size;
+    struct flb_compress *pool = NULL;
+    struct flb_compress_job *job;
+    struct flb_compress_block *block;
+
+    if (in_len >= FLB_COMPRESS_INLINE_MAX) {
+        pool = compress_pool_get(config);
+    }
+    if (!pool) {
+        return flb_gzip_compress(in_data, in_len, out_data, out_len);
+    }
+
+    if (pool->block_size > 0) {
+        blocks_n = (in_len + pool->block_size - 1) / pool->block_size;
+    }
+
+    job = flb_calloc(1, sizeof(struct flb_compress_job) +
+                     (sizeof(struct flb_compress_block) * blocks_n));
+    if (!job) {
+        flb_errno();
+        return -1;
+    }
+    job->blocks = (struct flb_compress_block *) (job + 1);
+    job->blocks_n = blocks_n;
+    job->pending = blocks_n;
+
+    ret = flb_pipe_create(job->ch);
+    if (ret == -1) {
+        flb_errno();
+        flb_free(job);
+        return -1;
+    }
+
+    off = 0;
+    for (i = 0; i < blocks_n; i++) {
+        block = &job->blocks[i];
+        block->job = job;
+        block->ret = -1;
+        block->in_data = (char *) in_data + off;
+        if (blocks_n == 1) {
+            block->in_len = in_len;
+        }
+        else {
+            block->in_len = (in_len - off) < pool->block_size ?
+                (in_len - off) : pool->block_size;
+        }
+        off += block->in_len;
+    }
+
+    ret = compress_job_submit(pool, job);
+    if (ret == -1) {
+        compress_job_destroy(job);
+        return flb_gzip_compress(in_data, in_len, out_data, out_len);
+    }
+
+    ret = compress_job_wait(job);
+    if (ret == -1) {
+        /*
+         * The workers still reference the job, it can't be released. This
+         * only happens if the event loop or the channel failed.
+         */
+        flb_error("[compress] lost a compression job");
+        return -1;
+    }
+
+    /* A single member is handed as is */
+    if (blocks_n == 1) {
+        block = &job->blocks[0];
+        if (block->ret == -1) {
+            compress_job_destroy(job);
+            return -1;
+        }
+        *out_data = block->out_data;
+        *out_len = block->out_len;
+        block->out_data = NULL;
+        compress_job_destroy(job);
+        return 0;
+    }
+
+    size = 0;
+    for (i = 0; i < blocks_n; i++) {
+        if (job->blocks[i].ret == -1) {
+            compress_job_destroy(job);
+            return -1;
+        }
+        size += job->blocks[i].out_len;
+    }
+
+    buf = flb_malloc(size);
+    if (!buf) {
+        flb_errno();
+        compress_job_destroy(job);
+        return -1;
+    }
+
+    off = 0;
+    for (i = 0; i < blocks_n; i++) {
+        memcpy(buf + off, job->blocks[i].out_data, job->blocks[i].out_len);
+        off += job->blocks[i].out_len;
+    }
+    compress_job_destroy(job);
+
+    *out_data = buf;
+    *out_len = size;
+    return 0;
+}
+
+/* Stop the workers, blocks still queued are dropped */
+void flb_compress_exit(struct flb_config *config)
+{
+    int i;
+    struct flb_compress *pool;
+
+    pthread_mutex_lock(&compress_pool_lock);
+    pool = config->compress_ctx;
+    config->compress_ctx = NULL;
+    pthread_mutex_unlock(&compress_pool_lock);
+
+    if (!pool) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = FLB_TRUE;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->workers; i++) {
+        pthread_join(pool->tids[i], NULL);
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->cond);
+    flb_free(pool->tids);
+    flb_free(pool);
+}
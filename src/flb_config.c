@@ -27,6 +27,7 @@
 #include <fluent-bit/flb_mem.h>
 #include <fluent-bit/flb_str.h>
 #include <fluent-bit/flb_env.h>
+#include <fluent-bit/flb_utils.h>
 #include <fluent-bit/flb_macros.h>
 #include <fluent-bit/flb_config.h>
 #include <fluent-bit/flb_parser.h>
@@ -34,9 +35,19 @@
 #include <fluent-bit/flb_io_tls.h>
 #include <fluent-bit/flb_kernel.h>
 #include <fluent-bit/flb_worker.h>
+#include <fluent-bit/flb_procfs.h>
 #include <fluent-bit/flb_scheduler.h>
 #include <fluent-bit/flb_http_server.h>
 #include <fluent-bit/flb_plugin_proxy.h>
+#include <fluent-bit/flb_buffer.h>
+#include <fluent-bit/flb_compress.h>
+#include <fluent-bit/flb_dns.h>
+#include <fluent-bit/flb_task_trace.h>
+#include <fluent-bit/flb_task.h>
+#include <fluent-bit/flb_tag.h>
+#include <fluent-bit/flb_reload.h>
+#include <fluent-bit/flb_sp.h>
+#include <fluent-bit/flb_mem_pool.h>
 
 int flb_regex_init();
 
@@ -45,6 +56,10 @@ struct flb_service_config service_configs[] = {
      FLB_CONF_TYPE_INT,
      offsetof(struct flb_config, flush)},
 
+    {FLB_CONF_STR_GRACE,
+     FLB_CONF_TYPE_INT,
+     offsetof(struct flb_config, grace)},
+
     {FLB_CONF_STR_DAEMON,
      FLB_CONF_TYPE_BOOL,
      offsetof(struct flb_config, daemon)},
@@ -65,6 +80,74 @@ struct flb_service_config service_configs[] = {
      FLB_CONF_TYPE_STR,
      offsetof(struct flb_config, log)},
 
+    {FLB_CONF_STR_LOGRATELIMIT,
+     FLB_CONF_TYPE_INT,
+     offsetof(struct flb_config, log_rate_limit)},
+
+    {FLB_CONF_STR_MEM_TOTAL_LIMIT,
+     FLB_CONF_TYPE_OTHER,
+     offsetof(struct flb_config, mem_total_limit)},
+
+    {FLB_CONF_STR_MEM_POOL,
+     FLB_CONF_TYPE_OTHER,
+     offsetof(struct flb_config, mem_pool)},
+
+    {FLB_CONF_STR_MEM_POOL_HUGEPAGES,
+     FLB_CONF_TYPE_OTHER,
+     offsetof(struct flb_config, mem_pool_hugepages)},
+
+    {FLB_CONF_STR_INIT_WORKERS,
+     FLB_CONF_TYPE_INT,
+     offsetof(struct flb_config, init_workers)},
+
+    {FLB_CONF_STR_TASKS_MAX,
+     FLB_CONF_TYPE_INT,
+     offsetof(struct flb_config, tasks_max)},
+
+    {FLB_CONF_STR_COMPRESS_WORKERS,
+     FLB_CONF_TYPE_INT,
+     offsetof(struct flb_config, compress_workers)},
+
+    {FLB_CONF_STR_COMPRESS_BLOCK_SIZE,
+     FLB_CONF_TYPE_OTHER,
+     offsetof(struct flb_config, compress_block_size)},
+
+    {FLB_CONF_STR_FILTER_WORKERS,
+     FLB_CONF_TYPE_INT,
+     offsetof(struct flb_config, filter_workers)},
+
+    {FLB_CONF_STR_DNS_WORKERS,
+     FLB_CONF_TYPE_INT,
+     offsetof(struct flb_config, dns_workers)},
+
+    {FLB_CONF_STR_DNS_CACHE_TTL,
+     FLB_CONF_TYPE_INT,
+     offsetof(struct flb_config, dns_cache_ttl)},
+
+    {FLB_CONF_STR_CPU_AFFINITY,
+     FLB_CONF_TYPE_OTHER,
+     offsetof(struct flb_config, cpu_affinity)},
+
+    {FLB_CONF_STR_ENGINE_SHARDS,
+     FLB_CONF_TYPE_INT,
+     offsetof(struct flb_config, engine_shards)},
+
+    {FLB_CONF_STR_HOT_RELOAD,
+     FLB_CONF_TYPE_BOOL,
+     offsetof(struct flb_config, hot_reload)},
+
+#ifdef FLB_HAVE_METRICS
+    {FLB_CONF_STR_TASK_TRACE,
+     FLB_CONF_TYPE_INT,
+     offsetof(struct flb_config, task_trace)},
+#endif
+
+#ifdef FLB_HAVE_STATS
+    {FLB_CONF_STR_STATS_PATH,
+     FLB_CONF_TYPE_STR,
+     offsetof(struct flb_config, stats_path)},
+#endif
+
 #ifdef FLB_HAVE_HTTP_SERVER
     {FLB_CONF_STR_HTTP_SERVER,
      FLB_CONF_TYPE_BOOL,
@@ -76,6 +159,31 @@ struct flb_service_config service_configs[] = {
     {FLB_CONF_STR_HTTP_PORT,
      FLB_CONF_TYPE_STR,
      offsetof(struct flb_config, http_port)},
+
+    {FLB_CONF_STR_HEALTH_CHECK,
+     FLB_CONF_TYPE_BOOL,
+     offsetof(struct flb_config, health_check)},
+    {FLB_CONF_STR_HC_PERIOD,
+     FLB_CONF_TYPE_INT,
+     offsetof(struct flb_config, hc_period)},
+    {FLB_CONF_STR_HC_ERRORS_COUNT,
+     FLB_CONF_TYPE_INT,
+     offsetof(struct flb_config, hc_errors_count)},
+    {FLB_CONF_STR_HC_RETRY_FAILURE_COUNT,
+     FLB_CONF_TYPE_INT,
+     offsetof(struct flb_config, hc_retry_failure_count)},
+    {FLB_CONF_STR_HC_TASKS_USAGE,
+     FLB_CONF_TYPE_INT,
+     offsetof(struct flb_config, hc_tasks_usage)},
+    {FLB_CONF_STR_HC_BACKLOG_SIZE,
+     FLB_CONF_TYPE_OTHER,
+     offsetof(struct flb_config, hc_backlog_size)},
+    {FLB_CONF_STR_HC_RETRIES_PENDING,
+     FLB_CONF_TYPE_INT,
+     offsetof(struct flb_config, hc_retries_pending)},
+    {FLB_CONF_STR_HC_STALL_TIMEOUT,
+     FLB_CONF_TYPE_INT,
+     offsetof(struct flb_config, hc_stall_timeout)},
 #endif
 
 #ifdef FLB_HAVE_BUFFERING
@@ -86,6 +194,18 @@ struct flb_service_config service_configs[] = {
     {FLB_CONF_STR_BUF_WORKERS,
      FLB_CONF_TYPE_INT,
      offsetof(struct flb_config, buffer_workers)},
+
+    {FLB_CONF_STR_BUF_SYNC,
+     FLB_CONF_TYPE_OTHER,
+     offsetof(struct flb_config, buffer_sync)},
+
+    {FLB_CONF_STR_BUF_SYNC_INTERVAL,
+     FLB_CONF_TYPE_INT,
+     offsetof(struct flb_config, buffer_sync_interval)},
+
+    {FLB_CONF_STR_BUF_COMPRESS,
+     FLB_CONF_TYPE_BOOL,
+     offsetof(struct flb_config, buffer_compress)},
 #endif
 
     {NULL, FLB_CONF_TYPE_OTHER, 0} /* end of array */
@@ -101,10 +221,21 @@ struct flb_config *flb_config_init()
         perror("malloc");
         return NULL;
     }
+
+    if (flb_task_slabs_create(config) == -1) {
+        flb_free(config);
+        return NULL;
+    }
+    if (flb_tag_table_create(config) == -1) {
+        flb_task_slabs_destroy(config);
+        flb_free(config);
+        return NULL;
+    }
     config->is_running = FLB_TRUE;
 
     /* Flush */
     config->flush        = FLB_CONFIG_FLUSH_SECS;
+    config->grace        = FLB_CONFIG_GRACE_SECS;
 #if defined FLB_HAVE_FLUSH_PTHREADS
     config->flush_method = FLB_FLUSH_PTHREADS;
 #elif defined FLB_HAVE_FLUSH_LIBCO
@@ -114,18 +245,48 @@ struct flb_config *flb_config_init()
     config->init_time    = time(NULL);
     config->kernel       = flb_kernel_info();
     config->verbose      = 3;
+    config->log_rate_limit = FLB_LOG_RATE_LIMIT;
+
+    config->mem_pool            = 0;
+    config->mem_pool_hugepages  = FLB_MEM_POOL_HUGE_OFF;
+    config->init_workers        = FLB_CONFIG_INIT_WORKERS;
+    config->tasks_max           = FLB_CONFIG_TASKS_MAX;
+    config->compress_workers    = FLB_COMPRESS_WORKERS;
+    config->compress_block_size = FLB_COMPRESS_BLOCK_SIZE;
+    config->dns_workers         = FLB_DNS_WORKERS;
+    config->dns_cache_ttl       = FLB_DNS_CACHE_TTL;
+    config->filter_workers      = 0;
+    config->filter_pool         = NULL;
+    config->cpu_affinity        = NULL;
+    config->engine_shards       = 1;
+    config->shard_id            = 0;
+    config->shard_parent        = NULL;
+    config->shards_ctx          = NULL;
+    config->hot_reload          = FLB_FALSE;
 
 #ifdef FLB_HAVE_HTTP_SERVER
     config->http_ctx     = NULL;
     config->http_server  = FLB_FALSE;
     config->http_listen  = flb_strdup(FLB_CONFIG_HTTP_LISTEN);
     config->http_port    = flb_strdup(FLB_CONFIG_HTTP_PORT);
+
+    config->health_check           = FLB_FALSE;
+    config->hc_period              = FLB_CONFIG_HC_PERIOD;
+    config->hc_errors_count        = FLB_CONFIG_HC_ERRORS_COUNT;
+    config->hc_retry_failure_count = FLB_CONFIG_HC_RETRY_FAILURE_COUNT;
+    config->hc_tasks_usage         = FLB_CONFIG_HC_TASKS_USAGE;
+    config->hc_backlog_size        = 0;
+    config->hc_retries_pending     = 0;
+    config->hc_stall_timeout       = FLB_CONFIG_HC_STALL_TIMEOUT;
 #endif
 
 #ifdef FLB_HAVE_BUFFERING
     config->buffer_ctx     = NULL;
     config->buffer_path    = NULL;
     config->buffer_workers = 0;
+    config->buffer_sync    = FLB_BUFFER_SYNC_NORMAL;
+    config->buffer_sync_interval = FLB_BUFFER_SYNC_INTERVAL;
+    config->buffer_compress = FLB_FALSE;
 #endif
 
 #ifdef FLB_HAVE_SQLDB
@@ -136,26 +297,26 @@ struct flb_config *flb_config_init()
     mk_list_init(&config->luajit_list);
 #endif
 
+#ifdef FLB_HAVE_STREAM_PROCESSOR
+    mk_list_init(&config->stream_tasks);
+#endif
+
     mk_list_init(&config->collectors);
-    mk_list_init(&config->in_plugins);
     mk_list_init(&config->parser_plugins);
-    mk_list_init(&config->filter_plugins);
     mk_list_init(&config->out_plugins);
     mk_list_init(&config->inputs);
     mk_list_init(&config->parsers);
     mk_list_init(&config->filters);
+    pthread_rwlock_init(&config->filters_lock, NULL);
     mk_list_init(&config->outputs);
+    mk_list_init(&config->outputs_retired);
     mk_list_init(&config->proxies);
     mk_list_init(&config->workers);
-
-    memset(&config->tasks_map, '\0', sizeof(config->tasks_map));
+    mk_list_init(&config->procfs_files);
 
     /* Environment */
     config->env = flb_env_create();
 
-    /* Register plugins */
-    flb_register_plugins(config);
-
     /* Ignoring SIGPIPE on Windows (scary) */
 #ifndef _WIN32
     /* Ignore SIGPIPE */
@@ -183,7 +344,8 @@ void flb_config_exit(struct flb_config *config)
         flb_free(config->log_file);
     }
 
-    if (config->log) {
+    /* A shard shares the log and the CPUs of the main engine */
+    if (config->log && !config->shard_parent) {
         flb_log_stop(config->log, config);
     }
 
@@ -212,6 +374,7 @@ void flb_config_exit(struct flb_config *config)
     }
 
     /* Channel manager */
+    flb_engine_channel_destroy(config->ch_engine);
     if (config->ch_manager[0] > 0) {
         close(config->ch_manager[0]);
         if (config->ch_manager[0] != config->ch_manager[1]) {
@@ -249,9 +412,20 @@ void flb_config_exit(struct flb_config *config)
     if (config->conf_path) {
         flb_free(config->conf_path);
     }
+    if (config->conf_file) {
+        flb_free(config->conf_file);
+    }
+    flb_reload_exit(config);
+    pthread_rwlock_destroy(&config->filters_lock);
 
     /* Workers */
     flb_worker_exit(config);
+    if (!config->shard_parent) {
+        flb_worker_cpus_destroy(config->cpu_affinity);
+    }
+
+    /* Shared /proc files left open */
+    flb_procfs_exit(config);
 
     /* Event flush */
     if (config->evl) {
@@ -259,6 +433,11 @@ void flb_config_exit(struct flb_config *config)
     }
     close(config->flush_fd);
 
+#ifdef FLB_HAVE_STREAM_PROCESSOR
+    /* Stream tasks, their window timers go first */
+    flb_sp_exit(config);
+#endif
+
     /* Release scheduler */
     flb_sched_exit(config);
 
@@ -274,6 +453,15 @@ void flb_config_exit(struct flb_config *config)
 
 #ifdef FLB_HAVE_STATS
     flb_stats_exit(config);
+    if (config->stats_path) {
+        flb_free(config->stats_path);
+    }
+#endif
+
+#ifdef FLB_HAVE_METRICS
+    if (config->task_traces) {
+        flb_task_traces_destroy(config->task_traces);
+    }
 #endif
 
 #ifdef FLB_HAVE_BUFFERING
@@ -283,6 +471,14 @@ void flb_config_exit(struct flb_config *config)
     if (config->evl) {
         mk_event_loop_destroy(config->evl);
     }
+    flb_task_map_destroy(config);
+    flb_task_slabs_destroy(config);
+    flb_tag_table_destroy(config);
+
+    /* The last one, buffers of the pool are released by now */
+    if (config->mem_pool > 0) {
+        flb_mem_pool_destroy();
+    }
     flb_free(config);
 }
 
@@ -349,6 +545,28 @@ static inline int atobool(char*v)
         : FLB_FALSE;
 }
 
+#ifdef FLB_HAVE_BUFFERING
+static int set_buffer_sync(struct flb_config *config, char *v_str)
+{
+    if (strcasecmp(v_str, "none") == 0) {
+        config->buffer_sync = FLB_BUFFER_SYNC_NONE;
+    }
+    else if (strcasecmp(v_str, "normal") == 0) {
+        config->buffer_sync = FLB_BUFFER_SYNC_NORMAL;
+    }
+    else if (strcasecmp(v_str, "full") == 0) {
+        config->buffer_sync = FLB_BUFFER_SYNC_FULL;
+    }
+    else {
+        flb_error("[config] invalid %s value '%s'",
+                  FLB_CONF_STR_BUF_SYNC, v_str);
+        return -1;
+    }
+
+    return 0;
+}
+#endif
+
 int flb_config_set_property(struct flb_config *config,
                             char *k, char *v)
 {
@@ -356,6 +574,7 @@ int flb_config_set_property(struct flb_config *config,
     int ret = -1;
     int *i_val;
     char **s_val;
+    ssize_t limit;
     size_t len = strnlen(k, 256);
     char *key = service_configs[0].key;
     char *tmp = NULL;
@@ -373,6 +592,92 @@ int flb_config_set_property(struct flb_config *config,
                 tmp = NULL;
 #endif
             }
+            else if (!strncasecmp(key, FLB_CONF_STR_MEM_TOTAL_LIMIT, 32)) {
+                tmp = flb_env_var_translate(config->env, v);
+                limit = flb_utils_size_to_bytes(tmp);
+                if (limit == -1) {
+                    flb_error("[config] invalid %s value '%s'", key, tmp);
+                    ret = -1;
+                }
+                else {
+                    config->mem_total_limit = (size_t) limit;
+                    ret = 0;
+                }
+                flb_free(tmp);
+                tmp = NULL;
+            }
+            else if (!strncasecmp(key, FLB_CONF_STR_MEM_POOL_HUGEPAGES, 32)) {
+                tmp = flb_env_var_translate(config->env, v);
+                ret = flb_mem_pool_hugepages(tmp);
+                if (ret == -1) {
+                    flb_error("[config] invalid %s value '%s'", key, tmp);
+                }
+                else {
+                    config->mem_pool_hugepages = ret;
+                    ret = 0;
+                }
+                flb_free(tmp);
+                tmp = NULL;
+            }
+            else if (!strncasecmp(key, FLB_CONF_STR_MEM_POOL, 32)) {
+                tmp = flb_env_var_translate(config->env, v);
+                limit = flb_utils_size_to_bytes(tmp);
+                if (limit == -1) {
+                    flb_error("[config] invalid %s value '%s'", key, tmp);
+                    ret = -1;
+                }
+                else {
+                    config->mem_pool = (size_t) limit;
+                    ret = 0;
+                }
+                flb_free(tmp);
+                tmp = NULL;
+            }
+#ifdef FLB_HAVE_HTTP_SERVER
+            else if (!strncasecmp(key, FLB_CONF_STR_HC_BACKLOG_SIZE, 32)) {
+                tmp = flb_env_var_translate(config->env, v);
+                limit = flb_utils_size_to_bytes(tmp);
+                if (limit == -1) {
+                    flb_error("[config] invalid %s value '%s'", key, tmp);
+                    ret = -1;
+                }
+                else {
+                    config->hc_backlog_size = (size_t) limit;
+                    ret = 0;
+                }
+                flb_free(tmp);
+                tmp = NULL;
+            }
+#endif
+            else if (!strncasecmp(key, FLB_CONF_STR_COMPRESS_BLOCK_SIZE, 32)) {
+                tmp = flb_env_var_translate(config->env, v);
+                limit = flb_utils_size_to_bytes(tmp);
+                if (limit == -1) {
+                    flb_error("[config] invalid %s value '%s'", key, tmp);
+                    ret = -1;
+                }
+                else {
+                    config->compress_block_size = (size_t) limit;
+                    ret = 0;
+                }
+                flb_free(tmp);
+                tmp = NULL;
+            }
+            else if (!strncasecmp(key, FLB_CONF_STR_CPU_AFFINITY, 32)) {
+                tmp = flb_env_var_translate(config->env, v);
+                if (!config->shard_parent) {
+        flb_worker_cpus_destroy(config->cpu_affinity);
+    }
+                config->cpu_affinity = flb_worker_cpus_create(tmp);
+                ret = config->cpu_affinity ? 0 : -1;
+                flb_free(tmp);
+                tmp = NULL;
+            }
+#ifdef FLB_HAVE_BUFFERING
+            else if (!strncasecmp(key, FLB_CONF_STR_BUF_SYNC, 32)) {
+                ret = set_buffer_sync(config, v);
+            }
+#endif
 #ifdef FLB_HAVE_PROXY_GO
             else if (!strncasecmp(key, FLB_CONF_STR_PLUGINS_FILE, 32)) {
                 tmp = flb_env_var_translate(config->env, v);
@@ -0,0 +1,137 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <pthread.h>
+
+#include <fluent-bit/flb_crc32c.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define FLB_CRC32C_SSE42
+#include <nmmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#define FLB_CRC32C_ARMV8
+#include <arm_acle.h>
+#endif
+
+/* Reversed Castagnoli polynomial */
+#define CRC32C_POLY  0x82f63b78
+
+static uint32_t crc32c_table[256];
+static uint32_t (*crc32c_func)(uint32_t, const void *, size_t);
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static void crc32c_table_init()
+{
+    int i;
+    int j;
+    uint32_t crc;
+
+    for (i = 0; i < 256; i++) {
+        crc = i;
+        for (j = 0; j < 8; j++) {
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        crc32c_table[i] = crc;
+    }
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+
+    crc = ~crc;
+    while (len--) {
+        crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+
+    return ~crc;
+}
+
+#ifdef FLB_CRC32C_SSE42
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const void *data, size_t len)
+{
+    uint64_t v;
+    uint64_t c;
+    const unsigned char *p = data;
+
+    c = ~crc;
+    while (len >= 8) {
+        __builtin_memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+        p += 8;
+        len -= 8;
+    }
+
+    crc = (uint32_t) c;
+    while (len--) {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+
+    return ~crc;
+}
+#elif defined(FLB_CRC32C_ARMV8)
+static uint32_t crc32c_hw(uint32_t crc, const void *data, size_t len)
+{
+    uint64_t v;
+    const unsigned char *p = data;
+
+    crc = ~crc;
+    while (len >= 8) {
+        __builtin_memcpy(&v, p, 8);
+        crc = __crc32cd(crc, v);
+        p += 8;
+        len -= 8;
+    }
+
+    while (len--) {
+        crc = __crc32cb(crc, *p++);
+    }
+
+    return ~crc;
+}
+#endif
+
+static void crc32c_init()
+{
+    crc32c_table_init();
+    crc32c_func = crc32c_sw;
+
+#ifdef FLB_CRC32C_SSE42
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc32c_func = crc32c_hw;
+    }
+#elif defined(FLB_CRC32C_ARMV8)
+    crc32c_func = crc32c_hw;
+#endif
+}
+
+uint32_t flb_crc32c(uint32_t crc, const void *data, size_t len)
+{
+    pthread_once(&crc32c_once, crc32c_init);
+    return crc32c_func(crc, data, len);
+}
+
+/* Table based version, always available (used by tests) */
+uint32_t flb_crc32c_sw(uint32_t crc, const void *data, size_t len)
+{
+    pthread_once(&crc32c_once, crc32c_init);
+    return crc32c_sw(crc, data, len);
+}
@@ -0,0 +1,372 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_log.h>
+#include <fluent-bit/flb_pipe.h>
+#include <fluent-bit/flb_config.h>
+#include <fluent-bit/flb_engine.h>
+#include <fluent-bit/flb_thread.h>
+#include <fluent-bit/flb_worker.h>
+#include <fluent-bit/flb_dns.h>
+
+#include <string.h>
+#include <netdb.h>
+
+/* Serialize the creation and release of the pool */
+static pthread_mutex_t dns_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Run getaddrinfo() and keep a copy of the addresses in the job */
+static void dns_lookup(struct flb_dns_job *job)
+{
+    int n = 0;
+    struct addrinfo hints;
+    struct addrinfo *res;
+    struct addrinfo *rp;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = job->family;
+    hints.ai_socktype = SOCK_STREAM;
+
+    job->ret = getaddrinfo(job->host, job->port, &hints, &res);
+    if (job->ret != 0) {
+        return;
+    }
+
+    for (rp = res; rp != NULL; rp = rp->ai_next) {
+        n++;
+    }
+    if (n > FLB_DNS_ADDRS_MAX) {
+        n = FLB_DNS_ADDRS_MAX;
+    }
+
+    job->addrs = flb_calloc(n, sizeof(struct flb_dns_addr));
+    if (!job->addrs) {
+        flb_errno();
+        freeaddrinfo(res);
+        job->ret = EAI_MEMORY;
+        return;
+    }
+
+    for (rp = res; rp != NULL && job->count < n; rp = rp->ai_next) {
+        if (rp->ai_addrlen > sizeof(struct sockaddr_storage)) {
+            continue;
+        }
+        job->addrs[job->count].family = rp->ai_family;
+        job->addrs[job->count].len = rp->ai_addrlen;
+        memcpy(&job->addrs[job->count].addr, rp->ai_addr, rp->ai_addrlen);
+        job->count++;
+    }
+    freeaddrinfo(res);
+}
+
+static void dns_worker(void *data)
+{
+    int ret;
+    uint64_t val = 1;
+    struct flb_dns *pool = data;
+    struct flb_dns_job *job;
+
+    while (1) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->stop == FLB_FALSE && mk_list_is_empty(&pool->queue) == 0) {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        }
+        if (pool->stop == FLB_TRUE) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        job = mk_list_entry_first(&pool->queue, struct flb_dns_job, _head);
+        mk_list_del(&job->_head);
+        pthread_mutex_unlock(&pool->lock);
+
+        dns_lookup(job);
+
+        /* The job is owned by the caller again once notified */
+        ret = flb_pipe_w(job->ch[1], &val, sizeof(val));
+        if (ret == -1) {
+            flb_errno();
+        }
+    }
+}
+
+static struct flb_dns *dns_pool_create(struct flb_config *config)
+{
+    int i;
+    int ret;
+    struct flb_dns *pool;
+
+    pool = flb_calloc(1, sizeof(struct flb_dns));
+    if (!pool) {
+        flb_errno();
+        return NULL;
+    }
+    pool->workers = config->dns_workers;
+    pool->config = config;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    mk_list_init(&pool->queue);
+
+    pool->tids = flb_calloc(pool->workers, sizeof(pthread_t));
+    if (!pool->tids) {
+        flb_errno();
+        flb_free(pool);
+        return NULL;
+    }
+
+    for (i = 0; i < pool->workers; i++) {
+        ret = flb_worker_create_role(dns_worker, pool, &pool->tids[i],
+                                     "dns", NULL, config);
+        if (ret == -1) {
+            flb_error("[dns] could not spawn resolver #%i", i);
+            break;
+        }
+    }
+
+    /* Run with the workers that could be started */
+    pool->workers = i;
+    if (pool->workers == 0) {
+        flb_free(pool->tids);
+        flb_free(pool);
+        return NULL;
+    }
+
+    flb_debug("[dns] %i resolvers started", pool->workers);
+    return pool;
+}
+
+/* Get the pool, it's started on the first lookup that needs it */
+static struct flb_dns *dns_pool_get(struct flb_config *config)
+{
+    struct flb_dns *pool;
+
+    pthread_mutex_lock(&dns_pool_lock);
+    if (!config->dns_ctx && config->dns_workers > 0) {
+        config->dns_ctx = dns_pool_create(config);
+        if (!config->dns_ctx) {
+            /* don't try again, resolve in place from now on */
+            config->dns_workers = 0;
+        }
+    }
+    pool = config->dns_ctx;
+    pthread_mutex_unlock(&dns_pool_lock);
+
+    return pool;
+}
+
+/* Enqueue a lookup, returns -1 if the pool is stopping */
+static int dns_job_submit(struct flb_dns *pool, struct flb_dns_job *job)
+{
+    pthread_mutex_lock(&pool->lock);
+    if (pool->stop == FLB_TRUE) {
+        pthread_mutex_unlock(&pool->lock);
+        return -1;
+    }
+    mk_list_add(&job->_head, &pool->queue);
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    return 0;
+}
+
+/* Yield the co-routine until the resolver is done with the job */
+static int dns_job_wait(struct flb_dns_job *job, struct flb_thread *th,
+                        struct mk_event_loop *evl)
+{
+    int ret;
+    uint64_t val;
+
+    job->thread = th;
+    MK_EVENT_NEW(&job->event);
+    ret = mk_event_add(evl, job->ch[0],
+                       FLB_ENGINE_EV_THREAD, MK_EVENT_READ, &job->event);
+    if (ret == -1) {
+        return -1;
+    }
+    flb_thread_yield(th, FLB_FALSE);
+    mk_event_del(evl, &job->event);
+
+    ret = flb_pipe_read_all(job->ch[0], &val, sizeof(val));
+    if (ret <= 0) {
+        flb_errno();
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Resolve 'host' and return its addresses, the array must be released
+ * with flb_free(). When a co-routine 'th' and the event loop running it
+ * are given, the lookup runs in a resolver thread while the co-routine
+ * yields.
+ */
+int flb_dns_resolve(struct flb_config *config, char *host, int port,
+                    int family, struct flb_thread *th,
+                    struct mk_event_loop *evl,
+                    struct flb_dns_addr **addrs, int *count)
+{
+    int ret;
+    struct flb_dns *pool = NULL;
+    struct flb_dns_job *job;
+
+    job = flb_calloc(1, sizeof(struct flb_dns_job));
+    if (!job) {
+        flb_errno();
+        return -1;
+    }
+    job->host = host;
+    job->family = family;
+    snprintf(job->port, sizeof(job->port), "%i", port);
+
+    if (th && evl) {
+        pool = dns_pool_get(config);
+    }
+
+    if (pool) {
+        ret = flb_pipe_create(job->ch);
+        if (ret == -1) {
+            flb_errno();
+            pool = NULL;
+        }
+        else if (dns_job_submit(pool, job) == -1) {
+            flb_pipe_destroy(job->ch);
+            pool = NULL;
+        }
+    }
+
+    if (!pool) {
+        dns_lookup(job);
+    }
+    else {
+        ret = dns_job_wait(job, th, evl);
+        if (ret == -1) {
+            /*
+             * The resolver still references the job, it can't be released.
+             * This only happens if the event loop or the channel failed.
+             */
+            flb_error("[dns] lost a lookup for host '%s'", host);
+            return -1;
+        }
+        flb_pipe_destroy(job->ch);
+    }
+
+    if (job->ret != 0 || job->count == 0) {
+        flb_warn("[dns] could not resolve host '%s': %s", host,
+                 job->ret != 0 ? gai_strerror(job->ret) : "no address");
+        flb_free(job->addrs);
+        flb_free(job);
+        return -1;
+    }
+
+    *addrs = job->addrs;
+    *count = job->count;
+    flb_free(job);
+
+    return 0;
+}
+
+/*
+ * Get the address for a new connection to 'host' from the cache, it's
+ * resolved again once the entry expires. Consecutive calls rotate across
+ * the addresses. If the lookup fails the expired addresses are used.
+ */
+int flb_dns_cache_get(struct flb_config *config, struct flb_dns_cache *cache,
+                      pthread_mutex_t *lock, char *host, int port,
+                      int family, struct flb_thread *th,
+                      struct mk_event_loop *evl, struct flb_dns_addr *addr)
+{
+    int ret;
+    int count;
+    time_t now;
+    struct flb_dns_addr *addrs;
+
+    now = time(NULL);
+
+    pthread_mutex_lock(lock);
+    if (cache->count > 0 && now < cache->expire) {
+        *addr = cache->addrs[cache->next++ % cache->count];
+        pthread_mutex_unlock(lock);
+        return 0;
+    }
+    pthread_mutex_unlock(lock);
+
+    /* The lock is not held while the co-routine waits for the resolver */
+    ret = flb_dns_resolve(config, host, port, family, th, evl,
+                          &addrs, &count);
+
+    pthread_mutex_lock(lock);
+    if (ret == 0) {
+        flb_free(cache->addrs);
+        cache->addrs = addrs;
+        cache->count = count;
+        cache->expire = now + config->dns_cache_ttl;
+        flb_debug("[dns] host '%s' resolved to %i address(es)", host, count);
+    }
+    else if (cache->count > 0) {
+        flb_debug("[dns] using expired addresses of host '%s'", host);
+    }
+    else {
+        pthread_mutex_unlock(lock);
+        return -1;
+    }
+    *addr = cache->addrs[cache->next++ % cache->count];
+    pthread_mutex_unlock(lock);
+
+    return 0;
+}
+
+void flb_dns_cache_destroy(struct flb_dns_cache *cache)
+{
+    flb_free(cache->addrs);
+    cache->addrs = NULL;
+    cache->count = 0;
+    cache->expire = 0;
+}
+
+/* Stop the resolvers, lookups still queued are dropped */
+void flb_dns_exit(struct flb_config *config)
+{
+    int i;
+    struct flb_dns *pool;
+
+    pthread_mutex_lock(&dns_pool_lock);
+    pool = config->dns_ctx;
+    config->dns_ctx = NULL;
+    pthread_mutex_unlock(&dns_pool_lock);
+
+    if (!pool) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = FLB_TRUE;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->workers; i++) {
+        pthread_join(pool->tids[i], NULL);
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->cond);
+    flb_free(pool->tids);
+    flb_free(pool);
+}
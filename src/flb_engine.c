@@ -19,6 +19,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <monkey/mk_core.h>
 #include <fluent-bit/flb_info.h>
@@ -32,29 +33,61 @@
 #include <fluent-bit/flb_utils.h>
 #include <fluent-bit/flb_config.h>
 #include <fluent-bit/flb_engine.h>
+#include <fluent-bit/flb_mem_pool.h>
+#include <fluent-bit/flb_engine_shard.h>
 #include <fluent-bit/flb_engine_dispatch.h>
 #include <fluent-bit/flb_task.h>
+#include <fluent-bit/flb_probes.h>
 #include <fluent-bit/flb_router.h>
 #include <fluent-bit/flb_http_server.h>
 #include <fluent-bit/flb_buffer.h>
 #include <fluent-bit/flb_buffer_qchunk.h>
 #include <fluent-bit/flb_scheduler.h>
+#include <fluent-bit/flb_upstream.h>
 #include <fluent-bit/flb_parser.h>
 #include <fluent-bit/flb_sosreport.h>
 #include <fluent-bit/flb_http_server.h>
+#include <fluent-bit/flb_output_worker.h>
+#include <fluent-bit/flb_compress.h>
+#include <fluent-bit/flb_dns.h>
+#include <fluent-bit/flb_worker.h>
+#include <fluent-bit/flb_filter_pool.h>
+#include <fluent-bit/flb_thread_storage.h>
+#include <fluent-bit/flb_reload.h>
+#include <fluent-bit/flb_sp.h>
 
 #ifdef FLB_HAVE_METRICS
-#include <fluent-bit/flb_metrics_exporter.h>
+#include <fluent-bit/flb_task_trace.h>
 #endif
 
 #ifdef FLB_HAVE_BUFFERING
 #include <fluent-bit/flb_buffer_chunk.h>
+#include <sys/mman.h>
 #endif
 
 #ifdef FLB_HAVE_STATS
 #include <fluent-bit/flb_stats.h>
+#include <fluent-bit/flb_time.h>
 #endif
 
+/* Event loop of the running thread: engine or output worker */
+FLB_TLS_DEFINE(struct mk_event_loop, flb_engine_evl);
+
+void flb_engine_evl_init()
+{
+    FLB_TLS_INIT(flb_engine_evl);
+}
+
+void flb_engine_evl_set(struct mk_event_loop *evl)
+{
+    FLB_TLS_SET(flb_engine_evl, evl);
+}
+
+struct mk_event_loop *flb_engine_evl_get()
+{
+    return FLB_TLS_GET(flb_engine_evl);
+}
+
 int flb_engine_destroy_tasks(struct mk_list *tasks)
 {
     int c = 0;
@@ -74,41 +107,174 @@ int flb_engine_destroy_tasks(struct mk_list *tasks)
 int flb_engine_flush(struct flb_config *config,
                      struct flb_input_plugin *in_force)
 {
+    int priority;
     struct flb_input_instance *in;
     struct flb_input_plugin *p;
     struct mk_list *head;
 
-    mk_list_foreach(head, &config->inputs) {
-        in = mk_list_entry(head, struct flb_input_instance, _head);
-        p = in->p;
+    /* Higher priority classes take the free flush slots first */
+    for (priority = FLB_PRIORITY_HIGH; priority >= FLB_PRIORITY_LOW;
+         priority--) {
+        mk_list_foreach(head, &config->inputs) {
+            in = mk_list_entry(head, struct flb_input_instance, _head);
+            p = in->p;
 
-        if (in_force != NULL && p != in_force) {
-            continue;
+            if (in->priority != priority ||
+                (in_force != NULL && p != in_force)) {
+                continue;
+            }
+            flb_engine_dispatch(0, in, config);
         }
-        flb_engine_dispatch(0, in, config);
     }
 
     return 0;
 }
 
-static inline int flb_engine_manager(flb_pipefd_t fd, struct flb_config *config)
+/* Flush the pending tasks of an output instance with its own interval */
+static void cb_engine_output_flush(struct flb_config *config, void *data)
+{
+    int ret;
+    struct flb_output_instance *o_ins = data;
+
+    flb_engine_dispatch_pending(o_ins, config);
+    if (config->is_running == FLB_FALSE) {
+        return;
+    }
+
+    ret = flb_sched_timer_cb_create(config, o_ins->flush * 1000,
+                                    cb_engine_output_flush, o_ins);
+    if (ret == -1) {
+        flb_error("[engine] cannot schedule flush for %s", o_ins->name);
+    }
+}
+
+/* Start the flush timer of an output instance with its own interval */
+int flb_engine_output_flush_timer(struct flb_output_instance *o_ins,
+                                  struct flb_config *config)
+{
+    int ret;
+
+    if (o_ins->flush <= 0) {
+        return 0;
+    }
+
+    ret = flb_sched_timer_cb_create(config, o_ins->flush * 1000,
+                                    cb_engine_output_flush, o_ins);
+    if (ret == -1) {
+        flb_error("[engine] cannot schedule flush for %s", o_ins->name);
+        return -1;
+    }
+    flb_debug("[engine] %s flush every %i seconds",
+              o_ins->name, o_ins->flush);
+
+    return 0;
+}
+
+/* Start the flush timers of output instances with their own interval */
+static int flb_engine_output_flush_start(struct flb_config *config)
+{
+    int ret;
+    struct mk_list *head;
+    struct flb_output_instance *o_ins;
+
+    mk_list_foreach(head, &config->outputs) {
+        o_ins = mk_list_entry(head, struct flb_output_instance, _head);
+        ret = flb_engine_output_flush_timer(o_ins, config);
+        if (ret == -1) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Flush the pending tasks of all output instances */
+static void flb_engine_output_flush_pending(struct flb_config *config)
+{
+    struct mk_list *head;
+    struct flb_output_instance *o_ins;
+
+    mk_list_foreach(head, &config->outputs) {
+        o_ins = mk_list_entry(head, struct flb_output_instance, _head);
+        flb_engine_dispatch_pending(o_ins, config);
+        flb_engine_dispatch_coalesced(o_ins, config);
+    }
+
+    /* Retired by a reload, their tasks are still flushed */
+    mk_list_foreach(head, &config->outputs_retired) {
+        o_ins = mk_list_entry(head, struct flb_output_instance, _head);
+        flb_engine_dispatch_pending(o_ins, config);
+        flb_engine_dispatch_coalesced(o_ins, config);
+    }
+}
+
+/*
+ * The other tasks of a coalesced flush: each one takes the result of its
+ * chunk and releases the reference the flush held.
+ */
+static void flb_engine_task_batch_return(struct flb_output_thread *out_th,
+                                         struct flb_config *config)
+{
+    int i;
+    int task_ret;
+    int retry_seconds;
+    struct flb_task *task;
+    struct flb_task_retry *retry;
+    struct flb_output_instance *o_ins = out_th->o_ins;
+
+    for (i = 1; i < out_th->chunks_num; i++) {
+        task = out_th->tasks[i];
+        task_ret = out_th->chunks[i].ret;
+        task->users--;
+
+        if (task_ret == FLB_OK) {
+            flb_task_retry_clean(task, out_th->parent);
+        }
+        else if (task_ret == FLB_RETRY) {
+            retry = flb_task_retry_create(task, out_th);
+            if (!retry) {
+#ifdef FLB_HAVE_METRICS
+                flb_metrics_sum(FLB_METRIC_OUT_RETRY_FAILED, 1,
+                                o_ins->metrics);
+#endif
+                flb_warn("[engine] Task cannot be retried: "
+                         "task_id=%i output=%s", task->id, o_ins->name);
+            }
+            else {
+#ifdef FLB_HAVE_METRICS
+                flb_metrics_sum(FLB_METRIC_OUT_RETRY, 1, o_ins->metrics);
+#endif
+                retry_seconds = flb_sched_request_create(config, retry,
+                                                         retry->attemps);
+                if (retry_seconds == -1) {
+                    flb_warn("[sched] retry for task %i could not be "
+                             "scheduled", task->id);
+                    flb_task_retry_destroy(retry);
+                }
+                else {
+                    flb_debug("[sched] retry=%p %i in %i seconds",
+                              retry, task->id, retry_seconds);
+                }
+            }
+        }
+
+        if (task->users == 0 && mk_list_size(&task->retries) == 0) {
+            flb_task_destroy(task);
+        }
+    }
+}
+
+static int flb_engine_manager_event(uint64_t val, struct flb_config *config)
 {
     int ret;
-    int bytes;
     int task_id;
     int thread_id;
     int retry_seconds;
     uint32_t type;
     uint32_t key;
-    uint64_t val;
     struct flb_task *task;
     struct flb_output_thread *out_th;
-
-    bytes = flb_pipe_r(fd, &val, sizeof(val));
-    if (bytes == -1) {
-        flb_errno();
-        return -1;
-    }
+    struct flb_output_instance *o_ins;
 
     /* Get type and key */
     type = FLB_BITS_U64_HIGH(val);
@@ -117,15 +283,12 @@ static inline int flb_engine_manager(flb_pipefd_t fd, struct flb_config *config)
     /* Flush all remaining data */
     if (type == 1) {                  /* Engine type */
         if (key == FLB_ENGINE_STOP) {
-            flb_trace("[engine] flush enqueued data");
-            flb_engine_flush(config, NULL);
-#ifdef FLB_HAVE_BUFFERING
-            if (config->buffer_ctx) {
-                flb_buffer_stop(config->buffer_ctx);
-            }
-#endif
+            /* the shutdown sequence flushes the enqueued data */
             return FLB_ENGINE_STOP;
         }
+        else if (key == FLB_ENGINE_RELOAD) {
+            flb_reload(config);
+        }
     }
     else if (type == FLB_ENGINE_IN_THREAD) {
         /* Event coming from an input thread */
@@ -160,6 +323,16 @@ static inline int flb_engine_manager(flb_pipefd_t fd, struct flb_config *config)
 
         task   = config->tasks_map[task_id].task;
         out_th = flb_output_thread_get(thread_id, task);
+        o_ins  = out_th->o_ins;
+
+        /* Tune the coalesced batches with the flush latency */
+        flb_output_coalesce_update(o_ins, ret, out_th->start,
+                                   out_th->latency);
+
+        /* Tasks flushed along with this one */
+        if (out_th->chunks) {
+            flb_engine_task_batch_return(out_th, config);
+        }
 
         /* A thread has finished, delete it */
         if (ret == FLB_OK) {
@@ -206,6 +379,8 @@ static inline int flb_engine_manager(flb_pipefd_t fd, struct flb_config *config)
                     flb_task_destroy(task);
                 }
 
+                flb_output_circuit_update(o_ins, ret, config);
+                flb_engine_dispatch_backlog(o_ins, config);
                 return 0;
             }
 
@@ -236,6 +411,26 @@ static inline int flb_engine_manager(flb_pipefd_t fd, struct flb_config *config)
             else {
                 flb_debug("[sched] retry=%p %i in %i seconds",
                           retry, task->id, retry_seconds);
+                FLB_PROBE4(retry_schedule, o_ins->name, task->id,
+                           retry->attemps, retry_seconds);
+#ifdef FLB_HAVE_METRICS
+                flb_metrics_observe(FLB_METRIC_OUT_RETRY_WAIT,
+                                    retry_seconds * 1000000ULL,
+                                    o_ins->metrics);
+                if (task->trace) {
+                    flb_task_trace_event(task->trace, FLB_TASK_TRACE_RETRY,
+                                         o_ins->name, retry->attemps,
+                                         retry_seconds * 1000000ULL);
+                }
+#endif
+#ifdef FLB_HAVE_BUFFERING
+                /* Keep the retry state with the buffered chunk */
+                if (config->buffer_ctx) {
+                    flb_buffer_chunk_retry(config->buffer_ctx, task, o_ins,
+                                           retry->attemps,
+                                           time(NULL) + retry_seconds);
+                }
+#endif
             }
         }
         else if (ret == FLB_ERROR) {
@@ -244,6 +439,10 @@ static inline int flb_engine_manager(flb_pipefd_t fd, struct flb_config *config)
                 flb_task_destroy(task);
             }
         }
+
+        /* A flush slot is free, start waiting backlog flushes */
+        flb_output_circuit_update(o_ins, ret, config);
+        flb_engine_dispatch_backlog(o_ins, config);
     }
 #ifdef FLB_HAVE_BUFFERING
     else if (type == FLB_ENGINE_BUFFER) {
@@ -259,6 +458,65 @@ static inline int flb_engine_manager(flb_pipefd_t fd, struct flb_config *config)
     return 0;
 }
 
+/* Event written to the manager pipe */
+static inline int flb_engine_manager(flb_pipefd_t fd, struct flb_config *config)
+{
+    int bytes;
+    uint64_t val;
+
+    bytes = flb_pipe_r(fd, &val, sizeof(val));
+    if (bytes == -1) {
+        flb_errno();
+        return -1;
+    }
+
+    return flb_engine_manager_event(val, config);
+}
+
+/*
+ * Events queued in the engine channel: the doorbell is consumed once and
+ * the queue drained in batches. A stop request is handled in order but the
+ * events behind it are still processed before reporting it. To not starve
+ * the rest of the loop, one wake up handles at most the queue size, if
+ * more events are left the doorbell is rung again.
+ */
+static inline int flb_engine_manager_queue(struct flb_engine_channel *ch,
+                                           struct flb_config *config)
+{
+    int i;
+    int n;
+    int ret;
+    int stop = FLB_FALSE;
+    uint32_t total = 0;
+    uint64_t vals[FLB_ENGINE_CHANNEL_BATCH];
+
+    flb_engine_channel_ack(ch);
+
+    while (total <= ch->mask) {
+        n = flb_engine_channel_pop(ch, vals, FLB_ENGINE_CHANNEL_BATCH);
+        for (i = 0; i < n; i++) {
+            ret = flb_engine_manager_event(vals[i], config);
+            if (ret == FLB_ENGINE_STOP) {
+                stop = FLB_TRUE;
+            }
+        }
+        total += n;
+
+        if (n < FLB_ENGINE_CHANNEL_BATCH) {
+            break;
+        }
+    }
+
+    if (total > ch->mask) {
+        flb_engine_channel_wake(ch);
+    }
+
+    if (stop == FLB_TRUE) {
+        return FLB_ENGINE_STOP;
+    }
+    return 0;
+}
+
 static FLB_INLINE int flb_engine_handle_event(flb_pipefd_t fd, int mask,
                                               struct flb_config *config)
 {
@@ -268,6 +526,7 @@ static FLB_INLINE int flb_engine_handle_event(flb_pipefd_t fd, int mask,
         /* Check if we need to flush */
         if (config->flush_fd == fd) {
             flb_utils_timer_consume(fd);
+            config->engine_heartbeat = time(NULL);
             flb_engine_flush(config, NULL);
 #ifdef FLB_HAVE_BUFFERING
             /*
@@ -285,26 +544,33 @@ static FLB_INLINE int flb_engine_handle_event(flb_pipefd_t fd, int mask,
             flb_utils_pipe_byte_consume(fd);
             return FLB_ENGINE_SHUTDOWN;
         }
+#ifdef FLB_HAVE_STATS
+        else if (config->stats_ctx && config->stats_ctx->timer_fd == fd) {
+            flb_utils_timer_consume(fd);
+            flb_stats_collect(config);
+            return 0;
+        }
+#endif
         else if (config->ch_manager[0] == fd) {
             ret = flb_engine_manager(fd, config);
             if (ret == FLB_ENGINE_STOP) {
                 return FLB_ENGINE_STOP;
             }
         }
+        else if (config->ch_engine &&
+                 config->ch_engine->doorbell[0] == fd) {
+            ret = flb_engine_manager_queue(config->ch_engine, config);
+            if (ret == FLB_ENGINE_STOP) {
+                return FLB_ENGINE_STOP;
+            }
+            return 0;
+        }
 
         /* Try to match the file descriptor with a collector event */
         ret = flb_input_collector_fd(fd, config);
         if (ret != -1) {
             return ret;
         }
-
-        /* Metrics exporter event ? */
-#ifdef FLB_HAVE_METRICS
-        ret = flb_me_fd_event(fd, config->metrics);
-        if (ret != -1) {
-            return ret;
-        }
-#endif
     }
 
     return 0;
@@ -370,11 +636,267 @@ static int flb_engine_log_start(struct flb_config *config)
     return 0;
 }
 
+/* Startup and shutdown phases, reported once they complete */
+struct engine_phase {
+    char *name;
+    uint64_t usec;
+};
+
+#define ENGINE_PHASES 8
+
+struct engine_phases {
+    int count;
+    uint64_t start;
+    uint64_t last;
+    struct engine_phase phases[ENGINE_PHASES];
+};
+
+static void phases_init(struct engine_phases *st)
+{
+    memset(st, 0, sizeof(struct engine_phases));
+    st->start = flb_time_usec();
+    st->last = st->start;
+}
+
+static void phases_mark(struct engine_phases *st, char *name)
+{
+    uint64_t now;
+
+    now = flb_time_usec();
+    if (st->count < ENGINE_PHASES) {
+        st->phases[st->count].name = name;
+        st->phases[st->count].usec = now - st->last;
+        st->count++;
+    }
+    st->last = now;
+}
+
+static void phases_report(struct engine_phases *st, char *what, char *extra)
+{
+    int i;
+    int len = 0;
+    char buf[512];
+
+    buf[0] = '\0';
+    for (i = 0; i < st->count && len < (int) sizeof(buf); i++) {
+        len += snprintf(buf + len, sizeof(buf) - len, "%s%s %.1f ms",
+                        i > 0 ? ", " : "", st->phases[i].name,
+                        st->phases[i].usec / 1000.0);
+    }
+    flb_info("[engine] %s in %.1f ms: %s%s", what,
+             (st->last - st->start) / 1000.0, buf, extra ? extra : "");
+}
+
+/*
+ * Shutdown sequence: the inputs are paused, then every output flushes what
+ * is left at the same time, pending retries included. The service stops
+ * as soon as no task is left or when the 'Grace' period expires; shortly
+ * before that, the chunks not delivered yet are spilled to the filesystem
+ * buffer so the next run sends them.
+ */
+#define ENGINE_DRAIN_TICK     100        /* milliseconds between checks  */
+#define ENGINE_SPILL_MARGIN   1000000    /* spill 1 second before the end */
+
+struct engine_drain {
+    struct engine_phases phases;
+    uint64_t spill_at;          /* usec */
+    uint64_t deadline;          /* usec */
+    int spilled;                /* spill phase done ? */
+};
+
+/*
+ * Number of tasks not completed yet, the size of their chunks and how many
+ * of them are stored in the filesystem buffer.
+ */
+static int engine_tasks_pending(struct flb_config *config, size_t *bytes,
+                                int *stored)
+{
+    int n = 0;
+    struct mk_list *head;
+    struct mk_list *t_head;
+    struct flb_task *task;
+    struct flb_input_instance *i_ins;
+
+    *bytes = 0;
+    *stored = 0;
+    mk_list_foreach(head, &config->inputs) {
+        i_ins = mk_list_entry(head, struct flb_input_instance, _head);
+        mk_list_foreach(t_head, &i_ins->tasks) {
+            task = mk_list_entry(t_head, struct flb_task, _head);
+            *bytes += task->size;
+#ifdef FLB_HAVE_BUFFERING
+            if (config->buffer_ctx && task->fs_routes != 0) {
+                (*stored)++;
+            }
+#endif
+            n++;
+        }
+    }
+
+    return n;
+}
+
+#ifdef FLB_HAVE_BUFFERING
+/*
+ * Store the chunk of a task that is not in the buffer yet (e.g: it was
+ * over the quota when the task was created). The task keeps its own copy,
+ * the chunk is deleted if the task is delivered before the service stops.
+ */
+static int engine_spill_task(struct flb_config *config, struct flb_task *task)
+{
+    int worker_id;
+    void *map;
+    uint64_t routes = 0;
+    uint64_t stored;
+    struct mk_list *head;
+    struct flb_task_route *route;
+
+    mk_list_foreach(head, &task->routes) {
+        route = mk_list_entry(head, struct flb_task_route, _head);
+        routes |= route->out->mask_id;
+    }
+    if (routes == 0 || !task->buf) {
+        return -1;
+    }
+
+    flb_buffer_chunk_id(task->buf, task->size, task->hash_hex);
+    worker_id = flb_buffer_chunk_push(config->buffer_ctx, task->buf,
+                                      task->size, task->tag, routes,
+                                      task->hash_hex, &map, &stored);
+    if (worker_id == -1 || stored == 0) {
+        return -1;
+    }
+    if (map) {
+        munmap(map, task->size);
+    }
+
+    task->worker_id = worker_id;
+    task->fs_routes = stored;
+    return 0;
+}
+#endif
+
+/* Store the pending tasks missing in the filesystem buffer */
+static void engine_spill(struct flb_config *config)
+{
+#ifdef FLB_HAVE_BUFFERING
+    struct mk_list *head;
+    struct mk_list *t_head;
+    struct flb_task *task;
+    struct flb_input_instance *i_ins;
+
+    if (!config->buffer_ctx) {
+        return;
+    }
+
+    mk_list_foreach(head, &config->inputs) {
+        i_ins = mk_list_entry(head, struct flb_input_instance, _head);
+        mk_list_foreach(t_head, &i_ins->tasks) {
+            task = mk_list_entry(t_head, struct flb_task, _head);
+            if (task->fs_routes == 0 &&
+                engine_spill_task(config, task) == -1) {
+                flb_warn("[engine] task %i could not be spilled", task->id);
+            }
+        }
+    }
+#endif
+}
+
+static void engine_drain_start(struct flb_config *config,
+                               struct engine_drain *dr)
+{
+    int tasks;
+    int stored;
+    int retries;
+    uint64_t grace;
+    uint64_t margin;
+    size_t bytes;
+    struct mk_event *event;
+
+    memset(dr, 0, sizeof(struct engine_drain));
+    phases_init(&dr->phases);
+
+    flb_input_pause_all(config);
+    phases_mark(&dr->phases, "pause");
+
+    /* Flush everything, retries do not wait for their backoff */
+    flb_engine_flush(config, NULL);
+    flb_engine_output_flush_pending(config);
+    retries = flb_sched_request_expedite(config);
+
+    grace = (uint64_t) (config->grace > 0 ? config->grace : 0) * 1000000;
+    margin = grace / 5;
+    if (margin > ENGINE_SPILL_MARGIN) {
+        margin = ENGINE_SPILL_MARGIN;
+    }
+    dr->deadline = dr->phases.start + grace;
+    dr->spill_at = dr->deadline - margin;
+
+    tasks = engine_tasks_pending(config, &bytes, &stored);
+    flb_info("[engine] draining %i tasks (%lu bytes, %i retries), "
+             "grace period %i seconds", tasks, bytes, retries, config->grace);
+
+    event = &config->event_shutdown;
+    event->mask = MK_EVENT_EMPTY;
+    event->status = MK_EVENT_NONE;
+    config->shutdown_fd = mk_event_timeout_create(config->evl, 0,
+                                                  ENGINE_DRAIN_TICK * 1000000,
+                                                  event);
+}
+
+/* Check the drain progress, it returns FLB_TRUE when the service can stop */
+static int engine_drain_check(struct flb_config *config,
+                              struct engine_drain *dr)
+{
+    int tasks;
+    int stored;
+    size_t bytes;
+    uint64_t now;
+    char extra[128];
+
+    now = flb_time_usec();
+    tasks = engine_tasks_pending(config, &bytes, &stored);
+
+    if (tasks > 0 && dr->spilled == FLB_FALSE && now >= dr->spill_at) {
+        phases_mark(&dr->phases, "flush");
+        engine_spill(config);
+        phases_mark(&dr->phases, "spill");
+        dr->spilled = FLB_TRUE;
+        tasks = engine_tasks_pending(config, &bytes, &stored);
+    }
+
+    if (tasks > 0 && now < dr->deadline) {
+        return FLB_FALSE;
+    }
+
+    phases_mark(&dr->phases, dr->spilled ? "wait" : "flush");
+    snprintf(extra, sizeof(extra), "; %i tasks left (%lu bytes), %i spilled",
+             tasks, bytes, stored);
+    phases_report(&dr->phases, "shutdown", extra);
+
+    if (tasks > stored) {
+        flb_warn("[engine] grace period expired, %i tasks not delivered "
+                 "nor stored in the filesystem buffer are lost",
+                 tasks - stored);
+    }
+
+    return FLB_TRUE;
+}
+
 int flb_engine_start(struct flb_config *config)
 {
     int ret;
     struct mk_event *event;
     struct mk_event_loop *evl;
+    struct engine_phases startup;
+    struct engine_drain drain;
+
+    phases_init(&startup);
+
+    /* The engine thread runs on the service CPUs, as its workers do */
+    if (config->cpu_affinity) {
+        flb_worker_cpus_apply(config->cpu_affinity);
+    }
 
     /* HTTP Server */
 #ifdef FLB_HAVE_HTTP
@@ -383,14 +905,30 @@ int flb_engine_start(struct flb_config *config)
     }
 #endif
 
-    /* Start the Logging service */
-    ret = flb_engine_log_start(config);
-    if (ret == -1) {
-        return -1;
+    /* A shard runs with the log and the threads setup of the main engine */
+    if (config->shard_parent) {
+        flb_info("[engine] shard %i started", config->shard_id);
+    }
+    else {
+        /* Start the Logging service */
+        ret = flb_engine_log_start(config);
+        if (ret == -1) {
+            return -1;
+        }
+
+        flb_info("[engine] started (pid=%i)", getpid());
+        flb_thread_prepare();
     }
 
-    flb_info("[engine] started (pid=%i)", getpid());
-    flb_thread_prepare();
+    /* Chunk and flush buffers are carved from the memory pool */
+    if (config->mem_pool > 0) {
+        ret = flb_mem_pool_create(config->mem_pool,
+                                  config->mem_pool_hugepages);
+        if (ret == -1) {
+            config->mem_pool = 0;
+            return -1;
+        }
+    }
 
     /* Create the event loop and set it in the global configuration */
     evl = mk_event_loop_create(256);
@@ -398,6 +936,10 @@ int flb_engine_start(struct flb_config *config)
         return -1;
     }
     config->evl = evl;
+    if (!config->shard_parent) {
+        flb_engine_evl_init();
+    }
+    flb_engine_evl_set(evl);
 
     /*
      * Create a communication channel: this routine creates a channel to
@@ -413,11 +955,36 @@ int flb_engine_start(struct flb_config *config)
         return -1;
     }
 
+    /* Manager events are queued and drained in batches */
+    config->ch_engine = flb_engine_channel_create(config->evl,
+                                                  FLB_ENGINE_CHANNEL_SIZE);
+    if (!config->ch_engine) {
+        flb_error("[engine] could not create the engine channel");
+        return -1;
+    }
+
+    /* Once the inputs append records they are filtered by the pool */
+    ret = flb_filter_pool_create(config);
+    if (ret == -1) {
+        flb_error("[engine] could not start the filters pool");
+        return -1;
+    }
+
+    /* Inputs of other shards are moved to them before their init */
+    ret = flb_engine_shards_create(config);
+    if (ret == -1) {
+        flb_error("[engine] could not create the engine shards");
+        return -1;
+    }
+
+    phases_mark(&startup, "engine");
+
     /* Initialize input plugins */
     flb_input_initialize_all(config);
 
     /* Inputs pre-run */
     flb_input_pre_run_all(config);
+    phases_mark(&startup, "inputs");
 
     /* Initialize output plugins */
     ret = flb_output_init(config);
@@ -427,9 +994,32 @@ int flb_engine_start(struct flb_config *config)
 
     /* Outputs pre-run */
     flb_output_pre_run(config);
+    phases_mark(&startup, "outputs");
+
+    /* Initialize the scheduler, filters can register timers on init */
+    ret = flb_sched_init(config);
+    if (ret == -1) {
+        flb_error("[engine] scheduler could not start");
+        return -1;
+    }
+
+    /* Upstreams keeping warm connections, it uses a scheduler timer */
+    ret = flb_upstream_warm_start(config);
+    if (ret == -1) {
+        flb_warn("[engine] upstream connections warm-up disabled");
+    }
 
     /* Initialize filter plugins */
     flb_filter_initialize_all(config);
+    phases_mark(&startup, "filters");
+
+#ifdef FLB_HAVE_STREAM_PROCESSOR
+    /* Windows of the stream processor tasks */
+    ret = flb_sp_start(config);
+    if (ret == -1) {
+        return -1;
+    }
+#endif
 
     /* Create and register the timer fd for flush procedure */
     event = &config->event_flush;
@@ -440,17 +1030,27 @@ int flb_engine_start(struct flb_config *config)
     if (config->flush_fd == -1) {
         flb_utils_error(FLB_ERR_CFG_FLUSH_CREATE);
     }
+    config->engine_heartbeat = time(NULL);
 
-    /* Initialize the scheduler */
-    ret = flb_sched_init(config);
+    /* Outputs with their own flush interval */
+    ret = flb_engine_output_flush_start(config);
     if (ret == -1) {
-        flb_error("[engine] scheduler could not start");
         return -1;
     }
 
     /* Initialize the stats interface (just if FLB_HAVE_STATS is defined) */
     flb_stats_init(config);
 
+    /* Hot reload of the configuration file (Hot_Reload) */
+    flb_reload_init(config);
+
+#ifdef FLB_HAVE_METRICS
+    /* Sampled task lifecycle traces */
+    if (config->task_trace > 0) {
+        config->task_traces = flb_task_traces_create(config->task_trace);
+    }
+#endif
+
     /* Initialize collectors */
     flb_input_collectors_start(config);
 
@@ -460,6 +1060,7 @@ int flb_engine_start(struct flb_config *config)
         flb_error("[engine] router failed");
         return -1;
     }
+    phases_mark(&startup, "collectors");
 
     /* Enable Buffering Support */
 #ifdef FLB_HAVE_BUFFERING
@@ -491,11 +1092,6 @@ int flb_engine_start(struct flb_config *config)
         exit(1);
     }
 
-    /* Initialize Metrics exporter */
-#ifdef FLB_HAVE_METRICS
-    config->metrics = flb_me_create(config);
-#endif
-
     /* Initialize HTTP Server */
 #ifdef FLB_HAVE_HTTP_SERVER
     if (config->http_server == FLB_TRUE) {
@@ -505,27 +1101,48 @@ int flb_engine_start(struct flb_config *config)
     }
 #endif
 
+    phases_mark(&startup, "services");
+
+    /* The other shards start once the main engine is ready */
+    ret = flb_engine_shards_start(config);
+    if (ret == -1) {
+        return -1;
+    }
+    if (config->shards_ctx) {
+        phases_mark(&startup, "shards");
+    }
+    phases_report(&startup, "startup", NULL);
+
     /* Signal that we have started */
-    flb_engine_started(config);
+    if (config->shard_parent) {
+        flb_engine_shard_ready(config, FLB_TRUE);
+    }
+    else {
+        flb_engine_started(config);
+    }
 
     while (1) {
         mk_event_wait(evl);
+        flb_time_loop_update();
         mk_event_foreach(event, evl) {
             if (event->type == FLB_ENGINE_EV_CORE) {
                 ret = flb_engine_handle_event(event->fd, event->mask, config);
                 if (ret == FLB_ENGINE_STOP) {
-                    /*
-                     * We are preparing to shutdown, we give a graceful time
-                     * of 5 seconds to process any pending event.
-                     */
-                    event = &config->event_shutdown;
-                    event->mask = MK_EVENT_EMPTY;
-                    event->status = MK_EVENT_NONE;
-                    config->shutdown_fd = mk_event_timeout_create(evl, 5, 0, event);
-
-                    flb_warn("[engine] service will stop in 5 seconds");
+                    /* Every shard drains its own tasks */
+                    flb_engine_shards_stop(config);
+                    if (config->shutdown_fd <= 0) {
+                        engine_drain_start(config, &drain);
+                    }
+                    else {
+                        /* stop requested again: spill and stop right away */
+                        drain.spill_at = 0;
+                        drain.deadline = 0;
+                    }
                 }
                 else if (ret == FLB_ENGINE_SHUTDOWN) {
+                    if (engine_drain_check(config, &drain) == FLB_FALSE) {
+                        continue;
+                    }
                     flb_info("[engine] service stopped");
                     if (config->shutdown_fd > 0) {
                         mk_event_timeout_destroy(config->evl,
@@ -564,10 +1181,30 @@ int flb_engine_start(struct flb_config *config)
 /* Release all resources associated to the engine */
 int flb_engine_shutdown(struct flb_config *config)
 {
+    int shard = (config->shard_parent != NULL);
+
+    /* Shards release their own resources, the main engine waits for them */
+    flb_engine_shards_exit(config);
+    flb_engine_shard_detach(config);
 
     config->is_running = FLB_FALSE;
     flb_input_pause_all(config);
 
+    /* Stop output workers before releasing the tasks they may reference */
+    flb_output_worker_exit(config);
+
+    /* No more background connections to the upstreams */
+    flb_upstream_warm_exit(config);
+
+    /* No flush can wait on the compression workers anymore */
+    flb_compress_exit(config);
+
+    /* Same for the resolver workers */
+    flb_dns_exit(config);
+
+    /* Filtered buffers go back to their tasks before these are released */
+    flb_filter_pool_exit(config);
+
 #ifdef FLB_HAVE_BUFFERING
     if (config->buffer_ctx) {
         flb_buffer_stop(config->buffer_ctx);
@@ -582,26 +1219,26 @@ int flb_engine_shutdown(struct flb_config *config)
     flb_parser_exit(config);
 #endif
 
-    /* cleanup plugins */
-    flb_filter_exit(config);
-    flb_input_exit_all(config);
-    flb_output_exit(config);
-
-    /* metrics */
-#ifdef FLB_HAVE_METRICS
-    if (config->metrics) {
-        flb_me_destroy(config->metrics);
-    }
-#endif
-
+    /* The HTTP server reads the plugins metrics, stop it first */
 #ifdef FLB_HAVE_HTTP_SERVER
     if (config->http_server == FLB_TRUE) {
         flb_hs_destroy(config->http_ctx);
     }
 #endif
 
+    /* cleanup plugins */
+    flb_filter_exit(config);
+    flb_input_exit_all(config);
+    flb_output_exit(config);
+
+    flb_engine_shards_destroy(config);
     flb_config_exit(config);
 
+    /* release cached co-routines stacks */
+    if (!shard) {
+        flb_thread_pool_exit();
+    }
+
     return 0;
 }
 
@@ -615,7 +1252,7 @@ int flb_engine_exit(struct flb_config *config)
     flb_input_pause_all(config);
 
     val = FLB_ENGINE_EV_STOP;
-    ret = flb_pipe_w(config->ch_manager[1], &val, sizeof(uint64_t));
+    ret = flb_engine_notify(config, val);
 
     return ret;
 }
@@ -0,0 +1,249 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include <monkey/mk_core.h>
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_log.h>
+#include <fluent-bit/flb_pipe.h>
+#include <fluent-bit/flb_config.h>
+#include <fluent-bit/flb_engine_channel.h>
+
+/*
+ * Bounded queue with a sequence number per cell: a cell is free for the
+ * producer reserving position 'pos' when its sequence is 'pos', and ready
+ * for the consumer once the producer stores 'pos + 1'. After popping it
+ * the consumer sets 'pos + size' so the cell is free for the next lap.
+ * Producers reserve positions with a compare and swap on 'head'.
+ */
+
+struct flb_engine_channel *flb_engine_channel_create(struct mk_event_loop *evl,
+                                                     uint32_t size)
+{
+    int ret;
+    uint32_t i;
+    uint32_t n = 1;
+    struct mk_event *event;
+    struct flb_engine_channel *ch;
+
+    if (size == 0 || size > (1U << 31)) {
+        return NULL;
+    }
+
+    /* Round up to a power of two */
+    while (n < size) {
+        n <<= 1;
+    }
+
+    ch = flb_calloc(1, sizeof(struct flb_engine_channel));
+    if (!ch) {
+        flb_errno();
+        return NULL;
+    }
+    ch->doorbell[0] = -1;
+    ch->doorbell[1] = -1;
+
+    ch->cells = flb_malloc(sizeof(struct flb_engine_channel_cell) * n);
+    if (!ch->cells) {
+        flb_errno();
+        flb_free(ch);
+        return NULL;
+    }
+    for (i = 0; i < n; i++) {
+        ch->cells[i].seq = i;
+    }
+    ch->mask = n - 1;
+
+#ifdef __linux__
+    ch->doorbell[0] = eventfd(0, EFD_CLOEXEC);
+    ch->doorbell[1] = ch->doorbell[0];
+    ret = ch->doorbell[0];
+#else
+    ret = flb_pipe_create(ch->doorbell);
+#endif
+    if (ret == -1) {
+        flb_errno();
+        flb_engine_channel_destroy(ch);
+        return NULL;
+    }
+
+    if (evl) {
+        event = &ch->event;
+        MK_EVENT_NEW(event);
+        ret = mk_event_add(evl, ch->doorbell[0],
+                           MK_EVENT_NOTIFICATION, MK_EVENT_READ, event);
+        if (ret != 0) {
+            flb_error("[engine] could not register the channel doorbell");
+            flb_engine_channel_destroy(ch);
+            return NULL;
+        }
+    }
+
+    return ch;
+}
+
+void flb_engine_channel_destroy(struct flb_engine_channel *ch)
+{
+    if (!ch) {
+        return;
+    }
+
+    if (ch->doorbell[0] != -1) {
+        close(ch->doorbell[0]);
+        if (ch->doorbell[1] != ch->doorbell[0]) {
+            close(ch->doorbell[1]);
+        }
+    }
+    flb_free(ch->cells);
+    flb_free(ch);
+}
+
+/* Producers: queue an event, it returns -1 if the queue is full */
+int flb_engine_channel_push(struct flb_engine_channel *ch, uint64_t val)
+{
+    int32_t dif;
+    uint32_t seq;
+    uint32_t pos;
+    struct flb_engine_channel_cell *cell;
+
+    pos = __atomic_load_n(&ch->head, __ATOMIC_RELAXED);
+    while (1) {
+        cell = &ch->cells[pos & ch->mask];
+        seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        dif = (int32_t) (seq - pos);
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&ch->head, &pos, pos + 1,
+                                            FLB_TRUE,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+                break;
+            }
+            /* 'pos' was reloaded by the failed compare and swap */
+        }
+        else if (dif < 0) {
+            return -1;
+        }
+        else {
+            pos = __atomic_load_n(&ch->head, __ATOMIC_RELAXED);
+        }
+    }
+
+    cell->val = val;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/*
+ * Wake up the consumer, the doorbell is rung only if it's not pending
+ * already: consecutive events share a single wake up.
+ */
+void flb_engine_channel_wake(struct flb_engine_channel *ch)
+{
+    int ret;
+    uint64_t val = 1;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    ret = __atomic_exchange_n(&ch->armed, FLB_TRUE, __ATOMIC_SEQ_CST);
+    if (ret == FLB_TRUE) {
+        return;
+    }
+
+    ret = flb_pipe_w(ch->doorbell[1], &val, sizeof(val));
+    if (ret == -1) {
+        flb_errno();
+    }
+}
+
+/*
+ * Consumer: take the doorbell before draining the queue. From now on the
+ * next producer rings it again, so an event queued after the last pop is
+ * never left behind.
+ */
+void flb_engine_channel_ack(struct flb_engine_channel *ch)
+{
+    int ret;
+    uint64_t val;
+
+    ret = flb_pipe_r(ch->doorbell[0], &val, sizeof(val));
+    if (ret == -1) {
+        flb_errno();
+    }
+
+    __atomic_store_n(&ch->armed, FLB_FALSE, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/* Consumer: pop up to 'max' events, it returns the number of events */
+int flb_engine_channel_pop(struct flb_engine_channel *ch,
+                           uint64_t *vals, int max)
+{
+    int n = 0;
+    uint32_t seq;
+    uint32_t pos;
+    struct flb_engine_channel_cell *cell;
+
+    pos = ch->tail;
+    while (n < max) {
+        cell = &ch->cells[pos & ch->mask];
+        seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        if (seq != pos + 1) {
+            /* empty, or the producer of this cell did not finish yet */
+            break;
+        }
+
+        vals[n++] = cell->val;
+        __atomic_store_n(&cell->seq, pos + ch->mask + 1, __ATOMIC_RELEASE);
+        pos++;
+    }
+    ch->tail = pos;
+
+    return n;
+}
+
+/*
+ * Notify the engine manager, it can be called from any thread. The return
+ * value follows flb_pipe_w(): the number of bytes of the event or -1.
+ */
+int flb_engine_notify(struct flb_config *config, uint64_t val)
+{
+    int ret;
+    struct flb_engine_channel *ch;
+
+    ch = config->ch_engine;
+    if (!ch) {
+        return flb_pipe_w(config->ch_manager[1], &val, sizeof(val));
+    }
+
+    ret = flb_engine_channel_push(ch, val);
+    if (ret == -1) {
+        /* Queue is full, the manager pipe keeps the event */
+        return flb_pipe_w(config->ch_manager[1], &val, sizeof(val));
+    }
+
+    flb_engine_channel_wake(ch);
+
+    return sizeof(val);
+}
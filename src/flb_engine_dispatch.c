@@ -25,17 +25,215 @@
 #include <fluent-bit/flb_router.h>
 #include <fluent-bit/flb_config.h>
 #include <fluent-bit/flb_thread.h>
+#include <fluent-bit/flb_probes.h>
 #include <fluent-bit/flb_engine.h>
+#include <fluent-bit/flb_scheduler.h>
 #include <fluent-bit/flb_task.h>
+#include <fluent-bit/flb_output_worker.h>
+#include <fluent-bit/flb_filter_pool.h>
+#include <fluent-bit/flb_sp.h>
 
 void flb_task_add_thread(struct flb_thread *thread,
                                 struct flb_task *task);
 
+/*
+ * Start the flush co-routine: it's resumed right away in the engine event
+ * loop unless the output instance runs its own workers. 'backlog' tells if
+ * it flushes a retry or a buffered chunk instead of fresh data.
+ */
+static inline void thread_start(struct flb_thread *th,
+                                struct flb_output_instance *o_ins,
+                                int backlog)
+{
+    int ret;
+    struct flb_output_thread *out_th;
+
+    out_th = (struct flb_output_thread *) FLB_THREAD_DATA(th);
+    out_th->backlog = backlog;
+    if (backlog == FLB_TRUE) {
+        o_ins->backlog_running++;
+        o_ins->live_credit = 0;
+    }
+    else {
+        o_ins->live_running++;
+        o_ins->live_credit++;
+    }
+
+    if (o_ins->workers > 0) {
+        ret = flb_output_worker_dispatch(o_ins, th);
+        if (ret == 0) {
+            return;
+        }
+        flb_warn("[engine] could not dispatch to %s workers", o_ins->name);
+    }
+
+    flb_thread_resume(th);
+}
+
+/* Is there a free flush slot under the instance 'max_inflight' ? */
+static inline int inflight_ready(struct flb_output_instance *o_ins)
+{
+    /* An open circuit has no slot, a half-open one only the probe */
+    if (o_ins->circuit_state == FLB_OUTPUT_CIRCUIT_OPEN) {
+        return FLB_FALSE;
+    }
+    else if (o_ins->circuit_state == FLB_OUTPUT_CIRCUIT_HALF_OPEN) {
+        return (o_ins->live_running + o_ins->backlog_running == 0);
+    }
+
+    if (o_ins->max_inflight <= 0) {
+        return FLB_TRUE;
+    }
+
+    return (o_ins->live_running + o_ins->backlog_running < o_ins->max_inflight);
+}
+
+static inline int inflight_queue_limit(struct flb_output_instance *o_ins)
+{
+    if (o_ins->max_inflight_queue > 0) {
+        return o_ins->max_inflight_queue;
+    }
+    else if (o_ins->max_inflight <= 0) {
+        /* No concurrency limit, only an open circuit queues routes */
+        return FLB_OUTPUT_CIRCUIT_QUEUE;
+    }
+
+    return o_ins->max_inflight * FLB_OUTPUT_INFLIGHT_QUEUE;
+}
+
+/* Priority class of the data of a route */
+static inline int route_priority(struct flb_task_route *route)
+{
+    if (!route->task->i_ins) {
+        return FLB_PRIORITY_NORMAL;
+    }
+    return route->task->i_ins->priority;
+}
+
+/*
+ * Make the route wait for a free flush slot of its output instance. Once
+ * the queue is full for the priority of the task its input instance stops
+ * ingesting, the caller holds a task reference for the route.
+ */
+static void inflight_queue_add(struct flb_task_route *route)
+{
+    int limit;
+    int priority;
+    struct flb_output_instance *o_ins = route->out;
+
+    priority = route_priority(route);
+    route->queued = FLB_TRUE;
+    flb_priority_queue_add(&o_ins->inflight_queue, &route->_head_pending,
+                           priority);
+
+    /* Low priority inputs stop at the half of the limit, high ones later */
+    limit = inflight_queue_limit(o_ins) * (priority + 1) / 2;
+    if (limit < 1) {
+        limit = 1;
+    }
+
+    if (o_ins->inflight_queue.count >= limit) {
+        if (o_ins->inflight_full == FLB_FALSE) {
+            flb_debug("[engine] %s inflight queue is full for %s priority "
+                      "(%i routes)", o_ins->name,
+                      flb_priority_name(priority), o_ins->inflight_queue.count);
+            o_ins->inflight_pause_at = limit;
+        }
+        else if (limit < o_ins->inflight_pause_at) {
+            o_ins->inflight_pause_at = limit;
+        }
+        o_ins->inflight_full = FLB_TRUE;
+        flb_input_queue_pause(route->task->i_ins);
+    }
+}
+
+/* Start the queued routes while the instance has free flush slots */
+static int inflight_queue_start(struct flb_output_instance *o_ins,
+                                struct flb_config *config)
+{
+    int c = 0;
+    struct mk_list *head;
+    struct flb_task *task;
+    struct flb_thread *th;
+    struct flb_task_route *route;
+
+    while (inflight_ready(o_ins) == FLB_TRUE &&
+           !flb_priority_queue_empty(&o_ins->inflight_queue)) {
+        head = flb_priority_queue_pop(&o_ins->inflight_queue);
+        route = mk_list_entry(head, struct flb_task_route, _head_pending);
+        route->queued = FLB_FALSE;
+
+        task = route->task;
+        th = flb_output_thread(task,
+                               task->i_ins,
+                               o_ins,
+                               config,
+                               task->buf, task->size,
+                               task->tag,
+                               task->tag_len);
+        /* The thread takes the reference of the queued route */
+        task->users--;
+
+        if (!th) {
+            if (task->users == 0 && mk_list_size(&task->retries) == 0) {
+                flb_task_destroy(task);
+            }
+            continue;
+        }
+
+        flb_task_add_thread(th, task);
+        thread_start(th, o_ins, FLB_FALSE);
+        c++;
+    }
+
+    /* Drained to the half, the inputs held by this queue can go on */
+    if (o_ins->inflight_full == FLB_TRUE &&
+        o_ins->inflight_queue.count <= o_ins->inflight_pause_at / 2) {
+        o_ins->inflight_full = FLB_FALSE;
+        flb_input_queue_resume(config);
+    }
+
+    return c;
+}
+
+/* Check if a backlog flush can start now for the output instance */
+static inline int backlog_ready(struct flb_output_instance *o_ins)
+{
+    if (inflight_ready(o_ins) == FLB_FALSE) {
+        return FLB_FALSE;
+    }
+
+    if (o_ins->backlog_max > 0 &&
+        o_ins->backlog_running >= o_ins->backlog_max) {
+        return FLB_FALSE;
+    }
+
+    if (o_ins->backlog_policy == FLB_OUTPUT_BACKLOG_LIVE_FIRST) {
+        return (o_ins->live_running == 0);
+    }
+    else if (o_ins->backlog_policy == FLB_OUTPUT_BACKLOG_WEIGHTED) {
+        return (o_ins->live_running == 0 ||
+                o_ins->live_credit >= o_ins->backlog_ratio);
+    }
+
+    return FLB_TRUE;
+}
+
+/* Backlog entries are started in order, new ones wait behind */
+static inline int backlog_waiting(struct flb_output_instance *o_ins)
+{
+    if (!flb_priority_queue_empty(&o_ins->backlog_routes) ||
+        mk_list_is_empty(&o_ins->backlog_retries) != 0) {
+        return FLB_TRUE;
+    }
+
+    return FLB_FALSE;
+}
+
 #if defined (FLB_HAVE_FLUSH_LIBCO)
 
-/* It creates a new output thread using a 'Retry' context */
-int flb_engine_dispatch_retry(struct flb_task_retry *retry,
-                              struct flb_config *config)
+static int retry_start(struct flb_task_retry *retry,
+                       struct flb_config *config)
 {
     struct flb_thread *th;
     struct flb_task *task;
@@ -50,19 +248,264 @@ int flb_engine_dispatch_retry(struct flb_task_retry *retry,
                            config,
                            task->buf, task->size,
                            task->tag,
-                           strlen(task->tag));
+                           task->tag_len);
     if (!th) {
         return -1;
     }
 
     flb_task_add_thread(th, task);
-    flb_thread_resume(th);
+    thread_start(th, retry->o_ins, FLB_TRUE);
+
+    return 0;
+}
+
+/* It creates a new output thread using a 'Retry' context */
+int flb_engine_dispatch_retry(struct flb_task_retry *retry,
+                              struct flb_config *config)
+{
+    struct flb_output_instance *o_ins = retry->o_ins;
+
+    if (backlog_waiting(o_ins) == FLB_TRUE ||
+        backlog_ready(o_ins) == FLB_FALSE) {
+        retry->backlog = FLB_TRUE;
+        mk_list_add(&retry->_head_backlog, &o_ins->backlog_retries);
+        return 0;
+    }
+
+    return retry_start(retry, config);
+}
+
+/* Waiting routes that should be flushed as soon as there is a free slot */
+static inline int coalesce_due(struct flb_output_instance *o_ins)
+{
+    if (o_ins->coalesce_count == 0) {
+        return FLB_FALSE;
+    }
+
+    return (o_ins->coalesce_timer == NULL ||
+            o_ins->coalesce_size >= o_ins->coalesce_max_size);
+}
+
+/* Start one flush with the first routes waiting to be coalesced */
+static int coalesce_start(struct flb_output_instance *o_ins,
+                          struct flb_config *config)
+{
+    int i;
+    int n;
+    struct flb_task *task;
+    struct flb_task *first;
+    struct flb_thread *th;
+    struct flb_task **tasks;
+    struct flb_task_route *route;
+    struct flb_output_chunk *chunks;
+
+    n = o_ins->coalesce_count;
+    if (n > FLB_OUTPUT_COALESCE_MAX) {
+        n = FLB_OUTPUT_COALESCE_MAX;
+    }
+
+    chunks = flb_malloc(sizeof(struct flb_output_chunk) * n);
+    if (!chunks) {
+        flb_errno();
+        return -1;
+    }
+    tasks = flb_malloc(sizeof(struct flb_task *) * n);
+    if (!tasks) {
+        flb_errno();
+        flb_free(chunks);
+        return -1;
+    }
+
+    for (i = 0; i < n; i++) {
+        route = mk_list_entry_first(&o_ins->coalesce,
+                                    struct flb_task_route, _head_pending);
+        mk_list_del(&route->_head_pending);
+        route->coalesced = FLB_FALSE;
+
+        task = route->task;
+        o_ins->coalesce_count--;
+        o_ins->coalesce_size -= task->size;
+
+        tasks[i] = task;
+        chunks[i].data    = task->buf;
+        chunks[i].bytes   = task->size;
+        chunks[i].tag     = task->tag;
+        chunks[i].tag_len = task->tag_len;
+        chunks[i].i_ins   = task->i_ins;
+        chunks[i].index   = NULL;
+        chunks[i].ret     = -1;
+        if (flb_chunk_index_valid(&task->index, task->size)) {
+            chunks[i].index = &task->index;
+        }
+    }
+
+    /* A single task does not need the multi flush */
+    first = tasks[0];
+    if (n == 1) {
+        flb_free(chunks);
+        flb_free(tasks);
+        th = flb_output_thread(first,
+                               first->i_ins,
+                               o_ins,
+                               config,
+                               first->buf, first->size,
+                               first->tag,
+                               first->tag_len);
+    }
+    else {
+        th = flb_output_thread_multi(tasks, chunks, n, o_ins, config);
+    }
+
+    /*
+     * The thread takes the reference of the first route, the flush keeps
+     * the others until it returns.
+     */
+    first->users--;
+
+    if (!th) {
+        /* With a single task the arrays are already released */
+        for (i = 1; i < n; i++) {
+            task = tasks[i];
+            task->users--;
+            if (task->users == 0 && mk_list_size(&task->retries) == 0) {
+                flb_task_destroy(task);
+            }
+        }
+        if (n > 1) {
+            flb_free(chunks);
+            flb_free(tasks);
+        }
+        if (first->users == 0 && mk_list_size(&first->retries) == 0) {
+            flb_task_destroy(first);
+        }
+        return -1;
+    }
+
+    flb_debug("[engine] %s coalesced flush of %i tasks", o_ins->name, n);
+    flb_task_add_thread(th, first);
+    thread_start(th, o_ins, FLB_FALSE);
 
     return 0;
 }
 
+/*
+ * Start the coalesced flushes of the task routes waiting for the output
+ * instance while it has free flush slots.
+ */
+int flb_engine_dispatch_coalesced(struct flb_output_instance *o_ins,
+                                  struct flb_config *config)
+{
+    int c = 0;
+
+    while (o_ins->coalesce_count > 0 && inflight_ready(o_ins) == FLB_TRUE) {
+        if (coalesce_start(o_ins, config) == -1) {
+            break;
+        }
+        c++;
+    }
+
+    return c;
+}
+
+/* The coalescing window of the output instance is over */
+static void cb_coalesce_window(struct flb_config *config, void *data)
+{
+    struct flb_output_instance *o_ins = data;
+
+    /* The scheduler releases the timer once the callback returns */
+    o_ins->coalesce_timer = NULL;
+    flb_engine_dispatch_coalesced(o_ins, config);
+}
+
+/*
+ * Make the route wait for a coalesced flush: it starts when the window
+ * armed by the first waiting route ends or once they reach the size.
+ */
+static void coalesce_add(struct flb_task_route *route,
+                         struct flb_config *config)
+{
+    struct flb_output_instance *o_ins = route->out;
+
+    route->coalesced = FLB_TRUE;
+    mk_list_add(&route->_head_pending, &o_ins->coalesce);
+    route->task->users++;
+    o_ins->coalesce_count++;
+    o_ins->coalesce_size += route->task->size;
+
+    if (o_ins->coalesce_size >= o_ins->coalesce_max_size ||
+        o_ins->coalesce_count >= FLB_OUTPUT_COALESCE_MAX) {
+        flb_engine_dispatch_coalesced(o_ins, config);
+        return;
+    }
+
+    if (o_ins->coalesce_timer) {
+        return;
+    }
+
+    o_ins->coalesce_timer = flb_sched_timer_cb_add(config,
+                                                   o_ins->coalesce_window,
+                                                   cb_coalesce_window, o_ins);
+    if (!o_ins->coalesce_timer) {
+        flb_error("[engine] cannot schedule coalesced flush for %s",
+                  o_ins->name);
+        flb_engine_dispatch_coalesced(o_ins, config);
+    }
+}
+
+/* Hand a new task to the filters pool, it's started once filtered */
+static inline void task_filter(struct flb_task *task, struct flb_config *config)
+{
+    int ret;
+
+    if (!config->filter_pool) {
+        return;
+    }
+
+    ret = flb_filter_pool_submit(task, config);
+    if (ret == 0) {
+        task->status = FLB_TASK_FILTERING;
+    }
+}
+
+/* Create a task for the buffer of a dyntag node */
+static struct flb_task *dyntag_task_create(uint64_t id,
+                                           struct flb_input_dyntag *dt,
+                                           struct flb_config *config)
+{
+    char *buf;
+    size_t size;
+    struct flb_task *task;
+
+    if (dt->busy == FLB_TRUE) {
+        return NULL;
+    }
+
+    /* There is a match, get the buffer */
+    buf = flb_input_dyntag_flush(dt, &size);
+    if (size == 0 || !buf) {
+        /*
+         * Nothing was appended, no task will ever take this dyntag so it's
+         * released now, otherwise it would stay busy until the instance
+         * exits. The buffer (if allocated) goes with it.
+         */
+        flb_input_dyntag_destroy(dt);
+        return NULL;
+    }
+
+    flb_trace("[dyntag %s] %p tag=%s", dt->in->name, dt, dt->tag);
+    FLB_PROBE3(engine_dispatch, dt->in->name, dt->tag, size);
+
+    /* Do not release the buffer on failure, will happen on dyntag destroy */
+    task = flb_task_create(id, buf, size, dt->in, dt, dt->tag, config);
+    if (task) {
+        task_filter(task, config);
+    }
+
+    return task;
+}
+
 static int tasks_start(struct flb_input_instance *in,
-                       struct flb_config *config)
+                       struct flb_config *config, int backlog)
 {
     struct mk_list *tmp;
     struct mk_list *head;
@@ -81,10 +524,58 @@ static int tasks_start(struct flb_input_instance *in,
         }
         task->status = FLB_TASK_RUNNING;
 
+#ifdef FLB_HAVE_STREAM_PROCESSOR
+        /*
+         * The stream processor sees every chunk once, after the filters.
+         * Chunks loaded from the buffer were already seen.
+         */
+        if (backlog == FLB_FALSE &&
+            mk_list_is_empty(&config->stream_tasks) != 0) {
+            flb_sp_do(config, in, task->tag, task->tag_len,
+                      task->buf, task->size);
+        }
+#endif
+
         /* A task contain one or more routes */
         mk_list_foreach(r_head, &task->routes) {
             route = mk_list_entry(r_head, struct flb_task_route, _head);
 
+            /* Outputs with their own flush interval take it later */
+            if (route->out->flush > 0 && config->is_running == FLB_TRUE) {
+                route->pending = FLB_TRUE;
+                mk_list_add(&route->_head_pending, &route->out->pending);
+                task->users++;
+                continue;
+            }
+
+            /* Fresh data of outputs that coalesce their flushes */
+            if (backlog == FLB_FALSE && route->out->coalesce_window > 0 &&
+                config->is_running == FLB_TRUE) {
+                coalesce_add(route, config);
+                continue;
+            }
+
+            /* Buffered chunks may have to wait in the output backlog */
+            if (backlog == FLB_TRUE &&
+                (backlog_waiting(route->out) == FLB_TRUE ||
+                 backlog_ready(route->out) == FLB_FALSE)) {
+                route->backlog = FLB_TRUE;
+                flb_priority_queue_add(&route->out->backlog_routes,
+                                       &route->_head_pending,
+                                       route_priority(route));
+                task->users++;
+                continue;
+            }
+
+            /* Over the instance concurrency limit, wait for a free slot */
+            if (backlog == FLB_FALSE &&
+                (inflight_ready(route->out) == FLB_FALSE ||
+                 !flb_priority_queue_empty(&route->out->inflight_queue))) {
+                inflight_queue_add(route);
+                task->users++;
+                continue;
+            }
+
             /*
              * We have the Task and the Route, created a thread context for the
              * data handling.
@@ -95,9 +586,9 @@ static int tasks_start(struct flb_input_instance *in,
                                    config,
                                    task->buf, task->size,
                                    task->tag,
-                                   strlen(task->tag));
+                                   task->tag_len);
             flb_task_add_thread(th, task);
-            flb_thread_resume(th);
+            thread_start(th, route->out, backlog);
         }
     }
 
@@ -124,36 +615,18 @@ int flb_engine_dispatch(uint64_t id, struct flb_input_instance *in,
         return 0;
     }
 
-    if (in->flags & FLB_INPUT_DYN_TAG) {
+    /* Records of a threaded instance are appended to dynamic tag buffers */
+    if ((in->flags & FLB_INPUT_DYN_TAG) || in->runner) {
         /* Iterate dynamic tag buffers */
         struct mk_list *d_head, *tmp;
         struct flb_input_dyntag *dt;
 
+        /* Records emitted by other threads join the buffers first */
+        flb_input_emit_flush(in);
+
         mk_list_foreach_safe(d_head, tmp, &in->dyntags) {
             dt = mk_list_entry(d_head, struct flb_input_dyntag, _head);
-            if (dt->busy == FLB_TRUE) {
-                continue;
-            }
-
-            /* There is a match, get the buffer */
-            buf = flb_input_dyntag_flush(dt, &size);
-            if (size == 0) {
-                /*
-                 * Do not release the buffer since if allocated, it will be
-                 * released upon input_dyntag context destroy.
-                 */
-                continue;
-            }
-            if (!buf) {
-                continue;
-            }
-
-            flb_trace("[dyntag %s] %p tag=%s", dt->in->name, dt, dt->tag);
-            task = flb_task_create(id, buf, size, dt->in, dt, dt->tag, config);
-            if (!task) {
-                /* Do not release the buffer, will happen on dyntag destroy */
-                continue;
-            }
+            dyntag_task_create(id, dt, config);
         }
     }
     else {
@@ -165,6 +638,7 @@ int flb_engine_dispatch(uint64_t id, struct flb_input_instance *in,
             }
             return 0;
         }
+        FLB_PROBE3(engine_dispatch, in->name, in->tag, size);
 
         /*
          * Create an engine task, the task will hold the buffer reference
@@ -174,26 +648,227 @@ int flb_engine_dispatch(uint64_t id, struct flb_input_instance *in,
         task = flb_task_create(id, buf, size, in, NULL, in->tag, config);
         if (!task) {
             flb_free(buf);
+            flb_chunk_index_reset(&in->mp_index);
             return -1;
         }
         flb_trace("[engine dispatch] task #%i created %p", task->id, task);
+        task_filter(task, config);
     }
 
     /* Start the new enqueued Tasks */
-    tasks_start(in, config);
+    tasks_start(in, config, FLB_FALSE);
+    return 0;
+}
+
+/* Is an older task of the same tag still in the filters pool ? */
+static int task_filtering_before(struct flb_input_instance *in,
+                                 struct flb_task *task)
+{
+    struct mk_list *head;
+    struct flb_task *prev;
+
+    mk_list_foreach(head, &in->tasks) {
+        prev = mk_list_entry(head, struct flb_task, _head);
+        if (prev == task) {
+            break;
+        }
+        if (prev->status == FLB_TASK_FILTERING && prev->itag == task->itag) {
+            return FLB_TRUE;
+        }
+    }
+
+    return FLB_FALSE;
+}
+
+/*
+ * Start the tasks of the input instance that the filters pool is done
+ * with. A task of a tag waits until the older ones of the same tag are
+ * released, so records of a tag reach the outputs in order.
+ */
+int flb_engine_dispatch_filtered(struct flb_input_instance *in,
+                                 struct flb_config *config)
+{
+    int c = 0;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct flb_task *task;
+
+    mk_list_foreach_safe(head, tmp, &in->tasks) {
+        task = mk_list_entry(head, struct flb_task, _head);
+        if (task->status != FLB_TASK_FILTERING ||
+            flb_filter_job_done(task->filter_job) == FLB_FALSE ||
+            task_filtering_before(in, task) == FLB_TRUE) {
+            continue;
+        }
+
+        flb_filter_pool_release(task);
+        task->status = FLB_TASK_NEW;
+
+        /* The filters dropped all the records */
+        if (task->size == 0) {
+            flb_task_destroy(task);
+            continue;
+        }
+        c++;
+    }
+
+    if (c > 0) {
+        tasks_start(in, config, FLB_FALSE);
+    }
+
+    return c;
+}
+
+/*
+ * Start the flush of the task routes waiting for the given output instance,
+ * used by outputs that set their own flush interval.
+ */
+int flb_engine_dispatch_pending(struct flb_output_instance *o_ins,
+                                struct flb_config *config)
+{
+    int c = 0;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct flb_task *task;
+    struct flb_thread *th;
+    struct flb_task_route *route;
+
+    mk_list_foreach_safe(head, tmp, &o_ins->pending) {
+        route = mk_list_entry(head, struct flb_task_route, _head_pending);
+        mk_list_del(&route->_head_pending);
+        route->pending = FLB_FALSE;
+
+        /* The queue keeps the reference of the pending route */
+        if (inflight_ready(o_ins) == FLB_FALSE ||
+            !flb_priority_queue_empty(&o_ins->inflight_queue)) {
+            inflight_queue_add(route);
+            continue;
+        }
+
+        task = route->task;
+        th = flb_output_thread(task,
+                               task->i_ins,
+                               o_ins,
+                               config,
+                               task->buf, task->size,
+                               task->tag,
+                               task->tag_len);
+        /* The thread takes the reference of the pending route */
+        task->users--;
+
+        if (!th) {
+            if (task->users == 0 && mk_list_size(&task->retries) == 0) {
+                flb_task_destroy(task);
+            }
+            continue;
+        }
+
+        flb_task_add_thread(th, task);
+        thread_start(th, o_ins, FLB_FALSE);
+        c++;
+    }
+
+    return c;
+}
+
+/*
+ * Start the backlog flushes (buffered chunks first, then retries) that the
+ * output instance policy allows and the routes waiting for a free flush
+ * slot, it's invoked every time a flush of the instance ends.
+ */
+int flb_engine_dispatch_backlog(struct flb_output_instance *o_ins,
+                                struct flb_config *config)
+{
+    int c = 0;
+    struct mk_list *head;
+    struct flb_task *task;
+    struct flb_thread *th;
+    struct flb_task_route *route;
+    struct flb_task_retry *retry;
+
+    /* Fresh data waiting for a slot goes before the backlog */
+    if (o_ins->backlog_policy == FLB_OUTPUT_BACKLOG_LIVE_FIRST) {
+        c += inflight_queue_start(o_ins, config);
+    }
+
+    while (backlog_ready(o_ins) == FLB_TRUE) {
+        if (!flb_priority_queue_empty(&o_ins->backlog_routes)) {
+            head = flb_priority_queue_pop(&o_ins->backlog_routes);
+            route = mk_list_entry(head, struct flb_task_route, _head_pending);
+            route->backlog = FLB_FALSE;
+
+            task = route->task;
+            th = flb_output_thread(task,
+                                   task->i_ins,
+                                   o_ins,
+                                   config,
+                                   task->buf, task->size,
+                                   task->tag,
+                                   task->tag_len);
+            /* The thread takes the reference of the waiting route */
+            task->users--;
+
+            if (!th) {
+                if (task->users == 0 && mk_list_size(&task->retries) == 0) {
+                    flb_task_destroy(task);
+                }
+                continue;
+            }
+
+            flb_task_add_thread(th, task);
+            thread_start(th, o_ins, FLB_TRUE);
+        }
+        else if (mk_list_is_empty(&o_ins->backlog_retries) != 0) {
+            retry = mk_list_entry_first(&o_ins->backlog_retries,
+                                        struct flb_task_retry, _head_backlog);
+            mk_list_del(&retry->_head_backlog);
+            retry->backlog = FLB_FALSE;
+            retry_start(retry, config);
+        }
+        else {
+            break;
+        }
+        c++;
+    }
+
+    c += inflight_queue_start(o_ins, config);
+
+    /* Coalesced flushes that could not start in time */
+    if (coalesce_due(o_ins) == FLB_TRUE) {
+        c += flb_engine_dispatch_coalesced(o_ins, config);
+    }
+
+    return c;
+}
+
+/* Create and start the task for a sealed dyntag buffer */
+int flb_engine_dispatch_dyntag(uint64_t id, struct flb_input_dyntag *dt,
+                               struct flb_config *config)
+{
+    struct flb_task *task;
+
+    task = dyntag_task_create(id, dt, config);
+    if (!task) {
+        return -1;
+    }
+
+    tasks_start(dt->in, config, FLB_FALSE);
     return 0;
 }
 
 /*
  * Given an input instance, buffer and a bitmask of routes, create the task
  * and routes associated for processing. This mechanism does direct routing
- * without the use of a Tag.
+ * without the use of a Tag. Routes found in 'retries' continue their retry
+ * instead of being flushed right away.
  */
 int flb_engine_dispatch_direct(uint64_t id,
                                struct flb_input_instance *in,
                                char *buf, size_t size,
                                char *tag, uint64_t routes,
                                char *hash_str,
+                               struct flb_task_retry_state *retries,
+                               int retries_n,
                                struct flb_config *config)
 {
     struct flb_task *task;
@@ -205,8 +880,12 @@ int flb_engine_dispatch_direct(uint64_t id,
     }
     flb_trace("[engine dispatch direct] task created %p", task);
 
-    /* Start the new enqueued Tasks */
-    tasks_start(in, config);
+    if (retries_n > 0) {
+        flb_task_retry_restore(task, retries, retries_n);
+    }
+
+    /* Start the new enqueued Tasks, they come from the buffer */
+    tasks_start(in, config, FLB_TRUE);
     return 0;
 }
 
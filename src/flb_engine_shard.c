@@ -0,0 +1,513 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_str.h>
+#include <fluent-bit/flb_log.h>
+#include <fluent-bit/flb_config.h>
+#include <fluent-bit/flb_engine.h>
+#include <fluent-bit/flb_engine_channel.h>
+#include <fluent-bit/flb_input.h>
+#include <fluent-bit/flb_filter.h>
+#include <fluent-bit/flb_output.h>
+#include <fluent-bit/flb_worker.h>
+#include <fluent-bit/flb_metrics.h>
+#include <fluent-bit/flb_engine_shard.h>
+
+#include <string.h>
+
+#ifdef FLB_HAVE_METRICS
+/* The copies of the filters and outputs are reported per shard */
+static void shard_metrics_title(struct flb_metrics *metrics, char *name,
+                                int id)
+{
+    if (!metrics) {
+        return;
+    }
+    snprintf(metrics->title, sizeof(metrics->title) - 1,
+             "%s.shard%i", name, id);
+    metrics->title_len = strlen(metrics->title);
+}
+#endif
+
+/* Components which need the whole pipeline in a single engine */
+static int shards_supported(struct flb_config *config)
+{
+    char *reason = NULL;
+    struct mk_list *head;
+    struct flb_output_instance *o_ins;
+
+    if (config->hot_reload == FLB_TRUE) {
+        reason = "Hot_Reload";
+    }
+#ifdef FLB_HAVE_BUFFERING
+    if (config->buffer_path) {
+        reason = "Buffer_Path";
+    }
+#endif
+#ifdef FLB_HAVE_STREAM_PROCESSOR
+    if (mk_list_is_empty(&config->stream_tasks) != 0) {
+        reason = "stream tasks";
+    }
+#endif
+    if (reason) {
+        flb_warn("[engine] Engine_Shards cannot be used with %s, "
+                 "running a single engine", reason);
+        return FLB_FALSE;
+    }
+
+    /* Every output is copied in every shard */
+    mk_list_foreach(head, &config->outputs) {
+        o_ins = mk_list_entry(head, struct flb_output_instance, _head);
+        if (o_ins->p->type != FLB_OUTPUT_PLUGIN_CORE ||
+            (o_ins->p->flags & FLB_OUTPUT_SHARDS) == 0) {
+            flb_warn("[engine] output %s cannot run in engine shards, "
+                     "running a single engine", o_ins->name);
+            return FLB_FALSE;
+        }
+    }
+
+    return FLB_TRUE;
+}
+
+static int shard_copy_filters(struct flb_config *config,
+                              struct flb_config *shard)
+{
+    struct mk_list *head;
+    struct mk_list *p_head;
+    struct flb_config_prop *prop;
+    struct flb_filter_instance *f_ins;
+    struct flb_filter_instance *ins;
+
+    mk_list_foreach(head, &config->filters) {
+        f_ins = mk_list_entry(head, struct flb_filter_instance, _head);
+        ins = flb_filter_new(shard, f_ins->p->name, f_ins->data);
+        if (!ins) {
+            return -1;
+        }
+        if (f_ins->match &&
+            flb_filter_set_property(ins, "match", f_ins->match) == -1) {
+            return -1;
+        }
+        mk_list_foreach(p_head, &f_ins->properties) {
+            prop = mk_list_entry(p_head, struct flb_config_prop, _head);
+            if (flb_filter_set_property(ins, prop->key, prop->val) == -1) {
+                return -1;
+            }
+        }
+#ifdef FLB_HAVE_METRICS
+        shard_metrics_title(ins->metrics, ins->name, shard->shard_id);
+#endif
+    }
+
+    return 0;
+}
+
+static int shard_copy_outputs(struct flb_config *config,
+                              struct flb_config *shard)
+{
+    char *address;
+    struct mk_list *head;
+    struct mk_list *p_head;
+    struct flb_config_prop *prop;
+    struct flb_output_instance *o_ins;
+    struct flb_output_instance *ins;
+
+    mk_list_foreach(head, &config->outputs) {
+        o_ins = mk_list_entry(head, struct flb_output_instance, _head);
+
+        /* The plugin://host:port/uri form the instance was created with */
+        address = o_ins->host.address ? o_ins->host.address : o_ins->p->name;
+        ins = flb_output_new(shard, address, o_ins->data);
+        if (!ins) {
+            return -1;
+        }
+        mk_list_foreach(p_head, &o_ins->props_set) {
+            prop = mk_list_entry(p_head, struct flb_config_prop, _head);
+            if (flb_output_set_property(ins, prop->key, prop->val) == -1) {
+                return -1;
+            }
+        }
+#ifdef FLB_HAVE_METRICS
+        shard_metrics_title(ins->metrics, ins->name, shard->shard_id);
+#endif
+    }
+
+    return 0;
+}
+
+static void shard_config_destroy(struct flb_config *shard)
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct flb_filter_instance *f_ins;
+    struct flb_output_instance *o_ins;
+
+    mk_list_foreach_safe(head, tmp, &shard->filters) {
+        f_ins = mk_list_entry(head, struct flb_filter_instance, _head);
+        flb_filter_instance_destroy(f_ins, FLB_FALSE);
+    }
+    mk_list_foreach_safe(head, tmp, &shard->outputs) {
+        o_ins = mk_list_entry(head, struct flb_output_instance, _head);
+        flb_output_instance_destroy(o_ins);
+    }
+    flb_config_exit(shard);
+}
+
+/* Configuration of shard 'id', with the service settings of the engine */
+static struct flb_config *shard_config_create(struct flb_config *config,
+                                              int id, int n)
+{
+    struct flb_config *shard;
+
+    shard = flb_config_init();
+    if (!shard) {
+        return NULL;
+    }
+    shard->shard_id = id;
+    shard->shard_parent = config;
+    shard->engine_shards = n;
+    shard->flush_fd = -1;
+
+    /* Released by the main engine */
+    shard->log = config->log;
+    shard->cpu_affinity = config->cpu_affinity;
+
+    shard->flush               = config->flush;
+    shard->grace               = config->grace;
+    shard->verbose             = config->verbose;
+    shard->log_rate_limit      = config->log_rate_limit;
+    shard->mem_total_limit     = config->mem_total_limit;
+    shard->init_workers        = config->init_workers;
+    shard->tasks_max           = config->tasks_max;
+    shard->compress_workers    = config->compress_workers;
+    shard->compress_block_size = config->compress_block_size;
+    shard->dns_workers         = config->dns_workers;
+    shard->dns_cache_ttl       = config->dns_cache_ttl;
+    shard->filter_workers      = config->filter_workers;
+    if (config->conf_path) {
+        shard->conf_path = flb_strdup(config->conf_path);
+    }
+
+    if (shard_copy_filters(config, shard) == -1 ||
+        shard_copy_outputs(config, shard) == -1) {
+        flb_error("[engine] could not copy the pipeline to shard %i", id);
+        shard_config_destroy(shard);
+        return NULL;
+    }
+
+    return shard;
+}
+
+/*
+ * Create the shards set by 'Engine_Shards' and move the inputs to their
+ * shard, it runs before the inputs are initialized. With a single shard
+ * or a pipeline which cannot be split it does nothing.
+ */
+int flb_engine_shards_create(struct flb_config *config)
+{
+    int i;
+    int n;
+    int next = 0;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct flb_config *shard;
+    struct flb_input_instance *in;
+    struct flb_engine_shards *ctx;
+
+    if (config->shard_parent || config->engine_shards <= 1) {
+        return 0;
+    }
+
+    if (shards_supported(config) == FLB_FALSE) {
+        config->engine_shards = 1;
+        return 0;
+    }
+
+    /* A shard without inputs would never have work */
+    n = config->engine_shards;
+    if (n > mk_list_size(&config->inputs)) {
+        n = mk_list_size(&config->inputs);
+        if (n <= 1) {
+            config->engine_shards = 1;
+            return 0;
+        }
+        flb_info("[engine] %i inputs, using %i engine shards", n, n);
+    }
+
+    ctx = flb_calloc(1, sizeof(struct flb_engine_shards));
+    if (!ctx) {
+        flb_errno();
+        return -1;
+    }
+    ctx->count = n - 1;
+    ctx->shards = flb_calloc(ctx->count, sizeof(struct flb_engine_shard));
+    if (!ctx->shards) {
+        flb_errno();
+        flb_free(ctx);
+        return -1;
+    }
+    pthread_mutex_init(&ctx->lock, NULL);
+    pthread_cond_init(&ctx->cond, NULL);
+
+    for (i = 0; i < ctx->count; i++) {
+        shard = shard_config_create(config, i + 1, n);
+        if (!shard) {
+            while (--i >= 0) {
+                shard_config_destroy(ctx->shards[i].config);
+            }
+            pthread_mutex_destroy(&ctx->lock);
+            pthread_cond_destroy(&ctx->cond);
+            flb_free(ctx->shards);
+            flb_free(ctx);
+            return -1;
+        }
+        ctx->shards[i].id = i + 1;
+        ctx->shards[i].config = shard;
+    }
+
+    mk_list_foreach_safe(head, tmp, &config->inputs) {
+        in = mk_list_entry(head, struct flb_input_instance, _head);
+        if (in->shard >= n) {
+            flb_warn("[engine] %s shard %i out of range, using shard %i",
+                     in->name, in->shard, in->shard % n);
+        }
+        i = (in->shard >= 0) ? in->shard % n : next++ % n;
+        if (i == 0) {
+            continue;
+        }
+
+        shard = ctx->shards[i - 1].config;
+        mk_list_del(&in->_head);
+        mk_list_add(&in->_head, &shard->inputs);
+        in->config = shard;
+    }
+
+    /* The memory budget is split between the shards */
+    if (config->mem_total_limit > 0) {
+        config->mem_total_limit /= n;
+        if (config->mem_total_limit == 0) {
+            config->mem_total_limit = 1;
+        }
+        for (i = 0; i < ctx->count; i++) {
+            ctx->shards[i].config->mem_total_limit = config->mem_total_limit;
+        }
+    }
+
+    config->engine_shards = n;
+    config->shards_ctx = ctx;
+    flb_info("[engine] running %i engine shards", n);
+
+    return 0;
+}
+
+static void shard_worker(void *data)
+{
+    struct flb_engine_shard *shard = data;
+
+    /* On success the configuration is released once the shard stops */
+    if (flb_engine_start(shard->config) == -1) {
+        flb_engine_shard_ready(shard->config, FLB_FALSE);
+    }
+}
+
+/*
+ * Start the shards one by one, every shard initializes its plugins before
+ * the next one starts. It runs once the main engine is ready.
+ */
+int flb_engine_shards_start(struct flb_config *config)
+{
+    int i;
+    int ret;
+    int status;
+    char role[16];
+    struct flb_engine_shard *shard;
+    struct flb_engine_shards *ctx = config->shards_ctx;
+
+    if (!ctx) {
+        return 0;
+    }
+
+    for (i = 0; i < ctx->count; i++) {
+        shard = &ctx->shards[i];
+        snprintf(role, sizeof(role) - 1, "engine:%i", shard->id);
+        ret = flb_worker_create_role(shard_worker, shard, &shard->tid,
+                                     role, NULL, config);
+        if (ret == -1) {
+            flb_error("[engine] could not spawn shard %i", shard->id);
+            flb_engine_shards_exit(config);
+            return -1;
+        }
+        shard->started = FLB_TRUE;
+
+        pthread_mutex_lock(&ctx->lock);
+        while (shard->status == FLB_ENGINE_SHARD_NEW) {
+            pthread_cond_wait(&ctx->cond, &ctx->lock);
+        }
+        status = shard->status;
+        pthread_mutex_unlock(&ctx->lock);
+
+        if (status == FLB_ENGINE_SHARD_FAILED) {
+            /* Like the main engine, a failed shard is not released */
+            flb_error("[engine] shard %i could not start", shard->id);
+            flb_engine_shards_exit(config);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Called by a shard once its loop is about to run, or when it failed */
+void flb_engine_shard_ready(struct flb_config *config, int ok)
+{
+    struct flb_engine_shard *shard;
+    struct flb_engine_shards *ctx;
+
+    if (!config->shard_parent) {
+        return;
+    }
+
+    ctx = config->shard_parent->shards_ctx;
+    shard = &ctx->shards[config->shard_id - 1];
+
+    pthread_mutex_lock(&ctx->lock);
+    shard->status = ok ? FLB_ENGINE_SHARD_RUNNING : FLB_ENGINE_SHARD_FAILED;
+    pthread_cond_broadcast(&ctx->cond);
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+/* A stopping shard is no longer reachable from the main engine */
+void flb_engine_shard_detach(struct flb_config *config)
+{
+    struct flb_engine_shards *ctx;
+
+    if (!config->shard_parent) {
+        return;
+    }
+
+    ctx = config->shard_parent->shards_ctx;
+    pthread_mutex_lock(&ctx->lock);
+    ctx->shards[config->shard_id - 1].config = NULL;
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+/*
+ * Forward a stop request of the main engine, every shard drains its own
+ * tasks. A second request makes them stop right away, as it does for the
+ * main engine.
+ */
+void flb_engine_shards_stop(struct flb_config *config)
+{
+    int i;
+    struct flb_engine_shard *shard;
+    struct flb_engine_shards *ctx = config->shards_ctx;
+
+    if (!ctx) {
+        return;
+    }
+
+    pthread_mutex_lock(&ctx->lock);
+    ctx->stopping = FLB_TRUE;
+    for (i = 0; i < ctx->count; i++) {
+        shard = &ctx->shards[i];
+        if (shard->status != FLB_ENGINE_SHARD_RUNNING || !shard->config) {
+            continue;
+        }
+        shard->config->is_running = FLB_FALSE;
+        flb_engine_notify(shard->config, FLB_ENGINE_EV_STOP);
+    }
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+/* Wait for the shards to stop, they release their own configuration */
+void flb_engine_shards_exit(struct flb_config *config)
+{
+    int i;
+    struct flb_engine_shards *ctx = config->shards_ctx;
+
+    if (!ctx) {
+        return;
+    }
+
+    /* Not drained (e.g: SIGINT), do not wait for the grace period */
+    if (ctx->stopping == FLB_FALSE) {
+        flb_engine_shards_stop(config);
+        flb_engine_shards_stop(config);
+    }
+
+    for (i = 0; i < ctx->count; i++) {
+        if (ctx->shards[i].started == FLB_TRUE) {
+            pthread_join(ctx->shards[i].tid, NULL);
+            ctx->shards[i].started = FLB_FALSE;
+        }
+    }
+}
+
+/* Release the shards context, the shards must be stopped */
+void flb_engine_shards_destroy(struct flb_config *config)
+{
+    struct flb_engine_shards *ctx = config->shards_ctx;
+
+    if (!ctx) {
+        return;
+    }
+
+    config->shards_ctx = NULL;
+    pthread_mutex_destroy(&ctx->lock);
+    pthread_cond_destroy(&ctx->cond);
+    flb_free(ctx->shards);
+    flb_free(ctx);
+}
+
+int flb_engine_shards_lock(struct flb_config *config)
+{
+    struct flb_engine_shards *ctx = config->shards_ctx;
+
+    if (!ctx) {
+        return 1;
+    }
+
+    pthread_mutex_lock(&ctx->lock);
+    return ctx->count + 1;
+}
+
+void flb_engine_shards_unlock(struct flb_config *config)
+{
+    struct flb_engine_shards *ctx = config->shards_ctx;
+
+    if (ctx) {
+        pthread_mutex_unlock(&ctx->lock);
+    }
+}
+
+struct flb_config *flb_engine_shard_get(struct flb_config *config, int i)
+{
+    struct flb_engine_shards *ctx = config->shards_ctx;
+
+    if (i == 0) {
+        return config;
+    }
+    if (!ctx || i > ctx->count) {
+        return NULL;
+    }
+
+    return ctx->shards[i - 1].config;
+}
@@ -22,6 +22,19 @@
 #include <fluent-bit/flb_str.h>
 #include <fluent-bit/flb_env.h>
 #include <fluent-bit/flb_router.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_mem_pool.h>
+#include <fluent-bit/flb_arena.h>
+#include <fluent-bit/flb_mp.h>
+#ifdef FLB_HAVE_REGEX
+#include <fluent-bit/flb_regex.h>
+#endif
+#include <fluent-bit/flb_time.h>
+
+#ifdef FLB_HAVE_METRICS
+#include <fluent-bit/flb_metrics.h>
+#include <fluent-bit/flb_worker.h>
+#endif
 
 static inline int instance_id(struct flb_filter_plugin *p,
                               struct flb_config *config)
@@ -40,6 +53,65 @@ static inline int instance_id(struct flb_filter_plugin *p,
     return c;
 }
 
+/* Next free id of the plugin, instances of a reload can not reuse them */
+static int instance_id_next(struct flb_filter_plugin *p, struct mk_list *list,
+                            struct flb_config *config)
+{
+    int id = -1;
+    struct mk_list *head;
+    struct flb_filter_instance *entry;
+
+    mk_list_foreach(head, &config->filters) {
+        entry = mk_list_entry(head, struct flb_filter_instance, _head);
+        if (entry->p == p && entry->id > id) {
+            id = entry->id;
+        }
+    }
+    mk_list_foreach(head, list) {
+        entry = mk_list_entry(head, struct flb_filter_instance, _head);
+        if (entry->p == p && entry->id > id) {
+            id = entry->id;
+        }
+    }
+
+    return id + 1;
+}
+
+#ifdef FLB_HAVE_METRICS
+/* Resolve the handles, without all of them the instance has no metrics */
+static void instance_metrics_resolve(struct flb_filter_instance *ins)
+{
+    struct flb_metrics *metrics = ins->metrics;
+
+    ins->m_records_in   = flb_metrics_get_id(FLB_METRIC_FILTER_IN_RECORDS,
+                                             metrics);
+    ins->m_records_out  = flb_metrics_get_id(FLB_METRIC_FILTER_OUT_RECORDS,
+                                             metrics);
+    ins->m_bytes_in     = flb_metrics_get_id(FLB_METRIC_FILTER_IN_BYTES,
+                                             metrics);
+    ins->m_bytes_out    = flb_metrics_get_id(FLB_METRIC_FILTER_OUT_BYTES,
+                                             metrics);
+    ins->m_drop_records = flb_metrics_get_id(FLB_METRIC_FILTER_DROP_RECORDS,
+                                             metrics);
+    ins->m_time         = flb_metrics_get_id(FLB_METRIC_FILTER_TIME, metrics);
+
+    if (!ins->m_records_in || !ins->m_records_out || !ins->m_bytes_in ||
+        !ins->m_bytes_out || !ins->m_drop_records || !ins->m_time) {
+        flb_metrics_destroy(metrics);
+        ins->metrics = NULL;
+    }
+}
+#endif
+
+static inline void instance_metrics_destroy(struct flb_filter_instance *ins)
+{
+#ifdef FLB_HAVE_METRICS
+    if (ins->metrics) {
+        flb_metrics_destroy(ins->metrics);
+    }
+#endif
+}
+
 static inline int prop_key_check(char *key, char *kv, int k_len)
 {
     int len;
@@ -61,7 +133,354 @@ static void flb_filter_replace(msgpack_sbuffer *mp_sbuf, msgpack_packer *mp_pck,
                                void *new_buf, size_t new_size)
 {
     mp_sbuf->size -= old_size;
-    msgpack_sbuffer_write(mp_sbuf, new_buf, new_size);
+    flb_mem_pool_sbuffer_write(mp_sbuf, new_buf, new_size);
+}
+
+/*
+ * Invoke the filter callback, if the records were modified the 'data' and
+ * 'bytes' references are updated to the new content.
+ */
+static inline int filter_run(struct flb_filter_instance *f_ins,
+                              msgpack_sbuffer *mp_sbuf, msgpack_packer *mp_pck,
+                              void **data, size_t *bytes,
+                              char *tag, int tag_len,
+                              struct flb_config *config)
+{
+    int ret;
+    void *out_buf = NULL;
+    size_t out_size = 0;
+    FLB_MEM_SCOPE_ENTER(FLB_MEM_FILTER);
+
+    /* Invoke the filter callback */
+    ret = f_ins->p->cb_filter(*data, *bytes,     /* msgpack raw data */
+                              tag, tag_len,      /* input tag        */
+                              &out_buf,          /* new data         */
+                              &out_size,         /* new data size    */
+                              f_ins,             /* filter instance  */
+                              f_ins->context,    /* filter priv data */
+                              config);
+    FLB_MEM_SCOPE_LEAVE();
+
+    /* Override buffer just if it was modified */
+    if (ret == FLB_FILTER_MODIFIED) {
+        flb_filter_replace(mp_sbuf, mp_pck,    /* msgpack        */
+                           *bytes,             /* passed data    */
+                           out_buf, out_size); /* new data       */
+        /* Release new temporal buffer */
+        flb_free(out_buf);
+
+        /* Point back the 'data' pointer to the new address */
+        *bytes = out_size;
+        *data  = mp_sbuf->data + (mp_sbuf->size - out_size);
+    }
+
+    return ret;
+}
+
+/*
+ * State of the records being processed by the filters chain. The records
+ * are kept as raw msgpack ('data' and 'bytes') or decoded into 'batch',
+ * conversions between both happens only when a filter requires it.
+ */
+struct filter_state {
+    msgpack_sbuffer *mp_sbuf;
+    msgpack_packer *mp_pck;
+    void *data;
+    size_t bytes;
+    int decoded;                    /* batch is valid        */
+    int modified;                   /* batch must be encoded */
+    struct flb_filter_batch batch;
+
+#ifdef FLB_HAVE_METRICS
+    int records;                    /* live records, -1 if unknown */
+
+    /*
+     * A batch filter that modified the records does not know the size of
+     * its output until the batch is encoded again.
+     */
+    struct flb_filter_instance *bytes_pending;
+    size_t bytes_pending_in;
+#endif
+};
+
+/* Allocate memory that lives as long as the decoded records */
+void *flb_filter_batch_alloc(struct flb_filter_batch *batch, size_t size)
+{
+    return msgpack_zone_malloc(batch->zone, size);
+}
+
+static int batch_decode(struct filter_state *st)
+{
+    int ret;
+    size_t off = 0;
+    size_t start;
+    msgpack_object root;
+    struct flb_filter_batch *batch = &st->batch;
+    struct flb_filter_record *rec;
+    struct flb_filter_record *tmp;
+
+    if (!batch->zone) {
+        batch->zone = flb_mp_zone_get();
+        if (!batch->zone) {
+            return -1;
+        }
+    }
+    batch->count = 0;
+
+    /* Objects are allocated in the zone and reference the raw buffer */
+    while (1) {
+        start = off;
+        ret = msgpack_unpack(st->data, st->bytes, &off, batch->zone, &root);
+        if (ret != MSGPACK_UNPACK_SUCCESS &&
+            ret != MSGPACK_UNPACK_EXTRA_BYTES) {
+            break;
+        }
+
+        if (root.type != MSGPACK_OBJECT_ARRAY || root.via.array.size != 2) {
+            continue;
+        }
+
+        if (batch->count == batch->size) {
+            tmp = flb_realloc(batch->records,
+                              sizeof(struct flb_filter_record) *
+                              (batch->size + 64));
+            if (!tmp) {
+                flb_errno();
+                return -1;
+            }
+            batch->records = tmp;
+            batch->size += 64;
+        }
+
+        rec = &batch->records[batch->count++];
+        rec->drop = FLB_FALSE;
+        rec->ts   = root.via.array.ptr[0];
+        rec->map  = root.via.array.ptr[1];
+        rec->raw  = (char *) st->data + start;
+        rec->raw_size = off - start;
+
+        if (ret == MSGPACK_UNPACK_SUCCESS) {
+            break;
+        }
+    }
+
+    st->decoded  = FLB_TRUE;
+    st->modified = FLB_FALSE;
+    return 0;
+}
+
+/* Encode the batch back (if modified) into the input instance buffer */
+static void batch_encode(struct filter_state *st)
+{
+    int i;
+    char *span = NULL;
+    size_t span_size = 0;
+    msgpack_sbuffer tmp_sbuf;
+    msgpack_packer tmp_pck;
+    struct flb_filter_record *rec;
+
+    if (st->decoded == FLB_FALSE) {
+        return;
+    }
+
+    if (st->modified == FLB_TRUE) {
+        msgpack_sbuffer_init(&tmp_sbuf);
+        msgpack_packer_init(&tmp_pck, &tmp_sbuf, msgpack_sbuffer_write);
+
+        /*
+         * Untouched records are copied from the raw buffer, contiguous ones
+         * with a single write.
+         */
+        for (i = 0; i < st->batch.count; i++) {
+            rec = &st->batch.records[i];
+            if (rec->drop == FLB_TRUE) {
+                continue;
+            }
+
+            if (rec->raw) {
+                if (span && span + span_size == rec->raw) {
+                    span_size += rec->raw_size;
+                    continue;
+                }
+                if (span) {
+                    msgpack_sbuffer_write(&tmp_sbuf, span, span_size);
+                }
+                span = rec->raw;
+                span_size = rec->raw_size;
+                continue;
+            }
+
+            if (span) {
+                msgpack_sbuffer_write(&tmp_sbuf, span, span_size);
+                span = NULL;
+            }
+            msgpack_pack_array(&tmp_pck, 2);
+            msgpack_pack_object(&tmp_pck, rec->ts);
+            msgpack_pack_object(&tmp_pck, rec->map);
+        }
+        if (span) {
+            msgpack_sbuffer_write(&tmp_sbuf, span, span_size);
+        }
+
+        flb_filter_replace(st->mp_sbuf, st->mp_pck, st->bytes,
+                           tmp_sbuf.data, tmp_sbuf.size);
+        st->bytes = tmp_sbuf.size;
+        st->data  = st->mp_sbuf->data + (st->mp_sbuf->size - tmp_sbuf.size);
+        msgpack_sbuffer_destroy(&tmp_sbuf);
+
+#ifdef FLB_HAVE_METRICS
+        if (st->bytes_pending && st->bytes_pending->metrics) {
+            flb_metric_sum(st->bytes_pending->m_bytes_out, st->bytes);
+        }
+        st->bytes_pending = NULL;
+#endif
+    }
+
+    /* Decoded objects are not longer valid */
+    msgpack_zone_clear(st->batch.zone);
+    st->batch.count = 0;
+    st->decoded  = FLB_FALSE;
+    st->modified = FLB_FALSE;
+}
+
+#ifdef FLB_HAVE_METRICS
+static int batch_live_records(struct flb_filter_batch *batch)
+{
+    int i;
+    int c = 0;
+
+    for (i = 0; i < batch->count; i++) {
+        if (batch->records[i].drop == FLB_FALSE) {
+            c++;
+        }
+    }
+    return c;
+}
+
+/*
+ * A batch filter modified the records: its output size is known once the
+ * batch is encoded. If another batch filter modifies them first, the size
+ * of the previous one output is unknown and its input size is reported.
+ */
+static void filter_bytes_pending(struct filter_state *st,
+                                 struct flb_filter_instance *f_ins,
+                                 size_t bytes_in)
+{
+    if (st->bytes_pending && st->bytes_pending->metrics) {
+        flb_metric_sum(st->bytes_pending->m_bytes_out, st->bytes_pending_in);
+    }
+    st->bytes_pending = f_ins;
+    st->bytes_pending_in = bytes_in;
+}
+
+static void filter_metrics(struct flb_filter_instance *f_ins,
+                           struct filter_state *st,
+                           int records_in, size_t bytes_in, int bytes_out,
+                           uint64_t usec)
+{
+    if (!f_ins->metrics) {
+        return;
+    }
+
+    flb_metric_sum(f_ins->m_records_in, records_in);
+    flb_metric_sum(f_ins->m_records_out, st->records);
+    if (records_in > st->records) {
+        flb_metric_sum(f_ins->m_drop_records, records_in - st->records);
+    }
+    flb_metric_sum(f_ins->m_bytes_in, bytes_in);
+    if (bytes_out >= 0) {
+        flb_metric_sum(f_ins->m_bytes_out, bytes_out);
+    }
+    flb_metric_sum(f_ins->m_time, usec);
+}
+#endif
+
+static void filter_state_run(struct flb_filter_instance *f_ins,
+                             struct filter_state *st,
+                             char *tag, int tag_len,
+                             struct flb_config *config)
+{
+    int ret;
+#ifdef FLB_HAVE_METRICS
+    int records_in;
+    int bytes_out;
+    size_t bytes_in;
+    uint64_t start;
+
+    /* The decoding and encoding of the records are part of the cost */
+    start = flb_metrics_clock();
+    if (st->records == -1) {
+        st->records = flb_mp_count(st->data, st->bytes);
+    }
+    records_in = st->records;
+#endif
+
+    if (f_ins->p->cb_filter_batch) {
+        if (st->decoded == FLB_FALSE && batch_decode(st) == -1) {
+            return;
+        }
+#ifdef FLB_HAVE_METRICS
+        /* Size of the records when they were last encoded */
+        bytes_in = st->bytes;
+        bytes_out = st->bytes;
+#endif
+
+        ret = f_ins->p->cb_filter_batch(&st->batch, tag, tag_len,
+                                        f_ins, f_ins->context, config);
+        if (ret == FLB_FILTER_MODIFIED) {
+            st->modified = FLB_TRUE;
+#ifdef FLB_HAVE_METRICS
+            st->records = batch_live_records(&st->batch);
+            filter_bytes_pending(st, f_ins, bytes_in);
+            bytes_out = -1;
+#endif
+        }
+#ifdef FLB_HAVE_METRICS
+        filter_metrics(f_ins, st, records_in, bytes_in, bytes_out,
+                       flb_metrics_clock() - start);
+#endif
+        return;
+    }
+
+    /* Compatibility: raw msgpack filter */
+    batch_encode(st);
+#ifdef FLB_HAVE_METRICS
+    bytes_in = st->bytes;
+#endif
+    ret = filter_run(f_ins, st->mp_sbuf, st->mp_pck,
+                     &st->data, &st->bytes, tag, tag_len, config);
+#ifdef FLB_HAVE_METRICS
+    if (ret == FLB_FILTER_MODIFIED) {
+        st->records = flb_mp_count(st->data, st->bytes);
+    }
+    filter_metrics(f_ins, st, records_in, bytes_in, st->bytes,
+                   flb_metrics_clock() - start);
+#else
+    (void) ret;
+#endif
+}
+
+static void filter_state_init(struct filter_state *st,
+                              msgpack_sbuffer *mp_sbuf, msgpack_packer *mp_pck,
+                              void *data, size_t bytes)
+{
+    memset(st, '\0', sizeof(struct filter_state));
+    st->mp_sbuf = mp_sbuf;
+    st->mp_pck  = mp_pck;
+    st->data    = data;
+    st->bytes   = bytes;
+#ifdef FLB_HAVE_METRICS
+    st->records = -1;
+#endif
+}
+
+static void filter_state_done(struct filter_state *st)
+{
+    /* Serialize the records once for the whole chain */
+    batch_encode(st);
+
+    flb_mp_zone_put(st->batch.zone);
+    flb_free(st->batch.records);
 }
 
 void flb_filter_do(msgpack_sbuffer *mp_sbuf, msgpack_packer *mp_pck,
@@ -69,42 +488,138 @@ void flb_filter_do(msgpack_sbuffer *mp_sbuf, msgpack_packer *mp_pck,
                    char *tag, int tag_len,
                    struct flb_config *config)
 {
-    int ret;
-    void *out_buf;
-    size_t out_size;
+    int i;
+    struct mk_list *head;
+    struct filter_state st;
+    struct flb_filter_instance *f_ins;
+    struct flb_router_cache_entry *route;
+    struct flb_arena *arena;
+
+    if (mk_list_is_empty(&config->filters) == 0) {
+        return;
+    }
+
+    /* Temporary memory of the filters is released once the chain is done */
+    arena = flb_arena_enter();
+    filter_state_init(&st, mp_sbuf, mp_pck, data, bytes);
+    pthread_rwlock_rdlock(&config->filters_lock);
+
+    /* Lookup the filters chain for this tag */
+    route = flb_router_cache_get(tag, tag_len, config);
+    if (route) {
+        for (i = 0; i < route->filters_count; i++) {
+            filter_state_run(route->filters[i], &st, tag, tag_len, config);
+        }
+    }
+    else {
+        mk_list_foreach(head, &config->filters) {
+            f_ins = mk_list_entry(head, struct flb_filter_instance, _head);
+            if (flb_router_match(tag, f_ins->match)) {
+                filter_state_run(f_ins, &st, tag, tag_len, config);
+            }
+        }
+    }
+    pthread_rwlock_unlock(&config->filters_lock);
+
+    filter_state_done(&st);
+    flb_arena_leave(arena);
+}
+
+/*
+ * Run the filters chain outside of the engine thread (e.g: input workers).
+ * The router cache is not shared with the caller, the 'match' rules are
+ * evaluated on every call. If any filter matching the tag is not flagged
+ * with FLB_FILTER_THREAD_SAFE the records are not touched and it returns
+ * -1, the caller must let the engine run the chain with flb_filter_do().
+ */
+int flb_filter_do_threaded(msgpack_sbuffer *mp_sbuf, msgpack_packer *mp_pck,
+                           void *data, size_t bytes,
+                           char *tag, int tag_len,
+                           struct flb_config *config)
+{
     struct mk_list *head;
+    struct filter_state st;
     struct flb_filter_instance *f_ins;
+    struct flb_arena *arena;
+
+    /* The filters pool takes the records once the chunk is sealed */
+    if (config->filter_pool) {
+        return -1;
+    }
 
+    pthread_rwlock_rdlock(&config->filters_lock);
     mk_list_foreach(head, &config->filters) {
         f_ins = mk_list_entry(head, struct flb_filter_instance, _head);
-        if (flb_router_match(tag, f_ins->match)) {
-            /* Reset filtered buffer */
-            out_buf = NULL;
-            out_size = 0;
-
-            /* Invoke the filter callback */
-            ret = f_ins->p->cb_filter(data, bytes,    /* msgpack raw data */
-                                      tag, tag_len,   /* input tag        */
-                                      &out_buf,       /* new data         */
-                                      &out_size,      /* new data size    */
-                                      f_ins,          /* filter instance  */
-                                      f_ins->context, /* filter priv data */
-                                      config);
-
-            /* Override buffer just if it was modified */
-            if (ret == FLB_FILTER_MODIFIED) {
-                flb_filter_replace(mp_sbuf, mp_pck,    /* msgpack        */
-                                   bytes,              /* passed data    */
-                                   out_buf, out_size); /* new data       */
-                /* Release new temporal buffer */
-                flb_free(out_buf);
-
-                /* Point back the 'data' pointer to the new address */
-                bytes = out_size;
-                data  = mp_sbuf->data + (mp_sbuf->size - out_size);
-            }
+        if (!f_ins->match || !flb_router_match(tag, f_ins->match)) {
+            continue;
+        }
+        if (!(f_ins->p->flags & FLB_FILTER_THREAD_SAFE)) {
+            pthread_rwlock_unlock(&config->filters_lock);
+            return -1;
         }
     }
+
+    if (mk_list_is_empty(&config->filters) == 0) {
+        pthread_rwlock_unlock(&config->filters_lock);
+        return 0;
+    }
+
+    arena = flb_arena_enter();
+    filter_state_init(&st, mp_sbuf, mp_pck, data, bytes);
+
+    mk_list_foreach(head, &config->filters) {
+        f_ins = mk_list_entry(head, struct flb_filter_instance, _head);
+        if (f_ins->match && flb_router_match(tag, f_ins->match)) {
+            filter_state_run(f_ins, &st, tag, tag_len, config);
+        }
+    }
+    pthread_rwlock_unlock(&config->filters_lock);
+
+    filter_state_done(&st);
+    flb_arena_leave(arena);
+
+    return 0;
+}
+
+/*
+ * Run the filters chain from a thread of the filters pool. Chains of
+ * different chunks run at the same time: the callbacks of a filter not
+ * flagged with FLB_FILTER_THREAD_SAFE are serialized with the instance lock.
+ */
+void flb_filter_do_locked(msgpack_sbuffer *mp_sbuf, msgpack_packer *mp_pck,
+                          void *data, size_t bytes,
+                          char *tag, int tag_len,
+                          struct flb_config *config)
+{
+    int safe;
+    struct mk_list *head;
+    struct filter_state st;
+    struct flb_filter_instance *f_ins;
+    struct flb_arena *arena;
+
+    arena = flb_arena_enter();
+    filter_state_init(&st, mp_sbuf, mp_pck, data, bytes);
+
+    pthread_rwlock_rdlock(&config->filters_lock);
+    mk_list_foreach(head, &config->filters) {
+        f_ins = mk_list_entry(head, struct flb_filter_instance, _head);
+        if (!f_ins->match || !flb_router_match(tag, f_ins->match)) {
+            continue;
+        }
+
+        safe = f_ins->p->flags & FLB_FILTER_THREAD_SAFE;
+        if (!safe) {
+            pthread_mutex_lock(&f_ins->lock);
+        }
+        filter_state_run(f_ins, &st, tag, tag_len, config);
+        if (!safe) {
+            pthread_mutex_unlock(&f_ins->lock);
+        }
+    }
+    pthread_rwlock_unlock(&config->filters_lock);
+
+    filter_state_done(&st);
+    flb_arena_leave(arena);
 }
 
 int flb_filter_set_property(struct flb_filter_instance *filter, char *k, char *v)
@@ -121,7 +636,11 @@ int flb_filter_set_property(struct flb_filter_instance *filter, char *k, char *v
 
     /* Check if the key is a known/shared property */
     if (prop_key_check("match", k, len) == 0) {
+        if (filter->match) {
+            flb_free(filter->match);
+        }
         filter->match = tmp;
+        flb_router_cache_invalidate(filter->config);
     }
     else {
         /* Append any remaining configuration key to prop list */
@@ -144,115 +663,344 @@ char *flb_filter_get_property(char *key, struct flb_filter_instance *i)
     return flb_config_prop_get(key, &i->properties);
 }
 
+/* Release an instance, 'exit' runs the exit callback of the plugin */
+void flb_filter_instance_destroy(struct flb_filter_instance *ins, int exit)
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct flb_config_prop *prop;
+
+    if (exit == FLB_TRUE && ins->p->cb_exit) {
+        ins->p->cb_exit(ins->context, ins->config);
+    }
+
+    /* release properties */
+    mk_list_foreach_safe(head, tmp, &ins->properties) {
+        prop = mk_list_entry(head, struct flb_config_prop, _head);
+
+        flb_free(prop->key);
+        flb_free(prop->val);
+
+        mk_list_del(&prop->_head);
+        flb_free(prop);
+    }
+
+    if (ins->match != NULL) {
+        flb_free(ins->match);
+    }
+
+    instance_metrics_destroy(ins);
+    pthread_mutex_destroy(&ins->lock);
+    mk_list_del(&ins->_head);
+    flb_free(ins);
+}
+
 /* Invoke exit call for the filter plugin */
 void flb_filter_exit(struct flb_config *config)
 {
     struct mk_list *tmp;
     struct mk_list *head;
-    struct mk_list *tmp_prop;
-    struct mk_list *head_prop;
-    struct flb_config_prop *prop;
     struct flb_filter_instance *ins;
-    struct flb_filter_plugin *p;
+
+    /* Cached routes reference the filter instances */
+    flb_router_cache_invalidate(config);
 
     mk_list_foreach_safe(head, tmp, &config->filters) {
         ins = mk_list_entry(head, struct flb_filter_instance, _head);
-        p = ins->p;
+        flb_filter_instance_destroy(ins, FLB_TRUE);
+    }
 
-        /* Check a exit callback */
-        if (p->cb_exit) {
-            p->cb_exit(ins->context, config);
-        }
+    flb_arena_thread_exit();
+    flb_mp_thread_exit();
+#ifdef FLB_HAVE_REGEX
+    flb_regex_thread_exit();
+#endif
+}
 
-        /* release properties */
-        mk_list_foreach_safe(head_prop, tmp_prop, &ins->properties) {
-            prop = mk_list_entry(head_prop, struct flb_config_prop, _head);
+static struct flb_filter_plugin *plugin_lookup(struct flb_config *config,
+                                               char *filter)
+{
+    int i;
+    (void) config;
 
-            flb_free(prop->key);
-            flb_free(prop->val);
+    if (!filter) {
+        return NULL;
+    }
 
-            mk_list_del(&prop->_head);
-            flb_free(prop);
+    for (i = 0; flb_filter_plugins[i]; i++) {
+        if (strcmp(flb_filter_plugins[i]->name, filter) == 0) {
+            return flb_filter_plugins[i];
         }
+    }
 
-        if (ins->match != NULL) {
-            flb_free(ins->match);
-        }
+    return NULL;
+}
+
+static struct flb_filter_instance *instance_create(struct flb_config *config,
+                                                   struct flb_filter_plugin *plugin,
+                                                   int id, void *data)
+{
+    struct flb_filter_instance *instance;
+
+    instance = flb_malloc(sizeof(struct flb_filter_instance));
+    if (!instance) {
+        flb_errno();
+        return NULL;
+    }
+    instance->config = config;
+
+    /* format name (with instance id) */
+    snprintf(instance->name, sizeof(instance->name) - 1,
+             "%s.%i", plugin->name, id);
+
+    instance->id      = id;
+    instance->p       = plugin;
+    instance->data    = data;
+    instance->context = NULL;
+    instance->match   = NULL;
+    pthread_mutex_init(&instance->lock, NULL);
+    mk_list_init(&instance->properties);
 
-        mk_list_del(&ins->_head);
-        flb_free(ins);
+    /* Metrics: the plugins can register their own ones */
+#ifdef FLB_HAVE_METRICS
+    instance->metrics = flb_metrics_create(instance->name);
+    if (instance->metrics) {
+        flb_metrics_add(FLB_METRIC_FILTER_IN_RECORDS, "records_in",
+                        instance->metrics);
+        flb_metrics_add(FLB_METRIC_FILTER_OUT_RECORDS, "records_out",
+                        instance->metrics);
+        flb_metrics_add(FLB_METRIC_FILTER_IN_BYTES, "bytes_in",
+                        instance->metrics);
+        flb_metrics_add(FLB_METRIC_FILTER_OUT_BYTES, "bytes_out",
+                        instance->metrics);
+        flb_metrics_add(FLB_METRIC_FILTER_DROP_RECORDS, "drop_records",
+                        instance->metrics);
+        flb_metrics_add(FLB_METRIC_FILTER_TIME, "time_usec",
+                        instance->metrics);
+        instance_metrics_resolve(instance);
     }
+#endif
+
+    return instance;
 }
 
 struct flb_filter_instance *flb_filter_new(struct flb_config *config,
                                            char *filter, void *data)
 {
-    int id;
-    struct mk_list *head;
     struct flb_filter_plugin *plugin;
-    struct flb_filter_instance *instance = NULL;
+    struct flb_filter_instance *instance;
 
-    if (!filter) {
+    plugin = plugin_lookup(config, filter);
+    if (!plugin) {
         return NULL;
     }
 
-    mk_list_foreach(head, &config->filter_plugins) {
-        plugin = mk_list_entry(head, struct flb_filter_plugin, _head);
-        if (strcmp(plugin->name, filter) == 0) {
-            break;
-        }
-        plugin = NULL;
+    instance = instance_create(config, plugin,
+                               instance_id(plugin, config), data);
+    if (!instance) {
+        return NULL;
     }
+    mk_list_add(&instance->_head, &config->filters);
+
+    return instance;
+}
+
+/*
+ * Create an instance linked to 'list' instead of the running chain, it
+ * becomes part of the chain with flb_filter_chain_swap(). The id does not
+ * collide with the running instances nor with the ones in 'list'.
+ */
+struct flb_filter_instance *flb_filter_new_detached(struct flb_config *config,
+                                                    char *filter, void *data,
+                                                    struct mk_list *list)
+{
+    struct flb_filter_plugin *plugin;
+    struct flb_filter_instance *instance;
 
+    plugin = plugin_lookup(config, filter);
     if (!plugin) {
         return NULL;
     }
 
-    instance = flb_malloc(sizeof(struct flb_filter_instance));
+    instance = instance_create(config, plugin,
+                               instance_id_next(plugin, list, config), data);
     if (!instance) {
-        flb_errno();
         return NULL;
     }
-    instance->config = config;
+    mk_list_add(&instance->_head, list);
 
-    /* Get an ID */
-    id =  instance_id(plugin, config);
+    return instance;
+}
 
-    /* format name (with instance id) */
-    snprintf(instance->name, sizeof(instance->name) - 1,
-             "%s.%i", plugin->name, id);
+/* Same plugin, match rule and properties (in the same order) */
+int flb_filter_instance_equal(struct flb_filter_instance *a,
+                              struct flb_filter_instance *b)
+{
+    struct mk_list *h_a;
+    struct mk_list *h_b;
+    struct flb_config_prop *p_a;
+    struct flb_config_prop *p_b;
 
-    instance->id    = id;
-    instance->p     = plugin;
-    instance->data  = data;
-    instance->match = NULL;
-    mk_list_init(&instance->properties);
-    mk_list_add(&instance->_head, &config->filters);
+    if (a->p != b->p) {
+        return FLB_FALSE;
+    }
 
-    return instance;
+    if (!a->match || !b->match) {
+        if (a->match != b->match) {
+            return FLB_FALSE;
+        }
+    }
+    else if (strcmp(a->match, b->match) != 0) {
+        return FLB_FALSE;
+    }
+
+    if (mk_list_size(&a->properties) != mk_list_size(&b->properties)) {
+        return FLB_FALSE;
+    }
+
+    h_b = b->properties.next;
+    mk_list_foreach(h_a, &a->properties) {
+        p_a = mk_list_entry(h_a, struct flb_config_prop, _head);
+        p_b = mk_list_entry(h_b, struct flb_config_prop, _head);
+        if (strcasecmp(p_a->key, p_b->key) != 0 ||
+            strcmp(p_a->val, p_b->val) != 0) {
+            return FLB_FALSE;
+        }
+        h_b = h_b->next;
+    }
+
+    return FLB_TRUE;
+}
+
+/* Run the init callback of a detached instance, -1 if it failed */
+int flb_filter_instance_init(struct flb_filter_instance *ins,
+                             struct flb_config *config)
+{
+    int ret;
+
+    if (!ins->p->cb_init) {
+        return 0;
+    }
+
+    ret = ins->p->cb_init(ins, config, ins->data);
+    if (ret != 0) {
+        flb_error("Failed initialize filter %s", ins->name);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Replace the running chain with the 'n' instances of 'chain', in that
+ * order. The instances of the old chain not present in the new one are
+ * moved to 'removed', the caller destroys them. The readers of the chain
+ * hold the lock while they run it, once it returns no filter callback is
+ * running over a removed instance.
+ */
+void flb_filter_chain_swap(struct flb_config *config,
+                           struct flb_filter_instance **chain, int n,
+                           struct mk_list *removed)
+{
+    int i;
+    struct mk_list *tmp;
+    struct mk_list *head;
+
+    pthread_rwlock_wrlock(&config->filters_lock);
+
+    mk_list_foreach_safe(head, tmp, &config->filters) {
+        mk_list_del(head);
+        mk_list_add(head, removed);
+    }
+    for (i = 0; i < n; i++) {
+        mk_list_del(&chain[i]->_head);
+        mk_list_add(&chain[i]->_head, &config->filters);
+    }
+
+    /* Cached routes reference the old instances */
+    flb_router_cache_invalidate(config);
+
+    pthread_rwlock_unlock(&config->filters_lock);
 }
 
 /* Initialize all filter plugins */
+/* Init of a filter instance, may run on an init worker */
+struct filter_init_job {
+    int ret;
+    int done;
+    struct flb_filter_instance *ins;
+    struct flb_config *config;
+};
+
+static void filter_init_job(void *data)
+{
+    uint64_t start;
+    struct filter_init_job *job = data;
+    struct flb_filter_instance *ins = job->ins;
+
+    start = flb_time_usec();
+    job->done = FLB_TRUE;
+    job->ret = ins->p->cb_init(ins, job->config, ins->data);
+    flb_debug("[filter %s] initialized in %.1f ms", ins->name,
+              (flb_time_usec() - start) / 1000.0);
+}
+
+/*
+ * Filters flagged with FLB_FILTER_INIT_PARALLEL (e.g. kubernetes and its
+ * API server warm-up) are initialized first on 'Init_Workers' threads,
+ * the others after them in order.
+ */
 void flb_filter_initialize_all(struct flb_config *config)
 {
-    int ret;
+    int i;
+    int n;
+    int parallel = 0;
+    void **args = NULL;
     struct mk_list *tmp;
     struct mk_list *head;
-    struct mk_list *tmp_prop;
-    struct mk_list *head_prop;
-    struct flb_config_prop *prop;
     struct flb_filter_plugin *p;
     struct flb_filter_instance *in;
+    struct filter_init_job *jobs;
+    struct filter_init_job *job;
+
+    n = mk_list_size(&config->filters);
+    jobs = flb_calloc(n + 1, sizeof(struct filter_init_job));
+    if (jobs) {
+        args = flb_calloc(n + 1, sizeof(void *));
+    }
+    if (!jobs || !args) {
+        flb_errno();
+        flb_free(jobs);
+        return;
+    }
+
+    i = 0;
+    mk_list_foreach(head, &config->filters) {
+        in = mk_list_entry(head, struct flb_filter_instance, _head);
+        jobs[i].ins = in;
+        jobs[i].config = config;
+        if (in->match && in->p->cb_init &&
+            in->p->flags & FLB_FILTER_INIT_PARALLEL) {
+            args[parallel++] = &jobs[i];
+        }
+        i++;
+    }
+    if (parallel > 1 && config->init_workers > 1) {
+        flb_worker_run_all(filter_init_job, args, parallel,
+                           config->init_workers, config);
+    }
+    flb_free(args);
 
     /* Iterate all active filter instance plugins */
+    i = 0;
     mk_list_foreach_safe(head, tmp, &config->filters) {
         in = mk_list_entry(head, struct flb_filter_instance, _head);
+        job = &jobs[i++];
 
         if (!in->match) {
             flb_warn("[filter] NO match rule for %s filter instance, unloading.",
                      in->name);
-            mk_list_del(&in->_head);
-            flb_free(in);
+            flb_filter_instance_destroy(in, FLB_FALSE);
             continue;
         }
 
@@ -261,28 +1009,16 @@ void flb_filter_initialize_all(struct flb_config *config)
 
         /* Initialize the input */
         if (p->cb_init) {
-            ret = p->cb_init(in, config, in->data);
-            if (ret != 0) {
+            if (!job->done) {
+                filter_init_job(job);
+            }
+            if (job->ret != 0) {
                 flb_error("Failed initialize filter %s", in->name);
-
-                /* release properties */
-                mk_list_foreach_safe(head_prop, tmp_prop, &in->properties) {
-                    prop = mk_list_entry(head_prop, struct flb_config_prop, _head);
-                    flb_free(prop->key);
-                    flb_free(prop->val);
-                    mk_list_del(&prop->_head);
-                    flb_free(prop);
-                }
-
-                if (in->match != NULL) {
-                    flb_free(in->match);
-                }
-
-                mk_list_del(&in->_head);
-                flb_free(in);
+                flb_filter_instance_destroy(in, FLB_FALSE);
             }
         }
     }
+    flb_free(jobs);
 }
 
 void flb_filter_set_context(struct flb_filter_instance *ins, void *context)
@@ -0,0 +1,387 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_log.h>
+#include <fluent-bit/flb_mp.h>
+#ifdef FLB_HAVE_REGEX
+#include <fluent-bit/flb_regex.h>
+#endif
+#include <fluent-bit/flb_arena.h>
+#include <fluent-bit/flb_pipe.h>
+#include <fluent-bit/flb_config.h>
+#include <fluent-bit/flb_engine.h>
+#include <fluent-bit/flb_engine_dispatch.h>
+#include <fluent-bit/flb_filter.h>
+#include <fluent-bit/flb_router.h>
+#include <fluent-bit/flb_worker.h>
+#include <fluent-bit/flb_task.h>
+#include <fluent-bit/flb_filter_pool.h>
+#include <fluent-bit/flb_mem_pool.h>
+
+#include <string.h>
+
+static void job_init(struct flb_filter_job *job, struct flb_task *task)
+{
+    job->task = task;
+    job->mp_sbuf.data  = task->buf;
+    job->mp_sbuf.size  = task->size;
+    job->mp_sbuf.alloc = task->size;
+}
+
+/* Run the filters chain over the task buffer */
+static void job_run(struct flb_filter_job *job, struct flb_config *config)
+{
+    msgpack_packer mp_pck;
+    struct flb_task *task = job->task;
+
+    msgpack_packer_init(&mp_pck, &job->mp_sbuf, flb_mem_pool_sbuffer_write);
+    flb_filter_do_locked(&job->mp_sbuf, &mp_pck,
+                         job->mp_sbuf.data, job->mp_sbuf.size,
+                         task->tag, task->tag_len, config);
+
+    flb_chunk_index_init(&job->index);
+    flb_chunk_index_append(&job->index, job->mp_sbuf.data, job->mp_sbuf.size);
+}
+
+/* Give the filtered buffer and its records index to the task */
+static void job_apply(struct flb_filter_job *job)
+{
+    flb_task_buf_update(job->task, job->mp_sbuf.data, job->mp_sbuf.size,
+                        job->mp_sbuf.alloc, &job->index);
+}
+
+/* Take the oldest job of the worker queue or steal the newest of another */
+static struct flb_filter_job *job_take(struct flb_filter_worker *w)
+{
+    int i;
+    struct flb_filter_pool *pool = w->pool;
+    struct flb_filter_worker *victim;
+    struct flb_filter_job *job = NULL;
+
+    pthread_mutex_lock(&w->lock);
+    if (mk_list_is_empty(&w->jobs) != 0) {
+        job = mk_list_entry_first(&w->jobs, struct flb_filter_job, _head);
+        mk_list_del(&job->_head);
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    for (i = 0; !job && i < pool->workers; i++) {
+        victim = &pool->w[i];
+        if (victim == w) {
+            continue;
+        }
+
+        pthread_mutex_lock(&victim->lock);
+        if (mk_list_is_empty(&victim->jobs) != 0) {
+            job = mk_list_entry_last(&victim->jobs,
+                                     struct flb_filter_job, _head);
+            mk_list_del(&job->_head);
+        }
+        pthread_mutex_unlock(&victim->lock);
+    }
+
+    return job;
+}
+
+static void filter_worker(void *data)
+{
+    int ret;
+    struct flb_filter_worker *w = data;
+    struct flb_filter_pool *pool = w->pool;
+    struct flb_filter_job *job;
+
+    while (1) {
+        /* Reserve one of the queued jobs */
+        pthread_mutex_lock(&pool->lock);
+        while (pool->stop == FLB_FALSE && pool->queued == 0) {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        }
+        if (pool->stop == FLB_TRUE) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        pool->queued--;
+        pthread_mutex_unlock(&pool->lock);
+
+        /* The reserved job is in some queue, look until it's found */
+        do {
+            job = job_take(w);
+        } while (!job);
+
+        job_run(job, pool->config);
+
+        /* The job belongs to the engine again once it's done */
+        __atomic_store_n(&job->done, FLB_TRUE, __ATOMIC_RELEASE);
+        ret = flb_pipe_w(pool->ch[1], &job->task, sizeof(struct flb_task *));
+        if (ret == -1) {
+            flb_errno();
+        }
+    }
+
+    flb_arena_thread_exit();
+    flb_mp_thread_exit();
+#ifdef FLB_HAVE_REGEX
+    flb_regex_thread_exit();
+#endif
+}
+
+/* Engine loop handler: start the tasks of the input that are ready */
+static int pool_engine_collect(void *data)
+{
+    int ret;
+    struct flb_task *task;
+    struct flb_filter_pool *pool = data;
+
+    ret = flb_pipe_r(pool->ch[0], &task, sizeof(struct flb_task *));
+    if (ret <= 0) {
+        flb_errno();
+        return -1;
+    }
+
+    return flb_engine_dispatch_filtered(task->i_ins, pool->config);
+}
+
+static void pool_destroy(struct flb_filter_pool *pool)
+{
+    int i;
+
+    if (pool->ch[0] != -1) {
+        mk_event_del(pool->config->evl, &pool->event);
+        flb_pipe_destroy(pool->ch);
+    }
+
+    for (i = 0; i < pool->workers; i++) {
+        pthread_mutex_destroy(&pool->w[i].lock);
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->cond);
+    flb_free(pool->w);
+    flb_free(pool);
+}
+
+/*
+ * Start the pool if 'Filter_Workers' is set. It must run before the input
+ * instances start appending records, from there they are not filtered
+ * until their chunk is sealed.
+ */
+int flb_filter_pool_create(struct flb_config *config)
+{
+    int i;
+    int ret;
+    struct flb_filter_pool *pool;
+
+    if (config->filter_workers <= 0 ||
+        mk_list_is_empty(&config->filters) == 0) {
+        return 0;
+    }
+
+#ifdef FLB_HAVE_BUFFERING
+    /* Chunks are stored as they are sealed, they must be filtered already */
+    if (config->buffer_path) {
+        flb_warn("[filter pool] not available with filesystem buffering, "
+                 "filters run in the engine thread");
+        return 0;
+    }
+#endif
+
+    pool = flb_calloc(1, sizeof(struct flb_filter_pool));
+    if (!pool) {
+        flb_errno();
+        return -1;
+    }
+    pool->config = config;
+    pool->ch[0] = -1;
+    pool->ch[1] = -1;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+
+    pool->w = flb_calloc(config->filter_workers,
+                         sizeof(struct flb_filter_worker));
+    if (!pool->w) {
+        flb_errno();
+        pool_destroy(pool);
+        return -1;
+    }
+
+    ret = flb_pipe_create(pool->ch);
+    if (ret == -1) {
+        flb_errno();
+        pool->ch[0] = -1;
+        pool_destroy(pool);
+        return -1;
+    }
+    MK_EVENT_NEW(&pool->event);
+    pool->event.handler = pool_engine_collect;
+    ret = mk_event_add(config->evl, pool->ch[0],
+                       FLB_ENGINE_EV_CUSTOM, MK_EVENT_READ, pool);
+    if (ret == -1) {
+        flb_pipe_destroy(pool->ch);
+        pool->ch[0] = -1;
+        pool_destroy(pool);
+        return -1;
+    }
+
+    for (i = 0; i < config->filter_workers; i++) {
+        pool->w[i].pool = pool;
+        pthread_mutex_init(&pool->w[i].lock, NULL);
+        mk_list_init(&pool->w[i].jobs);
+        pool->workers++;
+
+        ret = flb_worker_create_role(filter_worker, &pool->w[i],
+                                     &pool->w[i].tid, "filter_pool", NULL,
+                                     config);
+        if (ret == -1) {
+            flb_error("[filter pool] could not spawn worker #%i", i);
+            pthread_mutex_destroy(&pool->w[i].lock);
+            pool->workers--;
+            break;
+        }
+    }
+
+    /* Run with the workers that could be started */
+    if (pool->workers == 0) {
+        pool_destroy(pool);
+        return -1;
+    }
+
+    config->filter_pool = pool;
+    flb_info("[filter pool] %i workers started", pool->workers);
+    return 0;
+}
+
+/*
+ * Queue a new task to be filtered. Returns 0 if the task must wait for
+ * the pool, -1 if it can be started right away (no filter for its tag).
+ */
+int flb_filter_pool_submit(struct flb_task *task, struct flb_config *config)
+{
+    int n = 0;
+    struct mk_list *head;
+    struct flb_filter_job tmp;
+    struct flb_filter_job *job;
+    struct flb_filter_worker *w;
+    struct flb_filter_instance *f_ins;
+    struct flb_filter_pool *pool = config->filter_pool;
+    struct flb_router_cache_entry *route;
+
+    route = flb_router_cache_get(task->tag, task->tag_len, config);
+    if (route) {
+        n = route->filters_count;
+    }
+    else {
+        mk_list_foreach(head, &config->filters) {
+            f_ins = mk_list_entry(head, struct flb_filter_instance, _head);
+            if (flb_router_match(task->tag, f_ins->match)) {
+                n++;
+            }
+        }
+    }
+    if (n == 0) {
+        return -1;
+    }
+
+    job = flb_calloc(1, sizeof(struct flb_filter_job));
+    if (!job) {
+        flb_errno();
+
+        /* Filter it in the engine thread */
+        memset(&tmp, '\0', sizeof(tmp));
+        job_init(&tmp, task);
+        job_run(&tmp, config);
+        job_apply(&tmp);
+        return -1;
+    }
+    job_init(job, task);
+    task->filter_job = job;
+
+    w = &pool->w[pool->next];
+    pool->next = (pool->next + 1) % pool->workers;
+
+    pthread_mutex_lock(&w->lock);
+    mk_list_add(&job->_head, &w->jobs);
+    pthread_mutex_unlock(&w->lock);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->queued++;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    return 0;
+}
+
+/* Give the filtered buffer to the task, the job must be done */
+void flb_filter_pool_release(struct flb_task *task)
+{
+    struct flb_filter_job *job = task->filter_job;
+
+    job_apply(job);
+    task->filter_job = NULL;
+    flb_free(job);
+}
+
+void flb_filter_pool_exit(struct flb_config *config)
+{
+    int i;
+    struct mk_list *head;
+    struct mk_list *t_head;
+    struct flb_task *task;
+    struct flb_input_instance *in;
+    struct flb_filter_pool *pool = config->filter_pool;
+
+    if (!pool) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = FLB_TRUE;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->workers; i++) {
+        pthread_join(pool->w[i].tid, NULL);
+    }
+
+    /*
+     * A filtered buffer may have been moved by the filters, it's given to
+     * its task. Jobs never taken leave the task buffer untouched.
+     */
+    mk_list_foreach(head, &config->inputs) {
+        in = mk_list_entry(head, struct flb_input_instance, _head);
+        mk_list_foreach(t_head, &in->tasks) {
+            task = mk_list_entry(t_head, struct flb_task, _head);
+            if (!task->filter_job) {
+                continue;
+            }
+            if (flb_filter_job_done(task->filter_job)) {
+                flb_filter_pool_release(task);
+            }
+            else {
+                flb_free(task->filter_job);
+                task->filter_job = NULL;
+            }
+            task->status = FLB_TASK_NEW;
+        }
+    }
+
+    config->filter_pool = NULL;
+    pool_destroy(pool);
+}
@@ -0,0 +1,340 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_input.h>
+#include <fluent-bit/flb_filter.h>
+#include <fluent-bit/flb_output.h>
+#include <fluent-bit/flb_router.h>
+#include <fluent-bit/flb_mp.h>
+#include <fluent-bit/flb_filter_pushdown.h>
+#ifdef FLB_HAVE_REGEX
+#include <fluent-bit/flb_regex.h>
+#endif
+
+#include <string.h>
+
+void flb_filter_pushdown_init(struct flb_filter_pushdown *pd,
+                              struct flb_input_instance *ins,
+                              char *tag, int tag_len,
+                              char *key, int key_len)
+{
+    memset(pd, '\0', sizeof(struct flb_filter_pushdown));
+    pd->ins = ins;
+    pd->tag = tag;
+    pd->tag_len = tag_len;
+    pd->key = key;
+    pd->key_len = key_len;
+    pd->gen = -1;
+
+    if (!ins->pushdown || !tag || tag_len <= 0) {
+        pd->off = FLB_TRUE;
+    }
+}
+
+void flb_filter_pushdown_destroy(struct flb_filter_pushdown *pd)
+{
+    flb_free(pd->rules);
+    pd->rules = NULL;
+    pd->rules_len = 0;
+    pd->rules_size = 0;
+}
+
+int flb_filter_pushdown_add(struct flb_filter_pushdown *pd,
+                            char *key, int key_len,
+                            struct flb_regex *regex)
+{
+    int size;
+    struct flb_filter_pushdown_rule *tmp;
+    struct flb_filter_pushdown_rule *rule;
+
+    if (pd->rules_len == pd->rules_size) {
+        size = pd->rules_size ? pd->rules_size * 2 : 8;
+        tmp = flb_realloc(pd->rules,
+                          size * sizeof(struct flb_filter_pushdown_rule));
+        if (!tmp) {
+            flb_errno();
+            return -1;
+        }
+        pd->rules = tmp;
+        pd->rules_size = size;
+    }
+
+    rule = &pd->rules[pd->rules_len++];
+    rule->group = pd->group;
+    rule->key = key;
+    rule->key_len = key_len;
+    rule->regex = regex;
+
+    return 0;
+}
+
+/*
+ * Walk the filters chain of the tag, it runs with the chain lock held. The
+ * rules are taken from the filters at the head of the chain, up to the
+ * first one that could modify the records.
+ */
+static void pushdown_resolve(struct flb_filter_pushdown *pd,
+                             struct flb_config *config)
+{
+    int ret;
+    int routes = 0;
+    int pure = FLB_TRUE;
+    struct mk_list *head;
+    struct flb_filter_instance *f_ins;
+    struct flb_output_instance *o_ins;
+
+    pd->rules_len = 0;
+    pd->group = 0;
+    pd->drop = FLB_FALSE;
+
+    mk_list_foreach(head, &config->filters) {
+        f_ins = mk_list_entry(head, struct flb_filter_instance, _head);
+        if (!f_ins->match || !flb_router_match(pd->tag, f_ins->match)) {
+            continue;
+        }
+        if (!f_ins->p->cb_pushdown) {
+            pure = FLB_FALSE;
+            break;
+        }
+
+        /* Rules added before a failure are still a valid prefix */
+        ret = f_ins->p->cb_pushdown(pd, f_ins, f_ins->context);
+        if (ret == -1) {
+            pure = FLB_FALSE;
+            break;
+        }
+        pd->group++;
+    }
+
+    /* Records with no destination are dropped when the task is created */
+    mk_list_foreach(head, &config->outputs) {
+        o_ins = mk_list_entry(head, struct flb_output_instance, _head);
+        if (o_ins->match && flb_router_match(pd->tag, o_ins->match)) {
+            routes++;
+            break;
+        }
+    }
+#ifdef FLB_HAVE_STREAM_PROCESSOR
+    if (mk_list_is_empty(&config->stream_tasks) != 0) {
+        routes++;
+    }
+#endif
+    if (routes == 0 && pure == FLB_TRUE) {
+        pd->drop = FLB_TRUE;
+    }
+
+    pd->gen = config->router_gen;
+    flb_debug("[filter pushdown] %s tag=%s rules=%i drop=%s",
+              pd->ins->name, pd->tag, pd->rules_len,
+              pd->drop ? "yes" : "no");
+}
+
+/*
+ * Evaluate the rules, every group in order: a field without a string value
+ * makes the filter keep the record, the next group decides then.
+ */
+static int pushdown_eval(struct flb_filter_pushdown *pd,
+                         flb_filter_pushdown_get get, void *data)
+{
+    int i;
+    int ret;
+    int group = -1;
+    char *val;
+    size_t val_len;
+    struct flb_filter_pushdown_rule *rule;
+
+    if (pd->drop == FLB_TRUE) {
+        return FLB_TRUE;
+    }
+
+#ifdef FLB_HAVE_REGEX
+    for (i = 0; i < pd->rules_len; i++) {
+        rule = &pd->rules[i];
+        if (rule->group == group) {
+            continue;
+        }
+
+        ret = get(data, rule->key, rule->key_len, &val, &val_len);
+        if (ret == FLB_FALSE) {
+            group = rule->group;
+            continue;
+        }
+        if (flb_regex_match(rule->regex,
+                            (unsigned char *) val, val_len) > 0) {
+            return FLB_TRUE;
+        }
+    }
+#else
+    (void) i;
+    (void) ret;
+    (void) group;
+    (void) val;
+    (void) val_len;
+    (void) rule;
+    (void) get;
+    (void) data;
+#endif
+
+    return FLB_FALSE;
+}
+
+int flb_filter_pushdown_fields(struct flb_filter_pushdown *pd,
+                               flb_filter_pushdown_get get, void *data)
+{
+    int ret;
+    struct flb_config *config;
+
+    if (pd->off == FLB_TRUE) {
+        return FLB_FALSE;
+    }
+
+    config = pd->ins->config;
+
+    /* Nothing to apply: no need to take the lock */
+    if (pd->gen == __atomic_load_n(&config->router_gen, __ATOMIC_RELAXED) &&
+        pd->rules_len == 0 && pd->drop == FLB_FALSE) {
+        return FLB_FALSE;
+    }
+
+    pthread_rwlock_rdlock(&config->filters_lock);
+    if (pd->gen != config->router_gen) {
+        pushdown_resolve(pd, config);
+    }
+    ret = pushdown_eval(pd, get, data);
+    pthread_rwlock_unlock(&config->filters_lock);
+
+#ifdef FLB_HAVE_METRICS
+    if (ret == FLB_TRUE && pd->ins->metrics) {
+        flb_metric_sum(pd->ins->m_drop_records, 1);
+    }
+#endif
+
+    return ret;
+}
+
+/* Fields are unknown, only a tag without destination drops the record */
+static int none_get(void *data, char *key, int key_len,
+                    char **val, size_t *val_len)
+{
+    return FLB_FALSE;
+}
+
+int flb_filter_pushdown_tag(struct flb_filter_pushdown *pd)
+{
+    return flb_filter_pushdown_fields(pd, none_get, NULL);
+}
+
+struct pushdown_line {
+    struct flb_filter_pushdown *pd;
+    char *line;
+    size_t len;
+};
+
+/* The record of a raw line has the line under the key of the context */
+static int line_get(void *data, char *key, int key_len,
+                    char **val, size_t *val_len)
+{
+    struct pushdown_line *l = data;
+
+    if (!l->pd->key || l->pd->key_len != key_len ||
+        memcmp(l->pd->key, key, key_len) != 0) {
+        return FLB_FALSE;
+    }
+
+    *val = l->line;
+    *val_len = l->len;
+    return FLB_TRUE;
+}
+
+int flb_filter_pushdown_line(struct flb_filter_pushdown *pd,
+                             char *line, size_t len)
+{
+    struct pushdown_line l = {pd, line, len};
+
+    return flb_filter_pushdown_fields(pd, line_get, &l);
+}
+
+struct pushdown_pack {
+    char *buf;
+    size_t size;
+};
+
+/* First level field of a serialized map, without unpacking it */
+static int pack_get(void *data, char *key, int key_len,
+                    char **val, size_t *val_len)
+{
+    int ret;
+    uint32_t i;
+    uint32_t count;
+    uint32_t len;
+    size_t hdr;
+    size_t obj;
+    size_t off;
+    const char *str;
+    struct pushdown_pack *p = data;
+
+    ret = flb_mp_map_header(p->buf, p->size, &count, &hdr);
+    if (ret == -1) {
+        return FLB_FALSE;
+    }
+
+    off = hdr;
+    for (i = 0; i < count; i++) {
+        /* key */
+        ret = flb_mp_key(p->buf + off, p->size - off, &str, &len, &obj);
+        if (ret == -1) {
+            if (flb_mp_object_size(p->buf + off, p->size - off, &obj) == -1) {
+                return FLB_FALSE;
+            }
+            off += obj;
+        }
+        else {
+            off += obj;
+            if (len == (uint32_t) key_len && memcmp(str, key, len) == 0) {
+                /* value: a string or a binary */
+                ret = flb_mp_key(p->buf + off, p->size - off,
+                                 &str, &len, &obj);
+                if (ret == -1) {
+                    return FLB_FALSE;
+                }
+                *val = (char *) str;
+                *val_len = len;
+                return FLB_TRUE;
+            }
+        }
+
+        /* value */
+        if (flb_mp_object_size(p->buf + off, p->size - off, &obj) == -1) {
+            return FLB_FALSE;
+        }
+        off += obj;
+    }
+
+    return FLB_FALSE;
+}
+
+int flb_filter_pushdown_pack(struct flb_filter_pushdown *pd,
+                             char *buf, size_t size)
+{
+    struct pushdown_pack p = {buf, size};
+
+    return flb_filter_pushdown_fields(pd, pack_get, &p);
+}
@@ -0,0 +1,375 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_log.h>
+#include <fluent-bit/flb_gzip.h>
+
+/*
+ * Miniz does not write gzip streams: the header and the footer (CRC32 and
+ * size of the input) are written here around a raw deflate stream.
+ */
+
+#define FLB_GZIP_HEADER   10
+#define FLB_GZIP_FOOTER    8
+
+static const unsigned char gzip_header[FLB_GZIP_HEADER] = {
+    0x1f, 0x8b,                /* magic */
+    0x08,                      /* deflate */
+    0x00,                      /* flags */
+    0x00, 0x00, 0x00, 0x00,    /* mtime */
+    0x00,                      /* extra flags */
+    0xff                       /* unknown OS */
+};
+
+static int gzip_grow(struct flb_gzip *gz, size_t min)
+{
+    size_t used;
+    size_t size;
+    char *tmp;
+
+    used = gz->strm.next_out - (unsigned char *) gz->buf;
+    size = gz->size * 2;
+    if (size < used + min) {
+        size = used + min;
+    }
+
+    tmp = flb_realloc(gz->buf, size);
+    if (!tmp) {
+        flb_errno();
+        return -1;
+    }
+
+    gz->buf = tmp;
+    gz->size = size;
+    gz->strm.next_out = (unsigned char *) tmp + used;
+    gz->strm.avail_out = size - used;
+
+    return 0;
+}
+
+int flb_gzip_init(struct flb_gzip *gz, size_t size_hint)
+{
+    int ret;
+
+    memset(gz, '\0', sizeof(struct flb_gzip));
+
+    gz->size = FLB_GZIP_HEADER + FLB_GZIP_FOOTER + size_hint;
+    if (gz->size < 256) {
+        gz->size = 256;
+    }
+    gz->buf = flb_malloc(gz->size);
+    if (!gz->buf) {
+        flb_errno();
+        return -1;
+    }
+    memcpy(gz->buf, gzip_header, FLB_GZIP_HEADER);
+
+    ret = mz_deflateInit2(&gz->strm, MZ_DEFAULT_COMPRESSION, MZ_DEFLATED,
+                          -MZ_DEFAULT_WINDOW_BITS, 9, MZ_DEFAULT_STRATEGY);
+    if (ret != MZ_OK) {
+        flb_free(gz->buf);
+        gz->buf = NULL;
+        return -1;
+    }
+
+    gz->crc = MZ_CRC32_INIT;
+    gz->strm.next_out = (unsigned char *) gz->buf + FLB_GZIP_HEADER;
+    gz->strm.avail_out = gz->size - FLB_GZIP_HEADER;
+
+    return 0;
+}
+
+static int gzip_deflate(struct flb_gzip *gz, int flush)
+{
+    int ret;
+
+    while (1) {
+        if (gz->strm.avail_out == 0 && gzip_grow(gz, 256) == -1) {
+            return -1;
+        }
+
+        ret = mz_deflate(&gz->strm, flush);
+        if (ret == MZ_STREAM_END) {
+            return 0;
+        }
+        else if (ret == MZ_BUF_ERROR) {
+            /* no progress possible: more input or more room is needed */
+            if (flush == MZ_NO_FLUSH) {
+                return 0;
+            }
+            if (gzip_grow(gz, 256) == -1) {
+                return -1;
+            }
+            continue;
+        }
+        else if (ret != MZ_OK) {
+            return -1;
+        }
+
+        if (flush == MZ_NO_FLUSH && gz->strm.avail_in == 0) {
+            return 0;
+        }
+    }
+}
+
+int flb_gzip_write(struct flb_gzip *gz, const void *data, size_t len)
+{
+    if (len == 0) {
+        return 0;
+    }
+
+    gz->crc = mz_crc32(gz->crc, data, len);
+    gz->in_len += len;
+
+    gz->strm.next_in = data;
+    gz->strm.avail_in = len;
+
+    return gzip_deflate(gz, MZ_NO_FLUSH);
+}
+
+int flb_gzip_finish(struct flb_gzip *gz, void **out_data, size_t *out_len)
+{
+    unsigned char *p;
+
+    gz->strm.next_in = NULL;
+    gz->strm.avail_in = 0;
+    if (gzip_deflate(gz, MZ_FINISH) == -1) {
+        return -1;
+    }
+
+    if (gz->strm.avail_out < FLB_GZIP_FOOTER &&
+        gzip_grow(gz, FLB_GZIP_FOOTER) == -1) {
+        return -1;
+    }
+
+    /* Footer: CRC32 and input size modulo 2^32, little endian */
+    p = gz->strm.next_out;
+    p[0] = gz->crc & 0xff;
+    p[1] = (gz->crc >> 8) & 0xff;
+    p[2] = (gz->crc >> 16) & 0xff;
+    p[3] = (gz->crc >> 24) & 0xff;
+    p[4] = gz->in_len & 0xff;
+    p[5] = (gz->in_len >> 8) & 0xff;
+    p[6] = (gz->in_len >> 16) & 0xff;
+    p[7] = (gz->in_len >> 24) & 0xff;
+
+    *out_data = gz->buf;
+    *out_len = (p + FLB_GZIP_FOOTER) - (unsigned char *) gz->buf;
+
+    /* The buffer belongs to the caller now */
+    gz->buf = NULL;
+    mz_deflateEnd(&gz->strm);
+
+    return 0;
+}
+
+void flb_gzip_destroy(struct flb_gzip *gz)
+{
+    if (gz->buf) {
+        mz_deflateEnd(&gz->strm);
+        flb_free(gz->buf);
+        gz->buf = NULL;
+    }
+}
+
+int flb_gzip_compress(void *in_data, size_t in_len,
+                      void **out_data, size_t *out_len)
+{
+    struct flb_gzip gz;
+
+    /* Sized for the worst case, the buffer never grows */
+    if (flb_gzip_init(&gz, mz_deflateBound(NULL, in_len)) == -1) {
+        return -1;
+    }
+
+    if (flb_gzip_write(&gz, in_data, in_len) == -1 ||
+        flb_gzip_finish(&gz, out_data, out_len) == -1) {
+        flb_gzip_destroy(&gz);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Decoder states */
+#define FLB_GUNZIP_HEADER  0
+#define FLB_GUNZIP_BODY    1
+#define FLB_GUNZIP_FOOTER  2
+
+/* Header flags (RFC 1952) */
+#define FLB_GZIP_FHCRC     0x02
+#define FLB_GZIP_FEXTRA    0x04
+#define FLB_GZIP_FNAME     0x08
+#define FLB_GZIP_FCOMMENT  0x10
+
+static inline uint32_t gunzip_le32(const unsigned char *p)
+{
+    return ((uint32_t) p[3] << 24) | ((uint32_t) p[2] << 16) |
+           ((uint32_t) p[1] << 8) | p[0];
+}
+
+/* Skip a member header and start inflating its deflate stream */
+static int gunzip_header(struct flb_gunzip *gz)
+{
+    int flags;
+    size_t off;
+    size_t len = gz->strm.avail_in;
+    const unsigned char *p = gz->strm.next_in;
+
+    if (len < FLB_GZIP_HEADER || p[0] != 0x1f || p[1] != 0x8b || p[2] != 8) {
+        return -1;
+    }
+    flags = p[3];
+    off = FLB_GZIP_HEADER;
+
+    if (flags & FLB_GZIP_FEXTRA) {
+        if (off + 2 > len) {
+            return -1;
+        }
+        off += 2 + (p[off] | (p[off + 1] << 8));
+    }
+    if (flags & FLB_GZIP_FNAME) {
+        while (off < len && p[off] != '\0') {
+            off++;
+        }
+        off++;
+    }
+    if (flags & FLB_GZIP_FCOMMENT) {
+        while (off < len && p[off] != '\0') {
+            off++;
+        }
+        off++;
+    }
+    if (flags & FLB_GZIP_FHCRC) {
+        off += 2;
+    }
+    if (off > len) {
+        return -1;
+    }
+
+    if (gz->inflating == FLB_TRUE) {
+        mz_inflateEnd(&gz->strm);
+        gz->inflating = FLB_FALSE;
+    }
+    if (mz_inflateInit2(&gz->strm, -MZ_DEFAULT_WINDOW_BITS) != MZ_OK) {
+        return -1;
+    }
+    gz->inflating = FLB_TRUE;
+
+    /* inflateInit does not touch the input pointers */
+    gz->strm.next_in = p + off;
+    gz->strm.avail_in = len - off;
+    gz->crc = MZ_CRC32_INIT;
+    gz->out_len = 0;
+    gz->state = FLB_GUNZIP_BODY;
+
+    return 0;
+}
+
+/* Check the CRC32 and size of the member that just ended */
+static int gunzip_footer(struct flb_gunzip *gz)
+{
+    const unsigned char *p = gz->strm.next_in;
+
+    if (gz->strm.avail_in < FLB_GZIP_FOOTER ||
+        gunzip_le32(p) != (uint32_t) gz->crc ||
+        gunzip_le32(p + 4) != (uint32_t) gz->out_len) {
+        return -1;
+    }
+
+    gz->strm.next_in += FLB_GZIP_FOOTER;
+    gz->strm.avail_in -= FLB_GZIP_FOOTER;
+    gz->state = FLB_GUNZIP_HEADER;
+
+    return 0;
+}
+
+int flb_gunzip_init(struct flb_gunzip *gz, const void *data, size_t len)
+{
+    memset(gz, '\0', sizeof(struct flb_gunzip));
+    gz->strm.next_in = data;
+    gz->strm.avail_in = len;
+    gz->state = FLB_GUNZIP_HEADER;
+
+    return 0;
+}
+
+/*
+ * Uncompress up to 'size' bytes into 'buf'. On success 'out_len' is set to
+ * the number of bytes written, zero once the end of the data is reached.
+ * Returns -1 if the data is not valid gzip or it's truncated.
+ */
+int flb_gunzip_read(struct flb_gunzip *gz, void *buf, size_t size,
+                    size_t *out_len)
+{
+    int ret;
+    size_t n;
+    size_t in_len;
+    size_t produced = 0;
+    unsigned char *out = buf;
+
+    while (produced < size) {
+        if (gz->state == FLB_GUNZIP_HEADER) {
+            if (gz->strm.avail_in == 0) {
+                break;
+            }
+            if (gunzip_header(gz) == -1) {
+                return -1;
+            }
+        }
+        else if (gz->state == FLB_GUNZIP_FOOTER) {
+            if (gunzip_footer(gz) == -1) {
+                return -1;
+            }
+        }
+        else {
+            gz->strm.next_out = out + produced;
+            gz->strm.avail_out = size - produced;
+            in_len = gz->strm.avail_in;
+            ret = mz_inflate(&gz->strm, MZ_SYNC_FLUSH);
+
+            n = (size - produced) - gz->strm.avail_out;
+            gz->crc = mz_crc32(gz->crc, out + produced, n);
+            gz->out_len += n;
+            produced += n;
+
+            if (ret == MZ_STREAM_END) {
+                gz->state = FLB_GUNZIP_FOOTER;
+            }
+            else if (ret != MZ_OK ||
+                     (n == 0 && gz->strm.avail_in == in_len)) {
+                /* corrupted or truncated stream */
+                return -1;
+            }
+        }
+    }
+
+    *out_len = produced;
+    return 0;
+}
+
+void flb_gunzip_destroy(struct flb_gunzip *gz)
+{
+    if (gz->inflating == FLB_TRUE) {
+        mz_inflateEnd(&gz->strm);
+        gz->inflating = FLB_FALSE;
+    }
+}
@@ -23,6 +23,10 @@
 #include <fluent-bit/flb_log.h>
 #include <fluent-bit/flb_str.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 /*
  * This hash generation function is taken originally from Redis source code:
  *
@@ -84,28 +88,223 @@ static unsigned int gen_hash(const void *key, int len)
     return (unsigned int) h;
 }
 
-static inline void flb_hash_entry_free(struct flb_hash *ht, struct flb_hash_entry *entry)
+/*
+ * Slot metadata, one byte per slot: the high bit is set for empty and
+ * deleted slots, a full slot stores the low 7 bits of the entry hash.
+ */
+#define CTRL_EMPTY     0x80
+#define CTRL_DELETED   0xfe
+#define GROUP_WIDTH    16
+#define MIN_SLOTS      GROUP_WIDTH
+
+#define h1(hash)       ((hash) >> 7)
+#define h2(hash)       ((uint8_t) ((hash) & 0x7f))
+
+/*
+ * Group operations return a bitmask, bit N refers to the slot 'pos + N'.
+ * The 'ctrl' array is GROUP_WIDTH bytes longer than the table and the
+ * extra bytes mirror the first ones, so a group never wraps.
+ */
+#ifdef __SSE2__
+static inline uint32_t group_match(uint8_t *ctrl, uint8_t b)
+{
+    __m128i g = _mm_loadu_si128((const __m128i *) ctrl);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8((char) b)));
+}
+
+/* Empty or deleted slots, both have the high bit set */
+static inline uint32_t group_match_free(uint8_t *ctrl)
+{
+    return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *) ctrl));
+}
+#else
+static inline uint32_t group_match(uint8_t *ctrl, uint8_t b)
+{
+    int i;
+    uint32_t mask = 0;
+
+    for (i = 0; i < GROUP_WIDTH; i++) {
+        if (ctrl[i] == b) {
+            mask |= (1 << i);
+        }
+    }
+    return mask;
+}
+
+static inline uint32_t group_match_free(uint8_t *ctrl)
+{
+    int i;
+    uint32_t mask = 0;
+
+    for (i = 0; i < GROUP_WIDTH; i++) {
+        if (ctrl[i] & 0x80) {
+            mask |= (1 << i);
+        }
+    }
+    return mask;
+}
+#endif
+
+static inline void set_ctrl(struct flb_hash *ht, size_t i, uint8_t b)
+{
+    size_t mask = ht->size - 1;
+
+    ht->ctrl[i] = b;
+    ht->ctrl[((i - (GROUP_WIDTH - 1)) & mask) + (GROUP_WIDTH - 1)] = b;
+}
+
+static int table_alloc(struct flb_hash *ht, size_t slots)
+{
+    uint8_t *ctrl;
+    struct flb_hash_entry **tmp;
+
+    ctrl = flb_malloc(slots + GROUP_WIDTH);
+    if (!ctrl) {
+        flb_errno();
+        return -1;
+    }
+
+    tmp = flb_calloc(slots, sizeof(struct flb_hash_entry *));
+    if (!tmp) {
+        flb_errno();
+        flb_free(ctrl);
+        return -1;
+    }
+
+    memset(ctrl, CTRL_EMPTY, slots + GROUP_WIDTH);
+    ht->ctrl = ctrl;
+    ht->slots = tmp;
+    ht->size = slots;
+    ht->deleted = 0;
+
+    return 0;
+}
+
+/*
+ * Triangular probing over groups, it visits every group of a power of
+ * two table. Returns the index of the first empty or deleted slot.
+ */
+static size_t find_free_slot(struct flb_hash *ht, uint32_t hash)
+{
+    size_t mask = ht->size - 1;
+    size_t pos = h1(hash) & mask;
+    size_t stride = 0;
+    uint32_t m;
+
+    while (1) {
+        m = group_match_free(ht->ctrl + pos);
+        if (m) {
+            return (pos + __builtin_ctz(m)) & mask;
+        }
+        stride += GROUP_WIDTH;
+        pos = (pos + stride) & mask;
+    }
+}
+
+/* Rebuild the table with 'slots' slots, it drops deleted slots too */
+static int table_resize(struct flb_hash *ht, size_t slots)
+{
+    size_t i;
+    size_t id;
+    size_t old_size = ht->size;
+    uint8_t *old_ctrl = ht->ctrl;
+    struct flb_hash_entry **old_slots = ht->slots;
+    struct flb_hash_entry *entry;
+
+    if (table_alloc(ht, slots) == -1) {
+        return -1;
+    }
+
+    for (i = 0; i < old_size; i++) {
+        if (old_ctrl[i] & 0x80) {
+            continue;
+        }
+        entry = old_slots[i];
+        id = find_free_slot(ht, entry->hash);
+        set_ctrl(ht, id, h2(entry->hash));
+        ht->slots[id] = entry;
+    }
+
+    flb_free(old_ctrl);
+    flb_free(old_slots);
+    return 0;
+}
+
+/*
+ * Keep the load, deleted slots included, under 7/8 so a probe always
+ * finds an empty slot. When most of the load are deleted slots the table
+ * is rebuilt with the same size.
+ */
+static int table_reserve(struct flb_hash *ht)
 {
-    mk_list_del(&entry->_head);
+    size_t slots = ht->size;
+
+    if ((ht->total_count + ht->deleted + 1) * 8 <= ht->size * 7) {
+        return 0;
+    }
+
+    if ((ht->total_count + 1) * 16 > ht->size * 7) {
+        slots *= 2;
+    }
+    return table_resize(ht, slots);
+}
+
+/* Returns the slot of 'key' or -1 */
+static int table_find(struct flb_hash *ht, uint32_t hash,
+                      char *key, int key_len)
+{
+    size_t i;
+    size_t mask = ht->size - 1;
+    size_t pos = h1(hash) & mask;
+    size_t stride = 0;
+    uint32_t m;
+    struct flb_hash_entry *entry;
+
+    while (1) {
+        m = group_match(ht->ctrl + pos, h2(hash));
+        while (m) {
+            i = (pos + __builtin_ctz(m)) & mask;
+            entry = ht->slots[i];
+            if (entry->hash == hash && entry->key_len == key_len &&
+                memcmp(entry->key, key, key_len) == 0) {
+                return i;
+            }
+            m &= m - 1;
+        }
+
+        /* an empty slot ends the probe sequence */
+        if (group_match(ht->ctrl + pos, CTRL_EMPTY)) {
+            return -1;
+        }
+        stride += GROUP_WIDTH;
+        pos = (pos + stride) & mask;
+    }
+}
+
+static void flb_hash_entry_free(struct flb_hash *ht, int id)
+{
+    struct flb_hash_entry *entry = ht->slots[id];
+
+    set_ctrl(ht, id, CTRL_DELETED);
+    ht->slots[id] = NULL;
+    ht->deleted++;
+
     mk_list_del(&entry->_head_parent);
-    entry->table->count--;
     ht->total_count--;
-    flb_free(entry->key);
-    flb_free(entry->val);
+    ht->total_size -= entry->size;
     flb_free(entry);
 }
 
 struct flb_hash *flb_hash_create(int evict_mode, size_t size, int max_entries)
 {
-    int i;
-    struct flb_hash_table *tmp;
+    size_t slots = MIN_SLOTS;
     struct flb_hash *ht;
 
     if (size <= 0) {
         return NULL;
     }
 
-    ht = flb_malloc(sizeof(struct flb_hash));
+    ht = flb_calloc(1, sizeof(struct flb_hash));
     if (!ht) {
         flb_errno();
         return NULL;
@@ -114,152 +313,215 @@ struct flb_hash *flb_hash_create(int evict_mode, size_t size, int max_entries)
     mk_list_init(&ht->entries);
     ht->evict_mode = evict_mode;
     ht->max_entries = max_entries;
-    ht->total_count = 0;
-    ht->size = size;
-    ht->total_count = 0;
-    ht->table = flb_calloc(1, sizeof(struct flb_hash_table) * size);
-    if (!ht->table) {
-        flb_errno();
+
+    /* 'size' is the expected number of entries, the table grows anyway */
+    while (slots * 7 < size * 8) {
+        slots *= 2;
+    }
+    if (table_alloc(ht, slots) == -1) {
         flb_free(ht);
         return NULL;
     }
 
-    /* Initialize chains list head */
-    for (i = 0; i < size; i++) {
-        tmp = &ht->table[i];
-        tmp->count = 0;
-        mk_list_init(&tmp->chains);
-    }
-
     return ht;
 }
 
+/* Limit the memory used by keys, values and entries */
+void flb_hash_set_max_size(struct flb_hash *ht, size_t max_size)
+{
+    ht->max_size = max_size;
+}
+
+/* Entries older than 'ttl' seconds are not returned by flb_hash_get() */
+void flb_hash_set_ttl(struct flb_hash *ht, int ttl)
+{
+    ht->ttl = ttl;
+}
+
 void flb_hash_destroy(struct flb_hash *ht)
 {
-    int i;
     struct mk_list *tmp;
     struct mk_list *head;
     struct flb_hash_entry *entry;
-    struct flb_hash_table *table;
 
-    for (i = 0; i < ht->size; i++) {
-        table = &ht->table[i];
-        mk_list_foreach_safe(head, tmp, &table->chains) {
-            entry = mk_list_entry(head, struct flb_hash_entry, _head);
-            flb_hash_entry_free(ht, entry);
-        }
+    mk_list_foreach_safe(head, tmp, &ht->entries) {
+        entry = mk_list_entry(head, struct flb_hash_entry, _head_parent);
+        flb_free(entry);
     }
 
-    flb_free(ht->table);
+    flb_free(ht->ctrl);
+    flb_free(ht->slots);
     flb_free(ht);
 }
 
-static void flb_hash_evict_random(struct flb_hash *ht)
+static inline int entry_slot(struct flb_hash *ht, struct flb_hash_entry *entry)
+{
+    return table_find(ht, entry->hash, entry->key, entry->key_len);
+}
+
+/* A random slot, then the next full one */
+static int flb_hash_evict_random(struct flb_hash *ht)
+{
+    size_t i;
+    size_t n;
+    size_t mask = ht->size - 1;
+
+    i = random() & mask;
+    for (n = 0; n < ht->size; n++) {
+        if (!(ht->ctrl[i] & 0x80)) {
+            return i;
+        }
+        i = (i + 1) & mask;
+    }
+
+    return -1;
+}
+
+static int flb_hash_evict_less_used(struct flb_hash *ht)
 {
-    int id;
-    int count = 0;
-    struct mk_list *tmp;
     struct mk_list *head;
     struct flb_hash_entry *entry;
+    struct flb_hash_entry *less = NULL;
 
-    id = random() % ht->total_count;
-    mk_list_foreach_safe(head, tmp, &ht->entries) {
-        if (id == count) {
-            entry = mk_list_entry(head, struct flb_hash_entry, _head_parent);
-            flb_hash_entry_free(ht, entry);
+    mk_list_foreach(head, &ht->entries) {
+        entry = mk_list_entry(head, struct flb_hash_entry, _head_parent);
+        if (!less || entry->hits < less->hits) {
+            less = entry;
+        }
+    }
+
+    return entry_slot(ht, less);
+}
+
+/* Remove one entry based on the eviction mode, returns -1 if none was */
+static int flb_hash_evict(struct flb_hash *ht)
+{
+    int id = -1;
+    struct flb_hash_entry *entry;
+
+    if (ht->total_count == 0) {
+        return -1;
+    }
+
+    /* An expired entry goes first whatever the mode is */
+    entry = mk_list_entry_first(&ht->entries, struct flb_hash_entry,
+                                _head_parent);
+    if (ht->ttl > 0 && time(NULL) - entry->created >= ht->ttl) {
+        id = entry_slot(ht, entry);
+    }
+    else {
+        switch (ht->evict_mode) {
+        case FLB_HASH_EVICT_OLDER:
+        case FLB_HASH_EVICT_LRU:
+            /* the oldest entry, or the least recently used one */
+            id = entry_slot(ht, entry);
+            break;
+        case FLB_HASH_EVICT_LESS_USED:
+            id = flb_hash_evict_less_used(ht);
+            break;
+        case FLB_HASH_EVICT_RANDOM:
+            id = flb_hash_evict_random(ht);
             break;
         }
-        count++;
     }
+
+    if (id == -1) {
+        return -1;
+    }
+
+    flb_hash_entry_free(ht, id);
+    ht->evictions++;
+    return 0;
+}
+
+static struct flb_hash_entry *flb_hash_lookup(struct flb_hash *ht,
+                                              char *key, int key_len,
+                                              int *out_id)
+{
+    int id;
+
+    id = table_find(ht, gen_hash(key, key_len), key, key_len);
+    *out_id = id;
+    if (id == -1) {
+        return NULL;
+    }
+
+    return ht->slots[id];
 }
 
 int flb_hash_add(struct flb_hash *ht, char *key, int key_len,
                  char *val, size_t val_size)
 {
     int id;
-    unsigned int hash;
-    struct mk_list *tmp;
-    struct mk_list *head;
+    uint32_t hash;
+    size_t size;
     struct flb_hash_entry *entry;
-    struct flb_hash_entry *old;
-    struct flb_hash_table *table;
 
     if (!key || key_len <= 0 || !val || val_size <= 0) {
         return -1;
     }
 
-    /* Check capacity */
-    if (ht->max_entries > 0 && ht->total_count >= ht->max_entries) {
-        /* FIXME: handle eviction mode */
-        if (ht->evict_mode == FLB_HASH_EVICT_NONE) {
-
-        }
-        else if (ht->evict_mode == FLB_HASH_EVICT_OLDER) {
-
-        }
-        else if (ht->evict_mode == FLB_HASH_EVICT_LESS_USED) {
+    /* A new value for an existing key replaces the entry */
+    hash = gen_hash(key, key_len);
+    id = table_find(ht, hash, key, key_len);
+    if (id != -1) {
+        flb_hash_entry_free(ht, id);
+    }
 
-        }
-        else if (ht->evict_mode == FLB_HASH_EVICT_RANDOM) {
-            flb_hash_evict_random(ht);
+    /*
+     * Check capacity: evict until the new entry fits, an entry bigger than
+     * the memory limit is still stored alone.
+     */
+    size = sizeof(struct flb_hash_entry) + key_len + val_size + 2;
+    if (ht->evict_mode != FLB_HASH_EVICT_NONE) {
+        while ((ht->max_entries > 0 && ht->total_count >= ht->max_entries) ||
+               (ht->max_size > 0 && ht->total_size + size > ht->max_size)) {
+            if (flb_hash_evict(ht) == -1) {
+                break;
+            }
         }
     }
 
-    /* Generate hash number */
-    hash = gen_hash(key, key_len);
-    id = (hash % ht->size);
+    if (table_reserve(ht) == -1) {
+        return -1;
+    }
 
-    /* Allocate the entry */
-    entry = flb_malloc(sizeof(struct flb_hash_entry));
+    /* The entry, key and value share a single memory region */
+    entry = flb_malloc(size);
     if (!entry) {
         flb_errno();
         return -1;
     }
     entry->created = time(NULL);
     entry->hits = 0;
+    entry->hash = hash;
+    entry->size = size;
 
-    /* Store the key and value as a new memory region */
-    entry->key = flb_strdup(key);
+    entry->key = (char *) (entry + 1);
+    memcpy(entry->key, key, key_len);
+    entry->key[key_len] = '\0';
     entry->key_len = key_len;
-    entry->val = flb_malloc(val_size + 1);
-    if (!entry->val) {
-        flb_errno();
-        flb_free(entry->key);
-        flb_free(entry);
-        return -1;
-    }
 
     /*
      * Copy the buffer and append a NULL byte in case the caller set and
      * expects a string.
      */
+    entry->val = entry->key + key_len + 1;
     memcpy(entry->val, val, val_size);
     entry->val[val_size] = '\0';
     entry->val_size = val_size;
 
     /* Link the new entry in our table at the end of the list */
-    table = &ht->table[id];
-    entry->table = table;
-
-    /* Check if the new key already exists */
-    if (table->count == 0) {
-        mk_list_add(&entry->_head, &table->chains);
-        mk_list_add(&entry->_head_parent, &ht->entries);
-    }
-    else {
-        mk_list_foreach_safe(head, tmp, &table->chains) {
-            old = mk_list_entry(head, struct flb_hash_entry, _head);
-            if (strcmp(old->key, entry->key) == 0) {
-                flb_hash_entry_free(ht, old);
-                break;
-            }
-        }
-        mk_list_add(&entry->_head, &table->chains);
-        mk_list_add(&entry->_head_parent, &ht->entries);
+    id = find_free_slot(ht, hash);
+    if (ht->ctrl[id] == CTRL_DELETED) {
+        ht->deleted--;
     }
+    set_ctrl(ht, id, h2(hash));
+    ht->slots[id] = entry;
+    mk_list_add(&entry->_head_parent, &ht->entries);
 
-    table->count++;
     ht->total_count++;
+    ht->total_size += size;
 
     return id;
 }
@@ -268,58 +530,54 @@ int flb_hash_get(struct flb_hash *ht, char *key, int key_len,
                  char **out_buf, size_t *out_size)
 {
     int id;
-    unsigned int hash;
-    struct mk_list *head;
-    struct flb_hash_table *table;
     struct flb_hash_entry *entry;
 
     if (!key || key_len <= 0) {
         return -1;
     }
 
-    hash = gen_hash(key, key_len);
-    id = (hash % ht->size);
-
-    table = &ht->table[id];
-    if (table->count == 0) {
+    entry = flb_hash_lookup(ht, key, key_len, &id);
+    if (!entry) {
+        ht->misses++;
         return -1;
     }
 
-    if (table->count == 1) {
-        entry = mk_list_entry_first(&table->chains,
-                                    struct flb_hash_entry,
-                                    _head);
+    /* Expired entries are kept for flb_hash_get_stale() */
+    if (ht->ttl > 0 && time(NULL) - entry->created >= ht->ttl) {
+        ht->misses++;
+        ht->expired++;
+        return -1;
+    }
 
-        if (strcmp(entry->key, key) != 0) {
-            entry = NULL;
-        }
+    if (ht->evict_mode == FLB_HASH_EVICT_LRU) {
+        mk_list_del(&entry->_head_parent);
+        mk_list_add(&entry->_head_parent, &ht->entries);
     }
-    else {
-        /* Iterate entries */
-        mk_list_foreach(head, &table->chains) {
-            entry = mk_list_entry(head, struct flb_hash_entry, _head);
-            if (entry->key_len != key_len) {
-                entry = NULL;
-                continue;
-            }
 
-            if (strcmp(entry->key, key) == 0) {
-                break;
-            }
+    ht->hits++;
+    entry->hits++;
+    *out_buf = entry->val;
+    *out_size = entry->val_size;
 
-            entry = NULL;
-        }
-    }
+    return id;
+}
 
-    if (!entry) {
+/* Like flb_hash_get() but it also returns expired entries */
+int flb_hash_get_stale(struct flb_hash *ht, char *key, int key_len,
+                       char **out_buf, size_t *out_size)
+{
+    int id;
+    struct flb_hash_entry *entry;
+
+    if (!key || key_len <= 0) {
         return -1;
     }
 
-    if (!entry->val) {
+    entry = flb_hash_lookup(ht, key, key_len, &id);
+    if (!entry) {
         return -1;
     }
 
-    entry->hits++;
     *out_buf = entry->val;
     *out_size = entry->val_size;
 
@@ -327,32 +585,28 @@ int flb_hash_get(struct flb_hash *ht, char *key, int key_len,
 }
 
 /*
- * Get an entry based in the table id. Note that a table id might have multiple
- * entries so the 'key' parameter is required to get an exact match.
+ * Get an entry based in the id returned by flb_hash_add(). The table moves
+ * entries when it grows so the 'key' is required to validate the slot, on
+ * a mismatch it falls back to a regular lookup.
  */
 int flb_hash_get_by_id(struct flb_hash *ht, int id, char *key, char **out_buf,
                        size_t *out_size)
 {
-    struct mk_list *head;
+    int len;
     struct flb_hash_entry *entry = NULL;
-    struct flb_hash_table *table;
 
-    table = &ht->table[id];
-    if (table->count == 0) {
+    if (!key) {
         return -1;
     }
 
-    if (table->count == 1) {
-        entry = mk_list_entry_first(&table->chains,
-                                    struct flb_hash_entry, _head);
+    if (id >= 0 && (size_t) id < ht->size && !(ht->ctrl[id] & 0x80) &&
+        strcmp(ht->slots[id]->key, key) == 0) {
+        entry = ht->slots[id];
     }
     else {
-        mk_list_foreach(head, &table->chains) {
-            entry = mk_list_entry(head, struct flb_hash_entry, _head);
-            if (strcmp(entry->key, key) == 0) {
-                break;
-            }
-            entry = NULL;
+        len = strlen(key);
+        if (len > 0) {
+            entry = flb_hash_lookup(ht, key, len, &id);
         }
     }
 
@@ -370,10 +624,6 @@ int flb_hash_del(struct flb_hash *ht, char *key)
 {
     int id;
     int len;
-    unsigned int hash;
-    struct mk_list *head;
-    struct flb_hash_entry *entry = NULL;
-    struct flb_hash_table *table;
 
     if (!key) {
         return -1;
@@ -384,30 +634,11 @@ int flb_hash_del(struct flb_hash *ht, char *key)
         return -1;
     }
 
-    hash = gen_hash(key, len);
-    id = (hash % ht->size);
-
-    table = &ht->table[id];
-    if (table->count == 1) {
-        entry = mk_list_entry_first(&table->chains,
-                                    struct flb_hash_entry,
-                                    _head);
-    }
-    else {
-        mk_list_foreach(head, &table->chains) {
-            entry = mk_list_entry(head, struct flb_hash_entry, _head);
-            if (strcmp(entry->key, key) == 0) {
-                break;
-            }
-            entry = NULL;
-        }
-    }
-
-    if (!entry) {
+    if (!flb_hash_lookup(ht, key, len, &id)) {
         return -1;
     }
 
-    flb_hash_entry_free(ht, entry);
+    flb_hash_entry_free(ht, id);
 
     return 0;
 }
@@ -0,0 +1,1095 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/*
+ * HTTP/2 client mode of the upstreams: the HTTP client requests of the
+ * flush co-routines become streams of a single connection per event loop.
+ *
+ * The request is built by flb_http_client() as usual, its HTTP/1.1 header
+ * block is converted to a header list when the request is submitted. The
+ * response is stored in the client buffer as a HTTP/1.1 style status line
+ * and headers followed by the body, so the plugins can keep using the
+ * 'resp' fields no matter what protocol was used.
+ *
+ * Cleartext connections use prior knowledge (h2c), TLS connections
+ * negotiate "h2" with ALPN: if the server does not support it the upstream
+ * falls back to HTTP/1.1 and the pending requests are retried.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+
+#include <monkey/mk_core.h>
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_log.h>
+#include <fluent-bit/flb_io.h>
+#include <fluent-bit/flb_io_tls.h>
+#include <fluent-bit/flb_engine.h>
+#include <fluent-bit/flb_output.h>
+#include <fluent-bit/flb_socket.h>
+#include <fluent-bit/flb_upstream.h>
+#include <fluent-bit/flb_http_client.h>
+#include <fluent-bit/flb_http2.h>
+
+/* Socket reads of the session handler */
+#define H2_READ_SIZE   16384
+
+static int h2_handler(void *data);
+static int h2_wake_handler(void *data);
+
+static inline struct mk_event_loop *h2_evl(struct flb_upstream *u)
+{
+    struct mk_event_loop *evl;
+
+    evl = flb_engine_evl_get();
+    if (!evl) {
+        evl = u->evl;
+    }
+
+    return evl;
+}
+
+/* Move a stream to the 'done' list, its co-routine is resumed later */
+static void stream_finish(struct flb_http2_session *s,
+                          struct flb_http2_stream *st, int status)
+{
+    st->status = status;
+    mk_list_del(&st->_head);
+    mk_list_add(&st->_head, &s->done);
+}
+
+/* Append response data to the client buffer, the excess is dropped */
+static void resp_append(struct flb_http_client *c, const char *data,
+                        size_t len)
+{
+    size_t avail;
+    size_t out_size;
+
+    while (1) {
+        avail = flb_http_buffer_available(c);
+        if (avail > len) {
+            break;
+        }
+        if (flb_http_buffer_increase(c, len - avail + FLB_HTTP_DATA_CHUNK,
+                                     &out_size) == -1) {
+            break;
+        }
+    }
+
+    avail = flb_http_buffer_available(c);
+    if (avail <= 1) {
+        return;
+    }
+    if (len > avail - 1) {
+        len = avail - 1;
+    }
+
+    memcpy(c->resp.data + c->resp.data_len, data, len);
+    c->resp.data_len += len;
+    c->resp.data[c->resp.data_len] = '\0';
+}
+
+/*
+ * nghttp2 callbacks: they run in the session handler, or in the co-routine
+ * submitting a request, and fill the client response of each stream.
+ */
+static int cb_on_header(nghttp2_session *ngh, const nghttp2_frame *frame,
+                        const uint8_t *name, size_t namelen,
+                        const uint8_t *value, size_t valuelen,
+                        uint8_t flags, void *user_data)
+{
+    int len;
+    char tmp[32];
+    struct flb_http2_stream *st;
+    struct flb_http_client *c;
+
+    if (frame->hd.type != NGHTTP2_HEADERS) {
+        return 0;
+    }
+
+    st = nghttp2_session_get_stream_user_data(ngh, frame->hd.stream_id);
+    if (!st || !st->c) {
+        return 0;
+    }
+    c = st->c;
+
+    if (namelen == 7 && strncmp((char *) name, ":status", 7) == 0) {
+        /* A new status line, it replaces an informational (1xx) response */
+        c->resp.data_len = 0;
+        c->resp.headers_end = NULL;
+        c->resp.content_length = -1;
+        c->resp.status = atoi((char *) value);
+        len = snprintf(tmp, sizeof(tmp), "HTTP/2 %i\r\n", c->resp.status);
+        resp_append(c, tmp, len);
+        return 0;
+    }
+
+    /* Trailers are not exposed */
+    if (c->resp.headers_end) {
+        return 0;
+    }
+
+    if (namelen == 14 && strncmp((char *) name, "content-length", 14) == 0) {
+        c->resp.content_length = atoi((char *) value);
+    }
+
+    resp_append(c, (char *) name, namelen);
+    resp_append(c, ": ", 2);
+    resp_append(c, (char *) value, valuelen);
+    resp_append(c, "\r\n", 2);
+
+    return 0;
+}
+
+static int cb_on_frame_recv(nghttp2_session *ngh, const nghttp2_frame *frame,
+                            void *user_data)
+{
+    struct flb_http2_stream *st;
+    struct flb_http_client *c;
+
+    if (frame->hd.type != NGHTTP2_HEADERS ||
+        !(frame->hd.flags & NGHTTP2_FLAG_END_HEADERS)) {
+        return 0;
+    }
+
+    st = nghttp2_session_get_stream_user_data(ngh, frame->hd.stream_id);
+    if (!st || !st->c) {
+        return 0;
+    }
+    c = st->c;
+
+    /* End of the final response headers, the body goes after them */
+    if (!c->resp.headers_end && c->resp.status >= 200) {
+        resp_append(c, "\r\n", 2);
+        c->resp.headers_end = c->resp.data + c->resp.data_len;
+    }
+
+    return 0;
+}
+
+static int cb_on_data_chunk_recv(nghttp2_session *ngh, uint8_t flags,
+                                 int32_t stream_id, const uint8_t *data,
+                                 size_t len, void *user_data)
+{
+    struct flb_http2_stream *st;
+
+    st = nghttp2_session_get_stream_user_data(ngh, stream_id);
+    if (!st || !st->c) {
+        return 0;
+    }
+
+    resp_append(st->c, (char *) data, len);
+    return 0;
+}
+
+static int cb_on_stream_close(nghttp2_session *ngh, int32_t stream_id,
+                              uint32_t error_code, void *user_data)
+{
+    struct flb_http2_session *s = user_data;
+    struct flb_http2_stream *st;
+    struct flb_http_client *c;
+
+    st = nghttp2_session_get_stream_user_data(ngh, stream_id);
+    if (!st) {
+        return 0;
+    }
+
+    /* The client was destroyed while the stream was in flight */
+    if (!st->c) {
+        mk_list_del(&st->_head);
+        flb_free(st);
+        return 0;
+    }
+
+    c = st->c;
+    if (error_code != NGHTTP2_NO_ERROR || !c->resp.headers_end) {
+        flb_debug("[http2] %s:%i stream %i closed, error=%u",
+                  s->u_conn.u->tcp_host, s->u_conn.u->tcp_port,
+                  stream_id, error_code);
+        stream_finish(s, st, FLB_HTTP2_STREAM_FAILED);
+        return 0;
+    }
+
+    c->resp.payload = c->resp.headers_end;
+    c->resp.payload_size = (c->resp.data + c->resp.data_len) -
+                           c->resp.headers_end;
+    if (c->resp.content_length == -1) {
+        c->resp.content_length = c->resp.payload_size;
+    }
+    stream_finish(s, st, FLB_HTTP2_STREAM_DONE);
+
+    return 0;
+}
+
+/* Request body provider, it reads from the client buffer */
+static ssize_t cb_body_read(nghttp2_session *ngh, int32_t stream_id,
+                            uint8_t *buf, size_t length, uint32_t *data_flags,
+                            nghttp2_data_source *source, void *user_data)
+{
+    size_t n;
+    struct flb_http2_stream *st;
+
+    st = nghttp2_session_get_stream_user_data(ngh, stream_id);
+    if (!st || !st->c) {
+        /* The body is gone with the client, reset the stream */
+        return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
+    }
+
+    n = st->body_len - st->body_pos;
+    if (n > length) {
+        n = length;
+    }
+    memcpy(buf, st->body + st->body_pos, n);
+    st->body_pos += n;
+
+    if (st->body_pos == st->body_len) {
+        *data_flags |= NGHTTP2_DATA_FLAG_EOF;
+    }
+
+    return n;
+}
+
+static int session_ngh_create(struct flb_http2_session *s)
+{
+    int ret;
+    nghttp2_session_callbacks *cbs;
+    nghttp2_settings_entry settings[] = {
+        {NGHTTP2_SETTINGS_ENABLE_PUSH, 0},
+        {NGHTTP2_SETTINGS_INITIAL_WINDOW_SIZE, FLB_HTTP2_WINDOW_SIZE}
+    };
+
+    ret = nghttp2_session_callbacks_new(&cbs);
+    if (ret != 0) {
+        return -1;
+    }
+    nghttp2_session_callbacks_set_on_header_callback(cbs, cb_on_header);
+    nghttp2_session_callbacks_set_on_frame_recv_callback(cbs,
+                                                         cb_on_frame_recv);
+    nghttp2_session_callbacks_set_on_data_chunk_recv_callback(cbs,
+                                                 cb_on_data_chunk_recv);
+    nghttp2_session_callbacks_set_on_stream_close_callback(cbs,
+                                                       cb_on_stream_close);
+
+    ret = nghttp2_session_client_new(&s->ngh, cbs, s);
+    nghttp2_session_callbacks_del(cbs);
+    if (ret != 0) {
+        s->ngh = NULL;
+        return -1;
+    }
+
+    /* Connection preface: settings and a larger connection window */
+    nghttp2_submit_settings(s->ngh, NGHTTP2_FLAG_NONE, settings,
+                            sizeof(settings) / sizeof(settings[0]));
+    nghttp2_session_set_local_window_size(s->ngh, NGHTTP2_FLAG_NONE, 0,
+                                          FLB_HTTP2_WINDOW_SIZE);
+    return 0;
+}
+
+/* Wake up the session handler so it resumes the completed streams */
+static void session_wake(struct flb_http2_session *s)
+{
+    uint64_t val = 1;
+
+    if (s->wake_pending == FLB_TRUE || mk_list_is_empty(&s->done) == 0) {
+        return;
+    }
+
+    if (flb_pipe_w(s->ch_wake[1], &val, sizeof(val)) == -1) {
+        flb_errno();
+        return;
+    }
+    s->wake_pending = FLB_TRUE;
+}
+
+/*
+ * Drop the connection: all the streams in flight fail. Orphan streams
+ * (their client is gone) are released right away.
+ */
+static void session_close(struct flb_http2_session *s)
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct flb_http2_stream *st;
+    struct flb_upstream_conn *u_conn = &s->u_conn;
+
+    if (u_conn->event.status & MK_EVENT_REGISTERED) {
+        mk_event_del(u_conn->evl, &u_conn->event);
+    }
+    if (u_conn->fd > 0) {
+        flb_socket_close(u_conn->fd);
+        u_conn->fd = -1;
+    }
+#ifdef FLB_HAVE_TLS
+    if (u_conn->tls_session) {
+        flb_tls_session_destroy(u_conn->tls_session);
+        u_conn->tls_session = NULL;
+    }
+#endif
+
+    mk_list_foreach_safe(head, tmp, &s->streams) {
+        st = mk_list_entry(head, struct flb_http2_stream, _head);
+        if (!st->c) {
+            mk_list_del(&st->_head);
+            flb_free(st);
+            continue;
+        }
+        stream_finish(s, st, FLB_HTTP2_STREAM_FAILED);
+    }
+
+    if (s->ngh) {
+        nghttp2_session_del(s->ngh);
+        s->ngh = NULL;
+    }
+
+    s->wbuf_pos = 0;
+    s->wbuf_len = 0;
+    s->status = FLB_HTTP2_IDLE;
+}
+
+/* Returns the bytes written, zero if the socket is full or -1 on error */
+static ssize_t session_write(struct flb_http2_session *s,
+                             const char *buf, size_t len)
+{
+    ssize_t ret;
+
+#ifdef FLB_HAVE_TLS
+    if (s->u_conn.tls_session) {
+        ret = mbedtls_ssl_write(&s->u_conn.tls_session->ssl,
+                                (const unsigned char *) buf, len);
+        if (ret == MBEDTLS_ERR_SSL_WANT_WRITE ||
+            ret == MBEDTLS_ERR_SSL_WANT_READ) {
+            return 0;
+        }
+        if (ret < 0) {
+            return -1;
+        }
+        return ret;
+    }
+#endif
+
+    ret = send(s->u_conn.fd, buf, len, MSG_NOSIGNAL);
+    if (ret == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        }
+        return -1;
+    }
+
+    return ret;
+}
+
+/* Returns the bytes read, zero if there is nothing or -1 on error or EOF */
+static ssize_t session_read(struct flb_http2_session *s, char *buf, size_t len)
+{
+    ssize_t ret;
+
+#ifdef FLB_HAVE_TLS
+    if (s->u_conn.tls_session) {
+        ret = mbedtls_ssl_read(&s->u_conn.tls_session->ssl,
+                               (unsigned char *) buf, len);
+        if (ret == MBEDTLS_ERR_SSL_WANT_READ ||
+            ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+            return 0;
+        }
+        if (ret <= 0) {
+            return -1;
+        }
+        return ret;
+    }
+#endif
+
+    ret = recv(s->u_conn.fd, buf, len, 0);
+    if (ret == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        }
+        return -1;
+    }
+    if (ret == 0) {
+        return -1;
+    }
+
+    return ret;
+}
+
+/* Keep the frames the socket did not take, they go first next time */
+static int session_wbuf_save(struct flb_http2_session *s,
+                             const char *data, size_t len)
+{
+    char *tmp;
+
+    if (len > s->wbuf_size) {
+        tmp = flb_realloc(s->wbuf, len);
+        if (!tmp) {
+            flb_errno();
+            return -1;
+        }
+        s->wbuf = tmp;
+        s->wbuf_size = len;
+    }
+
+    memcpy(s->wbuf, data, len);
+    s->wbuf_pos = 0;
+    s->wbuf_len = len;
+    return 0;
+}
+
+/*
+ * Write the pending frames without blocking. Returns -1 if the connection
+ * failed, otherwise what could not be written stays in 'wbuf'.
+ */
+static int session_flush(struct flb_http2_session *s)
+{
+    ssize_t n;
+    ssize_t ret;
+    const uint8_t *data;
+
+    while (s->wbuf_len > 0) {
+        ret = session_write(s, s->wbuf + s->wbuf_pos,
+                            s->wbuf_len - s->wbuf_pos);
+        if (ret == -1) {
+            return -1;
+        }
+        if (ret == 0) {
+            return 0;
+        }
+        s->wbuf_pos += ret;
+        if (s->wbuf_pos == s->wbuf_len) {
+            s->wbuf_pos = 0;
+            s->wbuf_len = 0;
+        }
+    }
+
+    while (1) {
+        n = nghttp2_session_mem_send(s->ngh, &data);
+        if (n < 0) {
+            flb_error("[http2] %s", nghttp2_strerror(n));
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+
+        ret = session_write(s, (const char *) data, n);
+        if (ret == -1) {
+            return -1;
+        }
+        if (ret < n) {
+            return session_wbuf_save(s, (const char *) data + ret, n - ret);
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Watch the socket while streams are in flight or frames are pending, an
+ * idle connection is left out of the loop.
+ */
+static int session_update(struct flb_http2_session *s)
+{
+    int ret;
+    int mask = 0;
+    struct flb_upstream_conn *u_conn = &s->u_conn;
+
+    if (mk_list_is_empty(&s->streams) != 0) {
+        mask |= MK_EVENT_READ;
+    }
+    if (s->wbuf_len > 0) {
+        mask |= MK_EVENT_READ | MK_EVENT_WRITE;
+    }
+
+    if (mask == 0) {
+        if (u_conn->event.status & MK_EVENT_REGISTERED) {
+            mk_event_del(u_conn->evl, &u_conn->event);
+        }
+        s->ts_idle = time(NULL);
+        return 0;
+    }
+
+    if ((u_conn->event.status & MK_EVENT_REGISTERED) &&
+        u_conn->event.type == FLB_ENGINE_EV_CUSTOM &&
+        u_conn->event.mask == mask) {
+        return 0;
+    }
+
+    u_conn->event.handler = h2_handler;
+    u_conn->event.data = s;
+    ret = mk_event_add(u_conn->evl, u_conn->fd, FLB_ENGINE_EV_CUSTOM,
+                       mask, &u_conn->event);
+    if (ret == -1) {
+        flb_error("[http2] could not register connection event");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Resume the co-routines waiting for a completed stream */
+static void session_resume(struct flb_http2_session *s)
+{
+    struct flb_thread *th;
+    struct flb_http2_stream *st;
+
+    while (mk_list_is_empty(&s->done) != 0) {
+        st = mk_list_entry_first(&s->done, struct flb_http2_stream, _head);
+        mk_list_del(&st->_head);
+        mk_list_init(&st->_head);
+
+        th = st->th;
+        if (th) {
+            st->th = NULL;
+            flb_output_thread_resume(th);
+        }
+    }
+}
+
+/* Connection events: read and process frames, then send what is pending */
+static int h2_handler(void *data)
+{
+    ssize_t n;
+    ssize_t ret;
+    char buf[H2_READ_SIZE];
+    struct mk_event *event = data;
+    struct flb_http2_session *s = event->data;
+    struct flb_upstream *u = s->u_conn.u;
+
+    if (s->status != FLB_HTTP2_READY) {
+        return 0;
+    }
+
+    while (1) {
+        n = session_read(s, buf, sizeof(buf));
+        if (n == 0) {
+            break;
+        }
+        if (n == -1) {
+            flb_debug("[http2] %s:%i connection closed",
+                      u->tcp_host, u->tcp_port);
+            session_close(s);
+            goto resume;
+        }
+
+        ret = nghttp2_session_mem_recv(s->ngh, (const uint8_t *) buf, n);
+        if (ret < 0) {
+            flb_error("[http2] %s:%i %s", u->tcp_host, u->tcp_port,
+                      nghttp2_strerror(ret));
+            session_close(s);
+            goto resume;
+        }
+    }
+
+    if (session_flush(s) == -1) {
+        session_close(s);
+        goto resume;
+    }
+
+    /* The server sent GOAWAY and nothing is left on this connection */
+    if (nghttp2_session_want_read(s->ngh) == 0 &&
+        nghttp2_session_want_write(s->ngh) == 0) {
+        flb_debug("[http2] %s:%i connection finished",
+                  u->tcp_host, u->tcp_port);
+        session_close(s);
+        goto resume;
+    }
+
+    if (session_update(s) == -1) {
+        session_close(s);
+    }
+
+ resume:
+    session_resume(s);
+    return 0;
+}
+
+static int h2_wake_handler(void *data)
+{
+    uint64_t val;
+    struct mk_event *event = data;
+    struct flb_http2_session *s = event->data;
+
+    if (flb_pipe_r(s->ch_wake[0], &val, sizeof(val)) <= 0) {
+        flb_errno();
+    }
+    s->wake_pending = FLB_FALSE;
+
+    session_resume(s);
+    return 0;
+}
+
+/*
+ * Connect the session from the co-routine submitting the first request,
+ * the ones submitted meanwhile just wait.
+ */
+static int session_connect(struct flb_http2_session *s, struct flb_thread *th)
+{
+    int ret;
+    struct flb_upstream_conn *u_conn = &s->u_conn;
+    struct flb_upstream *u = u_conn->u;
+#ifdef FLB_HAVE_TLS
+    const char *alpn;
+#endif
+
+    s->status = FLB_HTTP2_CONNECTING;
+    MK_EVENT_NEW(&u_conn->event);
+
+    ret = flb_io_net_connect(u_conn, th);
+    if (ret == -1) {
+        /* the socket is closed already */
+        u_conn->fd = -1;
+        goto error;
+    }
+
+#ifdef FLB_HAVE_TLS
+    if (u_conn->tls_session) {
+        alpn = mbedtls_ssl_get_alpn_protocol(&u_conn->tls_session->ssl);
+        if (!alpn || strcmp(alpn, "h2") != 0) {
+            flb_warn("[http2] %s:%i did not negotiate HTTP/2, using HTTP/1.1",
+                     u->tcp_host, u->tcp_port);
+            pthread_mutex_lock(&u->mutex_queue);
+            u->http2 = FLB_FALSE;
+            pthread_mutex_unlock(&u->mutex_queue);
+            goto error;
+        }
+    }
+#endif
+
+    flb_debug("[http2] %s:%i connected", u->tcp_host, u->tcp_port);
+    s->status = FLB_HTTP2_READY;
+
+    if (session_flush(s) == -1 || session_update(s) == -1) {
+        goto error;
+    }
+
+    /* sending can close streams too (e.g: a reset one) */
+    session_wake(s);
+    return 0;
+
+ error:
+    session_close(s);
+    session_wake(s);
+    return -1;
+}
+
+/*
+ * Check an idle connection before a new request: it is not watched by the
+ * loop, the server might have closed it or the idle timeout expired. Frames
+ * received meanwhile (e.g: PING) are processed once it's watched again.
+ */
+static int session_is_alive(struct flb_http2_session *s)
+{
+    int ret;
+    char tmp;
+    struct flb_upstream *u = s->u_conn.u;
+
+    if (u->ka_idle_timeout > 0 &&
+        (time(NULL) - s->ts_idle) > u->ka_idle_timeout) {
+        return FLB_FALSE;
+    }
+
+    ret = recv(s->u_conn.fd, &tmp, 1, MSG_PEEK | MSG_DONTWAIT);
+    if (ret == 0 || (ret == -1 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+        return FLB_FALSE;
+    }
+
+    return FLB_TRUE;
+}
+
+/* Build the header list of the request from its HTTP/1.1 header block */
+static int request_headers(struct flb_http_client *c, char *buf,
+                           nghttp2_nv *nv, size_t *nv_len,
+                           char *clen, size_t clen_size)
+{
+    int i;
+    int n = 4;
+    size_t len;
+    char *p;
+    char *end;
+    char *eol;
+    char *sep;
+    char *val;
+    char *method;
+    char *path;
+    char *path_end;
+    char *authority = NULL;
+    size_t authority_len = 0;
+    struct flb_upstream *u = c->u_conn->u;
+
+    memcpy(buf, c->header_buf, c->header_len);
+    p = buf;
+    end = buf + c->header_len;
+
+    /* Request line */
+    eol = memchr(p, '\r', end - p);
+    if (!eol) {
+        return -1;
+    }
+    method = p;
+    sep = memchr(p, ' ', eol - p);
+    if (!sep) {
+        return -1;
+    }
+    path = sep + 1;
+    path_end = memchr(path, ' ', eol - path);
+    if (!path_end) {
+        return -1;
+    }
+
+#define H2_NV(k, k_len, v, v_len)                                        \
+    nv[n].name = (uint8_t *) (k);                                        \
+    nv[n].namelen = (k_len);                                             \
+    nv[n].value = (uint8_t *) (v);                                       \
+    nv[n].valuelen = (v_len);                                            \
+    nv[n].flags = NGHTTP2_NV_FLAG_NONE;                                  \
+    n++
+
+    /* Headers, names go in lower case */
+    p = eol + 2;
+    while (p < end) {
+        eol = memchr(p, '\r', end - p);
+        if (!eol) {
+            eol = end;
+        }
+        sep = memchr(p, ':', eol - p);
+        if (!sep) {
+            p = eol + 2;
+            continue;
+        }
+        len = sep - p;
+        for (i = 0; i < len; i++) {
+            p[i] = tolower(p[i]);
+        }
+        val = sep + 1;
+        while (val < eol && *val == ' ') {
+            val++;
+        }
+
+        if (len == 4 && strncmp(p, "host", 4) == 0) {
+            authority = val;
+            authority_len = eol - val;
+        }
+        else if ((len == 10 && strncmp(p, "connection", 10) == 0) ||
+                 (len == 16 && strncmp(p, "proxy-connection", 16) == 0) ||
+                 (len == 10 && strncmp(p, "keep-alive", 10) == 0) ||
+                 (len == 17 && strncmp(p, "transfer-encoding", 17) == 0) ||
+                 (len == 7 && strncmp(p, "upgrade", 7) == 0)) {
+            /* connection specific, not allowed in HTTP/2 */
+        }
+        else {
+            H2_NV(p, len, val, eol - val);
+        }
+        p = eol + 2;
+    }
+
+    /* A streamed body is complete by now */
+    if (c->flags & FLB_HTTP_CHUNKED) {
+        len = snprintf(clen, clen_size, "%zu", c->chunk_len);
+        H2_NV("content-length", 14, clen, len);
+    }
+
+    if (!authority) {
+        authority = u->tcp_host;
+        authority_len = strlen(u->tcp_host);
+    }
+
+    /* Pseudo headers go first */
+    i = n;
+    n = 0;
+    H2_NV(":method", 7, method, path - method - 1);
+    H2_NV(":scheme", 7, (u->flags & FLB_IO_TLS) ? "https" : "http",
+          (u->flags & FLB_IO_TLS) ? 5 : 4);
+    H2_NV(":authority", 10, authority, authority_len);
+    H2_NV(":path", 5, path, path_end - path);
+#undef H2_NV
+
+    *nv_len = i;
+    return 0;
+}
+
+/*
+ * Submit the request as a new stream. It connects the session if needed,
+ * otherwise the frames are written right away or by the session handler.
+ */
+int flb_http2_send(struct flb_http_client *c, size_t *bytes)
+{
+    int ret;
+    int lines = 0;
+    int32_t id;
+    size_t i;
+    size_t nv_len;
+    char clen[32];
+    char *buf;
+    nghttp2_nv *nv;
+    nghttp2_data_provider prd;
+    struct flb_http2_stream *st;
+    struct flb_upstream_conn *u_conn = c->u_conn;
+    struct flb_upstream *u = u_conn->u;
+    struct flb_http2_session *s = u_conn->h2;
+    struct flb_thread *th = pthread_getspecific(flb_thread_key);
+
+    if (c->h2) {
+        return -1;
+    }
+
+    /* An idle connection could have been closed by the server */
+    if (s->status == FLB_HTTP2_READY && mk_list_is_empty(&s->streams) == 0 &&
+        session_is_alive(s) == FLB_FALSE) {
+        flb_debug("[http2] %s:%i idle connection closed",
+                  u->tcp_host, u->tcp_port);
+        session_close(s);
+    }
+
+    if (!s->ngh && session_ngh_create(s) == -1) {
+        flb_error("[http2] could not create session");
+        return -1;
+    }
+
+    for (i = 0; i < c->header_len; i++) {
+        if (c->header_buf[i] == '\n') {
+            lines++;
+        }
+    }
+
+    st = flb_calloc(1, sizeof(struct flb_http2_stream));
+    buf = flb_malloc(c->header_len);
+    nv = flb_malloc(sizeof(nghttp2_nv) * (lines + 6));
+    if (!st || !buf || !nv) {
+        flb_errno();
+        flb_free(st);
+        flb_free(buf);
+        flb_free(nv);
+        return -1;
+    }
+
+    ret = request_headers(c, buf, nv, &nv_len, clen, sizeof(clen));
+    if (ret == -1) {
+        flb_error("[http2] invalid request headers");
+        flb_free(st);
+        flb_free(buf);
+        flb_free(nv);
+        return -1;
+    }
+
+    st->c = c;
+    st->status = FLB_HTTP2_STREAM_PENDING;
+    if (c->flags & FLB_HTTP_CHUNKED) {
+        st->body = c->chunk_buf;
+        st->body_len = c->chunk_len;
+    }
+    else {
+        st->body = c->body_buf;
+        st->body_len = c->body_len;
+    }
+
+    prd.source.ptr = NULL;
+    prd.read_callback = cb_body_read;
+
+    id = nghttp2_submit_request(s->ngh, NULL, nv, nv_len,
+                                st->body_len > 0 ? &prd : NULL, st);
+    flb_free(buf);
+    flb_free(nv);
+    if (id < 0) {
+        flb_error("[http2] could not submit request: %s",
+                  nghttp2_strerror(id));
+        flb_free(st);
+        return -1;
+    }
+
+    st->id = id;
+    mk_list_add(&st->_head, &s->streams);
+    c->h2 = st;
+
+    if (s->status == FLB_HTTP2_IDLE) {
+        if (session_connect(s, th) == -1) {
+            return -1;
+        }
+    }
+    else if (s->status == FLB_HTTP2_READY) {
+        if (session_flush(s) == -1 || session_update(s) == -1) {
+            session_close(s);
+            session_wake(s);
+            return -1;
+        }
+        session_wake(s);
+    }
+
+    c->bytes_sent = c->header_len + st->body_len;
+    *bytes = c->bytes_sent;
+    return 0;
+}
+
+/* Wait for the response of the stream */
+int flb_http2_recv(struct flb_http_client *c)
+{
+    struct flb_http2_stream *st = c->h2;
+    struct flb_thread *th = pthread_getspecific(flb_thread_key);
+
+    if (!st) {
+        return -1;
+    }
+
+    while (st->status == FLB_HTTP2_STREAM_PENDING) {
+        st->th = th;
+        flb_thread_yield(th, FLB_FALSE);
+    }
+    st->th = NULL;
+
+    if (st->status == FLB_HTTP2_STREAM_FAILED) {
+        flb_error("[http2] request to %s:%i failed",
+                  c->u_conn->u->tcp_host, c->u_conn->u->tcp_port);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Release the stream of the client. A stream still in flight is reset and
+ * stays with the session until nghttp2 closes it.
+ */
+void flb_http2_client_destroy(struct flb_http_client *c)
+{
+    struct flb_http2_stream *st = c->h2;
+    struct flb_http2_session *s = c->u_conn->h2;
+
+    if (!st) {
+        return;
+    }
+    c->h2 = NULL;
+
+    if (st->status == FLB_HTTP2_STREAM_PENDING && s->ngh) {
+        st->c = NULL;
+        nghttp2_submit_rst_stream(s->ngh, NGHTTP2_FLAG_NONE, st->id,
+                                  NGHTTP2_CANCEL);
+        if (s->status == FLB_HTTP2_READY &&
+            (session_flush(s) == -1 || session_update(s) == -1)) {
+            session_close(s);
+        }
+        session_wake(s);
+        return;
+    }
+
+    mk_list_del(&st->_head);
+    flb_free(st);
+}
+
+/* Session of the running event loop, it's created on first use */
+struct flb_upstream_conn *flb_http2_conn_get(struct flb_upstream *u)
+{
+    int ret;
+    struct mk_list *head;
+    struct mk_event_loop *evl;
+    struct flb_http2_session *s = NULL;
+
+    evl = h2_evl(u);
+
+    pthread_mutex_lock(&u->mutex_queue);
+    mk_list_foreach(head, &u->h2_sessions) {
+        s = mk_list_entry(head, struct flb_http2_session, _head);
+        if (s->u_conn.evl == evl) {
+            s->users++;
+            pthread_mutex_unlock(&u->mutex_queue);
+            return &s->u_conn;
+        }
+    }
+    pthread_mutex_unlock(&u->mutex_queue);
+
+    s = flb_calloc(1, sizeof(struct flb_http2_session));
+    if (!s) {
+        flb_errno();
+        return NULL;
+    }
+    s->status = FLB_HTTP2_IDLE;
+    mk_list_init(&s->streams);
+    mk_list_init(&s->done);
+
+    s->u_conn.u = u;
+    s->u_conn.evl = evl;
+    s->u_conn.fd = -1;
+    s->u_conn.recycle = FLB_FALSE;
+    s->u_conn.h2 = s;
+    mk_list_init(&s->u_conn._head);
+    MK_EVENT_NEW(&s->u_conn.event);
+
+    ret = flb_pipe_create(s->ch_wake);
+    if (ret == -1) {
+        flb_errno();
+        flb_free(s);
+        return NULL;
+    }
+    MK_EVENT_NEW(&s->wake_event);
+    s->wake_event.handler = h2_wake_handler;
+    s->wake_event.data = s;
+    ret = mk_event_add(evl, s->ch_wake[0], FLB_ENGINE_EV_CUSTOM,
+                       MK_EVENT_READ, &s->wake_event);
+    if (ret == -1) {
+        flb_pipe_destroy(s->ch_wake);
+        flb_free(s);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&u->mutex_queue);
+    s->users = 1;
+    mk_list_add(&s->_head, &u->h2_sessions);
+    pthread_mutex_unlock(&u->mutex_queue);
+
+    flb_debug("[http2] %s:%i new session", u->tcp_host, u->tcp_port);
+    return &s->u_conn;
+}
+
+int flb_http2_conn_release(struct flb_upstream_conn *u_conn)
+{
+    struct flb_http2_session *s = u_conn->h2;
+    struct flb_upstream *u = u_conn->u;
+
+    pthread_mutex_lock(&u->mutex_queue);
+    s->users--;
+    pthread_mutex_unlock(&u->mutex_queue);
+
+    return 0;
+}
+
+void flb_http2_sessions_destroy(struct flb_upstream *u)
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct flb_http2_stream *st;
+    struct flb_http2_session *s;
+
+    mk_list_foreach_safe(head, tmp, &u->h2_sessions) {
+        s = mk_list_entry(head, struct flb_http2_session, _head);
+        session_close(s);
+
+        /* nobody waits anymore */
+        while (mk_list_is_empty(&s->done) != 0) {
+            st = mk_list_entry_first(&s->done, struct flb_http2_stream, _head);
+            mk_list_del(&st->_head);
+            mk_list_init(&st->_head);
+        }
+
+        mk_event_del(s->u_conn.evl, &s->wake_event);
+        flb_pipe_destroy(s->ch_wake);
+        mk_list_del(&s->_head);
+        flb_free(s->wbuf);
+        flb_free(s);
+    }
+}
@@ -27,6 +27,9 @@
  * - Use upstream connections.
  * - Support 'retry' in case the HTTP server timeouts a connection.
  * - Get return Status, Headers and Body content if found.
+ * - Stream a request body with chunked transfer encoding (FLB_HTTP_CHUNKED).
+ * - Send the request as a HTTP/2 stream when the upstream connection is
+ *   part of a HTTP/2 session (FLB_HTTP2 builds).
  */
 
 #define _GNU_SOURCE
@@ -35,6 +38,7 @@
 #include <fluent-bit/flb_info.h>
 #include <fluent-bit/flb_mem.h>
 #include <fluent-bit/flb_http_client.h>
+#include <fluent-bit/flb_http2.h>
 
 #include <mbedtls/base64.h>
 
@@ -85,6 +89,37 @@ static int header_lookup(struct flb_http_client *c,
     return FLB_HTTP_OK;
 }
 
+/*
+ * Check if the server response allows to keep the connection open, if not
+ * let the upstream know the connection must not be recycled.
+ */
+static void check_connection_close(struct flb_http_client *c)
+{
+    int ret;
+    int len;
+    char *header = NULL;
+
+    /* HTTP/1.0 connections are closed by the server after the response */
+    if (c->flags & FLB_HTTP_10) {
+        flb_upstream_conn_recycle(c->u_conn, FLB_FALSE);
+        return;
+    }
+
+    ret = header_lookup(c, "Connection: ", 12, &header, &len);
+    if (ret != FLB_HTTP_OK) {
+        return;
+    }
+
+    /* The lookup is done in the whole buffer, skip matches in the payload */
+    if (c->resp.headers_end && header > c->resp.headers_end) {
+        return;
+    }
+
+    if (len == 5 && strncasecmp(header, "close", 5) == 0) {
+        flb_upstream_conn_recycle(c->u_conn, FLB_FALSE);
+    }
+}
+
 /* HTTP/1.1: Check if we have a Chunked Transfer Encoding */
 static int check_chunked_encoding(struct flb_http_client *c)
 {
@@ -429,15 +464,14 @@ struct flb_http_client *flb_http_client(struct flb_upstream_conn *u_conn,
     int ret;
     char *buf = NULL;
     char *str_method = NULL;
+    int len;
     char *fmt_plain =                           \
         "%s %s HTTP/1.%i\r\n"
-        "Host: %s:%i\r\n"
-        "Content-Length: %i\r\n";
+        "Host: %s:%i\r\n";
     char *fmt_proxy =                           \
         "%s http://%s:%i/%s HTTP/1.%i\r\n"
         "Host: %s:%i\r\n"
-        "Proxy-Connection: KeepAlive\r\n"
-        "Content-Length: %i\r\n";
+        "Proxy-Connection: KeepAlive\r\n";
 
     struct flb_http_client *c;
     struct flb_upstream *u = u_conn->u;
@@ -471,8 +505,7 @@ struct flb_http_client *flb_http_client(struct flb_upstream_conn *u_conn,
                        uri,
                        flags & FLB_HTTP_10 ? 0 : 1,
                        u->tcp_host,
-                       u->tcp_port,
-                       body_len);
+                       u->tcp_port);
     }
     else {
         ret = snprintf(buf, FLB_HTTP_BUF_SIZE,
@@ -483,8 +516,7 @@ struct flb_http_client *flb_http_client(struct flb_upstream_conn *u_conn,
                        port,
                        "",
                        host,
-                       port,
-                       body_len);
+                       port);
     }
 
     if (ret == -1) {
@@ -493,6 +525,33 @@ struct flb_http_client *flb_http_client(struct flb_upstream_conn *u_conn,
         return NULL;
     }
 
+    if (u_conn->h2) {
+        flags &= ~FLB_HTTP_10;
+        flags |= FLB_HTTP_20;
+    }
+
+    /*
+     * A chunked body (HTTP/1.1 only) is not sized in advance, on HTTP/2 it
+     * is buffered and the length is set when the request is submitted.
+     */
+    if ((flags & FLB_HTTP_CHUNKED) && (flags & FLB_HTTP_20)) {
+        len = 0;
+    }
+    else if ((flags & FLB_HTTP_CHUNKED) && !(flags & FLB_HTTP_10)) {
+        len = snprintf(buf + ret, FLB_HTTP_BUF_SIZE - ret,
+                       "Transfer-Encoding: chunked\r\n");
+    }
+    else {
+        flags &= ~FLB_HTTP_CHUNKED;
+        len = snprintf(buf + ret, FLB_HTTP_BUF_SIZE - ret,
+                       "Content-Length: %i\r\n", (int) body_len);
+    }
+    if (len < 0 || ret + len >= FLB_HTTP_BUF_SIZE) {
+        flb_free(buf);
+        return NULL;
+    }
+    ret += len;
+
     c = flb_calloc(1, sizeof(struct flb_http_client));
     if (!c) {
         flb_free(buf);
@@ -513,7 +572,7 @@ struct flb_http_client *flb_http_client(struct flb_upstream_conn *u_conn,
         c->flags |= FLB_HTTP_11;
     }
 
-    if (body && body_len > 0) {
+    if (body && body_len > 0 && !(flags & FLB_HTTP_CHUNKED)) {
         c->body_buf = body;
         c->body_len = body_len;
     }
@@ -751,54 +810,217 @@ int flb_http_basic_auth(struct flb_http_client *c, char *user, char *passwd)
     return ret;
 }
 
-int flb_http_do(struct flb_http_client *c, size_t *bytes)
+/*
+ * Send data on the connection. The request headers go in front of the first
+ * data sent, header and data take a single vectored write.
+ */
+static int http_send(struct flb_http_client *c, char *data, size_t len)
 {
+    int n = 0;
     int ret;
-    int r_bytes;
     int crlf = 2;
     int new_size;
-    ssize_t available;
-    size_t out_size;
-    size_t bytes_header = 0;
-    size_t bytes_body = 0;
+    size_t bytes = 0;
     char *tmp;
+    struct iovec iov[2];
+
+    if (c->headers_sent == FLB_FALSE) {
+        /* check enough space for the ending CRLF */
+        if (header_available(c, crlf) != 0) {
+            new_size = c->header_size + 2;
+            tmp = flb_realloc(c->header_buf, new_size);
+            if (!tmp) {
+                return -1;
+            }
+            c->header_buf = tmp;
+            c->header_size = new_size;
+        }
 
-    /* check enough space for the ending CRLF */
-    if (header_available(c, crlf) != 0) {
-        new_size = c->header_size + 2;
-        tmp = flb_realloc(c->header_buf, new_size);
+        /* Append the ending header CRLF */
+        c->header_buf[c->header_len++] = '\r';
+        c->header_buf[c->header_len++] = '\n';
+
+        iov[n].iov_base = c->header_buf;
+        iov[n].iov_len = c->header_len;
+        n++;
+        c->headers_sent = FLB_TRUE;
+    }
+
+    if (len > 0) {
+        iov[n].iov_base = data;
+        iov[n].iov_len = len;
+        n++;
+    }
+
+    if (n == 0) {
+        return 0;
+    }
+
+    ret = flb_io_net_writev(c->u_conn, iov, n, &bytes);
+    if (ret == -1) {
+        flb_errno();
+        return -1;
+    }
+
+    c->bytes_sent += bytes;
+    return 0;
+}
+
+/*
+ * Send the buffered data as one chunk: the size line is written right
+ * before the data and the CRLF after it, so it takes a single write. The
+ * last call also appends the zero sized chunk that ends the body.
+ */
+static int http_chunk_send(struct flb_http_client *c, int last)
+{
+    int len;
+    char head[FLB_HTTP_CHUNK_HEAD + 1];
+    char *start;
+    char *end;
+
+    if (!c->chunk_buf) {
+        /* nothing was written: just the last chunk */
+        return http_send(c, "0\r\n\r\n", 5);
+    }
+
+    start = c->chunk_buf + FLB_HTTP_CHUNK_HEAD;
+    end = start + c->chunk_len;
+
+    if (c->chunk_len > 0) {
+        len = snprintf(head, sizeof(head), "%zx\r\n", c->chunk_len);
+        start -= len;
+        memcpy(start, head, len);
+        memcpy(end, "\r\n", 2);
+        end += 2;
+    }
+    if (last == FLB_TRUE) {
+        memcpy(end, "0\r\n\r\n", 5);
+        end += 5;
+    }
+
+    c->chunk_len = 0;
+    return http_send(c, start, end - start);
+}
+
+/* HTTP/2: the whole body is buffered, it goes out with the stream */
+static int http2_body_write(struct flb_http_client *c, const void *data,
+                            size_t len)
+{
+    size_t size;
+    char *tmp;
+
+    if (c->chunk_len + len > c->chunk_size) {
+        size = c->chunk_size > 0 ? c->chunk_size : FLB_HTTP_DATA_CHUNK;
+        while (size < c->chunk_len + len) {
+            size *= 2;
+        }
+        tmp = flb_realloc(c->chunk_buf, size);
         if (!tmp) {
+            flb_errno();
             return -1;
         }
-        c->header_buf = tmp;
-        c->header_len = new_size;
+        c->chunk_buf = tmp;
+        c->chunk_size = size;
     }
 
-    /* Append the ending header CRLF */
-    c->header_buf[c->header_len++] = '\r';
-    c->header_buf[c->header_len++] = '\n';
+    memcpy(c->chunk_buf + c->chunk_len, data, len);
+    c->chunk_len += len;
+    return 0;
+}
 
-    /* Write the header */
-    ret = flb_io_net_write(c->u_conn,
-                           c->header_buf, c->header_len,
-                           &bytes_header);
-    if (ret == -1) {
-        flb_errno();
+/*
+ * Append data to a chunked request body. The data goes out in chunks of
+ * FLB_HTTP_DATA_CHUNK bytes, the first one along with the headers, the
+ * body is completed by flb_http_do().
+ */
+int flb_http_body_write(struct flb_http_client *c, const void *data,
+                        size_t len)
+{
+    size_t n;
+    const char *p = data;
+
+    if (!(c->flags & FLB_HTTP_CHUNKED)) {
         return -1;
     }
 
-    if (c->body_len > 0) {
-        ret = flb_io_net_write(c->u_conn,
-                               c->body_buf, c->body_len,
-                               &bytes_body);
-        if (ret == -1) {
+    if (c->flags & FLB_HTTP_20) {
+        return http2_body_write(c, data, len);
+    }
+
+    if (!c->chunk_buf) {
+        c->chunk_buf = flb_malloc(FLB_HTTP_CHUNK_HEAD + FLB_HTTP_DATA_CHUNK +
+                                  FLB_HTTP_CHUNK_TAIL);
+        if (!c->chunk_buf) {
             flb_errno();
             return -1;
         }
+        c->chunk_len = 0;
+    }
+
+    while (len > 0) {
+        n = FLB_HTTP_DATA_CHUNK - c->chunk_len;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(c->chunk_buf + FLB_HTTP_CHUNK_HEAD + c->chunk_len, p, n);
+        c->chunk_len += n;
+        p += n;
+        len -= n;
+
+        if (c->chunk_len == FLB_HTTP_DATA_CHUNK &&
+            http_chunk_send(c, FLB_FALSE) == -1) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Send the request without waiting for the response. A caller holding
+ * several connections sends all its requests first so the server handles
+ * them at the same time, then reads each response with flb_http_recv().
+ */
+int flb_http_send(struct flb_http_client *c, size_t *bytes)
+{
+    int ret;
+
+#ifdef FLB_HAVE_HTTP2
+    if (c->flags & FLB_HTTP_20) {
+        return flb_http2_send(c, bytes);
+    }
+#endif
+
+    if (c->flags & FLB_HTTP_CHUNKED) {
+        /* Pending data and the last chunk */
+        ret = http_chunk_send(c, FLB_TRUE);
+    }
+    else {
+        /* Header and body */
+        ret = http_send(c, c->body_buf, c->body_len);
+    }
+    if (ret == -1) {
+        return -1;
     }
 
     /* number of sent bytes */
-    *bytes = (bytes_header + bytes_body);
+    *bytes = c->bytes_sent;
+    return 0;
+}
+
+/* Read the response of a request sent with flb_http_send() */
+int flb_http_recv(struct flb_http_client *c)
+{
+    int ret;
+    int r_bytes;
+    ssize_t available;
+    size_t out_size;
+
+#ifdef FLB_HAVE_HTTP2
+    if (c->flags & FLB_HTTP_20) {
+        return flb_http2_recv(c);
+    }
+#endif
 
     /* Read the server response, we need at least 19 bytes */
     c->resp.data_len = 0;
@@ -814,8 +1036,10 @@ int flb_http_do(struct flb_http_client *c, size_t *bytes)
             if (ret == -1) {
                 /*
                  * We could not allocate more space, let the caller handle
-                 * this.
+                 * this. Pending data might still be in the socket, so the
+                 * connection cannot be recycled.
                  */
+                flb_upstream_conn_recycle(c->u_conn, FLB_FALSE);
                 return 0;
             }
             available = flb_http_buffer_available(c) - 1;
@@ -837,9 +1061,11 @@ int flb_http_do(struct flb_http_client *c, size_t *bytes)
 
             ret = process_data(c);
             if (ret == FLB_HTTP_ERROR) {
+                flb_upstream_conn_recycle(c->u_conn, FLB_FALSE);
                 return -1;
             }
             else if (ret == FLB_HTTP_OK) {
+                check_connection_close(c);
                 break;
             }
             else if (ret == FLB_HTTP_MORE) {
@@ -856,8 +1082,21 @@ int flb_http_do(struct flb_http_client *c, size_t *bytes)
     return 0;
 }
 
+int flb_http_do(struct flb_http_client *c, size_t *bytes)
+{
+    if (flb_http_send(c, bytes) == -1) {
+        return -1;
+    }
+
+    return flb_http_recv(c);
+}
+
 void flb_http_client_destroy(struct flb_http_client *c)
 {
+#ifdef FLB_HAVE_HTTP2
+    flb_http2_client_destroy(c);
+#endif
+    flb_free(c->chunk_buf);
     flb_free(c->resp.data);
     flb_free(c->header_buf);
     flb_free(c);
@@ -22,15 +22,23 @@
 #include <monkey/mk_core.h>
 #include <fluent-bit/flb_info.h>
 #include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_mem_pool.h>
 #include <fluent-bit/flb_str.h>
 #include <fluent-bit/flb_env.h>
 #include <fluent-bit/flb_pipe.h>
 #include <fluent-bit/flb_macros.h>
 #include <fluent-bit/flb_input.h>
+#include <fluent-bit/flb_input_runner.h>
+#include <fluent-bit/flb_output.h>
 #include <fluent-bit/flb_error.h>
 #include <fluent-bit/flb_utils.h>
 #include <fluent-bit/flb_engine.h>
+#include <fluent-bit/flb_engine_dispatch.h>
 #include <fluent-bit/flb_metrics.h>
+#include <fluent-bit/flb_time.h>
+#include <fluent-bit/flb_tag.h>
+#include <fluent-bit/flb_worker.h>
+#include <fluent-bit/flb_scheduler.h>
 
 #define protcmp(a, b)  strncasecmp(a, b, strlen(a))
 
@@ -87,9 +95,9 @@ static int collector_id(struct flb_input_instance *in)
 struct flb_input_instance *flb_input_new(struct flb_config *config,
                                          char *input, void *data)
 {
+    int i;
     int id;
     int ret;
-    struct mk_list *head;
     struct flb_input_plugin *plugin;
     struct flb_input_instance *instance = NULL;
 
@@ -97,8 +105,8 @@ struct flb_input_instance *flb_input_new(struct flb_config *config,
         return NULL;
     }
 
-    mk_list_foreach(head, &config->in_plugins) {
-        plugin = mk_list_entry(head, struct flb_input_plugin, _head);
+    for (i = 0; flb_in_plugins[i]; i++) {
+        plugin = flb_in_plugins[i];
         if (!check_protocol(plugin->name, input)) {
             plugin = NULL;
             continue;
@@ -126,6 +134,9 @@ struct flb_input_instance *flb_input_new(struct flb_config *config,
         instance->context  = NULL;
         instance->data     = data;
         instance->threaded = FLB_FALSE;
+        instance->run_threaded = FLB_FALSE;
+        instance->runner   = NULL;
+        instance->cpus     = NULL;
 
         /* net */
         instance->host.name    = NULL;
@@ -133,21 +144,18 @@ struct flb_input_instance *flb_input_new(struct flb_config *config,
         instance->host.uri     = NULL;
         instance->host.ipv6    = FLB_FALSE;
 
-        /* Initialize msgpack counter and buffers */
-        instance->mp_records = 0;
+        /* Initialize msgpack index and buffers */
+        flb_chunk_index_init(&instance->mp_index);
         msgpack_sbuffer_init(&instance->mp_sbuf);
         msgpack_packer_init(&instance->mp_pck, &instance->mp_sbuf,
-                            msgpack_sbuffer_write);
-        instance->mp_zone = msgpack_zone_new(MSGPACK_ZONE_CHUNK_SIZE);
-        if (!instance->mp_zone) {
-            flb_free(instance);
-            return NULL;
-        }
+                            flb_mem_pool_sbuffer_write);
 
         /* Initialize list heads */
         mk_list_init(&instance->routes);
         mk_list_init(&instance->tasks);
         mk_list_init(&instance->dyntags);
+        mk_list_init(&instance->emit_queue);
+        pthread_mutex_init(&instance->emit_lock, NULL);
         mk_list_init(&instance->properties);
         mk_list_init(&instance->collectors);
         mk_list_init(&instance->threads);
@@ -167,8 +175,21 @@ struct flb_input_instance *flb_input_new(struct flb_config *config,
         }
 
         instance->mp_total_buf_size = 0;
+        instance->mp_tasks_size = 0;
+        instance->mem_paused = FLB_FALSE;
+        instance->queue_paused = FLB_FALSE;
+        instance->rate_paused = FLB_FALSE;
+        memset(&instance->rate, '\0', sizeof(struct flb_input_rate));
+        instance->rate.burst = 1;
+        instance->priority = FLB_PRIORITY_NORMAL;
         instance->mp_buf_limit = 0;
+        instance->coro_stack_size = FLB_THREAD_STACK_SIZE;
+        instance->flush_bytes = 0;
+        instance->flush_records = 0;
+        instance->time_precision = FLB_TIME_PRECISE;
         instance->mp_buf_status = FLB_INPUT_RUNNING;
+        instance->pushdown = FLB_TRUE;
+        instance->shard = -1;
 
         /* Metrics */
 #ifdef FLB_HAVE_METRICS
@@ -176,9 +197,23 @@ struct flb_input_instance *flb_input_new(struct flb_config *config,
         if (instance->metrics) {
             flb_metrics_add(FLB_METRIC_N_RECORDS, "records", instance->metrics);
             flb_metrics_add(FLB_METRIC_N_BYTES, "bytes", instance->metrics);
+            flb_metrics_add(FLB_METRIC_N_DROPPED, "drop_records",
+                            instance->metrics);
+            instance->m_records = flb_metrics_get_id(FLB_METRIC_N_RECORDS,
+                                                     instance->metrics);
+            instance->m_bytes = flb_metrics_get_id(FLB_METRIC_N_BYTES,
+                                                   instance->metrics);
+            instance->m_drop_records = flb_metrics_get_id(FLB_METRIC_N_DROPPED,
+                                                          instance->metrics);
+            if (!instance->m_records || !instance->m_bytes ||
+                !instance->m_drop_records) {
+                flb_metrics_destroy(instance->metrics);
+                instance->metrics = NULL;
+            }
         }
 #endif
         mk_list_add(&instance->_head, &config->inputs);
+        break;
     }
 
     return instance;
@@ -227,6 +262,107 @@ int flb_input_set_property(struct flb_input_instance *in, char *k, char *v)
         }
         in->mp_buf_limit = (size_t) limit;
     }
+    else if (prop_key_check("flush_bytes", k, len) == 0 && tmp) {
+        limit = flb_utils_size_to_bytes(tmp);
+        flb_free(tmp);
+        if (limit == -1) {
+            return -1;
+        }
+        in->flush_bytes = (size_t) limit;
+    }
+    else if (prop_key_check("flush_records", k, len) == 0 && tmp) {
+        in->flush_records = atoi(tmp);
+        flb_free(tmp);
+        if (in->flush_records < 0) {
+            flb_error("[config] %s invalid flush_records", in->name);
+            return -1;
+        }
+    }
+    else if (prop_key_check("rate_limit.records", k, len) == 0 && tmp) {
+        in->rate.records = atof(tmp);
+        flb_free(tmp);
+        if (in->rate.records < 0) {
+            flb_error("[config] %s invalid rate_limit.records", in->name);
+            return -1;
+        }
+    }
+    else if (prop_key_check("rate_limit.bytes", k, len) == 0 && tmp) {
+        limit = flb_utils_size_to_bytes(tmp);
+        flb_free(tmp);
+        if (limit == -1) {
+            return -1;
+        }
+        in->rate.bytes = (double) limit;
+    }
+    else if (prop_key_check("rate_limit.burst", k, len) == 0 && tmp) {
+        in->rate.burst = atof(tmp);
+        flb_free(tmp);
+        if (in->rate.burst <= 0) {
+            flb_error("[config] %s invalid rate_limit.burst", in->name);
+            return -1;
+        }
+    }
+    else if (prop_key_check("priority", k, len) == 0 && tmp) {
+        in->priority = flb_priority_parse(tmp);
+        flb_free(tmp);
+        if (in->priority == -1) {
+            flb_error("[config] %s invalid priority, expected 'low', "
+                      "'normal' or 'high'", in->name);
+            return -1;
+        }
+    }
+    else if (prop_key_check("time_precision", k, len) == 0 && tmp) {
+        in->time_precision = flb_time_precision(tmp);
+        flb_free(tmp);
+        if (in->time_precision == -1) {
+            flb_error("[config] %s invalid time_precision, expected "
+                      "'precise', 'coarse' or 'loop'", in->name);
+            return -1;
+        }
+    }
+    else if (prop_key_check("coro_stack_size", k, len) == 0 && tmp) {
+        limit = flb_utils_size_to_bytes(tmp);
+        flb_free(tmp);
+        if (limit == -1) {
+            return -1;
+        }
+        if (limit < FLB_THREAD_STACK_MIN) {
+            flb_warn("[config] %s coro_stack_size too small, using %i bytes",
+                     in->name, FLB_THREAD_STACK_MIN);
+            limit = FLB_THREAD_STACK_MIN;
+        }
+        in->coro_stack_size = (size_t) limit;
+    }
+    else if (prop_key_check("cpu_affinity", k, len) == 0 && tmp) {
+        flb_worker_cpus_destroy(in->cpus);
+        in->cpus = flb_worker_cpus_create(tmp);
+        flb_free(tmp);
+        if (!in->cpus) {
+            return -1;
+        }
+    }
+    else if (prop_key_check("threaded", k, len) == 0 && tmp) {
+        in->run_threaded = flb_utils_bool(tmp);
+        flb_free(tmp);
+        if (in->run_threaded == -1) {
+            return -1;
+        }
+    }
+    else if (prop_key_check("pushdown", k, len) == 0 && tmp) {
+        in->pushdown = flb_utils_bool(tmp);
+        flb_free(tmp);
+        if (in->pushdown == -1) {
+            return -1;
+        }
+    }
+    else if (prop_key_check("shard", k, len) == 0 && tmp) {
+        in->shard = atoi(tmp);
+        flb_free(tmp);
+        if (in->shard < 0) {
+            flb_error("[config] %s invalid shard", in->name);
+            return -1;
+        }
+    }
     else if (prop_key_check("listen", k, len) == 0) {
         in->host.listen = tmp;
     }
@@ -266,14 +402,71 @@ char *flb_input_get_property(char *key, struct flb_input_instance *i)
     return flb_config_prop_get(key, &i->properties);
 }
 
+/*
+ * Initialize an input instance, on failure the instance is removed and
+ * released. Components creating their own input instances once the engine
+ * is starting (e.g: the instance where a filter emits records) call it
+ * after flb_input_new().
+ */
+int flb_input_instance_init(struct flb_input_instance *in,
+                            struct flb_config *config)
+{
+    int ret;
+    uint64_t start;
+    struct flb_input_plugin *p = in->p;
+
+    if (!p->cb_init) {
+        return 0;
+    }
+
+    /* Sanity check: all non-dynamic tag input plugins must have a tag */
+    if (!in->tag && ((p->flags & FLB_INPUT_DYN_TAG) == 0)) {
+        flb_input_set_property(in, "tag", in->name);
+    }
+
+    /* The collectors must be registered in the runner loop */
+    if (in->run_threaded == FLB_TRUE) {
+        if (p->flags & FLB_INPUT_RUNNER) {
+            in->runner = flb_input_runner_create(in);
+        }
+        if (!in->runner) {
+            flb_warn("[input] %s cannot run in its own thread, "
+                     "using the engine thread", in->name);
+        }
+    }
+
+    start = flb_time_usec();
+    ret = p->cb_init(in, config, in->data);
+    flb_debug("[input %s] initialized in %.1f ms", in->name,
+              (flb_time_usec() - start) / 1000.0);
+    if (ret != 0) {
+        flb_error("Failed initialize input %s",
+                  in->name);
+        if (in->runner) {
+            flb_input_runner_destroy(in->runner);
+        }
+        mk_list_del(&in->_head);
+        if (p->flags & FLB_INPUT_NET) {
+            flb_free(in->tag);
+            flb_free(in->host.uri);
+            flb_free(in->host.name);
+            flb_free(in->host.address);
+        }
+        flb_worker_cpus_destroy(in->cpus);
+        pthread_mutex_destroy(&in->emit_lock);
+        flb_free(in);
+        return -1;
+    }
+
+    return 0;
+}
+
 /* Initialize all inputs */
 void flb_input_initialize_all(struct flb_config *config)
 {
-    int ret;
     struct mk_list *tmp;
     struct mk_list *head;
     struct flb_input_instance *in;
-    struct flb_input_plugin *p;
 
     /* Initialize thread-id table */
     memset(&config->in_table_id, '\0', sizeof(config->in_table_id));
@@ -281,34 +474,14 @@ void flb_input_initialize_all(struct flb_config *config)
     /* Iterate all active input instance plugins */
     mk_list_foreach_safe(head, tmp, &config->inputs) {
         in = mk_list_entry(head, struct flb_input_instance, _head);
-        p = in->p;
 
         /* Skip pseudo input plugins */
-        if (!p) {
+        if (!in->p) {
             continue;
         }
 
         /* Initialize the input */
-        if (p->cb_init) {
-            /* Sanity check: all non-dynamic tag input plugins must have a tag */
-            if (!in->tag && ((p->flags & FLB_INPUT_DYN_TAG) == 0)) {
-                flb_input_set_property(in, "tag", in->name);
-            }
-
-            ret = p->cb_init(in, config, in->data);
-            if (ret != 0) {
-                flb_error("Failed initialize input %s",
-                          in->name);
-                mk_list_del(&in->_head);
-                if (p->flags & FLB_INPUT_NET) {
-                    flb_free(in->tag);
-                    flb_free(in->host.uri);
-                    flb_free(in->host.name);
-                    flb_free(in->host.address);
-                }
-                flb_free(in);
-            }
-        }
+        flb_input_instance_init(in, config);
     }
 }
 
@@ -332,6 +505,30 @@ void flb_input_pre_run_all(struct flb_config *config)
     }
 }
 
+/* Records queued by flb_input_dyntag_emit(), the buffers follow it */
+struct input_emit {
+    int records;
+    int tag_len;
+    char *tag;
+    char *buf;
+    size_t size;
+    struct mk_list _head;
+};
+
+static void emit_queue_destroy(struct flb_input_instance *in)
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct input_emit *e;
+
+    mk_list_foreach_safe(head, tmp, &in->emit_queue) {
+        e = mk_list_entry(head, struct input_emit, _head);
+        mk_list_del(&e->_head);
+        flb_free(e);
+    }
+    pthread_mutex_destroy(&in->emit_lock);
+}
+
 /* Invoke all exit input callbacks */
 void flb_input_exit_all(struct flb_config *config)
 {
@@ -351,6 +548,16 @@ void flb_input_exit_all(struct flb_config *config)
             continue;
         }
 
+        if (in->rate_paused == FLB_TRUE) {
+            flb_sched_timer_cb_cancel(config, in);
+        }
+
+        /* Collectors of a threaded instance must be stopped first */
+        if (in->runner) {
+            flb_input_runner_destroy(in->runner);
+            in->runner = NULL;
+        }
+
         if (p->cb_exit) {
             p->cb_exit(in->context, config);
         }
@@ -362,9 +569,9 @@ void flb_input_exit_all(struct flb_config *config)
         flb_free(in->host.name);
         flb_free(in->host.address);
 
-        /* Destroy buffer */
-        msgpack_sbuffer_destroy(&in->mp_sbuf);
-        msgpack_zone_free(in->mp_zone);
+        /* Destroy buffer, it can be a block of the memory pool */
+        flb_free(in->mp_sbuf.data);
+        flb_chunk_index_invalidate(&in->mp_index);
 
         /* release the tag if any */
         flb_free(in->tag);
@@ -384,6 +591,8 @@ void flb_input_exit_all(struct flb_config *config)
         }
 
         flb_input_dyntag_exit(in);
+        emit_queue_destroy(in);
+        flb_worker_cpus_destroy(in->cpus);
 
         /* Remove metrics */
 #ifdef FLB_HAVE_METRICS
@@ -474,6 +683,7 @@ int flb_input_set_collector_time(struct flb_input_instance *in,
     collector->nanoseconds = nanoseconds;
     collector->instance    = in;
     collector->running     = FLB_FALSE;
+    collector->rate_held   = FLB_FALSE;
     MK_EVENT_NEW(&collector->event);
     mk_list_add(&collector->_head, &config->collectors);
     mk_list_add(&collector->_head_ins, &in->collectors);
@@ -499,6 +709,7 @@ int flb_input_set_collector_event(struct flb_input_instance *in,
     collector->nanoseconds = -1;
     collector->instance    = in;
     collector->running     = FLB_FALSE;
+    collector->rate_held   = FLB_FALSE;
     MK_EVENT_NEW(&collector->event);
     mk_list_add(&collector->_head, &config->collectors);
     mk_list_add(&collector->_head_ins, &in->collectors);
@@ -506,6 +717,15 @@ int flb_input_set_collector_event(struct flb_input_instance *in,
     return collector->id;
 }
 
+/* Event loop of the collectors of an instance */
+static inline struct mk_event_loop *collector_evl(struct flb_input_instance *in)
+{
+    if (in->runner) {
+        return in->runner->evl;
+    }
+    return in->config->evl;
+}
+
 static int collector_start(struct flb_input_collector *coll,
                            struct flb_config *config)
 {
@@ -519,7 +739,7 @@ static int collector_start(struct flb_input_collector *coll,
     }
 
     event = &coll->event;
-    evl = config->evl;
+    evl = collector_evl(coll->instance);
 
     if (coll->type == FLB_COLLECT_TIME) {
         event->mask = MK_EVENT_EMPTY;
@@ -580,6 +800,7 @@ int flb_input_collector_start(int coll_id, struct flb_input_instance *in)
 int flb_input_collectors_start(struct flb_config *config)
 {
     struct mk_list *head;
+    struct flb_input_instance *in;
     struct flb_input_collector *collector;
 
     /* For each Collector, register the event into the main loop */
@@ -588,6 +809,14 @@ int flb_input_collectors_start(struct flb_config *config)
         collector_start(collector, config);
     }
 
+    /* Threaded instances: their collectors are ready, spawn the runners */
+    mk_list_foreach(head, &config->inputs) {
+        in = mk_list_entry(head, struct flb_input_instance, _head);
+        if (in->runner) {
+            flb_input_runner_start(in->runner);
+        }
+    }
+
     return 0;
 }
 
@@ -619,6 +848,30 @@ int flb_input_collector_running(int coll_id, struct flb_input_instance *in)
     return coll->running;
 }
 
+/*
+ * Notify the plugin it cannot append more data, the callback of a threaded
+ * instance runs in its runner thread.
+ */
+void flb_input_plugin_pause(struct flb_input_instance *in)
+{
+    if (in->runner) {
+        flb_input_runner_pause(in->runner);
+    }
+    else if (in->p && in->p->cb_pause) {
+        in->p->cb_pause(in->context, in->config);
+    }
+}
+
+void flb_input_plugin_resume(struct flb_input_instance *in)
+{
+    if (in->runner) {
+        flb_input_runner_resume(in->runner);
+    }
+    else if (in->p && in->p->cb_resume) {
+        in->p->cb_resume(in->context, in->config);
+    }
+}
+
 int flb_input_pause_all(struct flb_config *config)
 {
     int paused = 0;
@@ -629,9 +882,7 @@ int flb_input_pause_all(struct flb_config *config)
         in = mk_list_entry(head, struct flb_input_instance, _head);
         flb_info("[input] pausing %s", in->name);
         if (flb_input_buf_paused(in) == FLB_FALSE) {
-            if (in->p->cb_pause) {
-                in->p->cb_pause(in->context, in->config);
-            }
+            flb_input_plugin_pause(in);
             paused++;
         }
         in->mp_buf_status = FLB_INPUT_PAUSED;
@@ -640,10 +891,341 @@ int flb_input_pause_all(struct flb_config *config)
     return paused;
 }
 
+/* Memory used by an input instance from the global budget perspective */
+static inline size_t mem_usage(struct flb_input_instance *in)
+{
+    return in->mp_total_buf_size + in->mp_tasks_size;
+}
+
+/*
+ * The global memory budget (Mem_Total_Limit) is over: pause the instances
+ * that use more than their fair share of the budget, starting with the
+ * largest consumers, until the remaining ones fit in the limit. Instances
+ * below the fair share are kept running so a single noisy input cannot
+ * starve the others. Returns the number of paused instances.
+ */
+int flb_input_mem_pause(struct flb_config *config)
+{
+    int n = 0;
+    int paused = 0;
+    size_t share;
+    size_t total;
+    struct mk_list *head;
+    struct flb_input_instance *in;
+    struct flb_input_instance *top;
+
+    if (config->mem_total_limit == 0) {
+        return 0;
+    }
+
+    n = mk_list_size(&config->inputs);
+    if (n == 0) {
+        return 0;
+    }
+    share = config->mem_total_limit / n;
+
+    /* Usage of the instances that are still able to append data */
+    total = config->mem_total;
+    mk_list_foreach(head, &config->inputs) {
+        in = mk_list_entry(head, struct flb_input_instance, _head);
+        if (flb_input_buf_paused(in) == FLB_TRUE) {
+            total -= mem_usage(in);
+        }
+    }
+
+    while (total >= config->mem_total_limit) {
+        top = NULL;
+        mk_list_foreach(head, &config->inputs) {
+            in = mk_list_entry(head, struct flb_input_instance, _head);
+            if (flb_input_buf_paused(in) == FLB_TRUE ||
+                mem_usage(in) < share) {
+                continue;
+            }
+            if (!top || mem_usage(in) > mem_usage(top)) {
+                top = in;
+            }
+        }
+
+        if (!top) {
+            break;
+        }
+
+        flb_debug("[input] %s paused (mem total limit, usage=%lu share=%lu)",
+                  top->name, (unsigned long) mem_usage(top),
+                  (unsigned long) share);
+        flb_input_plugin_pause(top);
+        top->mp_buf_status = FLB_INPUT_PAUSED;
+        top->mem_paused = FLB_TRUE;
+        config->mem_paused++;
+        paused++;
+
+        total -= mem_usage(top);
+    }
+
+    return paused;
+}
+
+/*
+ * Memory usage is back under the global limit: resume the instances paused
+ * by the budget, unless their own Mem_Buf_Limit still holds them.
+ */
+int flb_input_mem_resume(struct flb_config *config)
+{
+    int resumed = 0;
+    struct mk_list *head;
+    struct flb_input_instance *in;
+
+    mk_list_foreach(head, &config->inputs) {
+        in = mk_list_entry(head, struct flb_input_instance, _head);
+        if (in->mem_paused == FLB_FALSE) {
+            continue;
+        }
+
+        in->mem_paused = FLB_FALSE;
+        config->mem_paused--;
+
+        if (flb_input_buf_overlimit(in) == FLB_TRUE ||
+            in->queue_paused == FLB_TRUE ||
+            in->rate_paused == FLB_TRUE ||
+            config->is_running == FLB_FALSE) {
+            continue;
+        }
+
+        in->mp_buf_status = FLB_INPUT_RUNNING;
+        flb_input_plugin_resume(in);
+        flb_debug("[input] %s resume (mem total limit)", in->name);
+        resumed++;
+    }
+
+    return resumed;
+}
+
+/* An output instance cannot take more tasks, stop ingesting data */
+void flb_input_queue_pause(struct flb_input_instance *in)
+{
+    if (in->queue_paused == FLB_TRUE) {
+        return;
+    }
+
+    in->queue_paused = FLB_TRUE;
+    if (!flb_input_buf_paused(in)) {
+        flb_input_plugin_pause(in);
+        in->mp_buf_status = FLB_INPUT_PAUSED;
+    }
+    flb_debug("[input] %s paused (output inflight queue full)", in->name);
+}
+
+/* Does a full output inflight queue hold a task of the instance ? */
+static int queue_holds(struct flb_input_instance *in,
+                       struct flb_config *config)
+{
+    struct mk_list *head;
+    struct mk_list *r_head;
+    struct flb_task_route *route;
+    struct flb_output_instance *o_ins;
+
+    mk_list_foreach(head, &config->outputs) {
+        o_ins = mk_list_entry(head, struct flb_output_instance, _head);
+        if (o_ins->inflight_full == FLB_FALSE) {
+            continue;
+        }
+        /* Routes are queued in the class of their input */
+        mk_list_foreach(r_head, &o_ins->inflight_queue.lists[in->priority]) {
+            route = mk_list_entry(r_head, struct flb_task_route, _head_pending);
+            if (route->task->i_ins == in) {
+                return FLB_TRUE;
+            }
+        }
+    }
+
+    return FLB_FALSE;
+}
+
+/*
+ * An output inflight queue drained: resume the instances that no full
+ * queue holds anymore, unless their memory limits still hold them.
+ */
+int flb_input_queue_resume(struct flb_config *config)
+{
+    int resumed = 0;
+    struct mk_list *head;
+    struct flb_input_instance *in;
+
+    mk_list_foreach(head, &config->inputs) {
+        in = mk_list_entry(head, struct flb_input_instance, _head);
+        if (in->queue_paused == FLB_FALSE || queue_holds(in, config)) {
+            continue;
+        }
+
+        in->queue_paused = FLB_FALSE;
+        if (flb_input_buf_overlimit(in) == FLB_TRUE ||
+            in->mem_paused == FLB_TRUE ||
+            in->rate_paused == FLB_TRUE ||
+            config->is_running == FLB_FALSE) {
+            continue;
+        }
+
+        in->mp_buf_status = FLB_INPUT_RUNNING;
+        flb_input_plugin_resume(in);
+        flb_debug("[input] %s resume (output inflight queue)", in->name);
+        resumed++;
+    }
+
+    return resumed;
+}
+
+/* Refill the token buckets with the time elapsed since the last refill */
+static void rate_refill(struct flb_input_rate *rate)
+{
+    double sec;
+    uint64_t now;
+
+    now = flb_time_usec();
+    if (rate->last == 0) {
+        /* First data of the instance: start with full buckets */
+        sec = rate->burst;
+    }
+    else {
+        sec = (now - rate->last) / 1000000.0;
+    }
+    rate->last = now;
+
+    if (rate->records > 0) {
+        rate->tk_records += sec * rate->records;
+        if (rate->tk_records > rate->records * rate->burst) {
+            rate->tk_records = rate->records * rate->burst;
+        }
+    }
+    if (rate->bytes > 0) {
+        rate->tk_bytes += sec * rate->bytes;
+        if (rate->tk_bytes > rate->bytes * rate->burst) {
+            rate->tk_bytes = rate->bytes * rate->burst;
+        }
+    }
+}
+
+/* Milliseconds until the buckets are out of debt, zero if they are not */
+static int rate_wait(struct flb_input_rate *rate)
+{
+    double sec = 0;
+
+    if (rate->records > 0 && rate->tk_records < 0) {
+        sec = -rate->tk_records / rate->records;
+    }
+    if (rate->bytes > 0 && rate->tk_bytes < 0 &&
+        -rate->tk_bytes / rate->bytes > sec) {
+        sec = -rate->tk_bytes / rate->bytes;
+    }
+    if (sec <= 0) {
+        return 0;
+    }
+
+    return (int) (sec * 1000) + 1;
+}
+
+/*
+ * Stop or restart the collectors of an instance that cannot be told to stop
+ * appending data: without it, the records generated while it's paused would
+ * be discarded. Only the collectors that were running are restarted.
+ */
+static void rate_collectors(struct flb_input_instance *in, int hold)
+{
+    struct mk_list *head;
+    struct flb_input_collector *coll;
+
+    if (in->runner || in->p->cb_pause) {
+        return;
+    }
+
+    mk_list_foreach(head, &in->collectors) {
+        coll = mk_list_entry(head, struct flb_input_collector, _head_ins);
+        if (hold == FLB_TRUE && coll->running == FLB_TRUE) {
+            if (flb_input_collector_pause(coll->id, in) == 0) {
+                coll->rate_held = FLB_TRUE;
+            }
+        }
+        else if (hold == FLB_FALSE && coll->rate_held == FLB_TRUE) {
+            coll->rate_held = FLB_FALSE;
+            flb_input_collector_resume(coll->id, in);
+        }
+    }
+}
+
+static void rate_resume(struct flb_input_instance *in)
+{
+    in->rate_paused = FLB_FALSE;
+    rate_collectors(in, FLB_FALSE);
+
+    if (flb_input_buf_overlimit(in) == FLB_TRUE ||
+        in->mem_paused == FLB_TRUE ||
+        in->queue_paused == FLB_TRUE ||
+        in->config->is_running == FLB_FALSE) {
+        return;
+    }
+
+    in->mp_buf_status = FLB_INPUT_RUNNING;
+    flb_input_plugin_resume(in);
+    flb_debug("[input] %s resume (rate limit)", in->name);
+}
+
+static void cb_rate_refill(struct flb_config *config, void *data)
+{
+    int ms;
+    struct flb_input_instance *in = data;
+
+    rate_refill(&in->rate);
+    ms = rate_wait(&in->rate);
+    if (ms > 0 &&
+        flb_sched_timer_cb_create(config, ms, cb_rate_refill, in) == 0) {
+        return;
+    }
+
+    rate_resume(in);
+}
+
+/*
+ * Take the tokens of data accepted by the instance from its rate limit. The
+ * data is never discarded: once the buckets are in debt the instance is
+ * paused until the refill pays it back.
+ */
+void flb_input_rate_consume(struct flb_input_instance *in,
+                            char *buf, size_t bytes, int records)
+{
+    int ms;
+    struct flb_input_rate *rate = &in->rate;
+
+    rate_refill(rate);
+    if (rate->records > 0) {
+        if (records < 0) {
+            records = flb_mp_count(buf, bytes);
+        }
+        rate->tk_records -= records;
+    }
+    rate->tk_bytes -= bytes;
+
+    ms = rate_wait(rate);
+    if (ms == 0 || in->rate_paused == FLB_TRUE) {
+        return;
+    }
+
+    if (flb_sched_timer_cb_create(in->config, ms, cb_rate_refill, in) != 0) {
+        flb_error("[input] %s cannot schedule the rate limit refill",
+                  in->name);
+        return;
+    }
+
+    in->rate_paused = FLB_TRUE;
+    if (!flb_input_buf_paused(in)) {
+        flb_input_plugin_pause(in);
+        in->mp_buf_status = FLB_INPUT_PAUSED;
+    }
+    rate_collectors(in, FLB_TRUE);
+    flb_debug("[input] %s paused (rate limit) for %i ms", in->name, ms);
+}
+
 int flb_input_collector_pause(int coll_id, struct flb_input_instance *in)
 {
     int ret;
-    struct flb_config *config;
     struct flb_input_collector *coll;
 
     coll = get_collector(coll_id, in);
@@ -651,19 +1233,18 @@ int flb_input_collector_pause(int coll_id, struct flb_input_instance *in)
         return -1;
     }
 
-    config = in->config;
     if (coll->type == FLB_COLLECT_TIME) {
         /*
          * For a collector time, it's better to just remove the file
          * descriptor associated to the time out, when resumed a new
          * one can be created.
          */
-        mk_event_timeout_destroy(config->evl, &coll->event);
+        mk_event_timeout_destroy(collector_evl(in), &coll->event);
         close(coll->fd_timer);
         coll->fd_timer = -1;
     }
     else if (coll->type & (FLB_COLLECT_FD_SERVER | FLB_COLLECT_FD_EVENT)) {
-        ret = mk_event_del(config->evl, &coll->event);
+        ret = mk_event_del(collector_evl(in), &coll->event);
         if (ret != 0) {
             flb_warn("[input] cannot disable event for %s", in->name);
             return -1;
@@ -680,7 +1261,6 @@ int flb_input_collector_resume(int coll_id, struct flb_input_instance *in)
     int fd;
     int ret;
     struct flb_input_collector *coll;
-    struct flb_config *config;
     struct mk_event *event;
 
     coll = get_collector(coll_id, in);
@@ -694,13 +1274,12 @@ int flb_input_collector_resume(int coll_id, struct flb_input_instance *in)
         return -1;
     }
 
-    config = in->config;
     event = &coll->event;
 
     if (coll->type == FLB_COLLECT_TIME) {
         event->mask = MK_EVENT_EMPTY;
         event->status = MK_EVENT_NONE;
-        fd = mk_event_timeout_create(config->evl, coll->seconds,
+        fd = mk_event_timeout_create(collector_evl(in), coll->seconds,
                                      coll->nanoseconds, event);
         if (fd == -1) {
             flb_error("[input collector] resume COLLECT_TIME failed");
@@ -713,7 +1292,7 @@ int flb_input_collector_resume(int coll_id, struct flb_input_instance *in)
         event->mask   = MK_EVENT_EMPTY;
         event->status = MK_EVENT_NONE;
 
-        ret = mk_event_add(config->evl,
+        ret = mk_event_add(collector_evl(in),
                            coll->fd_event,
                            FLB_ENGINE_EV_CORE,
                            MK_EVENT_READ, event);
@@ -746,6 +1325,7 @@ int flb_input_set_collector_socket(struct flb_input_instance *in,
     collector->nanoseconds = -1;
     collector->instance    = in;
     collector->running     = FLB_FALSE;
+    collector->rate_held   = FLB_FALSE;
     MK_EVENT_NEW(&collector->event);
     mk_list_add(&collector->_head, &config->collectors);
     mk_list_add(&collector->_head_ins, &in->collectors);
@@ -770,18 +1350,24 @@ struct flb_input_dyntag *flb_input_dyntag_create(struct flb_input_instance *in,
     }
     dt->busy = FLB_FALSE;
     dt->lock = FLB_FALSE;
+    flb_chunk_index_init(&dt->mp_index);
+    dt->mp_buf_write_records = -1;
     dt->in   = in;
-    dt->tag  = flb_malloc(tag_len + 1);
-    memcpy(dt->tag, tag, tag_len);
-    dt->tag[tag_len] = '\0';
+    dt->itag = flb_tag_get(in->config, tag, tag_len);
+    if (!dt->itag) {
+        flb_free(dt);
+        return NULL;
+    }
+    dt->tag  = dt->itag->name;
     dt->tag_len = tag_len;
 
     /* Initialize MessagePack fields */
     msgpack_sbuffer_init(&dt->mp_sbuf);
-    msgpack_packer_init(&dt->mp_pck, &dt->mp_sbuf, msgpack_sbuffer_write);
+    msgpack_packer_init(&dt->mp_pck, &dt->mp_sbuf, flb_mem_pool_sbuffer_write);
 
-    /* Link to the list head */
+    /* Link to the list head and to the tag index */
     mk_list_add(&dt->_head, &in->dyntags);
+    mk_list_add(&dt->_head_tag, &dt->itag->dyntags);
     return dt;
 }
 
@@ -791,9 +1377,11 @@ int flb_input_dyntag_destroy(struct flb_input_dyntag *dt)
     flb_debug("[dyntag %s] %p destroy (tag=%s, bytes=%lu)",
               dt->in->name, dt, dt->tag, dt->mp_sbuf.size);
 
-    msgpack_sbuffer_destroy(&dt->mp_sbuf);
+    flb_free(dt->mp_sbuf.data);
+    flb_chunk_index_invalidate(&dt->mp_index);
     mk_list_del(&dt->_head);
-    flb_free(dt->tag);
+    mk_list_del(&dt->_head_tag);
+    flb_tag_release(dt->in->config, dt->itag);
     flb_free(dt);
 
     return 0;
@@ -816,26 +1404,24 @@ struct flb_input_dyntag *flb_input_dyntag_get(char *tag, size_t tag_len,
 
 {
     struct mk_list *head;
+    struct flb_tag *itag;
     struct flb_input_dyntag *dt = NULL;
 
-    /* Try to find a current dyntag node to append the data */
-    mk_list_foreach(head, &in->dyntags) {
-        dt = mk_list_entry(head, struct flb_input_dyntag, _head);
-        if (dt->busy == FLB_TRUE || dt->lock == FLB_TRUE) {
-            dt = NULL;
-            continue;
-        }
-
-        if (dt->tag_len != tag_len) {
-            dt = NULL;
-            continue;
-        }
-
-        if (strncmp(dt->tag, tag, tag_len) != 0) {
-            dt = NULL;
-            continue;
+    /*
+     * Try to find a current dyntag node to append the data. Every dyntag
+     * is linked to its interned tag, if the tag is not interned there is
+     * no dyntag for it. Only the dyntags of the same tag are visited.
+     */
+    itag = flb_tag_lookup(in->config, tag, tag_len);
+    if (itag) {
+        mk_list_foreach(head, &itag->dyntags) {
+            dt = mk_list_entry(head, struct flb_input_dyntag, _head_tag);
+            if (dt->in != in || dt->busy == FLB_TRUE || dt->lock == FLB_TRUE) {
+                dt = NULL;
+                continue;
+            }
+            break;
         }
-        break;
     }
 
     /* No dyntag was found, we need to create a new one */
@@ -865,18 +1451,26 @@ int flb_input_dyntag_append_obj(struct flb_input_instance *in,
     msgpack_pack_object(&dt->mp_pck, data);
     flb_input_dbuf_write_end(dt);
 
-    /* Lock buffers where size > 2MB */
-    if (dt->mp_sbuf.size > 2048000) {
+    /* Seal full buffers, no more data can be appended */
+    if (flb_input_chunk_full(in, dt->mp_sbuf.size,
+                             dt->mp_index.records) == FLB_TRUE) {
         dt->lock = FLB_TRUE;
+        flb_input_chunk_seal(in, dt);
     }
 
     return 0;
 }
 
-/* Append a RAW MessagPack buffer to the input instance */
-int flb_input_dyntag_append_raw(struct flb_input_instance *in,
-                                char *tag, size_t tag_len,
-                                void *buf, size_t buf_size)
+/*
+ * Append a RAW MessagPack buffer to the input instance. When the caller
+ * already knows the number of records in the buffer (e.g. it validated
+ * them) it passes 'records' so they are not unpacked again to count them,
+ * otherwise it's -1.
+ */
+static int dyntag_append(struct flb_input_instance *in,
+                         char *tag, size_t tag_len,
+                         void *buf, size_t buf_size,
+                         int records, int filtered)
 {
     struct flb_input_dyntag *dt;
 
@@ -887,20 +1481,120 @@ int flb_input_dyntag_append_raw(struct flb_input_instance *in,
 
     /* Mark buf write */
     flb_input_dbuf_write_start(dt);
+    dt->mp_buf_write_records = records;
+    dt->mp_buf_write_filtered = filtered;
 
-    msgpack_sbuffer_write(&dt->mp_sbuf, buf, buf_size);
+    flb_mem_pool_sbuffer_write(&dt->mp_sbuf, buf, buf_size);
 
     /* Unmark buf write */
     flb_input_dbuf_write_end(dt);
 
-    /* Lock buffers where size > 2MB */
-    if (dt->mp_sbuf.size > 2048000) {
+    /* Seal full buffers, no more data can be appended */
+    if (flb_input_chunk_full(in, dt->mp_sbuf.size,
+                             dt->mp_index.records) == FLB_TRUE) {
         dt->lock = FLB_TRUE;
+        flb_input_chunk_seal(in, dt);
     }
 
     return 0;
 }
 
+int flb_input_dyntag_append_records(struct flb_input_instance *in,
+                                    char *tag, size_t tag_len,
+                                    void *buf, size_t buf_size, int records)
+{
+    return dyntag_append(in, tag, tag_len, buf, buf_size,
+                         records, FLB_FALSE);
+}
+
+/*
+ * Append records that already went through the filters chain in another
+ * thread (see flb_filter_do_threaded()), 'records' is the number of records
+ * before filtering.
+ */
+int flb_input_dyntag_append_filtered(struct flb_input_instance *in,
+                                     char *tag, size_t tag_len,
+                                     void *buf, size_t buf_size, int records)
+{
+    return dyntag_append(in, tag, tag_len, buf, buf_size,
+                         records, FLB_TRUE);
+}
+
+int flb_input_dyntag_append_raw(struct flb_input_instance *in,
+                                char *tag, size_t tag_len,
+                                void *buf, size_t buf_size)
+{
+    return flb_input_dyntag_append_records(in, tag, tag_len,
+                                           buf, buf_size, -1);
+}
+
+/*
+ * Append records that skip the filters from any thread. Dyntag buffers
+ * belong to the engine thread: records emitted by another thread (e.g. a
+ * filter running in the filters pool or in an input worker) are copied to
+ * the queue of the instance and appended when the engine dispatches it.
+ */
+int flb_input_dyntag_emit(struct flb_input_instance *in,
+                          char *tag, size_t tag_len,
+                          void *buf, size_t buf_size, int records)
+{
+    struct input_emit *e;
+
+    if (flb_engine_evl_get() == in->config->evl) {
+        return flb_input_dyntag_append_filtered(in, tag, tag_len,
+                                                buf, buf_size, records);
+    }
+
+    e = flb_malloc(sizeof(struct input_emit) + tag_len + buf_size);
+    if (!e) {
+        flb_errno();
+        return -1;
+    }
+    e->records = records;
+    e->tag_len = tag_len;
+    e->tag = (char *) (e + 1);
+    e->buf = e->tag + tag_len;
+    e->size = buf_size;
+    memcpy(e->tag, tag, tag_len);
+    memcpy(e->buf, buf, buf_size);
+
+    pthread_mutex_lock(&in->emit_lock);
+    mk_list_add(&e->_head, &in->emit_queue);
+    pthread_mutex_unlock(&in->emit_lock);
+
+    return 0;
+}
+
+/* Append the records emitted from other threads, engine thread only */
+int flb_input_emit_flush(struct flb_input_instance *in)
+{
+    int c = 0;
+    struct mk_list queue;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct input_emit *e;
+
+    mk_list_init(&queue);
+    pthread_mutex_lock(&in->emit_lock);
+    mk_list_foreach_safe(head, tmp, &in->emit_queue) {
+        e = mk_list_entry(head, struct input_emit, _head);
+        mk_list_del(&e->_head);
+        mk_list_add(&e->_head, &queue);
+    }
+    pthread_mutex_unlock(&in->emit_lock);
+
+    mk_list_foreach_safe(head, tmp, &queue) {
+        e = mk_list_entry(head, struct input_emit, _head);
+        flb_input_dyntag_append_filtered(in, e->tag, e->tag_len,
+                                         e->buf, e->size, e->records);
+        mk_list_del(&e->_head);
+        flb_free(e);
+        c++;
+    }
+
+    return c;
+}
+
 /* Flush a buffer from an input instance (new since v0.11) */
 void *flb_input_flush(struct flb_input_instance *i_ins, size_t *size)
 {
@@ -911,23 +1605,64 @@ void *flb_input_flush(struct flb_input_instance *i_ins, size_t *size)
         return NULL;
     }
 
-    /* Allocate buffer */
-    buf = flb_malloc(i_ins->mp_sbuf.size);
-    if (!buf) {
-        flb_errno();
-        return NULL;
+    /*
+     * Take the buffer from msgpack-c, the caller owns it now. This avoids
+     * a copy, the msgpack buffer is re-initialized and will allocate a new
+     * one on next write. The records index is left in 'mp_index', the task
+     * created for the buffer takes it.
+     */
+    *size = i_ins->mp_sbuf.size;
+    buf = msgpack_sbuffer_release(&i_ins->mp_sbuf);
+
+    return buf;
+}
+
+/*
+ * Seal a full buffer and create a task for it right away. If 'dt' is set,
+ * the dyntag buffer is sealed, otherwise the buffer of the input instance.
+ */
+int flb_input_chunk_seal(struct flb_input_instance *in,
+                         struct flb_input_dyntag *dt)
+{
+#ifdef FLB_HAVE_FLUSH_LIBCO
+    int ret;
+    void *th;
+
+    flb_debug("[input %s] sealing full chunk (tag=%s)",
+              in->name, dt ? dt->tag : in->tag);
+
+    /*
+     * Dispatching resumes the output co-routines, we might be running
+     * inside an input co-routine so restore it reference after that.
+     */
+    th = pthread_getspecific(flb_thread_key);
+    if (dt) {
+        ret = flb_engine_dispatch_dyntag(0, dt, in->config);
     }
+    else {
+        ret = flb_engine_dispatch(0, in, in->config);
+    }
+    pthread_setspecific(flb_thread_key, th);
 
-    /* Copy original data to new buffer and update it size */
-    memcpy(buf, i_ins->mp_sbuf.data, i_ins->mp_sbuf.size);
-    *size = i_ins->mp_sbuf.size;
+    return ret;
+#else
+    /* The buffer will be flushed on the next engine flush */
+    return 0;
+#endif
+}
 
-    /* re-initialize msgpack buffers */
-    i_ins->mp_records = 0;
-    msgpack_sbuffer_destroy(&i_ins->mp_sbuf);
-    msgpack_sbuffer_init(&i_ins->mp_sbuf);
+int flb_input_time_get(struct flb_input_instance *in, struct flb_time *tm)
+{
+    return flb_time_get_precision(tm, in->time_precision);
+}
 
-    return buf;
+int flb_input_pack_time_now(struct flb_input_instance *in,
+                            msgpack_packer *mp_pck)
+{
+    struct flb_time tm;
+
+    flb_time_get_precision(&tm, in->time_precision);
+    return flb_time_append_to_msgpack(&tm, mp_pck, 0);
 }
 
 /* Retrieve a raw buffer from a dyntag node */
@@ -992,8 +1727,10 @@ int flb_input_collector_fd(flb_pipefd_t fd, struct flb_config *config)
         flb_thread_resume(th);
     }
     else {
+        FLB_MEM_SCOPE_ENTER(FLB_MEM_INPUT);
         collector->cb_collect(collector->instance, config,
                               collector->instance->context);
+        FLB_MEM_SCOPE_LEAVE();
     }
 
     return 0;
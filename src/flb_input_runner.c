@@ -0,0 +1,403 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+
+#include <monkey/mk_core.h>
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_arena.h>
+#include <fluent-bit/flb_mp.h>
+#ifdef FLB_HAVE_REGEX
+#include <fluent-bit/flb_regex.h>
+#endif
+#include <fluent-bit/flb_log.h>
+#include <fluent-bit/flb_pipe.h>
+#include <fluent-bit/flb_ring.h>
+#include <fluent-bit/flb_config.h>
+#include <fluent-bit/flb_engine.h>
+#include <fluent-bit/flb_input.h>
+#include <fluent-bit/flb_input_worker.h>
+#include <fluent-bit/flb_input_runner.h>
+#include <fluent-bit/flb_utils.h>
+#include <fluent-bit/flb_worker.h>
+#include <fluent-bit/flb_time.h>
+
+#include <signal.h>
+#include <unistd.h>
+
+static void runner_chunk_destroy(struct flb_input_worker_chunk *chunk)
+{
+    flb_free(chunk->data);
+    flb_free(chunk);
+}
+
+/* Take the records packed by the collectors in this loop iteration */
+static struct flb_input_worker_chunk *runner_chunk_take(struct flb_input_runner *runner)
+{
+    struct flb_input_instance *in = runner->in;
+    struct flb_input_worker_chunk *chunk;
+
+    if (in->mp_sbuf.size == 0) {
+        return NULL;
+    }
+
+    chunk = flb_calloc(1, sizeof(struct flb_input_worker_chunk));
+    if (!chunk) {
+        flb_errno();
+        in->mp_sbuf.size = 0;
+        return NULL;
+    }
+
+    chunk->size = in->mp_sbuf.size;
+    chunk->alloc = in->mp_sbuf.alloc;
+    chunk->data = msgpack_sbuffer_release(&in->mp_sbuf);
+    chunk->records = flb_mp_count(chunk->data, chunk->size);
+
+    return chunk;
+}
+
+/* Hand the records of this loop iteration to the engine thread */
+static void runner_flush(struct flb_input_runner *runner)
+{
+    int ret;
+    uint64_t val = 1;
+    struct flb_input_worker_chunk *chunk;
+
+    chunk = runner_chunk_take(runner);
+    if (!chunk) {
+        return;
+    }
+    flb_input_worker_chunk_filter(runner->in, chunk);
+
+    /* The engine is behind or the instance is paused: wait */
+    while (flb_ring_push(runner->queue, &chunk) == -1) {
+        if (__atomic_load_n(&runner->stop, __ATOMIC_SEQ_CST) == FLB_TRUE) {
+            runner_chunk_destroy(chunk);
+            return;
+        }
+        usleep(1000);
+    }
+
+    ret = flb_pipe_w(runner->ch_chunks[1], &val, sizeof(val));
+    if (ret == -1) {
+        flb_errno();
+    }
+}
+
+/* Invoke the callback of a collector registered in the runner loop */
+static void runner_collect(struct flb_input_runner *runner,
+                           struct mk_event *event)
+{
+    struct flb_input_collector *coll;
+
+    coll = mk_list_entry(event, struct flb_input_collector, event);
+    if (coll->type == FLB_COLLECT_TIME) {
+        flb_utils_timer_consume(coll->fd_timer);
+    }
+
+    if (coll->running == FLB_FALSE) {
+        return;
+    }
+
+    FLB_MEM_SCOPE_ENTER(FLB_MEM_INPUT);
+    coll->cb_collect(runner->in, runner->config, runner->in->context);
+    FLB_MEM_SCOPE_LEAVE();
+}
+
+/* Runner main loop, it runs in it own POSIX thread */
+static void runner_loop(void *data)
+{
+    int n;
+    int run = FLB_TRUE;
+    uint64_t val;
+    sigset_t mask;
+    struct mk_event *event;
+    struct flb_input_runner *runner = data;
+    struct flb_input_instance *in = runner->in;
+
+    /*
+     * The shutdown signals stop this thread, their handlers must never
+     * run on it.
+     */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGQUIT);
+    sigaddset(&mask, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    flb_debug("[input runner] %s started", in->name);
+
+    while (run == FLB_TRUE) {
+        mk_event_wait(runner->evl);
+        flb_time_loop_update();
+        mk_event_foreach(event, runner->evl) {
+            if (event == &runner->e_ctl) {
+                n = flb_pipe_r(runner->ch_ctl[0], &val, sizeof(val));
+                if (n <= 0) {
+                    flb_errno();
+                    continue;
+                }
+
+                if (val == FLB_INPUT_RUNNER_STOP) {
+                    run = FLB_FALSE;
+                    break;
+                }
+                else if (val == FLB_INPUT_RUNNER_PAUSE && in->p->cb_pause) {
+                    in->p->cb_pause(in->context, runner->config);
+                }
+                else if (val == FLB_INPUT_RUNNER_RESUME && in->p->cb_resume) {
+                    in->p->cb_resume(in->context, runner->config);
+                }
+            }
+            else if (event->type == FLB_ENGINE_EV_CORE) {
+                runner_collect(runner, event);
+            }
+        }
+
+        runner_flush(runner);
+    }
+
+    /* Records filtered in this thread used its own arena and pools */
+    flb_arena_thread_exit();
+    flb_mp_thread_exit();
+#ifdef FLB_HAVE_REGEX
+    flb_regex_thread_exit();
+#endif
+
+    flb_debug("[input runner] %s stopped", in->name);
+}
+
+/* Append a chunk of the runner to a buffer of the instance tag */
+static void runner_chunk_append(struct flb_input_runner *runner,
+                                struct flb_input_worker_chunk *chunk)
+{
+    struct flb_input_instance *in = runner->in;
+
+    if (chunk->filtered == FLB_TRUE) {
+        flb_input_dyntag_append_filtered(in, in->tag, in->tag_len,
+                                         chunk->data, chunk->size,
+                                         chunk->records);
+    }
+    else {
+        flb_input_dyntag_append_records(in, in->tag, in->tag_len,
+                                        chunk->data, chunk->size,
+                                        chunk->records);
+    }
+}
+
+/*
+ * Engine loop handler: append the chunks queued by the runner. Once the
+ * instance is paused the rest of the chunks wait in the queue.
+ */
+static int runner_engine_collect(void *data)
+{
+    int n;
+    uint64_t val;
+    struct flb_input_runner *runner = data;
+    struct flb_input_worker_chunk *chunk;
+
+    n = flb_pipe_r(runner->ch_chunks[0], &val, sizeof(val));
+    if (n <= 0) {
+        flb_errno();
+        return -1;
+    }
+
+    while (runner->paused == FLB_FALSE &&
+           flb_ring_pop(runner->queue, &chunk) == 0) {
+        runner_chunk_append(runner, chunk);
+        runner_chunk_destroy(chunk);
+    }
+
+    return 0;
+}
+
+static void runner_ctl(struct flb_input_runner *runner, uint64_t val)
+{
+    int n;
+
+    n = flb_pipe_w(runner->ch_ctl[1], &val, sizeof(val));
+    if (n == -1) {
+        flb_errno();
+    }
+}
+
+/*
+ * Create the runner of an input instance, it must exists before the
+ * collectors are started so they get registered in the runner loop. The
+ * thread is spawned by flb_input_runner_start().
+ */
+struct flb_input_runner *flb_input_runner_create(struct flb_input_instance *in)
+{
+    int ret;
+    struct flb_input_runner *runner;
+
+    runner = flb_calloc(1, sizeof(struct flb_input_runner));
+    if (!runner) {
+        flb_errno();
+        return NULL;
+    }
+    runner->in = in;
+    runner->config = in->config;
+    runner->ch_ctl[0] = -1;
+    runner->ch_ctl[1] = -1;
+    runner->ch_chunks[0] = -1;
+    runner->ch_chunks[1] = -1;
+
+    runner->queue = flb_ring_create(sizeof(struct flb_input_worker_chunk *),
+                                    FLB_INPUT_RUNNER_QUEUE);
+    if (!runner->queue) {
+        flb_input_runner_destroy(runner);
+        return NULL;
+    }
+
+    runner->evl = mk_event_loop_create(64);
+    if (!runner->evl) {
+        flb_error("[input runner] %s could not create event loop", in->name);
+        flb_input_runner_destroy(runner);
+        return NULL;
+    }
+
+    /* Control channel, engine -> runner */
+    MK_EVENT_NEW(&runner->e_ctl);
+    ret = mk_event_channel_create(runner->evl,
+                                  &runner->ch_ctl[0], &runner->ch_ctl[1],
+                                  &runner->e_ctl);
+    if (ret != 0) {
+        flb_error("[input runner] %s could not create channel", in->name);
+        runner->ch_ctl[0] = -1;
+        runner->ch_ctl[1] = -1;
+        flb_input_runner_destroy(runner);
+        return NULL;
+    }
+
+    /* Chunks channel, runner -> engine */
+    ret = flb_pipe_create(runner->ch_chunks);
+    if (ret == -1) {
+        flb_errno();
+        runner->ch_chunks[0] = -1;
+        runner->ch_chunks[1] = -1;
+        flb_input_runner_destroy(runner);
+        return NULL;
+    }
+    MK_EVENT_NEW(&runner->event);
+    runner->event.handler = runner_engine_collect;
+    ret = mk_event_add(runner->config->evl, runner->ch_chunks[0],
+                       FLB_ENGINE_EV_CUSTOM, MK_EVENT_READ, runner);
+    if (ret == -1) {
+        flb_input_runner_destroy(runner);
+        return NULL;
+    }
+
+    return runner;
+}
+
+/* Spawn the runner thread, the collectors callbacks run in that thread */
+int flb_input_runner_start(struct flb_input_runner *runner)
+{
+    int ret;
+    char role[32];
+
+    snprintf(role, sizeof(role) - 1, "input:%s", runner->in->name);
+    ret = flb_worker_create_role(runner_loop, runner, &runner->tid,
+                                 role, runner->in->cpus, runner->config);
+    if (ret == -1) {
+        flb_error("[input runner] %s could not spawn thread",
+                  runner->in->name);
+        runner->tid = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Called from the engine thread when the instance is paused */
+void flb_input_runner_pause(struct flb_input_runner *runner)
+{
+    if (runner->paused == FLB_TRUE) {
+        return;
+    }
+
+    runner->paused = FLB_TRUE;
+    mk_event_del(runner->config->evl, &runner->event);
+    runner_ctl(runner, FLB_INPUT_RUNNER_PAUSE);
+}
+
+void flb_input_runner_resume(struct flb_input_runner *runner)
+{
+    int n;
+    uint64_t val = 1;
+
+    if (runner->paused == FLB_FALSE) {
+        return;
+    }
+
+    runner->paused = FLB_FALSE;
+    mk_event_add(runner->config->evl, runner->ch_chunks[0],
+                 FLB_ENGINE_EV_CUSTOM, MK_EVENT_READ, runner);
+
+    /* Chunks may be waiting in the queue without a notification */
+    n = flb_pipe_w(runner->ch_chunks[1], &val, sizeof(val));
+    if (n == -1) {
+        flb_errno();
+    }
+
+    runner_ctl(runner, FLB_INPUT_RUNNER_RESUME);
+}
+
+/*
+ * Stop the runner thread and release it, chunks not appended yet are
+ * dropped. It must be called before the plugin exit callback.
+ */
+void flb_input_runner_destroy(struct flb_input_runner *runner)
+{
+    struct flb_input_worker_chunk *chunk;
+
+    if (runner->tid) {
+        __atomic_store_n(&runner->stop, FLB_TRUE, __ATOMIC_SEQ_CST);
+        runner_ctl(runner, FLB_INPUT_RUNNER_STOP);
+        pthread_join(runner->tid, NULL);
+        runner->tid = 0;
+    }
+
+    if (runner->queue) {
+        while (flb_ring_pop(runner->queue, &chunk) == 0) {
+            runner_chunk_destroy(chunk);
+        }
+        flb_ring_destroy(runner->queue);
+    }
+
+    if (runner->ch_chunks[0] != -1) {
+        if (runner->paused == FLB_FALSE) {
+            mk_event_del(runner->config->evl, &runner->event);
+        }
+        flb_pipe_close(runner->ch_chunks[0]);
+        flb_pipe_close(runner->ch_chunks[1]);
+    }
+    if (runner->ch_ctl[0] != -1) {
+        mk_event_del(runner->evl, &runner->e_ctl);
+        flb_pipe_close(runner->ch_ctl[0]);
+        flb_pipe_close(runner->ch_ctl[1]);
+    }
+    if (runner->evl) {
+        mk_event_loop_destroy(runner->evl);
+    }
+
+    flb_free(runner);
+}
@@ -0,0 +1,560 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+
+#include <monkey/mk_core.h>
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_mem_pool.h>
+#include <fluent-bit/flb_arena.h>
+#include <fluent-bit/flb_mp.h>
+#ifdef FLB_HAVE_REGEX
+#include <fluent-bit/flb_regex.h>
+#endif
+#include <fluent-bit/flb_log.h>
+#include <fluent-bit/flb_pipe.h>
+#include <fluent-bit/flb_ring.h>
+#include <fluent-bit/flb_config.h>
+#include <fluent-bit/flb_engine.h>
+#include <fluent-bit/flb_input.h>
+#include <fluent-bit/flb_input_worker.h>
+#include <fluent-bit/flb_filter.h>
+#include <fluent-bit/flb_network.h>
+#include <fluent-bit/flb_worker.h>
+#include <fluent-bit/flb_time.h>
+
+#include <string.h>
+#include <unistd.h>
+
+static void worker_chunk_destroy(struct flb_input_worker_chunk *chunk)
+{
+    flb_free(chunk->data);
+    flb_free(chunk);
+}
+
+/*
+ * Run the filters chain over the chunk in the calling thread. If a filter
+ * for the tag is not thread safe, the engine filters the records later.
+ */
+void flb_input_worker_chunk_filter(struct flb_input_instance *in,
+                                   struct flb_input_worker_chunk *chunk)
+{
+    int ret;
+    int tag_len;
+    char *tag;
+    msgpack_sbuffer mp_sbuf;
+    msgpack_packer mp_pck;
+
+    if (chunk->tag) {
+        tag = chunk->tag;
+        tag_len = chunk->tag_len;
+    }
+    else {
+        tag = in->tag;
+        tag_len = in->tag_len;
+    }
+    if (!tag) {
+        return;
+    }
+
+    /* The filters work over the chunk buffer */
+    mp_sbuf.data  = chunk->data;
+    mp_sbuf.size  = chunk->size;
+    mp_sbuf.alloc = chunk->alloc;
+    msgpack_packer_init(&mp_pck, &mp_sbuf, flb_mem_pool_sbuffer_write);
+
+    ret = flb_filter_do_threaded(&mp_sbuf, &mp_pck,
+                                 chunk->data, chunk->size,
+                                 tag, tag_len, in->config);
+
+    chunk->data  = mp_sbuf.data;
+    chunk->size  = mp_sbuf.size;
+    chunk->alloc = mp_sbuf.alloc;
+    if (ret == 0) {
+        chunk->filtered = FLB_TRUE;
+    }
+}
+
+/* Hand the chunks filled in this loop iteration to the engine thread */
+static void worker_flush(struct flb_input_worker *worker)
+{
+    int n = 0;
+    int ret;
+    uint64_t val = 1;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct flb_input_worker_chunk *chunk;
+
+    mk_list_foreach_safe(head, tmp, &worker->chunks) {
+        chunk = mk_list_entry(head, struct flb_input_worker_chunk, _head);
+        mk_list_del(&chunk->_head);
+        flb_input_worker_chunk_filter(worker->in, chunk);
+
+        /*
+         * The engine is behind or the instance is paused: wait, the
+         * connections of this worker are not read meanwhile.
+         */
+        while (flb_ring_push(worker->queue, &chunk) == -1) {
+            if (__atomic_load_n(&worker->stop, __ATOMIC_SEQ_CST) == FLB_TRUE) {
+                worker_chunk_destroy(chunk);
+                chunk = NULL;
+                break;
+            }
+            if (n > 0) {
+                flb_pipe_w(worker->ch_chunks[1], &val, sizeof(val));
+                n = 0;
+            }
+            usleep(1000);
+        }
+        if (chunk) {
+            n++;
+        }
+    }
+
+    if (n > 0) {
+        ret = flb_pipe_w(worker->ch_chunks[1], &val, sizeof(val));
+        if (ret == -1) {
+            flb_errno();
+        }
+    }
+}
+
+/* Worker main loop, it runs in it own POSIX thread */
+static void worker_loop(void *data)
+{
+    int n;
+    int run = FLB_TRUE;
+    uint64_t val;
+    struct mk_event *event;
+    struct flb_input_worker *worker = data;
+
+    flb_debug("[input worker] %s worker #%i started",
+              worker->in->name, worker->id);
+
+    while (run == FLB_TRUE) {
+        mk_event_wait(worker->evl);
+        flb_time_loop_update();
+        mk_event_foreach(event, worker->evl) {
+            if (event == &worker->e_ctl) {
+                n = flb_pipe_r(worker->ch_ctl[0], &val, sizeof(val));
+                if (n <= 0) {
+                    flb_errno();
+                    continue;
+                }
+
+                if (val == FLB_INPUT_WORKER_STOP) {
+                    run = FLB_FALSE;
+                    break;
+                }
+                else if (val == FLB_INPUT_WORKER_PAUSE) {
+                    mk_event_del(worker->evl, &worker->e_server);
+                    worker->cb_pause(worker->data);
+                }
+                else if (val == FLB_INPUT_WORKER_RESUME) {
+                    worker->cb_resume(worker->data);
+                    mk_event_add(worker->evl, worker->server_fd,
+                                 FLB_ENGINE_EV_CUSTOM, MK_EVENT_READ,
+                                 &worker->e_server);
+                }
+            }
+            else if (event == &worker->e_server) {
+                worker->cb_accept(worker->data);
+            }
+            else if (event->type == FLB_ENGINE_EV_CUSTOM) {
+                event->handler(event);
+            }
+        }
+
+        worker_flush(worker);
+    }
+
+    /* Records filtered in this thread used its own arena and pools */
+    flb_arena_thread_exit();
+    flb_mp_thread_exit();
+#ifdef FLB_HAVE_REGEX
+    flb_regex_thread_exit();
+#endif
+
+    flb_debug("[input worker] %s worker #%i stopped",
+              worker->in->name, worker->id);
+}
+
+/* Append a chunk of a worker to the instance buffers */
+static void worker_chunk_append(struct flb_input_worker *worker,
+                                struct flb_input_worker_chunk *chunk)
+{
+    struct flb_input_instance *in = worker->in;
+
+    if (chunk->tag && chunk->filtered == FLB_TRUE) {
+        flb_input_dyntag_append_filtered(in, chunk->tag, chunk->tag_len,
+                                         chunk->data, chunk->size,
+                                         chunk->records);
+        return;
+    }
+    else if (chunk->tag) {
+        flb_input_dyntag_append_records(in, chunk->tag, chunk->tag_len,
+                                        chunk->data, chunk->size,
+                                        chunk->records);
+        return;
+    }
+
+    flb_input_buf_write_start(in);
+    in->mp_buf_write_filtered = chunk->filtered;
+    flb_mem_pool_sbuffer_write(&in->mp_sbuf, chunk->data, chunk->size);
+    flb_input_buf_write_end(in);
+}
+
+/*
+ * Engine loop handler: append the chunks queued by the worker. Once the
+ * instance is paused the rest of the chunks wait in the queue.
+ */
+static int worker_collect(void *data)
+{
+    int n;
+    uint64_t val;
+    struct flb_input_worker *worker = data;
+    struct flb_input_worker_chunk *chunk;
+
+    n = flb_pipe_r(worker->ch_chunks[0], &val, sizeof(val));
+    if (n <= 0) {
+        flb_errno();
+        return -1;
+    }
+
+    while (worker->paused == FLB_FALSE &&
+           flb_ring_pop(worker->queue, &chunk) == 0) {
+        worker_chunk_append(worker, chunk);
+        worker_chunk_destroy(chunk);
+    }
+
+    return 0;
+}
+
+static void worker_ctl(struct flb_input_worker *worker, uint64_t val)
+{
+    int n;
+
+    n = flb_pipe_w(worker->ch_ctl[1], &val, sizeof(val));
+    if (n == -1) {
+        flb_errno();
+    }
+}
+
+static struct flb_input_worker *worker_create(struct flb_input_instance *in,
+                                              int id, char *listen,
+                                              char *port, int udp)
+{
+    int ret;
+    struct flb_input_worker *worker;
+
+    worker = flb_calloc(1, sizeof(struct flb_input_worker));
+    if (!worker) {
+        flb_errno();
+        return NULL;
+    }
+    worker->id = id;
+    worker->in = in;
+    worker->config = in->config;
+    worker->server_fd = -1;
+    worker->ch_ctl[0] = -1;
+    worker->ch_ctl[1] = -1;
+    worker->ch_chunks[0] = -1;
+    worker->ch_chunks[1] = -1;
+    mk_list_init(&worker->chunks);
+
+    worker->queue = flb_ring_create(sizeof(struct flb_input_worker_chunk *),
+                                    FLB_INPUT_WORKER_QUEUE);
+    if (!worker->queue) {
+        flb_input_worker_destroy(worker);
+        return NULL;
+    }
+
+    worker->evl = mk_event_loop_create(256);
+    if (!worker->evl) {
+        flb_error("[input worker] %s could not create event loop", in->name);
+        flb_input_worker_destroy(worker);
+        return NULL;
+    }
+
+    /* Control channel, engine -> worker */
+    MK_EVENT_NEW(&worker->e_ctl);
+    ret = mk_event_channel_create(worker->evl,
+                                  &worker->ch_ctl[0], &worker->ch_ctl[1],
+                                  &worker->e_ctl);
+    if (ret != 0) {
+        flb_error("[input worker] %s could not create channel", in->name);
+        worker->ch_ctl[0] = -1;
+        worker->ch_ctl[1] = -1;
+        flb_input_worker_destroy(worker);
+        return NULL;
+    }
+
+    /* Chunks channel, worker -> engine */
+    ret = flb_pipe_create(worker->ch_chunks);
+    if (ret == -1) {
+        flb_errno();
+        worker->ch_chunks[0] = -1;
+        worker->ch_chunks[1] = -1;
+        flb_input_worker_destroy(worker);
+        return NULL;
+    }
+    MK_EVENT_NEW(&worker->event);
+    worker->event.handler = worker_collect;
+    ret = mk_event_add(worker->config->evl, worker->ch_chunks[0],
+                       FLB_ENGINE_EV_CUSTOM, MK_EVENT_READ, worker);
+    if (ret == -1) {
+        flb_input_worker_destroy(worker);
+        return NULL;
+    }
+
+    /* Every worker binds the same address */
+    if (udp == FLB_TRUE) {
+        worker->server_fd = flb_net_server_udp_reuseport(port, listen);
+    }
+    else {
+        worker->server_fd = flb_net_server_reuseport(port, listen);
+    }
+    if (worker->server_fd == -1) {
+        flb_error("[input worker] %s could not bind address %s:%s",
+                  in->name, listen, port);
+        flb_input_worker_destroy(worker);
+        return NULL;
+    }
+    flb_net_socket_nonblocking(worker->server_fd);
+
+    MK_EVENT_NEW(&worker->e_server);
+    ret = mk_event_add(worker->evl, worker->server_fd,
+                       FLB_ENGINE_EV_CUSTOM, MK_EVENT_READ, &worker->e_server);
+    if (ret == -1) {
+        flb_input_worker_destroy(worker);
+        return NULL;
+    }
+
+    return worker;
+}
+
+/*
+ * Create a worker for the input instance with its own listening socket,
+ * the thread is spawned by flb_input_worker_start() once the plugin
+ * prepared its worker context.
+ */
+struct flb_input_worker *flb_input_worker_create(struct flb_input_instance *in,
+                                                 int id, char *listen,
+                                                 char *port)
+{
+    return worker_create(in, id, listen, port, FLB_FALSE);
+}
+
+/*
+ * Same as above with a UDP socket: the accept callback is invoked when
+ * datagrams are ready to be read from the worker socket.
+ */
+struct flb_input_worker *flb_input_worker_create_udp(struct flb_input_instance *in,
+                                                     int id, char *listen,
+                                                     char *port)
+{
+    return worker_create(in, id, listen, port, FLB_TRUE);
+}
+
+/* Spawn the worker thread, the callbacks run in that thread */
+int flb_input_worker_start(struct flb_input_worker *worker, void *data,
+                           int (*cb_accept) (void *),
+                           void (*cb_pause) (void *),
+                           void (*cb_resume) (void *),
+                           void (*cb_exit) (void *))
+{
+    int ret;
+    char role[32];
+
+    worker->data = data;
+    worker->cb_accept = cb_accept;
+    worker->cb_pause = cb_pause;
+    worker->cb_resume = cb_resume;
+    worker->cb_exit = cb_exit;
+
+    snprintf(role, sizeof(role) - 1, "input:%s", worker->in->name);
+    ret = flb_worker_create_role(worker_loop, worker, &worker->tid,
+                                 role, worker->in->cpus, worker->config);
+    if (ret == -1) {
+        flb_error("[input worker] %s could not spawn worker #%i",
+                  worker->in->name, worker->id);
+        worker->tid = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Append records from the worker thread, they are grouped by tag until
+ * the end of the event loop iteration.
+ */
+int flb_input_worker_append(struct flb_input_worker *worker,
+                            char *tag, int tag_len,
+                            void *buf, size_t size, int records)
+{
+    size_t alloc;
+    char *tmp;
+    struct mk_list *head;
+    struct flb_input_worker_chunk *chunk = NULL;
+    struct flb_input_worker_chunk *entry;
+
+    mk_list_foreach(head, &worker->chunks) {
+        entry = mk_list_entry(head, struct flb_input_worker_chunk, _head);
+        if ((entry->tag == NULL) == (tag == NULL) &&
+            entry->tag_len == tag_len &&
+            (tag == NULL || memcmp(entry->tag, tag, tag_len) == 0)) {
+            chunk = entry;
+            break;
+        }
+    }
+
+    if (!chunk) {
+        chunk = flb_calloc(1, sizeof(struct flb_input_worker_chunk) +
+                           (tag ? tag_len + 1 : 0));
+        if (!chunk) {
+            flb_errno();
+            return -1;
+        }
+        if (tag) {
+            chunk->tag = (char *) (chunk + 1);
+            memcpy(chunk->tag, tag, tag_len);
+            chunk->tag[tag_len] = '\0';
+            chunk->tag_len = tag_len;
+        }
+        mk_list_add(&chunk->_head, &worker->chunks);
+    }
+
+    if (chunk->size + size > chunk->alloc) {
+        alloc = chunk->alloc * 2;
+        if (alloc < chunk->size + size) {
+            alloc = chunk->size + size;
+        }
+        tmp = flb_realloc(chunk->data, alloc);
+        if (!tmp) {
+            flb_errno();
+            return -1;
+        }
+        chunk->data = tmp;
+        chunk->alloc = alloc;
+    }
+
+    memcpy(chunk->data + chunk->size, buf, size);
+    chunk->size += size;
+
+    /* The count is only known if every piece had it */
+    if (records < 0 || chunk->records < 0) {
+        chunk->records = -1;
+    }
+    else {
+        chunk->records += records;
+    }
+
+    return 0;
+}
+
+/* Called from the engine thread when the instance is paused */
+void flb_input_worker_pause(struct flb_input_worker *worker)
+{
+    if (worker->paused == FLB_TRUE) {
+        return;
+    }
+
+    worker->paused = FLB_TRUE;
+    mk_event_del(worker->config->evl, &worker->event);
+    worker_ctl(worker, FLB_INPUT_WORKER_PAUSE);
+}
+
+void flb_input_worker_resume(struct flb_input_worker *worker)
+{
+    int n;
+    uint64_t val = 1;
+
+    if (worker->paused == FLB_FALSE) {
+        return;
+    }
+
+    worker->paused = FLB_FALSE;
+    mk_event_add(worker->config->evl, worker->ch_chunks[0],
+                 FLB_ENGINE_EV_CUSTOM, MK_EVENT_READ, worker);
+
+    /* Chunks may be waiting in the queue without a notification */
+    n = flb_pipe_w(worker->ch_chunks[1], &val, sizeof(val));
+    if (n == -1) {
+        flb_errno();
+    }
+
+    worker_ctl(worker, FLB_INPUT_WORKER_RESUME);
+}
+
+/*
+ * Stop the worker thread and release it. Chunks not appended yet are
+ * dropped, the plugin exit callback releases its worker context.
+ */
+void flb_input_worker_destroy(struct flb_input_worker *worker)
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct flb_input_worker_chunk *chunk;
+
+    if (worker->tid) {
+        __atomic_store_n(&worker->stop, FLB_TRUE, __ATOMIC_SEQ_CST);
+        worker_ctl(worker, FLB_INPUT_WORKER_STOP);
+        pthread_join(worker->tid, NULL);
+        worker->tid = 0;
+    }
+
+    if (worker->cb_exit && worker->data) {
+        worker->cb_exit(worker->data);
+    }
+
+    if (worker->queue) {
+        while (flb_ring_pop(worker->queue, &chunk) == 0) {
+            worker_chunk_destroy(chunk);
+        }
+        flb_ring_destroy(worker->queue);
+    }
+    mk_list_foreach_safe(head, tmp, &worker->chunks) {
+        chunk = mk_list_entry(head, struct flb_input_worker_chunk, _head);
+        mk_list_del(&chunk->_head);
+        worker_chunk_destroy(chunk);
+    }
+
+    if (worker->server_fd != -1) {
+        mk_event_del(worker->evl, &worker->e_server);
+        flb_socket_close(worker->server_fd);
+    }
+    if (worker->ch_chunks[0] != -1) {
+        if (worker->paused == FLB_FALSE) {
+            mk_event_del(worker->config->evl, &worker->event);
+        }
+        flb_pipe_close(worker->ch_chunks[0]);
+        flb_pipe_close(worker->ch_chunks[1]);
+    }
+    if (worker->ch_ctl[0] != -1) {
+        mk_event_del(worker->evl, &worker->e_ctl);
+        flb_pipe_close(worker->ch_ctl[0]);
+        flb_pipe_close(worker->ch_ctl[1]);
+    }
+    if (worker->evl) {
+        mk_event_loop_destroy(worker->evl);
+    }
+
+    flb_free(worker);
+}
@@ -49,6 +49,9 @@
 #include <stdlib.h>
 #include <limits.h>
 #include <assert.h>
+#include <stddef.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 
 #include <monkey/mk_core.h>
 #include <fluent-bit/flb_info.h>
@@ -63,53 +66,115 @@
 #include <fluent-bit/flb_utils.h>
 #include <fluent-bit/flb_macros.h>
 #include <fluent-bit/flb_network.h>
+#include <fluent-bit/flb_dns.h>
 #include <fluent-bit/flb_engine.h>
 #include <fluent-bit/flb_thread.h>
+#include <fluent-bit/flb_probes.h>
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+/* A unix socket upstream keeps the socket path as its host */
+static int io_unix_addr(char *path, struct flb_dns_addr *addr)
+{
+    size_t len;
+    struct sockaddr_un *sun = (struct sockaddr_un *) &addr->addr;
+
+    len = strlen(path);
+    if (len >= sizeof(sun->sun_path)) {
+        flb_error("[io] unix socket path too long: %s", path);
+        return -1;
+    }
+
+    memset(sun, '\0', sizeof(struct sockaddr_un));
+    sun->sun_family = AF_UNIX;
+    memcpy(sun->sun_path, path, len + 1);
+    addr->family = AF_UNIX;
+    addr->len = offsetof(struct sockaddr_un, sun_path) + len + 1;
+
+    return 0;
+}
 
 FLB_INLINE int flb_io_net_connect(struct flb_upstream_conn *u_conn,
                                   struct flb_thread *th)
 {
     int ret;
     int err;
+    int async;
     int error = 0;
     uint32_t mask;
     char so_error_buf[256];
+    int family;
     flb_sockfd_t fd;
     socklen_t len = sizeof(error);
+    struct flb_dns_addr addr;
     struct flb_upstream *u = u_conn->u;
 
     if (u_conn->fd > 0) {
         flb_socket_close(u_conn->fd);
+        u_conn->fd = -1;
     }
 
-    /* Create the socket */
-    if (u_conn->u->flags & FLB_IO_IPV6) {
-        fd = flb_net_socket_create(AF_INET6, FLB_FALSE);
+    /*
+     * Without a co-routine to yield (e.g: upstream warm-up thread) an async
+     * upstream connects in blocking mode, with a timeout.
+     */
+    async = ((u->flags & FLB_IO_ASYNC) && th);
+
+    /*
+     * Get the address from the upstream cache, in async mode the lookup
+     * runs in a resolver thread while this co-routine yields.
+     */
+    if (u->flags & FLB_IO_IPV6) {
+        family = AF_INET6;
+    }
+    else {
+        family = AF_INET;
+    }
+    if (u->flags & FLB_IO_UNIX) {
+        ret = io_unix_addr(u->tcp_host, &addr);
     }
     else {
-        fd = flb_net_socket_create(AF_INET, FLB_FALSE);
+        ret = flb_dns_cache_get(u->config, &u->dns, &u->mutex_queue,
+                                u->tcp_host, u->tcp_port, family,
+                                async ? th : NULL,
+                                u_conn->evl, &addr);
+    }
+    if (ret == -1) {
+        return -1;
     }
+
+    /* Create the socket */
+    fd = flb_net_socket_create(addr.family, FLB_FALSE);
     if (fd == -1) {
         flb_error("[io] could not create socket");
         return -1;
     }
     u_conn->fd = fd;
+    u_conn->event.fd = fd;
 
     /*
      * If we use co-routines flushing method, make sure socket
      * operations are asynchronous
      */
-    if (u->flags & FLB_IO_ASYNC) {
+    if (async) {
         flb_net_socket_nonblocking(u_conn->fd);
     }
+    else if (u->flags & FLB_IO_ASYNC) {
+        flb_net_socket_timeout(fd, FLB_UPSTREAM_WARM_TIMEOUT);
+    }
 
-    flb_net_socket_tcp_nodelay(fd);
+    if (!(u->flags & FLB_IO_UNIX)) {
+        flb_net_socket_tcp_nodelay(fd);
+    }
 
     /* Start the connection */
-    ret = flb_net_tcp_fd_connect(fd, u->tcp_host, u->tcp_port);
+    ret = flb_net_tcp_fd_connect_addr(fd, (struct sockaddr *) &addr.addr,
+                                      addr.len);
     if (ret == -1) {
         /* In blocking mode connect() fails right away */
-        if ((u->flags & FLB_IO_ASYNC) == 0) {
+        if (!async) {
             flb_socket_close(fd);
             return -1;
         }
@@ -125,7 +190,7 @@ FLB_INLINE int flb_io_net_connect(struct flb_upstream_conn *u_conn,
 
         MK_EVENT_NEW(&u_conn->event);
         u_conn->thread = th;
-        ret = mk_event_add(u->evl,
+        ret = mk_event_add(u_conn->evl,
                            fd,
                            FLB_ENGINE_EV_THREAD,
                            MK_EVENT_WRITE, &u_conn->event);
@@ -148,7 +213,7 @@ FLB_INLINE int flb_io_net_connect(struct flb_upstream_conn *u_conn,
         mask = u_conn->event.mask;
 
         /* We got a notification, remove the event registered */
-        ret = mk_event_del(u->evl, &u_conn->event);
+        ret = mk_event_del(u_conn->evl, &u_conn->event);
         if (ret == -1) {
             flb_error("[io] connect event handler error");
             flb_socket_close(fd);
@@ -192,17 +257,40 @@ FLB_INLINE int flb_io_net_connect(struct flb_upstream_conn *u_conn,
     }
 #endif
 
+    /* Ready to be used by the co-routines */
+    if (!async && (u->flags & FLB_IO_ASYNC)) {
+        flb_net_socket_timeout(fd, 0);
+        flb_net_socket_nonblocking(fd);
+    }
+
     u_conn->connect_count++;
     flb_trace("[io] connection OK");
 
     return 0;
 }
 
-static int net_io_write(struct flb_upstream_conn *u_conn,
-                        void *data, size_t len, size_t *out_len)
+/* Skip 'bytes' already written from the head of an I/O vector */
+static inline void net_iov_advance(struct iovec **iov, int *iovcnt,
+                                   size_t bytes)
+{
+    while (*iovcnt > 0 && bytes >= (*iov)->iov_len) {
+        bytes -= (*iov)->iov_len;
+        (*iov)++;
+        (*iovcnt)--;
+    }
+
+    if (*iovcnt > 0 && bytes > 0) {
+        (*iov)->iov_base = (char *) (*iov)->iov_base + bytes;
+        (*iov)->iov_len -= bytes;
+    }
+}
+
+static int net_io_writev(struct flb_upstream_conn *u_conn,
+                         struct iovec *iov, int iovcnt, size_t *out_len)
 {
     int ret;
     int tries = 0;
+    ssize_t bytes;
     size_t total = 0;
 
     if (u_conn->fd <= 0) {
@@ -214,9 +302,9 @@ static int net_io_write(struct flb_upstream_conn *u_conn,
         }
     }
 
-    while (total < len) {
-        ret = send(u_conn->fd, (char *) data + total, len - total, 0);
-        if (ret == -1) {
+    while (iovcnt > 0) {
+        bytes = writev(u_conn->fd, iov, iovcnt > IOV_MAX ? IOV_MAX : iovcnt);
+        if (bytes == -1) {
             if (errno == EAGAIN) {
                 /*
                  * FIXME: for now we are handling this in a very lazy way,
@@ -233,7 +321,8 @@ static int net_io_write(struct flb_upstream_conn *u_conn,
             return -1;
         }
         tries = 0;
-        total += ret;
+        total += bytes;
+        net_iov_advance(&iov, &iovcnt, bytes);
     }
 
     *out_len = total;
@@ -241,23 +330,23 @@ static int net_io_write(struct flb_upstream_conn *u_conn,
 }
 
 /*
- * Perform Async socket write(2) operations. This function depends on a
+ * Perform Async socket writev(2) operations. This function depends on a
  * maine event-loop and the co-routines interface to yield/resume once
  * sockets are ready to continue.
  *
  * Intentionally we register/de-register the socket file descriptor from
  * the event loop each time when we require to do some work.
  */
-static FLB_INLINE int net_io_write_async(struct flb_thread *th,
-                                         struct flb_upstream_conn *u_conn,
-                                         void *data, size_t len, size_t *out_len)
+static FLB_INLINE int net_io_writev_async(struct flb_thread *th,
+                                          struct flb_upstream_conn *u_conn,
+                                          struct iovec *iov, int iovcnt,
+                                          size_t *out_len)
 {
     int ret = 0;
     int error;
     uint32_t mask;
     ssize_t bytes;
     size_t total = 0;
-    size_t to_send;
     socklen_t slen = sizeof(error);
     char so_error_buf[256];
     struct flb_upstream *u = u_conn->u;
@@ -265,29 +354,23 @@ static FLB_INLINE int net_io_write_async(struct flb_thread *th,
  retry:
     error = 0;
 
-    if (len - total > 524288) {
-        to_send = 524288;
-    }
-    else {
-        to_send = (len - total);
-    }
-    bytes = send(u_conn->fd, (char *) data + total, to_send, 0);
+    bytes = writev(u_conn->fd, iov, iovcnt > IOV_MAX ? IOV_MAX : iovcnt);
 
 #ifdef FLB_HAVE_TRACE
     if (bytes > 0) {
-        flb_trace("[io thread=%p] [fd %i] write_async(2)=%d (%lu/%lu)",
-                  th, u_conn->fd, bytes, total + bytes, len);
+        flb_trace("[io thread=%p] [fd %i] writev_async(2)=%d (%lu)",
+                  th, u_conn->fd, bytes, total + bytes);
     }
     else {
-        flb_trace("[io thread=%p] [fd %i] write_async(2)=%d (%lu/%lu)",
-                  th, u_conn->fd, bytes, total, len);
+        flb_trace("[io thread=%p] [fd %i] writev_async(2)=%d (%lu)",
+                  th, u_conn->fd, bytes, total);
     }
 #endif
 
     if (bytes == -1) {
         if (errno == EAGAIN) {
             u_conn->thread = th;
-            ret = mk_event_add(u->evl,
+            ret = mk_event_add(u_conn->evl,
                                u_conn->fd,
                                FLB_ENGINE_EV_THREAD,
                                MK_EVENT_WRITE, &u_conn->event);
@@ -309,7 +392,7 @@ static FLB_INLINE int net_io_write_async(struct flb_thread *th,
             mask = u_conn->event.mask;
 
             /* We got a notification, remove the event registered */
-            ret = mk_event_del(u->evl, &u_conn->event);
+            ret = mk_event_del(u_conn->evl, &u_conn->event);
             if (ret == -1) {
                 return -1;
             }
@@ -347,11 +430,12 @@ static FLB_INLINE int net_io_write_async(struct flb_thread *th,
 
     /* Update counters */
     total += bytes;
-    if (total < len) {
+    net_iov_advance(&iov, &iovcnt, bytes);
+    if (iovcnt > 0) {
         if (u_conn->event.status == MK_EVENT_NONE) {
             u_conn->event.mask = MK_EVENT_EMPTY;
             u_conn->thread = th;
-            ret = mk_event_add(u->evl,
+            ret = mk_event_add(u_conn->evl,
                                u_conn->fd,
                                FLB_ENGINE_EV_THREAD,
                                MK_EVENT_WRITE, &u_conn->event);
@@ -369,7 +453,7 @@ static FLB_INLINE int net_io_write_async(struct flb_thread *th,
 
     if (u_conn->event.status & MK_EVENT_REGISTERED) {
         /* We got a notification, remove the event registered */
-        ret = mk_event_del(u->evl, &u_conn->event);
+        ret = mk_event_del(u_conn->evl, &u_conn->event);
         assert(ret == 0);
     }
 
@@ -377,6 +461,82 @@ static FLB_INLINE int net_io_write_async(struct flb_thread *th,
     return bytes;
 }
 
+#ifdef FLB_HAVE_TLS
+static inline int io_tls_write_count(struct flb_thread *th,
+                                   struct flb_upstream_conn *u_conn,
+                                   void *data, size_t len, size_t *total)
+{
+    int ret;
+    size_t bytes = 0;
+
+    ret = flb_io_tls_net_write(th, u_conn, data, len, &bytes);
+    *total += bytes;
+    return ret;
+}
+
+/*
+ * TLS have no vectored write: small buffers are coalesced so they go out in
+ * the same record instead of one record each. The full records of bigger
+ * buffers are written straight from their memory, the remainder is
+ * coalesced with the next buffers so records are always full size but the
+ * last one.
+ */
+static int net_io_tls_writev(struct flb_thread *th,
+                             struct flb_upstream_conn *u_conn,
+                             struct iovec *iov, int iovcnt, size_t *out_len)
+{
+    int i;
+    int ret = 0;
+    size_t n;
+    size_t off = 0;
+    size_t len = 0;
+    size_t total = 0;
+    char *buf = NULL;
+
+    for (i = 0; i < iovcnt && ret == 0; i++) {
+        off = 0;
+        while (off < iov[i].iov_len && ret == 0) {
+            n = iov[i].iov_len - off;
+            if (len == 0 && n >= FLB_IO_TLS_RECORD) {
+                n -= (n % FLB_IO_TLS_RECORD);
+                ret = io_tls_write_count(th, u_conn,
+                                       (char *) iov[i].iov_base + off, n,
+                                       &total);
+                off += n;
+                continue;
+            }
+
+            if (!buf) {
+                buf = flb_malloc(FLB_IO_TLS_RECORD);
+                if (!buf) {
+                    flb_errno();
+                    return -1;
+                }
+            }
+            if (n > FLB_IO_TLS_RECORD - len) {
+                n = FLB_IO_TLS_RECORD - len;
+            }
+            memcpy(buf + len, (char *) iov[i].iov_base + off, n);
+            len += n;
+            off += n;
+
+            if (len == FLB_IO_TLS_RECORD) {
+                ret = io_tls_write_count(th, u_conn, buf, len, &total);
+                len = 0;
+            }
+        }
+    }
+
+    if (ret == 0 && len > 0) {
+        ret = io_tls_write_count(th, u_conn, buf, len, &total);
+    }
+    flb_free(buf);
+
+    *out_len = total;
+    return ret;
+}
+#endif
+
 static ssize_t net_io_read(struct flb_upstream_conn *u_conn,
                            void *buf, size_t len)
 {
@@ -395,7 +555,6 @@ static FLB_INLINE ssize_t net_io_read_async(struct flb_thread *th,
                                             void *buf, size_t len)
 {
     int ret;
-    struct flb_upstream *u = u_conn->u;
 
  retry_read:
 
@@ -403,7 +562,7 @@ static FLB_INLINE ssize_t net_io_read_async(struct flb_thread *th,
     if (ret == -1) {
         if (errno == EAGAIN) {
             u_conn->thread = th;
-            ret = mk_event_add(u->evl,
+            ret = mk_event_add(u_conn->evl,
                                u_conn->fd,
                                FLB_ENGINE_EV_THREAD,
                                MK_EVENT_READ, &u_conn->event);
@@ -427,50 +586,149 @@ static FLB_INLINE ssize_t net_io_read_async(struct flb_thread *th,
     return ret;
 }
 
-/* Write data to an upstream connection/server */
-int flb_io_net_write(struct flb_upstream_conn *u_conn, void *data,
-                     size_t len, size_t *out_len)
+/*
+ * Write an I/O vector to an upstream connection/server, all the buffers go
+ * out with as few system calls as possible. The vector entries are updated
+ * while the data is written.
+ */
+int flb_io_net_writev(struct flb_upstream_conn *u_conn,
+                      struct iovec *iov, int iovcnt, size_t *out_len)
 {
     int ret = -1;
     struct flb_upstream *u = u_conn->u;
 
+    *out_len = 0;
+
 #if defined (FLB_HAVE_FLUSH_LIBCO)
     struct flb_thread *th = pthread_getspecific(flb_thread_key);
-    flb_trace("[io thread=%p] [net_write] trying %zd bytes",
-              th, len);
+    flb_trace("[io thread=%p] [net_write] trying %i buffers",
+              th, iovcnt);
 #else
     void *th = NULL;
-    flb_trace("[io] [net_write] trying %zd bytes", len);
+    flb_trace("[io] [net_write] trying %i buffers", iovcnt);
 #endif
     if (u->flags & FLB_IO_TCP) {
         if (u->flags & FLB_IO_ASYNC) {
-            ret = net_io_write_async(th, u_conn, data, len, out_len);
+            ret = net_io_writev_async(th, u_conn, iov, iovcnt, out_len);
         }
         else {
-            ret = net_io_write(u_conn, data, len, out_len);
+            ret = net_io_writev(u_conn, iov, iovcnt, out_len);
         }
     }
 #ifdef FLB_HAVE_TLS
     else if (u->flags & FLB_IO_TLS) {
-        ret = flb_io_tls_net_write(th, u_conn, data, len, out_len);
+        ret = net_io_tls_writev(th, u_conn, iov, iovcnt, out_len);
     }
 #endif
 
+    FLB_PROBE3(net_write, u_conn->fd, *out_len, ret);
+
     if (ret == -1 && u_conn->fd > 0) {
         flb_socket_close(u_conn->fd);
         u_conn->fd = -1;
     }
 
 #if defined (FLB_HAVE_FLUSH_LIBCO)
-    flb_trace("[io thread=%p] [net_write] ret=%i total=%lu/%lu",
-              th, ret, *out_len, len);
+    flb_trace("[io thread=%p] [net_write] ret=%i total=%lu",
+              th, ret, *out_len);
 #else
-    flb_trace("[io] [net_write] ret=%i total=%i",
+    flb_trace("[io] [net_write] ret=%i total=%lu",
               ret, *out_len);
 #endif
     return ret;
 }
 
+/* Write data to an upstream connection/server */
+int flb_io_net_write(struct flb_upstream_conn *u_conn, void *data,
+                     size_t len, size_t *out_len)
+{
+    struct iovec iov;
+
+    iov.iov_base = data;
+    iov.iov_len = len;
+
+    return flb_io_net_writev(u_conn, &iov, 1, out_len);
+}
+
+/*
+ * Send 'data' over a unix socket connection with the file descriptor 'fd'
+ * attached (SCM_RIGHTS): the peer gets its own copy of the descriptor
+ * along with the first byte, the caller keeps 'fd' open.
+ */
+int flb_io_net_send_fd(struct flb_upstream_conn *u_conn, void *data,
+                       size_t len, int fd)
+{
+    int ret;
+    ssize_t bytes;
+    size_t out_len;
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } ctl;
+    struct flb_upstream *u = u_conn->u;
+
+#if defined (FLB_HAVE_FLUSH_LIBCO)
+    struct flb_thread *th = pthread_getspecific(flb_thread_key);
+#else
+    void *th = NULL;
+#endif
+
+    if (!(u->flags & FLB_IO_UNIX) || u_conn->fd <= 0 || len == 0) {
+        return -1;
+    }
+
+    iov.iov_base = data;
+    iov.iov_len = len;
+
+    memset(&msg, '\0', sizeof(msg));
+    memset(&ctl, '\0', sizeof(ctl));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    while ((bytes = sendmsg(u_conn->fd, &msg, MSG_NOSIGNAL)) == -1) {
+        if (errno != EAGAIN || !(u->flags & FLB_IO_ASYNC) || !th) {
+            goto error;
+        }
+
+        /* Wait for the socket to be writable */
+        u_conn->thread = th;
+        ret = mk_event_add(u_conn->evl, u_conn->fd,
+                           FLB_ENGINE_EV_THREAD,
+                           MK_EVENT_WRITE, &u_conn->event);
+        if (ret == -1) {
+            goto error;
+        }
+        flb_thread_yield(th, FLB_FALSE);
+        mk_event_del(u_conn->evl, &u_conn->event);
+    }
+    FLB_PROBE3(net_write, u_conn->fd, bytes, 0);
+
+    /* The descriptor went with the first byte, the rest is plain data */
+    if (bytes < len) {
+        ret = flb_io_net_write(u_conn, (char *) data + bytes, len - bytes,
+                               &out_len);
+        return ret == -1 ? -1 : 0;
+    }
+
+    return 0;
+
+ error:
+    flb_socket_close(u_conn->fd);
+    u_conn->fd = -1;
+    return -1;
+}
+
 ssize_t flb_io_net_read(struct flb_upstream_conn *u_conn, void *buf, size_t len)
 {
     int ret = -1;
@@ -499,6 +757,11 @@ ssize_t flb_io_net_read(struct flb_upstream_conn *u_conn, void *buf, size_t len)
     }
 #endif
 
+    /* A broken or closed connection cannot be recycled by the upstream */
+    if (ret <= 0) {
+        flb_upstream_conn_recycle(u_conn, FLB_FALSE);
+    }
+
     flb_trace("[io thread=%p] [net_read] ret=%i", th, ret);
     return ret;
 }
@@ -23,10 +23,12 @@
 #include <mbedtls/ctr_drbg.h>
 #include <mbedtls/debug.h>
 #include <mbedtls/error.h>
+#include <mbedtls/aesni.h>
 
 #include <monkey/mk_core.h>
 #include <fluent-bit/flb_info.h>
 #include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_str.h>
 #include <fluent-bit/flb_io.h>
 #include <fluent-bit/flb_tls.h>
 #include <fluent-bit/flb_io_tls.h>
@@ -36,9 +38,16 @@
 #include <fluent-bit/flb_network.h>
 #include <fluent-bit/flb_engine.h>
 #include <fluent-bit/flb_thread.h>
+#include <fluent-bit/flb_metrics.h>
+
+#include <pthread.h>
 
 #define FLB_TLS_CLIENT   "Fluent Bit"
 
+/* Contexts shared by the instances with the same settings */
+static pthread_mutex_t tls_contexts_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct mk_list tls_contexts = {&tls_contexts, &tls_contexts};
+
 #define io_tls_error(ret) _io_tls_error(ret, __FILE__, __LINE__)
 
 void _io_tls_error(int ret, char *file, int line)
@@ -54,11 +63,10 @@ static inline int io_tls_event_switch(struct flb_upstream_conn *u_conn,
 {
     int ret;
     struct mk_event *event;
-    struct flb_upstream *u = u_conn->u;
 
     event = &u_conn->event;
     if ((event->mask & mask) == 0) {
-        ret = mk_event_add(u->evl,
+        ret = mk_event_add(u_conn->evl,
                            event->fd,
                            FLB_ENGINE_EV_THREAD,
                            mask, &u_conn->event);
@@ -71,6 +79,45 @@ static inline int io_tls_event_switch(struct flb_upstream_conn *u_conn,
     return 0;
 }
 
+static void flb_tls_debug(void *ctx, int level,
+                          const char *file, int line,
+                          const char *str)
+{
+    int len;
+    char *p;
+    ((void) level);
+
+    len = strlen(str);
+    p = (char *) str;
+    p[len - 1] = '\0';
+
+    flb_debug("[io_tls] %s %04d: %s", file + sizeof(FLB_SOURCE_DIR) - 1,
+              line, str);
+}
+
+#ifdef MBEDTLS_SSL_ALPN
+/* Protocols offered by the HTTP/2 sessions, by preference */
+static const char *tls_alpn_h2[] = {"h2", "http/1.1", NULL};
+#endif
+
+/*
+ * The CTR-DRBG is shared by the sessions of the context, and they handshake
+ * from the engine, the output workers, the engine shards and the upstream
+ * warm up thread. mbedtls is built without MBEDTLS_THREADING_C, so the
+ * generator is serialized here.
+ */
+static int io_tls_rng(void *data, unsigned char *output, size_t len)
+{
+    int ret;
+    struct flb_tls_context *ctx = data;
+
+    pthread_mutex_lock(&ctx->rng_lock);
+    ret = mbedtls_ctr_drbg_random(&ctx->ctr_drbg, output, len);
+    pthread_mutex_unlock(&ctx->rng_lock);
+
+    return ret;
+}
+
 struct flb_tls_context *flb_tls_context_new(int verify,
                                             int debug,
                                             char *ca_path,
@@ -88,6 +135,7 @@ struct flb_tls_context *flb_tls_context_new(int verify,
     ctx->verify    = verify;
     ctx->debug     = debug;
     ctx->certs_set = 0;
+    pthread_mutex_init(&ctx->rng_lock, NULL);
 
     mbedtls_entropy_init(&ctx->entropy);
     mbedtls_ctr_drbg_init(&ctx->ctr_drbg);
@@ -148,6 +196,71 @@ struct flb_tls_context *flb_tls_context_new(int verify,
         ctx->certs_set |= FLB_TLS_PRIV_KEY;
     }
 
+    /* Client configuration, shared by the sessions */
+    mbedtls_ssl_config_init(&ctx->conf);
+    ctx->conf_set = FLB_TRUE;
+    ret = mbedtls_ssl_config_defaults(&ctx->conf,
+                                      MBEDTLS_SSL_IS_CLIENT,
+                                      MBEDTLS_SSL_TRANSPORT_STREAM,
+                                      MBEDTLS_SSL_PRESET_DEFAULT);
+    if (ret != 0) {
+        io_tls_error(ret);
+        goto error;
+    }
+
+    mbedtls_ssl_conf_rng(&ctx->conf, io_tls_rng, ctx);
+
+    if (ctx->debug >= 0) {
+        mbedtls_ssl_conf_dbg(&ctx->conf, flb_tls_debug, NULL);
+        mbedtls_debug_set_threshold(ctx->debug);
+    }
+
+    if (ctx->verify == FLB_TRUE) {
+        mbedtls_ssl_conf_authmode(&ctx->conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+    }
+    else {
+        mbedtls_ssl_conf_authmode(&ctx->conf, MBEDTLS_SSL_VERIFY_NONE);
+    }
+
+#ifdef MBEDTLS_SSL_SESSION_TICKETS
+    /* Servers can hand a ticket, resumed connections skip the key exchange */
+    mbedtls_ssl_conf_session_tickets(&ctx->conf,
+                                     MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+#endif
+
+    /* CA Root */
+    if (ctx->certs_set & FLB_TLS_CA_ROOT) {
+        mbedtls_ssl_conf_ca_chain(&ctx->conf, &ctx->ca_cert, NULL);
+    }
+
+    /* Specific Cert */
+    if (ctx->certs_set & FLB_TLS_CERT) {
+        ret = mbedtls_ssl_conf_own_cert(&ctx->conf, &ctx->cert,
+                                        &ctx->priv_key);
+        if (ret != 0) {
+            flb_error("[TLS] Error loading certificate with private key");
+            goto error;
+        }
+    }
+
+    /*
+     * HTTP/2 sessions negotiate the protocol with ALPN. The configuration
+     * is a copy of the client one: it references the same certificates and
+     * random generator and it's not freed on its own.
+     */
+    ctx->conf_h2 = ctx->conf;
+#ifdef MBEDTLS_SSL_ALPN
+    mbedtls_ssl_conf_alpn_protocols(&ctx->conf_h2, tls_alpn_h2);
+#endif
+
+#if defined(MBEDTLS_AESNI_C) && defined(MBEDTLS_HAVE_X86_64)
+    /* AES-GCM records use the CPU instructions when they are available */
+    flb_debug("[io_tls] AES-NI %s, PCLMUL %s",
+              mbedtls_aesni_has_support(MBEDTLS_AESNI_AES) ? "on" : "off",
+              mbedtls_aesni_has_support(MBEDTLS_AESNI_CLMUL) ? "on" : "off");
+#endif
+
+    ctx->users = 1;
     return ctx;
 
  error:
@@ -155,8 +268,85 @@ struct flb_tls_context *flb_tls_context_new(int verify,
     return NULL;
 }
 
+static inline int tls_str_eq(char *a, char *b)
+{
+    if (!a || !b) {
+        return (a == b);
+    }
+    return (strcmp(a, b) == 0);
+}
+
+/*
+ * Get a context for the given settings: an existing one is shared if the
+ * settings match, otherwise it's created. Loading the CA path and parsing
+ * the certificates is done once for all the instances.
+ */
+struct flb_tls_context *flb_tls_context_get(int verify,
+                                            int debug,
+                                            char *ca_path,
+                                            char *ca_file, char *crt_file,
+                                            char *key_file, char *key_passwd)
+{
+    struct mk_list *head;
+    struct flb_tls_context *ctx;
+
+    pthread_mutex_lock(&tls_contexts_lock);
+    mk_list_foreach(head, &tls_contexts) {
+        ctx = mk_list_entry(head, struct flb_tls_context, _head);
+        if (ctx->verify == verify && ctx->debug == debug &&
+            tls_str_eq(ctx->ca_path, ca_path) &&
+            tls_str_eq(ctx->ca_file, ca_file) &&
+            tls_str_eq(ctx->crt_file, crt_file) &&
+            tls_str_eq(ctx->key_file, key_file) &&
+            tls_str_eq(ctx->key_passwd, key_passwd)) {
+            ctx->users++;
+            pthread_mutex_unlock(&tls_contexts_lock);
+            flb_debug("[io_tls] sharing TLS context, %i users", ctx->users);
+            return ctx;
+        }
+    }
+
+    ctx = flb_tls_context_new(verify, debug, ca_path, ca_file,
+                              crt_file, key_file, key_passwd);
+    if (!ctx) {
+        pthread_mutex_unlock(&tls_contexts_lock);
+        return NULL;
+    }
+
+    ctx->ca_path = ca_path ? flb_strdup(ca_path) : NULL;
+    ctx->ca_file = ca_file ? flb_strdup(ca_file) : NULL;
+    ctx->crt_file = crt_file ? flb_strdup(crt_file) : NULL;
+    ctx->key_file = key_file ? flb_strdup(key_file) : NULL;
+    ctx->key_passwd = key_passwd ? flb_strdup(key_passwd) : NULL;
+    mk_list_add(&ctx->_head, &tls_contexts);
+    pthread_mutex_unlock(&tls_contexts_lock);
+
+    return ctx;
+}
+
+/* Release a reference, the last user destroys the context */
 void flb_tls_context_destroy(struct flb_tls_context *ctx)
 {
+    if (ctx->_head.next) {
+        pthread_mutex_lock(&tls_contexts_lock);
+        if (--ctx->users > 0) {
+            pthread_mutex_unlock(&tls_contexts_lock);
+            return;
+        }
+        mk_list_del(&ctx->_head);
+        pthread_mutex_unlock(&tls_contexts_lock);
+
+        flb_free(ctx->ca_path);
+        flb_free(ctx->ca_file);
+        flb_free(ctx->crt_file);
+        flb_free(ctx->key_file);
+        flb_free(ctx->key_passwd);
+    }
+
+    if (ctx->conf_set == FLB_TRUE) {
+        mbedtls_ssl_config_free(&ctx->conf);
+    }
+
     if (ctx->certs_set & FLB_TLS_CA_ROOT) {
         mbedtls_x509_crt_free(&ctx->ca_cert);
     }
@@ -169,26 +359,12 @@ void flb_tls_context_destroy(struct flb_tls_context *ctx)
         mbedtls_pk_free(&ctx->priv_key);
     }
 
+    pthread_mutex_destroy(&ctx->rng_lock);
     flb_free(ctx);
 }
 
-static void flb_tls_debug(void *ctx, int level,
-                          const char *file, int line,
-                          const char *str)
-{
-    int len;
-    char *p;
-    ((void) level);
-
-    len = strlen(str);
-    p = (char *) str;
-    p[len - 1] = '\0';
-
-    flb_debug("[io_tls] %s %04d: %s", file + sizeof(FLB_SOURCE_DIR) - 1,
-              line, str);
-}
-
-struct flb_tls_session *flb_tls_session_new(struct flb_tls_context *ctx)
+struct flb_tls_session *flb_tls_session_new(struct flb_tls_context *ctx,
+                                            int http2)
 {
     int ret;
     struct flb_tls_session *session;
@@ -202,53 +378,15 @@ struct flb_tls_session *flb_tls_session_new(struct flb_tls_context *ctx)
         return NULL;
     }
 
-    mbedtls_ssl_init(&session->ssl);
+    session->net = NULL;
+    session->rbuf_pos = 0;
+    session->rbuf_len = 0;
 
-    mbedtls_ssl_config_init(&session->conf);
-    ret = mbedtls_ssl_config_defaults(&session->conf,
-                                      MBEDTLS_SSL_IS_CLIENT,
-                                      MBEDTLS_SSL_TRANSPORT_STREAM,
-                                      MBEDTLS_SSL_PRESET_DEFAULT);
+    mbedtls_ssl_init(&session->ssl);
+    ret = mbedtls_ssl_setup(&session->ssl,
+                            http2 == FLB_TRUE ? &ctx->conf_h2 : &ctx->conf);
     if (ret != 0) {
         io_tls_error(ret);
-    }
-
-    mbedtls_ssl_conf_rng(&session->conf,
-                         mbedtls_ctr_drbg_random,
-                         &ctx->ctr_drbg);
-
-    if (ctx->debug >= 0) {
-        mbedtls_ssl_conf_dbg(&session->conf, flb_tls_debug, NULL);
-        mbedtls_debug_set_threshold(ctx->debug);
-    }
-
-    if (ctx->verify == FLB_TRUE) {
-        mbedtls_ssl_conf_authmode(&session->conf, MBEDTLS_SSL_VERIFY_REQUIRED);
-    }
-    else {
-        mbedtls_ssl_conf_authmode(&session->conf, MBEDTLS_SSL_VERIFY_NONE);
-    }
-
-
-    /* CA Root */
-    if (ctx->certs_set & FLB_TLS_CA_ROOT) {
-        mbedtls_ssl_conf_ca_chain(&session->conf, &ctx->ca_cert, NULL);
-    }
-
-    /* Specific Cert */
-    if (ctx->certs_set & FLB_TLS_CERT) {
-        ret = mbedtls_ssl_conf_own_cert(&session->conf,
-                                        &ctx->cert,
-                                        &ctx->priv_key);
-        if (ret != 0) {
-            flb_error("[TLS] Error loading certificate with private key");
-            goto error;
-        }
-    }
-
-
-    ret = mbedtls_ssl_setup(&session->ssl, &session->conf);
-    if (ret == -1) {
         flb_error("[tls] ssl_setup");
         goto error;
     }
@@ -256,6 +394,7 @@ struct flb_tls_session *flb_tls_session_new(struct flb_tls_context *ctx)
     return session;
 
  error:
+    mbedtls_ssl_free(&session->ssl);
     flb_free(session);
     return NULL;
 }
@@ -264,41 +403,160 @@ int flb_tls_session_destroy(struct flb_tls_session *session)
 {
     if (session) {
         mbedtls_ssl_free(&session->ssl);
-        mbedtls_ssl_config_free(&session->conf);
         flb_free(session);
     }
 
     return 0;
 }
 
+/* Receive callback for mbedtls, it reads ahead as much as available */
+static int io_tls_net_recv(void *ctx, unsigned char *buf, size_t len)
+{
+    int ret;
+    size_t n;
+    struct flb_tls_session *session = ctx;
+
+    if (session->rbuf_pos == session->rbuf_len) {
+        /* Nothing buffered and a big read, no need to copy it */
+        if (len >= FLB_TLS_READ_AHEAD) {
+            return mbedtls_net_recv(session->net, buf, len);
+        }
+
+        ret = mbedtls_net_recv(session->net, session->rbuf,
+                               FLB_TLS_READ_AHEAD);
+        if (ret <= 0) {
+            return ret;
+        }
+        session->rbuf_pos = 0;
+        session->rbuf_len = ret;
+    }
+
+    n = session->rbuf_len - session->rbuf_pos;
+    if (n > len) {
+        n = len;
+    }
+    memcpy(buf, session->rbuf + session->rbuf_pos, n);
+    session->rbuf_pos += n;
+
+    return n;
+}
+
+static int io_tls_net_send(void *ctx, const unsigned char *buf, size_t len)
+{
+    struct flb_tls_session *session = ctx;
+
+    return mbedtls_net_send(session->net, buf, len);
+}
+
+/* Records already received, decrypted or not */
+static inline int io_tls_pending(struct flb_tls_session *session)
+{
+    return (mbedtls_ssl_get_bytes_avail(&session->ssl) > 0 ||
+            session->rbuf_pos < session->rbuf_len);
+}
+
+/* Offer the session cached in the upstream, if any */
+static void io_tls_resume_set(struct flb_upstream *u,
+                              struct flb_tls_session *session)
+{
+    pthread_mutex_lock(&u->mutex_queue);
+    if (u->tls_resume_set == FLB_TRUE) {
+        mbedtls_ssl_set_session(&session->ssl, &u->tls_resume);
+    }
+    pthread_mutex_unlock(&u->mutex_queue);
+}
+
+#ifdef FLB_HAVE_METRICS
+static void io_tls_metrics(struct flb_upstream *u, int resumed,
+                           uint64_t start)
+{
+    struct flb_metrics *metrics = u->tls->metrics;
+
+    if (!metrics) {
+        return;
+    }
+
+    flb_metrics_sum(FLB_METRIC_OUT_TLS_HANDSHAKES, 1, metrics);
+    if (resumed == FLB_TRUE) {
+        flb_metrics_sum(FLB_METRIC_OUT_TLS_RESUMED, 1, metrics);
+    }
+    flb_metrics_observe(FLB_METRIC_OUT_TLS_HANDSHAKE_TIME,
+                        flb_metrics_clock() - start, metrics);
+}
+#endif
+
+/*
+ * Keep the session of a completed handshake so the next connections can
+ * resume it, a failed handshake drops it in case it was rejected.
+ */
+static void io_tls_resume_save(struct flb_upstream *u,
+                               struct flb_tls_session *session, int ok)
+{
+    pthread_mutex_lock(&u->mutex_queue);
+    if (u->tls_resume_set == FLB_TRUE) {
+        mbedtls_ssl_session_free(&u->tls_resume);
+        u->tls_resume_set = FLB_FALSE;
+    }
+    if (ok == FLB_TRUE) {
+        mbedtls_ssl_session_init(&u->tls_resume);
+        if (mbedtls_ssl_get_session(&session->ssl, &u->tls_resume) == 0) {
+            u->tls_resume_set = FLB_TRUE;
+        }
+        else {
+            mbedtls_ssl_session_free(&u->tls_resume);
+        }
+    }
+    pthread_mutex_unlock(&u->mutex_queue);
+}
+
 /* Perform a TLS handshake */
 int net_io_tls_handshake(void *_u_conn, void *_th)
 {
     int ret;
     int flag;
+    int resumed = FLB_TRUE;
     struct flb_tls_session *session;
     struct flb_upstream_conn *u_conn = _u_conn;
     struct flb_upstream *u = u_conn->u;
+#ifdef FLB_HAVE_METRICS
+    uint64_t start = flb_metrics_clock();
+#endif
 
     struct flb_thread *th = _th;
 
-    session = flb_tls_session_new(u->tls->context);
+    session = flb_tls_session_new(u->tls->context,
+                                  u_conn->h2 ? FLB_TRUE : FLB_FALSE);
     if (!session) {
         flb_error("[io_tls] could not create tls session");
         return -1;
     }
     mbedtls_ssl_set_hostname(&session->ssl,u->tcp_host);
+    io_tls_resume_set(u, session);
 
     /* Store session and mbedtls net context fd */
     u_conn->tls_session = session;
     u_conn->tls_net_context.fd = u_conn->fd;
 
-    mbedtls_ssl_set_bio(&session->ssl,
-                        &u_conn->tls_net_context,
-                        mbedtls_net_send, mbedtls_net_recv, NULL);
+    session->net = &u_conn->tls_net_context;
+    mbedtls_ssl_set_bio(&session->ssl, session,
+                        io_tls_net_send, io_tls_net_recv, NULL);
 
+    /*
+     * Same as mbedtls_ssl_handshake() but step by step: a handshake that
+     * goes through the server certificate is a full one, the resumed
+     * ones go from the server hello to the change cipher spec.
+     */
  retry_handshake:
-    ret = mbedtls_ssl_handshake(&session->ssl);
+    ret = 0;
+    while (session->ssl.state != MBEDTLS_SSL_HANDSHAKE_OVER) {
+        if (session->ssl.state == MBEDTLS_SSL_SERVER_CERTIFICATE) {
+            resumed = FLB_FALSE;
+        }
+        ret = mbedtls_ssl_handshake_step(&session->ssl);
+        if (ret != 0) {
+            break;
+        }
+    }
     if (ret != 0) {
         if (ret != MBEDTLS_ERR_SSL_WANT_READ &&
             ret !=  MBEDTLS_ERR_SSL_WANT_WRITE) {
@@ -320,7 +578,7 @@ int net_io_tls_handshake(void *_u_conn, void *_th)
          * FIXME: if we need multiple reads we are invoking the same
          * system call multiple times.
          */
-        ret = mk_event_add(u->evl,
+        ret = mk_event_add(u_conn->evl,
                            u_conn->event.fd,
                            FLB_ENGINE_EV_THREAD,
                            flag, &u_conn->event);
@@ -335,29 +593,46 @@ int net_io_tls_handshake(void *_u_conn, void *_th)
         flb_trace("[io_tls] Handshake OK");
     }
 
+    flb_debug("[io_tls] %s handshake with %s:%i",
+              resumed == FLB_TRUE ? "abbreviated" : "full",
+              u->tcp_host, u->tcp_port);
+#ifdef FLB_HAVE_METRICS
+    io_tls_metrics(u, resumed, start);
+#endif
+
+    /* Cache the (new or resumed) session for the next connections */
+    io_tls_resume_save(u, session, FLB_TRUE);
+
     if (u_conn->event.status & MK_EVENT_REGISTERED) {
-        mk_event_del(u->evl, &u_conn->event);
+        mk_event_del(u_conn->evl, &u_conn->event);
     }
     flb_trace("[io_tls] connection OK");
     return 0;
 
  error:
     if (u_conn->event.status & MK_EVENT_REGISTERED) {
-        mk_event_del(u->evl, &u_conn->event);
+        mk_event_del(u_conn->evl, &u_conn->event);
     }
+    io_tls_resume_save(u, session, FLB_FALSE);
     flb_tls_session_destroy(u_conn->tls_session);
     u_conn->tls_session = NULL;
 
     return -1;
 }
 
+/*
+ * Read into 'buf', besides the first record it takes all the data already
+ * received that fits: a response spread in many records is read at once.
+ */
 int flb_io_tls_net_read(struct flb_thread *th, struct flb_upstream_conn *u_conn,
                         void *buf, size_t len)
 {
     int ret;
+    size_t total;
+    struct flb_tls_session *session = u_conn->tls_session;
 
  retry_read:
-    ret = mbedtls_ssl_read(&u_conn->tls_session->ssl, buf, len);
+    ret = mbedtls_ssl_read(&session->ssl, buf, len);
     if (ret == MBEDTLS_ERR_SSL_WANT_READ) {
         u_conn->thread = th;
         io_tls_event_switch(u_conn, MK_EVENT_READ);
@@ -375,7 +650,18 @@ int flb_io_tls_net_read(struct flb_thread *th, struct flb_upstream_conn *u_conn,
         return -1;
     }
 
-    return ret;
+    total = ret;
+    while (total < len && io_tls_pending(session)) {
+        ret = mbedtls_ssl_read(&session->ssl,
+                               (unsigned char *) buf + total, len - total);
+        if (ret <= 0) {
+            /* errors and the end of the stream show up on the next read */
+            break;
+        }
+        total += ret;
+    }
+
+    return total;
 }
 
 int flb_io_tls_net_write(struct flb_thread *th, struct flb_upstream_conn *u_conn,
@@ -383,7 +669,6 @@ int flb_io_tls_net_write(struct flb_thread *th, struct flb_upstream_conn *u_conn
 {
     int ret;
     size_t total = 0;
-    struct flb_upstream *u = u_conn->u;
 
     u_conn->thread = th;
 
@@ -417,6 +702,6 @@ int flb_io_tls_net_write(struct flb_thread *th, struct flb_upstream_conn *u_conn
     }
 
     *out_len = total;
-    mk_event_del(u->evl, &u_conn->event);
+    mk_event_del(u_conn->evl, &u_conn->event);
     return 0;
 }
@@ -0,0 +1,901 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_log.h>
+#include <fluent-bit/flb_error.h>
+#include <fluent-bit/flb_json.h>
+
+#include <msgpack.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define FLB_JSON_SSE2
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define FLB_JSON_NEON
+#include <arm_neon.h>
+#endif
+
+#define JSON_EVEN_BITS    0x5555555555555555ULL
+#define JSON_NUMBER_MAX   64
+#define JSON_STACK_SIZE   64
+
+#define json_is_space(c)  (c == ' ' || c == '\n' || c == '\r' || c == '\t')
+#define json_is_digit(c)  (c >= '0' && c <= '9')
+
+/*
+ * Stage 1: structural scan
+ * ------------------------
+ * Every block of 64 bytes is turned into four bit masks: quotes, backslashes,
+ * opening and closing brackets. '{' and '[' only differ by the 0x20 bit, so
+ * are '}' and ']', one comparison finds both.
+ */
+#ifdef FLB_JSON_SSE2
+static inline void scan_masks(const char *p, uint64_t *quote, uint64_t *bs,
+                              uint64_t *open, uint64_t *close)
+{
+    int i;
+    uint64_t m;
+    __m128i v;
+    __m128i low;
+    const __m128i q = _mm_set1_epi8('"');
+    const __m128i b = _mm_set1_epi8('\\');
+    const __m128i o = _mm_set1_epi8('{');
+    const __m128i c = _mm_set1_epi8('}');
+    const __m128i x = _mm_set1_epi8(0x20);
+
+    *quote = *bs = *open = *close = 0;
+    for (i = 0; i < 64; i += 16) {
+        v = _mm_loadu_si128((const __m128i *) (p + i));
+        low = _mm_or_si128(v, x);
+
+        m = (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(v, q));
+        *quote |= m << i;
+        m = (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(v, b));
+        *bs |= m << i;
+        m = (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(low, o));
+        *open |= m << i;
+        m = (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(low, c));
+        *close |= m << i;
+    }
+}
+#elif defined(FLB_JSON_NEON)
+/* NEON does not have a movemask, weight the lanes and add them pairwise */
+static inline uint64_t neon_mask(uint8x16_t r0, uint8x16_t r1,
+                                 uint8x16_t r2, uint8x16_t r3)
+{
+    const uint8x16_t w = {1, 2, 4, 8, 16, 32, 64, 128,
+                          1, 2, 4, 8, 16, 32, 64, 128};
+    uint8x16_t s0;
+    uint8x16_t s1;
+
+    s0 = vpaddq_u8(vandq_u8(r0, w), vandq_u8(r1, w));
+    s1 = vpaddq_u8(vandq_u8(r2, w), vandq_u8(r3, w));
+    s0 = vpaddq_u8(s0, s1);
+    s0 = vpaddq_u8(s0, s0);
+
+    return vgetq_lane_u64(vreinterpretq_u64_u8(s0), 0);
+}
+
+static inline void scan_masks(const char *p, uint64_t *quote, uint64_t *bs,
+                              uint64_t *open, uint64_t *close)
+{
+    int i;
+    uint8x16_t v[4];
+    uint8x16_t low[4];
+    const uint8x16_t x = vdupq_n_u8(0x20);
+
+    for (i = 0; i < 4; i++) {
+        v[i] = vld1q_u8((const uint8_t *) (p + (i * 16)));
+        low[i] = vorrq_u8(v[i], x);
+    }
+
+#define NEON_EQ(a, ch)                                                  \
+    neon_mask(vceqq_u8(a[0], vdupq_n_u8(ch)), vceqq_u8(a[1], vdupq_n_u8(ch)), \
+              vceqq_u8(a[2], vdupq_n_u8(ch)), vceqq_u8(a[3], vdupq_n_u8(ch)))
+
+    *quote = NEON_EQ(v, '"');
+    *bs    = NEON_EQ(v, '\\');
+    *open  = NEON_EQ(low, '{');
+    *close = NEON_EQ(low, '}');
+
+#undef NEON_EQ
+}
+#else
+static inline void scan_masks(const char *p, uint64_t *quote, uint64_t *bs,
+                              uint64_t *open, uint64_t *close)
+{
+    int i;
+    char c;
+
+    *quote = *bs = *open = *close = 0;
+    for (i = 0; i < 64; i++) {
+        c = p[i];
+        if (c == '"') {
+            *quote |= 1ULL << i;
+        }
+        else if (c == '\\') {
+            *bs |= 1ULL << i;
+        }
+        else if ((c | 0x20) == '{') {
+            *open |= 1ULL << i;
+        }
+        else if ((c | 0x20) == '}') {
+            *close |= 1ULL << i;
+        }
+    }
+}
+#endif
+
+/*
+ * Bytes preceded by an odd number of backslashes are escaped. A run of
+ * backslashes is added to its first bit so the carry lands right after the
+ * run, the parity of where it started and where it ended tells if the run
+ * length is odd. 'prev' carries an odd run ending at the previous block.
+ */
+static inline uint64_t scan_escaped(uint64_t bs, uint64_t *prev)
+{
+    uint64_t starts;
+    uint64_t even_starts;
+    uint64_t odd_starts;
+    uint64_t even_mask;
+    uint64_t even_ends;
+    uint64_t odd_ends;
+    uint64_t odd_carries;
+    int overflow;
+
+    starts = bs & ~(bs << 1);
+    even_mask = JSON_EVEN_BITS ^ *prev;
+    even_starts = starts & even_mask;
+    odd_starts = starts & ~even_mask;
+
+    even_ends = (bs + even_starts) & ~bs;
+    overflow = __builtin_add_overflow(bs, odd_starts, &odd_carries);
+    odd_ends = (odd_carries | *prev) & ~bs;
+    *prev = overflow;
+
+    return (even_ends & ~JSON_EVEN_BITS) | (odd_ends & JSON_EVEN_BITS);
+}
+
+/* Bit i is set if an odd number of bits are set in [0, i] */
+static inline uint64_t prefix_xor(uint64_t m)
+{
+    m ^= m << 1;
+    m ^= m << 2;
+    m ^= m << 4;
+    m ^= m << 8;
+    m ^= m << 16;
+    m ^= m << 32;
+
+    return m;
+}
+
+/*
+ * Scan one block, it returns the offset of the bracket closing the root
+ * value or -1 if the value continues in the next block.
+ */
+static inline int scan_block(const char *p, struct flb_json_scan *scan)
+{
+    int n;
+    uint64_t bit;
+    uint64_t quote;
+    uint64_t bs;
+    uint64_t open;
+    uint64_t close;
+    uint64_t in_string;
+    uint64_t brackets;
+
+    scan_masks(p, &quote, &bs, &open, &close);
+
+    if (bs || scan->escaped) {
+        quote &= ~scan_escaped(bs, &scan->escaped);
+    }
+
+    in_string = prefix_xor(quote) ^ scan->string;
+    scan->string = (uint64_t) ((int64_t) in_string >> 63);
+
+    open &= ~in_string;
+    close &= ~in_string;
+
+    /* Fast path: the depth cannot get to zero in this block */
+    n = __builtin_popcountll(close);
+    if (n < scan->depth) {
+        scan->depth += __builtin_popcountll(open) - n;
+        return -1;
+    }
+
+    brackets = open | close;
+    while (brackets) {
+        bit = brackets & -brackets;
+        if (open & bit) {
+            scan->depth++;
+        }
+        else if (--scan->depth == 0) {
+            return __builtin_ctzll(bit);
+        }
+        brackets ^= bit;
+    }
+
+    return -1;
+}
+
+/* Find the first quote or backslash in [p, end) */
+static inline const char *string_special(const char *p, const char *end)
+{
+#ifdef FLB_JSON_SSE2
+    uint32_t mask;
+    __m128i v;
+    const __m128i q = _mm_set1_epi8('"');
+    const __m128i b = _mm_set1_epi8('\\');
+
+    for (; p + 16 <= end; p += 16) {
+        v = _mm_loadu_si128((const __m128i *) p);
+        mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, q),
+                                              _mm_cmpeq_epi8(v, b)));
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+#elif defined(FLB_JSON_NEON)
+    uint64_t bits;
+    uint8x16_t v;
+    const uint8x16_t q = vdupq_n_u8('"');
+    const uint8x16_t b = vdupq_n_u8('\\');
+
+    for (; p + 16 <= end; p += 16) {
+        v = vld1q_u8((const uint8_t *) p);
+        v = vorrq_u8(vceqq_u8(v, q), vceqq_u8(v, b));
+        bits = vget_lane_u64(vreinterpret_u64_u8(
+                  vshrn_n_u16(vreinterpretq_u16_u8(v), 4)), 0);
+        if (bits) {
+            return p + (__builtin_ctzll(bits) >> 2);
+        }
+    }
+#endif
+
+    for (; p < end; p++) {
+        if (*p == '"' || *p == '\\') {
+            return p;
+        }
+    }
+
+    return end;
+}
+
+void flb_json_scan_init(struct flb_json_scan *scan)
+{
+    memset(scan, '\0', sizeof(struct flb_json_scan));
+}
+
+/*
+ * Find where the root values end. Objects and arrays are scanned by blocks,
+ * anything between them is checked byte by byte. 'scan->end' is set after
+ * the last complete root value. A trailing block shorter than 64 bytes is
+ * padded and only takes effect if a root value ends inside it, otherwise it
+ * is scanned again when more data arrives.
+ */
+int flb_json_scan(const char *js, size_t len, struct flb_json_scan *scan)
+{
+    int off;
+    char c;
+    char block[64];
+    const char *p;
+    size_t pos;
+    struct flb_json_scan tmp;
+
+    pos = scan->pos;
+    while (pos < len) {
+        if (scan->depth > 0) {
+            if (len - pos >= 64) {
+                off = scan_block(js + pos, scan);
+                if (off == -1) {
+                    pos += 64;
+                    continue;
+                }
+            }
+            else {
+                memset(block, ' ', sizeof(block));
+                memcpy(block, js + pos, len - pos);
+                tmp = *scan;
+                off = scan_block(block, &tmp);
+                if (off == -1) {
+                    break;
+                }
+                scan->depth = 0;
+            }
+
+            pos += off + 1;
+            scan->end = pos;
+            scan->escaped = 0;
+            scan->string = 0;
+            continue;
+        }
+
+        c = js[pos];
+        if (json_is_space(c) || c == ',') {
+            pos++;
+        }
+        else if (c == '{' || c == '[') {
+            scan->depth = 1;
+            pos++;
+        }
+        else if (c == '}' || c == ']') {
+            scan->pos = pos;
+            return FLB_ERR_JSON_INVAL;
+        }
+        else if (c == '"') {
+            /* root string */
+            p = string_special(js + pos + 1, js + len);
+            while (p < js + len && *p == '\\') {
+                p = string_special(p + 2, js + len);
+            }
+            if (p >= js + len) {
+                break;
+            }
+            pos = (p - js) + 1;
+            scan->end = pos;
+        }
+        else {
+            /* root primitive, it ends at the next delimiter */
+            p = js + pos;
+            while (p < js + len && !json_is_space(*p) && *p != ',' &&
+                   *p != '{' && *p != '[' && *p != '}' && *p != ']' &&
+                   *p != '"') {
+                p++;
+            }
+            if (p == js + len) {
+                break;
+            }
+            pos = p - js;
+            scan->end = pos;
+        }
+    }
+
+    scan->pos = pos;
+    return 0;
+}
+
+/*
+ * Stage 2: parser
+ * ---------------
+ * The msgpack buffer is written by a custom msgpack writer on top of
+ * flb_realloc(), so the result can be released with flb_free().
+ */
+struct json_buf {
+    int error;
+    char *data;
+    size_t size;
+    size_t alloc;
+};
+
+struct json_frame {
+    size_t offset;       /* offset of the container header */
+    uint32_t count;      /* number of entries              */
+    char type;           /* '{' or '['                     */
+};
+
+static int json_buf_reserve(struct json_buf *jb, size_t len)
+{
+    size_t size;
+    char *tmp;
+
+    if (jb->size + len <= jb->alloc) {
+        return 0;
+    }
+
+    size = jb->alloc * 2;
+    if (size < jb->size + len) {
+        size = jb->size + len;
+    }
+
+    tmp = flb_realloc(jb->data, size);
+    if (!tmp) {
+        flb_errno();
+        return -1;
+    }
+    jb->data = tmp;
+    jb->alloc = size;
+
+    return 0;
+}
+
+static int json_buf_write(void *data, const char *buf, size_t len)
+{
+    struct json_buf *jb = data;
+
+    if (json_buf_reserve(jb, len) == -1) {
+        jb->error = FLB_TRUE;
+        return -1;
+    }
+    memcpy(jb->data + jb->size, buf, len);
+    jb->size += len;
+
+    return 0;
+}
+
+/*
+ * Entries are only known when the container closes: one byte is reserved
+ * for the header, which is enough for up to 15 entries. Bigger containers
+ * move their body to make room for a 16 or 32 bits header.
+ */
+static int json_close(struct json_buf *jb, struct json_frame *f)
+{
+    int hdr;
+    char *h;
+    uint32_t n = f->count;
+
+    if (n <= 15) {
+        jb->data[f->offset] = (f->type == '{' ? 0x80 : 0x90) | n;
+        return 0;
+    }
+
+    hdr = (n <= 0xffff) ? 3 : 5;
+    if (json_buf_reserve(jb, hdr - 1) == -1) {
+        return -1;
+    }
+    memmove(jb->data + f->offset + hdr, jb->data + f->offset + 1,
+            jb->size - f->offset - 1);
+    jb->size += hdr - 1;
+
+    h = jb->data + f->offset;
+    if (hdr == 3) {
+        h[0] = (f->type == '{') ? 0xde : 0xdc;
+        h[1] = n >> 8;
+        h[2] = n;
+    }
+    else {
+        h[0] = (f->type == '{') ? 0xdf : 0xdd;
+        h[1] = n >> 24;
+        h[2] = n >> 16;
+        h[3] = n >> 8;
+        h[4] = n;
+    }
+
+    return 0;
+}
+
+/* Validate a string starting at the quote, it returns the closing quote */
+static const char *json_string(const char *p, const char *end, int *ret)
+{
+    int i;
+    char c;
+
+    p++;
+    while (1) {
+        p = string_special(p, end);
+        if (p == end) {
+            *ret = FLB_ERR_JSON_PART;
+            return NULL;
+        }
+        if (*p == '"') {
+            return p;
+        }
+
+        /* escape sequence */
+        if (++p == end) {
+            *ret = FLB_ERR_JSON_PART;
+            return NULL;
+        }
+        switch (*p) {
+        case '"': case '\\': case '/': case 'b':
+        case 'f': case 'n': case 'r': case 't':
+            p++;
+            break;
+        case 'u':
+            p++;
+            for (i = 0; i < 4; i++, p++) {
+                if (p == end) {
+                    *ret = FLB_ERR_JSON_PART;
+                    return NULL;
+                }
+                c = *p | 0x20;
+                if (!json_is_digit(*p) && !(c >= 'a' && c <= 'f')) {
+                    *ret = FLB_ERR_JSON_INVAL;
+                    return NULL;
+                }
+            }
+            break;
+        default:
+            *ret = FLB_ERR_JSON_INVAL;
+            return NULL;
+        }
+    }
+}
+
+/*
+ * Validate and pack a number. Integers are converted on the fly, numbers
+ * with a fraction or exponent (or too big for 64 bits) are doubles. A number
+ * reaching the end of the buffer is only complete at root level.
+ */
+static const char *json_number(const char *p, const char *end, int root,
+                               msgpack_packer *pck, int *ret)
+{
+    int neg = 0;
+    int is_int = 1;
+    int overflow = 0;
+    size_t len;
+    char *tmp;
+    char buf[JSON_NUMBER_MAX];
+    const char *s = p;
+    uint64_t val = 0;
+    double d;
+
+    if (*p == '-') {
+        neg = 1;
+        p++;
+    }
+
+    if (p == end) {
+        goto partial;
+    }
+
+    if (*p == '0') {
+        p++;
+    }
+    else if (json_is_digit(*p)) {
+        while (p < end && json_is_digit(*p)) {
+            if (val > (UINT64_MAX - (*p - '0')) / 10) {
+                overflow = 1;
+            }
+            val = (val * 10) + (*p - '0');
+            p++;
+        }
+    }
+    else {
+        goto invalid;
+    }
+
+    if (p < end && *p == '.') {
+        is_int = 0;
+        if (++p == end) {
+            goto partial;
+        }
+        if (!json_is_digit(*p)) {
+            goto invalid;
+        }
+        while (p < end && json_is_digit(*p)) {
+            p++;
+        }
+    }
+
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        is_int = 0;
+        if (++p == end) {
+            goto partial;
+        }
+        if (*p == '+' || *p == '-') {
+            if (++p == end) {
+                goto partial;
+            }
+        }
+        if (!json_is_digit(*p)) {
+            goto invalid;
+        }
+        while (p < end && json_is_digit(*p)) {
+            p++;
+        }
+    }
+
+    if (p == end && !root) {
+        goto partial;
+    }
+
+    if (neg && val > (uint64_t) INT64_MAX + 1) {
+        overflow = 1;
+    }
+
+    if (is_int && !overflow) {
+        if (neg) {
+            msgpack_pack_int64(pck, (int64_t) (0 - val));
+        }
+        else {
+            msgpack_pack_uint64(pck, val);
+        }
+        return p;
+    }
+
+    /* strtod() needs a terminated string */
+    len = p - s;
+    tmp = buf;
+    if (len >= sizeof(buf)) {
+        tmp = flb_malloc(len + 1);
+        if (!tmp) {
+            flb_errno();
+            goto invalid;
+        }
+    }
+    memcpy(tmp, s, len);
+    tmp[len] = '\0';
+    d = strtod(tmp, NULL);
+    if (tmp != buf) {
+        flb_free(tmp);
+    }
+
+    msgpack_pack_double(pck, d);
+    return p;
+
+ partial:
+    *ret = FLB_ERR_JSON_PART;
+    return NULL;
+
+ invalid:
+    *ret = FLB_ERR_JSON_INVAL;
+    return NULL;
+}
+
+/* Match 'true', 'false' or 'null' */
+static const char *json_literal(const char *p, const char *end,
+                                const char *lit, size_t lit_len, int *ret)
+{
+    size_t len = end - p;
+
+    if (len < lit_len) {
+        *ret = (memcmp(p, lit, len) == 0) ? FLB_ERR_JSON_PART :
+               FLB_ERR_JSON_INVAL;
+        return NULL;
+    }
+    if (memcmp(p, lit, lit_len) != 0) {
+        *ret = FLB_ERR_JSON_INVAL;
+        return NULL;
+    }
+
+    return p + lit_len;
+}
+
+/*
+ * Convert the JSON values found in the buffer to msgpack. Root values can be
+ * separated by spaces or commas. It returns the number of root values or
+ * FLB_ERR_JSON_INVAL / FLB_ERR_JSON_PART (-1 if memory is exhausted). If
+ * 'out_buf' is NULL the buffer is only validated.
+ */
+int flb_json_parse(const char *js, size_t len,
+                   char **out_buf, size_t *out_size)
+{
+    int ret = 0;
+    int roots = 0;
+    int depth = 0;
+    int stack_size = JSON_STACK_SIZE;
+    const char *p = js;
+    const char *end = js + len;
+    const char *q;
+    struct json_buf jb;
+    struct json_frame *f = NULL;
+    struct json_frame *stack;
+    struct json_frame *tmp;
+    struct json_frame stack_local[JSON_STACK_SIZE];
+    msgpack_packer pck;
+
+    jb.error = FLB_FALSE;
+    jb.size = 0;
+    jb.alloc = len + 64;
+    jb.data = flb_malloc(jb.alloc);
+    if (!jb.data) {
+        flb_errno();
+        return -1;
+    }
+    msgpack_packer_init(&pck, &jb, json_buf_write);
+    stack = stack_local;
+
+ root:
+    while (p < end && (json_is_space(*p) || *p == ',')) {
+        p++;
+    }
+    if (p == end) {
+        goto done;
+    }
+
+ value:
+    while (p < end && json_is_space(*p)) {
+        p++;
+    }
+    if (p == end) {
+        goto partial;
+    }
+
+    switch (*p) {
+    case '{':
+    case '[':
+        if (depth == stack_size) {
+            stack_size *= 2;
+            if (stack == stack_local) {
+                tmp = flb_malloc(sizeof(struct json_frame) * stack_size);
+                if (tmp) {
+                    memcpy(tmp, stack_local, sizeof(stack_local));
+                }
+            }
+            else {
+                tmp = flb_realloc(stack,
+                                  sizeof(struct json_frame) * stack_size);
+            }
+            if (!tmp) {
+                flb_errno();
+                goto invalid;
+            }
+            stack = tmp;
+        }
+        if (json_buf_reserve(&jb, 1) == -1) {
+            goto invalid;
+        }
+        f = &stack[depth++];
+        f->type = *p;
+        f->count = 0;
+        f->offset = jb.size++;
+        p++;
+
+        while (p < end && json_is_space(*p)) {
+            p++;
+        }
+        if (p == end) {
+            goto partial;
+        }
+        if (*p == f->type + 2) {
+            /* empty container, '}' and ']' are two bytes after the opener */
+            p++;
+            goto close;
+        }
+        if (f->type == '{') {
+            goto key;
+        }
+        goto value;
+    case '"':
+        q = json_string(p, end, &ret);
+        if (!q) {
+            goto error;
+        }
+        msgpack_pack_str(&pck, q - p - 1);
+        msgpack_pack_str_body(&pck, p + 1, q - p - 1);
+        p = q + 1;
+        break;
+    case 't':
+        p = json_literal(p, end, "true", 4, &ret);
+        if (!p) {
+            goto error;
+        }
+        msgpack_pack_true(&pck);
+        break;
+    case 'f':
+        p = json_literal(p, end, "false", 5, &ret);
+        if (!p) {
+            goto error;
+        }
+        msgpack_pack_false(&pck);
+        break;
+    case 'n':
+        p = json_literal(p, end, "null", 4, &ret);
+        if (!p) {
+            goto error;
+        }
+        msgpack_pack_nil(&pck);
+        break;
+    default:
+        if (*p != '-' && !json_is_digit(*p)) {
+            goto invalid;
+        }
+        p = json_number(p, end, depth == 0, &pck, &ret);
+        if (!p) {
+            goto error;
+        }
+        break;
+    }
+
+ next:
+    /* a value is complete */
+    if (depth == 0) {
+        roots++;
+        goto root;
+    }
+
+    f = &stack[depth - 1];
+    f->count++;
+    if (f->count == 0) {
+        /* more than 2^32 - 1 entries */
+        goto invalid;
+    }
+
+    while (p < end && json_is_space(*p)) {
+        p++;
+    }
+    if (p == end) {
+        goto partial;
+    }
+    if (*p == ',') {
+        p++;
+        if (f->type == '{') {
+            goto key;
+        }
+        goto value;
+    }
+    if (*p != f->type + 2) {
+        goto invalid;
+    }
+    p++;
+
+ close:
+    if (json_close(&jb, f) == -1) {
+        goto invalid;
+    }
+    depth--;
+    goto next;
+
+ key:
+    while (p < end && json_is_space(*p)) {
+        p++;
+    }
+    if (p == end) {
+        goto partial;
+    }
+    if (*p != '"') {
+        goto invalid;
+    }
+    q = json_string(p, end, &ret);
+    if (!q) {
+        goto error;
+    }
+    msgpack_pack_str(&pck, q - p - 1);
+    msgpack_pack_str_body(&pck, p + 1, q - p - 1);
+    p = q + 1;
+
+    while (p < end && json_is_space(*p)) {
+        p++;
+    }
+    if (p == end) {
+        goto partial;
+    }
+    if (*p != ':') {
+        goto invalid;
+    }
+    p++;
+    goto value;
+
+ partial:
+    ret = FLB_ERR_JSON_PART;
+    goto error;
+
+ invalid:
+    ret = FLB_ERR_JSON_INVAL;
+
+ error:
+    if (stack != stack_local) {
+        flb_free(stack);
+    }
+    flb_free(jb.data);
+    return ret;
+
+ done:
+    if (stack != stack_local) {
+        flb_free(stack);
+    }
+    if (jb.error == FLB_TRUE) {
+        flb_free(jb.data);
+        return -1;
+    }
+    if (roots == 0 || !out_buf) {
+        flb_free(jb.data);
+    }
+    else {
+        *out_buf = jb.data;
+        *out_size = jb.size;
+    }
+
+    return roots;
+}
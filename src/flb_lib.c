@@ -22,14 +22,17 @@
 #include <fluent-bit/flb_mem.h>
 #include <fluent-bit/flb_pipe.h>
 #include <fluent-bit/flb_engine.h>
+#include <fluent-bit/flb_engine_shard.h>
 #include <fluent-bit/flb_input.h>
 #include <fluent-bit/flb_output.h>
 #include <fluent-bit/flb_filter.h>
 #include <fluent-bit/flb_utils.h>
 #include <fluent-bit/flb_time.h>
+#include <fluent-bit/flb_mp.h>
 
 #include <signal.h>
 #include <stdarg.h>
+#include <string.h>
 
 #ifdef FLB_HAVE_MTRACE
 #include <mcheck.h>
@@ -37,18 +40,31 @@
 
 extern struct flb_input_plugin in_lib_plugin;
 
+/* Once the service runs, the instance can be in any engine shard */
 static inline struct flb_input_instance *in_instance_get(flb_ctx_t *ctx,
                                                          int ffd)
 {
+    int i;
+    int n;
     struct mk_list *head;
+    struct flb_config *config;
     struct flb_input_instance *i_ins;
 
-    mk_list_foreach(head, &ctx->config->inputs) {
-        i_ins = mk_list_entry(head, struct flb_input_instance, _head);
-        if (i_ins->id == ffd) {
-            return i_ins;
+    n = flb_engine_shards_lock(ctx->config);
+    for (i = 0; i < n; i++) {
+        config = flb_engine_shard_get(ctx->config, i);
+        if (!config) {
+            continue;
+        }
+        mk_list_foreach(head, &config->inputs) {
+            i_ins = mk_list_entry(head, struct flb_input_instance, _head);
+            if (i_ins->id == ffd) {
+                flb_engine_shards_unlock(ctx->config);
+                return i_ins;
+            }
         }
     }
+    flb_engine_shards_unlock(ctx->config);
 
     return NULL;
 }
@@ -352,6 +368,12 @@ int flb_lib_config_file(struct flb_lib_ctx *ctx, char *path)
     return 0;
 }
 
+/* Allocate a buffer to be handed to the engine with flb_lib_push_batch() */
+void *flb_lib_alloc(size_t size)
+{
+    return flb_malloc(size);
+}
+
 /* This is a wrapper to release a buffer which comes from out_lib_flush() */
 int flb_lib_free(void* data)
 {
@@ -382,6 +404,57 @@ int flb_lib_push(flb_ctx_t *ctx, int ffd, void *data, size_t len)
     return ret;
 }
 
+/*
+ * Push msgpack records, a sequence of [timestamp, map] arrays, with no JSON
+ * encoding involved. The buffer is given to the input instance: it must be
+ * allocated with flb_lib_alloc() and it's owned by the engine on success,
+ * on error it still belongs to the caller. It returns the number of bytes
+ * queued, -1 on error, e.g: invalid records or too much data waiting to be
+ * ingested (the caller can retry later).
+ */
+int flb_lib_push_batch(flb_ctx_t *ctx, int ffd, void *data, size_t len)
+{
+    int ret;
+    struct flb_input_instance *i_ins;
+
+    i_ins = in_instance_get(ctx, ffd);
+    if (!i_ins || !i_ins->p->cb_ingest || !i_ins->context) {
+        return -1;
+    }
+
+    if (len == 0 || flb_mp_records_check(data, len) <= 0) {
+        return -1;
+    }
+
+    ret = i_ins->p->cb_ingest(i_ins->context, data, len);
+    if (ret == -1) {
+        return -1;
+    }
+
+    return len;
+}
+
+/* Same as flb_lib_push_batch() but the records are copied */
+int flb_lib_push_msgpack(flb_ctx_t *ctx, int ffd, void *data, size_t len)
+{
+    int ret;
+    void *buf;
+
+    buf = flb_malloc(len);
+    if (!buf) {
+        flb_errno();
+        return -1;
+    }
+    memcpy(buf, data, len);
+
+    ret = flb_lib_push_batch(ctx, ffd, buf, len);
+    if (ret == -1) {
+        flb_free(buf);
+    }
+
+    return ret;
+}
+
 static void flb_lib_worker(void *data)
 {
     int ret;
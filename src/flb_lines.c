@@ -0,0 +1,180 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include <fluent-bit/flb_lines.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define FLB_LINES_SSE2
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define FLB_LINES_NEON
+#include <arm_neon.h>
+#endif
+
+static int (*lines_func)(const char *, size_t, size_t *, int);
+static pthread_once_t lines_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Every SIMD version compares a block and gets a bit mask of the matches,
+ * the offsets are extracted from the mask lowest bit first.
+ */
+#define LINES_MASK(mask, pos)                       \
+    while (mask) {                                  \
+        offsets[n++] = pos + __builtin_ctz(mask);   \
+        if (n == max) {                             \
+            return n;                               \
+        }                                           \
+        mask &= mask - 1;                           \
+    }
+
+static inline int lines_tail(const char *buf, size_t i, size_t len,
+                             size_t *offsets, int n, int max)
+{
+    for (; i < len && n < max; i++) {
+        if (buf[i] == '\n') {
+            offsets[n++] = i;
+        }
+    }
+
+    return n;
+}
+
+static int lines_sw(const char *buf, size_t len, size_t *offsets, int max)
+{
+    if (max <= 0) {
+        return 0;
+    }
+
+    return lines_tail(buf, 0, len, offsets, 0, max);
+}
+
+#ifdef FLB_LINES_SSE2
+static int lines_sse2(const char *buf, size_t len, size_t *offsets, int max)
+{
+    int n = 0;
+    size_t i = 0;
+    uint32_t mask;
+    __m128i nl;
+    __m128i v;
+
+    if (max <= 0) {
+        return 0;
+    }
+
+    nl = _mm_set1_epi8('\n');
+    for (; i + 16 <= len; i += 16) {
+        v = _mm_loadu_si128((const __m128i *) (buf + i));
+        mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+        LINES_MASK(mask, i);
+    }
+
+    return lines_tail(buf, i, len, offsets, n, max);
+}
+
+__attribute__((target("avx2")))
+static int lines_avx2(const char *buf, size_t len, size_t *offsets, int max)
+{
+    int n = 0;
+    size_t i = 0;
+    uint32_t mask;
+    __m256i nl;
+    __m256i v;
+
+    if (max <= 0) {
+        return 0;
+    }
+
+    nl = _mm256_set1_epi8('\n');
+    for (; i + 32 <= len; i += 32) {
+        v = _mm256_loadu_si256((const __m256i *) (buf + i));
+        mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+        LINES_MASK(mask, i);
+    }
+
+    return lines_tail(buf, i, len, offsets, n, max);
+}
+#elif defined(FLB_LINES_NEON)
+static int lines_neon(const char *buf, size_t len, size_t *offsets, int max)
+{
+    int n = 0;
+    size_t i = 0;
+    uint64_t bits;
+    uint8x16_t nl;
+    uint8x16_t v;
+    uint8x8_t nibbles;
+
+    if (max <= 0) {
+        return 0;
+    }
+
+    /*
+     * NEON does not have a movemask, narrow the comparison result to 4 bits
+     * per byte and keep one bit of each.
+     */
+    nl = vdupq_n_u8('\n');
+    for (; i + 16 <= len; i += 16) {
+        v = vceqq_u8(vld1q_u8((const uint8_t *) (buf + i)), nl);
+        nibbles = vshrn_n_u16(vreinterpretq_u16_u8(v), 4);
+        bits = vget_lane_u64(vreinterpret_u64_u8(nibbles), 0);
+        if (bits == 0) {
+            continue;
+        }
+        bits &= 0x1111111111111111ULL;
+        while (bits) {
+            offsets[n++] = i + (__builtin_ctzll(bits) >> 2);
+            if (n == max) {
+                return n;
+            }
+            bits &= bits - 1;
+        }
+    }
+
+    return lines_tail(buf, i, len, offsets, n, max);
+}
+#endif
+
+static void lines_init()
+{
+    lines_func = lines_sw;
+
+#ifdef FLB_LINES_SSE2
+    lines_func = lines_sse2;
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        lines_func = lines_avx2;
+    }
+#elif defined(FLB_LINES_NEON)
+    lines_func = lines_neon;
+#endif
+}
+
+int flb_lines_scan(const char *buf, size_t len, size_t *offsets, int max)
+{
+    pthread_once(&lines_once, lines_init);
+    return lines_func(buf, len, offsets, max);
+}
+
+/* Byte by byte version, always available (used by tests) */
+int flb_lines_scan_sw(const char *buf, size_t len, size_t *offsets, int max)
+{
+    return lines_sw(buf, len, offsets, max);
+}
@@ -25,6 +25,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <sys/uio.h>
 
 #include <monkey/mk_core.h>
 #include <fluent-bit/flb_log.h>
@@ -46,6 +47,74 @@ struct log_message {
     char   msg[1024 - sizeof(size_t)];
 };
 
+/*
+ * Bounded MPSC ring: a writer reserves a position moving 'tail' with a CAS
+ * and publishes the slot setting its sequence to position + 1. The
+ * collector reads the slots in order and gives them back to the writers
+ * setting their sequence to position + ring size.
+ */
+struct log_slot {
+    uint64_t seq;
+    struct log_message msg;
+};
+
+struct flb_log_ring {
+    uint64_t tail __attribute__((aligned(64)));     /* writers   */
+    uint64_t head __attribute__((aligned(64)));     /* collector */
+    struct log_slot slots[FLB_LOG_RING_SIZE];
+};
+
+#define RING_MASK       (FLB_LOG_RING_SIZE - 1)
+#define LOG_BATCH       64
+
+static struct flb_log_ring *ring_create()
+{
+    int i;
+    struct flb_log_ring *ring;
+
+    ring = flb_calloc(1, sizeof(struct flb_log_ring));
+    if (!ring) {
+        return NULL;
+    }
+    for (i = 0; i < FLB_LOG_RING_SIZE; i++) {
+        ring->slots[i].seq = i;
+    }
+    return ring;
+}
+
+static int ring_push(struct flb_log_ring *ring, struct log_message *msg)
+{
+    int64_t diff;
+    uint64_t pos;
+    uint64_t seq;
+    struct log_slot *slot;
+
+    pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    while (1) {
+        slot = &ring->slots[pos & RING_MASK];
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        diff = (int64_t) seq - (int64_t) pos;
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&ring->tail, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+                break;
+            }
+        }
+        else if (diff < 0) {
+            /* full */
+            return -1;
+        }
+        else {
+            pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    memcpy(&slot->msg, msg, sizeof(size_t) + msg->size);
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
 static inline int consume_byte(flb_pipefd_t fd)
 {
     int ret;
@@ -61,46 +130,90 @@ static inline int consume_byte(flb_pipefd_t fd)
     return 0;
 }
 
-static inline int log_push(struct log_message *msg, struct flb_log *log)
+static int log_write(struct flb_log *log, struct iovec *iov, int n)
 {
     int fd;
     int ret = -1;
 
     if (log->type == FLB_LOG_STDERR) {
-        return write(STDERR_FILENO, msg->msg, msg->size);
+        return writev(STDERR_FILENO, iov, n);
     }
     else if (log->type == FLB_LOG_FILE) {
         fd = open(log->out, O_CREAT | O_WRONLY | O_APPEND, 0666);
         if (fd == -1) {
             fprintf(stderr, "[log] error opening log file %s. Using stderr.\n",
                     log->out);
-            return write(STDERR_FILENO, msg->msg, msg->size);
+            return writev(STDERR_FILENO, iov, n);
         }
-        ret = write(fd, msg->msg, msg->size);
+        ret = writev(fd, iov, n);
         close(fd);
     }
 
     return ret;
 }
 
-static inline int log_read(flb_pipefd_t fd, struct flb_log *log)
+/* Write the queued messages, in batches of one writev(2) */
+static void log_drain(struct flb_log *log)
 {
-    int bytes;
-    struct log_message msg;
+    int i;
+    int n;
+    int len;
+    uint64_t dropped;
+    uint64_t head;
+    char buf[128];
+    struct iovec iov[LOG_BATCH];
+    struct log_slot *slot;
+    struct flb_log_ring *ring = log->ring;
+
+    do {
+        n = 0;
+        head = ring->head;
+        while (n < LOG_BATCH) {
+            slot = &ring->slots[(head + n) & RING_MASK];
+            if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != head + n + 1) {
+                break;
+            }
+            iov[n].iov_base = slot->msg.msg;
+            iov[n].iov_len = slot->msg.size;
+            n++;
+        }
+        if (n > 0) {
+            log_write(log, iov, n);
+        }
 
-    /*
-     * Since write operations to the pipe are always atomic 'if' they are
-     * under the PIPE_BUF limit (4KB on Linux) and our messages are always 1KB,
-     * we can trust we will always get a full message on each read(2).
-     */
-    bytes = flb_pipe_r(fd, &msg, sizeof(struct log_message));
-    if (bytes <= 0) {
-        perror("bytes");
-        return -1;
+        /* Give the slots back */
+        for (i = 0; i < n; i++) {
+            slot = &ring->slots[(head + i) & RING_MASK];
+            __atomic_store_n(&slot->seq, head + i + FLB_LOG_RING_SIZE,
+                             __ATOMIC_RELEASE);
+        }
+        ring->head = head + n;
+    } while (n == LOG_BATCH);
+
+    dropped = __atomic_exchange_n(&log->dropped, 0, __ATOMIC_RELAXED);
+    if (dropped > 0) {
+        len = snprintf(buf, sizeof(buf),
+                       "[log] %" PRIu64 " messages dropped, log queue full\n",
+                       dropped);
+        iov[0].iov_base = buf;
+        iov[0].iov_len = len;
+        log_write(log, iov, 1);
     }
-    log_push(&msg, log);
+}
 
-    return bytes;
+static inline void log_wakeup(struct flb_log *log)
+{
+    int ret;
+    uint64_t val = 1;
+
+    /* Pairs with the fence in the collector before it drains the ring */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_exchange_n(&log->wake_pending, 1, __ATOMIC_SEQ_CST) == 0) {
+        ret = flb_pipe_w(log->ch_wake[1], &val, sizeof(val));
+        if (ret == -1) {
+            __atomic_store_n(&log->wake_pending, 0, __ATOMIC_SEQ_CST);
+        }
+    }
 }
 
 /* Central collector of messages */
@@ -122,7 +235,12 @@ static void log_worker_collector(void *data)
         mk_event_wait(log->evl);
         mk_event_foreach(event, log->evl) {
             if (event->type == FLB_LOG_EVENT) {
-                log_read(event->fd, log);
+                consume_byte(event->fd);
+
+                /* Writers queuing from now on wake us up again */
+                __atomic_store_n(&log->wake_pending, 0, __ATOMIC_SEQ_CST);
+                __atomic_thread_fence(__ATOMIC_SEQ_CST);
+                log_drain(log);
             }
             else if (event->type == FLB_LOG_MNG) {
                 consume_byte(event->fd);
@@ -131,36 +249,11 @@ static void log_worker_collector(void *data)
         }
     }
 
+    /* Flush what's left */
+    log_drain(log);
     pthread_exit(NULL);
 }
 
-int flb_log_worker_init(void *data)
-{
-    int ret;
-    struct flb_worker *worker = data;
-    struct flb_config *config = worker->config;
-    struct flb_log *log = config->log;
-
-    /* Pipe to communicate Thread with worker log-collector */
-    ret = flb_pipe_create(worker->log);
-    if (ret == -1) {
-        perror("pipe");
-        return -1;
-    }
-
-    /* Register the read-end of the pipe (log[0]) into the event loop */
-    MK_EVENT_NEW(&worker->event);
-    ret = mk_event_add(log->evl, worker->log[0],
-                       FLB_LOG_EVENT, MK_EVENT_READ, &worker->event);
-    if (ret == -1) {
-        close(worker->log[0]);
-        close(worker->log[1]);
-        return -1;
-    }
-
-    return 0;
-}
-
 int flb_log_set_level(struct flb_config *config, int level)
 {
     config->log->level = level;
@@ -183,43 +276,64 @@ int flb_log_set_file(struct flb_config *config, char *out)
     return 0;
 }
 
+static void log_destroy(struct flb_log *log)
+{
+    if (log->evl) {
+        mk_event_loop_destroy(log->evl);
+    }
+    if (log->ch_mng[0] != -1) {
+        flb_pipe_destroy(log->ch_mng);
+    }
+    if (log->ch_wake[0] != -1) {
+        flb_pipe_destroy(log->ch_wake);
+    }
+    flb_free(log->ring);
+    flb_free(log->worker);
+    flb_free(log);
+}
+
 struct flb_log *flb_log_init(struct flb_config *config, int type,
                              int level, char *out)
 {
     int ret;
     struct flb_log *log;
     struct flb_worker *worker;
-    struct mk_event_loop *evl;
 
-    log = flb_malloc(sizeof(struct flb_log));
+    log = flb_calloc(1, sizeof(struct flb_log));
     if (!log) {
         perror("malloc");
         return NULL;
     }
-    config->log = log;
-
-    /* Create event loop to be used by the collector worker */
-    evl = mk_event_loop_create(16);
-    if (!evl) {
-        fprintf(stderr, "[log] could not create event loop\n");
-        flb_free(log);
-        config->log = NULL;
-        return NULL;
-    }
+    log->ch_mng[0] = -1;
+    log->ch_wake[0] = -1;
 
     /* Prepare logging context */
     log->type  = type;
     log->level = level;
     log->out   = out;
-    log->evl   = evl;
     log->tid   = 0;
+    log->rate_limit = config->log_rate_limit;
+
+    /* Create event loop to be used by the collector worker */
+    log->evl = mk_event_loop_create(16);
+    if (!log->evl) {
+        fprintf(stderr, "[log] could not create event loop\n");
+        log_destroy(log);
+        return NULL;
+    }
+
+    log->ring = ring_create();
+    if (!log->ring) {
+        fprintf(stderr, "[log] could not create messages ring\n");
+        log_destroy(log);
+        return NULL;
+    }
 
     ret = flb_pipe_create(log->ch_mng);
     if (ret == -1) {
-        fprintf(stderr, "[log] could not create pipe(2)");
-        mk_event_loop_destroy(log->evl);
-        flb_free(log);
-        config->log = NULL;
+        fprintf(stderr, "[log] could not create pipe(2)\n");
+        log->ch_mng[0] = -1;
+        log_destroy(log);
         return NULL;
     }
     MK_EVENT_NEW(&log->event);
@@ -229,9 +343,24 @@ struct flb_log *flb_log_init(struct flb_config *config, int type,
                        FLB_LOG_MNG, MK_EVENT_READ, &log->event);
     if (ret == -1) {
         fprintf(stderr, "[log] could not register event\n");
-        mk_event_loop_destroy(log->evl);
-        flb_free(log);
-        config->log = NULL;
+        log_destroy(log);
+        return NULL;
+    }
+
+    /* Writers wake up the collector through this pipe */
+    ret = flb_pipe_create(log->ch_wake);
+    if (ret == -1) {
+        fprintf(stderr, "[log] could not create pipe(2)\n");
+        log->ch_wake[0] = -1;
+        log_destroy(log);
+        return NULL;
+    }
+    MK_EVENT_NEW(&log->ev_wake);
+    ret = mk_event_add(log->evl, log->ch_wake[0],
+                       FLB_LOG_EVENT, MK_EVENT_READ, &log->ev_wake);
+    if (ret == -1) {
+        fprintf(stderr, "[log] could not register event\n");
+        log_destroy(log);
         return NULL;
     }
 
@@ -243,29 +372,18 @@ struct flb_log *flb_log_init(struct flb_config *config, int type,
     worker = flb_malloc(sizeof(struct flb_worker));
     if (!worker) {
         flb_errno();
-        mk_event_loop_destroy(log->evl);
-        flb_free(log);
-        config->log = NULL;
+        log_destroy(log);
         return NULL;
     }
     worker->func    = NULL;
     worker->data    = NULL;
     worker->log_ctx = log;
     worker->config  = config;
+    log->worker = worker;
 
     /* Set the worker context global */
     FLB_TLS_SET(flb_worker_ctx, worker);
-
-    ret = flb_log_worker_init(worker);
-    if (ret == -1) {
-        flb_errno();
-        mk_event_loop_destroy(log->evl);
-        flb_free(log);
-        config->log = NULL;
-        flb_free(worker);
-        return NULL;
-    }
-    log->worker = worker;
+    config->log = log;
 
     /*
      * This lock is used for the 'pth_cond' conditional. Once the worker
@@ -277,13 +395,13 @@ struct flb_log *flb_log_init(struct flb_config *config, int type,
 
     pthread_mutex_lock(&pth_mutex);
 
-    ret = flb_worker_create(log_worker_collector, log, &log->tid, config);
+    ret = flb_worker_create_role(log_worker_collector, log, &log->tid,
+                                 "log", NULL, config);
     if (ret == -1) {
         pthread_mutex_unlock(&pth_mutex);
-        mk_event_loop_destroy(log->evl);
-        flb_free(log->worker);
-        flb_free(log);
+        FLB_TLS_SET(flb_worker_ctx, NULL);
         config->log = NULL;
+        log_destroy(log);
         return NULL;
     }
 
@@ -296,21 +414,18 @@ struct flb_log *flb_log_init(struct flb_config *config, int type,
     return log;
 }
 
-void flb_log_print(int type, const char *file, int line, const char *fmt, ...)
+/* Format the header and the message, returns the header length */
+static int log_format(struct log_message *msg, int type, time_t now,
+                      const char *fmt, va_list args)
 {
     int len;
     int total;
-    time_t now;
     const char *header_color = NULL;
     const char *header_title = NULL;
     const char *bold_color = ANSI_BOLD;
     const char *reset_color = ANSI_RESET;
     struct tm result;
     struct tm *current;
-    struct log_message msg = {0};
-    va_list args;
-
-    va_start(args, fmt);
 
     switch (type) {
     case FLB_LOG_INFO:
@@ -342,10 +457,9 @@ void flb_log_print(int type, const char *file, int line, const char *fmt, ...)
         reset_color = "";
     }
 
-    now = time(NULL);
     current = localtime_r(&now, &result);
 
-    len = snprintf(msg.msg, sizeof(msg.msg) - 1,
+    len = snprintf(msg->msg, sizeof(msg->msg) - 1,
                    "%s[%s%i/%02i/%02i %02i:%02i:%02i%s]%s [%s%5s%s] ",
                    /*      time     */                    /* type */
 
@@ -362,31 +476,157 @@ void flb_log_print(int type, const char *file, int line, const char *fmt, ...)
                    /* type format */
                    header_color, header_title, reset_color);
 
-    total = vsnprintf(msg.msg + len,
-                      (sizeof(msg.msg) - 2) - len,
+    total = vsnprintf(msg->msg + len,
+                      (sizeof(msg->msg) - 2) - len,
                       fmt, args);
     if (total < 0) {
+        return -1;
+    }
+
+    total = strlen(msg->msg + len) + len;
+    msg->msg[total++] = '\n';
+    msg->msg[total]   = '\0';
+    msg->size = total;
+
+    return len;
+}
+
+static void log_push(struct log_message *msg)
+{
+    struct flb_log *log;
+    struct flb_worker *w;
+
+    w = flb_worker_get();
+    if (!w || !w->log_ctx) {
+        fprintf(stderr, "%s", (char *) msg->msg);
+        return;
+    }
+
+    log = w->log_ctx;
+    if (ring_push(log->ring, msg) == -1) {
+        __atomic_add_fetch(&log->dropped, 1, __ATOMIC_RELAXED);
         return;
     }
+    log_wakeup(log);
+}
+
+static void log_notice(int type, time_t now, const char *fmt, ...)
+{
+    va_list args;
+    struct log_message msg;
 
-    total = strlen(msg.msg + len) + len;
-    msg.msg[total++] = '\n';
-    msg.msg[total]   = '\0';
-    msg.size = total;
+    va_start(args, fmt);
+    if (log_format(&msg, type, now, fmt, args) >= 0) {
+        log_push(&msg);
+    }
     va_end(args);
+}
+
+static inline uint64_t log_hash(const char *buf, size_t size)
+{
+    size_t i;
+    uint64_t hash = 0xcbf29ce484222325ULL;
 
+    for (i = 0; i < size; i++) {
+        hash ^= (unsigned char) buf[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/*
+ * Fold the message if the call site printed the same one in the last
+ * FLB_LOG_DEDUP_PERIOD seconds and apply the rate limit of the site.
+ * Returns FLB_FALSE if the message must not be printed.
+ */
+static int log_site_check(struct flb_log_site *site, int rate_limit, int type,
+                          time_t now, char *buf, size_t size)
+{
+    uint64_t hash;
+    uint32_t repeats = 0;
+    uint32_t suppressed = 0;
+
+    hash = log_hash(buf, size);
+
+    while (__atomic_test_and_set(&site->lock, __ATOMIC_ACQUIRE));
+    if (site->hash == hash && now - site->hash_time < FLB_LOG_DEDUP_PERIOD) {
+        site->repeats++;
+        __atomic_clear(&site->lock, __ATOMIC_RELEASE);
+        return FLB_FALSE;
+    }
+    if (site->window != now) {
+        suppressed = site->suppressed;
+        site->window = now;
+        site->count = 0;
+        site->suppressed = 0;
+    }
+    if (site->count >= (uint32_t) rate_limit) {
+        site->suppressed++;
+        __atomic_clear(&site->lock, __ATOMIC_RELEASE);
+        return FLB_FALSE;
+    }
+    site->count++;
+    repeats = site->repeats;
+    site->repeats = 0;
+    site->hash = hash;
+    site->hash_time = now;
+    __atomic_clear(&site->lock, __ATOMIC_RELEASE);
+
+    if (repeats > 0) {
+        log_notice(type, now, "last message repeated %u times", repeats);
+    }
+    if (suppressed > 0) {
+        log_notice(type, now, "%u messages suppressed, rate limit reached",
+                   suppressed);
+    }
+    return FLB_TRUE;
+}
+
+static void log_vprint(struct flb_log_site *site, int type,
+                       const char *fmt, va_list args)
+{
+    int len;
+    time_t now;
+    struct flb_log *log;
     struct flb_worker *w;
+    struct log_message msg;
 
-    w = flb_worker_get();
-    if (w) {
-        int n = flb_pipe_w(w->log[1], &msg, sizeof(msg));
-        if (n == -1) {
-            perror("write");
-        }
+    now = time(NULL);
+    len = log_format(&msg, type, now, fmt, args);
+    if (len < 0) {
+        return;
     }
-    else {
-        fprintf(stderr, "%s", (char *) msg.msg);
+
+    if (site) {
+        w = flb_worker_get();
+        log = w ? w->log_ctx : NULL;
+        if (log && log->rate_limit > 0 &&
+            log_site_check(site, log->rate_limit, type, now,
+                           msg.msg + len, msg.size - len) == FLB_FALSE) {
+            return;
+        }
     }
+
+    log_push(&msg);
+}
+
+void flb_log_print(int type, const char *file, int line, const char *fmt, ...)
+{
+    va_list args;
+
+    va_start(args, fmt);
+    log_vprint(NULL, type, fmt, args);
+    va_end(args);
+}
+
+void flb_log_print_site(struct flb_log_site *site, int type,
+                        const char *file, int line, const char *fmt, ...)
+{
+    va_list args;
+
+    va_start(args, fmt);
+    log_vprint(site, type, fmt, args);
+    va_end(args);
 }
 
 int flb_errno_print(int errnum, const char *file, int line)
@@ -407,10 +647,7 @@ int flb_log_stop(struct flb_log *log, struct flb_config *config)
     pthread_join(log->tid, NULL);
 
     /* Release resources */
-    mk_event_loop_destroy(log->evl);
-    flb_pipe_destroy(log->ch_mng);
-    flb_free(log->worker);
-    flb_free(log);
+    log_destroy(log);
 
     return 0;
 }
@@ -22,6 +22,8 @@
 #include <fluent-bit/flb_log.h>
 #include <fluent-bit/flb_luajit.h>
 
+#include <limits.h>
+
 struct flb_luajit *flb_luajit_create(struct flb_config *config)
 {
     struct flb_luajit *lj;
@@ -81,3 +83,182 @@ int flb_luajit_destroy_all(struct flb_config *ctx)
 
     return c;
 }
+
+/*
+ * Push a msgpack object as a Lua value: arrays and maps become tables,
+ * strings and binaries Lua strings and every number a Lua number.
+ */
+void flb_luajit_pushmsgpack(lua_State *l, msgpack_object *o)
+{
+    uint32_t i;
+    msgpack_object_kv *kv;
+
+    switch (o->type) {
+    case MSGPACK_OBJECT_BOOLEAN:
+        lua_pushboolean(l, o->via.boolean);
+        break;
+    case MSGPACK_OBJECT_POSITIVE_INTEGER:
+        lua_pushnumber(l, (double) o->via.u64);
+        break;
+    case MSGPACK_OBJECT_NEGATIVE_INTEGER:
+        lua_pushnumber(l, (double) o->via.i64);
+        break;
+    case MSGPACK_OBJECT_FLOAT32:
+    case MSGPACK_OBJECT_FLOAT64:
+        lua_pushnumber(l, o->via.f64);
+        break;
+    case MSGPACK_OBJECT_STR:
+        lua_pushlstring(l, o->via.str.ptr, o->via.str.size);
+        break;
+    case MSGPACK_OBJECT_BIN:
+        lua_pushlstring(l, o->via.bin.ptr, o->via.bin.size);
+        break;
+    case MSGPACK_OBJECT_ARRAY:
+        lua_checkstack(l, 3);
+        lua_createtable(l, o->via.array.size, 0);
+        for (i = 0; i < o->via.array.size; i++) {
+            flb_luajit_pushmsgpack(l, &o->via.array.ptr[i]);
+            lua_rawseti(l, -2, i + 1);
+        }
+        break;
+    case MSGPACK_OBJECT_MAP:
+        lua_checkstack(l, 3);
+        lua_createtable(l, 0, o->via.map.size);
+        for (i = 0; i < o->via.map.size; i++) {
+            kv = &o->via.map.ptr[i];
+            /* A nil key cannot be set in a table */
+            if (kv->key.type == MSGPACK_OBJECT_NIL) {
+                continue;
+            }
+            flb_luajit_pushmsgpack(l, &kv->key);
+            flb_luajit_pushmsgpack(l, &kv->val);
+            lua_rawset(l, -3);
+        }
+        break;
+    default:
+        lua_pushnil(l);
+    }
+}
+
+/* Length of the table if it's a sequence 1..n, otherwise -1 */
+int flb_luajit_arraylen(lua_State *l, int index)
+{
+    int n = 0;
+    double key;
+
+    if (index < 0) {
+        index = lua_gettop(l) + index + 1;
+    }
+
+    lua_pushnil(l);
+    while (lua_next(l, index) != 0) {
+        lua_pop(l, 1);
+        if (lua_type(l, -1) != LUA_TNUMBER) {
+            lua_pop(l, 1);
+            return -1;
+        }
+        key = lua_tonumber(l, -1);
+        if (key < 1 || key > INT_MAX || key != (double) (int) key) {
+            lua_pop(l, 1);
+            return -1;
+        }
+        n++;
+    }
+
+    /* Positive integer keys with no holes */
+    if (n == 0 || lua_objlen(l, index) != n) {
+        return -1;
+    }
+
+    return n;
+}
+
+static void luajit_pack_number(msgpack_packer *pck, double d)
+{
+    if (d >= -9007199254740992.0 && d <= 9007199254740992.0 &&
+        d == (double) (int64_t) d) {
+        msgpack_pack_int64(pck, (int64_t) d);
+    }
+    else {
+        msgpack_pack_double(pck, d);
+    }
+}
+
+static void luajit_tomsgpack(lua_State *l, msgpack_packer *pck,
+                             int index, int depth)
+{
+    int i;
+    int n;
+    size_t len;
+    const char *str;
+
+    switch (lua_type(l, index)) {
+    case LUA_TSTRING:
+        str = lua_tolstring(l, index, &len);
+        msgpack_pack_str(pck, len);
+        msgpack_pack_str_body(pck, str, len);
+        break;
+    case LUA_TNUMBER:
+        luajit_pack_number(pck, lua_tonumber(l, index));
+        break;
+    case LUA_TBOOLEAN:
+        if (lua_toboolean(l, index)) {
+            msgpack_pack_true(pck);
+        }
+        else {
+            msgpack_pack_false(pck);
+        }
+        break;
+    case LUA_TTABLE:
+        if (depth >= FLB_LUAJIT_MAX_DEPTH || !lua_checkstack(l, 3)) {
+            msgpack_pack_nil(pck);
+            break;
+        }
+
+        n = flb_luajit_arraylen(l, index);
+        if (n > 0) {
+            msgpack_pack_array(pck, n);
+            for (i = 1; i <= n; i++) {
+                lua_rawgeti(l, index, i);
+                luajit_tomsgpack(l, pck, lua_gettop(l), depth + 1);
+                lua_pop(l, 1);
+            }
+            break;
+        }
+
+        /* Empty tables are packed as maps */
+        n = 0;
+        lua_pushnil(l);
+        while (lua_next(l, index) != 0) {
+            lua_pop(l, 1);
+            n++;
+        }
+
+        msgpack_pack_map(pck, n);
+        lua_pushnil(l);
+        while (lua_next(l, index) != 0) {
+            luajit_tomsgpack(l, pck, lua_gettop(l) - 1, depth + 1);
+            luajit_tomsgpack(l, pck, lua_gettop(l), depth + 1);
+            lua_pop(l, 1);
+        }
+        break;
+    default:
+        /* nil, functions, userdata, threads */
+        msgpack_pack_nil(pck);
+    }
+}
+
+/*
+ * Pack the Lua value at 'index' into msgpack. Sequences become arrays, any
+ * other table a map. Numbers with no fractional part are packed as
+ * integers. Returns the Lua type of the value.
+ */
+int flb_luajit_tomsgpack(lua_State *l, msgpack_packer *pck, int index)
+{
+    if (index < 0) {
+        index = lua_gettop(l) + index + 1;
+    }
+
+    luajit_tomsgpack(l, pck, index, 0);
+    return lua_type(l, index);
+}
@@ -0,0 +1,586 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_log.h>
+#include <fluent-bit/flb_mp.h>
+#include <fluent-bit/flb_luajit.h>
+#include <fluent-bit/flb_luajit_ffi.h>
+
+#include <string.h>
+
+/*
+ * Lua side of the record view. The record is a cdata pointer to struct
+ * flb_luajit_rec, its methods call the accessors of the 'api' table so
+ * nothing has to be resolved from the executable symbols.
+ */
+static const char *ffi_prelude =
+    "local ffi = require('ffi')\n"
+    "ffi.cdef[[\n"
+    "typedef struct flb_luajit_val {\n"
+    "    int type;\n"
+    "    double num;\n"
+    "    const char *str;\n"
+    "    size_t len;\n"
+    "} flb_luajit_val;\n"
+    "struct flb_luajit_rec;\n"
+    "typedef struct flb_luajit_api {\n"
+    "    int (*get)(struct flb_luajit_rec *, const char *, size_t,\n"
+    "               flb_luajit_val *);\n"
+    "    int (*size)(struct flb_luajit_rec *);\n"
+    "    int (*entry)(struct flb_luajit_rec *, int,\n"
+    "                 flb_luajit_val *, flb_luajit_val *);\n"
+    "    int (*set)(struct flb_luajit_rec *, const char *, size_t,\n"
+    "               flb_luajit_val *);\n"
+    "    int (*remove)(struct flb_luajit_rec *, const char *, size_t);\n"
+    "} flb_luajit_api;\n"
+    "struct flb_luajit_rec {\n"
+    "    const flb_luajit_api *api;\n"
+    "};\n"
+    "]]\n"
+    "local unpack = flb.unpack\n"
+    "local k_val = ffi.new('flb_luajit_val')\n"
+    "local v_val = ffi.new('flb_luajit_val')\n"
+    "local function value(v)\n"
+    "    local t = v.type\n"
+    "    if t == 3 then return ffi.string(v.str, v.len)\n"
+    "    elseif t == 2 then return v.num\n"
+    "    elseif t == 1 then return v.num ~= 0\n"
+    "    elseif t == 4 then return unpack(ffi.string(v.str, v.len))\n"
+    "    end\n"
+    "    return nil\n"
+    "end\n"
+    "local rec = {}\n"
+    "function rec.get(r, k)\n"
+    "    if r.api.get(r, k, #k, v_val) == -1 then return nil end\n"
+    "    return value(v_val)\n"
+    "end\n"
+    "function rec.set(r, k, v)\n"
+    "    local t = type(v)\n"
+    "    if t == 'string' then\n"
+    "        v_val.type = 3; v_val.str = v; v_val.len = #v\n"
+    "    elseif t == 'number' then v_val.type = 2; v_val.num = v\n"
+    "    elseif t == 'boolean' then v_val.type = 1; v_val.num = v and 1 or 0\n"
+    "    elseif t == 'nil' then v_val.type = 0\n"
+    "    else error('cannot set a ' .. t .. ' value') end\n"
+    "    r.api.set(r, k, #k, v_val)\n"
+    "end\n"
+    "function rec.remove(r, k)\n"
+    "    r.api.remove(r, k, #k)\n"
+    "end\n"
+    "function rec.size(r)\n"
+    "    return r.api.size(r)\n"
+    "end\n"
+    "function rec.entry(r, i)\n"
+    "    if r.api.entry(r, i - 1, k_val, v_val) == -1 then return nil end\n"
+    "    return value(k_val), value(v_val)\n"
+    "end\n"
+    "ffi.metatype('struct flb_luajit_rec', { __index = rec })\n"
+    "function flb.bind(p)\n"
+    "    return ffi.cast('struct flb_luajit_rec *', p)\n"
+    "end\n";
+
+static inline uint64_t load_be(const unsigned char *p, int bytes)
+{
+    int i;
+    uint64_t v = 0;
+
+    for (i = 0; i < bytes; i++) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+/* Decode a scalar, anything else is handed as raw msgpack */
+static int ffi_value(const char *buf, size_t size, struct flb_luajit_val *v)
+{
+    int n = 0;
+    uint32_t len;
+    size_t obj_size;
+    float f;
+    double d;
+    uint64_t u;
+    unsigned char c;
+    const unsigned char *p = (const unsigned char *) buf;
+
+    if (size < 1) {
+        return -1;
+    }
+
+    c = p[0];
+    v->num = 0;
+    v->str = NULL;
+    v->len = 0;
+
+    if (c <= 0x7f) {
+        v->type = FLB_LUAJIT_NUMBER;
+        v->num = c;
+        return 0;
+    }
+    if (c >= 0xe0) {
+        v->type = FLB_LUAJIT_NUMBER;
+        v->num = (int8_t) c;
+        return 0;
+    }
+    if (flb_mp_str(buf, size, &v->str, &len, &obj_size) == 0) {
+        v->type = FLB_LUAJIT_STRING;
+        v->len = len;
+        return 0;
+    }
+
+    switch (c) {
+    case 0xc0:
+        v->type = FLB_LUAJIT_NIL;
+        return 0;
+    case 0xc2:
+    case 0xc3:
+        v->type = FLB_LUAJIT_BOOL;
+        v->num = (c == 0xc3);
+        return 0;
+    case 0xc4: /* bin 8, 16, 32 */
+    case 0xc5:
+    case 0xc6:
+        n = 1 << (c - 0xc4);
+        if (size < 1 + n) {
+            return -1;
+        }
+        len = load_be(p + 1, n);
+        if (1 + n + len > size) {
+            return -1;
+        }
+        v->type = FLB_LUAJIT_STRING;
+        v->str = buf + 1 + n;
+        v->len = len;
+        return 0;
+    case 0xca:
+        n = 4;
+        break;
+    case 0xcb:
+    case 0xcc: /* uint 8, 16, 32, 64 */
+    case 0xcd:
+    case 0xce:
+    case 0xcf:
+    case 0xd0: /* int 8, 16, 32, 64 */
+    case 0xd1:
+    case 0xd2:
+    case 0xd3:
+        n = (c == 0xcb) ? 8 : 1 << ((c - 0xcc) & 0x03);
+        break;
+    }
+
+    if (n == 0) {
+        /* containers and extensions */
+        if (flb_mp_object_size(buf, size, &obj_size) == -1) {
+            return -1;
+        }
+        v->type = FLB_LUAJIT_OBJECT;
+        v->str = buf;
+        v->len = obj_size;
+        return 0;
+    }
+
+    if (size < 1 + n) {
+        return -1;
+    }
+    u = load_be(p + 1, n);
+    v->type = FLB_LUAJIT_NUMBER;
+
+    if (c == 0xca) {
+        len = u;
+        memcpy(&f, &len, 4);
+        v->num = f;
+    }
+    else if (c == 0xcb) {
+        memcpy(&d, &u, 8);
+        v->num = d;
+    }
+    else if (c <= 0xcf) {
+        v->num = (double) u;
+    }
+    else if (n == 1) {
+        v->num = (int8_t) u;
+    }
+    else if (n == 2) {
+        v->num = (int16_t) u;
+    }
+    else if (n == 4) {
+        v->num = (int32_t) u;
+    }
+    else {
+        v->num = (double) (int64_t) u;
+    }
+
+    return 0;
+}
+
+static inline const char *ffi_base(struct flb_luajit_rec *r,
+                                   struct flb_luajit_entry *e)
+{
+    return e->local ? r->sets.data : r->map;
+}
+
+static int ffi_entries_grow(struct flb_luajit_rec *r, int size)
+{
+    int n;
+    struct flb_luajit_entry *tmp;
+
+    if (size <= r->entries_size) {
+        return 0;
+    }
+
+    n = r->entries_size * 2;
+    if (n < size) {
+        n = size + 8;
+    }
+    tmp = flb_realloc(r->entries, n * sizeof(struct flb_luajit_entry));
+    if (!tmp) {
+        flb_errno();
+        return -1;
+    }
+    r->entries = tmp;
+    r->entries_size = n;
+
+    return 0;
+}
+
+/* Register every entry of the map, it's done on first access */
+static int ffi_index(struct flb_luajit_rec *r)
+{
+    int i;
+    int ret;
+    uint32_t count;
+    uint32_t len;
+    size_t hdr;
+    size_t off;
+    size_t obj_size;
+    const char *key;
+    struct flb_luajit_entry *e;
+
+    if (r->indexed == FLB_TRUE) {
+        return 0;
+    }
+    r->indexed = FLB_TRUE;
+
+    ret = flb_mp_map_header(r->map, r->map_size, &count, &hdr);
+    if (ret == -1 || ffi_entries_grow(r, count) == -1) {
+        return -1;
+    }
+
+    off = hdr;
+    for (i = 0; i < count; i++) {
+        e = &r->entries[i];
+        e->removed = FLB_FALSE;
+        e->local = FLB_FALSE;
+        e->obj = off;
+
+        if (flb_mp_object_size(r->map + off, r->map_size - off,
+                               &obj_size) == -1) {
+            return -1;
+        }
+        if (flb_mp_str(r->map + off, obj_size, &key, &len, &obj_size) == 0) {
+            e->key = key - r->map;
+            e->key_len = len;
+        }
+        else {
+            e->key_len = -1;
+        }
+        off += obj_size;
+
+        e->val = off;
+        if (flb_mp_object_size(r->map + off, r->map_size - off,
+                               &obj_size) == -1) {
+            return -1;
+        }
+        off += obj_size;
+        e->obj_size = off - e->obj;
+    }
+
+    r->count = count;
+    r->live = count;
+    return 0;
+}
+
+static struct flb_luajit_entry *ffi_find(struct flb_luajit_rec *r,
+                                         const char *key, size_t len)
+{
+    int i;
+    struct flb_luajit_entry *e;
+
+    if (ffi_index(r) == -1) {
+        return NULL;
+    }
+
+    for (i = 0; i < r->count; i++) {
+        e = &r->entries[i];
+        if (e->removed == FLB_FALSE && e->key_len == len &&
+            memcmp(ffi_base(r, e) + e->key, key, len) == 0) {
+            return e;
+        }
+    }
+
+    return NULL;
+}
+
+static int ffi_get(struct flb_luajit_rec *r, const char *key, size_t len,
+                   struct flb_luajit_val *v)
+{
+    struct flb_luajit_entry *e;
+
+    e = ffi_find(r, key, len);
+    if (!e) {
+        return -1;
+    }
+
+    return ffi_value(ffi_base(r, e) + e->val,
+                     e->obj + e->obj_size - e->val, v);
+}
+
+static int ffi_size(struct flb_luajit_rec *r)
+{
+    if (ffi_index(r) == -1) {
+        return 0;
+    }
+    return r->live;
+}
+
+static int ffi_entry(struct flb_luajit_rec *r, int n,
+                     struct flb_luajit_val *k, struct flb_luajit_val *v)
+{
+    int i;
+    const char *base;
+    struct flb_luajit_entry *e;
+
+    if (ffi_index(r) == -1) {
+        return -1;
+    }
+
+    for (i = 0; i < r->count; i++) {
+        e = &r->entries[i];
+        if (e->removed == FLB_TRUE || n-- > 0) {
+            continue;
+        }
+
+        base = ffi_base(r, e);
+        if (ffi_value(base + e->obj, e->val - e->obj, k) == -1) {
+            return -1;
+        }
+        return ffi_value(base + e->val, e->obj + e->obj_size - e->val, v);
+    }
+
+    return -1;
+}
+
+static int ffi_remove(struct flb_luajit_rec *r, const char *key, size_t len)
+{
+    struct flb_luajit_entry *e;
+
+    e = ffi_find(r, key, len);
+    if (!e) {
+        return -1;
+    }
+
+    e->removed = FLB_TRUE;
+    r->live--;
+    r->modified = FLB_TRUE;
+    return 0;
+}
+
+static int ffi_set(struct flb_luajit_rec *r, const char *key, size_t len,
+                   struct flb_luajit_val *v)
+{
+    struct flb_luajit_entry *e;
+    msgpack_packer *pck = &r->sets_pck;
+
+    if (ffi_index(r) == -1 || ffi_entries_grow(r, r->count + 1) == -1) {
+        return -1;
+    }
+    ffi_remove(r, key, len);
+
+    e = &r->entries[r->count];
+    e->removed = FLB_FALSE;
+    e->local = FLB_TRUE;
+    e->obj = r->sets.size;
+
+    msgpack_pack_str(pck, len);
+    msgpack_pack_str_body(pck, key, len);
+    e->key = r->sets.size - len;
+    e->key_len = len;
+    e->val = r->sets.size;
+
+    switch (v->type) {
+    case FLB_LUAJIT_BOOL:
+        if (v->num != 0) {
+            msgpack_pack_true(pck);
+        }
+        else {
+            msgpack_pack_false(pck);
+        }
+        break;
+    case FLB_LUAJIT_NUMBER:
+        if (v->num >= -9007199254740992.0 && v->num <= 9007199254740992.0 &&
+            v->num == (double) (int64_t) v->num) {
+            msgpack_pack_int64(pck, (int64_t) v->num);
+        }
+        else {
+            msgpack_pack_double(pck, v->num);
+        }
+        break;
+    case FLB_LUAJIT_STRING:
+        msgpack_pack_str(pck, v->len);
+        msgpack_pack_str_body(pck, v->str, v->len);
+        break;
+    default:
+        msgpack_pack_nil(pck);
+    }
+    e->obj_size = r->sets.size - e->obj;
+
+    r->count++;
+    r->live++;
+    r->modified = FLB_TRUE;
+    return 0;
+}
+
+static const struct flb_luajit_api ffi_api = {
+    .get    = ffi_get,
+    .size   = ffi_size,
+    .entry  = ffi_entry,
+    .set    = ffi_set,
+    .remove = ffi_remove,
+};
+
+/* flb.unpack(str): raw msgpack to a Lua value */
+static int ffi_unpack(lua_State *l)
+{
+    size_t len;
+    size_t off = 0;
+    const char *buf;
+    msgpack_unpacked result;
+
+    buf = luaL_checklstring(l, 1, &len);
+
+    msgpack_unpacked_init(&result);
+    if (msgpack_unpack_next(&result, buf, len, &off)) {
+        flb_luajit_pushmsgpack(l, &result.data);
+    }
+    else {
+        lua_pushnil(l);
+    }
+    msgpack_unpacked_destroy(&result);
+
+    return 1;
+}
+
+/* Load the prelude, it defines the 'flb' global table */
+int flb_luajit_ffi_init(lua_State *l)
+{
+    int ret;
+
+    lua_newtable(l);
+    lua_pushcfunction(l, ffi_unpack);
+    lua_setfield(l, -2, "unpack");
+    lua_setglobal(l, "flb");
+
+    ret = luaL_dostring(l, ffi_prelude);
+    if (ret != 0) {
+        flb_error("[luajit] cannot load FFI prelude: %s",
+                  lua_tostring(l, -1));
+        lua_pop(l, 1);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Push the record as a cdata and keep it referenced from the registry,
+ * the same view is reused for every record. Returns the reference.
+ */
+int flb_luajit_ffi_bind(lua_State *l, struct flb_luajit_rec *rec)
+{
+    lua_getglobal(l, "flb");
+    lua_getfield(l, -1, "bind");
+    lua_remove(l, -2);
+    lua_pushlightuserdata(l, rec);
+    lua_call(l, 1, 1);
+
+    return luaL_ref(l, LUA_REGISTRYINDEX);
+}
+
+struct flb_luajit_rec *flb_luajit_rec_create()
+{
+    struct flb_luajit_rec *rec;
+
+    rec = flb_calloc(1, sizeof(struct flb_luajit_rec));
+    if (!rec) {
+        flb_errno();
+        return NULL;
+    }
+    rec->api = &ffi_api;
+    msgpack_sbuffer_init(&rec->sets);
+    msgpack_packer_init(&rec->sets_pck, &rec->sets, msgpack_sbuffer_write);
+
+    return rec;
+}
+
+void flb_luajit_rec_destroy(struct flb_luajit_rec *rec)
+{
+    msgpack_sbuffer_destroy(&rec->sets);
+    flb_free(rec->entries);
+    flb_free(rec);
+}
+
+/* Point the view to a new record, 'map' must stay valid while in use */
+void flb_luajit_rec_reset(struct flb_luajit_rec *rec,
+                          const char *map, size_t size)
+{
+    rec->map = map;
+    rec->map_size = size;
+    rec->indexed = FLB_FALSE;
+    rec->count = 0;
+    rec->live = 0;
+    rec->modified = FLB_FALSE;
+    rec->sets.size = 0;
+}
+
+/* Write the record map: untouched entries are copied as they are */
+int flb_luajit_rec_pack(struct flb_luajit_rec *rec, msgpack_sbuffer *sbuf)
+{
+    int i;
+    int len;
+    char hdr[5];
+    struct flb_luajit_entry *e;
+
+    if (rec->modified == FLB_FALSE) {
+        return msgpack_sbuffer_write(sbuf, rec->map, rec->map_size);
+    }
+
+    len = flb_mp_map_header_write(hdr, rec->live);
+    msgpack_sbuffer_write(sbuf, hdr, len);
+
+    for (i = 0; i < rec->count; i++) {
+        e = &rec->entries[i];
+        if (e->removed == FLB_FALSE) {
+            msgpack_sbuffer_write(sbuf, ffi_base(rec, e) + e->obj,
+                                  e->obj_size);
+        }
+    }
+
+    return 0;
+}
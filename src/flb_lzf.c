@@ -0,0 +1,218 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include <fluent-bit/flb_lzf.h>
+
+/*
+ * Stream format, a sequence of:
+ *
+ * - 000LLLLL                     : literal run of L + 1 bytes
+ * - LLLooooo oooooooo            : back reference of L + 2 bytes
+ * - 111ooooo LLLLLLLL oooooooo   : back reference of L + 9 bytes
+ *
+ * where the offset 'o' is the distance to the reference minus one.
+ */
+
+#define LZF_HLOG     13
+#define LZF_HSIZE    (1 << LZF_HLOG)
+#define LZF_MAX_LIT  (1 << 5)
+#define LZF_MAX_OFF  (1 << 13)
+#define LZF_MAX_REF  ((1 << 8) + (1 << 3))
+
+static inline uint32_t lzf_hash(const uint8_t *p)
+{
+    uint32_t v;
+
+    v = (p[0] << 16) | (p[1] << 8) | p[2];
+    return (v * 2654435761U) >> (32 - LZF_HLOG);
+}
+
+/*
+ * Compress 'in_data' into 'out_data'. It returns the compressed size or zero
+ * if the result does not fit in 'out_len' bytes (not compressible data).
+ */
+size_t flb_lzf_compress(const void *in_data, size_t in_len,
+                        void *out_data, size_t out_len)
+{
+    int lit;
+    size_t len;
+    size_t max;
+    size_t off;
+    uint32_t h;
+    uint32_t htab[LZF_HSIZE];
+    const uint8_t *ip = in_data;
+    const uint8_t *in_end = ip + in_len;
+    const uint8_t *ref;
+    uint8_t *op = out_data;
+    uint8_t *out_end = op + out_len;
+
+    if (in_len == 0 || out_len < 2) {
+        return 0;
+    }
+
+    memset(htab, '\0', sizeof(htab));
+
+    /* Reserve the control byte of the first literal run */
+    lit = 0;
+    op++;
+
+    while (ip + 2 < in_end) {
+        h = lzf_hash(ip);
+        ref = (const uint8_t *) in_data + htab[h];
+        htab[h] = ip - (const uint8_t *) in_data;
+        off = ip - ref - 1;
+
+        if (ref < ip && off < LZF_MAX_OFF &&
+            ref[0] == ip[0] && ref[1] == ip[1] && ref[2] == ip[2]) {
+
+            max = in_end - ip;
+            if (max > LZF_MAX_REF) {
+                max = LZF_MAX_REF;
+            }
+            len = 3;
+            while (len < max && ref[len] == ip[len]) {
+                len++;
+            }
+
+            /* control (and optional length) + offset */
+            if (op + 3 + 1 >= out_end) {
+                return 0;
+            }
+
+            /* Close the current literal run */
+            if (lit > 0) {
+                op[-lit - 1] = lit - 1;
+            }
+            else {
+                op--;
+            }
+
+            len -= 2;
+            if (len < 7) {
+                *op++ = (off >> 8) + (len << 5);
+            }
+            else {
+                *op++ = (off >> 8) + (7 << 5);
+                *op++ = len - 7;
+            }
+            *op++ = off;
+
+            ip += len + 2;
+
+            /* Start a new literal run */
+            lit = 0;
+            op++;
+            continue;
+        }
+
+        if (op >= out_end) {
+            return 0;
+        }
+        *op++ = *ip++;
+        lit++;
+        if (lit == LZF_MAX_LIT) {
+            op[-lit - 1] = lit - 1;
+            lit = 0;
+            op++;
+        }
+    }
+
+    /* Remaining bytes are literals */
+    while (ip < in_end) {
+        if (op >= out_end) {
+            return 0;
+        }
+        *op++ = *ip++;
+        lit++;
+        if (lit == LZF_MAX_LIT) {
+            op[-lit - 1] = lit - 1;
+            lit = 0;
+            op++;
+        }
+    }
+
+    if (lit > 0) {
+        op[-lit - 1] = lit - 1;
+    }
+    else {
+        op--;
+    }
+
+    return op - (uint8_t *) out_data;
+}
+
+/*
+ * Decompress 'in_data' into 'out_data'. It returns the decompressed size or
+ * zero if the stream is corrupted or 'out_len' is too small.
+ */
+size_t flb_lzf_decompress(const void *in_data, size_t in_len,
+                          void *out_data, size_t out_len)
+{
+    size_t len;
+    size_t off;
+    unsigned int ctrl;
+    const uint8_t *ip = in_data;
+    const uint8_t *in_end = ip + in_len;
+    const uint8_t *ref;
+    uint8_t *op = out_data;
+    uint8_t *out_end = op + out_len;
+
+    while (ip < in_end) {
+        ctrl = *ip++;
+
+        if (ctrl < LZF_MAX_LIT) {
+            len = ctrl + 1;
+            if (ip + len > in_end || op + len > out_end) {
+                return 0;
+            }
+            memcpy(op, ip, len);
+            op += len;
+            ip += len;
+            continue;
+        }
+
+        len = ctrl >> 5;
+        if (len == 7) {
+            if (ip >= in_end) {
+                return 0;
+            }
+            len += *ip++;
+        }
+        if (ip >= in_end) {
+            return 0;
+        }
+        off = ((ctrl & 0x1f) << 8) + *ip++ + 1;
+        len += 2;
+
+        if (off > (size_t) (op - (uint8_t *) out_data) || op + len > out_end) {
+            return 0;
+        }
+
+        /* References may overlap the output, copy byte by byte */
+        ref = op - off;
+        while (len--) {
+            *op++ = *ref++;
+        }
+    }
+
+    return op - (uint8_t *) out_data;
+}
@@ -0,0 +1,236 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/*
+ * Memory accounting: the owner and size of every block allocated through
+ * flb_malloc() and friends are kept in a sharded pointer table. Blocks are
+ * not prefixed with a header: buffers allocated by libraries (e.g: msgpack)
+ * are released with flb_free() and must stay valid libc pointers, unknown
+ * pointers are just not found in the table.
+ */
+
+#include <pthread.h>
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+
+#define MEM_SHARDS       64
+#define MEM_BUCKETS      1024       /* per shard */
+
+struct mem_block {
+    void *ptr;
+    size_t size;
+    int id;
+    struct mem_block *next;
+};
+
+struct mem_shard {
+    pthread_mutex_t lock;
+    struct mem_block *buckets[MEM_BUCKETS];
+};
+
+__thread int flb_mem_scope_id;
+
+static struct mem_shard shards[MEM_SHARDS] = {
+    [0 ... MEM_SHARDS - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER }
+};
+static struct flb_mem_usage usage[FLB_MEM_SUBSYSTEMS];
+
+static char *names[] = {
+    "core", "input", "parser", "filter", "output", "upstream", "kubernetes"
+};
+
+static inline uint64_t mem_hash(void *ptr)
+{
+    return ((uintptr_t) ptr >> 4) * 0x9e3779b97f4a7c15ULL;
+}
+
+static inline struct mem_shard *mem_shard(uint64_t hash)
+{
+    return &shards[hash >> 58];
+}
+
+static inline struct mem_block **mem_bucket(struct mem_shard *s,
+                                            uint64_t hash)
+{
+    return &s->buckets[(hash >> 32) % MEM_BUCKETS];
+}
+
+static void usage_add(int id, size_t size)
+{
+    uint64_t live;
+    uint64_t peak;
+    struct flb_mem_usage *u = &usage[id];
+
+    __atomic_add_fetch(&u->allocs, 1, __ATOMIC_RELAXED);
+    live = __atomic_add_fetch(&u->live, size, __ATOMIC_RELAXED);
+    peak = __atomic_load_n(&u->peak, __ATOMIC_RELAXED);
+    while (live > peak &&
+           !__atomic_compare_exchange_n(&u->peak, &peak, live, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static void usage_sub(int id, size_t size)
+{
+    struct flb_mem_usage *u = &usage[id];
+
+    __atomic_add_fetch(&u->frees, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&u->live, size, __ATOMIC_RELAXED);
+}
+
+/* Unlink the block of 'ptr', returns NULL if it was not accounted */
+static struct mem_block *block_take(void *ptr)
+{
+    uint64_t hash = mem_hash(ptr);
+    struct mem_shard *s = mem_shard(hash);
+    struct mem_block **prev;
+    struct mem_block *b;
+
+    pthread_mutex_lock(&s->lock);
+    prev = mem_bucket(s, hash);
+    for (b = *prev; b; prev = &b->next, b = b->next) {
+        if (b->ptr == ptr) {
+            *prev = b->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    return b;
+}
+
+static void block_put(struct mem_block *b)
+{
+    uint64_t hash = mem_hash(b->ptr);
+    struct mem_shard *s = mem_shard(hash);
+    struct mem_block **head;
+
+    pthread_mutex_lock(&s->lock);
+    head = mem_bucket(s, hash);
+    b->next = *head;
+    *head = b;
+    pthread_mutex_unlock(&s->lock);
+}
+
+static int scope_id()
+{
+    int id = flb_mem_scope_id;
+
+    if (id < 0 || id >= FLB_MEM_SUBSYSTEMS) {
+        return FLB_MEM_CORE;
+    }
+    return id;
+}
+
+void flb_mem_acct_alloc(void *ptr, size_t size)
+{
+    struct mem_block *b;
+
+    /*
+     * An entry for the same address is stale: the block was released by
+     * a plain free() out of our sight, drop its charge and reuse it.
+     */
+    b = block_take(ptr);
+    if (b) {
+        usage_sub(b->id, b->size);
+    }
+    else {
+        b = malloc(sizeof(struct mem_block));
+        if (!b) {
+            return;
+        }
+    }
+
+    b->ptr = ptr;
+    b->size = size;
+    b->id = scope_id();
+    usage_add(b->id, size);
+    block_put(b);
+}
+
+/*
+ * Reallocation in two steps: the block of the old address is unlinked
+ * before realloc() releases it (another thread could get the address
+ * back right away), then linked again with the new address.
+ */
+void *flb_mem_acct_take(void *ptr)
+{
+    if (!ptr) {
+        return NULL;
+    }
+    return block_take(ptr);
+}
+
+/* A resized block keeps its owner */
+void flb_mem_acct_resize(void *block, void *ptr, size_t size)
+{
+    struct mem_block *b = block;
+
+    if (!b) {
+        if (ptr) {
+            flb_mem_acct_alloc(ptr, size);
+        }
+        return;
+    }
+
+    if (!ptr) {
+        if (size > 0) {
+            /* realloc() failed, the old block is still valid */
+            block_put(b);
+            return;
+        }
+        usage_sub(b->id, b->size);
+        free(b);
+        return;
+    }
+
+    usage_sub(b->id, b->size);
+    b->ptr = ptr;
+    b->size = size;
+    usage_add(b->id, size);
+    block_put(b);
+}
+
+void flb_mem_acct_free(void *ptr)
+{
+    struct mem_block *b;
+
+    if (!ptr) {
+        return;
+    }
+
+    b = block_take(ptr);
+    if (b) {
+        usage_sub(b->id, b->size);
+        free(b);
+    }
+}
+
+void flb_mem_acct_get(int id, struct flb_mem_usage *out)
+{
+    out->live   = __atomic_load_n(&usage[id].live, __ATOMIC_RELAXED);
+    out->peak   = __atomic_load_n(&usage[id].peak, __ATOMIC_RELAXED);
+    out->allocs = __atomic_load_n(&usage[id].allocs, __ATOMIC_RELAXED);
+    out->frees  = __atomic_load_n(&usage[id].frees, __ATOMIC_RELAXED);
+}
+
+char *flb_mem_subsystem_name(int id)
+{
+    return names[id];
+}
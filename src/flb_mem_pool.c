@@ -0,0 +1,492 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_log.h>
+#include <fluent-bit/flb_mem_pool.h>
+
+#include <msgpack.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#define POOL_ORDERS      (FLB_MEM_POOL_MAX_ORDER - FLB_MEM_POOL_MIN_ORDER + 1)
+#define POOL_MIN_BLOCK   ((size_t) 1 << FLB_MEM_POOL_MIN_ORDER)
+#define POOL_MAX_BLOCK   ((size_t) 1 << FLB_MEM_POOL_MAX_ORDER)
+#define POOL_HUGE_PAGE   (2 * 1024 * 1024)
+
+/*
+ * Every 4KB page of the region has a byte in the map: the first page of a
+ * block keeps its order (relative to the minimum one) and the free flag,
+ * the other pages are not a block start.
+ */
+#define MAP_FREE         0x80
+#define MAP_NONE         0x7f
+
+/* Free blocks are linked through their first bytes */
+struct pool_free {
+    struct pool_free *next;
+    struct pool_free *prev;
+};
+
+struct flb_mem_pool {
+    char *map_base;              /* mapping, it can start before 'start' */
+    size_t map_size;
+    int hugepages;
+    int users;                   /* contexts that created the pool       */
+
+    uint8_t *map;                /* a byte per 4KB page                  */
+    struct pool_free *free[POOL_ORDERS];
+
+    size_t size;
+    size_t used;
+    size_t peak;
+    uint64_t fallbacks;
+    pthread_mutex_t lock;
+};
+
+char *flb_mem_pool_start = NULL;
+char *flb_mem_pool_end = NULL;
+
+static struct flb_mem_pool *pool = NULL;
+static pthread_mutex_t pool_create_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline size_t page_of(char *p)
+{
+    return (p - flb_mem_pool_start) >> FLB_MEM_POOL_MIN_ORDER;
+}
+
+static inline void free_push(int o, char *p)
+{
+    struct pool_free *f = (struct pool_free *) p;
+
+    f->prev = NULL;
+    f->next = pool->free[o];
+    if (f->next) {
+        f->next->prev = f;
+    }
+    pool->free[o] = f;
+    pool->map[page_of(p)] = o | MAP_FREE;
+}
+
+static inline void free_unlink(int o, char *p)
+{
+    struct pool_free *f = (struct pool_free *) p;
+
+    if (f->prev) {
+        f->prev->next = f->next;
+    }
+    else {
+        pool->free[o] = f->next;
+    }
+    if (f->next) {
+        f->next->prev = f->prev;
+    }
+    pool->map[page_of(p)] = MAP_NONE;
+}
+
+/* Order (relative) of the smallest block holding 'size' bytes */
+static inline int size_order(size_t size)
+{
+    int o = 0;
+
+    while (((size_t) POOL_MIN_BLOCK << o) < size) {
+        o++;
+    }
+    return o;
+}
+
+/* Map the region, huge pages as asked if possible */
+static char *region_map(size_t size, int *hugepages, char **start,
+                        size_t *map_size)
+{
+    char *p;
+    char *aligned;
+    size_t extra;
+
+    *start = NULL;
+
+#ifdef MAP_HUGETLB
+    if (*hugepages == FLB_MEM_POOL_HUGE_EXPLICIT) {
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) {
+            *start = p;
+            *map_size = size;
+            return p;
+        }
+        flb_warn("[mem_pool] no huge pages reserved for %lu bytes, "
+                 "using transparent huge pages", size);
+        *hugepages = FLB_MEM_POOL_HUGE_TRANSPARENT;
+    }
+#else
+    if (*hugepages == FLB_MEM_POOL_HUGE_EXPLICIT) {
+        *hugepages = FLB_MEM_POOL_HUGE_TRANSPARENT;
+    }
+#endif
+
+    /* Huge pages need an aligned start, map a bit more and skip the head */
+    extra = (*hugepages == FLB_MEM_POOL_HUGE_TRANSPARENT) ? POOL_HUGE_PAGE : 0;
+    p = mmap(NULL, size + extra, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        flb_errno();
+        return NULL;
+    }
+
+    aligned = p;
+    if (extra > 0) {
+        aligned = (char *) (((uintptr_t) p + POOL_HUGE_PAGE - 1) &
+                            ~((uintptr_t) POOL_HUGE_PAGE - 1));
+#ifdef MADV_HUGEPAGE
+        if (madvise(aligned, size, MADV_HUGEPAGE) == -1) {
+            flb_warn("[mem_pool] transparent huge pages are not available");
+            *hugepages = FLB_MEM_POOL_HUGE_OFF;
+        }
+#else
+        *hugepages = FLB_MEM_POOL_HUGE_OFF;
+#endif
+    }
+
+    *start = aligned;
+    *map_size = size + extra;
+    return p;
+}
+
+/*
+ * Reserve the pool region, 'size' is rounded down to the maximum block
+ * size. Its pages are faulted in right away, so the footprint does not
+ * change while running. The pool is created once, other calls just take
+ * a reference.
+ */
+int flb_mem_pool_create(size_t size, int hugepages)
+{
+    int i;
+    int o;
+    char *p;
+    char *start;
+    size_t pages;
+    struct flb_mem_pool *mp;
+
+    pthread_mutex_lock(&pool_create_lock);
+    if (pool) {
+        if (size != pool->size) {
+            flb_warn("[mem_pool] already created with %lu bytes", pool->size);
+        }
+        pool->users++;
+        pthread_mutex_unlock(&pool_create_lock);
+        return 0;
+    }
+
+    size &= ~(POOL_MAX_BLOCK - 1);
+    if (size == 0) {
+        flb_error("[mem_pool] the pool size must be at least %lu bytes",
+                  POOL_MAX_BLOCK);
+        pthread_mutex_unlock(&pool_create_lock);
+        return -1;
+    }
+
+    mp = flb_calloc(1, sizeof(struct flb_mem_pool));
+    if (!mp) {
+        flb_errno();
+        pthread_mutex_unlock(&pool_create_lock);
+        return -1;
+    }
+
+    pages = size >> FLB_MEM_POOL_MIN_ORDER;
+    mp->map = flb_malloc(pages);
+    if (!mp->map) {
+        flb_errno();
+        flb_free(mp);
+        pthread_mutex_unlock(&pool_create_lock);
+        return -1;
+    }
+    memset(mp->map, MAP_NONE, pages);
+
+    mp->hugepages = hugepages;
+    mp->map_base = region_map(size, &mp->hugepages, &start, &mp->map_size);
+    if (!mp->map_base) {
+        flb_error("[mem_pool] cannot map %lu bytes", size);
+        flb_free(mp->map);
+        flb_free(mp);
+        pthread_mutex_unlock(&pool_create_lock);
+        return -1;
+    }
+    /* Fault the pages in now instead of during a burst */
+    for (p = start; p < start + size; p += POOL_MIN_BLOCK) {
+        *(volatile char *) p = 0;
+    }
+
+    mp->size = size;
+    mp->users = 1;
+    pthread_mutex_init(&mp->lock, NULL);
+
+    pool = mp;
+    flb_mem_pool_start = start;
+    flb_mem_pool_end = start + size;
+
+    /* The region is a list of the biggest blocks */
+    o = POOL_ORDERS - 1;
+    for (i = (size / POOL_MAX_BLOCK) - 1; i >= 0; i--) {
+        free_push(o, start + i * POOL_MAX_BLOCK);
+    }
+    pthread_mutex_unlock(&pool_create_lock);
+
+    flb_info("[mem_pool] %lu bytes reserved%s", size,
+             mp->hugepages == FLB_MEM_POOL_HUGE_EXPLICIT ?
+             " on huge pages" :
+             mp->hugepages == FLB_MEM_POOL_HUGE_TRANSPARENT ?
+             " on transparent huge pages" : "");
+    return 0;
+}
+
+/*
+ * Drop a reference, the last one releases the region unless some blocks
+ * are still given out.
+ */
+void flb_mem_pool_destroy()
+{
+    struct flb_mem_pool *mp;
+
+    pthread_mutex_lock(&pool_create_lock);
+    mp = pool;
+    if (!mp || --mp->users > 0) {
+        pthread_mutex_unlock(&pool_create_lock);
+        return;
+    }
+
+    flb_debug("[mem_pool] peak usage %lu of %lu bytes, %lu fallbacks",
+              mp->peak, mp->size, mp->fallbacks);
+    if (mp->used > 0) {
+        /* Released later by flb_free(), the region must stay */
+        flb_warn("[mem_pool] %lu bytes still in use, the region is kept",
+                 mp->used);
+        pthread_mutex_unlock(&pool_create_lock);
+        return;
+    }
+
+    pool = NULL;
+    flb_mem_pool_start = NULL;
+    flb_mem_pool_end = NULL;
+    pthread_mutex_unlock(&pool_create_lock);
+
+    munmap(mp->map_base, mp->map_size);
+    pthread_mutex_destroy(&mp->lock);
+    flb_free(mp->map);
+    flb_free(mp);
+}
+
+/* Parse a 'Mem_Pool_Hugepages' value */
+int flb_mem_pool_hugepages(char *str)
+{
+    if (strcasecmp(str, "off") == 0 || strcasecmp(str, "false") == 0) {
+        return FLB_MEM_POOL_HUGE_OFF;
+    }
+    else if (strcasecmp(str, "transparent") == 0 ||
+             strcasecmp(str, "on") == 0) {
+        return FLB_MEM_POOL_HUGE_TRANSPARENT;
+    }
+    else if (strcasecmp(str, "explicit") == 0) {
+        return FLB_MEM_POOL_HUGE_EXPLICIT;
+    }
+
+    return -1;
+}
+
+void flb_mem_pool_usage(struct flb_mem_pool_usage *out)
+{
+    memset(out, 0, sizeof(struct flb_mem_pool_usage));
+    if (!pool) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    out->size = pool->size;
+    out->used = pool->used;
+    out->peak = pool->peak;
+    out->fallbacks = pool->fallbacks;
+    out->hugepages = pool->hugepages;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* Take a block of the order (relative) or NULL, the lock is held */
+static char *block_take(int order)
+{
+    int o;
+    char *p;
+
+    for (o = order; o < POOL_ORDERS && !pool->free[o]; o++);
+    if (o == POOL_ORDERS) {
+        return NULL;
+    }
+
+    p = (char *) pool->free[o];
+    free_unlink(o, p);
+
+    /* Split it, the upper halves are free */
+    while (o > order) {
+        o--;
+        free_push(o, p + (POOL_MIN_BLOCK << o));
+    }
+    pool->map[page_of(p)] = order;
+
+    pool->used += POOL_MIN_BLOCK << order;
+    if (pool->used > pool->peak) {
+        pool->peak = pool->used;
+    }
+    return p;
+}
+
+/*
+ * Allocate 'size' bytes from the pool, flb_malloc() serves the requests
+ * bigger than a block, the ones that do not fit and all of them when there
+ * is no pool.
+ */
+void *flb_mem_pool_alloc(size_t size)
+{
+    char *p;
+
+    if (!pool || size == 0 || size > POOL_MAX_BLOCK) {
+        return flb_malloc(size);
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    p = block_take(size_order(size));
+    if (!p) {
+        pool->fallbacks++;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (!p) {
+        return flb_malloc(size);
+    }
+    return p;
+}
+
+/* Release a block, merged with its free buddies */
+void flb_mem_pool_free(void *ptr)
+{
+    int o;
+    char *p = ptr;
+    char *buddy;
+    size_t page;
+
+    page = page_of(p);
+
+    pthread_mutex_lock(&pool->lock);
+    if (((uintptr_t) (p - flb_mem_pool_start) & (POOL_MIN_BLOCK - 1)) != 0 ||
+        pool->map[page] & MAP_FREE || pool->map[page] == MAP_NONE) {
+        pthread_mutex_unlock(&pool->lock);
+        flb_error("[mem_pool] invalid release of %p", ptr);
+        return;
+    }
+
+    o = pool->map[page];
+    pool->used -= POOL_MIN_BLOCK << o;
+    pool->map[page] = MAP_NONE;
+
+    while (o < POOL_ORDERS - 1) {
+        buddy = flb_mem_pool_start +
+                ((p - flb_mem_pool_start) ^ (POOL_MIN_BLOCK << o));
+        if (pool->map[page_of(buddy)] != (o | MAP_FREE)) {
+            break;
+        }
+        free_unlink(o, buddy);
+        if (buddy < p) {
+            p = buddy;
+        }
+        o++;
+    }
+    free_push(o, p);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* Usable bytes of a pool block, zero for other addresses */
+size_t flb_mem_pool_block_size(void *ptr)
+{
+    if (!flb_mem_pool_owns(ptr)) {
+        return 0;
+    }
+    return POOL_MIN_BLOCK << pool->map[page_of(ptr)];
+}
+
+/* Resize a block, it moves to a bigger block (or out of the pool) */
+void *flb_mem_pool_resize(void *ptr, size_t size)
+{
+    void *tmp;
+    size_t block;
+
+    block = flb_mem_pool_block_size(ptr);
+    if (size <= block && size > 0) {
+        return ptr;
+    }
+    else if (size == 0) {
+        flb_mem_pool_free(ptr);
+        return NULL;
+    }
+
+    tmp = flb_mem_pool_alloc(size);
+    if (!tmp) {
+        return NULL;
+    }
+    memcpy(tmp, ptr, block);
+    flb_mem_pool_free(ptr);
+
+    return tmp;
+}
+
+int flb_mem_pool_sbuffer_write(void *data, const char *buf, size_t len)
+{
+    void *tmp;
+    size_t nsize;
+    msgpack_sbuffer *sbuf = data;
+
+    if (sbuf->alloc - sbuf->size < len) {
+        nsize = sbuf->alloc ? sbuf->alloc * 2 : MSGPACK_SBUFFER_INIT_SIZE;
+        while (nsize < sbuf->size + len) {
+            size_t tmp_nsize = nsize * 2;
+            if (tmp_nsize <= nsize) {
+                nsize = sbuf->size + len;
+                break;
+            }
+            nsize = tmp_nsize;
+        }
+
+        /* A new buffer comes from the pool, the others are resized */
+        if (!sbuf->data) {
+            tmp = flb_mem_pool_alloc(nsize);
+        }
+        else {
+            tmp = flb_realloc(sbuf->data, nsize);
+        }
+        if (!tmp) {
+            return -1;
+        }
+
+        sbuf->data = tmp;
+        sbuf->alloc = nsize;
+    }
+
+    memcpy(sbuf->data + sbuf->size, buf, len);
+    sbuf->size += len;
+
+    return 0;
+}
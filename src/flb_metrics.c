@@ -24,10 +24,74 @@
 
 #include <fluent-bit/flb_info.h>
 #include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_str.h>
 #include <fluent-bit/flb_utils.h>
 #include <fluent-bit/flb_metrics.h>
 #include <msgpack.h>
 
+#ifdef FLB_HAVE_C_TLS
+__thread int flb_metrics_slot_id;
+#endif
+
+static int slot_next;
+
+/* Threads take the slots round robin */
+int flb_metrics_slot_assign()
+{
+    return __atomic_fetch_add(&slot_next, 1, __ATOMIC_RELAXED) %
+        FLB_METRIC_SLOTS;
+}
+
+/*
+ * The slots of a counter are allocated by its first update, gauges never
+ * need them. Two threads can race here, the one losing the exchange
+ * releases its own array.
+ */
+struct flb_metric_slot *flb_metric_slots(struct flb_metric *m)
+{
+    struct flb_metric_slot *slots;
+    struct flb_metric_slot *expected = NULL;
+
+    slots = flb_calloc(FLB_METRIC_SLOTS, sizeof(struct flb_metric_slot));
+    if (!slots) {
+        flb_errno();
+        return NULL;
+    }
+
+    if (!__atomic_compare_exchange_n(&m->slots, &expected, slots, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        flb_free(slots);
+        return expected;
+    }
+    return slots;
+}
+
+/* Aggregate the slots, the value is read without stopping the writers */
+uint64_t flb_metric_value(struct flb_metric *m)
+{
+    int i;
+    uint64_t val;
+    struct flb_metric_slot *slots;
+
+    val = __atomic_load_n(&m->val, __ATOMIC_RELAXED);
+    slots = __atomic_load_n(&m->slots, __ATOMIC_ACQUIRE);
+    if (slots) {
+        for (i = 0; i < FLB_METRIC_SLOTS; i++) {
+            val += __atomic_load_n(&slots[i].val, __ATOMIC_RELAXED);
+        }
+    }
+    return val;
+}
+
+/* The lock is held by the parent context */
+static inline pthread_mutex_t *metrics_lock(struct flb_metrics *metrics)
+{
+    if (metrics->parent) {
+        return &metrics->parent->lock;
+    }
+    return &metrics->lock;
+}
+
 static int id_exists(int id, struct flb_metrics *metrics)
 {
     struct mk_list *head;
@@ -63,6 +127,10 @@ struct flb_metric *flb_metrics_get_id(int id, struct flb_metrics *metrics)
     struct mk_list *head;
     struct flb_metric *m;
 
+    if (id >= 0 && id < FLB_METRICS_DIRECT_IDS) {
+        return metrics->ids[id];
+    }
+
     mk_list_foreach(head, &metrics->list) {
         m = mk_list_entry(head, struct flb_metric, _head);
         if (m->id == id) {
@@ -84,6 +152,7 @@ struct flb_metrics *flb_metrics_create(char *title)
         return NULL;
     }
     metrics->count = 0;
+    memset(metrics->ids, 0, sizeof(metrics->ids));
 
     ret = snprintf(metrics->title, sizeof(metrics->title) - 1, "%s", title);
     if (ret == -1) {
@@ -92,12 +161,45 @@ struct flb_metrics *flb_metrics_create(char *title)
         return NULL;
     }
     metrics->title_len = strlen(metrics->title);
+    metrics->label = NULL;
+    metrics->children_count = 0;
+    metrics->parent = NULL;
 
     mk_list_init(&metrics->list);
+    mk_list_init(&metrics->children);
+    pthread_mutex_init(&metrics->lock, NULL);
     return metrics;
 }
 
-int flb_metrics_add(int id, char *title, struct flb_metrics *metrics)
+/* Create a context labelled as 'title'='label' under 'parent' */
+struct flb_metrics *flb_metrics_create_child(char *title, char *label,
+                                             struct flb_metrics *parent)
+{
+    struct flb_metrics *metrics;
+
+    metrics = flb_metrics_create(title);
+    if (!metrics) {
+        return NULL;
+    }
+
+    metrics->label = flb_strdup(label);
+    if (!metrics->label) {
+        pthread_mutex_destroy(&metrics->lock);
+        flb_free(metrics);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&parent->lock);
+    metrics->parent = parent;
+    mk_list_add(&metrics->_head, &parent->children);
+    parent->children_count++;
+    pthread_mutex_unlock(&parent->lock);
+
+    return metrics;
+}
+
+static int metric_add(int id, int type, char *title,
+                      struct flb_metrics *metrics)
 {
     int ret;
     struct flb_metric *m;
@@ -109,11 +211,24 @@ int flb_metrics_add(int id, char *title, struct flb_metrics *metrics)
         return -1;
     }
     m->val = 0;
+    m->type = type;
+    m->slots = NULL;
+    m->hist = NULL;
+
+    if (type == FLB_METRIC_HISTOGRAM) {
+        m->hist = flb_calloc(1, sizeof(struct flb_metric_hist));
+        if (!m->hist) {
+            flb_errno();
+            flb_free(m);
+            return -1;
+        }
+    }
 
     /* Write title */
     ret = snprintf(m->title, sizeof(m->title) - 1, "%s", title);
     if (ret == -1) {
         flb_errno();
+        flb_free(m->hist);
         flb_free(m);
         return -1;
     }
@@ -125,6 +240,7 @@ int flb_metrics_add(int id, char *title, struct flb_metrics *metrics)
         if (id_exists(id, metrics) == FLB_TRUE) {
             flb_error("[metrics] id=%i already exists for metric '%s'",
                       id, metrics->title);
+            flb_free(m->hist);
             flb_free(m);
             return -1;
         }
@@ -134,13 +250,115 @@ int flb_metrics_add(int id, char *title, struct flb_metrics *metrics)
     }
 
     /* Link to parent list */
-    mk_list_add(&m->_head, &metrics->list);
     m->id = id;
+    pthread_mutex_lock(metrics_lock(metrics));
+    mk_list_add(&m->_head, &metrics->list);
     metrics->count++;
+    if (id < FLB_METRICS_DIRECT_IDS) {
+        metrics->ids[id] = m;
+    }
+    pthread_mutex_unlock(metrics_lock(metrics));
 
     return id;
 }
 
+int flb_metrics_add(int id, char *title, struct flb_metrics *metrics)
+{
+    return metric_add(id, FLB_METRIC_COUNTER, title, metrics);
+}
+
+/* Latency distribution, the values are observed in microseconds */
+int flb_metrics_add_histogram(int id, char *title,
+                              struct flb_metrics *metrics)
+{
+    return metric_add(id, FLB_METRIC_HISTOGRAM, title, metrics);
+}
+
+/* Bucket of a value: the smallest 'i' where (BASE << i) >= usec */
+int flb_metrics_hist_bucket(uint64_t usec)
+{
+    int i;
+    uint64_t q;
+
+    q = (usec + FLB_METRIC_HIST_BASE - 1) / FLB_METRIC_HIST_BASE;
+    if (q <= 1) {
+        return 0;
+    }
+
+    i = 64 - __builtin_clzll(q - 1);
+    if (i > FLB_METRIC_HIST_BUCKETS) {
+        i = FLB_METRIC_HIST_BUCKETS;
+    }
+    return i;
+}
+
+/*
+ * Histograms can be observed from the output workers, the updates are
+ * atomic so no lock is needed. They are updated once per flush, the
+ * buckets are shared by the threads.
+ */
+void flb_metric_observe(struct flb_metric *m, uint64_t usec)
+{
+    int i;
+
+    i = flb_metrics_hist_bucket(usec);
+    __atomic_add_fetch(&m->hist->buckets[i], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&m->hist->sum, usec, __ATOMIC_RELAXED);
+    flb_metric_sum(m, 1);
+}
+
+int flb_metrics_observe(int id, uint64_t usec, struct flb_metrics *metrics)
+{
+    struct flb_metric *m;
+
+    m = flb_metrics_get_id(id, metrics);
+    if (!m || !m->hist) {
+        return -1;
+    }
+
+    flb_metric_observe(m, usec);
+    return 0;
+}
+
+/*
+ * Estimate a quantile in seconds: upper bound of the bucket where the
+ * cumulative count reaches it. Values above the last bound report the
+ * last bound.
+ */
+double flb_metrics_hist_quantile(struct flb_metric *m, double q)
+{
+    int i;
+    uint64_t count;
+    uint64_t total = 0;
+    uint64_t rank;
+
+    if (!m->hist) {
+        return 0;
+    }
+
+    count = flb_metric_value(m);
+    if (count == 0) {
+        return 0;
+    }
+
+    rank = (uint64_t) (q * count);
+    if (rank == 0) {
+        rank = 1;
+    }
+
+    for (i = 0; i < FLB_METRIC_HIST_BUCKETS; i++) {
+        total += m->hist->buckets[i];
+        if (total >= rank) {
+            break;
+        }
+    }
+    if (i == FLB_METRIC_HIST_BUCKETS) {
+        i--;
+    }
+
+    return (FLB_METRIC_HIST_BASE << i) / 1000000.0;
+}
+
 int flb_metrics_sum(int id, size_t val, struct flb_metrics *metrics)
 {
     struct flb_metric *m;
@@ -150,7 +368,21 @@ int flb_metrics_sum(int id, size_t val, struct flb_metrics *metrics)
         return -1;
     }
 
-    m->val += val;
+    flb_metric_sum(m, val);
+    return 0;
+}
+
+/* Gauges: replace the value */
+int flb_metrics_set(int id, size_t val, struct flb_metrics *metrics)
+{
+    struct flb_metric *m;
+
+    m = flb_metrics_get_id(id, metrics);
+    if (!m) {
+        return -1;
+    }
+
+    flb_metric_set(m, val);
     return 0;
 }
 
@@ -160,14 +392,35 @@ int flb_metrics_destroy(struct flb_metrics *metrics)
     struct mk_list *tmp;
     struct mk_list *head;
     struct flb_metric *m;
+    struct flb_metrics *child;
+
+    mk_list_foreach_safe(head, tmp, &metrics->children) {
+        child = mk_list_entry(head, struct flb_metrics, _head);
+        flb_metrics_destroy(child);
+    }
 
     mk_list_foreach_safe(head, tmp, &metrics->list) {
         m = mk_list_entry(head, struct flb_metric, _head);
         mk_list_del(&m->_head);
+        if (m->hist) {
+            flb_free(m->hist);
+        }
+        flb_free(m->slots);
         flb_free(m);
         count++;
     }
 
+    if (metrics->parent) {
+        pthread_mutex_lock(&metrics->parent->lock);
+        mk_list_del(&metrics->_head);
+        metrics->parent->children_count--;
+        pthread_mutex_unlock(&metrics->parent->lock);
+    }
+    if (metrics->label) {
+        flb_free(metrics->label);
+    }
+
+    pthread_mutex_destroy(&metrics->lock);
     flb_free(metrics);
     return count;
 }
@@ -181,19 +434,79 @@ int flb_metrics_print(struct flb_metrics *metrics)
 
     mk_list_foreach(head, &metrics->list) {
         m = mk_list_entry(head, struct flb_metric, _head);
-        printf(", '%s' => %lu", m->title, m->val);
+        printf(", '%s' => %lu", m->title, flb_metric_value(m));
     }
     printf("\n");
 
     return 0;
 }
 
+static void pack_key(msgpack_packer *mp_pck, char *key)
+{
+    int len = strlen(key);
+
+    msgpack_pack_str(mp_pck, len);
+    msgpack_pack_str_body(mp_pck, key, len);
+}
+
+/* Histograms: {"count": N, "sum": seconds, "p50": s, "p90": s, "p99": s} */
+static void hist_pack(msgpack_packer *mp_pck, struct flb_metric *m)
+{
+    msgpack_pack_map(mp_pck, 5);
+    pack_key(mp_pck, "count");
+    msgpack_pack_uint64(mp_pck, flb_metric_value(m));
+    pack_key(mp_pck, "sum");
+    msgpack_pack_double(mp_pck, m->hist->sum / 1000000.0);
+    pack_key(mp_pck, "p50");
+    msgpack_pack_double(mp_pck, flb_metrics_hist_quantile(m, 0.50));
+    pack_key(mp_pck, "p90");
+    msgpack_pack_double(mp_pck, flb_metrics_hist_quantile(m, 0.90));
+    pack_key(mp_pck, "p99");
+    msgpack_pack_double(mp_pck, flb_metrics_hist_quantile(m, 0.99));
+}
+
+static void metrics_pack(msgpack_packer *mp_pck, struct flb_metrics *me)
+{
+    struct mk_list *head;
+    struct flb_metric *m;
+    struct flb_metrics *child;
+
+    msgpack_pack_map(mp_pck, me->count + (me->children_count > 0));
+
+    mk_list_foreach(head, &me->list) {
+        m = mk_list_entry(head, struct flb_metric, _head);
+        msgpack_pack_str(mp_pck, m->title_len);
+        msgpack_pack_str_body(mp_pck, m->title, m->title_len);
+        if (m->type == FLB_METRIC_HISTOGRAM) {
+            hist_pack(mp_pck, m);
+        }
+        else {
+            msgpack_pack_uint64(mp_pck, flb_metric_value(m));
+        }
+    }
+
+    if (me->children_count == 0) {
+        return;
+    }
+
+    /* Children: {label name: {label value: {metrics}}} */
+    child = mk_list_entry_first(&me->children, struct flb_metrics, _head);
+    msgpack_pack_str(mp_pck, child->title_len);
+    msgpack_pack_str_body(mp_pck, child->title, child->title_len);
+    msgpack_pack_map(mp_pck, me->children_count);
+
+    mk_list_foreach(head, &me->children) {
+        child = mk_list_entry(head, struct flb_metrics, _head);
+        msgpack_pack_str(mp_pck, strlen(child->label));
+        msgpack_pack_str_body(mp_pck, child->label, strlen(child->label));
+        metrics_pack(mp_pck, child);
+    }
+}
+
 /* Write metrics in messagepack format */
 int flb_metrics_dump_values(char **out_buf, size_t *out_size,
                             struct flb_metrics *me)
 {
-    struct mk_list *head;
-    struct flb_metric *m;
     msgpack_sbuffer mp_sbuf;
     msgpack_packer mp_pck;
 
@@ -201,17 +514,184 @@ int flb_metrics_dump_values(char **out_buf, size_t *out_size,
     msgpack_sbuffer_init(&mp_sbuf);
     msgpack_packer_init(&mp_pck, &mp_sbuf, msgpack_sbuffer_write);
 
-    msgpack_pack_map(&mp_pck, me->count);
-
-    mk_list_foreach(head, &me->list) {
-        m = mk_list_entry(head, struct flb_metric, _head);
-        msgpack_pack_str(&mp_pck, m->title_len);
-        msgpack_pack_str_body(&mp_pck, m->title, m->title_len);
-        msgpack_pack_uint64(&mp_pck, m->val);
-    }
+    pthread_mutex_lock(metrics_lock(me));
+    metrics_pack(&mp_pck, me);
+    pthread_mutex_unlock(metrics_lock(me));
 
     *out_buf  = mp_sbuf.data;
     *out_size = mp_sbuf.size;
 
     return 0;
 }
+
+/* Append a label value escaping quotes, backslashes and line breaks */
+static flb_sds_t prometheus_label(flb_sds_t sds, char *str, int len)
+{
+    int i;
+    int start = 0;
+
+    for (i = 0; i < len; i++) {
+        if (str[i] != '"' && str[i] != '\\' && str[i] != '\n') {
+            continue;
+        }
+        sds = flb_sds_cat(sds, str + start, i - start);
+        if (str[i] == '\n') {
+            sds = flb_sds_cat(sds, "\\n", 2);
+        }
+        else {
+            sds = flb_sds_cat(sds, "\\", 1);
+            sds = flb_sds_cat(sds, str + i, 1);
+        }
+        start = i + 1;
+    }
+
+    return flb_sds_cat(sds, str + start, i - start);
+}
+
+/* Labels of a context: name="TITLE" plus the label of a child */
+static flb_sds_t prometheus_labels(flb_sds_t sds, struct flb_metrics *me,
+                                   struct flb_metrics *child)
+{
+    sds = flb_sds_cat(sds, "name=\"", 6);
+    sds = flb_sds_cat(sds, me->title, me->title_len);
+    sds = flb_sds_cat(sds, "\"", 1);
+    if (child) {
+        sds = flb_sds_cat(sds, ",", 1);
+        sds = flb_sds_cat(sds, child->title, child->title_len);
+        sds = flb_sds_cat(sds, "=\"", 2);
+        sds = prometheus_label(sds, child->label, strlen(child->label));
+        sds = flb_sds_cat(sds, "\"", 1);
+    }
+    return sds;
+}
+
+static flb_sds_t prometheus_sample(flb_sds_t sds, char *kind, int kind_len,
+                                   struct flb_metric *m, char *suffix,
+                                   struct flb_metrics *me,
+                                   struct flb_metrics *child,
+                                   char *le, char *val,
+                                   char *time_str, int time_len)
+{
+    sds = flb_sds_cat(sds, "fluentbit_", 10);
+    sds = flb_sds_cat(sds, kind, kind_len);
+    sds = flb_sds_cat(sds, "_", 1);
+    sds = flb_sds_cat(sds, m->title, m->title_len);
+    sds = flb_sds_cat(sds, suffix, strlen(suffix));
+    sds = flb_sds_cat(sds, "{", 1);
+    sds = prometheus_labels(sds, me, child);
+    if (le) {
+        sds = flb_sds_cat(sds, ",le=\"", 5);
+        sds = flb_sds_cat(sds, le, strlen(le));
+        sds = flb_sds_cat(sds, "\"", 1);
+    }
+    sds = flb_sds_cat(sds, "} ", 2);
+    sds = flb_sds_cat(sds, val, strlen(val));
+    sds = flb_sds_cat(sds, " ", 1);
+    sds = flb_sds_cat(sds, time_str, time_len);
+    sds = flb_sds_cat(sds, "\n", 1);
+
+    return sds;
+}
+
+/*
+ * fluentbit_output_flush_seconds_bucket{name="TITLE",le="0.00025"} NUM TIME
+ * ...
+ * fluentbit_output_flush_seconds_bucket{name="TITLE",le="+Inf"} NUM TIME
+ * fluentbit_output_flush_seconds_sum{name="TITLE"} SECONDS TIME
+ * fluentbit_output_flush_seconds_count{name="TITLE"} NUM TIME
+ */
+static flb_sds_t prometheus_hist(flb_sds_t sds, char *kind, int kind_len,
+                                 struct flb_metric *m,
+                                 struct flb_metrics *me,
+                                 struct flb_metrics *child,
+                                 char *time_str, int time_len)
+{
+    int i;
+    uint64_t count = 0;
+    char le[32];
+    char val[32];
+
+    for (i = 0; i <= FLB_METRIC_HIST_BUCKETS; i++) {
+        count += m->hist->buckets[i];
+        if (i < FLB_METRIC_HIST_BUCKETS) {
+            snprintf(le, sizeof(le) - 1, "%g",
+                     (FLB_METRIC_HIST_BASE << i) / 1000000.0);
+        }
+        else {
+            strcpy(le, "+Inf");
+        }
+        snprintf(val, sizeof(val) - 1, "%lu", count);
+        sds = prometheus_sample(sds, kind, kind_len, m, "_bucket", me, child,
+                                le, val, time_str, time_len);
+    }
+
+    snprintf(val, sizeof(val) - 1, "%.6f", m->hist->sum / 1000000.0);
+    sds = prometheus_sample(sds, kind, kind_len, m, "_sum", me, child,
+                            NULL, val, time_str, time_len);
+
+    /* The count matches the +Inf bucket */
+    snprintf(val, sizeof(val) - 1, "%lu", count);
+    sds = prometheus_sample(sds, kind, kind_len, m, "_count", me, child,
+                            NULL, val, time_str, time_len);
+
+    return sds;
+}
+
+/*
+ * fluentbit_KIND_METRIC_total{name="TITLE"} NUM TIME
+ *
+ * Children metrics are gauges of a labelled context, they are exposed
+ * without the '_total' suffix:
+ *
+ * fluentbit_input_lag_bytes{name="tail.0",file="/var/log/a.log"} NUM TIME
+ */
+static flb_sds_t prometheus_metrics(flb_sds_t sds, char *kind, int kind_len,
+                                    struct flb_metrics *me,
+                                    struct flb_metrics *child,
+                                    char *time_str, int time_len)
+{
+    char val[32];
+    struct mk_list *head;
+    struct flb_metric *m;
+    struct flb_metrics *ctx = child ? child : me;
+
+    mk_list_foreach(head, &ctx->list) {
+        m = mk_list_entry(head, struct flb_metric, _head);
+
+        if (m->type == FLB_METRIC_HISTOGRAM) {
+            sds = prometheus_hist(sds, kind, kind_len, m, me, child,
+                                  time_str, time_len);
+            continue;
+        }
+
+        snprintf(val, sizeof(val) - 1, "%lu", flb_metric_value(m));
+        sds = prometheus_sample(sds, kind, kind_len, m,
+                                child ? "" : "_total", me, child,
+                                NULL, val, time_str, time_len);
+    }
+
+    return sds;
+}
+
+/* Append the metrics of a context in Prometheus text exposition format */
+flb_sds_t flb_metrics_prometheus(flb_sds_t sds, char *kind,
+                                 struct flb_metrics *me,
+                                 char *time_str, int time_len)
+{
+    int kind_len = strlen(kind);
+    struct mk_list *head;
+    struct flb_metrics *child;
+
+    pthread_mutex_lock(&me->lock);
+
+    sds = prometheus_metrics(sds, kind, kind_len, me, NULL,
+                             time_str, time_len);
+    mk_list_foreach(head, &me->children) {
+        child = mk_list_entry(head, struct flb_metrics, _head);
+        sds = prometheus_metrics(sds, kind, kind_len, me, child,
+                                 time_str, time_len);
+    }
+
+    pthread_mutex_unlock(&me->lock);
+    return sds;
+}
@@ -18,9 +18,9 @@
  */
 
 /*
- * Metrics exporter go around each Fluent Bit subsystem and collect metrics
- * in a fixed interval of time. This operation is atomic and happens as one
- * event handled by the main event loop.
+ * Metrics exporter go around each Fluent Bit subsystem and collect metrics.
+ * It runs on demand from the HTTP server thread when an end-point is
+ * requested, nothing is collected while nobody asks for the metrics.
  */
 
 #include <fluent-bit/flb_info.h>
@@ -28,45 +28,70 @@
 #include <fluent-bit/flb_utils.h>
 #include <fluent-bit/flb_config.h>
 #include <fluent-bit/flb_input.h>
+#include <fluent-bit/flb_filter.h>
 #include <fluent-bit/flb_output.h>
 #include <fluent-bit/flb_pack.h>
-#include <fluent-bit/flb_http_server.h>
 #include <fluent-bit/flb_metrics.h>
 #include <fluent-bit/flb_metrics_exporter.h>
+#include <fluent-bit/flb_engine_shard.h>
 
+#include <sys/time.h>
+
+/*
+ * The instances of every engine shard are reported, the copies of the
+ * filters and outputs have the shard in their title.
+ */
 static int collect_inputs(msgpack_sbuffer *mp_sbuf, msgpack_packer *mp_pck,
                           struct flb_config *ctx)
 {
+    int k;
+    int n;
     int total = 0;
     size_t s;
     char *buf;
     struct mk_list *head;
+    struct flb_config *config;
     struct flb_input_instance *i;
 
     msgpack_pack_str(mp_pck, 5);
     msgpack_pack_str_body(mp_pck, "input", 5);
 
-    mk_list_foreach(head, &ctx->inputs) {
-        i = mk_list_entry(head, struct flb_input_instance, _head);
-        if (!i->metrics) {
+    n = flb_engine_shards_lock(ctx);
+    for (k = 0; k < n; k++) {
+        config = flb_engine_shard_get(ctx, k);
+        if (!config) {
             continue;
         }
-        total++; /* FIXME: keep total number in cache */
+        mk_list_foreach(head, &config->inputs) {
+            i = mk_list_entry(head, struct flb_input_instance, _head);
+            if (!i->metrics) {
+                continue;
+            }
+            total++; /* FIXME: keep total number in cache */
+        }
     }
 
     msgpack_pack_map(mp_pck, total);
-    mk_list_foreach(head, &ctx->inputs) {
-        i = mk_list_entry(head, struct flb_input_instance, _head);
-        if (!i->metrics) {
+    for (k = 0; k < n; k++) {
+        config = flb_engine_shard_get(ctx, k);
+        if (!config) {
             continue;
         }
-
-        flb_metrics_dump_values(&buf, &s, i->metrics);
-        msgpack_pack_str(mp_pck, i->metrics->title_len);
-        msgpack_pack_str_body(mp_pck, i->metrics->title, i->metrics->title_len);
-        msgpack_sbuffer_write(mp_sbuf, buf, s);
-        flb_free(buf);
+        mk_list_foreach(head, &config->inputs) {
+            i = mk_list_entry(head, struct flb_input_instance, _head);
+            if (!i->metrics) {
+                continue;
+            }
+
+            flb_metrics_dump_values(&buf, &s, i->metrics);
+            msgpack_pack_str(mp_pck, i->metrics->title_len);
+            msgpack_pack_str_body(mp_pck, i->metrics->title,
+                                  i->metrics->title_len);
+            msgpack_sbuffer_write(mp_sbuf, buf, s);
+            flb_free(buf);
+        }
     }
+    flb_engine_shards_unlock(ctx);
 
     return 0;
 }
@@ -74,45 +99,147 @@ static int collect_inputs(msgpack_sbuffer *mp_sbuf, msgpack_packer *mp_pck,
 static int collect_outputs(msgpack_sbuffer *mp_sbuf, msgpack_packer *mp_pck,
                            struct flb_config *ctx)
 {
+    int k;
+    int n;
     int total = 0;
     size_t s;
     char *buf;
     struct mk_list *head;
+    struct flb_config *config;
     struct flb_output_instance *i;
 
     msgpack_pack_str(mp_pck, 6);
     msgpack_pack_str_body(mp_pck, "output", 6);
 
-    mk_list_foreach(head, &ctx->outputs) {
-        i = mk_list_entry(head, struct flb_output_instance, _head);
-        if (!i->metrics) {
+    /* A reload can add and retire instances */
+    n = flb_engine_shards_lock(ctx);
+    for (k = 0; k < n; k++) {
+        config = flb_engine_shard_get(ctx, k);
+        if (config) {
+            pthread_rwlock_rdlock(&config->filters_lock);
+        }
+    }
+
+    for (k = 0; k < n; k++) {
+        config = flb_engine_shard_get(ctx, k);
+        if (!config) {
             continue;
         }
-        total++; /* FIXME: keep total number in cache */
+        mk_list_foreach(head, &config->outputs) {
+            i = mk_list_entry(head, struct flb_output_instance, _head);
+            if (!i->metrics) {
+                continue;
+            }
+            total++; /* FIXME: keep total number in cache */
+        }
     }
 
     msgpack_pack_map(mp_pck, total);
-    mk_list_foreach(head, &ctx->outputs) {
-        i = mk_list_entry(head, struct flb_output_instance, _head);
-        if (!i->metrics) {
+    for (k = 0; k < n; k++) {
+        config = flb_engine_shard_get(ctx, k);
+        if (!config) {
             continue;
         }
+        mk_list_foreach(head, &config->outputs) {
+            i = mk_list_entry(head, struct flb_output_instance, _head);
+            if (!i->metrics) {
+                continue;
+            }
+
+            flb_metrics_dump_values(&buf, &s, i->metrics);
+            msgpack_pack_str(mp_pck, i->metrics->title_len);
+            msgpack_pack_str_body(mp_pck, i->metrics->title,
+                                  i->metrics->title_len);
+            msgpack_sbuffer_write(mp_sbuf, buf, s);
+            flb_free(buf);
+        }
+    }
 
-        flb_metrics_dump_values(&buf, &s, i->metrics);
-        msgpack_pack_str(mp_pck, i->metrics->title_len);
-        msgpack_pack_str_body(mp_pck, i->metrics->title, i->metrics->title_len);
-        msgpack_sbuffer_write(mp_sbuf, buf, s);
-        flb_free(buf);
+    for (k = 0; k < n; k++) {
+        config = flb_engine_shard_get(ctx, k);
+        if (config) {
+            pthread_rwlock_unlock(&config->filters_lock);
+        }
     }
+    flb_engine_shards_unlock(ctx);
 
     return 0;
 }
 
-static int collect_metrics(struct flb_me *me)
+static int collect_filters(msgpack_sbuffer *mp_sbuf, msgpack_packer *mp_pck,
+                           struct flb_config *ctx)
 {
-    int keys;
-    struct flb_config *ctx = me->config;
+    int k;
+    int n;
+    int total = 0;
+    size_t s;
+    char *buf;
+    struct mk_list *head;
+    struct flb_config *config;
+    struct flb_filter_instance *i;
+
+    msgpack_pack_str(mp_pck, 6);
+    msgpack_pack_str_body(mp_pck, "filter", 6);
+
+    /* A reload can replace the instances */
+    n = flb_engine_shards_lock(ctx);
+    for (k = 0; k < n; k++) {
+        config = flb_engine_shard_get(ctx, k);
+        if (config) {
+            pthread_rwlock_rdlock(&config->filters_lock);
+        }
+    }
+
+    for (k = 0; k < n; k++) {
+        config = flb_engine_shard_get(ctx, k);
+        if (!config) {
+            continue;
+        }
+        mk_list_foreach(head, &config->filters) {
+            i = mk_list_entry(head, struct flb_filter_instance, _head);
+            if (!i->metrics) {
+                continue;
+            }
+            total++;
+        }
+    }
 
+    msgpack_pack_map(mp_pck, total);
+    for (k = 0; k < n; k++) {
+        config = flb_engine_shard_get(ctx, k);
+        if (!config) {
+            continue;
+        }
+        mk_list_foreach(head, &config->filters) {
+            i = mk_list_entry(head, struct flb_filter_instance, _head);
+            if (!i->metrics) {
+                continue;
+            }
+
+            flb_metrics_dump_values(&buf, &s, i->metrics);
+            msgpack_pack_str(mp_pck, i->metrics->title_len);
+            msgpack_pack_str_body(mp_pck, i->metrics->title,
+                                  i->metrics->title_len);
+            msgpack_sbuffer_write(mp_sbuf, buf, s);
+            flb_free(buf);
+        }
+    }
+
+    for (k = 0; k < n; k++) {
+        config = flb_engine_shard_get(ctx, k);
+        if (config) {
+            pthread_rwlock_unlock(&config->filters_lock);
+        }
+    }
+    flb_engine_shards_unlock(ctx);
+
+    return 0;
+}
+
+/* Snapshot of all the metrics: {"input": {...}, "filter": ..., "output": ...} */
+int flb_me_dump(struct flb_config *ctx, char **out_buf, size_t *out_size)
+{
+    int keys;
     msgpack_sbuffer mp_sbuf;
     msgpack_packer mp_pck;
 
@@ -120,72 +247,95 @@ static int collect_metrics(struct flb_me *me)
     msgpack_sbuffer_init(&mp_sbuf);
     msgpack_packer_init(&mp_pck, &mp_sbuf, msgpack_sbuffer_write);
 
-    keys = 2; /* input, output */
+    keys = 3; /* input, filter, output */
     msgpack_pack_map(&mp_pck, keys);
 
     /* Collect metrics from input instances */
-    collect_inputs(&mp_sbuf, &mp_pck, me->config);
-    collect_outputs(&mp_sbuf, &mp_pck, me->config);
-
-#ifdef FLB_HAVE_HTTP_SERVER
-    if (ctx->http_server == FLB_TRUE) {
-        flb_hs_push_metrics(ctx->http_ctx, mp_sbuf.data, mp_sbuf.size);
-    }
-#endif
-    msgpack_sbuffer_destroy(&mp_sbuf);
+    collect_inputs(&mp_sbuf, &mp_pck, ctx);
+    collect_filters(&mp_sbuf, &mp_pck, ctx);
+    collect_outputs(&mp_sbuf, &mp_pck, ctx);
 
+    *out_buf = mp_sbuf.data;
+    *out_size = mp_sbuf.size;
 
     return 0;
 }
 
-/* Create metrics exporter context */
-struct flb_me *flb_me_create(struct flb_config *ctx)
+/*
+ * Prometheus text exposition format, rendered straight from the metrics
+ * contexts:
+ *
+ * fluentbit_input_records_total{name="cpu.0"} NUM TIMESTAMP
+ */
+flb_sds_t flb_me_prometheus(struct flb_config *ctx)
 {
-    int fd;
-    struct mk_event *event;
-    struct flb_me *me;
-
-    /* Context */
-    me = flb_malloc(sizeof(struct flb_me));
-    if (!me) {
-        flb_errno();
-        return NULL;
-    }
-    me->config = ctx;
-
-    /* Initialize event loop context */
-    event = &me->event;
-    MK_EVENT_NEW(event);
+    int k;
+    int n;
+    int time_len;
+    char time_str[64];
+    unsigned long now;
+    flb_sds_t sds;
+    struct timeval tp;
+    struct mk_list *head;
+    struct flb_config *config;
+    struct flb_input_instance *in;
+    struct flb_filter_instance *f;
+    struct flb_output_instance *out;
 
-    /* Run every one second */
-    fd = mk_event_timeout_create(ctx->evl, 1, 0, &me->event);
-    if (fd == -1) {
-        flb_error("[metrics_exporter] registration failed");
-        flb_free(me);
+    sds = flb_sds_create_size(1024);
+    if (!sds) {
         return NULL;
     }
-    me->fd = fd;
-
-    return me;
 
-}
+    gettimeofday(&tp, NULL);
+    now = tp.tv_sec * 1000 + tp.tv_usec / 1000;
+    time_len = snprintf(time_str, sizeof(time_str) - 1, "%lu", now);
 
-/* Handle the event loop notification: "it's time to collect metrics" */
-int flb_me_fd_event(int fd, struct flb_me *me)
-{
-    if (fd != me->fd) {
-        return -1;
+    n = flb_engine_shards_lock(ctx);
+    for (k = 0; k < n; k++) {
+        config = flb_engine_shard_get(ctx, k);
+        if (!config) {
+            continue;
+        }
+        mk_list_foreach(head, &config->inputs) {
+            in = mk_list_entry(head, struct flb_input_instance, _head);
+            if (in->metrics) {
+                sds = flb_metrics_prometheus(sds, "input", in->metrics,
+                                             time_str, time_len);
+            }
+        }
     }
+    for (k = 0; k < n; k++) {
+        config = flb_engine_shard_get(ctx, k);
+        if (!config) {
+            continue;
+        }
+        pthread_rwlock_rdlock(&config->filters_lock);
+        mk_list_foreach(head, &config->filters) {
+            f = mk_list_entry(head, struct flb_filter_instance, _head);
+            if (f->metrics) {
+                sds = flb_metrics_prometheus(sds, "filter", f->metrics,
+                                             time_str, time_len);
+            }
+        }
+        pthread_rwlock_unlock(&config->filters_lock);
+    }
+    for (k = 0; k < n; k++) {
+        config = flb_engine_shard_get(ctx, k);
+        if (!config) {
+            continue;
+        }
+        pthread_rwlock_rdlock(&config->filters_lock);
+        mk_list_foreach(head, &config->outputs) {
+            out = mk_list_entry(head, struct flb_output_instance, _head);
+            if (out->metrics) {
+                sds = flb_metrics_prometheus(sds, "output", out->metrics,
+                                             time_str, time_len);
+            }
+        }
+        pthread_rwlock_unlock(&config->filters_lock);
+    }
+    flb_engine_shards_unlock(ctx);
 
-    flb_utils_timer_consume(fd);
-    collect_metrics(me);
-
-    return 0;
-}
-
-int flb_me_destroy(struct flb_me *me)
-{
-    mk_event_timeout_destroy(me->config->evl, &me->event);
-    flb_free(me);
-    return 0;
+    return sds;
 }
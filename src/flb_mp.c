@@ -18,9 +18,120 @@
  */
 
 #include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_log.h>
 #include <fluent-bit/flb_pack.h>
+#include <fluent-bit/flb_mp.h>
 #include <msgpack.h>
 
+#include <string.h>
+
+/* Released contexts and zones of the calling thread */
+static __thread msgpack_unpacked *unpackers[FLB_MP_POOL_SIZE];
+static __thread int unpackers_count;
+static __thread msgpack_zone *zones[FLB_MP_POOL_SIZE];
+static __thread int zones_count;
+
+msgpack_zone *flb_mp_zone_get()
+{
+    if (zones_count > 0) {
+        return zones[--zones_count];
+    }
+
+    return msgpack_zone_new(MSGPACK_ZONE_CHUNK_SIZE);
+}
+
+/* The zone is cleared, its first chunk is kept for the next user */
+void flb_mp_zone_put(msgpack_zone *zone)
+{
+    if (!zone) {
+        return;
+    }
+
+    if (zones_count == FLB_MP_POOL_SIZE) {
+        msgpack_zone_free(zone);
+        return;
+    }
+
+    msgpack_zone_clear(zone);
+    zones[zones_count++] = zone;
+}
+
+msgpack_unpacked *flb_mp_unpacker_get()
+{
+    msgpack_unpacked *result;
+
+    if (unpackers_count > 0) {
+        return unpackers[--unpackers_count];
+    }
+
+    result = flb_malloc(sizeof(msgpack_unpacked));
+    if (!result) {
+        flb_errno();
+        return NULL;
+    }
+    msgpack_unpacked_init(result);
+
+    result->zone = msgpack_zone_new(MSGPACK_ZONE_CHUNK_SIZE);
+    if (!result->zone) {
+        flb_free(result);
+        return NULL;
+    }
+
+    return result;
+}
+
+void flb_mp_unpacker_put(msgpack_unpacked *result)
+{
+    if (!result) {
+        return;
+    }
+
+    if (unpackers_count == FLB_MP_POOL_SIZE) {
+        msgpack_unpacked_destroy(result);
+        flb_free(result);
+        return;
+    }
+
+    msgpack_zone_clear(result->zone);
+    memset(&result->data, 0, sizeof(msgpack_object));
+    unpackers[unpackers_count++] = result;
+}
+
+/*
+ * Same as msgpack_unpack_next() for a context of the pool: the objects of
+ * the previous call are released by clearing the zone.
+ */
+int flb_mp_unpack_next(msgpack_unpacked *result,
+                       const char *data, size_t size, size_t *off)
+{
+    int ret;
+    size_t noff = *off;
+
+    msgpack_zone_clear(result->zone);
+    ret = msgpack_unpack(data, size, &noff, result->zone, &result->data);
+    if (ret == MSGPACK_UNPACK_SUCCESS || ret == MSGPACK_UNPACK_EXTRA_BYTES) {
+        *off = noff;
+        return MSGPACK_UNPACK_SUCCESS;
+    }
+
+    return ret;
+}
+
+/* Release the pools of the calling thread */
+void flb_mp_thread_exit()
+{
+    while (unpackers_count > 0) {
+        unpackers_count--;
+        msgpack_unpacked_destroy(unpackers[unpackers_count]);
+        flb_free(unpackers[unpackers_count]);
+    }
+
+    while (zones_count > 0) {
+        msgpack_zone_free(zones[--zones_count]);
+    }
+}
+
 static inline int mp_count(void *data, size_t bytes, msgpack_zone *zone)
 {
     int c = 0;
@@ -29,7 +140,7 @@ static inline int mp_count(void *data, size_t bytes, msgpack_zone *zone)
     msgpack_object obj;
 
     if (!zone) {
-        t = msgpack_zone_new(MSGPACK_ZONE_CHUNK_SIZE);
+        t = flb_mp_zone_get();
         if (!t) {
             return -1;
         }
@@ -38,13 +149,15 @@ static inline int mp_count(void *data, size_t bytes, msgpack_zone *zone)
         t = zone;
     }
 
-    while (msgpack_unpack(data, bytes, &off, t, &obj)) {
+    while (msgpack_unpack(data, bytes, &off, t, &obj) > 0) {
         c++;
     }
 
-    msgpack_zone_clear(t);
     if (t != zone) {
-        msgpack_zone_free(t);
+        flb_mp_zone_put(t);
+    }
+    else {
+        msgpack_zone_clear(t);
     }
 
     return c;
@@ -59,3 +172,392 @@ int flb_mp_count_zone(void *data, size_t bytes, msgpack_zone *zone)
 {
     return mp_count(data, bytes, zone);
 }
+
+static inline uint32_t load16(const unsigned char *p)
+{
+    return ((uint32_t) p[0] << 8) | p[1];
+}
+
+static inline uint32_t load32(const unsigned char *p)
+{
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) |
+           ((uint32_t) p[2] << 8) | p[3];
+}
+
+/*
+ * Compute the size of one object. Containers are not visited recursively,
+ * their entries are just added to the number of objects still pending.
+ */
+int flb_mp_object_size(const char *buf, size_t size, size_t *out)
+{
+    size_t off = 0;
+    size_t hdr;
+    uint64_t body;
+    uint64_t pending = 1;
+    unsigned char c;
+    const unsigned char *p = (const unsigned char *) buf;
+
+    while (pending > 0) {
+        if (off >= size) {
+            return -1;
+        }
+
+        pending--;
+        c = p[off];
+
+        /* positive and negative fixint */
+        if (c <= 0x7f || c >= 0xe0) {
+            off++;
+            continue;
+        }
+        /* fixmap */
+        if ((c & 0xf0) == 0x80) {
+            pending += (c & 0x0f) * 2;
+            off++;
+            continue;
+        }
+        /* fixarray */
+        if ((c & 0xf0) == 0x90) {
+            pending += (c & 0x0f);
+            off++;
+            continue;
+        }
+        /* fixstr */
+        if ((c & 0xe0) == 0xa0) {
+            off += 1 + (c & 0x1f);
+            continue;
+        }
+
+        hdr = 1;
+        body = 0;
+        switch (c) {
+        case 0xc0: /* nil, false, true */
+        case 0xc2:
+        case 0xc3:
+            break;
+        case 0xcc: /* uint8, int8 */
+        case 0xd0:
+            body = 1;
+            break;
+        case 0xcd: /* uint16, int16 */
+        case 0xd1:
+            body = 2;
+            break;
+        case 0xca: /* float32, uint32, int32 */
+        case 0xce:
+        case 0xd2:
+            body = 4;
+            break;
+        case 0xcb: /* float64, uint64, int64 */
+        case 0xcf:
+        case 0xd3:
+            body = 8;
+            break;
+        case 0xd4: /* fixext 1, 2, 4, 8, 16 */
+            body = 2;
+            break;
+        case 0xd5:
+            body = 3;
+            break;
+        case 0xd6:
+            body = 5;
+            break;
+        case 0xd7:
+            body = 9;
+            break;
+        case 0xd8:
+            body = 17;
+            break;
+        case 0xc4: /* bin8, str8 */
+        case 0xd9:
+            hdr = 2;
+            if (off + hdr > size) {
+                return -1;
+            }
+            body = p[off + 1];
+            break;
+        case 0xc5: /* bin16, str16 */
+        case 0xda:
+            hdr = 3;
+            if (off + hdr > size) {
+                return -1;
+            }
+            body = load16(p + off + 1);
+            break;
+        case 0xc6: /* bin32, str32 */
+        case 0xdb:
+            hdr = 5;
+            if (off + hdr > size) {
+                return -1;
+            }
+            body = load32(p + off + 1);
+            break;
+        case 0xc7: /* ext8, ext16, ext32: length + type */
+            hdr = 3;
+            if (off + hdr > size) {
+                return -1;
+            }
+            body = p[off + 1];
+            break;
+        case 0xc8:
+            hdr = 4;
+            if (off + hdr > size) {
+                return -1;
+            }
+            body = load16(p + off + 1);
+            break;
+        case 0xc9:
+            hdr = 6;
+            if (off + hdr > size) {
+                return -1;
+            }
+            body = load32(p + off + 1);
+            break;
+        case 0xdc: /* array16, array32 */
+            hdr = 3;
+            if (off + hdr > size) {
+                return -1;
+            }
+            pending += load16(p + off + 1);
+            break;
+        case 0xdd:
+            hdr = 5;
+            if (off + hdr > size) {
+                return -1;
+            }
+            pending += load32(p + off + 1);
+            break;
+        case 0xde: /* map16, map32 */
+            hdr = 3;
+            if (off + hdr > size) {
+                return -1;
+            }
+            pending += (uint64_t) load16(p + off + 1) * 2;
+            break;
+        case 0xdf:
+            hdr = 5;
+            if (off + hdr > size) {
+                return -1;
+            }
+            pending += (uint64_t) load32(p + off + 1) * 2;
+            break;
+        default:
+            /* 0xc1 is never used */
+            return -1;
+        }
+        off += hdr + body;
+    }
+
+    if (off > size) {
+        return -1;
+    }
+
+    *out = off;
+    return 0;
+}
+
+/*
+ * Check that 'buf' is a sequence of complete [timestamp, map] records,
+ * returns the number of records or -1 if the content is not valid.
+ */
+int flb_mp_records_check(const char *buf, size_t size)
+{
+    int ret;
+    int records = 0;
+    size_t off = 0;
+    size_t len;
+    size_t hdr;
+    uint32_t count;
+
+    while (off < size) {
+        ret = flb_mp_array_header(buf + off, size - off, &count, &hdr);
+        if (ret == -1 || count != 2) {
+            return -1;
+        }
+
+        /* timestamp */
+        off += hdr;
+        ret = flb_mp_object_size(buf + off, size - off, &len);
+        if (ret == -1) {
+            return -1;
+        }
+        off += len;
+
+        /* map */
+        ret = flb_mp_map_header(buf + off, size - off, &count, &hdr);
+        if (ret == -1) {
+            return -1;
+        }
+        ret = flb_mp_object_size(buf + off, size - off, &len);
+        if (ret == -1) {
+            return -1;
+        }
+        off += len;
+        records++;
+    }
+
+    return records;
+}
+
+int flb_mp_map_header(const char *buf, size_t size,
+                      uint32_t *count, size_t *hdr_size)
+{
+    unsigned char c;
+    const unsigned char *p = (const unsigned char *) buf;
+
+    if (size < 1) {
+        return -1;
+    }
+
+    c = p[0];
+    if ((c & 0xf0) == 0x80) {
+        *count = (c & 0x0f);
+        *hdr_size = 1;
+    }
+    else if (c == 0xde && size >= 3) {
+        *count = load16(p + 1);
+        *hdr_size = 3;
+    }
+    else if (c == 0xdf && size >= 5) {
+        *count = load32(p + 1);
+        *hdr_size = 5;
+    }
+    else {
+        return -1;
+    }
+
+    return 0;
+}
+
+int flb_mp_array_header(const char *buf, size_t size,
+                        uint32_t *count, size_t *hdr_size)
+{
+    unsigned char c;
+    const unsigned char *p = (const unsigned char *) buf;
+
+    if (size < 1) {
+        return -1;
+    }
+
+    c = p[0];
+    if ((c & 0xf0) == 0x90) {
+        *count = (c & 0x0f);
+        *hdr_size = 1;
+    }
+    else if (c == 0xdc && size >= 3) {
+        *count = load16(p + 1);
+        *hdr_size = 3;
+    }
+    else if (c == 0xdd && size >= 5) {
+        *count = load32(p + 1);
+        *hdr_size = 5;
+    }
+    else {
+        return -1;
+    }
+
+    return 0;
+}
+
+int flb_mp_str(const char *buf, size_t size,
+               const char **str, uint32_t *len, size_t *obj_size)
+{
+    size_t hdr;
+    uint32_t n;
+    unsigned char c;
+    const unsigned char *p = (const unsigned char *) buf;
+
+    if (size < 1) {
+        return -1;
+    }
+
+    c = p[0];
+    if ((c & 0xe0) == 0xa0) {
+        n = (c & 0x1f);
+        hdr = 1;
+    }
+    else if (c == 0xd9 && size >= 2) {
+        n = p[1];
+        hdr = 2;
+    }
+    else if (c == 0xda && size >= 3) {
+        n = load16(p + 1);
+        hdr = 3;
+    }
+    else if (c == 0xdb && size >= 5) {
+        n = load32(p + 1);
+        hdr = 5;
+    }
+    else {
+        return -1;
+    }
+
+    if (hdr + n > size) {
+        return -1;
+    }
+
+    *str = buf + hdr;
+    *len = n;
+    *obj_size = hdr + n;
+    return 0;
+}
+
+int flb_mp_key(const char *buf, size_t size,
+               const char **key, uint32_t *len, size_t *obj_size)
+{
+    size_t hdr;
+    uint32_t n;
+    const unsigned char *p = (const unsigned char *) buf;
+
+    if (flb_mp_str(buf, size, key, len, obj_size) == 0) {
+        return 0;
+    }
+
+    if (size >= 2 && p[0] == 0xc4) {
+        n = p[1];
+        hdr = 2;
+    }
+    else if (size >= 3 && p[0] == 0xc5) {
+        n = load16(p + 1);
+        hdr = 3;
+    }
+    else if (size >= 5 && p[0] == 0xc6) {
+        n = load32(p + 1);
+        hdr = 5;
+    }
+    else {
+        return -1;
+    }
+
+    if (hdr + n > size) {
+        return -1;
+    }
+
+    *key = buf + hdr;
+    *len = n;
+    *obj_size = hdr + n;
+    return 0;
+}
+
+int flb_mp_map_header_write(char *buf, uint32_t count)
+{
+    unsigned char *p = (unsigned char *) buf;
+
+    if (count < 16) {
+        p[0] = 0x80 | count;
+        return 1;
+    }
+    else if (count < 65536) {
+        p[0] = 0xde;
+        p[1] = (count >> 8) & 0xff;
+        p[2] = count & 0xff;
+        return 3;
+    }
+
+    p[0] = 0xdf;
+    p[1] = (count >> 24) & 0xff;
+    p[2] = (count >> 16) & 0xff;
+    p[3] = (count >> 8) & 0xff;
+    p[4] = count & 0xff;
+    return 5;
+}
@@ -129,6 +129,37 @@ int flb_net_socket_reset(flb_sockfd_t fd)
     return 0;
 }
 
+int flb_net_socket_reuseport(flb_sockfd_t fd)
+{
+#ifdef SO_REUSEPORT
+    int on = 1;
+
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1) {
+        flb_errno();
+        return -1;
+    }
+
+    return 0;
+#else
+    flb_error("[net] SO_REUSEPORT is not supported on this platform");
+    return -1;
+#endif
+}
+
+/* Set the size of the kernel receive buffer of the socket */
+int flb_net_socket_rcvbuf(flb_sockfd_t fd, int size)
+{
+    int ret;
+
+    ret = setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    if (ret == -1) {
+        flb_errno();
+        return -1;
+    }
+
+    return 0;
+}
+
 int flb_net_socket_tcp_nodelay(flb_sockfd_t fd)
 {
     int on = 1;
@@ -158,6 +189,32 @@ int flb_net_socket_nonblocking(flb_sockfd_t fd)
     return 0;
 }
 
+/*
+ * Send and receive timeout of a blocking socket, on Linux it applies to
+ * connect() too. Zero seconds removes the timeout.
+ */
+int flb_net_socket_timeout(flb_sockfd_t fd, int seconds)
+{
+#ifdef _WIN32
+    DWORD tv = seconds * 1000;
+#else
+    struct timeval tv;
+
+    tv.tv_sec = seconds;
+    tv.tv_usec = 0;
+#endif
+
+    if (setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO,
+                   (const char *) &tv, sizeof(tv)) == -1 ||
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO,
+                   (const char *) &tv, sizeof(tv)) == -1) {
+        flb_errno();
+        return -1;
+    }
+
+    return 0;
+}
+
 /*
  * Enable the TCP_FASTOPEN feature for server side implemented in Linux Kernel >= 3.7,
  * for more details read here:
@@ -277,7 +334,14 @@ int flb_net_tcp_fd_connect(flb_sockfd_t fd, char *host, unsigned long port)
     return ret;
 }
 
-flb_sockfd_t flb_net_server(char *port, char *listen_addr)
+/* Connect a TCP socket to an address already resolved */
+int flb_net_tcp_fd_connect_addr(flb_sockfd_t fd, const struct sockaddr *addr,
+                                socklen_t addrlen)
+{
+    return connect(fd, addr, addrlen);
+}
+
+static flb_sockfd_t net_server(char *port, char *listen_addr, int reuseport)
 {
     flb_sockfd_t fd = -1;
     int ret;
@@ -305,6 +369,11 @@ flb_sockfd_t flb_net_server(char *port, char *listen_addr)
 
         flb_net_socket_tcp_nodelay(fd);
         flb_net_socket_reset(fd);
+        if (reuseport == FLB_TRUE && flb_net_socket_reuseport(fd) == -1) {
+            flb_socket_close(fd);
+            fd = -1;
+            continue;
+        }
 
         ret = flb_net_bind(fd, rp->ai_addr, rp->ai_addrlen, 128);
         if(ret == -1) {
@@ -323,6 +392,83 @@ flb_sockfd_t flb_net_server(char *port, char *listen_addr)
     return fd;
 }
 
+flb_sockfd_t flb_net_server(char *port, char *listen_addr)
+{
+    return net_server(port, listen_addr, FLB_FALSE);
+}
+
+/*
+ * Create a server socket that can share the address with other sockets of
+ * the same process, each one gets a share of the new connections.
+ */
+flb_sockfd_t flb_net_server_reuseport(char *port, char *listen_addr)
+{
+    return net_server(port, listen_addr, FLB_TRUE);
+}
+
+static flb_sockfd_t net_server_udp(char *port, char *listen_addr,
+                                   int reuseport)
+{
+    flb_sockfd_t fd = -1;
+    int ret;
+    struct addrinfo hints;
+    struct addrinfo *res, *rp;
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    ret = getaddrinfo(listen_addr, port, &hints, &res);
+    if (ret != 0) {
+        flb_warn("net_server_udp: getaddrinfo(listen='%s:%s'): %s",
+                 listen_addr, port, gai_strerror(ret));
+        return -1;
+    }
+
+    for (rp = res; rp != NULL; rp = rp->ai_next) {
+        fd = flb_net_socket_create_udp(rp->ai_family, 1);
+        if (fd == -1) {
+            flb_error("Error creating server socket, retrying");
+            continue;
+        }
+
+        flb_net_socket_reset(fd);
+        if (reuseport == FLB_TRUE && flb_net_socket_reuseport(fd) == -1) {
+            flb_socket_close(fd);
+            fd = -1;
+            continue;
+        }
+
+        ret = bind(fd, rp->ai_addr, rp->ai_addrlen);
+        if (ret == -1) {
+            flb_warn("Cannot bind to %s port %s", listen_addr, port);
+            flb_socket_close(fd);
+            continue;
+        }
+        break;
+    }
+    freeaddrinfo(res);
+
+    if (rp == NULL) {
+        return -1;
+    }
+
+    return fd;
+}
+
+/* Create a non-blocking UDP socket bound to the address */
+flb_sockfd_t flb_net_server_udp(char *port, char *listen_addr)
+{
+    return net_server_udp(port, listen_addr, FLB_FALSE);
+}
+
+/* Same as above, each socket sharing the address gets a share of datagrams */
+flb_sockfd_t flb_net_server_udp_reuseport(char *port, char *listen_addr)
+{
+    return net_server_udp(port, listen_addr, FLB_TRUE);
+}
+
 int flb_net_bind(flb_sockfd_t fd, const struct sockaddr *addr,
                  socklen_t addrlen, int backlog)
 {
@@ -27,6 +27,8 @@
 #include <fluent-bit/flb_env.h>
 #include <fluent-bit/flb_thread.h>
 #include <fluent-bit/flb_output.h>
+#include <fluent-bit/flb_output_worker.h>
+#include <fluent-bit/flb_task.h>
 
 #include <fluent-bit/flb_io.h>
 #include <fluent-bit/flb_uri.h>
@@ -34,6 +36,11 @@
 #include <fluent-bit/flb_macros.h>
 #include <fluent-bit/flb_utils.h>
 #include <fluent-bit/flb_plugin_proxy.h>
+#include <fluent-bit/flb_router.h>
+#include <fluent-bit/flb_worker.h>
+#include <fluent-bit/flb_time.h>
+#include <fluent-bit/flb_scheduler.h>
+#include <fluent-bit/flb_engine_dispatch.h>
 
 #define protcmp(a, b)  strncasecmp(a, b, strlen(a))
 
@@ -85,6 +92,15 @@ static void flb_output_free_properties(struct flb_output_instance *ins)
         mk_list_del(&prop->_head);
         flb_free(prop);
     }
+    mk_list_foreach_safe(head, tmp, &ins->props_set) {
+        prop = mk_list_entry(head, struct flb_config_prop, _head);
+
+        flb_free(prop->key);
+        flb_free(prop->val);
+
+        mk_list_del(&prop->_head);
+        flb_free(prop);
+    }
 
 #ifdef FLB_HAVE_TLS
     if (ins->tls_ca_path) {
@@ -105,8 +121,27 @@ static void flb_output_free_properties(struct flb_output_instance *ins)
 #endif
 }
 
+/* Release the pending timers that reference the instance */
+static void instance_timers_destroy(struct flb_output_instance *ins)
+{
+    if (ins->circuit_timer) {
+        flb_sched_timer_cb_destroy(ins->circuit_timer);
+        ins->circuit_timer = NULL;
+    }
+    if (ins->coalesce_timer) {
+        flb_sched_timer_cb_destroy(ins->coalesce_timer);
+        ins->coalesce_timer = NULL;
+    }
+}
+
 int flb_output_instance_destroy(struct flb_output_instance *ins)
 {
+    /* Release workers */
+    flb_output_worker_destroy(ins);
+
+    /* A pending circuit probe or coalescing window */
+    instance_timers_destroy(ins);
+
     /* Remove URI context */
     if (ins->host.uri) {
         flb_uri_destroy(ins->host.uri);
@@ -133,6 +168,7 @@ int flb_output_instance_destroy(struct flb_output_instance *ins)
 
     /* release properties */
     flb_output_free_properties(ins);
+    flb_worker_cpus_destroy(ins->cpus);
 
     mk_list_del(&ins->_head);
     flb_free(ins);
@@ -140,30 +176,62 @@ int flb_output_instance_destroy(struct flb_output_instance *ins)
     return 0;
 }
 
+/* Invoke the exit callback of an initialized instance and release it */
+void flb_output_instance_exit(struct flb_output_instance *ins,
+                              struct flb_config *config)
+{
+    struct flb_output_plugin *p = ins->p;
+
+    /* Check a exit callback */
+    if (p->cb_exit) {
+        p->cb_exit(ins->context, config);
+    }
+
+    if (ins->upstream) {
+        flb_upstream_destroy(ins->upstream);
+    }
+
+    flb_output_instance_destroy(ins);
+}
+
 /* Invoke exit call for the output plugin */
 void flb_output_exit(struct flb_config *config)
 {
     struct mk_list *tmp;
     struct mk_list *head;
     struct flb_output_instance *ins;
-    struct flb_output_plugin *p;
 
     mk_list_foreach_safe(head, tmp, &config->outputs) {
         ins = mk_list_entry(head, struct flb_output_instance, _head);
-        p = ins->p;
-
-        /* Check a exit callback */
-        if (p->cb_exit) {
-            p->cb_exit(ins->context, config);
-        }
+        flb_output_instance_exit(ins, config);
+    }
 
-        if (ins->upstream) {
-            flb_upstream_destroy(ins->upstream);
-        }
+    /* Removed by a reload and not drained yet */
+    mk_list_foreach_safe(head, tmp, &config->outputs_retired) {
+        ins = mk_list_entry(head, struct flb_output_instance, _head);
+        flb_output_instance_exit(ins, config);
+    }
+}
 
-        flb_output_instance_destroy(ins);
+#ifdef FLB_HAVE_METRICS
+/* Resolve the handles, without all of them the instance has no metrics */
+static void instance_metrics_resolve(struct flb_output_instance *ins)
+{
+    struct flb_metrics *metrics = ins->metrics;
+
+    ins->m_ok_records = flb_metrics_get_id(FLB_METRIC_OUT_OK_RECORDS, metrics);
+    ins->m_ok_bytes   = flb_metrics_get_id(FLB_METRIC_OUT_OK_BYTES, metrics);
+    ins->m_errors     = flb_metrics_get_id(FLB_METRIC_OUT_ERROR, metrics);
+    ins->m_flush_time = flb_metrics_get_id(FLB_METRIC_OUT_FLUSH_TIME, metrics);
+    ins->m_task_age   = flb_metrics_get_id(FLB_METRIC_OUT_TASK_AGE, metrics);
+
+    if (!ins->m_ok_records || !ins->m_ok_bytes || !ins->m_errors ||
+        !ins->m_flush_time || !ins->m_task_age) {
+        flb_metrics_destroy(metrics);
+        ins->metrics = NULL;
     }
 }
+#endif
 
 static inline int instance_id(struct flb_output_plugin *p,
                               struct flb_config *config) \
@@ -182,46 +250,56 @@ static inline int instance_id(struct flb_output_plugin *p,
     return c;
 }
 
-/*
- * It validate an output type given the string, it return the
- * proper type and if valid, populate the global config.
- */
-struct flb_output_instance *flb_output_new(struct flb_config *config,
-                                           char *output, void *data)
+/* Built-in plugins first, then the proxies loaded at runtime */
+static struct flb_output_plugin *plugin_lookup(struct flb_config *config,
+                                               char *output)
 {
-    int ret = -1;
-    int mask_id;
-    int flags = 0;
+    int i;
     struct mk_list *head;
     struct flb_output_plugin *plugin;
-    struct flb_output_instance *instance = NULL;
-
-    if (!output) {
-        return NULL;
-    }
 
-    /* Get the last mask_id reported by an output instance plugin */
-    if (mk_list_is_empty(&config->outputs) == 0) {
-        mask_id = 0;
-    }
-    else {
-        instance = mk_list_entry_last(&config->outputs,
-                                      struct flb_output_instance,
-                                      _head);
-        mask_id = (instance->mask_id);
+    for (i = 0; flb_out_plugins[i]; i++) {
+        if (check_protocol(flb_out_plugins[i]->name, output)) {
+            return flb_out_plugins[i];
+        }
     }
 
     mk_list_foreach(head, &config->out_plugins) {
         plugin = mk_list_entry(head, struct flb_output_plugin, _head);
         if (check_protocol(plugin->name, output)) {
-            break;
+            return plugin;
         }
-        plugin = NULL;
     }
 
-    if (!plugin) {
-        return NULL;
+    return NULL;
+}
+
+/* Highest id of the 'p' instances in 'list' and the routing bits they use */
+static void instances_scan(struct mk_list *list, struct flb_output_plugin *p,
+                           int *id, uint64_t *mask)
+{
+    struct mk_list *head;
+    struct flb_output_instance *entry;
+
+    mk_list_foreach(head, list) {
+        entry = mk_list_entry(head, struct flb_output_instance, _head);
+        if (entry->p == p && entry->id > *id) {
+            *id = entry->id;
+        }
+        *mask |= entry->mask_id;
     }
+}
+
+/* Create an instance of the plugin, the caller links it to a list */
+static struct flb_output_instance *instance_create(struct flb_config *config,
+                                                   struct flb_output_plugin *plugin,
+                                                   char *output, int id,
+                                                   uint64_t mask_id,
+                                                   void *data)
+{
+    int ret = -1;
+    int flags = 0;
+    struct flb_output_instance *instance;
 
     /* Create and load instance */
     instance = flb_calloc(1, sizeof(struct flb_output_instance));
@@ -230,23 +308,12 @@ struct flb_output_instance *flb_output_new(struct flb_config *config,
         return NULL;
     }
     instance->config = config;
-
-    /*
-     * Set mask_id: the mask_id is an unique number assigned to this
-     * output instance that is used later to set in an 'unsigned 64
-     * bit number' where a specific task (buffer/records) should be
-     * routed.
-     */
-    if (mask_id == 0) {
-        instance->mask_id = 1;
-    }
-    else {
-        instance->mask_id = (mask_id * 2);
-    }
+    instance->mask_id = mask_id;
 
     /* format name (with instance id) */
+    instance->id = id;
     snprintf(instance->name, sizeof(instance->name) - 1,
-             "%s.%i", plugin->name, instance_id(plugin, config));
+             "%s.%i", plugin->name, id);
     instance->p = plugin;
 
     if (plugin->type == FLB_OUTPUT_PLUGIN_CORE) {
@@ -263,6 +330,79 @@ struct flb_output_instance *flb_output_new(struct flb_config *config,
     instance->retry_limit = 1;
     instance->host.name   = NULL;
 
+    /* Keepalive */
+    if (instance->flags & FLB_OUTPUT_KEEPALIVE) {
+        instance->keepalive = FLB_TRUE;
+    }
+    else {
+        instance->keepalive = FLB_FALSE;
+    }
+    instance->keepalive_idle_timeout = FLB_UPSTREAM_KA_IDLE_TIMEOUT;
+    instance->keepalive_max_recycle  = FLB_UPSTREAM_KA_MAX_RECYCLE;
+    instance->keepalive_min_idle     = 0;
+    instance->http2                  = FLB_FALSE;
+
+    /* Workers: by default flush co-routines runs in the engine */
+    instance->workers      = 0;
+    instance->workers_next = NULL;
+    mk_list_init(&instance->workers_pool);
+
+    /* Flush co-routines stack size */
+    instance->coro_stack_size = FLB_THREAD_STACK_SIZE;
+
+    /* By default use the global service flush */
+    instance->flush = 0;
+    mk_list_init(&instance->pending);
+
+    /* Backlog dispatch */
+    instance->backlog_policy  = FLB_OUTPUT_BACKLOG_FIFO;
+    instance->backlog_ratio   = FLB_OUTPUT_BACKLOG_RATIO;
+    instance->backlog_max     = 0;
+    instance->backlog_running = 0;
+    instance->live_running    = 0;
+    instance->live_credit     = 0;
+    flb_priority_queue_init(&instance->backlog_routes);
+    mk_list_init(&instance->backlog_retries);
+
+    /* No concurrency limit */
+    instance->max_inflight       = 0;
+    instance->max_inflight_queue = 0;
+    instance->inflight_full      = FLB_FALSE;
+    instance->inflight_pause_at  = 0;
+    flb_priority_queue_init(&instance->inflight_queue);
+
+    /* No circuit breaker */
+    instance->circuit_failures = 0;
+    instance->circuit_probe    = FLB_OUTPUT_CIRCUIT_PROBE;
+    instance->circuit_state    = FLB_OUTPUT_CIRCUIT_CLOSED;
+    instance->circuit_count    = 0;
+    instance->circuit_timer    = NULL;
+
+    /* No coalescing, 1MB batches once enabled */
+    instance->coalesce_window   = 0;
+    instance->coalesce_max_size = FLB_OUTPUT_COALESCE_SIZE;
+    instance->coalesce_size     = 0;
+    instance->coalesce_count    = 0;
+    instance->coalesce_timer    = NULL;
+    mk_list_init(&instance->coalesce);
+
+    /* Fixed window and size, the adaptive bounds are set on init */
+    instance->coalesce_adaptive   = FLB_FALSE;
+    instance->coalesce_latency    = FLB_OUTPUT_ADAPTIVE_LATENCY;
+    instance->coalesce_window_min = 0;
+    instance->coalesce_window_max = 0;
+    instance->coalesce_size_min   = 0;
+    instance->coalesce_size_max   = 0;
+    instance->coalesce_cut        = 0;
+
+#ifdef FLB_HAVE_BUFFERING
+    /* No buffer quota by default */
+    instance->fs_limit        = 0;
+    instance->fs_limit_policy = FLB_OUTPUT_FS_DROP_OLDEST;
+    instance->fs_size         = 0;
+    mk_list_init(&instance->fs_chunks);
+#endif
+
     /* Parent plugin flags */
     flags = instance->flags;
     if (flags & FLB_IO_TCP) {
@@ -296,7 +436,7 @@ struct flb_output_instance *flb_output_new(struct flb_config *config,
         }
     }
     mk_list_init(&instance->properties);
-    mk_list_add(&instance->_head, &config->outputs);
+    mk_list_init(&instance->props_set);
 
     /* Metrics */
 #ifdef FLB_HAVE_METRICS
@@ -308,12 +448,168 @@ struct flb_output_instance *flb_output_new(struct flb_config *config,
         flb_metrics_add(FLB_METRIC_OUT_RETRY, "retries", instance->metrics);
         flb_metrics_add(FLB_METRIC_OUT_RETRY_FAILED,
                         "retries_failed", instance->metrics);
+        flb_metrics_add_histogram(FLB_METRIC_OUT_FLUSH_TIME,
+                                  "flush_seconds", instance->metrics);
+        flb_metrics_add_histogram(FLB_METRIC_OUT_TASK_AGE,
+                                  "task_age_seconds", instance->metrics);
+        flb_metrics_add_histogram(FLB_METRIC_OUT_RETRY_WAIT,
+                                  "retry_wait_seconds", instance->metrics);
+#ifdef FLB_HAVE_BUFFERING
+        flb_metrics_add(FLB_METRIC_OUT_FS_SIZE,
+                        "fs_chunks_size", instance->metrics);
+        flb_metrics_add(FLB_METRIC_OUT_FS_EVICTED,
+                        "fs_evicted", instance->metrics);
+        flb_metrics_add(FLB_METRIC_OUT_FS_EVICTED_BYTES,
+                        "fs_evicted_bytes", instance->metrics);
+        flb_metrics_add(FLB_METRIC_OUT_FS_REJECTED,
+                        "fs_rejected", instance->metrics);
+#endif
+#ifdef FLB_HAVE_TLS
+        if (instance->flags & FLB_IO_TLS) {
+            flb_metrics_add(FLB_METRIC_OUT_TLS_HANDSHAKES,
+                            "tls_handshakes", instance->metrics);
+            flb_metrics_add(FLB_METRIC_OUT_TLS_RESUMED,
+                            "tls_resumed", instance->metrics);
+            flb_metrics_add_histogram(FLB_METRIC_OUT_TLS_HANDSHAKE_TIME,
+                                      "tls_handshake_seconds",
+                                      instance->metrics);
+        }
+#endif
+        instance_metrics_resolve(instance);
+#ifdef FLB_HAVE_TLS
+        instance->tls.metrics = instance->metrics;
+#endif
     }
 #endif
 
     return instance;
 }
 
+/*
+ * It validate an output type given the string, it return the
+ * proper type and if valid, populate the global config.
+ */
+struct flb_output_instance *flb_output_new(struct flb_config *config,
+                                           char *output, void *data)
+{
+    uint64_t mask_id;
+    struct flb_output_plugin *plugin;
+    struct flb_output_instance *instance = NULL;
+
+    if (!output) {
+        return NULL;
+    }
+
+    /*
+     * Set mask_id: the mask_id is an unique number assigned to this
+     * output instance that is used later to set in an 'unsigned 64
+     * bit number' where a specific task (buffer/records) should be
+     * routed. It follows the one of the last output instance.
+     */
+    if (mk_list_is_empty(&config->outputs) == 0) {
+        mask_id = 1;
+    }
+    else {
+        instance = mk_list_entry_last(&config->outputs,
+                                      struct flb_output_instance,
+                                      _head);
+        mask_id = (instance->mask_id * 2);
+    }
+
+    plugin = plugin_lookup(config, output);
+    if (!plugin) {
+        return NULL;
+    }
+
+    instance = instance_create(config, plugin, output,
+                               instance_id(plugin, config), mask_id, data);
+    if (!instance) {
+        return NULL;
+    }
+    mk_list_add(&instance->_head, &config->outputs);
+
+    return instance;
+}
+
+/*
+ * Create an instance linked to 'list' instead of the running outputs, a
+ * reload adds it with flb_output_swap(). The id and the routing bit do not
+ * collide with the running and retired instances nor with the ones in
+ * 'list'.
+ */
+struct flb_output_instance *flb_output_new_detached(struct flb_config *config,
+                                                    char *output, void *data,
+                                                    struct mk_list *list)
+{
+    int id = -1;
+    uint64_t used = 0;
+    uint64_t mask_id;
+    struct flb_output_plugin *plugin;
+    struct flb_output_instance *instance;
+
+    plugin = plugin_lookup(config, output);
+    if (!plugin) {
+        return NULL;
+    }
+
+    instances_scan(&config->outputs, plugin, &id, &used);
+    instances_scan(&config->outputs_retired, plugin, &id, &used);
+    instances_scan(list, plugin, &id, &used);
+
+    /* Lowest free routing bit */
+    for (mask_id = 1; mask_id != 0 && (used & mask_id); mask_id <<= 1);
+    if (mask_id == 0) {
+        flb_error("[output] %s: the 64 routing masks are in use", output);
+        return NULL;
+    }
+
+    instance = instance_create(config, plugin, output, id + 1, mask_id, data);
+    if (!instance) {
+        return NULL;
+    }
+    mk_list_add(&instance->_head, list);
+
+    return instance;
+}
+
+/* Same plugin and properties (in the same order) */
+int flb_output_instance_equal(struct flb_output_instance *a,
+                              struct flb_output_instance *b)
+{
+    struct mk_list *h_a;
+    struct mk_list *h_b;
+    struct flb_config_prop *p_a;
+    struct flb_config_prop *p_b;
+
+    if (a->p != b->p) {
+        return FLB_FALSE;
+    }
+
+    if (mk_list_size(&a->props_set) != mk_list_size(&b->props_set)) {
+        return FLB_FALSE;
+    }
+
+    h_b = b->props_set.next;
+    mk_list_foreach(h_a, &a->props_set) {
+        p_a = mk_list_entry(h_a, struct flb_config_prop, _head);
+        p_b = mk_list_entry(h_b, struct flb_config_prop, _head);
+        if (strcasecmp(p_a->key, p_b->key) != 0) {
+            return FLB_FALSE;
+        }
+        if (!p_a->val || !p_b->val) {
+            if (p_a->val != p_b->val) {
+                return FLB_FALSE;
+            }
+        }
+        else if (strcmp(p_a->val, p_b->val) != 0) {
+            return FLB_FALSE;
+        }
+        h_b = h_b->next;
+    }
+
+    return FLB_TRUE;
+}
+
 static inline int prop_key_check(char *key, char *kv, int k_len)
 {
     int len;
@@ -326,10 +622,29 @@ static inline int prop_key_check(char *key, char *kv, int k_len)
     return -1;
 }
 
+/* Keep the property, the engine shards create copies of the instance */
+static int output_prop_save(struct flb_output_instance *out, char *k,
+                            char *v)
+{
+    struct flb_config_prop *prop;
+
+    prop = flb_malloc(sizeof(struct flb_config_prop));
+    if (!prop) {
+        flb_errno();
+        return -1;
+    }
+    prop->key = flb_strdup(k);
+    prop->val = v ? flb_strdup(v) : NULL;
+    mk_list_add(&prop->_head, &out->props_set);
+
+    return 0;
+}
+
 /* Override a configuration property for the given input_instance plugin */
 int flb_output_set_property(struct flb_output_instance *out, char *k, char *v)
 {
     int len;
+    ssize_t limit;
     char *tmp;
     struct flb_config_prop *prop;
 
@@ -342,9 +657,18 @@ int flb_output_set_property(struct flb_output_instance *out, char *k, char *v)
         }
     }
 
+    if (output_prop_save(out, k, tmp) == -1) {
+        flb_free(tmp);
+        return -1;
+    }
+
     /* Check if the key is a known/shared property */
     if (prop_key_check("match", k, len) == 0) {
+        if (out->match) {
+            flb_free(out->match);
+        }
         out->match = tmp;
+        flb_router_cache_invalidate(out->config);
     }
     else if (prop_key_check("host", k, len) == 0) {
         out->host.name = tmp;
@@ -378,53 +702,250 @@ int flb_output_set_property(struct flb_output_instance *out, char *k, char *v)
             out->retry_limit = 0;
         }
     }
-#ifdef FLB_HAVE_TLS
-    else if (prop_key_check("tls", k, len) == 0 && tmp) {
-        if (strcasecmp(tmp, "true") == 0 || strcasecmp(tmp, "on") == 0) {
-            if ((out->flags & FLB_IO_TLS) == 0) {
-                flb_error("[config] %s don't support TLS", out->name);
-                flb_free(tmp);
-                return -1;
-            }
-
-            out->use_tls = FLB_TRUE;
+    else if (prop_key_check("keepalive", k, len) == 0 && tmp) {
+        out->keepalive = flb_utils_bool(tmp);
+        flb_free(tmp);
+    }
+    else if (prop_key_check("keepalive_idle_timeout", k, len) == 0 && tmp) {
+        out->keepalive_idle_timeout = atoi(tmp);
+        flb_free(tmp);
+    }
+    else if (prop_key_check("keepalive_max_recycle", k, len) == 0 && tmp) {
+        out->keepalive_max_recycle = atoi(tmp);
+        flb_free(tmp);
+    }
+    else if (prop_key_check("keepalive_min_idle", k, len) == 0 && tmp) {
+        out->keepalive_min_idle = atoi(tmp);
+        flb_free(tmp);
+    }
+    else if (prop_key_check("http2", k, len) == 0 && tmp) {
+        out->http2 = flb_utils_bool(tmp);
+        flb_free(tmp);
+    }
+    else if (prop_key_check("cpu_affinity", k, len) == 0 && tmp) {
+        flb_worker_cpus_destroy(out->cpus);
+        out->cpus = flb_worker_cpus_create(tmp);
+        flb_free(tmp);
+        if (!out->cpus) {
+            return -1;
         }
-        else {
-            out->use_tls = FLB_FALSE;
+    }
+    else if (prop_key_check("workers", k, len) == 0 && tmp) {
+        out->workers = atoi(tmp);
+        flb_free(tmp);
+        if (out->workers < 0) {
+            flb_error("[config] %s invalid number of workers", out->name);
+            return -1;
         }
+    }
+    else if (prop_key_check("flush", k, len) == 0 && tmp) {
+        out->flush = atoi(tmp);
         flb_free(tmp);
+        if (out->flush < 0) {
+            flb_error("[config] %s invalid flush interval", out->name);
+            return -1;
+        }
     }
-    else if (prop_key_check("tls.verify", k, len) == 0 && tmp) {
-        if (strcasecmp(tmp, "true") == 0 || strcasecmp(tmp, "on") == 0) {
-            out->tls_verify = FLB_TRUE;
+    else if (prop_key_check("coro_stack_size", k, len) == 0 && tmp) {
+        limit = flb_utils_size_to_bytes(tmp);
+        flb_free(tmp);
+        if (limit == -1) {
+            return -1;
+        }
+        if (limit < FLB_THREAD_STACK_MIN) {
+            flb_warn("[config] %s coro_stack_size too small, using %i bytes",
+                     out->name, FLB_THREAD_STACK_MIN);
+            limit = FLB_THREAD_STACK_MIN;
+        }
+        out->coro_stack_size = (size_t) limit;
+    }
+    else if (prop_key_check("backlog.policy", k, len) == 0 && tmp) {
+        if (strcasecmp(tmp, "fifo") == 0) {
+            out->backlog_policy = FLB_OUTPUT_BACKLOG_FIFO;
+        }
+        else if (strcasecmp(tmp, "live_first") == 0) {
+            out->backlog_policy = FLB_OUTPUT_BACKLOG_LIVE_FIRST;
+        }
+        else if (strcasecmp(tmp, "weighted") == 0) {
+            out->backlog_policy = FLB_OUTPUT_BACKLOG_WEIGHTED;
         }
         else {
-            out->tls_verify = FLB_FALSE;
+            flb_error("[config] %s invalid backlog.policy '%s'",
+                      out->name, tmp);
+            flb_free(tmp);
+            return -1;
         }
         flb_free(tmp);
     }
-    else if (prop_key_check("tls.debug", k, len) == 0 && tmp) {
-        out->tls_debug = atoi(tmp);
+    else if (prop_key_check("backlog.ratio", k, len) == 0 && tmp) {
+        out->backlog_ratio = atoi(tmp);
         flb_free(tmp);
+        if (out->backlog_ratio <= 0) {
+            flb_error("[config] %s invalid backlog.ratio", out->name);
+            return -1;
+        }
     }
-    else if (prop_key_check("tls.ca_path", k, len) == 0) {
-        out->tls_ca_path = tmp;
+    else if (prop_key_check("backlog.max_flushes", k, len) == 0 && tmp) {
+        out->backlog_max = atoi(tmp);
+        flb_free(tmp);
+        if (out->backlog_max < 0) {
+            flb_error("[config] %s invalid backlog.max_flushes", out->name);
+            return -1;
+        }
     }
-    else if (prop_key_check("tls.ca_file", k, len) == 0) {
-        out->tls_ca_file = tmp;
+    else if (prop_key_check("max_inflight", k, len) == 0 && tmp) {
+        out->max_inflight = atoi(tmp);
+        flb_free(tmp);
+        if (out->max_inflight < 0) {
+            flb_error("[config] %s invalid max_inflight", out->name);
+            return -1;
+        }
     }
-    else if (prop_key_check("tls.crt_file", k, len) == 0) {
-        out->tls_crt_file = tmp;
+    else if (prop_key_check("max_inflight_queue", k, len) == 0 && tmp) {
+        out->max_inflight_queue = atoi(tmp);
+        flb_free(tmp);
+        if (out->max_inflight_queue < 0) {
+            flb_error("[config] %s invalid max_inflight_queue", out->name);
+            return -1;
+        }
     }
-    else if (prop_key_check("tls.key_file", k, len) == 0) {
-        out->tls_key_file = tmp;
+    else if (prop_key_check("circuit.failures", k, len) == 0 && tmp) {
+        out->circuit_failures = atoi(tmp);
+        flb_free(tmp);
+        if (out->circuit_failures < 0) {
+            flb_error("[config] %s invalid circuit.failures", out->name);
+            return -1;
+        }
     }
-    else if (prop_key_check("tls.key_passwd", k, len) == 0) {
-        out->tls_key_passwd = tmp;
+    else if (prop_key_check("circuit.probe_interval", k, len) == 0 && tmp) {
+        out->circuit_probe = atoi(tmp);
+        flb_free(tmp);
+        if (out->circuit_probe <= 0) {
+            flb_error("[config] %s invalid circuit.probe_interval", out->name);
+            return -1;
+        }
     }
-#endif
-    else {
-        /* Append any remaining configuration key to prop list */
+    else if (prop_key_check("coalesce.window", k, len) == 0 && tmp) {
+        out->coalesce_window = atoi(tmp);
+        flb_free(tmp);
+        if (out->coalesce_window < 0) {
+            flb_error("[config] %s invalid coalesce.window", out->name);
+            return -1;
+        }
+    }
+    else if (prop_key_check("coalesce.max_size", k, len) == 0 && tmp) {
+        limit = flb_utils_size_to_bytes(tmp);
+        flb_free(tmp);
+        if (limit <= 0) {
+            flb_error("[config] %s invalid coalesce.max_size", out->name);
+            return -1;
+        }
+        out->coalesce_max_size = (size_t) limit;
+    }
+    else if (prop_key_check("coalesce.adaptive", k, len) == 0 && tmp) {
+        out->coalesce_adaptive = flb_utils_bool(tmp);
+        flb_free(tmp);
+    }
+    else if (prop_key_check("coalesce.latency_target", k, len) == 0 && tmp) {
+        out->coalesce_latency = atoi(tmp);
+        flb_free(tmp);
+        if (out->coalesce_latency <= 0) {
+            flb_error("[config] %s invalid coalesce.latency_target",
+                      out->name);
+            return -1;
+        }
+    }
+    else if (prop_key_check("coalesce.min_window", k, len) == 0 && tmp) {
+        out->coalesce_window_min = atoi(tmp);
+        flb_free(tmp);
+        if (out->coalesce_window_min <= 0) {
+            flb_error("[config] %s invalid coalesce.min_window", out->name);
+            return -1;
+        }
+    }
+    else if (prop_key_check("coalesce.min_size", k, len) == 0 && tmp) {
+        limit = flb_utils_size_to_bytes(tmp);
+        flb_free(tmp);
+        if (limit <= 0) {
+            flb_error("[config] %s invalid coalesce.min_size", out->name);
+            return -1;
+        }
+        out->coalesce_size_min = (size_t) limit;
+    }
+#ifdef FLB_HAVE_BUFFERING
+    else if (prop_key_check("storage.total_limit_size", k, len) == 0 && tmp) {
+        limit = flb_utils_size_to_bytes(tmp);
+        flb_free(tmp);
+        if (limit == -1) {
+            flb_error("[config] %s invalid storage.total_limit_size",
+                      out->name);
+            return -1;
+        }
+        out->fs_limit = (size_t) limit;
+    }
+    else if (prop_key_check("storage.limit_policy", k, len) == 0 && tmp) {
+        if (strcasecmp(tmp, "drop_oldest") == 0) {
+            out->fs_limit_policy = FLB_OUTPUT_FS_DROP_OLDEST;
+        }
+        else if (strcasecmp(tmp, "reject") == 0) {
+            out->fs_limit_policy = FLB_OUTPUT_FS_REJECT;
+        }
+        else {
+            flb_error("[config] %s invalid storage.limit_policy '%s'",
+                      out->name, tmp);
+            flb_free(tmp);
+            return -1;
+        }
+        flb_free(tmp);
+    }
+#endif
+#ifdef FLB_HAVE_TLS
+    else if (prop_key_check("tls", k, len) == 0 && tmp) {
+        if (strcasecmp(tmp, "true") == 0 || strcasecmp(tmp, "on") == 0) {
+            if ((out->flags & FLB_IO_TLS) == 0) {
+                flb_error("[config] %s don't support TLS", out->name);
+                flb_free(tmp);
+                return -1;
+            }
+
+            out->use_tls = FLB_TRUE;
+        }
+        else {
+            out->use_tls = FLB_FALSE;
+        }
+        flb_free(tmp);
+    }
+    else if (prop_key_check("tls.verify", k, len) == 0 && tmp) {
+        if (strcasecmp(tmp, "true") == 0 || strcasecmp(tmp, "on") == 0) {
+            out->tls_verify = FLB_TRUE;
+        }
+        else {
+            out->tls_verify = FLB_FALSE;
+        }
+        flb_free(tmp);
+    }
+    else if (prop_key_check("tls.debug", k, len) == 0 && tmp) {
+        out->tls_debug = atoi(tmp);
+        flb_free(tmp);
+    }
+    else if (prop_key_check("tls.ca_path", k, len) == 0) {
+        out->tls_ca_path = tmp;
+    }
+    else if (prop_key_check("tls.ca_file", k, len) == 0) {
+        out->tls_ca_file = tmp;
+    }
+    else if (prop_key_check("tls.crt_file", k, len) == 0) {
+        out->tls_crt_file = tmp;
+    }
+    else if (prop_key_check("tls.key_file", k, len) == 0) {
+        out->tls_key_file = tmp;
+    }
+    else if (prop_key_check("tls.key_passwd", k, len) == 0) {
+        out->tls_key_passwd = tmp;
+    }
+#endif
+    else {
+        /* Append any remaining configuration key to prop list */
         prop = flb_malloc(sizeof(struct flb_config_prop));
         if (!prop) {
             if (tmp) {
@@ -446,65 +967,381 @@ char *flb_output_get_property(char *key, struct flb_output_instance *o_ins)
     return flb_config_prop_get(key, &o_ins->properties);
 }
 
-/* Trigger the output plugins setup callbacks to prepare them. */
-int flb_output_init(struct flb_config *config)
+/*
+ * Output plugins that create their own upstream context can use this
+ * function to apply the generic network properties set in the instance
+ * configuration (e.g: keepalive, http2).
+ */
+void flb_output_upstream_set(struct flb_upstream *u,
+                             struct flb_output_instance *o_ins)
 {
-    int ret;
-    struct mk_list *tmp;
+    flb_upstream_set_keepalive(u,
+                               o_ins->keepalive,
+                               o_ins->keepalive_idle_timeout,
+                               o_ins->keepalive_max_recycle);
+
+    /* A HTTP/2 session keeps its own connection, no warm-up */
+    if (o_ins->http2 == FLB_TRUE) {
+        if (!(o_ins->p->flags & FLB_OUTPUT_HTTP2)) {
+            flb_warn("[output] %s: http2 is not supported by the plugin",
+                     o_ins->name);
+        }
+        else if (flb_upstream_set_http2(u, FLB_TRUE) == 0) {
+            return;
+        }
+    }
+
+    flb_upstream_set_warm(u, o_ins->keepalive_min_idle);
+}
+
+/*
+ * Upstream group from the instance properties, for plugins sending to a
+ * list of nodes instead of a single host:
+ *
+ *   Nodes            es1:9200 es2:9200 es3:9200@2
+ *   Nodes_Balance    round_robin | least_inflight | weighted
+ *   Nodes_Max_Fails  3
+ *   Nodes_Eject_Time 30
+ *   Nodes_Heartbeat  5
+ *
+ * or from an upstream file with per-node settings, see
+ * flb_upstream_group_conf_file():
+ *
+ *   Upstream         upstream.conf
+ *
+ * Returns 0 and sets 'out' to NULL when none of them is set.
+ */
+int flb_output_upstream_group(struct flb_output_instance *o_ins,
+                              struct flb_config *config,
+                              int default_port, int flags, void *tls,
+                              struct flb_upstream_group **out)
+{
+    int mode = FLB_UPSTREAM_GROUP_ROUND_ROBIN;
+    char *tmp;
     struct mk_list *head;
-    struct flb_output_instance *ins;
-    struct flb_output_plugin *p;
+    struct flb_upstream_node *node;
+    struct flb_upstream_group *g;
 
-    /* We need at least one output */
-    if (mk_list_is_empty(&config->outputs) == 0) {
+    *out = NULL;
+
+    tmp = flb_output_get_property("upstream", o_ins);
+    if (tmp) {
+        g = flb_upstream_group_conf_file(config, tmp, default_port,
+                                         flags, tls);
+        if (!g) {
+            flb_error("[output] %s: invalid upstream file '%s'",
+                      o_ins->name, tmp);
+            return -1;
+        }
+        goto done;
+    }
+
+    tmp = flb_output_get_property("nodes", o_ins);
+    if (!tmp) {
+        return 0;
+    }
+
+    tmp = flb_output_get_property("nodes_balance", o_ins);
+    if (tmp) {
+        mode = flb_upstream_group_mode(tmp);
+        if (mode == -1) {
+            flb_error("[output] %s: invalid nodes_balance '%s'",
+                      o_ins->name, tmp);
+            return -1;
+        }
+    }
+
+    g = flb_upstream_group_create(mode);
+    if (!g) {
         return -1;
     }
 
-    /* Retrieve the plugin reference */
-    mk_list_foreach_safe(head, tmp, &config->outputs) {
-        ins = mk_list_entry(head, struct flb_output_instance, _head);
-        p = ins->p;
+    tmp = flb_output_get_property("nodes_max_fails", o_ins);
+    if (tmp && atoi(tmp) > 0) {
+        g->max_fails = atoi(tmp);
+    }
+    tmp = flb_output_get_property("nodes_eject_time", o_ins);
+    if (tmp && atoi(tmp) >= 0) {
+        g->eject_time = atoi(tmp);
+    }
 
-#ifdef FLB_HAVE_PROXY_GO
-        /* Proxy plugins have heir own initialization */
-        if (p->type == FLB_OUTPUT_PLUGIN_PROXY) {
-            flb_plugin_proxy_init(p->proxy, ins, config);
-            continue;
+    tmp = flb_output_get_property("nodes", o_ins);
+    if (flb_upstream_group_add_list(g, config, tmp, default_port,
+                                    flags, tls) <= 0) {
+        flb_error("[output] %s: invalid nodes '%s'", o_ins->name, tmp);
+        flb_upstream_group_destroy(g);
+        return -1;
+    }
+
+    tmp = flb_output_get_property("nodes_heartbeat", o_ins);
+    if (tmp && atoi(tmp) > 0 &&
+        flb_upstream_group_heartbeat_start(g, atoi(tmp)) == -1) {
+        flb_upstream_group_destroy(g);
+        return -1;
+    }
+
+ done:
+    mk_list_foreach(head, &g->nodes) {
+        node = mk_list_entry(head, struct flb_upstream_node, _head);
+        flb_output_upstream_set(node->u, o_ins);
+    }
+
+    *out = g;
+    return 0;
+}
+
+/* Trigger the output plugins setup callbacks to prepare them. */
+/* Init of an output instance, may run on an init worker */
+struct output_init_job {
+    int ret;
+    int done;
+    int tls_failed;
+    struct flb_output_instance *ins;
+    struct flb_config *config;
+};
+
+static void output_init_job(void *data)
+{
+    uint64_t start;
+    struct output_init_job *job = data;
+    struct flb_output_instance *ins = job->ins;
+
+    start = flb_time_usec();
+    job->done = FLB_TRUE;
+
+#ifdef FLB_HAVE_TLS
+    /*
+     * Plugins with optional TLS only use the context with 'tls on', the
+     * certificates of the CA path are not loaded for plain TCP outputs.
+     */
+    if (ins->flags & FLB_IO_TLS && ins->use_tls == FLB_TRUE) {
+        ins->tls.context = flb_tls_context_get(ins->tls_verify,
+                                               ins->tls_debug,
+                                               ins->tls_ca_path,
+                                               ins->tls_ca_file,
+                                               ins->tls_crt_file,
+                                               ins->tls_key_file,
+                                               ins->tls_key_passwd);
+        if (!ins->tls.context) {
+            job->tls_failed = FLB_TRUE;
+            job->ret = -1;
+            return;
         }
+    }
 #endif
 
-#ifdef FLB_HAVE_TLS
-        if (ins->flags & FLB_IO_TLS) {
-            ins->tls.context = flb_tls_context_new(ins->tls_verify,
-                                                   ins->tls_debug,
-                                                   ins->tls_ca_path,
-                                                   ins->tls_ca_file,
-                                                   ins->tls_crt_file,
-                                                   ins->tls_key_file,
-                                                   ins->tls_key_passwd);
-            if (!ins->tls.context) {
-                flb_error("[output %s] error initializing TLS context",
+    job->ret = ins->p->cb_init(ins, job->config, ins->data);
+    flb_debug("[output %s] initialized in %.1f ms", ins->name,
+              (flb_time_usec() - start) / 1000.0);
+}
+
+/*
+ * Set the bounds of the adaptive coalescing: the configured window and
+ * size are the upper ones, the tuning starts from the lower ones.
+ */
+static void output_coalesce_adaptive(struct flb_output_instance *ins)
+{
+    ins->coalesce_window_max = ins->coalesce_window;
+    ins->coalesce_size_max = ins->coalesce_max_size;
+
+    if (ins->coalesce_window_min <= 0) {
+        ins->coalesce_window_min = ins->coalesce_window /
+                                   FLB_OUTPUT_ADAPTIVE_RATIO;
+    }
+    if (ins->coalesce_window_min < 1) {
+        ins->coalesce_window_min = 1;
+    }
+    else if (ins->coalesce_window_min > ins->coalesce_window_max) {
+        ins->coalesce_window_min = ins->coalesce_window_max;
+    }
+
+    if (ins->coalesce_size_min == 0) {
+        ins->coalesce_size_min = ins->coalesce_size_max /
+                                 FLB_OUTPUT_ADAPTIVE_RATIO;
+    }
+    if (ins->coalesce_size_min < 1) {
+        ins->coalesce_size_min = 1;
+    }
+    else if (ins->coalesce_size_min > ins->coalesce_size_max) {
+        ins->coalesce_size_min = ins->coalesce_size_max;
+    }
+
+    ins->coalesce_window = ins->coalesce_window_min;
+    ins->coalesce_max_size = ins->coalesce_size_min;
+
+    flb_debug("[output] %s adaptive coalescing: window %i-%i ms, "
+              "size %lu-%lu bytes, latency target %i ms", ins->name,
+              ins->coalesce_window_min, ins->coalesce_window_max,
+              ins->coalesce_size_min, ins->coalesce_size_max,
+              ins->coalesce_latency);
+}
+
+/*
+ * Finish the init of an instance once its job ran (or run it here) and
+ * spawn its workers, -1 if the instance cannot be used.
+ */
+static int output_start(struct flb_output_instance *ins,
+                        struct output_init_job *job,
+                        struct flb_config *config)
+{
+    int ret;
+    struct flb_output_plugin *p = ins->p;
+
+#ifdef FLB_HAVE_PROXY_GO
+    /* Proxy plugins have heir own initialization */
+    if (p->type == FLB_OUTPUT_PLUGIN_PROXY) {
+        ret = flb_plugin_proxy_init(p->proxy, ins, config);
+        if (ret == -1) {
+            flb_error("[output] Failed to initialize '%s' plugin",
+                      p->name);
+            return -1;
+        }
+
+        /* Workers only if the plugin flush is thread safe */
+        if (ins->workers > 0 && !(p->flags & FLB_PROXY_OUTPUT_WORKERS)) {
+            flb_warn("[output] %s: plugin does not support workers, "
+                     "flushing from the engine", ins->name);
+            ins->workers = 0;
+        }
+        if (ins->workers > 0) {
+            ret = flb_output_worker_start(ins);
+            if (ret == -1) {
+                flb_error("[output] could not start workers for '%s'",
                           ins->name);
-                flb_output_instance_destroy(ins);
                 return -1;
             }
         }
+        return 0;
+    }
+#endif
+
+    if (!job->done) {
+        output_init_job(job);
+    }
+    if (job->tls_failed) {
+        flb_error("[output %s] error initializing TLS context",
+                  ins->name);
+        return -1;
+    }
+    mk_list_init(&ins->th_queue);
+    if (job->ret == -1) {
+        flb_error("[output] Failed to initialize '%s' plugin",
+                  p->name);
+        return -1;
+    }
+
+    /* Coalesced flushes need the plugin support */
+    if (ins->coalesce_window > 0 && !p->cb_flush_multi) {
+        flb_warn("[output] %s: plugin does not support coalesce.window",
+                 ins->name);
+        ins->coalesce_window = 0;
+    }
+#ifdef FLB_HAVE_BUFFERING
+    /* Buffered chunks are released one flush at a time */
+    if (ins->coalesce_window > 0 && config->buffer_path) {
+        flb_warn("[output] %s: coalesce.window is not available with "
+                 "the filesystem buffer", ins->name);
+        ins->coalesce_window = 0;
+    }
 #endif
-        ret = p->cb_init(ins, config, ins->data);
-        mk_list_init(&ins->th_queue);
+    if (ins->coalesce_window > 0 && ins->coalesce_adaptive == FLB_TRUE) {
+        output_coalesce_adaptive(ins);
+    }
+
+    /* Spawn the workers that will run the flush co-routines */
+    if (ins->workers > 0) {
+        ret = flb_output_worker_start(ins);
         if (ret == -1) {
-            flb_error("[output] Failed to initialize '%s' plugin",
-                      p->name);
+            flb_error("[output] could not start workers for '%s'",
+                      ins->name);
             return -1;
         }
+    }
+
+    return 0;
+}
+
+/* Initialize a detached instance and start its workers (reload) */
+int flb_output_instance_init(struct flb_output_instance *ins,
+                             struct flb_config *config)
+{
+    struct output_init_job job;
+
+    memset(&job, 0, sizeof(job));
+    job.ins = ins;
+    job.config = config;
+
+    return output_start(ins, &job, config);
+}
+
+/*
+ * Network outputs only set up their own context, upstream and TLS context,
+ * with more than one of them they are initialized on 'Init_Workers'
+ * threads: DNS lookups, certificates loading and similar don't add up.
+ */
+int flb_output_init(struct flb_config *config)
+{
+    int i;
+    int n;
+    int ret = 0;
+    int parallel = 0;
+    void **args;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct flb_output_instance *ins;
+    struct output_init_job *jobs;
+    struct output_init_job *job;
+
+    /* We need at least one output */
+    if (mk_list_is_empty(&config->outputs) == 0) {
+        return -1;
+    }
+
+    n = mk_list_size(&config->outputs);
+    jobs = flb_calloc(n, sizeof(struct output_init_job));
+    if (!jobs) {
+        flb_errno();
+        return -1;
+    }
+    args = flb_calloc(n, sizeof(void *));
+    if (!args) {
+        flb_errno();
+        flb_free(jobs);
+        return -1;
+    }
+
+    i = 0;
+    mk_list_foreach(head, &config->outputs) {
+        ins = mk_list_entry(head, struct flb_output_instance, _head);
+        jobs[i].ins = ins;
+        jobs[i].config = config;
+        if (ins->p->type == FLB_OUTPUT_PLUGIN_CORE &&
+            ins->p->flags & FLB_OUTPUT_NET) {
+            args[parallel++] = &jobs[i];
+        }
+        i++;
+    }
+    if (parallel > 1 && config->init_workers > 1) {
+        flb_worker_run_all(output_init_job, args, parallel,
+                           config->init_workers, config);
+    }
+    flb_free(args);
 
+    /* Retrieve the plugin reference */
+    i = 0;
+    mk_list_foreach_safe(head, tmp, &config->outputs) {
+        ins = mk_list_entry(head, struct flb_output_instance, _head);
+        job = &jobs[i++];
 
-#ifdef FLB_HAVE_STATS
-        //struct flb_stats *stats;
-        //stats = &out->stats;
-        //stats->n = -1;
-#endif
+        ret = output_start(ins, job, config);
+        if (ret == -1) {
+            if (job->tls_failed) {
+                flb_output_instance_destroy(ins);
+            }
+            break;
+        }
     }
+    flb_free(jobs);
 
     /* Iterate list of proxies plugins */
     mk_list_foreach(head, &config->proxies) {
@@ -513,8 +1350,225 @@ int flb_output_init(struct flb_config *config)
         //printf("load proxy name = %s\n", proxy->name);
     }
 
+    return ret;
+}
+
+/*
+ * Replace the running outputs with the 'n' instances of 'outs', in that
+ * order, and route the inputs to them. The running instances not present
+ * in 'outs' are retired: no new task is routed to them but the tasks they
+ * hold are still flushed, flb_output_retired_cleanup() releases them once
+ * drained. Readers out of the engine thread hold 'filters_lock'.
+ */
+void flb_output_swap(struct flb_config *config,
+                     struct flb_output_instance **outs, int n)
+{
+    int i;
+    struct mk_list *tmp;
+    struct mk_list *head;
+
+    pthread_rwlock_wrlock(&config->filters_lock);
+
+    mk_list_foreach_safe(head, tmp, &config->outputs) {
+        mk_list_del(head);
+        mk_list_add(head, &config->outputs_retired);
+    }
+    for (i = 0; i < n; i++) {
+        mk_list_del(&outs[i]->_head);
+        mk_list_add(&outs[i]->_head, &config->outputs);
+    }
+
+    /* Static routes and cached ones reference the old instances */
+    flb_router_io_update(config);
 
-    return 0;
+    pthread_rwlock_unlock(&config->filters_lock);
+}
+
+/* Does a task still reference the instance: a route, a retry or a flush ? */
+static int instance_busy(struct flb_output_instance *ins,
+                         struct flb_config *config)
+{
+    struct mk_list *head;
+    struct mk_list *t_head;
+    struct mk_list *r_head;
+    struct flb_task *task;
+    struct flb_task_route *route;
+    struct flb_task_retry *retry;
+    struct flb_output_thread *out_th;
+    struct flb_input_instance *i_ins;
+
+    mk_list_foreach(head, &config->inputs) {
+        i_ins = mk_list_entry(head, struct flb_input_instance, _head);
+        mk_list_foreach(t_head, &i_ins->tasks) {
+            task = mk_list_entry(t_head, struct flb_task, _head);
+            mk_list_foreach(r_head, &task->routes) {
+                route = mk_list_entry(r_head, struct flb_task_route, _head);
+                if (route->out == ins) {
+                    return FLB_TRUE;
+                }
+            }
+            mk_list_foreach(r_head, &task->retries) {
+                retry = mk_list_entry(r_head, struct flb_task_retry, _head);
+                if (retry->o_ins == ins) {
+                    return FLB_TRUE;
+                }
+            }
+            mk_list_foreach(r_head, &task->threads) {
+                out_th = mk_list_entry(r_head, struct flb_output_thread, _head);
+                if (out_th->o_ins == ins) {
+                    return FLB_TRUE;
+                }
+            }
+        }
+    }
+
+    return FLB_FALSE;
+}
+
+/*
+ * Release the retired instances no task references anymore, it returns the
+ * number of instances still draining.
+ */
+int flb_output_retired_cleanup(struct flb_config *config)
+{
+    int c = 0;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct flb_output_instance *ins;
+
+    mk_list_foreach_safe(head, tmp, &config->outputs_retired) {
+        ins = mk_list_entry(head, struct flb_output_instance, _head);
+        if (instance_busy(ins, config) == FLB_TRUE) {
+            c++;
+            continue;
+        }
+
+        flb_info("[output] %s drained, stopping it", ins->name);
+
+        /* Its own timers, then the flush interval */
+        instance_timers_destroy(ins);
+        flb_sched_timer_cb_cancel(config, ins);
+        flb_output_worker_stop(ins);
+        flb_output_instance_exit(ins, config);
+    }
+
+    return c;
+}
+
+/* Time for a probe: let a single flush through the open circuit */
+static void cb_circuit_probe(struct flb_config *config, void *data)
+{
+    struct flb_output_instance *ins = data;
+
+    /* The scheduler releases the timer once the callback returns */
+    ins->circuit_timer = NULL;
+
+    if (ins->circuit_state != FLB_OUTPUT_CIRCUIT_OPEN) {
+        return;
+    }
+
+    ins->circuit_state = FLB_OUTPUT_CIRCUIT_HALF_OPEN;
+    flb_debug("[output] %s circuit half-open", ins->name);
+    flb_engine_dispatch_backlog(ins, config);
+}
+
+/*
+ * Account the result of a flush of the instance in its circuit breaker.
+ * Only retries count as failures, an error is about the data.
+ */
+void flb_output_circuit_update(struct flb_output_instance *ins, int ret,
+                               struct flb_config *config)
+{
+    if (ins->circuit_failures <= 0) {
+        return;
+    }
+
+    if (ret == FLB_OK) {
+        if (ins->circuit_state != FLB_OUTPUT_CIRCUIT_CLOSED) {
+            flb_info("[output] %s circuit closed", ins->name);
+        }
+        ins->circuit_state = FLB_OUTPUT_CIRCUIT_CLOSED;
+        ins->circuit_count = 0;
+        return;
+    }
+    else if (ret != FLB_RETRY) {
+        return;
+    }
+
+    ins->circuit_count++;
+    if (ins->circuit_state == FLB_OUTPUT_CIRCUIT_OPEN ||
+        (ins->circuit_state == FLB_OUTPUT_CIRCUIT_CLOSED &&
+         ins->circuit_count < ins->circuit_failures)) {
+        return;
+    }
+
+    ins->circuit_state = FLB_OUTPUT_CIRCUIT_OPEN;
+    flb_warn("[output] %s circuit open after %i failed flushes, "
+             "next probe in %i seconds", ins->name, ins->circuit_count,
+             ins->circuit_probe);
+
+    ins->circuit_timer = flb_sched_timer_cb_add(config,
+                                                ins->circuit_probe * 1000,
+                                                cb_circuit_probe, ins);
+    if (!ins->circuit_timer) {
+        /* Without a timer the next flush is the probe */
+        flb_error("[output] %s cannot schedule the circuit probe", ins->name);
+        ins->circuit_state = FLB_OUTPUT_CIRCUIT_HALF_OPEN;
+    }
+}
+
+/*
+ * Tune the coalescing window and size of an adaptive instance after a
+ * flush: additive increase while flushes succeed within the latency target,
+ * multiplicative decrease on a retry or a slower flush. Flushes started
+ * before the last decrease saw the old values and don't decrease again, an
+ * error is about the data, it does not count.
+ */
+void flb_output_coalesce_update(struct flb_output_instance *ins, int ret,
+                                uint64_t start, uint64_t latency)
+{
+    int window;
+    size_t size;
+
+    if (ins->coalesce_adaptive == FLB_FALSE || ins->coalesce_window <= 0 ||
+        ret == FLB_ERROR) {
+        return;
+    }
+
+    window = ins->coalesce_window;
+    size = ins->coalesce_max_size;
+
+    if (ret == FLB_OK && latency <= ins->coalesce_latency * 1000ULL) {
+        window += (ins->coalesce_window_max - ins->coalesce_window_min) /
+                  FLB_OUTPUT_ADAPTIVE_STEPS + 1;
+        size += (ins->coalesce_size_max - ins->coalesce_size_min) /
+                FLB_OUTPUT_ADAPTIVE_STEPS + 1;
+        if (window > ins->coalesce_window_max) {
+            window = ins->coalesce_window_max;
+        }
+        if (size > ins->coalesce_size_max) {
+            size = ins->coalesce_size_max;
+        }
+    }
+    else if (start >= ins->coalesce_cut) {
+        ins->coalesce_cut = start + latency;
+        window /= 2;
+        size /= 2;
+        if (window < ins->coalesce_window_min) {
+            window = ins->coalesce_window_min;
+        }
+        if (size < ins->coalesce_size_min) {
+            size = ins->coalesce_size_min;
+        }
+    }
+
+    if (window != ins->coalesce_window || size != ins->coalesce_max_size) {
+        flb_trace("[output] %s coalesce window %i ms size %lu bytes "
+                  "(flush %s in %.1f ms)", ins->name, window, size,
+                  ret == FLB_OK ? "ok" : "retry", latency / 1000.0);
+        ins->coalesce_window = window;
+        ins->coalesce_max_size = size;
+    }
 }
 
 /* Assign an Configuration context to an Output */
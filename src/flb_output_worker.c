@@ -0,0 +1,337 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <monkey/mk_core.h>
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_log.h>
+#include <fluent-bit/flb_mp.h>
+#ifdef FLB_HAVE_REGEX
+#include <fluent-bit/flb_regex.h>
+#endif
+#include <fluent-bit/flb_pipe.h>
+#include <fluent-bit/flb_config.h>
+#include <fluent-bit/flb_engine.h>
+#include <fluent-bit/flb_output.h>
+#include <fluent-bit/flb_output_worker.h>
+#include <fluent-bit/flb_thread.h>
+#include <fluent-bit/flb_upstream.h>
+#include <fluent-bit/flb_worker.h>
+
+#ifdef FLB_HAVE_FLUSH_LIBCO
+
+/*
+ * Resume a flush co-routine. If the co-routine finished (it called
+ * FLB_OUTPUT_RETURN), notify the engine. This is done after the co-routine
+ * yielded so the engine cannot destroy it while is still running.
+ *
+ * It's also used by the components resuming co-routines from an event
+ * handler of the loop they run in, e.g: the HTTP/2 sessions.
+ */
+void flb_output_thread_resume(struct flb_thread *th)
+{
+    int n;
+    uint64_t val;
+    struct flb_output_thread *out_th;
+
+    out_th = (struct flb_output_thread *) FLB_THREAD_DATA(th);
+    flb_thread_resume(th);
+
+    if (out_th->ret_pending == FLB_FALSE) {
+        return;
+    }
+
+    out_th->ret_pending = FLB_FALSE;
+    val = out_th->ret_event;
+    n = flb_engine_notify(out_th->config, val);
+    if (n == -1) {
+        flb_errno();
+    }
+}
+
+/* Worker main loop, it runs in it own POSIX thread */
+static void worker_loop(void *data)
+{
+    int n;
+    int run = FLB_TRUE;
+    uint64_t val;
+    struct mk_event *event;
+    struct flb_thread *th;
+    struct flb_upstream_conn *u_conn;
+    struct flb_output_worker *worker = data;
+
+    /* Coroutines and connections started here belongs to this event loop */
+    flb_engine_evl_set(worker->evl);
+
+    flb_debug("[output worker] %s worker #%i started",
+              worker->o_ins->name, worker->id);
+
+    while (run == FLB_TRUE) {
+        mk_event_wait(worker->evl);
+        mk_event_foreach(event, worker->evl) {
+            if (event->type == FLB_ENGINE_EV_CORE) {
+                /* A new flush request or the stop signal */
+                n = flb_pipe_r(worker->ch_events[0], &val, sizeof(val));
+                if (n <= 0) {
+                    flb_errno();
+                    continue;
+                }
+
+                if (val == FLB_OUTPUT_WORKER_STOP) {
+                    run = FLB_FALSE;
+                    break;
+                }
+
+                th = (struct flb_thread *) (uintptr_t) val;
+                flb_output_thread_resume(th);
+            }
+            else if (event->type == FLB_ENGINE_EV_THREAD) {
+                /* Network event for a flush co-routine */
+                u_conn = (struct flb_upstream_conn *) event;
+                th = u_conn->thread;
+                flb_trace("[output worker] resuming thread=%p", th);
+                flb_output_thread_resume(th);
+            }
+            else if (event->type == FLB_ENGINE_EV_CUSTOM) {
+                /* Connection handlers, e.g: HTTP/2 sessions */
+                event->handler(event);
+            }
+        }
+    }
+
+    /* Unpack contexts pooled by the flushes of this thread */
+    flb_mp_thread_exit();
+#ifdef FLB_HAVE_REGEX
+    flb_regex_thread_exit();
+#endif
+
+    flb_debug("[output worker] %s worker #%i stopped",
+              worker->o_ins->name, worker->id);
+}
+
+static void worker_destroy(struct flb_output_worker *worker)
+{
+    if (worker->ch_events[0] > 0) {
+        mk_event_del(worker->evl, &worker->event);
+        flb_pipe_close(worker->ch_events[0]);
+    }
+    if (worker->ch_events[1] > 0) {
+        flb_pipe_close(worker->ch_events[1]);
+    }
+    if (worker->evl) {
+        mk_event_loop_destroy(worker->evl);
+    }
+
+    mk_list_del(&worker->_head);
+    flb_free(worker);
+}
+
+/*
+ * Create the pool of workers for the output instance. This is only
+ * called if the 'workers' property is greater than zero.
+ */
+int flb_output_worker_start(struct flb_output_instance *ins)
+{
+    int i;
+    int ret;
+    char role[32];
+    struct flb_output_worker *worker;
+
+    for (i = 0; i < ins->workers; i++) {
+        worker = flb_calloc(1, sizeof(struct flb_output_worker));
+        if (!worker) {
+            flb_errno();
+            flb_output_worker_destroy(ins);
+            return -1;
+        }
+        worker->id = i;
+        worker->o_ins = ins;
+        worker->config = ins->config;
+        worker->ch_events[0] = -1;
+        worker->ch_events[1] = -1;
+        mk_list_add(&worker->_head, &ins->workers_pool);
+
+        worker->evl = mk_event_loop_create(64);
+        if (!worker->evl) {
+            flb_error("[output worker] %s could not create event loop",
+                      ins->name);
+            flb_output_worker_destroy(ins);
+            return -1;
+        }
+
+        ret = mk_event_channel_create(worker->evl,
+                                      &worker->ch_events[0],
+                                      &worker->ch_events[1],
+                                      worker);
+        if (ret != 0) {
+            flb_error("[output worker] %s could not create channel",
+                      ins->name);
+            worker->ch_events[0] = -1;
+            worker->ch_events[1] = -1;
+            flb_output_worker_destroy(ins);
+            return -1;
+        }
+
+        snprintf(role, sizeof(role) - 1, "output:%s", ins->name);
+        ret = flb_worker_create_role(worker_loop, worker, &worker->tid,
+                                     role, ins->cpus, ins->config);
+        if (ret == -1) {
+            flb_error("[output worker] %s could not spawn worker #%i",
+                      ins->name, i);
+            worker->tid = 0;
+            flb_output_worker_destroy(ins);
+            return -1;
+        }
+    }
+
+    flb_info("[output worker] %s started %i workers", ins->name, ins->workers);
+    return 0;
+}
+
+/*
+ * Stop the workers of the output instance. Their event loops are kept since
+ * the upstream connections of pending co-routines are still registered on
+ * them, they are released by flb_output_worker_destroy().
+ */
+void flb_output_worker_stop(struct flb_output_instance *ins)
+{
+    int n;
+    uint64_t val = FLB_OUTPUT_WORKER_STOP;
+    struct mk_list *head;
+    struct flb_output_worker *worker;
+
+    mk_list_foreach(head, &ins->workers_pool) {
+        worker = mk_list_entry(head, struct flb_output_worker, _head);
+        if (!worker->tid) {
+            continue;
+        }
+
+        n = flb_pipe_w(worker->ch_events[1], &val, sizeof(val));
+        if (n == -1) {
+            flb_errno();
+        }
+        pthread_join(worker->tid, NULL);
+        worker->tid = 0;
+    }
+}
+
+/* Stop and release the workers of the output instance */
+void flb_output_worker_destroy(struct flb_output_instance *ins)
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct flb_output_worker *worker;
+
+    flb_output_worker_stop(ins);
+
+    mk_list_foreach_safe(head, tmp, &ins->workers_pool) {
+        worker = mk_list_entry(head, struct flb_output_worker, _head);
+        worker_destroy(worker);
+    }
+    ins->workers_next = NULL;
+}
+
+/*
+ * Hand a flush co-routine to the next worker of the output instance. From
+ * now on the co-routine is only resumed by that worker.
+ */
+int flb_output_worker_dispatch(struct flb_output_instance *ins,
+                               struct flb_thread *th)
+{
+    int n;
+    uint64_t val;
+    struct mk_list *head;
+    struct flb_output_thread *out_th;
+    struct flb_output_worker *worker;
+
+    if (mk_list_is_empty(&ins->workers_pool) == 0) {
+        return -1;
+    }
+
+    /* Round robin */
+    head = ins->workers_next;
+    if (!head || head->next == &ins->workers_pool) {
+        head = ins->workers_pool.next;
+    }
+    else {
+        head = head->next;
+    }
+    ins->workers_next = head;
+
+    worker = mk_list_entry(head, struct flb_output_worker, _head);
+
+    out_th = (struct flb_output_thread *) FLB_THREAD_DATA(th);
+    out_th->worker = FLB_TRUE;
+
+    val = (uint64_t) (uintptr_t) th;
+    n = flb_pipe_w(worker->ch_events[1], &val, sizeof(val));
+    if (n == -1) {
+        flb_errno();
+        out_th->worker = FLB_FALSE;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Stop the workers of all output instances */
+void flb_output_worker_exit(struct flb_config *config)
+{
+    struct mk_list *head;
+    struct flb_output_instance *ins;
+
+    mk_list_foreach(head, &config->outputs) {
+        ins = mk_list_entry(head, struct flb_output_instance, _head);
+        flb_output_worker_stop(ins);
+    }
+    mk_list_foreach(head, &config->outputs_retired) {
+        ins = mk_list_entry(head, struct flb_output_instance, _head);
+        flb_output_worker_stop(ins);
+    }
+}
+
+#else
+
+int flb_output_worker_start(struct flb_output_instance *ins)
+{
+    flb_warn("[output worker] %s workers require co-routines support, "
+             "running in the engine", ins->name);
+    ins->workers = 0;
+    return 0;
+}
+
+void flb_output_worker_stop(struct flb_output_instance *ins)
+{
+}
+
+void flb_output_worker_destroy(struct flb_output_instance *ins)
+{
+}
+
+int flb_output_worker_dispatch(struct flb_output_instance *ins,
+                               struct flb_thread *th)
+{
+    return -1;
+}
+
+void flb_output_worker_exit(struct flb_config *config)
+{
+}
+
+#endif /* !FLB_HAVE_FLUSH_LIBCO */
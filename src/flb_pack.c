@@ -29,144 +29,17 @@
 #include <fluent-bit/flb_time.h>
 
 #include <msgpack.h>
-#include <jsmn/jsmn.h>
 
-#define try_to_write_str  flb_utils_write_str
-
-static int json_tokenise(char *js, size_t len,
-                         struct flb_pack_state *state)
-{
-    int ret;
-    int n;
-    void *tmp;
-
-    ret = jsmn_parse(&state->parser, js, len,
-                     state->tokens, state->tokens_size);
-
-    while (ret == JSMN_ERROR_NOMEM) {
-        n = state->tokens_size += 256;
-        tmp = flb_realloc(state->tokens, sizeof(jsmntok_t) * n);
-        if (!tmp) {
-            perror("realloc");
-            return -1;
-        }
-        state->tokens = tmp;
-        state->tokens_size = n;
-        ret = jsmn_parse(&state->parser, js, len,
-                         state->tokens, state->tokens_size);
-    }
-
-    if (ret == JSMN_ERROR_INVAL) {
-        return FLB_ERR_JSON_INVAL;
-    }
-
-    if (ret == JSMN_ERROR_PART) {
-        /* This is a partial JSON message, just stop */
-        flb_trace("[json tokenise] incomplete");
-        return FLB_ERR_JSON_PART;
-    }
-
-    state->tokens_count += ret;
-    return 0;
-}
-
-static inline int is_float(char *buf, int len)
-{
-    char *end = buf + len;
-    char *p = buf;
-
-    while (p <= end) {
-        if (*p == '.') {
-            return 1;
-        }
-        p++;
-    }
-    return 0;
-}
-
-/* Receive a tokenized JSON message and convert it to MsgPack */
-static char *tokens_to_msgpack(char *js,
-                               jsmntok_t *tokens, int arr_size, int *out_size,
-                               int *last_byte)
+/* The JSON input ends at the first NULL byte, if any */
+static inline size_t json_length(char *js, size_t len)
 {
-    int i;
-    int flen;
     char *p;
-    char *buf;
-    jsmntok_t *t;
-    msgpack_packer pck;
-    msgpack_sbuffer sbuf;
-
-    if (arr_size == 0) {
-        return NULL;
-    }
-
-    /* initialize buffers */
-    msgpack_sbuffer_init(&sbuf);
-    msgpack_packer_init(&pck, &sbuf, msgpack_sbuffer_write);
-
-    for (i = 0; i < arr_size ; i++) {
-        t = &tokens[i];
 
-        if (t->start == -1 || t->end == -1 || (t->start == 0 && t->end == 0)) {
-            break;
-        }
-
-        if (t->parent == -1) {
-            *last_byte = t->end;
-        }
-
-        flen = (t->end - t->start);
-        switch (t->type) {
-        case JSMN_OBJECT:
-            msgpack_pack_map(&pck, t->size);
-            break;
-        case JSMN_ARRAY:
-            msgpack_pack_array(&pck, t->size);
-            break;
-        case JSMN_STRING:
-            msgpack_pack_str(&pck, flen);
-            msgpack_pack_str_body(&pck, js + t->start, flen);
-            break;
-        case JSMN_PRIMITIVE:
-            p = js + t->start;
-            if (*p == 'f') {
-                msgpack_pack_false(&pck);
-            }
-            else if (*p == 't') {
-                msgpack_pack_true(&pck);
-            }
-            else if (*p == 'n') {
-                msgpack_pack_nil(&pck);
-            }
-            else {
-                if (is_float(p, flen)) {
-                    msgpack_pack_double(&pck, atof(p));
-                }
-                else {
-                    msgpack_pack_int64(&pck, atol(p));
-                }
-            }
-            break;
-        case JSMN_UNDEFINED:
-            msgpack_sbuffer_destroy(&sbuf);
-            return NULL;
-        }
-    }
-
-    /* dump data back to a new buffer */
-    *out_size = sbuf.size;
-    buf = flb_malloc(sbuf.size);
-    if (!buf) {
-        flb_errno();
-        msgpack_sbuffer_destroy(&sbuf);
-        return NULL;
+    p = memchr(js, '\0', len);
+    if (p) {
+        return p - js;
     }
-
-    memcpy(buf, sbuf.data, sbuf.size);
-    msgpack_sbuffer_destroy(&sbuf);
-
-    return buf;
+    return len;
 }
 
 /*
@@ -179,45 +52,21 @@ static char *tokens_to_msgpack(char *js,
  */
 int flb_pack_json(char *js, size_t len, char **buffer, size_t *size)
 {
-    int ret = -1;
-    int out;
-    char *buf = NULL;
-    struct flb_pack_state state;
+    int ret;
 
-    ret = flb_pack_state_init(&state);
-    if (ret != 0) {
+    ret = flb_json_parse(js, json_length(js, len), buffer, size);
+    if (ret <= 0) {
         return -1;
     }
-    ret = json_tokenise(js, len, &state);
-    if (ret != 0) {
-        ret = -1;
-        goto flb_pack_json_end;
-    }
-
-    int last;
-    buf = tokens_to_msgpack(js, state.tokens, state.tokens_count, &out, &last);
-    if (!buf) {
-        ret = -1;
-        goto flb_pack_json_end;
-    }
-
-    *size = out;
-    *buffer = buf;
-
-    ret = 0;
 
- flb_pack_json_end:
-    flb_pack_state_reset(&state);
-    return ret;
+    return 0;
 }
 
 int flb_pack_json_valid(char *json, size_t len)
 {
     int ret;
-    jsmn_parser parser;
 
-    jsmn_init(&parser);
-    ret = jsmn_parse(&parser, json, len, NULL, 0);
+    ret = flb_json_parse(json, json_length(json, len), NULL, NULL);
     if (ret <= 0) {
         return -1;
     }
@@ -228,95 +77,76 @@ int flb_pack_json_valid(char *json, size_t len)
 /* Initialize a JSON packer state */
 int flb_pack_state_init(struct flb_pack_state *s)
 {
-    int size = 256;
-
-    jsmn_init(&s->parser);
-    s->tokens = flb_calloc(1, sizeof(jsmntok_t) * size);
-    if (!s->tokens) {
-        flb_errno();
-        return -1;
-    }
-    s->tokens_size   = size;
-    s->tokens_count  = 0;
-    s->last_byte     = 0;
+    s->multiple  = FLB_FALSE;
+    s->last_byte = 0;
+    flb_json_scan_init(&s->scan);
 
     return 0;
 }
 
 void flb_pack_state_reset(struct flb_pack_state *s)
 {
-    flb_free(s->tokens);
-    s->tokens_size  = 0;
-    s->tokens_count = 0;
-    s->last_byte    = 0;
+    s->last_byte = 0;
+    flb_json_scan_init(&s->scan);
 }
 
 
 /*
  * It parse a JSON string and convert it to MessagePack format. The main
  * difference of this function and the previous flb_pack_json() is that it
- * keeps a parser and tokens state, allowing to process big messages and
- * resume the parsing process instead of start from zero.
+ * keeps a scan state, the buffer can grow between calls and only the new
+ * data is scanned. The complete JSON messages found at the beginning of the
+ * buffer are packed, 'last_byte' is set to the end of the last one.
+ *
+ * On success the caller must drop the first 'last_byte' bytes of the buffer
+ * before the next call, the scan state is moved accordingly so the data that
+ * follows is not scanned again. A caller that discards the buffer in any
+ * other way must reset the state.
  */
 int flb_pack_json_state(char *js, size_t len,
                         char **buffer, int *size,
                         struct flb_pack_state *state)
 {
     int ret;
-    int out;
-    int delim = 0;
-    int last =  0;
-    char *buf;
-    jsmntok_t *t;
+    size_t end;
+    size_t out_size;
 
-    ret = json_tokenise(js, len, state);
+    len = json_length(js, len);
     state->multiple = FLB_TRUE;
-    if (ret == FLB_ERR_JSON_PART && state->multiple == FLB_TRUE) {
-        /*
-         * If the caller enabled 'multiple' flag, it means that the incoming
-         * JSON message may have multiple messages concatenated and likely
-         * the last one is only incomplete.
-         *
-         * The following routine aims to determinate how many JSON messages
-         * are OK in the array of tokens, if any, process them and adjust
-         * the JSMN context/buffers.
-         */
-        int i;
-        int found = 0;
-
-        for (i = 1; i < state->tokens_size; i++) {
-            t = &state->tokens[i];
-
-            if (t->start < (state->tokens[i - 1]).start) {
-                break;
-            }
-
-            if (t->parent == -1 && (t->end != 0)) {
-                found++;
-                delim = i;
-            }
 
-        }
-
-        if (found > 0) {
-            state->tokens_count += delim;
-        }
-        else {
-            return ret;
-        }
+    /* The caller dropped data behind our back */
+    if (state->scan.pos > len) {
+        flb_json_scan_init(&state->scan);
     }
-    else if (ret != 0) {
+
+    ret = flb_json_scan(js, len, &state->scan);
+    if (ret != 0) {
         return ret;
     }
 
-    buf = tokens_to_msgpack(js, state->tokens, state->tokens_count, &out, &last);
-    if (!buf) {
-        return -1;
+    end = state->scan.end;
+    if (end == 0) {
+        /* This is a partial JSON message, just stop */
+        flb_trace("[json state] incomplete, %lu bytes scanned",
+                  state->scan.pos);
+        return FLB_ERR_JSON_PART;
+    }
+
+    ret = flb_json_parse(js, end, buffer, &out_size);
+    if (ret == FLB_ERR_JSON_PART) {
+        /* the scan found the end of the values, it cannot be partial */
+        return FLB_ERR_JSON_INVAL;
+    }
+    else if (ret <= 0) {
+        return (ret == 0) ? FLB_ERR_JSON_PART : ret;
     }
 
-    *size = out;
-    *buffer = buf;
-    state->last_byte = last;
+    *size = out_size;
+    state->last_byte = end;
+
+    /* Make the scan state relative to the data left after 'end' */
+    state->scan.pos -= end;
+    state->scan.end = 0;
 
     return 0;
 }
@@ -336,158 +166,175 @@ void flb_pack_print(char *data, size_t bytes)
 }
 
 
-static inline int try_to_write(char *buf, int *off, size_t left,
-                               char *str, size_t str_len)
+/*
+ * msgpack to JSON
+ * ---------------
+ * The encoder only appends to a sds buffer that grows as needed, the output
+ * never have to be restarted from scratch because the guessed size was too
+ * small.
+ */
+
+static inline int json_cat(flb_sds_t *s, char *str, size_t len)
 {
-    if (str_len <= 0){
-        str_len = strlen(str);
+    flb_sds_t buf;
+
+    buf = flb_sds_reserve(*s, len);
+    if (!buf) {
+        return -1;
     }
-    if (left <= *off+str_len) {
-        return FLB_FALSE;
+    memcpy(buf + flb_sds_len(buf), str, len);
+    flb_sds_len_set(buf, flb_sds_len(buf) + len);
+    *s = buf;
+
+    return 0;
+}
+
+static inline int json_int(flb_sds_t *s, uint64_t val, int negative)
+{
+    char tmp[24];
+    char *p = tmp + sizeof(tmp);
+
+    do {
+        *--p = '0' + (val % 10);
+        val /= 10;
+    } while (val > 0);
+
+    if (negative) {
+        *--p = '-';
     }
-    memcpy(buf+*off, str, str_len);
-    *off += str_len;
-    return FLB_TRUE;
+
+    return json_cat(s, p, (tmp + sizeof(tmp)) - p);
 }
 
+static inline int json_str(flb_sds_t *s, char *str, size_t len)
+{
+    if (json_cat(s, "\"", 1) == -1 ||
+        flb_utils_write_str_sds(s, str, len) == -1 ||
+        json_cat(s, "\"", 1) == -1) {
+        return -1;
+    }
+
+    return 0;
+}
 
-static int msgpack2json(char *buf, int *off, size_t left, msgpack_object *o)
+static int msgpack2json(flb_sds_t *s, msgpack_object *o)
 {
-    int ret = FLB_FALSE;
     int i;
+    int len;
     int loop;
+    char temp[32];
 
     switch(o->type) {
     case MSGPACK_OBJECT_NIL:
-        ret = try_to_write(buf, off, left, "null", 4);
-        break;
+        return json_cat(s, "null", 4);
 
     case MSGPACK_OBJECT_BOOLEAN:
-        ret = try_to_write(buf, off, left,
-                           (o->via.boolean ? "true":"false"),0);
-
-        break;
+        if (o->via.boolean) {
+            return json_cat(s, "true", 4);
+        }
+        return json_cat(s, "false", 5);
 
     case MSGPACK_OBJECT_POSITIVE_INTEGER:
-        {
-            char temp[32] = {0};
-            i = snprintf(temp, sizeof(temp)-1, "%lu", (unsigned long)o->via.u64);
-            ret = try_to_write(buf, off, left, temp, i);
-        }
-        break;
+        return json_int(s, o->via.u64, FLB_FALSE);
 
     case MSGPACK_OBJECT_NEGATIVE_INTEGER:
-        {
-            char temp[32] = {0};
-            i = snprintf(temp, sizeof(temp)-1, "%ld", (signed long)o->via.i64);
-            ret = try_to_write(buf, off, left, temp, i);
-        }
-        break;
+        return json_int(s, 0 - (uint64_t) o->via.i64, o->via.i64 < 0);
+
     case MSGPACK_OBJECT_FLOAT32:
     case MSGPACK_OBJECT_FLOAT64:
-        {
-            char temp[32] = {0};
-            i = snprintf(temp, sizeof(temp)-1, "%f", o->via.f64);
-            ret = try_to_write(buf, off, left, temp, i);
-        }
-        break;
+        len = snprintf(temp, sizeof(temp) - 1, "%f", o->via.f64);
+        return json_cat(s, temp, len);
 
     case MSGPACK_OBJECT_STR:
-        if (try_to_write(buf, off, left, "\"", 1) &&
-            (o->via.str.size > 0 ?
-             try_to_write_str(buf, off, left, (char*)o->via.str.ptr, o->via.str.size)
-             : 1/* nothing to do */) &&
-            try_to_write(buf, off, left, "\"", 1)) {
-            ret = FLB_TRUE;
-        }
-        break;
+        return json_str(s, (char *) o->via.str.ptr, o->via.str.size);
 
     case MSGPACK_OBJECT_BIN:
-        if (try_to_write(buf, off, left, "\"", 1) &&
-            (o->via.bin.size > 0 ?
-             try_to_write_str(buf, off, left, (char*)o->via.bin.ptr, o->via.bin.size)
-              : 1 /* nothing to do */) &&
-            try_to_write(buf, off, left, "\"", 1)) {
-            ret = FLB_TRUE;
-        }
-        break;
+        return json_str(s, (char *) o->via.bin.ptr, o->via.bin.size);
 
     case MSGPACK_OBJECT_EXT:
-        if (!try_to_write(buf, off, left, "\"", 1)) {
-            goto msg2json_end;
-        }
         /* ext body. fortmat is similar to printf(1) */
-        {
-            char temp[32] = {0};
-            int  len;
-            loop = o->via.ext.size;
-            for(i=0; i<loop; i++) {
-                len = snprintf(temp, sizeof(temp)-1, "\\x%02x", (char)o->via.ext.ptr[i]);
-                if (!try_to_write(buf, off, left, temp, len)) {
-                    goto msg2json_end;
-                }
-            }
+        if (json_cat(s, "\"", 1) == -1) {
+            return -1;
         }
-        if (!try_to_write(buf, off, left, "\"", 1)) {
-            goto msg2json_end;
+        loop = o->via.ext.size;
+        for (i = 0; i < loop; i++) {
+            len = snprintf(temp, sizeof(temp) - 1, "\\x%02x",
+                           (char) o->via.ext.ptr[i]);
+            if (json_cat(s, temp, len) == -1) {
+                return -1;
+            }
         }
-        ret = FLB_TRUE;
-        break;
+        return json_cat(s, "\"", 1);
 
     case MSGPACK_OBJECT_ARRAY:
         loop = o->via.array.size;
-
-        if (!try_to_write(buf, off, left, "[", 1)) {
-            goto msg2json_end;
+        if (json_cat(s, "[", 1) == -1) {
+            return -1;
         }
-        if (loop != 0) {
-            msgpack_object* p = o->via.array.ptr;
-            if (!msgpack2json(buf, off, left, p)) {
-                goto msg2json_end;
-            }
-            for (i=1; i<loop; i++) {
-                if (!try_to_write(buf, off, left, ", ", 2) ||
-                    !msgpack2json(buf, off, left, p+i)) {
-                    goto msg2json_end;
-                }
+        for (i = 0; i < loop; i++) {
+            if ((i > 0 && json_cat(s, ", ", 2) == -1) ||
+                msgpack2json(s, o->via.array.ptr + i) == -1) {
+                return -1;
             }
         }
-
-        ret = try_to_write(buf, off, left, "]", 1);
-        break;
+        return json_cat(s, "]", 1);
 
     case MSGPACK_OBJECT_MAP:
         loop = o->via.map.size;
-        if (!try_to_write(buf, off, left, "{", 1)) {
-            goto msg2json_end;
+        if (json_cat(s, "{", 1) == -1) {
+            return -1;
         }
-        if (loop != 0) {
-            msgpack_object_kv *p = o->via.map.ptr;
-            if (!msgpack2json(buf, off, left, &p->key) ||
-                !try_to_write(buf, off, left, ":", 1)  ||
-                !msgpack2json(buf, off, left, &p->val)) {
-                goto msg2json_end;
-            }
-            for (i = 1; i < loop; i++) {
-                if (
-                    !try_to_write(buf, off, left, ", ", 2) ||
-                    !msgpack2json(buf, off, left, &(p+i)->key) ||
-                    !try_to_write(buf, off, left, ":", 1)  ||
-                    !msgpack2json(buf, off, left, &(p+i)->val) ) {
-                    goto msg2json_end;
-
-                }
+        for (i = 0; i < loop; i++) {
+            if ((i > 0 && json_cat(s, ", ", 2) == -1) ||
+                msgpack2json(s, &o->via.map.ptr[i].key) == -1 ||
+                json_cat(s, ":", 1) == -1 ||
+                msgpack2json(s, &o->via.map.ptr[i].val) == -1) {
+                return -1;
             }
         }
-
-        ret = try_to_write(buf, off, left, "}", 1);
-        break;
+        return json_cat(s, "}", 1);
 
     default:
         flb_warn("[%s] unknown msgpack type %i", __FUNCTION__, o->type);
     }
 
- msg2json_end:
+    return -1;
+}
+
+/*
+ * Release the sds header of a string so it can be returned to callers that
+ * expect a plain buffer to be released with flb_free().
+ */
+static char *json_sds_to_str(flb_sds_t s)
+{
+    char *buf;
+    size_t len;
+
+    buf = (char *) FLB_SDS_HEADER(s);
+    len = flb_sds_len(s);
+    memmove(buf, s, len + 1);
+
+    return buf;
+}
+
+/**
+ *  Append the JSON representation of a msgpack object to a sds string.
+ *
+ *  @param  s         The sds string, it's updated if the buffer grows.
+ *  @param  obj       The msgpack object.
+ *  @return success   ? 0 : -1, on error the string is still valid.
+ */
+int flb_msgpack_to_json_sds(flb_sds_t *s, msgpack_object *obj)
+{
+    int ret;
+
+    if (s == NULL || *s == NULL || obj == NULL) {
+        return -1;
+    }
+
+    ret = msgpack2json(s, obj);
+    (*s)[flb_sds_len(*s)] = '\0';
+
     return ret;
 }
 
@@ -503,30 +350,40 @@ static int msgpack2json(char *buf, int *off, size_t left, msgpack_object *o)
 int flb_msgpack_to_json(char *json_str, size_t json_size,
                         msgpack_object *obj)
 {
-    int ret = -1;
-    int off = 0;
+    int ret;
+    size_t len;
+    flb_sds_t s;
 
     if (json_str == NULL || obj == NULL) {
         return -1;
     }
 
-    ret = msgpack2json(json_str, &off, json_size, obj);
-    json_str[off] = '\0';
-    return ret ? off: ret;
+    s = flb_sds_create_size(json_size);
+    if (!s) {
+        return -1;
+    }
+
+    ret = flb_msgpack_to_json_sds(&s, obj);
+    len = flb_sds_len(s);
+    if (ret == -1 || len >= json_size) {
+        flb_sds_destroy(s);
+        return -1;
+    }
+
+    memcpy(json_str, s, len + 1);
+    flb_sds_destroy(s);
+
+    return len;
 }
 
 flb_sds_t flb_msgpack_raw_to_json_sds(void *in_buf, size_t in_size)
 {
     int ret;
     size_t off = 0;
-    size_t out_size;
     msgpack_unpacked result;
-    msgpack_object *root;
     flb_sds_t out_buf;
-    flb_sds_t tmp_buf;
 
-    out_size = in_size * 1.5;
-    out_buf = flb_sds_create_size(out_size);
+    out_buf = flb_sds_create_size(in_size * 1.5);
     if (!out_buf) {
         flb_errno();
         return NULL;
@@ -534,37 +391,20 @@ flb_sds_t flb_msgpack_raw_to_json_sds(void *in_buf, size_t in_size)
 
     msgpack_unpacked_init(&result);
     msgpack_unpack_next(&result, in_buf, in_size, &off);
-    root = &result.data;
-
-    while (1) {
-        ret = flb_msgpack_to_json(out_buf, out_size, root);
-        if (ret <= 0) {
-            tmp_buf = flb_sds_increase(out_buf, 256);
-            if (tmp_buf) {
-                out_buf = tmp_buf;
-                out_size += 256;
-            }
-            else {
-                flb_errno();
-                flb_sds_destroy(out_buf);
-                msgpack_unpacked_destroy(&result);
-                return NULL;
-            }
-        }
-        else {
-            break;
-        }
-    }
 
+    ret = flb_msgpack_to_json_sds(&out_buf, &result.data);
     msgpack_unpacked_destroy(&result);
-    flb_sds_len_set(out_buf, ret);
+    if (ret == -1) {
+        flb_errno();
+        flb_sds_destroy(out_buf);
+        return NULL;
+    }
 
     return out_buf;
 }
 
 /**
  *  convert msgpack to JSON string.
- *  This API is similar to snprintf.
  *  @param  size     Estimated length of json str.
  *  @param  data     The msgpack_unpacked data.
  *  @return success  ? allocated json str ptr : NULL
@@ -572,8 +412,7 @@ flb_sds_t flb_msgpack_raw_to_json_sds(void *in_buf, size_t in_size)
 char *flb_msgpack_to_json_str(size_t size, msgpack_object *obj)
 {
     int ret;
-    char *buf = NULL;
-    char *tmp;
+    flb_sds_t s;
 
     if (obj == NULL) {
         return NULL;
@@ -583,33 +422,19 @@ char *flb_msgpack_to_json_str(size_t size, msgpack_object *obj)
         size = 128;
     }
 
-    buf = flb_malloc(size);
-    if (!buf) {
+    s = flb_sds_create_size(size);
+    if (!s) {
         flb_errno();
         return NULL;
     }
 
-    while (1) {
-        ret = flb_msgpack_to_json(buf, size, obj);
-        if (ret <= 0) {
-            /* buffer is small. retry.*/
-            size += 128;
-            tmp = flb_realloc(buf, size);
-            if (tmp) {
-                buf = tmp;
-            }
-            else {
-                flb_free(buf);
-                flb_errno();
-                return NULL;
-            }
-        }
-        else {
-            break;
-        }
+    ret = flb_msgpack_to_json_sds(&s, obj);
+    if (ret == -1) {
+        flb_sds_destroy(s);
+        return NULL;
     }
 
-    return buf;
+    return json_sds_to_str(s);
 }
 
 int flb_msgpack_raw_to_json_str(char *buf, size_t buf_size,
@@ -617,9 +442,8 @@ int flb_msgpack_raw_to_json_str(char *buf, size_t buf_size,
 {
     int ret;
     size_t off = 0;
-    size_t json_size;
-    char *json_buf;
-    char *tmp;
+    size_t len;
+    flb_sds_t s;
     msgpack_unpacked result;
 
     if (!buf || buf_size <= 0) {
@@ -632,35 +456,24 @@ int flb_msgpack_raw_to_json_str(char *buf, size_t buf_size,
         return -1;
     }
 
-    json_size = (buf_size * 1.2);
-    json_buf = flb_calloc(1, json_size);
-    if (!json_buf) {
+    s = flb_sds_create_size(buf_size * 1.2);
+    if (!s) {
         flb_errno();
         msgpack_unpacked_destroy(&result);
         return -1;
     }
 
-    while (1) {
-        ret = flb_msgpack_to_json(json_buf, json_size, &result.data);
-        if (ret <= 0) {
-            json_size += 128;
-            tmp = flb_realloc(json_buf, json_size);
-            if (!tmp) {
-                flb_errno();
-                flb_free(json_buf);
-                msgpack_unpacked_destroy(&result);
-                return -1;
-            }
-            json_buf = tmp;
-            continue;
-        }
-        break;
+    ret = flb_msgpack_to_json_sds(&s, &result.data);
+    msgpack_unpacked_destroy(&result);
+    if (ret == -1) {
+        flb_sds_destroy(s);
+        return -1;
     }
 
-    *out_buf = json_buf;
-    *out_size = ret;
+    len = flb_sds_len(s);
+    *out_buf = json_sds_to_str(s);
+    *out_size = len;
 
-    msgpack_unpacked_destroy(&result);
     return 0;
 }
 
@@ -32,6 +32,7 @@
 #include <time.h>
 #include <limits.h>
 #include <string.h>
+#include <ctype.h>
 
 static inline uint32_t digits10(uint64_t v) {
     if (v < 10) return 1;
@@ -81,6 +82,234 @@ static unsigned u64_to_str(uint64_t value, char* dst) {
     return length;
 }
 
+static const char *time_months[] = {
+    "jan", "feb", "mar", "apr", "may", "jun",
+    "jul", "aug", "sep", "oct", "nov", "dec"
+};
+
+/*
+ * Check if a time format only uses the conversions known by
+ * time_fast_parse(): %Y, %m, %d, %H, %M, %S, %b and %z.
+ */
+static int time_fast_supported(char *fmt)
+{
+    char *p;
+
+    for (p = fmt; *p != '\0'; p++) {
+        if (*p != '%') {
+            if (*p == ' ' || !isspace(*p)) {
+                continue;
+            }
+            return FLB_FALSE;
+        }
+
+        p++;
+        switch (*p) {
+        case 'Y':
+        case 'm':
+        case 'd':
+        case 'H':
+        case 'M':
+        case 'S':
+        case 'b':
+        case 'z':
+            break;
+        default:
+            return FLB_FALSE;
+        }
+    }
+
+    return FLB_TRUE;
+}
+
+static inline int time_fast_digits(char *p, char *end, int n, int *out)
+{
+    int i;
+    int val = 0;
+
+    if (end - p < n) {
+        return -1;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (p[i] < '0' || p[i] > '9') {
+            return -1;
+        }
+        val = (val * 10) + (p[i] - '0');
+    }
+
+    *out = val;
+    return 0;
+}
+
+/*
+ * Resolve the fixed width layouts used by ISO8601/RFC3339, Apache/nginx and
+ * Syslog timestamps without strptime(3). It only succeeds on input that
+ * strptime(3) would read the same way (two digits fields, abbreviated month
+ * names, single spaces), anything else returns NULL and the caller falls
+ * back to strptime(3).
+ */
+static char *time_fast_parse(char *str, char *end, char *fmt, struct tm *tm)
+{
+    int i;
+    int val;
+    int min;
+    char *p = str;
+    char *f;
+
+    for (f = fmt; *f != '\0'; f++) {
+        if (*f != '%') {
+            if (p >= end || *p != *f) {
+                return NULL;
+            }
+            p++;
+            continue;
+        }
+
+        f++;
+        switch (*f) {
+        case 'Y':
+            if (time_fast_digits(p, end, 4, &val) == -1) {
+                return NULL;
+            }
+            tm->tm_year = val - 1900;
+            p += 4;
+            break;
+        case 'm':
+            if (time_fast_digits(p, end, 2, &val) == -1 ||
+                val < 1 || val > 12) {
+                return NULL;
+            }
+            tm->tm_mon = val - 1;
+            p += 2;
+            break;
+        case 'd':
+            if (time_fast_digits(p, end, 2, &val) == -1 ||
+                val < 1 || val > 31) {
+                return NULL;
+            }
+            tm->tm_mday = val;
+            p += 2;
+            break;
+        case 'H':
+            if (time_fast_digits(p, end, 2, &val) == -1 || val > 23) {
+                return NULL;
+            }
+            tm->tm_hour = val;
+            p += 2;
+            break;
+        case 'M':
+            if (time_fast_digits(p, end, 2, &val) == -1 || val > 59) {
+                return NULL;
+            }
+            tm->tm_min = val;
+            p += 2;
+            break;
+        case 'S':
+            if (time_fast_digits(p, end, 2, &val) == -1 || val > 61) {
+                return NULL;
+            }
+            tm->tm_sec = val;
+            p += 2;
+            break;
+        case 'b':
+            /* full month names are left to strptime(3) */
+            if (end - p < 3 || (end - p > 3 && isalpha(p[3]))) {
+                return NULL;
+            }
+            for (i = 0; i < 12; i++) {
+                if (strncasecmp(p, time_months[i], 3) == 0) {
+                    break;
+                }
+            }
+            if (i == 12) {
+                return NULL;
+            }
+            tm->tm_mon = i;
+            p += 3;
+            break;
+        case 'z':
+            if (p < end && *p == 'Z') {
+                tm->tm_gmtoff = 0;
+                p++;
+                break;
+            }
+            if (end - p < 5 || (*p != '+' && *p != '-')) {
+                return NULL;
+            }
+            if (time_fast_digits(p + 1, end, 2, &val) == -1) {
+                return NULL;
+            }
+            if (p[3] == ':') {
+                if (time_fast_digits(p + 4, end, 2, &min) == -1) {
+                    return NULL;
+                }
+                i = 6;
+            }
+            else {
+                if (time_fast_digits(p + 3, end, 2, &min) == -1) {
+                    return NULL;
+                }
+                i = 5;
+            }
+            if (p + i < end && isdigit(p[i])) {
+                return NULL;
+            }
+            if (val > 12 || min > 59) {
+                return NULL;
+            }
+            val = (val * 3600) + (min * 60);
+            tm->tm_gmtoff = (*p == '-') ? -val : val;
+            p += i;
+            break;
+        default:
+            return NULL;
+        }
+    }
+
+    return p;
+}
+
+/*
+ * Run strptime(3) through the parser time cache: consecutive records
+ * usually carry the same second, so if the bytes consumed by the format and
+ * the one that follows them are the same than the last resolved string,
+ * the broken-down time is reused. The cache is skipped when another thread
+ * holds it.
+ */
+static char *time_cached_parse(struct flb_parser *parser,
+                               char *str, int len, char *fmt, struct tm *tm)
+{
+    int n;
+    char *p;
+    struct flb_parser_time_cache *c = &parser->time_cache;
+
+    if (pthread_mutex_trylock(&c->lock) != 0) {
+        return strptime(str, fmt, tm);
+    }
+
+    n = c->consumed;
+    if (n > 0 && n <= len && memcmp(c->key, str, n + 1) == 0) {
+        *tm = c->tm;
+        pthread_mutex_unlock(&c->lock);
+        return str + n;
+    }
+
+    p = strptime(str, fmt, tm);
+    if (p != NULL) {
+        n = p - str;
+        if (n < sizeof(c->key) - 1) {
+            /* include the next byte (or the NULL terminator) in the key */
+            memcpy(c->key, str, n + 1);
+            c->consumed = n;
+            c->tm = *tm;
+        }
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    return p;
+}
+
 int flb_parser_regex_do(struct flb_parser *parser,
                         char *buf, size_t length,
                         void **out_buf, size_t *out_size,
@@ -91,15 +320,196 @@ int flb_parser_json_do(struct flb_parser *parser,
                        void **out_buf, size_t *out_size,
                        struct flb_time *out_time);
 
-struct flb_parser *flb_parser_create(char *name, char *format,
-                                     char *p_regex,
-                                     char *time_fmt, char *time_key,
-                                     char *time_offset,
-                                     int time_keep,
-                                     struct flb_parser_types *types,
-                                     int types_len,
-                                     struct mk_list *decoders,
-                                     struct flb_config *config)
+int flb_parser_logfmt_do(struct flb_parser *parser,
+                         char *buf, size_t length,
+                         void **out_buf, size_t *out_size,
+                         struct flb_time *out_time);
+
+int flb_parser_ltsv_do(struct flb_parser *parser,
+                       char *buf, size_t length,
+                       void **out_buf, size_t *out_size,
+                       struct flb_time *out_time);
+
+int flb_parser_regex_compile(struct flb_parser *parser,
+                             struct flb_regex *regex);
+void flb_parser_regex_release(struct flb_parser *parser);
+
+/*
+ * Types index
+ * -----------
+ * The types of a parser are resolved for every field of every record. The
+ * keys are placed in a table with a hash seed chosen so none of them share
+ * a slot, a lookup costs one hash and one comparison no matter how many
+ * types are declared.
+ */
+#define FLB_PARSER_TYPES_SEEDS      64
+#define FLB_PARSER_TYPES_MAX_TABLE  (1 << 16)
+
+static inline uint32_t types_hash(char *key, int len, uint32_t seed)
+{
+    int i;
+    uint32_t h = 2166136261U ^ (seed * 0x9e3779b9U);
+
+    for (i = 0; i < len; i++) {
+        h ^= (unsigned char) key[i];
+        h *= 16777619U;
+    }
+
+    return h ^ (h >> 15);
+}
+
+static int types_index_fill(struct flb_parser *p, int *table,
+                            uint32_t mask, uint32_t seed)
+{
+    int i;
+    int idx;
+    uint32_t h;
+    struct flb_parser_types *t;
+
+    memset(table, '\0', sizeof(int) * (mask + 1));
+    for (i = 0; i < p->types_len; i++) {
+        t = &p->types[i];
+        if (!t->key) {
+            continue;
+        }
+
+        h = types_hash(t->key, t->key_len, seed) & mask;
+        idx = table[h];
+        if (idx == 0) {
+            table[h] = i + 1;
+            continue;
+        }
+
+        /* A repeated key keeps its first type */
+        if (p->types[idx - 1].key_len == t->key_len &&
+            memcmp(p->types[idx - 1].key, t->key, t->key_len) == 0) {
+            continue;
+        }
+        return -1;
+    }
+
+    return 0;
+}
+
+static void types_index_create(struct flb_parser *p)
+{
+    int ret;
+    int *table;
+    uint32_t seed;
+    uint32_t size = 8;
+
+    p->types_table = NULL;
+    if (p->types_len == 0) {
+        return;
+    }
+
+    while (size < p->types_len * 2) {
+        size <<= 1;
+    }
+
+    /* If no table fits the keys the lookup falls back to a plain scan */
+    for (; size <= FLB_PARSER_TYPES_MAX_TABLE; size <<= 1) {
+        table = flb_malloc(sizeof(int) * size);
+        if (!table) {
+            flb_errno();
+            return;
+        }
+
+        for (seed = 0; seed < FLB_PARSER_TYPES_SEEDS; seed++) {
+            ret = types_index_fill(p, table, size - 1, seed);
+            if (ret == 0) {
+                p->types_table = table;
+                p->types_mask = size - 1;
+                p->types_seed = seed;
+                return;
+            }
+        }
+        flb_free(table);
+    }
+}
+
+/* Get the type declared for a key, zero if there is none */
+int flb_parser_type_lookup(struct flb_parser *parser, char *key, int key_len)
+{
+    int i;
+    int idx;
+    uint32_t h;
+    struct flb_parser_types *t;
+
+    if (parser->types_len == 0) {
+        return 0;
+    }
+
+    if (parser->types_table) {
+        h = types_hash(key, key_len, parser->types_seed) & parser->types_mask;
+        idx = parser->types_table[h];
+        if (idx == 0) {
+            return 0;
+        }
+        t = &parser->types[idx - 1];
+        if (t->key_len == key_len && memcmp(t->key, key, key_len) == 0) {
+            return t->type;
+        }
+        return 0;
+    }
+
+    for (i = 0; i < parser->types_len; i++) {
+        t = &parser->types[i];
+        if (t->key != NULL && t->key_len == key_len &&
+            strncmp(t->key, key, key_len) == 0) {
+            return t->type;
+        }
+    }
+
+    return 0;
+}
+
+/* Serialize the lazy compilation of parsers looked up by several threads */
+static pthread_mutex_t parser_compile_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Compile the pattern of a regex parser and build its capture map. Parsers
+ * with the same pattern share the compiled regex. It's published only once
+ * the capture map is complete: flb_parser_do() reads it without the lock.
+ */
+static int parser_regex_load(struct flb_parser *p)
+{
+    int ret;
+    struct flb_regex *regex;
+
+    regex = flb_regex_get((unsigned char *) p->p_regex);
+    if (!regex) {
+        flb_error("[parser:%s] Invalid regex pattern %s", p->name, p->p_regex);
+        return -1;
+    }
+
+    /* Resolve the regex named groups to keys and types */
+    ret = flb_parser_regex_compile(p, regex);
+    if (ret == -1) {
+        flb_error("[parser:%s] could not build capture map", p->name);
+        flb_regex_put(regex);
+        return -1;
+    }
+
+    __atomic_store_n(&p->regex, regex, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*
+ * Parsers from a parsers file are created with 'lazy' set: the pattern of a
+ * regex parser is compiled when a plugin looks it up, most of the parsers
+ * of a file are never referenced.
+ */
+static struct flb_parser *parser_create(char *name, char *format,
+                                        char *p_regex,
+                                        char *time_fmt, char *time_key,
+                                        char *time_offset,
+                                        int time_keep,
+                                        struct flb_parser_types *types,
+                                        int types_len,
+                                        struct mk_list *decoders,
+                                        int lazy,
+                                        struct flb_config *config)
 {
     int ret;
     int len;
@@ -108,7 +518,6 @@ struct flb_parser *flb_parser_create(char *name, char *format,
     char *tmp;
     struct mk_list *head;
     struct flb_parser *p;
-    struct flb_regex *regex;
 
     /* Iterate current parsers and make sure the new one don't exists */
     mk_list_foreach(head, &config->parsers) {
@@ -127,6 +536,7 @@ struct flb_parser *flb_parser_create(char *name, char *format,
         return NULL;
     }
     p->decoders = decoders;
+    pthread_mutex_init(&p->time_cache.lock, NULL);
 
     /* Format lookup */
     if (strcmp(format, "regex") == 0) {
@@ -135,30 +545,28 @@ struct flb_parser *flb_parser_create(char *name, char *format,
     else if (strcmp(format, "json") == 0) {
         p->type = FLB_PARSER_JSON;
     }
+    else if (strcmp(format, "logfmt") == 0) {
+        p->type = FLB_PARSER_LOGFMT;
+    }
+    else if (strcmp(format, "ltsv") == 0) {
+        p->type = FLB_PARSER_LTSV;
+    }
     else {
         flb_error("[parser:%s] Invalid format %s", name, format);
         flb_free(p);
         return NULL;
     }
 
-    if (p->type == FLB_PARSER_REGEX) {
-        if (!p_regex) {
-            flb_error("[parser:%s] Invalid regex pattern", name);
-            flb_free(p);
-            return NULL;
-        }
-
-        regex = flb_regex_create((unsigned char *) p_regex);
-        if (!regex) {
-            flb_error("[parser:%s] Invalid regex pattern %s", name, p_regex);
-            flb_free(p);
-            return NULL;
-        }
-        p->regex = regex;
-        p->p_regex = flb_strdup(p_regex);
+    if (p->type == FLB_PARSER_REGEX && !p_regex) {
+        flb_error("[parser:%s] Invalid regex pattern", name);
+        flb_free(p);
+        return NULL;
     }
 
     p->name = flb_strdup(name);
+    if (p->type == FLB_PARSER_REGEX) {
+        p->p_regex = flb_strdup(p_regex);
+    }
 
     if (time_fmt) {
         p->time_fmt = flb_strdup(time_fmt);
@@ -218,6 +626,14 @@ struct flb_parser *flb_parser_create(char *name, char *format,
             p->time_frac_secs = NULL;
         }
 
+        /* Can the format be resolved by the built-in scanner ? */
+        if (p->time_with_year == FLB_TRUE) {
+            p->time_fast = time_fast_supported(p->time_fmt);
+        }
+        else {
+            p->time_fast = time_fast_supported(p->time_fmt_year);
+        }
+
         /* Check if the format contains a timezone (%z) */
         tmp = strstr(p->time_fmt, "%z");
         if (tmp) {
@@ -247,17 +663,42 @@ struct flb_parser *flb_parser_create(char *name, char *format,
     p->time_keep = time_keep;
     p->types = types;
     p->types_len = types_len;
+    types_index_create(p);
 
     mk_list_add(&p->_head, &config->parsers);
 
+    /* The capture map needs the time key and the types */
+    if (p->type == FLB_PARSER_REGEX && !lazy && parser_regex_load(p) == -1) {
+        flb_parser_destroy(p);
+        return NULL;
+    }
+
     return p;
 }
 
+struct flb_parser *flb_parser_create(char *name, char *format,
+                                     char *p_regex,
+                                     char *time_fmt, char *time_key,
+                                     char *time_offset,
+                                     int time_keep,
+                                     struct flb_parser_types *types,
+                                     int types_len,
+                                     struct mk_list *decoders,
+                                     struct flb_config *config)
+{
+    return parser_create(name, format, p_regex, time_fmt, time_key,
+                         time_offset, time_keep, types, types_len, decoders,
+                         FLB_FALSE, config);
+}
+
 void flb_parser_destroy(struct flb_parser *parser)
 {
     int i = 0;
     if (parser->type == FLB_PARSER_REGEX) {
-        flb_regex_destroy(parser->regex);
+        flb_parser_regex_release(parser);
+        if (parser->regex) {
+            flb_regex_put(parser->regex);
+        }
         flb_free(parser->p_regex);
     }
 
@@ -277,11 +718,15 @@ void flb_parser_destroy(struct flb_parser *parser)
         }
         flb_free(parser->types);
     }
+    if (parser->types_table) {
+        flb_free(parser->types_table);
+    }
 
     if (parser->decoders) {
         flb_parser_decoder_list_destroy(parser->decoders);
     }
 
+    pthread_mutex_destroy(&parser->time_cache.lock);
     mk_list_del(&parser->_head);
     flb_free(parser);
 }
@@ -327,7 +772,7 @@ static int proc_types_str(char *types_str, struct flb_parser_types **types)
         *type_str = '\0'; /* for strdup */
         (*types)[i].key = flb_strdup(sentry->value);
         (*types)[i].key_len = strlen(sentry->value);
-        *types_str = ':';
+        *type_str = ':';
 
         type_str++;
         if (!strcasecmp(type_str, "integer")) {
@@ -356,6 +801,8 @@ static int proc_types_str(char *types_str, struct flb_parser_types **types)
 int flb_parser_conf_file(char *file, struct flb_config *config)
 {
     int ret;
+    int count = 0;
+    uint64_t start;
     char tmp[PATH_MAX + 1];
     char *cfg = NULL;
     char *name;
@@ -393,6 +840,7 @@ int flb_parser_conf_file(char *file, struct flb_config *config)
     }
 
     flb_debug("[parser] opening file %s", cfg);
+    start = flb_time_usec();
     fconf = mk_rconf_open(cfg);
     if (!fconf) {
         return -1;
@@ -471,13 +919,14 @@ int flb_parser_conf_file(char *file, struct flb_config *config)
         decoders = flb_parser_decoder_list_create(section);
 
         /* Create the parser context */
-        if (!flb_parser_create(name, format, regex,
-                               time_fmt, time_key, time_offset, time_keep,
-                               types, types_len, decoders, config)) {
+        if (!parser_create(name, format, regex,
+                           time_fmt, time_key, time_offset, time_keep,
+                           types, types_len, decoders, FLB_TRUE, config)) {
             goto fconf_error;
         }
 
         flb_debug("[parser] new parser registered: %s", name);
+        count++;
 
         flb_free(name);
         flb_free(format);
@@ -502,6 +951,8 @@ int flb_parser_conf_file(char *file, struct flb_config *config)
     }
 
     mk_rconf_free(fconf);
+    flb_debug("[parser] %i parsers loaded from %s in %.1f ms", count, cfg,
+              (flb_time_usec() - start) / 1000.0);
     return 0;
 
  fconf_error:
@@ -531,12 +982,30 @@ struct flb_parser *flb_parser_get(char *name, struct flb_config *config)
     struct mk_list *head;
     struct flb_parser *parser;
 
+    /* The parsers of the engine shards are the ones of the main engine */
+    if (config->shard_parent) {
+        config = config->shard_parent;
+    }
 
     mk_list_foreach(head, &config->parsers) {
         parser = mk_list_entry(head, struct flb_parser, _head);
-        if (strcmp(parser->name, name) == 0) {
-            return parser;
+        if (strcmp(parser->name, name) != 0) {
+            continue;
+        }
+
+        /* First use of a parser loaded lazily */
+        if (parser->type == FLB_PARSER_REGEX) {
+            pthread_mutex_lock(&parser_compile_lock);
+            if (!parser->regex && !parser->regex_failed &&
+                parser_regex_load(parser) == -1) {
+                parser->regex_failed = FLB_TRUE;
+            }
+            pthread_mutex_unlock(&parser_compile_lock);
+            if (!parser->regex) {
+                return NULL;
+            }
         }
+        return parser;
     }
 
     return NULL;
@@ -545,17 +1014,33 @@ struct flb_parser *flb_parser_get(char *name, struct flb_config *config)
 int flb_parser_do(struct flb_parser *parser, char *buf, size_t length,
                   void **out_buf, size_t *out_size, struct flb_time *out_time)
 {
+    int ret = -1;
+    FLB_MEM_SCOPE_ENTER(FLB_MEM_PARSER);
 
     if (parser->type == FLB_PARSER_REGEX) {
-        return flb_parser_regex_do(parser, buf, length,
-                                   out_buf, out_size, out_time);
+        if (!__atomic_load_n(&parser->regex, __ATOMIC_ACQUIRE)) {
+            /* loaded lazily and never looked up with flb_parser_get() */
+            FLB_MEM_SCOPE_LEAVE();
+            return -1;
+        }
+        ret = flb_parser_regex_do(parser, buf, length,
+                                  out_buf, out_size, out_time);
     }
     else if (parser->type == FLB_PARSER_JSON) {
-        return flb_parser_json_do(parser, buf, length,
-                                  out_buf, out_size, out_time);
+        ret = flb_parser_json_do(parser, buf, length,
+                                 out_buf, out_size, out_time);
+    }
+    else if (parser->type == FLB_PARSER_LOGFMT) {
+        ret = flb_parser_logfmt_do(parser, buf, length,
+                                   out_buf, out_size, out_time);
+    }
+    else if (parser->type == FLB_PARSER_LTSV) {
+        ret = flb_parser_ltsv_do(parser, buf, length,
+                                 out_buf, out_size, out_time);
     }
 
-    return -1;
+    FLB_MEM_SCOPE_LEAVE();
+    return ret;
 }
 
 /* Given a timezone string, return it numeric offset */
@@ -619,8 +1104,9 @@ int flb_parser_time_lookup(char *time_str, size_t tsize,
     double tmfrac = 0;
     char *p = NULL;
     char *fmt;
+    char *time_fmt;
     int time_len = tsize;
-    char *time_ptr = time_str;
+    char *time_ptr;
     char tmp[64];
     char fs_tmp[32];
     struct tm tmy;
@@ -662,16 +1148,28 @@ int flb_parser_time_lookup(char *time_str, size_t tsize,
         fmt += 4;
         *fmt++ = ' ';
 
-        memcpy(fmt, time_ptr, time_len);
+        memcpy(fmt, time_str, time_len);
         fmt += time_len;
         *fmt++ = '\0';
 
-        time_ptr = tmp;
-        time_len = strlen(tmp);
-        p = strptime(time_ptr, parser->time_fmt_year, tm);
+        time_len += 5;
+        time_fmt = parser->time_fmt_year;
     }
     else {
-        p = strptime(time_ptr, parser->time_fmt, tm);
+        /* strptime(3) expects a NULL terminated string */
+        memcpy(tmp, time_str, time_len);
+        tmp[time_len] = '\0';
+        time_fmt = parser->time_fmt;
+    }
+    time_ptr = tmp;
+
+    memset(tm, '\0', sizeof(struct tm));
+    if (parser->time_fast == FLB_TRUE) {
+        p = time_fast_parse(time_ptr, time_ptr + time_len, time_fmt, tm);
+    }
+    if (p == NULL) {
+        memset(tm, '\0', sizeof(struct tm));
+        p = time_cached_parse(parser, time_ptr, time_len, time_fmt, tm);
     }
 
     if (p != NULL) {
@@ -747,97 +1245,78 @@ int flb_parser_frac_tzone(char *str, int len, double *frac, int *tmdiff)
     return 0;
 }
 
-int flb_parser_typecast(char *key, int key_len,
-                        char *val, int val_len,
-                        msgpack_packer *pck,
-                        struct flb_parser_types *types,
-                        int types_len)
+/*
+ * Pack a single value converted to the given type. If the conversion is
+ * not possible the value is packed as a string.
+ */
+int flb_parser_typecast_value(char *key, int type,
+                              char *val, int val_len,
+                              msgpack_packer *pck)
 {
-    int i;
     int error = FLB_FALSE;
     char tmp_char;
-    int casted = FLB_FALSE;
-
-    for(i=0; i<types_len; i++){
-        if (types[i].key != NULL
-            && key_len == types[i].key_len &&
-            !strncmp(key, types[i].key, key_len)) {
-
-            casted = FLB_TRUE;
-
-            msgpack_pack_str(pck, key_len);
-            msgpack_pack_str_body(pck, key, key_len);
-
-            switch (types[i].type) {
-            case FLB_PARSER_TYPE_INT:
-                {
-                    long long lval;
-
-                    /* msgpack char is not null terminated.
-                       So backup and fill null char,
-                       convert int,
-                       rewind char.
-                     */
-                    tmp_char = val[val_len];
-                    val[val_len] = '\0';
-                    lval = atoll(val);
-                    val[val_len] = tmp_char;
-                    msgpack_pack_int64(pck, lval);
-                }
-                break;
-            case FLB_PARSER_TYPE_HEX:
-                {
-                    unsigned long long lval;
-                    tmp_char = val[val_len];
-                    val[val_len] = '\0';
-                    lval = strtoull(val, NULL, 16);
-                    val[val_len] = tmp_char;
-                    msgpack_pack_uint64(pck, lval);
-                }
-                break;
 
-            case FLB_PARSER_TYPE_FLOAT:
-                {
-                    double dval;
-                    tmp_char = val[val_len];
-                    val[val_len] = '\0';
-                    dval = atof(val);
-                    val[val_len] = tmp_char;
-                    msgpack_pack_double(pck, dval);
-                }
-                break;
-            case FLB_PARSER_TYPE_BOOL:
-                if (!strncasecmp(val, "true", 4)) {
-                    msgpack_pack_true(pck);
-                }
-                else if(!strncasecmp(val, "false", 5)){
-                    msgpack_pack_false(pck);
-                }
-                else {
-                    error = FLB_TRUE;
-                }
-                break;
-            case FLB_PARSER_TYPE_STRING:
-                msgpack_pack_str(pck, val_len);
-                msgpack_pack_str_body(pck, val, val_len);
-                break;
-            default:
-                error = FLB_TRUE;
-            }
-            if (error == FLB_TRUE) {
-                flb_warn("[PARSER] key=%s cast error. save as string.", key);
-                msgpack_pack_str(pck, val_len);
-                msgpack_pack_str_body(pck, val, val_len);
-            }
-            break;
+    switch (type) {
+    case FLB_PARSER_TYPE_INT:
+        {
+            long long lval;
+
+            /* msgpack char is not null terminated.
+               So backup and fill null char,
+               convert int,
+               rewind char.
+             */
+            tmp_char = val[val_len];
+            val[val_len] = '\0';
+            lval = atoll(val);
+            val[val_len] = tmp_char;
+            msgpack_pack_int64(pck, lval);
+        }
+        break;
+    case FLB_PARSER_TYPE_HEX:
+        {
+            unsigned long long lval;
+            tmp_char = val[val_len];
+            val[val_len] = '\0';
+            lval = strtoull(val, NULL, 16);
+            val[val_len] = tmp_char;
+            msgpack_pack_uint64(pck, lval);
+        }
+        break;
+
+    case FLB_PARSER_TYPE_FLOAT:
+        {
+            double dval;
+            tmp_char = val[val_len];
+            val[val_len] = '\0';
+            dval = atof(val);
+            val[val_len] = tmp_char;
+            msgpack_pack_double(pck, dval);
         }
+        break;
+    case FLB_PARSER_TYPE_BOOL:
+        if (!strncasecmp(val, "true", 4)) {
+            msgpack_pack_true(pck);
+        }
+        else if(!strncasecmp(val, "false", 5)){
+            msgpack_pack_false(pck);
+        }
+        else {
+            error = FLB_TRUE;
+        }
+        break;
+    case FLB_PARSER_TYPE_STRING:
+        msgpack_pack_str(pck, val_len);
+        msgpack_pack_str_body(pck, val, val_len);
+        break;
+    default:
+        error = FLB_TRUE;
     }
-
-    if (casted == FLB_FALSE) {
-        msgpack_pack_str(pck, key_len);
-        msgpack_pack_str_body(pck, key, key_len);
+    if (error == FLB_TRUE) {
+        flb_warn("[PARSER] key=%s cast error. save as string.", key);
         msgpack_pack_str(pck, val_len);
         msgpack_pack_str_body(pck, val, val_len);
     }
+
     return 0;
 }
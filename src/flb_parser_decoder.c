@@ -19,242 +19,62 @@
 
 #include <fluent-bit/flb_info.h>
 #include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_arena.h>
 #include <fluent-bit/flb_str.h>
 #include <fluent-bit/flb_log.h>
 #include <fluent-bit/flb_pack.h>
 #include <fluent-bit/flb_parser_decoder.h>
+#include <fluent-bit/flb_mp.h>
 #include <fluent-bit/flb_utils.h>
+#include <fluent-bit/flb_unescape.h>
 #include <msgpack.h>
 
 #define TYPE_OUT_STRING  0  /* unstructured text         */
 #define TYPE_OUT_OBJECT  1  /* structured msgpack object */
 
-static int octal_digit(char c)
-{
-    return (c >= '0' && c <= '7');
-}
-
-static int hex_digit(char c)
-{
-    return ((c >= '0' && c <= '9') ||
-            (c >= 'A' && c <= 'F') ||
-            (c >= 'a' && c <= 'f'));
-}
-
-static int u8_wc_toutf8(char *dest, u_int32_t ch)
-{
-    if (ch < 0x80) {
-        dest[0] = (char)ch;
-        return 1;
-    }
-    if (ch < 0x800) {
-        dest[0] = (ch>>6) | 0xC0;
-        dest[1] = (ch & 0x3F) | 0x80;
-        return 2;
-    }
-    if (ch < 0x10000) {
-        dest[0] = (ch>>12) | 0xE0;
-        dest[1] = ((ch>>6) & 0x3F) | 0x80;
-        dest[2] = (ch & 0x3F) | 0x80;
-        return 3;
-    }
-    if (ch < 0x110000) {
-        dest[0] = (ch>>18) | 0xF0;
-        dest[1] = ((ch>>12) & 0x3F) | 0x80;
-        dest[2] = ((ch>>6) & 0x3F) | 0x80;
-        dest[3] = (ch & 0x3F) | 0x80;
-        return 4;
-    }
-    return 0;
-}
-
-/* assumes that src points to the character after a backslash
-   returns number of input characters processed */
-static int u8_read_escape_sequence(char *str, u_int32_t *dest)
-{
-    u_int32_t ch;
-    char digs[9]="\0\0\0\0\0\0\0\0";
-    int dno=0, i=1;
-
-    ch = (u_int32_t)str[0];    /* take literal character */
-
-    if (str[0] == 'n')
-        ch = L'\n';
-    else if (str[0] == 't')
-        ch = L'\t';
-    else if (str[0] == 'r')
-        ch = L'\r';
-    else if (str[0] == 'b')
-        ch = L'\b';
-    else if (str[0] == 'f')
-        ch = L'\f';
-    else if (str[0] == 'v')
-        ch = L'\v';
-    else if (str[0] == 'a')
-        ch = L'\a';
-    else if (octal_digit(str[0])) {
-        i = 0;
-        do {
-            digs[dno++] = str[i++];
-        } while (octal_digit(str[i]) && dno < 3);
-        ch = strtol(digs, NULL, 8);
-    }
-    else if (str[0] == 'x') {
-        while (hex_digit(str[i]) && dno < 2) {
-            digs[dno++] = str[i++];
-        }
-        if (dno > 0)
-            ch = strtol(digs, NULL, 16);
-    }
-    else if (str[0] == 'u') {
-        while (hex_digit(str[i]) && dno < 4) {
-            digs[dno++] = str[i++];
-        }
-        if (dno > 0)
-            ch = strtol(digs, NULL, 16);
-    }
-    else if (str[0] == 'U') {
-        while (hex_digit(str[i]) && dno < 8) {
-            digs[dno++] = str[i++];
-        }
-        if (dno > 0)
-            ch = strtol(digs, NULL, 16);
-    }
-    *dest = ch;
-
-    return i;
-}
-
-static inline bool is_json_escape(char *c)
-{
-  return (
-        (*c == '\"') || // double-quote
-        (*c == '\'') || // single-quote
-        (*c == '\\') || // solidus
-        (*c == '/')     // reverse-solidus
-      );
-}
-
-static int unescape_string_utf8(char *in_buf, int sz, char *out_buf)
+/*
+ * Unescape the input into 'tmp' using the given mode. Strings that have
+ * nothing to unescape, the usual case, are returned as they are.
+ */
+static char *decode_unescape(char *in_buf, size_t in_size, char *tmp,
+                             int mode, size_t *out_size)
 {
-    u_int32_t ch;
-    char temp[4];
-    char *next;
-
-    int count_out = 0;
-    int count_in = 0;
-    int esc_in = 0;
-    int esc_out = 0;
-
-    while (*in_buf && count_in < sz) {
-        next = in_buf + 1;
-        if (*in_buf == '\\' && !is_json_escape(next)) {
-            esc_in = u8_read_escape_sequence((in_buf + 1), &ch) + 1;
-        }
-        else {
-            ch = (u_int32_t)*in_buf;
-            esc_in = 1;
-        }
-
-        in_buf += esc_in;
-        count_in += esc_in;
-
-        esc_out = u8_wc_toutf8(temp, ch);
-
-        if (esc_out > sz-count_out) {
-            flb_error("Crossing over string boundary");
-            break;
-        }
-        memcpy(&out_buf[count_out], temp, esc_out);
-        count_out += esc_out;
-    }
-    if (count_in < sz) {
-        flb_error("Not at boundary but still NULL terminating : %d - '%s'", sz, in_buf);
+    if (flb_unescape_span(in_buf, in_size, mode) == in_size) {
+        *out_size = in_size;
+        return in_buf;
     }
-    out_buf[count_in - 1] = '\0';
-    return count_out;
-}
 
-static int unescape_string(char *buf, int buf_len, char **unesc_buf)
-{
-    int i = 0;
-    int j = 0;
-    char *p;
-    char n;
-
-    p = *unesc_buf;
-    while (i < buf_len) {
-        if (buf[i] == '\\') {
-            if (i + 1 < buf_len) {
-                n = buf[i + 1];
-                if (n == 'n') {
-                    p[j++] = '\n';
-                    i++;
-                }
-                else if (n == 'a') {
-                    p[j++] = '\a';
-                    i++;
-                }
-                else if (n == 'b') {
-                    p[j++] = '\b';
-                    i++;
-                }
-                else if (n == 't') {
-                    p[j++] = '\t';
-                    i++;
-                }
-                else if (n == 'v') {
-                    p[j++] = '\v';
-                    i++;
-                }
-                else if (n == 'f') {
-                    p[j++] = '\f';
-                    i++;
-                }
-                else if (n == 'r') {
-                    p[j++] = '\r';
-                    i++;
-                }
-                i++;
-                continue;
-            }
-            else {
-                i++;
-            }
-        }
-        p[j++] = buf[i++];
-    }
-    p[j] = '\0';
-    return j;
+    *out_size = flb_unescape(in_buf, in_size, tmp, mode);
+    return tmp;
 }
 
 /* Decode a stringified JSON message */
-static int decode_json(struct flb_parser_dec *dec,
-                       char *in_buf, size_t in_size,
+static int decode_json(char *in_buf, size_t in_size, char *tmp,
                        char **out_buf, size_t *out_size, int *out_type)
 {
-    int len;
     int ret;
     char *buf;
+    char *json;
+    size_t len;
     size_t size;
 
     /* JSON Decoder: content may be escaped */
-    len = unescape_string(in_buf, in_size, &dec->buffer);
+    json = decode_unescape(in_buf, in_size, tmp, FLB_UNESCAPE_CONTROL, &len);
 
-    /* Is it JSON valid ? (pre validation to avoid mem allocation on tokens */
-    ret = flb_pack_json_valid(dec->buffer, len);
-    if (ret == -1) {
-        /* Invalid or no JSON Message */
+    /* It must be a map */
+    if (len == 0 || json[0] != '{') {
         return -1;
     }
 
-    /* It must be a map */
-    if (dec->buffer[0] != '{') {
+    /* Is it JSON valid ? (pre validation to avoid mem allocation on tokens */
+    ret = flb_pack_json_valid(json, len);
+    if (ret == -1) {
+        /* Invalid or no JSON Message */
         return -1;
     }
 
     /* Convert from unescaped JSON to MessagePack */
-    ret = flb_pack_json(dec->buffer, len, &buf, &size);
+    ret = flb_pack_json(json, len, &buf, &size);
     if (ret != 0) {
         return -1;
     }
@@ -266,422 +86,421 @@ static int decode_json(struct flb_parser_dec *dec,
     return 0;
 }
 
-static int decode_escaped(struct flb_parser_dec *dec,
-                          char *in_buf, size_t in_size,
+static int decode_escaped(char *in_buf, size_t in_size, char *tmp,
                           char **out_buf, size_t *out_size, int *out_type)
 {
-    int len;
-
-    /* Unescape string */
-    len = unescape_string(in_buf, in_size, &dec->buffer);
-    *out_buf = dec->buffer;
-    *out_size = len;
+    *out_buf = decode_unescape(in_buf, in_size, tmp,
+                               FLB_UNESCAPE_CONTROL, out_size);
     *out_type = TYPE_OUT_STRING;
 
     return 0;
 }
 
-static int decode_escaped_utf8(struct flb_parser_dec *dec,
-                          char *in_buf, size_t in_size,
-                          char **out_buf, size_t *out_size, int *out_type)
+static int decode_escaped_utf8(char *in_buf, size_t in_size, char *tmp,
+                               char **out_buf, size_t *out_size,
+                               int *out_type)
 {
-    int len;
-
-    len = unescape_string_utf8(in_buf, in_size, dec->buffer);
-    *out_buf = dec->buffer;
-    *out_size = len;
+    *out_buf = decode_unescape(in_buf, in_size, tmp,
+                               FLB_UNESCAPE_UTF8, out_size);
     *out_type = TYPE_OUT_STRING;
 
     return 0;
 }
 
-static int merge_record_and_extra_keys(char *in_buf, size_t in_size,
-                                       char *extra_buf, size_t extra_size,
-                                       char **out_buf, size_t *out_size)
+static struct flb_parser_dec *decoder_lookup(struct mk_list *decoders,
+                                             const char *key, int key_len)
+{
+    struct mk_list *head;
+    struct flb_parser_dec *dec;
+
+    mk_list_foreach(head, decoders) {
+        dec = mk_list_entry(head, struct flb_parser_dec, _head);
+        if (flb_sds_cmp(dec->key, (char *) key, key_len) == 0) {
+            return dec;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Locate the next map entry: key and value ranges, plus the decoder that
+ * applies to it (only string keys with string values are decoded).
+ */
+static int decoder_entry(struct mk_list *decoders, char *buf, size_t size,
+                         size_t *key_size, size_t *val_size,
+                         struct flb_parser_dec **dec)
 {
-    int i;
     int ret;
-    int map_size = 0;
-    size_t in_off = 0;
-    size_t extra_off = 0;
-    msgpack_sbuffer mp_sbuf;
-    msgpack_packer  mp_pck;
-    msgpack_unpacked in_result;
-    msgpack_unpacked extra_result;
-    msgpack_object k;
-    msgpack_object v;
-    msgpack_object map;
-
-    msgpack_unpacked_init(&in_result);
-    msgpack_unpacked_init(&extra_result);
-
-    /* Check if the extra buffer have some serialized data */
-    ret = msgpack_unpack_next(&extra_result, extra_buf, extra_size, &extra_off);
-    if (ret != MSGPACK_UNPACK_SUCCESS) {
-        msgpack_unpacked_destroy(&in_result);
-        msgpack_unpacked_destroy(&extra_result);
+    uint32_t key_len;
+    uint32_t val_len;
+    const char *key;
+    const char *val;
+
+    *dec = NULL;
+    ret = flb_mp_object_size(buf, size, key_size);
+    if (ret == -1) {
+        return -1;
+    }
+    ret = flb_mp_object_size(buf + *key_size, size - *key_size, val_size);
+    if (ret == -1) {
         return -1;
     }
-    msgpack_unpack_next(&in_result, in_buf, in_size, &in_off);
 
+    ret = flb_mp_str(buf, *key_size, &key, &key_len, key_size);
+    if (ret == -1) {
+        return 0;
+    }
+    ret = flb_mp_str(buf + *key_size, *val_size, &val, &val_len, val_size);
+    if (ret == -1) {
+        return 0;
+    }
 
-    msgpack_sbuffer_init(&mp_sbuf);
-    msgpack_packer_init(&mp_pck, &mp_sbuf, msgpack_sbuffer_write);
+    *dec = decoder_lookup(decoders, key, key_len);
+    return 0;
+}
+
+#define DECODER_SCRATCH_HEAP    0
+#define DECODER_SCRATCH_SHARED  1
+#define DECODER_SCRATCH_ARENA   2
 
-    map_size = in_result.data.via.map.size;
-    map_size += extra_result.data.via.map.size;
+/*
+ * Scratch space used by the rules of one field: two areas that can hold
+ * an unescaped value plus its NULL terminator (with some slack). Decoders
+ * reuse their own buffer, if another thread is using it a temporary one
+ * is taken from the filters arena, or allocated when there is none.
+ */
+static char *decoder_scratch(struct flb_parser_dec *dec, size_t size,
+                             int *owner)
+{
+    char *tmp;
+    flb_sds_t tmp_sds;
+    struct flb_arena *arena;
 
-    msgpack_pack_map(&mp_pck, map_size);
-    map = in_result.data;
-    for (i = 0; i < map.via.map.size; i++) {
-        k = map.via.map.ptr[i].key;
-        v = map.via.map.ptr[i].val;
-        msgpack_pack_object(&mp_pck, k);
-        msgpack_pack_object(&mp_pck, v);
+    if (pthread_mutex_trylock(&dec->lock) != 0) {
+        arena = flb_arena_current();
+        if (arena) {
+            *owner = DECODER_SCRATCH_ARENA;
+            tmp = flb_arena_alloc(arena, size);
+        }
+        else {
+            *owner = DECODER_SCRATCH_HEAP;
+            tmp = flb_malloc(size);
+        }
+        if (!tmp) {
+            flb_errno();
+        }
+        return tmp;
     }
 
-    map = extra_result.data;
-    for (i = 0; i < map.via.map.size; i++) {
-        k = map.via.map.ptr[i].key;
-        v = map.via.map.ptr[i].val;
-        msgpack_pack_object(&mp_pck, k);
-        msgpack_pack_object(&mp_pck, v);
+    if (flb_sds_alloc(dec->buffer) < size) {
+        tmp_sds = flb_sds_increase(dec->buffer,
+                                   size - flb_sds_alloc(dec->buffer));
+        if (!tmp_sds) {
+            flb_errno();
+            pthread_mutex_unlock(&dec->lock);
+            return NULL;
+        }
+        dec->buffer = tmp_sds;
     }
 
-    msgpack_unpacked_destroy(&in_result);
-    msgpack_unpacked_destroy(&extra_result);
+    *owner = DECODER_SCRATCH_SHARED;
+    return dec->buffer;
+}
 
-    *out_buf = mp_sbuf.data;
-    *out_size = mp_sbuf.size;
+/* Append the entries of a decoded map to the extra keys buffer */
+static int decoder_extra_keys(msgpack_sbuffer *extra, char *map, size_t size)
+{
+    int ret;
+    uint32_t count;
+    size_t hdr;
 
-    return 0;
+    ret = flb_mp_map_header(map, size, &count, &hdr);
+    if (ret == -1) {
+        return 0;
+    }
+
+    msgpack_sbuffer_write(extra, map + hdr, size - hdr);
+    return count;
 }
 
-/*
- * Given a msgpack map, apply the parser-decoder rules defined and generate
- * a new msgpack buffer.
- */
-int flb_parser_decoder_do(struct mk_list *decoders,
-                          char *in_buf, size_t in_size,
-                          char **out_buf, size_t *out_size)
+/* Run the rules of a decoder over one string value and pack the result */
+static int decoder_field(struct flb_parser_dec *dec,
+                         char *key, size_t key_size,
+                         char *val, size_t val_size,
+                         msgpack_sbuffer *sbuf, msgpack_packer *pck,
+                         msgpack_sbuffer *extra, int *extra_count)
 {
-    int i;
     int ret;
-    int matched;
-    int is_decoded;
-    int is_decoded_as;
-    int in_type;
-    int out_type;
+    int owner;
+    int in_type = TYPE_OUT_STRING;
+    int out_type = TYPE_OUT_STRING;
     int dec_type;
-    int extra_keys = FLB_FALSE;
-    size_t off = 0;
-    char *dec_buf;
+    int is_decoded = FLB_FALSE;
+    int is_decoded_as = FLB_FALSE;
+    size_t half;
+    size_t data_len;
     size_t dec_size;
-    flb_sds_t tmp_sds = NULL;
-    flb_sds_t data_sds = NULL;
-    flb_sds_t in_sds = NULL;
-    flb_sds_t out_sds = NULL;
+    size_t as_size = 0;
+    size_t out_size = 0;
+    uint32_t len;
+    const char *str;
+    char *data;
+    char *work;
+    char *scratch;
+    char *dec_buf;
+    char *as_obj = NULL;
+    char *out_obj = NULL;
     struct mk_list *head;
-    struct mk_list *r_head;
-    struct flb_parser_dec *dec = NULL;
     struct flb_parser_dec_rule *rule;
-    msgpack_object k;
-    msgpack_object v;
-    msgpack_object map;
-    msgpack_unpacked result;
-    msgpack_sbuffer mp_sbuf;
-    msgpack_packer  mp_pck;
-    /* Contexts to handle extra keys to be appended at the end of the log */
-    msgpack_sbuffer extra_mp_sbuf;
-    msgpack_packer  extra_mp_pck;
 
-    /* Initialize unpacker */
-    msgpack_unpacked_init(&result);
-    msgpack_unpack_next(&result, in_buf, in_size, &off);
-    map = result.data;
+    flb_mp_str(val, val_size, &str, &len, &val_size);
 
-    if (map.type != MSGPACK_OBJECT_MAP) {
-        msgpack_unpacked_destroy(&result);
+    /* Rules read from 'data' and write string results to 'work' */
+    half = len + 16;
+    scratch = decoder_scratch(dec, half * 2, &owner);
+    if (!scratch) {
         return -1;
     }
+    /* The value is read in place, decoders only copy what they change */
+    data = (char *) str;
+    data_len = len;
+    work = scratch;
 
-    /*
-     * First check if any field in the record matches a decoder rule. It's
-     * better to check this before hand otherwise we need to jump directly
-     * to create a "possible new outgoing buffer".
-     */
-    matched = -1;
-    for (i = 0; i < map.via.map.size; i++) {
-        k = map.via.map.ptr[i].key;
-        if (k.type != MSGPACK_OBJECT_STR) {
+    mk_list_foreach(head, &dec->rules) {
+        rule = mk_list_entry(head, struct flb_parser_dec_rule, _head);
+
+        if (rule->type == FLB_PARSER_DEC_DEFAULT &&
+            rule->action == FLB_PARSER_ACT_DO_NEXT &&
+            is_decoded == FLB_TRUE) {
             continue;
         }
 
-        /* Try to match this key name with decoder's rule */
-        mk_list_foreach(head, decoders) {
-            dec = mk_list_entry(head, struct flb_parser_dec, _head);
-            if (flb_sds_cmp(dec->key, (char *) k.via.str.ptr,
-                            k.via.str.size) == 0) {
-                /* we have a match, stop the check */
-                matched = i;
-                break;
-            }
-            else {
-                matched = -1;
-            }
+        if (is_decoded_as == FLB_TRUE && in_type != TYPE_OUT_STRING) {
+            continue;
         }
 
-        if (matched >= 0) {
-            break;
+        /* Process using defined decoder backend */
+        ret = -1;
+        dec_buf = NULL;
+        if (rule->backend == FLB_PARSER_DEC_JSON) {
+            ret = decode_json(data, data_len, work,
+                              &dec_buf, &dec_size, &dec_type);
         }
-    }
-
-    /* No matches, no need to continue */
-    if (matched == -1) {
-        msgpack_unpacked_destroy(&result);
-        return -1;
-    }
-
-    /* Create new outgoing buffer */
-    msgpack_sbuffer_init(&mp_sbuf);
-    msgpack_packer_init(&mp_pck, &mp_sbuf, msgpack_sbuffer_write);
-
-    /* Register the map (same size) */
-    msgpack_pack_map(&mp_pck, map.via.map.size);
-
-    /* Compose new outgoing buffer */
-    for (i = 0; i < map.via.map.size; i++) {
-        k = map.via.map.ptr[i].key;
-        v = map.via.map.ptr[i].val;
-
-        /* Pack right away previous fields in the map */
-        if (i < matched) {
-            msgpack_pack_object(&mp_pck, k);
-            msgpack_pack_object(&mp_pck, v);
-            continue;
+        else if (rule->backend == FLB_PARSER_DEC_ESCAPED) {
+            ret = decode_escaped(data, data_len, work,
+                                 &dec_buf, &dec_size, &dec_type);
         }
-
-        /* Process current key names and decoder rules */
-        if (k.type != MSGPACK_OBJECT_STR || v.type != MSGPACK_OBJECT_STR) {
-            msgpack_pack_object(&mp_pck, k);
-            msgpack_pack_object(&mp_pck, v);
-            continue;
+        else if (rule->backend == FLB_PARSER_DEC_ESCAPED_UTF8) {
+            ret = decode_escaped_utf8(data, data_len, work,
+                                      &dec_buf, &dec_size, &dec_type);
         }
 
-        /*
-         * Per key, we allow only one successful 'Decode_Field' and one
-         * successful 'Decode_Field_As' rules. Otherwise it may lead
-         * to duplicated entries in the final map.
-         *
-         * is_decoded    => Decode_Field successul ?
-         * is_decoded_as => Decode_Field_As successful ?
-         */
-        is_decoded = FLB_FALSE;
-        is_decoded_as = FLB_FALSE;
-
-        /* Lookup for decoders associated to the current 'key' */
-        mk_list_foreach(head, decoders) {
-            dec = mk_list_entry(head, struct flb_parser_dec, _head);
-            if (flb_sds_cmp(dec->key, (char *) k.via.str.ptr,
-                            k.via.str.size) == 0) {
-                break;
+        /* Check decoder status */
+        if (ret == -1) {
+            /* Current decoder failed, should we try the next one ? */
+            if (rule->action == FLB_PARSER_ACT_TRY_NEXT ||
+                rule->action == FLB_PARSER_ACT_DO_NEXT) {
+                continue;
             }
-            dec = NULL;
-        }
 
-        /* No decoder found, pack content */
-        if (!dec) {
-            msgpack_pack_object(&mp_pck, k);
-            msgpack_pack_object(&mp_pck, v);
-            continue;
+            /* Stop: no more rules should be applied */
+            break;
         }
 
-        if (!in_sds) {
-            in_sds  = flb_sds_create_size(v.via.str.size);
-            if (!in_sds) {
-                break;
+        /* Internal packing: replace value content in the same key */
+        if (rule->type == FLB_PARSER_DEC_AS) {
+            in_type = dec_type;
+            is_decoded_as = FLB_TRUE;
+            if (dec_type == TYPE_OUT_STRING) {
+                /*
+                 * the result is the input of next rules, swap areas if it
+                 * was written to 'work' (unchanged strings are not copied)
+                 */
+                if (dec_buf == work) {
+                    work = (work == scratch) ? scratch + half : scratch;
+                }
+                data = dec_buf;
+                data_len = dec_size;
             }
-            out_sds = flb_sds_create_size(v.via.str.size);
-            if (!out_sds) {
-                break;
+            else {
+                flb_free(as_obj);
+                as_obj = dec_buf;
+                as_size = dec_size;
             }
-            data_sds = flb_sds_create_size(v.via.str.size);
-        }
-
-        /* Copy original content */
-        tmp_sds = flb_sds_copy(data_sds, (char *) v.via.str.ptr,
-                               v.via.str.size);
-        if (tmp_sds != data_sds) {
-            data_sds = tmp_sds;
         }
-
-        /*
-         * We got a match: 'key name' == 'decoder field name', validate
-         * that we have enough space in our temporal buffer.
-         */
-        if (flb_sds_alloc(dec->buffer) < v.via.str.size) {
-            /* Increase buffer size */
-            size_t diff = (v.via.str.size - flb_sds_alloc(dec->buffer));
-            tmp_sds = flb_sds_increase(dec->buffer, diff);
-            if (!tmp_sds) {
-                flb_errno();
-                break;
+        else if (rule->type == FLB_PARSER_DEC_DEFAULT) {
+            out_type = dec_type;
+            is_decoded = FLB_TRUE;
+            if (dec_type == TYPE_OUT_OBJECT) {
+                flb_free(out_obj);
+                out_obj = dec_buf;
+                out_size = dec_size;
             }
-            dec->buffer = tmp_sds;
         }
 
-        /* Process decoder rules */
-        ret = -1;
-        dec_buf = NULL;
-
-        /*
-         * If some rule type is FLB_PARSER_DEC_DEFAULT, means that it will
-         * try to register some extra fields as part of the record. For such
-         * case we prepare a temporal buffer to hold these extra keys.
-         *
-         * The content of this buffer is just a serialized number of maps.
-         */
-        if (dec->add_extra_keys == FLB_TRUE) {
-            extra_keys = FLB_TRUE;
-            msgpack_sbuffer_init(&extra_mp_sbuf);
-            msgpack_packer_init(&extra_mp_pck, &extra_mp_sbuf,
-                                msgpack_sbuffer_write);
+        /* Apply more rules ? */
+        if (rule->action == FLB_PARSER_ACT_DO_NEXT) {
+            continue;
         }
+        break;
+    }
 
-        mk_list_foreach(r_head, &dec->rules) {
-            rule = mk_list_entry(r_head, struct flb_parser_dec_rule, _head);
-
-            if (rule->type == FLB_PARSER_DEC_DEFAULT &&
-                rule->action == FLB_PARSER_ACT_DO_NEXT &&
-                is_decoded == FLB_TRUE) {
-                continue;
-            }
-
-            if (is_decoded_as == FLB_TRUE && in_type != TYPE_OUT_STRING) {
-                continue;
-            }
+    /* Package the key as it is */
+    msgpack_sbuffer_write(sbuf, key, key_size);
 
-            /* Process using defined decoder backend */
-            if (rule->backend == FLB_PARSER_DEC_JSON) {
-                ret = decode_json(dec, (char *) data_sds, flb_sds_len(data_sds),
-                                  &dec_buf, &dec_size, &dec_type);
-            }
-            else if (rule->backend == FLB_PARSER_DEC_ESCAPED) {
-                ret = decode_escaped(dec,
-                                     (char *) data_sds, flb_sds_len(data_sds),
-                                     &dec_buf, &dec_size, &dec_type);
-            }
-            else if (rule->backend == FLB_PARSER_DEC_ESCAPED_UTF8) {
-                ret = decode_escaped_utf8(dec,
-                                     (char *) data_sds, flb_sds_len(data_sds),
-                                     &dec_buf, &dec_size, &dec_type);
-            }
+    /* We need to place some value for the key in question */
+    if (is_decoded_as == FLB_TRUE && in_type == TYPE_OUT_STRING) {
+        msgpack_pack_str(pck, data_len);
+        msgpack_pack_str_body(pck, data, data_len);
+    }
+    else if (is_decoded_as == FLB_TRUE && in_type == TYPE_OUT_OBJECT) {
+        msgpack_sbuffer_write(sbuf, as_obj, as_size);
+    }
+    else {
+        /* Pack original value */
+        msgpack_sbuffer_write(sbuf, val, val_size);
+    }
 
-            /* Check decoder status */
-            if (ret == -1) {
-                /* Current decoder failed, should we try the next one ? */
-                if (rule->action == FLB_PARSER_ACT_TRY_NEXT ||
-                    rule->action == FLB_PARSER_ACT_DO_NEXT) {
-                    continue;
-                }
+    /* Package as external keys */
+    if (is_decoded == FLB_TRUE) {
+        if (out_type == TYPE_OUT_STRING) {
+            flb_error("[parser_decoder] string type is not allowed");
+        }
+        else if (out_obj) {
+            *extra_count += decoder_extra_keys(extra, out_obj, out_size);
+        }
+    }
 
-                /* Stop: no more rules should be applied */
-                break;
-            }
+    flb_free(as_obj);
+    flb_free(out_obj);
+    if (owner == DECODER_SCRATCH_SHARED) {
+        pthread_mutex_unlock(&dec->lock);
+    }
+    else if (owner == DECODER_SCRATCH_HEAP) {
+        flb_free(scratch);
+    }
 
-            /* Internal packing: replace value content in the same key */
-            if (rule->type == FLB_PARSER_DEC_AS) {
-                tmp_sds = flb_sds_copy(in_sds, dec_buf, dec_size);
-                if (tmp_sds != in_sds) {
-                    in_sds = tmp_sds;
-                }
-                tmp_sds = flb_sds_copy(data_sds, dec_buf, dec_size);
-                if (tmp_sds != data_sds) {
-                    data_sds = tmp_sds;
-                }
-                in_type = dec_type;
-                is_decoded_as = FLB_TRUE;
-            }
-            else if (rule->type == FLB_PARSER_DEC_DEFAULT) {
-                tmp_sds = flb_sds_copy(out_sds, dec_buf, dec_size);
-                if (tmp_sds != out_sds) {
-                    out_sds = tmp_sds;
-                }
-                out_type = dec_type;
-                is_decoded = FLB_TRUE;
-            }
+    return 0;
+}
 
+/*
+ * Given a msgpack map, apply the parser-decoder rules defined and generate
+ * a new msgpack buffer.
+ *
+ * The record is not unpacked: entries are walked as raw msgpack, the ones
+ * without a decoder are copied as byte ranges and only decoded values are
+ * re-encoded. Extra keys generated by 'Decode_Field' rules are appended at
+ * the end of the map.
+ */
+int flb_parser_decoder_do(struct mk_list *decoders,
+                          char *in_buf, size_t in_size,
+                          char **out_buf, size_t *out_size)
+{
+    int i;
+    int ret;
+    int len;
+    int extra_count = 0;
+    uint32_t map_size;
+    size_t hdr;
+    size_t off;
+    size_t copied;
+    size_t key_size;
+    size_t val_size;
+    char header[5] = {0};
+    struct flb_parser_dec *dec;
+    msgpack_sbuffer mp_sbuf;
+    msgpack_packer  mp_pck;
+    /* Context to handle extra keys to be appended at the end of the log */
+    msgpack_sbuffer extra_mp_sbuf;
 
-            if (dec_buf != dec->buffer) {
-                flb_free(dec_buf);
-            }
-            dec_buf = NULL;
-            dec_size = 0;
+    ret = flb_mp_map_header(in_buf, in_size, &map_size, &hdr);
+    if (ret == -1) {
+        return -1;
+    }
 
-            /* Apply more rules ? */
-            if (rule->action == FLB_PARSER_ACT_DO_NEXT) {
-                continue;
-            }
+    /*
+     * First check if any field in the record matches a decoder rule. It's
+     * better to check this before hand otherwise we need to jump directly
+     * to create a "possible new outgoing buffer".
+     */
+    off = hdr;
+    for (i = 0; i < map_size; i++) {
+        ret = decoder_entry(decoders, in_buf + off, in_size - off,
+                            &key_size, &val_size, &dec);
+        if (ret == -1) {
+            return -1;
+        }
+        if (dec) {
             break;
         }
+        off += key_size + val_size;
+    }
 
-        /* Package the key */
-        msgpack_pack_object(&mp_pck, k);
+    /* No matches, no need to continue */
+    if (i == map_size) {
+        return -1;
+    }
 
-        /* We need to place some value for the key in question */
-        if (is_decoded_as == FLB_TRUE) {
-            if (in_type == TYPE_OUT_STRING) {
-                msgpack_pack_str(&mp_pck, flb_sds_len(in_sds));
-                msgpack_pack_str_body(&mp_pck,
-                                      in_sds, flb_sds_len(in_sds));
-            }
-            else if (in_type == TYPE_OUT_OBJECT) {
-                msgpack_sbuffer_write(&mp_sbuf,
-                                      in_sds, flb_sds_len(in_sds));
-            }
+    /* Create new outgoing buffer, the map header is set at the end */
+    msgpack_sbuffer_init(&mp_sbuf);
+    msgpack_packer_init(&mp_pck, &mp_sbuf, msgpack_sbuffer_write);
+    msgpack_sbuffer_init(&extra_mp_sbuf);
+    msgpack_sbuffer_write(&mp_sbuf, header, sizeof(header));
+
+    /* Previous fields in the map are copied right away */
+    copied = hdr;
+    for (; i < map_size; i++) {
+        ret = decoder_entry(decoders, in_buf + off, in_size - off,
+                            &key_size, &val_size, &dec);
+        if (ret == -1) {
+            break;
         }
-        else {
-            /* Pack original value */
-            msgpack_pack_object(&mp_pck, v);
+
+        if (!dec) {
+            off += key_size + val_size;
+            continue;
         }
 
-        /* Package as external keys */
-        if (is_decoded == FLB_TRUE) {
-            if (out_type == TYPE_OUT_STRING) {
-                flb_error("[parser_decoder] string type is not allowed");
-            }
-            else if (out_type == TYPE_OUT_OBJECT) {
-                msgpack_sbuffer_write(&extra_mp_sbuf,
-                                      out_sds, flb_sds_len(out_sds));
-            }
+        /* Flush the untouched range before this entry */
+        msgpack_sbuffer_write(&mp_sbuf, in_buf + copied, off - copied);
+
+        ret = decoder_field(dec,
+                            in_buf + off, key_size,
+                            in_buf + off + key_size, val_size,
+                            &mp_sbuf, &mp_pck,
+                            &extra_mp_sbuf, &extra_count);
+        if (ret == -1) {
+            break;
         }
-    }
 
-    if (in_sds) {
-        flb_sds_destroy(in_sds);
+        off += key_size + val_size;
+        copied = off;
     }
-    if (out_sds) {
-        flb_sds_destroy(out_sds);
+
+    if (i < map_size) {
+        msgpack_sbuffer_destroy(&extra_mp_sbuf);
+        msgpack_sbuffer_destroy(&mp_sbuf);
+        return -1;
     }
-    if (data_sds) {
-        flb_sds_destroy(data_sds);
+
+    msgpack_sbuffer_write(&mp_sbuf, in_buf + copied, off - copied);
+    if (extra_mp_sbuf.size > 0) {
+        msgpack_sbuffer_write(&mp_sbuf,
+                              extra_mp_sbuf.data, extra_mp_sbuf.size);
     }
+    msgpack_sbuffer_destroy(&extra_mp_sbuf);
+
+    /* Set the final map header in front of the entries */
+    len = flb_mp_map_header_write(header, map_size + extra_count);
+    memmove(mp_sbuf.data + len, mp_sbuf.data + sizeof(header),
+            mp_sbuf.size - sizeof(header));
+    memcpy(mp_sbuf.data, header, len);
+    mp_sbuf.size -= (sizeof(header) - len);
 
-    msgpack_unpacked_destroy(&result);
     *out_buf = mp_sbuf.data;
     *out_size = mp_sbuf.size;
 
-    if (extra_keys == FLB_TRUE) {
-        ret = merge_record_and_extra_keys(mp_sbuf.data, mp_sbuf.size,
-                                          extra_mp_sbuf.data, extra_mp_sbuf.size,
-                                          out_buf, out_size);
-        msgpack_sbuffer_destroy(&extra_mp_sbuf);
-        if (ret == 0) {
-            msgpack_sbuffer_destroy(&mp_sbuf);
-            return 0;
-        }
-    }
-
     return 0;
 }
 
@@ -730,6 +549,7 @@ static struct flb_parser_dec *get_decoder_key_context(char *key_name, int key_le
             return NULL;
         }
         dec->add_extra_keys = FLB_FALSE;
+        pthread_mutex_init(&dec->lock, NULL);
         mk_list_init(&dec->rules);
         mk_list_add(&dec->_head, list);
     }
@@ -903,6 +723,7 @@ int flb_parser_decoder_list_destroy(struct mk_list *list)
         mk_list_del(&dec->_head);
         flb_sds_destroy(dec->key);
         flb_sds_destroy(dec->buffer);
+        pthread_mutex_destroy(&dec->lock);
         flb_free(dec);
         c++;
     }
@@ -0,0 +1,305 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#define _GNU_SOURCE
+#include <time.h>
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_log.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_parser.h>
+#include <fluent-bit/flb_parser_decoder.h>
+
+#include <msgpack.h>
+
+/*
+ * logfmt records are a sequence of key=value pairs separated by spaces:
+ *
+ *   level=info msg="stopping fetcher" duration=1.2ms done
+ *
+ * A value can be double quoted (with backslash escapes), an empty value
+ * (key=) is packed as an empty string and a key without '=' as nil.
+ */
+
+struct logfmt_ctx {
+    int time_found;
+    time_t time_lookup;
+    time_t time_now;
+    double time_frac;
+    char *time_key;
+    int time_key_len;
+    char *time_at;             /* key of the resolved time field */
+    int escaped;               /* some value needs unescaping */
+    char *unesc;               /* buffer for unescaped values */
+    struct flb_parser *parser;
+    msgpack_packer *pck;
+};
+
+static inline int logfmt_is_key(char c)
+{
+    return (c > ' ' && c != '=' && c != '"' && c != 0x7f);
+}
+
+static inline int logfmt_is_space(char c)
+{
+    return (c == ' ' || c == '\t' || c == '\r' || c == '\n');
+}
+
+/* Unescape a quoted value into 'out', returns the new length */
+static int logfmt_unescape(char *val, int len, char *out)
+{
+    int i;
+    int n = 0;
+
+    for (i = 0; i < len; i++) {
+        if (val[i] != '\\' || i + 1 == len) {
+            out[n++] = val[i];
+            continue;
+        }
+
+        i++;
+        switch (val[i]) {
+        case 'n':
+            out[n++] = '\n';
+            break;
+        case 't':
+            out[n++] = '\t';
+            break;
+        case 'r':
+            out[n++] = '\r';
+            break;
+        default:
+            out[n++] = val[i];
+        }
+    }
+
+    return n;
+}
+
+static int logfmt_pack(struct logfmt_ctx *ctx,
+                       char *key, int key_len, char *val, int val_len)
+{
+    int ret;
+    int type;
+    double frac = 0;
+    struct tm tm;
+    struct flb_parser *parser = ctx->parser;
+
+    /* The time is resolved on the first pass, the second just skips it */
+    if (ctx->pck != NULL) {
+        if (key == ctx->time_at && parser->time_keep == FLB_FALSE) {
+            return 0;
+        }
+    }
+    else if (ctx->time_key && ctx->time_found == FLB_FALSE && val &&
+             key_len == ctx->time_key_len &&
+             strncmp(key, ctx->time_key, key_len) == 0) {
+        ret = flb_parser_time_lookup(val, val_len, ctx->time_now, parser,
+                                     &tm, &frac);
+        if (ret == -1) {
+            flb_error("[parser:%s] Invalid time format %s.",
+                      parser->name, parser->time_fmt);
+        }
+        else {
+            ctx->time_found = FLB_TRUE;
+            ctx->time_frac = frac;
+            ctx->time_lookup = flb_parser_tm2time(&tm);
+            ctx->time_at = key;
+
+            if (parser->time_keep == FLB_FALSE) {
+                return 0;
+            }
+        }
+    }
+
+    if (ctx->pck == NULL) {
+        return 1;
+    }
+
+    msgpack_pack_str(ctx->pck, key_len);
+    msgpack_pack_str_body(ctx->pck, key, key_len);
+
+    if (!val) {
+        msgpack_pack_nil(ctx->pck);
+        return 1;
+    }
+
+    type = flb_parser_type_lookup(parser, key, key_len);
+    if (type != 0) {
+        flb_parser_typecast_value(key, type, val, val_len, ctx->pck);
+    }
+    else {
+        msgpack_pack_str(ctx->pck, val_len);
+        msgpack_pack_str_body(ctx->pck, val, val_len);
+    }
+
+    return 1;
+}
+
+/*
+ * Scan the record once. When the context have no packer it only counts the
+ * entries the map will hold, returns the number of entries or -1 if the
+ * record is not valid logfmt.
+ */
+static int logfmt_scan(struct logfmt_ctx *ctx, char *buf, char *end)
+{
+    int n = 0;
+    int key_len;
+    int val_len;
+    int escaped;
+    char *p = buf;
+    char *key;
+    char *val;
+
+    while (p < end) {
+        while (p < end && logfmt_is_space(*p)) {
+            p++;
+        }
+        if (p == end) {
+            break;
+        }
+
+        key = p;
+        while (p < end && logfmt_is_key(*p)) {
+            p++;
+        }
+        key_len = p - key;
+        if (key_len == 0) {
+            return -1;
+        }
+
+        /* Key without value */
+        if (p == end || *p != '=') {
+            if (p < end && !logfmt_is_space(*p)) {
+                return -1;
+            }
+            n += logfmt_pack(ctx, key, key_len, NULL, 0);
+            continue;
+        }
+        p++;
+
+        if (p < end && *p == '"') {
+            p++;
+            val = p;
+            escaped = FLB_FALSE;
+            while (p < end && *p != '"') {
+                if (*p == '\\') {
+                    escaped = FLB_TRUE;
+                    p++;
+                }
+                p++;
+            }
+            if (p >= end) {
+                /* unterminated quoted value */
+                return -1;
+            }
+            val_len = p - val;
+            p++;
+
+            if (escaped == FLB_TRUE && !ctx->pck) {
+                ctx->escaped = FLB_TRUE;
+            }
+            else if (escaped == FLB_TRUE) {
+                val_len = logfmt_unescape(val, val_len, ctx->unesc);
+                val = ctx->unesc;
+            }
+        }
+        else {
+            val = p;
+            while (p < end && !logfmt_is_space(*p)) {
+                p++;
+            }
+            val_len = p - val;
+        }
+
+        n += logfmt_pack(ctx, key, key_len, val, val_len);
+    }
+
+    return n;
+}
+
+int flb_parser_logfmt_do(struct flb_parser *parser,
+                         char *buf, size_t length,
+                         void **out_buf, size_t *out_size,
+                         struct flb_time *out_time)
+{
+    int n;
+    int ret;
+    size_t dec_out_size;
+    char *dec_out_buf;
+    char *end = buf + length;
+    struct logfmt_ctx ctx;
+    struct flb_time *t;
+    msgpack_sbuffer tmp_sbuf;
+    msgpack_packer tmp_pck;
+
+    memset(&ctx, '\0', sizeof(struct logfmt_ctx));
+    ctx.parser = parser;
+    ctx.time_now = time(NULL);
+    if (parser->time_fmt) {
+        ctx.time_key = parser->time_key ? parser->time_key : "time";
+        ctx.time_key_len = strlen(ctx.time_key);
+    }
+
+    /* First pass: validate and count the entries */
+    n = logfmt_scan(&ctx, buf, end);
+    if (n == -1 || (n == 0 && ctx.time_found == FLB_FALSE)) {
+        return -1;
+    }
+
+    /* Unescaped values never grow, one buffer fits any of them */
+    if (ctx.escaped == FLB_TRUE) {
+        ctx.unesc = flb_malloc(length + 1);
+        if (!ctx.unesc) {
+            flb_errno();
+            return -1;
+        }
+    }
+
+    msgpack_sbuffer_init(&tmp_sbuf);
+    msgpack_packer_init(&tmp_pck, &tmp_sbuf, msgpack_sbuffer_write);
+    msgpack_pack_map(&tmp_pck, n);
+
+    /* Second pass: pack */
+    ctx.pck = &tmp_pck;
+    logfmt_scan(&ctx, buf, end);
+    if (ctx.unesc) {
+        flb_free(ctx.unesc);
+    }
+
+    *out_buf = tmp_sbuf.data;
+    *out_size = tmp_sbuf.size;
+
+    t = out_time;
+    t->tm.tv_sec  = ctx.time_lookup;
+    t->tm.tv_nsec = (ctx.time_frac * 1000000000);
+
+    if (parser->decoders) {
+        ret = flb_parser_decoder_do(parser->decoders,
+                                    tmp_sbuf.data, tmp_sbuf.size,
+                                    &dec_out_buf, &dec_out_size);
+        if (ret == 0) {
+            *out_buf = dec_out_buf;
+            *out_size = dec_out_size;
+            msgpack_sbuffer_destroy(&tmp_sbuf);
+        }
+    }
+
+    return length;
+}
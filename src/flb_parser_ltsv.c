@@ -0,0 +1,212 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#define _GNU_SOURCE
+#include <time.h>
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_log.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_parser.h>
+#include <fluent-bit/flb_parser_decoder.h>
+
+#include <msgpack.h>
+
+/*
+ * LTSV (Labeled Tab-separated Values, http://ltsv.org) records are fields
+ * separated by a TAB, every field is a label and a value separated by the
+ * first colon:
+ *
+ *   host:127.0.0.1<TAB>ident:-<TAB>status:200<TAB>size:777
+ *
+ * Values are not escaped, so they are always packed straight from the
+ * incoming buffer.
+ */
+
+struct ltsv_ctx {
+    int time_found;
+    time_t time_lookup;
+    time_t time_now;
+    double time_frac;
+    char *time_key;
+    int time_key_len;
+    char *time_at;             /* label of the resolved time field */
+    struct flb_parser *parser;
+    msgpack_packer *pck;
+};
+
+static inline int ltsv_is_label(char c)
+{
+    return ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') ||
+            (c >= 'A' && c <= 'Z') || c == '_' || c == '.' || c == '-');
+}
+
+static int ltsv_pack(struct ltsv_ctx *ctx,
+                     char *key, int key_len, char *val, int val_len)
+{
+    int ret;
+    int type;
+    double frac = 0;
+    struct tm tm;
+    struct flb_parser *parser = ctx->parser;
+
+    /* The time is resolved on the first pass, the second just skips it */
+    if (ctx->pck != NULL) {
+        if (key == ctx->time_at && parser->time_keep == FLB_FALSE) {
+            return 0;
+        }
+    }
+    else if (ctx->time_key && ctx->time_found == FLB_FALSE &&
+             key_len == ctx->time_key_len &&
+             strncmp(key, ctx->time_key, key_len) == 0) {
+        ret = flb_parser_time_lookup(val, val_len, ctx->time_now, parser,
+                                     &tm, &frac);
+        if (ret == -1) {
+            flb_error("[parser:%s] Invalid time format %s.",
+                      parser->name, parser->time_fmt);
+        }
+        else {
+            ctx->time_found = FLB_TRUE;
+            ctx->time_frac = frac;
+            ctx->time_lookup = flb_parser_tm2time(&tm);
+            ctx->time_at = key;
+
+            if (parser->time_keep == FLB_FALSE) {
+                return 0;
+            }
+        }
+    }
+
+    if (ctx->pck == NULL) {
+        return 1;
+    }
+
+    msgpack_pack_str(ctx->pck, key_len);
+    msgpack_pack_str_body(ctx->pck, key, key_len);
+
+    type = flb_parser_type_lookup(parser, key, key_len);
+    if (type != 0) {
+        flb_parser_typecast_value(key, type, val, val_len, ctx->pck);
+    }
+    else {
+        msgpack_pack_str(ctx->pck, val_len);
+        msgpack_pack_str_body(ctx->pck, val, val_len);
+    }
+
+    return 1;
+}
+
+/*
+ * Scan the record once. When the context have no packer it only counts the
+ * entries the map will hold, returns the number of entries or -1 if the
+ * record is not valid LTSV.
+ */
+static int ltsv_scan(struct ltsv_ctx *ctx, char *buf, char *end)
+{
+    int n = 0;
+    char *p = buf;
+    char *key;
+    char *val;
+
+    /* A trailing line break is not part of the last value */
+    while (end > buf && (end[-1] == '\n' || end[-1] == '\r')) {
+        end--;
+    }
+
+    while (p < end) {
+        key = p;
+        while (p < end && ltsv_is_label(*p)) {
+            p++;
+        }
+        if (p == key || p == end || *p != ':') {
+            return -1;
+        }
+
+        val = ++p;
+        p = memchr(val, '\t', end - val);
+        if (!p) {
+            p = end;
+        }
+
+        n += ltsv_pack(ctx, key, (val - 1) - key, val, p - val);
+        if (p < end) {
+            p++;
+        }
+    }
+
+    return n;
+}
+
+int flb_parser_ltsv_do(struct flb_parser *parser,
+                       char *buf, size_t length,
+                       void **out_buf, size_t *out_size,
+                       struct flb_time *out_time)
+{
+    int n;
+    int ret;
+    size_t dec_out_size;
+    char *dec_out_buf;
+    char *end = buf + length;
+    struct ltsv_ctx ctx;
+    struct flb_time *t;
+    msgpack_sbuffer tmp_sbuf;
+    msgpack_packer tmp_pck;
+
+    memset(&ctx, '\0', sizeof(struct ltsv_ctx));
+    ctx.parser = parser;
+    ctx.time_now = time(NULL);
+    if (parser->time_fmt) {
+        ctx.time_key = parser->time_key ? parser->time_key : "time";
+        ctx.time_key_len = strlen(ctx.time_key);
+    }
+
+    /* First pass: validate and count the entries */
+    n = ltsv_scan(&ctx, buf, end);
+    if (n == -1 || (n == 0 && ctx.time_found == FLB_FALSE)) {
+        return -1;
+    }
+
+    msgpack_sbuffer_init(&tmp_sbuf);
+    msgpack_packer_init(&tmp_pck, &tmp_sbuf, msgpack_sbuffer_write);
+    msgpack_pack_map(&tmp_pck, n);
+
+    /* Second pass: pack */
+    ctx.pck = &tmp_pck;
+    ltsv_scan(&ctx, buf, end);
+
+    *out_buf = tmp_sbuf.data;
+    *out_size = tmp_sbuf.size;
+
+    t = out_time;
+    t->tm.tv_sec  = ctx.time_lookup;
+    t->tm.tv_nsec = (ctx.time_frac * 1000000000);
+
+    if (parser->decoders) {
+        ret = flb_parser_decoder_do(parser->decoders,
+                                    tmp_sbuf.data, tmp_sbuf.size,
+                                    &dec_out_buf, &dec_out_size);
+        if (ret == 0) {
+            *out_buf = dec_out_buf;
+            *out_size = dec_out_size;
+            msgpack_sbuffer_destroy(&tmp_sbuf);
+        }
+    }
+
+    return length;
+}
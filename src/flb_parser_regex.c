@@ -25,6 +25,8 @@
 #include <fluent-bit/flb_parser_decoder.h>
 #include <fluent-bit/flb_regex.h>
 #include <fluent-bit/flb_str.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_log.h>
 
 #include <msgpack.h>
 
@@ -32,70 +34,100 @@
 #define pack_uint16(buf, d) _msgpack_store16(buf, (uint16_t) d)
 #define pack_uint32(buf, d) _msgpack_store32(buf, (uint32_t) d)
 
-struct regex_cb_ctx {
-    int time_found;
-    time_t time_lookup;
-    time_t time_now;
-    double time_frac;
-    struct flb_parser *parser;
-    msgpack_packer *pck;
-};
+#define FLB_PARSER_CAPTURES_GROW  8
 
-static void cb_results(unsigned char *name, unsigned char *value,
-                       size_t vlen, void *data)
+static int cb_capture(unsigned char *name, size_t len, int group, void *data)
 {
-    int len;
-    int ret;
-    double frac = 0;
+    int size;
     char *time_key;
-    struct regex_cb_ctx *pcb = data;
-    struct flb_parser *parser = pcb->parser;
-    struct tm tm = {0};
-    (void) data;
+    struct flb_parser *parser = data;
+    struct flb_parser_capture *tmp;
+    struct flb_parser_capture *cap;
+    msgpack_sbuffer sbuf;
+    msgpack_packer pck;
 
-    len = strlen((char *) name);
-
-    /* Check if there is a time lookup field */
-    if (parser->time_fmt) {
-        if (parser->time_key) {
-            time_key = parser->time_key;
-        }
-        else {
-            time_key = "time";
+    if (parser->captures_len % FLB_PARSER_CAPTURES_GROW == 0) {
+        size = (parser->captures_len + FLB_PARSER_CAPTURES_GROW) *
+            sizeof(struct flb_parser_capture);
+        tmp = flb_realloc(parser->captures, size);
+        if (!tmp) {
+            flb_errno();
+            return -1;
         }
+        parser->captures = tmp;
+    }
 
-        if (strcmp((char *) name, time_key) == 0) {
-            /* Lookup time */
-            ret = flb_parser_time_lookup((char *) value, vlen,
-                                         pcb->time_now, parser, &tm, &frac);
-            if (ret == -1) {
-                flb_error("[parser:%s] Invalid time format %s.", parser->name, parser->time_fmt);
-                return;
-            }
+    cap = &parser->captures[parser->captures_len];
+    memset(cap, '\0', sizeof(struct flb_parser_capture));
 
-            pcb->time_found = FLB_TRUE;
-            pcb->time_frac = frac;
-            pcb->time_lookup = flb_parser_tm2time(&tm);
+    cap->name = flb_strndup((char *) name, len);
+    if (!cap->name) {
+        return -1;
+    }
+    cap->name_len = len;
+    cap->group = group;
+    cap->type = flb_parser_type_lookup(parser, cap->name, len);
 
-            if (parser->time_keep == FLB_FALSE) {
-                return;
-            }
+    if (parser->time_fmt) {
+        time_key = parser->time_key ? parser->time_key : "time";
+        if (strcmp(cap->name, time_key) == 0) {
+            cap->is_time = FLB_TRUE;
         }
     }
 
-    if (parser->types_len != 0) {
-        flb_parser_typecast((char*)name, len,
-                            (char*)value, vlen,
-                            pcb->pck,
-                            parser->types,
-                            parser->types_len);
+    /* Pre-pack the key so it can be copied as is into every record */
+    msgpack_sbuffer_init(&sbuf);
+    msgpack_packer_init(&pck, &sbuf, msgpack_sbuffer_write);
+    msgpack_pack_str(&pck, len);
+    msgpack_pack_str_body(&pck, name, len);
+
+    cap->key = flb_malloc(sbuf.size);
+    if (!cap->key) {
+        flb_errno();
+        flb_free(cap->name);
+        msgpack_sbuffer_destroy(&sbuf);
+        return -1;
+    }
+    memcpy(cap->key, sbuf.data, sbuf.size);
+    cap->key_size = sbuf.size;
+    msgpack_sbuffer_destroy(&sbuf);
+
+    parser->captures_len++;
+    return 0;
+}
+
+void flb_parser_regex_release(struct flb_parser *parser)
+{
+    int i;
+    struct flb_parser_capture *cap;
+
+    for (i = 0; i < parser->captures_len; i++) {
+        cap = &parser->captures[i];
+        flb_free(cap->name);
+        flb_free(cap->key);
     }
-    else {
-        msgpack_pack_str(pcb->pck, len);
-        msgpack_pack_str_body(pcb->pck, (char *) name, len);
-        msgpack_pack_str(pcb->pck, vlen);
-        msgpack_pack_str_body(pcb->pck, (char *) value, vlen);
+    flb_free(parser->captures);
+    parser->captures = NULL;
+    parser->captures_len = 0;
+}
+
+/*
+ * Build the capture map of a regex parser: every named group is resolved
+ * once to its group number, pre-packed key, cast type and time flag, so
+ * parsing a record only needs to read the offsets of the search region.
+ */
+int flb_parser_regex_compile(struct flb_parser *parser,
+                             struct flb_regex *regex)
+{
+    int ret;
+
+    ret = flb_regex_foreach_name(regex, cb_capture, parser);
+    if (ret != 0) {
+        flb_parser_regex_release(parser);
+        return -1;
     }
+
+    return 0;
 }
 
 int flb_parser_regex_do(struct flb_parser *parser,
@@ -103,16 +135,28 @@ int flb_parser_regex_do(struct flb_parser *parser,
                         void **out_buf, size_t *out_size,
                         struct flb_time *out_time)
 {
+    int i;
     int ret;
     int arr_size;
-    int last_byte;
+    int last_byte = -1;
+    int beg;
+    int end;
+    int vlen;
+    int time_found = FLB_FALSE;
     ssize_t n;
     size_t dec_out_size;
+    double frac = 0;
+    double time_frac = 0;
+    time_t time_lookup = 0;
+    time_t time_now;
+    char *val;
     char *dec_out_buf;
     char *tmp;
+    struct tm tm;
     struct flb_regex_search result;
-    struct regex_cb_ctx pcb;
+    struct flb_parser_capture *cap;
     struct flb_time *t;
+    OnigRegion *region;
     msgpack_sbuffer tmp_sbuf;
     msgpack_packer tmp_pck;
 
@@ -120,25 +164,66 @@ int flb_parser_regex_do(struct flb_parser *parser,
     if (n <= 0) {
         return -1;
     }
+    region = result.region;
 
     /* Prepare new outgoing buffer */
     msgpack_sbuffer_init(&tmp_sbuf);
     msgpack_packer_init(&tmp_pck, &tmp_sbuf, msgpack_sbuffer_write);
 
-    /* Set a Map size with the exact number of matches returned by regex */
-    arr_size = n;
+    /* Set a Map size with the exact number of captures known by the map */
+    arr_size = parser->captures_len;
     msgpack_pack_map(&tmp_pck, arr_size);
 
-    /* Callback context */
-    pcb.pck = &tmp_pck;
-    pcb.parser = parser;
-    pcb.time_found = FLB_FALSE;
-    pcb.time_lookup = 0;
-    pcb.time_frac = 0;
-    pcb.time_now = time(NULL);
+    time_now = time(NULL);
+
+    /* Compose the new buffer straight from the region offsets */
+    for (i = 0; i < parser->captures_len; i++) {
+        cap = &parser->captures[i];
+        beg = region->beg[cap->group];
+        end = region->end[cap->group];
+
+        if (beg >= 0) {
+            val = buf + beg;
+            vlen = end - beg;
+            last_byte = end;
+        }
+        else {
+            /* the group did not take part in the match */
+            val = buf;
+            vlen = 0;
+        }
+
+        if (cap->is_time == FLB_TRUE) {
+            memset(&tm, '\0', sizeof(struct tm));
+            ret = flb_parser_time_lookup(val, vlen, time_now, parser,
+                                         &tm, &frac);
+            if (ret == -1) {
+                flb_error("[parser:%s] Invalid time format %s.",
+                          parser->name, parser->time_fmt);
+            }
+            else {
+                time_found = FLB_TRUE;
+                time_frac = frac;
+                time_lookup = flb_parser_tm2time(&tm);
+
+                if (parser->time_keep == FLB_FALSE) {
+                    continue;
+                }
+            }
+        }
+
+        msgpack_sbuffer_write(&tmp_sbuf, cap->key, cap->key_size);
+        if (cap->type != 0) {
+            flb_parser_typecast_value(cap->name, cap->type, val, vlen,
+                                      &tmp_pck);
+        }
+        else {
+            msgpack_pack_str(&tmp_pck, vlen);
+            msgpack_pack_str_body(&tmp_pck, val, vlen);
+        }
+    }
+    flb_regex_results_release(&result);
 
-    /* Iterate results and compose new buffer */
-    last_byte = flb_regex_parse(parser->regex, &result, cb_results, &pcb);
     if (last_byte == -1) {
         msgpack_sbuffer_destroy(&tmp_sbuf);
         return -1;
@@ -164,8 +249,8 @@ int flb_parser_regex_do(struct flb_parser *parser,
      * in Big-Endian is a requirement.
      */
     if (parser->time_fmt && parser->time_keep == FLB_FALSE &&
-        pcb.time_found == FLB_TRUE) {
-        arr_size = (n - 1);
+        time_found == FLB_TRUE) {
+        arr_size--;
 
         tmp = tmp_sbuf.data;
         uint8_t h = tmp[0];
@@ -187,8 +272,8 @@ int flb_parser_regex_do(struct flb_parser *parser,
     *out_size = tmp_sbuf.size;
 
     t = out_time;
-    t->tm.tv_sec  = pcb.time_lookup;
-    t->tm.tv_nsec = (pcb.time_frac * 1000000000);
+    t->tm.tv_sec  = time_lookup;
+    t->tm.tv_nsec = (time_frac * 1000000000);
 
     /* Check if some decoder was specified */
     if (parser->decoders) {
@@ -32,11 +32,32 @@
 #include <fluent-bit/flb_api.h>
 #include <fluent-bit/flb_error.h>
 #include <fluent-bit/flb_utils.h>
+#include <fluent-bit/flb_mp.h>
+#include <fluent-bit/flb_chunk_index.h>
 #include <fluent-bit/flb_plugin_proxy.h>
 
 /* Proxies */
 #include "proxy/go/go.h"
 
+/* Records in the flushed buffer, the task index knows it most times */
+static int proxy_records(void *data, size_t bytes)
+{
+    struct flb_thread *th;
+    struct flb_task *task;
+    struct flb_output_thread *out_th;
+
+    th = (struct flb_thread *) pthread_getspecific(flb_thread_key);
+    if (th) {
+        out_th = (struct flb_output_thread *) FLB_THREAD_DATA(th);
+        task = out_th->task;
+        if (task && task->buf == data) {
+            return flb_chunk_index_count(&task->index, data, bytes);
+        }
+    }
+
+    return flb_mp_count(data, bytes);
+}
+
 static void flb_proxy_cb_flush(void *data, size_t bytes,
                                char *tag, int tag_len,
                                struct flb_input_instance *i_ins,
@@ -45,17 +66,19 @@ static void flb_proxy_cb_flush(void *data, size_t bytes,
 {
     int ret = FLB_ERROR;
     struct flb_plugin_proxy *p = out_context;
-    (void) tag_len;
     (void) i_ins;
     (void) config;
 
 #ifdef FLB_HAVE_PROXY_GO
     if (p->proxy == FLB_PROXY_GOLANG) {
         flb_trace("[GO] entering go_flush()");
-        ret = proxy_go_flush(p, data, bytes, tag);
+        ret = proxy_go_flush(p, data, bytes, tag, tag_len,
+                             proxy_records(data, bytes));
     }
 #else
     (void) p;
+    (void) tag_len;
+    (void) proxy_records;
 #endif
 
     if (ret != FLB_OK && ret != FLB_RETRY && ret != FLB_ERROR) {
@@ -65,6 +88,21 @@ static void flb_proxy_cb_flush(void *data, size_t bytes,
     FLB_OUTPUT_RETURN(ret);
 }
 
+static int flb_proxy_cb_exit(void *out_context, struct flb_config *config)
+{
+    struct flb_plugin_proxy *p = out_context;
+    (void) config;
+
+#ifdef FLB_HAVE_PROXY_GO
+    if (p->proxy == FLB_PROXY_GOLANG) {
+        proxy_go_exit(p);
+    }
+#else
+    (void) p;
+#endif
+
+    return 0;
+}
 
 static int flb_proxy_register_output(struct flb_plugin_proxy *proxy,
                                      struct flb_plugin_proxy_def *def,
@@ -92,6 +130,7 @@ static int flb_proxy_register_output(struct flb_plugin_proxy *proxy,
      * we put our proxy-middle callbacks to do the translation properly.
      */
     out->cb_flush = flb_proxy_cb_flush;
+    out->cb_exit  = flb_proxy_cb_exit;
     return 0;
 }
 
@@ -174,7 +213,7 @@ int flb_plugin_proxy_init(struct flb_plugin_proxy *proxy,
     /* Based on 'proxy', use the proper handler */
     if (proxy->proxy == FLB_PROXY_GOLANG) {
 #ifdef FLB_HAVE_PROXY_GO
-        ret = proxy_go_init(proxy);
+        ret = proxy_go_init(proxy, config);
 #endif
     }
     else {
@@ -0,0 +1,116 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <strings.h>
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_priority.h>
+
+/* Turns of every class in a round, from low to high */
+static const int priority_weights[FLB_PRIORITY_CLASSES] = {1, 2, 4};
+
+static const char *priority_names[FLB_PRIORITY_CLASSES] = {
+    "low", "normal", "high"
+};
+
+/* Priority class from its name, -1 if unknown */
+int flb_priority_parse(const char *str)
+{
+    int i;
+
+    for (i = 0; i < FLB_PRIORITY_CLASSES; i++) {
+        if (strcasecmp(str, priority_names[i]) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+const char *flb_priority_name(int priority)
+{
+    if (priority < 0 || priority >= FLB_PRIORITY_CLASSES) {
+        return "unknown";
+    }
+    return priority_names[priority];
+}
+
+void flb_priority_queue_init(struct flb_priority_queue *q)
+{
+    int i;
+
+    q->count = 0;
+    q->turns = 0;
+
+    /* The first round starts with the high class */
+    q->current = FLB_PRIORITY_LOW;
+    for (i = 0; i < FLB_PRIORITY_CLASSES; i++) {
+        mk_list_init(&q->lists[i]);
+    }
+}
+
+void flb_priority_queue_add(struct flb_priority_queue *q,
+                            struct mk_list *head, int priority)
+{
+    mk_list_add(head, &q->lists[priority]);
+    q->count++;
+}
+
+/* Unlink an entry that is still queued */
+void flb_priority_queue_del(struct flb_priority_queue *q,
+                            struct mk_list *head)
+{
+    mk_list_del(head);
+    q->count--;
+}
+
+/*
+ * Take the next entry: the current class keeps going while it has turns
+ * left, then the next class with entries takes over, going down from high
+ * to low and then again from high.
+ */
+struct mk_list *flb_priority_queue_pop(struct flb_priority_queue *q)
+{
+    int i;
+    int c;
+    struct mk_list *head;
+
+    if (q->count == 0) {
+        return NULL;
+    }
+
+    c = q->current;
+    if (q->turns <= 0 || mk_list_is_empty(&q->lists[c]) == 0) {
+        for (i = 1; i <= FLB_PRIORITY_CLASSES; i++) {
+            c = (q->current - i + FLB_PRIORITY_CLASSES) % FLB_PRIORITY_CLASSES;
+            if (mk_list_is_empty(&q->lists[c]) != 0) {
+                break;
+            }
+        }
+        q->current = c;
+        q->turns = priority_weights[c];
+    }
+
+    head = q->lists[c].next;
+    mk_list_del(head);
+    q->count--;
+    q->turns--;
+
+    return head;
+}
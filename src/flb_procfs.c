@@ -0,0 +1,187 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_log.h>
+#include <fluent-bit/flb_str.h>
+#include <fluent-bit/flb_config.h>
+#include <fluent-bit/flb_procfs.h>
+
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+static inline uint64_t procfs_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+struct flb_procfs_file *flb_procfs_file_open(const char *path)
+{
+    struct flb_procfs_file *file;
+
+    file = flb_calloc(1, sizeof(struct flb_procfs_file));
+    if (!file) {
+        flb_errno();
+        return NULL;
+    }
+
+    file->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (file->fd == -1) {
+        flb_free(file);
+        return NULL;
+    }
+
+    file->path = flb_strdup(path);
+    file->buf = flb_malloc(FLB_PROCFS_BUF_SIZE);
+    if (!file->path || !file->buf) {
+        flb_errno();
+        flb_procfs_file_close(file);
+        return NULL;
+    }
+    file->buf_size = FLB_PROCFS_BUF_SIZE;
+
+    return file;
+}
+
+void flb_procfs_file_close(struct flb_procfs_file *file)
+{
+    if (file->fd != -1) {
+        close(file->fd);
+    }
+    flb_free(file->path);
+    flb_free(file->buf);
+    flb_free(file);
+}
+
+/*
+ * Read the whole file in a single pread(2): most /proc files are rendered
+ * on each read, a partial read followed by another one could mix two
+ * samples. If the content fills the buffer it's read again with a buffer
+ * twice as large.
+ */
+char *flb_procfs_file_read(struct flb_procfs_file *file, size_t *size)
+{
+    char *tmp;
+    ssize_t bytes;
+
+    while (1) {
+        bytes = pread(file->fd, file->buf, file->buf_size - 1, 0);
+        if (bytes == -1) {
+            return NULL;
+        }
+
+        if ((size_t) bytes < file->buf_size - 1) {
+            break;
+        }
+
+        tmp = flb_realloc(file->buf, file->buf_size * 2);
+        if (!tmp) {
+            flb_errno();
+            return NULL;
+        }
+        file->buf = tmp;
+        file->buf_size *= 2;
+    }
+
+    file->buf[bytes] = '\0';
+    file->len = bytes;
+    file->sampled = procfs_now();
+
+    if (size) {
+        *size = bytes;
+    }
+    return file->buf;
+}
+
+/*
+ * Shared files: the system wide files (/proc/stat, /proc/diskstats, ...)
+ * are opened once and every input sampling them uses the same descriptor
+ * and content.
+ */
+struct flb_procfs_file *flb_procfs_get(struct flb_config *config,
+                                       const char *path)
+{
+    struct mk_list *head;
+    struct flb_procfs_file *file;
+
+    mk_list_foreach(head, &config->procfs_files) {
+        file = mk_list_entry(head, struct flb_procfs_file, _head);
+        if (strcmp(file->path, path) == 0) {
+            file->users++;
+            return file;
+        }
+    }
+
+    file = flb_procfs_file_open(path);
+    if (!file) {
+        return NULL;
+    }
+    file->users = 1;
+    mk_list_add(&file->_head, &config->procfs_files);
+
+    return file;
+}
+
+void flb_procfs_put(struct flb_config *config, struct flb_procfs_file *file)
+{
+    (void) config;
+
+    if (--file->users > 0) {
+        return;
+    }
+
+    mk_list_del(&file->_head);
+    flb_procfs_file_close(file);
+}
+
+/*
+ * Content of a shared file, it's read again only if the last sample is
+ * older than FLB_PROCFS_SAMPLE_NS: the inputs that fire on the same
+ * interval share one read.
+ */
+char *flb_procfs_sample(struct flb_procfs_file *file, size_t *size)
+{
+    if (file->sampled > 0 &&
+        procfs_now() - file->sampled < FLB_PROCFS_SAMPLE_NS) {
+        if (size) {
+            *size = file->len;
+        }
+        return file->buf;
+    }
+
+    return flb_procfs_file_read(file, size);
+}
+
+void flb_procfs_exit(struct flb_config *config)
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct flb_procfs_file *file;
+
+    mk_list_foreach_safe(head, tmp, &config->procfs_files) {
+        file = mk_list_entry(head, struct flb_procfs_file, _head);
+        mk_list_del(&file->_head);
+        flb_procfs_file_close(file);
+    }
+}
@@ -0,0 +1,242 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_str.h>
+#include <fluent-bit/flb_log.h>
+#include <fluent-bit/flb_record_accessor.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+/* Count the steps of a '$' pattern, it returns -1 if it's not valid */
+static int pattern_parse(char *p, struct flb_ra_step *steps)
+{
+    int n = 0;
+    char q;
+    char *end;
+    char *start;
+
+    /* First level key: up to the first subscript */
+    start = ++p;
+    while (*p && *p != '[') {
+        p++;
+    }
+    if (p == start) {
+        return -1;
+    }
+    if (steps) {
+        steps[n].type = FLB_RA_KEY;
+        steps[n].key = start;
+        steps[n].len = p - start;
+    }
+    n++;
+
+    /* Subscripts: ['key'], ["key"] or [index] */
+    while (*p) {
+        if (*p++ != '[') {
+            return -1;
+        }
+
+        if (*p == '\'' || *p == '"') {
+            q = *p++;
+            start = p;
+            end = strchr(p, q);
+            if (!end || end == start || end[1] != ']') {
+                return -1;
+            }
+            if (steps) {
+                steps[n].type = FLB_RA_KEY;
+                steps[n].key = start;
+                steps[n].len = end - start;
+            }
+            p = end + 2;
+        }
+        else if (isdigit((unsigned char) *p)) {
+            start = p;
+            while (isdigit((unsigned char) *p)) {
+                p++;
+            }
+            if (*p != ']') {
+                return -1;
+            }
+            if (steps) {
+                steps[n].type = FLB_RA_INDEX;
+                steps[n].index = atoi(start);
+            }
+            p++;
+        }
+        else {
+            return -1;
+        }
+        n++;
+    }
+
+    return n;
+}
+
+struct flb_record_accessor *flb_ra_create(char *pattern)
+{
+    int n;
+    struct flb_record_accessor *ra;
+
+    if (!pattern || *pattern == '\0') {
+        return NULL;
+    }
+
+    if (*pattern == '$') {
+        n = pattern_parse(pattern, NULL);
+        if (n <= 0) {
+            flb_error("[record accessor] invalid pattern '%s'", pattern);
+            return NULL;
+        }
+    }
+    else {
+        n = 1;
+    }
+
+    ra = flb_calloc(1, sizeof(struct flb_record_accessor));
+    if (!ra) {
+        flb_errno();
+        return NULL;
+    }
+
+    /* The steps keys point to our own copy of the pattern */
+    ra->pattern = flb_strdup(pattern);
+    ra->steps = flb_calloc(n, sizeof(struct flb_ra_step));
+    if (!ra->pattern || !ra->steps) {
+        flb_errno();
+        flb_ra_destroy(ra);
+        return NULL;
+    }
+    ra->steps_len = n;
+
+    if (*pattern == '$') {
+        pattern_parse(ra->pattern, ra->steps);
+    }
+    else {
+        ra->steps[0].type = FLB_RA_KEY;
+        ra->steps[0].key = ra->pattern;
+        ra->steps[0].len = strlen(ra->pattern);
+    }
+
+    return ra;
+}
+
+void flb_ra_destroy(struct flb_record_accessor *ra)
+{
+    flb_free(ra->pattern);
+    flb_free(ra->steps);
+    flb_free(ra);
+}
+
+static inline int key_cmp(msgpack_object *o, struct flb_ra_step *step)
+{
+    if (o->type == MSGPACK_OBJECT_STR) {
+        return (o->via.str.size == step->len &&
+                memcmp(o->via.str.ptr, step->key, step->len) == 0);
+    }
+    else if (o->type == MSGPACK_OBJECT_BIN) {
+        return (o->via.bin.size == step->len &&
+                memcmp(o->via.bin.ptr, step->key, step->len) == 0);
+    }
+    return FLB_FALSE;
+}
+
+static inline msgpack_object *map_get(msgpack_object *map,
+                                      struct flb_ra_step *step)
+{
+    int i;
+    int hint;
+    int size = map->via.map.size;
+    msgpack_object_kv *kv = map->via.map.ptr;
+
+    /* The hint is shared by the threads running the same filter */
+    hint = __atomic_load_n(&step->hint, __ATOMIC_RELAXED);
+    if (hint < size && key_cmp(&kv[hint].key, step)) {
+        return &kv[hint].val;
+    }
+
+    for (i = 0; i < size; i++) {
+        if (key_cmp(&kv[i].key, step)) {
+            __atomic_store_n(&step->hint, i, __ATOMIC_RELAXED);
+            return &kv[i].val;
+        }
+    }
+
+    return NULL;
+}
+
+/* Find the value of the path in the record map, NULL if it's not there */
+msgpack_object *flb_ra_get(struct flb_record_accessor *ra, msgpack_object map)
+{
+    int i;
+    msgpack_object *o = &map;
+    struct flb_ra_step *step;
+
+    for (i = 0; i < ra->steps_len; i++) {
+        step = &ra->steps[i];
+        if (step->type == FLB_RA_KEY) {
+            if (o->type != MSGPACK_OBJECT_MAP) {
+                return NULL;
+            }
+            o = map_get(o, step);
+            if (!o) {
+                return NULL;
+            }
+        }
+        else {
+            if (o->type != MSGPACK_OBJECT_ARRAY ||
+                step->index >= o->via.array.size) {
+                return NULL;
+            }
+            o = &o->via.array.ptr[step->index];
+        }
+    }
+
+    return o;
+}
+
+/* Same as flb_ra_get() for string values (or binary), returns -1 if not */
+int flb_ra_get_str(struct flb_record_accessor *ra, msgpack_object map,
+                   char **str, int *len)
+{
+    msgpack_object *o;
+
+    o = flb_ra_get(ra, map);
+    if (!o) {
+        return -1;
+    }
+
+    if (o->type == MSGPACK_OBJECT_STR) {
+        *str = (char *) o->via.str.ptr;
+        *len = o->via.str.size;
+    }
+    else if (o->type == MSGPACK_OBJECT_BIN) {
+        *str = (char *) o->via.bin.ptr;
+        *len = o->via.bin.size;
+    }
+    else {
+        return -1;
+    }
+
+    return 0;
+}
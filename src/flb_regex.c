@@ -17,12 +17,53 @@
  *  limitations under the License.
  */
 
+#define _GNU_SOURCE
+#include <string.h>
+
 #include <fluent-bit/flb_info.h>
 #include <fluent-bit/flb_regex.h>
 #include <fluent-bit/flb_log.h>
 
-#include <string.h>
+#include <ctype.h>
 #include <onigmo.h>
+#include <pthread.h>
+
+/* Plugins initialized in parallel may compile patterns at the same time */
+static pthread_mutex_t regex_compile_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Patterns compiled once and shared by reference, see flb_regex_get() */
+static struct flb_regex *regex_shared;
+
+/*
+ * Every thread keeps one spare search region: the region of a search is
+ * returned there once consumed, so the next search of the same thread don't
+ * allocate a new one. Regions are never shared across threads.
+ */
+static __thread OnigRegion *region_spare;
+
+static OnigRegion *region_get()
+{
+    OnigRegion *region;
+
+    region = region_spare;
+    if (region) {
+        region_spare = NULL;
+        return region;
+    }
+
+    return onig_region_new();
+}
+
+static void region_put(OnigRegion *region)
+{
+    if (!region_spare) {
+        onig_region_clear(region);
+        region_spare = region;
+        return;
+    }
+
+    onig_region_free(region, 1);
+}
 
 
 static int
@@ -57,7 +98,244 @@ cb_onig_named(const UChar *name, const UChar *name_end,
     return 0;
 }
 
-static int str_to_regex(unsigned char *pattern, OnigRegex *reg)
+struct regex_names_ctx {
+    int (*cb_name) (unsigned char *, size_t, int, void *);
+    void *data;
+};
+
+static int
+cb_onig_names(const UChar *name, const UChar *name_end,
+              int ngroup_num, int *group_nums,
+              regex_t *reg, void *data)
+{
+    int i;
+    int ret;
+    struct regex_names_ctx *ctx = data;
+
+    for (i = 0; i < ngroup_num; i++) {
+        ret = ctx->cb_name((unsigned char *) name, name_end - name,
+                           group_nums[i], ctx->data);
+        if (ret != 0) {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Literal prefilter
+ * -----------------
+ * Walk the top level of the pattern looking for the longest run of plain
+ * characters that any match must contain, e.g: '.log' in the Kubernetes tag
+ * pattern. Groups, classes and escaped sequences break a run and a character
+ * followed by a quantifier is dropped from it. Anything not understood here
+ * (alternations, inline options, escapes taking arguments...) disables the
+ * prefilter, a subject is only discarded if it cannot match.
+ */
+
+/* Skip a character class, returns NULL if it's not understood */
+static unsigned char *regex_skip_class(unsigned char *p, unsigned char *end)
+{
+    int depth = 1;
+
+    p++;
+    if (p < end && *p == '^') {
+        p++;
+    }
+    if (p < end && *p == ']') {
+        return NULL;
+    }
+
+    while (p < end) {
+        if (*p == '\\') {
+            p++;
+        }
+        else if (*p == '[') {
+            depth++;
+        }
+        else if (*p == ']' && --depth == 0) {
+            return p + 1;
+        }
+        p++;
+    }
+
+    return NULL;
+}
+
+/* Skip a group, returns NULL if it's not understood */
+static unsigned char *regex_skip_group(unsigned char *p, unsigned char *end)
+{
+    int depth = 0;
+
+    /* Comments are not nested, they end on the first parenthesis */
+    if (p + 2 < end && p[1] == '?' && p[2] == '#') {
+        p = memchr(p, ')', end - p);
+        return p ? p + 1 : NULL;
+    }
+
+    while (p < end) {
+        if (*p == '\\') {
+            p += 2;
+            continue;
+        }
+        else if (*p == '[') {
+            p = regex_skip_class(p, end);
+            if (!p) {
+                return NULL;
+            }
+            continue;
+        }
+        else if (*p == '(') {
+            depth++;
+        }
+        else if (*p == ')' && --depth == 0) {
+            return p + 1;
+        }
+        p++;
+    }
+
+    return NULL;
+}
+
+/*
+ * Skip the quantifiers that follow an atom. Returns NULL if they are not
+ * understood, 'required' is set if the atom must still appear once.
+ */
+static unsigned char *regex_skip_quantifier(unsigned char *p, unsigned char *end,
+                                            int *required)
+{
+    int first = FLB_TRUE;
+
+    *required = FLB_TRUE;
+    while (p < end && strchr("?*+{", *p)) {
+        /* 'a+?' and 'a++' are lazy and possessive forms of 'a+' */
+        if (*p != '+' && !(first == FLB_FALSE && *p == '?')) {
+            *required = FLB_FALSE;
+        }
+
+        if (*p == '{') {
+            p = memchr(p, '}', end - p);
+            if (!p) {
+                return NULL;
+            }
+        }
+        first = FLB_FALSE;
+        p++;
+    }
+
+    return p;
+}
+
+static inline void regex_literal_keep(struct flb_regex *r,
+                                      unsigned char *run, int n)
+{
+    if (n > r->literal_len) {
+        memcpy(r->literal, run, n);
+        r->literal_len = n;
+    }
+}
+
+static void regex_literal(struct flb_regex *r,
+                          unsigned char *p, unsigned char *end)
+{
+    int n = 0;
+    int lit;
+    int required;
+    unsigned char c;
+    unsigned char *atom_end;
+    unsigned char run[FLB_REGEX_LITERAL];
+
+    r->literal_len = 0;
+
+    while (p < end) {
+        lit = -1;
+        c = *p;
+
+        if (c == '|') {
+            goto disable;
+        }
+        else if (c == '(') {
+            /* Inline options change how the rest of the pattern matches */
+            if (p + 2 < end && p[1] == '?' && strchr("imxadlu-", p[2])) {
+                goto disable;
+            }
+            p = regex_skip_group(p, end);
+        }
+        else if (c == '[') {
+            p = regex_skip_class(p, end);
+        }
+        else if (c == '\\') {
+            if (p + 1 >= end) {
+                goto disable;
+            }
+            c = p[1];
+            if (isdigit(c) || (c < 0x80 && strchr("xucCMkgpP", c))) {
+                /* Back references and escapes taking arguments */
+                goto disable;
+            }
+            if (c < 0x80 && !isalnum(c)) {
+                lit = c;
+            }
+            p += 2;
+        }
+        else if (!strchr("?*+{", c)) {
+            /* Multibyte characters are not taken, just like anchors */
+            if (c < 0x80 && !strchr(".^$)", c)) {
+                lit = c;
+            }
+            p++;
+        }
+
+        if (!p) {
+            goto disable;
+        }
+
+        atom_end = p;
+        p = regex_skip_quantifier(p, end, &required);
+        if (!p) {
+            goto disable;
+        }
+
+        if (lit != -1 && required == FLB_TRUE && n < FLB_REGEX_LITERAL) {
+            run[n++] = lit;
+        }
+
+        if (lit == -1 || p != atom_end) {
+            regex_literal_keep(r, run, n);
+            n = 0;
+
+            /* With 'a+b' the next run still starts with 'a' */
+            if (lit != -1 && required == FLB_TRUE) {
+                run[n++] = lit;
+            }
+        }
+    }
+
+    regex_literal_keep(r, run, n);
+    return;
+
+ disable:
+    r->literal_len = 0;
+}
+
+/* Check if the subject could match the pattern */
+static inline int regex_prefilter(struct flb_regex *r,
+                                  unsigned char *str, size_t slen)
+{
+    if (r->literal_len == 0) {
+        return FLB_TRUE;
+    }
+
+    if (slen < r->literal_len ||
+        !memmem(str, slen, r->literal, r->literal_len)) {
+        return FLB_FALSE;
+    }
+
+    return FLB_TRUE;
+}
+
+static int str_to_regex(unsigned char *pattern, struct flb_regex *r)
 {
     int ret;
     int len;
@@ -74,13 +352,15 @@ static int str_to_regex(unsigned char *pattern, OnigRegex *reg)
         end--;
     }
 
-    ret = onig_new(reg, start, end,
+    ret = onig_new(&r->regex, start, end,
                    ONIG_OPTION_DEFAULT,
                    ONIG_ENCODING_UTF8, ONIG_SYNTAX_RUBY, &einfo);
 
     if (ret != ONIG_NORMAL) {
         return -1;
     }
+
+    regex_literal(r, start, end);
     return 0;
 }
 
@@ -101,8 +381,14 @@ struct flb_regex *flb_regex_create(unsigned char *pattern)
         return NULL;
     }
 
+    r->key = NULL;
+    r->refs = 0;
+    r->next = NULL;
+
     /* Compile pattern */
-    ret = str_to_regex(pattern, &r->regex);
+    pthread_mutex_lock(&regex_compile_lock);
+    ret = str_to_regex(pattern, r);
+    pthread_mutex_unlock(&regex_compile_lock);
     if (ret == -1) {
         free(r);
         return NULL;
@@ -111,6 +397,81 @@ struct flb_regex *flb_regex_create(unsigned char *pattern)
     return r;
 }
 
+/*
+ * Get a reference to the compiled form of a pattern, it's compiled only the
+ * first time: instances and threads using the same pattern share it. The
+ * compiled regex is read-only, searches keep their state in the region so
+ * it can be used by several threads at the same time. Release the reference
+ * with flb_regex_put().
+ */
+struct flb_regex *flb_regex_get(unsigned char *pattern)
+{
+    int ret;
+    struct flb_regex *r;
+
+    pthread_mutex_lock(&regex_compile_lock);
+    for (r = regex_shared; r; r = r->next) {
+        if (strcmp(r->key, (char *) pattern) == 0) {
+            r->refs++;
+            pthread_mutex_unlock(&regex_compile_lock);
+            return r;
+        }
+    }
+
+    r = malloc(sizeof(struct flb_regex));
+    if (!r) {
+        pthread_mutex_unlock(&regex_compile_lock);
+        return NULL;
+    }
+
+    r->key = strdup((char *) pattern);
+    if (!r->key) {
+        free(r);
+        pthread_mutex_unlock(&regex_compile_lock);
+        return NULL;
+    }
+
+    ret = str_to_regex(pattern, r);
+    if (ret == -1) {
+        free(r->key);
+        free(r);
+        pthread_mutex_unlock(&regex_compile_lock);
+        return NULL;
+    }
+
+    r->refs = 1;
+    r->next = regex_shared;
+    regex_shared = r;
+    pthread_mutex_unlock(&regex_compile_lock);
+
+    return r;
+}
+
+/* Drop a reference taken with flb_regex_get() */
+void flb_regex_put(struct flb_regex *r)
+{
+    struct flb_regex **prev;
+
+    pthread_mutex_lock(&regex_compile_lock);
+    r->refs--;
+    if (r->refs > 0) {
+        pthread_mutex_unlock(&regex_compile_lock);
+        return;
+    }
+
+    for (prev = &regex_shared; *prev; prev = &(*prev)->next) {
+        if (*prev == r) {
+            *prev = r->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&regex_compile_lock);
+
+    onig_free(r->regex);
+    free(r->key);
+    free(r);
+}
+
 ssize_t flb_regex_do(struct flb_regex *r, unsigned char *str, size_t slen,
                      struct flb_regex_search *result)
 {
@@ -120,7 +481,11 @@ ssize_t flb_regex_do(struct flb_regex *r, unsigned char *str, size_t slen,
     unsigned char *range;
     OnigRegion *region;
 
-    region = onig_region_new();
+    if (regex_prefilter(r, str, slen) == FLB_FALSE) {
+        return -1;
+    }
+
+    region = region_get();
     if (!region) {
         return -1;
     }
@@ -132,11 +497,11 @@ ssize_t flb_regex_do(struct flb_regex *r, unsigned char *str, size_t slen,
 
     ret = onig_search(r->regex, str, end, start, range, region, ONIG_OPTION_NONE);
     if (ret == ONIG_MISMATCH) {
-        onig_region_free(region, 1);
+        region_put(region);
         return -1;
     }
     else if (ret < 0) {
-        onig_region_free(region, 1);
+        region_put(region);
         return -1;
     }
 
@@ -147,12 +512,41 @@ ssize_t flb_regex_do(struct flb_regex *r, unsigned char *str, size_t slen,
 
     if (ret == 0) {
         result->region = NULL;
-        onig_region_free(region, 1);
+        region_put(region);
     }
 
     return ret;
 }
 
+/*
+ * Check if the subject matches, the search don't keep any region so it's the
+ * cheapest option when the captures are not needed. Returns 1 on match, 0
+ * if it don't match and -1 on error.
+ */
+int flb_regex_match(struct flb_regex *r, unsigned char *str, size_t slen)
+{
+    int ret;
+    unsigned char *start;
+    unsigned char *end;
+
+    if (regex_prefilter(r, str, slen) == FLB_FALSE) {
+        return 0;
+    }
+
+    start = (unsigned char *) str;
+    end   = start + slen;
+
+    ret = onig_search(r->regex, str, end, start, end, NULL, ONIG_OPTION_NONE);
+    if (ret == ONIG_MISMATCH) {
+        return 0;
+    }
+    else if (ret < 0) {
+        return -1;
+    }
+
+    return 1;
+}
+
 int flb_regex_parse(struct flb_regex *r, struct flb_regex_search *result,
                     void (*cb_match) (unsigned char *,          /* name  */
                                       unsigned char *, size_t,  /* value */
@@ -166,7 +560,8 @@ int flb_regex_parse(struct flb_regex *r, struct flb_regex_search *result,
     result->last_pos = -1;
 
     ret = onig_foreach_name(r->regex, cb_onig_named, result);
-    onig_region_free(result->region, 1);
+    region_put(result->region);
+    result->region = NULL;
 
     if (ret == 0) {
         return result->last_pos;
@@ -174,6 +569,34 @@ int flb_regex_parse(struct flb_regex *r, struct flb_regex_search *result,
     return -1;
 }
 
+/*
+ * Iterate the named groups of a compiled pattern in the same order used by
+ * flb_regex_parse(). This let callers resolve names to group numbers once
+ * and later read the matches directly from the search region.
+ */
+int flb_regex_foreach_name(struct flb_regex *r,
+                           int (*cb_name) (unsigned char *, size_t, /* name */
+                                           int,                     /* group */
+                                           void *),                 /* data */
+                           void *data)
+{
+    struct regex_names_ctx ctx;
+
+    ctx.cb_name = cb_name;
+    ctx.data = data;
+
+    return onig_foreach_name(r->regex, cb_onig_names, &ctx);
+}
+
+/* Release the region of a search not consumed through flb_regex_parse() */
+void flb_regex_results_release(struct flb_regex_search *result)
+{
+    if (result->region) {
+        region_put(result->region);
+        result->region = NULL;
+    }
+}
+
 int flb_regex_destroy(struct flb_regex *r)
 {
     onig_free(r->regex);
@@ -181,7 +604,17 @@ int flb_regex_destroy(struct flb_regex *r)
     return 0;
 }
 
+/* Release the spare search region of the calling thread */
+void flb_regex_thread_exit()
+{
+    if (region_spare) {
+        onig_region_free(region_spare, 1);
+        region_spare = NULL;
+    }
+}
+
 void flb_regex_exit()
 {
+    flb_regex_thread_exit();
     onig_end();
 }
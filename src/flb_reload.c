@@ -0,0 +1,616 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <monkey/mk_core.h>
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_log.h>
+#include <fluent-bit/flb_sds.h>
+#include <fluent-bit/flb_env.h>
+#include <fluent-bit/flb_meta.h>
+#include <fluent-bit/flb_pipe.h>
+#include <fluent-bit/flb_config.h>
+#include <fluent-bit/flb_engine.h>
+#include <fluent-bit/flb_filter.h>
+#include <fluent-bit/flb_output.h>
+#include <fluent-bit/flb_scheduler.h>
+#include <fluent-bit/flb_stats.h>
+#include <fluent-bit/flb_time.h>
+#include <fluent-bit/flb_reload.h>
+
+/* Append 'a' 'sep' 'b' '\n' to the signature */
+static flb_sds_t sig_add(flb_sds_t sig, char *a, char *sep, char *b)
+{
+    flb_sds_t tmp;
+
+    tmp = flb_sds_increase(sig, strlen(a) + strlen(b) + 3);
+    if (!tmp) {
+        flb_sds_destroy(sig);
+        return NULL;
+    }
+    sig = flb_sds_cat(tmp, a, strlen(a));
+    sig = flb_sds_cat(sig, sep, strlen(sep));
+    sig = flb_sds_cat(sig, b, strlen(b));
+    return flb_sds_cat(sig, "\n", 1);
+}
+
+/* Buffer chunks store the routing masks of the outputs, these stay fixed */
+static int outputs_reloadable(struct flb_config *config)
+{
+#ifdef FLB_HAVE_BUFFERING
+    if (config->buffer_path) {
+        return FLB_FALSE;
+    }
+#endif
+    return FLB_TRUE;
+}
+
+/*
+ * Content of the sections a reload can not apply, in the file order. The
+ * values are the raw ones, a different environment at reload time is not
+ * detected.
+ */
+static flb_sds_t conf_signature(struct mk_rconf *fconf,
+                                struct flb_config *config)
+{
+    int outputs = outputs_reloadable(config);
+    struct mk_list *head;
+    struct mk_list *h_prop;
+    struct mk_rconf_entry *entry;
+    struct mk_rconf_section *section;
+    flb_sds_t sig;
+
+    sig = flb_sds_create_size(256);
+    if (!sig) {
+        return NULL;
+    }
+
+    mk_list_foreach(head, &fconf->sections) {
+        section = mk_list_entry(head, struct mk_rconf_section, _head);
+        if (strcasecmp(section->name, "FILTER") == 0 ||
+            (outputs && strcasecmp(section->name, "OUTPUT") == 0)) {
+            continue;
+        }
+
+        sig = sig_add(sig, "[", "", section->name);
+        if (!sig) {
+            return NULL;
+        }
+        mk_list_foreach(h_prop, &section->entries) {
+            entry = mk_list_entry(h_prop, struct mk_rconf_entry, _head);
+            sig = sig_add(sig, entry->key, "=", entry->val);
+            if (!sig) {
+                return NULL;
+            }
+        }
+    }
+
+    return sig;
+}
+
+/* Keep the state needed to compare the configuration on every reload */
+int flb_reload_init(struct flb_config *config)
+{
+    struct mk_rconf *fconf;
+    struct flb_reload *ctx;
+
+    if (config->hot_reload == FLB_FALSE || config->reload_ctx) {
+        return 0;
+    }
+
+    if (!config->conf_file) {
+        flb_warn("[reload] no configuration file, hot reload disabled");
+        return -1;
+    }
+
+    fconf = mk_rconf_open(config->conf_file);
+    if (!fconf) {
+        flb_error("[reload] cannot read %s", config->conf_file);
+        return -1;
+    }
+
+    ctx = flb_calloc(1, sizeof(struct flb_reload));
+    if (!ctx) {
+        flb_errno();
+        mk_rconf_free(fconf);
+        return -1;
+    }
+
+    ctx->signature = conf_signature(fconf, config);
+    mk_rconf_free(fconf);
+    if (!ctx->signature) {
+        flb_free(ctx);
+        return -1;
+    }
+    config->reload_ctx = ctx;
+
+    flb_info("[reload] hot reload enabled for %s", config->conf_file);
+    return 0;
+}
+
+void flb_reload_exit(struct flb_config *config)
+{
+    struct flb_reload *ctx = config->reload_ctx;
+
+    if (!ctx) {
+        return;
+    }
+
+    flb_sched_timer_cb_cancel(config, ctx);
+    flb_sds_destroy(ctx->signature);
+    flb_free(ctx);
+    config->reload_ctx = NULL;
+}
+
+/*
+ * Ask the engine thread to reload. It only writes to the manager pipe, it
+ * can be called from a signal handler or from any thread.
+ */
+int flb_reload_request(struct flb_config *config)
+{
+    int ret;
+    uint64_t val = FLB_ENGINE_EV_RELOAD;
+
+    if (!config->reload_ctx) {
+        return -1;
+    }
+
+    ret = flb_pipe_w(config->ch_manager[1], &val, sizeof(val));
+    if (ret != sizeof(val)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Running instance equal to 'ins' and not claimed yet by the new chain */
+static struct flb_filter_instance *filter_lookup(struct flb_filter_instance *ins,
+                                                 struct flb_filter_instance **chain,
+                                                 int n,
+                                                 struct flb_config *config)
+{
+    int i;
+    struct mk_list *head;
+    struct flb_filter_instance *entry;
+
+    mk_list_foreach(head, &config->filters) {
+        entry = mk_list_entry(head, struct flb_filter_instance, _head);
+        if (flb_filter_instance_equal(entry, ins) == FLB_FALSE) {
+            continue;
+        }
+        for (i = 0; i < n; i++) {
+            if (chain[i] == entry) {
+                break;
+            }
+        }
+        if (i == n) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Build the new chain in the order of the [FILTER] sections: 'chain' gets
+ * the reused running instances and the new ones, the new ones are linked
+ * to 'fresh' until they are initialized. Returns the number of instances
+ * or -1.
+ */
+static int chain_build(struct mk_rconf *fconf, struct flb_filter_instance **chain,
+                       struct mk_list *fresh, struct flb_config *config)
+{
+    int n = 0;
+    char *tmp;
+    char *name;
+    struct mk_list *head;
+    struct mk_list *h_prop;
+    struct mk_rconf_entry *entry;
+    struct mk_rconf_section *section;
+    struct flb_filter_instance *ins;
+    struct flb_filter_instance *running;
+
+    mk_list_foreach(head, &fconf->sections) {
+        section = mk_list_entry(head, struct mk_rconf_section, _head);
+        if (strcasecmp(section->name, "FILTER") != 0) {
+            continue;
+        }
+
+        name = mk_rconf_section_get_key(section, "Name", MK_RCONF_STR);
+        if (!name) {
+            flb_error("[reload] [FILTER] without Name");
+            return -1;
+        }
+        tmp = flb_env_var_translate(config->env, name);
+        mk_mem_free(name);
+        if (!tmp) {
+            return -1;
+        }
+
+        ins = flb_filter_new_detached(config, tmp, NULL, fresh);
+        if (!ins) {
+            flb_error("[reload] filter plugin '%s' cannot be loaded", tmp);
+            flb_free(tmp);
+            return -1;
+        }
+        flb_free(tmp);
+
+        mk_list_foreach(h_prop, &section->entries) {
+            entry = mk_list_entry(h_prop, struct mk_rconf_entry, _head);
+            if (strcasecmp(entry->key, "Name") == 0) {
+                continue;
+            }
+            if (flb_filter_set_property(ins, entry->key, entry->val) == -1) {
+                flb_error("[reload] invalid property '%s' in %s",
+                          entry->key, ins->name);
+                return -1;
+            }
+        }
+
+        if (!ins->match) {
+            flb_warn("[filter] NO match rule for %s filter instance, unloading.",
+                     ins->name);
+            flb_filter_instance_destroy(ins, FLB_FALSE);
+            continue;
+        }
+
+        /* Unchanged filter: keep the running instance */
+        running = filter_lookup(ins, chain, n, config);
+        if (running) {
+            flb_filter_instance_destroy(ins, FLB_FALSE);
+            ins = running;
+        }
+        chain[n++] = ins;
+    }
+
+    return n;
+}
+
+static void fresh_destroy(struct mk_list *fresh, int exit)
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct flb_filter_instance *ins;
+
+    mk_list_foreach_safe(head, tmp, fresh) {
+        ins = mk_list_entry(head, struct flb_filter_instance, _head);
+        flb_filter_instance_destroy(ins, exit);
+    }
+}
+
+/* Running output equal to 'ins' and not claimed yet by the new list */
+static struct flb_output_instance *output_lookup(struct flb_output_instance *ins,
+                                                 struct flb_output_instance **outs,
+                                                 int n,
+                                                 struct flb_config *config)
+{
+    int i;
+    struct mk_list *head;
+    struct flb_output_instance *entry;
+
+    mk_list_foreach(head, &config->outputs) {
+        entry = mk_list_entry(head, struct flb_output_instance, _head);
+        if (flb_output_instance_equal(entry, ins) == FLB_FALSE) {
+            continue;
+        }
+        for (i = 0; i < n; i++) {
+            if (outs[i] == entry) {
+                break;
+            }
+        }
+        if (i == n) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Build the new outputs in the order of the [OUTPUT] sections, like
+ * chain_build() does for the filters. Returns the number of instances or
+ * -1.
+ */
+static int outputs_build(struct mk_rconf *fconf,
+                         struct flb_output_instance **outs,
+                         struct mk_list *fresh, struct flb_config *config)
+{
+    int n = 0;
+    char *tmp;
+    char *name;
+    struct mk_list *head;
+    struct mk_list *h_prop;
+    struct mk_rconf_entry *entry;
+    struct mk_rconf_section *section;
+    struct flb_output_instance *ins;
+    struct flb_output_instance *running;
+
+    mk_list_foreach(head, &fconf->sections) {
+        section = mk_list_entry(head, struct mk_rconf_section, _head);
+        if (strcasecmp(section->name, "OUTPUT") != 0) {
+            continue;
+        }
+
+        name = mk_rconf_section_get_key(section, "Name", MK_RCONF_STR);
+        if (!name) {
+            flb_error("[reload] [OUTPUT] without Name");
+            return -1;
+        }
+        tmp = flb_env_var_translate(config->env, name);
+        mk_mem_free(name);
+        if (!tmp) {
+            return -1;
+        }
+
+        ins = flb_output_new_detached(config, tmp, NULL, fresh);
+        if (!ins) {
+            flb_error("[reload] output plugin '%s' cannot be loaded", tmp);
+            flb_free(tmp);
+            return -1;
+        }
+        flb_free(tmp);
+
+        mk_list_foreach(h_prop, &section->entries) {
+            entry = mk_list_entry(h_prop, struct mk_rconf_entry, _head);
+            if (strcasecmp(entry->key, "Name") == 0) {
+                continue;
+            }
+            if (flb_output_set_property(ins, entry->key, entry->val) == -1) {
+                flb_error("[reload] invalid property '%s' in %s",
+                          entry->key, ins->name);
+                return -1;
+            }
+        }
+
+        /* Unchanged output: keep the running instance and its tasks */
+        running = output_lookup(ins, outs, n, config);
+        if (running) {
+            flb_output_instance_destroy(ins);
+            ins = running;
+        }
+        outs[n++] = ins;
+    }
+
+    return n;
+}
+
+static void outputs_destroy(struct mk_list *list, int exit,
+                            struct flb_config *config)
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct flb_output_instance *ins;
+
+    mk_list_foreach_safe(head, tmp, list) {
+        ins = mk_list_entry(head, struct flb_output_instance, _head);
+        if (exit == FLB_TRUE) {
+            flb_output_instance_exit(ins, config);
+        }
+        else {
+            flb_output_instance_destroy(ins);
+        }
+    }
+}
+
+/* Release the retired outputs once drained, check again while any is left */
+static void cb_outputs_drain(struct flb_config *config, void *data)
+{
+    int ret;
+
+    if (flb_output_retired_cleanup(config) == 0 ||
+        config->is_running == FLB_FALSE) {
+        return;
+    }
+
+    ret = flb_sched_timer_cb_create(config, FLB_RELOAD_DRAIN_CHECK,
+                                    cb_outputs_drain, data);
+    if (ret == -1) {
+        flb_error("[reload] cannot schedule the retired outputs check");
+    }
+}
+
+/* Re-read the configuration file and apply it, runs in the engine thread */
+int flb_reload(struct flb_config *config)
+{
+    int n;
+    int n_out = 0;
+    int kept;
+    int added;
+    int removed_n;
+    int o_kept = 0;
+    int o_added = 0;
+    int o_retired = 0;
+    uint64_t start;
+    struct mk_list fresh;
+    struct mk_list ready;
+    struct mk_list removed;
+    struct mk_list o_fresh;
+    struct mk_list o_ready;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_rconf *fconf;
+    struct mk_rconf_entry *entry;
+    struct mk_rconf_section *section;
+    struct flb_filter_instance *ins;
+    struct flb_filter_instance **chain;
+    struct flb_output_instance *o_ins;
+    struct flb_output_instance **outs = NULL;
+    struct flb_reload *ctx = config->reload_ctx;
+    flb_sds_t sig;
+
+    if (!ctx) {
+        return -1;
+    }
+
+    start = flb_time_usec();
+    flb_info("[reload] reloading %s", config->conf_file);
+
+    fconf = mk_rconf_open(config->conf_file);
+    if (!fconf) {
+        flb_error("[reload] cannot read %s, configuration kept",
+                  config->conf_file);
+        ctx->failures++;
+        return -1;
+    }
+
+    /* Meta commands (@SET, ...) can be used by the filters and outputs */
+    mk_list_foreach(head, &fconf->metas) {
+        entry = mk_list_entry(head, struct mk_rconf_entry, _head);
+        flb_meta_run(config, entry->key, entry->val);
+    }
+
+    sig = conf_signature(fconf, config);
+    if (sig && strcmp(sig, ctx->signature) != 0) {
+        flb_warn("[reload] %s sections changed, a restart is required to "
+                 "apply them", outputs_reloadable(config) ?
+                 "[SERVICE] or [INPUT]" : "[SERVICE], [INPUT] or [OUTPUT]");
+    }
+    flb_sds_destroy(sig);
+
+    /* Upper bounds of the new chain and outputs */
+    n = 0;
+    mk_list_foreach(head, &fconf->sections) {
+        section = mk_list_entry(head, struct mk_rconf_section, _head);
+        if (strcasecmp(section->name, "FILTER") == 0) {
+            n++;
+        }
+        else if (strcasecmp(section->name, "OUTPUT") == 0) {
+            n_out++;
+        }
+    }
+    chain = flb_calloc(n + 1, sizeof(struct flb_filter_instance *));
+    if (!chain) {
+        flb_errno();
+        mk_rconf_free(fconf);
+        ctx->failures++;
+        return -1;
+    }
+
+    mk_list_init(&fresh);
+    mk_list_init(&ready);
+    mk_list_init(&o_fresh);
+    mk_list_init(&o_ready);
+    n = chain_build(fconf, chain, &fresh, config);
+    if (n == -1) {
+        mk_rconf_free(fconf);
+        goto error;
+    }
+
+    if (outputs_reloadable(config) == FLB_TRUE) {
+        outs = flb_calloc(n_out + 1, sizeof(struct flb_output_instance *));
+        if (!outs) {
+            flb_errno();
+            mk_rconf_free(fconf);
+            goto error;
+        }
+        n_out = outputs_build(fconf, outs, &o_fresh, config);
+        if (n_out == 0) {
+            flb_error("[reload] no [OUTPUT] section");
+        }
+        if (n_out <= 0) {
+            mk_rconf_free(fconf);
+            goto error;
+        }
+    }
+    mk_rconf_free(fconf);
+
+    /* New instances start while the running ones keep working */
+    added = 0;
+    mk_list_foreach_safe(head, tmp, &fresh) {
+        ins = mk_list_entry(head, struct flb_filter_instance, _head);
+        if (flb_filter_instance_init(ins, config) == -1) {
+            goto error;
+        }
+        mk_list_del(&ins->_head);
+        mk_list_add(&ins->_head, &ready);
+        added++;
+    }
+    kept = n - added;
+
+    mk_list_foreach_safe(head, tmp, &o_fresh) {
+        o_ins = mk_list_entry(head, struct flb_output_instance, _head);
+        if (flb_output_instance_init(o_ins, config) == -1) {
+            goto error;
+        }
+        mk_list_del(&o_ins->_head);
+        mk_list_add(&o_ins->_head, &o_ready);
+        o_added++;
+    }
+
+    mk_list_init(&removed);
+    flb_filter_chain_swap(config, chain, n, &removed);
+    flb_free(chain);
+
+    removed_n = mk_list_size(&removed);
+    fresh_destroy(&removed, FLB_TRUE);
+
+    /*
+     * Outputs: the removed ones are retired, the tasks routed to them are
+     * still flushed and they are released once drained.
+     */
+    if (outs) {
+        o_kept = n_out - o_added;
+        o_retired = mk_list_size(&config->outputs) - o_kept;
+        flb_output_swap(config, outs, n_out);
+        flb_free(outs);
+
+        if (config->sched) {
+            mk_list_foreach(head, &o_ready) {
+                o_ins = mk_list_entry(head, struct flb_output_instance, _head);
+                flb_engine_output_flush_timer(o_ins, config);
+            }
+        }
+
+        if (flb_output_retired_cleanup(config) > 0 && config->sched) {
+            flb_sched_timer_cb_cancel(config, ctx);
+            if (flb_sched_timer_cb_create(config, FLB_RELOAD_DRAIN_CHECK,
+                                          cb_outputs_drain, ctx) == -1) {
+                flb_error("[reload] cannot schedule the retired outputs "
+                          "check");
+            }
+        }
+    }
+
+#ifdef FLB_HAVE_STATS
+    /* Entries of the segment follow the instances */
+    if (config->stats_ctx) {
+        flb_stats_exit(config);
+        flb_stats_init(config);
+    }
+#endif
+
+    ctx->reloads++;
+    flb_info("[reload] done in %.1f ms: filters kept=%i new=%i removed=%i, "
+             "outputs kept=%i new=%i retired=%i",
+             (flb_time_usec() - start) / 1000.0, kept, added, removed_n,
+             o_kept, o_added, o_retired);
+    return 0;
+
+ error:
+    /* Initialized instances run their exit callback */
+    fresh_destroy(&ready, FLB_TRUE);
+    fresh_destroy(&fresh, FLB_FALSE);
+    outputs_destroy(&o_ready, FLB_TRUE, config);
+    outputs_destroy(&o_fresh, FLB_FALSE, config);
+    flb_free(chain);
+    flb_free(outs);
+    ctx->failures++;
+    flb_error("[reload] aborted, the running configuration is kept");
+    return -1;
+}
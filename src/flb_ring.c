@@ -0,0 +1,123 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <string.h>
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_log.h>
+#include <fluent-bit/flb_ring.h>
+
+/*
+ * Positions are free running 32 bit counters, the slot is the position
+ * masked. The producer publish a slot storing 'head' with release
+ * semantics after copying the message, the consumer release a slot the
+ * same way with 'tail'.
+ */
+
+struct flb_ring *flb_ring_create(size_t slot_size, uint32_t slots)
+{
+    uint32_t n = 1;
+    struct flb_ring *ring;
+
+    if (slot_size == 0 || slots == 0 || slots > (1U << 31)) {
+        return NULL;
+    }
+
+    /* Round up to a power of two */
+    while (n < slots) {
+        n <<= 1;
+    }
+
+    ring = flb_calloc(1, sizeof(struct flb_ring));
+    if (!ring) {
+        flb_errno();
+        return NULL;
+    }
+
+    ring->slots = flb_malloc(slot_size * n);
+    if (!ring->slots) {
+        flb_errno();
+        flb_free(ring);
+        return NULL;
+    }
+    ring->slot_size = slot_size;
+    ring->mask = n - 1;
+
+    return ring;
+}
+
+void flb_ring_destroy(struct flb_ring *ring)
+{
+    if (!ring) {
+        return;
+    }
+
+    flb_free(ring->slots);
+    flb_free(ring);
+}
+
+/* Producer: copy a message into the ring, it returns -1 if it's full */
+int flb_ring_push(struct flb_ring *ring, void *data)
+{
+    uint32_t head;
+    uint32_t tail;
+
+    head = ring->head;
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (head - tail > ring->mask) {
+        return -1;
+    }
+
+    memcpy(ring->slots + ((head & ring->mask) * ring->slot_size),
+           data, ring->slot_size);
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/* Consumer: copy the oldest message out of the ring, -1 if it's empty */
+int flb_ring_pop(struct flb_ring *ring, void *data)
+{
+    uint32_t head;
+    uint32_t tail;
+
+    tail = ring->tail;
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+        return -1;
+    }
+
+    memcpy(data, ring->slots + ((tail & ring->mask) * ring->slot_size),
+           ring->slot_size);
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+int flb_ring_empty(struct flb_ring *ring)
+{
+    uint32_t head;
+    uint32_t tail;
+
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+    return (head == tail);
+}
@@ -24,6 +24,8 @@
 #include <fluent-bit/flb_output.h>
 #include <fluent-bit/flb_config.h>
 #include <fluent-bit/flb_router.h>
+#include <fluent-bit/flb_filter.h>
+#include <fluent-bit/flb_hash.h>
 
 #include <string.h>
 
@@ -103,6 +105,9 @@ int flb_router_io_set(struct flb_config *config)
     struct flb_input_instance *i_ins;
     struct flb_output_instance *o_ins;
 
+    /* Routes could change, drop any cached entry */
+    flb_router_cache_invalidate(config);
+
     /* Quick setup for 1:1 */
     mk_list_foreach(i_head, &config->inputs) {
         in_count++;
@@ -171,7 +176,120 @@ int flb_router_io_set(struct flb_config *config)
     return 0;
 }
 
-void flb_router_exit(struct flb_config *config)
+/* Match the tag against filters and outputs and register the result */
+static struct flb_router_cache_entry *cache_entry_create(struct flb_hash *ht,
+                                                         char *tag, int tag_len,
+                                                         struct flb_config *config)
+{
+    int id;
+    int count = 0;
+    size_t size;
+    char *out_buf;
+    size_t out_size;
+    struct mk_list *head;
+    struct flb_filter_instance *f_ins;
+    struct flb_output_instance *o_ins;
+    struct flb_router_cache_entry *entry;
+
+    mk_list_foreach(head, &config->filters) {
+        count++;
+    }
+
+    size = sizeof(struct flb_router_cache_entry) +
+        (sizeof(struct flb_filter_instance *) * count);
+    entry = flb_malloc(size);
+    if (!entry) {
+        flb_errno();
+        return NULL;
+    }
+    entry->routes_mask = 0;
+    entry->filters_count = 0;
+
+    /* Filters chain, in the same order they were registered */
+    mk_list_foreach(head, &config->filters) {
+        f_ins = mk_list_entry(head, struct flb_filter_instance, _head);
+        if (f_ins->match && flb_router_match(tag, f_ins->match)) {
+            entry->filters[entry->filters_count++] = f_ins;
+        }
+    }
+
+    /* Destinations */
+    mk_list_foreach(head, &config->outputs) {
+        o_ins = mk_list_entry(head, struct flb_output_instance, _head);
+        if (o_ins->match && flb_router_match(tag, o_ins->match)) {
+            entry->routes_mask |= o_ins->mask_id;
+        }
+    }
+
+    /* The hash table keeps it own copy of the entry */
+    size = sizeof(struct flb_router_cache_entry) +
+        (sizeof(struct flb_filter_instance *) * entry->filters_count);
+    id = flb_hash_add(ht, tag, tag_len, (char *) entry, size);
+    flb_free(entry);
+    if (id == -1) {
+        return NULL;
+    }
+
+    id = flb_hash_get_by_id(ht, id, tag, &out_buf, &out_size);
+    if (id == -1) {
+        return NULL;
+    }
+
+    flb_trace("[router] cache tag=%s filters=%i", tag,
+              ((struct flb_router_cache_entry *) out_buf)->filters_count);
+
+    return (struct flb_router_cache_entry *) out_buf;
+}
+
+/*
+ * Lookup the routes for a tag. On a cache miss the 'match' rules are
+ * evaluated just once and the result is kept for the next lookups. It
+ * returns NULL only if the cache could not be used (e.g: no memory), the
+ * caller must fallback to flb_router_match().
+ */
+struct flb_router_cache_entry *flb_router_cache_get(char *tag, int tag_len,
+                                                    struct flb_config *config)
+{
+    int ret;
+    char *out_buf;
+    size_t out_size;
+    struct flb_hash *ht;
+
+    if (!tag || tag_len <= 0) {
+        return NULL;
+    }
+
+    ht = config->router_cache;
+    if (!ht) {
+        ht = flb_hash_create(FLB_HASH_EVICT_RANDOM,
+                             FLB_ROUTER_CACHE_SIZE,
+                             FLB_ROUTER_CACHE_MAX_ENTRIES);
+        if (!ht) {
+            return NULL;
+        }
+        config->router_cache = ht;
+    }
+
+    ret = flb_hash_get(ht, tag, tag_len, &out_buf, &out_size);
+    if (ret >= 0) {
+        return (struct flb_router_cache_entry *) out_buf;
+    }
+
+    return cache_entry_create(ht, tag, tag_len, config);
+}
+
+/* Drop cached routes, must be called if a filter or output 'match' changed */
+void flb_router_cache_invalidate(struct flb_config *config)
+{
+    if (config->router_cache) {
+        flb_hash_destroy(config->router_cache);
+        config->router_cache = NULL;
+    }
+    config->router_gen++;
+}
+
+/* Release the static routes of the input instances */
+static void routes_clear(struct flb_config *config)
 {
     struct mk_list *tmp;
     struct mk_list *r_tmp;
@@ -192,3 +310,16 @@ void flb_router_exit(struct flb_config *config)
         }
     }
 }
+
+/* Build the static routes again, the output instances changed (reload) */
+int flb_router_io_update(struct flb_config *config)
+{
+    routes_clear(config);
+    return flb_router_io_set(config);
+}
+
+void flb_router_exit(struct flb_config *config)
+{
+    routes_clear(config);
+    flb_router_cache_invalidate(config);
+}
@@ -36,13 +36,12 @@ static inline double xmin(double a, double b)
 }
 
 /* Consume an unsigned 64 bit number from fd */
-static inline int consume_byte(flb_pipefd_t fd)
+static inline int consume_byte(flb_pipefd_t fd, uint64_t *val)
 {
     int ret;
-    uint64_t val;
 
     /* We need to consume the byte */
-    ret = flb_pipe_r(fd, &val, sizeof(val));
+    ret = flb_pipe_r(fd, val, sizeof(uint64_t));
     if (ret <= 0) {
         flb_errno();
         return -1;
@@ -94,91 +93,124 @@ static int random_uniform(int min, int max)
     return ra / copies + min;
 }
 
+/* Slot of the requests table for a given data reference */
+static inline int request_hash(void *data)
+{
+    uintptr_t val = (uintptr_t) data;
+
+    /* pointers are aligned, skip the low bits */
+    return (int) ((val >> 4) % FLB_SCHED_REQUEST_HASH);
+}
+
+/* Milliseconds elapsed since the wheel started */
+static inline uint64_t wheel_elapsed(struct flb_sched *sched)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((now.tv_sec - sched->wheel_start.tv_sec) * 1000) +
+        ((now.tv_nsec - sched->wheel_start.tv_nsec) / 1000000);
+}
+
 /*
- * Schedule a request that will be processed within the next
- * FLB_SCHED_REQUEST_FRAME seconds.
+ * Place a timer into the wheel to expire after 'ms' milliseconds. The
+ * target tick is rounded up so a timer never expires ahead of time.
  */
-static int schedule_request_now(int seconds,
-                                struct flb_sched_timer *timer,
-                                struct flb_sched_request *request,
-                                struct flb_config *config)
+static void wheel_add(struct flb_sched *sched, struct flb_sched_timer *timer,
+                      int ms)
 {
-    flb_pipefd_t fd;
-    struct mk_event *event;
-    struct flb_sched *sched = config->sched;
+    uint64_t ticks;
+    uint64_t target;
 
-    /* Initialize event */
-    event = &timer->event;
-    event->mask   = MK_EVENT_EMPTY;
-    event->status = MK_EVENT_NONE;
+    if (ms < 0) {
+        ms = 0;
+    }
 
-    /* Create a timeout into the main event loop */
-    fd = mk_event_timeout_create(config->evl, seconds, 0, event);
-    if (fd == -1) {
-        return -1;
+    target = (wheel_elapsed(sched) + ms + FLB_SCHED_WHEEL_TICK - 1) /
+        FLB_SCHED_WHEEL_TICK;
+    if (target <= sched->wheel_ticks) {
+        ticks = 1;
+    }
+    else {
+        ticks = target - sched->wheel_ticks;
     }
-    request->fd = fd;
 
-    /*
-     * Note: mk_event_timeout_create() sets a type = MK_EVENT_NOTIFICATION by
-     * default, we need to overwrite this value so we can do a clean check
-     * into the Engine when the event is triggered.
-     */
-    event->type = FLB_ENGINE_EV_SCHED;
-    mk_list_add(&request->_head, &sched->requests);
+    timer->slot   = (sched->wheel_pos + ticks) % FLB_SCHED_WHEEL_SLOTS;
+    timer->rounds = (ticks - 1) / FLB_SCHED_WHEEL_SLOTS;
+    mk_list_add(&timer->_head_slot, &sched->wheel[timer->slot]);
+}
 
-    return 0;
+/* Unlink a timer from the wheel, it will not expire */
+static inline void wheel_del(struct flb_sched_timer *timer)
+{
+    if (timer->slot == -1) {
+        return;
+    }
+
+    mk_list_del(&timer->_head_slot);
+    timer->slot = -1;
 }
 
-/*
- * Enqueue a request that will wait until it expected timeout reach the
- * FLB_SCHED_REQUEST_FRAME interval.
- */
-static int schedule_request_wait(struct flb_sched_request *request,
-                                 struct flb_config *config)
+/* Expire a timer taken from the wheel */
+static void timer_expire(struct flb_config *config,
+                         struct flb_sched_timer *timer)
 {
-    struct flb_sched *sched = config->sched;
+    struct flb_sched_request *req;
 
-    mk_list_add(&request->_head, &sched->requests_wait);
-    return 0;
+    if (timer->type == FLB_SCHED_TIMER_REQUEST) {
+        req = timer->data;
+
+        /* Dispatch 'retry' */
+        flb_engine_dispatch_retry(req->data, config);
+
+        /* Destroy this scheduled request, it's not longer required */
+        flb_sched_request_destroy(config, req);
+    }
+    else if (timer->type == FLB_SCHED_TIMER_CUSTOM) {
+        flb_sched_timer_cb_disable(timer);
+        timer->cb(config, timer->data);
+        flb_sched_timer_cb_destroy(timer);
+    }
 }
 
 /*
- * Iterate requests_wait list looking for candidates to be promoted
- * to the 'requests' list.
+ * Advance the wheel one slot and expire the timers that completed their
+ * rounds. Expired timers are moved to a local list first: callbacks are
+ * allowed to create new timers or invalidate pending ones.
  */
-static int schedule_request_promote(struct flb_sched *sched)
+static void wheel_tick(struct flb_sched *sched)
 {
-    int passed;
-    int next;
-    time_t now;
     struct mk_list *tmp;
     struct mk_list *head;
-    struct flb_sched_request *request;
-
-    now = time(NULL);
-    mk_list_foreach_safe(head, tmp, &sched->requests_wait) {
-        request = mk_list_entry(head, struct flb_sched_request, _head);
+    struct mk_list *slot;
+    struct mk_list expired;
+    struct flb_sched_timer *timer;
 
-        /* First check how many seconds have passed since the request creation */
-        passed = (now - request->created);
+    sched->wheel_ticks++;
+    sched->wheel_pos = (sched->wheel_pos + 1) % FLB_SCHED_WHEEL_SLOTS;
+    slot = &sched->wheel[sched->wheel_pos];
 
-        /* If we passed the original time, schedule now for the next second */
-        if (passed > request->timeout) {
-            mk_list_del(&request->_head);
-            schedule_request_now(1, request->timer, request, sched->config);
-        }
-        else {
-            /* Check if we should schedule within this frame */
-            if (passed + FLB_SCHED_REQUEST_FRAME >= request->timeout) {
-                next = labs(passed - request->timeout);
-                mk_list_del(&request->_head);
-                schedule_request_now(next, request->timer, request, sched->config);
-            }
+    mk_list_init(&expired);
+    mk_list_foreach_safe(head, tmp, slot) {
+        timer = mk_list_entry(head, struct flb_sched_timer, _head_slot);
+        if (timer->rounds > 0) {
+            timer->rounds--;
+            continue;
         }
+        mk_list_del(&timer->_head_slot);
+        mk_list_add(&timer->_head_slot, &expired);
     }
 
-    return 0;
+    while (mk_list_is_empty(&expired) != 0) {
+        timer = mk_list_entry_first(&expired, struct flb_sched_timer,
+                                    _head_slot);
+        mk_list_del(&timer->_head_slot);
+        timer->slot = -1;
+
+        if (timer->active == FLB_TRUE) {
+            timer_expire(sched->config, timer);
+        }
+    }
 }
 
 /*
@@ -196,16 +228,15 @@ static int backoff_full_jitter(int base, int cap, int n)
     return random_uniform(0, exp);
 }
 
-/* Schedule the 'retry' for a thread buffer flush */
-int flb_sched_request_create(struct flb_config *config, void *data, int tries)
+/* Register a retry request that expires in 'seconds' */
+static int request_add(struct flb_config *config, void *data, int seconds)
 {
-    int ret;
-    int seconds;
+    struct flb_sched *sched = config->sched;
     struct flb_sched_timer *timer;
     struct flb_sched_request *request;
 
     /* Allocate timer context */
-    timer = flb_sched_timer_create(config->sched);
+    timer = flb_sched_timer_create(sched);
     if (!timer) {
         return -1;
     }
@@ -214,37 +245,57 @@ int flb_sched_request_create(struct flb_config *config, void *data, int tries)
     request = flb_malloc(sizeof(struct flb_sched_request));
     if (!request) {
         flb_errno();
+        flb_sched_timer_destroy(timer);
         return -1;
     }
 
     /* Link timer references */
     timer->type = FLB_SCHED_TIMER_REQUEST;
     timer->data = request;
-    timer->event.mask = MK_EVENT_EMPTY;
-
-    /* Get suggested wait_time for this request */
-    seconds = backoff_full_jitter(FLB_SCHED_BASE, FLB_SCHED_CAP, tries);
 
     /* Populare request */
-    request->fd      = -1;
     request->created = time(NULL);
     request->timeout = seconds;
     request->data    = data;
     request->timer   = timer;
+    mk_list_add(&request->_head, &sched->requests[request_hash(data)]);
+
+    wheel_add(sched, timer, seconds * 1000);
+
+    return seconds;
+}
+
+/* Schedule the 'retry' for a thread buffer flush */
+int flb_sched_request_create(struct flb_config *config, void *data, int tries)
+{
+    int seconds;
 
-    /* Request to be placed into the sched_requests_wait list */
-    if (seconds > FLB_SCHED_REQUEST_FRAME) {
-        schedule_request_wait(request, config);
+    /* Get suggested wait_time for this request */
+    seconds = backoff_full_jitter(FLB_SCHED_BASE, FLB_SCHED_CAP, tries);
+
+    return request_add(config, data, seconds);
+}
+
+/*
+ * Schedule a retry restored from a previous run: it keeps the original
+ * time if it's still ahead, otherwise a new wait time is taken for the
+ * number of tries so restored retries do not fire all at once.
+ */
+int flb_sched_request_restore(struct flb_config *config,
+                              void *data, int tries, time_t retry_at)
+{
+    int seconds;
+    time_t now;
+
+    now = time(NULL);
+    if (retry_at > now) {
+        seconds = xmin(retry_at - now, FLB_SCHED_CAP);
     }
     else {
-        ret = schedule_request_now(seconds, timer, request, config);
-        if (ret == -1) {
-            flb_free(request);
-            return -1;
-        }
+        seconds = backoff_full_jitter(FLB_SCHED_BASE, FLB_SCHED_CAP, tries);
     }
 
-    return seconds;
+    return request_add(config, data, seconds);
 }
 
 int flb_sched_request_destroy(struct flb_config *config,
@@ -254,18 +305,14 @@ int flb_sched_request_destroy(struct flb_config *config,
 
     mk_list_del(&req->_head);
 
-    timer = req->timer;
-    if (config->evl && timer->event.mask != MK_EVENT_EMPTY) {
-        mk_event_del(config->evl, &timer->event);
-    }
-    flb_pipe_close(req->fd);
-
     /*
      * We invalidate the timer since in the same event loop round
-     * an event associated to this timer can be present. Invalidation
-     * means the timer will do nothing and will be removed after
-     * the event loop round finish.
+     * it can be already taken from the wheel. Invalidation means the
+     * timer will do nothing and will be removed after the event loop
+     * round finish.
      */
+    timer = req->timer;
+    wheel_del(timer);
     flb_sched_timer_invalidate(timer);
 
     /* Remove request */
@@ -276,13 +323,12 @@ int flb_sched_request_destroy(struct flb_config *config,
 
 int flb_sched_request_invalidate(struct flb_config *config, void *data)
 {
-    struct mk_list *tmp;
     struct mk_list *head;
     struct flb_sched_request *request;
     struct flb_sched *sched;
 
     sched = config->sched;
-    mk_list_foreach_safe(head, tmp, &sched->requests) {
+    mk_list_foreach(head, &sched->requests[request_hash(data)]) {
         request = mk_list_entry(head, struct flb_sched_request, _head);
         if (request->data == data) {
             flb_sched_request_destroy(config, request);
@@ -293,41 +339,58 @@ int flb_sched_request_invalidate(struct flb_config *config, void *data)
     return -1;
 }
 
-/* Handle a timeout event set by a previous flb_sched_request_create(...) */
+/*
+ * Move every pending retry to the next wheel tick, used by the shutdown
+ * sequence so retries do not wait for their backoff. Returns the number of
+ * retries.
+ */
+int flb_sched_request_expedite(struct flb_config *config)
+{
+    int i;
+    int c = 0;
+    struct mk_list *head;
+    struct flb_sched_request *request;
+    struct flb_sched *sched = config->sched;
+
+    if (!sched) {
+        return 0;
+    }
+
+    for (i = 0; i < FLB_SCHED_REQUEST_HASH; i++) {
+        mk_list_foreach(head, &sched->requests[i]) {
+            request = mk_list_entry(head, struct flb_sched_request, _head);
+            wheel_del(request->timer);
+            wheel_add(sched, request->timer, 0);
+            c++;
+        }
+    }
+
+    return c;
+}
+
+/* Handle the timer wheel tick */
 int flb_sched_event_handler(struct flb_config *config, struct mk_event *event)
 {
+    uint64_t val;
+    uint64_t target;
     struct flb_sched *sched;
     struct flb_sched_timer *timer;
-    struct flb_sched_request *req;
 
     timer = (struct flb_sched_timer *) event;
     if (timer->active == FLB_FALSE) {
         return 0;
     }
 
-    if (timer->type == FLB_SCHED_TIMER_REQUEST) {
-        /* Map request struct */
-        req = timer->data;
-        consume_byte(req->fd);
-
-        /* Dispatch 'retry' */
-        flb_engine_dispatch_retry(req->data, config);
-
-        /* Destroy this scheduled request, it's not longer required */
-        flb_sched_request_destroy(config, req);
-    }
-    else if (timer->type == FLB_SCHED_TIMER_FRAME) {
+    if (timer->type == FLB_SCHED_TIMER_FRAME) {
         sched = timer->data;
 #ifndef __APPLE__
-        consume_byte(sched->frame_fd);
+        consume_byte(sched->frame_fd, &val);
 #endif
-        schedule_request_promote(sched);
-    }
-    else if (timer->type == FLB_SCHED_TIMER_CUSTOM) {
-        consume_byte(timer->timer_fd);
-        flb_sched_timer_cb_disable(timer);
-        timer->cb(config, timer->data);
-        flb_sched_timer_cb_destroy(timer);
+        /* Move the wheel up to the current time */
+        target = wheel_elapsed(sched) / FLB_SCHED_WHEEL_TICK;
+        while (sched->wheel_ticks < target) {
+            wheel_tick(sched);
+        }
     }
 
     return 0;
@@ -344,64 +407,82 @@ int flb_sched_timer_cb_create(struct flb_config *config, int ms,
                               void (*cb)(struct flb_config *, void *),
                               void *data)
 {
-    int fd;
-    time_t sec;
-    long nsec;
-    struct mk_event *event;
     struct flb_sched_timer *timer;
 
-    timer = flb_sched_timer_create(config->sched);
+    timer = flb_sched_timer_cb_add(config, ms, cb, data);
     if (!timer) {
         return -1;
     }
 
+    return 0;
+}
+
+/*
+ * Same as flb_sched_timer_cb_create() but it returns the timer: the owner
+ * can release it with flb_sched_timer_cb_destroy() until it expires, the
+ * callback must forget it since it's released right after it returns.
+ */
+struct flb_sched_timer *flb_sched_timer_cb_add(struct flb_config *config,
+                                               int ms,
+                                               void (*cb)(struct flb_config *,
+                                                          void *),
+                                               void *data)
+{
+    struct flb_sched_timer *timer;
+
+    timer = flb_sched_timer_create(config->sched);
+    if (!timer) {
+        return NULL;
+    }
+
     timer->type = FLB_SCHED_TIMER_CUSTOM;
     timer->data = data;
     timer->cb   = cb;
 
-    /* Initialize event */
-    event = &timer->event;
-    event->mask   = MK_EVENT_EMPTY;
-    event->status = MK_EVENT_NONE;
+    wheel_add(config->sched, timer, ms);
 
-    /* Convert from milliseconds to seconds and nanoseconds */
-    sec = (ms / 1000);
-    nsec = ((ms % 1000) * 1000000);
+    return timer;
+}
 
-    /* Create the frame timer */
-    fd = mk_event_timeout_create(config->evl, sec, nsec, event);
-    if (fd == -1) {
-        flb_error("[sched] cannot do timeout_create()");
-        flb_sched_timer_destroy(timer);
-        return -1;
+/*
+ * Cancel the pending custom timers created with 'data': a component that
+ * re-arms its timer from the callback must call it before releasing
+ * 'data'. Returns the number of timers cancelled.
+ */
+int flb_sched_timer_cb_cancel(struct flb_config *config, void *data)
+{
+    int c = 0;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct flb_sched_timer *timer;
+    struct flb_sched *sched = config->sched;
+
+    if (!sched) {
+        return 0;
     }
 
-    /*
-     * Note: mk_event_timeout_create() sets a type = MK_EVENT_NOTIFICATION by
-     * default, we need to overwrite this value so we can do a clean check
-     * into the Engine when the event is triggered.
-     */
-    event->type = FLB_ENGINE_EV_SCHED;
-    timer->timer_fd = fd;
+    mk_list_foreach_safe(head, tmp, &sched->timers) {
+        timer = mk_list_entry(head, struct flb_sched_timer, _head);
+        if (timer->type == FLB_SCHED_TIMER_CUSTOM && timer->data == data &&
+            timer->slot != -1) {
+            flb_sched_timer_cb_destroy(timer);
+            c++;
+        }
+    }
 
-    return 0;
+    return c;
 }
 
 /* Disable notifications, used before to destroy the context */
 int flb_sched_timer_cb_disable(struct flb_sched_timer *timer)
 {
-    int ret;
-
-    ret = close(timer->timer_fd);
-    timer->timer_fd = -1;
-    return ret;
+    wheel_del(timer);
+    return 0;
 }
 
 int flb_sched_timer_cb_destroy(struct flb_sched_timer *timer)
 {
-    if (timer->timer_fd > 0) {
-        flb_sched_timer_cb_disable(timer);
-    }
+    flb_sched_timer_cb_disable(timer);
     flb_sched_timer_destroy(timer);
     return 0;
 }
@@ -409,6 +490,7 @@ int flb_sched_timer_cb_destroy(struct flb_sched_timer *timer)
 /* Initialize the Scheduler */
 int flb_sched_init(struct flb_config *config)
 {
+    int i;
     flb_pipefd_t fd;
     struct mk_event *event;
     struct flb_sched_timer *timer;
@@ -423,12 +505,21 @@ int flb_sched_init(struct flb_config *config)
     sched->config = config;
 
     /* Initialize lists */
-    mk_list_init(&sched->requests);
-    mk_list_init(&sched->requests_wait);
+    for (i = 0; i < FLB_SCHED_REQUEST_HASH; i++) {
+        mk_list_init(&sched->requests[i]);
+    }
     mk_list_init(&sched->timers);
     mk_list_init(&sched->timers_drop);
 
-    /* Create the frame timer who enqueue 'requests' for future time */
+    /* Initialize the wheel */
+    sched->wheel_pos = 0;
+    sched->wheel_ticks = 0;
+    clock_gettime(CLOCK_MONOTONIC, &sched->wheel_start);
+    for (i = 0; i < FLB_SCHED_WHEEL_SLOTS; i++) {
+        mk_list_init(&sched->wheel[i]);
+    }
+
+    /* Create the timer who drives the wheel */
     timer = flb_sched_timer_create(sched);
     if (!timer) {
         flb_free(sched);
@@ -443,9 +534,9 @@ int flb_sched_init(struct flb_config *config)
     event->mask   = MK_EVENT_EMPTY;
     event->status = MK_EVENT_NONE;
 
-    /* Create the frame timer */
-    fd = mk_event_timeout_create(config->evl, FLB_SCHED_REQUEST_FRAME, 0,
-                                 event);
+    /* Create the wheel tick timer */
+    fd = mk_event_timeout_create(config->evl, 0,
+                                 FLB_SCHED_WHEEL_TICK * 1000000, event);
     if (fd == -1) {
         flb_sched_timer_destroy(timer);
         flb_free(sched);
@@ -466,6 +557,7 @@ int flb_sched_init(struct flb_config *config)
 /* Release all resources used by the Scheduler */
 int flb_sched_exit(struct flb_config *config)
 {
+    int i;
     int c = 0;
     struct mk_list *tmp;
     struct mk_list *head;
@@ -479,17 +571,12 @@ int flb_sched_exit(struct flb_config *config)
         return 0;
     }
 
-    mk_list_foreach_safe(head, tmp, &sched->requests) {
-        request = mk_list_entry(head, struct flb_sched_request, _head);
-        flb_sched_request_destroy(config, request);
-        c++; /* evil counter */
-    }
-
-    /* Delete requests on wait list */
-    mk_list_foreach_safe(head, tmp, &sched->requests_wait) {
-        request = mk_list_entry(head, struct flb_sched_request, _head);
-        flb_sched_request_destroy(config, request);
-        c++; /* evil counter */
+    for (i = 0; i < FLB_SCHED_REQUEST_HASH; i++) {
+        mk_list_foreach_safe(head, tmp, &sched->requests[i]) {
+            request = mk_list_entry(head, struct flb_sched_request, _head);
+            flb_sched_request_destroy(config, request);
+            c++; /* evil counter */
+        }
     }
 
     /* Delete timers */
@@ -506,6 +593,10 @@ int flb_sched_exit(struct flb_config *config)
         c++;
     }
 
+    if (sched->frame_fd > 0) {
+        flb_pipe_close(sched->frame_fd);
+    }
+
     flb_free(sched);
     return c;
 }
@@ -521,9 +612,10 @@ struct flb_sched_timer *flb_sched_timer_create(struct flb_sched *sched)
         flb_errno();
         return NULL;
     }
-    timer->timer_fd = -1;
     timer->config = sched->config;
     timer->data = NULL;
+    timer->slot = -1;
+    timer->rounds = 0;
 
     /* Active timer (not invalidated) */
     timer->active = FLB_TRUE;
@@ -539,6 +631,7 @@ void flb_sched_timer_invalidate(struct flb_sched_timer *timer)
     sched  = timer->config->sched;
 
     timer->active = FLB_FALSE;
+    wheel_del(timer);
     mk_list_del(&timer->_head);
     mk_list_add(&timer->_head, &sched->timers_drop);
 }
@@ -546,10 +639,10 @@ void flb_sched_timer_invalidate(struct flb_sched_timer *timer)
 /* Destroy a timer context */
 int flb_sched_timer_destroy(struct flb_sched_timer *timer)
 {
-    mk_event_timeout_destroy(timer->config->evl, &timer->event);
-    if (timer->timer_fd > 0) {
-        flb_sched_timer_cb_disable(timer);
+    if (timer->type == FLB_SCHED_TIMER_FRAME) {
+        mk_event_timeout_destroy(timer->config->evl, &timer->event);
     }
+    wheel_del(timer);
 
     mk_list_del(&timer->_head);
     flb_free(timer);
@@ -26,22 +26,44 @@
 #include <fluent-bit/flb_mem.h>
 #include <fluent-bit/flb_log.h>
 #include <fluent-bit/flb_sds.h>
+#include <fluent-bit/flb_arena.h>
 
-static flb_sds_t sds_alloc(size_t size)
+/* The arena of an arena string is stored right before its header */
+#define SDS_ARENA_PREFIX       sizeof(struct flb_arena *)
+#define SDS_ARENA_PTR(head)    ((struct flb_arena **) \
+                                ((char *) (head) - SDS_ARENA_PREFIX))
+
+static flb_sds_t sds_alloc(struct flb_arena *arena, size_t size)
 {
-    void *buf;
+    char *buf;
     flb_sds_t s;
     struct flb_sds *head;
 
-    buf = flb_malloc(FLB_SDS_HEADER_SIZE + size + 1);
-    if (!buf) {
-        flb_errno();
-        return NULL;
+    if (size < FLB_SDS_SMALL) {
+        size = FLB_SDS_SMALL;
     }
 
-    head = buf;
+    if (arena) {
+        buf = flb_arena_alloc(arena,
+                              SDS_ARENA_PREFIX + FLB_SDS_HEADER_SIZE +
+                              size + 1);
+        if (!buf) {
+            return NULL;
+        }
+        *((struct flb_arena **) buf) = arena;
+        head = (struct flb_sds *) (buf + SDS_ARENA_PREFIX);
+        head->alloc = size | FLB_SDS_ARENA;
+    }
+    else {
+        buf = flb_malloc(FLB_SDS_HEADER_SIZE + size + 1);
+        if (!buf) {
+            flb_errno();
+            return NULL;
+        }
+        head = (struct flb_sds *) buf;
+        head->alloc = size;
+    }
     head->len = 0;
-    head->alloc = size;
 
     s = head->buf;
     *s = '\0';
@@ -49,13 +71,13 @@ static flb_sds_t sds_alloc(size_t size)
     return s;
 }
 
-flb_sds_t flb_sds_create_len(char *str, int len)
+static flb_sds_t sds_create(struct flb_arena *arena, char *str, int len)
 {
     flb_sds_t s;
     struct flb_sds *head;
 
-    s = sds_alloc(len);
-    if (str) {
+    s = sds_alloc(arena, len);
+    if (s && str) {
         memcpy(s, str, len);
         s[len] = '\0';
 
@@ -65,6 +87,11 @@ flb_sds_t flb_sds_create_len(char *str, int len)
     return s;
 }
 
+flb_sds_t flb_sds_create_len(char *str, int len)
+{
+    return sds_create(NULL, str, len);
+}
+
 flb_sds_t flb_sds_create(char *str)
 {
     size_t len;
@@ -81,7 +108,21 @@ flb_sds_t flb_sds_create(char *str)
 
 flb_sds_t flb_sds_create_size(size_t size)
 {
-    return sds_alloc(size);
+    return sds_alloc(NULL, size);
+}
+
+/*
+ * Strings owned by an arena, e.g: the one of a flush co-routine. Without
+ * an arena they are regular heap strings.
+ */
+flb_sds_t flb_sds_create_arena(struct flb_arena *arena, char *str, int len)
+{
+    return sds_create(arena, str, len);
+}
+
+flb_sds_t flb_sds_create_size_arena(struct flb_arena *arena, size_t size)
+{
+    return sds_alloc(arena, size);
 }
 
 /* Increase SDS buffer size 'len' bytes */
@@ -90,6 +131,7 @@ flb_sds_t flb_sds_increase(flb_sds_t s, size_t len)
     size_t avail;
     size_t new_size;
     struct flb_sds *head;
+    struct flb_arena *arena;
     void *tmp;
 
     avail = flb_sds_avail(s);
@@ -99,10 +141,23 @@ flb_sds_t flb_sds_increase(flb_sds_t s, size_t len)
 
     new_size = (FLB_SDS_HEADER_SIZE + flb_sds_alloc(s) + len + 1);
     head = FLB_SDS_HEADER(s);
-    tmp = flb_realloc(head, new_size);
-    if (!tmp) {
-        flb_errno();
-        return NULL;
+    if (head->alloc & FLB_SDS_ARENA) {
+        arena = *SDS_ARENA_PTR(head);
+        tmp = flb_arena_realloc(arena, SDS_ARENA_PTR(head),
+                                SDS_ARENA_PREFIX + FLB_SDS_HEADER_SIZE +
+                                flb_sds_alloc(s) + 1,
+                                SDS_ARENA_PREFIX + new_size);
+        if (!tmp) {
+            return NULL;
+        }
+        tmp = (char *) tmp + SDS_ARENA_PREFIX;
+    }
+    else {
+        tmp = flb_realloc(head, new_size);
+        if (!tmp) {
+            flb_errno();
+            return NULL;
+        }
     }
     head = tmp;
     head->alloc += len;
@@ -162,6 +217,9 @@ int flb_sds_destroy(flb_sds_t s)
     struct flb_sds *head;
 
     head = FLB_SDS_HEADER(s);
+    if (head->alloc & FLB_SDS_ARENA) {
+        return 0;
+    }
     flb_free(head);
 
     return 0;
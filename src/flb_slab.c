@@ -0,0 +1,152 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <monkey/mk_core.h>
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_log.h>
+#include <fluent-bit/flb_slab.h>
+
+#include <stdint.h>
+
+#define SLAB_ALIGN(s)  (((s) + FLB_SLAB_ALIGN - 1) & ~((size_t) FLB_SLAB_ALIGN - 1))
+
+/* A page header sits at the start of the block, objects start aligned */
+struct flb_slab_page {
+    struct mk_list _head;
+};
+
+static int slab_grow(struct flb_slab *slab)
+{
+    int i;
+    int n;
+    char *obj;
+    char *raw;
+    struct flb_slab_page *page;
+
+    n = slab->per_page;
+    if (slab->max > 0) {
+        if (slab->objects >= slab->max) {
+            return -1;
+        }
+        if (slab->objects + n > slab->max) {
+            n = slab->max - slab->objects;
+        }
+    }
+
+    raw = flb_malloc(sizeof(struct flb_slab_page) + FLB_SLAB_ALIGN +
+                     slab->size * n);
+    if (!raw) {
+        flb_errno();
+        return -1;
+    }
+    page = (struct flb_slab_page *) raw;
+    mk_list_add(&page->_head, &slab->pages);
+
+    obj = (char *) SLAB_ALIGN((uintptr_t) (raw + sizeof(struct flb_slab_page)));
+    for (i = 0; i < n; i++) {
+        *(void **) obj = slab->free;
+        slab->free = obj;
+        obj += slab->size;
+    }
+    slab->objects += n;
+
+    return 0;
+}
+
+/*
+ * Create a cache of objects of 'size' bytes, the first page is allocated
+ * right away. With 'max' the cache does not grow beyond that number of
+ * objects.
+ */
+struct flb_slab *flb_slab_create(char *name, size_t size, int per_page,
+                                 int max)
+{
+    struct flb_slab *slab;
+
+    slab = flb_calloc(1, sizeof(struct flb_slab));
+    if (!slab) {
+        flb_errno();
+        return NULL;
+    }
+    slab->name = name;
+    slab->size = SLAB_ALIGN(size < sizeof(void *) ? sizeof(void *) : size);
+    slab->per_page = per_page > 0 ? per_page : 1;
+    slab->max = max;
+    mk_list_init(&slab->pages);
+
+    if (slab_grow(slab) == -1) {
+        flb_free(slab);
+        return NULL;
+    }
+
+    return slab;
+}
+
+void flb_slab_destroy(struct flb_slab *slab)
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct flb_slab_page *page;
+
+    if (!slab) {
+        return;
+    }
+
+    if (slab->used > 0) {
+        flb_debug("[slab] %s: %i objects still in use", slab->name,
+                  slab->used);
+    }
+
+    mk_list_foreach_safe(head, tmp, &slab->pages) {
+        page = mk_list_entry(head, struct flb_slab_page, _head);
+        mk_list_del(&page->_head);
+        flb_free(page);
+    }
+    flb_free(slab);
+}
+
+void *flb_slab_alloc(struct flb_slab *slab)
+{
+    void *obj;
+
+    if (!slab->free && slab_grow(slab) == -1) {
+        return NULL;
+    }
+
+    obj = slab->free;
+    slab->free = *(void **) obj;
+    slab->used++;
+    if (slab->used > slab->peak) {
+        slab->peak = slab->used;
+    }
+
+    return obj;
+}
+
+void flb_slab_free(struct flb_slab *slab, void *ptr)
+{
+    if (!ptr) {
+        return;
+    }
+
+    *(void **) ptr = slab->free;
+    slab->free = ptr;
+    slab->used--;
+}
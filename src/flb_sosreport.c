@@ -110,6 +110,7 @@ static void print_properties(struct mk_list *props)
 
 int flb_sosreport(struct flb_config *config)
 {
+    int i;
     char tmp[32];
     struct mk_list *head;
     struct mk_list *head_r;
@@ -158,20 +159,24 @@ int flb_sosreport(struct flb_config *config)
     /* Fluent Bit */
     printf("[Built Plugins]\n");
     print_key("Inputs");
-    mk_list_foreach(head, &config->in_plugins) {
-        in = mk_list_entry(head, struct flb_input_plugin, _head);
+    for (i = 0; flb_in_plugins[i]; i++) {
+        in = flb_in_plugins[i];
         printf("%s ", in->name);
     }
     printf("\n");
 
     print_key("Filters");
-    mk_list_foreach(head, &config->filter_plugins) {
-        filter = mk_list_entry(head, struct flb_filter_plugin, _head);
+    for (i = 0; flb_filter_plugins[i]; i++) {
+        filter = flb_filter_plugins[i];
         printf("%s ", filter->name);
     }
     printf("\n");
 
     print_key("Outputs");
+    for (i = 0; flb_out_plugins[i]; i++) {
+        out = flb_out_plugins[i];
+        printf("%s ", out->name);
+    }
     mk_list_foreach(head, &config->out_plugins) {
         out = mk_list_entry(head, struct flb_output_plugin, _head);
         printf("%s ", out->name);
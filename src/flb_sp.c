@@ -0,0 +1,745 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+
+#include <float.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_str.h>
+#include <fluent-bit/flb_log.h>
+#include <fluent-bit/flb_config.h>
+#include <fluent-bit/flb_input.h>
+#include <fluent-bit/flb_hash.h>
+#include <fluent-bit/flb_time.h>
+#include <fluent-bit/flb_router.h>
+#include <fluent-bit/flb_scheduler.h>
+#include <fluent-bit/flb_record_accessor.h>
+#include <fluent-bit/flb_sp.h>
+
+/*
+ * Numeric value of an object, strings holding a number are taken too as
+ * parsers use to leave them that way. Returns FLB_SP_INT, FLB_SP_FLOAT or
+ * -1 if it's not a number.
+ */
+static int num_get(msgpack_object *o, int64_t *i, double *f)
+{
+    int j;
+    int len;
+    char *end;
+    char tmp[64];
+
+    switch (o->type) {
+    case MSGPACK_OBJECT_POSITIVE_INTEGER:
+        if (o->via.u64 > INT64_MAX) {
+            *f = (double) o->via.u64;
+            return FLB_SP_FLOAT;
+        }
+        *i = (int64_t) o->via.u64;
+        return FLB_SP_INT;
+    case MSGPACK_OBJECT_NEGATIVE_INTEGER:
+        *i = o->via.i64;
+        return FLB_SP_INT;
+    case MSGPACK_OBJECT_FLOAT32:
+    case MSGPACK_OBJECT_FLOAT64:
+        *f = o->via.f64;
+        return FLB_SP_FLOAT;
+    case MSGPACK_OBJECT_STR:
+        len = o->via.str.size;
+        if (len == 0 || len >= sizeof(tmp)) {
+            return -1;
+        }
+        memcpy(tmp, o->via.str.ptr, len);
+        tmp[len] = '\0';
+
+        for (j = 0; j < len; j++) {
+            if (tmp[j] == '.' || tmp[j] == 'e' || tmp[j] == 'E') {
+                *f = strtod(tmp, &end);
+                return (*end == '\0') ? FLB_SP_FLOAT : -1;
+            }
+        }
+        *i = strtoll(tmp, &end, 10);
+        return (*end == '\0') ? FLB_SP_INT : -1;
+    default:
+        return -1;
+    }
+}
+
+static int cmp_result(int op, int c)
+{
+    switch (op) {
+    case FLB_SP_EQ:
+        return (c == 0);
+    case FLB_SP_NEQ:
+        return (c != 0);
+    case FLB_SP_LT:
+        return (c < 0);
+    case FLB_SP_LTE:
+        return (c <= 0);
+    case FLB_SP_GT:
+        return (c > 0);
+    case FLB_SP_GTE:
+        return (c >= 0);
+    }
+
+    return FLB_FALSE;
+}
+
+/* Compare a record value with the literal of the condition */
+static int exp_cmp(struct flb_sp_exp *exp, msgpack_object *o)
+{
+    int c;
+    int len;
+    int type;
+    int64_t i;
+    double f;
+    double a;
+    double b;
+    struct flb_sp_value *v = &exp->val;
+
+    if (v->type == FLB_SP_STRING) {
+        if (o->type != MSGPACK_OBJECT_STR) {
+            return FLB_FALSE;
+        }
+        len = o->via.str.size;
+        c = memcmp(o->via.str.ptr, v->s, (len < v->len) ? len : v->len);
+        if (c == 0) {
+            c = len - v->len;
+        }
+        return cmp_result(exp->op, c);
+    }
+
+    if (v->type == FLB_SP_BOOL) {
+        if (o->type != MSGPACK_OBJECT_BOOLEAN ||
+            (exp->op != FLB_SP_EQ && exp->op != FLB_SP_NEQ)) {
+            return FLB_FALSE;
+        }
+        return cmp_result(exp->op, o->via.boolean != v->i);
+    }
+
+    type = num_get(o, &i, &f);
+    if (type == -1) {
+        return FLB_FALSE;
+    }
+
+    if (type == FLB_SP_INT && v->type == FLB_SP_INT) {
+        c = (i > v->i) - (i < v->i);
+    }
+    else {
+        a = (type == FLB_SP_INT) ? (double) i : f;
+        b = (v->type == FLB_SP_INT) ? (double) v->i : v->f;
+        c = (a > b) - (a < b);
+    }
+
+    return cmp_result(exp->op, c);
+}
+
+/*
+ * Evaluate a condition over a record map. A missing key makes its
+ * comparisons false.
+ */
+static int exp_eval(struct flb_sp_exp *exp, msgpack_object map)
+{
+    msgpack_object *o;
+
+    switch (exp->type) {
+    case FLB_SP_EXP_AND:
+        return exp_eval(exp->left, map) && exp_eval(exp->right, map);
+    case FLB_SP_EXP_OR:
+        return exp_eval(exp->left, map) || exp_eval(exp->right, map);
+    case FLB_SP_EXP_NOT:
+        return !exp_eval(exp->left, map);
+    case FLB_SP_EXP_NULL:
+        o = flb_ra_get(exp->ra, map);
+        return (!o || o->type == MSGPACK_OBJECT_NIL);
+    case FLB_SP_EXP_CMP:
+        o = flb_ra_get(exp->ra, map);
+        if (!o) {
+            return FLB_FALSE;
+        }
+        return exp_cmp(exp, o);
+    }
+
+    return FLB_FALSE;
+}
+
+/* Pack the selected keys of a record, or the whole record for SELECT * */
+static void record_select(struct flb_sp_task *task, msgpack_object *root,
+                          char *raw, size_t raw_size)
+{
+    int i = 0;
+    int n = 0;
+    struct mk_list *head;
+    struct flb_sp_cmd_key *key;
+    msgpack_object map;
+    msgpack_packer *pck = &task->out_pck;
+
+    if (task->cmd->select_all == FLB_TRUE) {
+        msgpack_sbuffer_write(&task->out_sbuf, raw, raw_size);
+        return;
+    }
+
+    map = root->via.array.ptr[1];
+    mk_list_foreach(head, &task->cmd->keys) {
+        key = mk_list_entry(head, struct flb_sp_cmd_key, _head);
+        task->vals[i] = flb_ra_get(key->ra, map);
+        if (task->vals[i]) {
+            n++;
+        }
+        i++;
+    }
+
+    msgpack_pack_array(pck, 2);
+    msgpack_pack_object(pck, root->via.array.ptr[0]);
+    msgpack_pack_map(pck, n);
+
+    i = 0;
+    mk_list_foreach(head, &task->cmd->keys) {
+        key = mk_list_entry(head, struct flb_sp_cmd_key, _head);
+        if (task->vals[i]) {
+            msgpack_pack_str(pck, key->out_len);
+            msgpack_pack_str_body(pck, key->out, key->out_len);
+            msgpack_pack_object(pck, *task->vals[i]);
+        }
+        i++;
+    }
+}
+
+static void groups_destroy(struct flb_sp_task *task)
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct flb_sp_group *g;
+
+    mk_list_foreach_safe(head, tmp, &task->list) {
+        g = mk_list_entry(head, struct flb_sp_group, _head);
+        mk_list_del(&g->_head);
+        flb_free(g);
+    }
+    task->groups = 0;
+
+    if (task->ht) {
+        flb_hash_destroy(task->ht);
+        task->ht = NULL;
+    }
+}
+
+/* A group, its aggregations and key share one allocation */
+static struct flb_sp_group *group_create(struct flb_sp_task *task,
+                                         char *key, int key_len)
+{
+    int ret;
+    size_t size;
+    struct flb_sp_group *g;
+
+    if (!task->ht) {
+        task->ht = flb_hash_create(FLB_HASH_EVICT_NONE, 256, 0);
+        if (!task->ht) {
+            return NULL;
+        }
+    }
+
+    size = sizeof(struct flb_sp_group) +
+        (sizeof(struct flb_sp_agg) * task->cmd->keys_len) + key_len;
+    g = flb_calloc(1, size);
+    if (!g) {
+        flb_errno();
+        return NULL;
+    }
+    g->aggs = (struct flb_sp_agg *) (g + 1);
+    g->key = (char *) (g->aggs + task->cmd->keys_len);
+    g->key_len = key_len;
+    memcpy(g->key, key, key_len);
+
+    ret = flb_hash_add(task->ht, g->key, g->key_len, (char *) &g, sizeof(g));
+    if (ret == -1) {
+        flb_free(g);
+        return NULL;
+    }
+    mk_list_add(&g->_head, &task->list);
+    task->groups++;
+
+    return g;
+}
+
+static void agg_add(struct flb_sp_agg *agg, int type, int64_t i, double f)
+{
+    double val;
+
+    if (type == FLB_SP_INT) {
+        agg->isum += i;
+        val = (double) i;
+    }
+    else {
+        agg->is_float = FLB_TRUE;
+        agg->fsum += f;
+        val = f;
+    }
+
+    if (agg->count == 0 || val < agg->min) {
+        agg->min = val;
+    }
+    if (agg->count == 0 || val > agg->max) {
+        agg->max = val;
+    }
+    agg->count++;
+}
+
+/* Add a record to the aggregations of its group */
+static void record_aggregate(struct flb_sp_task *task, msgpack_object map)
+{
+    int i;
+    int type;
+    int64_t ival;
+    double fval;
+    char *buf;
+    size_t size;
+    struct mk_list *head;
+    struct flb_sp_cmd_key *key;
+    struct flb_sp_agg *agg;
+    struct flb_sp_group *g;
+    msgpack_object *o;
+
+    /* the GROUP BY values identify the group */
+    task->key_sbuf.size = 0;
+    msgpack_pack_array(&task->key_pck, task->cmd->group_by_len);
+    mk_list_foreach(head, &task->cmd->group_by) {
+        key = mk_list_entry(head, struct flb_sp_cmd_key, _head);
+        o = flb_ra_get(key->ra, map);
+        if (o) {
+            msgpack_pack_object(&task->key_pck, *o);
+        }
+        else {
+            msgpack_pack_nil(&task->key_pck);
+        }
+    }
+
+    if (task->ht && flb_hash_get(task->ht,
+                                 task->key_sbuf.data, task->key_sbuf.size,
+                                 &buf, &size) >= 0) {
+        memcpy(&g, buf, sizeof(g));
+    }
+    else if (task->groups >= FLB_SP_MAX_GROUPS) {
+        task->overflow++;
+        return;
+    }
+    else {
+        g = group_create(task, task->key_sbuf.data, task->key_sbuf.size);
+        if (!g) {
+            task->overflow++;
+            return;
+        }
+    }
+
+    i = 0;
+    mk_list_foreach(head, &task->cmd->keys) {
+        key = mk_list_entry(head, struct flb_sp_cmd_key, _head);
+        agg = &g->aggs[i++];
+
+        if (key->func == FLB_SP_KEY) {
+            continue;
+        }
+
+        /* COUNT(*) counts records, COUNT(key) the ones having the key */
+        if (key->func == FLB_SP_COUNT) {
+            if (!key->ra) {
+                agg->count++;
+            }
+            else {
+                o = flb_ra_get(key->ra, map);
+                if (o && o->type != MSGPACK_OBJECT_NIL) {
+                    agg->count++;
+                }
+            }
+            continue;
+        }
+
+        o = flb_ra_get(key->ra, map);
+        if (!o) {
+            continue;
+        }
+        type = num_get(o, &ival, &fval);
+        if (type != -1) {
+            agg_add(agg, type, ival, fval);
+        }
+    }
+}
+
+/* Pack the results of a group, functions without values are null */
+static void group_pack(struct flb_sp_task *task, struct flb_sp_group *g,
+                       struct flb_time *tm)
+{
+    int i = 0;
+    size_t off = 0;
+    struct mk_list *head;
+    struct flb_sp_agg *agg;
+    struct flb_sp_cmd_key *key;
+    msgpack_object *vals;
+    msgpack_unpacked result;
+    msgpack_packer *pck = &task->out_pck;
+
+    msgpack_unpacked_init(&result);
+    msgpack_unpack_next(&result, g->key, g->key_len, &off);
+    vals = result.data.via.array.ptr;
+
+    msgpack_pack_array(pck, 2);
+    flb_time_append_to_msgpack(tm, pck, 0);
+    msgpack_pack_map(pck, task->cmd->keys_len);
+
+    mk_list_foreach(head, &task->cmd->keys) {
+        key = mk_list_entry(head, struct flb_sp_cmd_key, _head);
+        agg = &g->aggs[i++];
+
+        msgpack_pack_str(pck, key->out_len);
+        msgpack_pack_str_body(pck, key->out, key->out_len);
+
+        if (key->func == FLB_SP_KEY) {
+            msgpack_pack_object(pck, vals[key->group]);
+            continue;
+        }
+        if (key->func == FLB_SP_COUNT) {
+            msgpack_pack_uint64(pck, agg->count);
+            continue;
+        }
+        if (agg->count == 0) {
+            msgpack_pack_nil(pck);
+            continue;
+        }
+
+        switch (key->func) {
+        case FLB_SP_SUM:
+            if (agg->is_float == FLB_TRUE) {
+                msgpack_pack_double(pck, agg->fsum + agg->isum);
+            }
+            else {
+                msgpack_pack_int64(pck, agg->isum);
+            }
+            break;
+        case FLB_SP_AVG:
+            msgpack_pack_double(pck,
+                                (agg->fsum + agg->isum) / agg->count);
+            break;
+        case FLB_SP_MIN:
+        case FLB_SP_MAX:
+            if (agg->is_float == FLB_TRUE) {
+                msgpack_pack_double(pck, (key->func == FLB_SP_MIN) ?
+                                    agg->min : agg->max);
+            }
+            else {
+                msgpack_pack_int64(pck, (int64_t) ((key->func == FLB_SP_MIN) ?
+                                                   agg->min : agg->max));
+            }
+            break;
+        }
+    }
+
+    msgpack_unpacked_destroy(&result);
+}
+
+/*
+ * Pack the results of the aggregations (one record per group) into the
+ * output buffer of the task and start over. Returns the number of records.
+ */
+int flb_sp_task_flush(struct flb_sp_task *task, struct flb_time *tm)
+{
+    int n;
+    struct mk_list *head;
+    struct flb_sp_group *g;
+
+    mk_list_foreach(head, &task->list) {
+        g = mk_list_entry(head, struct flb_sp_group, _head);
+        group_pack(task, g, tm);
+    }
+    n = task->groups;
+
+    if (task->overflow > 0) {
+        flb_warn("[sp] task '%s': %lu records not aggregated, more than "
+                 "%i groups", task->name, task->overflow, FLB_SP_MAX_GROUPS);
+        task->overflow = 0;
+    }
+    groups_destroy(task);
+
+    return n;
+}
+
+static int source_match(struct flb_sp_cmd *cmd,
+                        struct flb_input_instance *in, char *tag)
+{
+    if (cmd->source_type == FLB_SP_FROM_STREAM) {
+        return (in && strcmp(in->name, cmd->source) == 0);
+    }
+
+    return flb_router_match(tag, cmd->source);
+}
+
+/*
+ * Run the query over the records of a chunk. The results are packed into
+ * the output buffer of the task, the number of new records is returned.
+ * Aggregations over a window keep their state until the window ends,
+ * otherwise they are done per chunk.
+ */
+int flb_sp_task_process(struct flb_sp_task *task,
+                        struct flb_input_instance *in,
+                        char *tag, int tag_len,
+                        char *buf, size_t size)
+{
+    int n = 0;
+    size_t off = 0;
+    size_t prev = 0;
+    struct flb_time tm;
+    struct flb_sp_cmd *cmd = task->cmd;
+    msgpack_object root;
+    msgpack_object map;
+    msgpack_unpacked result;
+    (void) tag_len;
+
+    if (source_match(cmd, in, tag) == FLB_FALSE) {
+        return 0;
+    }
+
+    msgpack_unpacked_init(&result);
+    while (msgpack_unpack_next(&result, buf, size, &off) ==
+           MSGPACK_UNPACK_SUCCESS) {
+        root = result.data;
+        if (root.type != MSGPACK_OBJECT_ARRAY || root.via.array.size != 2 ||
+            root.via.array.ptr[1].type != MSGPACK_OBJECT_MAP) {
+            prev = off;
+            continue;
+        }
+        map = root.via.array.ptr[1];
+
+        if (!cmd->where || exp_eval(cmd->where, map)) {
+            if (cmd->aggregate == FLB_TRUE) {
+                record_aggregate(task, map);
+            }
+            else {
+                record_select(task, &root, buf + prev, off - prev);
+                n++;
+            }
+        }
+        prev = off;
+    }
+    msgpack_unpacked_destroy(&result);
+
+    if (cmd->aggregate == FLB_TRUE && cmd->window == 0) {
+        flb_time_get(&tm);
+        n = flb_sp_task_flush(task, &tm);
+    }
+
+    return n;
+}
+
+/* Append the results to the pipeline, they skip the filters */
+static void task_emit(struct flb_sp_task *task, int records)
+{
+    if (records > 0) {
+        flb_input_dyntag_append_filtered(task->ins, task->tag, task->tag_len,
+                                         task->out_sbuf.data,
+                                         task->out_sbuf.size, records);
+    }
+    task->out_sbuf.size = 0;
+}
+
+/*
+ * Called by the engine for every new task (chunk) once it went through
+ * the filters. Records of the stream processor itself are not processed.
+ */
+int flb_sp_do(struct flb_config *config, struct flb_input_instance *in,
+              char *tag, int tag_len, char *buf, size_t size)
+{
+    int n;
+    struct mk_list *head;
+    struct flb_sp_task *task;
+
+    mk_list_foreach(head, &config->stream_tasks) {
+        task = mk_list_entry(head, struct flb_sp_task, _head);
+        if (task->ins == in) {
+            return 0;
+        }
+    }
+
+    mk_list_foreach(head, &config->stream_tasks) {
+        task = mk_list_entry(head, struct flb_sp_task, _head);
+        n = flb_sp_task_process(task, in, tag, tag_len, buf, size);
+        task_emit(task, n);
+    }
+
+    return 0;
+}
+
+/* Milliseconds until the end of the current window */
+static int window_remaining_ms(struct flb_sp_task *task)
+{
+    int64_t ms;
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    ms = ((int64_t) (task->window_start + task->cmd->window) * 1000) -
+        (((int64_t) tv.tv_sec * 1000) + (tv.tv_usec / 1000));
+    if (ms < 1) {
+        ms = 1;
+    }
+
+    return (int) ms;
+}
+
+/* End of a tumbling window: emit its results and arm the next one */
+static void cb_sp_window(struct flb_config *config, void *data)
+{
+    int n;
+    struct flb_time tm;
+    struct flb_sp_task *task = data;
+
+    flb_time_set(&tm, task->window_start, 0);
+    n = flb_sp_task_flush(task, &tm);
+    task_emit(task, n);
+
+    /* Windows are contiguous, the timer firing late does not shift them */
+    task->window_start += task->cmd->window;
+
+    if (config->is_running == FLB_FALSE) {
+        return;
+    }
+    if (flb_sched_timer_cb_create(config, window_remaining_ms(task),
+                                  cb_sp_window, task) == -1) {
+        flb_error("[sp] task '%s': cannot schedule the window timer",
+                  task->name);
+    }
+}
+
+struct flb_sp_task *flb_sp_task_create(struct flb_config *config,
+                                       char *name, char *query)
+{
+    char *tag;
+    struct flb_sp_cmd *cmd;
+    struct flb_sp_task *task;
+
+    cmd = flb_sp_cmd_create(query);
+    if (!cmd) {
+        flb_error("[sp] task '%s': invalid query", name);
+        return NULL;
+    }
+
+    task = flb_calloc(1, sizeof(struct flb_sp_task));
+    if (!task) {
+        flb_errno();
+        flb_sp_cmd_destroy(cmd);
+        return NULL;
+    }
+    task->cmd = cmd;
+    mk_list_init(&task->list);
+    msgpack_sbuffer_init(&task->key_sbuf);
+    msgpack_packer_init(&task->key_pck, &task->key_sbuf,
+                        msgpack_sbuffer_write);
+    msgpack_sbuffer_init(&task->out_sbuf);
+    msgpack_packer_init(&task->out_pck, &task->out_sbuf,
+                        msgpack_sbuffer_write);
+    mk_list_add(&task->_head, &config->stream_tasks);
+
+    /* Results are tagged with the stream tag, its name or the task name */
+    tag = cmd->tag ? cmd->tag : (cmd->stream_name ? cmd->stream_name : name);
+    task->name = flb_strdup(name);
+    task->query = flb_strdup(query);
+    task->tag = flb_strdup(tag);
+    if (!task->name || !task->query || !task->tag) {
+        flb_sp_task_destroy(task);
+        return NULL;
+    }
+    task->tag_len = strlen(task->tag);
+
+    if (cmd->keys_len > 0) {
+        task->vals = flb_calloc(cmd->keys_len, sizeof(msgpack_object *));
+        if (!task->vals) {
+            flb_errno();
+            flb_sp_task_destroy(task);
+            return NULL;
+        }
+    }
+
+    /* The results enter the pipeline through their own input */
+    task->ins = flb_input_new(config, "emitter", NULL);
+    if (!task->ins) {
+        flb_error("[sp] task '%s': cannot create the emitter input", name);
+        flb_sp_task_destroy(task);
+        return NULL;
+    }
+
+    flb_debug("[sp] task '%s' created, results tagged '%s'",
+              task->name, task->tag);
+    return task;
+}
+
+/* The emitter instance is released with the other inputs */
+void flb_sp_task_destroy(struct flb_sp_task *task)
+{
+    mk_list_del(&task->_head);
+    groups_destroy(task);
+    msgpack_sbuffer_destroy(&task->key_sbuf);
+    msgpack_sbuffer_destroy(&task->out_sbuf);
+    flb_sp_cmd_destroy(task->cmd);
+    flb_free(task->vals);
+    flb_free(task->name);
+    flb_free(task->query);
+    flb_free(task->tag);
+    flb_free(task);
+}
+
+/* Start the windows of the tasks, the scheduler must be running */
+int flb_sp_start(struct flb_config *config)
+{
+    time_t now;
+    struct mk_list *head;
+    struct flb_sp_task *task;
+
+    mk_list_foreach(head, &config->stream_tasks) {
+        task = mk_list_entry(head, struct flb_sp_task, _head);
+        if (task->cmd->window == 0) {
+            continue;
+        }
+
+        /* Tumbling windows aligned to multiples of their length */
+        now = time(NULL);
+        task->window_start = now - (now % task->cmd->window);
+        if (flb_sched_timer_cb_create(config, window_remaining_ms(task),
+                                      cb_sp_window, task) == -1) {
+            flb_error("[sp] task '%s': cannot schedule the window timer",
+                      task->name);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void flb_sp_exit(struct flb_config *config)
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct flb_sp_task *task;
+
+    mk_list_foreach_safe(head, tmp, &config->stream_tasks) {
+        task = mk_list_entry(head, struct flb_sp_task, _head);
+        flb_sched_timer_cb_cancel(config, task);
+        flb_sp_task_destroy(task);
+    }
+}
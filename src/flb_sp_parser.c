@@ -0,0 +1,1016 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_str.h>
+#include <fluent-bit/flb_log.h>
+#include <fluent-bit/flb_record_accessor.h>
+#include <fluent-bit/flb_sp.h>
+
+/*
+ * Query compiler: a hand written lexer and recursive descent parser for
+ * the SQL subset of the stream processor:
+ *
+ *   [CREATE STREAM name [WITH (tag='tag')] AS]
+ *   SELECT * | key [AS alias] | FUNC(key | *) [AS alias], ...
+ *   FROM TAG:'pattern' | STREAM:input_name
+ *   [WHERE condition]
+ *   [WINDOW TUMBLING (N [SECOND | MINUTE | HOUR])]
+ *   [GROUP BY key, ...] [;]
+ *
+ * Keys are first level names, `quoted names` or record accessor patterns
+ * ($kubernetes['labels']['app']). Conditions compare a key with a literal
+ * and are combined with AND, OR, NOT and parenthesis.
+ */
+
+#define TOK_END      0
+#define TOK_IDENT    1      /* identifiers and keywords          */
+#define TOK_KEY      2      /* $accessor or `quoted name`        */
+#define TOK_STRING   3      /* 'literal', '' escapes a quote     */
+#define TOK_NUMBER   4
+#define TOK_PUNCT    5      /* ( ) , ; * :                       */
+#define TOK_OP       6      /* comparison operators              */
+#define TOK_ERROR    7
+
+struct sp_lexer {
+    char *query;
+    char *p;
+
+    /* current token */
+    int type;
+    char *tok;
+    int len;
+    int op;
+    int is_float;
+    int64_t i;
+    double f;
+
+    /* first error found */
+    char *error;
+    char *error_at;
+};
+
+/* Words that can't be used as key names without quotes */
+static char *reserved[] = {
+    "SELECT", "FROM", "WHERE", "AND", "OR", "NOT", "IS", "NULL", "TRUE",
+    "FALSE", "WINDOW", "GROUP", "BY", "AS", NULL
+};
+
+static void sp_error(struct sp_lexer *lx, char *msg)
+{
+    if (lx->error) {
+        return;
+    }
+    lx->error = msg;
+    lx->error_at = lx->tok;
+}
+
+static int is_ident_char(int c)
+{
+    return (isalnum(c) || c == '_' || c == '.' || c == '-');
+}
+
+static void lex_key(struct sp_lexer *lx)
+{
+    int depth = 0;
+    char quote = 0;
+    char *p = lx->p;
+
+    while (*p) {
+        if (quote) {
+            if (*p == quote) {
+                quote = 0;
+            }
+        }
+        else if (*p == '\'' || *p == '"') {
+            quote = *p;
+        }
+        else if (*p == '[') {
+            depth++;
+        }
+        else if (*p == ']') {
+            depth--;
+        }
+        else if (depth == 0 &&
+                 (isspace(*p) || strchr(",();=!<>", *p))) {
+            break;
+        }
+        p++;
+    }
+
+    lx->type = TOK_KEY;
+    lx->len = p - lx->tok;
+    lx->p = p;
+}
+
+static void lex_number(struct sp_lexer *lx)
+{
+    int i;
+    char *end;
+
+    lx->f = strtod(lx->tok, &end);
+    lx->type = TOK_NUMBER;
+    lx->len = end - lx->tok;
+    lx->p = end;
+
+    lx->is_float = FLB_FALSE;
+    for (i = 0; i < lx->len; i++) {
+        if (lx->tok[i] == '.' || lx->tok[i] == 'e' || lx->tok[i] == 'E') {
+            lx->is_float = FLB_TRUE;
+            break;
+        }
+    }
+    if (lx->is_float == FLB_FALSE) {
+        lx->i = strtoll(lx->tok, NULL, 10);
+    }
+}
+
+static int lex_next(struct sp_lexer *lx)
+{
+    char c;
+    char *p = lx->p;
+
+    while (isspace(*p)) {
+        p++;
+    }
+
+    lx->tok = p;
+    lx->len = 0;
+    c = *p;
+
+    if (c == '\0') {
+        lx->type = TOK_END;
+        lx->p = p;
+        return lx->type;
+    }
+
+    if (isalpha(c) || c == '_') {
+        while (is_ident_char(*p)) {
+            p++;
+        }
+        lx->type = TOK_IDENT;
+        lx->len = p - lx->tok;
+        lx->p = p;
+    }
+    else if (c == '$') {
+        lx->p = p;
+        lex_key(lx);
+    }
+    else if (c == '`') {
+        p = strchr(p + 1, '`');
+        if (!p) {
+            lx->type = TOK_ERROR;
+            sp_error(lx, "unterminated quoted name");
+            return lx->type;
+        }
+        lx->type = TOK_KEY;
+        lx->tok++;
+        lx->len = p - lx->tok;
+        lx->p = p + 1;
+    }
+    else if (c == '\'') {
+        p++;
+        while (*p) {
+            if (*p == '\'') {
+                if (p[1] != '\'') {
+                    break;
+                }
+                p++;
+            }
+            p++;
+        }
+        if (*p != '\'') {
+            lx->type = TOK_ERROR;
+            sp_error(lx, "unterminated string");
+            return lx->type;
+        }
+        lx->type = TOK_STRING;
+        lx->tok++;
+        lx->len = p - lx->tok;
+        lx->p = p + 1;
+    }
+    else if (isdigit(c) || ((c == '-' || c == '.') && isdigit(p[1]))) {
+        lx->p = p;
+        lex_number(lx);
+    }
+    else if (strchr("(),;*:", c)) {
+        lx->type = TOK_PUNCT;
+        lx->len = 1;
+        lx->p = p + 1;
+    }
+    else if (c == '=' || c == '!' || c == '<' || c == '>') {
+        lx->type = TOK_OP;
+        lx->len = 1;
+        if (c == '=') {
+            lx->op = FLB_SP_EQ;
+            if (p[1] == '=') {
+                lx->len = 2;
+            }
+        }
+        else if (c == '!' && p[1] == '=') {
+            lx->op = FLB_SP_NEQ;
+            lx->len = 2;
+        }
+        else if (c == '<' && p[1] == '>') {
+            lx->op = FLB_SP_NEQ;
+            lx->len = 2;
+        }
+        else if (c == '<') {
+            lx->op = FLB_SP_LT;
+            if (p[1] == '=') {
+                lx->op = FLB_SP_LTE;
+                lx->len = 2;
+            }
+        }
+        else if (c == '>') {
+            lx->op = FLB_SP_GT;
+            if (p[1] == '=') {
+                lx->op = FLB_SP_GTE;
+                lx->len = 2;
+            }
+        }
+        else {
+            lx->type = TOK_ERROR;
+            sp_error(lx, "invalid operator");
+            return lx->type;
+        }
+        lx->p = p + lx->len;
+    }
+    else {
+        lx->type = TOK_ERROR;
+        sp_error(lx, "invalid character");
+    }
+
+    return lx->type;
+}
+
+static int is_kw(struct sp_lexer *lx, char *kw)
+{
+    int len;
+
+    if (lx->type != TOK_IDENT) {
+        return FLB_FALSE;
+    }
+
+    len = strlen(kw);
+    if (lx->len == len && strncasecmp(lx->tok, kw, len) == 0) {
+        return FLB_TRUE;
+    }
+
+    return FLB_FALSE;
+}
+
+static int is_punct(struct sp_lexer *lx, char c)
+{
+    return (lx->type == TOK_PUNCT && lx->tok[0] == c);
+}
+
+static int expect_kw(struct sp_lexer *lx, char *kw, char *msg)
+{
+    if (is_kw(lx, kw) == FLB_FALSE) {
+        sp_error(lx, msg);
+        return -1;
+    }
+    lex_next(lx);
+    return 0;
+}
+
+static int expect_punct(struct sp_lexer *lx, char c, char *msg)
+{
+    if (is_punct(lx, c) == FLB_FALSE) {
+        sp_error(lx, msg);
+        return -1;
+    }
+    lex_next(lx);
+    return 0;
+}
+
+/* Is the next character (after blanks) 'c' ? */
+static int peek_char(struct sp_lexer *lx, char c)
+{
+    char *p = lx->p;
+
+    while (isspace(*p)) {
+        p++;
+    }
+    return (*p == c);
+}
+
+static int is_reserved(struct sp_lexer *lx)
+{
+    int i;
+
+    for (i = 0; reserved[i]; i++) {
+        if (is_kw(lx, reserved[i]) == FLB_TRUE) {
+            return FLB_TRUE;
+        }
+    }
+    return FLB_FALSE;
+}
+
+/* Copy of a string token, quotes of the literal are unescaped */
+static char *token_str(struct sp_lexer *lx, int *out_len)
+{
+    int i;
+    int len = 0;
+    char *s;
+
+    s = flb_malloc(lx->len + 1);
+    if (!s) {
+        flb_errno();
+        return NULL;
+    }
+
+    for (i = 0; i < lx->len; i++) {
+        s[len++] = lx->tok[i];
+        if (lx->type == TOK_STRING && lx->tok[i] == '\'') {
+            i++;
+        }
+    }
+    s[len] = '\0';
+
+    if (out_len) {
+        *out_len = len;
+    }
+    return s;
+}
+
+static void key_destroy(struct flb_sp_cmd_key *key)
+{
+    if (key->ra) {
+        flb_ra_destroy(key->ra);
+    }
+    flb_free(key->name);
+    flb_free(key->out);
+    flb_free(key);
+}
+
+/* A key name: identifier, `quoted name` or record accessor */
+static struct flb_sp_cmd_key *key_parse(struct sp_lexer *lx, int func)
+{
+    struct flb_sp_cmd_key *key;
+
+    if ((lx->type != TOK_IDENT && lx->type != TOK_KEY) ||
+        (lx->type == TOK_IDENT && is_reserved(lx) == FLB_TRUE) ||
+        lx->len == 0) {
+        sp_error(lx, "expected a key name");
+        return NULL;
+    }
+
+    key = flb_calloc(1, sizeof(struct flb_sp_cmd_key));
+    if (!key) {
+        flb_errno();
+        return NULL;
+    }
+    key->func = func;
+    key->group = -1;
+
+    key->name = token_str(lx, NULL);
+    if (!key->name) {
+        flb_free(key);
+        return NULL;
+    }
+
+    key->ra = flb_ra_create(key->name);
+    if (!key->ra) {
+        sp_error(lx, "invalid key pattern");
+        key_destroy(key);
+        return NULL;
+    }
+
+    lex_next(lx);
+    return key;
+}
+
+static int func_get(struct sp_lexer *lx)
+{
+    if (peek_char(lx, '(') == FLB_FALSE) {
+        return FLB_SP_KEY;
+    }
+
+    if (is_kw(lx, "COUNT")) {
+        return FLB_SP_COUNT;
+    }
+    else if (is_kw(lx, "SUM")) {
+        return FLB_SP_SUM;
+    }
+    else if (is_kw(lx, "AVG")) {
+        return FLB_SP_AVG;
+    }
+    else if (is_kw(lx, "MIN")) {
+        return FLB_SP_MIN;
+    }
+    else if (is_kw(lx, "MAX")) {
+        return FLB_SP_MAX;
+    }
+
+    return FLB_SP_KEY;
+}
+
+/* key [AS alias] or FUNC(key | *) [AS alias] */
+static struct flb_sp_cmd_key *select_key_parse(struct sp_lexer *lx)
+{
+    int len;
+    int func;
+    char *fname;
+    static char *funcs[] = {"", "COUNT", "SUM", "AVG", "MIN", "MAX"};
+    struct flb_sp_cmd_key *key;
+
+    func = func_get(lx);
+    if (func == FLB_SP_KEY) {
+        key = key_parse(lx, FLB_SP_KEY);
+        if (!key) {
+            return NULL;
+        }
+    }
+    else {
+        lex_next(lx);
+        lex_next(lx);
+        if (func == FLB_SP_COUNT && is_punct(lx, '*')) {
+            key = flb_calloc(1, sizeof(struct flb_sp_cmd_key));
+            if (!key) {
+                flb_errno();
+                return NULL;
+            }
+            key->func = func;
+            key->group = -1;
+            lex_next(lx);
+        }
+        else {
+            key = key_parse(lx, func);
+            if (!key) {
+                return NULL;
+            }
+        }
+        if (expect_punct(lx, ')', "expected ')'") == -1) {
+            key_destroy(key);
+            return NULL;
+        }
+    }
+
+    /* Name of the key in the results */
+    if (is_kw(lx, "AS")) {
+        lex_next(lx);
+        if (lx->type != TOK_IDENT && lx->type != TOK_KEY &&
+            lx->type != TOK_STRING) {
+            sp_error(lx, "expected an alias");
+            key_destroy(key);
+            return NULL;
+        }
+        key->out = token_str(lx, &key->out_len);
+        lex_next(lx);
+    }
+    else if (func == FLB_SP_KEY) {
+        key->out = flb_strdup(key->name);
+        key->out_len = strlen(key->name);
+    }
+    else {
+        fname = funcs[func];
+        len = strlen(fname) + (key->name ? strlen(key->name) : 1) + 3;
+        key->out = flb_malloc(len);
+        if (key->out) {
+            key->out_len = snprintf(key->out, len, "%s(%s)", fname,
+                                    key->name ? key->name : "*");
+        }
+    }
+
+    if (!key->out) {
+        key_destroy(key);
+        return NULL;
+    }
+
+    return key;
+}
+
+static void exp_destroy(struct flb_sp_exp *exp)
+{
+    if (!exp) {
+        return;
+    }
+
+    exp_destroy(exp->left);
+    exp_destroy(exp->right);
+    if (exp->ra) {
+        flb_ra_destroy(exp->ra);
+    }
+    flb_free(exp->val.s);
+    flb_free(exp);
+}
+
+static struct flb_sp_exp *exp_create(int type, struct flb_sp_exp *left,
+                                     struct flb_sp_exp *right)
+{
+    struct flb_sp_exp *exp;
+
+    exp = flb_calloc(1, sizeof(struct flb_sp_exp));
+    if (!exp) {
+        flb_errno();
+        exp_destroy(left);
+        exp_destroy(right);
+        return NULL;
+    }
+    exp->type = type;
+    exp->left = left;
+    exp->right = right;
+
+    return exp;
+}
+
+static int literal_parse(struct sp_lexer *lx, struct flb_sp_value *val)
+{
+    if (lx->type == TOK_STRING) {
+        val->type = FLB_SP_STRING;
+        val->s = token_str(lx, &val->len);
+        if (!val->s) {
+            return -1;
+        }
+    }
+    else if (lx->type == TOK_NUMBER) {
+        if (lx->is_float == FLB_TRUE) {
+            val->type = FLB_SP_FLOAT;
+            val->f = lx->f;
+        }
+        else {
+            val->type = FLB_SP_INT;
+            val->i = lx->i;
+        }
+    }
+    else if (is_kw(lx, "TRUE") || is_kw(lx, "FALSE")) {
+        val->type = FLB_SP_BOOL;
+        val->i = is_kw(lx, "TRUE");
+    }
+    else if (is_kw(lx, "NULL")) {
+        val->type = FLB_SP_NULL;
+    }
+    else {
+        sp_error(lx, "expected a value");
+        return -1;
+    }
+
+    lex_next(lx);
+    return 0;
+}
+
+static struct flb_sp_exp *exp_or_parse(struct sp_lexer *lx);
+
+/* '(' condition ')', key IS [NOT] NULL or key <op> literal */
+static struct flb_sp_exp *exp_primary_parse(struct sp_lexer *lx)
+{
+    int neg = FLB_FALSE;
+    struct flb_sp_exp *exp;
+    struct flb_sp_cmd_key *key;
+
+    if (is_punct(lx, '(')) {
+        lex_next(lx);
+        exp = exp_or_parse(lx);
+        if (!exp) {
+            return NULL;
+        }
+        if (expect_punct(lx, ')', "expected ')'") == -1) {
+            exp_destroy(exp);
+            return NULL;
+        }
+        return exp;
+    }
+
+    /* the accessor of the key is moved to the expression */
+    key = key_parse(lx, FLB_SP_KEY);
+    if (!key) {
+        return NULL;
+    }
+    exp = exp_create(FLB_SP_EXP_CMP, NULL, NULL);
+    if (!exp) {
+        key_destroy(key);
+        return NULL;
+    }
+    exp->ra = key->ra;
+    key->ra = NULL;
+    key_destroy(key);
+
+    if (is_kw(lx, "IS")) {
+        lex_next(lx);
+        if (is_kw(lx, "NOT")) {
+            neg = FLB_TRUE;
+            lex_next(lx);
+        }
+        if (expect_kw(lx, "NULL", "expected NULL") == -1) {
+            exp_destroy(exp);
+            return NULL;
+        }
+        exp->type = FLB_SP_EXP_NULL;
+    }
+    else {
+        if (lx->type != TOK_OP) {
+            sp_error(lx, "expected a comparison operator");
+            exp_destroy(exp);
+            return NULL;
+        }
+        exp->op = lx->op;
+        lex_next(lx);
+
+        if (literal_parse(lx, &exp->val) == -1) {
+            exp_destroy(exp);
+            return NULL;
+        }
+
+        /* key = NULL is taken as key IS NULL */
+        if (exp->val.type == FLB_SP_NULL) {
+            if (exp->op != FLB_SP_EQ && exp->op != FLB_SP_NEQ) {
+                sp_error(lx, "NULL can only be compared with = or !=");
+                exp_destroy(exp);
+                return NULL;
+            }
+            neg = (exp->op == FLB_SP_NEQ);
+            exp->type = FLB_SP_EXP_NULL;
+        }
+    }
+
+    if (neg == FLB_TRUE) {
+        return exp_create(FLB_SP_EXP_NOT, exp, NULL);
+    }
+    return exp;
+}
+
+static struct flb_sp_exp *exp_not_parse(struct sp_lexer *lx)
+{
+    struct flb_sp_exp *exp;
+
+    if (is_kw(lx, "NOT")) {
+        lex_next(lx);
+        exp = exp_not_parse(lx);
+        if (!exp) {
+            return NULL;
+        }
+        return exp_create(FLB_SP_EXP_NOT, exp, NULL);
+    }
+
+    return exp_primary_parse(lx);
+}
+
+static struct flb_sp_exp *exp_and_parse(struct sp_lexer *lx)
+{
+    struct flb_sp_exp *left;
+    struct flb_sp_exp *right;
+
+    left = exp_not_parse(lx);
+    while (left && is_kw(lx, "AND")) {
+        lex_next(lx);
+        right = exp_not_parse(lx);
+        if (!right) {
+            exp_destroy(left);
+            return NULL;
+        }
+        left = exp_create(FLB_SP_EXP_AND, left, right);
+    }
+
+    return left;
+}
+
+static struct flb_sp_exp *exp_or_parse(struct sp_lexer *lx)
+{
+    struct flb_sp_exp *left;
+    struct flb_sp_exp *right;
+
+    left = exp_and_parse(lx);
+    while (left && is_kw(lx, "OR")) {
+        lex_next(lx);
+        right = exp_and_parse(lx);
+        if (!right) {
+            exp_destroy(left);
+            return NULL;
+        }
+        left = exp_create(FLB_SP_EXP_OR, left, right);
+    }
+
+    return left;
+}
+
+static int select_parse(struct sp_lexer *lx, struct flb_sp_cmd *cmd)
+{
+    struct flb_sp_cmd_key *key;
+
+    if (is_punct(lx, '*')) {
+        cmd->select_all = FLB_TRUE;
+        lex_next(lx);
+        return 0;
+    }
+
+    while (1) {
+        key = select_key_parse(lx);
+        if (!key) {
+            return -1;
+        }
+        mk_list_add(&key->_head, &cmd->keys);
+        cmd->keys_len++;
+
+        if (key->func != FLB_SP_KEY) {
+            cmd->aggregate = FLB_TRUE;
+        }
+
+        if (!is_punct(lx, ',')) {
+            break;
+        }
+        lex_next(lx);
+    }
+
+    return 0;
+}
+
+static int source_parse(struct sp_lexer *lx, struct flb_sp_cmd *cmd)
+{
+    if (is_kw(lx, "TAG")) {
+        cmd->source_type = FLB_SP_FROM_TAG;
+    }
+    else if (is_kw(lx, "STREAM")) {
+        cmd->source_type = FLB_SP_FROM_STREAM;
+    }
+    else {
+        sp_error(lx, "expected TAG or STREAM");
+        return -1;
+    }
+    lex_next(lx);
+
+    if (expect_punct(lx, ':', "expected ':'") == -1) {
+        return -1;
+    }
+
+    if (lx->type != TOK_STRING &&
+        (cmd->source_type == FLB_SP_FROM_TAG || lx->type != TOK_IDENT)) {
+        sp_error(lx, "expected the source name");
+        return -1;
+    }
+    cmd->source = token_str(lx, NULL);
+    if (!cmd->source) {
+        return -1;
+    }
+    lex_next(lx);
+
+    return 0;
+}
+
+/* WINDOW TUMBLING (N [unit]) */
+static int window_parse(struct sp_lexer *lx, struct flb_sp_cmd *cmd)
+{
+    int n;
+
+    lex_next(lx);
+    if (expect_kw(lx, "TUMBLING", "expected TUMBLING") == -1 ||
+        expect_punct(lx, '(', "expected '('") == -1) {
+        return -1;
+    }
+
+    if (lx->type != TOK_NUMBER || lx->is_float == FLB_TRUE || lx->i <= 0) {
+        sp_error(lx, "expected the window length in seconds");
+        return -1;
+    }
+    n = lx->i;
+    lex_next(lx);
+
+    if (is_kw(lx, "s") || is_kw(lx, "SEC") || is_kw(lx, "SECOND") ||
+        is_kw(lx, "SECONDS")) {
+        lex_next(lx);
+    }
+    else if (is_kw(lx, "m") || is_kw(lx, "MIN") || is_kw(lx, "MINUTE") ||
+             is_kw(lx, "MINUTES")) {
+        n *= 60;
+        lex_next(lx);
+    }
+    else if (is_kw(lx, "h") || is_kw(lx, "HOUR") || is_kw(lx, "HOURS")) {
+        n *= 3600;
+        lex_next(lx);
+    }
+
+    cmd->window = n;
+    return expect_punct(lx, ')', "expected ')'");
+}
+
+static int group_by_parse(struct sp_lexer *lx, struct flb_sp_cmd *cmd)
+{
+    struct flb_sp_cmd_key *key;
+
+    lex_next(lx);
+    if (expect_kw(lx, "BY", "expected BY") == -1) {
+        return -1;
+    }
+
+    while (1) {
+        key = key_parse(lx, FLB_SP_KEY);
+        if (!key) {
+            return -1;
+        }
+        key->group = cmd->group_by_len++;
+        mk_list_add(&key->_head, &cmd->group_by);
+
+        if (!is_punct(lx, ',')) {
+            break;
+        }
+        lex_next(lx);
+    }
+
+    cmd->aggregate = FLB_TRUE;
+    return 0;
+}
+
+/* CREATE STREAM name [WITH (tag='tag')] AS */
+static int stream_parse(struct sp_lexer *lx, struct flb_sp_cmd *cmd)
+{
+    lex_next(lx);
+    if (expect_kw(lx, "STREAM", "expected STREAM") == -1) {
+        return -1;
+    }
+
+    if (lx->type != TOK_IDENT || is_reserved(lx) == FLB_TRUE) {
+        sp_error(lx, "expected the stream name");
+        return -1;
+    }
+    cmd->stream_name = token_str(lx, NULL);
+    lex_next(lx);
+
+    if (is_kw(lx, "WITH")) {
+        lex_next(lx);
+        if (expect_punct(lx, '(', "expected '('") == -1 ||
+            expect_kw(lx, "TAG", "expected TAG") == -1) {
+            return -1;
+        }
+        if (lx->type != TOK_OP || lx->op != FLB_SP_EQ) {
+            sp_error(lx, "expected '='");
+            return -1;
+        }
+        lex_next(lx);
+        if (lx->type != TOK_STRING || lx->len == 0) {
+            sp_error(lx, "expected the tag");
+            return -1;
+        }
+        cmd->tag = token_str(lx, NULL);
+        lex_next(lx);
+        if (expect_punct(lx, ')', "expected ')'") == -1) {
+            return -1;
+        }
+    }
+
+    return expect_kw(lx, "AS", "expected AS");
+}
+
+/* Plain keys of an aggregation are values of the GROUP BY keys */
+static int keys_check(struct sp_lexer *lx, struct flb_sp_cmd *cmd)
+{
+    struct mk_list *head;
+    struct mk_list *g_head;
+    struct flb_sp_cmd_key *key;
+    struct flb_sp_cmd_key *group;
+
+    if (cmd->select_all == FLB_TRUE && cmd->aggregate == FLB_TRUE) {
+        sp_error(lx, "SELECT * can't be aggregated");
+        return -1;
+    }
+    if (cmd->window > 0 && cmd->aggregate == FLB_FALSE) {
+        sp_error(lx, "WINDOW requires aggregate functions or GROUP BY");
+        return -1;
+    }
+    if (cmd->aggregate == FLB_FALSE) {
+        return 0;
+    }
+
+    mk_list_foreach(head, &cmd->keys) {
+        key = mk_list_entry(head, struct flb_sp_cmd_key, _head);
+        if (key->func != FLB_SP_KEY) {
+            continue;
+        }
+        mk_list_foreach(g_head, &cmd->group_by) {
+            group = mk_list_entry(g_head, struct flb_sp_cmd_key, _head);
+            if (strcmp(key->name, group->name) == 0) {
+                key->group = group->group;
+                break;
+            }
+        }
+        if (key->group == -1) {
+            sp_error(lx, "selected keys must be in GROUP BY");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+struct flb_sp_cmd *flb_sp_cmd_create(char *query)
+{
+    int ret = 0;
+    struct sp_lexer lx;
+    struct flb_sp_cmd *cmd;
+
+    cmd = flb_calloc(1, sizeof(struct flb_sp_cmd));
+    if (!cmd) {
+        flb_errno();
+        return NULL;
+    }
+    mk_list_init(&cmd->keys);
+    mk_list_init(&cmd->group_by);
+
+    memset(&lx, '\0', sizeof(lx));
+    lx.query = query;
+    lx.p = query;
+    lex_next(&lx);
+
+    if (is_kw(&lx, "CREATE")) {
+        ret = stream_parse(&lx, cmd);
+    }
+
+    if (ret == 0) {
+        ret = expect_kw(&lx, "SELECT", "expected SELECT");
+    }
+    if (ret == 0) {
+        ret = select_parse(&lx, cmd);
+    }
+    if (ret == 0) {
+        ret = expect_kw(&lx, "FROM", "expected FROM");
+    }
+    if (ret == 0) {
+        ret = source_parse(&lx, cmd);
+    }
+
+    /* optional clauses, in any order */
+    while (ret == 0) {
+        if (is_kw(&lx, "WHERE") && !cmd->where) {
+            lex_next(&lx);
+            cmd->where = exp_or_parse(&lx);
+            ret = cmd->where ? 0 : -1;
+        }
+        else if (is_kw(&lx, "WINDOW") && cmd->window == 0) {
+            ret = window_parse(&lx, cmd);
+        }
+        else if (is_kw(&lx, "GROUP") && cmd->group_by_len == 0) {
+            ret = group_by_parse(&lx, cmd);
+        }
+        else {
+            break;
+        }
+    }
+
+    if (ret == 0 && is_punct(&lx, ';')) {
+        lex_next(&lx);
+    }
+    if (ret == 0 && lx.type != TOK_END) {
+        sp_error(&lx, "unexpected token");
+        ret = -1;
+    }
+    if (ret == 0) {
+        ret = keys_check(&lx, cmd);
+    }
+
+    if (ret == -1) {
+        if (lx.error) {
+            flb_error("[sp] invalid query at position %i: %s",
+                      (int) (lx.error_at - lx.query), lx.error);
+        }
+        flb_sp_cmd_destroy(cmd);
+        return NULL;
+    }
+
+    return cmd;
+}
+
+void flb_sp_cmd_destroy(struct flb_sp_cmd *cmd)
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct flb_sp_cmd_key *key;
+
+    mk_list_foreach_safe(head, tmp, &cmd->keys) {
+        key = mk_list_entry(head, struct flb_sp_cmd_key, _head);
+        mk_list_del(&key->_head);
+        key_destroy(key);
+    }
+    mk_list_foreach_safe(head, tmp, &cmd->group_by) {
+        key = mk_list_entry(head, struct flb_sp_cmd_key, _head);
+        mk_list_del(&key->_head);
+        key_destroy(key);
+    }
+
+    exp_destroy(cmd->where);
+    flb_free(cmd->stream_name);
+    flb_free(cmd->tag);
+    flb_free(cmd->source);
+    flb_free(cmd);
+}
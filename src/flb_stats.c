@@ -18,642 +18,284 @@
  */
 
 /*
- * Initial draft of the stats interface, it basically aims to collect:
- *
- * - Number of events per second
- * - Number of bytes per second
- *
- * Each input/output plugin must have that counter in place
+ * The stats interface publishes the counters of the instances into a
+ * shared memory segment, see flb_stats.h for the layout. The counters are
+ * the metrics of the instances: nothing is added to the data path, the
+ * engine copies their values once per second.
  */
 
 #include <time.h>
-#include <sys/socket.h>
-#include <sys/un.h>
-#include <netinet/in.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #include <monkey/mk_core.h>
-#include <cjson.h>
 #include <fluent-bit/flb_info.h>
-#include <fluent-bit/flb_pipe.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_str.h>
+#include <fluent-bit/flb_log.h>
 #include <fluent-bit/flb_config.h>
 #include <fluent-bit/flb_input.h>
+#include <fluent-bit/flb_filter.h>
 #include <fluent-bit/flb_output.h>
-#include <fluent-bit/flb_error.h>
-#include <fluent-bit/flb_utils.h>
-
-#define SDP(s)       &s->data[s->n_data]
-#define SDP_TIME(s)  *SDP(s).time
-
-static FLB_INLINE int consume_byte(int fd)
-{
-    int ret;
-    uint64_t val;
-
-    /* We need to consume the byte */
-    ret = read(fd, &val, sizeof(val));
-    if (ret <= 0) {
-        perror("read");
-        return -1;
-    }
-
-    return 0;
-}
-
-static int stats_userver_timer(struct flb_stats *stats)
+#include <fluent-bit/flb_metrics.h>
+#include <fluent-bit/flb_stats.h>
+
+/* The layout is part of the interface */
+_Static_assert(sizeof(struct flb_stats_header) == 64,
+               "flb_stats_header must be 64 bytes");
+_Static_assert(sizeof(struct flb_stats_entry) == 128,
+               "flb_stats_entry must be 128 bytes");
+
+/* Metric IDs published in the value slots of every entry type */
+static int in_metrics[] = {
+    FLB_METRIC_N_RECORDS,
+    FLB_METRIC_N_BYTES
+};
+
+static int filter_metrics[] = {
+    FLB_METRIC_FILTER_IN_RECORDS,
+    FLB_METRIC_FILTER_OUT_RECORDS,
+    FLB_METRIC_FILTER_IN_BYTES,
+    FLB_METRIC_FILTER_OUT_BYTES,
+    FLB_METRIC_FILTER_DROP_RECORDS,
+    FLB_METRIC_FILTER_TIME
+};
+
+static int out_metrics[] = {
+    FLB_METRIC_OUT_OK_RECORDS,
+    FLB_METRIC_OUT_OK_BYTES,
+    FLB_METRIC_OUT_ERROR,
+    FLB_METRIC_OUT_RETRY,
+    FLB_METRIC_OUT_RETRY_FAILED
+};
+
+#define N_METRICS(a)  (int) (sizeof(a) / sizeof(int))
+
+struct flb_stats *flb_stats_segment_create(char *path, int entries)
 {
-    int fd;
-    struct mk_event *event;
-    struct flb_stats_userver_t *timer;
-    struct flb_stats_userver *userver;
-
-    userver = stats->userver;
-    timer = flb_malloc(sizeof(struct flb_stats_userver_t));
-    if (!timer) {
-        return -1;
-    }
-
-    /* Create a timeout caller every one second */
-    event = &timer->event;
-    event->mask   = MK_EVENT_EMPTY;
-    event->status = MK_EVENT_NONE;
-    fd = mk_event_timeout_create(stats->evl, 5, event);
-    if (fd == -1) {
-        flb_error("[stats_usrv] could not create timeout handler");
-        flb_free(timer);
-        return -1;
-    }
-
-    timer->fd = fd;
-    userver->timer = timer;
-
-    return 0;
-}
-
-static int stats_unix_server(char *path)
-{
-    unsigned long len;
-    int server_fd;
-    size_t address_length;
-    struct sockaddr_un address;
-
-    /* Create listening socket */
-    server_fd = socket(PF_UNIX, SOCK_STREAM, 0);
-    if (server_fd < 0) {
-        perror("socket() failed");
-        return -1;
-    }
-    unlink(path);
-
-    len = strlen(path);
-    address.sun_family = AF_UNIX;
-    sprintf(address.sun_path, "%s", path);
-    address_length = sizeof(address.sun_family) + len + 1;
-    if (bind(server_fd, (struct sockaddr *) &address, address_length) != 0) {
-        perror("bind");
-        close(server_fd);
-        return -1;
-    }
-
-    if (listen(server_fd, 5) != 0) {
-        perror("listen");
-        close(server_fd);
-        return -1;
-    }
-
-    return server_fd;
-}
-
-static FLB_INLINE int handle_input_plugin(void *event)
-{
-    ssize_t bytes;
-    struct flb_stats_in_plugin *sp = (struct flb_stats_in_plugin *) event;
-    struct flb_stats_datapoint data;
-
-    /* We have a READ notification */
-    bytes = read(sp->pipe[0], &data, sizeof(struct flb_stats_datapoint));
-    if (bytes <= 0) {
-        return 0;
-    }
+    void *map;
+    struct flb_stats *stats;
+    struct flb_stats_header *header;
 
-    if (sp->n_data == -1) {
-        sp->n_data = 0;
-    }
-    else {
-        if (SDP_TIME(sp) != data.time) {
-            if (sp->n_data + 1 == FLB_STATS_SIZE) {
-                sp->n_data = 0;
-            }
-            else {
-                sp->n_data++;
-            }
-        }
+    stats = flb_calloc(1, sizeof(struct flb_stats));
+    if (!stats) {
+        flb_errno();
+        return NULL;
     }
-    memcpy(SDP(sp), &data, sizeof(struct flb_stats_datapoint));
-    return 0;
-}
+    stats->timer_fd = -1;
+    stats->size = sizeof(struct flb_stats_header) +
+        (entries * sizeof(struct flb_stats_entry));
 
-static FLB_INLINE int handle_output_plugin(void *event)
-{
-    ssize_t bytes;
-    struct flb_stats_out_plugin *sp = (struct flb_stats_out_plugin *) event;
-    struct flb_stats_datapoint *out_data;
-    struct flb_stats_datapoint in_data;
-
-    /* We have a READ notification */
-    bytes = read(sp->pipe[0],
-                 &in_data,
-                 sizeof(struct flb_stats_datapoint));
-    if (bytes <= 0) {
-        sp->n_data--;
-        return -1;
+    stats->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (stats->fd == -1) {
+        flb_errno();
+        flb_error("[stats] cannot create %s", path);
+        flb_free(stats);
+        return NULL;
     }
 
-    if (sp->n_data == -1) {
-        sp->n_data = 0;
-    }
-    else {
-        out_data = &sp->data[sp->n_data];
-        if (out_data->time != in_data.time) {
-            if (sp->n_data + 1 == FLB_STATS_SIZE) {
-                sp->n_data = 0;
-            }
-            else {
-                sp->n_data++;
-            }
-        }
+    if (ftruncate(stats->fd, stats->size) == -1) {
+        flb_errno();
+        close(stats->fd);
+        unlink(path);
+        flb_free(stats);
+        return NULL;
     }
 
-    out_data = &sp->data[sp->n_data];
-    memcpy(out_data, &in_data, sizeof(struct flb_stats_datapoint));
-    return 0;
-}
-
-static FLB_INLINE int stats_userver_accept(struct flb_stats *stats)
-{
-    int remote_fd;
-    struct sockaddr sock_addr;
-    socklen_t socket_size = sizeof(struct sockaddr);
-
-    remote_fd = accept(stats->userver->fd, &sock_addr, &socket_size);
-    return remote_fd;
+    map = mmap(NULL, stats->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+               stats->fd, 0);
+    if (map == MAP_FAILED) {
+        flb_errno();
+        close(stats->fd);
+        unlink(path);
+        flb_free(stats);
+        return NULL;
+    }
+    stats->path = flb_strdup(path);
+    stats->header = map;
+    stats->entries = (struct flb_stats_entry *)
+        ((char *) map + sizeof(struct flb_stats_header));
+
+    /* The file is zeroed, the magic is written once the header is valid */
+    header = stats->header;
+    header->version     = FLB_STATS_VERSION;
+    header->header_size = sizeof(struct flb_stats_header);
+    header->entry_size  = sizeof(struct flb_stats_entry);
+    header->entries     = entries;
+    header->pid         = getpid();
+    header->start_time  = time(NULL);
+    __atomic_store_n(&header->magic, FLB_STATS_MAGIC, __ATOMIC_RELEASE);
+
+    return stats;
 }
 
-static int stats_userver_add(int fd, struct flb_stats *stats)
+/* The segment is removed, a stale file would look like a stalled writer */
+void flb_stats_segment_destroy(struct flb_stats *stats)
 {
-    int ret;
-    struct flb_stats_userver_c *client;
-    struct flb_stats_userver *userver = stats->userver;
-
-    /* Allocate connection node */
-    client = flb_calloc(1, sizeof(struct flb_stats_userver_c));
-    if (!client) {
-        return -1;
+    munmap(stats->header, stats->size);
+    close(stats->fd);
+    if (stats->path) {
+        unlink(stats->path);
+        flb_free(stats->path);
     }
-    client->fd = fd;
-    mk_list_add(&client->_head, &userver->clients);
-
-    /*
-     * Register the events into the event loop, we only want to know
-     * when it disconnects to release resources.
-     */
-    ret = mk_event_add(stats->evl,
-                       client->fd,
-                       FLB_STATS_USERVER_C,
-                       0,
-                       client);
-    if (ret == -1) {
-        mk_list_del(&client->_head);
-        flb_free(client);
-        return -1;
-    }
-
-    return 0;
-}
-
-static void stats_userver_remove(struct flb_stats_userver_c *uc,
-                                 struct flb_stats *stats)
-{
-    /* Unregister and release resources */
-    mk_event_del(stats->evl, &uc->event);
-    close(uc->fd);
-    mk_list_del(&uc->_head);
-    flb_free(uc);
+    flb_free(stats);
 }
 
-static int flb_stats_userver_deliver(struct flb_stats *stats)
+/* Single writer: the sequence is odd while the values are updated */
+void flb_stats_entry_write(struct flb_stats_entry *entry, uint64_t *values,
+                           int n, uint64_t now)
 {
     int i;
-    int len;
-    char *raw;
-    struct mk_list *head;
-    struct flb_stats_userver *userver = stats->userver;
-    struct flb_stats_userver_c *client;
-    struct flb_stats_in_plugin *in;
-    struct flb_stats_out_plugin *out;
-    struct flb_stats_datapoint *dp;
-
-    json_t *j_root;
-    json_t *j_inp;
-    json_t *j_outp;
-
-    /* Collect statistics */
-    j_root = json_create_object();
-    if (!j_root) {
-        return -1;
-    }
-
-    /* Input plugins */
-    j_inp = json_create_object();
-    mk_list_foreach(head, &stats->in_plugins) {
-        in = mk_list_entry(head, struct flb_stats_in_plugin, _head);
-
-        json_t *j_bytes = json_create_object();
-        json_t *j_datap = json_create_array();
-
-        json_add_to_object(j_bytes, "data", j_datap);
-
-        /* Go around each data point */
-        for (i = 0; i < in->n_data; i++) {
-            json_t *j_dp;
-
-            dp = &in->data[i];
-
-            j_dp = json_create_object();
-            json_add_to_object(j_dp, "time",   json_create_number(dp->time));
-            json_add_to_object(j_dp, "bytes",  json_create_number(dp->bytes));
-            json_add_to_object(j_dp, "events", json_create_number(dp->events));
-
-            json_add_to_array(j_datap, j_dp);
-        }
-
-        json_add_to_object(j_inp, in->plugin->name, j_bytes);
-    }
-    json_add_to_object(j_root, "input_plugins", j_inp);
-
-    /* Output plugins */
-    j_outp = json_create_object();
-    mk_list_foreach(head, &stats->out_plugins) {
-        out = mk_list_entry(head, struct flb_stats_out_plugin, _head);
-
-        json_t *j_bytes = json_create_object();
-        json_t *j_datap = json_create_array();
-
-        json_add_to_object(j_bytes, "data", j_datap);
-
-        /* Go around each data point */
-        for (i = 0; i < out->n_data; i++) {
-            json_t *j_dp;
-
-            dp = &out->data[i];
+    uint32_t seq;
 
-            j_dp = json_create_object();
-            json_add_to_object(j_dp, "time",   json_create_number(dp->time));
-            json_add_to_object(j_dp, "bytes",  json_create_number(dp->bytes));
-            json_add_to_object(j_dp, "events", json_create_number(dp->events));
+    seq = entry->seq;
+    __atomic_store_n(&entry->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
 
-            json_add_to_array(j_datap, j_dp);
-        }
-
-        json_add_to_object(j_outp, out->plugin->name, j_bytes);
-    }
-
-    json_add_to_object(j_root, "output_plugins", j_outp);
-    raw = json_print_unformatted(j_root);
-    flb_debug("[stats] dump\n%s", raw);
-
-    /* Deliver data */
-    len = strlen(raw);
-    mk_list_foreach(head, &userver->clients) {
-        client = mk_list_entry(head, struct flb_stats_userver_c, _head);
-        write(client->fd, raw, len);
+    for (i = 0; i < n; i++) {
+        __atomic_store_n(&entry->values[i], values[i], __ATOMIC_RELAXED);
     }
+    __atomic_store_n(&entry->update_time, now, __ATOMIC_RELAXED);
 
-    json_delete(j_root);
-    flb_free(raw);
-
-    return 0;
+    __atomic_store_n(&entry->seq, seq + 2, __ATOMIC_RELEASE);
 }
 
-/* Create and register unix socket server */
-static int flb_stats_userver(struct flb_stats *stats)
+static void entry_init(struct flb_stats_entry *entry, int type, char *name,
+                       int n_values)
 {
-    int fd;
-    int ret;
-    struct mk_event *event;
-    struct flb_stats_userver *userver;
-
-    /* Create a TCP server based on unix sockets */
-    userver = flb_malloc(sizeof(struct flb_stats_userver));
-    if (!userver) {
-        flb_error("[stats_usrv] no mem!");
-        return -1;
-    }
-
-    fd = stats_unix_server(FLB_STATS_USERVER_PATH);
-    if (fd == -1) {
-        flb_error("[stats_usrv] could not create unix server");
-        flb_free(userver);
-        return -1;
-    }
-
-    mk_list_init(&userver->clients);
-    userver->fd = fd;
-    event = &userver->event;
-    event->fd     = fd;
-    event->mask   = MK_EVENT_EMPTY;
-    event->status = MK_EVENT_NONE;
-    ret = mk_event_add(stats->evl,
-                       userver->fd,
-                       FLB_STATS_USERVER,
-                       MK_EVENT_READ,
-                       userver);
-    if (ret == -1) {
-        flb_error("[stats_usrv] could not registrate userver fd");
-        return -1;
-    }
-
-    stats->userver = userver;
-    return 0;
+    entry->type = type;
+    entry->n_values = n_values;
+    strncpy(entry->name, name, sizeof(entry->name) - 1);
 }
 
-static void stats_worker_exit(struct flb_stats *stats)
+static void entry_publish(struct flb_stats_entry *entry,
+                          struct flb_metrics *metrics,
+                          int *ids, int n, uint64_t now)
 {
-    struct flb_stats_userver *u;
-
-    /* Unix Server */
-    u = stats->userver;
-
-    /* Remove and close unix socket */
-    mk_event_del(stats->evl, &u->event);
-    close(u->fd);
-
-    /* Release the timer */
-    mk_event_del(stats->evl, &u->timer->event);
-    close(u->timer->fd);
-    flb_free(u->timer);
-
-    flb_free(u);
-}
-
-static void stats_worker_init(void *data)
-{
-    int fd;
-    int ret;
-    struct mk_event *event;
-    struct flb_stats *stats = (struct flb_stats *) data;
-
-    /* Initialize the unix socket server */
-    flb_stats_userver(stats);
-    stats_userver_timer(stats);
-
-    while (1) {
-        mk_event_wait(stats->evl);
-        mk_event_foreach(event, stats->evl) {
-            if (event->type == FLB_STATS_INPUT_PLUGIN) {
-                handle_input_plugin(event);
-            }
-            else if (event->type == FLB_STATS_OUTPUT_PLUGIN) {
-                handle_output_plugin(event);
-            }
-            else if (event->type == FLB_STATS_USERVER) {
-                /* userver connection arrived */
-                fd = stats_userver_accept(stats);
-                if (fd) {
-                    ret = stats_userver_add(fd, stats);
-                    if (ret == -1) {
-                        close(fd);
-                    }
-                }
-            }
-            else if (event->type == FLB_STATS_USERVER_C) {
-                /* userver client disconnected */
-                stats_userver_remove((struct flb_stats_userver_c *) event,
-                                     stats);
-            }
-            else if (event->fd == stats->ch_manager[1]) {
-                /*
-                 * Once we get a signal on the manager channel, we start
-                 * our shutdown procedure and return (pthread exit).
-                 */
-                consume_byte(event->fd);
-                stats_worker_exit(stats);
-                return;
-            }
-            else if (event->type == MK_EVENT_NOTIFICATION) {
-                /*
-                 * The only notification that we have registered is to
-                 * collect the statistic and write them to the userver
-                 * clients.
-                 */
-                consume_byte(event->fd);
-                flb_stats_userver_deliver(stats);
+    int i;
+    uint64_t values[FLB_STATS_VALUES] = {0};
+    struct flb_metric *m;
+
+    if (metrics) {
+        for (i = 0; i < n; i++) {
+            m = flb_metrics_get_id(ids[i], metrics);
+            if (m) {
+                values[i] = flb_metric_value(m);
             }
         }
     }
+    flb_stats_entry_write(entry, values, n, now);
 }
 
-static int register_input_plugin(struct flb_input_plugin *plugin,
-                                 struct flb_stats *stats)
+/* Copy the counters of every instance into the segment */
+int flb_stats_collect(struct flb_config *config)
 {
-    int ret;
-    struct flb_stats_in_plugin *sp;
+    int i = 0;
+    uint64_t now;
+    struct mk_list *head;
+    struct flb_stats *stats = config->stats_ctx;
+    struct flb_input_instance *in;
+    struct flb_filter_instance *f;
+    struct flb_output_instance *out;
 
-    /* Allocate stats object for this stats entry */
-    sp = flb_malloc(sizeof(struct flb_stats_in_plugin));
-    if (!sp) {
+    if (!stats) {
         return -1;
     }
 
-    /* Create the communication channel (plugin ---> stats worker) */
-    ret = flb_pipe_create(sp->pipe);
-    if (ret == -1) {
-        flb_error("[stats reg] could not create pipe");
-        flb_free(sp);
-        return -1;
+    now = time(NULL);
+    mk_list_foreach(head, &config->inputs) {
+        in = mk_list_entry(head, struct flb_input_instance, _head);
+        entry_publish(&stats->entries[i++], in->metrics,
+                      in_metrics, N_METRICS(in_metrics), now);
     }
-
-    sp->event.fd     = sp->pipe[0];
-    sp->event.mask   = MK_EVENT_EMPTY;
-    sp->event.status = MK_EVENT_NONE;
-    ret = mk_event_add(stats->evl,
-                       sp->pipe[0],
-                       FLB_STATS_INPUT_PLUGIN,
-                       MK_EVENT_READ,
-                       sp);
-    if (ret == -1) {
-        flb_pipe_destroy(sp->pipe);
-        flb_free(sp);
-        return -1;
+    mk_list_foreach(head, &config->filters) {
+        f = mk_list_entry(head, struct flb_filter_instance, _head);
+        entry_publish(&stats->entries[i++], f->metrics,
+                      filter_metrics, N_METRICS(filter_metrics), now);
     }
-    plugin->stats_fd = sp->pipe[1];
-    sp->plugin = plugin;
-    sp->n_data = -1;
-
-    /* Register the entry into the stats input plugins list */
-    mk_list_add(&sp->_head, &stats->in_plugins);
-
-    flb_debug("[stats] register in plugin: %s",
-              plugin->name);
-    return 0;
-}
-
-static int register_output_plugin(struct flb_output_plugin *plugin,
-                                  struct flb_stats *stats)
-{
-    int ret;
-    struct flb_stats_out_plugin *sp;
-
-    /* Allocate stats object for this stats entry */
-    sp = flb_malloc(sizeof(struct flb_stats_out_plugin));
-    if (!sp) {
-        return -1;
+    mk_list_foreach(head, &config->outputs) {
+        out = mk_list_entry(head, struct flb_output_instance, _head);
+        entry_publish(&stats->entries[i++], out->metrics,
+                      out_metrics, N_METRICS(out_metrics), now);
     }
+    __atomic_store_n(&stats->header->update_time, now, __ATOMIC_RELEASE);
 
-    /* Create the communication channel (plugin ---> stats worker) */
-    ret = flb_pipe_create(sp->pipe);
-    if (ret == -1) {
-        flb_error("[stats reg] could not create pipe");
-        flb_free(sp);
-        return -1;
-    }
-
-    sp->event.fd     = sp->pipe[0];
-    sp->event.mask   = MK_EVENT_EMPTY;
-    sp->event.status = MK_EVENT_NONE;
-    ret = mk_event_add(stats->evl,
-                       sp->pipe[0],
-                       FLB_STATS_OUTPUT_PLUGIN,
-                       MK_EVENT_READ,
-                       sp);
-    if (ret == -1) {
-        flb_pipe_destroy(sp->pipe);
-        flb_free(sp);
-        return -1;
-    }
-
-    plugin->stats_fd = sp->pipe[1];
-    sp->plugin = plugin;
-    sp->n_data = -1;
-
-    /* Register the entry into the stats input plugins list */
-    mk_list_add(&sp->_head, &stats->out_plugins);
-
-    flb_debug("[stats] register out plugin: %s",
-              plugin->name);
     return 0;
 }
 
 /*
- * For each component inside Fluent Bit, create a statistic
- * entry into our stats handler.
+ * Create the segment with one entry per instance, the instances don't
+ * change once the engine is running. The engine publishes every second.
  */
-static int flb_stats_components_init(struct flb_stats *stats)
+int flb_stats_init(struct flb_config *config)
 {
+    int n;
+    int i = 0;
     struct mk_list *head;
-    struct flb_input_plugin *in;
-    struct flb_output_plugin *out;
-
-    /* Initialize list headers */
-    mk_list_init(&stats->in_plugins);
-    mk_list_init(&stats->out_plugins);
-
-    /* Register input plugins */
-    mk_list_foreach(head, &stats->config->inputs) {
-        in = mk_list_entry(head, struct flb_input_plugin, _head);
-        register_input_plugin(in, stats);
-    }
+    struct mk_event *event;
+    struct flb_stats *stats;
+    struct flb_input_instance *in;
+    struct flb_filter_instance *f;
+    struct flb_output_instance *out;
 
-    /* Register output plugins */
-    mk_list_foreach(head, &stats->config->outputs) {
-        out = mk_list_entry(head, struct flb_output_plugin, _head);
-        register_output_plugin(out, stats);
+    if (!config->stats_path) {
+        return 0;
     }
 
-    return 0;
-}
-
-/*
- * Initialize the worker thread and statistics plugins across the
- * core and input/output plugins.
- */
-int flb_stats_init(struct flb_config *config)
-{
-    int ret;
-    struct flb_stats *stats;
-
-    stats = flb_malloc(sizeof(struct flb_stats));
+    n = mk_list_size(&config->inputs) + mk_list_size(&config->filters) +
+        mk_list_size(&config->outputs);
+    stats = flb_stats_segment_create(config->stats_path, n);
     if (!stats) {
-        flb_error("[stats] could not initialize");
         return -1;
     }
-    config->stats_ctx = stats;
 
-    /* Create the event loop */
-    stats->config = config;
-    stats->evl = mk_event_loop_create(64);
-    if (!stats->evl) {
-        flb_error("[stats] could not initialize event loop");
-        flb_free(stats);
-        return -1;
+    mk_list_foreach(head, &config->inputs) {
+        in = mk_list_entry(head, struct flb_input_instance, _head);
+        entry_init(&stats->entries[i++], FLB_STATS_INPUT, in->name,
+                   N_METRICS(in_metrics));
+    }
+    mk_list_foreach(head, &config->filters) {
+        f = mk_list_entry(head, struct flb_filter_instance, _head);
+        entry_init(&stats->entries[i++], FLB_STATS_FILTER, f->name,
+                   N_METRICS(filter_metrics));
+    }
+    mk_list_foreach(head, &config->outputs) {
+        out = mk_list_entry(head, struct flb_output_instance, _head);
+        entry_init(&stats->entries[i++], FLB_STATS_OUTPUT, out->name,
+                   N_METRICS(out_metrics));
     }
 
-    /* Register components into the stats interface */
-    flb_stats_components_init(stats);
-
-    /* Channel manager */
-    ret = mk_event_channel_create(stats->evl,
-                                  &stats->ch_manager[0],
-                                  &stats->ch_manager[1],
-                                  stats);
-    if (ret != 0) {
-        flb_error("[stats] could not create manager channels");
-        flb_free(stats);
+    event = &config->stats_event;
+    event->mask = MK_EVENT_EMPTY;
+    event->status = MK_EVENT_NONE;
+    stats->timer_fd = mk_event_timeout_create(config->evl, 1, 0, event);
+    if (stats->timer_fd == -1) {
+        flb_error("[stats] could not create the publish timer");
+        flb_stats_segment_destroy(stats);
         return -1;
     }
+    config->stats_ctx = stats;
+    flb_stats_collect(config);
 
-    /* Spawn a worker thread*/
-    stats->worker_tid = mk_utils_worker_spawn(stats_worker_init, stats);
-
+    flb_info("[stats] publishing %i entries in %s", n, config->stats_path);
     return 0;
 }
 
 int flb_stats_exit(struct flb_config *config)
 {
-    uint64_t val = 1;
-    struct mk_list *tmp;
-    struct mk_list *head;
-    struct flb_stats *ctx;
-    struct flb_stats_in_plugin *s_in;
-    struct flb_stats_out_plugin *s_out;
-
-    ctx = config->stats_ctx;
-
-    /* Shutdown the userver thread */
-    write(ctx->ch_manager[1], &val, sizeof(uint64_t));
-
-    /* Release components / Input plugins */
-    mk_list_foreach_safe(head, tmp, &ctx->in_plugins) {
-        s_in = mk_list_entry(head, struct flb_stats_in_plugin, _head);
-        mk_event_del(ctx->evl, &s_in->event);
-        flb_pipe_destroy(s_in);
-        mk_list_del(&s_in->_head);
-        flb_free(s_in);
-    }
+    struct flb_stats *stats = config->stats_ctx;
 
-    /* Release components / Output plugins */
-    mk_list_foreach_safe(head, tmp, &ctx->out_plugins) {
-        s_out = mk_list_entry(head, struct flb_stats_out_plugin, _head);
-        mk_event_del(ctx->evl, &s_out->event);
-        flb_pipe_destroy(s_out->pipe);
-        mk_list_del(&s_out->_head);
-        flb_free(s_out);
+    if (!stats) {
+        return 0;
     }
 
-    pthread_join(ctx->worker_tid, NULL);
-
-    mk_event_loop_destroy(ctx->evl);
+    if (stats->timer_fd != -1) {
+        mk_event_timeout_destroy(config->evl, &config->stats_event);
+        close(stats->timer_fd);
+    }
+    flb_stats_segment_destroy(stats);
     config->stats_ctx = NULL;
-    flb_free(ctx);
 
     return 0;
 }
@@ -0,0 +1,242 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+
+#include <monkey/mk_core.h>
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_log.h>
+#include <fluent-bit/flb_config.h>
+#include <fluent-bit/flb_router.h>
+#include <fluent-bit/flb_tag.h>
+
+#include <string.h>
+
+/* FNV-1a */
+static uint32_t tag_hash(const char *name, int len)
+{
+    int i;
+    uint32_t h = 2166136261u;
+
+    for (i = 0; i < len; i++) {
+        h ^= (unsigned char) name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static struct mk_list *buckets_create(int size)
+{
+    int i;
+    struct mk_list *buckets;
+
+    buckets = flb_malloc(sizeof(struct mk_list) * size);
+    if (!buckets) {
+        flb_errno();
+        return NULL;
+    }
+    for (i = 0; i < size; i++) {
+        mk_list_init(&buckets[i]);
+    }
+    return buckets;
+}
+
+/* Double the buckets, the tags are moved and keep their address */
+static void table_grow(struct flb_tag_table *table)
+{
+    int i;
+    int size;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_list *buckets;
+    struct flb_tag *tag;
+
+    size = table->size * 2;
+    buckets = buckets_create(size);
+    if (!buckets) {
+        /* longer chains, but still usable */
+        return;
+    }
+
+    for (i = 0; i < table->size; i++) {
+        mk_list_foreach_safe(head, tmp, &table->buckets[i]) {
+            tag = mk_list_entry(head, struct flb_tag, _head);
+            mk_list_del(&tag->_head);
+            mk_list_add(&tag->_head, &buckets[tag->hash & (size - 1)]);
+        }
+    }
+
+    flb_free(table->buckets);
+    table->buckets = buckets;
+    table->size = size;
+}
+
+int flb_tag_table_create(struct flb_config *config)
+{
+    struct flb_tag_table *table;
+
+    table = flb_calloc(1, sizeof(struct flb_tag_table));
+    if (!table) {
+        flb_errno();
+        return -1;
+    }
+
+    table->size = FLB_TAG_TABLE_SIZE;
+    table->buckets = buckets_create(table->size);
+    if (!table->buckets) {
+        flb_free(table);
+        return -1;
+    }
+
+    config->tags = table;
+    return 0;
+}
+
+void flb_tag_table_destroy(struct flb_config *config)
+{
+    int i;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct flb_tag *tag;
+    struct flb_tag_table *table = config->tags;
+
+    if (!table) {
+        return;
+    }
+
+    for (i = 0; i < table->size; i++) {
+        mk_list_foreach_safe(head, tmp, &table->buckets[i]) {
+            tag = mk_list_entry(head, struct flb_tag, _head);
+            mk_list_del(&tag->_head);
+            flb_free(tag);
+        }
+    }
+
+    flb_free(table->buckets);
+    flb_free(table);
+    config->tags = NULL;
+}
+
+static struct flb_tag *tag_find(struct flb_tag_table *table,
+                                const char *name, int len, uint32_t hash)
+{
+    struct mk_list *head;
+    struct flb_tag *tag;
+
+    mk_list_foreach(head, &table->buckets[hash & (table->size - 1)]) {
+        tag = mk_list_entry(head, struct flb_tag, _head);
+        if (tag->hash == hash && tag->len == len &&
+            memcmp(tag->name, name, len) == 0) {
+            return tag;
+        }
+    }
+    return NULL;
+}
+
+/* Find an interned tag, no reference is taken */
+struct flb_tag *flb_tag_lookup(struct flb_config *config,
+                               const char *name, int len)
+{
+    if (!config->tags || len <= 0) {
+        return NULL;
+    }
+    return tag_find(config->tags, name, len, tag_hash(name, len));
+}
+
+/* Get a reference to the interned tag, it's added on the first use */
+struct flb_tag *flb_tag_get(struct flb_config *config,
+                            const char *name, int len)
+{
+    uint32_t hash;
+    struct flb_tag *tag;
+    struct flb_tag_table *table = config->tags;
+
+    if (!table || len <= 0) {
+        return NULL;
+    }
+
+    hash = tag_hash(name, len);
+    tag = tag_find(table, name, len, hash);
+    if (tag) {
+        tag->refs++;
+        return tag;
+    }
+
+    tag = flb_malloc(sizeof(struct flb_tag) + len + 1);
+    if (!tag) {
+        flb_errno();
+        return NULL;
+    }
+    tag->len = len;
+    tag->refs = 1;
+    tag->hash = hash;
+    tag->routes_gen = -1;
+    tag->routes_mask = 0;
+    mk_list_init(&tag->dyntags);
+    memcpy(tag->name, name, len);
+    tag->name[len] = '\0';
+
+    if (table->count >= table->size * 2) {
+        table_grow(table);
+    }
+    mk_list_add(&tag->_head, &table->buckets[hash & (table->size - 1)]);
+    table->count++;
+
+    return tag;
+}
+
+/* Drop a reference, the tag is removed once nobody uses it */
+void flb_tag_release(struct flb_config *config, struct flb_tag *tag)
+{
+    if (!tag) {
+        return;
+    }
+
+    tag->refs--;
+    if (tag->refs > 0) {
+        return;
+    }
+
+    mk_list_del(&tag->_head);
+    config->tags->count--;
+    flb_free(tag);
+}
+
+/*
+ * Get the outputs routes of a tag. The mask is kept in the tag until the
+ * router cache is invalidated. It returns -1 if the routes could not be
+ * resolved, the caller must fallback to flb_router_match().
+ */
+int flb_tag_routes(struct flb_config *config, struct flb_tag *tag,
+                   uint64_t *mask)
+{
+    struct flb_router_cache_entry *cache;
+
+    if (tag->routes_gen != config->router_gen) {
+        cache = flb_router_cache_get(tag->name, tag->len, config);
+        if (!cache) {
+            return -1;
+        }
+        tag->routes_mask = cache->routes_mask;
+        tag->routes_gen = config->router_gen;
+    }
+
+    *mask = tag->routes_mask;
+    return 0;
+}
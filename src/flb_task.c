@@ -19,6 +19,8 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
 
 #include <fluent-bit/flb_info.h>
 #include <fluent-bit/flb_config.h>
@@ -26,48 +28,209 @@
 #include <fluent-bit/flb_output.h>
 #include <fluent-bit/flb_router.h>
 #include <fluent-bit/flb_task.h>
+#include <fluent-bit/flb_tag.h>
+#include <fluent-bit/flb_probes.h>
 #include <fluent-bit/flb_mem.h>
 #include <fluent-bit/flb_str.h>
 #include <fluent-bit/flb_scheduler.h>
+#include <fluent-bit/flb_sp.h>
 
 #ifdef FLB_HAVE_BUFFERING
-#include <fluent-bit/flb_sha1.h>
+#include <sys/mman.h>
 #include <fluent-bit/flb_buffer_chunk.h>
 #include <fluent-bit/flb_buffer_qchunk.h>
 #endif
 
 /*
- * Every task created must have an unique ID, this function lookup the
- * lowest number available in the tasks_map.
+ * Every task created must have an unique ID, the lowest one available in
+ * the tasks map is taken. The IDs in use are kept in a bitmap, a free one
+ * is found with a find-first-zero on the first word that is not full
+ * ('tasks_map_hint', every word before it is full).
  *
  * This 'id' is used by the task interface to communicate with the engine event
  * loop about some action.
  */
 
+/* Tasks map limit: 'Tasks_Max', within the bits of a task ID */
+int flb_task_map_limit(struct flb_config *config)
+{
+    if (config->tasks_max <= 0 || config->tasks_max > FLB_TASK_MAP_LIMIT) {
+        return FLB_TASK_MAP_LIMIT;
+    }
+    return config->tasks_max;
+}
+
+/* Double the size of the map, up to its limit */
+static int map_grow(struct flb_config *config)
+{
+    int size;
+    int limit;
+    int words;
+    int old_words;
+    uint64_t *bitmap;
+    struct flb_task_map *map;
+
+    limit = flb_task_map_limit(config);
+    if (config->tasks_map_size >= limit) {
+        return -1;
+    }
+
+    size = config->tasks_map_size * 2;
+    if (size < FLB_TASK_MAP_INITIAL) {
+        size = FLB_TASK_MAP_INITIAL;
+    }
+    if (size > limit) {
+        size = limit;
+    }
+
+    map = flb_realloc(config->tasks_map, size * sizeof(struct flb_task_map));
+    if (!map) {
+        flb_errno();
+        return -1;
+    }
+    memset(map + config->tasks_map_size, '\0',
+           (size - config->tasks_map_size) * sizeof(struct flb_task_map));
+    config->tasks_map = map;
+
+    old_words = (config->tasks_map_size + 63) / 64;
+    words = (size + 63) / 64;
+    bitmap = flb_realloc(config->tasks_bitmap, words * sizeof(uint64_t));
+    if (!bitmap) {
+        flb_errno();
+        return -1;
+    }
+    memset(bitmap + old_words, '\0', (words - old_words) * sizeof(uint64_t));
+    config->tasks_bitmap = bitmap;
+
+    if (config->tasks_map_size > 0) {
+        flb_info("[task] tasks map grown to %i entries", size);
+    }
+    config->tasks_map_size = size;
+
+    return 0;
+}
+
 static inline int map_get_task_id(struct flb_config *config)
 {
     int i;
-    int map_size = (sizeof(config->tasks_map) / sizeof(struct flb_task_map));
+    int id;
+    int words;
+    uint64_t w;
+
+    words = (config->tasks_map_size + 63) / 64;
+    for (i = config->tasks_map_hint; i < words; i++) {
+        w = config->tasks_bitmap[i];
+        if (w == UINT64_MAX) {
+            continue;
+        }
 
-    for (i = 0; i < map_size; i++) {
-        if (config->tasks_map[i].task == NULL) {
-            return i;
+        /* Bits over the map size are zero: if it's the first, it's full */
+        id = (i * 64) + __builtin_ctzll(~w);
+        if (id >= config->tasks_map_size) {
+            break;
         }
+        config->tasks_map_hint = i;
+        return id;
     }
+    config->tasks_map_hint = (i < words) ? i : words;
 
-    return -1;
+    if (map_grow(config) == -1) {
+        return -1;
+    }
+    return map_get_task_id(config);
 }
 
 static inline void map_set_task_id(int id, struct flb_task *task,
                                    struct flb_config *config)
 {
+    config->tasks_bitmap[id / 64] |= (1ULL << (id % 64));
     config->tasks_map[id].task = task;
-
+    __atomic_add_fetch(&config->tasks_count, 1, __ATOMIC_RELAXED);
 }
 
 static inline void map_free_task_id(int id, struct flb_config *config)
 {
+    config->tasks_bitmap[id / 64] &= ~(1ULL << (id % 64));
+    if (id / 64 < config->tasks_map_hint) {
+        config->tasks_map_hint = id / 64;
+    }
     config->tasks_map[id].task = NULL;
+    __atomic_sub_fetch(&config->tasks_count, 1, __ATOMIC_RELAXED);
+}
+
+void flb_task_map_destroy(struct flb_config *config)
+{
+    flb_free(config->tasks_map);
+    flb_free(config->tasks_bitmap);
+    config->tasks_map = NULL;
+    config->tasks_bitmap = NULL;
+    config->tasks_map_size = 0;
+    config->tasks_map_hint = 0;
+}
+
+/*
+ * Tasks, routes, retries and output co-routines are created and released
+ * for every chunk, they come from slab caches owned by the engine thread.
+ * The first pages are sized by the initial tasks map, the caches grow with
+ * the number of tasks in flight and of outputs.
+ */
+int flb_task_slabs_create(struct flb_config *config)
+{
+    int map_size = FLB_TASK_MAP_INITIAL;
+
+    config->task_slab = flb_slab_create("task", sizeof(struct flb_task),
+                                        map_size / 2, 0);
+    config->route_slab = flb_slab_create("route",
+                                         sizeof(struct flb_task_route),
+                                         map_size, 0);
+    config->retry_slab = flb_slab_create("retry",
+                                         sizeof(struct flb_task_retry),
+                                         map_size / 4, 0);
+    config->thread_slab = flb_slab_create("output thread",
+                                          sizeof(struct flb_thread) +
+                                          sizeof(struct flb_output_thread),
+                                          map_size / 2, 0);
+    if (!config->task_slab || !config->route_slab ||
+        !config->retry_slab || !config->thread_slab) {
+        flb_task_slabs_destroy(config);
+        return -1;
+    }
+
+    return 0;
+}
+
+void flb_task_slabs_destroy(struct flb_config *config)
+{
+    flb_slab_destroy(config->task_slab);
+    flb_slab_destroy(config->route_slab);
+    flb_slab_destroy(config->retry_slab);
+    flb_slab_destroy(config->thread_slab);
+    config->task_slab = NULL;
+    config->route_slab = NULL;
+    config->retry_slab = NULL;
+    config->thread_slab = NULL;
+}
+
+static struct flb_task_route *task_route_add(struct flb_task *task,
+                                             struct flb_output_instance *o_ins)
+{
+    struct flb_task_route *route;
+
+    route = flb_slab_alloc(task->config->route_slab);
+    if (!route) {
+        flb_errno();
+        return NULL;
+    }
+
+    route->out = o_ins;
+    route->task = task;
+    route->pending = FLB_FALSE;
+    route->backlog = FLB_FALSE;
+    route->queued  = FLB_FALSE;
+    route->coalesced = FLB_FALSE;
+    mk_list_add(&route->_head, &task->routes);
+
+    return route;
 }
 
 void flb_task_retry_destroy(struct flb_task_retry *retry)
@@ -81,8 +244,15 @@ void flb_task_retry_destroy(struct flb_task_retry *retry)
                   retry);
     }
 
+    /* It may be waiting in the output backlog */
+    if (retry->backlog == FLB_TRUE) {
+        mk_list_del(&retry->_head_backlog);
+    }
+
     mk_list_del(&retry->_head);
-    flb_free(retry);
+    __atomic_sub_fetch(&retry->parent->config->retries_pending, 1,
+                       __ATOMIC_RELAXED);
+    flb_slab_free(retry->parent->config->retry_slab, retry);
 }
 
 struct flb_task_retry *flb_task_retry_create(struct flb_task *task,
@@ -114,16 +284,19 @@ struct flb_task_retry *flb_task_retry_create(struct flb_task *task,
 
     if (!retry) {
         /* Create a new re-try instance */
-        retry = flb_malloc(sizeof(struct flb_task_retry));
+        retry = flb_slab_alloc(task->config->retry_slab);
         if (!retry) {
-            perror("malloc");
+            flb_errno();
             return NULL;
         }
 
         retry->attemps = 1;
         retry->o_ins   = o_ins;
         retry->parent  = task;
+        retry->backlog = FLB_FALSE;
         mk_list_add(&retry->_head, &task->retries);
+        __atomic_add_fetch(&task->config->retries_pending, 1,
+                           __ATOMIC_RELAXED);
 
         flb_debug("[retry] new retry created for task_id=%i attemps=%i",
                   out_th->task->id, retry->attemps);
@@ -161,25 +334,84 @@ int flb_task_retry_clean(struct flb_task *task, void *data)
     return -1;
 }
 
+/*
+ * Restore the retry state of the task routes (it comes from a buffered
+ * chunk): every route with a state is not flushed right away, a retry with
+ * the saved attemps is scheduled instead.
+ */
+int flb_task_retry_restore(struct flb_task *task,
+                           struct flb_task_retry_state *states, int n)
+{
+    int i;
+    int c = 0;
+    int ret;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct flb_task_route *route;
+    struct flb_task_retry *retry;
+
+    for (i = 0; i < n; i++) {
+        mk_list_foreach_safe(head, tmp, &task->routes) {
+            route = mk_list_entry(head, struct flb_task_route, _head);
+            if (route->out->mask_id != states[i].mask_id) {
+                continue;
+            }
+
+            retry = flb_slab_alloc(task->config->retry_slab);
+            if (!retry) {
+                flb_errno();
+                break;
+            }
+            retry->attemps = states[i].attemps;
+            retry->o_ins   = route->out;
+            retry->parent  = task;
+            retry->backlog = FLB_FALSE;
+            mk_list_add(&retry->_head, &task->retries);
+
+            ret = flb_sched_request_restore(task->config, retry,
+                                            retry->attemps,
+                                            states[i].retry_at);
+            if (ret == -1) {
+                mk_list_del(&retry->_head);
+                flb_slab_free(task->config->retry_slab, retry);
+                break;
+            }
+
+            flb_debug("[retry] restored retry for task_id=%i attemps=%i "
+                      "in %i seconds", task->id, retry->attemps, ret);
+
+            /* The retry takes care of the route */
+            mk_list_del(&route->_head);
+            flb_slab_free(task->config->route_slab, route);
+            c++;
+            break;
+        }
+    }
+
+    return c;
+}
+
 /* Allocate an initialize a basic Task structure */
 static struct flb_task *task_alloc(struct flb_config *config)
 {
     int task_id;
     struct flb_task *task;
 
-    /* Allocate the new task */
-    task = (struct flb_task *) flb_calloc(1, sizeof(struct flb_task));
-    if (!task) {
-        flb_errno();
+    /* Get ID */
+    task_id = map_get_task_id(config);
+    if (task_id == -1) {
+        flb_warn("[task] no more task slots, %i tasks in flight (Tasks_Max)",
+                 config->tasks_map_size);
         return NULL;
     }
 
-    /* Get ID and set back 'task' reference */
-    task_id = map_get_task_id(config);
-    if (task_id == -1) {
-        flb_free(task);
+    /* Allocate the new task */
+    task = flb_slab_alloc(config->task_slab);
+    if (!task) {
+        flb_errno();
         return NULL;
     }
+    memset(task, '\0', sizeof(struct flb_task));
     map_set_task_id(task_id, task, config);
 
     flb_trace("[task %p] created (id=%i)", task, task_id);
@@ -191,10 +423,23 @@ static struct flb_task *task_alloc(struct flb_config *config)
     task->status    = FLB_TASK_NEW;
     task->n_threads = 0;
     task->users     = 0;
+    task->mem_size  = 0;
+#ifdef FLB_HAVE_BUFFERING
+    task->chunk_mapped = FLB_FALSE;
+#endif
+#ifdef FLB_HAVE_METRICS
+    task->created   = flb_metrics_clock();
+    if (config->task_traces) {
+        task->trace = flb_task_trace_start(config->task_traces);
+    }
+#endif
     mk_list_init(&task->threads);
     mk_list_init(&task->routes);
     mk_list_init(&task->retries);
 
+    /* Records of the buffer are unknown until an index is given */
+    flb_chunk_index_invalidate(&task->index);
+
     return task;
 }
 
@@ -208,7 +453,11 @@ struct flb_task *flb_task_create(uint64_t ref_id,
                                  struct flb_config *config)
 {
     int count = 0;
+    int match;
+    int cached;
+    uint64_t tag_routes;
     uint64_t routes_mask = 0;
+    struct flb_tag *itag;
     struct flb_task *task;
     struct flb_task_route *route;
     struct flb_output_instance *o_ins;
@@ -216,14 +465,28 @@ struct flb_task *flb_task_create(uint64_t ref_id,
     struct mk_list *head;
     struct mk_list *o_head;
 
+    /* The task shares the interned tag with its dyntag */
+    if (dt) {
+        itag = flb_tag_ref(dt->itag);
+    }
+    else {
+        itag = flb_tag_get(config, tag, strlen(tag));
+        if (!itag) {
+            return NULL;
+        }
+    }
+
     task = task_alloc(config);
     if (!task) {
+        flb_tag_release(config, itag);
         return NULL;
     }
 
     /* Keep track of origins */
     task->ref_id = ref_id;
-    task->tag    = flb_strdup(tag);
+    task->itag   = itag;
+    task->tag    = itag->name;
+    task->tag_len = task->itag->len;
     task->buf    = buf;
     task->size   = size;
     task->i_ins  = i_ins;
@@ -231,6 +494,28 @@ struct flb_task *flb_task_create(uint64_t ref_id,
     task->destinations = 0;
     mk_list_add(&task->_head, &i_ins->tasks);
 
+    /* The records index built on append goes with the buffer */
+    if (dt) {
+        flb_chunk_index_move(&task->index, &dt->mp_index);
+    }
+    else {
+        flb_chunk_index_move(&task->index, &i_ins->mp_index);
+    }
+
+    /*
+     * A static buffer is owned by the task from now on, keep accounting it
+     * in the memory budget until the task is gone (dyntag buffers are still
+     * counted by the input instance).
+     */
+    if (!dt) {
+        task->mem_size = size;
+        i_ins->mp_tasks_size += size;
+        config->mem_total += size;
+        if (config->mem_total > config->mem_total_peak) {
+            config->mem_total_peak = config->mem_total;
+        }
+    }
+
     /* Routes */
     if (!dt) {
         /* A non-dynamic tag input plugin have static routes */
@@ -238,14 +523,10 @@ struct flb_task *flb_task_create(uint64_t ref_id,
             router_path = mk_list_entry(head, struct flb_router_path, _head);
             o_ins = router_path->ins;
 
-            route = flb_malloc(sizeof(struct flb_task_route));
+            route = task_route_add(task, o_ins);
             if (!route) {
-                flb_errno();
                 continue;
             }
-
-            route->out = o_ins;
-            mk_list_add(&route->_head, &task->routes);
             count++;
 
             routes_mask |= o_ins->mask_id;
@@ -253,6 +534,8 @@ struct flb_task *flb_task_create(uint64_t ref_id,
     }
     else {
         /* Find dynamic routes for the incoming tag */
+        cached = flb_tag_routes(config, task->itag, &tag_routes);
+
         mk_list_foreach(o_head, &config->outputs) {
             o_ins = mk_list_entry(o_head,
                                   struct flb_output_instance, _head);
@@ -260,15 +543,18 @@ struct flb_task *flb_task_create(uint64_t ref_id,
                 continue;
             }
 
-            if (flb_router_match(tag, o_ins->match)) {
-                route = flb_malloc(sizeof(struct flb_task_route));
+            if (cached == 0) {
+                match = (tag_routes & o_ins->mask_id);
+            }
+            else {
+                match = flb_router_match(tag, o_ins->match);
+            }
+
+            if (match) {
+                route = task_route_add(task, o_ins);
                 if (!route) {
-                    flb_errno();
                     continue;
                 }
-
-                route->out = o_ins;
-                mk_list_add(&route->_head, &task->routes);
                 count++;
 
                 /* set the routes as a mask */
@@ -279,6 +565,12 @@ struct flb_task *flb_task_create(uint64_t ref_id,
 
     /* no destinations ?, useless task. */
     if (count == 0) {
+#ifdef FLB_HAVE_STREAM_PROCESSOR
+        /* Records no output wants can still feed the stream processor */
+        if (mk_list_is_empty(&config->stream_tasks) != 0) {
+            flb_sp_do(config, i_ins, task->tag, task->tag_len, buf, size);
+        }
+#endif
         flb_debug("[task] created task=%p id=%i without routes, dropping.",
                   task, task->id);
         task->buf = NULL;
@@ -287,8 +579,8 @@ struct flb_task *flb_task_create(uint64_t ref_id,
     }
 
 #ifdef FLB_HAVE_BUFFERING
-    int i;
     int worker_id;
+    void *map;
 
     /* If no buffering is set, return right away */
     if (!config->buffer_ctx) {
@@ -296,21 +588,33 @@ struct flb_task *flb_task_create(uint64_t ref_id,
         return task;
     }
 
-    /* Generate content SHA1 and it Hexa representation */
-    flb_sha1_encode(buf, size, task->hash_sha1);
-    for (i = 0; i < 20; ++i) {
-        sprintf(&task->hash_hex[i*2], "%02x", task->hash_sha1[i]);
-    }
-    task->hash_hex[40] = '\0';
+    /* Chunk identity */
+    flb_buffer_chunk_id(buf, size, task->hash_hex);
 
     /*
      * Generate a buffer chunk push request, note that suggested routes
      * are passed through the 'routes_mask' bit mask variable.
      */
     worker_id = flb_buffer_chunk_push(config->buffer_ctx, buf, size, tag,
-                                      routes_mask, task->hash_hex);
+                                      routes_mask, task->hash_hex, &map,
+                                      &task->fs_routes);
 
     task->worker_id = worker_id;
+
+    /*
+     * The chunk file mapping replaces the task buffer, the heap copy is not
+     * longer needed (dyntag buffers are released with the dyntag).
+     */
+    if (map) {
+        if (!dt) {
+            flb_free(buf);
+            i_ins->mp_tasks_size -= task->mem_size;
+            config->mem_total -= task->mem_size;
+            task->mem_size = 0;
+        }
+        task->buf = map;
+        task->chunk_mapped = FLB_TRUE;
+    }
     flb_debug("[task->buffer] worker_id=%i", worker_id);
 #endif
 
@@ -319,6 +623,7 @@ struct flb_task *flb_task_create(uint64_t ref_id,
 #endif
 
     flb_debug("[task] created task=%p id=%i OK", task, task->id);
+    FLB_PROBE3(task_create, task->id, task->tag, task->size);
     return task;
 }
 
@@ -337,19 +642,28 @@ struct flb_task *flb_task_create_direct(uint64_t ref_id,
 {
     int count = 0;
     struct mk_list *head;
+    struct flb_tag *itag;
     struct flb_task *task;
     struct flb_task_route *route;
     struct flb_output_instance *o_ins;
 
+    itag = flb_tag_get(config, tag, strlen(tag));
+    if (!itag) {
+        return NULL;
+    }
+
     /* Allocate a task structure */
     task = task_alloc(config);
     if (!task) {
+        flb_tag_release(config, itag);
         return NULL;
     }
 
     /* Keep track of origins */
     task->ref_id    = ref_id;
-    task->tag       = flb_strdup(tag);
+    task->itag      = itag;
+    task->tag       = itag->name;
+    task->tag_len   = task->itag->len;
     task->buf       = buf;
     task->size      = size;
     task->i_ins     = i_ins;
@@ -357,6 +671,7 @@ struct flb_task *flb_task_create_direct(uint64_t ref_id,
     task->mapped    = FLB_TRUE;
 #ifdef FLB_HAVE_BUFFERING
     memcpy(&task->hash_hex, hash, 41);
+    task->fs_routes = routes;
 #endif
     mk_list_add(&task->_head, &i_ins->tasks);
 
@@ -364,14 +679,10 @@ struct flb_task *flb_task_create_direct(uint64_t ref_id,
     mk_list_foreach(head, &config->outputs) {
         o_ins = mk_list_entry(head, struct flb_output_instance, _head);
         if (o_ins->mask_id & routes) {
-            route = flb_malloc(sizeof(struct flb_task_route));
+            route = task_route_add(task, o_ins);
             if (!route) {
-                perror("malloc");
                 continue;
             }
-
-            route->out = o_ins;
-            mk_list_add(&route->_head, &task->routes);
             count++;
         }
     }
@@ -381,6 +692,38 @@ struct flb_task *flb_task_create_direct(uint64_t ref_id,
     return task;
 }
 
+/*
+ * Replace the buffer of a task that was not started yet (e.g: the filters
+ * pool ran the filters chain over it), the memory accounting follows the
+ * new size. The records index is taken from 'index'.
+ */
+void flb_task_buf_update(struct flb_task *task, char *buf, size_t size,
+                         size_t alloc, struct flb_chunk_index *index)
+{
+    struct flb_input_dyntag *dt = task->dt;
+    struct flb_input_instance *i_ins = task->i_ins;
+    struct flb_config *config = task->config;
+
+    if (dt) {
+        /* The dyntag still owns the buffer */
+        dt->mp_sbuf.data  = buf;
+        dt->mp_sbuf.size  = size;
+        dt->mp_sbuf.alloc = alloc;
+        flb_input_buf_size_set(i_ins);
+    }
+    else {
+        i_ins->mp_tasks_size -= task->mem_size;
+        config->mem_total -= task->mem_size;
+        task->mem_size = size;
+        i_ins->mp_tasks_size += size;
+        config->mem_total += size;
+    }
+
+    task->buf  = buf;
+    task->size = size;
+    flb_chunk_index_move(&task->index, index);
+}
+
 void flb_task_destroy(struct flb_task *task)
 {
     struct mk_list *tmp;
@@ -389,6 +732,20 @@ void flb_task_destroy(struct flb_task *task)
     struct flb_task_retry *retry;
 
     flb_debug("[task] destroy task=%p (task_id=%i)", task, task->id);
+#ifdef FLB_HAVE_METRICS
+    FLB_PROBE3(task_destroy, task->id, task->tag,
+               flb_metrics_clock() - task->created);
+#else
+    FLB_PROBE3(task_destroy, task->id, task->tag, 0);
+#endif
+
+#ifdef FLB_HAVE_METRICS
+    if (task->trace) {
+        flb_task_trace_end(task->config->task_traces, task->trace,
+                           task->tag, task->i_ins ? task->i_ins->name : NULL,
+                           task->size);
+    }
+#endif
 
     /* Release task_id */
     map_free_task_id(task->id, task->config);
@@ -396,13 +753,36 @@ void flb_task_destroy(struct flb_task *task)
     /* Remove routes */
     mk_list_foreach_safe(head, tmp, &task->routes) {
         route = mk_list_entry(head, struct flb_task_route, _head);
+        if (route->pending == FLB_TRUE) {
+            mk_list_del(&route->_head_pending);
+        }
+        else if (route->backlog == FLB_TRUE) {
+            flb_priority_queue_del(&route->out->backlog_routes,
+                                   &route->_head_pending);
+        }
+        else if (route->queued == FLB_TRUE) {
+            flb_priority_queue_del(&route->out->inflight_queue,
+                                   &route->_head_pending);
+        }
+        else if (route->coalesced == FLB_TRUE) {
+            mk_list_del(&route->_head_pending);
+            route->out->coalesce_count--;
+            route->out->coalesce_size -= task->size;
+        }
         mk_list_del(&route->_head);
-        flb_free(route);
+        flb_slab_free(task->config->route_slab, route);
     }
 
     /* Unlink and release */
     mk_list_del(&task->_head);
 
+#ifdef FLB_HAVE_BUFFERING
+    if (task->chunk_mapped == FLB_TRUE) {
+        munmap(task->buf, task->size);
+        task->buf = NULL;
+    }
+#endif
+
     if (task->mapped == FLB_FALSE) {
         if (task->dt && task->buf) {
             if (task->buf != task->dt->mp_sbuf.data) {
@@ -434,10 +814,15 @@ void flb_task_destroy(struct flb_task *task)
         flb_task_retry_destroy(retry);
     }
 
+    if (task->mem_size > 0) {
+        task->i_ins->mp_tasks_size -= task->mem_size;
+        task->config->mem_total -= task->mem_size;
+    }
     flb_input_buf_size_set(task->i_ins);
 
-    flb_free(task->tag);
-    flb_free(task);
+    flb_chunk_index_invalidate(&task->index);
+    flb_tag_release(task->config, task->itag);
+    flb_slab_free(task->config->task_slab, task);
 }
 
 /* Register a thread into the tasks list */
@@ -0,0 +1,300 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_log.h>
+#include <fluent-bit/flb_str.h>
+#include <fluent-bit/flb_macros.h>
+#include <fluent-bit/flb_metrics.h>
+#include <fluent-bit/flb_task_trace.h>
+
+#include <msgpack.h>
+#include <inttypes.h>
+
+static char *event_names[] = {
+    "create", "flush", "return", "retry", "destroy"
+};
+
+static void trace_destroy(struct flb_task_trace *trace)
+{
+    pthread_mutex_destroy(&trace->lock);
+    flb_free(trace->tag);
+    flb_free(trace);
+}
+
+struct flb_task_traces *flb_task_traces_create(int sample)
+{
+    struct flb_task_traces *ctx;
+
+    ctx = flb_calloc(1, sizeof(struct flb_task_traces));
+    if (!ctx) {
+        flb_errno();
+        return NULL;
+    }
+    ctx->sample = sample;
+    pthread_mutex_init(&ctx->lock, NULL);
+
+    return ctx;
+}
+
+void flb_task_traces_destroy(struct flb_task_traces *ctx)
+{
+    int i;
+
+    for (i = 0; i < ctx->size; i++) {
+        trace_destroy(ctx->ring[i]);
+    }
+    pthread_mutex_destroy(&ctx->lock);
+    flb_free(ctx);
+}
+
+/* Returns a new trace if the task is sampled, otherwise NULL */
+struct flb_task_trace *flb_task_trace_start(struct flb_task_traces *ctx)
+{
+    uint64_t n;
+    struct flb_task_trace *trace;
+
+    n = __atomic_fetch_add(&ctx->count, 1, __ATOMIC_RELAXED);
+    if (ctx->sample <= 0 || (n % ctx->sample) != 0) {
+        return NULL;
+    }
+
+    trace = flb_calloc(1, sizeof(struct flb_task_trace));
+    if (!trace) {
+        flb_errno();
+        return NULL;
+    }
+    trace->id = __atomic_add_fetch(&ctx->traced, 1, __ATOMIC_RELAXED);
+    trace->created = flb_metrics_clock();
+    pthread_mutex_init(&trace->lock, NULL);
+    flb_task_trace_event(trace, FLB_TASK_TRACE_CREATE, NULL, 0, 0);
+
+    return trace;
+}
+
+void flb_task_trace_event(struct flb_task_trace *trace, int type,
+                          char *output, int ret, uint64_t value)
+{
+    uint64_t now;
+    struct flb_task_trace_event *e;
+
+    now = flb_metrics_clock();
+
+    pthread_mutex_lock(&trace->lock);
+    if (trace->n_events == FLB_TASK_TRACE_EVENTS) {
+        trace->dropped++;
+        pthread_mutex_unlock(&trace->lock);
+        return;
+    }
+
+    e = &trace->events[trace->n_events++];
+    e->type  = type;
+    e->ret   = ret;
+    e->usec  = now - trace->created;
+    e->value = value;
+    if (output) {
+        strncpy(e->output, output, sizeof(e->output) - 1);
+    }
+    pthread_mutex_unlock(&trace->lock);
+}
+
+/* A route is ready at the creation or when its last retry backoff ends */
+static uint64_t route_ready(struct flb_task_trace *trace, int n)
+{
+    int i;
+    struct flb_task_trace_event *e;
+
+    for (i = n - 1; i >= 0; i--) {
+        e = &trace->events[i];
+        if (e->type == FLB_TASK_TRACE_RETRY &&
+            strcmp(e->output, trace->events[n].output) == 0) {
+            return e->usec + e->value;
+        }
+    }
+    return 0;
+}
+
+/*
+ * The task is gone: compute the time breakdown and move the trace to the
+ * ring, the oldest trace is released when the ring is full.
+ */
+void flb_task_trace_end(struct flb_task_traces *ctx,
+                        struct flb_task_trace *trace,
+                        char *tag, char *input, size_t size)
+{
+    int i;
+    uint64_t ready;
+    struct flb_task_trace_event *e;
+
+    flb_task_trace_event(trace, FLB_TASK_TRACE_DESTROY, NULL, 0, 0);
+    trace->total_usec = flb_metrics_clock() - trace->created;
+    trace->size = size;
+    if (tag) {
+        trace->tag = flb_strdup(tag);
+    }
+    if (input) {
+        strncpy(trace->input, input, sizeof(trace->input) - 1);
+    }
+
+    for (i = 0; i < trace->n_events; i++) {
+        e = &trace->events[i];
+        if (e->type == FLB_TASK_TRACE_FLUSH) {
+            ready = route_ready(trace, i);
+            if (e->usec > ready) {
+                trace->wait_usec += e->usec - ready;
+            }
+        }
+        else if (e->type == FLB_TASK_TRACE_RETURN) {
+            trace->output_usec += e->value;
+        }
+        else if (e->type == FLB_TASK_TRACE_RETRY) {
+            trace->backoff_usec += e->value;
+            trace->retries++;
+        }
+    }
+
+    flb_debug("[task trace] #%" PRIu64 " tag=%s total=%" PRIu64 "us "
+              "wait=%" PRIu64 "us output=%" PRIu64 "us "
+              "backoff=%" PRIu64 "us retries=%i",
+              trace->id, trace->tag ? trace->tag : "",
+              trace->total_usec, trace->wait_usec, trace->output_usec,
+              trace->backoff_usec, trace->retries);
+
+    pthread_mutex_lock(&ctx->lock);
+    if (ctx->size < FLB_TASK_TRACE_RING) {
+        ctx->ring[ctx->size++] = trace;
+    }
+    else {
+        trace_destroy(ctx->ring[ctx->head]);
+        ctx->ring[ctx->head] = trace;
+        ctx->head = (ctx->head + 1) % FLB_TASK_TRACE_RING;
+    }
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+static void pack_str(msgpack_packer *mp_pck, char *str)
+{
+    int len = strlen(str);
+
+    msgpack_pack_str(mp_pck, len);
+    msgpack_pack_str_body(mp_pck, str, len);
+}
+
+static void pack_event(msgpack_packer *mp_pck, struct flb_task_trace_event *e)
+{
+    int n = 2;
+    char *status;
+
+    if (e->output[0]) {
+        n++;
+    }
+    if (e->type == FLB_TASK_TRACE_RETURN || e->type == FLB_TASK_TRACE_RETRY) {
+        n += 2;
+    }
+
+    msgpack_pack_map(mp_pck, n);
+    pack_str(mp_pck, "event");
+    pack_str(mp_pck, event_names[e->type]);
+    pack_str(mp_pck, "usec");
+    msgpack_pack_uint64(mp_pck, e->usec);
+    if (e->output[0]) {
+        pack_str(mp_pck, "output");
+        pack_str(mp_pck, e->output);
+    }
+
+    if (e->type == FLB_TASK_TRACE_RETURN) {
+        if (e->ret == FLB_OK) {
+            status = "ok";
+        }
+        else if (e->ret == FLB_RETRY) {
+            status = "retry";
+        }
+        else {
+            status = "error";
+        }
+        pack_str(mp_pck, "status");
+        pack_str(mp_pck, status);
+        pack_str(mp_pck, "flush_usec");
+        msgpack_pack_uint64(mp_pck, e->value);
+    }
+    else if (e->type == FLB_TASK_TRACE_RETRY) {
+        pack_str(mp_pck, "attempt");
+        msgpack_pack_int(mp_pck, e->ret);
+        pack_str(mp_pck, "backoff_usec");
+        msgpack_pack_uint64(mp_pck, e->value);
+    }
+}
+
+static void pack_trace(msgpack_packer *mp_pck, struct flb_task_trace *trace)
+{
+    int i;
+
+    msgpack_pack_map(mp_pck, 11);
+    pack_str(mp_pck, "id");
+    msgpack_pack_uint64(mp_pck, trace->id);
+    pack_str(mp_pck, "tag");
+    pack_str(mp_pck, trace->tag ? trace->tag : "");
+    pack_str(mp_pck, "input");
+    pack_str(mp_pck, trace->input);
+    pack_str(mp_pck, "size");
+    msgpack_pack_uint64(mp_pck, trace->size);
+    pack_str(mp_pck, "total_usec");
+    msgpack_pack_uint64(mp_pck, trace->total_usec);
+    pack_str(mp_pck, "wait_usec");
+    msgpack_pack_uint64(mp_pck, trace->wait_usec);
+    pack_str(mp_pck, "output_usec");
+    msgpack_pack_uint64(mp_pck, trace->output_usec);
+    pack_str(mp_pck, "backoff_usec");
+    msgpack_pack_uint64(mp_pck, trace->backoff_usec);
+    pack_str(mp_pck, "retries");
+    msgpack_pack_int(mp_pck, trace->retries);
+    pack_str(mp_pck, "dropped_events");
+    msgpack_pack_int(mp_pck, trace->dropped);
+
+    pack_str(mp_pck, "events");
+    msgpack_pack_array(mp_pck, trace->n_events);
+    for (i = 0; i < trace->n_events; i++) {
+        pack_event(mp_pck, &trace->events[i]);
+    }
+}
+
+/* Pack the finished traces as an array, from the oldest to the newest */
+int flb_task_traces_dump(struct flb_task_traces *ctx,
+                         char **out_buf, size_t *out_size)
+{
+    int i;
+    msgpack_sbuffer mp_sbuf;
+    msgpack_packer mp_pck;
+
+    msgpack_sbuffer_init(&mp_sbuf);
+    msgpack_packer_init(&mp_pck, &mp_sbuf, msgpack_sbuffer_write);
+
+    pthread_mutex_lock(&ctx->lock);
+    msgpack_pack_array(&mp_pck, ctx->size);
+    for (i = 0; i < ctx->size; i++) {
+        pack_trace(&mp_pck, ctx->ring[(ctx->head + i) % ctx->size]);
+    }
+    pthread_mutex_unlock(&ctx->lock);
+
+    *out_buf  = mp_sbuf.data;
+    *out_size = mp_sbuf.size;
+
+    return 0;
+}
@@ -0,0 +1,134 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+
+/*
+ * Co-routines stack pool
+ * ======================
+ * Creating a libco context means a malloc(3) of the whole stack, since
+ * output and input threads are created and destroyed on every flush or
+ * collection, released stacks are kept in a bounded pool and derived
+ * again for the next co-routine that requests the same stack size.
+ *
+ * While a stack sits in the pool, its first bytes are used to link it
+ * into the list.
+ */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_log.h>
+#include <fluent-bit/flb_thread.h>
+
+#include <monkey/mk_core.h>
+#include <pthread.h>
+
+struct flb_thread_stack {
+    size_t size;                /* requested stack size */
+    size_t real_size;           /* allocated size       */
+    struct mk_list _head;
+};
+
+static int pool_count = 0;
+static struct mk_list pool_list = {&pool_list, &pool_list};
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Take a stack of the given size from the pool */
+static struct flb_thread_stack *pool_get(size_t size)
+{
+    struct mk_list *head;
+    struct flb_thread_stack *stack;
+
+    pthread_mutex_lock(&pool_mutex);
+    mk_list_foreach(head, &pool_list) {
+        stack = mk_list_entry(head, struct flb_thread_stack, _head);
+        if (stack->size == size) {
+            mk_list_del(&stack->_head);
+            pool_count--;
+            pthread_mutex_unlock(&pool_mutex);
+            return stack;
+        }
+    }
+    pthread_mutex_unlock(&pool_mutex);
+
+    return NULL;
+}
+
+cothread_t flb_thread_stack_create(size_t size, void (*entry)(void),
+                                   size_t *out_size)
+{
+    size_t real_size;
+    cothread_t callee;
+    struct flb_thread_stack *stack;
+
+    stack = pool_get(size);
+    if (stack) {
+        real_size = stack->real_size;
+        callee = co_derive(stack, real_size, entry);
+        if (callee) {
+            *out_size = real_size;
+            return callee;
+        }
+
+        /* the libco backend in use cannot reuse stacks */
+        co_delete(stack);
+    }
+
+    return co_create(size, entry, out_size);
+}
+
+void flb_thread_stack_release(cothread_t callee, size_t size, size_t real_size)
+{
+    struct flb_thread_stack *stack;
+
+    if (!callee) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool_mutex);
+    if (real_size < sizeof(struct flb_thread_stack) ||
+        pool_count >= FLB_THREAD_POOL_SIZE) {
+        pthread_mutex_unlock(&pool_mutex);
+        co_delete(callee);
+        return;
+    }
+
+    stack = (struct flb_thread_stack *) callee;
+    stack->size = size;
+    stack->real_size = real_size;
+    mk_list_add(&stack->_head, &pool_list);
+    pool_count++;
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+/* Release all the stacks from the pool */
+void flb_thread_pool_exit()
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct flb_thread_stack *stack;
+
+    pthread_mutex_lock(&pool_mutex);
+    mk_list_foreach_safe(head, tmp, &pool_list) {
+        stack = mk_list_entry(head, struct flb_thread_stack, _head);
+        mk_list_del(&stack->_head);
+        co_delete(stack);
+    }
+    pool_count = 0;
+    pthread_mutex_unlock(&pool_mutex);
+}
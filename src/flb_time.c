@@ -55,6 +55,58 @@ int flb_time_get(struct flb_time *tm)
     return _flb_time_get(tm);
 }
 
+#ifdef FLB_HAVE_C_TLS
+/* Time of the current event loop iteration, per thread */
+static __thread struct flb_time loop_time;
+#endif
+
+/* Event loops take the time once they wake up, before running the events */
+void flb_time_loop_update()
+{
+#ifdef FLB_HAVE_C_TLS
+    _flb_time_get(&loop_time);
+#endif
+}
+
+/*
+ * Get the current time with the given precision, it falls back to a
+ * precise read if the thread does not run an event loop or the coarse
+ * clock is not available.
+ */
+int flb_time_get_precision(struct flb_time *tm, int precision)
+{
+    if (precision == FLB_TIME_LOOP) {
+#ifdef FLB_HAVE_C_TLS
+        if (loop_time.tm.tv_sec != 0) {
+            *tm = loop_time;
+            return 0;
+        }
+#endif
+    }
+    else if (precision == FLB_TIME_COARSE) {
+#ifdef CLOCK_REALTIME_COARSE
+        return clock_gettime(CLOCK_REALTIME_COARSE, &tm->tm);
+#endif
+    }
+
+    return _flb_time_get(tm);
+}
+
+/* Parse a 'time_precision' value, it returns -1 if it's not valid */
+int flb_time_precision(char *str)
+{
+    if (strcasecmp(str, "precise") == 0) {
+        return FLB_TIME_PRECISE;
+    }
+    else if (strcasecmp(str, "coarse") == 0) {
+        return FLB_TIME_COARSE;
+    }
+    else if (strcasecmp(str, "loop") == 0) {
+        return FLB_TIME_LOOP;
+    }
+    return -1;
+}
+
 double flb_time_to_double(struct flb_time *tm)
 {
     return (double)(tm->tm.tv_sec) + ((double)tm->tm.tv_nsec/(double)ONESEC_IN_NSEC);
@@ -142,38 +194,41 @@ int flb_time_append_to_msgpack(struct flb_time *tm, msgpack_packer *pk, int fmt)
     return ret;
 }
 
-int flb_time_pop_from_msgpack(struct flb_time *time, msgpack_unpacked *upk,
-                              msgpack_object **map)
+int flb_time_msgpack_to_time(struct flb_time *time, msgpack_object *obj)
 {
-    msgpack_object obj;
     uint32_t tmp;
 
-    if(time == NULL || upk == NULL) {
-        return -1;
-    }
-
-    obj = upk->data.via.array.ptr[0];
-    *map = &upk->data.via.array.ptr[1];
-
-    switch(obj.type){
+    switch(obj->type){
     case MSGPACK_OBJECT_POSITIVE_INTEGER:
-        time->tm.tv_sec  = obj.via.u64;
+        time->tm.tv_sec  = obj->via.u64;
         time->tm.tv_nsec = 0;
         break;
     case MSGPACK_OBJECT_FLOAT:
-        time->tm.tv_sec  = obj.via.f64;
-        time->tm.tv_nsec = ((obj.via.f64 - time->tm.tv_sec) * ONESEC_IN_NSEC);
+        time->tm.tv_sec  = obj->via.f64;
+        time->tm.tv_nsec = ((obj->via.f64 - time->tm.tv_sec) * ONESEC_IN_NSEC);
         break;
     case MSGPACK_OBJECT_EXT:
-        memcpy(&tmp, &obj.via.ext.ptr[0], 4);
+        memcpy(&tmp, &obj->via.ext.ptr[0], 4);
         time->tm.tv_sec = (uint32_t)ntohl(tmp);
-        memcpy(&tmp, &obj.via.ext.ptr[4], 4);
+        memcpy(&tmp, &obj->via.ext.ptr[4], 4);
         time->tm.tv_nsec = (uint32_t)ntohl(tmp);
         break;
     default:
-        flb_warn("unknown time format %x", obj.type);
+        flb_warn("unknown time format %x", obj->type);
         return -1;
     }
 
     return 0;
 }
+
+int flb_time_pop_from_msgpack(struct flb_time *time, msgpack_unpacked *upk,
+                              msgpack_object **map)
+{
+    if(time == NULL || upk == NULL) {
+        return -1;
+    }
+
+    *map = &upk->data.via.array.ptr[1];
+
+    return flb_time_msgpack_to_time(time, &upk->data.via.array.ptr[0]);
+}
@@ -0,0 +1,411 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_macros.h>
+#include <fluent-bit/flb_utf8.h>
+#include <fluent-bit/flb_unescape.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define FLB_UNESCAPE_SSE2
+#include <emmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define FLB_UNESCAPE_NEON
+#include <arm_neon.h>
+#endif
+
+/* Bytes the scanners stop at */
+#define SCAN_BACKSLASH  1
+#define SCAN_HIGH       2    /* non-ASCII */
+
+#define UNESCAPE_BYTES(c)  (0x0101010101010101ULL * (c))
+
+/*
+ * Eight bytes at a time: the high bit of a mask byte is set for a
+ * backslash or a non-ASCII byte. The matching byte is located byte by byte
+ * so it works on any byte order.
+ */
+static size_t scan_sw(const char *buf, size_t len, int flags)
+{
+    size_t i = 0;
+    uint64_t v;
+    uint64_t x;
+    uint64_t m;
+    unsigned char c;
+
+    while (i + 8 <= len) {
+        memcpy(&v, buf + i, 8);
+
+        m = 0;
+        if (flags & SCAN_BACKSLASH) {
+            x = v ^ UNESCAPE_BYTES('\\');
+            m = (x - UNESCAPE_BYTES(0x01)) & ~x;
+        }
+        if (flags & SCAN_HIGH) {
+            m |= v;
+        }
+        if (m & UNESCAPE_BYTES(0x80)) {
+            break;
+        }
+        i += 8;
+    }
+
+    for (; i < len; i++) {
+        c = buf[i];
+        if (((flags & SCAN_BACKSLASH) && c == '\\') ||
+            ((flags & SCAN_HIGH) && c >= 0x80)) {
+            break;
+        }
+    }
+
+    return i;
+}
+
+#ifdef FLB_UNESCAPE_SSE2
+static size_t scan_simd(const char *buf, size_t len, int flags)
+{
+    size_t i = 0;
+    uint32_t mask;
+    __m128i bs;
+    __m128i v;
+
+    bs = _mm_set1_epi8('\\');
+    for (; i + 16 <= len; i += 16) {
+        v = _mm_loadu_si128((const __m128i *) (buf + i));
+        mask = 0;
+        if (flags & SCAN_BACKSLASH) {
+            mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, bs));
+        }
+        if (flags & SCAN_HIGH) {
+            mask |= _mm_movemask_epi8(v);
+        }
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+
+    return i + scan_sw(buf + i, len - i, flags);
+}
+#elif defined(FLB_UNESCAPE_NEON)
+static size_t scan_simd(const char *buf, size_t len, int flags)
+{
+    size_t i = 0;
+    uint64_t bits;
+    uint8x16_t bs;
+    uint8x16_t high;
+    uint8x16_t v;
+    uint8x16_t m;
+    uint8x16_t zero;
+
+    /* No movemask: narrow the result to 4 bits per byte (see flb_lines.c) */
+    bs = vdupq_n_u8('\\');
+    high = vdupq_n_u8(0x80);
+    zero = vdupq_n_u8(0);
+    for (; i + 16 <= len; i += 16) {
+        v = vld1q_u8((const uint8_t *) (buf + i));
+        m = zero;
+        if (flags & SCAN_BACKSLASH) {
+            m = vceqq_u8(v, bs);
+        }
+        if (flags & SCAN_HIGH) {
+            m = vorrq_u8(m, vtstq_u8(v, high));
+        }
+        bits = vget_lane_u64(vreinterpret_u64_u8(
+                   vshrn_n_u16(vreinterpretq_u16_u8(m), 4)), 0);
+        if (bits) {
+            return i + (__builtin_ctzll(bits) >> 2);
+        }
+    }
+
+    return i + scan_sw(buf + i, len - i, flags);
+}
+#else
+#define scan_simd scan_sw
+#endif
+
+/* Length of the valid UTF-8 sequence at 'buf', or 0 */
+static int utf8_sequence(const char *buf, size_t len)
+{
+    size_t i = 0;
+    uint32_t state = FLB_UTF8_ACCEPT;
+    uint32_t codepoint = 0;
+
+    do {
+        if (flb_utf8_decode(&state, &codepoint,
+                            (unsigned char) buf[i++]) == FLB_UTF8_REJECT) {
+            return 0;
+        }
+    } while (state != FLB_UTF8_ACCEPT && i < len);
+
+    if (state != FLB_UTF8_ACCEPT) {
+        return 0;
+    }
+    return i;
+}
+
+static size_t unescape_span(const char *buf, size_t len, int mode, int sw)
+{
+    int n;
+    int flags = SCAN_BACKSLASH;
+    size_t i = 0;
+
+    if (mode == FLB_UNESCAPE_UTF8) {
+        flags |= SCAN_HIGH;
+    }
+
+    while (i < len) {
+        if (sw) {
+            i += scan_sw(buf + i, len - i, flags);
+        }
+        else {
+            i += scan_simd(buf + i, len - i, flags);
+        }
+        if (i == len || buf[i] == '\\') {
+            break;
+        }
+
+        /* Non-ASCII byte: skip a valid UTF-8 sequence */
+        n = utf8_sequence(buf + i, len - i);
+        if (n == 0) {
+            break;
+        }
+        i += n;
+    }
+
+    return i;
+}
+
+size_t flb_unescape_span(const char *buf, size_t len, int mode)
+{
+    return unescape_span(buf, len, mode, FLB_FALSE);
+}
+
+/* Eight bytes at a time version, always available (used by tests) */
+size_t flb_unescape_span_sw(const char *buf, size_t len, int mode)
+{
+    return unescape_span(buf, len, mode, FLB_TRUE);
+}
+
+int flb_utf8_valid(const char *buf, size_t len)
+{
+    int n;
+    size_t i = 0;
+
+    while (i < len) {
+        i += scan_simd(buf + i, len - i, SCAN_HIGH);
+        if (i == len) {
+            break;
+        }
+        n = utf8_sequence(buf + i, len - i);
+        if (n == 0) {
+            return FLB_FALSE;
+        }
+        i += n;
+    }
+
+    return FLB_TRUE;
+}
+
+static int octal_digit(char c)
+{
+    return (c >= '0' && c <= '7');
+}
+
+static int hex_digit(char c)
+{
+    return ((c >= '0' && c <= '9') ||
+            (c >= 'A' && c <= 'F') ||
+            (c >= 'a' && c <= 'f'));
+}
+
+static int hex_value(char c)
+{
+    if (c <= '9') {
+        return c - '0';
+    }
+    return (c | 0x20) - 'a' + 10;
+}
+
+static int utf8_encode(char *dest, uint32_t ch)
+{
+    if (ch < 0x80) {
+        dest[0] = (char) ch;
+        return 1;
+    }
+    if (ch < 0x800) {
+        dest[0] = (ch >> 6) | 0xC0;
+        dest[1] = (ch & 0x3F) | 0x80;
+        return 2;
+    }
+    if (ch < 0x10000) {
+        dest[0] = (ch >> 12) | 0xE0;
+        dest[1] = ((ch >> 6) & 0x3F) | 0x80;
+        dest[2] = (ch & 0x3F) | 0x80;
+        return 3;
+    }
+    if (ch < 0x110000) {
+        dest[0] = (ch >> 18) | 0xF0;
+        dest[1] = ((ch >> 12) & 0x3F) | 0x80;
+        dest[2] = ((ch >> 6) & 0x3F) | 0x80;
+        dest[3] = (ch & 0x3F) | 0x80;
+        return 4;
+    }
+    return 0;
+}
+
+/*
+ * Numeric sequence after a backslash: \x (2 digits), \u (4), \U (8) or
+ * octal (3). Returns the input bytes consumed or 0 if 'str' is not one.
+ */
+static int read_code(const char *str, size_t len, uint32_t *dest)
+{
+    int i = 1;
+    int max;
+    uint32_t ch = 0;
+
+    if (octal_digit(str[0])) {
+        i = 0;
+        while (i < len && i < 3 && octal_digit(str[i])) {
+            ch = (ch << 3) | (str[i++] - '0');
+        }
+        *dest = ch;
+        return i;
+    }
+
+    if (str[0] == 'x') {
+        max = 2;
+    }
+    else if (str[0] == 'u') {
+        max = 4;
+    }
+    else if (str[0] == 'U') {
+        max = 8;
+    }
+    else {
+        return 0;
+    }
+
+    while (i < len && i <= max && hex_digit(str[i])) {
+        ch = (ch << 4) | hex_value(str[i++]);
+    }
+    if (i == 1) {
+        /* no digits, taken as a literal character */
+        return 0;
+    }
+
+    *dest = ch;
+    return i;
+}
+
+static char control_char(char c)
+{
+    switch (c) {
+    case 'n':
+        return '\n';
+    case 't':
+        return '\t';
+    case 'r':
+        return '\r';
+    case 'b':
+        return '\b';
+    case 'f':
+        return '\f';
+    case 'v':
+        return '\v';
+    case 'a':
+        return '\a';
+    }
+    return 0;
+}
+
+size_t flb_unescape(const char *in, size_t len, char *out, int mode)
+{
+    int n;
+    char c;
+    char ctrl;
+    size_t i = 0;
+    size_t j = 0;
+    uint32_t ch;
+
+    while (i < len) {
+        n = flb_unescape_span(in + i, len - i, mode);
+        memcpy(out + j, in + i, n);
+        i += n;
+        j += n;
+        if (i == len) {
+            break;
+        }
+
+        if (in[i] != '\\') {
+            /* invalid UTF-8 byte */
+            i++;
+            continue;
+        }
+
+        if (i + 1 == len) {
+            /* trailing backslash, nothing to unescape */
+            if (mode == FLB_UNESCAPE_UTF8) {
+                out[j++] = '\\';
+            }
+            i++;
+            break;
+        }
+
+        c = in[i + 1];
+        ctrl = control_char(c);
+        if (mode == FLB_UNESCAPE_CONTROL) {
+            out[j++] = ctrl ? ctrl : c;
+            i += 2;
+        }
+        else if (mode == FLB_UNESCAPE_KEEP_CONTROL) {
+            if (ctrl) {
+                out[j++] = '\\';
+            }
+            out[j++] = c;
+            i += 2;
+        }
+        else if (c == '"' || c == '\'' || c == '\\' || c == '/') {
+            out[j++] = '\\';
+            out[j++] = c;
+            i += 2;
+        }
+        else if (ctrl) {
+            out[j++] = ctrl;
+            i += 2;
+        }
+        else if ((n = read_code(in + i + 1, len - i - 1, &ch)) > 0) {
+            j += utf8_encode(out + j, ch);
+            i += n + 1;
+        }
+        else if ((unsigned char) c < 0x80) {
+            out[j++] = c;
+            i += 2;
+        }
+        else {
+            /* escaped UTF-8 sequence, only the backslash is removed */
+            i++;
+        }
+    }
+
+    out[j] = '\0';
+    return j;
+}
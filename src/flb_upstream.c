@@ -25,6 +25,42 @@
 #include <fluent-bit/flb_io.h>
 #include <fluent-bit/flb_io_tls.h>
 #include <fluent-bit/flb_tls.h>
+#include <fluent-bit/flb_engine.h>
+#include <fluent-bit/flb_probes.h>
+#include <fluent-bit/flb_worker.h>
+#include <fluent-bit/flb_scheduler.h>
+#include <fluent-bit/flb_http2.h>
+
+#include <errno.h>
+
+/* Serialize the creation and release of the warm-up service */
+static pthread_mutex_t warm_ctx_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline void upstream_lock(struct flb_upstream *u)
+{
+    pthread_mutex_lock(&u->mutex_queue);
+}
+
+static inline void upstream_unlock(struct flb_upstream *u)
+{
+    pthread_mutex_unlock(&u->mutex_queue);
+}
+
+/*
+ * Connections events are registered in the event loop of the running
+ * thread: the engine or an output worker.
+ */
+static inline struct mk_event_loop *conn_evl(struct flb_upstream *u)
+{
+    struct mk_event_loop *evl;
+
+    evl = flb_engine_evl_get();
+    if (!evl) {
+        evl = u->evl;
+    }
+
+    return evl;
+}
 
 /* Creates a new upstream context */
 struct flb_upstream *flb_upstream_create(struct flb_config *config,
@@ -43,9 +79,18 @@ struct flb_upstream *flb_upstream_create(struct flb_config *config,
     u->tcp_port      = port;
     u->flags         = flags;
     u->evl           = config->evl;
+    u->config        = config;
     u->n_connections = 0;
     mk_list_init(&u->av_queue);
     mk_list_init(&u->busy_queue);
+    mk_list_init(&u->_head_warm);
+    mk_list_init(&u->_head_warm_queue);
+    mk_list_init(&u->h2_sessions);
+
+    /* Keepalive is disabled by default, the caller must request it */
+    u->ka_enabled      = FLB_FALSE;
+    u->ka_idle_timeout = FLB_UPSTREAM_KA_IDLE_TIMEOUT;
+    u->ka_max_recycle  = FLB_UPSTREAM_KA_MAX_RECYCLE;
 
     /*
      * If Fluent Bit was built with FLUSH_PTHREADS, means each operation inside
@@ -65,29 +110,140 @@ struct flb_upstream *flb_upstream_create(struct flb_config *config,
     u->tls      = (struct flb_tls *) tls;
 #endif
 
-#ifdef FLB_HAVE_FLUSH_PTHREADS
     pthread_mutex_init(&u->mutex_queue, NULL);
-#endif
 
     return u;
 }
 
+/* Configure the keepalive mode for the connections of the upstream */
+void flb_upstream_set_keepalive(struct flb_upstream *u, int enabled,
+                                int idle_timeout, int max_recycle)
+{
+    u->ka_enabled      = enabled;
+    u->ka_idle_timeout = idle_timeout;
+    u->ka_max_recycle  = max_recycle;
+
+    flb_debug("[upstream] %s:%i keepalive=%s idle_timeout=%i max_recycle=%i",
+              u->tcp_host, u->tcp_port, enabled ? "on" : "off",
+              idle_timeout, max_recycle);
+}
+
+/*
+ * Send the HTTP requests of the upstream as HTTP/2 streams sharing a
+ * connection. It requires Fluent Bit built with FLB_HTTP2.
+ */
+int flb_upstream_set_http2(struct flb_upstream *u, int enabled)
+{
+#ifdef FLB_HAVE_HTTP2
+    u->http2 = enabled;
+    flb_debug("[upstream] %s:%i http2=%s",
+              u->tcp_host, u->tcp_port, enabled ? "on" : "off");
+    return 0;
+#else
+    if (enabled == FLB_TRUE) {
+        flb_error("[upstream] %s:%i HTTP/2 support is not built in "
+                  "(FLB_HTTP2)", u->tcp_host, u->tcp_port);
+        return -1;
+    }
+    return 0;
+#endif
+}
+
+/* Close the socket, release TLS session and unlink the connection */
+static int destroy_conn(struct flb_upstream_conn *u_conn)
+{
+    struct flb_upstream *u = u_conn->u;
+
+    flb_trace("[upstream] [fd=%i] destroy connection %p",
+              u_conn->fd, u_conn);
+
+    if (u->flags & FLB_IO_ASYNC) {
+        mk_event_del(u_conn->evl, &u_conn->event);
+    }
+
+    if (u_conn->fd > 0) {
+        flb_socket_close(u_conn->fd);
+    }
+
+#ifdef FLB_HAVE_TLS
+    if (u_conn->tls_session) {
+        flb_tls_session_destroy(u_conn->tls_session);
+        u_conn->tls_session = NULL;
+    }
+#endif
+
+    upstream_lock(u);
+
+    /* remove connection from the queue */
+    mk_list_del(&u_conn->_head);
+    u->n_connections--;
+
+    upstream_unlock(u);
+
+    flb_free(u_conn);
+
+    return 0;
+}
+
+/* Unregister from the warm-up service, wait if it's being connected */
+static void warm_unlink(struct flb_upstream *u)
+{
+    struct flb_upstream_warm *warm;
+
+    pthread_mutex_lock(&warm_ctx_lock);
+    warm = u->config->upstream_warm_ctx;
+    if (!warm) {
+        pthread_mutex_unlock(&warm_ctx_lock);
+        return;
+    }
+
+    pthread_mutex_lock(&warm->lock);
+    pthread_mutex_unlock(&warm_ctx_lock);
+
+    while (warm->current == u) {
+        pthread_cond_wait(&warm->cond, &warm->lock);
+    }
+    if (u->warm_queued == FLB_TRUE) {
+        mk_list_del(&u->_head_warm_queue);
+        u->warm_queued = FLB_FALSE;
+    }
+    mk_list_del(&u->_head_warm);
+    mk_list_init(&u->_head_warm);
+    pthread_mutex_unlock(&warm->lock);
+}
+
 int flb_upstream_destroy(struct flb_upstream *u)
 {
     struct mk_list *tmp;
     struct mk_list *head;
     struct flb_upstream_conn *u_conn;
 
+    if (u->warm_min_idle > 0) {
+        warm_unlink(u);
+    }
+
+#ifdef FLB_HAVE_HTTP2
+    flb_http2_sessions_destroy(u);
+#endif
+
     mk_list_foreach_safe(head, tmp, &u->av_queue) {
         u_conn = mk_list_entry(head, struct flb_upstream_conn, _head);
-        flb_upstream_conn_release(u_conn);
+        destroy_conn(u_conn);
     }
 
     mk_list_foreach_safe(head, tmp, &u->busy_queue) {
         u_conn = mk_list_entry(head, struct flb_upstream_conn, _head);
-        flb_upstream_conn_release(u_conn);
+        destroy_conn(u_conn);
     }
 
+#ifdef FLB_HAVE_TLS
+    if (u->tls_resume_set == FLB_TRUE) {
+        mbedtls_ssl_session_free(&u->tls_resume);
+    }
+#endif
+
+    flb_dns_cache_destroy(&u->dns);
+    pthread_mutex_destroy(&u->mutex_queue);
     flb_free(u->tcp_host);
     flb_free(u);
 
@@ -110,8 +266,13 @@ static struct flb_upstream_conn *create_conn(struct flb_upstream *u)
         return NULL;
     }
     conn->u             = u;
+    conn->evl           = conn_evl(u);
     conn->fd            = -1;
     conn->connect_count = 0;
+    conn->recycle       = FLB_TRUE;
+    conn->ka_count      = 0;
+    conn->ts_available  = 0;
+    conn->h2            = NULL;
 #ifdef FLB_HAVE_TLS
     conn->tls_session   = NULL;
 #endif
@@ -120,46 +281,100 @@ static struct flb_upstream_conn *create_conn(struct flb_upstream *u)
 
     /* Start connection */
     ret = flb_io_net_connect(conn, th);
+    FLB_PROBE4(upstream_connect, u->tcp_host, u->tcp_port, conn->fd, ret);
     if (ret == -1) {
         flb_free(conn);
         return NULL;
     }
 
-#ifdef FLB_HAVE_FLUSH_PTHREADS
-    pthread_mutex_lock(&u->mutex_queue);
-#endif
+    upstream_lock(u);
 
     /* Link new connection to the busy queue */
     mk_list_add(&conn->_head, &u->busy_queue);
 
-#ifdef FLB_HAVE_FLUSH_PTHREADS
-    pthread_mutex_unlock(&u->mutex_queue);
-#endif
-
-    u->n_connections++;
+    upstream_unlock(u);
 
     return conn;
 }
 
+/*
+ * Check if an idle connection is still usable: the remote end might have
+ * closed it while it was sitting in the 'av_queue'. Since no request is in
+ * flight, any readable data (or EOF) means the connection is not in a
+ * clean state and must be discarded.
+ */
+static int conn_is_alive(struct flb_upstream_conn *u_conn)
+{
+    int ret;
+    char tmp;
+
+    if (u_conn->fd <= 0) {
+        return FLB_FALSE;
+    }
+
+#ifdef _WIN32
+    return FLB_TRUE;
+#else
+    ret = recv(u_conn->fd, &tmp, 1, MSG_PEEK | MSG_DONTWAIT);
+    if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return FLB_TRUE;
+    }
+
+    return FLB_FALSE;
+#endif
+}
+
+/*
+ * Lookup an available connection that can be recycled. Expired and dead
+ * connections found on the way are destroyed.
+ */
 static struct flb_upstream_conn *get_conn(struct flb_upstream *u)
 {
+    time_t now;
     struct flb_upstream_conn *conn;
 
-#ifdef FLB_HAVE_FLUSH_PTHREADS
-    pthread_mutex_lock(&u->mutex_queue);
-#endif
-    /* Get the first available connection and increase the counter */
-    conn = mk_list_entry_first(&u->av_queue,
-                               struct flb_upstream_conn, _head);
-    u->n_connections++;
+    now = time(NULL);
 
-    /* Move it to the busy queue */
-    mk_list_del(&conn->_head);
-    mk_list_add(&conn->_head, &u->busy_queue);
+    while (1) {
+        upstream_lock(u);
+        if (mk_list_is_empty(&u->av_queue) == 0) {
+            upstream_unlock(u);
+            return NULL;
+        }
 
-#ifdef FLB_HAVE_FLUSH_PTHREADS
-    pthread_mutex_unlock(&u->mutex_queue);
-#endif
+        /* Take the oldest one and move it to the busy queue */
+        conn = mk_list_entry_first(&u->av_queue,
+                                   struct flb_upstream_conn, _head);
+        mk_list_del(&conn->_head);
+        mk_list_add(&conn->_head, &u->busy_queue);
+
+        upstream_unlock(u);
+
+        if (u->ka_idle_timeout > 0 &&
+            (now - conn->ts_available) > u->ka_idle_timeout) {
+            flb_debug("[upstream] [fd=%i] keepalive idle timeout, closing",
+                      conn->fd);
+            destroy_conn(conn);
+            continue;
+        }
+
+        if (conn_is_alive(conn) == FLB_FALSE) {
+            flb_debug("[upstream] [fd=%i] keepalive connection lost",
+                      conn->fd);
+            destroy_conn(conn);
+            continue;
+        }
+
+        break;
+    }
+
+    conn->ka_count++;
+    conn->recycle = FLB_TRUE;
+    conn->evl = conn_evl(u);
+    MK_EVENT_NEW(&conn->event);
+
+    flb_trace("[upstream] [fd=%i] recycled connection %p (ka_count=%i)",
+              conn->fd, conn, conn->ka_count);
 
     return conn;
 }
@@ -168,69 +383,377 @@ struct flb_upstream_conn *flb_upstream_conn_get(struct flb_upstream *u)
 {
     struct flb_upstream_conn *u_conn = NULL;
 
-    /*
-     * FIXME: for 0.9 series the keep alive mode will be enabled, useless
-     * check now as the available queue is always empty.
-     */
-    if (mk_list_is_empty(&u->av_queue) == 0) {
+#ifdef FLB_HAVE_HTTP2
+    /* Requests of the flush co-routines share the HTTP/2 session */
+    if (u->http2 == FLB_TRUE && (u->flags & FLB_IO_ASYNC) &&
+        pthread_getspecific(flb_thread_key)) {
+        return flb_http2_conn_get(u);
+    }
+#endif
 
-        if (u->max_connections <= 0) {
-            u_conn = create_conn(u);
-        }
-        else if (u->n_connections < u->max_connections) {
-            u_conn = create_conn(u);
-        }
-        else {
-            return NULL;
+    /* Try to recycle an available keepalive connection */
+    if (u->ka_enabled == FLB_TRUE) {
+        u_conn = get_conn(u);
+        if (u_conn) {
+            return u_conn;
         }
     }
-    else {
-        /* Get an available connection */
-        u_conn = get_conn(u);
+
+    /* Reserve a slot for the new connection */
+    upstream_lock(u);
+    if (u->max_connections > 0 && u->n_connections >= u->max_connections) {
+        upstream_unlock(u);
+        return NULL;
     }
+    u->n_connections++;
+    upstream_unlock(u);
 
+    /* Connections and TLS sessions are charged to the upstream */
+    {
+        FLB_MEM_SCOPE_ENTER(FLB_MEM_UPSTREAM);
+        u_conn = create_conn(u);
+        FLB_MEM_SCOPE_LEAVE();
+    }
     if (!u_conn) {
+        upstream_lock(u);
+        u->n_connections--;
+        upstream_unlock(u);
         return NULL;
     }
 
     return u_conn;
 }
 
+/*
+ * Mark if the connection can be recycled or not when released. Callers that
+ * know the connection is not in a clean state (e.g: the remote end asked to
+ * close it) must set FLB_FALSE.
+ */
+int flb_upstream_conn_recycle(struct flb_upstream_conn *u_conn, int val)
+{
+    /* HTTP/2 sessions handle their connection */
+    if (u_conn->h2) {
+        return 0;
+    }
+
+    if (val == FLB_TRUE || val == FLB_FALSE) {
+        u_conn->recycle = val;
+        return 0;
+    }
+
+    return -1;
+}
+
 int flb_upstream_conn_release(struct flb_upstream_conn *u_conn)
 {
     struct flb_upstream *u = u_conn->u;
 
+#ifdef FLB_HAVE_HTTP2
+    if (u_conn->h2) {
+        return flb_http2_conn_release(u_conn);
+    }
+#endif
+
     flb_trace("[upstream] [fd=%i] releasing connection %p",
               u_conn->fd, u_conn);
 
-    if (u->flags & FLB_IO_ASYNC) {
-        mk_event_del(u->evl, &u_conn->event);
+    /* Keepalive: return the connection to the pool if it's still healthy */
+    if (u->ka_enabled == FLB_TRUE && u_conn->recycle == FLB_TRUE &&
+        u_conn->fd > 0 &&
+        (u->ka_max_recycle <= 0 || u_conn->ka_count < u->ka_max_recycle)) {
+
+        if (u->flags & FLB_IO_ASYNC) {
+            mk_event_del(u_conn->evl, &u_conn->event);
+        }
+
+        u_conn->thread = NULL;
+        u_conn->ts_available = time(NULL);
+
+        upstream_lock(u);
+        mk_list_del(&u_conn->_head);
+        mk_list_add(&u_conn->_head, &u->av_queue);
+        upstream_unlock(u);
+
+        flb_trace("[upstream] [fd=%i] keepalive connection %p available",
+                  u_conn->fd, u_conn);
+        return 0;
     }
 
-    if (u_conn->fd > 0) {
-        flb_socket_close(u_conn->fd);
+    return destroy_conn(u_conn);
+}
+
+/*
+ * Health check of the idle connections: the dead and expired ones are
+ * destroyed. Returns the number of connections the upstream is missing to
+ * have 'warm_min_idle' of them available.
+ */
+static int warm_check_upstream(struct flb_upstream *u)
+{
+    int idle = 0;
+    int missing;
+    time_t now;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_list dead;
+    struct flb_upstream_conn *conn;
+
+    now = time(NULL);
+    mk_list_init(&dead);
+
+    upstream_lock(u);
+    mk_list_foreach_safe(head, tmp, &u->av_queue) {
+        conn = mk_list_entry(head, struct flb_upstream_conn, _head);
+
+        /*
+         * Expire a bit earlier than the idle timeout, a flush must not find
+         * a connection that is about to be closed.
+         */
+        if ((u->ka_idle_timeout > 0 &&
+             (now - conn->ts_available) + (FLB_UPSTREAM_WARM_INTERVAL / 1000) >
+             u->ka_idle_timeout) ||
+            conn_is_alive(conn) == FLB_FALSE) {
+            mk_list_del(&conn->_head);
+            mk_list_add(&conn->_head, &dead);
+            continue;
+        }
+        idle++;
     }
 
-#ifdef FLB_HAVE_TLS
-    if (u_conn->tls_session) {
-        flb_tls_session_destroy(u_conn->tls_session);
-        u_conn->tls_session = NULL;
+    missing = u->warm_min_idle - idle;
+    if (u->max_connections > 0 &&
+        missing > u->max_connections - u->n_connections + mk_list_size(&dead)) {
+        missing = u->max_connections - u->n_connections + mk_list_size(&dead);
     }
-#endif
+    upstream_unlock(u);
 
-#ifdef FLB_HAVE_FLUSH_PTHREADS
-    pthread_mutex_lock(&u->mutex_queue);
-#endif
+    mk_list_foreach_safe(head, tmp, &dead) {
+        conn = mk_list_entry(head, struct flb_upstream_conn, _head);
+        flb_debug("[upstream] [fd=%i] warm-up: closing idle connection",
+                  conn->fd);
+        destroy_conn(conn);
+    }
 
-    /* remove connection from the queue */
-    mk_list_del(&u_conn->_head);
+    return missing;
+}
 
-#ifdef FLB_HAVE_FLUSH_PTHREADS
-    pthread_mutex_unlock(&u->mutex_queue);
-#endif
+/* Open connections until the upstream has 'warm_min_idle' available */
+static void warm_fill(struct flb_upstream *u)
+{
+    int n = 0;
+    struct flb_upstream_conn *conn;
 
-    u->n_connections--;
-    flb_free(u_conn);
+    while (warm_check_upstream(u) > 0) {
+        upstream_lock(u);
+        if (u->max_connections > 0 &&
+            u->n_connections >= u->max_connections) {
+            upstream_unlock(u);
+            break;
+        }
+        u->n_connections++;
+        upstream_unlock(u);
+
+        /* No co-routine here: connect and handshake in blocking mode */
+        {
+            FLB_MEM_SCOPE_ENTER(FLB_MEM_UPSTREAM);
+            conn = create_conn(u);
+            FLB_MEM_SCOPE_LEAVE();
+        }
+        if (!conn) {
+            upstream_lock(u);
+            u->n_connections--;
+            upstream_unlock(u);
+            flb_debug("[upstream] %s:%i warm-up connection failed",
+                      u->tcp_host, u->tcp_port);
+            break;
+        }
+
+        /* A fresh connection, it doesn't count as recycled */
+        conn->ka_count = -1;
+        flb_upstream_conn_release(conn);
+        n++;
+    }
+
+    if (n > 0) {
+        flb_debug("[upstream] %s:%i warm-up: %i new connection(s)",
+                  u->tcp_host, u->tcp_port, n);
+    }
+}
+
+static void warm_worker(void *data)
+{
+    struct flb_upstream *u;
+    struct flb_upstream_warm *warm = data;
+
+    pthread_mutex_lock(&warm->lock);
+    while (1) {
+        while (warm->stop == FLB_FALSE &&
+               mk_list_is_empty(&warm->queue) == 0) {
+            pthread_cond_wait(&warm->cond, &warm->lock);
+        }
+        if (warm->stop == FLB_TRUE) {
+            break;
+        }
+
+        u = mk_list_entry_first(&warm->queue, struct flb_upstream,
+                                _head_warm_queue);
+        mk_list_del(&u->_head_warm_queue);
+        u->warm_queued = FLB_FALSE;
+        warm->current = u;
+        pthread_mutex_unlock(&warm->lock);
+
+        warm_fill(u);
+
+        pthread_mutex_lock(&warm->lock);
+        warm->current = NULL;
+        pthread_cond_broadcast(&warm->cond);
+    }
+    pthread_mutex_unlock(&warm->lock);
+}
+
+/* Scheduler timer, it runs in the engine thread */
+static void warm_timer(struct flb_config *config, void *data)
+{
+    int queued = 0;
+    struct mk_list *head;
+    struct flb_upstream *u;
+    struct flb_upstream_warm *warm = data;
+
+    pthread_mutex_lock(&warm->lock);
+    if (warm->stop == FLB_TRUE) {
+        pthread_mutex_unlock(&warm->lock);
+        return;
+    }
+
+    mk_list_foreach(head, &warm->upstreams) {
+        u = mk_list_entry(head, struct flb_upstream, _head_warm);
+        if (u->warm_queued == FLB_TRUE || warm->current == u) {
+            continue;
+        }
+        if (warm_check_upstream(u) > 0) {
+            mk_list_add(&u->_head_warm_queue, &warm->queue);
+            u->warm_queued = FLB_TRUE;
+            queued++;
+        }
+    }
+    if (queued > 0) {
+        pthread_cond_signal(&warm->cond);
+    }
+    pthread_mutex_unlock(&warm->lock);
+
+    if (flb_sched_timer_cb_create(config, FLB_UPSTREAM_WARM_INTERVAL,
+                                  warm_timer, warm) == -1) {
+        flb_error("[upstream] warm-up timer could not be scheduled");
+    }
+}
+
+/*
+ * Keep at least 'min_idle' connections of the upstream connected, a value
+ * of zero or less disables the warm-up. It requires keepalive, otherwise
+ * released connections are not pooled.
+ */
+int flb_upstream_set_warm(struct flb_upstream *u, int min_idle)
+{
+    struct flb_config *config = u->config;
+    struct flb_upstream_warm *warm;
+
+    if (min_idle <= 0 || u->warm_min_idle > 0) {
+        return 0;
+    }
+
+    if (u->ka_enabled == FLB_FALSE) {
+        flb_warn("[upstream] %s:%i warm-up requires keepalive, disabled",
+                 u->tcp_host, u->tcp_port);
+        return -1;
+    }
+
+    pthread_mutex_lock(&warm_ctx_lock);
+    warm = config->upstream_warm_ctx;
+    if (!warm) {
+        warm = flb_calloc(1, sizeof(struct flb_upstream_warm));
+        if (!warm) {
+            flb_errno();
+            pthread_mutex_unlock(&warm_ctx_lock);
+            return -1;
+        }
+        warm->config = config;
+        pthread_mutex_init(&warm->lock, NULL);
+        pthread_cond_init(&warm->cond, NULL);
+        mk_list_init(&warm->upstreams);
+        mk_list_init(&warm->queue);
+        config->upstream_warm_ctx = warm;
+    }
+
+    pthread_mutex_lock(&warm->lock);
+    pthread_mutex_unlock(&warm_ctx_lock);
+
+    u->warm_min_idle = min_idle;
+    mk_list_add(&u->_head_warm, &warm->upstreams);
+    pthread_mutex_unlock(&warm->lock);
+
+    flb_debug("[upstream] %s:%i warm-up min_idle=%i",
+              u->tcp_host, u->tcp_port, min_idle);
+
+    return 0;
+}
+
+/* Start the warm-up thread and timer, the scheduler must be running */
+int flb_upstream_warm_start(struct flb_config *config)
+{
+    int ret;
+    struct flb_upstream_warm *warm = config->upstream_warm_ctx;
+
+    if (!warm || warm->started == FLB_TRUE) {
+        return 0;
+    }
+
+    ret = flb_worker_create_role(warm_worker, warm, &warm->tid,
+                                 "upstream_warm", NULL, config);
+    if (ret == -1) {
+        flb_error("[upstream] could not start warm-up thread");
+        return -1;
+    }
+    warm->started = FLB_TRUE;
+
+    /* First round right away, the next ones from the scheduler */
+    warm_timer(config, warm);
 
     return 0;
 }
+
+void flb_upstream_warm_exit(struct flb_config *config)
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct flb_upstream *u;
+    struct flb_upstream_warm *warm;
+
+    pthread_mutex_lock(&warm_ctx_lock);
+    warm = config->upstream_warm_ctx;
+    config->upstream_warm_ctx = NULL;
+    pthread_mutex_unlock(&warm_ctx_lock);
+
+    if (!warm) {
+        return;
+    }
+
+    pthread_mutex_lock(&warm->lock);
+    warm->stop = FLB_TRUE;
+    pthread_cond_broadcast(&warm->cond);
+    pthread_mutex_unlock(&warm->lock);
+
+    if (warm->started == FLB_TRUE) {
+        pthread_join(warm->tid, NULL);
+    }
+
+    /* The upstreams remain, they just leave the service */
+    mk_list_foreach_safe(head, tmp, &warm->upstreams) {
+        u = mk_list_entry(head, struct flb_upstream, _head_warm);
+        mk_list_del(&u->_head_warm);
+        mk_list_init(&u->_head_warm);
+        u->warm_queued = FLB_FALSE;
+    }
+
+    pthread_mutex_destroy(&warm->lock);
+    pthread_cond_destroy(&warm->cond);
+    flb_free(warm);
+}
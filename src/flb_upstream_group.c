@@ -0,0 +1,803 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <monkey/mk_core.h>
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_log.h>
+#include <fluent-bit/flb_utils.h>
+#include <fluent-bit/flb_io.h>
+#include <fluent-bit/flb_network.h>
+#include <fluent-bit/flb_upstream_group.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netdb.h>
+#include <poll.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+/* Upper limit for a heartbeat connection attempt, in seconds */
+#define FLB_UPSTREAM_GROUP_HB_TIMEOUT   5
+
+struct flb_upstream_group *flb_upstream_group_create(int mode)
+{
+    struct flb_upstream_group *g;
+
+    g = flb_calloc(1, sizeof(struct flb_upstream_group));
+    if (!g) {
+        flb_errno();
+        return NULL;
+    }
+
+    g->mode = mode;
+    g->max_fails = FLB_UPSTREAM_GROUP_MAX_FAILS;
+    g->eject_time = FLB_UPSTREAM_GROUP_EJECT_TIME;
+    mk_list_init(&g->nodes);
+    pthread_mutex_init(&g->mutex, NULL);
+    pthread_cond_init(&g->hb_cond, NULL);
+
+    return g;
+}
+
+static struct flb_upstream_node *node_new()
+{
+    struct flb_upstream_node *node;
+
+    node = flb_calloc(1, sizeof(struct flb_upstream_node));
+    if (!node) {
+        flb_errno();
+        return NULL;
+    }
+    mk_list_init(&node->properties);
+
+    return node;
+}
+
+static void node_destroy(struct flb_upstream_node *node)
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct flb_config_prop *prop;
+
+    if (node->u) {
+        flb_upstream_destroy(node->u);
+    }
+
+#ifdef FLB_HAVE_TLS
+    if (node->tls.context) {
+        flb_tls_context_destroy(node->tls.context);
+    }
+#endif
+
+    mk_list_foreach_safe(head, tmp, &node->properties) {
+        prop = mk_list_entry(head, struct flb_config_prop, _head);
+        mk_list_del(&prop->_head);
+        flb_free(prop->key);
+        flb_free(prop->val);
+        flb_free(prop);
+    }
+
+    flb_free(node->name);
+    flb_free(node);
+}
+
+void flb_upstream_group_destroy(struct flb_upstream_group *g)
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct flb_upstream_node *node;
+
+    /* Stop the heartbeat before the nodes go away */
+    pthread_mutex_lock(&g->mutex);
+    if (g->hb_running == FLB_TRUE) {
+        g->hb_running = FLB_FALSE;
+        pthread_cond_signal(&g->hb_cond);
+        pthread_mutex_unlock(&g->mutex);
+        pthread_join(g->hb_thread, NULL);
+    }
+    else {
+        pthread_mutex_unlock(&g->mutex);
+    }
+
+    mk_list_foreach_safe(head, tmp, &g->nodes) {
+        node = mk_list_entry(head, struct flb_upstream_node, _head);
+        mk_list_del(&node->_head);
+        node_destroy(node);
+    }
+
+    pthread_cond_destroy(&g->hb_cond);
+    pthread_mutex_destroy(&g->mutex);
+    flb_free(g->name);
+    flb_free(g);
+}
+
+/* Selection mode from a configuration value, -1 if unknown */
+int flb_upstream_group_mode(char *str)
+{
+    if (strcasecmp(str, "round_robin") == 0) {
+        return FLB_UPSTREAM_GROUP_ROUND_ROBIN;
+    }
+    else if (strcasecmp(str, "least_inflight") == 0) {
+        return FLB_UPSTREAM_GROUP_LEAST_INFLIGHT;
+    }
+    else if (strcasecmp(str, "weighted") == 0) {
+        return FLB_UPSTREAM_GROUP_WEIGHTED;
+    }
+
+    return -1;
+}
+
+struct flb_upstream_node *flb_upstream_group_add(struct flb_upstream_group *g,
+                                                 struct flb_config *config,
+                                                 char *host, int port,
+                                                 int weight, int flags,
+                                                 void *tls)
+{
+    struct flb_upstream_node *node;
+
+    node = node_new();
+    if (!node) {
+        return NULL;
+    }
+
+    node->u = flb_upstream_create(config, host, port, flags, tls);
+    if (!node->u) {
+        node_destroy(node);
+        return NULL;
+    }
+    node->weight = weight > 0 ? weight : 1;
+
+    mk_list_add(&node->_head, &g->nodes);
+    g->nodes_count++;
+
+    return node;
+}
+
+/*
+ * Add the nodes of a list separated by spaces or commas, every entry is
+ * 'host[:port][@weight]':
+ *
+ *   es1:9200 es2:9200 es3:9200@2
+ */
+int flb_upstream_group_add_list(struct flb_upstream_group *g,
+                                struct flb_config *config,
+                                char *list, int default_port,
+                                int flags, void *tls)
+{
+    int port;
+    int weight;
+    int count = 0;
+    char *p;
+    char *end;
+    char *sep;
+    char *host;
+    struct mk_list *split;
+    struct mk_list *head;
+    struct flb_split_entry *entry;
+
+    split = flb_utils_split(list, ' ', 256);
+    if (!split) {
+        return -1;
+    }
+
+    mk_list_foreach(head, split) {
+        entry = mk_list_entry(head, struct flb_split_entry, _head);
+        p = entry->value;
+
+        /* Commas can separate entries too */
+        while (p && *p) {
+            end = strchr(p, ',');
+            if (end) {
+                *end = '\0';
+            }
+            if (*p == '\0') {
+                p = end ? end + 1 : NULL;
+                continue;
+            }
+
+            weight = 1;
+            sep = strchr(p, '@');
+            if (sep) {
+                *sep = '\0';
+                weight = atoi(sep + 1);
+            }
+
+            port = default_port;
+            sep = strrchr(p, ':');
+            if (sep) {
+                *sep = '\0';
+                port = atoi(sep + 1);
+            }
+            host = p;
+
+            if (*host == '\0' || port <= 0 || weight <= 0) {
+                flb_error("[upstream] invalid node '%s' in list", host);
+                flb_utils_split_free(split);
+                return -1;
+            }
+
+            if (!flb_upstream_group_add(g, config, host, port, weight,
+                                        flags, tls)) {
+                flb_utils_split_free(split);
+                return -1;
+            }
+            count++;
+
+            p = end ? end + 1 : NULL;
+        }
+    }
+    flb_utils_split_free(split);
+
+    return count;
+}
+
+char *flb_upstream_node_get_property(char *key,
+                                     struct flb_upstream_node *node)
+{
+    return flb_config_prop_get(key, &node->properties);
+}
+
+static int node_set_property(struct flb_upstream_node *node,
+                             char *key, char *val)
+{
+    struct flb_config_prop *prop;
+
+    prop = flb_calloc(1, sizeof(struct flb_config_prop));
+    if (!prop) {
+        flb_errno();
+        return -1;
+    }
+    prop->key = flb_strdup(key);
+    prop->val = flb_strdup(val);
+    if (!prop->key || !prop->val) {
+        flb_free(prop->key);
+        flb_free(prop->val);
+        flb_free(prop);
+        return -1;
+    }
+    mk_list_add(&prop->_head, &node->properties);
+
+    return 0;
+}
+
+/*
+ * Node from a [NODE] section. Without a 'tls' key the node uses the
+ * transport of the caller (flags and tls), otherwise it gets its own TLS
+ * context from the tls.* keys of the section.
+ */
+static int node_conf(struct flb_upstream_group *g, struct flb_config *config,
+                     struct mk_rconf_section *section, int default_port,
+                     int flags, void *tls)
+{
+    int port;
+    int weight = 1;
+#ifdef FLB_HAVE_TLS
+    int verify;
+    int debug;
+#endif
+    char *tmp;
+    char *host;
+    struct mk_list *head;
+    struct mk_rconf_entry *entry;
+    struct flb_upstream_node *node;
+
+    node = node_new();
+    if (!node) {
+        return -1;
+    }
+
+    mk_list_foreach(head, &section->entries) {
+        entry = mk_list_entry(head, struct mk_rconf_entry, _head);
+        if (node_set_property(node, entry->key, entry->val) == -1) {
+            node_destroy(node);
+            return -1;
+        }
+    }
+
+    tmp = flb_upstream_node_get_property("name", node);
+    if (tmp) {
+        node->name = flb_strdup(tmp);
+    }
+
+    host = flb_upstream_node_get_property("host", node);
+    if (!host) {
+        flb_error("[upstream] node '%s' has no host",
+                  node->name ? node->name : "");
+        node_destroy(node);
+        return -1;
+    }
+
+    port = default_port;
+    tmp = flb_upstream_node_get_property("port", node);
+    if (tmp) {
+        port = atoi(tmp);
+    }
+    tmp = flb_upstream_node_get_property("weight", node);
+    if (tmp) {
+        weight = atoi(tmp);
+    }
+    if (port <= 0 || weight <= 0) {
+        flb_error("[upstream] node %s: invalid port or weight", host);
+        node_destroy(node);
+        return -1;
+    }
+
+    tmp = flb_upstream_node_get_property("tls", node);
+    if (tmp) {
+        flags &= ~(FLB_IO_TCP | FLB_IO_TLS);
+        tls = NULL;
+        if (flb_utils_bool(tmp) == FLB_FALSE) {
+            flags |= FLB_IO_TCP;
+        }
+        else {
+#ifdef FLB_HAVE_TLS
+            tmp = flb_upstream_node_get_property("tls.verify", node);
+            verify = tmp ? flb_utils_bool(tmp) : FLB_TRUE;
+            tmp = flb_upstream_node_get_property("tls.debug", node);
+            debug = tmp ? atoi(tmp) : -1;
+
+            node->tls.context = flb_tls_context_get(
+                verify, debug,
+                flb_upstream_node_get_property("tls.ca_path", node),
+                flb_upstream_node_get_property("tls.ca_file", node),
+                flb_upstream_node_get_property("tls.crt_file", node),
+                flb_upstream_node_get_property("tls.key_file", node),
+                flb_upstream_node_get_property("tls.key_passwd", node));
+            if (!node->tls.context) {
+                flb_error("[upstream] node %s: cannot create TLS context",
+                          host);
+                node_destroy(node);
+                return -1;
+            }
+            flags |= FLB_IO_TLS;
+            tls = &node->tls;
+#else
+            flb_error("[upstream] node %s: TLS support is not built in",
+                      host);
+            node_destroy(node);
+            return -1;
+#endif
+        }
+    }
+
+    node->u = flb_upstream_create(config, host, port, flags, tls);
+    if (!node->u) {
+        node_destroy(node);
+        return -1;
+    }
+    node->weight = weight;
+
+    mk_list_add(&node->_head, &g->nodes);
+    g->nodes_count++;
+
+    return 0;
+}
+
+/*
+ * Upstream group from a file with one [UPSTREAM] section and a [NODE]
+ * section per node. Keys not known here are kept as node properties for
+ * the plugin (e.g: a per-node shared key):
+ *
+ *   [UPSTREAM]
+ *       Name               aggregators
+ *       Balance            weighted
+ *       Heartbeat_Interval 5
+ *
+ *   [NODE]
+ *       Name   agg-1
+ *       Host   10.0.0.1
+ *       Port   24224
+ *       Weight 2
+ *       tls    on
+ */
+struct flb_upstream_group *flb_upstream_group_conf_file(struct flb_config *config,
+                                                       char *file,
+                                                       int default_port,
+                                                       int flags, void *tls)
+{
+    int ret;
+    int mode = FLB_UPSTREAM_GROUP_ROUND_ROBIN;
+    int hb_interval = 0;
+    char *cfg = file;
+    char *tmp;
+    char path[PATH_MAX + 1];
+    struct stat st;
+    struct mk_list *head;
+    struct mk_rconf *fconf;
+    struct mk_rconf_section *section;
+    struct flb_upstream_group *g = NULL;
+
+    /* Relative paths are resolved from the main configuration file */
+    ret = stat(file, &st);
+    if (ret == -1 && errno == ENOENT && file[0] != '/' && config->conf_path) {
+        snprintf(path, PATH_MAX, "%s%s", config->conf_path, file);
+        cfg = path;
+    }
+
+    fconf = mk_rconf_open(cfg);
+    if (!fconf) {
+        flb_error("[upstream] cannot open upstream file %s", file);
+        return NULL;
+    }
+
+    section = mk_rconf_section_get(fconf, "UPSTREAM");
+    if (!section) {
+        flb_error("[upstream] %s: no [UPSTREAM] section", file);
+        goto error;
+    }
+
+    tmp = mk_rconf_section_get_key(section, "Balance", MK_RCONF_STR);
+    if (tmp) {
+        mode = flb_upstream_group_mode(tmp);
+        if (mode == -1) {
+            flb_error("[upstream] %s: invalid balance '%s'", file, tmp);
+        }
+        flb_free(tmp);
+        if (mode == -1) {
+            goto error;
+        }
+    }
+
+    g = flb_upstream_group_create(mode);
+    if (!g) {
+        goto error;
+    }
+    g->name = mk_rconf_section_get_key(section, "Name", MK_RCONF_STR);
+
+    tmp = mk_rconf_section_get_key(section, "Max_Fails", MK_RCONF_STR);
+    if (tmp && atoi(tmp) > 0) {
+        g->max_fails = atoi(tmp);
+    }
+    flb_free(tmp);
+    tmp = mk_rconf_section_get_key(section, "Eject_Time", MK_RCONF_STR);
+    if (tmp && atoi(tmp) >= 0) {
+        g->eject_time = atoi(tmp);
+    }
+    flb_free(tmp);
+    tmp = mk_rconf_section_get_key(section, "Heartbeat_Interval",
+                                   MK_RCONF_STR);
+    if (tmp) {
+        hb_interval = atoi(tmp);
+    }
+    flb_free(tmp);
+
+    mk_list_foreach(head, &fconf->sections) {
+        section = mk_list_entry(head, struct mk_rconf_section, _head);
+        if (strcasecmp(section->name, "NODE") != 0) {
+            continue;
+        }
+        if (node_conf(g, config, section, default_port, flags, tls) == -1) {
+            goto error;
+        }
+    }
+
+    if (g->nodes_count == 0) {
+        flb_error("[upstream] %s: no [NODE] sections", file);
+        goto error;
+    }
+
+    if (hb_interval > 0 &&
+        flb_upstream_group_heartbeat_start(g, hb_interval) == -1) {
+        goto error;
+    }
+
+    mk_rconf_free(fconf);
+    return g;
+
+ error:
+    if (g) {
+        flb_upstream_group_destroy(g);
+    }
+    mk_rconf_free(fconf);
+    return NULL;
+}
+
+/* Open a TCP connection to the node, 0 if it was accepted in time */
+static int node_probe(struct flb_upstream_node *node, int timeout)
+{
+    int ret = -1;
+    int err;
+    char port[16];
+    flb_sockfd_t fd;
+    socklen_t len;
+    struct pollfd pfd;
+    struct addrinfo hints;
+    struct addrinfo *res;
+    struct addrinfo *rp;
+
+    memset(&hints, '\0', sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(port, sizeof(port), "%i", node->u->tcp_port);
+
+    if (getaddrinfo(node->u->tcp_host, port, &hints, &res) != 0) {
+        return -1;
+    }
+
+    for (rp = res; rp && ret == -1; rp = rp->ai_next) {
+        fd = flb_net_socket_create(rp->ai_family, FLB_TRUE);
+        if (fd == -1) {
+            continue;
+        }
+
+        if (connect(fd, rp->ai_addr, rp->ai_addrlen) == 0) {
+            ret = 0;
+        }
+        else if (errno == EINPROGRESS) {
+            pfd.fd = fd;
+            pfd.events = POLLOUT;
+            if (poll(&pfd, 1, timeout * 1000) == 1) {
+                err = 0;
+                len = sizeof(err);
+                if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 &&
+                    err == 0) {
+                    ret = 0;
+                }
+            }
+        }
+        close(fd);
+    }
+    freeaddrinfo(res);
+
+    return ret;
+}
+
+static void *heartbeat_worker(void *data)
+{
+    int ret;
+    int timeout;
+    struct timespec ts;
+    struct mk_list *head;
+    struct flb_upstream_node *node;
+    struct flb_upstream_group *g = data;
+
+    timeout = g->hb_interval;
+    if (timeout > FLB_UPSTREAM_GROUP_HB_TIMEOUT) {
+        timeout = FLB_UPSTREAM_GROUP_HB_TIMEOUT;
+    }
+
+    pthread_mutex_lock(&g->mutex);
+    while (g->hb_running == FLB_TRUE) {
+        pthread_mutex_unlock(&g->mutex);
+
+        /* The list of nodes does not change once the group is running */
+        mk_list_foreach(head, &g->nodes) {
+            node = mk_list_entry(head, struct flb_upstream_node, _head);
+            ret = node_probe(node, timeout);
+
+            pthread_mutex_lock(&g->mutex);
+            if (ret == -1 && node->down == FLB_FALSE) {
+                flb_warn("[upstream] node %s:%i heartbeat failed, "
+                         "marked as down",
+                         node->u->tcp_host, node->u->tcp_port);
+                node->down = FLB_TRUE;
+            }
+            else if (ret == 0 && node->down == FLB_TRUE) {
+                flb_info("[upstream] node %s:%i heartbeat is back",
+                         node->u->tcp_host, node->u->tcp_port);
+                node->down = FLB_FALSE;
+            }
+            pthread_mutex_unlock(&g->mutex);
+        }
+
+        pthread_mutex_lock(&g->mutex);
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += g->hb_interval;
+        while (g->hb_running == FLB_TRUE) {
+            if (pthread_cond_timedwait(&g->hb_cond, &g->mutex, &ts) != 0) {
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&g->mutex);
+
+    return NULL;
+}
+
+int flb_upstream_group_heartbeat_start(struct flb_upstream_group *g,
+                                       int interval)
+{
+    int ret;
+
+    if (g->hb_running == FLB_TRUE || interval <= 0) {
+        return -1;
+    }
+
+    g->hb_interval = interval;
+    g->hb_running = FLB_TRUE;
+    ret = pthread_create(&g->hb_thread, NULL, heartbeat_worker, g);
+    if (ret != 0) {
+        flb_error("[upstream] cannot start heartbeat thread");
+        g->hb_running = FLB_FALSE;
+        return -1;
+    }
+
+    return 0;
+}
+
+static inline int node_available(struct flb_upstream_node *node, time_t now)
+{
+    return (node->down == FLB_FALSE && node->ejected_until <= now);
+}
+
+/* Next available node after the cursor */
+static struct flb_upstream_node *pick_round_robin(struct flb_upstream_group *g,
+                                                  time_t now)
+{
+    int i;
+    struct mk_list *head;
+    struct flb_upstream_node *node;
+
+    head = g->last ? &g->last->_head : &g->nodes;
+    for (i = 0; i <= g->nodes_count; i++) {
+        head = head->next;
+        if (head == &g->nodes) {
+            head = head->next;
+        }
+        node = mk_list_entry(head, struct flb_upstream_node, _head);
+        if (node_available(node, now)) {
+            return node;
+        }
+    }
+
+    return NULL;
+}
+
+/* Fewest requests in progress, ties are broken in round robin order */
+static struct flb_upstream_node *pick_least_inflight(struct flb_upstream_group *g,
+                                                     time_t now)
+{
+    int i;
+    struct mk_list *head;
+    struct flb_upstream_node *node;
+    struct flb_upstream_node *best = NULL;
+
+    head = g->last ? &g->last->_head : &g->nodes;
+    for (i = 0; i < g->nodes_count; i++) {
+        head = head->next;
+        if (head == &g->nodes) {
+            head = head->next;
+        }
+        node = mk_list_entry(head, struct flb_upstream_node, _head);
+        if (!node_available(node, now)) {
+            continue;
+        }
+        if (!best || node->inflight < best->inflight) {
+            best = node;
+        }
+    }
+
+    return best;
+}
+
+/*
+ * Smooth weighted round robin: every available node adds its weight to its
+ * current value, the highest wins and gives back the total. A node of
+ * weight 2 among two of weight 1 is picked every other time, not twice in
+ * a row.
+ */
+static struct flb_upstream_node *pick_weighted(struct flb_upstream_group *g,
+                                               time_t now)
+{
+    int total = 0;
+    struct mk_list *head;
+    struct flb_upstream_node *node;
+    struct flb_upstream_node *best = NULL;
+
+    mk_list_foreach(head, &g->nodes) {
+        node = mk_list_entry(head, struct flb_upstream_node, _head);
+        if (!node_available(node, now)) {
+            continue;
+        }
+        node->current += node->weight;
+        total += node->weight;
+        if (!best || node->current > best->current) {
+            best = node;
+        }
+    }
+
+    if (best) {
+        best->current -= total;
+    }
+
+    return best;
+}
+
+struct flb_upstream_node *flb_upstream_group_node_get(struct flb_upstream_group *g)
+{
+    time_t now;
+    struct mk_list *head;
+    struct flb_upstream_node *node;
+    struct flb_upstream_node *node_next = NULL;
+
+    if (g->nodes_count == 0) {
+        return NULL;
+    }
+
+    now = time(NULL);
+    pthread_mutex_lock(&g->mutex);
+
+    if (g->mode == FLB_UPSTREAM_GROUP_LEAST_INFLIGHT) {
+        node = pick_least_inflight(g, now);
+    }
+    else if (g->mode == FLB_UPSTREAM_GROUP_WEIGHTED) {
+        node = pick_weighted(g, now);
+    }
+    else {
+        node = pick_round_robin(g, now);
+    }
+
+    /*
+     * Every node is ejected or down: try the one that comes back first,
+     * a node with a working heartbeat goes before one without it.
+     */
+    if (!node) {
+        mk_list_foreach(head, &g->nodes) {
+            node_next = mk_list_entry(head, struct flb_upstream_node, _head);
+            if (!node || node_next->down < node->down ||
+                (node_next->down == node->down &&
+                 node_next->ejected_until < node->ejected_until)) {
+                node = node_next;
+            }
+        }
+    }
+
+    g->last = node;
+    node->inflight++;
+    pthread_mutex_unlock(&g->mutex);
+
+    return node;
+}
+
+void flb_upstream_group_node_release(struct flb_upstream_group *g,
+                                     struct flb_upstream_node *node,
+                                     int failed)
+{
+    pthread_mutex_lock(&g->mutex);
+
+    node->inflight--;
+    if (failed == FLB_FALSE) {
+        if (node->ejected_until > 0) {
+            flb_info("[upstream] node %s:%i is back",
+                     node->u->tcp_host, node->u->tcp_port);
+        }
+        node->fails = 0;
+        node->ejected_until = 0;
+        node->down = FLB_FALSE;
+    }
+    else {
+        /* A node back from an ejection goes out again on its first failure */
+        node->fails++;
+        if (node->fails >= g->max_fails || node->ejected_until > 0) {
+            flb_warn("[upstream] node %s:%i failed %i times, ejected for %is",
+                     node->u->tcp_host, node->u->tcp_port, node->fails,
+                     g->eject_time);
+            node->ejected_until = time(NULL) + g->eject_time;
+            node->fails = 0;
+        }
+    }
+
+    pthread_mutex_unlock(&g->mutex);
+}
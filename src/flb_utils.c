@@ -473,14 +473,99 @@ void flb_utils_bytes_to_human_readable_size(size_t bytes,
 }
 
 
-static inline void encoded_to_buf(char *out, char *in, int len)
+#define UTILS_BYTES(c)  (0x0101010101010101ULL * (c))
+
+/*
+ * Number of leading bytes of 'str' that can be written as they are. Eight
+ * bytes are checked at once for control characters, quotes, backslashes and
+ * non-ASCII bytes, the usual record is copied in a few steps.
+ */
+static inline size_t utils_json_plain(char *str, size_t len)
 {
-    int i;
-    char *p = out;
+    size_t i = 0;
+    uint64_t v;
+    uint64_t x;
+    uint64_t m;
+    unsigned char c;
+
+    while (i + 8 <= len) {
+        memcpy(&v, str + i, 8);
+
+        m = (v - UTILS_BYTES(0x20)) & ~v;
+        x = v ^ UTILS_BYTES('"');
+        m |= (x - UTILS_BYTES(0x01)) & ~x;
+        x = v ^ UTILS_BYTES('\\');
+        m |= (x - UTILS_BYTES(0x01)) & ~x;
+        x = v ^ UTILS_BYTES(0x7f);
+        m |= (x - UTILS_BYTES(0x01)) & ~x;
+        m |= v;
+
+        if (m & UTILS_BYTES(0x80)) {
+            break;
+        }
+        i += 8;
+    }
 
-    for (i = 0; i < len; i++) {
-        *p++ = in[i];
+    while (i < len) {
+        c = str[i];
+        if (c < 0x20 || c >= 0x7f || c == '"' || c == '\\') {
+            break;
+        }
+        i++;
     }
+
+    return i;
+}
+
+/*
+ * Escape the character at 'str' into 'out' (16 bytes at least), utf-8
+ * sequences are converted to their string representation. Returns the
+ * number of bytes written and sets the input bytes consumed, or -1 if the
+ * utf-8 sequence is not valid.
+ */
+static int utils_json_escape(char *out, char *str, size_t len, int *consumed)
+{
+    int b;
+    int hex_bytes;
+    uint32_t codepoint;
+    uint32_t state;
+    unsigned char c = str[0];
+
+    *consumed = 1;
+    if (c == '\\' || c == '"') {
+        out[0] = '\\';
+        out[1] = c;
+        return 2;
+    }
+    else if (c >= '\a' && c <= '\r') {
+        out[0] = '\\';
+        out[1] = "abtnvfr"[c - '\a'];
+        return 2;
+    }
+    else if (c < 32 || c == 0x7f) {
+        return snprintf(out, 16, "\\u%.4hhx", c);
+    }
+
+    hex_bytes = flb_utf8_len(str);
+    if (hex_bytes > len) {
+        return -1;
+    }
+
+    state = FLB_UTF8_ACCEPT;
+    codepoint = 0;
+    for (b = 0; b < hex_bytes; b++) {
+        if (flb_utf8_decode(&state, &codepoint,
+                            (unsigned char) str[b]) == FLB_UTF8_ACCEPT) {
+            break;
+        }
+    }
+
+    if (state != FLB_UTF8_ACCEPT) {
+        return -1;
+    }
+
+    *consumed = hex_bytes;
+    return snprintf(out, 16, "\\u%04x", codepoint);
 }
 
 /*
@@ -491,136 +576,107 @@ static inline void encoded_to_buf(char *out, char *in, int len)
 int flb_utils_write_str(char *buf, int *off, size_t size,
                         char *str, size_t str_len)
 {
-    int i;
-    int b;
-    int ret;
-    int written = 0;
-    int required;
+    int n;
     int len;
-    int hex_bytes;
-    uint32_t codepoint;
-    uint32_t state = 0;
+    size_t i = 0;
+    size_t plain;
     char tmp[16];
-    size_t available;
-    uint32_t c;
     char *p;
-    uint8_t *s;
+    char *end;
 
-    available = (size - *off);
-    required = str_len;
-    if (available <= required) {
+    if ((size - *off) <= str_len) {
         return FLB_FALSE;
     }
 
-    written = *off;
     p = buf + *off;
-    for (i = 0; i < str_len; i++) {
-        if ((available - written) < 2) {
-            return FLB_FALSE;
+    end = buf + size;
+    while (i < str_len) {
+        plain = utils_json_plain(str + i, str_len - i);
+        if (plain > 0) {
+            if (end - p <= plain) {
+                return FLB_FALSE;
+            }
+            memcpy(p, str + i, plain);
+            p += plain;
+            i += plain;
+            continue;
         }
 
-        c = (uint32_t) str[i];
-        if (c == '\\' || c == '"') {
-            *p++ = '\\';
-            *p++ = c;
-        }
-        else if (c >= '\a' && c <= '\r') {
-            *p++ = '\\';
-            switch (c) {
-            case '\n':
-                *p++ = 'n';
-                break;
-            case '\t':
-                *p++ = 't';
-                break;
-            case '\b':
-                *p++ = 'b';
-                break;
-            case '\f':
-                *p++ = 'f';
-                break;
-            case '\r':
-                *p++ = 'r';
-                break;
-            case '\a':
-                *p++ = 'a';
-                break;
-            case '\v':
-                *p++ = 'v';
-                break;
-            }
+        len = utils_json_escape(tmp, str + i, str_len - i, &n);
+        if (len == -1) {
+            /* Invalid UTF-8 hex, just skip utf-8 bytes */
+            flb_warn("[pack] invalid UTF-8 bytes, skipping");
+            break;
         }
-        else if (c < 32 || c == 0x7f) {
-            if ((available - written) < 6) {
-                return FLB_FALSE;
-            }
-            len = snprintf(tmp, sizeof(tmp) - 1, "\\u%.4hhx", (unsigned char) c);
-            encoded_to_buf(p, tmp, len);
-            p += len;
+        if (end - p <= len) {
+            return FLB_FALSE;
         }
-        else if (c >= 0x80 && c <= 0xFFFF) {
-            hex_bytes = flb_utf8_len(str + i);
-            if ((available - written) < (2 + hex_bytes)) {
-                return FLB_FALSE;
-            }
+        memcpy(p, tmp, len);
+        p += len;
+        i += n;
+    }
 
-            state = FLB_UTF8_ACCEPT;
-            codepoint = 0;
-            for (b = 0; b < hex_bytes; b++) {
-                s = (unsigned char *) str + i + b;
-                ret = flb_utf8_decode(&state, &codepoint, *s);
-                if (ret == 0) {
-                    break;
-                }
-            }
+    *off = p - buf;
+    return FLB_TRUE;
+}
 
-            if (state != FLB_UTF8_ACCEPT) {
-                /* Invalid UTF-8 hex, just skip utf-8 bytes */
-                break;
-            }
-            else {
-                len = snprintf(tmp, sizeof(tmp) - 1, "\\u%.4x", codepoint);
-                encoded_to_buf(p, tmp, len);
-                p += len;
-            }
-            i += (hex_bytes - 1);
-        }
-        else if (c > 0xFFFF) {
-            hex_bytes = flb_utf8_len(str + i);
-            if ((available - written) < (4 + hex_bytes)) {
-                return FLB_FALSE;
-            }
+/*
+ * Same as flb_utils_write_str() but appending to a sds string, it grows as
+ * needed. Returns 0 on success or -1 if the buffer could not be extended.
+ */
+int flb_utils_write_str_sds(flb_sds_t *s, char *str, size_t str_len)
+{
+    int n;
+    int len;
+    size_t i = 0;
+    size_t plain;
+    size_t off;
+    flb_sds_t buf;
 
-            state = FLB_UTF8_ACCEPT;
-            codepoint = 0;
-            for (b = 0; b < hex_bytes; b++) {
-                s = (unsigned char *) str + i + b;
-                ret = flb_utf8_decode(&state, &codepoint, *s);
-                if (ret == 0) {
-                    break;
-                }
-            }
+    buf = flb_sds_reserve(*s, str_len);
+    if (!buf) {
+        return -1;
+    }
+    *s = buf;
 
-            if (state != FLB_UTF8_ACCEPT) {
-                /* Invalid UTF-8 hex, just skip utf-8 bytes */
-                flb_warn("[pack] invalid UTF-8 bytes, skipping");
-                break;
+    off = flb_sds_len(buf);
+    while (i < str_len) {
+        plain = utils_json_plain(str + i, str_len - i);
+        if (plain > 0) {
+            buf = flb_sds_reserve(buf, plain);
+            if (!buf) {
+                goto error;
             }
-            else {
-                len = snprintf(tmp, sizeof(tmp) - 1, "\\u%04x", codepoint);
-                encoded_to_buf(p, tmp, len);
-                p += len;
-            }
-            i += (hex_bytes - 1);
+            memcpy(buf + off, str + i, plain);
+            off += plain;
+            i += plain;
+            flb_sds_len_set(buf, off);
+            *s = buf;
+            continue;
         }
-        else {
-            *p++ = c;
+
+        buf = flb_sds_reserve(buf, 16 + (str_len - i));
+        if (!buf) {
+            goto error;
         }
-        written = (p - (buf + *off));
+        *s = buf;
+
+        len = utils_json_escape(buf + off, str + i, str_len - i, &n);
+        if (len == -1) {
+            flb_warn("[pack] invalid UTF-8 bytes, skipping");
+            break;
+        }
+        off += len;
+        i += n;
+        flb_sds_len_set(buf, off);
     }
 
-    *off += written;
-    return FLB_TRUE;
+    buf[off] = '\0';
+    return 0;
+
+ error:
+    (*s)[flb_sds_len(*s)] = '\0';
+    return -1;
 }
 
 
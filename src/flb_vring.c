@@ -0,0 +1,174 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_log.h>
+#include <fluent-bit/flb_macros.h>
+#include <fluent-bit/flb_vring.h>
+
+#if defined(__linux__) && defined(SYS_memfd_create)
+#define FLB_VRING_MIRROR
+#define FLB_VRING_MFD_CLOEXEC  0x0001U
+#endif
+
+static size_t vring_round(size_t size)
+{
+    size_t page;
+
+    page = sysconf(_SC_PAGESIZE);
+    return ((size + page - 1) / page) * page;
+}
+
+#ifdef FLB_VRING_MIRROR
+/*
+ * Reserve twice the size of address space, then map the same memory file
+ * in both halves. The file descriptor is not needed once mapped.
+ */
+static char *vring_map(size_t size)
+{
+    int fd;
+    int ret;
+    char *base;
+    void *p;
+
+    fd = syscall(SYS_memfd_create, "flb_vring", FLB_VRING_MFD_CLOEXEC);
+    if (fd == -1) {
+        return NULL;
+    }
+
+    ret = ftruncate(fd, size);
+    if (ret == -1) {
+        close(fd);
+        return NULL;
+    }
+
+    base = mmap(NULL, size * 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+
+    p = mmap(base, size, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_FIXED, fd, 0);
+    if (p == MAP_FAILED) {
+        munmap(base, size * 2);
+        close(fd);
+        return NULL;
+    }
+
+    p = mmap(base + size, size, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_FIXED, fd, 0);
+    if (p == MAP_FAILED) {
+        munmap(base, size * 2);
+        close(fd);
+        return NULL;
+    }
+
+    close(fd);
+    return base;
+}
+#endif
+
+int flb_vring_create(struct flb_vring *ring, size_t size)
+{
+    ring->head = 0;
+    ring->size = vring_round(size);
+
+#ifdef FLB_VRING_MIRROR
+    ring->data = vring_map(ring->size);
+    if (ring->data) {
+        ring->mirrored = FLB_TRUE;
+        return 0;
+    }
+    flb_debug("[vring] double mapping not available, using heap buffer");
+#endif
+
+    ring->mirrored = FLB_FALSE;
+    ring->data = flb_malloc(ring->size);
+    if (!ring->data) {
+        flb_errno();
+        return -1;
+    }
+
+    return 0;
+}
+
+void flb_vring_destroy(struct flb_vring *ring)
+{
+    if (!ring->data) {
+        return;
+    }
+
+    if (ring->mirrored == FLB_TRUE) {
+        munmap(ring->data, ring->size * 2);
+    }
+    else {
+        flb_free(ring->data);
+    }
+    ring->data = NULL;
+}
+
+/* Change the ring size keeping the 'len' pending bytes */
+int flb_vring_resize(struct flb_vring *ring, size_t size, size_t len)
+{
+    int ret;
+    struct flb_vring tmp;
+
+    if (len > size) {
+        return -1;
+    }
+
+    ret = flb_vring_create(&tmp, size);
+    if (ret == -1) {
+        return -1;
+    }
+
+    memcpy(tmp.data, flb_vring_start(ring), len);
+    flb_vring_destroy(ring);
+    *ring = tmp;
+
+    return 0;
+}
+
+/* Release 'bytes' from the front, 'len' is the number of pending bytes */
+void flb_vring_consume(struct flb_vring *ring, size_t bytes, size_t len)
+{
+    if (bytes == 0) {
+        return;
+    }
+
+    if (ring->mirrored == FLB_TRUE) {
+        ring->head += bytes;
+        if (ring->head >= ring->size) {
+            ring->head -= ring->size;
+        }
+        return;
+    }
+
+    memmove(ring->data, ring->data + bytes, len - bytes);
+}
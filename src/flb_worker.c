@@ -17,16 +17,31 @@
  *  limitations under the License.
  */
 
+#define _GNU_SOURCE
+
 #include <monkey/mk_core.h>
 #include <fluent-bit/flb_info.h>
 #include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_str.h>
 #include <fluent-bit/flb_utils.h>
 #include <fluent-bit/flb_config.h>
 #include <fluent-bit/flb_worker.h>
 #include <fluent-bit/flb_log.h>
 
+#include <ctype.h>
+#include <string.h>
+
+#ifdef FLB_HAVE_AFFINITY
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
+
 FLB_TLS_DEFINE(struct flb_worker, flb_worker_ctx);
 
+/* Workers are registered from many threads and listed by the HTTP server */
+static pthread_mutex_t workers_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /*
  * The step_callback runs in a POSIX thread context, it have been started
  * by flb_worker_create(...). Here we setup specific FLB requirements and
@@ -34,20 +49,23 @@ FLB_TLS_DEFINE(struct flb_worker, flb_worker_ctx);
  */
 static void step_callback(void *data)
 {
-    int ret;
     struct flb_worker *worker = data;
 
     /* Set the worker context global */
     FLB_TLS_SET(flb_worker_ctx, worker);
 
-    /* Initialize worker-required data */
-    ret = flb_log_worker_init(worker);
-    if (ret == -1) {
-        fprintf(stderr, "[worker] error initializing log-worker context\n");
+#ifdef FLB_HAVE_AFFINITY
+    worker->os_tid = syscall(SYS_gettid);
+#endif
+
+    /* Pin the thread before it allocates its own buffers */
+    if (worker->cpus) {
+        flb_worker_cpus_apply(worker->cpus);
     }
 
     /* not too scary :) */
     worker->func(worker->data);
+    worker->running = FLB_FALSE;
 
     /* FIXME: add a good plan for pthread_exit and 'worker' release */
     pthread_exit(NULL);
@@ -64,11 +82,23 @@ static void step_callback(void *data)
  */
 int flb_worker_create(void (*func) (void *), void *arg, pthread_t *tid,
                       struct flb_config *config)
+{
+    return flb_worker_create_role(func, arg, tid, "worker", NULL, config);
+}
+
+/*
+ * Same as flb_worker_create() but the thread is reported with the given
+ * role and it runs on the 'cpus' set, or on the service 'CPU_Affinity'
+ * set if 'cpus' is NULL.
+ */
+int flb_worker_create_role(void (*func) (void *), void *arg, pthread_t *tid,
+                           const char *role, struct flb_worker_cpus *cpus,
+                           struct flb_config *config)
 {
     int ret;
     struct flb_worker *worker;
 
-    worker = flb_malloc(sizeof(struct flb_worker));
+    worker = flb_calloc(1, sizeof(struct flb_worker));
     if (!worker) {
         perror("malloc");
         return -1;
@@ -77,26 +107,79 @@ int flb_worker_create(void (*func) (void *), void *arg, pthread_t *tid,
     worker->data   = arg;
     worker->config = config;
     worker->log_ctx = config->log;
+    worker->running = FLB_TRUE;
+    worker->cpus = cpus ? cpus : config->cpu_affinity;
+    snprintf(worker->role, sizeof(worker->role) - 1, "%s", role);
 
-    /* Initialize log-specific */
-    ret = flb_log_worker_init(worker);
-    if (ret == -1) {
-        flb_free(worker);
-        return -1;
-    }
+    /* Registered first, the thread may look itself up right away */
+    pthread_mutex_lock(&workers_lock);
+    mk_list_add(&worker->_head, &config->workers);
 
     /* Spawn the step_callback and the func() */
     ret = mk_utils_worker_spawn(step_callback, worker, &worker->tid);
     if (ret != 0) {
+        mk_list_del(&worker->_head);
+        pthread_mutex_unlock(&workers_lock);
         flb_free(worker);
         return -1;
     }
     memcpy(tid, &worker->tid, sizeof(pthread_t));
-    mk_list_add(&worker->_head, &config->workers);
+    pthread_mutex_unlock(&workers_lock);
 
     return 0;
 }
 
+/*
+ * Run func() for every argument, on up to 'max' workers at the same time,
+ * and wait for all of them. If a worker cannot be spawned the call runs
+ * on the current thread.
+ */
+void flb_worker_run_all(void (*func) (void *), void **args, int n, int max,
+                        struct flb_config *config)
+{
+    int i;
+    int j;
+    int ret;
+    int running;
+    pthread_t *tids;
+    int *spawned;
+
+    if (max < 1) {
+        max = 1;
+    }
+
+    tids = flb_malloc(sizeof(pthread_t) * max);
+    spawned = flb_malloc(sizeof(int) * max);
+    if (!tids || !spawned || max == 1 || n == 1) {
+        flb_free(tids);
+        flb_free(spawned);
+        for (i = 0; i < n; i++) {
+            func(args[i]);
+        }
+        return;
+    }
+
+    for (i = 0; i < n; i += running) {
+        running = (n - i < max) ? n - i : max;
+        for (j = 0; j < running; j++) {
+            ret = flb_worker_create_role(func, args[i + j], &tids[j],
+                                         "init", NULL, config);
+            spawned[j] = (ret == 0);
+            if (ret != 0) {
+                func(args[i + j]);
+            }
+        }
+        for (j = 0; j < running; j++) {
+            if (spawned[j]) {
+                pthread_join(tids[j], NULL);
+            }
+        }
+    }
+
+    flb_free(tids);
+    flb_free(spawned);
+}
+
 /*
  * The worker interface aims to prepare any context required by Threads when
  * running, this function is called just one time.
@@ -113,15 +196,19 @@ struct flb_worker *flb_worker_lookup(pthread_t tid, struct flb_config *config)
 {
     struct mk_list *head;
     struct flb_worker *worker;
+    struct flb_worker *found = NULL;
 
+    pthread_mutex_lock(&workers_lock);
     mk_list_foreach(head, &config->workers) {
         worker = mk_list_entry(head, struct flb_worker, _head);
         if (pthread_equal(worker->tid, tid) != 0) {
-            return worker;
+            found = worker;
+            break;
         }
     }
+    pthread_mutex_unlock(&workers_lock);
 
-    return NULL;
+    return found;
 }
 
 struct flb_worker *flb_worker_get()
@@ -136,12 +223,14 @@ int flb_worker_exit(struct flb_config *config)
     struct mk_list *head;
     struct flb_worker *worker;
 
+    pthread_mutex_lock(&workers_lock);
     mk_list_foreach_safe(head, tmp, &config->workers) {
         worker = mk_list_entry(head, struct flb_worker, _head);
         mk_list_del(&worker->_head);
         flb_free(worker);
         c++;
     }
+    pthread_mutex_unlock(&workers_lock);
 
     return c;
 }
@@ -151,3 +240,173 @@ int flb_worker_log_level(struct flb_worker *worker)
     struct flb_log *log = worker->log_ctx;
     return log->level;
 };
+
+static void pack_str(msgpack_packer *mp_pck, char *str)
+{
+    int len = strlen(str);
+
+    msgpack_pack_str(mp_pck, len);
+    msgpack_pack_str_body(mp_pck, str, len);
+}
+
+/* Pack the running workers as an array of {role, tid, cpus} maps */
+void flb_worker_pack(struct flb_config *config, msgpack_packer *mp_pck)
+{
+    int n = 0;
+    struct mk_list *head;
+    struct flb_worker *worker;
+
+    pthread_mutex_lock(&workers_lock);
+    mk_list_foreach(head, &config->workers) {
+        worker = mk_list_entry(head, struct flb_worker, _head);
+        if (worker->running == FLB_TRUE) {
+            n++;
+        }
+    }
+
+    msgpack_pack_array(mp_pck, n);
+    mk_list_foreach(head, &config->workers) {
+        worker = mk_list_entry(head, struct flb_worker, _head);
+        if (worker->running == FLB_FALSE) {
+            continue;
+        }
+        msgpack_pack_map(mp_pck, 3);
+        pack_str(mp_pck, "role");
+        pack_str(mp_pck, worker->role);
+        pack_str(mp_pck, "tid");
+        msgpack_pack_int(mp_pck, worker->os_tid);
+        pack_str(mp_pck, "cpus");
+        if (worker->cpus) {
+            pack_str(mp_pck, worker->cpus->list);
+        }
+        else {
+            msgpack_pack_nil(mp_pck);
+        }
+    }
+    pthread_mutex_unlock(&workers_lock);
+}
+
+static inline void cpus_set(struct flb_worker_cpus *cpus, int cpu)
+{
+    if (!(cpus->mask[cpu / 8] & (1 << (cpu % 8)))) {
+        cpus->mask[cpu / 8] |= (1 << (cpu % 8));
+        cpus->count++;
+    }
+}
+
+static inline int cpus_isset(struct flb_worker_cpus *cpus, int cpu)
+{
+    return (cpus->mask[cpu / 8] & (1 << (cpu % 8))) != 0;
+}
+
+/* Parse a CPU list like '0-3,8', returns NULL if it's not valid */
+struct flb_worker_cpus *flb_worker_cpus_create(const char *list)
+{
+    int i;
+    long first;
+    long last;
+    char *end;
+    const char *p = list;
+    struct flb_worker_cpus *cpus;
+
+    cpus = flb_calloc(1, sizeof(struct flb_worker_cpus));
+    if (!cpus) {
+        flb_errno();
+        return NULL;
+    }
+
+    while (*p) {
+        while (*p == ' ') {
+            p++;
+        }
+        if (!isdigit(*p)) {
+            goto error;
+        }
+        first = strtol(p, &end, 10);
+        last = first;
+        p = end;
+
+        if (*p == '-') {
+            p++;
+            if (!isdigit(*p)) {
+                goto error;
+            }
+            last = strtol(p, &end, 10);
+            p = end;
+        }
+        while (*p == ' ') {
+            p++;
+        }
+
+        if (first > last || last >= FLB_WORKER_CPUS_MAX) {
+            goto error;
+        }
+        for (i = first; i <= last; i++) {
+            cpus_set(cpus, i);
+        }
+
+        if (*p == ',') {
+            p++;
+        }
+        else if (*p != '\0') {
+            goto error;
+        }
+    }
+
+    if (cpus->count == 0) {
+        goto error;
+    }
+
+    cpus->list = flb_strdup(list);
+    if (!cpus->list) {
+        flb_errno();
+        flb_free(cpus);
+        return NULL;
+    }
+    return cpus;
+
+ error:
+    flb_error("[worker] invalid CPU list '%s'", list);
+    flb_free(cpus);
+    return NULL;
+}
+
+void flb_worker_cpus_destroy(struct flb_worker_cpus *cpus)
+{
+    if (!cpus) {
+        return;
+    }
+
+    flb_free(cpus->list);
+    flb_free(cpus);
+}
+
+/* Restrict the calling thread to the CPU set */
+int flb_worker_cpus_apply(struct flb_worker_cpus *cpus)
+{
+#ifdef FLB_HAVE_AFFINITY
+    int i;
+    int ret;
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    for (i = 0; i < FLB_WORKER_CPUS_MAX && i < CPU_SETSIZE; i++) {
+        if (cpus_isset(cpus, i)) {
+            CPU_SET(i, &set);
+        }
+    }
+
+    ret = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set);
+    if (ret != 0) {
+        flb_warn("[worker] could not set CPU affinity '%s': %s",
+                 cpus->list, strerror(ret));
+        return -1;
+    }
+
+    return 0;
+#else
+    (void) cpus_isset;
+    flb_warn("[worker] CPU affinity is not supported on this platform");
+    return -1;
+#endif
+}
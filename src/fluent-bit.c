@@ -41,6 +41,8 @@
 #include <fluent-bit/flb_str.h>
 #include <fluent-bit/flb_plugin_proxy.h>
 #include <fluent-bit/flb_parser.h>
+#include <fluent-bit/flb_reload.h>
+#include <fluent-bit/flb_sp.h>
 
 /* Libbacktrace support */
 #ifdef FLB_HAVE_LIBBACKTRACE
@@ -114,6 +116,7 @@ struct flb_config *config;
 
 static void flb_help(int rc, struct flb_config *config)
 {
+    int i;
     struct mk_list *head;
     struct flb_input_plugin *in;
     struct flb_output_plugin *out;
@@ -154,8 +157,8 @@ static void flb_help(int rc, struct flb_config *config)
     printf("%sInputs%s\n", ANSI_BOLD, ANSI_RESET);
 
     /* Iterate each supported input */
-    mk_list_foreach(head, &config->in_plugins) {
-        in = mk_list_entry(head, struct flb_input_plugin, _head);
+    for (i = 0; flb_in_plugins[i]; i++) {
+        in = flb_in_plugins[i];
         if (strcmp(in->name, "lib") == 0) {
             /* useless..., just skip it. */
             continue;
@@ -163,18 +166,22 @@ static void flb_help(int rc, struct flb_config *config)
         printf("  %-22s%s\n", in->name, in->description);
     }
     printf("\n%sOutputs%s\n", ANSI_BOLD, ANSI_RESET);
-    mk_list_foreach(head, &config->out_plugins) {
-        out = mk_list_entry(head, struct flb_output_plugin, _head);
+    for (i = 0; flb_out_plugins[i]; i++) {
+        out = flb_out_plugins[i];
         if (strcmp(out->name, "lib") == 0) {
             /* useless..., just skip it. */
             continue;
         }
         printf("  %-22s%s\n", out->name, out->description);
     }
+    mk_list_foreach(head, &config->out_plugins) {
+        out = mk_list_entry(head, struct flb_output_plugin, _head);
+        printf("  %-22s%s\n", out->name, out->description);
+    }
 
     printf("\n%sFilters%s\n", ANSI_BOLD, ANSI_RESET);
-    mk_list_foreach(head, &config->filter_plugins) {
-        filter = mk_list_entry(head, struct flb_filter_plugin, _head);
+    for (i = 0; flb_filter_plugins[i]; i++) {
+        filter = flb_filter_plugins[i];
         printf("  %-22s%s\n", filter->name, filter->description);
     }
 
@@ -218,10 +225,17 @@ static void flb_signal_handler(int signal)
 
     /* Signal handlers */
     switch (signal) {
+#ifndef _WIN32
+    case SIGHUP:
+        /* Hot_Reload: reload the configuration instead of exiting */
+        if (flb_reload_request(config) == 0) {
+            break;
+        }
+        /* fall through */
+#endif
     case SIGINT:
 #ifndef _WIN32
     case SIGQUIT:
-    case SIGHUP:
 #endif
         flb_engine_shutdown(config);
 #ifdef FLB_HAVE_MTRACE
@@ -351,6 +365,7 @@ static int flb_service_conf_path_set(struct flb_config *config, char *file)
     if (!p) {
         return -1;
     }
+    config->conf_file = flb_strdup(path);
 
     /* lookup path ending and truncate */
     end = strrchr(path, '/');
@@ -378,6 +393,9 @@ static int flb_service_conf(struct flb_config *config, char *file)
     struct flb_input_instance *in;
     struct flb_output_instance *out;
     struct flb_filter_instance *filter;
+#ifdef FLB_HAVE_STREAM_PROCESSOR
+    struct flb_sp_task *task;
+#endif
 
     fconf = mk_rconf_open(file);
     if (!fconf) {
@@ -400,7 +418,8 @@ static int flb_service_conf(struct flb_config *config, char *file)
         if (strcasecmp(section->name, "SERVICE") == 0 ||
             strcasecmp(section->name, "INPUT") == 0 ||
             strcasecmp(section->name, "FILTER") == 0 ||
-            strcasecmp(section->name, "OUTPUT") == 0) {
+            strcasecmp(section->name, "OUTPUT") == 0 ||
+            strcasecmp(section->name, "STREAM_TASK") == 0) {
 
             /* continue on valid sections */
             continue;
@@ -548,6 +567,41 @@ static int flb_service_conf(struct flb_config *config, char *file)
         }
     }
 
+    /* Read all [STREAM_TASK] sections */
+    mk_list_foreach(head, &fconf->sections) {
+        section = mk_list_entry(head, struct mk_rconf_section, _head);
+        if (strcasecmp(section->name, "STREAM_TASK") != 0) {
+            continue;
+        }
+
+#ifdef FLB_HAVE_STREAM_PROCESSOR
+        name = s_get_key(section, "Name", MK_RCONF_STR);
+        if (!name) {
+            flb_service_conf_err(section, "Name");
+            goto flb_service_conf_end;
+        }
+        tmp = s_get_key(section, "Exec", MK_RCONF_STR);
+        if (!tmp) {
+            mk_mem_free(name);
+            flb_service_conf_err(section, "Exec");
+            goto flb_service_conf_end;
+        }
+
+        task = flb_sp_task_create(config, name, tmp);
+        mk_mem_free(name);
+        mk_mem_free(tmp);
+        if (!task) {
+            flb_service_conf_err(section, "Exec");
+            goto flb_service_conf_end;
+        }
+#else
+        fprintf(stderr,
+                "Error: [STREAM_TASK] requires the stream processor, "
+                "it's not built in.\n");
+        goto flb_service_conf_end;
+#endif
+    }
+
     ret = 0;
 
  flb_service_conf_end:
@@ -0,0 +1,400 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_pack.h>
+#include <fluent-bit/flb_input.h>
+#include <fluent-bit/flb_output.h>
+#include <fluent-bit/flb_metrics.h>
+#include <fluent-bit/flb_engine_shard.h>
+
+#include <fluent-bit/flb_http_server.h>
+#include <msgpack.h>
+
+/*
+ * Pipeline health
+ * ===============
+ *
+ * /api/v1/health/live reports if the engine loop is still running: its
+ * flush timer must have ticked in the last 'HC_Stall_Timeout' seconds (at
+ * least three flush intervals). It is meant for a liveness probe.
+ *
+ * /api/v1/health adds the state of the pipeline, meant for a readiness
+ * probe: paused inputs, usage of the tasks map, pending retries, bytes
+ * buffered by the inputs and their tasks, output errors and exhausted
+ * retries counted over the last one or two 'HC_Period'. A failed check
+ * answers 503, every check is reported in the JSON body.
+ *
+ * With engine shards the checks cover all of them: the oldest heartbeat,
+ * the sum of the tasks, retries and buffered bytes.
+ */
+
+static void pack_str(msgpack_packer *mp_pck, char *str)
+{
+    int len = strlen(str);
+
+    msgpack_pack_str(mp_pck, len);
+    msgpack_pack_str_body(mp_pck, str, len);
+}
+
+static void pack_ok(msgpack_packer *mp_pck, int ok)
+{
+    pack_str(mp_pck, "ok");
+    if (ok) {
+        msgpack_pack_true(mp_pck);
+    }
+    else {
+        msgpack_pack_false(mp_pck);
+    }
+}
+
+static int check_engine(struct flb_config *config, msgpack_packer *mp_pck)
+{
+    int i;
+    int n;
+    int ok;
+    int timeout;
+    time_t age;
+    time_t heartbeat;
+    struct flb_config *shard;
+
+    timeout = config->hc_stall_timeout;
+    if (timeout < config->flush * 3) {
+        timeout = config->flush * 3;
+    }
+
+    heartbeat = config->engine_heartbeat;
+    n = flb_engine_shards_lock(config);
+    for (i = 1; i < n; i++) {
+        shard = flb_engine_shard_get(config, i);
+        if (shard && shard->engine_heartbeat < heartbeat) {
+            heartbeat = shard->engine_heartbeat;
+        }
+    }
+    flb_engine_shards_unlock(config);
+
+    age = time(NULL) - heartbeat;
+    ok = (age <= timeout);
+
+    pack_str(mp_pck, "engine");
+    msgpack_pack_map(mp_pck, 3);
+    pack_ok(mp_pck, ok);
+    pack_str(mp_pck, "heartbeat_age");
+    msgpack_pack_int64(mp_pck, age);
+    pack_str(mp_pck, "stall_timeout");
+    msgpack_pack_int(mp_pck, timeout);
+
+    return ok;
+}
+
+static int check_inputs(struct flb_config *config, msgpack_packer *mp_pck)
+{
+    int i;
+    int k;
+    int engines;
+    int n = 0;
+    int paused = 0;
+    char *names[64];
+    struct mk_list *head;
+    struct flb_config *shard;
+    struct flb_input_instance *in;
+
+    /* Take a snapshot, the engine may resume an input meanwhile */
+    engines = flb_engine_shards_lock(config);
+    for (k = 0; k < engines; k++) {
+        shard = flb_engine_shard_get(config, k);
+        if (!shard) {
+            continue;
+        }
+        mk_list_foreach(head, &shard->inputs) {
+            in = mk_list_entry(head, struct flb_input_instance, _head);
+            if (flb_input_buf_paused(in) == FLB_TRUE || in->mem_paused) {
+                if (n < (int) (sizeof(names) / sizeof(char *))) {
+                    names[n++] = in->name;
+                }
+                paused++;
+            }
+        }
+    }
+    flb_engine_shards_unlock(config);
+
+    pack_str(mp_pck, "inputs");
+    msgpack_pack_map(mp_pck, 2);
+    pack_ok(mp_pck, paused == 0);
+    pack_str(mp_pck, "paused");
+    msgpack_pack_array(mp_pck, n);
+    for (i = 0; i < n; i++) {
+        pack_str(mp_pck, names[i]);
+    }
+
+    return (paused == 0);
+}
+
+static int check_tasks(struct flb_config *config, msgpack_packer *mp_pck)
+{
+    int i;
+    int n;
+    int ok = FLB_TRUE;
+    int used = 0;
+    int capacity = 0;
+    struct flb_config *shard;
+
+    n = flb_engine_shards_lock(config);
+    for (i = 0; i < n; i++) {
+        shard = flb_engine_shard_get(config, i);
+        if (!shard) {
+            continue;
+        }
+        used += __atomic_load_n(&shard->tasks_count, __ATOMIC_RELAXED);
+        capacity += flb_task_map_limit(shard);
+    }
+    flb_engine_shards_unlock(config);
+    if (config->hc_tasks_usage > 0) {
+        ok = (used * 100 < capacity * config->hc_tasks_usage);
+    }
+
+    pack_str(mp_pck, "tasks");
+    msgpack_pack_map(mp_pck, 3);
+    pack_ok(mp_pck, ok);
+    pack_str(mp_pck, "used");
+    msgpack_pack_int(mp_pck, used);
+    pack_str(mp_pck, "capacity");
+    msgpack_pack_int(mp_pck, capacity);
+
+    return ok;
+}
+
+static int check_retries(struct flb_config *config, msgpack_packer *mp_pck)
+{
+    int i;
+    int n;
+    int ok = FLB_TRUE;
+    int pending = 0;
+    struct flb_config *shard;
+
+    n = flb_engine_shards_lock(config);
+    for (i = 0; i < n; i++) {
+        shard = flb_engine_shard_get(config, i);
+        if (shard) {
+            pending += __atomic_load_n(&shard->retries_pending,
+                                       __ATOMIC_RELAXED);
+        }
+    }
+    flb_engine_shards_unlock(config);
+    if (config->hc_retries_pending > 0) {
+        ok = (pending < config->hc_retries_pending);
+    }
+
+    pack_str(mp_pck, "retries");
+    msgpack_pack_map(mp_pck, 2);
+    pack_ok(mp_pck, ok);
+    pack_str(mp_pck, "pending");
+    msgpack_pack_int(mp_pck, pending);
+
+    return ok;
+}
+
+static int check_backlog(struct flb_config *config, msgpack_packer *mp_pck)
+{
+    int i;
+    int n;
+    int ok = FLB_TRUE;
+    size_t bytes = 0;
+    struct flb_config *shard;
+
+    n = flb_engine_shards_lock(config);
+    for (i = 0; i < n; i++) {
+        shard = flb_engine_shard_get(config, i);
+        if (shard) {
+            bytes += shard->mem_total;
+        }
+    }
+    flb_engine_shards_unlock(config);
+
+    if (config->hc_backlog_size > 0) {
+        ok = (bytes < config->hc_backlog_size);
+    }
+
+    pack_str(mp_pck, "backlog");
+    msgpack_pack_map(mp_pck, 2);
+    pack_ok(mp_pck, ok);
+    pack_str(mp_pck, "bytes");
+    msgpack_pack_uint64(mp_pck, bytes);
+
+    return ok;
+}
+
+/*
+ * The counts are taken against the totals saved at the start of the
+ * previous window, so they cover between one and two periods and never
+ * drop to zero right after a window starts.
+ */
+static int check_outputs(struct flb_hs *hs, msgpack_packer *mp_pck)
+{
+    int i;
+    int n;
+    int ok = FLB_TRUE;
+    time_t now;
+    uint64_t errors = 0;
+    uint64_t retry_failures = 0;
+    struct mk_list *head;
+    struct flb_metric *m;
+    struct flb_output_instance *o_ins;
+    struct flb_config *shard;
+    struct flb_config *config = hs->config;
+
+    n = flb_engine_shards_lock(config);
+    for (i = 0; i < n; i++) {
+        shard = flb_engine_shard_get(config, i);
+        if (!shard) {
+            continue;
+        }
+        pthread_rwlock_rdlock(&shard->filters_lock);
+        mk_list_foreach(head, &shard->outputs) {
+            o_ins = mk_list_entry(head, struct flb_output_instance, _head);
+            if (!o_ins->metrics) {
+                continue;
+            }
+            errors += flb_metric_value(o_ins->m_errors);
+            m = flb_metrics_get_id(FLB_METRIC_OUT_RETRY_FAILED,
+                                   o_ins->metrics);
+            if (m) {
+                retry_failures += flb_metric_value(m);
+            }
+        }
+        pthread_rwlock_unlock(&shard->filters_lock);
+    }
+    flb_engine_shards_unlock(config);
+
+    now = time(NULL);
+    pthread_mutex_lock(&hs->hc_lock);
+    /* The counts of the outputs retired by a reload are gone, start over */
+    if (errors < hs->hc_errors[1] ||
+        retry_failures < hs->hc_retry_failures[1]) {
+        hs->hc_window = 0;
+    }
+    if (hs->hc_window == 0) {
+        hs->hc_window = now;
+        hs->hc_errors[0] = hs->hc_errors[1] = errors;
+        hs->hc_retry_failures[0] = hs->hc_retry_failures[1] = retry_failures;
+    }
+    else if (now - hs->hc_window >= config->hc_period) {
+        hs->hc_window = now;
+        hs->hc_errors[0] = hs->hc_errors[1];
+        hs->hc_errors[1] = errors;
+        hs->hc_retry_failures[0] = hs->hc_retry_failures[1];
+        hs->hc_retry_failures[1] = retry_failures;
+    }
+    errors -= hs->hc_errors[0];
+    retry_failures -= hs->hc_retry_failures[0];
+    pthread_mutex_unlock(&hs->hc_lock);
+
+    if (config->hc_errors_count > 0 && errors >= config->hc_errors_count) {
+        ok = FLB_FALSE;
+    }
+    if (config->hc_retry_failure_count > 0 &&
+        retry_failures >= config->hc_retry_failure_count) {
+        ok = FLB_FALSE;
+    }
+
+    pack_str(mp_pck, "outputs");
+    msgpack_pack_map(mp_pck, 4);
+    pack_ok(mp_pck, ok);
+    pack_str(mp_pck, "errors");
+    msgpack_pack_uint64(mp_pck, errors);
+    pack_str(mp_pck, "retries_failed");
+    msgpack_pack_uint64(mp_pck, retry_failures);
+    pack_str(mp_pck, "period");
+    msgpack_pack_int(mp_pck, config->hc_period);
+
+    return ok;
+}
+
+static void health_reply(mk_request_t *request, struct flb_hs *hs, int full)
+{
+    int ok = FLB_TRUE;
+    int ret;
+    char *json_buf;
+    size_t json_size;
+    msgpack_sbuffer mp_sbuf;
+    msgpack_packer mp_pck;
+    struct flb_config *config = hs->config;
+
+    /* Enabled by the 'Health_Check' service option */
+    if (config->health_check == FLB_FALSE) {
+        mk_http_status(request, 404);
+        mk_http_done(request);
+        return;
+    }
+
+    msgpack_sbuffer_init(&mp_sbuf);
+    msgpack_packer_init(&mp_pck, &mp_sbuf, msgpack_sbuffer_write);
+
+    /* Checks first, the status is the last key of the map */
+    msgpack_pack_map(&mp_pck, 2);
+    pack_str(&mp_pck, "checks");
+    msgpack_pack_map(&mp_pck, full ? 6 : 1);
+    ok &= check_engine(config, &mp_pck);
+    if (full) {
+        ok &= check_inputs(config, &mp_pck);
+        ok &= check_tasks(config, &mp_pck);
+        ok &= check_retries(config, &mp_pck);
+        ok &= check_backlog(config, &mp_pck);
+        ok &= check_outputs(hs, &mp_pck);
+    }
+    pack_str(&mp_pck, "status");
+    pack_str(&mp_pck, ok ? "ok" : "error");
+
+    ret = flb_msgpack_raw_to_json_str(mp_sbuf.data, mp_sbuf.size,
+                                      &json_buf, &json_size);
+    msgpack_sbuffer_destroy(&mp_sbuf);
+    if (ret < 0) {
+        mk_http_status(request, 500);
+        mk_http_done(request);
+        return;
+    }
+
+    mk_http_status(request, ok ? 200 : 503);
+    mk_http_send(request, json_buf, json_size, NULL);
+    mk_http_done(request);
+    flb_free(json_buf);
+}
+
+/* API: engine liveness /api/v1/health/live */
+static void cb_health_live(mk_request_t *request, void *data)
+{
+    health_reply(request, data, FLB_FALSE);
+}
+
+/* API: pipeline health /api/v1/health */
+static void cb_health(mk_request_t *request, void *data)
+{
+    health_reply(request, data, FLB_TRUE);
+}
+
+/* Perform registration */
+int api_v1_health(struct flb_hs *hs)
+{
+    /* Handlers are matched in order, the longest path goes first */
+    mk_vhost_handler(hs->ctx, hs->vid, "/api/v1/health/live",
+                     cb_health_live, hs);
+    mk_vhost_handler(hs->ctx, hs->vid, "/api/v1/health", cb_health, hs);
+    return 0;
+}
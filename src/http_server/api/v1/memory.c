@@ -0,0 +1,168 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_mem_pool.h>
+#include <fluent-bit/flb_pack.h>
+
+#include <fluent-bit/flb_http_server.h>
+#include <msgpack.h>
+
+static void pack_str(msgpack_packer *mp_pck, char *str)
+{
+    int len = strlen(str);
+
+    msgpack_pack_str(mp_pck, len);
+    msgpack_pack_str_body(mp_pck, str, len);
+}
+
+#ifdef FLB_HAVE_MEM_ACCOUNTING
+static void pack_subsystems(msgpack_packer *mp_pck)
+{
+    int i;
+    struct flb_mem_usage u;
+
+    msgpack_pack_map(mp_pck, FLB_MEM_SUBSYSTEMS);
+    for (i = 0; i < FLB_MEM_SUBSYSTEMS; i++) {
+        flb_mem_acct_get(i, &u);
+        pack_str(mp_pck, flb_mem_subsystem_name(i));
+        msgpack_pack_map(mp_pck, 4);
+        pack_str(mp_pck, "live");
+        msgpack_pack_uint64(mp_pck, u.live);
+        pack_str(mp_pck, "peak");
+        msgpack_pack_uint64(mp_pck, u.peak);
+        pack_str(mp_pck, "allocs");
+        msgpack_pack_uint64(mp_pck, u.allocs);
+        pack_str(mp_pck, "frees");
+        msgpack_pack_uint64(mp_pck, u.frees);
+    }
+}
+#endif
+
+#ifdef FLB_HAVE_JEMALLOC
+static void pack_jemalloc(msgpack_packer *mp_pck)
+{
+    int i;
+    size_t val;
+    size_t len;
+    uint64_t epoch = 1;
+    char key[32];
+    char *stats[] = {"allocated", "active", "resident", "mapped"};
+
+    /* Refresh the cached statistics */
+    len = sizeof(epoch);
+    mallctl("epoch", &epoch, &len, &epoch, len);
+
+    msgpack_pack_map(mp_pck, 4);
+    for (i = 0; i < 4; i++) {
+        snprintf(key, sizeof(key) - 1, "stats.%s", stats[i]);
+        val = 0;
+        len = sizeof(val);
+        mallctl(key, &val, &len, NULL, 0);
+        pack_str(mp_pck, stats[i]);
+        msgpack_pack_uint64(mp_pck, val);
+    }
+}
+#endif
+
+/* API: memory usage by subsystem /api/v1/memory */
+static void cb_memory(mk_request_t *request, void *data)
+{
+    int n = 3;
+    int ret;
+    char *json_buf;
+    size_t json_size;
+    msgpack_sbuffer mp_sbuf;
+    msgpack_packer mp_pck;
+    struct flb_hs *hs = data;
+    struct flb_config *config = hs->config;
+    struct flb_mem_pool_usage pool;
+
+#ifdef FLB_HAVE_MEM_ACCOUNTING
+    n++;
+#endif
+#ifdef FLB_HAVE_JEMALLOC
+    n++;
+#endif
+
+    msgpack_sbuffer_init(&mp_sbuf);
+    msgpack_packer_init(&mp_pck, &mp_sbuf, msgpack_sbuffer_write);
+    msgpack_pack_map(&mp_pck, n);
+
+    pack_str(&mp_pck, "accounting");
+#ifdef FLB_HAVE_MEM_ACCOUNTING
+    msgpack_pack_true(&mp_pck);
+    pack_str(&mp_pck, "subsystems");
+    pack_subsystems(&mp_pck);
+#else
+    msgpack_pack_false(&mp_pck);
+#endif
+
+    /* Records buffered by the inputs and held by tasks (Mem_Total_Limit) */
+    pack_str(&mp_pck, "input_buffers");
+    msgpack_pack_map(&mp_pck, 3);
+    pack_str(&mp_pck, "live");
+    msgpack_pack_uint64(&mp_pck, config->mem_total);
+    pack_str(&mp_pck, "peak");
+    msgpack_pack_uint64(&mp_pck, config->mem_total_peak);
+    pack_str(&mp_pck, "limit");
+    msgpack_pack_uint64(&mp_pck, config->mem_total_limit);
+
+    /* Memory pool (Mem_Pool), all zero without it */
+    flb_mem_pool_usage(&pool);
+    pack_str(&mp_pck, "mem_pool");
+    msgpack_pack_map(&mp_pck, 5);
+    pack_str(&mp_pck, "size");
+    msgpack_pack_uint64(&mp_pck, pool.size);
+    pack_str(&mp_pck, "used");
+    msgpack_pack_uint64(&mp_pck, pool.used);
+    pack_str(&mp_pck, "peak");
+    msgpack_pack_uint64(&mp_pck, pool.peak);
+    pack_str(&mp_pck, "fallbacks");
+    msgpack_pack_uint64(&mp_pck, pool.fallbacks);
+    pack_str(&mp_pck, "hugepages");
+    msgpack_pack_int(&mp_pck, pool.hugepages);
+
+#ifdef FLB_HAVE_JEMALLOC
+    pack_str(&mp_pck, "jemalloc");
+    pack_jemalloc(&mp_pck);
+#endif
+
+    ret = flb_msgpack_raw_to_json_str(mp_sbuf.data, mp_sbuf.size,
+                                      &json_buf, &json_size);
+    msgpack_sbuffer_destroy(&mp_sbuf);
+    if (ret < 0) {
+        mk_http_status(request, 500);
+        mk_http_done(request);
+        return;
+    }
+
+    mk_http_status(request, 200);
+    mk_http_send(request, json_buf, json_size, NULL);
+    mk_http_done(request);
+    flb_free(json_buf);
+}
+
+/* Perform registration */
+int api_v1_memory(struct flb_hs *hs)
+{
+    mk_vhost_handler(hs->ctx, hs->vid, "/api/v1/memory", cb_memory, hs);
+    return 0;
+}
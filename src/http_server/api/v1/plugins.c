@@ -29,6 +29,7 @@
 /* API: List all built-in plugins */
 static void cb_plugins(mk_request_t *request, void *data)
 {
+    int i;
     int len;
     char *out_buf;
     size_t out_size;
@@ -57,10 +58,10 @@ static void cb_plugins(mk_request_t *request, void *data)
     /* Inputs */
     msgpack_pack_str(&mp_pck, 6);
     msgpack_pack_str_body(&mp_pck, "inputs", 6);
-    len = mk_list_size(&config->in_plugins);
+    for (len = 0; flb_in_plugins[len]; len++);
     msgpack_pack_array(&mp_pck, len);
-    mk_list_foreach(head, &hs->config->in_plugins) {
-        in = mk_list_entry(head, struct flb_input_plugin, _head);
+    for (i = 0; flb_in_plugins[i]; i++) {
+        in = flb_in_plugins[i];
         len = strlen(in->name);
         msgpack_pack_str(&mp_pck, len);
         msgpack_pack_str_body(&mp_pck, in->name, len);
@@ -69,10 +70,10 @@ static void cb_plugins(mk_request_t *request, void *data)
     /* Filters */
     msgpack_pack_str(&mp_pck, 7);
     msgpack_pack_str_body(&mp_pck, "filters", 7);
-    len = mk_list_size(&config->filter_plugins);
+    for (len = 0; flb_filter_plugins[len]; len++);
     msgpack_pack_array(&mp_pck, len);
-    mk_list_foreach(head, &config->filter_plugins) {
-        filter = mk_list_entry(head, struct flb_filter_plugin, _head);
+    for (i = 0; flb_filter_plugins[i]; i++) {
+        filter = flb_filter_plugins[i];
         len = strlen(filter->name);
         msgpack_pack_str(&mp_pck, len);
         msgpack_pack_str_body(&mp_pck, filter->name, len);
@@ -81,8 +82,14 @@ static void cb_plugins(mk_request_t *request, void *data)
     /* Outputs */
     msgpack_pack_str(&mp_pck, 7);
     msgpack_pack_str_body(&mp_pck, "outputs", 7);
-    len = mk_list_size(&config->out_plugins);
-    msgpack_pack_array(&mp_pck, len);
+    for (len = 0; flb_out_plugins[len]; len++);
+    msgpack_pack_array(&mp_pck, len + mk_list_size(&config->out_plugins));
+    for (i = 0; flb_out_plugins[i]; i++) {
+        out = flb_out_plugins[i];
+        len = strlen(out->name);
+        msgpack_pack_str(&mp_pck, len);
+        msgpack_pack_str_body(&mp_pck, out->name, len);
+    }
     mk_list_foreach(head, &config->out_plugins) {
         out = mk_list_entry(head, struct flb_output_plugin, _head);
         len = strlen(out->name);
@@ -22,10 +22,20 @@
 
 #include "metrics.h"
 #include "plugins.h"
+#include "traces.h"
+#include "memory.h"
+#include "threads.h"
+#include "health.h"
+#include "reload.h"
 
 int api_v1_registration(struct flb_hs *hs)
 {
     api_v1_metrics(hs);
     api_v1_plugins(hs);
+    api_v1_traces(hs);
+    api_v1_memory(hs);
+    api_v1_threads(hs);
+    api_v1_health(hs);
+    api_v1_reload(hs);
     return 0;
 }
@@ -0,0 +1,58 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_http_server.h>
+#include <fluent-bit/flb_reload.h>
+
+#define RELOAD_OK      "{\"reload\":\"requested\"}"
+#define RELOAD_ERROR   "{\"reload\":\"disabled\"}"
+
+/*
+ * API: POST /api/v1/reload, the engine applies the configuration file in
+ * background, the result is reported in the log.
+ */
+static void cb_reload(mk_request_t *request, void *data)
+{
+    struct flb_hs *hs = data;
+
+    if (request->method != MK_METHOD_POST) {
+        mk_http_status(request, 405);
+        mk_http_done(request);
+        return;
+    }
+
+    if (flb_reload_request(hs->config) == -1) {
+        mk_http_status(request, 400);
+        mk_http_send(request, RELOAD_ERROR, sizeof(RELOAD_ERROR) - 1, NULL);
+        mk_http_done(request);
+        return;
+    }
+
+    mk_http_status(request, 202);
+    mk_http_send(request, RELOAD_OK, sizeof(RELOAD_OK) - 1, NULL);
+    mk_http_done(request);
+}
+
+/* Perform registration */
+int api_v1_reload(struct flb_hs *hs)
+{
+    mk_vhost_handler(hs->ctx, hs->vid, "/api/v1/reload", cb_reload, hs);
+    return 0;
+}
@@ -0,0 +1,86 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_pack.h>
+#include <fluent-bit/flb_http_server.h>
+#include <fluent-bit/flb_worker.h>
+#include <msgpack.h>
+
+#include <unistd.h>
+
+static void pack_str(msgpack_packer *mp_pck, char *str)
+{
+    int len = strlen(str);
+
+    msgpack_pack_str(mp_pck, len);
+    msgpack_pack_str_body(mp_pck, str, len);
+}
+
+/* API: roles, kernel IDs and CPU sets of the threads /api/v1/threads */
+static void cb_threads(mk_request_t *request, void *data)
+{
+    int ret;
+    char *json_buf;
+    size_t json_size;
+    msgpack_sbuffer mp_sbuf;
+    msgpack_packer mp_pck;
+    struct flb_hs *hs = data;
+    struct flb_config *config = hs->config;
+
+    msgpack_sbuffer_init(&mp_sbuf);
+    msgpack_packer_init(&mp_pck, &mp_sbuf, msgpack_sbuffer_write);
+    msgpack_pack_map(&mp_pck, 3);
+
+    pack_str(&mp_pck, "pid");
+    msgpack_pack_int(&mp_pck, getpid());
+
+    pack_str(&mp_pck, "cpus");
+    if (config->cpu_affinity) {
+        pack_str(&mp_pck, config->cpu_affinity->list);
+    }
+    else {
+        msgpack_pack_nil(&mp_pck);
+    }
+
+    pack_str(&mp_pck, "workers");
+    flb_worker_pack(config, &mp_pck);
+
+    ret = flb_msgpack_raw_to_json_str(mp_sbuf.data, mp_sbuf.size,
+                                      &json_buf, &json_size);
+    msgpack_sbuffer_destroy(&mp_sbuf);
+    if (ret < 0) {
+        mk_http_status(request, 500);
+        mk_http_done(request);
+        return;
+    }
+
+    mk_http_status(request, 200);
+    mk_http_send(request, json_buf, json_size, NULL);
+    mk_http_done(request);
+    flb_free(json_buf);
+}
+
+/* Perform registration */
+int api_v1_threads(struct flb_hs *hs)
+{
+    mk_vhost_handler(hs->ctx, hs->vid, "/api/v1/threads", cb_threads, hs);
+    return 0;
+}
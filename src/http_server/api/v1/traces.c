@@ -0,0 +1,65 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_pack.h>
+#include <fluent-bit/flb_task_trace.h>
+
+#include <fluent-bit/flb_http_server.h>
+#include <msgpack.h>
+
+/* API: last finished task traces /api/v1/traces */
+static void cb_traces(mk_request_t *request, void *data)
+{
+    int ret;
+    char *buf;
+    size_t size;
+    char *json_buf;
+    size_t json_size;
+    struct flb_hs *hs = data;
+
+    /* Tracing is enabled by the 'Task_Trace' service option */
+    if (!hs->config->task_traces) {
+        mk_http_status(request, 404);
+        mk_http_done(request);
+        return;
+    }
+
+    flb_task_traces_dump(hs->config->task_traces, &buf, &size);
+    ret = flb_msgpack_raw_to_json_str(buf, size, &json_buf, &json_size);
+    flb_free(buf);
+    if (ret < 0) {
+        mk_http_status(request, 500);
+        mk_http_done(request);
+        return;
+    }
+
+    mk_http_status(request, 200);
+    mk_http_send(request, json_buf, json_size, NULL);
+    mk_http_done(request);
+    flb_free(json_buf);
+}
+
+/* Perform registration */
+int api_v1_traces(struct flb_hs *hs)
+{
+    mk_vhost_handler(hs->ctx, hs->vid, "/api/v1/traces", cb_traces, hs);
+    return 0;
+}
@@ -35,12 +35,6 @@ static void cb_root(mk_request_t *request, void *data)
     mk_http_done(request);
 }
 
-/* Ingest metrics into the web service context */
-int flb_hs_push_metrics(struct flb_hs *hs, void *data, size_t size)
-{
-    return mk_mq_send(hs->ctx, hs->qid, data, size);
-}
-
 /* Create ROOT endpoints */
 struct flb_hs *flb_hs_create(char *listen, char *tcp_port,
                              struct flb_config *config)
@@ -57,6 +51,7 @@ struct flb_hs *flb_hs_create(char *listen, char *tcp_port,
 
     /* Setup endpoint specific data */
     flb_hs_endpoints(hs);
+    pthread_mutex_init(&hs->hc_lock, NULL);
 
     /* Create HTTP server context */
     hs->ctx = mk_create();
@@ -112,6 +107,7 @@ int flb_hs_destroy(struct flb_hs *hs)
     mk_destroy(hs->ctx);
 
     flb_hs_endpoints_free(hs);
+    pthread_mutex_destroy(&hs->hc_lock);
     flb_free(hs);
 
     return 0;
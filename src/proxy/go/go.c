@@ -18,10 +18,18 @@
  */
 
 #include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_log.h>
+#include <fluent-bit/flb_pipe.h>
 #include <fluent-bit/flb_config.h>
+#include <fluent-bit/flb_engine.h>
+#include <fluent-bit/flb_thread.h>
+#include <fluent-bit/flb_worker.h>
 #include <fluent-bit/flb_plugin_proxy.h>
 #include <fluent-bit/flb_output.h>
 
+#include <pthread.h>
+
 /*
  * These functions needs to be moved to a better place, still in
  * experimental mode.
@@ -49,6 +57,9 @@
  * 3. Plugin Initialization
  */
 
+struct flbgo_batch;
+
+/* The Go side reads the leading fields, new ones are appended */
 struct flbgo_output_plugin {
     char *name;
     void *api;
@@ -56,9 +67,235 @@ struct flbgo_output_plugin {
     int (*cb_init)();
     int (*cb_flush)(void *, size_t, char *);
     int (*cb_exit)(void *);
+    int (*cb_flush_batch)(struct flb_proxy_chunk *, int);
+    struct flbgo_batch *batch;
 };
 /*------------------------EOF------------------------------------------------*/
 
+/*
+ * Batch dispatcher: the flushes queue their chunk and wait, a thread hands
+ * all the queued chunks to FLBPluginFlushBatch() in one call.
+ */
+struct flbgo_batch {
+    int stop;
+    pthread_t tid;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct mk_list queue;              /* flushes waiting for a call */
+    struct flbgo_output_plugin *plugin;
+    struct flb_proxy_chunk chunks[FLB_PROXY_BATCH_MAX];
+};
+
+/* A flush waiting for the batch call, it lives in the flush stack */
+struct flbgo_flush {
+    struct mk_event event;
+    struct flb_thread *thread;
+    struct flb_proxy_chunk chunk;
+    flb_pipefd_t ch[2];                /* the dispatcher notifies here */
+    struct mk_list _head;
+};
+
+static void batch_notify(struct flbgo_flush *flush)
+{
+    int ret;
+    uint64_t val = 1;
+
+    ret = flb_pipe_w(flush->ch[1], &val, sizeof(val));
+    if (ret == -1) {
+        flb_errno();
+    }
+}
+
+static void batch_worker(void *data)
+{
+    int i;
+    int n;
+    int ret;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_list calls;
+    struct flbgo_flush *flush;
+    struct flbgo_batch *batch = data;
+    struct flbgo_output_plugin *plugin = batch->plugin;
+
+    while (1) {
+        mk_list_init(&calls);
+
+        pthread_mutex_lock(&batch->lock);
+        while (batch->stop == FLB_FALSE &&
+               mk_list_is_empty(&batch->queue) == 0) {
+            pthread_cond_wait(&batch->cond, &batch->lock);
+        }
+        if (batch->stop == FLB_TRUE) {
+            pthread_mutex_unlock(&batch->lock);
+            break;
+        }
+        n = 0;
+        mk_list_foreach_safe(head, tmp, &batch->queue) {
+            if (n == FLB_PROXY_BATCH_MAX) {
+                break;
+            }
+            mk_list_del(head);
+            mk_list_add(head, &calls);
+            n++;
+        }
+        pthread_mutex_unlock(&batch->lock);
+
+        i = 0;
+        mk_list_foreach(head, &calls) {
+            flush = mk_list_entry(head, struct flbgo_flush, _head);
+            batch->chunks[i++] = flush->chunk;
+        }
+
+        ret = plugin->cb_flush_batch(batch->chunks, n);
+
+        /* The flushes own their entry again once notified */
+        i = 0;
+        mk_list_foreach_safe(head, tmp, &calls) {
+            flush = mk_list_entry(head, struct flbgo_flush, _head);
+            flush->chunk.ret = batch->chunks[i++].ret;
+            if (flush->chunk.ret == FLB_PROXY_RET_UNSET) {
+                flush->chunk.ret = ret;
+            }
+            mk_list_del(&flush->_head);
+            batch_notify(flush);
+        }
+    }
+
+    /* Stopping: the pending flushes are retried */
+    pthread_mutex_lock(&batch->lock);
+    mk_list_foreach_safe(head, tmp, &batch->queue) {
+        flush = mk_list_entry(head, struct flbgo_flush, _head);
+        flush->chunk.ret = FLB_RETRY;
+        mk_list_del(&flush->_head);
+        batch_notify(flush);
+    }
+    pthread_mutex_unlock(&batch->lock);
+}
+
+static struct flbgo_batch *batch_create(struct flbgo_output_plugin *plugin,
+                                        struct flb_config *config)
+{
+    int ret;
+    struct flbgo_batch *batch;
+
+    batch = flb_calloc(1, sizeof(struct flbgo_batch));
+    if (!batch) {
+        flb_errno();
+        return NULL;
+    }
+    batch->plugin = plugin;
+    pthread_mutex_init(&batch->lock, NULL);
+    pthread_cond_init(&batch->cond, NULL);
+    mk_list_init(&batch->queue);
+
+    ret = flb_worker_create_role(batch_worker, batch, &batch->tid,
+                                 "go_batch", NULL, config);
+    if (ret == -1) {
+        pthread_mutex_destroy(&batch->lock);
+        pthread_cond_destroy(&batch->cond);
+        flb_free(batch);
+        return NULL;
+    }
+
+    return batch;
+}
+
+static void batch_destroy(struct flbgo_batch *batch)
+{
+    pthread_mutex_lock(&batch->lock);
+    batch->stop = FLB_TRUE;
+    pthread_cond_broadcast(&batch->cond);
+    pthread_mutex_unlock(&batch->lock);
+
+    pthread_join(batch->tid, NULL);
+    pthread_mutex_destroy(&batch->lock);
+    pthread_cond_destroy(&batch->cond);
+    flb_free(batch);
+}
+
+/*
+ * Wait for the dispatcher. Inside a flush co-routine the channel is
+ * registered in the event loop that runs it and the co-routine yields,
+ * otherwise the caller blocks.
+ */
+static int batch_wait(struct flbgo_flush *flush)
+{
+    int ret;
+    uint64_t val;
+    struct mk_event_loop *evl;
+    struct flb_thread *th = NULL;
+
+    evl = flb_engine_evl_get();
+#ifdef FLB_HAVE_FLUSH_LIBCO
+    if (evl) {
+        th = (struct flb_thread *) pthread_getspecific(flb_thread_key);
+        if (th && th->callee != co_active()) {
+            th = NULL;
+        }
+    }
+#endif
+
+    if (th) {
+        flush->thread = th;
+        MK_EVENT_NEW(&flush->event);
+        ret = mk_event_add(evl, flush->ch[0],
+                           FLB_ENGINE_EV_THREAD, MK_EVENT_READ, &flush->event);
+        if (ret == -1) {
+            return -1;
+        }
+        flb_thread_yield(th, FLB_FALSE);
+        mk_event_del(evl, &flush->event);
+    }
+
+    ret = flb_pipe_read_all(flush->ch[0], &val, sizeof(val));
+    if (ret <= 0) {
+        flb_errno();
+        return -1;
+    }
+
+    return 0;
+}
+
+static int batch_flush(struct flbgo_batch *batch, void *data, size_t size,
+                       char *tag, int tag_len, int records)
+{
+    int ret;
+    struct flbgo_flush flush;
+
+    memset(&flush, '\0', sizeof(flush));
+    flush.chunk.data    = data;
+    flush.chunk.size    = size;
+    flush.chunk.records = records;
+    flush.chunk.tag     = tag;
+    flush.chunk.tag_len = tag_len;
+    flush.chunk.ret     = FLB_PROXY_RET_UNSET;
+
+    ret = flb_pipe_create(flush.ch);
+    if (ret == -1) {
+        flb_errno();
+        return FLB_RETRY;
+    }
+
+    pthread_mutex_lock(&batch->lock);
+    if (batch->stop == FLB_TRUE) {
+        pthread_mutex_unlock(&batch->lock);
+        flb_pipe_destroy(flush.ch);
+        return FLB_RETRY;
+    }
+    mk_list_add(&flush._head, &batch->queue);
+    pthread_cond_signal(&batch->cond);
+    pthread_mutex_unlock(&batch->lock);
+
+    ret = batch_wait(&flush);
+    flb_pipe_destroy(flush.ch);
+    if (ret == -1) {
+        return FLB_RETRY;
+    }
+
+    return flush.chunk.ret;
+}
+
 int proxy_go_register(struct flb_plugin_proxy *proxy,
                       struct flb_plugin_proxy_def *def)
 {
@@ -89,15 +326,25 @@ int proxy_go_register(struct flb_plugin_proxy *proxy,
 
     plugin->cb_flush = flb_plugin_proxy_symbol(proxy, "FLBPluginFlush");
     plugin->cb_exit  = flb_plugin_proxy_symbol(proxy, "FLBPluginExit");
+    plugin->cb_flush_batch = flb_plugin_proxy_symbol(proxy,
+                                                     "FLBPluginFlushBatch");
+    plugin->batch    = NULL;
     plugin->name     = flb_strdup(def->name);
 
+    if (!plugin->cb_flush && !plugin->cb_flush_batch) {
+        fprintf(stderr, "[go proxy]: could not load FLBPluginFlush symbol\n");
+        flb_free(plugin->name);
+        flb_free(plugin);
+        return -1;
+    }
+
     /* This Go plugin context is an opaque data for the parent proxy */
     proxy->data = plugin;
 
     return 0;
 }
 
-int proxy_go_init(struct flb_plugin_proxy *proxy)
+int proxy_go_init(struct flb_plugin_proxy *proxy, struct flb_config *config)
 {
     int ret;
     struct flbgo_output_plugin *plugin = proxy->data;
@@ -110,15 +357,49 @@ int proxy_go_init(struct flb_plugin_proxy *proxy)
     if (ret == -1) {
         fprintf(stderr, "[go proxy]: plugin failed to initialize\n");
         flb_free(plugin);
+        proxy->data = NULL;
         return -1;
     }
 
+    if (plugin->cb_flush_batch) {
+        plugin->batch = batch_create(plugin, config);
+        if (!plugin->batch && !plugin->cb_flush) {
+            fprintf(stderr, "[go proxy]: could not start the batch thread\n");
+            return -1;
+        }
+        if (plugin->batch) {
+            flb_debug("[go proxy] %s: batched flushes", plugin->name);
+        }
+    }
+
     return 0;
 }
 
 int proxy_go_flush(struct flb_plugin_proxy *proxy, void *data, size_t size,
-                   char *tag)
+                   char *tag, int tag_len, int records)
 {
     struct flbgo_output_plugin *plugin = proxy->data;
+
+    if (plugin->batch) {
+        return batch_flush(plugin->batch, data, size, tag, tag_len, records);
+    }
     return plugin->cb_flush(data, size, tag);
 }
+
+void proxy_go_exit(struct flb_plugin_proxy *proxy)
+{
+    struct flbgo_output_plugin *plugin = proxy->data;
+
+    if (!plugin) {
+        return;
+    }
+
+    /* No batch call is running once the thread is joined */
+    if (plugin->batch) {
+        batch_destroy(plugin->batch);
+        plugin->batch = NULL;
+    }
+    if (plugin->cb_exit) {
+        plugin->cb_exit(plugin);
+    }
+}
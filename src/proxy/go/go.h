@@ -26,9 +26,11 @@
 int proxy_go_register(struct flb_plugin_proxy *proxy,
                       struct flb_plugin_proxy_def *def);
 
-int proxy_go_init(struct flb_plugin_proxy *proxy);
+int proxy_go_init(struct flb_plugin_proxy *proxy, struct flb_config *config);
 
 int proxy_go_flush(struct flb_plugin_proxy *proxy, void *data, size_t size,
-                   char *tag);
+                   char *tag, int tag_len, int records);
+
+void proxy_go_exit(struct flb_plugin_proxy *proxy);
 
 #endif
@@ -0,0 +1,178 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_arena.h>
+
+#include <msgpack.h>
+#include <string.h>
+#include <stdint.h>
+#include "flb_tests_internal.h"
+
+static void test_arena_alloc()
+{
+    int i;
+    char *p;
+    char *prev = NULL;
+    struct flb_arena *arena;
+
+    arena = flb_arena_create(1024);
+    TEST_CHECK(arena != NULL);
+    TEST_CHECK(arena->blocks == 1);
+
+    /* Aligned and not overlapping */
+    for (i = 0; i < 200; i++) {
+        p = flb_arena_alloc(arena, 1 + (i % 40));
+        TEST_CHECK(p != NULL);
+        TEST_CHECK(((uintptr_t) p % FLB_ARENA_ALIGN) == 0);
+        memset(p, i, 1 + (i % 40));
+        if (prev) {
+            TEST_CHECK(prev[0] == (char) (i - 1));
+        }
+        prev = p;
+    }
+    TEST_CHECK(arena->allocs == 200);
+    TEST_CHECK(arena->blocks > 1);
+
+    /* Large allocations get their own block, the current one keeps going */
+    p = flb_arena_alloc(arena, 4096);
+    TEST_CHECK(p != NULL);
+    memset(p, 'x', 4096);
+    TEST_CHECK(arena->size >= 4096);
+
+    p = flb_arena_strndup(arena, "fluent-bit", 6);
+    TEST_CHECK(p != NULL && strcmp(p, "fluent") == 0);
+
+    p = flb_arena_calloc(arena, 10, 8);
+    TEST_CHECK(p != NULL);
+    for (i = 0; i < 80; i++) {
+        TEST_CHECK(p[i] == 0);
+    }
+
+    /* The first block is kept */
+    flb_arena_reset(arena);
+    TEST_CHECK(arena->size == 1024);
+    TEST_CHECK(arena->head == arena->first);
+    TEST_CHECK(arena->peak > 1024);
+
+    flb_arena_destroy(arena);
+}
+
+static void test_arena_realloc()
+{
+    int i;
+    char *p;
+    char *q;
+    struct flb_arena *arena;
+
+    arena = flb_arena_create(1024);
+    TEST_CHECK(arena != NULL);
+
+    /* The last allocation grows in place */
+    p = flb_arena_alloc(arena, 16);
+    memcpy(p, "0123456789abcdef", 16);
+    q = flb_arena_realloc(arena, p, 16, 256);
+    TEST_CHECK(q == p);
+    TEST_CHECK(memcmp(q, "0123456789abcdef", 16) == 0);
+
+    /* Anything else is copied */
+    flb_arena_alloc(arena, 8);
+    q = flb_arena_realloc(arena, p, 256, 512);
+    TEST_CHECK(q != NULL && q != p);
+    TEST_CHECK(memcmp(q, "0123456789abcdef", 16) == 0);
+
+    /* Beyond the block */
+    p = flb_arena_realloc(arena, q, 512, 8192);
+    TEST_CHECK(p != NULL && p != q);
+    TEST_CHECK(memcmp(p, "0123456789abcdef", 16) == 0);
+    for (i = 0; i < 8192; i++) {
+        p[i] = 'z';
+    }
+
+    flb_arena_destroy(arena);
+}
+
+static void test_arena_buf()
+{
+    int i;
+    int ret;
+    size_t off = 0;
+    struct flb_arena *arena;
+    struct flb_arena_buf buf;
+    msgpack_packer pck;
+    msgpack_unpacked result;
+
+    arena = flb_arena_create(512);
+    TEST_CHECK(arena != NULL);
+
+    /* msgpack write callback, with and without an arena */
+    for (i = 0; i < 2; i++) {
+        flb_arena_buf_init(&buf, i == 0 ? arena : NULL);
+        msgpack_packer_init(&pck, &buf, flb_arena_buf_write);
+        for (ret = 0; ret < 1000; ret++) {
+            msgpack_pack_array(&pck, 2);
+            msgpack_pack_int(&pck, ret);
+            msgpack_pack_str(&pck, 5);
+            msgpack_pack_str_body(&pck, "hello", 5);
+        }
+
+        off = 0;
+        ret = 0;
+        msgpack_unpacked_init(&result);
+        while (msgpack_unpack_next(&result, buf.data, buf.size, &off)) {
+            TEST_CHECK(result.data.via.array.ptr[0].via.i64 == ret);
+            ret++;
+        }
+        msgpack_unpacked_destroy(&result);
+        TEST_CHECK(ret == 1000);
+
+        flb_arena_buf_destroy(&buf);
+        TEST_CHECK(buf.data == NULL);
+    }
+
+    flb_arena_destroy(arena);
+}
+
+static void test_arena_current()
+{
+    char *p;
+    struct flb_arena *arena;
+    struct flb_arena *outer;
+    struct flb_arena *inner;
+
+    TEST_CHECK(flb_arena_current() == NULL);
+
+    outer = flb_arena_enter();
+    TEST_CHECK(outer == NULL);
+    arena = flb_arena_current();
+    TEST_CHECK(arena != NULL);
+    p = flb_arena_alloc(arena, 64);
+    TEST_CHECK(p != NULL);
+
+    /* Nested calls share the arena, it's not reset on the inner leave */
+    inner = flb_arena_enter();
+    TEST_CHECK(inner == arena);
+    TEST_CHECK(flb_arena_current() == arena);
+    flb_arena_leave(inner);
+    TEST_CHECK(flb_arena_current() == arena);
+    TEST_CHECK(arena->head->used > 0);
+
+    flb_arena_leave(outer);
+    TEST_CHECK(flb_arena_current() == NULL);
+    TEST_CHECK(arena->head->used == 0);
+
+    /* The arena of the thread is reused */
+    outer = flb_arena_enter();
+    TEST_CHECK(flb_arena_current() == arena);
+    flb_arena_leave(outer);
+
+    flb_arena_thread_exit();
+}
+
+TEST_LIST = {
+    { "alloc"  , test_arena_alloc},
+    { "realloc", test_arena_realloc},
+    { "buf"    , test_arena_buf},
+    { "current", test_arena_current},
+    { 0 }
+};
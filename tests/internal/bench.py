@@ -0,0 +1,246 @@
+#!/usr/bin/env python3
+#
+# Fluent Bit / Benchmark results
+# ==============================
+#
+# Run a flb-bench-* binary several times and store the results, or compare
+# two stored results:
+#
+#   $ bench.py run [-r repeat] [-c cpus] [-a] -o result.json -- \
+#         bin/flb-bench-pipeline -o null 500000
+#   $ bench.py compare [-t percent] [-k factor] base.json new.json
+#
+# 'run' adds -j to the benchmark command, every JSON line it prints is a
+# case ('bench' and 'case' keys) with numeric metrics. The result file keeps
+# the samples of every metric with their median and MAD (median absolute
+# deviation), plus a few details of the host. With -a the cases are merged
+# in an existing file, so a single baseline can hold several benchmarks.
+# With -c the benchmark is pinned to the given CPUs (e.g. '2' or '2,3').
+#
+# 'compare' reports the change of the medians for the cases and metrics of
+# both files. A change is a regression or an improvement only when it is
+# larger than the threshold (-t, 5% by default) and than the noise of the
+# samples, 'k' times the largest relative MAD of both sides (-k, 3 by
+# default). It exits with status 1 if anything regressed.
+#
+# The numbers are only comparable between runs on the same host.
+
+import argparse
+import json
+import os
+import platform
+import socket
+import statistics
+import subprocess
+import sys
+import time
+
+# Metrics where a lower value is better, anything else is a rate
+LOWER_IS_BETTER = ('ns_per_record', 'cpu_usec_per_record', 'allocs_per_record',
+                   'peak_rss_kb', 'latency_p50_usec', 'latency_p99_usec',
+                   'server_drops', 'errors', 'seconds', 'lost', 'duplicated',
+                   'retries', 'retries_failed', 'heap_bytes_per_unit',
+                   'rss_bytes_per_unit', 'allocs_per_unit', 'heap_peak_kb',
+                   'ns_per_op')
+
+# Inputs of the benchmark, not results
+IGNORE = ('records', 'filters', 'connections', 'server_records', 'units')
+
+
+def cpu_model():
+    try:
+        with open('/proc/cpuinfo') as f:
+            for line in f:
+                if line.startswith('model name'):
+                    return line.split(':', 1)[1].strip()
+    except OSError:
+        pass
+    return platform.processor()
+
+
+def git_revision():
+    try:
+        out = subprocess.check_output(['git', 'rev-parse', '--short', 'HEAD'],
+                                      cwd=os.path.dirname(__file__) or '.',
+                                      stderr=subprocess.DEVNULL)
+        return out.decode().strip()
+    except (OSError, subprocess.CalledProcessError):
+        return None
+
+
+def summary(samples):
+    med = statistics.median(samples)
+    mad = statistics.median([abs(s - med) for s in samples])
+    return {'median': med, 'mad': mad, 'samples': samples}
+
+
+def cmd_run(args):
+    cmd = args.command
+    if cmd and cmd[0] == '--':
+        cmd = cmd[1:]
+    if not cmd:
+        sys.stderr.write('run: missing benchmark command\n')
+        return 2
+    cmd = [cmd[0], '-j'] + cmd[1:]
+
+    cpus = None
+    if args.cpus:
+        cpus = set(int(c) for c in args.cpus.split(','))
+
+    def pin():
+        if cpus:
+            os.sched_setaffinity(0, cpus)
+
+    samples = {}
+    for i in range(args.repeat):
+        proc = subprocess.run(cmd, stdout=subprocess.PIPE, preexec_fn=pin)
+        if proc.returncode != 0:
+            sys.stderr.write('run %d: %s exited with status %d\n' %
+                             (i + 1, cmd[0], proc.returncode))
+            return 1
+
+        for line in proc.stdout.decode().splitlines():
+            line = line.strip()
+            if not line.startswith('{'):
+                continue
+            obj = json.loads(line)
+            key = '%s/%s' % (obj.get('bench', os.path.basename(cmd[0])),
+                             obj.get('case', 'default'))
+            case = samples.setdefault(key, {})
+            for name, value in obj.items():
+                if name in IGNORE or isinstance(value, bool) or \
+                   not isinstance(value, (int, float)):
+                    continue
+                case.setdefault(name, []).append(value)
+
+    if not samples:
+        sys.stderr.write('run: no results, does the benchmark support -j?\n')
+        return 1
+
+    result = {'meta': {}, 'cases': {}}
+    if args.append and os.path.exists(args.output):
+        with open(args.output) as f:
+            result = json.load(f)
+
+    result['meta'] = {
+        'host': socket.gethostname(),
+        'cpu': cpu_model(),
+        'cpus': args.cpus,
+        'revision': git_revision(),
+        'date': time.strftime('%Y-%m-%dT%H:%M:%S'),
+        'repeat': args.repeat,
+    }
+    for key, metrics in samples.items():
+        result['cases'][key] = {
+            'command': ' '.join(cmd),
+            'metrics': dict((m, summary(s)) for m, s in metrics.items())
+        }
+
+    with open(args.output, 'w') as f:
+        json.dump(result, f, indent=2, sort_keys=True)
+        f.write('\n')
+
+    for key in sorted(samples):
+        print('%-40s %d metrics, %d runs' % (key, len(samples[key]),
+                                             args.repeat))
+    return 0
+
+
+def compare_metric(name, base, new, threshold, k):
+    b = base['median']
+    n = new['median']
+    if b == n:
+        return 0.0, 0.0, 'same'
+
+    if b == 0:
+        change = float('inf')
+        noise = 0.0
+    else:
+        change = (n - b) / abs(b)
+        noise = k * max(base['mad'] / abs(b),
+                        new['mad'] / abs(n) if n else 0.0)
+        if abs(change) <= max(threshold, noise):
+            return change, noise, 'same'
+
+    better = n < b if name in LOWER_IS_BETTER else n > b
+    return change, noise, 'better' if better else 'worse'
+
+
+def cmd_compare(args):
+    with open(args.base) as f:
+        base = json.load(f)
+    with open(args.new) as f:
+        new = json.load(f)
+
+    for label, res in (('base', base), ('new', new)):
+        meta = res.get('meta', {})
+        print('%-5s %s %s, %s, %s runs' % (label, meta.get('revision'),
+                                           meta.get('date'), meta.get('cpu'),
+                                           meta.get('repeat')))
+    if base.get('meta', {}).get('host') != new.get('meta', {}).get('host'):
+        print('warning: the results come from different hosts')
+    print()
+
+    regressions = 0
+    print('%-40s %-22s %14s %14s %9s %8s' %
+          ('case', 'metric', 'base', 'new', 'change', 'noise'))
+    for key in sorted(set(base['cases']) & set(new['cases'])):
+        bm = base['cases'][key]['metrics']
+        nm = new['cases'][key]['metrics']
+        for name in sorted(set(bm) & set(nm)):
+            change, noise, verdict = compare_metric(name, bm[name], nm[name],
+                                                    args.threshold / 100.0,
+                                                    args.k)
+            mark = ''
+            if verdict == 'worse':
+                mark = '  REGRESSION'
+                regressions += 1
+            elif verdict == 'better':
+                mark = '  improvement'
+            print('%-40s %-22s %14.3f %14.3f %+8.1f%% %7.1f%%%s' %
+                  (key, name, bm[name]['median'], nm[name]['median'],
+                   change * 100, noise * 100, mark))
+
+    for key in sorted(set(base['cases']) ^ set(new['cases'])):
+        print('%-40s only in %s' % (key, 'base' if key in base['cases']
+                                    else 'new'))
+
+    print()
+    print('%d regression(s)' % regressions)
+    return 1 if regressions > 0 else 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Fluent Bit benchmarks')
+    sub = parser.add_subparsers(dest='cmd')
+
+    run = sub.add_parser('run', help='run a benchmark and store its results')
+    run.add_argument('-r', '--repeat', type=int, default=5)
+    run.add_argument('-c', '--cpus', help='pin to CPUs, e.g. 2,3')
+    run.add_argument('-a', '--append', action='store_true',
+                     help='merge the cases in an existing result file')
+    run.add_argument('-o', '--output', required=True)
+    run.add_argument('command', nargs=argparse.REMAINDER)
+
+    cmp = sub.add_parser('compare', help='compare two result files')
+    cmp.add_argument('-t', '--threshold', type=float, default=5.0,
+                     help='minimum change in percent (default 5)')
+    cmp.add_argument('-k', type=float, default=3.0,
+                     help='noise factor applied to the MAD (default 3)')
+    cmp.add_argument('base')
+    cmp.add_argument('new')
+
+    args = parser.parse_args()
+    if args.cmd == 'run':
+        if args.repeat < 1:
+            parser.error('repeat must be at least 1')
+        return cmd_run(args)
+    elif args.cmd == 'compare':
+        return cmd_compare(args)
+
+    parser.print_help()
+    return 2
+
+
+if __name__ == '__main__':
+    sys.exit(main())
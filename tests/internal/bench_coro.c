@@ -0,0 +1,267 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * Co-routines benchmark
+ * =====================
+ * Measure the cost of the co-routines used to flush the outputs, for a
+ * few stack sizes:
+ *
+ *   $ bin/flb-bench-coro [-s size,size...] [-j] [iterations]
+ *
+ *   create  co_create() + co_delete(), a new stack every time
+ *   pool    flb_thread_stack_create() + first switch + release, the
+ *           stacks come from the pool of released ones
+ *   switch  a switch to the co-routine and back
+ *   flush   the life of a flush co-routine as the engine runs it:
+ *           flb_thread_new(), its stack, resume, return and destroy
+ *
+ * The name of the libco backend prefixes every case, build with
+ * -DFLB_LIBCO_BACKEND=sjlj or ucontext to compare the portable backends
+ * with the assembly one. With -j one JSON object is printed per case.
+ */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_thread.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include "flb_bench.h"
+
+#define CORO_ITERATIONS  100000
+#define CORO_MAX_SIZES   16
+
+static cothread_t main_co;
+static volatile uint64_t counter;
+
+struct coro_case {
+    char *name;
+    int switches;                         /* switches per operation */
+    double (*run)(size_t, uint64_t);
+};
+
+static void cb_entry()
+{
+    while (1) {
+        counter++;
+        co_switch(main_co);
+    }
+}
+
+static void cb_flush()
+{
+    struct flb_thread *th;
+
+    th = pthread_getspecific(flb_thread_key);
+    while (1) {
+        counter++;
+        flb_thread_return(th);
+    }
+}
+
+static double run_create(size_t size, uint64_t n)
+{
+    uint64_t i;
+    size_t out_size;
+    double start;
+    cothread_t co;
+
+    start = bench_now();
+    for (i = 0; i < n; i++) {
+        co = co_create(size, cb_entry, &out_size);
+        if (!co) {
+            return -1;
+        }
+        co_delete(co);
+    }
+    return bench_now() - start;
+}
+
+static double run_pool(size_t size, uint64_t n)
+{
+    uint64_t i;
+    size_t out_size;
+    double start;
+    cothread_t co;
+
+    start = bench_now();
+    for (i = 0; i < n; i++) {
+        co = flb_thread_stack_create(size, cb_entry, &out_size);
+        if (!co) {
+            return -1;
+        }
+        co_switch(co);
+        flb_thread_stack_release(co, size, out_size);
+    }
+    return bench_now() - start;
+}
+
+static double run_switch(size_t size, uint64_t n)
+{
+    uint64_t i;
+    size_t out_size;
+    double start;
+    cothread_t co;
+
+    co = co_create(size, cb_entry, &out_size);
+    if (!co) {
+        return -1;
+    }
+    co_switch(co);
+    counter = 0;
+
+    start = bench_now();
+    for (i = 0; i < n; i++) {
+        co_switch(co);
+    }
+    start = bench_now() - start;
+
+    co_delete(co);
+    return start;
+}
+
+static double run_flush(size_t size, uint64_t n)
+{
+    uint64_t i;
+    size_t out_size;
+    double start;
+    struct flb_thread *th;
+
+    start = bench_now();
+    for (i = 0; i < n; i++) {
+        th = flb_thread_new(0, NULL);
+        if (!th) {
+            return -1;
+        }
+        th->callee = flb_thread_stack_create(size, cb_flush, &out_size);
+        if (!th->callee) {
+            flb_free(th);
+            return -1;
+        }
+        th->stack_request = size;
+        th->stack_size = out_size;
+
+        flb_thread_resume(th);
+        flb_thread_destroy(th);
+    }
+    return bench_now() - start;
+}
+
+static struct coro_case cases[] = {
+    { "create", 0, run_create },
+    { "pool",   1, run_pool   },
+    { "switch", 1, run_switch },
+    { "flush",  1, run_flush  },
+    { 0 }
+};
+
+static int parse_sizes(char *str, size_t *sizes)
+{
+    int n = 0;
+    char *p;
+    char *save = NULL;
+
+    for (p = strtok_r(str, ",", &save); p; p = strtok_r(NULL, ",", &save)) {
+        if (n == CORO_MAX_SIZES) {
+            return -1;
+        }
+        sizes[n] = strtoul(p, NULL, 10);
+        if (sizes[n] < FLB_THREAD_STACK_MIN) {
+            return -1;
+        }
+        n++;
+    }
+    return n;
+}
+
+static void usage(char *name)
+{
+    fprintf(stderr, "usage: %s [-s size,size...] [-j] [iterations]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    int i;
+    int opt;
+    int n_sizes;
+    uint64_t n;
+    uint64_t expected;
+    double secs;
+    size_t sizes[CORO_MAX_SIZES] = {
+        FLB_THREAD_STACK_MIN, FLB_THREAD_STACK_SIZE, 65536, 262144
+    };
+    char name[64];
+    struct coro_case *c;
+
+    n = CORO_ITERATIONS;
+    n_sizes = 4;
+
+    while ((opt = getopt(argc, argv, "s:j")) != -1) {
+        switch (opt) {
+        case 's':
+            n_sizes = parse_sizes(optarg, sizes);
+            if (n_sizes <= 0) {
+                fprintf(stderr, "invalid stack sizes, the minimum is %i\n",
+                        FLB_THREAD_STACK_MIN);
+                return 1;
+            }
+            break;
+        case 'j': bench_json = 1; break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind < argc) {
+        n = strtoull(argv[optind], NULL, 10);
+    }
+    if (n == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    flb_thread_prepare();
+    main_co = co_active();
+
+    if (!bench_json) {
+        printf("backend %s, %" PRIu64 " iterations\n\n", co_method(), n);
+        printf("%-8s %10s %12s\n", "case", "stack", "ns/op");
+    }
+
+    for (c = cases; c->name; c++) {
+        for (i = 0; i < n_sizes; i++) {
+            counter = 0;
+            secs = c->run(sizes[i], n);
+            if (secs < 0) {
+                fprintf(stderr, "%s: could not create a %zu bytes stack\n",
+                        c->name, sizes[i]);
+                return 1;
+            }
+
+            /* every switch must have reached the co-routine */
+            expected = c->switches * n;
+            if (counter != expected) {
+                fprintf(stderr, "%s: %" PRIu64 " switches, expected %"
+                        PRIu64 "\n", c->name, (uint64_t) counter, expected);
+                return 1;
+            }
+
+            if (bench_json) {
+                snprintf(name, sizeof(name), "%s/%s-%zu",
+                         co_method(), c->name, sizes[i]);
+                printf("{\"bench\": \"coro\", \"case\": \"%s\", "
+                       "\"ns_per_op\": %.2f}\n", name, secs * 1e9 / n);
+            }
+            else {
+                printf("%-8s %10zu %12.1f\n", c->name, sizes[i],
+                       secs * 1e9 / n);
+            }
+        }
+    }
+
+    flb_thread_pool_exit();
+    return 0;
+}
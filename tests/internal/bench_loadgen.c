@@ -0,0 +1,1079 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * Network load generator
+ * ======================
+ * Send records to a network input and report the achieved rate and the
+ * records the server did not take:
+ *
+ *   $ bin/flb-bench-loadgen [-p protocol] [-H host] [-P port] [-c conns]
+ *                           [-r records/s] [-s record size] [-b batch]
+ *                           [-t tags] [-d seconds] [-M host:port] [-j]
+ *                           [records]
+ *
+ * Protocols:
+ *
+ *   message      Forward, Message mode: [tag, time, record]
+ *   forward      Forward, Forward mode: [tag, [[time, record], ...]]
+ *   packed       Forward, PackedForward mode
+ *   compressed   Forward, CompressedPackedForward mode (gzip)
+ *   tcp          JSON records, in_tcp
+ *   syslog-tcp   RFC5424 lines, in_syslog (mode tcp)
+ *   syslog-udp   RFC5424 datagrams, in_syslog (mode udp)
+ *   mqtt         MQTT 3.1.1 PUBLISH QoS 0 with a JSON payload
+ *   http         HTTP/1.1 POST of NDJSON batches, in_http
+ *
+ * Without -H the matching input runs in this process (library mode, null
+ * output) on a free loopback port, and the records it ingested are read
+ * from its metrics. With -H the records go to an external server, -M
+ * points to its monitoring API to read the input records counters from
+ * /api/v1/metrics/prometheus before and after the run.
+ *
+ * Every connection is a thread sending 'batch' records per message (one
+ * per message for 'message', 'mqtt' and the syslog protocols) and the
+ * total rate (-r, 0 = as fast as possible) is split between them. Tags
+ * are 'bench.0' to 'bench.N-1' (-t N), it applies to Forward, MQTT
+ * topics and HTTP paths. The run ends after 'records' records or
+ * 'seconds' seconds, whatever comes first.
+ */
+
+#include <fluent-bit.h>
+#include <fluent-bit/flb_time.h>
+#include <fluent-bit/flb_gzip.h>
+#include <fluent-bit/flb_metrics.h>
+#include <msgpack.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "flb_bench.h"
+
+#define LG_RECORDS        1000000
+#define LG_RECORD_SIZE    128
+#define LG_BATCH          100
+#define LG_DURATION       5
+#define LG_IDLE           3       /* seconds without progress on the server */
+#define LG_MAX_CONNS      256
+
+enum {
+    LG_MESSAGE = 0,
+    LG_FORWARD,
+    LG_PACKED,
+    LG_COMPRESSED,
+    LG_TCP,
+    LG_SYSLOG_TCP,
+    LG_SYSLOG_UDP,
+    LG_MQTT,
+    LG_HTTP
+};
+
+struct lg_protocol {
+    char *name;
+    int id;
+    char *input;               /* plugin used by the embedded server */
+    int udp;
+    int batched;               /* several records per message */
+};
+
+static struct lg_protocol protocols[] = {
+    {"message",    LG_MESSAGE,    "forward", 0, 0},
+    {"forward",    LG_FORWARD,    "forward", 0, 1},
+    {"packed",     LG_PACKED,     "forward", 0, 1},
+    {"compressed", LG_COMPRESSED, "forward", 0, 1},
+    {"tcp",        LG_TCP,        "tcp",     0, 1},
+    {"syslog-tcp", LG_SYSLOG_TCP, "syslog",  0, 0},
+    {"syslog-udp", LG_SYSLOG_UDP, "syslog",  1, 0},
+    {"mqtt",       LG_MQTT,       "mqtt",    0, 0},
+    {"http",       LG_HTTP,       "http",    0, 1},
+    {NULL, 0, NULL, 0, 0}
+};
+
+struct lg {
+    struct lg_protocol *proto;
+    char *host;
+    int port;
+    char *monitor;
+    int conns;
+    uint64_t rate;
+    int record_size;
+    int batch;
+    int tags;
+    int duration;
+    int json;
+    uint64_t target;
+    char *payload;
+
+    /* shared by the sender threads */
+    int stop;
+    uint64_t reserved;
+};
+
+struct lg_conn {
+    int id;
+    int fd;
+    pthread_t tid;
+    struct lg *lg;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+
+    /* buffers */
+    msgpack_sbuffer mp_sbuf;
+    msgpack_sbuffer mp_entries;
+    char *buf;
+    size_t buf_size;
+
+    /* results */
+    uint64_t sent;
+    uint64_t bytes;
+    uint64_t errors;
+};
+
+static int net_connect(struct lg_conn *c, char *host, int port, int udp)
+{
+    int fd = -1;
+    int on = 1;
+    char tmp[16];
+    struct addrinfo hints;
+    struct addrinfo *res;
+    struct addrinfo *rp;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = udp ? SOCK_DGRAM : SOCK_STREAM;
+
+    snprintf(tmp, sizeof(tmp), "%i", port);
+    if (getaddrinfo(host, tmp, &hints, &res) != 0) {
+        fprintf(stderr, "cannot resolve '%s'\n", host);
+        return -1;
+    }
+
+    for (rp = res; rp; rp = rp->ai_next) {
+        fd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+        if (fd == -1) {
+            continue;
+        }
+        if (udp) {
+            memcpy(&c->addr, rp->ai_addr, rp->ai_addrlen);
+            c->addr_len = rp->ai_addrlen;
+            break;
+        }
+        if (connect(fd, rp->ai_addr, rp->ai_addrlen) == 0) {
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+
+    if (fd == -1) {
+        fprintf(stderr, "cannot connect to %s:%i: %s\n",
+                host, port, strerror(errno));
+    }
+    return fd;
+}
+
+static int net_write(int fd, char *buf, size_t len)
+{
+    ssize_t ret;
+    size_t off = 0;
+
+    while (off < len) {
+        ret = write(fd, buf + off, len - off);
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        off += ret;
+    }
+    return 0;
+}
+
+static int lg_send(struct lg_conn *c, char *buf, size_t len)
+{
+    ssize_t ret;
+
+    if (c->lg->proto->udp) {
+        ret = sendto(c->fd, buf, len, 0,
+                     (struct sockaddr *) &c->addr, c->addr_len);
+        return ret == (ssize_t) len ? 0 : -1;
+    }
+    return net_write(c->fd, buf, len);
+}
+
+static inline void buf_reserve(struct lg_conn *c, size_t size)
+{
+    if (c->buf_size < size) {
+        c->buf = realloc(c->buf, size);
+        c->buf_size = size;
+    }
+}
+
+static inline int tag_get(struct lg *lg, uint64_t n, char *buf, size_t size)
+{
+    return snprintf(buf, size, "bench.%i", (int) (n % lg->tags));
+}
+
+/* {"log": "xxx...", "n": N} */
+static void pack_record(msgpack_packer *pck, struct lg *lg, uint64_t n)
+{
+    int len = strlen(lg->payload);
+
+    msgpack_pack_map(pck, 2);
+    msgpack_pack_str(pck, 3);
+    msgpack_pack_str_body(pck, "log", 3);
+    msgpack_pack_str(pck, len);
+    msgpack_pack_str_body(pck, lg->payload, len);
+    msgpack_pack_str(pck, 1);
+    msgpack_pack_str_body(pck, "n", 1);
+    msgpack_pack_uint64(pck, n);
+}
+
+static void pack_entries(struct lg_conn *c, uint64_t n, int records)
+{
+    int i;
+    struct flb_time tm;
+    msgpack_packer pck;
+
+    msgpack_sbuffer_clear(&c->mp_entries);
+    msgpack_packer_init(&pck, &c->mp_entries, msgpack_sbuffer_write);
+
+    flb_time_get(&tm);
+    for (i = 0; i < records; i++) {
+        msgpack_pack_array(&pck, 2);
+        flb_time_append_to_msgpack(&tm, &pck, FLB_TIME_ETFMT_V1_FIXEXT);
+        pack_record(&pck, c->lg, n + i);
+    }
+}
+
+/* Forward protocol, every mode */
+static int msg_forward(struct lg_conn *c, uint64_t n, int records,
+                       char **out, size_t *out_len)
+{
+    int i;
+    int len;
+    int ret;
+    char tag[32];
+    void *gz;
+    size_t gz_len;
+    struct flb_time tm;
+    msgpack_packer pck;
+    struct lg *lg = c->lg;
+
+    len = tag_get(lg, n, tag, sizeof(tag));
+    msgpack_sbuffer_clear(&c->mp_sbuf);
+    msgpack_packer_init(&pck, &c->mp_sbuf, msgpack_sbuffer_write);
+
+    switch (lg->proto->id) {
+    case LG_MESSAGE:
+        flb_time_get(&tm);
+        msgpack_pack_array(&pck, 3);
+        msgpack_pack_str(&pck, len);
+        msgpack_pack_str_body(&pck, tag, len);
+        flb_time_append_to_msgpack(&tm, &pck, FLB_TIME_ETFMT_V1_FIXEXT);
+        pack_record(&pck, lg, n);
+        break;
+    case LG_FORWARD:
+        flb_time_get(&tm);
+        msgpack_pack_array(&pck, 2);
+        msgpack_pack_str(&pck, len);
+        msgpack_pack_str_body(&pck, tag, len);
+        msgpack_pack_array(&pck, records);
+        for (i = 0; i < records; i++) {
+            msgpack_pack_array(&pck, 2);
+            flb_time_append_to_msgpack(&tm, &pck, FLB_TIME_ETFMT_V1_FIXEXT);
+            pack_record(&pck, lg, n + i);
+        }
+        break;
+    case LG_PACKED:
+        pack_entries(c, n, records);
+        msgpack_pack_array(&pck, 3);
+        msgpack_pack_str(&pck, len);
+        msgpack_pack_str_body(&pck, tag, len);
+        msgpack_pack_bin(&pck, c->mp_entries.size);
+        msgpack_pack_bin_body(&pck, c->mp_entries.data, c->mp_entries.size);
+        msgpack_pack_map(&pck, 1);
+        msgpack_pack_str(&pck, 4);
+        msgpack_pack_str_body(&pck, "size", 4);
+        msgpack_pack_int(&pck, records);
+        break;
+    case LG_COMPRESSED:
+        pack_entries(c, n, records);
+        ret = flb_gzip_compress(c->mp_entries.data, c->mp_entries.size,
+                                &gz, &gz_len);
+        if (ret == -1) {
+            return -1;
+        }
+        msgpack_pack_array(&pck, 3);
+        msgpack_pack_str(&pck, len);
+        msgpack_pack_str_body(&pck, tag, len);
+        msgpack_pack_bin(&pck, gz_len);
+        msgpack_pack_bin_body(&pck, gz, gz_len);
+        msgpack_pack_map(&pck, 2);
+        msgpack_pack_str(&pck, 4);
+        msgpack_pack_str_body(&pck, "size", 4);
+        msgpack_pack_int(&pck, records);
+        msgpack_pack_str(&pck, 10);
+        msgpack_pack_str_body(&pck, "compressed", 10);
+        msgpack_pack_str(&pck, 4);
+        msgpack_pack_str_body(&pck, "gzip", 4);
+        flb_free(gz);
+        break;
+    }
+
+    *out = c->mp_sbuf.data;
+    *out_len = c->mp_sbuf.size;
+    return 0;
+}
+
+/* JSON records, one per line */
+static size_t json_lines(struct lg_conn *c, size_t off, uint64_t n,
+                         int records)
+{
+    int i;
+    size_t len = strlen(c->lg->payload);
+
+    buf_reserve(c, off + records * (len + 64));
+    for (i = 0; i < records; i++) {
+        off += sprintf(c->buf + off, "{\"log\": \"%s\", \"n\": %" PRIu64 "}\n",
+                       c->lg->payload, n + i);
+    }
+    return off;
+}
+
+static int msg_syslog(struct lg_conn *c, uint64_t n,
+                      char **out, size_t *out_len)
+{
+    int len;
+
+    buf_reserve(c, strlen(c->lg->payload) + 128);
+    len = sprintf(c->buf,
+                  "<134>1 2018-06-01T00:00:00.000Z bench loadgen %i - - "
+                  "%" PRIu64 " %s\n", c->id, n, c->lg->payload);
+
+    *out = c->buf;
+    *out_len = len;
+    return 0;
+}
+
+/* MQTT remaining length, variable byte integer */
+static int mqtt_length(char *buf, size_t len)
+{
+    int i = 0;
+
+    do {
+        buf[i] = len % 128;
+        len /= 128;
+        if (len > 0) {
+            buf[i] |= 0x80;
+        }
+        i++;
+    } while (len > 0);
+
+    return i;
+}
+
+static int mqtt_connect(struct lg_conn *c)
+{
+    int len;
+    int off;
+    char id[32];
+    char buf[64];
+    char ack[4];
+
+    len = snprintf(id, sizeof(id), "bench-%i", c->id);
+    off = 0;
+    buf[off++] = 0x10;
+    off += mqtt_length(buf + off, 10 + 2 + len);
+    memcpy(buf + off, "\x00\x04MQTT\x04\x02\x00\x3c", 10);
+    off += 10;
+    buf[off++] = 0;
+    buf[off++] = len;
+    memcpy(buf + off, id, len);
+    off += len;
+
+    if (net_write(c->fd, buf, off) == -1 ||
+        recv(c->fd, ack, sizeof(ack), MSG_WAITALL) != sizeof(ack) ||
+        ack[0] != 0x20 || ack[3] != 0) {
+        fprintf(stderr, "MQTT connection refused\n");
+        return -1;
+    }
+    return 0;
+}
+
+static int msg_mqtt(struct lg_conn *c, uint64_t n,
+                    char **out, size_t *out_len)
+{
+    int len;
+    int plen;
+    int tlen;
+    int off;
+    char topic[32];
+    char payload[64];
+    char *p = c->lg->payload;
+
+    tlen = tag_get(c->lg, n, topic, sizeof(topic));
+    plen = snprintf(payload, sizeof(payload), "%" PRIu64, n);
+    plen += strlen(p) + 18;                 /* {"log": "", "n": } */
+    len = 2 + tlen + plen;
+
+    buf_reserve(c, len + 8);
+    off = 0;
+    c->buf[off++] = 0x30;
+    off += mqtt_length(c->buf + off, len);
+    c->buf[off++] = tlen >> 8;
+    c->buf[off++] = tlen & 0xff;
+    memcpy(c->buf + off, topic, tlen);
+    off += tlen;
+    off += sprintf(c->buf + off, "{\"log\": \"%s\", \"n\": %s}", p, payload);
+
+    *out = c->buf;
+    *out_len = off;
+    return 0;
+}
+
+static int msg_http(struct lg_conn *c, uint64_t n, int records,
+                    char **out, size_t *out_len)
+{
+    int i;
+    int hdr;
+    size_t len;
+    char tag[32];
+    char head[256];
+
+    tag_get(c->lg, n, tag, sizeof(tag));
+    for (i = 0; tag[i]; i++) {
+        if (tag[i] == '.') {
+            tag[i] = '/';
+        }
+    }
+
+    /* Body first, right after room for the headers */
+    len = json_lines(c, sizeof(head), n, records) - sizeof(head);
+    hdr = snprintf(head, sizeof(head),
+                   "POST /%s HTTP/1.1\r\n"
+                   "Host: %s:%i\r\n"
+                   "Content-Type: application/x-ndjson\r\n"
+                   "Content-Length: %zu\r\n\r\n",
+                   tag, c->lg->host, c->lg->port, len);
+    memcpy(c->buf + sizeof(head) - hdr, head, hdr);
+
+    *out = c->buf + sizeof(head) - hdr;
+    *out_len = hdr + len;
+    return 0;
+}
+
+/* Read a response, the bodies of in_http answers are empty */
+static int http_response(struct lg_conn *c)
+{
+    int status;
+    ssize_t ret;
+    size_t off = 0;
+    char buf[1024];
+    char *end;
+    char *p;
+    long clen = 0;
+
+    while (1) {
+        ret = read(c->fd, buf + off, sizeof(buf) - 1 - off);
+        if (ret <= 0) {
+            return -1;
+        }
+        off += ret;
+        buf[off] = '\0';
+        end = strstr(buf, "\r\n\r\n");
+        if (end) {
+            break;
+        }
+        if (off == sizeof(buf) - 1) {
+            return -1;
+        }
+    }
+
+    if (sscanf(buf, "HTTP/1.%*c %i", &status) != 1) {
+        return -1;
+    }
+    for (p = strstr(buf, "\r\n"); p && p < end; p = strstr(p + 2, "\r\n")) {
+        if (strncasecmp(p + 2, "content-length:", 15) == 0) {
+            clen = atol(p + 17);
+            break;
+        }
+    }
+
+    /* Discard the body */
+    clen -= off - (end + 4 - buf);
+    while (clen > 0) {
+        ret = read(c->fd, buf, clen < sizeof(buf) ? clen : sizeof(buf));
+        if (ret <= 0) {
+            return -1;
+        }
+        clen -= ret;
+    }
+
+    return status;
+}
+
+/* Reserve up to 'want' records from the total */
+static int lg_reserve(struct lg *lg, int want, uint64_t *n)
+{
+    uint64_t first;
+
+    if (__atomic_load_n(&lg->stop, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+
+    first = __atomic_fetch_add(&lg->reserved, want, __ATOMIC_RELAXED);
+    if (first >= lg->target) {
+        return 0;
+    }
+    *n = first;
+    return (first + want > lg->target) ? lg->target - first : want;
+}
+
+static void *lg_worker(void *data)
+{
+    int ret;
+    int records;
+    int batch;
+    uint64_t n;
+    double start;
+    double wait;
+    double rate = 0;
+    char *msg = NULL;
+    size_t len = 0;
+    struct lg_conn *c = data;
+    struct lg *lg = c->lg;
+
+    batch = lg->proto->batched ? lg->batch : 1;
+    if (lg->rate > 0) {
+        rate = (double) lg->rate / lg->conns;
+    }
+
+    if (lg->proto->id == LG_MQTT && mqtt_connect(c) == -1) {
+        c->errors++;
+        return NULL;
+    }
+
+    start = bench_now();
+    while ((records = lg_reserve(lg, batch, &n)) > 0) {
+        switch (lg->proto->id) {
+        case LG_MESSAGE:
+        case LG_FORWARD:
+        case LG_PACKED:
+        case LG_COMPRESSED:
+            ret = msg_forward(c, n, records, &msg, &len);
+            break;
+        case LG_TCP:
+            len = json_lines(c, 0, n, records);
+            msg = c->buf;
+            ret = 0;
+            break;
+        case LG_SYSLOG_TCP:
+        case LG_SYSLOG_UDP:
+            ret = msg_syslog(c, n, &msg, &len);
+            break;
+        case LG_MQTT:
+            ret = msg_mqtt(c, n, &msg, &len);
+            break;
+        case LG_HTTP:
+            ret = msg_http(c, n, records, &msg, &len);
+            break;
+        default:
+            ret = -1;
+        }
+        if (ret == -1 || lg_send(c, msg, len) == -1) {
+            c->errors++;
+            break;
+        }
+
+        if (lg->proto->id == LG_HTTP) {
+            ret = http_response(c);
+            if (ret < 200 || ret > 299) {
+                c->errors++;
+                if (ret == -1) {
+                    break;
+                }
+                continue;
+            }
+        }
+
+        c->sent += records;
+        c->bytes += len;
+
+        /* Pace the connection to its share of the rate */
+        if (rate > 0) {
+            wait = start + (c->sent / rate) - bench_now();
+            if (wait > 0) {
+                usleep(wait * 1e6);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/* Records ingested by the inputs of the embedded server */
+static uint64_t embedded_records(flb_ctx_t *ctx)
+{
+#ifdef FLB_HAVE_METRICS
+    uint64_t total = 0;
+    struct mk_list *head;
+    struct flb_metric *m;
+    struct flb_input_instance *in;
+
+    mk_list_foreach(head, &ctx->config->inputs) {
+        in = mk_list_entry(head, struct flb_input_instance, _head);
+        m = flb_metrics_get_id(FLB_METRIC_N_RECORDS, in->metrics);
+        if (m) {
+            total += flb_metric_value(m);
+        }
+    }
+    return total;
+#else
+    return 0;
+#endif
+}
+
+/*
+ * Check if the HTTP response in 'buf' is complete and de-chunk its body,
+ * returns the body length or -1 if more data is needed. The monitoring
+ * server does not close the connection after the response.
+ */
+static ssize_t http_body(char *buf, size_t len, char **body)
+{
+    long clen = -1;
+    size_t size;
+    char *end;
+    char *p;
+    char *in;
+    char *out;
+
+    end = strstr(buf, "\r\n\r\n");
+    if (!end) {
+        return -1;
+    }
+    *body = end + 4;
+
+    for (p = strstr(buf, "\r\n"); p && p < end; p = strstr(p + 2, "\r\n")) {
+        if (strncasecmp(p + 2, "content-length:", 15) == 0) {
+            clen = atol(p + 17);
+        }
+        else if (strncasecmp(p + 2, "transfer-encoding: chunked", 26) == 0) {
+            clen = -2;
+        }
+    }
+
+    if (clen >= 0) {
+        return (buf + len - *body) >= clen ? clen : -1;
+    }
+    if (clen == -1) {
+        return -1;               /* until the server closes */
+    }
+
+    /* Chunked: walk the chunks first, then copy them in place */
+    in = *body;
+    while (1) {
+        size = strtoul(in, &p, 16);
+        p = strstr(p, "\r\n");
+        if (!p || p + 2 + size + 2 > buf + len) {
+            return -1;
+        }
+        if (size == 0) {
+            break;
+        }
+        in = p + 2 + size + 2;
+    }
+
+    in = out = *body;
+    while ((size = strtoul(in, &p, 16)) > 0) {
+        p = strstr(p, "\r\n") + 2;
+        memmove(out, p, size);
+        out += size;
+        in = p + size + 2;
+    }
+    *out = '\0';
+
+    return out - *body;
+}
+
+/* Sum of fluentbit_input_records_total from a monitoring API */
+static int64_t monitor_records(char *monitor)
+{
+    int fd;
+    int port;
+    ssize_t ret;
+    size_t off = 0;
+    size_t size = 65536;
+    int64_t total = -1;
+    char host[256];
+    char req[512];
+    char *buf;
+    char *body = NULL;
+    char *p;
+    char *colon;
+    struct timeval tv = {5, 0};
+    struct lg_conn c;
+
+    colon = strrchr(monitor, ':');
+    if (!colon || colon - monitor >= (int) sizeof(host)) {
+        return -1;
+    }
+    memcpy(host, monitor, colon - monitor);
+    host[colon - monitor] = '\0';
+    port = atoi(colon + 1);
+
+    memset(&c, 0, sizeof(c));
+    fd = net_connect(&c, host, port, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    snprintf(req, sizeof(req),
+             "GET /api/v1/metrics/prometheus HTTP/1.1\r\n"
+             "Host: %s\r\n"
+             "Connection: close\r\n\r\n", monitor);
+    if (net_write(fd, req, strlen(req)) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    buf = malloc(size);
+    while (1) {
+        ret = read(fd, buf + off, size - 1 - off);
+        if (ret > 0) {
+            off += ret;
+            buf[off] = '\0';
+            if (off == size - 1) {
+                size *= 2;
+                buf = realloc(buf, size);
+            }
+            if (http_body(buf, off, &body) >= 0) {
+                break;
+            }
+            continue;
+        }
+
+        /* Closed by the server, the body ends here */
+        if (ret == 0 && strstr(buf, "\r\n\r\n")) {
+            body = strstr(buf, "\r\n\r\n") + 4;
+        }
+        break;
+    }
+    close(fd);
+
+    if (body) {
+        total = 0;
+        p = body;
+        while ((p = strstr(p, "fluentbit_input_records_total{"))) {
+            p = strchr(p, '}');
+            if (!p) {
+                break;
+            }
+            total += strtoll(p + 1, &p, 10);
+        }
+    }
+    free(buf);
+
+    return total;
+}
+
+#ifdef FLB_HAVE_METRICS
+/* A free loopback port for the embedded server */
+static int free_port(int udp)
+{
+    int fd;
+    int port = -1;
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+
+    fd = socket(AF_INET, udp ? SOCK_DGRAM : SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0 &&
+        getsockname(fd, (struct sockaddr *) &addr, &len) == 0) {
+        port = ntohs(addr.sin_port);
+    }
+    close(fd);
+    return port;
+}
+
+static flb_ctx_t *embedded_start(struct lg *lg)
+{
+    int in_ffd;
+    int out_ffd;
+    char port[16];
+    flb_ctx_t *ctx;
+
+    lg->port = free_port(lg->proto->udp);
+    snprintf(port, sizeof(port), "%i", lg->port);
+
+    ctx = flb_create();
+    flb_service_set(ctx, "Flush", "1", "Log_Level", "error", NULL);
+
+    in_ffd = flb_input(ctx, lg->proto->input, NULL);
+    flb_input_set(ctx, in_ffd, "tag", "bench", "listen", "127.0.0.1",
+                  "port", port, NULL);
+    if (strcmp(lg->proto->input, "syslog") == 0) {
+        flb_input_set(ctx, in_ffd, "mode", lg->proto->udp ? "udp" : "tcp",
+                      "parser_format", "rfc5424", NULL);
+    }
+    else if (strcmp(lg->proto->input, "tcp") == 0) {
+        flb_input_set(ctx, in_ffd, "format", "ndjson", NULL);
+    }
+    else if (strcmp(lg->proto->input, "mqtt") == 0) {
+        flb_input_set(ctx, in_ffd, "tag_from_topic", "on", NULL);
+    }
+
+    out_ffd = flb_output(ctx, "null", NULL);
+    flb_output_set(ctx, out_ffd, "Match", "*", NULL);
+
+    if (flb_start(ctx) == -1) {
+        flb_destroy(ctx);
+        return NULL;
+    }
+
+    return ctx;
+}
+#else
+static flb_ctx_t *embedded_start(struct lg *lg)
+{
+    fprintf(stderr, "the embedded server needs FLB_METRICS\n");
+    return NULL;
+}
+#endif
+
+/* Server side records, -1 when unknown */
+static int64_t server_records(struct lg *lg, flb_ctx_t *ctx)
+{
+    if (ctx) {
+        return embedded_records(ctx);
+    }
+    if (lg->monitor) {
+        return monitor_records(lg->monitor);
+    }
+    return -1;
+}
+
+static void usage(char *name)
+{
+    fprintf(stderr,
+            "usage: %s [-p message|forward|packed|compressed|tcp|syslog-tcp|"
+            "syslog-udp|mqtt|http] [-H host] [-P port] [-c connections] "
+            "[-r records/s] [-s record size] [-b batch] [-t tags] "
+            "[-d seconds] [-M host:port] [-j] [records]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    int i;
+    int opt;
+    int pad;
+    int ret = 0;
+    char *proto = "forward";
+    uint64_t sent = 0;
+    uint64_t bytes = 0;
+    uint64_t errors = 0;
+    int64_t srv_start = -1;
+    int64_t srv_end = -1;
+    int64_t received = -1;
+    int64_t prev;
+    double start;
+    double elapsed;
+    double idle;
+    struct lg *lg;
+    struct lg_conn *conns;
+    flb_ctx_t *ctx = NULL;
+
+    lg = calloc(1, sizeof(struct lg));
+    lg->conns = 1;
+    lg->record_size = LG_RECORD_SIZE;
+    lg->batch = LG_BATCH;
+    lg->tags = 1;
+    lg->duration = LG_DURATION;
+    lg->target = LG_RECORDS;
+
+    while ((opt = getopt(argc, argv, "p:H:P:c:r:s:b:t:d:M:j")) != -1) {
+        switch (opt) {
+        case 'p': proto = optarg; break;
+        case 'H': lg->host = optarg; break;
+        case 'P': lg->port = atoi(optarg); break;
+        case 'c': lg->conns = atoi(optarg); break;
+        case 'r': lg->rate = strtoull(optarg, NULL, 10); break;
+        case 's': lg->record_size = atoi(optarg); break;
+        case 'b': lg->batch = atoi(optarg); break;
+        case 't': lg->tags = atoi(optarg); break;
+        case 'd': lg->duration = atoi(optarg); break;
+        case 'M': lg->monitor = optarg; break;
+        case 'j': lg->json = 1; break;
+        default:
+            usage(argv[0]);
+            free(lg);
+            return 1;
+        }
+    }
+    if (optind < argc) {
+        lg->target = strtoull(argv[optind], NULL, 10);
+    }
+
+    for (i = 0; protocols[i].name; i++) {
+        if (strcmp(protocols[i].name, proto) == 0) {
+            lg->proto = &protocols[i];
+        }
+    }
+    if (!lg->proto || lg->target == 0 || lg->duration <= 0 ||
+        lg->conns <= 0 || lg->conns > LG_MAX_CONNS || lg->batch <= 0 ||
+        lg->tags <= 0 || (lg->host && lg->port <= 0)) {
+        usage(argv[0]);
+        free(lg);
+        return 1;
+    }
+
+    pad = lg->record_size > 32 ? lg->record_size - 32 : 1;
+    lg->payload = malloc(pad + 1);
+    memset(lg->payload, 'x', pad);
+    lg->payload[pad] = '\0';
+
+    /* A closed connection must fail the write, not kill the process */
+    signal(SIGPIPE, SIG_IGN);
+
+    if (!lg->host) {
+        ctx = embedded_start(lg);
+        if (!ctx) {
+            free(lg->payload);
+            free(lg);
+            return 1;
+        }
+        lg->host = "127.0.0.1";
+    }
+    srv_start = server_records(lg, ctx);
+
+    conns = calloc(lg->conns, sizeof(struct lg_conn));
+    for (i = 0; i < lg->conns; i++) {
+        conns[i].id = i;
+        conns[i].lg = lg;
+        msgpack_sbuffer_init(&conns[i].mp_sbuf);
+        msgpack_sbuffer_init(&conns[i].mp_entries);
+        conns[i].fd = net_connect(&conns[i], lg->host, lg->port,
+                                  lg->proto->udp);
+        if (conns[i].fd == -1) {
+            lg->conns = i;
+            ret = 1;
+            break;
+        }
+    }
+
+    start = bench_now();
+    for (i = 0; i < lg->conns; i++) {
+        pthread_create(&conns[i].tid, NULL, lg_worker, &conns[i]);
+    }
+
+    /* Stop at the deadline, or when every record was sent */
+    while (bench_now() - start < lg->duration &&
+           __atomic_load_n(&lg->reserved, __ATOMIC_RELAXED) < lg->target) {
+        usleep(10000);
+    }
+    __atomic_store_n(&lg->stop, 1, __ATOMIC_RELAXED);
+
+    for (i = 0; i < lg->conns; i++) {
+        pthread_join(conns[i].tid, NULL);
+        sent += conns[i].sent;
+        bytes += conns[i].bytes;
+        errors += conns[i].errors;
+    }
+    elapsed = bench_now() - start;
+
+    /* Let the server take the records in flight */
+    if (srv_start >= 0) {
+        prev = srv_start;
+        idle = bench_now();
+        while (1) {
+            srv_end = server_records(lg, ctx);
+            if (srv_end < 0 || (uint64_t) (srv_end - srv_start) >= sent) {
+                break;
+            }
+            if (srv_end != prev) {
+                prev = srv_end;
+                idle = bench_now();
+            }
+            else if (bench_now() - idle > LG_IDLE) {
+                break;
+            }
+            usleep(50000);
+        }
+        if (srv_end >= 0) {
+            received = srv_end - srv_start;
+        }
+    }
+
+    for (i = 0; i < lg->conns; i++) {
+        close(conns[i].fd);
+        msgpack_sbuffer_destroy(&conns[i].mp_sbuf);
+        msgpack_sbuffer_destroy(&conns[i].mp_entries);
+        free(conns[i].buf);
+    }
+    free(conns);
+
+    if (elapsed <= 0) {
+        elapsed = 1e-6;
+    }
+
+    if (lg->json) {
+        printf("{\"bench\": \"loadgen\", \"case\": \"%s-c%i\", "
+               "\"protocol\": \"%s\", \"connections\": %i, "
+               "\"records\": %" PRIu64 ", \"seconds\": %.3f, "
+               "\"records_per_sec\": %.0f, \"bytes_per_sec\": %.0f, "
+               "\"errors\": %" PRIu64,
+               lg->proto->name, lg->conns,
+               lg->proto->name, lg->conns, sent, elapsed, sent / elapsed,
+               bytes / elapsed, errors);
+        if (received >= 0) {
+            printf(", \"server_records\": %" PRId64 ", "
+                   "\"server_drops\": %" PRId64,
+                   received, (int64_t) sent - received);
+        }
+        printf("}\n");
+    }
+    else {
+        printf("protocol        %s, %i connection(s)\n",
+               lg->proto->name, lg->conns);
+        printf("records         %" PRIu64 " in %.3f s\n", sent, elapsed);
+        printf("records/s       %.0f\n", sent / elapsed);
+        printf("MB/s            %.2f\n", (bytes / elapsed) / (1024 * 1024));
+        printf("errors          %" PRIu64 "\n", errors);
+        if (received >= 0) {
+            printf("server records  %" PRId64 "\n", received);
+            printf("server drops    %" PRId64 "\n",
+                   (int64_t) sent - received);
+        }
+    }
+
+    if (sent == 0 || received == 0) {
+        ret = 1;
+    }
+
+    if (ctx) {
+        flb_stop(ctx);
+        flb_destroy(ctx);
+    }
+    free(lg->payload);
+    free(lg);
+
+    return ret;
+}
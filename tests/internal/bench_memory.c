@@ -0,0 +1,649 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * Memory footprint benchmark
+ * ==========================
+ * Measure the memory used per unit of the common scenarios:
+ *
+ *   $ bin/flb-bench-memory [-s record size] [-f files] [-j] [units]
+ *                          [scenario]
+ *
+ *   records  a record buffered by the engine while the output can't
+ *            deliver it (in_lib -> out_lib asking for retries)
+ *   tail     a file followed by in_tail ('-f' files, 100 by default)
+ *   kube     an entry of the Kubernetes metadata cache (the hash table of
+ *            filter_kubernetes holding the packed metadata of a pod)
+ *   coro     a co-routine with the default stack size
+ *
+ * Every scenario takes the usage once its context is ready and again
+ * with 'units' units alive, and reports the difference per unit of the
+ * heap bytes (usable size of the blocks, glibc allocator only), of the
+ * RSS and of the number of allocations, plus the peaks of the heap and
+ * of the RSS during the scenario. With FLB_MEM_ACCOUNTING the heap bytes
+ * per unit are also broken down by subsystem.
+ *
+ * Freed memory stays in the allocator, the RSS numbers of a scenario are
+ * the most accurate when it runs alone. With -j one JSON object is
+ * printed per scenario.
+ */
+
+#include <fluent-bit.h>
+#include <fluent-bit/flb_hash.h>
+#include <fluent-bit/flb_time.h>
+#include <fluent-bit/flb_thread.h>
+#include <fluent-bit/flb_metrics.h>
+#include <msgpack.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <sys/stat.h>
+
+#include "flb_bench.h"
+
+#define MEM_UNITS         10000
+#define MEM_RECORD_SIZE   128
+#define MEM_FILES         100
+#define MEM_WAIT          30      /* seconds to wait for the engine */
+#define MEM_SETTLE        1500000 /* usec, let the engine create the tasks */
+
+struct footprint {
+    int64_t heap;
+    int64_t rss;
+    uint64_t allocs;
+#ifdef FLB_HAVE_MEM_ACCOUNTING
+    struct flb_mem_usage mem[FLB_MEM_SUBSYSTEMS];
+#endif
+};
+
+struct bench {
+    int record_size;
+    int files;
+    uint64_t units;
+};
+
+struct scenario {
+    char *name;
+    char *unit;
+    int (*run)(struct bench *, uint64_t *, struct footprint *,
+               struct footprint *);
+};
+
+static int64_t rss_get()
+{
+    long pages = 0;
+    long resident = 0;
+    FILE *f;
+
+    f = fopen("/proc/self/statm", "r");
+    if (!f) {
+        return 0;
+    }
+    if (fscanf(f, "%ld %ld", &pages, &resident) != 2) {
+        resident = 0;
+    }
+    fclose(f);
+
+    return (int64_t) resident * sysconf(_SC_PAGESIZE);
+}
+
+/* Peak RSS (VmHWM) in KB */
+static int64_t rss_peak_get()
+{
+    char line[256];
+    long kb = 0;
+    FILE *f;
+
+    f = fopen("/proc/self/status", "r");
+    if (!f) {
+        return 0;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, "VmHWM:", 6) == 0) {
+            kb = atol(line + 6);
+            break;
+        }
+    }
+    fclose(f);
+
+    return kb;
+}
+
+/* Start new peaks, the RSS one needs Linux >= 4.0 */
+static void peak_reset()
+{
+    int fd;
+
+    bench_heap_peak_reset();
+    fd = open("/proc/self/clear_refs", O_WRONLY);
+    if (fd != -1) {
+        if (write(fd, "5", 1) != 1) {
+            /* keep the peak of the process */
+        }
+        close(fd);
+    }
+}
+
+static void footprint_get(struct footprint *fp)
+{
+#ifdef FLB_HAVE_MEM_ACCOUNTING
+    int i;
+
+    for (i = 0; i < FLB_MEM_SUBSYSTEMS; i++) {
+        flb_mem_acct_get(i, &fp->mem[i]);
+    }
+#endif
+    fp->heap = bench_heap_get();
+    fp->rss = rss_get();
+    fp->allocs = bench_allocs_get();
+}
+
+/* Wait until the input of the context ingested 'records' records */
+static int wait_input_records(flb_ctx_t *ctx, uint64_t records)
+{
+#ifdef FLB_HAVE_METRICS
+    double start;
+    struct flb_metric *m;
+    struct flb_input_instance *i_ins;
+
+    i_ins = mk_list_entry_first(&ctx->config->inputs,
+                                struct flb_input_instance, _head);
+    start = bench_now();
+    while (bench_now() - start < MEM_WAIT) {
+        m = flb_metrics_get_id(FLB_METRIC_N_RECORDS, i_ins->metrics);
+        if (m && (uint64_t) flb_metric_value(m) >= records) {
+            return 0;
+        }
+        usleep(10000);
+    }
+    return -1;
+#else
+    sleep(MEM_WAIT / 10);
+    return 0;
+#endif
+}
+
+/* out_lib callback: the destination is 'down', every chunk is retried */
+static int cb_retry(void *record, size_t size, void *data)
+{
+    (void) size;
+    (void) data;
+
+    flb_lib_free(record);
+    return -1;
+}
+
+static int run_records(struct bench *b, uint64_t *units,
+                       struct footprint *before, struct footprint *after)
+{
+    int ret = 0;
+    int len;
+    int pad;
+    int in_ffd;
+    int out_ffd;
+    uint64_t i;
+    char *buf;
+    char *payload;
+    struct flb_lib_out_cb cb;
+    flb_ctx_t *ctx;
+
+    ctx = flb_create();
+    flb_service_set(ctx, "Flush", "1", "Log_Level", "error", NULL);
+    in_ffd = flb_input(ctx, "lib", NULL);
+    flb_input_set(ctx, in_ffd, "tag", "bench", NULL);
+
+    cb.cb = cb_retry;
+    cb.data = NULL;
+    out_ffd = flb_output(ctx, "lib", &cb);
+    flb_output_set(ctx, out_ffd, "Match", "*", "format", "chunk",
+                   "Retry_Limit", "False", NULL);
+    if (flb_start(ctx) == -1) {
+        flb_destroy(ctx);
+        return -1;
+    }
+
+    usleep(MEM_SETTLE);
+    footprint_get(before);
+
+    pad = b->record_size > 48 ? b->record_size - 48 : 1;
+    payload = malloc(pad + 1);
+    buf = malloc(pad + 128);
+    memset(payload, 'x', pad);
+    payload[pad] = '\0';
+    for (i = 0; i < *units; i++) {
+        len = snprintf(buf, pad + 128,
+                       "[%f, {\"log\": \"%s\", \"n\": %" PRIu64 "}]",
+                       flb_time_now(), payload, i);
+        if (flb_lib_push(ctx, in_ffd, buf, len) == -1) {
+            break;
+        }
+    }
+    *units = i;
+    free(payload);
+    free(buf);
+
+    if (wait_input_records(ctx, i) == -1) {
+        fprintf(stderr, "records: the input did not take the records\n");
+        ret = -1;
+    }
+    usleep(MEM_SETTLE);
+    footprint_get(after);
+
+    flb_stop(ctx);
+    flb_destroy(ctx);
+    return ret;
+}
+
+static void dir_remove(char *dir)
+{
+    char path[512];
+    DIR *d;
+    struct dirent *e;
+
+    d = opendir(dir);
+    if (!d) {
+        return;
+    }
+    while ((e = readdir(d))) {
+        if (e->d_name[0] == '.') {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+        unlink(path);
+    }
+    closedir(d);
+    rmdir(dir);
+}
+
+/* Null output, the records are only needed in the input metrics */
+static int run_tail(struct bench *b, uint64_t *units,
+                    struct footprint *before, struct footprint *after)
+{
+    int i;
+    int fd;
+    int ret = 0;
+    int in_ffd;
+    int out_ffd;
+    char dir[64];
+    char path[256];
+    char line[64];
+    flb_ctx_t *ctx;
+
+    strcpy(dir, "/tmp/flb-bench-memory.XXXXXX");
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return -1;
+    }
+
+    ctx = flb_create();
+    flb_service_set(ctx, "Flush", "1", "Log_Level", "error", NULL);
+    snprintf(path, sizeof(path), "%s/*.log", dir);
+    in_ffd = flb_input(ctx, "tail", NULL);
+    flb_input_set(ctx, in_ffd, "tag", "bench", "path", path,
+                  "refresh_interval", "1", NULL);
+    out_ffd = flb_output(ctx, "null", NULL);
+    flb_output_set(ctx, out_ffd, "Match", "*", NULL);
+    if (flb_start(ctx) == -1) {
+        flb_destroy(ctx);
+        dir_remove(dir);
+        return -1;
+    }
+
+    usleep(MEM_SETTLE);
+    footprint_get(before);
+
+    /* One line per file, found by the next scan of the path */
+    *units = b->files;
+    for (i = 0; i < b->files; i++) {
+        snprintf(path, sizeof(path), "%s/%i.log", dir, i);
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1) {
+            perror(path);
+            *units = i;
+            break;
+        }
+        ret = snprintf(line, sizeof(line), "file %i\n", i);
+        if (write(fd, line, ret) != ret) {
+            perror(path);
+        }
+        close(fd);
+    }
+    ret = 0;
+
+    if (wait_input_records(ctx, *units) == -1) {
+        fprintf(stderr, "tail: the files were not read\n");
+        ret = -1;
+    }
+    usleep(MEM_SETTLE);
+    footprint_get(after);
+
+    flb_stop(ctx);
+    flb_destroy(ctx);
+    dir_remove(dir);
+    return ret;
+}
+
+/* Metadata of a pod as filter_kubernetes keeps it in the cache */
+static void kube_meta_pack(msgpack_packer *mp_pck, uint64_t i)
+{
+    char tmp[128];
+    int len;
+
+#define PACK_STR(s, l)                          \
+    msgpack_pack_str(mp_pck, l);                \
+    msgpack_pack_str_body(mp_pck, s, l)
+#define PACK_LIT(s)  PACK_STR(s, sizeof(s) - 1)
+
+    msgpack_pack_map(mp_pck, 8);
+
+    PACK_LIT("pod_name");
+    len = snprintf(tmp, sizeof(tmp), "app-%" PRIu64 "-7d9f8b6c5d-x2x7k", i);
+    PACK_STR(tmp, len);
+
+    PACK_LIT("namespace_name");
+    len = snprintf(tmp, sizeof(tmp), "namespace-%" PRIu64, i % 16);
+    PACK_STR(tmp, len);
+
+    PACK_LIT("pod_id");
+    len = snprintf(tmp, sizeof(tmp), "%08" PRIx64 "-4f2b-11e8-9c2d-fa7ae01bbebc",
+                   i);
+    PACK_STR(tmp, len);
+
+    PACK_LIT("labels");
+    msgpack_pack_map(mp_pck, 4);
+    PACK_LIT("app");
+    len = snprintf(tmp, sizeof(tmp), "app-%" PRIu64, i);
+    PACK_STR(tmp, len);
+    PACK_LIT("pod-template-hash");
+    PACK_LIT("7d9f8b6c5d");
+    PACK_LIT("release");
+    PACK_LIT("stable");
+    PACK_LIT("tier");
+    PACK_LIT("backend");
+
+    PACK_LIT("annotations");
+    msgpack_pack_map(mp_pck, 2);
+    PACK_LIT("prometheus.io/scrape");
+    PACK_LIT("true");
+    PACK_LIT("prometheus.io/port");
+    PACK_LIT("9102");
+
+    PACK_LIT("host");
+    len = snprintf(tmp, sizeof(tmp), "node-%" PRIu64 ".cluster.local", i % 64);
+    PACK_STR(tmp, len);
+
+    PACK_LIT("container_name");
+    PACK_LIT("app");
+
+    PACK_LIT("docker_id");
+    len = snprintf(tmp, sizeof(tmp),
+                   "%016" PRIx64 "9b1f0c1d2e3f4a5b6c7d8e9fa0b1c2d3e4f5a6b7c8d9e0f1",
+                   i);
+    PACK_STR(tmp, len);
+
+#undef PACK_LIT
+#undef PACK_STR
+}
+
+/* Same table settings as filter_kubernetes (kube_conf.c) */
+static int run_kube(struct bench *b, uint64_t *units,
+                    struct footprint *before, struct footprint *after)
+{
+    int len;
+    uint64_t i;
+    char key[128];
+    msgpack_sbuffer mp_sbuf;
+    msgpack_packer mp_pck;
+    struct flb_hash *ht;
+    (void) b;
+
+    ht = flb_hash_create(FLB_HASH_EVICT_LRU, 256, -1);
+    if (!ht) {
+        return -1;
+    }
+
+    msgpack_sbuffer_init(&mp_sbuf);
+    msgpack_packer_init(&mp_pck, &mp_sbuf, msgpack_sbuffer_write);
+
+    footprint_get(before);
+    for (i = 0; i < *units; i++) {
+        /* cache key: namespace:pod */
+        len = snprintf(key, sizeof(key),
+                       "namespace-%" PRIu64 ":app-%" PRIu64 "-7d9f8b6c5d-x2x7k",
+                       i % 16, i);
+        msgpack_sbuffer_clear(&mp_sbuf);
+        kube_meta_pack(&mp_pck, i);
+        if (flb_hash_add(ht, key, len, mp_sbuf.data, mp_sbuf.size) == -1) {
+            break;
+        }
+    }
+    *units = i;
+
+    msgpack_sbuffer_destroy(&mp_sbuf);
+    footprint_get(after);
+    flb_hash_destroy(ht);
+
+    return 0;
+}
+
+#ifdef FLB_HAVE_FLUSH_LIBCO
+static void cb_coro()
+{
+    struct flb_thread *th;
+
+    th = pthread_getspecific(flb_thread_key);
+    while (1) {
+        flb_thread_return(th);
+    }
+}
+
+/* Co-routines as the engine creates them for a flush */
+static int run_coro(struct bench *b, uint64_t *units,
+                    struct footprint *before, struct footprint *after)
+{
+    int ret = 0;
+    uint64_t i;
+    size_t stack_size;
+    struct flb_thread **th;
+    (void) b;
+
+    th = calloc(*units, sizeof(struct flb_thread *));
+    if (!th) {
+        return -1;
+    }
+    flb_thread_prepare();
+
+    footprint_get(before);
+    for (i = 0; i < *units; i++) {
+        th[i] = flb_thread_new(0, NULL);
+        if (!th[i]) {
+            break;
+        }
+        th[i]->stack_request = FLB_THREAD_STACK_SIZE;
+        th[i]->callee = flb_thread_stack_create(FLB_THREAD_STACK_SIZE,
+                                                cb_coro, &stack_size);
+        if (!th[i]->callee) {
+            flb_free(th[i]);
+            break;
+        }
+        th[i]->stack_size = stack_size;
+
+        /* run it once, it touches its stack */
+        flb_thread_resume(th[i]);
+    }
+    if (i < *units) {
+        fprintf(stderr, "coro: could not create co-routine %" PRIu64 "\n", i);
+        ret = -1;
+    }
+    *units = i;
+    footprint_get(after);
+
+    while (i > 0) {
+        flb_thread_destroy(th[--i]);
+    }
+    flb_thread_pool_exit();
+    free(th);
+
+    return ret;
+}
+#endif
+
+static struct scenario scenarios[] = {
+    {"records", "record",    run_records},
+    {"tail",    "file",      run_tail},
+    {"kube",    "entry",     run_kube},
+#ifdef FLB_HAVE_FLUSH_LIBCO
+    {"coro",    "coroutine", run_coro},
+#endif
+    {NULL, NULL, NULL}
+};
+
+static void report(struct scenario *s, uint64_t units, int64_t heap_peak,
+                   int64_t rss_peak, struct footprint *before,
+                   struct footprint *after)
+{
+    double heap;
+    double rss;
+    double allocs;
+#ifdef FLB_HAVE_MEM_ACCOUNTING
+    int i;
+    int n = 0;
+    int64_t live;
+#endif
+
+    if (units == 0) {
+        units = 1;
+    }
+    heap = (double) (after->heap - before->heap) / units;
+    rss = (double) (after->rss - before->rss) / units;
+    allocs = (double) (after->allocs - before->allocs) / units;
+
+    if (bench_json) {
+        printf("{\"bench\": \"memory\", \"case\": \"%s\", \"units\": %" PRIu64
+               ", \"heap_bytes_per_unit\": %.1f, \"rss_bytes_per_unit\": %.1f, "
+               "\"allocs_per_unit\": %.2f, \"heap_peak_kb\": %" PRId64 ", "
+               "\"peak_rss_kb\": %" PRId64,
+               s->name, units, heap, rss, allocs, heap_peak / 1024, rss_peak);
+#ifdef FLB_HAVE_MEM_ACCOUNTING
+        printf(", \"subsystems\": {");
+        for (i = 0; i < FLB_MEM_SUBSYSTEMS; i++) {
+            live = after->mem[i].live - before->mem[i].live;
+            printf("%s\"%s\": %.1f", i > 0 ? ", " : "",
+                   flb_mem_subsystem_name(i), (double) live / units);
+        }
+        printf("}");
+#endif
+        printf("}\n");
+        return;
+    }
+
+    printf("%-8s %9" PRIu64 " %-10s %12.1f %12.1f %10.2f %10" PRId64
+           " %10" PRId64 "\n", s->name, units, s->unit, heap, rss, allocs,
+           heap_peak / 1024, rss_peak);
+
+#ifdef FLB_HAVE_MEM_ACCOUNTING
+    for (i = 0; i < FLB_MEM_SUBSYSTEMS; i++) {
+        live = after->mem[i].live - before->mem[i].live;
+        if (live == 0) {
+            continue;
+        }
+        printf("%s %s %.1f", n++ == 0 ? "         by subsystem:" : ",",
+               flb_mem_subsystem_name(i), (double) live / units);
+    }
+    if (n > 0) {
+        printf(" bytes/unit\n");
+    }
+#endif
+}
+
+static void usage(char *name)
+{
+    fprintf(stderr,
+            "usage: %s [-s record size] [-f files] [-j] [units] "
+            "[records|tail|kube|coro]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+    int ret = 0;
+    int found = 0;
+    char *name = NULL;
+    uint64_t units;
+    int64_t heap_peak;
+    int64_t rss_peak;
+    struct footprint before;
+    struct footprint after;
+    struct scenario *s;
+    struct bench b;
+
+    memset(&b, 0, sizeof(b));
+    b.record_size = MEM_RECORD_SIZE;
+    b.files = MEM_FILES;
+    b.units = MEM_UNITS;
+
+    while ((opt = getopt(argc, argv, "s:f:j")) != -1) {
+        switch (opt) {
+        case 's': b.record_size = atoi(optarg); break;
+        case 'f': b.files = atoi(optarg); break;
+        case 'j': bench_json = 1; break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind < argc) {
+        b.units = strtoull(argv[optind++], NULL, 10);
+    }
+    if (optind < argc) {
+        name = argv[optind];
+    }
+    if (b.units == 0 || b.files <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+#ifndef BENCH_ALLOCS
+    fprintf(stderr, "heap usage needs the glibc allocator, "
+            "only the RSS is reported\n");
+#endif
+
+    if (!bench_json) {
+        printf("%-8s %9s %-10s %12s %12s %10s %10s %10s\n", "scenario",
+               "units", "unit", "heap B/unit", "rss B/unit", "allocs",
+               "heap peak", "rss peak");
+        printf("%-8s %9s %-10s %12s %12s %10s %10s %10s\n", "", "", "",
+               "", "", "/unit", "KB", "KB");
+    }
+
+    for (s = scenarios; s->name; s++) {
+        if (name && strcmp(name, s->name) != 0) {
+            continue;
+        }
+        found++;
+
+        memset(&before, 0, sizeof(before));
+        memset(&after, 0, sizeof(after));
+        units = b.units;
+
+        peak_reset();
+        if (s->run(&b, &units, &before, &after) == -1) {
+            fprintf(stderr, "%s: scenario failed\n", s->name);
+            ret = 1;
+            continue;
+        }
+        heap_peak = bench_heap_peak_get();
+        rss_peak = rss_peak_get();
+        report(s, units, heap_peak, rss_peak, &before, &after);
+    }
+
+    if (found == 0) {
+        fprintf(stderr, "unknown scenario '%s'\n", name);
+        return 1;
+    }
+    return ret;
+}
@@ -0,0 +1,1070 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * Output benchmark
+ * ================
+ * A mock HTTP server answers like Elasticsearch (bulk API), Splunk (HEC)
+ * or a generic HTTP endpoint, while the engine pushes records through
+ * the matching output plugin:
+ *
+ *   $ bin/flb-bench-output [-o es|http|splunk] [-l latency ms]
+ *                          [-e error %] [-p partial %] [-S seed]
+ *                          [-k] [-W workers] [-O key=value] [-s record size]
+ *                          [-F flush] [-j] [records]
+ *   $ bin/flb-bench-output -L port [-o es|http|splunk] [-l ms] [-e %] [-p %]
+ *
+ * Every response waits 'latency' milliseconds. A request fails as a whole
+ * (HTTP 503) with a probability of 'error' percent and, for 'es', a
+ * successful request carries failed items (status 429) with a probability
+ * of 'partial' percent: every item of such a request fails with a 50%
+ * probability. The decisions come from a PRNG seeded with -S.
+ *
+ * The records carry a sequence number, the server parses the request
+ * bodies (chunked and gzip bodies too) and keeps the records it accepted,
+ * so the benchmark reports the delivery rate, the requests and the TCP
+ * connections used (keepalive with -k), the records accepted more than
+ * once (a whole chunk retried after a partial failure) and the retries of
+ * the engine. -O sets more output properties (e.g. 'partial_retry=on',
+ * 'compress=gzip'), -W the output workers.
+ *
+ * With -L only the server runs on the given port, for an external Fluent
+ * Bit, and it prints its counters on SIGINT.
+ *
+ * With -j a single JSON object is printed. The numbers are only
+ * comparable between runs on the same host.
+ */
+
+#include <fluent-bit.h>
+#include <fluent-bit/flb_gzip.h>
+#include <fluent-bit/flb_time.h>
+#include <fluent-bit/flb_metrics.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+
+#include "flb_bench.h"
+
+#define OUT_RECORDS       100000
+#define OUT_RECORD_SIZE   128
+#define OUT_IDLE          60      /* seconds without progress, give up */
+#define OUT_HEADER_MAX    65536
+
+enum {
+    MOCK_ES = 0,
+    MOCK_HTTP,
+    MOCK_SPLUNK
+};
+
+static char *mock_names[] = {"es", "http", "splunk", NULL};
+
+struct mock_buf {
+    char *data;
+    size_t len;
+    size_t size;
+};
+
+struct mock_req {
+    char method[16];
+    char uri[256];
+    int close;
+    int chunked;
+    int gzip;
+    size_t hdr_len;
+    size_t content_length;
+    size_t consumed;              /* request bytes in the input buffer */
+    struct mock_buf body;
+};
+
+struct mock {
+    int type;
+    int fd;
+    int port;
+    int latency;                  /* msec */
+    int error_rate;               /* percent */
+    int partial_rate;             /* percent */
+    int stop;
+    int active;                   /* open connections */
+    pthread_t tid;
+
+    /* protected by 'lock' */
+    pthread_mutex_t lock;
+    uint64_t rand;
+    uint8_t *seen;
+    uint64_t seen_size;           /* bits */
+    uint64_t connections;
+    uint64_t requests;
+    uint64_t bytes;               /* request bytes, as received */
+    uint64_t records;             /* records in the request bodies */
+    uint64_t accepted;            /* unique records acknowledged */
+    uint64_t duplicated;
+    uint64_t error_responses;
+    uint64_t partial_responses;
+    uint64_t rejected_items;
+    uint64_t invalid;
+};
+
+struct mock_conn {
+    int fd;
+    struct mock *m;
+};
+
+static volatile sig_atomic_t exit_signal;
+
+static void cb_signal(int sig)
+{
+    exit_signal = sig;
+}
+
+/* xorshift64*, the caller holds the lock */
+static inline uint32_t mock_rand(struct mock *m)
+{
+    m->rand ^= m->rand >> 12;
+    m->rand ^= m->rand << 25;
+    m->rand ^= m->rand >> 27;
+    return (m->rand * 2685821657736338717ULL) >> 32;
+}
+
+static inline int mock_roll(struct mock *m, int percent)
+{
+    return percent > 0 && (int) (mock_rand(m) % 100) < percent;
+}
+
+static int buf_reserve(struct mock_buf *b, size_t size)
+{
+    char *tmp;
+    size_t n;
+
+    if (b->len + size <= b->size) {
+        return 0;
+    }
+    n = b->size ? b->size : 65536;
+    while (n < b->len + size) {
+        n *= 2;
+    }
+    tmp = realloc(b->data, n);
+    if (!tmp) {
+        return -1;
+    }
+    b->data = tmp;
+    b->size = n;
+    return 0;
+}
+
+static int buf_append(struct mock_buf *b, const void *data, size_t len)
+{
+    if (buf_reserve(b, len) == -1) {
+        return -1;
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+    return 0;
+}
+
+static inline int buf_str(struct mock_buf *b, const char *str)
+{
+    return buf_append(b, str, strlen(str));
+}
+
+/* Read more bytes of the request, returns 0 on EOF or error */
+static ssize_t buf_read(int fd, struct mock_buf *b)
+{
+    ssize_t n;
+
+    if (buf_reserve(b, 16384) == -1) {
+        return 0;
+    }
+    do {
+        n = recv(fd, b->data + b->len, b->size - b->len, 0);
+    } while (n == -1 && errno == EINTR);
+    if (n <= 0) {
+        return 0;
+    }
+    b->len += n;
+    return n;
+}
+
+static char *find_crlf(char *p, size_t len)
+{
+    char *end = p + len;
+
+    while (p + 1 < end) {
+        p = memchr(p, '\r', end - p - 1);
+        if (!p) {
+            return NULL;
+        }
+        if (p[1] == '\n') {
+            return p;
+        }
+        p++;
+    }
+    return NULL;
+}
+
+static char *find_headers_end(char *p, size_t len)
+{
+    char *end = p + len;
+    char *crlf;
+
+    while ((crlf = find_crlf(p, end - p))) {
+        if (crlf + 3 < end && crlf[2] == '\r' && crlf[3] == '\n') {
+            return crlf + 4;
+        }
+        p = crlf + 2;
+    }
+    return NULL;
+}
+
+static int header_is(char *line, size_t len, char *name, char **val)
+{
+    size_t n = strlen(name);
+
+    if (len <= n || strncasecmp(line, name, n) != 0 || line[n] != ':') {
+        return FLB_FALSE;
+    }
+    line += n + 1;
+    while (*line == ' ') {
+        line++;
+    }
+    *val = line;
+    return FLB_TRUE;
+}
+
+static int parse_headers(struct mock_req *r, char *buf, size_t len)
+{
+    int http10;
+    char *p;
+    char *eol;
+    char *val;
+
+    eol = find_crlf(buf, len);
+    if (sscanf(buf, "%15s %255s", r->method, r->uri) != 2) {
+        return -1;
+    }
+    http10 = (eol - buf >= 8 && memcmp(eol - 8, "HTTP/1.0", 8) == 0);
+    r->close = http10;
+
+    for (p = eol + 2; p < buf + len - 2; p = eol + 2) {
+        eol = find_crlf(p, buf + len - p);
+        if (header_is(p, eol - p, "Content-Length", &val)) {
+            r->content_length = strtoul(val, NULL, 10);
+        }
+        else if (header_is(p, eol - p, "Transfer-Encoding", &val)) {
+            r->chunked = (strncasecmp(val, "chunked", 7) == 0);
+        }
+        else if (header_is(p, eol - p, "Content-Encoding", &val)) {
+            r->gzip = (strncasecmp(val, "gzip", 4) == 0);
+        }
+        else if (header_is(p, eol - p, "Connection", &val)) {
+            if (strncasecmp(val, "close", 5) == 0) {
+                r->close = FLB_TRUE;
+            }
+            else if (strncasecmp(val, "keep-alive", 10) == 0) {
+                r->close = FLB_FALSE;
+            }
+        }
+    }
+    return 0;
+}
+
+/* Decode the chunks of the body as they arrive */
+static int read_chunked(int fd, struct mock_buf *in, struct mock_req *r)
+{
+    size_t pos = r->hdr_len;
+    size_t size;
+    char *eol;
+
+    while (1) {
+        eol = find_crlf(in->data + pos, in->len - pos);
+        if (!eol) {
+            if (buf_read(fd, in) == 0) {
+                return -1;
+            }
+            continue;
+        }
+
+        size = strtoul(in->data + pos, NULL, 16);
+        if (size == 0) {
+            /* no trailers: '0\r\n\r\n' */
+            while (in->len < (size_t) (eol - in->data) + 4) {
+                if (buf_read(fd, in) == 0) {
+                    return -1;
+                }
+            }
+            r->consumed = (eol - in->data) + 4;
+            return 0;
+        }
+
+        pos = (eol - in->data) + 2;
+        while (in->len < pos + size + 2) {
+            if (buf_read(fd, in) == 0) {
+                return -1;
+            }
+        }
+        if (buf_append(&r->body, in->data + pos, size) == -1) {
+            return -1;
+        }
+        pos += size + 2;
+    }
+}
+
+static int gunzip_body(struct mock_req *r)
+{
+    int ret;
+    size_t len;
+    struct flb_gunzip gz;
+    struct mock_buf out = {0};
+
+    flb_gunzip_init(&gz, r->body.data, r->body.len);
+    while (1) {
+        if (buf_reserve(&out, 65536) == -1) {
+            ret = -1;
+            break;
+        }
+        ret = flb_gunzip_read(&gz, out.data + out.len, out.size - out.len,
+                              &len);
+        if (ret == -1 || len == 0) {
+            break;
+        }
+        out.len += len;
+    }
+    flb_gunzip_destroy(&gz);
+
+    if (ret == -1) {
+        free(out.data);
+        return -1;
+    }
+    free(r->body.data);
+    r->body = out;
+    return 0;
+}
+
+/* Read one request, returns -1 when the connection is closed */
+static int read_request(int fd, struct mock_buf *in, struct mock_req *r)
+{
+    char *end;
+
+    while (!(end = find_headers_end(in->data, in->len))) {
+        if (in->len > OUT_HEADER_MAX || buf_read(fd, in) == 0) {
+            return -1;
+        }
+    }
+    r->hdr_len = end - in->data;
+    if (parse_headers(r, in->data, r->hdr_len) == -1) {
+        return -1;
+    }
+
+    if (r->chunked) {
+        if (read_chunked(fd, in, r) == -1) {
+            return -1;
+        }
+    }
+    else {
+        while (in->len < r->hdr_len + r->content_length) {
+            if (buf_read(fd, in) == 0) {
+                return -1;
+            }
+        }
+        if (buf_append(&r->body, in->data + r->hdr_len,
+                       r->content_length) == -1) {
+            return -1;
+        }
+        r->consumed = r->hdr_len + r->content_length;
+    }
+
+    if (r->gzip && gunzip_body(r) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Sequence numbers of the records in a body, in order: the '"n":' keys of
+ * the JSON records. Returns the number of records.
+ */
+static size_t body_records(struct mock_req *r, uint64_t **out)
+{
+    char *p;
+    char *end;
+    size_t n = 0;
+    size_t size = 0;
+    uint64_t *seq = NULL;
+    uint64_t *tmp;
+
+    p = r->body.data;
+    end = p + r->body.len;
+    while (p && p + 4 < end) {
+        p = memchr(p, '"', end - p - 4);
+        if (!p) {
+            break;
+        }
+        if (p > r->body.data && (p[-1] == ',' || p[-1] == '{' || p[-1] == ' ') &&
+            p[1] == 'n' && p[2] == '"' && p[3] == ':') {
+            if (n == size) {
+                size = size ? size * 2 : 1024;
+                tmp = realloc(seq, size * sizeof(uint64_t));
+                if (!tmp) {
+                    break;
+                }
+                seq = tmp;
+            }
+            seq[n++] = strtoull(p + 4, &p, 10);
+            continue;
+        }
+        p++;
+    }
+
+    *out = seq;
+    return n;
+}
+
+/* Mark a record as accepted, the caller holds the lock */
+static void mock_accept(struct mock *m, uint64_t seq)
+{
+    uint64_t size;
+
+    if (seq >= m->seen_size) {
+        size = m->seen_size ? m->seen_size : 65536;
+        while (size <= seq) {
+            size *= 2;
+        }
+        m->seen = realloc(m->seen, size / 8);
+        memset(m->seen + m->seen_size / 8, 0, (size - m->seen_size) / 8);
+        m->seen_size = size;
+    }
+
+    if ((m->seen[seq / 8] >> (seq % 8)) & 1) {
+        m->duplicated++;
+        return;
+    }
+    m->seen[seq / 8] |= 1 << (seq % 8);
+    m->accepted++;
+}
+
+static int uri_is(struct mock_req *r, char *prefix)
+{
+    return strncmp(r->uri, prefix, strlen(prefix)) == 0;
+}
+
+/* Build the response of a request, returns the HTTP status */
+static int mock_handle(struct mock *m, struct mock_req *r,
+                       struct mock_buf *resp)
+{
+    int i;
+    int status = 200;
+    int partial = FLB_FALSE;
+    int item;
+    int len;
+    char tmp[256];
+    size_t n;
+    uint64_t *seq = NULL;
+
+    if (strcmp(r->method, "POST") != 0 && strcmp(r->method, "PUT") != 0) {
+        buf_str(resp, "{}");
+        return 200;
+    }
+
+    if ((m->type == MOCK_ES && !uri_is(r, "/_bulk")) ||
+        (m->type == MOCK_SPLUNK && !uri_is(r, "/services/collector"))) {
+        pthread_mutex_lock(&m->lock);
+        m->invalid++;
+        pthread_mutex_unlock(&m->lock);
+        buf_str(resp, "{\"error\":\"not found\"}");
+        return 404;
+    }
+
+    n = body_records(r, &seq);
+
+    pthread_mutex_lock(&m->lock);
+    m->requests++;
+    m->records += n;
+
+    if (mock_roll(m, m->error_rate)) {
+        m->error_responses++;
+        pthread_mutex_unlock(&m->lock);
+        free(seq);
+
+        if (m->type == MOCK_SPLUNK) {
+            buf_str(resp, "{\"text\":\"Server is busy\",\"code\":9}");
+        }
+        else if (m->type == MOCK_ES) {
+            buf_str(resp, "{\"error\":{\"type\":\"es_rejected_execution_"
+                    "exception\"},\"status\":503}");
+        }
+        return 503;
+    }
+
+    if (m->type == MOCK_ES) {
+        partial = mock_roll(m, m->partial_rate);
+        if (partial) {
+            m->partial_responses++;
+        }
+        len = snprintf(tmp, sizeof(tmp),
+                       "{\"took\":1,\"errors\":%s,\"items\":[",
+                       partial ? "true" : "false");
+        buf_append(resp, tmp, len);
+    }
+
+    for (i = 0; i < (int) n; i++) {
+        item = 201;
+        if (partial && (mock_rand(m) & 1)) {
+            item = 429;
+            m->rejected_items++;
+        }
+        else {
+            mock_accept(m, seq[i]);
+        }
+
+        if (m->type != MOCK_ES) {
+            continue;
+        }
+        if (item == 201) {
+            len = snprintf(tmp, sizeof(tmp),
+                           "%s{\"index\":{\"_index\":\"bench\",\"_id\":\"%i\","
+                           "\"status\":201}}", i > 0 ? "," : "", i);
+        }
+        else {
+            len = snprintf(tmp, sizeof(tmp),
+                           "%s{\"index\":{\"_index\":\"bench\",\"status\":429,"
+                           "\"error\":{\"type\":\"es_rejected_execution_"
+                           "exception\",\"reason\":\"mock\"}}}",
+                           i > 0 ? "," : "");
+        }
+        buf_append(resp, tmp, len);
+    }
+    pthread_mutex_unlock(&m->lock);
+    free(seq);
+
+    if (m->type == MOCK_ES) {
+        buf_str(resp, "]}");
+    }
+    else if (m->type == MOCK_SPLUNK) {
+        buf_str(resp, "{\"text\":\"Success\",\"code\":0}");
+    }
+    else {
+        buf_str(resp, "ok");
+    }
+    return status;
+}
+
+static int write_all(int fd, char *data, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void *conn_run(void *data)
+{
+    int ret;
+    int status;
+    char hdr[256];
+    struct mock_conn *c = data;
+    struct mock *m = c->m;
+    struct mock_buf in = {0};
+    struct mock_buf resp = {0};
+    struct mock_req r;
+
+    while (!__atomic_load_n(&m->stop, __ATOMIC_RELAXED)) {
+        memset(&r, 0, sizeof(r));
+        if (read_request(c->fd, &in, &r) == -1) {
+            free(r.body.data);
+            break;
+        }
+
+        resp.len = 0;
+        status = mock_handle(m, &r, &resp);
+        pthread_mutex_lock(&m->lock);
+        m->bytes += r.consumed;
+        pthread_mutex_unlock(&m->lock);
+
+        if (m->latency > 0) {
+            usleep(m->latency * 1000);
+        }
+
+        ret = snprintf(hdr, sizeof(hdr),
+                       "HTTP/1.1 %i %s\r\n"
+                       "Content-Type: application/json\r\n"
+                       "Content-Length: %zu\r\n"
+                       "%s\r\n",
+                       status, status == 200 ? "OK" : "Error", resp.len,
+                       r.close ? "Connection: close\r\n" : "");
+        if (write_all(c->fd, hdr, ret) == -1 ||
+            write_all(c->fd, resp.data, resp.len) == -1) {
+            free(r.body.data);
+            break;
+        }
+        free(r.body.data);
+
+        if (r.close) {
+            break;
+        }
+
+        /* keep a pipelined request */
+        memmove(in.data, in.data + r.consumed, in.len - r.consumed);
+        in.len -= r.consumed;
+    }
+
+    close(c->fd);
+    free(in.data);
+    free(resp.data);
+    __atomic_sub_fetch(&m->active, 1, __ATOMIC_RELAXED);
+    free(c);
+
+    return NULL;
+}
+
+static void *mock_run(void *data)
+{
+    int fd;
+    int on = 1;
+    pthread_t tid;
+    pthread_attr_t attr;
+    struct pollfd pfd;
+    struct mock_conn *c;
+    struct mock *m = data;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    pfd.fd = m->fd;
+    pfd.events = POLLIN;
+    while (!__atomic_load_n(&m->stop, __ATOMIC_RELAXED)) {
+        if (poll(&pfd, 1, 100) <= 0) {
+            continue;
+        }
+        fd = accept(m->fd, NULL, NULL);
+        if (fd == -1) {
+            continue;
+        }
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+        c = malloc(sizeof(struct mock_conn));
+        c->fd = fd;
+        c->m = m;
+        pthread_mutex_lock(&m->lock);
+        m->connections++;
+        pthread_mutex_unlock(&m->lock);
+        __atomic_add_fetch(&m->active, 1, __ATOMIC_RELAXED);
+        if (pthread_create(&tid, &attr, conn_run, c) != 0) {
+            __atomic_sub_fetch(&m->active, 1, __ATOMIC_RELAXED);
+            close(fd);
+            free(c);
+        }
+    }
+    pthread_attr_destroy(&attr);
+
+    return NULL;
+}
+
+/* Listen on 127.0.0.1:port, a free port if it's zero */
+static int mock_start(struct mock *m)
+{
+    int on = 1;
+    socklen_t len;
+    struct sockaddr_in addr;
+
+    m->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (m->fd == -1) {
+        perror("socket");
+        return -1;
+    }
+    setsockopt(m->fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(m->port);
+    len = sizeof(addr);
+    if (bind(m->fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+        listen(m->fd, 128) == -1 ||
+        getsockname(m->fd, (struct sockaddr *) &addr, &len) == -1) {
+        perror("mock server");
+        close(m->fd);
+        return -1;
+    }
+    m->port = ntohs(addr.sin_port);
+
+    pthread_mutex_init(&m->lock, NULL);
+    if (pthread_create(&m->tid, NULL, mock_run, m) != 0) {
+        close(m->fd);
+        return -1;
+    }
+    return 0;
+}
+
+static void mock_stop(struct mock *m)
+{
+    int i;
+
+    __atomic_store_n(&m->stop, 1, __ATOMIC_RELAXED);
+    pthread_join(m->tid, NULL);
+    close(m->fd);
+
+    /* connections wake up when the engine closes them */
+    for (i = 0; i < 500 && __atomic_load_n(&m->active, __ATOMIC_RELAXED) > 0;
+         i++) {
+        usleep(10000);
+    }
+}
+
+static uint64_t mock_accepted(struct mock *m)
+{
+    uint64_t n;
+
+    pthread_mutex_lock(&m->lock);
+    n = m->accepted;
+    pthread_mutex_unlock(&m->lock);
+    return n;
+}
+
+#ifdef FLB_HAVE_METRICS
+static uint64_t output_metric(flb_ctx_t *ctx, int id)
+{
+    struct flb_metric *m;
+    struct flb_output_instance *o_ins;
+
+    o_ins = mk_list_entry_first(&ctx->config->outputs,
+                                struct flb_output_instance, _head);
+    m = flb_metrics_get_id(id, o_ins->metrics);
+    return m ? flb_metric_value(m) : 0;
+}
+#endif
+
+static int bench_setup(flb_ctx_t *ctx, struct mock *m, char *flush,
+                       int keepalive, char *workers, char **props, int n_props)
+{
+    int i;
+    int in_ffd;
+    int out_ffd;
+    char port[16];
+    char *sep;
+
+    flb_service_set(ctx, "Flush", flush, "Log_Level", "error", NULL);
+
+    in_ffd = flb_input(ctx, "lib", NULL);
+    flb_input_set(ctx, in_ffd, "tag", "bench", NULL);
+
+    out_ffd = flb_output(ctx, mock_names[m->type], NULL);
+    if (out_ffd < 0) {
+        fprintf(stderr, "output '%s' is not available\n",
+                mock_names[m->type]);
+        return -1;
+    }
+
+    snprintf(port, sizeof(port), "%i", m->port);
+    flb_output_set(ctx, out_ffd, "Match", "*", "Host", "127.0.0.1",
+                   "Port", port, "Retry_Limit", "False",
+                   "keepalive", keepalive ? "on" : "off", NULL);
+    if (workers) {
+        flb_output_set(ctx, out_ffd, "workers", workers, NULL);
+    }
+
+    if (m->type == MOCK_ES) {
+        flb_output_set(ctx, out_ffd, "Index", "bench", NULL);
+    }
+    else if (m->type == MOCK_HTTP) {
+        flb_output_set(ctx, out_ffd, "uri", "/bench", "format", "json_lines",
+                       NULL);
+    }
+    else {
+        flb_output_set(ctx, out_ffd, "splunk_token", "bench", NULL);
+    }
+
+    for (i = 0; i < n_props; i++) {
+        sep = strchr(props[i], '=');
+        if (!sep) {
+            fprintf(stderr, "invalid property '%s'\n", props[i]);
+            return -1;
+        }
+        *sep = '\0';
+        flb_output_set(ctx, out_ffd, props[i], sep + 1, NULL);
+    }
+
+    return in_ffd;
+}
+
+static uint64_t bench_push(flb_ctx_t *ctx, int in_ffd, uint64_t target,
+                           int record_size)
+{
+    int len;
+    int pad;
+    uint64_t i;
+    char *buf;
+    char *payload;
+
+    pad = record_size > 48 ? record_size - 48 : 1;
+    payload = malloc(pad + 1);
+    buf = malloc(pad + 128);
+    memset(payload, 'x', pad);
+    payload[pad] = '\0';
+
+    for (i = 0; i < target; i++) {
+        len = snprintf(buf, pad + 128,
+                       "[%f, {\"log\": \"%s\", \"n\": %" PRIu64 "}]",
+                       flb_time_now(), payload, i);
+        if (flb_lib_push(ctx, in_ffd, buf, len) == -1) {
+            break;
+        }
+    }
+
+    free(payload);
+    free(buf);
+    return i;
+}
+
+static void mock_print(struct mock *m)
+{
+    printf("requests        %" PRIu64 " on %" PRIu64 " connection(s)\n",
+           m->requests, m->connections);
+    printf("records         %" PRIu64 " received, %" PRIu64 " accepted, "
+           "%" PRIu64 " duplicated\n", m->records, m->accepted,
+           m->duplicated);
+    printf("error responses %" PRIu64 "\n", m->error_responses);
+    printf("partial         %" PRIu64 " response(s), %" PRIu64
+           " rejected item(s)\n", m->partial_responses, m->rejected_items);
+    printf("bytes           %" PRIu64 "\n", m->bytes);
+}
+
+/* Only the server, for an external Fluent Bit */
+static int mock_serve(struct mock *m)
+{
+    if (mock_start(m) == -1) {
+        return 1;
+    }
+    fprintf(stderr, "mock %s server on 127.0.0.1:%i\n",
+            mock_names[m->type], m->port);
+
+    signal(SIGINT, cb_signal);
+    signal(SIGTERM, cb_signal);
+    while (!exit_signal) {
+        pause();
+    }
+    mock_stop(m);
+    mock_print(m);
+
+    return 0;
+}
+
+static void usage(char *name)
+{
+    fprintf(stderr,
+            "usage: %s [-o es|http|splunk] [-l latency ms] [-e error %%] "
+            "[-p partial %%] [-S seed] [-k] [-W workers] [-O key=value] "
+            "[-s record size] [-F flush] [-L port] [-j] [records]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    int i;
+    int opt;
+    int ret = 0;
+    int json = 0;
+    int keepalive = 0;
+    int listen_port = -1;
+    int record_size = OUT_RECORD_SIZE;
+    int in_ffd;
+    int n_props = 0;
+    char *props[16];
+    char *type = "es";
+    char *flush = "1";
+    char *workers = NULL;
+    uint64_t seed = 1;
+    uint64_t target = OUT_RECORDS;
+    uint64_t pushed;
+    uint64_t accepted;
+    uint64_t prev = 0;
+    uint64_t lost;
+    uint64_t retries = 0;
+    uint64_t retries_failed = 0;
+    double start;
+    double elapsed;
+    double idle;
+    double cpu;
+    struct rusage ru0;
+    struct rusage ru1;
+    struct mock *m;
+    flb_ctx_t *ctx;
+
+    m = calloc(1, sizeof(struct mock));
+    while ((opt = getopt(argc, argv, "o:l:e:p:S:kW:O:s:F:L:j")) != -1) {
+        switch (opt) {
+        case 'o': type = optarg; break;
+        case 'l': m->latency = atoi(optarg); break;
+        case 'e': m->error_rate = atoi(optarg); break;
+        case 'p': m->partial_rate = atoi(optarg); break;
+        case 'S': seed = strtoull(optarg, NULL, 10); break;
+        case 'k': keepalive = 1; break;
+        case 'W': workers = optarg; break;
+        case 'O':
+            if (n_props < 16) {
+                props[n_props++] = optarg;
+            }
+            break;
+        case 's': record_size = atoi(optarg); break;
+        case 'F': flush = optarg; break;
+        case 'L': listen_port = atoi(optarg); break;
+        case 'j': json = 1; break;
+        default:
+            usage(argv[0]);
+            free(m);
+            return 1;
+        }
+    }
+    if (optind < argc) {
+        target = strtoull(argv[optind], NULL, 10);
+    }
+
+    m->type = -1;
+    for (i = 0; mock_names[i]; i++) {
+        if (strcmp(mock_names[i], type) == 0) {
+            m->type = i;
+        }
+    }
+    if (m->type == -1 || target == 0 || m->latency < 0 ||
+        m->error_rate < 0 || m->error_rate >= 100 ||
+        m->partial_rate < 0 || m->partial_rate > 100) {
+        usage(argv[0]);
+        free(m);
+        return 1;
+    }
+    m->rand = seed ? seed : 1;
+
+    if (listen_port >= 0) {
+        m->port = listen_port;
+        ret = mock_serve(m);
+        free(m->seen);
+        free(m);
+        return ret;
+    }
+
+    if (mock_start(m) == -1) {
+        free(m);
+        return 1;
+    }
+
+    ctx = flb_create();
+    in_ffd = bench_setup(ctx, m, flush, keepalive, workers, props, n_props);
+    if (in_ffd < 0 || flb_start(ctx) == -1) {
+        flb_destroy(ctx);
+        mock_stop(m);
+        free(m);
+        return 1;
+    }
+
+    getrusage(RUSAGE_SELF, &ru0);
+    start = bench_now();
+    pushed = bench_push(ctx, in_ffd, target, record_size);
+
+    /* Wait for the server to accept everything, or for it to stall */
+    idle = bench_now();
+    while (1) {
+        accepted = mock_accepted(m);
+        if (accepted >= pushed) {
+            break;
+        }
+        if (accepted != prev) {
+            prev = accepted;
+            idle = bench_now();
+        }
+        else if (bench_now() - idle > OUT_IDLE) {
+            break;
+        }
+        usleep(10000);
+    }
+    elapsed = bench_now() - start;
+    getrusage(RUSAGE_SELF, &ru1);
+
+#ifdef FLB_HAVE_METRICS
+    retries = output_metric(ctx, FLB_METRIC_OUT_RETRY);
+    retries_failed = output_metric(ctx, FLB_METRIC_OUT_RETRY_FAILED);
+#endif
+
+    flb_stop(ctx);
+    flb_destroy(ctx);
+    mock_stop(m);
+
+    cpu = (ru1.ru_utime.tv_sec - ru0.ru_utime.tv_sec) +
+          (ru1.ru_utime.tv_usec - ru0.ru_utime.tv_usec) / 1e6 +
+          (ru1.ru_stime.tv_sec - ru0.ru_stime.tv_sec) +
+          (ru1.ru_stime.tv_usec - ru0.ru_stime.tv_usec) / 1e6;
+    accepted = m->accepted;
+    lost = pushed > accepted ? pushed - accepted : 0;
+    if (elapsed <= 0) {
+        elapsed = 1e-6;
+    }
+
+    if (json) {
+        printf("{\"bench\": \"output\", \"case\": \"%s-l%i-e%i-p%i%s\", "
+               "\"records\": %" PRIu64 ", \"accepted\": %" PRIu64 ", "
+               "\"lost\": %" PRIu64 ", \"duplicated\": %" PRIu64 ", "
+               "\"seconds\": %.3f, \"records_per_sec\": %.0f, "
+               "\"requests\": %" PRIu64 ", \"requests_per_sec\": %.1f, "
+               "\"bytes_per_sec\": %.0f, \"connections\": %" PRIu64 ", "
+               "\"requests_per_connection\": %.2f, "
+               "\"error_responses\": %" PRIu64 ", "
+               "\"partial_responses\": %" PRIu64 ", "
+               "\"retries\": %" PRIu64 ", \"retries_failed\": %" PRIu64 ", "
+               "\"cpu_usec_per_record\": %.3f}\n",
+               mock_names[m->type], m->latency, m->error_rate,
+               m->partial_rate, keepalive ? "-k" : "",
+               pushed, accepted, lost, m->duplicated, elapsed,
+               accepted / elapsed, m->requests, m->requests / elapsed,
+               m->bytes / elapsed, m->connections,
+               m->connections ? (double) m->requests / m->connections : 0,
+               m->error_responses, m->partial_responses, retries,
+               retries_failed, accepted ? (cpu * 1e6) / accepted : 0);
+    }
+    else {
+        printf("output          %s, latency %i ms, errors %i%%, "
+               "partial %i%%%s\n", mock_names[m->type], m->latency,
+               m->error_rate, m->partial_rate,
+               keepalive ? ", keepalive" : "");
+        printf("records pushed  %" PRIu64 "\n", pushed);
+        printf("accepted        %" PRIu64 " in %.3f s\n", accepted, elapsed);
+        printf("lost            %" PRIu64 "\n", lost);
+        printf("records/s       %.0f\n", accepted / elapsed);
+        printf("requests/s      %.1f\n", m->requests / elapsed);
+        printf("requests/conn   %.2f\n",
+               m->connections ? (double) m->requests / m->connections : 0);
+        printf("engine retries  %" PRIu64 " (%" PRIu64 " failed)\n",
+               retries, retries_failed);
+        printf("cpu usec/record %.3f\n", accepted ? (cpu * 1e6) / accepted : 0);
+        mock_print(m);
+    }
+    if (m->invalid > 0) {
+        fprintf(stderr, "invalid requests: %" PRIu64 "\n", m->invalid);
+    }
+
+    if (accepted == 0 || lost > 0 || m->invalid > 0) {
+        ret = 1;
+    }
+
+    free(m->seen);
+    free(m);
+
+    return ret;
+}
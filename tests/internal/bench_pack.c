@@ -0,0 +1,460 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * Pack benchmark
+ * ==============
+ * Run the JSON <-> msgpack conversions of flb_pack.c and the timestamp
+ * lookup of the records over generated corpora, and report nanoseconds
+ * per record, MB/s of input and allocations per record:
+ *
+ *   $ bin/flb-bench-pack [-j] [records per case] [case name]
+ *
+ * The corpora are built in memory with a fixed seed, so they are the same
+ * between runs:
+ *
+ *   small     docker-like records of ~100 bytes
+ *   large     ~4KB records, 40 keys of every type, nested map and array
+ *   escape    strings full of quotes, backslashes and control characters
+ *   unicode   UTF-8 text and \uXXXX escapes, with surrogate pairs
+ */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_sds.h>
+#include <fluent-bit/flb_pack.h>
+#include <fluent-bit/flb_time.h>
+#include <msgpack.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "flb_bench.h"
+
+#define BENCH_RECORDS   200000
+#define BENCH_CORPUS    256             /* records per corpus */
+#define BENCH_MAX       8192            /* max size of a JSON record */
+
+struct bench_corpus {
+    char *name;
+    int count;
+    char *json[BENCH_CORPUS];
+    size_t json_len[BENCH_CORPUS];
+    char *mp[BENCH_CORPUS];             /* the map packed */
+    size_t mp_len[BENCH_CORPUS];
+    char *rec[BENCH_CORPUS];            /* [timestamp, map] */
+    size_t rec_len[BENCH_CORPUS];
+};
+
+static uint64_t seed = 42;
+
+static inline uint32_t rnd()
+{
+    /* xorshift64 */
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    return seed >> 32;
+}
+
+static int gen_word(char *p, int len)
+{
+    int i;
+
+    for (i = 0; i < len; i++) {
+        p[i] = 'a' + (rnd() % 26);
+    }
+    return len;
+}
+
+static int gen_small(char *buf, int i)
+{
+    int n;
+    char word[32];
+
+    n = gen_word(word, 8 + (rnd() % 16));
+    word[n] = '\0';
+    return snprintf(buf, BENCH_MAX,
+                    "{\"log\": \"%i.%i.%i.%i - GET /%s HTTP/1.1 200 %u\", "
+                    "\"stream\": \"stdout\", \"n\": %i}",
+                    rnd() % 256, rnd() % 256, rnd() % 256, rnd() % 256,
+                    word, rnd() % 65536, i);
+}
+
+static int gen_large(char *buf, int i)
+{
+    int k;
+    int len;
+    int n;
+    char word[128];
+
+    len = snprintf(buf, BENCH_MAX, "{\"id\": %i", i);
+    for (k = 0; k < 36; k++) {
+        switch (k % 4) {
+        case 0:
+            n = gen_word(word, 40 + (rnd() % 60));
+            word[n] = '\0';
+            len += snprintf(buf + len, BENCH_MAX - len,
+                            ", \"str_%i\": \"%s\"", k, word);
+            break;
+        case 1:
+            len += snprintf(buf + len, BENCH_MAX - len,
+                            ", \"int_%i\": %u", k, rnd());
+            break;
+        case 2:
+            len += snprintf(buf + len, BENCH_MAX - len,
+                            ", \"float_%i\": %u.%03u", k,
+                            rnd() % 1000, rnd() % 1000);
+            break;
+        case 3:
+            len += snprintf(buf + len, BENCH_MAX - len,
+                            ", \"bool_%i\": %s, \"null_%i\": null", k,
+                            rnd() % 2 ? "true" : "false", k);
+            break;
+        }
+    }
+    len += snprintf(buf + len, BENCH_MAX - len,
+                    ", \"kubernetes\": {\"pod_name\": \"app-%u\", "
+                    "\"namespace_name\": \"default\", \"labels\": "
+                    "{\"app\": \"web\", \"tier\": \"frontend\"}}, "
+                    "\"tags\": [\"a\", \"b\", %u, 1.5, false]}", rnd(), rnd());
+    return len;
+}
+
+static int gen_escape(char *buf, int i)
+{
+    int k;
+    int len;
+    static const char *esc[] = {
+        "\\\"", "\\\\", "\\n", "\\t", "\\r", "\\/", "\\u0001", "\\u001f"
+    };
+
+    len = snprintf(buf, BENCH_MAX, "{\"n\": %i, \"log\": \"", i);
+    for (k = 0; k < 40; k++) {
+        len += gen_word(buf + len, 1 + (rnd() % 4));
+        len += snprintf(buf + len, BENCH_MAX - len, "%s",
+                        esc[rnd() % (sizeof(esc) / sizeof(char *))]);
+    }
+    len += snprintf(buf + len, BENCH_MAX - len,
+                    "\", \"path\": \"C:\\\\logs\\\\app\\\\%i.log\"}", i);
+    return len;
+}
+
+static int gen_unicode(char *buf, int i)
+{
+    int k;
+    int len;
+    static const char *text[] = {
+        "caf\xc3\xa9 ", "\xe6\x97\xa5\xe6\x9c\xac\xe8\xaa\x9e ",
+        "\xd0\xbf\xd1\x80\xd0\xb8\xd0\xb2\xd0\xb5\xd1\x82 ",
+        "\xf0\x9f\x98\x80 ", "\\u00e9", "\\u65e5\\u672c", "\\ud83d\\ude00",
+        "plain "
+    };
+
+    len = snprintf(buf, BENCH_MAX, "{\"n\": %i, \"msg\": \"", i);
+    for (k = 0; k < 24; k++) {
+        len += snprintf(buf + len, BENCH_MAX - len, "%s",
+                        text[rnd() % (sizeof(text) / sizeof(char *))]);
+    }
+    len += snprintf(buf + len, BENCH_MAX - len, "\"}");
+    return len;
+}
+
+/* Generate the JSON records and their msgpack forms */
+static int corpus_create(struct bench_corpus *c, char *name,
+                         int (*gen)(char *, int))
+{
+    int i;
+    int ret;
+    char buf[BENCH_MAX];
+    struct flb_time tm;
+    msgpack_sbuffer sbuf;
+    msgpack_packer pck;
+
+    memset(c, '\0', sizeof(struct bench_corpus));
+    c->name = name;
+
+    for (i = 0; i < BENCH_CORPUS; i++) {
+        c->json_len[i] = gen(buf, i);
+        c->json[i] = flb_malloc(c->json_len[i] + 1);
+        memcpy(c->json[i], buf, c->json_len[i] + 1);
+
+        ret = flb_pack_json(c->json[i], c->json_len[i],
+                            &c->mp[i], &c->mp_len[i]);
+        if (ret != 0) {
+            fprintf(stderr, "%s: record %i is not valid JSON\n", name, i);
+            return -1;
+        }
+
+        msgpack_sbuffer_init(&sbuf);
+        msgpack_packer_init(&pck, &sbuf, msgpack_sbuffer_write);
+        msgpack_pack_array(&pck, 2);
+        tm.tm.tv_sec = 1539500000 + i;
+        tm.tm.tv_nsec = i * 1000;
+        flb_time_append_to_msgpack(&tm, &pck, FLB_TIME_ETFMT_V1_FIXEXT);
+        msgpack_sbuffer_write(&sbuf, c->mp[i], c->mp_len[i]);
+        c->rec[i] = sbuf.data;
+        c->rec_len[i] = sbuf.size;
+        c->count++;
+    }
+
+    return 0;
+}
+
+static void corpus_destroy(struct bench_corpus *c)
+{
+    int i;
+
+    for (i = 0; i < c->count; i++) {
+        flb_free(c->json[i]);
+        flb_free(c->mp[i]);
+        free(c->rec[i]);
+    }
+}
+
+/* Operations, one record at a time: return -1 on error */
+
+static int op_pack_json(struct bench_corpus *c, int i, size_t *bytes)
+{
+    int ret;
+    char *buf;
+    size_t size;
+
+    ret = flb_pack_json(c->json[i], c->json_len[i], &buf, &size);
+    if (ret != 0) {
+        return -1;
+    }
+    flb_free(buf);
+    *bytes = c->json_len[i];
+    return 0;
+}
+
+static int op_pack_json_state(struct bench_corpus *c, int i, size_t *bytes)
+{
+    int ret;
+    int size;
+    char *buf;
+    struct flb_pack_state state;
+
+    flb_pack_state_init(&state);
+    ret = flb_pack_json_state(c->json[i], c->json_len[i], &buf, &size,
+                              &state);
+    flb_pack_state_reset(&state);
+    if (ret != 0) {
+        return -1;
+    }
+    flb_free(buf);
+    *bytes = c->json_len[i];
+    return 0;
+}
+
+static int op_to_json_str(struct bench_corpus *c, int i, size_t *bytes)
+{
+    int ret;
+    char *buf;
+    size_t size;
+
+    ret = flb_msgpack_raw_to_json_str(c->mp[i], c->mp_len[i], &buf, &size);
+    if (ret != 0) {
+        return -1;
+    }
+    flb_free(buf);
+    *bytes = c->mp_len[i];
+    return 0;
+}
+
+static int op_to_json_sds(struct bench_corpus *c, int i, size_t *bytes)
+{
+    flb_sds_t s;
+
+    s = flb_msgpack_raw_to_json_sds(c->mp[i], c->mp_len[i]);
+    if (!s) {
+        return -1;
+    }
+    flb_sds_destroy(s);
+    *bytes = c->mp_len[i];
+    return 0;
+}
+
+static int op_expand_map(struct bench_corpus *c, int i, size_t *bytes)
+{
+    int ret;
+    int size;
+    char *buf;
+    msgpack_object_kv kv[2];
+    msgpack_object_kv *kv_arr[2] = {&kv[0], &kv[1]};
+
+    kv[0].key.type = MSGPACK_OBJECT_STR;
+    kv[0].key.via.str.ptr = "host";
+    kv[0].key.via.str.size = 4;
+    kv[0].val.type = MSGPACK_OBJECT_STR;
+    kv[0].val.via.str.ptr = "node-01";
+    kv[0].val.via.str.size = 7;
+    kv[1].key.type = MSGPACK_OBJECT_STR;
+    kv[1].key.via.str.ptr = "seq";
+    kv[1].key.via.str.size = 3;
+    kv[1].val.type = MSGPACK_OBJECT_POSITIVE_INTEGER;
+    kv[1].val.via.u64 = i;
+
+    ret = flb_msgpack_expand_map(c->mp[i], c->mp_len[i], kv_arr, 2,
+                                 &buf, &size);
+    if (ret != 0) {
+        return -1;
+    }
+    flb_free(buf);
+    *bytes = c->mp_len[i];
+    return 0;
+}
+
+/* Unpack a record and read its timestamp, as every output does */
+static int op_time_pop(struct bench_corpus *c, int i, size_t *bytes)
+{
+    int ret;
+    size_t off = 0;
+    struct flb_time tm;
+    msgpack_object *map;
+    msgpack_unpacked result;
+
+    msgpack_unpacked_init(&result);
+    if (!msgpack_unpack_next(&result, c->rec[i], c->rec_len[i], &off)) {
+        msgpack_unpacked_destroy(&result);
+        return -1;
+    }
+    ret = flb_time_pop_from_msgpack(&tm, &result, &map);
+    msgpack_unpacked_destroy(&result);
+    if (ret != 0 || tm.tm.tv_sec != 1539500000 + i) {
+        return -1;
+    }
+    *bytes = c->rec_len[i];
+    return 0;
+}
+
+struct bench_op {
+    char *name;
+    int (*run) (struct bench_corpus *, int, size_t *);
+};
+
+static struct bench_op ops[] = {
+    {"pack_json",       op_pack_json},
+    {"pack_json_state", op_pack_json_state},
+    {"to_json_str",     op_to_json_str},
+    {"to_json_sds",     op_to_json_sds},
+    {"expand_map",      op_expand_map},
+    {"time_pop",        op_time_pop},
+    {NULL, NULL}
+};
+
+static int bench_run(struct bench_op *op, struct bench_corpus *c,
+                     uint64_t target)
+{
+    int i;
+    char name[64];
+    size_t size;
+    double start;
+    double elapsed;
+    uint64_t errors = 0;
+    uint64_t records = 0;
+    uint64_t bytes = 0;
+    uint64_t allocs;
+
+    allocs = bench_allocs_get();
+    start = bench_now();
+
+    while (records < target) {
+        for (i = 0; i < c->count && records < target; i++) {
+            if (op->run(c, i, &size) == -1) {
+                errors++;
+            }
+            records++;
+            bytes += size;
+        }
+    }
+
+    elapsed = bench_now() - start;
+    allocs = bench_allocs_get() - allocs;
+
+    snprintf(name, sizeof(name), "%s/%s", op->name, c->name);
+    if (bench_json) {
+        printf("{\"bench\": \"pack\", \"case\": \"%s\", "
+               "\"records\": %" PRIu64 ", \"ns_per_record\": %.1f, "
+               "\"bytes_per_sec\": %.0f, ", name, records,
+               (elapsed * 1e9) / records, bytes / elapsed);
+#ifdef BENCH_ALLOCS
+        printf("\"allocs_per_record\": %.3f, ", (double) allocs / records);
+#endif
+        printf("\"errors\": %" PRIu64 "}\n", errors);
+        return errors > 0 ? -1 : 0;
+    }
+
+    printf("%-24s %10.1f %10.2f", name,
+           (elapsed * 1e9) / records, (bytes / elapsed) / (1024 * 1024));
+#ifdef BENCH_ALLOCS
+    printf(" %12.2f", (double) allocs / records);
+#else
+    printf(" %12s", "-");
+#endif
+    printf(" %8" PRIu64 "\n", errors);
+
+    return errors > 0 ? -1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+    int i;
+    int failed = 0;
+    uint64_t target = BENCH_RECORDS;
+    char *only = NULL;
+    char name[64];
+    struct bench_op *op;
+    struct bench_corpus *corpora;
+    static char *names[] = {"small", "large", "escape", "unicode"};
+    static int (*gens[]) (char *, int) = {
+        gen_small, gen_large, gen_escape, gen_unicode
+    };
+
+    bench_json_args(&argc, &argv);
+    if (argc > 1) {
+        target = strtoull(argv[1], NULL, 10);
+    }
+    if (argc > 2) {
+        only = argv[2];
+    }
+    if (target == 0) {
+        fprintf(stderr, "usage: %s [-j] [records per case] [case name]\n",
+                argv[0]);
+        return 1;
+    }
+
+    corpora = calloc(4, sizeof(struct bench_corpus));
+    for (i = 0; i < 4; i++) {
+        if (corpus_create(&corpora[i], names[i], gens[i]) == -1) {
+            return 1;
+        }
+    }
+
+    if (!bench_json) {
+        printf("%-24s %10s %10s %12s %8s\n",
+               "case", "ns/rec", "MB/s", "allocs/rec", "errors");
+    }
+
+    for (op = ops; op->name; op++) {
+        for (i = 0; i < 4; i++) {
+            snprintf(name, sizeof(name), "%s/%s", op->name, names[i]);
+            if (only && strcmp(only, name) != 0 &&
+                strcmp(only, op->name) != 0) {
+                continue;
+            }
+            if (bench_run(op, &corpora[i], target) == -1) {
+                failed++;
+            }
+        }
+    }
+
+    for (i = 0; i < 4; i++) {
+        corpus_destroy(&corpora[i]);
+    }
+    free(corpora);
+
+    return failed > 0 ? 1 : 0;
+}
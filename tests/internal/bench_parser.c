@@ -0,0 +1,245 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * Parser benchmark
+ * ================
+ * Run the parsers over the fixed corpora of data/parser/bench/ and report
+ * records per second, bytes per second and allocations per record:
+ *
+ *   $ bin/flb-bench-parser [-j] [records per case] [case name]
+ *
+ * The corpora are generated by data/parser/bench/gen.py. The numbers are
+ * only comparable between runs on the same host.
+ */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_config.h>
+#include <fluent-bit/flb_parser.h>
+#include <monkey/mk_core.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "flb_bench.h"
+
+#define BENCH_PARSERS   FLB_BENCH_DATA_PATH "/bench.conf"
+#define BENCH_RECORDS   500000
+#define BENCH_LINES     4096
+
+struct bench_case {
+    char *name;
+    char *parser;
+    char *corpus;         /* file under data/parser/bench/ */
+    char *time_fmt;       /* time strings only: printf(3) format */
+};
+
+static struct bench_case cases[] = {
+    {"regex_apache",   "apache2",        "apache.log", NULL},
+    {"regex_nginx",    "nginx",          "nginx.log",  NULL},
+    {"regex_syslog",   "syslog-rfc3164", "syslog.log", NULL},
+    {"json",           "json",           "json.log",   NULL},
+    {"json_docker",    "docker",         "docker.log", NULL},
+    {"decoder_docker", "docker_decoder", "docker.log", NULL},
+
+    /* Time lookups, the seconds change every four records */
+    {"time_clf",       "apache2",        NULL,
+     "%02i/Feb/2018:13:%02i:%02i +0000"},
+    {"time_syslog",    "syslog-rfc3164", NULL,
+     "Feb %2i 01:%02i:%02i"},
+    {"time_iso_frac",  "docker",         NULL,
+     "2018-01-%02iT15:%02i:%02i.422518Z"},
+    {NULL, NULL, NULL, NULL}
+};
+
+struct bench_lines {
+    int count;
+    char *data;
+    char *buf[BENCH_LINES];
+    size_t len[BENCH_LINES];
+};
+
+/* Load the corpus lines, or compose the time strings */
+static int bench_lines_load(struct bench_case *c, struct bench_lines *lines)
+{
+    int i;
+    int len;
+    char *p;
+    char *end;
+    char path[1024];
+
+    memset(lines, '\0', sizeof(struct bench_lines));
+
+    if (c->time_fmt) {
+        lines->data = flb_malloc(256 * 64);
+        if (!lines->data) {
+            return -1;
+        }
+        for (i = 0; i < 256; i++) {
+            p = lines->data + (i * 64);
+            len = snprintf(p, 64, c->time_fmt,
+                           (i / 240) + 1, (i / 4) / 60, (i / 4) % 60);
+            lines->buf[i] = p;
+            lines->len[i] = len;
+        }
+        lines->count = 256;
+        return 0;
+    }
+
+    snprintf(path, sizeof(path) - 1, "%s/%s", FLB_BENCH_DATA_PATH, c->corpus);
+    lines->data = mk_file_to_buffer(path);
+    if (!lines->data) {
+        fprintf(stderr, "cannot read corpus %s\n", path);
+        return -1;
+    }
+
+    p = lines->data;
+    end = p + strlen(p);
+    while (p < end && lines->count < BENCH_LINES) {
+        lines->buf[lines->count] = p;
+        p = memchr(p, '\n', end - p);
+        if (!p) {
+            p = end;
+        }
+        lines->len[lines->count] = p - lines->buf[lines->count];
+        if (lines->len[lines->count] > 0) {
+            lines->count++;
+        }
+        p++;
+    }
+
+    return 0;
+}
+
+static int bench_run(struct bench_case *c, struct flb_parser *parser,
+                     struct bench_lines *lines, uint64_t target)
+{
+    int i;
+    int ret;
+    double frac;
+    double start;
+    double elapsed;
+    uint64_t errors = 0;
+    uint64_t records = 0;
+    uint64_t bytes = 0;
+    uint64_t allocs;
+    void *out_buf;
+    size_t out_size;
+    struct tm tm;
+    struct flb_time out_time;
+
+    allocs = bench_allocs_get();
+    start = bench_now();
+
+    while (records < target) {
+        for (i = 0; i < lines->count && records < target; i++) {
+            if (c->time_fmt) {
+                ret = flb_parser_time_lookup(lines->buf[i], lines->len[i], 0,
+                                             parser, &tm, &frac);
+            }
+            else {
+                ret = flb_parser_do(parser, lines->buf[i], lines->len[i],
+                                    &out_buf, &out_size, &out_time);
+                if (ret != -1) {
+                    flb_free(out_buf);
+                }
+            }
+            if (ret == -1) {
+                errors++;
+            }
+            records++;
+            bytes += lines->len[i];
+        }
+    }
+
+    elapsed = bench_now() - start;
+    allocs = bench_allocs_get() - allocs;
+
+    if (bench_json) {
+        printf("{\"bench\": \"parser\", \"case\": \"%s\", "
+               "\"records\": %" PRIu64 ", \"records_per_sec\": %.0f, "
+               "\"bytes_per_sec\": %.0f, ", c->name, records,
+               records / elapsed, bytes / elapsed);
+#ifdef BENCH_ALLOCS
+        printf("\"allocs_per_record\": %.3f, ", (double) allocs / records);
+#endif
+        printf("\"errors\": %" PRIu64 "}\n", errors);
+        return errors > 0 ? -1 : 0;
+    }
+
+    printf("%-16s %12.0f %10.2f", c->name,
+           records / elapsed, (bytes / elapsed) / (1024 * 1024));
+#ifdef BENCH_ALLOCS
+    printf(" %12.2f", (double) allocs / records);
+#else
+    printf(" %12s", "-");
+#endif
+    printf(" %8" PRIu64 "\n", errors);
+
+    return errors > 0 ? -1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+    int ret;
+    int failed = 0;
+    uint64_t target = BENCH_RECORDS;
+    char *only = NULL;
+    struct bench_case *c;
+    struct bench_lines lines;
+    struct flb_parser *parser;
+    struct flb_config *config;
+
+    bench_json_args(&argc, &argv);
+    if (argc > 1) {
+        target = strtoull(argv[1], NULL, 10);
+    }
+    if (argc > 2) {
+        only = argv[2];
+    }
+    if (target == 0) {
+        fprintf(stderr, "usage: %s [-j] [records per case] [case name]\n",
+                argv[0]);
+        return 1;
+    }
+
+    config = flb_calloc(1, sizeof(struct flb_config));
+    mk_list_init(&config->parsers);
+
+    ret = flb_parser_conf_file(BENCH_PARSERS, config);
+    if (ret != 0) {
+        fprintf(stderr, "cannot load %s\n", BENCH_PARSERS);
+        flb_free(config);
+        return 1;
+    }
+
+    if (!bench_json) {
+        printf("%-16s %12s %10s %12s %8s\n",
+               "case", "records/s", "MB/s", "allocs/rec", "errors");
+    }
+
+    for (c = cases; c->name; c++) {
+        if (only && strcmp(only, c->name) != 0) {
+            continue;
+        }
+
+        parser = flb_parser_get(c->parser, config);
+        if (!parser || bench_lines_load(c, &lines) == -1) {
+            fprintf(stderr, "%s: cannot prepare case\n", c->name);
+            failed++;
+            continue;
+        }
+
+        if (bench_run(c, parser, &lines, target) == -1) {
+            failed++;
+        }
+        flb_free(lines.data);
+    }
+
+    flb_parser_exit(config);
+    flb_free(config);
+
+    return failed > 0 ? 1 : 0;
+}
@@ -0,0 +1,442 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * Pipeline benchmark
+ * ==================
+ * Run the whole engine in library mode, input -> filters -> output, at
+ * the maximum rate and report records per second, bytes per second, CPU
+ * time per record, peak RSS and the latency of the records:
+ *
+ *   $ bin/flb-bench-pipeline [-i lib|dummy] [-f filter] [-n filters]
+ *                            [-o lib|null] [-s record size] [-F flush]
+ *                            [-d seconds] [-j] [records]
+ *
+ * The 'lib' input pushes 'records' records as fast as the engine takes
+ * them, 'dummy' generates records during 'seconds'. Filters are N
+ * instances of grep, modify or record_modifier that keep every record.
+ * The latency of a record is the time from its timestamp to the out_lib
+ * callback, it includes the wait for the next flush. Bytes are msgpack
+ * bytes delivered to the output. CPU time covers the whole process,
+ * including the JSON formatting of the pushed records.
+ *
+ * With -j a single JSON object is printed. The numbers are only
+ * comparable between runs on the same host.
+ */
+
+#include <fluent-bit.h>
+#include <fluent-bit/flb_time.h>
+#include <fluent-bit/flb_metrics.h>
+#include <msgpack.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/resource.h>
+
+#include "flb_bench.h"
+
+#define BENCH_RECORDS     200000
+#define BENCH_RECORD_SIZE 128
+#define BENCH_DURATION    5
+#define BENCH_IDLE        10      /* seconds without progress, give up */
+
+/* Log-linear latency histogram: 32 buckets per power of two (usec) */
+#define LAT_SUB_BITS      5
+#define LAT_BUCKETS       (64 * (1 << LAT_SUB_BITS))
+
+struct bench_filter {
+    char *name;
+    char *key;
+    char *val;
+};
+
+/* Every preset keeps all the records */
+static struct bench_filter filters[] = {
+    {"grep",            "Regex",              "log ."},
+    {"modify",          "Add_If_Not_Present", "bench on"},
+    {"record_modifier", "Record",             "bench on"},
+    {NULL, NULL, NULL}
+};
+
+struct bench {
+    char *input;
+    char *output;
+    char *filter;
+    int n_filters;
+    int record_size;
+    int duration;
+    int json;
+    char *flush;
+    int in_ffd;
+    uint64_t target;
+
+    /* updated by the out_lib callback, engine thread */
+    uint64_t received;
+    uint64_t bytes;
+    uint64_t last;                /* usec, monotonic */
+    uint64_t lat[LAT_BUCKETS];
+};
+
+static inline uint64_t bench_now_usec()
+{
+    return bench_now() * 1e6;
+}
+
+static inline int lat_index(uint64_t v)
+{
+    int msb;
+
+    if (v < (2 << LAT_SUB_BITS)) {
+        return v;
+    }
+    msb = 63 - __builtin_clzll(v);
+    return ((msb - LAT_SUB_BITS) << LAT_SUB_BITS) + (v >> (msb - LAT_SUB_BITS));
+}
+
+static inline uint64_t lat_value(int idx)
+{
+    int m;
+
+    if (idx < (2 << LAT_SUB_BITS)) {
+        return idx;
+    }
+    m = idx >> LAT_SUB_BITS;
+    return (uint64_t) ((idx & ((1 << LAT_SUB_BITS) - 1)) |
+                       (1 << LAT_SUB_BITS)) << (m - 1);
+}
+
+static uint64_t lat_percentile(struct bench *b, double p)
+{
+    int i;
+    uint64_t n = 0;
+    uint64_t total = 0;
+
+    for (i = 0; i < LAT_BUCKETS; i++) {
+        total += b->lat[i];
+    }
+    if (total == 0) {
+        return 0;
+    }
+    for (i = 0; i < LAT_BUCKETS; i++) {
+        n += b->lat[i];
+        if (n >= total * p) {
+            return lat_value(i);
+        }
+    }
+    return lat_value(LAT_BUCKETS - 1);
+}
+
+/* out_lib 'chunk' callback: count the records and their latency */
+static int cb_chunk(void *record, size_t size, void *data)
+{
+    int idx;
+    size_t off = 0;
+    double now;
+    double lat;
+    struct bench *b = data;
+    struct flb_lib_chunk *chunk = record;
+    struct flb_time tm;
+    msgpack_object *obj;
+    msgpack_unpacked result;
+
+    now = flb_time_now();
+    msgpack_unpacked_init(&result);
+    while (msgpack_unpack_next(&result, chunk->data, chunk->size, &off)) {
+        flb_time_pop_from_msgpack(&tm, &result, &obj);
+        lat = (now - flb_time_to_double(&tm)) * 1e6;
+        idx = lat_index(lat > 0 ? (uint64_t) lat : 0);
+        b->lat[idx < LAT_BUCKETS ? idx : LAT_BUCKETS - 1]++;
+    }
+    msgpack_unpacked_destroy(&result);
+
+    b->bytes += chunk->size;
+    __atomic_store_n(&b->last, bench_now_usec(), __ATOMIC_RELAXED);
+    __atomic_add_fetch(&b->received, chunk->records, __ATOMIC_RELEASE);
+    flb_lib_free(chunk);
+
+    return 0;
+}
+
+/* Records and bytes flushed by out_null, from its metrics */
+static uint64_t null_received(flb_ctx_t *ctx, struct bench *b)
+{
+#ifdef FLB_HAVE_METRICS
+    struct flb_metric *m;
+    struct flb_output_instance *o_ins;
+
+    o_ins = mk_list_entry_first(&ctx->config->outputs,
+                                struct flb_output_instance, _head);
+    m = flb_metrics_get_id(FLB_METRIC_OUT_OK_BYTES, o_ins->metrics);
+    b->bytes = m ? flb_metric_value(m) : 0;
+    m = flb_metrics_get_id(FLB_METRIC_OUT_OK_RECORDS, o_ins->metrics);
+    return m ? flb_metric_value(m) : 0;
+#else
+    return 0;
+#endif
+}
+
+static uint64_t bench_received(flb_ctx_t *ctx, struct bench *b)
+{
+    if (strcmp(b->output, "null") == 0) {
+        return null_received(ctx, b);
+    }
+    return __atomic_load_n(&b->received, __ATOMIC_ACQUIRE);
+}
+
+static int bench_setup(flb_ctx_t *ctx, struct bench *b)
+{
+    int i;
+    int in_ffd;
+    int out_ffd = -1;
+    int f_ffd;
+    char rate[32];
+    struct bench_filter *f = NULL;
+    struct flb_lib_out_cb cb;
+
+    flb_service_set(ctx, "Flush", b->flush, "Log_Level", "error", NULL);
+
+    in_ffd = flb_input(ctx, b->input, NULL);
+    if (in_ffd < 0) {
+        fprintf(stderr, "unknown input '%s'\n", b->input);
+        return -1;
+    }
+    flb_input_set(ctx, in_ffd, "tag", "bench", NULL);
+    b->in_ffd = in_ffd;
+    if (strcmp(b->input, "dummy") == 0) {
+        snprintf(rate, sizeof(rate), "%i", 1000000);
+        flb_input_set(ctx, in_ffd, "Rate", rate, NULL);
+    }
+
+    if (b->n_filters > 0) {
+        for (i = 0; filters[i].name; i++) {
+            if (strcmp(filters[i].name, b->filter) == 0) {
+                f = &filters[i];
+            }
+        }
+        if (!f) {
+            fprintf(stderr, "unknown filter preset '%s'\n", b->filter);
+            return -1;
+        }
+    }
+    for (i = 0; i < b->n_filters; i++) {
+        f_ffd = flb_filter(ctx, f->name, NULL);
+        if (f_ffd < 0) {
+            fprintf(stderr, "filter '%s' is not available\n", f->name);
+            return -1;
+        }
+        flb_filter_set(ctx, f_ffd, "Match", "*", f->key, f->val, NULL);
+    }
+
+    if (strcmp(b->output, "lib") == 0) {
+        cb.cb = cb_chunk;
+        cb.data = b;
+        out_ffd = flb_output(ctx, "lib", &cb);
+        flb_output_set(ctx, out_ffd, "Match", "*", "format", "chunk", NULL);
+    }
+    else if (strcmp(b->output, "null") == 0) {
+#ifndef FLB_HAVE_METRICS
+        fprintf(stderr, "the null output needs FLB_METRICS\n");
+        return -1;
+#endif
+        out_ffd = flb_output(ctx, "null", NULL);
+        flb_output_set(ctx, out_ffd, "Match", "*", NULL);
+    }
+    else {
+        fprintf(stderr, "unknown output '%s'\n", b->output);
+        return -1;
+    }
+
+    return out_ffd < 0 ? -1 : 0;
+}
+
+/* Push the records through in_lib, the pipe blocks when the engine lags */
+static uint64_t bench_push(flb_ctx_t *ctx, struct bench *b)
+{
+    int len;
+    int pad;
+    uint64_t i;
+    char *buf;
+    char *payload;
+
+    pad = b->record_size > 48 ? b->record_size - 48 : 1;
+    payload = malloc(pad + 1);
+    buf = malloc(pad + 128);
+    memset(payload, 'x', pad);
+    payload[pad] = '\0';
+
+    for (i = 0; i < b->target; i++) {
+        len = snprintf(buf, pad + 128, "[%f, {\"log\": \"%s\", \"n\": %" PRIu64 "}]",
+                       flb_time_now(), payload, i);
+        if (flb_lib_push(ctx, b->in_ffd, buf, len) == -1) {
+            break;
+        }
+    }
+
+    free(payload);
+    free(buf);
+    return i;
+}
+
+static void usage(char *name)
+{
+    fprintf(stderr,
+            "usage: %s [-i lib|dummy] [-f grep|modify|record_modifier] "
+            "[-n filters] [-o lib|null] [-s record size] [-F flush] "
+            "[-d seconds] [-j] [records]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+    int ret = 0;
+    uint64_t pushed = 0;
+    uint64_t received = 0;
+    uint64_t prev = 0;
+    double start;
+    double elapsed;
+    double idle;
+    double cpu;
+    struct rusage ru0;
+    struct rusage ru1;
+    struct bench *b;
+    flb_ctx_t *ctx;
+
+    b = calloc(1, sizeof(struct bench));
+    b->input = "lib";
+    b->output = "lib";
+    b->filter = "grep";
+    b->flush = "1";
+    b->record_size = BENCH_RECORD_SIZE;
+    b->duration = BENCH_DURATION;
+    b->target = BENCH_RECORDS;
+
+    while ((opt = getopt(argc, argv, "i:o:f:n:s:F:d:j")) != -1) {
+        switch (opt) {
+        case 'i': b->input = optarg; break;
+        case 'o': b->output = optarg; break;
+        case 'f': b->filter = optarg; break;
+        case 'n': b->n_filters = atoi(optarg); break;
+        case 's': b->record_size = atoi(optarg); break;
+        case 'F': b->flush = optarg; break;
+        case 'd': b->duration = atoi(optarg); break;
+        case 'j': b->json = 1; break;
+        default:
+            usage(argv[0]);
+            free(b);
+            return 1;
+        }
+    }
+    if (optind < argc) {
+        b->target = strtoull(argv[optind], NULL, 10);
+    }
+    if (b->target == 0 || b->duration <= 0) {
+        usage(argv[0]);
+        free(b);
+        return 1;
+    }
+
+    ctx = flb_create();
+    if (bench_setup(ctx, b) == -1 || flb_start(ctx) == -1) {
+        flb_destroy(ctx);
+        free(b);
+        return 1;
+    }
+
+    getrusage(RUSAGE_SELF, &ru0);
+    start = bench_now();
+
+    if (strcmp(b->input, "dummy") == 0) {
+        /* Endless input: count what went out during the period */
+        sleep(b->duration);
+        received = bench_received(ctx, b);
+        elapsed = bench_now() - start;
+        b->target = 0;
+    }
+    else {
+        pushed = bench_push(ctx, b);
+
+        /* Wait for the output to get everything, or for it to stall */
+        idle = bench_now();
+        while (1) {
+            received = bench_received(ctx, b);
+            if (received >= pushed) {
+                idle = bench_now();
+                break;
+            }
+            if (received != prev) {
+                prev = received;
+                idle = bench_now();
+            }
+            else if (bench_now() - idle > BENCH_IDLE) {
+                break;
+            }
+            usleep(10000);
+        }
+
+        /* Up to the last delivery */
+        if (strcmp(b->output, "lib") == 0) {
+            elapsed = __atomic_load_n(&b->last, __ATOMIC_RELAXED) / 1e6 - start;
+        }
+        else {
+            elapsed = idle - start;
+        }
+    }
+    getrusage(RUSAGE_SELF, &ru1);
+    cpu = (ru1.ru_utime.tv_sec - ru0.ru_utime.tv_sec) * 1e6 +
+          (ru1.ru_utime.tv_usec - ru0.ru_utime.tv_usec) +
+          (ru1.ru_stime.tv_sec - ru0.ru_stime.tv_sec) * 1e6 +
+          (ru1.ru_stime.tv_usec - ru0.ru_stime.tv_usec);
+    if (elapsed <= 0) {
+        elapsed = 1e-6;
+    }
+
+    if (b->json) {
+        printf("{\"bench\": \"pipeline\", \"case\": \"%s-%ix%s-%s\", "
+               "\"input\": \"%s\", \"filter\": \"%s\", \"filters\": %i, "
+               "\"output\": \"%s\", \"records\": %" PRIu64 ", "
+               "\"seconds\": %.3f, \"records_per_sec\": %.0f, "
+               "\"bytes_per_sec\": %.0f, \"cpu_usec_per_record\": %.3f, "
+               "\"peak_rss_kb\": %li",
+               b->input, b->n_filters, b->filter, b->output,
+               b->input, b->filter, b->n_filters, b->output, received,
+               elapsed, received / elapsed, b->bytes / elapsed,
+               received ? cpu / received : 0, ru1.ru_maxrss);
+        if (strcmp(b->output, "lib") == 0) {
+            printf(", \"latency_p50_usec\": %" PRIu64 ", "
+                   "\"latency_p99_usec\": %" PRIu64,
+                   lat_percentile(b, 0.50), lat_percentile(b, 0.99));
+        }
+        printf("}\n");
+    }
+    else {
+        printf("pipeline        %s -> %i x %s -> %s\n",
+               b->input, b->n_filters, b->filter, b->output);
+        printf("records         %" PRIu64 " in %.3f s\n", received, elapsed);
+        printf("records/s       %.0f\n", received / elapsed);
+        printf("MB/s            %.2f\n", (b->bytes / elapsed) / (1024 * 1024));
+        printf("cpu usec/rec    %.3f\n", received ? cpu / received : 0);
+        printf("peak rss        %li KB\n", ru1.ru_maxrss);
+        if (strcmp(b->output, "lib") == 0) {
+            printf("latency p50     %" PRIu64 " usec\n", lat_percentile(b, 0.50));
+            printf("latency p99     %" PRIu64 " usec\n", lat_percentile(b, 0.99));
+        }
+    }
+
+    if (b->target > 0 && received < pushed) {
+        fprintf(stderr, "lost records: pushed %" PRIu64 ", received %" PRIu64
+                "\n", pushed, received);
+        ret = 1;
+    }
+    else if (received == 0) {
+        ret = 1;
+    }
+
+    flb_stop(ctx);
+    flb_destroy(ctx);
+    free(b);
+
+    return ret;
+}
@@ -0,0 +1,659 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * Tail benchmark
+ * ==============
+ * Writer threads append lines to N files while in_tail follows them, the
+ * lines are checked at the out_lib callback:
+ *
+ *   $ bin/flb-bench-tail [-f files] [-w writers] [-r lines/s] [-l length]
+ *                        [-R none|rename|copytruncate] [-S rotate size]
+ *                        [-D] [-T tail threads] [-F flush] [-d seconds]
+ *                        [-j] [lines]
+ *
+ * Every line carries its file, sequence number and write time, so the
+ * benchmark reports the ingest rate, the collection lag (write to output,
+ * it includes the wait for the next flush), the lines lost and the lines
+ * duplicated, plus the CPU time per line of the engine (the process time
+ * minus the time of the writers).
+ *
+ * With -S a file is rotated when it reaches that size: 'rename' moves it
+ * to '<name>.1' and creates it again, 'copytruncate' copies it and
+ * truncates it in place, the rotated copies are not tailed. With -D the
+ * tail database is enabled. The writers stop after 'seconds' seconds or
+ * 'lines' lines, whatever comes first. The files live in a temporary
+ * directory that is removed at exit.
+ *
+ * With -j a single JSON object is printed. The numbers are only
+ * comparable between runs on the same host.
+ */
+
+#include <fluent-bit.h>
+#include <fluent-bit/flb_time.h>
+#include <msgpack.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+#include "flb_bench.h"
+
+#define TAIL_FILES        4
+#define TAIL_LINE_LEN     128
+#define TAIL_DURATION     5
+#define TAIL_IDLE         5       /* seconds without progress, give up */
+#define TAIL_BATCH        64      /* lines per write(2) */
+
+#define LAT_SUB_BITS      5
+#define LAT_BUCKETS       (64 * (1 << LAT_SUB_BITS))
+
+enum {
+    ROTATE_NONE = 0,
+    ROTATE_RENAME,
+    ROTATE_COPYTRUNCATE
+};
+
+/* Lines seen by the output for one file, a bit per sequence number */
+struct tail_seen {
+    uint8_t *bits;
+    uint64_t size;                /* bits */
+};
+
+struct tail_file {
+    int fd;
+    char path[256];
+    size_t size;
+    uint64_t seq;                 /* lines written */
+};
+
+struct bench {
+    char dir[64];
+    int files;
+    int writers;
+    uint64_t rate;
+    int line_len;
+    int rotate;
+    size_t rotate_size;
+    int db;
+    char *threads;
+    char *flush;
+    int duration;
+    int json;
+    uint64_t target;
+    char *payload;
+
+    struct tail_file *tf;
+    int stop;
+    int done;                     /* writers finished */
+    uint64_t rotations;
+    double writers_cpu;           /* seconds */
+
+    /* updated by the out_lib callback, engine thread */
+    struct tail_seen *seen;
+    uint64_t received;
+    uint64_t duplicated;
+    uint64_t invalid;
+    uint64_t last;                /* usec, monotonic */
+    uint64_t lat[LAT_BUCKETS];
+};
+
+struct writer {
+    int id;
+    pthread_t tid;
+    struct bench *b;
+    double cpu;
+};
+
+static inline uint64_t bench_now_usec()
+{
+    return bench_now() * 1e6;
+}
+
+static inline int lat_index(uint64_t v)
+{
+    int msb;
+
+    if (v < (2 << LAT_SUB_BITS)) {
+        return v;
+    }
+    msb = 63 - __builtin_clzll(v);
+    return ((msb - LAT_SUB_BITS) << LAT_SUB_BITS) + (v >> (msb - LAT_SUB_BITS));
+}
+
+static inline uint64_t lat_value(int idx)
+{
+    int m;
+
+    if (idx < (2 << LAT_SUB_BITS)) {
+        return idx;
+    }
+    m = idx >> LAT_SUB_BITS;
+    return (uint64_t) ((idx & ((1 << LAT_SUB_BITS) - 1)) |
+                       (1 << LAT_SUB_BITS)) << (m - 1);
+}
+
+static uint64_t lat_percentile(struct bench *b, double p)
+{
+    int i;
+    uint64_t n = 0;
+    uint64_t total = 0;
+
+    for (i = 0; i < LAT_BUCKETS; i++) {
+        total += b->lat[i];
+    }
+    if (total == 0) {
+        return 0;
+    }
+    for (i = 0; i < LAT_BUCKETS; i++) {
+        n += b->lat[i];
+        if (n >= total * p) {
+            return lat_value(i);
+        }
+    }
+    return lat_value(LAT_BUCKETS - 1);
+}
+
+/* Mark a line as seen, returns 1 if it was seen already */
+static int seen_set(struct tail_seen *s, uint64_t seq)
+{
+    int dup;
+    uint64_t size;
+
+    if (seq >= s->size) {
+        size = s->size ? s->size : 65536;
+        while (size <= seq) {
+            size *= 2;
+        }
+        s->bits = realloc(s->bits, size / 8);
+        memset(s->bits + s->size / 8, 0, (size - s->size) / 8);
+        s->size = size;
+    }
+
+    dup = (s->bits[seq / 8] >> (seq % 8)) & 1;
+    s->bits[seq / 8] |= 1 << (seq % 8);
+    return dup;
+}
+
+/* A line is '<file> <seq> <usec> xxx...' */
+static void line_check(struct bench *b, const char *p, size_t len,
+                       uint64_t now)
+{
+    int idx;
+    char *end;
+    uint64_t file;
+    uint64_t seq;
+    uint64_t usec;
+
+    file = strtoull(p, &end, 10);
+    seq = strtoull(end, &end, 10);
+    usec = strtoull(end, &end, 10);
+    if ((size_t) (end - p) > len || file >= (uint64_t) b->files) {
+        b->invalid++;
+        return;
+    }
+
+    if (seen_set(&b->seen[file], seq)) {
+        b->duplicated++;
+        return;
+    }
+
+    idx = lat_index(now > usec ? now - usec : 0);
+    b->lat[idx < LAT_BUCKETS ? idx : LAT_BUCKETS - 1]++;
+    b->received++;
+}
+
+/* out_lib 'chunk' callback */
+static int cb_chunk(void *record, size_t size, void *data)
+{
+    int i;
+    size_t off = 0;
+    uint64_t now;
+    struct bench *b = data;
+    struct flb_lib_chunk *chunk = record;
+    struct flb_time tm;
+    msgpack_object *obj;
+    msgpack_object_kv *kv;
+    msgpack_unpacked result;
+
+    now = bench_now_usec();
+    msgpack_unpacked_init(&result);
+    while (msgpack_unpack_next(&result, chunk->data, chunk->size, &off)) {
+        flb_time_pop_from_msgpack(&tm, &result, &obj);
+        if (obj->type != MSGPACK_OBJECT_MAP) {
+            b->invalid++;
+            continue;
+        }
+        for (i = 0; i < obj->via.map.size; i++) {
+            kv = &obj->via.map.ptr[i];
+            if (kv->key.type == MSGPACK_OBJECT_STR &&
+                kv->key.via.str.size == 3 &&
+                memcmp(kv->key.via.str.ptr, "log", 3) == 0 &&
+                kv->val.type == MSGPACK_OBJECT_STR) {
+                line_check(b, kv->val.via.str.ptr, kv->val.via.str.size, now);
+                break;
+            }
+        }
+    }
+    msgpack_unpacked_destroy(&result);
+
+    __atomic_store_n(&b->last, now, __ATOMIC_RELAXED);
+    flb_lib_free(chunk);
+
+    return 0;
+}
+
+static int file_open(struct tail_file *f)
+{
+    f->fd = open(f->path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (f->fd == -1) {
+        perror(f->path);
+        return -1;
+    }
+    f->size = 0;
+    return 0;
+}
+
+static int file_copy(char *src, char *dst)
+{
+    int in;
+    int out;
+    ssize_t ret;
+    char buf[65536];
+
+    in = open(src, O_RDONLY);
+    out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (in == -1 || out == -1) {
+        if (in != -1) {
+            close(in);
+        }
+        if (out != -1) {
+            close(out);
+        }
+        return -1;
+    }
+
+    while ((ret = read(in, buf, sizeof(buf))) > 0) {
+        if (write(out, buf, ret) != ret) {
+            ret = -1;
+            break;
+        }
+    }
+    close(in);
+    close(out);
+
+    return ret == 0 ? 0 : -1;
+}
+
+static void file_rotate(struct bench *b, struct tail_file *f)
+{
+    char tmp[300];
+
+    snprintf(tmp, sizeof(tmp), "%s.1", f->path);
+    if (b->rotate == ROTATE_RENAME) {
+        close(f->fd);
+        rename(f->path, tmp);
+        file_open(f);
+    }
+    else {
+        file_copy(f->path, tmp);
+        if (ftruncate(f->fd, 0) == 0) {
+            f->size = 0;
+        }
+    }
+    __atomic_add_fetch(&b->rotations, 1, __ATOMIC_RELAXED);
+}
+
+/* Every writer owns the files i % writers == id */
+static void *writer_run(void *data)
+{
+    int i;
+    int n;
+    int len;
+    ssize_t ret;
+    uint64_t lines = 0;
+    double start;
+    double wait;
+    double rate = 0;
+    char *buf;
+    size_t buf_size;
+    struct timespec ts;
+    struct tail_file *f;
+    struct writer *w = data;
+    struct bench *b = w->b;
+
+    buf_size = TAIL_BATCH * (b->line_len + 64);
+    buf = malloc(buf_size);
+    if (b->rate > 0) {
+        rate = (double) b->rate / b->writers;
+    }
+
+    start = bench_now();
+    while (!__atomic_load_n(&b->stop, __ATOMIC_RELAXED) &&
+           (b->target == 0 || lines * b->writers < b->target)) {
+        for (i = w->id; i < b->files; i += b->writers) {
+            f = &b->tf[i];
+
+            len = 0;
+            for (n = 0; n < TAIL_BATCH; n++) {
+                len += sprintf(buf + len, "%i %" PRIu64 " %" PRIu64 " %s\n",
+                               i, f->seq + n, bench_now_usec(), b->payload);
+            }
+            ret = write(f->fd, buf, len);
+            if (ret != len) {
+                fprintf(stderr, "%s: short write\n", f->path);
+                __atomic_store_n(&b->stop, 1, __ATOMIC_RELAXED);
+                break;
+            }
+            f->seq += TAIL_BATCH;
+            f->size += len;
+            lines += TAIL_BATCH;
+
+            if (b->rotate != ROTATE_NONE && b->rotate_size > 0 &&
+                f->size >= b->rotate_size) {
+                file_rotate(b, f);
+            }
+        }
+
+        if (rate > 0) {
+            wait = start + (lines / rate) - bench_now();
+            if (wait > 0) {
+                usleep(wait * 1e6);
+            }
+        }
+    }
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    w->cpu = ts.tv_sec + ts.tv_nsec / 1e9;
+    free(buf);
+    __atomic_add_fetch(&b->done, 1, __ATOMIC_RELAXED);
+
+    return NULL;
+}
+
+static void dir_remove(char *dir)
+{
+    char path[512];
+    DIR *d;
+    struct dirent *e;
+
+    d = opendir(dir);
+    if (!d) {
+        return;
+    }
+    while ((e = readdir(d))) {
+        if (e->d_name[0] == '.') {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+        unlink(path);
+    }
+    closedir(d);
+    rmdir(dir);
+}
+
+static flb_ctx_t *bench_start(struct bench *b)
+{
+    int in_ffd;
+    int out_ffd;
+    char path[128];
+    struct flb_lib_out_cb cb;
+    flb_ctx_t *ctx;
+
+    ctx = flb_create();
+    flb_service_set(ctx, "Flush", b->flush, "Log_Level", "error", NULL);
+
+    snprintf(path, sizeof(path), "%s/*.log", b->dir);
+    in_ffd = flb_input(ctx, "tail", NULL);
+    flb_input_set(ctx, in_ffd, "tag", "bench", "path", path,
+                  "refresh_interval", "1", "rotate_wait", "5", NULL);
+    if (b->threads) {
+        flb_input_set(ctx, in_ffd, "threads", b->threads, NULL);
+    }
+    if (b->db) {
+        snprintf(path, sizeof(path), "%s/tail.db", b->dir);
+        flb_input_set(ctx, in_ffd, "db", path, NULL);
+    }
+
+    cb.cb = cb_chunk;
+    cb.data = b;
+    out_ffd = flb_output(ctx, "lib", &cb);
+    flb_output_set(ctx, out_ffd, "Match", "*", "format", "chunk", NULL);
+
+    if (flb_start(ctx) == -1) {
+        flb_destroy(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+static void usage(char *name)
+{
+    fprintf(stderr,
+            "usage: %s [-f files] [-w writers] [-r lines/s] [-l length] "
+            "[-R none|rename|copytruncate] [-S rotate size] [-D] "
+            "[-T tail threads] [-F flush] [-d seconds] [-j] [lines]\n",
+            name);
+}
+
+int main(int argc, char **argv)
+{
+    int i;
+    int opt;
+    int pad;
+    int ret = 0;
+    char *rotate = "none";
+    uint64_t written = 0;
+    uint64_t received;
+    uint64_t prev = 0;
+    uint64_t lost;
+    double start;
+    double end;
+    double elapsed;
+    double idle;
+    double cpu;
+    struct rusage ru0;
+    struct rusage ru1;
+    struct writer *w;
+    struct bench *b;
+    flb_ctx_t *ctx;
+
+    b = calloc(1, sizeof(struct bench));
+    b->files = TAIL_FILES;
+    b->line_len = TAIL_LINE_LEN;
+    b->duration = TAIL_DURATION;
+    b->flush = "1";
+
+    while ((opt = getopt(argc, argv, "f:w:r:l:R:S:DT:F:d:j")) != -1) {
+        switch (opt) {
+        case 'f': b->files = atoi(optarg); break;
+        case 'w': b->writers = atoi(optarg); break;
+        case 'r': b->rate = strtoull(optarg, NULL, 10); break;
+        case 'l': b->line_len = atoi(optarg); break;
+        case 'R': rotate = optarg; break;
+        case 'S': b->rotate_size = strtoull(optarg, NULL, 10); break;
+        case 'D': b->db = 1; break;
+        case 'T': b->threads = optarg; break;
+        case 'F': b->flush = optarg; break;
+        case 'd': b->duration = atoi(optarg); break;
+        case 'j': b->json = 1; break;
+        default:
+            usage(argv[0]);
+            free(b);
+            return 1;
+        }
+    }
+
+    if (optind < argc) {
+        b->target = strtoull(argv[optind], NULL, 10);
+    }
+
+    if (strcmp(rotate, "none") == 0) {
+        b->rotate = ROTATE_NONE;
+    }
+    else if (strcmp(rotate, "rename") == 0) {
+        b->rotate = ROTATE_RENAME;
+    }
+    else if (strcmp(rotate, "copytruncate") == 0) {
+        b->rotate = ROTATE_COPYTRUNCATE;
+    }
+    else {
+        b->rotate = -1;
+    }
+    if (b->writers <= 0 || b->writers > b->files) {
+        b->writers = b->files < 4 ? b->files : 4;
+    }
+    if (b->files <= 0 || b->duration <= 0 || b->line_len <= 0 ||
+        b->rotate == -1 || (b->rotate != ROTATE_NONE && b->rotate_size == 0)) {
+        usage(argv[0]);
+        free(b);
+        return 1;
+    }
+
+    pad = b->line_len > 40 ? b->line_len - 40 : 1;
+    b->payload = malloc(pad + 1);
+    memset(b->payload, 'x', pad);
+    b->payload[pad] = '\0';
+
+    strcpy(b->dir, "/tmp/flb-bench-tail.XXXXXX");
+    if (!mkdtemp(b->dir)) {
+        perror("mkdtemp");
+        free(b->payload);
+        free(b);
+        return 1;
+    }
+
+    /* The files exist before the engine starts, they are read from 0 */
+    b->tf = calloc(b->files, sizeof(struct tail_file));
+    b->seen = calloc(b->files, sizeof(struct tail_seen));
+    for (i = 0; i < b->files; i++) {
+        snprintf(b->tf[i].path, sizeof(b->tf[i].path), "%s/%i.log",
+                 b->dir, i);
+        if (file_open(&b->tf[i]) == -1) {
+            dir_remove(b->dir);
+            return 1;
+        }
+    }
+
+    ctx = bench_start(b);
+    if (!ctx) {
+        dir_remove(b->dir);
+        return 1;
+    }
+
+    getrusage(RUSAGE_SELF, &ru0);
+    start = bench_now();
+
+    w = calloc(b->writers, sizeof(struct writer));
+    for (i = 0; i < b->writers; i++) {
+        w[i].id = i;
+        w[i].b = b;
+        pthread_create(&w[i].tid, NULL, writer_run, &w[i]);
+    }
+    while (bench_now() - start < b->duration &&
+           __atomic_load_n(&b->done, __ATOMIC_RELAXED) < b->writers) {
+        usleep(10000);
+    }
+    __atomic_store_n(&b->stop, 1, __ATOMIC_RELAXED);
+
+    for (i = 0; i < b->writers; i++) {
+        pthread_join(w[i].tid, NULL);
+        b->writers_cpu += w[i].cpu;
+    }
+    for (i = 0; i < b->files; i++) {
+        written += b->tf[i].seq;
+    }
+    free(w);
+
+    /* Wait for the output to get everything, or for it to stall */
+    idle = bench_now();
+    while (1) {
+        received = __atomic_load_n(&b->received, __ATOMIC_RELAXED);
+        if (received >= written) {
+            break;
+        }
+        if (received != prev) {
+            prev = received;
+            idle = bench_now();
+        }
+        else if (bench_now() - idle > TAIL_IDLE) {
+            break;
+        }
+        usleep(10000);
+    }
+    end = __atomic_load_n(&b->last, __ATOMIC_RELAXED) / 1e6;
+    getrusage(RUSAGE_SELF, &ru1);
+
+    flb_stop(ctx);
+    flb_destroy(ctx);
+
+    received = b->received;
+    lost = written > received ? written - received : 0;
+    elapsed = end - start;
+    if (elapsed <= 0) {
+        elapsed = 1e-6;
+    }
+    cpu = (ru1.ru_utime.tv_sec - ru0.ru_utime.tv_sec) +
+          (ru1.ru_utime.tv_usec - ru0.ru_utime.tv_usec) / 1e6 +
+          (ru1.ru_stime.tv_sec - ru0.ru_stime.tv_sec) +
+          (ru1.ru_stime.tv_usec - ru0.ru_stime.tv_usec) / 1e6 -
+          b->writers_cpu;
+
+    if (b->json) {
+        printf("{\"bench\": \"tail\", \"case\": \"f%i-%s%s%s%s\", "
+               "\"files\": %i, \"lines\": %" PRIu64 ", "
+               "\"received\": %" PRIu64 ", \"lost\": %" PRIu64 ", "
+               "\"duplicated\": %" PRIu64 ", \"rotations\": %" PRIu64 ", "
+               "\"seconds\": %.3f, \"lines_per_sec\": %.0f, "
+               "\"cpu_usec_per_line\": %.3f, "
+               "\"lag_p50_usec\": %" PRIu64 ", \"lag_p99_usec\": %" PRIu64
+               "}\n",
+               b->files, rotate, b->db ? "-db" : "",
+               b->threads ? "-t" : "", b->threads ? b->threads : "",
+               b->files, written, received, lost, b->duplicated,
+               b->rotations, elapsed, received / elapsed,
+               received ? (cpu * 1e6) / received : 0,
+               lat_percentile(b, 0.50), lat_percentile(b, 0.99));
+    }
+    else {
+        printf("files           %i, %i writer(s), rotation %s%s\n",
+               b->files, b->writers, rotate, b->db ? ", db" : "");
+        printf("lines written   %" PRIu64 "\n", written);
+        printf("lines received  %" PRIu64 " in %.3f s\n", received, elapsed);
+        printf("lines lost      %" PRIu64 "\n", lost);
+        printf("duplicated      %" PRIu64 "\n", b->duplicated);
+        printf("rotations       %" PRIu64 "\n", b->rotations);
+        printf("lines/s         %.0f\n", received / elapsed);
+        printf("cpu usec/line   %.3f\n", received ? (cpu * 1e6) / received : 0);
+        printf("lag p50         %" PRIu64 " usec\n", lat_percentile(b, 0.50));
+        printf("lag p99         %" PRIu64 " usec\n", lat_percentile(b, 0.99));
+    }
+    if (b->invalid > 0) {
+        fprintf(stderr, "invalid lines: %" PRIu64 "\n", b->invalid);
+    }
+
+    /* Without rotation every line must arrive once */
+    if (received == 0 || b->invalid > 0 ||
+        (b->rotate == ROTATE_NONE && (lost > 0 || b->duplicated > 0))) {
+        ret = 1;
+    }
+
+    for (i = 0; i < b->files; i++) {
+        close(b->tf[i].fd);
+        free(b->seen[i].bits);
+    }
+    dir_remove(b->dir);
+    free(b->seen);
+    free(b->tf);
+    free(b->payload);
+    free(b);
+
+    return ret;
+}
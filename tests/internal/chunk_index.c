@@ -0,0 +1,140 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_mp.h>
+#include <fluent-bit/flb_chunk_index.h>
+#include <msgpack.h>
+
+#include <string.h>
+#include "flb_tests_internal.h"
+
+#define RECORDS  300
+
+/* Pack a [timestamp, {"n": i}] record */
+static void pack_record(msgpack_packer *pck, uint64_t ts, int i)
+{
+    msgpack_pack_array(pck, 2);
+    msgpack_pack_uint64(pck, ts);
+    msgpack_pack_map(pck, 1);
+    msgpack_pack_str(pck, 1);
+    msgpack_pack_str_body(pck, "n", 1);
+    msgpack_pack_int(pck, i);
+}
+
+static void test_append()
+{
+    int i;
+    int ret;
+    size_t off;
+    size_t bytes;
+    size_t uoff;
+    msgpack_sbuffer sbuf;
+    msgpack_packer pck;
+    msgpack_unpacked result;
+    struct flb_chunk_index idx;
+
+    msgpack_sbuffer_init(&sbuf);
+    msgpack_packer_init(&pck, &sbuf, msgpack_sbuffer_write);
+    flb_chunk_index_init(&idx);
+
+    /* Records appended in batches, like an input instance does */
+    for (i = 0; i < RECORDS; i++) {
+        pack_record(&pck, 1500000000 + (i % 7), i);
+        if (i % 10 == 9) {
+            ret = flb_chunk_index_append(&idx, sbuf.data, sbuf.size);
+            TEST_CHECK(ret == 10);
+        }
+    }
+
+    TEST_CHECK(idx.records == RECORDS);
+    TEST_CHECK(flb_chunk_index_valid(&idx, sbuf.size));
+    TEST_CHECK(idx.tm_min == 1500000000 && idx.tm_max == 1500000006);
+    TEST_CHECK(flb_chunk_index_count(&idx, sbuf.data, sbuf.size) == RECORDS);
+
+    /* A range holds exactly the records requested */
+    ret = flb_chunk_index_range(&idx, 100, 50, &off, &bytes);
+    TEST_CHECK(ret == 0);
+    TEST_CHECK(flb_mp_count(sbuf.data + off, bytes) == 50);
+
+    msgpack_unpacked_init(&result);
+    uoff = 0;
+    ret = msgpack_unpack_next(&result, sbuf.data + off, bytes, &uoff);
+    TEST_CHECK(ret == MSGPACK_UNPACK_SUCCESS);
+    TEST_CHECK(result.data.via.array.ptr[1].via.map.ptr[0].val.via.i64 == 100);
+    msgpack_unpacked_destroy(&result);
+
+    /* The last range ends with the chunk */
+    ret = flb_chunk_index_range(&idx, RECORDS - 1, 1, &off, &bytes);
+    TEST_CHECK(ret == 0 && off + bytes == sbuf.size);
+    ret = flb_chunk_index_range(&idx, RECORDS - 1, 2, &off, &bytes);
+    TEST_CHECK(ret == -1);
+
+    flb_chunk_index_invalidate(&idx);
+    msgpack_sbuffer_destroy(&sbuf);
+}
+
+static void test_event_time()
+{
+    int ret;
+    char ext[10];
+    msgpack_sbuffer sbuf;
+    msgpack_packer pck;
+    struct flb_chunk_index idx;
+
+    msgpack_sbuffer_init(&sbuf);
+    msgpack_packer_init(&pck, &sbuf, msgpack_sbuffer_write);
+    flb_chunk_index_init(&idx);
+
+    /* EventTime: 0x5e0be100 seconds */
+    memcpy(ext, "\x5e\x0b\xe1\x00\x00\x00\x00\x01", 8);
+    msgpack_pack_array(&pck, 2);
+    msgpack_pack_ext(&pck, 8, 0);
+    msgpack_pack_ext_body(&pck, ext, 8);
+    msgpack_pack_map(&pck, 0);
+
+    /* Float timestamp */
+    msgpack_pack_array(&pck, 2);
+    msgpack_pack_double(&pck, 1577836801.5);
+    msgpack_pack_map(&pck, 0);
+
+    ret = flb_chunk_index_append(&idx, sbuf.data, sbuf.size);
+    TEST_CHECK(ret == 2);
+    TEST_CHECK(idx.tm_min == 0x5e0be100);
+    TEST_CHECK(idx.tm_max == 1577836801);
+
+    flb_chunk_index_invalidate(&idx);
+    msgpack_sbuffer_destroy(&sbuf);
+}
+
+static void test_invalid()
+{
+    int ret;
+    char buf[] = "\x92\xce\x00\x00";
+    struct flb_chunk_index idx;
+    struct flb_chunk_index dst;
+
+    flb_chunk_index_init(&idx);
+    flb_chunk_index_init(&dst);
+
+    /* A truncated record invalidates the index */
+    ret = flb_chunk_index_append(&idx, buf, sizeof(buf) - 1);
+    TEST_CHECK(ret == -1);
+    TEST_CHECK(idx.records == -1);
+    TEST_CHECK(!flb_chunk_index_valid(&idx, sizeof(buf) - 1));
+    TEST_CHECK(flb_chunk_index_append(&idx, buf, sizeof(buf) - 1) == -1);
+
+    /* The index goes to 'dst', the source is ready to be used again */
+    flb_chunk_index_move(&dst, &idx);
+    TEST_CHECK(dst.records == -1);
+    TEST_CHECK(idx.records == 0 && idx.offsets == NULL);
+
+    flb_chunk_index_invalidate(&dst);
+}
+
+TEST_LIST = {
+    { "append"     , test_append},
+    { "event_time" , test_event_time},
+    { "invalid"    , test_invalid},
+    { 0 }
+};
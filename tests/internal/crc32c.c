@@ -0,0 +1,63 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_crc32c.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "flb_tests_internal.h"
+
+/* Check values from RFC 3720 (iSCSI) */
+static void test_crc32c_vectors()
+{
+    char buf[32];
+
+    TEST_CHECK(flb_crc32c(0, "123456789", 9) == 0xe3069283);
+    TEST_CHECK(flb_crc32c_sw(0, "123456789", 9) == 0xe3069283);
+
+    memset(buf, 0, sizeof(buf));
+    TEST_CHECK(flb_crc32c(0, buf, sizeof(buf)) == 0x8a9136aa);
+
+    memset(buf, 0xff, sizeof(buf));
+    TEST_CHECK(flb_crc32c(0, buf, sizeof(buf)) == 0x62a8ab43);
+
+    TEST_CHECK(flb_crc32c(0, buf, 0) == 0);
+}
+
+/* Any length and alignment must match the table version */
+static void test_crc32c_match()
+{
+    int i;
+    int off;
+    int len;
+    char *buf;
+    uint32_t crc;
+
+    buf = malloc(4096);
+    TEST_CHECK(buf != NULL);
+    srand(1);
+    for (i = 0; i < 4096; i++) {
+        buf[i] = rand();
+    }
+
+    for (off = 0; off < 8; off++) {
+        for (len = 0; len < 4096 - 8; len += 61) {
+            TEST_CHECK(flb_crc32c(0, buf + off, len) ==
+                       flb_crc32c_sw(0, buf + off, len));
+        }
+    }
+
+    /* Incremental */
+    crc = flb_crc32c(0, buf, 1000);
+    crc = flb_crc32c(crc, buf + 1000, 3096);
+    TEST_CHECK(crc == flb_crc32c(0, buf, 4096));
+
+    free(buf);
+}
+
+TEST_LIST = {
+    { "vectors", test_crc32c_vectors},
+    { "match"  , test_crc32c_match},
+    { 0 }
+};
@@ -0,0 +1,99 @@
+# Fluent Bit / Parser benchmark corpora
+# =====================================
+#
+# Generate the fixed samples used by flb-bench-parser. The random generator
+# is seeded so the files never change unless this script does.
+
+import json
+import random
+
+LINES = 256
+
+random.seed(2018)
+
+hosts = ['192.168.1.%d' % i for i in range(1, 40)] + ['10.0.0.7', '::1']
+users = ['-', 'frank', 'admin', 'deploy']
+methods = ['GET', 'GET', 'GET', 'POST', 'PUT', 'DELETE', 'HEAD']
+paths = ['/', '/index.html', '/api/v1/users', '/api/v1/orders/1234',
+         '/static/css/app.min.css', '/static/js/vendor.js?v=2.4.1',
+         '/search?q=fluent+bit&page=2', '/health']
+codes = ['200', '200', '200', '301', '304', '404', '500']
+agents = ['Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 '
+          '(KHTML, like Gecko) Chrome/66.0.3359.181 Safari/537.36',
+          'curl/7.58.0', 'Go-http-client/1.1',
+          'Mozilla/5.0 (Macintosh; Intel Mac OS X 10.13; rv:60.0) '
+          'Gecko/20100101 Firefox/60.0']
+months = ['Jan', 'Feb', 'Mar', 'Apr', 'May', 'Jun', 'Jul', 'Aug', 'Sep',
+          'Oct', 'Nov', 'Dec']
+idents = ['sshd', 'kernel', 'systemd', 'CRON', 'dhclient']
+messages = ['Accepted publickey for deploy from 10.0.0.7 port 51234 ssh2',
+            'Started Session 42 of user root.',
+            'pam_unix(cron:session): session opened for user root by (uid=0)',
+            'DHCPREQUEST of 192.168.1.20 on eth0 to 192.168.1.1 port 67',
+            'Out of memory: Kill process 1234 (java) score 901 or sacrifice']
+logs = ['GET /health 200 0.001s\n',
+        'Connecting to "db-01" on port 5432\n',
+        '\tat com.example.Main.run(Main.java:42)\n',
+        'level=info msg="request done" path=/api/v1/users status=200\n',
+        'Café — "quoted" and \\backslash\\\n']
+
+def clf_time():
+    return '%02d/%s/2018:%02d:%02d:%02d +0%d00' % (
+        random.randint(1, 28), random.choice(months),
+        random.randint(0, 23), random.randint(0, 59),
+        random.randint(0, 59), random.randint(0, 9))
+
+def iso_time():
+    return '2018-%02d-%02dT%02d:%02d:%02d.%06dZ' % (
+        random.randint(1, 12), random.randint(1, 28),
+        random.randint(0, 23), random.randint(0, 59),
+        random.randint(0, 59), random.randint(0, 999999))
+
+def request():
+    return '"%s %s HTTP/1.1" %s %d "%s" "%s"' % (
+        random.choice(methods), random.choice(paths), random.choice(codes),
+        random.randint(0, 50000), 'https://example.com/',
+        random.choice(agents))
+
+def apache():
+    return '%s - %s [%s] %s' % (random.choice(hosts), random.choice(users),
+                                clf_time(), request())
+
+def nginx():
+    return '%s example.com %s [%s] %s' % (random.choice(hosts),
+                                         random.choice(users),
+                                         clf_time(), request())
+
+def syslog():
+    return '<%d>%s %2d %02d:%02d:%02d web-%02d %s[%d]: %s' % (
+        random.randint(0, 191), random.choice(months),
+        random.randint(1, 28), random.randint(0, 23),
+        random.randint(0, 59), random.randint(0, 59),
+        random.randint(1, 9), random.choice(idents),
+        random.randint(1, 65535), random.choice(messages))
+
+def docker():
+    return json.dumps({'log': random.choice(logs),
+                       'stream': random.choice(['stdout', 'stderr']),
+                       'time': iso_time()})
+
+def json_record():
+    return json.dumps({'host': random.choice(hosts),
+                       'user': random.choice(users),
+                       'method': random.choice(methods),
+                       'path': random.choice(paths),
+                       'code': int(random.choice(codes)),
+                       'size': random.randint(0, 50000),
+                       'agent': random.choice(agents),
+                       'time': clf_time()})
+
+def write(name, func):
+    with open(name, 'w') as f:
+        for i in range(LINES):
+            f.write(func() + '\n')
+
+write('apache.log', apache)
+write('nginx.log', nginx)
+write('syslog.log', syslog)
+write('docker.log', docker)
+write('json.log', json_record)
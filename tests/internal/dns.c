@@ -0,0 +1,102 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_config.h>
+#include <fluent-bit/flb_dns.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "flb_tests_internal.h"
+
+static void test_dns_resolve()
+{
+    int ret;
+    int count = 0;
+    struct sockaddr_in *sin;
+    struct flb_config config;
+    struct flb_dns_addr *addrs = NULL;
+
+    memset(&config, '\0', sizeof(config));
+
+    /* Without a co-routine the lookup runs in place */
+    ret = flb_dns_resolve(&config, "127.0.0.1", 80, AF_INET, NULL, NULL,
+                          &addrs, &count);
+    TEST_CHECK(ret == 0);
+    TEST_CHECK(count == 1);
+    TEST_CHECK(addrs[0].family == AF_INET);
+
+    sin = (struct sockaddr_in *) &addrs[0].addr;
+    TEST_CHECK(ntohs(sin->sin_port) == 80);
+    TEST_CHECK(sin->sin_addr.s_addr == htonl(INADDR_LOOPBACK));
+    flb_free(addrs);
+}
+
+static void test_dns_cache()
+{
+    int i;
+    int ret;
+    struct sockaddr_in *sin;
+    struct flb_config config;
+    struct flb_dns_addr addr;
+    struct flb_dns_cache cache;
+    pthread_mutex_t lock;
+
+    memset(&config, '\0', sizeof(config));
+    memset(&cache, '\0', sizeof(cache));
+    config.dns_cache_ttl = 60;
+    pthread_mutex_init(&lock, NULL);
+
+    ret = flb_dns_cache_get(&config, &cache, &lock, "127.0.0.1", 80,
+                            AF_INET, NULL, NULL, &addr);
+    TEST_CHECK(ret == 0);
+    TEST_CHECK(cache.count == 1);
+    TEST_CHECK(cache.expire > time(NULL));
+
+    /* Replace the entry with three addresses, the cache is not expired */
+    flb_free(cache.addrs);
+    cache.addrs = flb_calloc(3, sizeof(struct flb_dns_addr));
+    TEST_CHECK(cache.addrs != NULL);
+    cache.count = 3;
+    cache.next = 0;
+    for (i = 0; i < 3; i++) {
+        sin = (struct sockaddr_in *) &cache.addrs[i].addr;
+        sin->sin_family = AF_INET;
+        sin->sin_addr.s_addr = htonl(i);
+        cache.addrs[i].family = AF_INET;
+        cache.addrs[i].len = sizeof(struct sockaddr_in);
+    }
+
+    /* Connections rotate across the addresses */
+    for (i = 0; i < 6; i++) {
+        ret = flb_dns_cache_get(&config, &cache, &lock, "127.0.0.1", 80,
+                                AF_INET, NULL, NULL, &addr);
+        TEST_CHECK(ret == 0);
+        sin = (struct sockaddr_in *) &addr.addr;
+        TEST_CHECK(ntohl(sin->sin_addr.s_addr) == (i % 3));
+    }
+
+    /* Once expired it's resolved again */
+    cache.expire = 0;
+    ret = flb_dns_cache_get(&config, &cache, &lock, "127.0.0.1", 80,
+                            AF_INET, NULL, NULL, &addr);
+    TEST_CHECK(ret == 0);
+    TEST_CHECK(cache.count == 1);
+
+    /* A failed lookup keeps using the expired addresses */
+    cache.expire = 0;
+    ret = flb_dns_cache_get(&config, &cache, &lock, "host.invalid", 80,
+                            AF_INET, NULL, NULL, &addr);
+    TEST_CHECK(ret == 0);
+    sin = (struct sockaddr_in *) &addr.addr;
+    TEST_CHECK(sin->sin_addr.s_addr == htonl(INADDR_LOOPBACK));
+
+    flb_dns_cache_destroy(&cache);
+    pthread_mutex_destroy(&lock);
+}
+
+TEST_LIST = {
+    { "resolve", test_dns_resolve},
+    { "cache"  , test_dns_cache},
+    { 0 }
+};
@@ -0,0 +1,175 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_config.h>
+#include <fluent-bit/flb_engine_channel.h>
+
+#include <pthread.h>
+#include <sched.h>
+#include "flb_tests_internal.h"
+
+#define PRODUCERS  4
+#define MESSAGES   250000
+
+static void test_channel_usage()
+{
+    int i;
+    int n;
+    int ret;
+    uint64_t vals[16];
+    struct flb_engine_channel *ch;
+
+    /* Cells are rounded up to a power of two */
+    ch = flb_engine_channel_create(NULL, 5);
+    TEST_CHECK(ch != NULL);
+    TEST_CHECK(ch->mask == 7);
+
+    n = flb_engine_channel_pop(ch, vals, 16);
+    TEST_CHECK(n == 0);
+
+    for (i = 0; i < 8; i++) {
+        ret = flb_engine_channel_push(ch, i);
+        TEST_CHECK(ret == 0);
+    }
+
+    /* Full */
+    ret = flb_engine_channel_push(ch, 8);
+    TEST_CHECK(ret == -1);
+
+    /* Batches keep the order */
+    n = flb_engine_channel_pop(ch, vals, 3);
+    TEST_CHECK(n == 3);
+    n += flb_engine_channel_pop(ch, vals + 3, 16);
+    TEST_CHECK(n == 8);
+    for (i = 0; i < 8; i++) {
+        TEST_CHECK(vals[i] == i);
+    }
+
+    /* Cells are reused on the next lap */
+    for (i = 0; i < 8; i++) {
+        ret = flb_engine_channel_push(ch, 100 + i);
+        TEST_CHECK(ret == 0);
+    }
+    n = flb_engine_channel_pop(ch, vals, 16);
+    TEST_CHECK(n == 8);
+    TEST_CHECK(vals[7] == 107);
+
+    flb_engine_channel_destroy(ch);
+}
+
+static void test_channel_doorbell()
+{
+    int i;
+    int n;
+    int ret;
+    uint64_t vals[16];
+    struct flb_config config;
+    struct flb_engine_channel *ch;
+
+    ch = flb_engine_channel_create(NULL, 16);
+    TEST_CHECK(ch != NULL);
+
+    memset(&config, '\0', sizeof(config));
+    config.ch_engine = ch;
+
+    /* Consecutive events ring the doorbell once */
+    for (i = 0; i < 10; i++) {
+        ret = flb_engine_notify(&config, i);
+        TEST_CHECK(ret == sizeof(uint64_t));
+    }
+    TEST_CHECK(ch->armed == FLB_TRUE);
+
+    flb_engine_channel_ack(ch);
+    TEST_CHECK(ch->armed == FLB_FALSE);
+    n = flb_engine_channel_pop(ch, vals, 16);
+    TEST_CHECK(n == 10);
+
+    /* Once acknowledged, the next event rings it again */
+    ret = flb_engine_notify(&config, 10);
+    TEST_CHECK(ret == sizeof(uint64_t));
+    TEST_CHECK(ch->armed == FLB_TRUE);
+    flb_engine_channel_ack(ch);
+    n = flb_engine_channel_pop(ch, vals, 16);
+    TEST_CHECK(n == 1);
+    TEST_CHECK(vals[0] == 10);
+
+    flb_engine_channel_destroy(ch);
+}
+
+struct producer {
+    int id;
+    pthread_t tid;
+    struct flb_engine_channel *ch;
+};
+
+static void *producer(void *data)
+{
+    uint64_t i;
+    struct producer *p = data;
+
+    for (i = 0; i < MESSAGES; i++) {
+        while (flb_engine_channel_push(p->ch,
+                                       ((uint64_t) p->id << 32) | i) == -1) {
+            sched_yield();
+        }
+    }
+
+    return NULL;
+}
+
+static void test_channel_threads()
+{
+    int i;
+    int n;
+    int ret;
+    int errors = 0;
+    uint32_t id;
+    uint64_t total = 0;
+    uint64_t next[PRODUCERS];
+    uint64_t vals[FLB_ENGINE_CHANNEL_BATCH];
+    struct producer p[PRODUCERS];
+    struct flb_engine_channel *ch;
+
+    ch = flb_engine_channel_create(NULL, 64);
+    TEST_CHECK(ch != NULL);
+
+    for (i = 0; i < PRODUCERS; i++) {
+        next[i] = 0;
+        p[i].id = i;
+        p[i].ch = ch;
+        ret = pthread_create(&p[i].tid, NULL, producer, &p[i]);
+        TEST_CHECK(ret == 0);
+    }
+
+    /* Events of each producer arrive complete and in order */
+    while (total < PRODUCERS * MESSAGES) {
+        n = flb_engine_channel_pop(ch, vals, FLB_ENGINE_CHANNEL_BATCH);
+        if (n == 0) {
+            sched_yield();
+            continue;
+        }
+        for (i = 0; i < n; i++) {
+            id = vals[i] >> 32;
+            if (id >= PRODUCERS || (vals[i] & 0xffffffff) != next[id]) {
+                errors++;
+                continue;
+            }
+            next[id]++;
+        }
+        total += n;
+    }
+
+    for (i = 0; i < PRODUCERS; i++) {
+        pthread_join(p[i].tid, NULL);
+    }
+    TEST_CHECK(errors == 0);
+
+    flb_engine_channel_destroy(ch);
+}
+
+TEST_LIST = {
+    { "usage"   , test_channel_usage},
+    { "doorbell", test_channel_doorbell},
+    { "threads" , test_channel_threads},
+    { 0 }
+};
@@ -0,0 +1,200 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_str.h>
+#include <fluent-bit/flb_config.h>
+#include <fluent-bit/flb_input.h>
+#include <fluent-bit/flb_filter.h>
+#include <fluent-bit/flb_output.h>
+#include <fluent-bit/flb_router.h>
+#include <fluent-bit/flb_filter_pushdown.h>
+
+#include <msgpack.h>
+#include <stdarg.h>
+#include <string.h>
+#include "flb_tests_internal.h"
+
+struct pushdown_test {
+    struct flb_config *config;
+    struct flb_input_instance ins;
+    struct flb_output_instance *out;
+    struct flb_filter_pushdown pd;
+};
+
+static void test_create(struct pushdown_test *t, char *out_match)
+{
+    memset(t, '\0', sizeof(struct pushdown_test));
+    t->config = flb_config_init();
+
+    t->ins.config = t->config;
+    t->ins.pushdown = FLB_TRUE;
+    strcpy(t->ins.name, "test.0");
+
+    t->out = flb_output_new(t->config, "null", NULL);
+    TEST_CHECK(t->out != NULL);
+    flb_output_set_property(t->out, "match", out_match);
+    TEST_CHECK(flb_output_init(t->config) == 0);
+}
+
+static struct flb_filter_instance *test_filter(struct pushdown_test *t,
+                                               char *name)
+{
+    struct flb_filter_instance *f_ins;
+
+    f_ins = flb_filter_new(t->config, name, NULL);
+    TEST_CHECK(f_ins != NULL);
+    flb_filter_set_property(f_ins, "match", "test");
+
+    return f_ins;
+}
+
+static void test_start(struct pushdown_test *t)
+{
+    flb_filter_initialize_all(t->config);
+    flb_filter_pushdown_init(&t->pd, &t->ins, "test", 4, "log", 3);
+}
+
+static void test_destroy(struct pushdown_test *t)
+{
+    flb_filter_pushdown_destroy(&t->pd);
+    flb_filter_exit(t->config);
+    flb_output_exit(t->config);
+    flb_config_exit(t->config);
+}
+
+static int line(struct pushdown_test *t, char *str)
+{
+    return flb_filter_pushdown_line(&t->pd, str, strlen(str));
+}
+
+/* Pack a map of 'n' string pairs and check it */
+static int pack(struct pushdown_test *t, int n, ...)
+{
+    int i;
+    int ret;
+    char *str;
+    va_list va;
+    msgpack_sbuffer sbuf;
+    msgpack_packer pck;
+
+    msgpack_sbuffer_init(&sbuf);
+    msgpack_packer_init(&pck, &sbuf, msgpack_sbuffer_write);
+
+    va_start(va, n);
+    msgpack_pack_map(&pck, n);
+    for (i = 0; i < n * 2; i++) {
+        str = va_arg(va, char *);
+        msgpack_pack_str(&pck, strlen(str));
+        msgpack_pack_str_body(&pck, str, strlen(str));
+    }
+    va_end(va);
+
+    ret = flb_filter_pushdown_pack(&t->pd, sbuf.data, sbuf.size);
+    msgpack_sbuffer_destroy(&sbuf);
+
+    return ret;
+}
+
+/* Exclude rules on the raw line field */
+static void test_exclude()
+{
+    struct pushdown_test t;
+    struct flb_filter_instance *f_ins;
+
+    test_create(&t, "*");
+    f_ins = test_filter(&t, "grep");
+    flb_filter_set_property(f_ins, "exclude", "log ^debug");
+    flb_filter_set_property(f_ins, "exclude", "log ^trace");
+    test_start(&t);
+
+    TEST_CHECK(line(&t, "debug: starting") == FLB_TRUE);
+    TEST_CHECK(line(&t, "trace: starting") == FLB_TRUE);
+    TEST_CHECK(line(&t, "info: starting") == FLB_FALSE);
+    TEST_CHECK(t.pd.rules_len == 1);
+
+    TEST_CHECK(pack(&t, 2, "msg", "x", "log", "trace: y") == FLB_TRUE);
+    TEST_CHECK(pack(&t, 1, "msg", "debug") == FLB_FALSE);
+
+    test_destroy(&t);
+}
+
+/* A field the input does not know stops the rules of the filter */
+static void test_order()
+{
+    struct pushdown_test t;
+    struct flb_filter_instance *f_ins;
+
+    test_create(&t, "*");
+    f_ins = test_filter(&t, "grep");
+    flb_filter_set_property(f_ins, "exclude", "host ^a");
+    flb_filter_set_property(f_ins, "exclude", "log ^debug");
+    flb_filter_set_property(f_ins, "regex", "log ^info");
+    flb_filter_set_property(f_ins, "exclude", "log ^warn");
+    f_ins = test_filter(&t, "grep");
+    flb_filter_set_property(f_ins, "exclude", "log ^error");
+    test_start(&t);
+
+    TEST_CHECK(line(&t, "debug: x") == FLB_FALSE);
+    TEST_CHECK(line(&t, "warn: x") == FLB_FALSE);
+    TEST_CHECK(line(&t, "error: x") == FLB_TRUE);
+
+    TEST_CHECK(pack(&t, 2, "host", "b", "log", "debug: x") == FLB_TRUE);
+    TEST_CHECK(pack(&t, 2, "host", "a", "log", "info: x") == FLB_TRUE);
+    TEST_CHECK(pack(&t, 1, "log", "debug: x") == FLB_FALSE);
+
+    test_destroy(&t);
+}
+
+/* Filters after one that is not a pure dropper are not taken */
+static void test_chain()
+{
+    struct pushdown_test t;
+    struct flb_filter_instance *f_ins;
+
+    test_create(&t, "*");
+    test_filter(&t, "stdout");
+    f_ins = test_filter(&t, "grep");
+    flb_filter_set_property(f_ins, "exclude", "log ^debug");
+    test_start(&t);
+
+    TEST_CHECK(line(&t, "debug: x") == FLB_FALSE);
+    TEST_CHECK(t.pd.rules_len == 0);
+
+    test_destroy(&t);
+}
+
+/* A tag with no destination drops everything, until the routes change */
+static void test_no_route()
+{
+    struct pushdown_test t;
+
+    test_create(&t, "other");
+    test_start(&t);
+
+    TEST_CHECK(line(&t, "info: x") == FLB_TRUE);
+    TEST_CHECK(flb_filter_pushdown_tag(&t.pd) == FLB_TRUE);
+
+    flb_free(t.out->match);
+    t.out->match = flb_strdup("te*");
+    flb_router_cache_invalidate(t.config);
+    TEST_CHECK(line(&t, "info: x") == FLB_FALSE);
+
+    /* Disabled for the instance */
+    flb_free(t.out->match);
+    t.out->match = flb_strdup("other");
+    flb_router_cache_invalidate(t.config);
+    t.ins.pushdown = FLB_FALSE;
+    flb_filter_pushdown_init(&t.pd, &t.ins, "test", 4, "log", 3);
+    TEST_CHECK(line(&t, "info: x") == FLB_FALSE);
+
+    test_destroy(&t);
+}
+
+TEST_LIST = {
+    { "exclude",  test_exclude  },
+    { "order",    test_order    },
+    { "chain",    test_chain    },
+    { "no_route", test_no_route },
+    { 0 }
+};
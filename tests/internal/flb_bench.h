@@ -0,0 +1,195 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef FLB_BENCH_H
+#define FLB_BENCH_H
+
+/* Helpers shared by the flb-bench-* binaries, include it once per binary */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+/*
+ * Allocations are counted wrapping the libc allocator, the code reaches
+ * it through flb_malloc() and the libraries (msgpack, onigmo) directly.
+ * The wrappers also keep the heap bytes in use (usable size of the
+ * blocks) and their peak.
+ */
+#if defined(__GLIBC__) && !defined(FLB_HAVE_JEMALLOC) && \
+    !defined(__SANITIZE_ADDRESS__)
+#define BENCH_ALLOCS
+
+#include <malloc.h>
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t align, size_t size);
+extern void __libc_free(void *ptr);
+
+static uint64_t bench_allocs;
+static int64_t bench_heap_live;
+static int64_t bench_heap_peak;
+
+static inline void bench_heap_add(int64_t bytes)
+{
+    int64_t live;
+    int64_t peak;
+
+    live = __atomic_add_fetch(&bench_heap_live, bytes, __ATOMIC_RELAXED);
+    peak = __atomic_load_n(&bench_heap_peak, __ATOMIC_RELAXED);
+    while (live > peak &&
+           !__atomic_compare_exchange_n(&bench_heap_peak, &peak, live, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static inline void *bench_alloc_done(void *ptr)
+{
+    __atomic_add_fetch(&bench_allocs, 1, __ATOMIC_RELAXED);
+    if (ptr) {
+        bench_heap_add(malloc_usable_size(ptr));
+    }
+    return ptr;
+}
+
+void *malloc(size_t size)
+{
+    return bench_alloc_done(__libc_malloc(size));
+}
+
+void *calloc(size_t n, size_t size)
+{
+    return bench_alloc_done(__libc_calloc(n, size));
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    size_t prev = 0;
+    void *tmp;
+
+    if (ptr) {
+        prev = malloc_usable_size(ptr);
+    }
+    tmp = __libc_realloc(ptr, size);
+    if (tmp) {
+        bench_heap_add(-(int64_t) prev);
+    }
+    else if (ptr && size == 0) {
+        /* released */
+        bench_heap_add(-(int64_t) prev);
+        return NULL;
+    }
+    return bench_alloc_done(tmp);
+}
+
+void *memalign(size_t align, size_t size)
+{
+    return bench_alloc_done(__libc_memalign(align, size));
+}
+
+void *aligned_alloc(size_t align, size_t size)
+{
+    return bench_alloc_done(__libc_memalign(align, size));
+}
+
+int posix_memalign(void **ptr, size_t align, size_t size)
+{
+    void *tmp;
+
+    tmp = bench_alloc_done(__libc_memalign(align, size));
+    if (!tmp) {
+        return ENOMEM;
+    }
+    *ptr = tmp;
+    return 0;
+}
+
+void free(void *ptr)
+{
+    if (ptr) {
+        bench_heap_add(-(int64_t) malloc_usable_size(ptr));
+    }
+    __libc_free(ptr);
+}
+#endif
+
+/*
+ * With -j as first argument the benchmarks print one JSON object per line
+ * and case instead of a table, see bench.py.
+ */
+static int bench_json;
+
+static inline void bench_json_args(int *argc, char ***argv)
+{
+    if (*argc > 1 && strcmp((*argv)[1], "-j") == 0) {
+        bench_json = 1;
+        (*argv)[1] = (*argv)[0];
+        (*argc)--;
+        (*argv)++;
+    }
+}
+
+static inline double bench_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+static inline uint64_t bench_allocs_get()
+{
+#ifdef BENCH_ALLOCS
+    return __atomic_load_n(&bench_allocs, __ATOMIC_RELAXED);
+#else
+    return 0;
+#endif
+}
+
+/* Heap bytes in use, zero if the allocator is not wrapped */
+static inline int64_t bench_heap_get()
+{
+#ifdef BENCH_ALLOCS
+    return __atomic_load_n(&bench_heap_live, __ATOMIC_RELAXED);
+#else
+    return 0;
+#endif
+}
+
+static inline int64_t bench_heap_peak_get()
+{
+#ifdef BENCH_ALLOCS
+    return __atomic_load_n(&bench_heap_peak, __ATOMIC_RELAXED);
+#else
+    return 0;
+#endif
+}
+
+/* Start a new peak from the current usage */
+static inline void bench_heap_peak_reset()
+{
+#ifdef BENCH_ALLOCS
+    __atomic_store_n(&bench_heap_peak, bench_heap_get(), __ATOMIC_RELAXED);
+#endif
+}
+
+#endif
@@ -0,0 +1,319 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_gzip.h>
+#include <fluent-bit/flb_log.h>
+#include <fluent-bit/flb_config.h>
+#include <fluent-bit/flb_worker.h>
+#include <fluent-bit/flb_compress.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "flb_tests_internal.h"
+
+/* Inflate a gzip stream and check its header and footer */
+static int gunzip_check(void *gz, size_t gz_len, void *data, size_t len)
+{
+    int ret;
+    char *out;
+    unsigned char *p = gz;
+    mz_ulong crc;
+    mz_stream strm;
+
+    if (gz_len < 18 || p[0] != 0x1f || p[1] != 0x8b || p[2] != 8) {
+        return -1;
+    }
+
+    out = flb_malloc(len + 1);
+    memset(&strm, '\0', sizeof(strm));
+    mz_inflateInit2(&strm, -MZ_DEFAULT_WINDOW_BITS);
+    strm.next_in = p + 10;
+    strm.avail_in = gz_len - 18;
+    strm.next_out = (unsigned char *) out;
+    strm.avail_out = len + 1;
+    ret = mz_inflate(&strm, MZ_FINISH);
+    mz_inflateEnd(&strm);
+
+    if (ret != MZ_STREAM_END || strm.total_out != len ||
+        memcmp(out, data, len) != 0) {
+        flb_free(out);
+        return -1;
+    }
+    flb_free(out);
+
+    p += gz_len - 8;
+    crc = mz_crc32(MZ_CRC32_INIT, data, len);
+    if (p[0] != (crc & 0xff) || p[3] != ((crc >> 24) & 0xff) ||
+        p[4] != (len & 0xff) || p[5] != ((len >> 8) & 0xff)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static void test_compress()
+{
+    int i;
+    int ret;
+    size_t len = 256 * 1024;
+    size_t gz_len;
+    char *data;
+    void *gz;
+
+    /* NDJSON like text */
+    data = flb_malloc(len);
+    for (i = 0; i < len; i++) {
+        data[i] = "{\"key\": \"value\", \"n\": 12345}\n"[i % 30];
+    }
+    ret = flb_gzip_compress(data, len, &gz, &gz_len);
+    TEST_CHECK(ret == 0);
+    TEST_CHECK(gz_len < len / 10);
+    TEST_CHECK(gunzip_check(gz, gz_len, data, len) == 0);
+    flb_free(gz);
+
+    /* Random bytes don't compress, the output is bigger than the input */
+    srand(1);
+    for (i = 0; i < len; i++) {
+        data[i] = rand() & 0xff;
+    }
+    ret = flb_gzip_compress(data, len, &gz, &gz_len);
+    TEST_CHECK(ret == 0);
+    TEST_CHECK(gunzip_check(gz, gz_len, data, len) == 0);
+    flb_free(gz);
+
+    /* Empty input */
+    ret = flb_gzip_compress(data, 0, &gz, &gz_len);
+    TEST_CHECK(ret == 0);
+    TEST_CHECK(gunzip_check(gz, gz_len, data, 0) == 0);
+    flb_free(gz);
+
+    flb_free(data);
+}
+
+static void test_stream()
+{
+    int i;
+    int ret;
+    size_t off;
+    size_t len = 512 * 1024;
+    size_t gz_len;
+    char *data;
+    void *gz;
+    struct flb_gzip ctx;
+
+    data = flb_malloc(len);
+    srand(2);
+    for (i = 0; i < len; i++) {
+        data[i] = 'a' + (rand() % 8);
+    }
+
+    /* Small size hint, the buffer has to grow many times */
+    ret = flb_gzip_init(&ctx, 0);
+    TEST_CHECK(ret == 0);
+    for (off = 0; off < len; off += 97) {
+        ret = flb_gzip_write(&ctx, data + off,
+                             (len - off) < 97 ? (len - off) : 97);
+        TEST_CHECK(ret == 0);
+    }
+    ret = flb_gzip_finish(&ctx, &gz, &gz_len);
+    TEST_CHECK(ret == 0);
+    TEST_CHECK(gunzip_check(gz, gz_len, data, len) == 0);
+    flb_gzip_destroy(&ctx);
+    flb_free(gz);
+
+    /* Abandoned stream */
+    ret = flb_gzip_init(&ctx, 1024);
+    TEST_CHECK(ret == 0);
+    flb_gzip_write(&ctx, data, 4096);
+    flb_gzip_destroy(&ctx);
+
+    flb_free(data);
+}
+
+/* Walk a sequence of gzip members, each one is checked on its own */
+static int gunzip_members_check(void *gz, size_t gz_len,
+                                char *data, size_t len, size_t block_size)
+{
+    int ret;
+    int members = 0;
+    size_t off = 0;
+    size_t in_len;
+    size_t used;
+    char *out;
+    unsigned char *p = gz;
+    mz_stream strm;
+
+    while (off < len) {
+        in_len = (len - off) < block_size ? (len - off) : block_size;
+
+        /* find where the member ends */
+        memset(&strm, '\0', sizeof(strm));
+        mz_inflateInit2(&strm, -MZ_DEFAULT_WINDOW_BITS);
+        strm.next_in = p + 10;
+        strm.avail_in = gz_len - 10;
+        out = flb_malloc(in_len);
+        strm.next_out = (unsigned char *) out;
+        strm.avail_out = in_len;
+        ret = mz_inflate(&strm, MZ_FINISH);
+        used = 10 + (gz_len - 10 - strm.avail_in) + 8;
+        mz_inflateEnd(&strm);
+        flb_free(out);
+        if (ret != MZ_STREAM_END) {
+            return -1;
+        }
+
+        if (gunzip_check(p, used, data + off, in_len) != 0) {
+            return -1;
+        }
+        p += used;
+        gz_len -= used;
+        off += in_len;
+        members++;
+    }
+
+    return gz_len == 0 ? members : -1;
+}
+
+static void test_workers()
+{
+    int i;
+    int ret;
+    size_t len = 1024 * 1024;
+    size_t gz_len;
+    char *data;
+    void *gz;
+    struct flb_config *config;
+
+    config = flb_config_init();
+    config->log = flb_log_init(config, FLB_LOG_STDERR, FLB_LOG_INFO, NULL);
+    config->compress_workers = 4;
+
+    data = flb_malloc(len);
+    srand(3);
+    for (i = 0; i < len; i++) {
+        data[i] = 'a' + (rand() % 8);
+    }
+
+    /* One member compressed by a worker */
+    ret = flb_compress_gzip(config, data, len, &gz, &gz_len);
+    TEST_CHECK(ret == 0);
+    TEST_CHECK(gunzip_check(gz, gz_len, data, len) == 0);
+    flb_free(gz);
+
+    /* Small buffers are compressed in place */
+    ret = flb_compress_gzip(config, data, 100, &gz, &gz_len);
+    TEST_CHECK(ret == 0);
+    TEST_CHECK(gunzip_check(gz, gz_len, data, 100) == 0);
+    flb_free(gz);
+
+    flb_compress_exit(config);
+
+    /* Parallel blocks, the last one is shorter */
+    config->compress_block_size = 100000;
+    ret = flb_compress_gzip(config, data, len, &gz, &gz_len);
+    TEST_CHECK(ret == 0);
+    ret = gunzip_members_check(gz, gz_len, data, len, 100000);
+    TEST_CHECK(ret == 11);
+    flb_free(gz);
+
+    flb_compress_exit(config);
+    flb_worker_exit(config);
+    flb_config_exit(config);
+    flb_free(data);
+}
+
+/* Read gzip data back in small pieces */
+static int gunzip_read_all(void *gz_data, size_t gz_len,
+                           char *out, size_t size, size_t piece)
+{
+    int ret;
+    size_t off = 0;
+    size_t len;
+    struct flb_gunzip gz;
+
+    flb_gunzip_init(&gz, gz_data, gz_len);
+    do {
+        if (off + piece > size) {
+            ret = -1;
+            break;
+        }
+        ret = flb_gunzip_read(&gz, out + off, piece, &len);
+        off += len;
+    } while (ret == 0 && len > 0);
+    flb_gunzip_destroy(&gz);
+
+    if (ret == -1) {
+        return -1;
+    }
+    return off;
+}
+
+static void test_gunzip()
+{
+    int i;
+    int ret;
+    size_t len = 300 * 1024;
+    size_t gz_len;
+    size_t m_len;
+    char *data;
+    char *out;
+    char *gz;
+    void *m1;
+    void *m2;
+
+    data = flb_malloc(len);
+    out = flb_malloc(len + 4096);
+    srand(5);
+    for (i = 0; i < len; i++) {
+        data[i] = 'a' + (rand() % 4);
+    }
+
+    /* Two members read as a single stream */
+    ret = flb_gzip_compress(data, 1000, &m1, &m_len);
+    TEST_CHECK(ret == 0);
+    ret = flb_gzip_compress(data + 1000, len - 1000, &m2, &gz_len);
+    TEST_CHECK(ret == 0);
+    gz = flb_malloc(m_len + gz_len);
+    memcpy(gz, m1, m_len);
+    memcpy(gz + m_len, m2, gz_len);
+    gz_len += m_len;
+    flb_free(m1);
+    flb_free(m2);
+
+    ret = gunzip_read_all(gz, gz_len, out, len + 4096, 4096);
+    TEST_CHECK(ret == len);
+    TEST_CHECK(memcmp(out, data, len) == 0);
+
+    ret = gunzip_read_all(gz, gz_len, out, len + 4096, 7);
+    TEST_CHECK(ret == len);
+    TEST_CHECK(memcmp(out, data, len) == 0);
+
+    /* Truncated data */
+    ret = gunzip_read_all(gz, gz_len - 4, out, len + 4096, 4096);
+    TEST_CHECK(ret == -1);
+    ret = gunzip_read_all(gz, gz_len / 2, out, len + 4096, 4096);
+    TEST_CHECK(ret == -1);
+
+    /* Bad checksum */
+    gz[gz_len - 8] ^= 0xff;
+    ret = gunzip_read_all(gz, gz_len, out, len + 4096, 4096);
+    TEST_CHECK(ret == -1);
+
+    /* Not gzip */
+    ret = gunzip_read_all(data, 100, out, len + 4096, 4096);
+    TEST_CHECK(ret == -1);
+
+    flb_free(gz);
+    flb_free(out);
+    flb_free(data);
+}
+
+TEST_LIST = {
+    { "compress", test_compress},
+    { "stream"  , test_stream},
+    { "workers" , test_workers},
+    { "gunzip"  , test_gunzip},
+    { 0 }
+};
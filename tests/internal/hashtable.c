@@ -140,15 +140,26 @@ void test_medium_table()
     flb_hash_destroy(ht);
 }
 
-void test_chaining()
+/* Number of full slots in the table */
+static int ht_slots_used(struct flb_hash *ht)
+{
+    int i;
+    int used = 0;
+
+    for (i = 0; i < ht->size; i++) {
+        if (!(ht->ctrl[i] & 0x80)) {
+            TEST_CHECK(ht->slots[i] != NULL);
+            used++;
+        }
+    }
+    return used;
+}
+
+void test_slots_count()
 {
     int i;
     int inserts = 0;
-    int count;
-    int chains = 0;
     struct map *m;
-    struct mk_list *head;
-    struct flb_hash_table *table;
     struct flb_hash *ht;
 
     ht = flb_hash_create(FLB_HASH_EVICT_NONE, 8, -1);
@@ -160,21 +171,17 @@ void test_chaining()
         inserts++;
     }
 
-    for (i = 0; i < ht->size; i++) {
-        table = &ht->table[i];
-        count = 0;
-        mk_list_foreach(head, &table->chains) {
-            count++;
-        }
-        TEST_CHECK(count == table->count);
+    TEST_CHECK(ht_slots_used(ht) == ht->total_count);
+    TEST_CHECK(mk_list_size(&ht->entries) == ht->total_count);
+    TEST_CHECK(ht->total_count == inserts);
 
-        if (count > 0) {
-            chains++;
-        }
+    /* Overrides replace the entries */
+    for (i = 100; i < 103; i++) {
+        m = &entries[i];
+        ht_add(ht, m->key, m->val);
     }
+    TEST_CHECK(ht_slots_used(ht) == ht->total_count);
 
-    /* Tests diff between total, new minus 3 overrides */
-    TEST_CHECK(chains == inserts - 3);
     flb_hash_destroy(ht);
 }
 
@@ -182,11 +189,9 @@ void test_delete_all()
 {
     int i;
     int ret;
-    int count;
     int not_found = 0;
     int total = 0;
     struct map *m;
-    struct flb_hash_table *table;
     struct flb_hash *ht;
 
     ht = flb_hash_create(FLB_HASH_EVICT_NONE, 8, -1);
@@ -206,13 +211,120 @@ void test_delete_all()
         }
     }
 
-    count = 0;
-    for (i = 0; i < ht->size; i++) {
-        table = &ht->table[i];
-        count += table->count;
+    /* the 3 overridden keys were deleted already */
+    TEST_CHECK(not_found == 3);
+    TEST_CHECK(ht->total_count == 0);
+    TEST_CHECK(ht->total_size == 0);
+    TEST_CHECK(ht_slots_used(ht) == 0);
+    TEST_CHECK(mk_list_is_empty(&ht->entries) == 0);
+    flb_hash_destroy(ht);
+}
+
+void test_delete_other_key()
+{
+    int ret;
+    char *out_buf;
+    size_t out_size;
+    struct flb_hash *ht;
+
+    ht = flb_hash_create(FLB_HASH_EVICT_NONE, 8, -1);
+    TEST_CHECK(ht != NULL);
+
+    ht_add(ht, "key1", "value1");
+
+    /* a missing key must not remove another entry */
+    ret = flb_hash_del(ht, "key2");
+    TEST_CHECK(ret == -1);
+    ret = flb_hash_get(ht, "key1", 4, &out_buf, &out_size);
+    TEST_CHECK(ret >= 0);
+
+    flb_hash_destroy(ht);
+}
+
+void test_resize()
+{
+    int i;
+    int id;
+    int ret;
+    int first_id;
+    size_t size;
+    char key[32];
+    char val[32];
+    char *out_buf;
+    size_t out_size;
+    struct flb_hash *ht;
+
+    ht = flb_hash_create(FLB_HASH_EVICT_NONE, 8, -1);
+    TEST_CHECK(ht != NULL);
+    size = ht->size;
+
+    first_id = ht_add(ht, "key_0", "val_0");
+    for (i = 1; i < 5000; i++) {
+        snprintf(key, sizeof(key) - 1, "key_%i", i);
+        snprintf(val, sizeof(val) - 1, "val_%i", i);
+        ht_add(ht, key, val);
+    }
+
+    TEST_CHECK(ht->size > size);
+    TEST_CHECK(ht->total_count == 5000);
+    TEST_CHECK(ht_slots_used(ht) == 5000);
+    TEST_CHECK(ht->total_count * 8 <= ht->size * 7);
+
+    for (i = 0; i < 5000; i++) {
+        snprintf(key, sizeof(key) - 1, "key_%i", i);
+        snprintf(val, sizeof(val) - 1, "val_%i", i);
+        ret = flb_hash_get(ht, key, strlen(key), &out_buf, &out_size);
+        TEST_CHECK(ret >= 0);
+        TEST_CHECK(strcmp(out_buf, val) == 0);
+    }
+
+    /* an id from before the growth still resolves by key */
+    ret = flb_hash_get_by_id(ht, first_id, "key_0", &out_buf, &out_size);
+    TEST_CHECK(ret == 0);
+    TEST_CHECK(strcmp(out_buf, "val_0") == 0);
+
+    id = flb_hash_get(ht, "key_1", 5, &out_buf, &out_size);
+    ret = flb_hash_get_by_id(ht, id, "key_0", &out_buf, &out_size);
+    TEST_CHECK(ret == 0);
+    TEST_CHECK(strcmp(out_buf, "val_0") == 0);
+
+    flb_hash_destroy(ht);
+}
+
+void test_deleted_slots()
+{
+    int i;
+    int ret;
+    size_t size;
+    char key[32];
+    char *out_buf;
+    size_t out_size;
+    struct flb_hash *ht;
+
+    ht = flb_hash_create(FLB_HASH_EVICT_NONE, 16, -1);
+    TEST_CHECK(ht != NULL);
+    size = ht->size;
+
+    /* many short lived keys: deleted slots are reused, no growth */
+    for (i = 0; i < 10000; i++) {
+        snprintf(key, sizeof(key) - 1, "key_%i", i);
+        ht_add(ht, key, "value");
+        if (i >= 4) {
+            snprintf(key, sizeof(key) - 1, "key_%i", i - 4);
+            ret = flb_hash_del(ht, key);
+            TEST_CHECK(ret == 0);
+        }
     }
 
-    TEST_CHECK(count == 0);
+    TEST_CHECK(ht->size == size);
+    TEST_CHECK(ht->total_count == 4);
+    TEST_CHECK(ht_slots_used(ht) == 4);
+
+    ret = flb_hash_get(ht, "key_9999", 8, &out_buf, &out_size);
+    TEST_CHECK(ret >= 0);
+    ret = flb_hash_get(ht, "key_9995", 8, &out_buf, &out_size);
+    TEST_CHECK(ret == -1);
+
     flb_hash_destroy(ht);
 }
 
@@ -241,13 +353,158 @@ void test_random_eviction()
     flb_hash_destroy(ht);
 }
 
+void test_lru_eviction()
+{
+    int ret;
+    char *out_buf;
+    size_t out_size;
+    struct flb_hash *ht;
+
+    ht = flb_hash_create(FLB_HASH_EVICT_LRU, 8, 2);
+    TEST_CHECK(ht != NULL);
+
+    ret = ht_add(ht, "key1", "value1");
+    TEST_CHECK(ret != -1);
+
+    ret = ht_add(ht, "key2", "value2");
+    TEST_CHECK(ret != -1);
+
+    /* key1 becomes the most recently used, key2 must go */
+    ret = flb_hash_get(ht, "key1", 4, &out_buf, &out_size);
+    TEST_CHECK(ret >= 0);
+
+    ret = ht_add(ht, "key3", "value3");
+    TEST_CHECK(ret != -1);
+
+    ret = flb_hash_get(ht, "key2", 4, &out_buf, &out_size);
+    TEST_CHECK(ret == -1);
+
+    ret = flb_hash_get(ht, "key1", 4, &out_buf, &out_size);
+    TEST_CHECK(ret >= 0);
+    TEST_CHECK(ht->total_count == 2);
+    TEST_CHECK(ht->evictions == 1);
+
+    flb_hash_destroy(ht);
+}
+
+void test_max_size()
+{
+    int i;
+    int ret;
+    char key[32];
+    char val[128];
+    size_t limit = 4096;
+    char *out_buf;
+    size_t out_size;
+    struct flb_hash *ht;
+
+    ht = flb_hash_create(FLB_HASH_EVICT_LRU, 16, -1);
+    TEST_CHECK(ht != NULL);
+    flb_hash_set_max_size(ht, limit);
+
+    memset(val, 'x', sizeof(val) - 1);
+    val[sizeof(val) - 1] = '\0';
+
+    for (i = 0; i < 100; i++) {
+        snprintf(key, sizeof(key) - 1, "key_%i", i);
+        ret = ht_add(ht, key, val);
+        TEST_CHECK(ret != -1);
+        TEST_CHECK(ht->total_size <= limit);
+    }
+
+    TEST_CHECK(ht->total_count < 100);
+    TEST_CHECK(ht->evictions == 100 - ht->total_count);
+
+    /* the last key added is always there */
+    ret = flb_hash_get(ht, "key_99", 6, &out_buf, &out_size);
+    TEST_CHECK(ret >= 0);
+    ret = flb_hash_get(ht, "key_0", 5, &out_buf, &out_size);
+    TEST_CHECK(ret == -1);
+
+    flb_hash_destroy(ht);
+}
+
+void test_ttl()
+{
+    int ret;
+    char *out_buf;
+    size_t out_size;
+    struct flb_hash *ht;
+    struct flb_hash_entry *entry;
+
+    ht = flb_hash_create(FLB_HASH_EVICT_LRU, 8, -1);
+    TEST_CHECK(ht != NULL);
+    flb_hash_set_ttl(ht, 60);
+
+    ret = ht_add(ht, "key1", "value1");
+    TEST_CHECK(ret != -1);
+
+    /* age the entry */
+    entry = mk_list_entry_first(&ht->entries, struct flb_hash_entry,
+                                _head_parent);
+    entry->created -= 120;
+
+    ret = flb_hash_get(ht, "key1", 4, &out_buf, &out_size);
+    TEST_CHECK(ret == -1);
+    TEST_CHECK(ht->expired == 1);
+
+    /* expired entries are still reachable as stale data */
+    ret = flb_hash_get_stale(ht, "key1", 4, &out_buf, &out_size);
+    TEST_CHECK(ret >= 0);
+    TEST_CHECK(strcmp(out_buf, "value1") == 0);
+
+    /* adding the key again refreshes it */
+    ret = ht_add(ht, "key1", "value2");
+    TEST_CHECK(ret != -1);
+    TEST_CHECK(ht->total_count == 1);
+
+    flb_hash_destroy(ht);
+}
+
+void test_ttl_eviction()
+{
+    int ret;
+    char *out_buf;
+    size_t out_size;
+    struct flb_hash *ht;
+    struct flb_hash_entry *entry;
+
+    ht = flb_hash_create(FLB_HASH_EVICT_RANDOM, 8, 2);
+    TEST_CHECK(ht != NULL);
+    flb_hash_set_ttl(ht, 60);
+
+    ht_add(ht, "key1", "value1");
+    ht_add(ht, "key2", "value2");
+
+    entry = mk_list_entry_first(&ht->entries, struct flb_hash_entry,
+                                _head_parent);
+    entry->created -= 120;
+
+    /* the expired entry goes before a random one */
+    ht_add(ht, "key3", "value3");
+    ret = flb_hash_get_stale(ht, "key1", 4, &out_buf, &out_size);
+    TEST_CHECK(ret == -1);
+    ret = flb_hash_get(ht, "key2", 4, &out_buf, &out_size);
+    TEST_CHECK(ret >= 0);
+    TEST_CHECK(ht->evictions == 1);
+
+    flb_hash_destroy(ht);
+}
+
 TEST_LIST = {
     { "zero_size", test_create_zero },
     { "single",    test_single },
     { "small_table", test_small_table },
     { "medium_table", test_medium_table },
-    { "chaining_count", test_chaining },
+    { "slots_count", test_slots_count },
     { "delete_all", test_delete_all },
+    { "delete_other_key", test_delete_other_key },
+    { "resize", test_resize },
+    { "deleted_slots", test_deleted_slots },
     { "random_eviction", test_random_eviction },
+    { "lru_eviction", test_lru_eviction },
+    { "max_size", test_max_size },
+    { "ttl", test_ttl },
+    { "ttl_eviction", test_ttl_eviction },
     { 0 }
 };
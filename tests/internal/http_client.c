@@ -80,7 +80,52 @@ void test_http_buffer_increase()
     flb_free(config);
 }
 
+void test_http_chunked_headers()
+{
+    struct flb_http_client *c;
+    struct flb_upstream *u;
+    struct flb_upstream_conn *u_conn;
+    struct flb_config *config;
+
+    config = flb_calloc(1, sizeof(struct flb_config));
+    TEST_CHECK(config != NULL);
+
+    u = flb_upstream_create(config, "127.0.0.1", 80, 0, NULL);
+    TEST_CHECK(u != NULL);
+
+    u_conn = flb_malloc(sizeof(struct flb_upstream_conn));
+    TEST_CHECK(u_conn != NULL);
+    u_conn->u = u;
+
+    /* Chunked body: no Content-Length */
+    c = flb_http_client(u_conn, FLB_HTTP_POST, "/", NULL, 0,
+                        "127.0.0.1", 80, NULL, FLB_HTTP_CHUNKED);
+    TEST_CHECK(c != NULL);
+    TEST_CHECK(c->flags & FLB_HTTP_CHUNKED);
+    c->header_buf[c->header_len] = '\0';
+    TEST_CHECK(strstr(c->header_buf, "Transfer-Encoding: chunked\r\n") != NULL);
+    TEST_CHECK(strstr(c->header_buf, "Content-Length") == NULL);
+    flb_http_client_destroy(c);
+
+    /* HTTP/1.0 have no chunked encoding, the body is sized */
+    c = flb_http_client(u_conn, FLB_HTTP_POST, "/", "abc", 3,
+                        "127.0.0.1", 80, NULL,
+                        FLB_HTTP_10 | FLB_HTTP_CHUNKED);
+    TEST_CHECK(c != NULL);
+    TEST_CHECK(!(c->flags & FLB_HTTP_CHUNKED));
+    c->header_buf[c->header_len] = '\0';
+    TEST_CHECK(strstr(c->header_buf, "Content-Length: 3\r\n") != NULL);
+    TEST_CHECK(strstr(c->header_buf, "Transfer-Encoding") == NULL);
+    TEST_CHECK(flb_http_body_write(c, "abc", 3) == -1);
+    flb_http_client_destroy(c);
+
+    flb_free(u_conn);
+    flb_upstream_destroy(u);
+    flb_free(config);
+}
+
 TEST_LIST = {
     { "http_buffer_increase", test_http_buffer_increase},
+    { "http_chunked_headers", test_http_chunked_headers},
     { 0 }
 };
@@ -0,0 +1,211 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_config.h>
+#include <fluent-bit/flb_input.h>
+#include <fluent-bit/flb_engine.h>
+#include <fluent-bit/flb_scheduler.h>
+#include <fluent-bit/flb_time.h>
+
+#include <unistd.h>
+
+#include "flb_tests_internal.h"
+
+static struct flb_input_instance *rate_input(struct flb_config *config,
+                                             char *records, char *bytes,
+                                             char *burst)
+{
+    struct flb_input_instance *in;
+
+    config->evl = mk_event_loop_create(64);
+    TEST_CHECK(flb_sched_init(config) == 0);
+    config->is_running = FLB_TRUE;
+
+    in = flb_input_new(config, "dummy", NULL);
+    TEST_CHECK(in != NULL);
+    flb_input_set_property(in, "tag", "test");
+    if (records) {
+        flb_input_set_property(in, "rate_limit.records", records);
+    }
+    if (bytes) {
+        flb_input_set_property(in, "rate_limit.bytes", bytes);
+    }
+    flb_input_set_property(in, "rate_limit.burst", burst);
+    TEST_CHECK(flb_input_instance_init(in, config) == 0);
+    flb_input_collectors_start(config);
+
+    return in;
+}
+
+static struct flb_input_collector *collector(struct flb_input_instance *in)
+{
+    return mk_list_entry_first(&in->collectors, struct flb_input_collector,
+                               _head_ins);
+}
+
+/* Append 'n' records with a 'size' bytes value, like an input plugin */
+static void records_append(struct flb_input_instance *in, int n, int size)
+{
+    int i;
+    char *val;
+
+    val = flb_malloc(size);
+    TEST_CHECK(val != NULL);
+    memset(val, 'x', size);
+
+    flb_input_buf_write_start(in);
+    for (i = 0; i < n; i++) {
+        msgpack_pack_array(&in->mp_pck, 2);
+        msgpack_pack_uint64(&in->mp_pck, 1);
+        msgpack_pack_map(&in->mp_pck, 1);
+        msgpack_pack_str(&in->mp_pck, 3);
+        msgpack_pack_str_body(&in->mp_pck, "key", 3);
+        msgpack_pack_str(&in->mp_pck, size);
+        msgpack_pack_str_body(&in->mp_pck, val, size);
+    }
+    flb_input_buf_write_end(in);
+
+    flb_free(val);
+}
+
+/* Run the scheduler while the instance is paused by its rate limit */
+static void rate_run(struct flb_config *config,
+                     struct flb_input_instance *in, int max_ms)
+{
+    struct flb_time t0;
+    struct flb_time t1;
+    struct flb_time diff;
+    struct mk_event *event;
+
+    flb_time_get(&t0);
+    while (in->rate_paused == FLB_TRUE) {
+        mk_event_wait(config->evl);
+        mk_event_foreach(event, config->evl) {
+            if (event->type & FLB_ENGINE_EV_SCHED) {
+                flb_sched_event_handler(config, event);
+            }
+        }
+        flb_sched_timer_cleanup(config->sched);
+
+        flb_time_get(&t1);
+        flb_time_diff(&t1, &t0, &diff);
+        if (flb_time_to_double(&diff) * 1000 > max_ms) {
+            break;
+        }
+    }
+}
+
+static void rate_exit(struct flb_config *config)
+{
+    flb_input_exit_all(config);
+    flb_config_exit(config);
+}
+
+/* The bucket starts full: a burst up to its capacity goes through */
+static void test_rate_burst()
+{
+    struct flb_config *config;
+    struct flb_input_instance *in;
+    struct flb_input_collector *coll;
+
+    config = flb_config_init();
+    in = rate_input(config, "10", NULL, "2");
+    coll = collector(in);
+    TEST_CHECK(coll->running == FLB_TRUE);
+
+    records_append(in, 20, 8);
+    TEST_CHECK(in->rate_paused == FLB_FALSE);
+    TEST_CHECK(in->rate.tk_records == 0);
+    TEST_CHECK(flb_input_buf_paused(in) == FLB_FALSE);
+
+    /* One more record is a debt: the instance and its collector stop */
+    records_append(in, 1, 8);
+    TEST_CHECK(in->rate_paused == FLB_TRUE);
+    TEST_CHECK(flb_input_buf_paused(in) == FLB_TRUE);
+    TEST_CHECK(coll->running == FLB_FALSE);
+    TEST_CHECK(coll->rate_held == FLB_TRUE);
+
+    /* The pending refill goes with the instance */
+    rate_exit(config);
+}
+
+/* The refill pays the debt back at the rate and resumes the instance */
+static void test_rate_refill()
+{
+    double sec;
+    struct flb_time t0;
+    struct flb_time t1;
+    struct flb_time diff;
+    struct flb_config *config;
+    struct flb_input_instance *in;
+    struct flb_input_collector *coll;
+
+    config = flb_config_init();
+    in = rate_input(config, "10", NULL, "1");
+    coll = collector(in);
+
+    /* 15 records: half a second of debt */
+    flb_time_get(&t0);
+    records_append(in, 15, 8);
+    TEST_CHECK(in->rate_paused == FLB_TRUE);
+
+    rate_run(config, in, 2000);
+    flb_time_get(&t1);
+    flb_time_diff(&t1, &t0, &diff);
+    sec = flb_time_to_double(&diff);
+
+    TEST_CHECK(in->rate_paused == FLB_FALSE);
+    TEST_CHECK(sec >= 0.45 && sec < 1.5);
+    TEST_MSG("resumed after %.3f seconds", sec);
+    TEST_CHECK(in->mp_buf_status == FLB_INPUT_RUNNING);
+    TEST_CHECK(coll->running == FLB_TRUE);
+    TEST_CHECK(coll->rate_held == FLB_FALSE);
+    TEST_CHECK(in->rate.tk_records >= 0);
+
+    /* Tokens keep coming at 10 per second */
+    usleep(300000);
+    records_append(in, 1, 8);
+    TEST_CHECK(in->rate_paused == FLB_FALSE);
+    TEST_CHECK(in->rate.tk_records >= 1.9 && in->rate.tk_records < 10);
+    TEST_MSG("tokens=%.2f", in->rate.tk_records);
+
+    /* Never over the capacity */
+    usleep(1200000);
+    flb_input_rate_consume(in, NULL, 0, 0);
+    TEST_CHECK(in->rate.tk_records == 10);
+
+    rate_exit(config);
+}
+
+/* With both buckets the longest debt sets the pause */
+static void test_rate_bytes()
+{
+    struct flb_config *config;
+    struct flb_input_instance *in;
+
+    config = flb_config_init();
+    in = rate_input(config, "1000", "1000", "1");
+
+    /* Few records, two seconds worth of bytes */
+    records_append(in, 2, 1500);
+    TEST_CHECK(in->rate_paused == FLB_TRUE);
+    TEST_CHECK(in->rate.tk_records > 0);
+    TEST_CHECK(in->rate.tk_bytes < -1000);
+
+    /* Still paused after the first second */
+    rate_run(config, in, 1200);
+    TEST_CHECK(in->rate_paused == FLB_TRUE);
+
+    rate_run(config, in, 2000);
+    TEST_CHECK(in->rate_paused == FLB_FALSE);
+    TEST_CHECK(in->rate.tk_bytes >= 0);
+
+    rate_exit(config);
+}
+
+TEST_LIST = {
+    { "rate_burst",  test_rate_burst  },
+    { "rate_refill", test_rate_refill },
+    { "rate_bytes",  test_rate_bytes  },
+    { 0 }
+};
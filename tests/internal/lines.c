@@ -0,0 +1,76 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_lines.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "flb_tests_internal.h"
+
+static void test_lines_usage()
+{
+    int n;
+    size_t offsets[8];
+    char *buf = "a\nbb\n\nccc";
+
+    n = flb_lines_scan(buf, strlen(buf), offsets, 8);
+    TEST_CHECK(n == 3);
+    TEST_CHECK(offsets[0] == 1);
+    TEST_CHECK(offsets[1] == 4);
+    TEST_CHECK(offsets[2] == 5);
+
+    /* Limit of entries */
+    n = flb_lines_scan(buf, strlen(buf), offsets, 2);
+    TEST_CHECK(n == 2);
+    TEST_CHECK(offsets[1] == 4);
+
+    n = flb_lines_scan("no newline", 10, offsets, 8);
+    TEST_CHECK(n == 0);
+    n = flb_lines_scan(buf, 0, offsets, 8);
+    TEST_CHECK(n == 0);
+}
+
+/* Compare against the byte by byte version with every alignment */
+static void test_lines_match()
+{
+    int i;
+    int n;
+    int n_sw;
+    int off;
+    size_t *offsets;
+    size_t *offsets_sw;
+    size_t size = 4096;
+    char *buf;
+
+    buf = malloc(size + 64);
+    offsets = malloc(sizeof(size_t) * size);
+    offsets_sw = malloc(sizeof(size_t) * size);
+
+    srand(1);
+    for (i = 0; i < size + 64; i++) {
+        buf[i] = (rand() % 8 == 0) ? '\n' : 'a' + (rand() % 26);
+    }
+
+    for (off = 0; off < 64; off++) {
+        n = flb_lines_scan(buf + off, size - off, offsets, size);
+        n_sw = flb_lines_scan_sw(buf + off, size - off, offsets_sw, size);
+        TEST_CHECK(n == n_sw);
+        TEST_CHECK(memcmp(offsets, offsets_sw, sizeof(size_t) * n) == 0);
+
+        /* Stop in the middle of a block */
+        n = flb_lines_scan(buf + off, size - off, offsets, 7);
+        TEST_CHECK(n == 7);
+        TEST_CHECK(memcmp(offsets, offsets_sw, sizeof(size_t) * n) == 0);
+    }
+
+    free(buf);
+    free(offsets);
+    free(offsets_sw);
+}
+
+TEST_LIST = {
+    { "usage", test_lines_usage},
+    { "match", test_lines_match},
+    { 0 }
+};
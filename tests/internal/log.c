@@ -0,0 +1,137 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_log.h>
+#include <fluent-bit/flb_config.h>
+#include <fluent-bit/flb_worker.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "flb_tests_internal.h"
+
+#define LOG_FILE  "/tmp/flb-test-log.txt"
+
+static struct flb_config *log_start(int rate_limit)
+{
+    struct flb_config *config;
+
+    unlink(LOG_FILE);
+    config = flb_config_init();
+    config->log_rate_limit = rate_limit;
+    config->log = flb_log_init(config, FLB_LOG_FILE, FLB_LOG_INFO, LOG_FILE);
+    TEST_CHECK(config->log != NULL);
+    return config;
+}
+
+/* Stop the collector and count the lines containing 'str' */
+static int log_stop(struct flb_config *config, char *str, int *dropped)
+{
+    int n = 0;
+    char line[1024];
+    char *p;
+    FILE *f;
+
+    flb_log_stop(config->log, config);
+    config->log = NULL;
+    flb_config_exit(config);
+
+    *dropped = 0;
+    f = fopen(LOG_FILE, "r");
+    if (!f) {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        if (strstr(line, str)) {
+            n++;
+        }
+        p = strstr(line, "[log] ");
+        if (p) {
+            *dropped += atoi(p + 6);
+        }
+    }
+    fclose(f);
+    unlink(LOG_FILE);
+
+    return n;
+}
+
+/* A single call site */
+static void log_msg(char *str)
+{
+    flb_error("%s", str);
+}
+
+static void test_dedup()
+{
+    int i;
+    int n;
+    int dropped;
+    struct flb_config *config;
+
+    config = log_start(20);
+    for (i = 0; i < 50; i++) {
+        log_msg("same message");
+    }
+    log_msg("other message");
+
+    n = log_stop(config, "same message", &dropped);
+    TEST_CHECK(n == 1);
+    TEST_CHECK(dropped == 0);
+
+    config = log_start(20);
+    for (i = 0; i < 50; i++) {
+        log_msg("same message");
+    }
+    log_msg("other message");
+    n = log_stop(config, "last message repeated 49 times", &dropped);
+    TEST_CHECK(n == 1);
+}
+
+static void test_rate_limit()
+{
+    int i;
+    int n;
+    int dropped;
+    char buf[32];
+    struct flb_config *config;
+
+    config = log_start(5);
+    for (i = 0; i < 100; i++) {
+        snprintf(buf, sizeof(buf), "message %i", i);
+        log_msg(buf);
+    }
+    n = log_stop(config, "message ", &dropped);
+
+    /* The loop may run over two windows of one second */
+    TEST_CHECK(n >= 5 && n <= 10);
+}
+
+static void test_ring_full()
+{
+    int i;
+    int n;
+    int dropped;
+    char buf[32];
+    struct flb_config *config;
+
+    /* No limit: every message is either written or counted as dropped */
+    config = log_start(0);
+    for (i = 0; i < 5000; i++) {
+        snprintf(buf, sizeof(buf), "message %i", i);
+        log_msg(buf);
+    }
+    n = log_stop(config, "message ", &dropped);
+    TEST_CHECK(n + dropped == 5000);
+    TEST_MSG("written=%i dropped=%i", n, dropped);
+}
+
+TEST_LIST = {
+    { "dedup"     , test_dedup},
+    { "rate_limit", test_rate_limit},
+    { "ring_full" , test_ring_full},
+    { 0 }
+};
@@ -0,0 +1,183 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_pack.h>
+#include <fluent-bit/flb_luajit.h>
+#include <fluent-bit/flb_luajit_ffi.h>
+
+#include <msgpack.h>
+#include <string.h>
+
+#include "flb_tests_internal.h"
+
+/* Push the JSON as a Lua value, run 'code' on it as 'v' and pack it back */
+static char *lua_roundtrip(char *json, char *code)
+{
+    int ret;
+    char *buf;
+    char *out = NULL;
+    size_t size;
+    size_t out_size;
+    size_t off = 0;
+    lua_State *l;
+    msgpack_unpacked result;
+    msgpack_sbuffer sbuf;
+    msgpack_packer pck;
+
+    ret = flb_pack_json(json, strlen(json), &buf, &size);
+    if (!TEST_CHECK(ret == 0)) {
+        return NULL;
+    }
+
+    l = luaL_newstate();
+    luaL_openlibs(l);
+
+    msgpack_unpacked_init(&result);
+    msgpack_unpack_next(&result, buf, size, &off);
+    flb_luajit_pushmsgpack(l, &result.data);
+    lua_setglobal(l, "v");
+    msgpack_unpacked_destroy(&result);
+    flb_free(buf);
+
+    if (code) {
+        ret = luaL_dostring(l, code);
+        TEST_CHECK(ret == 0);
+    }
+
+    msgpack_sbuffer_init(&sbuf);
+    msgpack_packer_init(&pck, &sbuf, msgpack_sbuffer_write);
+    lua_getglobal(l, "v");
+    flb_luajit_tomsgpack(l, &pck, -1);
+    TEST_CHECK(lua_gettop(l) == 1);
+    lua_close(l);
+
+    ret = flb_msgpack_raw_to_json_str(sbuf.data, sbuf.size, &out, &out_size);
+    TEST_CHECK(ret == 0);
+    msgpack_sbuffer_destroy(&sbuf);
+
+    return out;
+}
+
+static void check_roundtrip(char *json, char *code, char *expected)
+{
+    char *out;
+
+    out = lua_roundtrip(json, code);
+    if (!TEST_CHECK(out != NULL)) {
+        return;
+    }
+    if (!TEST_CHECK(strcmp(out, expected) == 0)) {
+        TEST_MSG("expected: %s", expected);
+        TEST_MSG("got     : %s", out);
+    }
+    flb_free(out);
+}
+
+static void test_luajit_msgpack()
+{
+    check_roundtrip("{\"a\": [1, -2, \"x\", true, null]}", NULL,
+                    "{\"a\":[1, -2, \"x\", true]}");
+    check_roundtrip("{\"k\": {\"n\": 2.5}}", NULL, "{\"k\":{\"n\":2.500000}}");
+    check_roundtrip("[1, [2, [3]]]", NULL, "[1, [2, [3]]]");
+    check_roundtrip("{\"k\": \"v\"}", "v.k = nil", "{}");
+    check_roundtrip("{\"k\": 1}", "v.k = v.k + 0.25", "{\"k\":1.250000}");
+    check_roundtrip("{\"k\": 1}", "v.k = 2^40", "{\"k\":1099511627776}");
+    check_roundtrip("{\"k\": 1}", "v.k = {[2] = 1}", "{\"k\":{2:1}}");
+}
+
+/* Tables referencing themselves stop at the depth limit */
+static void test_luajit_cycle()
+{
+    char *out;
+
+    out = lua_roundtrip("{}", "v.self = v");
+    TEST_CHECK(out != NULL);
+    TEST_CHECK(strstr(out, "null") != NULL);
+    flb_free(out);
+}
+
+/* Read and modify a record through the FFI view */
+static void test_luajit_ffi()
+{
+    int ret;
+    int ref;
+    char *buf;
+    char *out;
+    size_t size;
+    size_t out_size;
+    char *json = "{\"a\": \"x\", \"n\": -3, \"f\": 1.5, \"t\": true, "
+                 "\"m\": {\"k\": [1, 2]}}";
+    lua_State *l;
+    msgpack_sbuffer sbuf;
+    struct flb_luajit_rec *rec;
+
+    ret = flb_pack_json(json, strlen(json), &buf, &size);
+    TEST_CHECK(ret == 0);
+
+    l = luaL_newstate();
+    luaL_openlibs(l);
+    ret = flb_luajit_ffi_init(l);
+    TEST_CHECK(ret == 0);
+
+    rec = flb_luajit_rec_create();
+    ref = flb_luajit_ffi_bind(l, rec);
+
+    /* Not modified: the map is copied as it is */
+    flb_luajit_rec_reset(rec, buf, size);
+    lua_rawgeti(l, LUA_REGISTRYINDEX, ref);
+    lua_setglobal(l, "r");
+    ret = luaL_dostring(l,
+        "assert(r:get('a') == 'x')\n"
+        "assert(r:get('n') == -3)\n"
+        "assert(r:get('f') == 1.5)\n"
+        "assert(r:get('t') == true)\n"
+        "assert(r:get('m').k[2] == 2)\n"
+        "assert(r:get('none') == nil)\n"
+        "assert(r:size() == 5)\n"
+        "local k, v = r:entry(2)\n"
+        "assert(k == 'n' and v == -3)\n");
+    if (!TEST_CHECK(ret == 0)) {
+        TEST_MSG("%s", lua_tostring(l, -1));
+    }
+
+    msgpack_sbuffer_init(&sbuf);
+    flb_luajit_rec_pack(rec, &sbuf);
+    TEST_CHECK(sbuf.size == size && memcmp(sbuf.data, buf, size) == 0);
+    msgpack_sbuffer_destroy(&sbuf);
+
+    /* Modified */
+    flb_luajit_rec_reset(rec, buf, size);
+    ret = luaL_dostring(l,
+        "r:set('a', 'y')\n"
+        "r:remove('m')\n"
+        "r:remove('f')\n"
+        "r:remove('t')\n"
+        "r:set('b', 2)\n"
+        "assert(r:get('a') == 'y')\n"
+        "assert(r:size() == 3)\n");
+    if (!TEST_CHECK(ret == 0)) {
+        TEST_MSG("%s", lua_tostring(l, -1));
+    }
+
+    msgpack_sbuffer_init(&sbuf);
+    flb_luajit_rec_pack(rec, &sbuf);
+    ret = flb_msgpack_raw_to_json_str(sbuf.data, sbuf.size, &out, &out_size);
+    TEST_CHECK(ret == 0);
+    if (!TEST_CHECK(strcmp(out, "{\"n\":-3, \"a\":\"y\", \"b\":2}") == 0)) {
+        TEST_MSG("got: %s", out);
+    }
+    flb_free(out);
+    msgpack_sbuffer_destroy(&sbuf);
+
+    flb_luajit_rec_destroy(rec);
+    lua_close(l);
+    flb_free(buf);
+}
+
+TEST_LIST = {
+    {"msgpack", test_luajit_msgpack},
+    {"cycle",   test_luajit_cycle},
+    {"ffi",     test_luajit_ffi},
+    { 0 }
+};
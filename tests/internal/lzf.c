@@ -0,0 +1,116 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_lzf.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "flb_tests_internal.h"
+
+/* Compress and decompress a buffer, the result must match the original */
+static size_t roundtrip(char *data, size_t size)
+{
+    size_t c_size;
+    size_t d_size;
+    size_t bound;
+    char *c_buf;
+    char *d_buf;
+
+    bound = FLB_LZF_BOUND(size);
+    c_buf = flb_malloc(bound);
+    d_buf = flb_malloc(size + 1);
+    TEST_CHECK(c_buf != NULL && d_buf != NULL);
+
+    c_size = flb_lzf_compress(data, size, c_buf, bound);
+    TEST_CHECK(c_size > 0);
+
+    d_size = flb_lzf_decompress(c_buf, c_size, d_buf, size);
+    TEST_CHECK(d_size == size);
+    TEST_CHECK(memcmp(data, d_buf, size) == 0);
+
+    flb_free(c_buf);
+    flb_free(d_buf);
+
+    return c_size;
+}
+
+static void test_lzf_records()
+{
+    int i;
+    int len;
+    size_t size = 0;
+    size_t c_size;
+    char *buf;
+
+    /* Repetitive JSON like content compress well */
+    buf = flb_malloc(1024 * 1024);
+    for (i = 0; i < 10000; i++) {
+        len = snprintf(buf + size, 1024 * 1024 - size,
+                       "{\"id\": %i, \"level\": \"info\", "
+                       "\"message\": \"request served in %i ms\"}",
+                       i, i % 97);
+        size += len;
+    }
+
+    c_size = roundtrip(buf, size);
+    TEST_CHECK(c_size < size / 3);
+
+    flb_free(buf);
+}
+
+static void test_lzf_random()
+{
+    int i;
+    size_t size = 65536;
+    size_t c_size;
+    char *buf;
+    char *out;
+
+    buf = flb_malloc(size);
+    for (i = 0; i < size; i++) {
+        buf[i] = rand();
+    }
+    roundtrip(buf, size);
+
+    /* Not compressible data does not fit in a smaller output */
+    out = flb_malloc(size);
+    c_size = flb_lzf_compress(buf, size, out, size / 2);
+    TEST_CHECK(c_size == 0);
+
+    flb_free(out);
+    flb_free(buf);
+}
+
+static void test_lzf_small()
+{
+    roundtrip("a", 1);
+    roundtrip("ab", 2);
+    roundtrip("abc", 3);
+    roundtrip("aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa", 47);
+}
+
+static void test_lzf_corrupted()
+{
+    size_t ret;
+    char out[64];
+    unsigned char bad_ref[] = {0x00, 'a', 0x20, 0x10};
+    unsigned char bad_lit[] = {0x1f, 'a', 'b'};
+
+    /* Reference before the start of the output */
+    ret = flb_lzf_decompress(bad_ref, sizeof(bad_ref), out, sizeof(out));
+    TEST_CHECK(ret == 0);
+
+    /* Literal run longer than the input */
+    ret = flb_lzf_decompress(bad_lit, sizeof(bad_lit), out, sizeof(out));
+    TEST_CHECK(ret == 0);
+}
+
+TEST_LIST = {
+    { "records"  , test_lzf_records},
+    { "random"   , test_lzf_random},
+    { "small"    , test_lzf_small},
+    { "corrupted", test_lzf_corrupted},
+    { 0 }
+};
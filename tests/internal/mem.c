@@ -0,0 +1,65 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+
+#include "flb_tests_internal.h"
+
+static void test_scope()
+{
+    char *a;
+    char *b;
+    struct flb_mem_usage before;
+    struct flb_mem_usage u;
+
+    flb_mem_acct_get(FLB_MEM_FILTER, &before);
+
+    /* Charged to the subsystem active at allocation time */
+    flb_mem_scope_set(FLB_MEM_FILTER);
+    a = flb_malloc(1000);
+    flb_mem_scope_set(FLB_MEM_CORE);
+    flb_mem_acct_get(FLB_MEM_FILTER, &u);
+    TEST_CHECK(u.live == before.live + 1000);
+    TEST_CHECK(u.allocs == before.allocs + 1);
+
+    /* A resized block keeps its owner */
+    b = flb_realloc(a, 5000);
+    flb_mem_acct_get(FLB_MEM_FILTER, &u);
+    TEST_CHECK(u.live == before.live + 5000);
+    TEST_CHECK(u.peak >= before.live + 5000);
+
+    flb_free(b);
+    flb_mem_acct_get(FLB_MEM_FILTER, &u);
+    TEST_CHECK(u.live == before.live);
+    TEST_CHECK(u.peak >= before.live + 5000);
+}
+
+static void test_foreign()
+{
+    char *buf;
+    struct flb_mem_usage before;
+    struct flb_mem_usage u;
+
+    flb_mem_acct_get(FLB_MEM_CORE, &before);
+
+    /* Buffers from libraries can be released with flb_free() */
+    buf = malloc(100);
+    flb_free(buf);
+    flb_mem_acct_get(FLB_MEM_CORE, &u);
+    TEST_CHECK(u.live == before.live);
+    TEST_CHECK(u.frees == before.frees);
+
+    /* The release of an accounted block by a plain free() is forgiven */
+    buf = flb_calloc(1, 64);
+    free(buf);
+    buf = flb_malloc(32);
+    flb_mem_acct_get(FLB_MEM_CORE, &u);
+    TEST_CHECK(u.live == before.live + 32 || u.live == before.live + 96);
+    flb_free(buf);
+}
+
+TEST_LIST = {
+    { "scope"   , test_scope},
+    { "foreign" , test_foreign},
+    { 0 }
+};
@@ -0,0 +1,141 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_mem_pool.h>
+
+#include <msgpack.h>
+#include <string.h>
+#include "flb_tests_internal.h"
+
+#define MB (1024 * 1024)
+
+/* Blocks are split and merged back, the pool ends as it started */
+static void test_alloc_free()
+{
+    int i;
+    int ret;
+    char *p[64];
+    char *big[3];
+    struct flb_mem_pool_usage u;
+
+    ret = flb_mem_pool_create(9 * MB, FLB_MEM_POOL_HUGE_OFF);
+    TEST_CHECK(ret == 0);
+
+    flb_mem_pool_usage(&u);
+    TEST_CHECK(u.size == 8 * MB);
+    TEST_CHECK(u.used == 0);
+
+    for (i = 0; i < 64; i++) {
+        p[i] = flb_mem_pool_alloc(1000 + i * 1000);
+        TEST_CHECK(flb_mem_pool_owns(p[i]));
+        memset(p[i], i, 1000 + i * 1000);
+    }
+    TEST_CHECK(flb_mem_pool_block_size(p[0]) == 4096);
+    TEST_CHECK(flb_mem_pool_block_size(p[63]) == 65536);
+
+    for (i = 0; i < 64; i++) {
+        TEST_CHECK(p[i][999] == (char) i);
+        flb_free(p[i]);
+    }
+    flb_mem_pool_usage(&u);
+    TEST_CHECK(u.used == 0);
+    TEST_CHECK(u.peak > 0);
+
+    /* Merged back: two full blocks, then the pool is exhausted */
+    big[0] = flb_mem_pool_alloc(4 * MB);
+    big[1] = flb_mem_pool_alloc(4 * MB);
+    big[2] = flb_mem_pool_alloc(4 * MB);
+    TEST_CHECK(flb_mem_pool_owns(big[0]) && flb_mem_pool_owns(big[1]));
+    TEST_CHECK(big[2] != NULL && !flb_mem_pool_owns(big[2]));
+
+    flb_mem_pool_usage(&u);
+    TEST_CHECK(u.used == 8 * MB);
+    TEST_CHECK(u.fallbacks == 1);
+
+    for (i = 0; i < 3; i++) {
+        flb_free(big[i]);
+    }
+    flb_mem_pool_destroy();
+    TEST_CHECK(!flb_mem_pool_owns(big[0]));
+}
+
+/* flb_realloc() keeps the data when the block moves */
+static void test_realloc()
+{
+    char *p;
+    char *tmp;
+
+    TEST_CHECK(flb_mem_pool_create(4 * MB, FLB_MEM_POOL_HUGE_OFF) == 0);
+
+    p = flb_mem_pool_alloc(100);
+    strcpy(p, "pooled");
+    tmp = flb_realloc(p, 200);
+    TEST_CHECK(tmp == p);
+
+    tmp = flb_realloc(p, 10000);
+    TEST_CHECK(tmp != p && flb_mem_pool_owns(tmp));
+    TEST_CHECK(strcmp(tmp, "pooled") == 0);
+
+    /* Bigger than a block, out of the pool */
+    p = flb_realloc(tmp, 8 * MB);
+    TEST_CHECK(p != NULL && !flb_mem_pool_owns(p));
+    TEST_CHECK(strcmp(p, "pooled") == 0);
+    flb_free(p);
+
+    flb_mem_pool_destroy();
+}
+
+/* The chunk sbuffers grow inside the pool */
+static void test_sbuffer()
+{
+    int i;
+    char rec[100];
+    msgpack_sbuffer sbuf;
+    struct flb_mem_pool_usage u;
+
+    TEST_CHECK(flb_mem_pool_create(4 * MB, FLB_MEM_POOL_HUGE_OFF) == 0);
+
+    memset(rec, 'x', sizeof(rec));
+    msgpack_sbuffer_init(&sbuf);
+    for (i = 0; i < 1000; i++) {
+        flb_mem_pool_sbuffer_write(&sbuf, rec, sizeof(rec));
+    }
+    TEST_CHECK(sbuf.size == 100000);
+    TEST_CHECK(flb_mem_pool_owns(sbuf.data));
+    TEST_CHECK(sbuf.data[99999] == 'x');
+
+    flb_free(sbuf.data);
+    flb_mem_pool_usage(&u);
+    TEST_CHECK(u.used == 0);
+
+    flb_mem_pool_destroy();
+}
+
+/* Without a pool the requests go to flb_malloc() */
+static void test_no_pool()
+{
+    char *p;
+
+    TEST_CHECK(flb_mem_pool_create(1 * MB, FLB_MEM_POOL_HUGE_OFF) == -1);
+
+    p = flb_mem_pool_alloc(100);
+    TEST_CHECK(p != NULL && !flb_mem_pool_owns(p));
+    TEST_CHECK(flb_mem_pool_block_size(p) == 0);
+    flb_free(p);
+
+    TEST_CHECK(flb_mem_pool_hugepages("off") == FLB_MEM_POOL_HUGE_OFF);
+    TEST_CHECK(flb_mem_pool_hugepages("Transparent") ==
+               FLB_MEM_POOL_HUGE_TRANSPARENT);
+    TEST_CHECK(flb_mem_pool_hugepages("explicit") ==
+               FLB_MEM_POOL_HUGE_EXPLICIT);
+    TEST_CHECK(flb_mem_pool_hugepages("always") == -1);
+}
+
+TEST_LIST = {
+    { "alloc_free", test_alloc_free },
+    { "realloc",    test_realloc    },
+    { "sbuffer",    test_sbuffer    },
+    { "no_pool",    test_no_pool    },
+    { 0 }
+};
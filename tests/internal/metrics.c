@@ -4,6 +4,8 @@
 #include <fluent-bit/flb_mem.h>
 #include <fluent-bit/flb_error.h>
 #include <fluent-bit/flb_metrics.h>
+#include <msgpack.h>
+#include <pthread.h>
 
 #include "flb_tests_internal.h"
 
@@ -71,13 +73,220 @@ static void test_create_usage()
 
     m = flb_metrics_get_id(id_3, ctx);
     TEST_CHECK(m != NULL);
-    TEST_CHECK(m->val == 1);
+    TEST_CHECK(flb_metric_value(m) == 1);
 
     ret = flb_metrics_destroy(ctx);
     TEST_CHECK(ret == 3);
 }
 
+static void test_children()
+{
+    int ret;
+    char *buf;
+    size_t size;
+    size_t off = 0;
+    msgpack_unpacked result;
+    msgpack_object root;
+    msgpack_object files;
+    msgpack_object val;
+    struct flb_metrics *ctx;
+    struct flb_metrics *child_1;
+    struct flb_metrics *child_2;
+
+    ctx = flb_metrics_create("tail.0");
+    flb_metrics_add(0, "records", ctx);
+
+    child_1 = flb_metrics_create_child("file", "/var/log/a.log", ctx);
+    TEST_CHECK(child_1 != NULL);
+    flb_metrics_add(0, "lag_bytes", child_1);
+    child_2 = flb_metrics_create_child("file", "/var/log/b.log", ctx);
+    TEST_CHECK(child_2 != NULL);
+    flb_metrics_add(0, "lag_bytes", child_2);
+    TEST_CHECK(ctx->children_count == 2);
+
+    /* Gauges replace the value */
+    ret = flb_metrics_set(0, 10, child_1);
+    TEST_CHECK(ret == 0);
+    ret = flb_metrics_set(0, 7, child_1);
+    TEST_CHECK(ret == 0);
+    TEST_CHECK(flb_metrics_get_id(0, child_1)->val == 7);
+
+    /* Removing a child unlinks it from the parent */
+    ret = flb_metrics_destroy(child_2);
+    TEST_CHECK(ret == 1);
+    TEST_CHECK(ctx->children_count == 1);
+
+    /* {"records": 0, "file": {"/var/log/a.log": {"lag_bytes": 7}}} */
+    flb_metrics_dump_values(&buf, &size, ctx);
+    msgpack_unpacked_init(&result);
+    ret = msgpack_unpack_next(&result, buf, size, &off);
+    TEST_CHECK(ret == MSGPACK_UNPACK_SUCCESS);
+    root = result.data;
+    TEST_CHECK(root.type == MSGPACK_OBJECT_MAP);
+    TEST_CHECK(root.via.map.size == 2);
+
+    files = root.via.map.ptr[1].val;
+    TEST_CHECK(root.via.map.ptr[1].key.via.str.size == 4);
+    TEST_CHECK(files.type == MSGPACK_OBJECT_MAP);
+    TEST_CHECK(files.via.map.size == 1);
+    TEST_CHECK(memcmp(files.via.map.ptr[0].key.via.str.ptr,
+                      "/var/log/a.log", 14) == 0);
+    val = files.via.map.ptr[0].val;
+    TEST_CHECK(val.type == MSGPACK_OBJECT_MAP);
+    TEST_CHECK(val.via.map.ptr[0].val.via.u64 == 7);
+    msgpack_unpacked_destroy(&result);
+    flb_free(buf);
+
+    /* The parent releases the remaining children */
+    ret = flb_metrics_destroy(ctx);
+    TEST_CHECK(ret == 1);
+}
+
+static void test_prometheus()
+{
+    flb_sds_t sds;
+    struct flb_metrics *ctx;
+    struct flb_metrics *child;
+    char *expected =
+        "fluentbit_input_records_total{name=\"tail.0\"} 5 1000\n"
+        "fluentbit_input_lag_bytes{name=\"tail.0\",file=\"/a \\\"b\\\"\"} 7 1000\n";
+
+    ctx = flb_metrics_create("tail.0");
+    flb_metrics_add(0, "records", ctx);
+    flb_metrics_sum(0, 5, ctx);
+
+    /* Label values are escaped */
+    child = flb_metrics_create_child("file", "/a \"b\"", ctx);
+    flb_metrics_add(0, "lag_bytes", child);
+    flb_metrics_set(0, 7, child);
+
+    sds = flb_sds_create_size(64);
+    sds = flb_metrics_prometheus(sds, "input", ctx, "1000", 4);
+    TEST_CHECK(sds != NULL);
+    TEST_CHECK(strcmp(sds, expected) == 0);
+    if (strcmp(sds, expected) != 0) {
+        TEST_MSG("got: %s", sds);
+    }
+
+    flb_sds_destroy(sds);
+    flb_metrics_destroy(ctx);
+}
+
+static void test_histogram()
+{
+    int i;
+    int ret;
+    char *p;
+    flb_sds_t sds;
+    struct flb_metric *m;
+    struct flb_metrics *ctx;
+
+    /* Log scale buckets: 250us, 500us, 1ms ... */
+    TEST_CHECK(flb_metrics_hist_bucket(0) == 0);
+    TEST_CHECK(flb_metrics_hist_bucket(250) == 0);
+    TEST_CHECK(flb_metrics_hist_bucket(251) == 1);
+    TEST_CHECK(flb_metrics_hist_bucket(500) == 1);
+    TEST_CHECK(flb_metrics_hist_bucket(1000) == 2);
+    TEST_CHECK(flb_metrics_hist_bucket(1001) == 3);
+    TEST_CHECK(flb_metrics_hist_bucket(3600000000ULL) ==
+               FLB_METRIC_HIST_BUCKETS);
+
+    ctx = flb_metrics_create("http.0");
+    ret = flb_metrics_add_histogram(0, "flush_seconds", ctx);
+    TEST_CHECK(ret == 0);
+
+    /* 90 flushes of 1ms, 10 of 1s */
+    for (i = 0; i < 90; i++) {
+        flb_metrics_observe(0, 1000, ctx);
+    }
+    for (i = 0; i < 10; i++) {
+        flb_metrics_observe(0, 1000000, ctx);
+    }
+    TEST_CHECK(flb_metrics_observe(1, 1000, ctx) == -1);
+
+    m = flb_metrics_get_id(0, ctx);
+    TEST_CHECK(flb_metric_value(m) == 100);
+    TEST_CHECK(m->hist->sum == 90 * 1000 + 10 * 1000000);
+    TEST_CHECK(flb_metrics_hist_quantile(m, 0.50) == 0.001);
+    TEST_CHECK(flb_metrics_hist_quantile(m, 0.99) == 1.024);
+
+    /* Cumulative buckets, sum and count */
+    sds = flb_sds_create_size(64);
+    sds = flb_metrics_prometheus(sds, "output", ctx, "1000", 4);
+    TEST_CHECK(sds != NULL);
+    p = strstr(sds, "fluentbit_output_flush_seconds_bucket"
+                    "{name=\"http.0\",le=\"0.001\"} 90 1000\n");
+    TEST_CHECK(p != NULL);
+    p = strstr(sds, "fluentbit_output_flush_seconds_bucket"
+                    "{name=\"http.0\",le=\"+Inf\"} 100 1000\n");
+    TEST_CHECK(p != NULL);
+    p = strstr(sds, "fluentbit_output_flush_seconds_sum"
+                    "{name=\"http.0\"} 10.090000 1000\n");
+    TEST_CHECK(p != NULL);
+    p = strstr(sds, "fluentbit_output_flush_seconds_count"
+                    "{name=\"http.0\"} 100 1000\n");
+    TEST_CHECK(p != NULL);
+    flb_sds_destroy(sds);
+
+    ret = flb_metrics_destroy(ctx);
+    TEST_CHECK(ret == 1);
+}
+
+#define THREADS      12
+#define THREAD_SUMS  100000
+
+static void *thread_sum(void *data)
+{
+    int i;
+    struct flb_metric *m = data;
+
+    for (i = 0; i < THREAD_SUMS; i++) {
+        flb_metric_sum(m, 1);
+    }
+    return NULL;
+}
+
+static void test_threads()
+{
+    int i;
+    pthread_t tids[THREADS];
+    struct flb_metric *m;
+    struct flb_metric *gauge;
+    struct flb_metrics *ctx;
+
+    ctx = flb_metrics_create("out.0");
+    flb_metrics_add(0, "records", ctx);
+    flb_metrics_add(70, "lag_bytes", ctx);
+
+    /* Handles, the large IDs are found in the list */
+    m = flb_metrics_get_id(0, ctx);
+    gauge = flb_metrics_get_id(70, ctx);
+    TEST_CHECK(m != NULL && gauge != NULL);
+    TEST_CHECK(m->slots == NULL);
+
+    /* More threads than slots, some of them share one */
+    for (i = 0; i < THREADS; i++) {
+        pthread_create(&tids[i], NULL, thread_sum, m);
+    }
+    for (i = 0; i < THREADS; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    TEST_CHECK(flb_metric_value(m) == THREADS * THREAD_SUMS);
+
+    /* Gauges don't use slots */
+    flb_metric_set(gauge, 10);
+    flb_metrics_set(70, 7, ctx);
+    TEST_CHECK(flb_metric_value(gauge) == 7);
+    TEST_CHECK(gauge->slots == NULL);
+
+    flb_metrics_destroy(ctx);
+}
+
 TEST_LIST = {
     { "create_usage", test_create_usage},
+    { "children"    , test_children},
+    { "prometheus"  , test_prometheus},
+    { "histogram"   , test_histogram},
+    { "threads"     , test_threads},
     { 0 }
 };
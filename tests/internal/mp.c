@@ -0,0 +1,292 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mp.h>
+
+#include <msgpack.h>
+#include <string.h>
+
+#include "flb_tests_internal.h"
+
+/* Pack one object of every family and check its raw size */
+static void test_mp_object_size()
+{
+    int i;
+    int ret;
+    size_t off;
+    size_t size;
+    size_t prev;
+    char big[70000];
+    msgpack_sbuffer sbuf;
+    msgpack_packer pck;
+
+    memset(big, 'x', sizeof(big));
+    msgpack_sbuffer_init(&sbuf);
+    msgpack_packer_init(&pck, &sbuf, msgpack_sbuffer_write);
+
+    msgpack_pack_nil(&pck);
+    msgpack_pack_true(&pck);
+    msgpack_pack_int(&pck, -1);
+    msgpack_pack_uint64(&pck, 1ULL << 40);
+    msgpack_pack_int16(&pck, -300);
+    msgpack_pack_double(&pck, 0.5);
+    msgpack_pack_str(&pck, 3);
+    msgpack_pack_str_body(&pck, "abc", 3);
+    msgpack_pack_str(&pck, 200);
+    msgpack_pack_str_body(&pck, big, 200);
+    msgpack_pack_str(&pck, sizeof(big));
+    msgpack_pack_str_body(&pck, big, sizeof(big));
+    msgpack_pack_bin(&pck, 4);
+    msgpack_pack_bin_body(&pck, "abcd", 4);
+    msgpack_pack_ext(&pck, 8, 0);
+    msgpack_pack_ext_body(&pck, "12345678", 8);
+
+    /* nested containers */
+    msgpack_pack_map(&pck, 20);
+    for (i = 0; i < 20; i++) {
+        msgpack_pack_int(&pck, i);
+        msgpack_pack_array(&pck, 2);
+        msgpack_pack_str(&pck, 1);
+        msgpack_pack_str_body(&pck, "a", 1);
+        msgpack_pack_map(&pck, 0);
+    }
+
+    /* walk the buffer and compare against the msgpack unpacker */
+    off = 0;
+    prev = 0;
+    while (off < sbuf.size) {
+        msgpack_unpacked result;
+
+        msgpack_unpacked_init(&result);
+        ret = msgpack_unpack_next(&result, sbuf.data, sbuf.size, &off);
+        TEST_CHECK(ret == MSGPACK_UNPACK_SUCCESS);
+        msgpack_unpacked_destroy(&result);
+
+        ret = flb_mp_object_size(sbuf.data + prev, sbuf.size - prev, &size);
+        TEST_CHECK(ret == 0);
+        TEST_CHECK(size == off - prev);
+
+        /* truncated objects are rejected */
+        ret = flb_mp_object_size(sbuf.data + prev, size - 1, &size);
+        TEST_CHECK(ret == -1);
+        prev = off;
+    }
+
+    msgpack_sbuffer_destroy(&sbuf);
+}
+
+static void test_mp_map_str()
+{
+    int ret;
+    int len;
+    uint32_t count;
+    uint32_t slen;
+    size_t hdr;
+    size_t obj;
+    char buf[5];
+    const char *str;
+    msgpack_sbuffer sbuf;
+    msgpack_packer pck;
+
+    msgpack_sbuffer_init(&sbuf);
+    msgpack_packer_init(&pck, &sbuf, msgpack_sbuffer_write);
+    msgpack_pack_map(&pck, 70000);
+    msgpack_pack_str(&pck, 5);
+    msgpack_pack_str_body(&pck, "hello", 5);
+
+    ret = flb_mp_map_header(sbuf.data, sbuf.size, &count, &hdr);
+    TEST_CHECK(ret == 0 && count == 70000 && hdr == 5);
+
+    ret = flb_mp_str(sbuf.data + hdr, sbuf.size - hdr, &str, &slen, &obj);
+    TEST_CHECK(ret == 0 && slen == 5 && obj == 6);
+    TEST_CHECK(strncmp(str, "hello", 5) == 0);
+
+    /* not a string */
+    ret = flb_mp_str(sbuf.data, sbuf.size, &str, &slen, &obj);
+    TEST_CHECK(ret == -1);
+
+    /* shortest header form */
+    len = flb_mp_map_header_write(buf, 3);
+    TEST_CHECK(len == 1 && (unsigned char) buf[0] == 0x83);
+    len = flb_mp_map_header_write(buf, 300);
+    TEST_CHECK(len == 3 && (unsigned char) buf[0] == 0xde);
+    len = flb_mp_map_header_write(buf, 70000);
+    TEST_CHECK(len == 5 && memcmp(buf, sbuf.data, 5) == 0);
+
+    msgpack_sbuffer_destroy(&sbuf);
+}
+
+static void test_mp_key()
+{
+    int ret;
+    uint32_t len;
+    size_t obj;
+    char bin[300];
+    const char *key;
+    msgpack_sbuffer sbuf;
+    msgpack_packer pck;
+
+    memset(bin, 'k', sizeof(bin));
+
+    msgpack_sbuffer_init(&sbuf);
+    msgpack_packer_init(&pck, &sbuf, msgpack_sbuffer_write);
+    msgpack_pack_bin(&pck, 300);
+    msgpack_pack_bin_body(&pck, bin, 300);
+    msgpack_pack_str(&pck, 3);
+    msgpack_pack_str_body(&pck, "key", 3);
+    msgpack_pack_int(&pck, 1);
+
+    ret = flb_mp_key(sbuf.data, sbuf.size, &key, &len, &obj);
+    TEST_CHECK(ret == 0 && len == 300 && obj == 303 && key[299] == 'k');
+
+    ret = flb_mp_key(sbuf.data + obj, sbuf.size - obj, &key, &len, &obj);
+    TEST_CHECK(ret == 0 && len == 3 && obj == 4);
+    TEST_CHECK(strncmp(key, "key", 3) == 0);
+
+    /* integer keys are not matched */
+    ret = flb_mp_key(sbuf.data + sbuf.size - 1, 1, &key, &len, &obj);
+    TEST_CHECK(ret == -1);
+
+    /* truncated */
+    ret = flb_mp_key(sbuf.data, 100, &key, &len, &obj);
+    TEST_CHECK(ret == -1);
+
+    msgpack_sbuffer_destroy(&sbuf);
+}
+
+static void test_mp_array_header()
+{
+    int ret;
+    uint32_t count;
+    size_t hdr;
+    msgpack_sbuffer sbuf;
+    msgpack_packer pck;
+
+    msgpack_sbuffer_init(&sbuf);
+    msgpack_packer_init(&pck, &sbuf, msgpack_sbuffer_write);
+    msgpack_pack_array(&pck, 2);
+    msgpack_pack_array(&pck, 300);
+    msgpack_pack_array(&pck, 70000);
+    msgpack_pack_map(&pck, 1);
+
+    ret = flb_mp_array_header(sbuf.data, sbuf.size, &count, &hdr);
+    TEST_CHECK(ret == 0 && count == 2 && hdr == 1);
+
+    ret = flb_mp_array_header(sbuf.data + 1, sbuf.size - 1, &count, &hdr);
+    TEST_CHECK(ret == 0 && count == 300 && hdr == 3);
+
+    ret = flb_mp_array_header(sbuf.data + 4, sbuf.size - 4, &count, &hdr);
+    TEST_CHECK(ret == 0 && count == 70000 && hdr == 5);
+
+    /* a map is not an array */
+    ret = flb_mp_array_header(sbuf.data + 9, sbuf.size - 9, &count, &hdr);
+    TEST_CHECK(ret == -1);
+
+    /* truncated header */
+    ret = flb_mp_array_header(sbuf.data + 4, 3, &count, &hdr);
+    TEST_CHECK(ret == -1);
+
+    msgpack_sbuffer_destroy(&sbuf);
+}
+
+static void test_mp_records_check()
+{
+    int i;
+    msgpack_sbuffer sbuf;
+    msgpack_packer pck;
+
+    msgpack_sbuffer_init(&sbuf);
+    msgpack_packer_init(&pck, &sbuf, msgpack_sbuffer_write);
+    for (i = 0; i < 3; i++) {
+        msgpack_pack_array(&pck, 2);
+        msgpack_pack_uint32(&pck, 1500000000 + i);
+        msgpack_pack_map(&pck, 1);
+        msgpack_pack_str(&pck, 3);
+        msgpack_pack_str_body(&pck, "key", 3);
+        msgpack_pack_array(&pck, 2);
+        msgpack_pack_int(&pck, i);
+        msgpack_pack_nil(&pck);
+    }
+    TEST_CHECK(flb_mp_records_check(sbuf.data, sbuf.size) == 3);
+
+    /* truncated record */
+    TEST_CHECK(flb_mp_records_check(sbuf.data, sbuf.size - 1) == -1);
+
+    /* the body must be a map */
+    msgpack_pack_array(&pck, 2);
+    msgpack_pack_uint32(&pck, 1500000000);
+    msgpack_pack_str(&pck, 0);
+    TEST_CHECK(flb_mp_records_check(sbuf.data, sbuf.size) == -1);
+
+    /* not a record at all */
+    TEST_CHECK(flb_mp_records_check("\x93\x01\x02\x03", 4) == -1);
+
+    msgpack_sbuffer_destroy(&sbuf);
+}
+
+/* Contexts and zones are recycled by the thread pools */
+static void test_mp_unpacker_pool()
+{
+    int i;
+    int ret;
+    int count = 0;
+    size_t off = 0;
+    msgpack_sbuffer sbuf;
+    msgpack_packer pck;
+    msgpack_unpacked *a;
+    msgpack_unpacked *b;
+    msgpack_zone *zone;
+
+    msgpack_sbuffer_init(&sbuf);
+    msgpack_packer_init(&pck, &sbuf, msgpack_sbuffer_write);
+    for (i = 0; i < 100; i++) {
+        msgpack_pack_array(&pck, 2);
+        msgpack_pack_int(&pck, i);
+        msgpack_pack_map(&pck, 1);
+        msgpack_pack_str(&pck, 1);
+        msgpack_pack_str_body(&pck, "k", 1);
+        msgpack_pack_int(&pck, i);
+    }
+
+    a = flb_mp_unpacker_get();
+    TEST_CHECK(a != NULL);
+    while (flb_mp_unpack_next(a, sbuf.data, sbuf.size, &off) ==
+           MSGPACK_UNPACK_SUCCESS) {
+        TEST_CHECK(a->data.type == MSGPACK_OBJECT_ARRAY);
+        TEST_CHECK(a->data.via.array.ptr[0].via.u64 == count);
+        count++;
+    }
+    TEST_CHECK(count == 100 && off == sbuf.size);
+
+    /* A truncated object is not consumed */
+    off = 0;
+    ret = flb_mp_unpack_next(a, sbuf.data, 3, &off);
+    TEST_CHECK(ret == MSGPACK_UNPACK_CONTINUE && off == 0);
+
+    /* The same context is given back */
+    flb_mp_unpacker_put(a);
+    b = flb_mp_unpacker_get();
+    TEST_CHECK(a == b);
+    flb_mp_unpacker_put(b);
+
+    zone = flb_mp_zone_get();
+    TEST_CHECK(zone != NULL);
+    flb_mp_zone_put(zone);
+    TEST_CHECK(flb_mp_zone_get() == zone);
+    flb_mp_zone_put(zone);
+
+    TEST_CHECK(flb_mp_count(sbuf.data, sbuf.size) == 100);
+
+    flb_mp_thread_exit();
+    msgpack_sbuffer_destroy(&sbuf);
+}
+
+TEST_LIST = {
+    { "object_size", test_mp_object_size},
+    { "map_str"    , test_mp_map_str},
+    { "key"        , test_mp_key},
+    { "array"      , test_mp_array_header},
+    { "records"    , test_mp_records_check},
+    { "unpacker"   , test_mp_unpacker_pool},
+    { 0 }
+};
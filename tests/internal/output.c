@@ -0,0 +1,254 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_config.h>
+#include <fluent-bit/flb_output.h>
+#include <fluent-bit/flb_engine.h>
+#include <fluent-bit/flb_scheduler.h>
+#include <fluent-bit/flb_time.h>
+
+#include "flb_tests_internal.h"
+
+static struct flb_output_instance *adaptive_output(struct flb_config *config)
+{
+    int ret;
+    struct flb_output_instance *ins;
+
+    ins = flb_output_new(config, "http", NULL);
+    TEST_CHECK(ins != NULL);
+    flb_output_set_property(ins, "match", "*");
+    flb_output_set_property(ins, "coalesce.window", "1600");
+    flb_output_set_property(ins, "coalesce.max_size", "1600000");
+    flb_output_set_property(ins, "coalesce.adaptive", "on");
+    flb_output_set_property(ins, "coalesce.latency_target", "100");
+
+    ret = flb_output_init(config);
+    TEST_CHECK(ret == 0);
+
+    return ins;
+}
+
+/* The tuning starts from the lower bounds and grows up to the configured */
+static void test_adaptive_increase()
+{
+    int i;
+    struct flb_config *config;
+    struct flb_output_instance *ins;
+
+    config = flb_config_init();
+    ins = adaptive_output(config);
+
+    TEST_CHECK(ins->coalesce_window == 100);
+    TEST_CHECK(ins->coalesce_max_size == 100000);
+
+    /* Additive increase: the span over the steps */
+    flb_output_coalesce_update(ins, FLB_OK, 0, 50000);
+    TEST_CHECK(ins->coalesce_window == 194);
+    TEST_CHECK(ins->coalesce_max_size == 193751);
+
+    for (i = 0; i < 32; i++) {
+        flb_output_coalesce_update(ins, FLB_OK, 0, 50000);
+    }
+    TEST_CHECK(ins->coalesce_window == 1600);
+    TEST_CHECK(ins->coalesce_max_size == 1600000);
+
+    /* Errors are about the data */
+    flb_output_coalesce_update(ins, FLB_ERROR, 0, 500000);
+    TEST_CHECK(ins->coalesce_window == 1600);
+
+    flb_output_exit(config);
+    flb_config_exit(config);
+}
+
+/* Retries and slow flushes halve, once for the flushes running together */
+static void test_adaptive_decrease()
+{
+    int i;
+    struct flb_config *config;
+    struct flb_output_instance *ins;
+
+    config = flb_config_init();
+    ins = adaptive_output(config);
+
+    for (i = 0; i < 32; i++) {
+        flb_output_coalesce_update(ins, FLB_OK, 0, 50000);
+    }
+
+    flb_output_coalesce_update(ins, FLB_RETRY, 1000000, 50000);
+    TEST_CHECK(ins->coalesce_window == 800);
+    TEST_CHECK(ins->coalesce_max_size == 800000);
+
+    /* Started before the decrease ended */
+    flb_output_coalesce_update(ins, FLB_RETRY, 1020000, 50000);
+    TEST_CHECK(ins->coalesce_window == 800);
+
+    /* Over the latency target */
+    flb_output_coalesce_update(ins, FLB_OK, 1100000, 200000);
+    TEST_CHECK(ins->coalesce_window == 400);
+    TEST_CHECK(ins->coalesce_max_size == 400000);
+
+    for (i = 0; i < 8; i++) {
+        flb_output_coalesce_update(ins, FLB_RETRY, 2000000 + i * 1000000, 0);
+    }
+    TEST_CHECK(ins->coalesce_window == 100);
+    TEST_CHECK(ins->coalesce_max_size == 100000);
+
+    flb_output_exit(config);
+    flb_config_exit(config);
+}
+
+/* Without 'coalesce.adaptive' the window and size are fixed */
+static void test_fixed()
+{
+    struct flb_config *config;
+    struct flb_output_instance *ins;
+
+    config = flb_config_init();
+    ins = flb_output_new(config, "http", NULL);
+    TEST_CHECK(ins != NULL);
+    flb_output_set_property(ins, "coalesce.window", "1600");
+    TEST_CHECK(flb_output_init(config) == 0);
+
+    flb_output_coalesce_update(ins, FLB_RETRY, 0, 50000);
+    TEST_CHECK(ins->coalesce_window == 1600);
+    TEST_CHECK(ins->coalesce_max_size == FLB_OUTPUT_COALESCE_SIZE);
+
+    flb_output_exit(config);
+    flb_config_exit(config);
+}
+
+static struct flb_output_instance *circuit_output(struct flb_config *config)
+{
+    struct flb_output_instance *ins;
+
+    config->evl = mk_event_loop_create(64);
+    TEST_CHECK(flb_sched_init(config) == 0);
+
+    ins = flb_output_new(config, "http", NULL);
+    TEST_CHECK(ins != NULL);
+    flb_output_set_property(ins, "match", "*");
+    flb_output_set_property(ins, "circuit.failures", "3");
+    flb_output_set_property(ins, "circuit.probe_interval", "1");
+    TEST_CHECK(flb_output_init(config) == 0);
+
+    return ins;
+}
+
+/* Run the scheduler until the circuit leaves 'state' or the limit is reached */
+static void circuit_run(struct flb_config *config,
+                        struct flb_output_instance *ins, int state, int max_ms)
+{
+    struct flb_time t0;
+    struct flb_time t1;
+    struct flb_time diff;
+    struct mk_event *event;
+
+    flb_time_get(&t0);
+    while (ins->circuit_state == state) {
+        mk_event_wait(config->evl);
+        mk_event_foreach(event, config->evl) {
+            if (event->type & FLB_ENGINE_EV_SCHED) {
+                flb_sched_event_handler(config, event);
+            }
+        }
+        flb_sched_timer_cleanup(config->sched);
+
+        flb_time_get(&t1);
+        flb_time_diff(&t1, &t0, &diff);
+        if (flb_time_to_double(&diff) * 1000 > max_ms) {
+            break;
+        }
+    }
+}
+
+/* Only retries in a row count, the last one opens the circuit */
+static void test_circuit_threshold()
+{
+    int timers;
+    struct flb_sched *sched;
+    struct flb_config *config;
+    struct flb_output_instance *ins;
+
+    config = flb_config_init();
+    ins = circuit_output(config);
+    sched = config->sched;
+    timers = mk_list_size(&sched->timers);
+
+    flb_output_circuit_update(ins, FLB_RETRY, config);
+    flb_output_circuit_update(ins, FLB_RETRY, config);
+    TEST_CHECK(ins->circuit_state == FLB_OUTPUT_CIRCUIT_CLOSED);
+    TEST_CHECK(ins->circuit_count == 2);
+
+    /* Errors are about the data, not the destination */
+    flb_output_circuit_update(ins, FLB_ERROR, config);
+    TEST_CHECK(ins->circuit_count == 2);
+
+    flb_output_circuit_update(ins, FLB_OK, config);
+    TEST_CHECK(ins->circuit_count == 0);
+
+    flb_output_circuit_update(ins, FLB_RETRY, config);
+    flb_output_circuit_update(ins, FLB_RETRY, config);
+    TEST_CHECK(ins->circuit_state == FLB_OUTPUT_CIRCUIT_CLOSED);
+    TEST_CHECK(ins->circuit_timer == NULL);
+
+    flb_output_circuit_update(ins, FLB_RETRY, config);
+    TEST_CHECK(ins->circuit_state == FLB_OUTPUT_CIRCUIT_OPEN);
+    TEST_CHECK(ins->circuit_timer != NULL);
+    TEST_CHECK(mk_list_size(&sched->timers) == timers + 1);
+
+    /* Flushes finishing while open do not schedule more probes */
+    flb_output_circuit_update(ins, FLB_RETRY, config);
+    TEST_CHECK(ins->circuit_state == FLB_OUTPUT_CIRCUIT_OPEN);
+    TEST_CHECK(mk_list_size(&sched->timers) == timers + 1);
+
+    /* The pending probe goes with the instance */
+    flb_output_exit(config);
+    TEST_CHECK(mk_list_size(&sched->timers) == timers);
+
+    flb_config_exit(config);
+}
+
+/* closed -> open -> half-open -> open -> half-open -> closed */
+static void test_circuit_states()
+{
+    int i;
+    struct flb_config *config;
+    struct flb_output_instance *ins;
+
+    config = flb_config_init();
+    ins = circuit_output(config);
+
+    for (i = 0; i < 3; i++) {
+        flb_output_circuit_update(ins, FLB_RETRY, config);
+    }
+    TEST_CHECK(ins->circuit_state == FLB_OUTPUT_CIRCUIT_OPEN);
+
+    circuit_run(config, ins, FLB_OUTPUT_CIRCUIT_OPEN, 3000);
+    TEST_CHECK(ins->circuit_state == FLB_OUTPUT_CIRCUIT_HALF_OPEN);
+    TEST_CHECK(ins->circuit_timer == NULL);
+
+    /* The probe failed */
+    flb_output_circuit_update(ins, FLB_RETRY, config);
+    TEST_CHECK(ins->circuit_state == FLB_OUTPUT_CIRCUIT_OPEN);
+    TEST_CHECK(ins->circuit_timer != NULL);
+
+    circuit_run(config, ins, FLB_OUTPUT_CIRCUIT_OPEN, 3000);
+    TEST_CHECK(ins->circuit_state == FLB_OUTPUT_CIRCUIT_HALF_OPEN);
+
+    flb_output_circuit_update(ins, FLB_OK, config);
+    TEST_CHECK(ins->circuit_state == FLB_OUTPUT_CIRCUIT_CLOSED);
+    TEST_CHECK(ins->circuit_count == 0);
+    TEST_CHECK(ins->circuit_timer == NULL);
+
+    flb_output_exit(config);
+    flb_config_exit(config);
+}
+
+TEST_LIST = {
+    { "adaptive_increase", test_adaptive_increase },
+    { "adaptive_decrease", test_adaptive_decrease },
+    { "fixed",             test_fixed             },
+    { "circuit_threshold", test_circuit_threshold },
+    { "circuit_states",    test_circuit_states    },
+    { 0 }
+};
@@ -325,6 +325,318 @@ void test_json_pack_bug342()
 }
 
 
+/* Values are packed with their own types, strings keep the escapes */
+void test_json_pack_types()
+{
+    int ret;
+    char *out_buf;
+    size_t out_size;
+    size_t off = 0;
+    msgpack_object *a;
+    msgpack_unpacked result;
+    char *json = "[1, -2, 18446744073709551615, -9223372036854775808, "
+                 "1.5, 1e2, -0.25E-1, true, false, null, "
+                 "\"a\\\"b\\\\\", \"\\u00e9\", {\"k\": [ ]}, {}]";
+
+    ret = flb_pack_json(json, strlen(json), &out_buf, &out_size);
+    TEST_CHECK(ret == 0);
+    if (ret != 0) {
+        return;
+    }
+
+    msgpack_unpacked_init(&result);
+    ret = msgpack_unpack_next(&result, out_buf, out_size, &off);
+    TEST_CHECK(ret == MSGPACK_UNPACK_SUCCESS);
+    TEST_CHECK(off == out_size);
+    TEST_CHECK(result.data.type == MSGPACK_OBJECT_ARRAY);
+    TEST_CHECK(result.data.via.array.size == 14);
+
+    a = result.data.via.array.ptr;
+    TEST_CHECK(a[0].type == MSGPACK_OBJECT_POSITIVE_INTEGER &&
+               a[0].via.u64 == 1);
+    TEST_CHECK(a[1].type == MSGPACK_OBJECT_NEGATIVE_INTEGER &&
+               a[1].via.i64 == -2);
+    TEST_CHECK(a[2].type == MSGPACK_OBJECT_POSITIVE_INTEGER &&
+               a[2].via.u64 == UINT64_MAX);
+    TEST_CHECK(a[3].type == MSGPACK_OBJECT_NEGATIVE_INTEGER &&
+               a[3].via.i64 == INT64_MIN);
+    TEST_CHECK(a[4].type == MSGPACK_OBJECT_FLOAT && a[4].via.f64 == 1.5);
+    TEST_CHECK(a[5].type == MSGPACK_OBJECT_FLOAT && a[5].via.f64 == 100.0);
+    TEST_CHECK(a[6].type == MSGPACK_OBJECT_FLOAT && a[6].via.f64 == -0.025);
+    TEST_CHECK(a[7].type == MSGPACK_OBJECT_BOOLEAN && a[7].via.boolean);
+    TEST_CHECK(a[8].type == MSGPACK_OBJECT_BOOLEAN && !a[8].via.boolean);
+    TEST_CHECK(a[9].type == MSGPACK_OBJECT_NIL);
+    TEST_CHECK(a[10].type == MSGPACK_OBJECT_STR &&
+               a[10].via.str.size == 6 &&
+               memcmp(a[10].via.str.ptr, "a\\\"b\\\\", 6) == 0);
+    TEST_CHECK(a[11].type == MSGPACK_OBJECT_STR &&
+               a[11].via.str.size == 6);
+    TEST_CHECK(a[12].type == MSGPACK_OBJECT_MAP &&
+               a[12].via.map.size == 1 &&
+               a[12].via.map.ptr[0].val.type == MSGPACK_OBJECT_ARRAY &&
+               a[12].via.map.ptr[0].val.via.array.size == 0);
+    TEST_CHECK(a[13].type == MSGPACK_OBJECT_MAP && a[13].via.map.size == 0);
+
+    msgpack_unpacked_destroy(&result);
+    flb_free(out_buf);
+}
+
+/* Containers with more than 15 and 65535 entries use bigger headers */
+void test_json_pack_big()
+{
+    int i;
+    int ret;
+    int n;
+    int sizes[] = {15, 16, 65535, 65536};
+    char *p;
+    char *json;
+    char *out_buf;
+    size_t out_size;
+    size_t off;
+    msgpack_object *m;
+    msgpack_unpacked result;
+
+    json = flb_malloc(65536 * 32);
+    TEST_CHECK(json != NULL);
+
+    for (n = 0; n < sizeof(sizes) / sizeof(int); n++) {
+        /* {"a": [0, 1, ...], "b": {"0": 0, ...}} */
+        p = json;
+        p += sprintf(p, "{\"a\": [");
+        for (i = 0; i < sizes[n]; i++) {
+            p += sprintf(p, "%s%i", i ? "," : "", i);
+        }
+        p += sprintf(p, "], \"b\": {");
+        for (i = 0; i < sizes[n]; i++) {
+            p += sprintf(p, "%s\"%i\":%i", i ? "," : "", i, i);
+        }
+        p += sprintf(p, "}}");
+
+        ret = flb_pack_json(json, p - json, &out_buf, &out_size);
+        TEST_CHECK(ret == 0);
+        if (ret != 0) {
+            continue;
+        }
+
+        off = 0;
+        msgpack_unpacked_init(&result);
+        ret = msgpack_unpack_next(&result, out_buf, out_size, &off);
+        TEST_CHECK(ret == MSGPACK_UNPACK_SUCCESS);
+        TEST_CHECK(off == out_size);
+
+        m = &result.data;
+        TEST_CHECK(m->type == MSGPACK_OBJECT_MAP && m->via.map.size == 2);
+        TEST_CHECK(m->via.map.ptr[0].val.via.array.size == sizes[n]);
+        TEST_CHECK(m->via.map.ptr[0].val.via.array.ptr[sizes[n] - 1].via.u64
+                   == sizes[n] - 1);
+        TEST_CHECK(m->via.map.ptr[1].val.via.map.size == sizes[n]);
+
+        msgpack_unpacked_destroy(&result);
+        flb_free(out_buf);
+    }
+
+    /* Deep nesting */
+    for (i = 0; i < 1000; i++) {
+        json[i] = '[';
+        json[i + 1000] = ']';
+    }
+    ret = flb_pack_json(json, 2000, &out_buf, &out_size);
+    TEST_CHECK(ret == 0 && out_size == 1000);
+    if (ret == 0) {
+        flb_free(out_buf);
+    }
+
+    flb_free(json);
+}
+
+/* Feed concatenated messages in random chunks, the result must not change */
+void test_json_pack_chunks()
+{
+    int i;
+    int ret;
+    int records = 0;
+    int out_size;
+    char *out;
+    char *buf;
+    char *full_buf;
+    size_t full_size;
+    size_t len = 0;
+    size_t avail = 0;
+    size_t total;
+    size_t packed = 0;
+    msgpack_sbuffer sbuf;
+    struct flb_pack_state state;
+    char *rec = "{\"log\": \"a \\\"quoted\\\" {value}, \\\\\", \"n\": [1, 2.5, "
+                "{\"x\": null}], \"s\": \"\\\\\\\\\\\"]\\\\\"}\n";
+
+    total = strlen(rec) * 200;
+    buf = flb_malloc(total + 1);
+    TEST_CHECK(buf != NULL);
+    for (i = 0; i < 200; i++) {
+        memcpy(buf + (i * strlen(rec)), rec, strlen(rec));
+    }
+    buf[total] = '\0';
+
+    ret = flb_pack_json(buf, total, &full_buf, &full_size);
+    TEST_CHECK(ret == 0);
+
+    msgpack_sbuffer_init(&sbuf);
+    flb_pack_state_init(&state);
+    state.multiple = FLB_TRUE;
+
+    srand(342);
+    while (packed < total) {
+        if (avail < total - packed) {
+            avail += 1 + (rand() % 100);
+            if (avail > total - packed) {
+                avail = total - packed;
+            }
+        }
+        len = avail;
+
+        ret = flb_pack_json_state(buf + packed, len, &out, &out_size, &state);
+        TEST_CHECK(ret != FLB_ERR_JSON_INVAL);
+        if (ret == FLB_ERR_JSON_INVAL) {
+            break;
+        }
+        else if (ret == FLB_ERR_JSON_PART) {
+            if (len == total - packed) {
+                /* only the trailing new line is left */
+                break;
+            }
+            continue;
+        }
+
+        msgpack_sbuffer_write(&sbuf, out, out_size);
+        flb_free(out);
+        packed += state.last_byte;
+        avail -= state.last_byte;
+        records++;
+
+        flb_pack_state_reset(&state);
+        flb_pack_state_init(&state);
+        state.multiple = FLB_TRUE;
+    }
+
+    TEST_CHECK(records > 0);
+    TEST_CHECK(sbuf.size == full_size);
+    TEST_CHECK(memcmp(sbuf.data, full_buf, full_size) == 0);
+
+    msgpack_sbuffer_destroy(&sbuf);
+    flb_pack_state_reset(&state);
+    flb_free(full_buf);
+    flb_free(buf);
+}
+
+/* A big message arriving in pieces is only scanned once */
+void test_json_pack_resume()
+{
+    int i;
+    int ret;
+    int out_size;
+    int records = 0;
+    char *p;
+    char *buf;
+    char *out;
+    size_t off;
+    size_t len;
+    size_t total;
+    msgpack_unpacked result;
+    struct flb_pack_state state;
+
+    buf = flb_malloc(1024 * 1024);
+    TEST_CHECK(buf != NULL);
+
+    /* one big map followed by a small one */
+    p = buf;
+    p += sprintf(p, "{\"list\": [");
+    for (i = 0; i < 20000; i++) {
+        p += sprintf(p, "%s{\"id\": %i, \"v\": \"\\\"}]\\\\\"}", i ? "," : "",
+                     i);
+    }
+    p += sprintf(p, "]}\n{\"last\": true}");
+    total = p - buf;
+
+    flb_pack_state_init(&state);
+    state.multiple = FLB_TRUE;
+
+    len = 0;
+    while (len < total) {
+        len += 1000;
+        if (len > total) {
+            len = total;
+        }
+
+        ret = flb_pack_json_state(buf, len, &out, &out_size, &state);
+        if (ret == FLB_ERR_JSON_PART) {
+            /* only a trailing block smaller than 64 bytes is pending */
+            TEST_CHECK(state.scan.pos + 64 > len);
+            continue;
+        }
+        TEST_CHECK(ret == 0);
+        if (ret != 0) {
+            break;
+        }
+        off = 0;
+        msgpack_unpacked_init(&result);
+        while (msgpack_unpack_next(&result, out, out_size, &off)) {
+            records++;
+        }
+        msgpack_unpacked_destroy(&result);
+        flb_free(out);
+
+        /* keep the state, it follows the consumed bytes */
+        memmove(buf, buf + state.last_byte, total - state.last_byte);
+        total -= state.last_byte;
+        len -= state.last_byte;
+    }
+
+    TEST_CHECK(records == 2);
+    TEST_CHECK(total == 0);
+
+    flb_pack_state_reset(&state);
+    flb_free(buf);
+}
+
+void test_json_pack_invalid()
+{
+    int i;
+    int ret;
+    char *out_buf;
+    size_t out_size;
+    int out_int;
+    struct flb_pack_state state;
+    char *invalid[] = {
+        "{\"a\": 1,}", "[1, 2,]", "{\"a\" 1}", "{1: 2}", "[1 2]",
+        "{\"a\": tru}", "{\"a\": nulls}", "[01]", "[1.]", "[-]", "[1e]",
+        "[\"\\x\"]", "[\"\\u12g4\"]", "{\"a\": [}", "]", NULL
+    };
+    char *partial[] = {
+        "{", "{\"a\"", "{\"a\": ", "{\"a\": \"b", "[1, 2", "[\"\\",
+        "[tr", "   ", NULL
+    };
+
+    for (i = 0; invalid[i]; i++) {
+        ret = flb_json_parse(invalid[i], strlen(invalid[i]), NULL, NULL);
+        if (!TEST_CHECK(ret == FLB_ERR_JSON_INVAL)) {
+            printf("invalid: '%s' => %i\n", invalid[i], ret);
+        }
+        ret = flb_pack_json(invalid[i], strlen(invalid[i]),
+                            &out_buf, &out_size);
+        TEST_CHECK(ret == -1);
+    }
+
+    for (i = 0; partial[i]; i++) {
+        flb_pack_state_init(&state);
+        ret = flb_pack_json_state(partial[i], strlen(partial[i]),
+                                  &out_buf, &out_int, &state);
+        if (!TEST_CHECK(ret == FLB_ERR_JSON_PART)) {
+            printf("partial: '%s' => %i\n", partial[i], ret);
+        }
+        flb_pack_state_reset(&state);
+    }
+}
+
 /* Iterate data/pack/ directory and compose an array with files to test */
 static int utf8_tests_create()
 {
@@ -463,6 +775,128 @@ void test_utf8_to_json()
     utf8_tests_destroy(n_tests);
 }
 
+/* Encode every msgpack type and strings crossing the 8 bytes boundaries */
+void test_msgpack_to_json()
+{
+    int i;
+    int ret;
+    size_t off = 0;
+    size_t out_size;
+    char *out_buf;
+    char big[1000];
+    char expected[1100];
+    flb_sds_t s;
+    msgpack_sbuffer sbuf;
+    msgpack_packer pck;
+    msgpack_unpacked result;
+    char *json = "{\"nil\":null, \"t\":true, \"f\":false, \"u\":18446744073709551615, "
+        "\"n\":-9223372036854775808, \"z\":0, \"d\":0.500000, "
+        "\"a\":[1, -2, \"x\"], \"m\":{}, "
+        "\"s\":\"0123456789abc\\\"def\\\\ghi\\n\\tjkl\\u001fmno\\u00e9p\"}";
+
+    msgpack_sbuffer_init(&sbuf);
+    msgpack_packer_init(&pck, &sbuf, msgpack_sbuffer_write);
+
+    msgpack_pack_map(&pck, 10);
+    msgpack_pack_str(&pck, 3);
+    msgpack_pack_str_body(&pck, "nil", 3);
+    msgpack_pack_nil(&pck);
+    msgpack_pack_str(&pck, 1);
+    msgpack_pack_str_body(&pck, "t", 1);
+    msgpack_pack_true(&pck);
+    msgpack_pack_str(&pck, 1);
+    msgpack_pack_str_body(&pck, "f", 1);
+    msgpack_pack_false(&pck);
+    msgpack_pack_str(&pck, 1);
+    msgpack_pack_str_body(&pck, "u", 1);
+    msgpack_pack_uint64(&pck, 18446744073709551615ULL);
+    msgpack_pack_str(&pck, 1);
+    msgpack_pack_str_body(&pck, "n", 1);
+    msgpack_pack_int64(&pck, INT64_MIN);
+    msgpack_pack_str(&pck, 1);
+    msgpack_pack_str_body(&pck, "z", 1);
+    msgpack_pack_int(&pck, 0);
+    msgpack_pack_str(&pck, 1);
+    msgpack_pack_str_body(&pck, "d", 1);
+    msgpack_pack_double(&pck, 0.5);
+    msgpack_pack_str(&pck, 1);
+    msgpack_pack_str_body(&pck, "a", 1);
+    msgpack_pack_array(&pck, 3);
+    msgpack_pack_int(&pck, 1);
+    msgpack_pack_int(&pck, -2);
+    msgpack_pack_str(&pck, 1);
+    msgpack_pack_str_body(&pck, "x", 1);
+    msgpack_pack_str(&pck, 1);
+    msgpack_pack_str_body(&pck, "m", 1);
+    msgpack_pack_map(&pck, 0);
+    msgpack_pack_str(&pck, 1);
+    msgpack_pack_str_body(&pck, "s", 1);
+    msgpack_pack_str(&pck, 33);
+    msgpack_pack_str_body(&pck, "0123456789abc\"def\\ghi\n\tjkl\x1fmno\xc3\xa9p", 33);
+
+    out_buf = NULL;
+    ret = flb_msgpack_raw_to_json_str(sbuf.data, sbuf.size,
+                                      &out_buf, &out_size);
+    TEST_CHECK(ret == 0);
+    if (!TEST_CHECK(out_size == strlen(json) && strcmp(out_buf, json) == 0)) {
+        TEST_MSG("expected: %s", json);
+        TEST_MSG("encoded : %s", out_buf);
+    }
+    flb_free(out_buf);
+
+    /* The sds encoder appends and grows from a tiny buffer */
+    msgpack_unpacked_init(&result);
+    msgpack_unpack_next(&result, sbuf.data, sbuf.size, &off);
+
+    s = flb_sds_create_size(1);
+    TEST_CHECK(s != NULL);
+    s = flb_sds_cat(s, "x", 1);
+    ret = flb_msgpack_to_json_sds(&s, &result.data);
+    TEST_CHECK(ret == 0);
+    TEST_CHECK(flb_sds_len(s) == strlen(json) + 1);
+    TEST_CHECK(s[0] == 'x' && strcmp(s + 1, json) == 0);
+    flb_sds_destroy(s);
+
+    /* snprintf() like interface */
+    ret = flb_msgpack_to_json(expected, 10, &result.data);
+    TEST_CHECK(ret < 0);
+    ret = flb_msgpack_to_json(expected, sizeof(expected), &result.data);
+    TEST_CHECK(ret == strlen(json) && strcmp(expected, json) == 0);
+    msgpack_unpacked_destroy(&result);
+    msgpack_sbuffer_destroy(&sbuf);
+
+    /* A character to escape at every position of a long string */
+    for (i = 0; i < 40; i++) {
+        memset(big, 'a', sizeof(big));
+        big[i] = '"';
+        big[sizeof(big) - 1 - i] = 0x7f;
+
+        msgpack_sbuffer_init(&sbuf);
+        msgpack_packer_init(&pck, &sbuf, msgpack_sbuffer_write);
+        msgpack_pack_str(&pck, sizeof(big));
+        msgpack_pack_str_body(&pck, big, sizeof(big));
+
+        off = 0;
+        expected[off++] = '"';
+        memset(expected + off, 'a', sizeof(big) + 6);
+        expected[off + i] = '\\';
+        expected[off + i + 1] = '"';
+        memcpy(expected + off + sizeof(big) - i, "\\u007f", 6);
+        off += sizeof(big) + 6;
+        expected[off++] = '"';
+        expected[off] = '\0';
+
+        ret = flb_msgpack_raw_to_json_str(sbuf.data, sbuf.size,
+                                          &out_buf, &out_size);
+        TEST_CHECK(ret == 0);
+        if (!TEST_CHECK(out_size == off && strcmp(out_buf, expected) == 0)) {
+            TEST_MSG("escape at %i", i);
+        }
+        flb_free(out_buf);
+        msgpack_sbuffer_destroy(&sbuf);
+    }
+}
+
 TEST_LIST = {
     /* JSON maps iteration */
     { "json_pack", test_json_pack },
@@ -470,8 +904,14 @@ TEST_LIST = {
     { "json_pack_mult", test_json_pack_mult},
     { "json_pack_mult_iter", test_json_pack_mult_iter},
     { "json_pack_bug342", test_json_pack_bug342},
+    { "json_pack_types", test_json_pack_types},
+    { "json_pack_big", test_json_pack_big},
+    { "json_pack_chunks", test_json_pack_chunks},
+    { "json_pack_resume", test_json_pack_resume},
+    { "json_pack_invalid", test_json_pack_invalid},
 
     /* Mixed bytes, check JSON encoding */
     { "utf8_to_json", test_utf8_to_json},
+    { "msgpack_to_json", test_msgpack_to_json},
     { 0 }
 };
@@ -2,6 +2,7 @@
 
 #include <fluent-bit/flb_info.h>
 #include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_str.h>
 #include <fluent-bit/flb_parser.h>
 #include <fluent-bit/flb_error.h>
 
@@ -11,6 +12,8 @@
 /* Parsers configuration */
 #define JSON_PARSERS  FLB_TESTS_DATA_PATH "/data/parser/json.conf"
 #define REGEX_PARSERS FLB_TESTS_DATA_PATH "/data/parser/regex.conf"
+#define DECODER_PARSERS FLB_TESTS_DATA_PATH "/data/parser/decoder.conf"
+#define LAZY_PARSERS FLB_TESTS_DATA_PATH "/data/parser/lazy.conf"
 
 /* Templates */
 #define JSON_FMT_01  "{\"key001\": 12345, \"key002\": 0.99, \"time\": \"%s\"}"
@@ -396,10 +399,482 @@ void test_regex_parser_time_lookup()
     flb_free(config);
 }
 
+/* Built-in time scanner and strptime(3) cache */
+void test_parser_time_fast_cache()
+{
+    int i;
+    int ret;
+    double ns;
+    time_t epoch;
+    struct tm tm;
+    struct flb_parser *p;
+    struct flb_config *config;
+    struct {
+        char *fmt;
+        char *str;
+        time_t epoch;
+        double ns;
+        int fast;
+    } checks[] = {
+        /* ISO8601 / RFC3339 */
+        {"%Y-%m-%dT%H:%M:%S.%L%z", "2017-07-17T20:17:03.25Z",
+         1500322623, 0.25, FLB_TRUE},
+        {"%Y-%m-%dT%H:%M:%S%z", "2017-07-18T01:47:03+05:30",
+         1500322623, 0, FLB_TRUE},
+        /* Apache / Nginx */
+        {"%d/%b/%Y:%H:%M:%S %z", "18/Jul/2017:05:17:03 +0900",
+         1500322623, 0, FLB_TRUE},
+        /* full month name is left to strptime(3) */
+        {"%d/%b/%Y:%H:%M:%S %z", "18/July/2017:05:17:03 +0900",
+         1500322623, 0, FLB_TRUE},
+        /* strptime(3) through the cache, same second twice */
+        {"%a %d %b %Y %H:%M:%S.%L", "Mon 17 Jul 2017 20:17:03.1",
+         1500322623, 0.1, FLB_FALSE},
+        {"%a %d %b %Y %H:%M:%S.%L", "Mon 17 Jul 2017 20:17:03.5",
+         1500322623, 0.5, FLB_FALSE},
+        {"%a %d %b %Y %H:%M:%S.%L", "Mon 17 Jul 2017 20:17:04.5",
+         1500322624, 0.5, FLB_FALSE},
+        /* epoch prefix must not match a longer number */
+        {"%s", "1500322623", 1500322623, 0, FLB_FALSE},
+        {"%s", "15003226230", 15003226230, 0, FLB_FALSE},
+    };
+
+    config = flb_malloc(sizeof(struct flb_config));
+    mk_list_init(&config->parsers);
+
+    for (i = 0; i < sizeof(checks) / sizeof(checks[0]); i++) {
+        p = flb_parser_get("fast", config);
+        if (p && strcmp(p->time_fmt, checks[i].fmt) != 0) {
+            flb_parser_destroy(p);
+            p = NULL;
+        }
+        if (!p) {
+            p = flb_parser_create("fast", "json", NULL,
+                                  checks[i].fmt, NULL, NULL, FLB_FALSE,
+                                  NULL, 0, NULL, config);
+        }
+        TEST_CHECK(p != NULL);
+        if (!p) {
+            continue;
+        }
+        TEST_CHECK(p->time_fast == checks[i].fast);
+
+        ret = flb_parser_time_lookup(checks[i].str, strlen(checks[i].str),
+                                     0, p, &tm, &ns);
+        TEST_CHECK(ret == 0);
+
+        epoch = flb_parser_tm2time(&tm);
+        TEST_CHECK(epoch == checks[i].epoch);
+        TEST_CHECK(ns == checks[i].ns);
+        TEST_MSG("%s: epoch=%li ns=%f", checks[i].str, epoch, ns);
+    }
+
+    flb_parser_exit(config);
+    flb_free(config);
+}
+
+/* Regex parser output built from the capture map */
+void test_regex_parser_captures()
+{
+    int ret;
+    char buf[] = "12345 0.99 true 2017-11-28T23:33:46Z";
+    void *out_buf;
+    size_t out_size;
+    size_t off = 0;
+    msgpack_unpacked result;
+    msgpack_object map;
+    msgpack_object *k;
+    msgpack_object *v;
+    struct flb_time out_time;
+    struct flb_parser *p;
+    struct flb_parser_types *types;
+    struct flb_config *config;
+
+    config = flb_malloc(sizeof(struct flb_config));
+    mk_list_init(&config->parsers);
+
+    types = flb_malloc(sizeof(struct flb_parser_types) * 2);
+    types[0].key = flb_strdup("key001");
+    types[0].key_len = 6;
+    types[0].type = FLB_PARSER_TYPE_INT;
+    types[1].key = flb_strdup("key003");
+    types[1].key_len = 6;
+    types[1].type = FLB_PARSER_TYPE_BOOL;
+
+    p = flb_parser_create("captures", "regex",
+                          "^(?<key001>[^ ]*) (?<key002>[^ ]*) "
+                          "(?<key003>[^ ]*)(?<none>X)? (?<time>.+)$",
+                          "%Y-%m-%dT%H:%M:%SZ", NULL, NULL, FLB_FALSE,
+                          types, 2, NULL, config);
+    TEST_CHECK(p != NULL);
+    if (!p) {
+        flb_free(config);
+        return;
+    }
+    TEST_CHECK(p->captures_len == 5);
+
+    ret = flb_parser_regex_do(p, buf, sizeof(buf) - 1,
+                              &out_buf, &out_size, &out_time);
+    TEST_CHECK(ret == sizeof(buf) - 1);
+    TEST_CHECK(out_time.tm.tv_sec == 1511912026);
+
+    msgpack_unpacked_init(&result);
+    ret = msgpack_unpack_next(&result, out_buf, out_size, &off);
+    TEST_CHECK(ret == MSGPACK_UNPACK_SUCCESS);
+    map = result.data;
+    TEST_CHECK(map.type == MSGPACK_OBJECT_MAP);
+
+    /* 'time' is not kept */
+    TEST_CHECK(map.via.map.size == 4);
+    if (map.via.map.size == 4) {
+        k = &map.via.map.ptr[0].key;
+        v = &map.via.map.ptr[0].val;
+        TEST_CHECK(k->via.str.size == 6 &&
+                   strncmp(k->via.str.ptr, "key001", 6) == 0);
+        TEST_CHECK(v->type == MSGPACK_OBJECT_POSITIVE_INTEGER &&
+                   v->via.u64 == 12345);
+
+        v = &map.via.map.ptr[1].val;
+        TEST_CHECK(v->type == MSGPACK_OBJECT_STR && v->via.str.size == 4);
+
+        v = &map.via.map.ptr[2].val;
+        TEST_CHECK(v->type == MSGPACK_OBJECT_BOOLEAN && v->via.boolean);
+
+        /* optional group not taking part of the match */
+        v = &map.via.map.ptr[3].val;
+        TEST_CHECK(v->type == MSGPACK_OBJECT_STR && v->via.str.size == 0);
+    }
+
+    msgpack_unpacked_destroy(&result);
+    flb_free(out_buf);
+    flb_parser_exit(config);
+    flb_free(config);
+}
+
+static int map_check_str(msgpack_object *map, int i,
+                         char *key, char *val)
+{
+    msgpack_object *k = &map->via.map.ptr[i].key;
+    msgpack_object *v = &map->via.map.ptr[i].val;
+
+    if (k->via.str.size != strlen(key) ||
+        strncmp(k->via.str.ptr, key, k->via.str.size) != 0) {
+        return -1;
+    }
+    if (v->type != MSGPACK_OBJECT_STR || v->via.str.size != strlen(val) ||
+        strncmp(v->via.str.ptr, val, v->via.str.size) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/* logfmt and LTSV backends */
+void test_parser_logfmt_ltsv()
+{
+    int ret;
+    char logfmt[] = "level=info msg=\"stop \\\"fetch\\\"\" n=42 "
+        "empty= flag time=\"2017-07-17T20:17:03\"";
+    char ltsv[] = "host:127.0.0.1\tstatus:200\tua:-\t"
+        "time:[18/Jul/2017:05:17:03 +0900]\n";
+    void *out_buf;
+    size_t out_size;
+    size_t off = 0;
+    msgpack_unpacked result;
+    msgpack_object map;
+    struct flb_time out_time;
+    struct flb_parser *p;
+    struct flb_parser_types *types;
+    struct flb_config *config;
+
+    config = flb_malloc(sizeof(struct flb_config));
+    mk_list_init(&config->parsers);
+
+    /* logfmt */
+    types = flb_malloc(sizeof(struct flb_parser_types));
+    types[0].key = flb_strdup("n");
+    types[0].key_len = 1;
+    types[0].type = FLB_PARSER_TYPE_INT;
+    p = flb_parser_create("logfmt", "logfmt", NULL,
+                          "%Y-%m-%dT%H:%M:%S", NULL, NULL, FLB_FALSE,
+                          types, 1, NULL, config);
+    TEST_CHECK(p != NULL);
+
+    ret = flb_parser_do(p, logfmt, sizeof(logfmt) - 1,
+                        &out_buf, &out_size, &out_time);
+    TEST_CHECK(ret != -1);
+    TEST_CHECK(out_time.tm.tv_sec == 1500322623);
+
+    msgpack_unpacked_init(&result);
+    msgpack_unpack_next(&result, out_buf, out_size, &off);
+    map = result.data;
+    TEST_CHECK(map.type == MSGPACK_OBJECT_MAP && map.via.map.size == 5);
+    if (map.via.map.size == 5) {
+        TEST_CHECK(map_check_str(&map, 0, "level", "info") == 0);
+        TEST_CHECK(map_check_str(&map, 1, "msg", "stop \"fetch\"") == 0);
+        TEST_CHECK(map.via.map.ptr[2].val.type ==
+                   MSGPACK_OBJECT_POSITIVE_INTEGER);
+        TEST_CHECK(map_check_str(&map, 3, "empty", "") == 0);
+        TEST_CHECK(map.via.map.ptr[4].val.type == MSGPACK_OBJECT_NIL);
+    }
+    msgpack_unpacked_destroy(&result);
+    flb_free(out_buf);
+
+    /* invalid logfmt */
+    ret = flb_parser_do(p, "a=\"open", 8, &out_buf, &out_size, &out_time);
+    TEST_CHECK(ret == -1);
+
+    /* LTSV */
+    p = flb_parser_create("ltsv", "ltsv", NULL,
+                          "[%d/%b/%Y:%H:%M:%S %z]", NULL, NULL, FLB_TRUE,
+                          NULL, 0, NULL, config);
+    TEST_CHECK(p != NULL);
+
+    ret = flb_parser_do(p, ltsv, sizeof(ltsv) - 1,
+                        &out_buf, &out_size, &out_time);
+    TEST_CHECK(ret != -1);
+    TEST_CHECK(out_time.tm.tv_sec == 1500322623);
+
+    off = 0;
+    msgpack_unpacked_init(&result);
+    msgpack_unpack_next(&result, out_buf, out_size, &off);
+    map = result.data;
+    TEST_CHECK(map.type == MSGPACK_OBJECT_MAP && map.via.map.size == 4);
+    if (map.via.map.size == 4) {
+        TEST_CHECK(map_check_str(&map, 0, "host", "127.0.0.1") == 0);
+        TEST_CHECK(map_check_str(&map, 2, "ua", "-") == 0);
+        TEST_CHECK(map_check_str(&map, 3, "time",
+                                 "[18/Jul/2017:05:17:03 +0900]") == 0);
+    }
+    msgpack_unpacked_destroy(&result);
+    flb_free(out_buf);
+
+    flb_parser_exit(config);
+    flb_free(config);
+}
+
+/* Field decoders applied over the raw record */
+void test_parser_decoders()
+{
+    int ret;
+    char json[] = "myhost {\"status\": 200, \"path\": \"/x\"}";
+    char esc[] = "myhost line1\\nline2";
+    char plain[] = "myhost abc";
+    char utf8[] = "myhost caf\\u00e9";
+    void *out_buf;
+    size_t out_size;
+    size_t off = 0;
+    msgpack_unpacked result;
+    msgpack_object map;
+    struct flb_time out_time;
+    struct flb_parser *p;
+    struct flb_config *config;
+
+    config = flb_malloc(sizeof(struct flb_config));
+    mk_list_init(&config->parsers);
+
+    ret = flb_parser_conf_file(DECODER_PARSERS, config);
+    TEST_CHECK(ret == 0);
+
+    /* Decode_Field json: extra keys at the end of the map */
+    p = flb_parser_get("decode_json", config);
+    TEST_CHECK(p != NULL);
+    ret = flb_parser_do(p, json, sizeof(json) - 1,
+                        &out_buf, &out_size, &out_time);
+    TEST_CHECK(ret != -1);
+
+    msgpack_unpacked_init(&result);
+    ret = msgpack_unpack_next(&result, out_buf, out_size, &off);
+    TEST_CHECK(ret == MSGPACK_UNPACK_SUCCESS && off == out_size);
+    map = result.data;
+    TEST_CHECK(map.type == MSGPACK_OBJECT_MAP && map.via.map.size == 4);
+    if (map.via.map.size == 4) {
+        TEST_CHECK(map_check_str(&map, 0, "host", "myhost") == 0);
+        TEST_CHECK(map.via.map.ptr[2].val.type ==
+                   MSGPACK_OBJECT_POSITIVE_INTEGER);
+        TEST_CHECK(map_check_str(&map, 3, "path", "/x") == 0);
+    }
+    msgpack_unpacked_destroy(&result);
+    flb_free(out_buf);
+
+    /* Decode_Field_As escaped: value replaced in place */
+    p = flb_parser_get("decode_as", config);
+    TEST_CHECK(p != NULL);
+    ret = flb_parser_do(p, esc, sizeof(esc) - 1,
+                        &out_buf, &out_size, &out_time);
+    TEST_CHECK(ret != -1);
+
+    off = 0;
+    msgpack_unpacked_init(&result);
+    msgpack_unpack_next(&result, out_buf, out_size, &off);
+    map = result.data;
+    TEST_CHECK(map.via.map.size == 2);
+    TEST_CHECK(map_check_str(&map, 1, "log", "line1\nline2") == 0);
+    msgpack_unpacked_destroy(&result);
+    flb_free(out_buf);
+
+    /* Decode_Field_As escaped_utf8 */
+    p = flb_parser_get("decode_as_utf8", config);
+    TEST_CHECK(p != NULL);
+    ret = flb_parser_do(p, utf8, sizeof(utf8) - 1,
+                        &out_buf, &out_size, &out_time);
+    TEST_CHECK(ret != -1);
+
+    off = 0;
+    msgpack_unpacked_init(&result);
+    msgpack_unpack_next(&result, out_buf, out_size, &off);
+    map = result.data;
+    TEST_CHECK(map_check_str(&map, 1, "log", "caf\xc3\xa9") == 0);
+    msgpack_unpacked_destroy(&result);
+    flb_free(out_buf);
+
+    /* nothing to unescape, the value is kept as is */
+    ret = flb_parser_do(p, plain, sizeof(plain) - 1,
+                        &out_buf, &out_size, &out_time);
+    TEST_CHECK(ret != -1);
+
+    off = 0;
+    msgpack_unpacked_init(&result);
+    msgpack_unpack_next(&result, out_buf, out_size, &off);
+    map = result.data;
+    TEST_CHECK(map_check_str(&map, 1, "log", "abc") == 0);
+    msgpack_unpacked_destroy(&result);
+    flb_free(out_buf);
+
+    flb_parser_exit(config);
+    flb_free(config);
+}
+
+/* Many declared types resolved through the hash index */
+void test_parser_types_index()
+{
+    int i;
+    int ret;
+    int len;
+    int n = 40;
+    char key[32];
+    char record[1024];
+    void *out_buf;
+    size_t out_size;
+    size_t off = 0;
+    msgpack_unpacked result;
+    msgpack_object map;
+    struct flb_time out_time;
+    struct flb_parser *p;
+    struct flb_parser_types *types;
+    struct flb_config *config;
+
+    config = flb_malloc(sizeof(struct flb_config));
+    mk_list_init(&config->parsers);
+
+    /* Integer keys, a repeated key and an entry without key */
+    types = flb_calloc(n + 2, sizeof(struct flb_parser_types));
+    for (i = 0; i < n; i++) {
+        snprintf(key, sizeof(key) - 1, "key_%i", i);
+        types[i].key = flb_strdup(key);
+        types[i].key_len = strlen(key);
+        types[i].type = FLB_PARSER_TYPE_INT;
+    }
+    types[n].key = flb_strdup("key_0");
+    types[n].key_len = 5;
+    types[n].type = FLB_PARSER_TYPE_BOOL;
+    types[n + 1].type = FLB_PARSER_TYPE_STRING;
+
+    p = flb_parser_create("types", "ltsv", NULL, NULL, NULL, NULL, FLB_FALSE,
+                          types, n + 2, NULL, config);
+    TEST_CHECK(p != NULL);
+    TEST_CHECK(p->types_table != NULL);
+
+    for (i = 0; i < n; i++) {
+        len = snprintf(key, sizeof(key) - 1, "key_%i", i);
+        TEST_CHECK(flb_parser_type_lookup(p, key, len) == FLB_PARSER_TYPE_INT);
+    }
+    TEST_CHECK(flb_parser_type_lookup(p, "key_", 4) == 0);
+    TEST_CHECK(flb_parser_type_lookup(p, "key_400", 7) == 0);
+    TEST_CHECK(flb_parser_type_lookup(p, "", 0) == 0);
+
+    len = 0;
+    for (i = 0; i < n; i++) {
+        len += snprintf(record + len, sizeof(record) - len - 1,
+                        "%skey_%i:%i", i > 0 ? "\t" : "", i, i);
+    }
+    len += snprintf(record + len, sizeof(record) - len - 1, "\tother:1");
+
+    ret = flb_parser_do(p, record, len, &out_buf, &out_size, &out_time);
+    TEST_CHECK(ret != -1);
+
+    msgpack_unpacked_init(&result);
+    msgpack_unpack_next(&result, out_buf, out_size, &off);
+    map = result.data;
+    TEST_CHECK(map.type == MSGPACK_OBJECT_MAP && map.via.map.size == n + 1);
+    if (map.via.map.size == n + 1) {
+        for (i = 0; i < n; i++) {
+            TEST_CHECK(map.via.map.ptr[i].val.type ==
+                       MSGPACK_OBJECT_POSITIVE_INTEGER);
+            TEST_CHECK(map.via.map.ptr[i].val.via.u64 == i);
+        }
+        TEST_CHECK(map_check_str(&map, n, "other", "1") == 0);
+    }
+    msgpack_unpacked_destroy(&result);
+    flb_free(out_buf);
+
+    flb_parser_exit(config);
+    flb_free(config);
+}
+
+/* Regex parsers of a file are compiled by their first flb_parser_get() */
+void test_parser_lazy()
+{
+    int ret;
+    void *out_buf = NULL;
+    size_t out_size = 0;
+    struct flb_time out_time;
+    struct mk_list *head;
+    struct flb_parser *p;
+    struct flb_parser *bad = NULL;
+    struct flb_config *config;
+
+    config = flb_calloc(1, sizeof(struct flb_config));
+    mk_list_init(&config->parsers);
+
+    ret = flb_parser_conf_file(LAZY_PARSERS, config);
+    TEST_CHECK(ret == 0);
+    TEST_CHECK(mk_list_size(&config->parsers) == 2);
+
+    mk_list_foreach(head, &config->parsers) {
+        p = mk_list_entry(head, struct flb_parser, _head);
+        TEST_CHECK(p->regex == NULL);
+        if (strcmp(p->name, "lazy_bad") == 0) {
+            bad = p;
+        }
+    }
+
+    p = flb_parser_get("lazy_ok", config);
+    TEST_CHECK(p != NULL && p->regex != NULL && p->captures_len == 2);
+    TEST_CHECK(flb_parser_get("lazy_ok", config) == p);
+
+    /* the invalid pattern is only reported on lookup */
+    TEST_CHECK(flb_parser_get("lazy_bad", config) == NULL);
+    TEST_CHECK(flb_parser_get("lazy_bad", config) == NULL);
+    TEST_CHECK(bad != NULL && bad->regex_failed == FLB_TRUE);
+    if (bad) {
+        ret = flb_parser_do(bad, "a b", 3, &out_buf, &out_size, &out_time);
+        TEST_CHECK(ret == -1);
+    }
+
+    flb_parser_exit(config);
+    flb_free(config);
+}
+
 TEST_LIST = {
     { "tzone_offset", test_parser_tzone_offset},
     { "time_lookup", test_parser_time_lookup},
     { "json_time_lookup", test_json_parser_time_lookup},
     { "regex_time_lookup", test_regex_parser_time_lookup},
+    { "time_fast_cache", test_parser_time_fast_cache},
+    { "regex_captures", test_regex_parser_captures},
+    { "logfmt_ltsv", test_parser_logfmt_ltsv},
+    { "decoders", test_parser_decoders},
+    { "types_index", test_parser_types_index},
+    { "lazy", test_parser_lazy},
     { 0 }
 };
@@ -0,0 +1,100 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_priority.h>
+
+#include <string.h>
+#include "flb_tests_internal.h"
+
+struct entry {
+    int priority;
+    int seq;
+    struct mk_list _head;
+};
+
+static struct entry *pop(struct flb_priority_queue *q)
+{
+    struct mk_list *head;
+
+    head = flb_priority_queue_pop(q);
+    if (!head) {
+        return NULL;
+    }
+    return mk_list_entry(head, struct entry, _head);
+}
+
+static void test_parse()
+{
+    TEST_CHECK(flb_priority_parse("low") == FLB_PRIORITY_LOW);
+    TEST_CHECK(flb_priority_parse("Normal") == FLB_PRIORITY_NORMAL);
+    TEST_CHECK(flb_priority_parse("HIGH") == FLB_PRIORITY_HIGH);
+    TEST_CHECK(flb_priority_parse("urgent") == -1);
+    TEST_CHECK(strcmp(flb_priority_name(FLB_PRIORITY_HIGH), "high") == 0);
+}
+
+static void test_weighted()
+{
+    int i;
+    int n[FLB_PRIORITY_CLASSES] = {0};
+    char order[16];
+    struct entry e[30];
+    struct entry *p;
+    struct flb_priority_queue q;
+
+    flb_priority_queue_init(&q);
+    TEST_CHECK(flb_priority_queue_empty(&q));
+    TEST_CHECK(pop(&q) == NULL);
+
+    /* Ten entries of each class, queued in creation order */
+    for (i = 0; i < 30; i++) {
+        e[i].priority = i % FLB_PRIORITY_CLASSES;
+        e[i].seq = i;
+        flb_priority_queue_add(&q, &e[i]._head, e[i].priority);
+    }
+    TEST_CHECK(q.count == 30);
+
+    /* One round: four high, two normal and one low */
+    for (i = 0; i < 14; i++) {
+        p = pop(&q);
+        order[i] = flb_priority_name(p->priority)[0];
+        n[p->priority]++;
+    }
+    order[14] = '\0';
+    TEST_CHECK(strcmp(order, "hhhhnnlhhhhnnl") == 0);
+    TEST_MSG("order: %s", order);
+
+    /* FIFO inside a class */
+    p = pop(&q);
+    TEST_CHECK(p->priority == FLB_PRIORITY_HIGH && p->seq == 2 + 3 * 8);
+
+    /* Nothing starves: the remaining ones still come out */
+    while ((p = pop(&q))) {
+        n[p->priority]++;
+    }
+    TEST_CHECK(n[FLB_PRIORITY_LOW] == 10);
+    TEST_CHECK(n[FLB_PRIORITY_NORMAL] == 10);
+    TEST_CHECK(n[FLB_PRIORITY_HIGH] == 9);
+    TEST_CHECK(flb_priority_queue_empty(&q));
+}
+
+static void test_del()
+{
+    struct entry a;
+    struct entry b;
+    struct flb_priority_queue q;
+
+    flb_priority_queue_init(&q);
+    flb_priority_queue_add(&q, &a._head, FLB_PRIORITY_LOW);
+    flb_priority_queue_add(&q, &b._head, FLB_PRIORITY_LOW);
+    flb_priority_queue_del(&q, &a._head);
+    TEST_CHECK(q.count == 1);
+    TEST_CHECK(pop(&q) == &b);
+    TEST_CHECK(flb_priority_queue_empty(&q));
+}
+
+TEST_LIST = {
+    { "parse",    test_parse},
+    { "weighted", test_weighted},
+    { "del",      test_del},
+    { 0 }
+};
@@ -0,0 +1,120 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_config.h>
+#include <fluent-bit/flb_procfs.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "flb_tests_internal.h"
+
+void test_parse_helpers()
+{
+    char buf[] = "cpu  10 -20\t30 x 40\nnext line\n";
+    char *p = buf + 3;
+
+    TEST_CHECK(flb_procfs_u64(&p) == 10);
+    TEST_CHECK(flb_procfs_i64(&p) == -20);
+    TEST_CHECK(flb_procfs_u64(&p) == 30);
+
+    p = flb_procfs_skip(p, 1);
+    TEST_CHECK(flb_procfs_u64(&p) == 40);
+
+    p = flb_procfs_next_line(p);
+    TEST_CHECK(strncmp(p, "next", 4) == 0);
+    p = flb_procfs_next_line(p);
+    TEST_CHECK(*p == '\0');
+    p = flb_procfs_next_line(p);
+    TEST_CHECK(*p == '\0');
+}
+
+/* The same descriptor is read again on every call */
+void test_file_read()
+{
+    size_t size;
+    char *buf;
+    char *p;
+    struct flb_procfs_file *file;
+
+    file = flb_procfs_file_open("/proc/self/stat");
+    TEST_CHECK(file != NULL);
+    if (!file) {
+        return;
+    }
+
+    buf = flb_procfs_file_read(file, &size);
+    TEST_CHECK(buf != NULL && size > 0);
+    TEST_CHECK(strlen(buf) == size);
+
+    p = buf;
+    TEST_CHECK(flb_procfs_u64(&p) == (uint64_t) getpid());
+
+    buf = flb_procfs_file_read(file, &size);
+    TEST_CHECK(buf != NULL && size > 0);
+    flb_procfs_file_close(file);
+
+    TEST_CHECK(flb_procfs_file_open("/proc/flb-does-not-exist") == NULL);
+}
+
+/* Larger than the default buffer */
+void test_file_grow()
+{
+    size_t size;
+    char *buf;
+    struct flb_procfs_file *file;
+
+    file = flb_procfs_file_open("/proc/self/smaps");
+    TEST_CHECK(file != NULL);
+    if (!file) {
+        return;
+    }
+
+    buf = flb_procfs_file_read(file, &size);
+    TEST_CHECK(buf != NULL);
+    TEST_CHECK(strlen(buf) == size);
+    TEST_CHECK(file->buf_size > size);
+    flb_procfs_file_close(file);
+}
+
+void test_shared()
+{
+    size_t size;
+    char *buf;
+    struct flb_config *config;
+    struct flb_procfs_file *a;
+    struct flb_procfs_file *b;
+
+    config = flb_config_init();
+
+    a = flb_procfs_get(config, "/proc/stat");
+    b = flb_procfs_get(config, "/proc/stat");
+    TEST_CHECK(a != NULL && a == b);
+    TEST_CHECK(a->users == 2);
+
+    /* Within the sample window the content is not read again */
+    buf = flb_procfs_sample(a, &size);
+    TEST_CHECK(buf != NULL && strncmp(buf, "cpu ", 4) == 0);
+    TEST_CHECK(flb_procfs_sample(b, NULL) == buf);
+    TEST_CHECK(a->len == size);
+
+    flb_procfs_put(config, a);
+    TEST_CHECK(mk_list_size(&config->procfs_files) == 1);
+    flb_procfs_put(config, b);
+    TEST_CHECK(mk_list_size(&config->procfs_files) == 0);
+
+    /* Files still registered are released with the context */
+    a = flb_procfs_get(config, "/proc/meminfo");
+    TEST_CHECK(a != NULL);
+    flb_config_exit(config);
+}
+
+TEST_LIST = {
+    {"parse_helpers", test_parse_helpers},
+    {"file_read",     test_file_read},
+    {"file_grow",     test_file_grow},
+    {"shared",        test_shared},
+    { 0 }
+};
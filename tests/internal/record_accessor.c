@@ -0,0 +1,133 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_pack.h>
+#include <fluent-bit/flb_record_accessor.h>
+
+#include <msgpack.h>
+#include <string.h>
+
+#include "flb_tests_internal.h"
+
+#define JSON_RECORD                                                     \
+    "{\"log\": \"hello\", \"level\": 3, \"a.b\": \"dot\","              \
+    " \"kubernetes\": {\"pod\": \"p1\", \"labels\": {\"app\": \"web\"}},"  \
+    " \"items\": [{\"name\": \"first\"}, {\"name\": \"second\"}]}"
+
+static void unpack_record(msgpack_unpacked *result, char **buf)
+{
+    int ret;
+    size_t size;
+    size_t off = 0;
+
+    ret = flb_pack_json(JSON_RECORD, sizeof(JSON_RECORD) - 1, buf, &size);
+    TEST_CHECK(ret == 0);
+
+    msgpack_unpacked_init(result);
+    ret = msgpack_unpack_next(result, *buf, size, &off);
+    TEST_CHECK(ret == MSGPACK_UNPACK_SUCCESS);
+    TEST_CHECK(result->data.type == MSGPACK_OBJECT_MAP);
+}
+
+static int ra_str(char *pattern, msgpack_object map, char *expected)
+{
+    int ret;
+    int len;
+    char *str;
+    struct flb_record_accessor *ra;
+
+    ra = flb_ra_create(pattern);
+    if (!ra) {
+        return FLB_FALSE;
+    }
+    ret = flb_ra_get_str(ra, map, &str, &len);
+    flb_ra_destroy(ra);
+
+    if (!expected) {
+        return ret == -1;
+    }
+    return (ret == 0 && len == strlen(expected) &&
+            memcmp(str, expected, len) == 0);
+}
+
+static void test_parse()
+{
+    struct flb_record_accessor *ra;
+
+    ra = flb_ra_create("$kubernetes['labels'][\"app\"][2]");
+    TEST_CHECK(ra != NULL);
+    TEST_CHECK(ra->steps_len == 4);
+    TEST_CHECK(ra->steps[0].type == FLB_RA_KEY && ra->steps[0].len == 10);
+    TEST_CHECK(ra->steps[1].type == FLB_RA_KEY &&
+               memcmp(ra->steps[1].key, "labels", 6) == 0);
+    TEST_CHECK(ra->steps[2].type == FLB_RA_KEY && ra->steps[2].len == 3);
+    TEST_CHECK(ra->steps[3].type == FLB_RA_INDEX && ra->steps[3].index == 2);
+    TEST_CHECK(flb_ra_is_first_level(ra) == FLB_FALSE);
+    flb_ra_destroy(ra);
+
+    /* A plain key is taken as it is */
+    ra = flb_ra_create("a['b']");
+    TEST_CHECK(ra != NULL && flb_ra_is_first_level(ra) == FLB_TRUE);
+    TEST_CHECK(ra->steps[0].len == 6);
+    flb_ra_destroy(ra);
+
+    /* Invalid patterns */
+    TEST_CHECK(flb_ra_create("") == NULL);
+    TEST_CHECK(flb_ra_create("$") == NULL);
+    TEST_CHECK(flb_ra_create("$['a']") == NULL);
+    TEST_CHECK(flb_ra_create("$a[") == NULL);
+    TEST_CHECK(flb_ra_create("$a['b'") == NULL);
+    TEST_CHECK(flb_ra_create("$a['']") == NULL);
+    TEST_CHECK(flb_ra_create("$a[x]") == NULL);
+    TEST_CHECK(flb_ra_create("$a['b']c") == NULL);
+}
+
+static void test_get()
+{
+    char *buf;
+    msgpack_object *o;
+    msgpack_unpacked result;
+    struct flb_record_accessor *ra;
+
+    unpack_record(&result, &buf);
+
+    TEST_CHECK(ra_str("log", result.data, "hello"));
+    TEST_CHECK(ra_str("$log", result.data, "hello"));
+    TEST_CHECK(ra_str("a.b", result.data, "dot"));
+    TEST_CHECK(ra_str("$kubernetes['pod']", result.data, "p1"));
+    TEST_CHECK(ra_str("$kubernetes['labels']['app']", result.data, "web"));
+    TEST_CHECK(ra_str("$items[1]['name']", result.data, "second"));
+
+    /* Missing keys, out of range and type mismatches */
+    TEST_CHECK(ra_str("$nope", result.data, NULL));
+    TEST_CHECK(ra_str("$kubernetes['labels']['nope']", result.data, NULL));
+    TEST_CHECK(ra_str("$items[2]['name']", result.data, NULL));
+    TEST_CHECK(ra_str("$log['x']", result.data, NULL));
+    TEST_CHECK(ra_str("$kubernetes[0]", result.data, NULL));
+    TEST_CHECK(ra_str("$level", result.data, NULL));
+
+    /* Non string values, no copies */
+    ra = flb_ra_create("$level");
+    o = flb_ra_get(ra, result.data);
+    TEST_CHECK(o != NULL && o->type == MSGPACK_OBJECT_POSITIVE_INTEGER);
+    TEST_CHECK(o == &result.data.via.map.ptr[1].val);
+
+    /* The position hint is followed, and fixed when it's stale */
+    TEST_CHECK(ra->steps[0].hint == 1);
+    ra->steps[0].hint = 3;
+    TEST_CHECK(flb_ra_get(ra, result.data) == o);
+    TEST_CHECK(ra->steps[0].hint == 1);
+    ra->steps[0].hint = 1000;
+    TEST_CHECK(flb_ra_get(ra, result.data) == o);
+    flb_ra_destroy(ra);
+
+    msgpack_unpacked_destroy(&result);
+    flb_free(buf);
+}
+
+TEST_LIST = {
+    { "parse", test_parse},
+    { "get"  , test_get},
+    { 0 }
+};
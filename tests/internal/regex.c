@@ -0,0 +1,209 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_regex.h>
+
+#include <pthread.h>
+#include <string.h>
+
+#include "flb_tests_internal.h"
+
+struct regex_literal_test {
+    char *pattern;
+    char *literal;
+};
+
+struct regex_literal_test literals[] = {
+    {"abc",                       "abc"},
+    {"/^foo bar$/",               "foo bar"},
+    {"^\\[(?<time>[^\\]]*)\\] (?<msg>.*)$", "] "},
+    {"^(?<host>[^ ]*) - GET /index\\.html", " - GET /index.html"},
+    {"ab?cdef",                   "cdef"},
+    {"abcd*ef",                   "abc"},
+    {"xa+bcd",                    "abcd"},
+    {"ab{2,3}c",                  "a"},
+    {"(foo)?bar(baz)*",           "bar"},
+    {"a\\dbc\\.",                 "bc."},
+    {"[abc]de[^(]fg",             "de"},
+    {"(?<tag>[^.]+)?\\.?(?<pod_name>[a-z0-9-]+)_(?<ns>[^_]+)_"
+     "(?<container>.+)-(?<docker_id>[a-z0-9]{64})\\.log$",  ".log"},
+
+    /* Prefilter disabled */
+    {"foo|bar",                   ""},
+    {"(?i)foo",                   ""},
+    {"(a)\\1",                    ""},
+    {"\\x41BC",                   ""},
+    {"\\p{Alpha}xyz",             ""},
+    {"[]a]bcd",                   ""},
+    {".*",                        ""},
+    {NULL, NULL}
+};
+
+void test_regex_literal()
+{
+    int len;
+    struct flb_regex *r;
+    struct regex_literal_test *t;
+
+    flb_regex_init();
+
+    for (t = literals; t->pattern; t++) {
+        r = flb_regex_create((unsigned char *) t->pattern);
+        TEST_CHECK(r != NULL);
+        if (!r) {
+            continue;
+        }
+
+        len = strlen(t->literal);
+        if (!TEST_CHECK(r->literal_len == len &&
+                        memcmp(r->literal, t->literal, len) == 0)) {
+            TEST_MSG("pattern '%s': expected '%s', got '%.*s'",
+                     t->pattern, t->literal, r->literal_len, r->literal);
+        }
+        flb_regex_destroy(r);
+    }
+
+    flb_regex_exit();
+}
+
+struct regex_match_test {
+    char *pattern;
+    char *str;
+    int match;
+};
+
+struct regex_match_test matches[] = {
+    {"abc",            "xxabcxx",             1},
+    {"abc",            "xxabxcx",             0},
+    {"abc",            "ab",                  0},
+    {"xa+bcd",         "xaaabcd",             1},
+    {"ab+?c",          "abbc",                1},
+    {"a(b)?c",         "ac",                  1},
+    {"ab?cdef",        "acdef",               1},
+    {"foo|bar",        "bar",                 1},
+    {"(?i)foo",        "FOO",                 1},
+    {"(?<a>x)(?<b>y)", "zxy",                 1},
+    {"(?<a>x)(?<b>y)", "zyx",                 0},
+    {"\\.log$",        "a.log",               1},
+    {"\\.log$",        "a.log.1",             0},
+    {NULL, NULL, 0}
+};
+
+void test_regex_match()
+{
+    int ret;
+    ssize_t n;
+    struct flb_regex *r;
+    struct flb_regex_search result;
+    struct regex_match_test *t;
+
+    flb_regex_init();
+
+    for (t = matches; t->pattern; t++) {
+        r = flb_regex_create((unsigned char *) t->pattern);
+        TEST_CHECK(r != NULL);
+        if (!r) {
+            continue;
+        }
+
+        ret = flb_regex_match(r, (unsigned char *) t->str, strlen(t->str));
+        if (!TEST_CHECK(ret == t->match)) {
+            TEST_MSG("pattern '%s' on '%s': expected %i, got %i",
+                     t->pattern, t->str, t->match, ret);
+        }
+
+        /* The full search must agree */
+        n = flb_regex_do(r, (unsigned char *) t->str, strlen(t->str),
+                         &result);
+        TEST_CHECK((n >= 0) == (t->match == 1));
+        if (n > 0) {
+            flb_regex_results_release(&result);
+        }
+        flb_regex_destroy(r);
+    }
+
+    flb_regex_exit();
+}
+
+#define SHARED_PATTERN "^(?<host>[^ ]*) (?<code>[0-9]+)$"
+#define SHARED_THREADS 4
+
+static void cb_shared(unsigned char *name, unsigned char *value,
+                      size_t vlen, void *data)
+{
+    int *found = data;
+
+    if (strcmp((char *) name, "code") == 0 && vlen == 3 &&
+        memcmp(value, "200", 3) == 0) {
+        (*found)++;
+    }
+}
+
+/* Every thread searches the same compiled regex with its own regions */
+static void *shared_worker(void *data)
+{
+    int i;
+    int n;
+    int found = 0;
+    char *str = "example.com 200";
+    struct flb_regex *r;
+    struct flb_regex_search result;
+
+    r = flb_regex_get((unsigned char *) SHARED_PATTERN);
+    for (i = 0; i < 10000; i++) {
+        n = flb_regex_do(r, (unsigned char *) str, strlen(str), &result);
+        if (n > 0) {
+            flb_regex_parse(r, &result, cb_shared, &found);
+        }
+    }
+    flb_regex_put(r);
+    flb_regex_thread_exit();
+
+    *((int *) data) = found;
+    return NULL;
+}
+
+void test_regex_shared()
+{
+    int i;
+    int found[SHARED_THREADS];
+    pthread_t tid[SHARED_THREADS];
+    struct flb_regex *r1;
+    struct flb_regex *r2;
+
+    flb_regex_init();
+
+    /* The same pattern is compiled once */
+    r1 = flb_regex_get((unsigned char *) SHARED_PATTERN);
+    r2 = flb_regex_get((unsigned char *) SHARED_PATTERN);
+    TEST_CHECK(r1 != NULL && r1 == r2);
+    TEST_CHECK(r1->refs == 2);
+    TEST_CHECK(flb_regex_get((unsigned char *) "((") == NULL);
+
+    for (i = 0; i < SHARED_THREADS; i++) {
+        pthread_create(&tid[i], NULL, shared_worker, &found[i]);
+    }
+    for (i = 0; i < SHARED_THREADS; i++) {
+        pthread_join(tid[i], NULL);
+        TEST_CHECK(found[i] == 10000);
+        TEST_MSG("thread %i: %i matches", i, found[i]);
+    }
+    TEST_CHECK(r1->refs == 2);
+
+    flb_regex_put(r2);
+    flb_regex_put(r1);
+
+    /* Released with the last reference, next get compiles it again */
+    r1 = flb_regex_get((unsigned char *) SHARED_PATTERN);
+    TEST_CHECK(r1 != NULL && r1->refs == 1);
+    flb_regex_put(r1);
+
+    flb_regex_exit();
+}
+
+TEST_LIST = {
+    { "literal", test_regex_literal },
+    { "match",   test_regex_match },
+    { "shared",  test_regex_shared },
+    { 0 }
+};
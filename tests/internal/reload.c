@@ -0,0 +1,276 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_str.h>
+#include <fluent-bit/flb_log.h>
+#include <fluent-bit/flb_config.h>
+#include <fluent-bit/flb_input.h>
+#include <fluent-bit/flb_filter.h>
+#include <fluent-bit/flb_output.h>
+#include <fluent-bit/flb_router.h>
+#include <fluent-bit/flb_task.h>
+#include <fluent-bit/flb_reload.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "flb_tests_internal.h"
+
+#define CONF_IN                                 \
+    "[INPUT]\n"                                 \
+    "    Name dummy\n"                          \
+    "    Tag  app.foo\n"
+
+#define CONF_OUT_APP                            \
+    "[OUTPUT]\n"                                \
+    "    Name  null\n"                          \
+    "    Match app.*\n"
+
+#define CONF_OUT_ALL                            \
+    "[OUTPUT]\n"                                \
+    "    Name  null\n"                          \
+    "    Match *\n"
+
+#define CONF_HEAD CONF_IN CONF_OUT_ALL
+
+#define CONF_APP                                \
+    "[FILTER]\n"                                \
+    "    Name  stdout\n"                        \
+    "    Match app.*\n"
+
+#define CONF_WEB                                \
+    "[FILTER]\n"                                \
+    "    Name  stdout\n"                        \
+    "    Match web.*\n"
+
+static void conf_write(char *path, char *content)
+{
+    FILE *f;
+
+    f = fopen(path, "w");
+    TEST_CHECK(f != NULL);
+    fputs(content, f);
+    fclose(f);
+}
+
+static struct flb_filter_instance *filter_at(struct flb_config *config, int n)
+{
+    struct mk_list *head;
+
+    mk_list_foreach(head, &config->filters) {
+        if (n-- == 0) {
+            return mk_list_entry(head, struct flb_filter_instance, _head);
+        }
+    }
+
+    return NULL;
+}
+
+static void test_filters()
+{
+    int fd;
+    char path[] = "/tmp/flb-reload-XXXXXX";
+    struct flb_config *config;
+    struct flb_filter_instance *app;
+    struct flb_filter_instance *web;
+
+    fd = mkstemp(path);
+    TEST_CHECK(fd != -1);
+    close(fd);
+
+    config = flb_config_init();
+    TEST_CHECK(config != NULL);
+    if (!config) {
+        return;
+    }
+    config->log = flb_log_init(config, FLB_LOG_STDERR, FLB_LOG_INFO, NULL);
+    config->conf_file = flb_strdup(path);
+
+    /* Running chain */
+    app = flb_filter_new(config, "stdout", NULL);
+    flb_filter_set_property(app, "match", "app.*");
+    flb_filter_initialize_all(config);
+    conf_write(path, CONF_HEAD CONF_APP);
+
+    /* Disabled by default */
+    TEST_CHECK(flb_reload_init(config) == 0);
+    TEST_CHECK(flb_reload(config) == -1);
+
+    config->hot_reload = FLB_TRUE;
+    TEST_CHECK(flb_reload_init(config) == 0);
+
+    /* Nothing changed: the running instance is kept */
+    TEST_CHECK(flb_reload(config) == 0);
+    TEST_CHECK(mk_list_size(&config->filters) == 1);
+    TEST_CHECK(filter_at(config, 0) == app);
+
+    /* A new filter is appended with its own id */
+    conf_write(path, CONF_HEAD CONF_APP CONF_WEB);
+    TEST_CHECK(flb_reload(config) == 0);
+    TEST_CHECK(mk_list_size(&config->filters) == 2);
+    TEST_CHECK(filter_at(config, 0) == app);
+    web = filter_at(config, 1);
+    TEST_CHECK(web != NULL && strcmp(web->name, "stdout.1") == 0);
+
+    /* An invalid filter aborts the reload */
+    conf_write(path, CONF_HEAD CONF_WEB "[FILTER]\n    Name nosuch\n");
+    TEST_CHECK(flb_reload(config) == -1);
+    TEST_CHECK(mk_list_size(&config->filters) == 2);
+    TEST_CHECK(filter_at(config, 0) == app);
+
+    /* Removed filters are released, the others keep their instance */
+    conf_write(path, CONF_HEAD CONF_WEB);
+    TEST_CHECK(flb_reload(config) == 0);
+    TEST_CHECK(mk_list_size(&config->filters) == 1);
+    TEST_CHECK(filter_at(config, 0) == web);
+
+    /* Inputs are not reloaded, the change is only reported */
+    conf_write(path, "[INPUT]\n    Name cpu\n" CONF_OUT_ALL CONF_WEB);
+    TEST_CHECK(flb_reload(config) == 0);
+    TEST_CHECK(filter_at(config, 0) == web);
+
+    flb_filter_exit(config);
+    flb_output_exit(config);
+    flb_config_exit(config);
+    unlink(path);
+}
+
+static struct flb_output_instance *output_at(struct flb_config *config, int n)
+{
+    struct mk_list *head;
+
+    mk_list_foreach(head, &config->outputs) {
+        if (n-- == 0) {
+            return mk_list_entry(head, struct flb_output_instance, _head);
+        }
+    }
+
+    return NULL;
+}
+
+/* Is the input statically routed to the output ? */
+static int routed(struct flb_input_instance *in, struct flb_output_instance *out)
+{
+    struct mk_list *head;
+    struct flb_router_path *path;
+
+    mk_list_foreach(head, &in->routes) {
+        path = mk_list_entry(head, struct flb_router_path, _head);
+        if (path->ins == out) {
+            return FLB_TRUE;
+        }
+    }
+
+    return FLB_FALSE;
+}
+
+static void test_outputs()
+{
+    int fd;
+    char path[] = "/tmp/flb-reload-XXXXXX";
+    struct flb_task task;
+    struct flb_task_route route;
+    struct flb_config *config;
+    struct flb_input_instance *in;
+    struct flb_output_instance *app;
+    struct flb_output_instance *all;
+    struct flb_output_instance *out;
+
+    fd = mkstemp(path);
+    TEST_CHECK(fd != -1);
+    close(fd);
+
+    config = flb_config_init();
+    TEST_CHECK(config != NULL);
+    if (!config) {
+        return;
+    }
+    config->log = flb_log_init(config, FLB_LOG_STDERR, FLB_LOG_INFO, NULL);
+    config->conf_file = flb_strdup(path);
+    config->hot_reload = FLB_TRUE;
+
+    /* The input registers its collector */
+    config->evl = mk_event_loop_create(8);
+    TEST_CHECK(config->evl != NULL);
+
+    /* Running pipeline */
+    in = flb_input_new(config, "dummy", NULL);
+    TEST_CHECK(in != NULL);
+    flb_input_set_property(in, "tag", "app.foo");
+    flb_input_instance_init(in, config);
+    app = flb_output_new(config, "null", NULL);
+    flb_output_set_property(app, "match", "app.*");
+    TEST_CHECK(flb_output_init(config) == 0);
+    flb_router_io_set(config);
+    TEST_CHECK(flb_reload_init(config) == 0);
+
+    /* Nothing changed: the running instance is kept */
+    conf_write(path, CONF_IN CONF_OUT_APP);
+    TEST_CHECK(flb_reload(config) == 0);
+    TEST_CHECK(mk_list_size(&config->outputs) == 1);
+    TEST_CHECK(output_at(config, 0) == app);
+
+    /* A new output is started and the input is routed to both */
+    conf_write(path, CONF_IN CONF_OUT_APP CONF_OUT_ALL);
+    TEST_CHECK(flb_reload(config) == 0);
+    TEST_CHECK(mk_list_size(&config->outputs) == 2);
+    TEST_CHECK(output_at(config, 0) == app);
+    all = output_at(config, 1);
+    TEST_CHECK(all != NULL && strcmp(all->name, "null.1") == 0);
+    TEST_CHECK(all->mask_id == 2);
+    TEST_CHECK(routed(in, app) == FLB_TRUE && routed(in, all) == FLB_TRUE);
+
+    /* An unknown output aborts the reload */
+    conf_write(path, CONF_IN CONF_OUT_ALL "[OUTPUT]\n    Name nosuch\n");
+    TEST_CHECK(flb_reload(config) == -1);
+    TEST_CHECK(mk_list_size(&config->outputs) == 2);
+    TEST_CHECK(output_at(config, 0) == app);
+
+    /* A removed output with a pending task is retired until it drains */
+    memset(&task, 0, sizeof(task));
+    mk_list_init(&task.routes);
+    mk_list_init(&task.retries);
+    mk_list_init(&task.threads);
+    mk_list_add(&task._head, &in->tasks);
+    route.out = app;
+    route.task = &task;
+    mk_list_add(&route._head, &task.routes);
+
+    conf_write(path, CONF_IN CONF_OUT_ALL);
+    TEST_CHECK(flb_reload(config) == 0);
+    TEST_CHECK(mk_list_size(&config->outputs) == 1);
+    TEST_CHECK(output_at(config, 0) == all);
+    TEST_CHECK(routed(in, app) == FLB_FALSE && routed(in, all) == FLB_TRUE);
+    TEST_CHECK(mk_list_size(&config->outputs_retired) == 1);
+    TEST_CHECK(flb_output_retired_cleanup(config) == 1);
+
+    /* The task is done: the retired instance is released */
+    mk_list_del(&route._head);
+    mk_list_del(&task._head);
+    TEST_CHECK(flb_output_retired_cleanup(config) == 0);
+    TEST_CHECK(mk_list_size(&config->outputs_retired) == 0);
+
+    /* Added again: a new id, the free routing bit is reused */
+    conf_write(path, CONF_IN CONF_OUT_APP CONF_OUT_ALL);
+    TEST_CHECK(flb_reload(config) == 0);
+    TEST_CHECK(mk_list_size(&config->outputs) == 2);
+    out = output_at(config, 0);
+    TEST_CHECK(out != NULL && strcmp(out->name, "null.2") == 0);
+    TEST_CHECK(out->mask_id == 1);
+    TEST_CHECK(output_at(config, 1) == all);
+    TEST_CHECK(routed(in, out) == FLB_TRUE);
+
+    flb_router_exit(config);
+    flb_input_exit_all(config);
+    flb_output_exit(config);
+    flb_config_exit(config);
+    unlink(path);
+}
+
+TEST_LIST = {
+    { "filters", test_filters},
+    { "outputs", test_outputs},
+    { 0 }
+};
@@ -0,0 +1,111 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_ring.h>
+
+#include <pthread.h>
+#include <sched.h>
+#include "flb_tests_internal.h"
+
+#define MESSAGES  1000000
+
+struct msg {
+    uint64_t seq;
+    char pad[24];
+};
+
+static void test_ring_usage()
+{
+    int i;
+    int ret;
+    struct msg m;
+    struct flb_ring *ring;
+
+    /* Slots are rounded up to a power of two */
+    ring = flb_ring_create(sizeof(struct msg), 5);
+    TEST_CHECK(ring != NULL);
+    TEST_CHECK(ring->mask == 7);
+    TEST_CHECK(flb_ring_empty(ring) == 1);
+
+    ret = flb_ring_pop(ring, &m);
+    TEST_CHECK(ret == -1);
+
+    for (i = 0; i < 8; i++) {
+        m.seq = i;
+        ret = flb_ring_push(ring, &m);
+        TEST_CHECK(ret == 0);
+    }
+
+    /* Full */
+    ret = flb_ring_push(ring, &m);
+    TEST_CHECK(ret == -1);
+    TEST_CHECK(flb_ring_empty(ring) == 0);
+
+    for (i = 0; i < 8; i++) {
+        ret = flb_ring_pop(ring, &m);
+        TEST_CHECK(ret == 0);
+        TEST_CHECK(m.seq == i);
+    }
+    TEST_CHECK(flb_ring_empty(ring) == 1);
+
+    flb_ring_destroy(ring);
+}
+
+static void *consumer(void *data)
+{
+    uint64_t next = 0;
+    uint64_t *errors;
+    struct msg m;
+    struct flb_ring *ring = data;
+
+    errors = calloc(1, sizeof(uint64_t));
+    while (next < MESSAGES) {
+        if (flb_ring_pop(ring, &m) == -1) {
+            sched_yield();
+            continue;
+        }
+        if (m.seq != next) {
+            (*errors)++;
+        }
+        next++;
+    }
+
+    return errors;
+}
+
+static void test_ring_threads()
+{
+    int ret;
+    uint64_t i;
+    uint64_t *errors;
+    pthread_t tid;
+    struct msg m;
+    struct flb_ring *ring;
+
+    ring = flb_ring_create(sizeof(struct msg), 64);
+    TEST_CHECK(ring != NULL);
+
+    ret = pthread_create(&tid, NULL, consumer, ring);
+    TEST_CHECK(ret == 0);
+
+    /* Messages must arrive complete and in order */
+    memset(&m, '\0', sizeof(m));
+    for (i = 0; i < MESSAGES; i++) {
+        m.seq = i;
+        while (flb_ring_push(ring, &m) == -1) {
+            sched_yield();
+        }
+    }
+
+    pthread_join(tid, (void **) &errors);
+    TEST_CHECK(*errors == 0);
+    free(errors);
+
+    flb_ring_destroy(ring);
+}
+
+TEST_LIST = {
+    { "usage"  , test_ring_usage},
+    { "threads", test_ring_threads},
+    { 0 }
+};
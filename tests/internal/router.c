@@ -0,0 +1,131 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_config.h>
+#include <fluent-bit/flb_filter.h>
+#include <fluent-bit/flb_output.h>
+#include <fluent-bit/flb_router.h>
+
+#include "flb_tests_internal.h"
+
+static void test_match()
+{
+    TEST_CHECK(flb_router_match("app.foo", "*") == 1);
+    TEST_CHECK(flb_router_match("app.foo", "app.*") == 1);
+    TEST_CHECK(flb_router_match("app.foo", "app.foo") == 1);
+    TEST_CHECK(flb_router_match("app.foo", "*.foo") == 1);
+    TEST_CHECK(flb_router_match("app.foo", "app.bar") == 0);
+    TEST_CHECK(flb_router_match("app.foo", "web.*") == 0);
+}
+
+static void test_cache()
+{
+    struct flb_config *config;
+    struct flb_output_instance *o_app;
+    struct flb_output_instance *o_all;
+    struct flb_filter_instance *f_ins;
+    struct flb_router_cache_entry *route;
+    struct flb_router_cache_entry *cached;
+
+    config = flb_config_init();
+    TEST_CHECK(config != NULL);
+
+    o_app = flb_output_new(config, "null", NULL);
+    TEST_CHECK(o_app != NULL);
+    flb_output_set_property(o_app, "match", "app.*");
+
+    o_all = flb_output_new(config, "null", NULL);
+    TEST_CHECK(o_all != NULL);
+    flb_output_set_property(o_all, "match", "*");
+
+    f_ins = flb_filter_new(config, "stdout", NULL);
+    TEST_CHECK(f_ins != NULL);
+    flb_filter_set_property(f_ins, "match", "app.foo");
+
+    /* Tag matching everything */
+    route = flb_router_cache_get("app.foo", 7, config);
+    TEST_CHECK(route != NULL);
+    TEST_CHECK(route->routes_mask == (o_app->mask_id | o_all->mask_id));
+    TEST_CHECK(route->filters_count == 1);
+    TEST_CHECK(route->filters[0] == f_ins);
+
+    /* Same lookup must hit the cached entry */
+    cached = flb_router_cache_get("app.foo", 7, config);
+    TEST_CHECK(cached == route);
+
+    /* Tag matching the catch-all output only */
+    route = flb_router_cache_get("web.bar", 7, config);
+    TEST_CHECK(route != NULL);
+    TEST_CHECK(route->routes_mask == o_all->mask_id);
+    TEST_CHECK(route->filters_count == 0);
+
+    /* Changing a match rule invalidates the cache */
+    flb_filter_set_property(f_ins, "match", "web.*");
+    TEST_CHECK(config->router_cache == NULL);
+
+    route = flb_router_cache_get("web.bar", 7, config);
+    TEST_CHECK(route != NULL);
+    TEST_CHECK(route->filters_count == 1);
+
+    flb_filter_exit(config);
+    TEST_CHECK(config->router_cache == NULL);
+
+    flb_output_exit(config);
+    flb_config_exit(config);
+}
+
+static void test_filter_threaded()
+{
+    int ret;
+    msgpack_sbuffer mp_sbuf;
+    msgpack_packer mp_pck;
+    struct flb_config *config;
+    struct flb_filter_instance *f_ins;
+
+    config = flb_config_init();
+    TEST_CHECK(config != NULL);
+
+    f_ins = flb_filter_new(config, "stdout", NULL);
+    TEST_CHECK(f_ins != NULL);
+    flb_filter_set_property(f_ins, "match", "app.*");
+
+    msgpack_sbuffer_init(&mp_sbuf);
+    msgpack_packer_init(&mp_pck, &mp_sbuf, msgpack_sbuffer_write);
+    msgpack_pack_array(&mp_pck, 2);
+    msgpack_pack_uint64(&mp_pck, 0);
+    msgpack_pack_map(&mp_pck, 0);
+
+    /* The stdout filter is not thread safe, the engine must run it */
+    ret = flb_filter_do_threaded(&mp_sbuf, &mp_pck,
+                                 mp_sbuf.data, mp_sbuf.size,
+                                 "app.foo", 7, config);
+    TEST_CHECK(ret == -1);
+    TEST_CHECK(mp_sbuf.size == 3);
+
+    /* No filter for this tag */
+    ret = flb_filter_do_threaded(&mp_sbuf, &mp_pck,
+                                 mp_sbuf.data, mp_sbuf.size,
+                                 "web.bar", 7, config);
+    TEST_CHECK(ret == 0);
+    TEST_CHECK(mp_sbuf.size == 3);
+
+    /* Flagged filters can run in the caller thread */
+    f_ins->p->flags |= FLB_FILTER_THREAD_SAFE;
+    ret = flb_filter_do_threaded(&mp_sbuf, &mp_pck,
+                                 mp_sbuf.data, mp_sbuf.size,
+                                 "app.foo", 7, config);
+    TEST_CHECK(ret == 0);
+    TEST_CHECK(mp_sbuf.size == 3);
+    f_ins->p->flags &= ~FLB_FILTER_THREAD_SAFE;
+
+    msgpack_sbuffer_destroy(&mp_sbuf);
+    flb_filter_exit(config);
+    flb_config_exit(config);
+}
+
+TEST_LIST = {
+    { "match", test_match },
+    { "cache", test_cache },
+    { "filter_threaded", test_filter_threaded },
+    { 0 }
+};
@@ -0,0 +1,174 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_config.h>
+#include <fluent-bit/flb_engine.h>
+#include <fluent-bit/flb_scheduler.h>
+#include <fluent-bit/flb_time.h>
+
+#include "flb_tests_internal.h"
+
+static int expired;
+
+static void cb_timer(struct flb_config *config, void *data)
+{
+    int *val = data;
+
+    (*val)++;
+    expired++;
+}
+
+static struct flb_config *sched_config()
+{
+    int ret;
+    struct flb_config *config;
+
+    config = flb_config_init();
+    if (!config) {
+        return NULL;
+    }
+
+    config->evl = mk_event_loop_create(64);
+    ret = flb_sched_init(config);
+    if (ret == -1) {
+        flb_config_exit(config);
+        return NULL;
+    }
+
+    return config;
+}
+
+/* Run the event loop until 'n' timers expired or the limit is reached */
+static void sched_run(struct flb_config *config, int n, int max_ms)
+{
+    struct flb_time t0;
+    struct flb_time t1;
+    struct flb_time diff;
+    struct mk_event *event;
+
+    flb_time_get(&t0);
+    while (expired < n) {
+        mk_event_wait(config->evl);
+        mk_event_foreach(event, config->evl) {
+            if (event->type & FLB_ENGINE_EV_SCHED) {
+                flb_sched_event_handler(config, event);
+            }
+        }
+        flb_sched_timer_cleanup(config->sched);
+
+        flb_time_get(&t1);
+        flb_time_diff(&t1, &t0, &diff);
+        if (flb_time_to_double(&diff) * 1000 > max_ms) {
+            break;
+        }
+    }
+}
+
+static void test_timer_cb()
+{
+    int a = 0;
+    int b = 0;
+    int ret;
+    struct flb_time t0;
+    struct flb_time t1;
+    struct flb_time diff;
+    struct flb_config *config;
+
+    config = sched_config();
+    TEST_CHECK(config != NULL);
+    if (!config) {
+        return;
+    }
+
+    expired = 0;
+    flb_time_get(&t0);
+    ret = flb_sched_timer_cb_create(config, 300, cb_timer, &a);
+    TEST_CHECK(ret == 0);
+    ret = flb_sched_timer_cb_create(config, 600, cb_timer, &b);
+    TEST_CHECK(ret == 0);
+
+    sched_run(config, 1, 2000);
+    flb_time_get(&t1);
+    flb_time_diff(&t1, &t0, &diff);
+    TEST_CHECK(a == 1 && b == 0);
+    TEST_CHECK(flb_time_to_double(&diff) >= 0.2);
+
+    sched_run(config, 2, 2000);
+    TEST_CHECK(a == 1 && b == 1);
+
+    flb_config_exit(config);
+}
+
+static void test_request_invalidate()
+{
+    int ret;
+    int data[4];
+    struct flb_config *config;
+
+    config = sched_config();
+    TEST_CHECK(config != NULL);
+    if (!config) {
+        return;
+    }
+
+    ret = flb_sched_request_create(config, &data[0], 1);
+    TEST_CHECK(ret >= 0);
+    ret = flb_sched_request_create(config, &data[1], 1);
+    TEST_CHECK(ret >= 0);
+
+    TEST_CHECK(flb_sched_request_invalidate(config, &data[0]) == 0);
+    TEST_CHECK(flb_sched_request_invalidate(config, &data[0]) == -1);
+    TEST_CHECK(flb_sched_request_invalidate(config, &data[2]) == -1);
+    TEST_CHECK(flb_sched_request_invalidate(config, &data[1]) == 0);
+    flb_sched_timer_cleanup(config->sched);
+
+    flb_config_exit(config);
+}
+
+/* Pending retries are moved to the next wheel tick */
+static void test_request_expedite()
+{
+    int i;
+    int ret;
+    int data[2];
+    struct mk_list *head;
+    struct flb_sched *sched;
+    struct flb_sched_request *request;
+    struct flb_config *config;
+
+    config = sched_config();
+    TEST_CHECK(config != NULL);
+    if (!config) {
+        return;
+    }
+
+    ret = flb_sched_request_create(config, &data[0], 8);
+    TEST_CHECK(ret >= 0);
+    ret = flb_sched_request_create(config, &data[1], 8);
+    TEST_CHECK(ret >= 0);
+
+    TEST_CHECK(flb_sched_request_expedite(config) == 2);
+
+    sched = config->sched;
+    for (i = 0; i < FLB_SCHED_REQUEST_HASH; i++) {
+        mk_list_foreach(head, &sched->requests[i]) {
+            request = mk_list_entry(head, struct flb_sched_request, _head);
+            TEST_CHECK(request->timer->slot ==
+                       (sched->wheel_pos + 1) % FLB_SCHED_WHEEL_SLOTS);
+            TEST_CHECK(request->timer->rounds == 0);
+        }
+    }
+
+    TEST_CHECK(flb_sched_request_invalidate(config, &data[0]) == 0);
+    TEST_CHECK(flb_sched_request_invalidate(config, &data[1]) == 0);
+    flb_sched_timer_cleanup(config->sched);
+
+    flb_config_exit(config);
+}
+
+TEST_LIST = {
+    { "timer_cb", test_timer_cb },
+    { "request_invalidate", test_request_invalidate },
+    { "request_expedite", test_request_expedite },
+    { 0 }
+};
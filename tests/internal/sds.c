@@ -2,6 +2,7 @@
 
 #include <fluent-bit/flb_info.h>
 #include <fluent-bit/flb_sds.h>
+#include <fluent-bit/flb_arena.h>
 
 #include "flb_tests_internal.h"
 
@@ -12,7 +13,7 @@ static void test_sds_usage()
     s = flb_sds_create("test");
     TEST_CHECK(s != NULL);
     TEST_CHECK(flb_sds_len(s) == 4);
-    TEST_CHECK(flb_sds_alloc(s) == 4);
+    TEST_CHECK(flb_sds_alloc(s) == FLB_SDS_SMALL);
     TEST_CHECK(strcmp("test", s) == 0);
 
     s = flb_sds_cat(s, ",cat message", 12);
@@ -21,7 +22,45 @@ static void test_sds_usage()
     flb_sds_destroy(s);
 }
 
+static void test_sds_arena()
+{
+    int i;
+    flb_sds_t s;
+    flb_sds_t tmp;
+    struct flb_arena *arena;
+
+    arena = flb_arena_create(1024);
+    TEST_CHECK(arena != NULL);
+
+    s = flb_sds_create_arena(arena, "key", 3);
+    TEST_CHECK(s != NULL);
+    TEST_CHECK(flb_sds_len(s) == 3 && strcmp(s, "key") == 0);
+    TEST_CHECK(flb_sds_alloc(s) == FLB_SDS_SMALL);
+
+    /* Grows inside the arena, including blocks of their own */
+    for (i = 0; i < 1000; i++) {
+        tmp = flb_sds_cat(s, "0123456789", 10);
+        TEST_CHECK(tmp != NULL);
+        s = tmp;
+    }
+    TEST_CHECK(flb_sds_len(s) == 10003);
+    TEST_CHECK(strncmp(s, "key0123456789", 13) == 0);
+    TEST_CHECK(strcmp(s + 9993, "0123456789") == 0);
+    TEST_CHECK(flb_sds_avail(s) == flb_sds_alloc(s) - 10003);
+
+    /* No-op, the memory goes with the arena */
+    flb_sds_destroy(s);
+
+    /* Without an arena it's a regular string */
+    s = flb_sds_create_size_arena(NULL, 64);
+    TEST_CHECK(s != NULL && flb_sds_alloc(s) == 64);
+    flb_sds_destroy(s);
+
+    flb_arena_destroy(arena);
+}
+
 TEST_LIST = {
     { "sds_usage", test_sds_usage},
+    { "sds_arena", test_sds_arena},
     { 0 }
 };
@@ -0,0 +1,89 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_slab.h>
+
+#include <string.h>
+#include <stdint.h>
+#include "flb_tests_internal.h"
+
+struct obj {
+    int id;
+    char data[70];
+};
+
+static void test_slab_usage()
+{
+    int i;
+    struct obj *o[100];
+    struct obj *tmp;
+    struct flb_slab *slab;
+
+    slab = flb_slab_create("test", sizeof(struct obj), 16, 0);
+    TEST_CHECK(slab != NULL);
+    TEST_CHECK(slab->size == 128);
+    TEST_CHECK(slab->objects == 16);
+
+    /* Aligned, distinct and growing by pages */
+    for (i = 0; i < 100; i++) {
+        o[i] = flb_slab_alloc(slab);
+        TEST_CHECK(o[i] != NULL);
+        TEST_CHECK(((uintptr_t) o[i] % FLB_SLAB_ALIGN) == 0);
+        o[i]->id = i;
+        memset(o[i]->data, i, sizeof(o[i]->data));
+    }
+    TEST_CHECK(slab->used == 100);
+    TEST_CHECK(slab->objects == 112);
+
+    for (i = 0; i < 100; i++) {
+        TEST_CHECK(o[i]->id == i);
+        TEST_CHECK(o[i]->data[69] == (char) i);
+    }
+
+    /* The last released object is the next one given out */
+    tmp = o[42];
+    flb_slab_free(slab, o[42]);
+    TEST_CHECK(slab->used == 99);
+    o[42] = flb_slab_alloc(slab);
+    TEST_CHECK(o[42] == tmp);
+
+    for (i = 0; i < 100; i++) {
+        flb_slab_free(slab, o[i]);
+    }
+    TEST_CHECK(slab->used == 0);
+    TEST_CHECK(slab->peak == 100);
+    TEST_CHECK(slab->objects == 112);
+
+    flb_slab_destroy(slab);
+}
+
+static void test_slab_max()
+{
+    int i;
+    void *o[10];
+    struct flb_slab *slab;
+
+    slab = flb_slab_create("test", 24, 4, 10);
+    TEST_CHECK(slab != NULL);
+
+    for (i = 0; i < 10; i++) {
+        o[i] = flb_slab_alloc(slab);
+        TEST_CHECK(o[i] != NULL);
+    }
+    TEST_CHECK(slab->objects == 10);
+
+    /* Full */
+    TEST_CHECK(flb_slab_alloc(slab) == NULL);
+
+    flb_slab_free(slab, o[3]);
+    TEST_CHECK(flb_slab_alloc(slab) == o[3]);
+
+    flb_slab_destroy(slab);
+}
+
+TEST_LIST = {
+    { "usage", test_slab_usage},
+    { "max"  , test_slab_max},
+    { 0 }
+};
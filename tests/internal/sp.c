@@ -0,0 +1,265 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_config.h>
+#include <fluent-bit/flb_input.h>
+#include <fluent-bit/flb_pack.h>
+#include <fluent-bit/flb_time.h>
+#include <fluent-bit/flb_sp.h>
+
+#include <msgpack.h>
+#include <string.h>
+
+#include "flb_tests_internal.h"
+
+/* Pack a [timestamp, map] record from a JSON map */
+static void record_pack(msgpack_sbuffer *sbuf, char *json)
+{
+    int ret;
+    char *buf;
+    size_t size;
+    struct flb_time tm;
+    msgpack_packer pck;
+
+    msgpack_packer_init(&pck, sbuf, msgpack_sbuffer_write);
+    msgpack_pack_array(&pck, 2);
+    flb_time_set(&tm, 1000, 0);
+    flb_time_append_to_msgpack(&tm, &pck, 0);
+
+    ret = flb_pack_json(json, strlen(json), &buf, &size);
+    TEST_CHECK(ret == 0);
+    msgpack_sbuffer_write(sbuf, buf, size);
+    flb_free(buf);
+}
+
+static void chunk_create(msgpack_sbuffer *sbuf)
+{
+    msgpack_sbuffer_init(sbuf);
+    record_pack(sbuf, "{\"host\": \"a\", \"status\": 500, \"latency\": 10}");
+    record_pack(sbuf, "{\"host\": \"b\", \"status\": 200, \"latency\": 1}");
+    record_pack(sbuf, "{\"host\": \"a\", \"status\": \"503\", \"latency\": 20}");
+    record_pack(sbuf, "{\"host\": \"b\", \"status\": 502, \"latency\": 1.5}");
+    record_pack(sbuf, "{\"host\": \"a\", \"status\": 404}");
+}
+
+/* Map of the n-th result record of a task */
+static int result_get(struct flb_sp_task *task, int n,
+                      msgpack_unpacked *result, msgpack_object *map)
+{
+    int i = 0;
+    size_t off = 0;
+
+    while (msgpack_unpack_next(result, task->out_sbuf.data,
+                               task->out_sbuf.size, &off) ==
+           MSGPACK_UNPACK_SUCCESS) {
+        if (i++ == n) {
+            *map = result->data.via.array.ptr[1];
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+static msgpack_object *map_get(msgpack_object map, char *key)
+{
+    int i;
+    int len = strlen(key);
+    msgpack_object *k;
+
+    for (i = 0; i < map.via.map.size; i++) {
+        k = &map.via.map.ptr[i].key;
+        if (k->via.str.size == len && memcmp(k->via.str.ptr, key, len) == 0) {
+            return &map.via.map.ptr[i].val;
+        }
+    }
+
+    return NULL;
+}
+
+static void test_parse()
+{
+    int i;
+    struct flb_sp_cmd *cmd;
+    struct flb_sp_cmd_key *key;
+    char *invalid[] = {
+        "SELECT FROM TAG:'a'",
+        "SELECT a FROM",
+        "SELECT a FROM TAG:a",
+        "SELECT a FROM TAG:'a' WHERE b >",
+        "SELECT a FROM TAG:'a' WHERE (b = 1",
+        "SELECT a FROM TAG:'a' WHERE b > NULL",
+        "SELECT a FROM TAG:'a' WINDOW TUMBLING (5 SECOND)",
+        "SELECT a, COUNT(*) FROM TAG:'a' GROUP BY b",
+        "SELECT *, COUNT(*) FROM TAG:'a'",
+        "SELECT SUM(*) FROM TAG:'a'",
+        "SELECT a FROM TAG:'a' extra",
+        "SELECT from FROM TAG:'a'",
+        "SELECT a FROM TAG:'unterminated",
+        NULL
+    };
+
+    cmd = flb_sp_cmd_create("CREATE STREAM s1 WITH (tag='out.s1') AS "
+                            "SELECT host, COUNT(*), AVG(latency) AS lat "
+                            "FROM TAG:'app.*' "
+                            "WHERE status >= 500 AND NOT host = 'x' "
+                            "WINDOW TUMBLING (2 MINUTE) GROUP BY host;");
+    TEST_CHECK(cmd != NULL);
+    if (cmd) {
+        TEST_CHECK(strcmp(cmd->stream_name, "s1") == 0);
+        TEST_CHECK(strcmp(cmd->tag, "out.s1") == 0);
+        TEST_CHECK(strcmp(cmd->source, "app.*") == 0);
+        TEST_CHECK(cmd->keys_len == 3);
+        TEST_CHECK(cmd->aggregate == FLB_TRUE);
+        TEST_CHECK(cmd->window == 120);
+        TEST_CHECK(cmd->group_by_len == 1);
+        TEST_CHECK(cmd->where && cmd->where->type == FLB_SP_EXP_AND);
+
+        key = mk_list_entry_first(&cmd->keys, struct flb_sp_cmd_key, _head);
+        TEST_CHECK(key->func == FLB_SP_KEY && key->group == 0);
+        key = mk_list_entry_last(&cmd->keys, struct flb_sp_cmd_key, _head);
+        TEST_CHECK(key->func == FLB_SP_AVG && strcmp(key->out, "lat") == 0);
+        flb_sp_cmd_destroy(cmd);
+    }
+
+    cmd = flb_sp_cmd_create("select `a b`, $k['app'] from stream:tail.0 "
+                            "where x = 'it''s' or y is not null");
+    TEST_CHECK(cmd != NULL);
+    if (cmd) {
+        TEST_CHECK(cmd->source_type == FLB_SP_FROM_STREAM);
+        TEST_CHECK(strcmp(cmd->source, "tail.0") == 0);
+        TEST_CHECK(cmd->where->type == FLB_SP_EXP_OR);
+        TEST_CHECK(cmd->where->left->val.len == 4);
+        TEST_CHECK(memcmp(cmd->where->left->val.s, "it's", 4) == 0);
+        TEST_CHECK(cmd->where->right->type == FLB_SP_EXP_NOT);
+        flb_sp_cmd_destroy(cmd);
+    }
+
+    for (i = 0; invalid[i]; i++) {
+        cmd = flb_sp_cmd_create(invalid[i]);
+        TEST_CHECK(cmd == NULL);
+        TEST_MSG("query: %s", invalid[i]);
+        if (cmd) {
+            flb_sp_cmd_destroy(cmd);
+        }
+    }
+}
+
+static void test_select()
+{
+    int n;
+    msgpack_object map;
+    msgpack_object *o;
+    msgpack_sbuffer chunk;
+    msgpack_unpacked result;
+    struct flb_config *config;
+    struct flb_sp_task *task;
+
+    config = flb_config_init();
+    TEST_CHECK(config != NULL);
+    if (!config) {
+        return;
+    }
+    memset(&map, '\0', sizeof(map));
+    chunk_create(&chunk);
+
+    task = flb_sp_task_create(config, "errors",
+                              "SELECT host, latency AS ms FROM TAG:'app.*' "
+                              "WHERE status >= 500 AND status < 503.5");
+    TEST_CHECK(task != NULL);
+    if (!task) {
+        goto exit;
+    }
+    TEST_CHECK(strcmp(task->tag, "errors") == 0);
+
+    /* The source does not match */
+    n = flb_sp_task_process(task, NULL, "other", 5, chunk.data, chunk.size);
+    TEST_CHECK(n == 0);
+
+    n = flb_sp_task_process(task, NULL, "app.web", 7, chunk.data, chunk.size);
+    TEST_CHECK(n == 3);
+
+    msgpack_unpacked_init(&result);
+    TEST_CHECK(result_get(task, 1, &result, &map) == 0);
+    TEST_CHECK(map.via.map.size == 2);
+    o = map_get(map, "ms");
+    TEST_CHECK(o && o->type == MSGPACK_OBJECT_POSITIVE_INTEGER &&
+               o->via.u64 == 20);
+    msgpack_unpacked_destroy(&result);
+
+ exit:
+    msgpack_sbuffer_destroy(&chunk);
+    flb_input_exit_all(config);
+    flb_config_exit(config);
+}
+
+static void test_aggregate()
+{
+    int n;
+    msgpack_object map;
+    msgpack_object *o;
+    msgpack_sbuffer chunk;
+    msgpack_unpacked result;
+    struct flb_config *config;
+    struct flb_sp_task *task;
+
+    config = flb_config_init();
+    TEST_CHECK(config != NULL);
+    if (!config) {
+        return;
+    }
+    memset(&map, '\0', sizeof(map));
+    chunk_create(&chunk);
+
+    task = flb_sp_task_create(config, "agg",
+                              "CREATE STREAM hosts AS "
+                              "SELECT host, COUNT(*), COUNT(latency), "
+                              "SUM(latency), AVG(latency) AS avg, "
+                              "MIN(status), MAX(latency) "
+                              "FROM TAG:'app.*' GROUP BY host");
+    TEST_CHECK(task != NULL);
+    if (!task) {
+        goto exit;
+    }
+    TEST_CHECK(strcmp(task->tag, "hosts") == 0);
+
+    /* Without a window every chunk is aggregated on its own */
+    n = flb_sp_task_process(task, NULL, "app.web", 7, chunk.data, chunk.size);
+    TEST_CHECK(n == 2);
+    TEST_CHECK(task->groups == 0);
+
+    msgpack_unpacked_init(&result);
+    TEST_CHECK(result_get(task, 0, &result, &map) == 0);
+    o = map_get(map, "host");
+    if (o && o->via.str.ptr[0] == 'b') {
+        TEST_CHECK(result_get(task, 1, &result, &map) == 0);
+    }
+
+    o = map_get(map, "COUNT(*)");
+    TEST_CHECK(o && o->via.u64 == 3);
+    o = map_get(map, "COUNT(latency)");
+    TEST_CHECK(o && o->via.u64 == 2);
+    o = map_get(map, "SUM(latency)");
+    TEST_CHECK(o && o->type == MSGPACK_OBJECT_POSITIVE_INTEGER &&
+               o->via.u64 == 30);
+    o = map_get(map, "avg");
+    TEST_CHECK(o && o->type == MSGPACK_OBJECT_FLOAT64 && o->via.f64 == 15.0);
+    o = map_get(map, "MIN(status)");
+    TEST_CHECK(o && o->via.u64 == 404);
+    o = map_get(map, "MAX(latency)");
+    TEST_CHECK(o && o->via.u64 == 20);
+    msgpack_unpacked_destroy(&result);
+
+ exit:
+    msgpack_sbuffer_destroy(&chunk);
+    flb_input_exit_all(config);
+    flb_config_exit(config);
+}
+
+TEST_LIST = {
+    { "parse",     test_parse},
+    { "select",    test_select},
+    { "aggregate", test_aggregate},
+    { 0 }
+};
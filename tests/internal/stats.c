@@ -0,0 +1,119 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_stats.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "flb_tests_internal.h"
+
+#define STATS_PATH  "/tmp/flb-it-stats.shm"
+#define WRITES      200000
+
+static void test_segment()
+{
+    int fd;
+    void *map;
+    struct stat st;
+    struct flb_stats *stats;
+    struct flb_stats_header *header;
+    struct flb_stats_entry out;
+    struct flb_stats_entry *entries;
+    uint64_t values[] = {10, 20};
+
+    stats = flb_stats_segment_create(STATS_PATH, 3);
+    TEST_CHECK(stats != NULL);
+    strcpy(stats->entries[1].name, "dummy.0");
+    stats->entries[1].type = FLB_STATS_INPUT;
+    stats->entries[1].n_values = 2;
+    flb_stats_entry_write(&stats->entries[1], values, 2, 1234);
+
+    /* Read it the way an external process does */
+    fd = open(STATS_PATH, O_RDONLY);
+    TEST_CHECK(fd != -1);
+    fstat(fd, &st);
+    TEST_CHECK(st.st_size == 64 + (3 * 128));
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    TEST_CHECK(map != MAP_FAILED);
+
+    header = map;
+    TEST_CHECK(header->magic == FLB_STATS_MAGIC);
+    TEST_CHECK(header->version == FLB_STATS_VERSION);
+    TEST_CHECK(header->entries == 3);
+    TEST_CHECK(header->pid == getpid());
+
+    entries = (struct flb_stats_entry *) ((char *) map + header->header_size);
+    TEST_CHECK(flb_stats_entry_read(&entries[1], &out) == 2);
+    TEST_CHECK(out.seq == 2);
+    TEST_CHECK(out.type == FLB_STATS_INPUT);
+    TEST_CHECK(strcmp(out.name, "dummy.0") == 0);
+    TEST_CHECK(out.values[FLB_STATS_IN_RECORDS] == 10);
+    TEST_CHECK(out.values[FLB_STATS_IN_BYTES] == 20);
+    TEST_CHECK(out.update_time == 1234);
+
+    munmap(map, st.st_size);
+    close(fd);
+
+    /* The file goes away with the segment */
+    flb_stats_segment_destroy(stats);
+    TEST_CHECK(access(STATS_PATH, F_OK) == -1);
+}
+
+static void *writer(void *data)
+{
+    int i;
+    uint64_t v;
+    uint64_t values[FLB_STATS_VALUES];
+    struct flb_stats_entry *entry = data;
+
+    for (v = 1; v <= WRITES; v++) {
+        for (i = 0; i < FLB_STATS_VALUES; i++) {
+            values[i] = v;
+        }
+        flb_stats_entry_write(entry, values, FLB_STATS_VALUES, v);
+    }
+    return NULL;
+}
+
+/* A reader never sees the values of two different writes */
+static void test_seqlock()
+{
+    int i;
+    int torn = 0;
+    uint64_t last = 0;
+    pthread_t tid;
+    struct flb_stats *stats;
+    struct flb_stats_entry out;
+
+    stats = flb_stats_segment_create(STATS_PATH, 1);
+    TEST_CHECK(stats != NULL);
+    pthread_create(&tid, NULL, writer, &stats->entries[0]);
+
+    while (last < WRITES) {
+        flb_stats_entry_read(&stats->entries[0], &out);
+        for (i = 1; i < FLB_STATS_VALUES; i++) {
+            if (out.values[i] != out.values[0]) {
+                torn++;
+            }
+        }
+        if (out.update_time != out.values[0] || out.values[0] < last) {
+            torn++;
+        }
+        last = out.values[0];
+    }
+    pthread_join(tid, NULL);
+
+    TEST_CHECK(torn == 0);
+    TEST_CHECK(out.seq == WRITES * 2);
+    flb_stats_segment_destroy(stats);
+}
+
+TEST_LIST = {
+    { "segment" , test_segment},
+    { "seqlock" , test_seqlock},
+    { 0 }
+};
@@ -0,0 +1,183 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_config.h>
+#include <fluent-bit/flb_input.h>
+#include <fluent-bit/flb_task.h>
+#include <fluent-bit/flb_tag.h>
+#include <fluent-bit/flb_engine_dispatch.h>
+
+#include <stdio.h>
+#include <string.h>
+#include "flb_tests_internal.h"
+
+#define TAGS  2000
+
+static void test_intern()
+{
+    int i;
+    int len;
+    char name[32];
+    struct flb_tag *a;
+    struct flb_tag *b;
+    struct flb_tag *tags[TAGS];
+    struct flb_config *config;
+
+    config = flb_config_init();
+
+    /* Same name, same entry */
+    a = flb_tag_get(config, "tail.var.log.a", 14);
+    b = flb_tag_get(config, "tail.var.log.a.b", 14);
+    TEST_CHECK(a != NULL && a == b);
+    TEST_CHECK(a->refs == 2);
+    TEST_CHECK(a->len == 14 && strcmp(a->name, "tail.var.log.a") == 0);
+    TEST_CHECK(flb_tag_lookup(config, "tail.var.log.a", 14) == a);
+    TEST_CHECK(flb_tag_lookup(config, "tail.var.log.b", 14) == NULL);
+
+    /* The table grows, the tags keep their address */
+    for (i = 0; i < TAGS; i++) {
+        len = snprintf(name, sizeof(name) - 1, "tail.%i", i);
+        tags[i] = flb_tag_get(config, name, len);
+        TEST_CHECK(tags[i] != NULL);
+    }
+    TEST_CHECK(config->tags->count == TAGS + 1);
+    TEST_CHECK(config->tags->size > FLB_TAG_TABLE_SIZE);
+    TEST_CHECK(flb_tag_lookup(config, "tail.var.log.a", 14) == a);
+    for (i = 0; i < TAGS; i++) {
+        len = snprintf(name, sizeof(name) - 1, "tail.%i", i);
+        TEST_CHECK(flb_tag_lookup(config, name, len) == tags[i]);
+        flb_tag_release(config, tags[i]);
+    }
+    TEST_CHECK(config->tags->count == 1);
+
+    /* Removed with the last reference */
+    flb_tag_release(config, a);
+    TEST_CHECK(flb_tag_lookup(config, "tail.var.log.a", 14) == b);
+    flb_tag_release(config, b);
+    TEST_CHECK(flb_tag_lookup(config, "tail.var.log.a", 14) == NULL);
+    TEST_CHECK(config->tags->count == 0);
+
+    flb_config_exit(config);
+}
+
+static void test_task_dyntag()
+{
+    struct flb_config *config;
+    struct flb_input_instance *in;
+    struct flb_input_dyntag *dt;
+    struct flb_input_dyntag *dt2;
+    struct flb_task *task;
+    char hash[41] = {0};
+
+    config = flb_config_init();
+    in = flb_calloc(1, sizeof(struct flb_input_instance));
+    if (!TEST_CHECK(in != NULL)) {
+        flb_config_exit(config);
+        return;
+    }
+    strcpy(in->name, "test.0");
+    in->config = config;
+    in->mp_buf_status = FLB_INPUT_RUNNING;
+    mk_list_init(&in->routes);
+    mk_list_init(&in->tasks);
+    mk_list_init(&in->dyntags);
+
+    /* A dyntag and a task of the same tag share the interned entry */
+    dt = flb_input_dyntag_get("app.log", 7, in);
+    TEST_CHECK(dt != NULL);
+    TEST_CHECK(dt->tag == dt->itag->name && dt->tag_len == 7);
+    TEST_CHECK(flb_input_dyntag_get("app.log", 7, in) == dt);
+
+    task = flb_task_create_direct(0, NULL, 0, in, "app.log", hash, 0, config);
+    TEST_CHECK(task != NULL);
+    TEST_CHECK(task->itag == dt->itag);
+    TEST_CHECK(task->tag == dt->tag && task->tag_len == 7);
+    TEST_CHECK(dt->itag->refs == 2);
+
+    /* A busy dyntag is not reused */
+    dt->busy = FLB_TRUE;
+    dt2 = flb_input_dyntag_get("app.log", 7, in);
+    TEST_CHECK(dt2 != NULL && dt2 != dt && dt2->itag == dt->itag);
+    TEST_CHECK(dt->itag->refs == 3);
+
+    flb_input_dyntag_destroy(dt2);
+    flb_input_dyntag_destroy(dt);
+    TEST_CHECK(task->itag->refs == 1);
+    flb_task_destroy(task);
+    TEST_CHECK(config->tags->count == 0);
+
+    flb_free(in);
+    flb_config_exit(config);
+}
+
+static struct flb_input_instance *input_create(struct flb_config *config,
+                                               struct flb_input_plugin *p)
+{
+    struct flb_input_instance *in;
+
+    in = flb_calloc(1, sizeof(struct flb_input_instance));
+    if (!in) {
+        flb_errno();
+        return NULL;
+    }
+    in->p = p;
+    in->flags = FLB_INPUT_DYN_TAG;
+    in->config = config;
+    in->mp_buf_status = FLB_INPUT_RUNNING;
+    mk_list_init(&in->routes);
+    mk_list_init(&in->tasks);
+    mk_list_init(&in->dyntags);
+    mk_list_init(&in->emit_queue);
+    pthread_mutex_init(&in->emit_lock, NULL);
+
+    return in;
+}
+
+static void test_dyntag_index()
+{
+    struct flb_config *config;
+    struct flb_input_plugin p = {0};
+    struct flb_input_instance *in1;
+    struct flb_input_instance *in2;
+    struct flb_input_dyntag *dt1;
+    struct flb_input_dyntag *dt2;
+
+    config = flb_config_init();
+    in1 = input_create(config, &p);
+    in2 = input_create(config, &p);
+    if (!TEST_CHECK(in1 != NULL && in2 != NULL)) {
+        flb_free(in1);
+        flb_free(in2);
+        flb_config_exit(config);
+        return;
+    }
+
+    /* Each instance has its own dyntag under the same interned tag */
+    dt1 = flb_input_dyntag_get("app.log", 7, in1);
+    dt2 = flb_input_dyntag_get("app.log", 7, in2);
+    TEST_CHECK(dt1 != NULL && dt2 != NULL && dt1 != dt2);
+    TEST_CHECK(dt1->itag == dt2->itag);
+    TEST_CHECK(mk_list_size(&dt1->itag->dyntags) == 2);
+    TEST_CHECK(flb_input_dyntag_get("app.log", 7, in1) == dt1);
+    TEST_CHECK(flb_input_dyntag_get("app.log", 7, in2) == dt2);
+
+    /* Empty dyntags are released by the flush */
+    flb_engine_dispatch(0, in1, config);
+    TEST_CHECK(mk_list_size(&in1->dyntags) == 0);
+    TEST_CHECK(mk_list_size(&dt2->itag->dyntags) == 1);
+    flb_engine_dispatch(0, in2, config);
+    TEST_CHECK(mk_list_size(&in2->dyntags) == 0);
+    TEST_CHECK(config->tags->count == 0);
+
+    flb_free(in1);
+    flb_free(in2);
+    flb_config_exit(config);
+}
+
+TEST_LIST = {
+    { "intern"      , test_intern},
+    { "task_dyntag" , test_task_dyntag},
+    { "dyntag_index", test_dyntag_index},
+    { 0 }
+};
@@ -0,0 +1,125 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_config.h>
+#include <fluent-bit/flb_input.h>
+#include <fluent-bit/flb_task.h>
+
+#include "flb_tests_internal.h"
+
+#define TASKS  1000
+
+static struct flb_input_instance *input_create(struct flb_config *config)
+{
+    struct flb_input_instance *in;
+
+    in = flb_calloc(1, sizeof(struct flb_input_instance));
+    in->config = config;
+    in->mp_buf_status = FLB_INPUT_RUNNING;
+    mk_list_init(&in->routes);
+    mk_list_init(&in->tasks);
+    mk_list_init(&in->dyntags);
+
+    return in;
+}
+
+static struct flb_task *task_create(struct flb_input_instance *in)
+{
+    char hash[41] = {0};
+
+    return flb_task_create_direct(0, NULL, 0, in, "test", hash, 0,
+                                  in->config);
+}
+
+static void test_ids()
+{
+    int i;
+    struct flb_config *config;
+    struct flb_input_instance *in;
+    struct flb_task *tasks[TASKS];
+    struct flb_task *task;
+
+    config = flb_config_init();
+    in = input_create(config);
+
+    /* Lowest IDs first, the map grows past its first allocation */
+    for (i = 0; i < TASKS; i++) {
+        tasks[i] = task_create(in);
+        TEST_CHECK(tasks[i] != NULL);
+        TEST_CHECK(tasks[i]->id == i);
+        TEST_CHECK(config->tasks_map[i].task == tasks[i]);
+    }
+    TEST_CHECK(config->tasks_count == TASKS);
+    TEST_CHECK(config->tasks_map_size >= TASKS);
+
+    /* Released IDs are reused, the lowest one first */
+    flb_task_destroy(tasks[700]);
+    flb_task_destroy(tasks[70]);
+    flb_task_destroy(tasks[7]);
+    TEST_CHECK(config->tasks_map[70].task == NULL);
+
+    task = task_create(in);
+    TEST_CHECK(task->id == 7);
+    tasks[7] = task;
+    task = task_create(in);
+    TEST_CHECK(task->id == 70);
+    tasks[70] = task;
+    task = task_create(in);
+    TEST_CHECK(task->id == 700);
+    tasks[700] = task;
+    task = task_create(in);
+    TEST_CHECK(task->id == TASKS);
+    flb_task_destroy(task);
+
+    for (i = 0; i < TASKS; i++) {
+        flb_task_destroy(tasks[i]);
+    }
+    TEST_CHECK(config->tasks_count == 0);
+
+    flb_free(in);
+    flb_config_exit(config);
+}
+
+static void test_limit()
+{
+    int i;
+    struct flb_config *config;
+    struct flb_input_instance *in;
+    struct flb_task *tasks[300];
+
+    config = flb_config_init();
+    config->tasks_max = 300;
+    in = input_create(config);
+
+    for (i = 0; i < 300; i++) {
+        tasks[i] = task_create(in);
+        TEST_CHECK(tasks[i] != NULL);
+    }
+    TEST_CHECK(config->tasks_map_size == 300);
+    TEST_CHECK(flb_task_map_limit(config) == 300);
+
+    /* Full */
+    TEST_CHECK(task_create(in) == NULL);
+
+    flb_task_destroy(tasks[299]);
+    tasks[299] = task_create(in);
+    TEST_CHECK(tasks[299] != NULL && tasks[299]->id == 299);
+
+    for (i = 0; i < 300; i++) {
+        flb_task_destroy(tasks[i]);
+    }
+
+    /* The task IDs are 14 bits */
+    config->tasks_max = 100000;
+    TEST_CHECK(flb_task_map_limit(config) == FLB_TASK_MAP_LIMIT);
+
+    flb_free(in);
+    flb_config_exit(config);
+}
+
+TEST_LIST = {
+    { "ids"  , test_ids},
+    { "limit", test_limit},
+    { 0 }
+};
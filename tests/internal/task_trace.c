@@ -0,0 +1,124 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_macros.h>
+#include <fluent-bit/flb_task_trace.h>
+#include <msgpack.h>
+#include <unistd.h>
+
+#include "flb_tests_internal.h"
+
+static void test_sampling()
+{
+    int i;
+    int traced = 0;
+    struct flb_task_trace *trace;
+    struct flb_task_traces *ctx;
+
+    /* One task every three */
+    ctx = flb_task_traces_create(3);
+    for (i = 0; i < 9; i++) {
+        trace = flb_task_trace_start(ctx);
+        if (trace) {
+            TEST_CHECK(i % 3 == 0);
+            flb_task_trace_end(ctx, trace, "tag", "dummy.0", 10);
+            traced++;
+        }
+    }
+    TEST_CHECK(traced == 3);
+    TEST_CHECK(ctx->size == 3);
+    flb_task_traces_destroy(ctx);
+}
+
+static void test_breakdown()
+{
+    struct flb_task_trace *trace;
+    struct flb_task_traces *ctx;
+
+    ctx = flb_task_traces_create(1);
+    trace = flb_task_trace_start(ctx);
+    TEST_CHECK(trace != NULL);
+
+    /* Waits 2ms for the flush, retried with a 5ms backoff, then ok */
+    usleep(2000);
+    flb_task_trace_event(trace, FLB_TASK_TRACE_FLUSH, "http.0", 0, 0);
+    flb_task_trace_event(trace, FLB_TASK_TRACE_RETURN, "http.0",
+                         FLB_RETRY, 1000);
+    flb_task_trace_event(trace, FLB_TASK_TRACE_RETRY, "http.0", 1, 5000);
+    usleep(6000);
+    flb_task_trace_event(trace, FLB_TASK_TRACE_FLUSH, "http.0", 0, 0);
+    flb_task_trace_event(trace, FLB_TASK_TRACE_RETURN, "http.0",
+                         FLB_OK, 500);
+    flb_task_trace_end(ctx, trace, "app.logs", "tail.0", 100);
+
+    TEST_CHECK(trace->n_events == 7);
+    TEST_CHECK(trace->output_usec == 1500);
+    TEST_CHECK(trace->backoff_usec == 5000);
+    TEST_CHECK(trace->retries == 1);
+    TEST_CHECK(trace->wait_usec >= 3000);
+    TEST_CHECK(trace->wait_usec < trace->total_usec);
+    TEST_CHECK(trace->total_usec >= 8000);
+    TEST_CHECK(strcmp(trace->tag, "app.logs") == 0);
+
+    flb_task_traces_destroy(ctx);
+}
+
+static void test_ring_dump()
+{
+    int i;
+    int ret;
+    char *buf;
+    size_t size;
+    size_t off = 0;
+    msgpack_unpacked result;
+    msgpack_object root;
+    msgpack_object_kv *kv;
+    struct flb_task_trace *trace;
+    struct flb_task_traces *ctx;
+
+    ctx = flb_task_traces_create(1);
+    for (i = 0; i < FLB_TASK_TRACE_RING + 2; i++) {
+        trace = flb_task_trace_start(ctx);
+        if (i == 0) {
+            /* Events beyond the limit are counted */
+            while (trace->n_events < FLB_TASK_TRACE_EVENTS) {
+                flb_task_trace_event(trace, FLB_TASK_TRACE_FLUSH,
+                                     "null.0", 0, 0);
+            }
+        }
+        flb_task_trace_end(ctx, trace, "tag", "dummy.0", i);
+    }
+    TEST_CHECK(ctx->size == FLB_TASK_TRACE_RING);
+
+    /* The oldest kept trace comes first */
+    flb_task_traces_dump(ctx, &buf, &size);
+    msgpack_unpacked_init(&result);
+    ret = msgpack_unpack_next(&result, buf, size, &off);
+    TEST_CHECK(ret == MSGPACK_UNPACK_SUCCESS);
+    root = result.data;
+    TEST_CHECK(root.type == MSGPACK_OBJECT_ARRAY);
+    TEST_CHECK(root.via.array.size == FLB_TASK_TRACE_RING);
+
+    kv = root.via.array.ptr[0].via.map.ptr;
+    TEST_CHECK(strncmp(kv[0].key.via.str.ptr, "id", 2) == 0);
+    TEST_CHECK(kv[0].val.via.u64 == 3);
+    kv = root.via.array.ptr[FLB_TASK_TRACE_RING - 1].via.map.ptr;
+    TEST_CHECK(kv[0].val.via.u64 == FLB_TASK_TRACE_RING + 2);
+
+    /* create and destroy events */
+    kv = &kv[root.via.array.ptr[0].via.map.size - 1];
+    TEST_CHECK(strncmp(kv->key.via.str.ptr, "events", 6) == 0);
+    TEST_CHECK(kv->val.via.array.size == 2);
+
+    msgpack_unpacked_destroy(&result);
+    flb_free(buf);
+    flb_task_traces_destroy(ctx);
+}
+
+TEST_LIST = {
+    { "sampling"  , test_sampling},
+    { "breakdown" , test_breakdown},
+    { "ring_dump" , test_ring_dump},
+    { 0 }
+};
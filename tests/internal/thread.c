@@ -0,0 +1,130 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_thread.h>
+
+#include <stdint.h>
+#include <string.h>
+
+#include "flb_tests_internal.h"
+
+static int counter;
+static cothread_t main_co;
+
+static void entry()
+{
+    while (1) {
+        counter++;
+        co_switch(main_co);
+    }
+}
+
+static void test_stack_reuse()
+{
+    size_t size;
+    size_t size2;
+    cothread_t co;
+    cothread_t co2;
+
+    main_co = co_active();
+    counter = 0;
+
+    co = flb_thread_stack_create(FLB_THREAD_STACK_SIZE, entry, &size);
+    TEST_CHECK(co != NULL);
+    co_switch(co);
+    co_switch(co);
+    TEST_CHECK(counter == 2);
+    flb_thread_stack_release(co, FLB_THREAD_STACK_SIZE, size);
+
+    /* Same size request: the released stack is derived again */
+    co2 = flb_thread_stack_create(FLB_THREAD_STACK_SIZE, entry, &size2);
+    TEST_CHECK(co2 != NULL);
+    TEST_CHECK(size2 == size);
+    if (strcmp(co_method(), "sjlj") != 0 &&
+        strcmp(co_method(), "ucontext") != 0) {
+        TEST_CHECK(co2 == co);
+    }
+
+    /* The context starts again from the entry point */
+    co_switch(co2);
+    TEST_CHECK(counter == 3);
+
+    /* A different size never takes the cached stack */
+    flb_thread_stack_release(co2, FLB_THREAD_STACK_SIZE, size2);
+    co = flb_thread_stack_create(FLB_THREAD_STACK_SIZE * 2, entry, &size);
+    TEST_CHECK(co != NULL);
+    TEST_CHECK(co != co2);
+    TEST_CHECK(size > size2);
+    flb_thread_stack_release(co, FLB_THREAD_STACK_SIZE * 2, size);
+
+    flb_thread_pool_exit();
+}
+
+/*
+ * Two co-routines keep integer and floating point values alive across
+ * switches, the callee-saved registers must be restored by the backend.
+ */
+#define SWITCH_ROUNDS 10000
+
+static cothread_t co_a;
+static cothread_t co_b;
+static int sum_ok;
+
+static void entry_regs()
+{
+    int i;
+    uint64_t a = 1;
+    uint64_t b = 3;
+    double d = 0.5;
+    double e = 1.5;
+    cothread_t other;
+
+    other = (co_active() == co_a) ? co_b : co_a;
+    for (i = 0; i < SWITCH_ROUNDS; i++) {
+        a += 2;
+        b += a;
+        d += 1.0;
+        e = -e;
+        co_switch(other);
+    }
+
+    if (a == 1 + 2 * SWITCH_ROUNDS && d == 0.5 + SWITCH_ROUNDS && e == 1.5 &&
+        b == 3 + (uint64_t) SWITCH_ROUNDS * (SWITCH_ROUNDS + 2)) {
+        sum_ok++;
+    }
+    counter++;
+    while (1) {
+        co_switch(main_co);
+    }
+}
+
+static void test_switch_registers()
+{
+    size_t size_a;
+    size_t size_b;
+
+    main_co = co_active();
+    counter = 0;
+    sum_ok = 0;
+
+    co_a = flb_thread_stack_create(FLB_THREAD_STACK_SIZE, entry_regs, &size_a);
+    co_b = flb_thread_stack_create(FLB_THREAD_STACK_SIZE, entry_regs, &size_b);
+    TEST_CHECK(co_a != NULL && co_b != NULL);
+
+    /* a and b ping-pong, the first one done returns here */
+    co_switch(co_a);
+    TEST_CHECK(counter == 1);
+    co_switch(co_b);
+    TEST_CHECK(counter == 2);
+    TEST_CHECK(sum_ok == 2);
+
+    flb_thread_stack_release(co_a, FLB_THREAD_STACK_SIZE, size_a);
+    flb_thread_stack_release(co_b, FLB_THREAD_STACK_SIZE, size_b);
+    flb_thread_pool_exit();
+}
+
+TEST_LIST = {
+    { "stack_reuse", test_stack_reuse },
+    { "switch_registers", test_switch_registers },
+    { 0 }
+};
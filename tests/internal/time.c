@@ -0,0 +1,48 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_time.h>
+
+#include <unistd.h>
+#include "flb_tests_internal.h"
+
+static void test_precision()
+{
+    TEST_CHECK(flb_time_precision("precise") == FLB_TIME_PRECISE);
+    TEST_CHECK(flb_time_precision("Coarse") == FLB_TIME_COARSE);
+    TEST_CHECK(flb_time_precision("loop") == FLB_TIME_LOOP);
+    TEST_CHECK(flb_time_precision("nsec") == -1);
+}
+
+static void test_get()
+{
+    struct flb_time now;
+    struct flb_time tm;
+    struct flb_time diff;
+
+    /* A coarse read is behind by a few clock ticks at most */
+    flb_time_get(&now);
+    flb_time_get_precision(&tm, FLB_TIME_COARSE);
+    TEST_CHECK(tm.tm.tv_sec >= now.tm.tv_sec - 1);
+    TEST_CHECK(tm.tm.tv_sec <= now.tm.tv_sec + 1);
+
+#ifdef FLB_HAVE_C_TLS
+    /* The loop time stays the same until the loop wakes up again */
+    flb_time_loop_update();
+    flb_time_get_precision(&now, FLB_TIME_LOOP);
+    usleep(2000);
+    flb_time_get_precision(&tm, FLB_TIME_LOOP);
+    TEST_CHECK(tm.tm.tv_sec == now.tm.tv_sec && tm.tm.tv_nsec == now.tm.tv_nsec);
+
+    flb_time_loop_update();
+    flb_time_get_precision(&tm, FLB_TIME_LOOP);
+    flb_time_diff(&tm, &now, &diff);
+    TEST_CHECK(diff.tm.tv_sec > 0 || diff.tm.tv_nsec >= 2000000);
+#endif
+}
+
+TEST_LIST = {
+    { "precision", test_precision},
+    { "get"      , test_get},
+    { 0 }
+};
@@ -0,0 +1,106 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_macros.h>
+#include <fluent-bit/flb_unescape.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "flb_tests_internal.h"
+
+static void check(char *in, int mode, char *expected, size_t expected_len)
+{
+    size_t len;
+    char out[256];
+
+    len = flb_unescape(in, strlen(in), out, mode);
+    TEST_CHECK(len == expected_len);
+    TEST_CHECK(memcmp(out, expected, expected_len) == 0);
+    TEST_CHECK(out[len] == '\0');
+}
+
+static void test_unescape_modes()
+{
+    char *in = "a\\tb\\\"c\\\\d\\qe";
+
+    check(in, FLB_UNESCAPE_CONTROL, "a\tb\"c\\dqe", 9);
+    check(in, FLB_UNESCAPE_KEEP_CONTROL, "a\\tb\"c\\dqe", 10);
+    check(in, FLB_UNESCAPE_UTF8, "a\tb\\\"c\\\\dqe", 11);
+
+    /* Numeric sequences */
+    check("\\u00e9\\x41\\101\\U0001F600", FLB_UNESCAPE_UTF8,
+          "\xc3\xa9" "AA" "\xf0\x9f\x98\x80", 8);
+    check("\\u\\x", FLB_UNESCAPE_UTF8, "ux", 2);
+
+    /* Trailing backslash */
+    check("abc\\", FLB_UNESCAPE_CONTROL, "abc", 3);
+    check("abc\\", FLB_UNESCAPE_KEEP_CONTROL, "abc", 3);
+    check("abc\\", FLB_UNESCAPE_UTF8, "abc\\", 4);
+
+    /* UTF-8 is kept, invalid bytes are dropped in UTF-8 mode */
+    check("\xc3\xa9t\xc3\xa9", FLB_UNESCAPE_UTF8, "\xc3\xa9t\xc3\xa9", 5);
+    check("a\xff" "b\xc3", FLB_UNESCAPE_UTF8, "ab", 2);
+    check("a\xff" "b", FLB_UNESCAPE_CONTROL, "a\xff" "b", 3);
+}
+
+static void test_unescape_span()
+{
+    char *s;
+
+    s = "nothing to do here, \xc3\xa9 included";
+    TEST_CHECK(flb_unescape_span(s, strlen(s), FLB_UNESCAPE_CONTROL) ==
+               strlen(s));
+    TEST_CHECK(flb_unescape_span(s, strlen(s), FLB_UNESCAPE_UTF8) ==
+               strlen(s));
+
+    s = "0123456789abcdefghijklmnopqrstuvwxyz\\n";
+    TEST_CHECK(flb_unescape_span(s, strlen(s), FLB_UNESCAPE_CONTROL) == 36);
+
+    s = "0123456789abcdefghijklmnopqrstuvwxyz\xc3(";
+    TEST_CHECK(flb_unescape_span(s, strlen(s), FLB_UNESCAPE_CONTROL) ==
+               strlen(s));
+    TEST_CHECK(flb_unescape_span(s, strlen(s), FLB_UNESCAPE_UTF8) == 36);
+
+    TEST_CHECK(flb_utf8_valid("\xe2\x82\xac", 3) == FLB_TRUE);
+    TEST_CHECK(flb_utf8_valid("\xe2\x82", 2) == FLB_FALSE);
+    TEST_CHECK(flb_utf8_valid("\xed\xa0\x80", 3) == FLB_FALSE);
+    TEST_CHECK(flb_utf8_valid("", 0) == FLB_TRUE);
+}
+
+/* Compare against the eight bytes version with every alignment */
+static void test_unescape_match()
+{
+    int i;
+    int off;
+    int mode;
+    size_t size = 4096;
+    size_t n;
+    size_t n_sw;
+    char *buf;
+    char pick[] = "\\\xc3\xa9\xff";
+
+    buf = malloc(size + 64);
+
+    srand(1);
+    for (i = 0; i < size + 64; i++) {
+        buf[i] = (rand() % 64 == 0) ? pick[rand() % 4] : 'a' + (rand() % 26);
+    }
+
+    for (mode = 0; mode <= FLB_UNESCAPE_UTF8; mode++) {
+        for (off = 0; off < 64; off++) {
+            n = flb_unescape_span(buf + off, size - off, mode);
+            n_sw = flb_unescape_span_sw(buf + off, size - off, mode);
+            TEST_CHECK(n == n_sw);
+        }
+    }
+
+    free(buf);
+}
+
+TEST_LIST = {
+    { "modes", test_unescape_modes},
+    { "span",  test_unescape_span},
+    { "match", test_unescape_match},
+    { 0 }
+};
@@ -0,0 +1,152 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_log.h>
+#include <fluent-bit/flb_config.h>
+#include <fluent-bit/flb_engine.h>
+#include <fluent-bit/flb_scheduler.h>
+#include <fluent-bit/flb_thread.h>
+#include <fluent-bit/flb_upstream.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "flb_tests_internal.h"
+
+static int listener(int *port)
+{
+    int fd;
+    socklen_t len;
+    struct sockaddr_in addr;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&addr, '\0', sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(fd, (struct sockaddr *) &addr, sizeof(addr));
+    listen(fd, 16);
+
+    len = sizeof(addr);
+    getsockname(fd, (struct sockaddr *) &addr, &len);
+    *port = ntohs(addr.sin_port);
+
+    return fd;
+}
+
+/* Accept the connections that arrive within 'ms' milliseconds */
+static int accept_all(int fd, int *fds, int max, int ms)
+{
+    int n = 0;
+    struct pollfd pfd;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    while (n < max && poll(&pfd, 1, ms) == 1) {
+        fds[n++] = accept(fd, NULL, NULL);
+    }
+
+    return n;
+}
+
+static int idle_count(struct flb_upstream *u)
+{
+    int n;
+
+    pthread_mutex_lock(&u->mutex_queue);
+    n = mk_list_size(&u->av_queue);
+    pthread_mutex_unlock(&u->mutex_queue);
+
+    return n;
+}
+
+/* Run the scheduler timers for 'ms' milliseconds */
+static void sched_run(struct flb_config *config, int ms)
+{
+    time_t end;
+    struct mk_event *event;
+
+    end = time(NULL) + (ms / 1000) + 1;
+    while (time(NULL) < end) {
+        mk_event_wait(config->evl);
+        mk_event_foreach(event, config->evl) {
+            if (event->type & FLB_ENGINE_EV_SCHED) {
+                flb_sched_event_handler(config, event);
+            }
+        }
+        flb_sched_timer_cleanup(config->sched);
+    }
+}
+
+static void test_warm_up()
+{
+    int i;
+    int n;
+    int fd;
+    int port;
+    int fds[2];
+    struct flb_config *config;
+    struct flb_upstream *u;
+    struct flb_upstream_conn *conn;
+
+    config = flb_config_init();
+    TEST_CHECK(config != NULL);
+    if (!config) {
+        return;
+    }
+    config->log = flb_log_init(config, FLB_LOG_STDERR, FLB_LOG_INFO, NULL);
+    config->evl = mk_event_loop_create(64);
+    TEST_CHECK(flb_sched_init(config) == 0);
+    flb_thread_prepare();
+
+    fd = listener(&port);
+    u = flb_upstream_create(config, "127.0.0.1", port, FLB_IO_TCP, NULL);
+    TEST_CHECK(u != NULL);
+
+    /* Warm-up needs keepalive */
+    TEST_CHECK(flb_upstream_set_warm(u, 2) == -1);
+    flb_upstream_set_keepalive(u, FLB_TRUE, 30, 0);
+    TEST_CHECK(flb_upstream_set_warm(u, 2) == 0);
+    TEST_CHECK(flb_upstream_warm_start(config) == 0);
+
+    /* Both connections are opened in the background */
+    n = accept_all(fd, fds, 2, 2000);
+    TEST_CHECK(n == 2);
+    for (i = 0; i < 50 && idle_count(u) < 2; i++) {
+        usleep(20000);
+    }
+    TEST_CHECK(idle_count(u) == 2);
+
+    /* A warm connection is handed out as a fresh one */
+    conn = flb_upstream_conn_get(u);
+    TEST_CHECK(conn != NULL && conn->fd > 0);
+    TEST_CHECK(conn->ka_count == 0);
+    flb_upstream_conn_release(conn);
+    TEST_CHECK(idle_count(u) == 2);
+
+    /* The remote end closes them: the health check replaces both */
+    for (i = 0; i < n; i++) {
+        close(fds[i]);
+    }
+    sched_run(config, FLB_UPSTREAM_WARM_INTERVAL);
+    n = accept_all(fd, fds, 2, 2000);
+    TEST_CHECK(n == 2);
+    TEST_MSG("new connections: %i", n);
+
+    flb_upstream_warm_exit(config);
+    flb_upstream_destroy(u);
+    for (i = 0; i < n; i++) {
+        close(fds[i]);
+    }
+    close(fd);
+    flb_config_exit(config);
+}
+
+TEST_LIST = {
+    { "warm_up", test_warm_up},
+    { 0 }
+};
@@ -0,0 +1,343 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_config.h>
+#include <fluent-bit/flb_io.h>
+#include <fluent-bit/flb_upstream_group.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "flb_tests_internal.h"
+
+#define UPSTREAM_FILE  "/tmp/flb-it-upstream-group.conf"
+
+static struct flb_upstream_group *group_create(struct flb_config *config,
+                                               int mode, char *list)
+{
+    char buf[256];
+    struct flb_upstream_group *g;
+
+    g = flb_upstream_group_create(mode);
+    TEST_CHECK(g != NULL);
+
+    /* The list is modified while parsed */
+    strncpy(buf, list, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = '\0';
+    if (flb_upstream_group_add_list(g, config, buf, 80,
+                                    FLB_IO_TCP, NULL) <= 0) {
+        flb_upstream_group_destroy(g);
+        return NULL;
+    }
+
+    return g;
+}
+
+/* Pick a node and give it back right away */
+static char *pick(struct flb_upstream_group *g, int failed)
+{
+    struct flb_upstream_node *node;
+
+    node = flb_upstream_group_node_get(g);
+    flb_upstream_group_node_release(g, node, failed);
+
+    return node->u->tcp_host;
+}
+
+static void test_list()
+{
+    struct mk_list *head;
+    struct flb_config *config;
+    struct flb_upstream_node *node;
+    struct flb_upstream_group *g;
+    char *hosts[] = {"a", "b", "c"};
+    int ports[] = {9200, 80, 81};
+    int weights[] = {1, 3, 1};
+    int i = 0;
+
+    config = flb_calloc(1, sizeof(struct flb_config));
+
+    g = group_create(config, FLB_UPSTREAM_GROUP_ROUND_ROBIN,
+                     "a:9200 b@3,c:81");
+    TEST_CHECK(g != NULL && g->nodes_count == 3);
+    mk_list_foreach(head, &g->nodes) {
+        node = mk_list_entry(head, struct flb_upstream_node, _head);
+        TEST_CHECK(strcmp(node->u->tcp_host, hosts[i]) == 0);
+        TEST_CHECK(node->u->tcp_port == ports[i]);
+        TEST_CHECK(node->weight == weights[i]);
+        i++;
+    }
+    flb_upstream_group_destroy(g);
+
+    /* Invalid entries */
+    TEST_CHECK(group_create(config, 0, "a:0") == NULL);
+    TEST_CHECK(group_create(config, 0, "a@0") == NULL);
+    TEST_CHECK(group_create(config, 0, " , ") == NULL);
+
+    TEST_CHECK(flb_upstream_group_mode("weighted") ==
+               FLB_UPSTREAM_GROUP_WEIGHTED);
+    TEST_CHECK(flb_upstream_group_mode("random") == -1);
+
+    flb_free(config);
+}
+
+static void test_round_robin()
+{
+    int i;
+    char out[16];
+    struct flb_config *config;
+    struct flb_upstream_group *g;
+
+    config = flb_calloc(1, sizeof(struct flb_config));
+    g = group_create(config, FLB_UPSTREAM_GROUP_ROUND_ROBIN, "a b c");
+
+    for (i = 0; i < 7; i++) {
+        out[i] = pick(g, FLB_FALSE)[0];
+    }
+    out[i] = '\0';
+    TEST_CHECK(strcmp(out, "abcabca") == 0);
+
+    flb_upstream_group_destroy(g);
+    flb_free(config);
+}
+
+static void test_least_inflight()
+{
+    struct flb_config *config;
+    struct flb_upstream_node *n1;
+    struct flb_upstream_node *n2;
+    struct flb_upstream_node *n3;
+    struct flb_upstream_group *g;
+
+    config = flb_calloc(1, sizeof(struct flb_config));
+    g = group_create(config, FLB_UPSTREAM_GROUP_LEAST_INFLIGHT, "a b");
+
+    /* Requests in progress spread over the nodes */
+    n1 = flb_upstream_group_node_get(g);
+    n2 = flb_upstream_group_node_get(g);
+    TEST_CHECK(n1 != n2);
+
+    /* Once the second one is done it has the fewest requests */
+    n3 = flb_upstream_group_node_get(g);
+    TEST_CHECK(n3 == n1 && n1->inflight == 2);
+    flb_upstream_group_node_release(g, n2, FLB_FALSE);
+    flb_upstream_group_node_release(g, n3, FLB_FALSE);
+    n3 = flb_upstream_group_node_get(g);
+    TEST_CHECK(n3 == n2);
+
+    flb_upstream_group_node_release(g, n1, FLB_FALSE);
+    flb_upstream_group_node_release(g, n3, FLB_FALSE);
+    flb_upstream_group_destroy(g);
+    flb_free(config);
+}
+
+static void test_weighted()
+{
+    int i;
+    char out[16];
+    struct flb_config *config;
+    struct flb_upstream_group *g;
+
+    config = flb_calloc(1, sizeof(struct flb_config));
+    g = group_create(config, FLB_UPSTREAM_GROUP_WEIGHTED, "a@1 b@1 c@2");
+
+    /* 'c' gets half of the requests, never twice in a row */
+    for (i = 0; i < 8; i++) {
+        out[i] = pick(g, FLB_FALSE)[0];
+    }
+    out[i] = '\0';
+    TEST_CHECK(strcmp(out, "cabccabc") == 0);
+    TEST_MSG("order: %s", out);
+
+    flb_upstream_group_destroy(g);
+    flb_free(config);
+}
+
+static void test_eject()
+{
+    int i;
+    struct flb_config *config;
+    struct flb_upstream_node *node;
+    struct flb_upstream_group *g;
+
+    config = flb_calloc(1, sizeof(struct flb_config));
+    g = group_create(config, FLB_UPSTREAM_GROUP_ROUND_ROBIN, "a b");
+    g->max_fails = 2;
+
+    /* 'a' fails twice in a row and is left out */
+    TEST_CHECK(strcmp(pick(g, FLB_TRUE), "a") == 0);
+    TEST_CHECK(strcmp(pick(g, FLB_FALSE), "b") == 0);
+    TEST_CHECK(strcmp(pick(g, FLB_TRUE), "a") == 0);
+    for (i = 0; i < 4; i++) {
+        TEST_CHECK(strcmp(pick(g, FLB_FALSE), "b") == 0);
+    }
+
+    /* Every node ejected: the first one to come back is still used */
+    TEST_CHECK(strcmp(pick(g, FLB_TRUE), "b") == 0);
+    TEST_CHECK(strcmp(pick(g, FLB_TRUE), "b") == 0);
+    node = flb_upstream_group_node_get(g);
+    TEST_CHECK(node != NULL && strcmp(node->u->tcp_host, "a") == 0);
+
+    /* It succeeds and is back in the rotation */
+    flb_upstream_group_node_release(g, node, FLB_FALSE);
+    TEST_CHECK(node->ejected_until == 0);
+    TEST_CHECK(strcmp(pick(g, FLB_FALSE), "a") == 0);
+
+    flb_upstream_group_destroy(g);
+    flb_free(config);
+}
+
+static struct flb_upstream_group *group_conf(struct flb_config *config,
+                                             char *content)
+{
+    FILE *fp;
+
+    fp = fopen(UPSTREAM_FILE, "w");
+    TEST_CHECK(fp != NULL);
+    fputs(content, fp);
+    fclose(fp);
+
+    return flb_upstream_group_conf_file(config, UPSTREAM_FILE, 24224,
+                                        FLB_IO_TCP, NULL);
+}
+
+static void test_conf_file()
+{
+    struct flb_config *config;
+    struct flb_upstream_node *n1;
+    struct flb_upstream_node *n2;
+    struct flb_upstream_group *g;
+
+    config = flb_calloc(1, sizeof(struct flb_config));
+
+    g = group_conf(config,
+                   "[UPSTREAM]\n"
+                   "    name    aggregators\n"
+                   "    balance weighted\n"
+                   "\n"
+                   "[NODE]\n"
+                   "    name       agg-1\n"
+                   "    host       a\n"
+                   "    weight     3\n"
+                   "    shared_key k1\n"
+                   "\n"
+                   "[NODE]\n"
+                   "    name       agg-2\n"
+                   "    host       b\n"
+                   "    port       24225\n");
+    TEST_CHECK(g != NULL);
+    if (!g) {
+        flb_free(config);
+        return;
+    }
+
+    TEST_CHECK(g->nodes_count == 2);
+    TEST_CHECK(g->mode == FLB_UPSTREAM_GROUP_WEIGHTED);
+    TEST_CHECK(strcmp(g->name, "aggregators") == 0);
+
+    n1 = mk_list_entry_first(&g->nodes, struct flb_upstream_node, _head);
+    n2 = mk_list_entry_last(&g->nodes, struct flb_upstream_node, _head);
+    TEST_CHECK(strcmp(n1->name, "agg-1") == 0);
+    TEST_CHECK(n1->u->tcp_port == 24224 && n1->weight == 3);
+    TEST_CHECK(n2->u->tcp_port == 24225 && n2->weight == 1);
+
+    /* Unknown keys are kept for the plugin */
+    TEST_CHECK(strcmp(flb_upstream_node_get_property("shared_key", n1),
+                      "k1") == 0);
+    TEST_CHECK(flb_upstream_node_get_property("shared_key", n2) == NULL);
+    flb_upstream_group_destroy(g);
+
+    /* Invalid files */
+    TEST_CHECK(group_conf(config, "[NODE]\n    host a\n") == NULL);
+    TEST_CHECK(group_conf(config, "[UPSTREAM]\n    name x\n") == NULL);
+    TEST_CHECK(group_conf(config,
+                          "[UPSTREAM]\n    name x\n"
+                          "[NODE]\n    port 80\n") == NULL);
+
+    unlink(UPSTREAM_FILE);
+    flb_free(config);
+}
+
+/* Listening socket on a free local port */
+static int listener(int *port)
+{
+    int fd;
+    socklen_t len;
+    struct sockaddr_in addr;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&addr, '\0', sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(fd, (struct sockaddr *) &addr, sizeof(addr));
+    listen(fd, 16);
+
+    len = sizeof(addr);
+    getsockname(fd, (struct sockaddr *) &addr, &len);
+    *port = ntohs(addr.sin_port);
+
+    return fd;
+}
+
+static void test_heartbeat()
+{
+    int i;
+    int fd;
+    int closed_fd;
+    int port_up;
+    int port_down;
+    char list[64];
+    struct flb_config *config;
+    struct flb_upstream_node *node;
+    struct flb_upstream_group *g;
+
+    config = flb_calloc(1, sizeof(struct flb_config));
+
+    /* A port nobody listens on: bind one and close it */
+    fd = listener(&port_up);
+    closed_fd = listener(&port_down);
+    close(closed_fd);
+
+    snprintf(list, sizeof(list), "127.0.0.1:%i 127.0.0.1:%i",
+             port_down, port_up);
+    g = group_create(config, FLB_UPSTREAM_GROUP_ROUND_ROBIN, list);
+    TEST_CHECK(g != NULL);
+
+    TEST_CHECK(flb_upstream_group_heartbeat_start(g, 1) == 0);
+    for (i = 0; i < 50; i++) {
+        node = mk_list_entry_first(&g->nodes, struct flb_upstream_node,
+                                   _head);
+        if (node->down == FLB_TRUE) {
+            break;
+        }
+        usleep(100000);
+    }
+    TEST_CHECK(node->down == FLB_TRUE);
+
+    /* Only the node that accepts connections is selected */
+    for (i = 0; i < 4; i++) {
+        node = flb_upstream_group_node_get(g);
+        TEST_CHECK(node->u->tcp_port == port_up);
+        flb_upstream_group_node_release(g, node, FLB_FALSE);
+    }
+
+    flb_upstream_group_destroy(g);
+    close(fd);
+    flb_free(config);
+}
+
+TEST_LIST = {
+    { "list"          , test_list},
+    { "round_robin"   , test_round_robin},
+    { "least_inflight", test_least_inflight},
+    { "weighted"      , test_weighted},
+    { "eject"         , test_eject},
+    { "conf_file"     , test_conf_file},
+    { "heartbeat"     , test_heartbeat},
+    { 0 }
+};
@@ -0,0 +1,83 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_macros.h>
+#include <fluent-bit/flb_vring.h>
+
+#include <string.h>
+#include <unistd.h>
+#include "flb_tests_internal.h"
+
+static void test_vring_usage()
+{
+    int i;
+    int ret;
+    size_t len = 0;
+    size_t page;
+    char *p;
+    struct flb_vring ring;
+
+    page = sysconf(_SC_PAGESIZE);
+
+    /* Size is rounded to pages */
+    ret = flb_vring_create(&ring, 100);
+    TEST_CHECK(ret == 0);
+    TEST_CHECK(ring.size == page);
+
+    /* Fill, consume most of it and write across the end of the ring */
+    for (i = 0; i < 3; i++) {
+        p = flb_vring_start(&ring) + len;
+        memset(p, 'a' + i, ring.size - len - 1);
+        len = ring.size - 1;
+
+        flb_vring_consume(&ring, len - 10, len);
+        len = 10;
+
+        p = flb_vring_start(&ring);
+        TEST_CHECK(p[0] == 'a' + i && p[9] == 'a' + i);
+    }
+
+    /* The pending data is contiguous */
+    p = flb_vring_start(&ring);
+    memcpy(p + len, "0123456789", 10);
+    len += 10;
+    TEST_CHECK(memcmp(p + 10, "0123456789", 10) == 0);
+
+    /* Grow keeping the pending data */
+    ret = flb_vring_resize(&ring, page * 2, len);
+    TEST_CHECK(ret == 0);
+    TEST_CHECK(ring.size == page * 2);
+    p = flb_vring_start(&ring);
+    TEST_CHECK(p[0] == 'c');
+    TEST_CHECK(memcmp(p + 10, "0123456789", 10) == 0);
+
+    flb_vring_destroy(&ring);
+}
+
+#ifdef __linux__
+static void test_vring_mirror()
+{
+    int ret;
+    struct flb_vring ring;
+
+    ret = flb_vring_create(&ring, 4096);
+    TEST_CHECK(ret == 0);
+    TEST_CHECK(ring.mirrored == FLB_TRUE);
+
+    /* Both halves map the same memory */
+    ring.data[0] = 'x';
+    TEST_CHECK(ring.data[ring.size] == 'x');
+    ring.data[ring.size + 1] = 'y';
+    TEST_CHECK(ring.data[1] == 'y');
+
+    flb_vring_destroy(&ring);
+}
+#endif
+
+TEST_LIST = {
+    { "usage" , test_vring_usage},
+#ifdef __linux__
+    { "mirror", test_vring_mirror},
+#endif
+    { 0 }
+};
@@ -0,0 +1,70 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_config.h>
+#include <fluent-bit/flb_worker.h>
+
+#include <pthread.h>
+#include "flb_tests_internal.h"
+
+static void test_cpus_parse()
+{
+    struct flb_worker_cpus *cpus;
+
+    cpus = flb_worker_cpus_create("0-3,8");
+    TEST_CHECK(cpus != NULL);
+    TEST_CHECK(cpus->count == 5);
+    TEST_CHECK(strcmp(cpus->list, "0-3,8") == 0);
+    flb_worker_cpus_destroy(cpus);
+
+    /* Overlapping ranges count each CPU once */
+    cpus = flb_worker_cpus_create("1, 0-2 ,2");
+    TEST_CHECK(cpus != NULL);
+    TEST_CHECK(cpus->count == 3);
+    flb_worker_cpus_destroy(cpus);
+
+    TEST_CHECK(flb_worker_cpus_create("") == NULL);
+    TEST_CHECK(flb_worker_cpus_create("3-1") == NULL);
+    TEST_CHECK(flb_worker_cpus_create("a") == NULL);
+    TEST_CHECK(flb_worker_cpus_create("1-") == NULL);
+    TEST_CHECK(flb_worker_cpus_create("99999") == NULL);
+}
+
+static void worker_cb(void *data)
+{
+    struct flb_worker *worker;
+
+    worker = flb_worker_get();
+    *((int *) data) = (worker && strcmp(worker->role, "test") == 0);
+}
+
+static void test_role()
+{
+    int ok = 0;
+    pthread_t tid;
+    struct flb_config *config;
+    struct flb_worker *worker;
+
+    config = flb_config_init();
+    TEST_CHECK(config != NULL);
+
+    config->cpu_affinity = flb_worker_cpus_create("0");
+    TEST_CHECK(flb_worker_create_role(worker_cb, &ok, &tid, "test", NULL,
+                                      config) == 0);
+    pthread_join(tid, NULL);
+    TEST_CHECK(ok == 1);
+
+    /* Service CPUs are used when the worker has none */
+    worker = flb_worker_lookup(tid, config);
+    TEST_CHECK(worker != NULL);
+    TEST_CHECK(worker->cpus == config->cpu_affinity);
+    TEST_CHECK(worker->running == FLB_FALSE);
+
+    flb_config_exit(config);
+}
+
+TEST_LIST = {
+    { "cpus_parse", test_cpus_parse },
+    { "role", test_role },
+    { 0 }
+};
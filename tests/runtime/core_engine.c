@@ -29,10 +29,14 @@
 
 /* Test functions*/
 void flb_test_engine_wildcard(void);
+void flb_test_engine_shards(void);
+void flb_test_engine_shards_pinned(void);
 
 /* Test list */
 TEST_LIST = {
-    {"wildcard",    flb_test_engine_wildcard },
+    {"wildcard",      flb_test_engine_wildcard },
+    {"shards",        flb_test_engine_shards },
+    {"shards_pinned", flb_test_engine_shards_pinned },
     {NULL, NULL}
 };
 
@@ -145,3 +149,95 @@ void flb_test_engine_wildcard(void)
         i++;
     }
 }
+
+/* Records received by the output copies of all the engine shards */
+pthread_mutex_t shard_mutex = PTHREAD_MUTEX_INITIALIZER;
+int shard_records;
+
+int callback_count(void* data, size_t size, void* cb_data)
+{
+    int n = 0;
+    size_t i;
+    size_t len = sizeof("shard_value") - 1;
+    char *p = data;
+
+    for (i = 0; i + len <= size; i++) {
+        if (memcmp(p + i, "shard_value", len) == 0) {
+            i += len - 1;
+            n++;
+        }
+    }
+    flb_lib_free(data);
+
+    pthread_mutex_lock(&shard_mutex);
+    shard_records += n;
+    pthread_mutex_unlock(&shard_mutex);
+
+    return 0;
+}
+
+/* Push 'records' to each input, every record must reach the output */
+static void check_shards(char *shards, char *pinned, int records)
+{
+    int i;
+    int ret;
+    int in_ffd[2];
+    int out_ffd;
+    int total;
+    flb_ctx_t *ctx;
+    char *str = (char *) "[1, {\"key\":\"shard_value\"}]";
+    struct flb_lib_out_cb cb;
+
+    cb.cb   = callback_count;
+    cb.data = NULL;
+    shard_records = 0;
+
+    ctx = flb_create();
+    TEST_CHECK(ctx != NULL);
+
+    for (i = 0; i < 2; i++) {
+        in_ffd[i] = flb_input(ctx, (char *) "lib", NULL);
+        TEST_CHECK(in_ffd[i] >= 0);
+        flb_input_set(ctx, in_ffd[i], "tag", "test", NULL);
+        if (pinned) {
+            flb_input_set(ctx, in_ffd[i], "shard", pinned, NULL);
+        }
+    }
+
+    out_ffd = flb_output(ctx, (char *) "lib", &cb);
+    TEST_CHECK(out_ffd >= 0);
+    flb_output_set(ctx, out_ffd, "match", "test", NULL);
+
+    flb_service_set(ctx, "Flush", "1", "Grace", "2",
+                    "Engine_Shards", shards, NULL);
+
+    ret = flb_start(ctx);
+    TEST_CHECK(ret == 0);
+
+    for (i = 0; i < records; i++) {
+        flb_lib_push(ctx, in_ffd[0], str, strlen(str));
+        flb_lib_push(ctx, in_ffd[1], str, strlen(str));
+    }
+    sleep(2);
+
+    pthread_mutex_lock(&shard_mutex);
+    total = shard_records;
+    pthread_mutex_unlock(&shard_mutex);
+    TEST_CHECK(total == records * 2);
+    TEST_MSG("records: expected=%i got=%i", records * 2, total);
+
+    /* The shards stop with the service */
+    flb_stop(ctx);
+    flb_destroy(ctx);
+}
+
+void flb_test_engine_shards(void)
+{
+    check_shards("2", NULL, 100);
+}
+
+/* Both inputs in the second shard, the main engine has none */
+void flb_test_engine_shards_pinned(void)
+{
+    check_shards("2", "1", 100);
+}
@@ -0,0 +1,97 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <fluent-bit.h>
+#include "flb_tests_runtime.h"
+
+/* Utility functions */
+pthread_mutex_t result_mutex = PTHREAD_MUTEX_INITIALIZER;
+int num_output = 0;
+int num_count = 0;
+int num_raw = 0;
+
+/* Test functions */
+void flb_test_filter_aggregate_count(void);
+
+/* Test list */
+TEST_LIST = {
+    {"count", flb_test_filter_aggregate_count },
+    {NULL, NULL}
+};
+
+/* Aggregated records: add their 'count' field */
+static int cb_count(void *record, size_t size, void *data)
+{
+    char *p;
+
+    pthread_mutex_lock(&result_mutex);
+    p = strstr(record, "\"count\":");
+    if (p) {
+        num_output++;
+        num_count += atoi(p + 8);
+    }
+    else {
+        num_raw++;
+    }
+    pthread_mutex_unlock(&result_mutex);
+
+    flb_free(record);
+    return 0;
+}
+
+void flb_test_filter_aggregate_count(void)
+{
+    int i;
+    int ret;
+    int bytes;
+    int in_ffd;
+    int out_ffd;
+    int filter_ffd;
+    char p[100];
+    flb_ctx_t *ctx;
+    struct flb_lib_out_cb cb_data;
+
+    cb_data.cb = cb_count;
+    cb_data.data = NULL;
+
+    ctx = flb_create();
+    flb_service_set(ctx, "Flush", "1", NULL);
+
+    in_ffd = flb_input(ctx, (char *) "lib", NULL);
+    TEST_CHECK(in_ffd >= 0);
+    flb_input_set(ctx, in_ffd, "tag", "test", NULL);
+
+    out_ffd = flb_output(ctx, (char *) "lib", (void *) &cb_data);
+    TEST_CHECK(out_ffd >= 0);
+    flb_output_set(ctx, out_ffd, "match", "*", "format", "json", NULL);
+
+    filter_ffd = flb_filter(ctx, (char *) "aggregate", NULL);
+    TEST_CHECK(filter_ffd >= 0);
+    ret = flb_filter_set(ctx, filter_ffd, "match", "test",
+                         "group_by", "status", "value_key", "latency",
+                         "window", "1", "tag", "metrics", NULL);
+    TEST_CHECK(ret == 0);
+
+    ret = flb_start(ctx);
+    TEST_CHECK(ret == 0);
+
+    /* 3 groups */
+    for (i = 0; i < 30; i++) {
+        snprintf(p, sizeof(p),
+                 "[%d, {\"status\": %d, \"latency\": %d}]",
+                 i, 200 + (i % 3), i);
+        bytes = flb_lib_push(ctx, in_ffd, p, strlen(p));
+        TEST_CHECK(bytes == strlen(p));
+    }
+    sleep(4); /* window end and flush */
+
+    pthread_mutex_lock(&result_mutex);
+    TEST_CHECK(num_raw == 0);
+    TEST_CHECK(num_count == 30);
+    TEST_MSG("raw records: %i, aggregated count: %i", num_raw, num_count);
+    TEST_CHECK(num_output >= 3 && num_output <= 6);
+    TEST_MSG("aggregated records: %i", num_output);
+    pthread_mutex_unlock(&result_mutex);
+
+    flb_stop(ctx);
+    flb_destroy(ctx);
+}
@@ -0,0 +1,139 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <fluent-bit.h>
+#include "flb_tests_runtime.h"
+
+/* Utility functions */
+pthread_mutex_t result_mutex = PTHREAD_MUTEX_INITIALIZER;
+int num_output = 0;
+
+/* Test functions */
+void flb_test_filter_dedup_record(void);
+void flb_test_filter_dedup_keys(void);
+
+/* Test list */
+TEST_LIST = {
+    {"record", flb_test_filter_dedup_record },
+    {"keys",   flb_test_filter_dedup_keys   },
+    {NULL, NULL}
+};
+
+static int cb_count(void *record, size_t size, void *data)
+{
+    pthread_mutex_lock(&result_mutex);
+    num_output++;
+    pthread_mutex_unlock(&result_mutex);
+
+    flb_free(record);
+    return 0;
+}
+
+static int get_output()
+{
+    int ret;
+
+    pthread_mutex_lock(&result_mutex);
+    ret = num_output;
+    num_output = 0;
+    pthread_mutex_unlock(&result_mutex);
+
+    return ret;
+}
+
+static flb_ctx_t *dedup_ctx_create(int *in_ffd, int *filter_ffd)
+{
+    int out_ffd;
+    flb_ctx_t *ctx;
+    static struct flb_lib_out_cb cb_data;
+
+    cb_data.cb = cb_count;
+    cb_data.data = NULL;
+
+    ctx = flb_create();
+    flb_service_set(ctx, "Flush", "1", NULL);
+
+    *in_ffd = flb_input(ctx, (char *) "lib", NULL);
+    TEST_CHECK(*in_ffd >= 0);
+    flb_input_set(ctx, *in_ffd, "tag", "test", NULL);
+
+    out_ffd = flb_output(ctx, (char *) "lib", (void *) &cb_data);
+    TEST_CHECK(out_ffd >= 0);
+    flb_output_set(ctx, out_ffd, "match", "test", "format", "json", NULL);
+
+    *filter_ffd = flb_filter(ctx, (char *) "dedup", NULL);
+    TEST_CHECK(*filter_ffd >= 0);
+    flb_filter_set(ctx, *filter_ffd, "match", "*", NULL);
+
+    get_output();
+    return ctx;
+}
+
+static void push(flb_ctx_t *ctx, int in_ffd, char *p)
+{
+    int bytes;
+
+    bytes = flb_lib_push(ctx, in_ffd, p, strlen(p));
+    TEST_CHECK(bytes == strlen(p));
+}
+
+void flb_test_filter_dedup_record(void)
+{
+    int i;
+    int ret;
+    int in_ffd;
+    int filter_ffd;
+    char p[100];
+    flb_ctx_t *ctx;
+
+    ctx = dedup_ctx_create(&in_ffd, &filter_ffd);
+    ret = flb_start(ctx);
+    TEST_CHECK(ret == 0);
+
+    /* 100 distinct records sent three times */
+    for (i = 0; i < 300; i++) {
+        snprintf(p, sizeof(p), "[%d, {\"log\": \"line %d\"}]",
+                 i % 100, i % 100);
+        push(ctx, in_ffd, p);
+    }
+    sleep(2); /* waiting flush */
+
+    ret = get_output();
+    TEST_CHECK(ret == 100);
+    TEST_MSG("records: %i", ret);
+
+    flb_stop(ctx);
+    flb_destroy(ctx);
+}
+
+void flb_test_filter_dedup_keys(void)
+{
+    int ret;
+    int in_ffd;
+    int filter_ffd;
+    flb_ctx_t *ctx;
+
+    ctx = dedup_ctx_create(&in_ffd, &filter_ffd);
+    ret = flb_filter_set(ctx, filter_ffd, "key", "id", "key", "stream", NULL);
+    TEST_CHECK(ret == 0);
+    ret = flb_start(ctx);
+    TEST_CHECK(ret == 0);
+
+    /* Only the keys identify a record */
+    push(ctx, in_ffd, "[1, {\"id\": 1, \"stream\": \"out\", \"n\": 1}]");
+    push(ctx, in_ffd, "[2, {\"id\": 1, \"stream\": \"out\", \"n\": 2}]");
+    push(ctx, in_ffd, "[3, {\"id\": 1, \"stream\": \"err\", \"n\": 3}]");
+    push(ctx, in_ffd, "[4, {\"id\": 2, \"n\": 4}]");
+    push(ctx, in_ffd, "[5, {\"id\": 2, \"n\": 5}]");
+
+    /* Records without any key are kept */
+    push(ctx, in_ffd, "[6, {\"n\": 6}]");
+    push(ctx, in_ffd, "[7, {\"n\": 6}]");
+    sleep(2); /* waiting flush */
+
+    ret = get_output();
+    TEST_CHECK(ret == 5);
+    TEST_MSG("records: %i", ret);
+
+    flb_stop(ctx);
+    flb_destroy(ctx);
+}
@@ -1,6 +1,8 @@
 /* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
 
 #include <fluent-bit.h>
+#include <fluent-bit/flb_filter.h>
+#include <fluent-bit/flb_metrics.h>
 #include "flb_tests_runtime.h"
 
 /* Test data */
@@ -9,12 +11,14 @@
 void flb_test_filter_grep_regex(void);
 void flb_test_filter_grep_exclude(void);
 void flb_test_filter_grep_invalid(void);
+void flb_test_filter_grep_metrics(void);
 
 /* Test list */
 TEST_LIST = {
     {"regex",   flb_test_filter_grep_regex   },
     {"exclude", flb_test_filter_grep_exclude },
     {"invalid", flb_test_filter_grep_invalid },
+    {"metrics", flb_test_filter_grep_metrics },
     {NULL, NULL}
 };
 
@@ -152,3 +156,104 @@ void flb_test_filter_grep_invalid(void)
     flb_stop(ctx);
     flb_destroy(ctx);
 }
+
+static size_t filter_metric(flb_ctx_t *ctx, int n, int id)
+{
+    struct mk_list *head;
+    struct flb_metric *m;
+    struct flb_filter_instance *f_ins;
+
+    mk_list_foreach(head, &ctx->config->filters) {
+        f_ins = mk_list_entry(head, struct flb_filter_instance, _head);
+        if (n-- == 0) {
+            m = flb_metrics_get_id(id, f_ins->metrics);
+            return m ? flb_metric_value(m) : 0;
+        }
+    }
+    return 0;
+}
+
+/* Records and bytes through a chain of two filters */
+void flb_test_filter_grep_metrics(void)
+{
+    int i;
+    int ret;
+    int bytes;
+    int pass_1 = 0;
+    int pass_2 = 0;
+    char p[100];
+    flb_ctx_t *ctx;
+    int in_ffd;
+    int out_ffd;
+    int filter_ffd;
+
+    ctx = flb_create();
+
+    in_ffd = flb_input(ctx, (char *) "lib", NULL);
+    TEST_CHECK(in_ffd >= 0);
+    flb_input_set(ctx, in_ffd, "tag", "test", NULL);
+
+    out_ffd = flb_output(ctx, (char *) "null", NULL);
+    TEST_CHECK(out_ffd >= 0);
+    flb_output_set(ctx, out_ffd, "match", "test", NULL);
+
+    filter_ffd = flb_filter(ctx, (char *) "grep", NULL);
+    TEST_CHECK(filter_ffd >= 0);
+    ret = flb_filter_set(ctx, filter_ffd, "match", "*", NULL);
+    TEST_CHECK(ret == 0);
+    ret = flb_filter_set(ctx, filter_ffd, "Regex", "val ^1", NULL);
+    TEST_CHECK(ret == 0);
+
+    filter_ffd = flb_filter(ctx, (char *) "grep", NULL);
+    TEST_CHECK(filter_ffd >= 0);
+    ret = flb_filter_set(ctx, filter_ffd, "match", "*", NULL);
+    TEST_CHECK(ret == 0);
+    ret = flb_filter_set(ctx, filter_ffd, "Exclude", "val 1$", NULL);
+    TEST_CHECK(ret == 0);
+
+    ret = flb_start(ctx);
+    TEST_CHECK(ret == 0);
+
+    for (i = 0; i < 256; i++) {
+        snprintf(p, sizeof(p), "%d", i * i);
+        if (p[0] == '1') {
+            pass_1++;
+            if (p[strlen(p) - 1] != '1') {
+                pass_2++;
+            }
+        }
+        snprintf(p, sizeof(p),
+                 "[%d, {\"val\": \"%d\",\"END_KEY\": \"JSON_END\"}]",
+                 i, (i * i));
+        bytes = flb_lib_push(ctx, in_ffd, p, strlen(p));
+        TEST_CHECK(bytes == strlen(p));
+    }
+
+    sleep(1); /* waiting flush */
+
+    /* The filter instances are released when the engine stops */
+    TEST_CHECK(filter_metric(ctx, 0, FLB_METRIC_FILTER_IN_RECORDS) == 256);
+    TEST_CHECK(filter_metric(ctx, 0, FLB_METRIC_FILTER_OUT_RECORDS) ==
+               pass_1);
+    TEST_CHECK(filter_metric(ctx, 0, FLB_METRIC_FILTER_DROP_RECORDS) ==
+               256 - pass_1);
+
+    TEST_CHECK(filter_metric(ctx, 1, FLB_METRIC_FILTER_IN_RECORDS) == pass_1);
+    TEST_CHECK(filter_metric(ctx, 1, FLB_METRIC_FILTER_OUT_RECORDS) ==
+               pass_2);
+    TEST_CHECK(filter_metric(ctx, 1, FLB_METRIC_FILTER_DROP_RECORDS) ==
+               pass_1 - pass_2);
+
+    /*
+     * Both filters work on the same decoded records, the size is known once
+     * the chain encodes them: it's reported by the last one.
+     */
+    TEST_CHECK(filter_metric(ctx, 0, FLB_METRIC_FILTER_OUT_BYTES) ==
+               filter_metric(ctx, 0, FLB_METRIC_FILTER_IN_BYTES));
+    TEST_CHECK(filter_metric(ctx, 1, FLB_METRIC_FILTER_OUT_BYTES) <
+               filter_metric(ctx, 1, FLB_METRIC_FILTER_IN_BYTES));
+    TEST_CHECK(filter_metric(ctx, 1, FLB_METRIC_FILTER_OUT_BYTES) > 0);
+
+    flb_stop(ctx);
+    flb_destroy(ctx);
+}
@@ -1,5 +1,8 @@
 /* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
 
+/* accept4() in the monkey headers */
+#define _GNU_SOURCE
+
 #include <fluent-bit.h>
 #include <monkey/mk_lib.h>
 #include "flb_tests_runtime.h"
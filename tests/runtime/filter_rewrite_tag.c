@@ -0,0 +1,148 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <fluent-bit.h>
+#include "flb_tests_runtime.h"
+
+/* Utility functions */
+pthread_mutex_t result_mutex = PTHREAD_MUTEX_INITIALIZER;
+int num_orig = 0;
+int num_new = 0;
+
+/* Test functions */
+void flb_test_filter_rewrite_tag_move(void);
+void flb_test_filter_rewrite_tag_keep(void);
+
+/* Test list */
+TEST_LIST = {
+    {"move", flb_test_filter_rewrite_tag_move },
+    {"keep", flb_test_filter_rewrite_tag_keep },
+    {NULL, NULL}
+};
+
+static int cb_count(void *record, size_t size, void *data)
+{
+    int *counter = data;
+
+    pthread_mutex_lock(&result_mutex);
+    (*counter)++;
+    pthread_mutex_unlock(&result_mutex);
+
+    flb_free(record);
+    return 0;
+}
+
+static void get_output(int *orig, int *new)
+{
+    pthread_mutex_lock(&result_mutex);
+    *orig = num_orig;
+    *new = num_new;
+    num_orig = 0;
+    num_new = 0;
+    pthread_mutex_unlock(&result_mutex);
+}
+
+/* 'app.web' records go to one output, the re-tagged ones to another */
+static flb_ctx_t *rewrite_ctx_create(int *in_ffd, char *rule)
+{
+    int out_ffd;
+    int filter_ffd;
+    int orig;
+    int new;
+    flb_ctx_t *ctx;
+    static struct flb_lib_out_cb cb_orig;
+    static struct flb_lib_out_cb cb_new;
+
+    cb_orig.cb = cb_count;
+    cb_orig.data = &num_orig;
+    cb_new.cb = cb_count;
+    cb_new.data = &num_new;
+
+    ctx = flb_create();
+    flb_service_set(ctx, "Flush", "1", NULL);
+
+    *in_ffd = flb_input(ctx, (char *) "lib", NULL);
+    TEST_CHECK(*in_ffd >= 0);
+    flb_input_set(ctx, *in_ffd, "tag", "app.web", NULL);
+
+    out_ffd = flb_output(ctx, (char *) "lib", (void *) &cb_orig);
+    TEST_CHECK(out_ffd >= 0);
+    flb_output_set(ctx, out_ffd, "match", "app.web", "format", "json", NULL);
+
+    out_ffd = flb_output(ctx, (char *) "lib", (void *) &cb_new);
+    TEST_CHECK(out_ffd >= 0);
+    flb_output_set(ctx, out_ffd, "match", "errors.web.5*",
+                   "format", "json", NULL);
+
+    filter_ffd = flb_filter(ctx, (char *) "rewrite_tag", NULL);
+    TEST_CHECK(filter_ffd >= 0);
+    flb_filter_set(ctx, filter_ffd, "match", "app.*", "rule", rule, NULL);
+
+    get_output(&orig, &new);
+    return ctx;
+}
+
+static void push(flb_ctx_t *ctx, int in_ffd, char *p)
+{
+    int bytes;
+
+    bytes = flb_lib_push(ctx, in_ffd, p, strlen(p));
+    TEST_CHECK(bytes == strlen(p));
+}
+
+static void push_records(flb_ctx_t *ctx, int in_ffd)
+{
+    push(ctx, in_ffd, "[1, {\"status\": 200, \"log\": \"ok\"}]");
+    push(ctx, in_ffd, "[2, {\"status\": 503, \"log\": \"unavailable\"}]");
+    push(ctx, in_ffd, "[3, {\"status\": \"500\", \"log\": \"error\"}]");
+    push(ctx, in_ffd, "[4, {\"log\": \"no status\"}]");
+}
+
+void flb_test_filter_rewrite_tag_move(void)
+{
+    int ret;
+    int in_ffd;
+    int orig;
+    int new;
+    flb_ctx_t *ctx;
+
+    ctx = rewrite_ctx_create(&in_ffd, "$status ^(5)\\d\\d$ errors.$TAG[1].$1 false");
+    ret = flb_start(ctx);
+    TEST_CHECK(ret == 0);
+
+    push_records(ctx, in_ffd);
+    sleep(2); /* waiting flush */
+
+    get_output(&orig, &new);
+    TEST_CHECK(orig == 2);
+    TEST_MSG("original records: %i", orig);
+    TEST_CHECK(new == 2);
+    TEST_MSG("re-tagged records: %i", new);
+
+    flb_stop(ctx);
+    flb_destroy(ctx);
+}
+
+void flb_test_filter_rewrite_tag_keep(void)
+{
+    int ret;
+    int in_ffd;
+    int orig;
+    int new;
+    flb_ctx_t *ctx;
+
+    ctx = rewrite_ctx_create(&in_ffd, "$status ^(5)\\d\\d$ errors.$TAG[1].$1 true");
+    ret = flb_start(ctx);
+    TEST_CHECK(ret == 0);
+
+    push_records(ctx, in_ffd);
+    sleep(2); /* waiting flush */
+
+    get_output(&orig, &new);
+    TEST_CHECK(orig == 4);
+    TEST_MSG("original records: %i", orig);
+    TEST_CHECK(new == 2);
+    TEST_MSG("re-tagged records: %i", new);
+
+    flb_stop(ctx);
+    flb_destroy(ctx);
+}
@@ -0,0 +1,228 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <fluent-bit.h>
+#include "flb_tests_runtime.h"
+
+/* Test data */
+#define REQUESTS       100
+#define REQUEST_LINES  10
+
+/* Utility functions */
+pthread_mutex_t result_mutex = PTHREAD_MUTEX_INITIALIZER;
+int num_output = 0;
+int req_lines[REQUESTS];
+
+/* Test functions */
+void flb_test_filter_sampling_random(void);
+void flb_test_filter_sampling_hash(void);
+void flb_test_filter_sampling_tail(void);
+void flb_test_filter_sampling_invalid(void);
+
+/* Test list */
+TEST_LIST = {
+    {"random",  flb_test_filter_sampling_random  },
+    {"hash",    flb_test_filter_sampling_hash    },
+    {"tail",    flb_test_filter_sampling_tail    },
+    {"invalid", flb_test_filter_sampling_invalid },
+    {NULL, NULL}
+};
+
+static int cb_count(void *record, size_t size, void *data)
+{
+    int id;
+    char *p;
+
+    pthread_mutex_lock(&result_mutex);
+    num_output++;
+    p = strstr(record, "\"req\":");
+    if (p) {
+        id = atoi(p + 6);
+        if (id >= 0 && id < REQUESTS) {
+            req_lines[id]++;
+        }
+    }
+    pthread_mutex_unlock(&result_mutex);
+
+    flb_free(record);
+    return 0;
+}
+
+static void clear_output()
+{
+    pthread_mutex_lock(&result_mutex);
+    num_output = 0;
+    memset(req_lines, '\0', sizeof(req_lines));
+    pthread_mutex_unlock(&result_mutex);
+}
+
+static int get_output()
+{
+    int ret;
+
+    pthread_mutex_lock(&result_mutex);
+    ret = num_output;
+    pthread_mutex_unlock(&result_mutex);
+
+    return ret;
+}
+
+static flb_ctx_t *sampling_ctx_create(int *in_ffd, int *filter_ffd)
+{
+    int out_ffd;
+    flb_ctx_t *ctx;
+    static struct flb_lib_out_cb cb_data;
+
+    cb_data.cb = cb_count;
+    cb_data.data = NULL;
+
+    ctx = flb_create();
+    flb_service_set(ctx, "Flush", "1", NULL);
+
+    *in_ffd = flb_input(ctx, (char *) "lib", NULL);
+    TEST_CHECK(*in_ffd >= 0);
+    flb_input_set(ctx, *in_ffd, "tag", "test", NULL);
+
+    out_ffd = flb_output(ctx, (char *) "lib", (void *) &cb_data);
+    TEST_CHECK(out_ffd >= 0);
+    flb_output_set(ctx, out_ffd, "match", "test", "format", "json", NULL);
+
+    *filter_ffd = flb_filter(ctx, (char *) "sampling", NULL);
+    TEST_CHECK(*filter_ffd >= 0);
+    flb_filter_set(ctx, *filter_ffd, "match", "*", NULL);
+
+    clear_output();
+    return ctx;
+}
+
+static void push_records(flb_ctx_t *ctx, int in_ffd, int count, char *level)
+{
+    int i;
+    int bytes;
+    char p[100];
+
+    for (i = 0; i < count; i++) {
+        snprintf(p, sizeof(p),
+                 "[%d, {\"req\": %d, \"level\": \"%s\"}]",
+                 i, i % REQUESTS, level);
+        bytes = flb_lib_push(ctx, in_ffd, p, strlen(p));
+        TEST_CHECK(bytes == strlen(p));
+    }
+}
+
+void flb_test_filter_sampling_random(void)
+{
+    int ret;
+    int out;
+    int in_ffd;
+    int filter_ffd;
+    flb_ctx_t *ctx;
+
+    ctx = sampling_ctx_create(&in_ffd, &filter_ffd);
+    ret = flb_filter_set(ctx, filter_ffd, "mode", "random", "rate", "0.5",
+                         NULL);
+    TEST_CHECK(ret == 0);
+
+    ret = flb_start(ctx);
+    TEST_CHECK(ret == 0);
+
+    push_records(ctx, in_ffd, 1000, "info");
+    sleep(2); /* waiting flush */
+
+    out = get_output();
+    TEST_CHECK(out > 350 && out < 650);
+    TEST_MSG("records kept: %i of 1000", out);
+
+    flb_stop(ctx);
+    flb_destroy(ctx);
+}
+
+void flb_test_filter_sampling_hash(void)
+{
+    int i;
+    int ret;
+    int kept = 0;
+    int in_ffd;
+    int filter_ffd;
+    flb_ctx_t *ctx;
+
+    ctx = sampling_ctx_create(&in_ffd, &filter_ffd);
+    ret = flb_filter_set(ctx, filter_ffd, "mode", "hash", "hash_key", "req",
+                         "rate", "0.3", NULL);
+    TEST_CHECK(ret == 0);
+
+    ret = flb_start(ctx);
+    TEST_CHECK(ret == 0);
+
+    push_records(ctx, in_ffd, REQUESTS * REQUEST_LINES, "info");
+    sleep(2); /* waiting flush */
+
+    /* All the lines of a request are kept or dropped together */
+    pthread_mutex_lock(&result_mutex);
+    for (i = 0; i < REQUESTS; i++) {
+        TEST_CHECK(req_lines[i] == 0 || req_lines[i] == REQUEST_LINES);
+        TEST_MSG("request %i: %i lines", i, req_lines[i]);
+        if (req_lines[i] > 0) {
+            kept++;
+        }
+    }
+    pthread_mutex_unlock(&result_mutex);
+    TEST_CHECK(kept > 10 && kept < 50);
+    TEST_MSG("requests kept: %i of %i", kept, REQUESTS);
+
+    flb_stop(ctx);
+    flb_destroy(ctx);
+}
+
+void flb_test_filter_sampling_tail(void)
+{
+    int ret;
+    int in_ffd;
+    int filter_ffd;
+    flb_ctx_t *ctx;
+
+    ctx = sampling_ctx_create(&in_ffd, &filter_ffd);
+    ret = flb_filter_set(ctx, filter_ffd, "mode", "tail", "rate", "0",
+                         "window", "30", NULL);
+    TEST_CHECK(ret == 0);
+
+    ret = flb_start(ctx);
+    TEST_CHECK(ret == 0);
+
+    /* Nothing is kept out of a window */
+    push_records(ctx, in_ffd, 50, "info");
+    sleep(2);
+    TEST_CHECK(get_output() == 0);
+
+    /* An error opens the window */
+    push_records(ctx, in_ffd, 1, "ERROR");
+    push_records(ctx, in_ffd, 20, "info");
+    sleep(2);
+    TEST_CHECK(get_output() == 21);
+    TEST_MSG("records kept: %i", get_output());
+
+    flb_stop(ctx);
+    flb_destroy(ctx);
+}
+
+void flb_test_filter_sampling_invalid(void)
+{
+    int ret;
+    int in_ffd;
+    int filter_ffd;
+    flb_ctx_t *ctx;
+
+    /* hash mode without key: the filter is not loaded */
+    ctx = sampling_ctx_create(&in_ffd, &filter_ffd);
+    ret = flb_filter_set(ctx, filter_ffd, "mode", "hash", NULL);
+    TEST_CHECK(ret == 0);
+
+    ret = flb_start(ctx);
+    TEST_CHECK(ret == 0);
+
+    push_records(ctx, in_ffd, 100, "info");
+    sleep(2); /* waiting flush */
+    TEST_CHECK(get_output() == 100);
+
+    flb_stop(ctx);
+    flb_destroy(ctx);
+}
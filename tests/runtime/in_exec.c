@@ -0,0 +1,121 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2015-2018 Treasure Data Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+#include <fluent-bit.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "flb_tests_runtime.h"
+
+/* Test functions */
+void flb_test_in_exec_persistent(void);
+void flb_test_in_exec_persistent_restart(void);
+
+/* Test list */
+TEST_LIST = {
+    {"persistent",         flb_test_in_exec_persistent         },
+    {"persistent_restart", flb_test_in_exec_persistent_restart },
+    {NULL, NULL}
+};
+
+
+pthread_mutex_t result_mutex;
+int records;
+int matched;
+
+int callback_test(void* data, size_t size, void *cb_data)
+{
+    pthread_mutex_lock(&result_mutex);
+    records++;
+    if (strstr((char *) data, "\"exec\":\"line")) {
+        matched++;
+    }
+    pthread_mutex_unlock(&result_mutex);
+    flb_lib_free(data);
+    return 0;
+}
+
+static flb_ctx_t *exec_start(char *cmd)
+{
+    int ret;
+    int in_ffd;
+    int out_ffd;
+    flb_ctx_t *ctx;
+    struct flb_lib_out_cb cb;
+
+    cb.cb   = callback_test;
+    cb.data = NULL;
+
+    records = 0;
+    matched = 0;
+
+    ctx = flb_create();
+    flb_service_set(ctx, "Flush", "1", NULL);
+
+    in_ffd = flb_input(ctx, (char *) "exec", NULL);
+    TEST_CHECK(in_ffd >= 0);
+    flb_input_set(ctx, in_ffd, "tag", "test", "mode", "persistent",
+                  "command", cmd, NULL);
+
+    out_ffd = flb_output(ctx, (char *) "lib", &cb);
+    TEST_CHECK(out_ffd >= 0);
+    flb_output_set(ctx, out_ffd, "match", "test", "format", "json", NULL);
+
+    ret = flb_start(ctx);
+    TEST_CHECK(ret == 0);
+
+    return ctx;
+}
+
+/* The command keeps running, its lines are read as they are written */
+void flb_test_in_exec_persistent(void)
+{
+    flb_ctx_t *ctx;
+
+    pthread_mutex_init(&result_mutex, NULL);
+    ctx = exec_start("echo line 1; echo line 2; echo line 3; sleep 60");
+
+    sleep(2);
+    pthread_mutex_lock(&result_mutex);
+    TEST_CHECK(records == 3);
+    TEST_CHECK(matched == 3);
+    pthread_mutex_unlock(&result_mutex);
+
+    /* The command is terminated */
+    flb_stop(ctx);
+    flb_destroy(ctx);
+    pthread_mutex_destroy(&result_mutex);
+}
+
+/* The command is started again when it exits */
+void flb_test_in_exec_persistent_restart(void)
+{
+    flb_ctx_t *ctx;
+
+    pthread_mutex_init(&result_mutex, NULL);
+    ctx = exec_start("echo line");
+
+    sleep(4);
+    pthread_mutex_lock(&result_mutex);
+    TEST_CHECK(matched >= 2);
+    pthread_mutex_unlock(&result_mutex);
+
+    flb_stop(ctx);
+    flb_destroy(ctx);
+    pthread_mutex_destroy(&result_mutex);
+}
@@ -0,0 +1,339 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <fluent-bit.h>
+#include <fluent-bit/flb_lib.h>
+#include <fluent-bit/flb_gzip.h>
+#include <msgpack.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "flb_tests_runtime.h"
+
+#define HTTP_PORT      5184
+#define HTTP_CLIENTS   4
+#define HTTP_REQUESTS  50
+
+#define JSON_RECORDS   "[{\"n\": 1}, {\"n\": 2}, {\"n\": 3}, {\"n\": 4}]"
+
+/* Test functions */
+void flb_test_http_json(void);
+void flb_test_http_formats(void);
+void flb_test_http_workers(void);
+void flb_test_http_paused(void);
+
+/* Test list */
+TEST_LIST = {
+    {"json",    flb_test_http_json    },
+    {"formats", flb_test_http_formats },
+    {"workers", flb_test_http_workers },
+    {"paused",  flb_test_http_paused  },
+    {NULL, NULL}
+};
+
+static pthread_mutex_t result_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int result_records;
+static int result_tagged;
+
+static int cb_count(void *record, size_t size, void *data)
+{
+    struct flb_lib_chunk *chunk = record;
+
+    pthread_mutex_lock(&result_mutex);
+    result_records += chunk->records;
+    if (strcmp(chunk->tag, "app.logs") == 0) {
+        result_tagged += chunk->records;
+    }
+    pthread_mutex_unlock(&result_mutex);
+
+    flb_lib_free(chunk);
+    return 0;
+}
+
+static int http_connect()
+{
+    int fd;
+    int ret;
+    struct sockaddr_in addr;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) {
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(HTTP_PORT);
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    ret = connect(fd, (struct sockaddr *) &addr, sizeof(addr));
+    if (ret == -1) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/* Send a POST request on a keepalive connection, returns the status */
+static int http_post(int fd, char *path, char *type, char *encoding,
+                     char *body, size_t size)
+{
+    int len;
+    int ret;
+    int status;
+    char buf[512];
+
+    len = snprintf(buf, sizeof(buf),
+                   "POST %s HTTP/1.1\r\n"
+                   "Host: 127.0.0.1\r\n"
+                   "Content-Type: %s\r\n"
+                   "%s%s%s"
+                   "Content-Length: %lu\r\n\r\n",
+                   path, type,
+                   encoding ? "Content-Encoding: " : "",
+                   encoding ? encoding : "",
+                   encoding ? "\r\n" : "",
+                   size);
+    if (write(fd, buf, len) != len ||
+        write(fd, body, size) != (ssize_t) size) {
+        return -1;
+    }
+
+    /* The responses have no body */
+    len = 0;
+    while (len < 4 || memcmp(buf + len - 4, "\r\n\r\n", 4) != 0) {
+        ret = read(fd, buf + len, sizeof(buf) - len - 1);
+        if (ret <= 0) {
+            return -1;
+        }
+        len += ret;
+    }
+    buf[len] = '\0';
+
+    if (sscanf(buf, "HTTP/1.1 %d", &status) != 1) {
+        return -1;
+    }
+    return status;
+}
+
+static flb_ctx_t *http_start(char *workers, char *mem_buf_limit, char *flush)
+{
+    int ret;
+    int in_ffd;
+    int out_ffd;
+    char port[16];
+    flb_ctx_t *ctx;
+    struct flb_lib_out_cb cb_data;
+
+    cb_data.cb = cb_count;
+    cb_data.data = NULL;
+
+    pthread_mutex_lock(&result_mutex);
+    result_records = 0;
+    result_tagged = 0;
+    pthread_mutex_unlock(&result_mutex);
+
+    ctx = flb_create();
+
+    snprintf(port, sizeof(port), "%d", HTTP_PORT);
+    in_ffd = flb_input(ctx, (char *) "http", NULL);
+    TEST_CHECK(in_ffd >= 0);
+    flb_input_set(ctx, in_ffd, "tag", "test", "port", port,
+                  "listen", "127.0.0.1", "workers", workers, NULL);
+    if (mem_buf_limit) {
+        flb_input_set(ctx, in_ffd, "mem_buf_limit", mem_buf_limit, NULL);
+    }
+
+    out_ffd = flb_output(ctx, (char *) "lib", &cb_data);
+    TEST_CHECK(out_ffd >= 0);
+    flb_output_set(ctx, out_ffd, "match", "*", "format", "chunk", NULL);
+
+    flb_service_set(ctx, "Flush", flush, NULL);
+
+    ret = flb_start(ctx);
+    TEST_CHECK(ret == 0);
+
+    return ctx;
+}
+
+static void http_stop(flb_ctx_t *ctx)
+{
+    sleep(3); /* waiting flush */
+
+    flb_stop(ctx);
+    flb_destroy(ctx);
+}
+
+void flb_test_http_json(void)
+{
+    int i;
+    int fd;
+    int ret;
+    flb_ctx_t *ctx;
+
+    ctx = http_start("0", NULL, "1");
+
+    /* All the requests go through the same connection */
+    fd = http_connect();
+    TEST_CHECK(fd != -1);
+    for (i = 0; i < HTTP_REQUESTS; i++) {
+        ret = http_post(fd, "/app/logs", "application/json", NULL,
+                        JSON_RECORDS, sizeof(JSON_RECORDS) - 1);
+        TEST_CHECK(ret == 201);
+    }
+
+    /* Errors don't close the connection */
+    ret = http_post(fd, "/", "application/json", NULL, "{\"n\":", 5);
+    TEST_CHECK(ret == 400);
+    ret = http_post(fd, "/", "text/plain", NULL, "n", 1);
+    TEST_CHECK(ret == 415);
+    ret = http_post(fd, "/", "application/json", NULL, "{}", 2);
+    TEST_CHECK(ret == 201);
+    close(fd);
+
+    http_stop(ctx);
+    TEST_CHECK(result_tagged == HTTP_REQUESTS * 4);
+    TEST_CHECK(result_records == HTTP_REQUESTS * 4 + 1);
+}
+
+void flb_test_http_formats(void)
+{
+    int fd;
+    int ret;
+    char *ndjson = "{\"n\": 1}\n{\"n\": 2}\r\n\n{\"n\": 3}";
+    void *gz;
+    size_t gz_size;
+    flb_ctx_t *ctx;
+    msgpack_sbuffer mp_sbuf;
+    msgpack_packer mp_pck;
+
+    ctx = http_start("0", NULL, "1");
+    fd = http_connect();
+    TEST_CHECK(fd != -1);
+
+    /* 3 records */
+    ret = http_post(fd, "/", "application/x-ndjson", NULL,
+                    ndjson, strlen(ndjson));
+    TEST_CHECK(ret == 201);
+
+    /* 4 records */
+    ret = flb_gzip_compress(JSON_RECORDS, sizeof(JSON_RECORDS) - 1,
+                            &gz, &gz_size);
+    TEST_CHECK(ret == 0);
+    ret = http_post(fd, "/", "application/json", "gzip", gz, gz_size);
+    TEST_CHECK(ret == 201);
+    flb_free(gz);
+
+    /* 3 records: a map, an entry and a map in an array */
+    msgpack_sbuffer_init(&mp_sbuf);
+    msgpack_packer_init(&mp_pck, &mp_sbuf, msgpack_sbuffer_write);
+    msgpack_pack_map(&mp_pck, 1);
+    msgpack_pack_str(&mp_pck, 1);
+    msgpack_pack_str_body(&mp_pck, "k", 1);
+    msgpack_pack_int(&mp_pck, 1);
+    msgpack_pack_array(&mp_pck, 2);
+    msgpack_pack_uint32(&mp_pck, 1500000000);
+    msgpack_pack_map(&mp_pck, 0);
+    msgpack_pack_array(&mp_pck, 1);
+    msgpack_pack_map(&mp_pck, 0);
+    ret = http_post(fd, "/", "application/msgpack", NULL,
+                    mp_sbuf.data, mp_sbuf.size);
+    TEST_CHECK(ret == 201);
+
+    /* truncated */
+    ret = http_post(fd, "/", "application/msgpack", NULL,
+                    mp_sbuf.data, mp_sbuf.size - 1);
+    TEST_CHECK(ret == 400);
+    msgpack_sbuffer_destroy(&mp_sbuf);
+    close(fd);
+
+    http_stop(ctx);
+    TEST_CHECK(result_records == 10);
+}
+
+struct http_client {
+    pthread_t tid;
+    int created;
+};
+
+static void *http_client_run(void *data)
+{
+    int i;
+    int fd;
+    int *created = data;
+
+    fd = http_connect();
+    if (fd == -1) {
+        return NULL;
+    }
+    for (i = 0; i < HTTP_REQUESTS; i++) {
+        if (http_post(fd, "/app/logs", "application/json", NULL,
+                      JSON_RECORDS, sizeof(JSON_RECORDS) - 1) == 201) {
+            (*created)++;
+        }
+    }
+    close(fd);
+    return NULL;
+}
+
+void flb_test_http_workers(void)
+{
+    int i;
+    int created = 0;
+    flb_ctx_t *ctx;
+    struct http_client clients[HTTP_CLIENTS];
+
+    /* Connections are spread across the workers */
+    ctx = http_start("2", NULL, "1");
+
+    for (i = 0; i < HTTP_CLIENTS; i++) {
+        clients[i].created = 0;
+        pthread_create(&clients[i].tid, NULL, http_client_run,
+                       &clients[i].created);
+    }
+    for (i = 0; i < HTTP_CLIENTS; i++) {
+        pthread_join(clients[i].tid, NULL);
+        created += clients[i].created;
+    }
+    TEST_CHECK(created == HTTP_CLIENTS * HTTP_REQUESTS);
+
+    http_stop(ctx);
+    TEST_CHECK(result_tagged == HTTP_CLIENTS * HTTP_REQUESTS * 4);
+}
+
+void flb_test_http_paused(void)
+{
+    int i;
+    int fd;
+    int ret;
+    int created = 0;
+    int refused = 0;
+    flb_ctx_t *ctx;
+
+    /* Nothing is flushed during the test, the limit is reached */
+    ctx = http_start("0", "1k", "10");
+
+    fd = http_connect();
+    TEST_CHECK(fd != -1);
+    for (i = 0; i < HTTP_REQUESTS; i++) {
+        ret = http_post(fd, "/", "application/json", NULL,
+                        JSON_RECORDS, sizeof(JSON_RECORDS) - 1);
+        if (ret == 201) {
+            created++;
+        }
+        else if (ret == 429) {
+            refused++;
+        }
+    }
+    close(fd);
+
+    TEST_CHECK(created > 0);
+    TEST_CHECK(refused > 0);
+    TEST_CHECK(created + refused == HTTP_REQUESTS);
+
+    flb_stop(ctx);
+    flb_destroy(ctx);
+}
@@ -0,0 +1,276 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <fluent-bit.h>
+#include <fluent-bit/flb_lib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "flb_tests_runtime.h"
+
+#define MQTT_PORT       5185
+#define MQTT_MESSAGES   500
+
+#define MQTT_PAYLOAD    "{\"n\": 1, \"s\": \"abc\"}"
+
+/* Test functions */
+void flb_test_mqtt_publish(void);
+void flb_test_mqtt_topic_tag(void);
+
+/* Test list */
+TEST_LIST = {
+    {"publish",   flb_test_mqtt_publish   },
+    {"topic_tag", flb_test_mqtt_topic_tag },
+    {NULL, NULL}
+};
+
+static pthread_mutex_t result_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int result_records;
+static int result_tagged;
+
+static int cb_count(void *record, size_t size, void *data)
+{
+    struct flb_lib_chunk *chunk = record;
+
+    pthread_mutex_lock(&result_mutex);
+    result_records += chunk->records;
+    if (strcmp(chunk->tag, "sensors/a") == 0) {
+        result_tagged += chunk->records;
+    }
+    pthread_mutex_unlock(&result_mutex);
+
+    flb_lib_free(chunk);
+    return 0;
+}
+
+/* Fixed header with a one or two bytes remaining length */
+static int mqtt_header(unsigned char *buf, int type, int flags, int length)
+{
+    buf[0] = (type << 4) | flags;
+    if (length < 128) {
+        buf[1] = length;
+        return 2;
+    }
+    buf[1] = (length % 128) | 128;
+    buf[2] = length / 128;
+    return 3;
+}
+
+static int mqtt_publish(unsigned char *buf, char *topic, int qos, int id,
+                        char *payload)
+{
+    int len;
+    int topic_len = strlen(topic);
+    int payload_len = strlen(payload);
+
+    len = 2 + topic_len + payload_len + (qos > 0 ? 2 : 0);
+    len = mqtt_header(buf, 3, qos << 1, len);
+
+    buf[len++] = topic_len >> 8;
+    buf[len++] = topic_len & 0xff;
+    memcpy(buf + len, topic, topic_len);
+    len += topic_len;
+    if (qos > 0) {
+        buf[len++] = id >> 8;
+        buf[len++] = id & 0xff;
+    }
+    memcpy(buf + len, payload, payload_len);
+
+    return len + payload_len;
+}
+
+static int mqtt_read(int fd, unsigned char *buf, int size)
+{
+    int ret;
+    int len = 0;
+
+    while (len < size) {
+        ret = read(fd, buf + len, size - len);
+        if (ret <= 0) {
+            return -1;
+        }
+        len += ret;
+    }
+    return len;
+}
+
+/* Connect and send CONNECT, returns the socket once CONNACK is received */
+static int mqtt_connect()
+{
+    int fd;
+    int ret;
+    unsigned char connack[4];
+    unsigned char packet[] = {
+        0x10, 14, 0x00, 0x04, 'M', 'Q', 'T', 'T', 0x04, 0x02, 0x00, 0x3c,
+        0x00, 0x02, 't', '1'
+    };
+    struct sockaddr_in addr;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) {
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(MQTT_PORT);
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    ret = connect(fd, (struct sockaddr *) &addr, sizeof(addr));
+    if (ret == -1 ||
+        write(fd, packet, sizeof(packet)) != sizeof(packet) ||
+        mqtt_read(fd, connack, 4) != 4 || connack[0] != 0x20) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static flb_ctx_t *mqtt_start(char *tag_from_topic)
+{
+    int ret;
+    int in_ffd;
+    int out_ffd;
+    char port[16];
+    flb_ctx_t *ctx;
+    struct flb_lib_out_cb cb_data;
+
+    cb_data.cb = cb_count;
+    cb_data.data = NULL;
+
+    pthread_mutex_lock(&result_mutex);
+    result_records = 0;
+    result_tagged = 0;
+    pthread_mutex_unlock(&result_mutex);
+
+    ctx = flb_create();
+
+    snprintf(port, sizeof(port), "%d", MQTT_PORT);
+    in_ffd = flb_input(ctx, (char *) "mqtt", NULL);
+    TEST_CHECK(in_ffd >= 0);
+    flb_input_set(ctx, in_ffd, "tag", "test", "port", port,
+                  "listen", "127.0.0.1", "buffer_chunk_size", "64",
+                  "tag_from_topic", tag_from_topic, NULL);
+
+    out_ffd = flb_output(ctx, (char *) "lib", &cb_data);
+    TEST_CHECK(out_ffd >= 0);
+    flb_output_set(ctx, out_ffd, "match", "*", "format", "chunk", NULL);
+
+    flb_service_set(ctx, "Flush", "1", NULL);
+
+    ret = flb_start(ctx);
+    TEST_CHECK(ret == 0);
+
+    return ctx;
+}
+
+static void mqtt_stop(flb_ctx_t *ctx)
+{
+    sleep(3); /* waiting flush */
+
+    flb_stop(ctx);
+    flb_destroy(ctx);
+}
+
+/*
+ * All the packets are sent in small writes, the QoS 1 and 2 packets are
+ * acknowledged with their identifier.
+ */
+void flb_test_mqtt_publish(void)
+{
+    int i;
+    int fd;
+    int len = 0;
+    int ret;
+    int off;
+    int size;
+    unsigned char *buf;
+    unsigned char reply[4];
+    unsigned char pubrel[] = {0x62, 0x02, 0x01, 0x02};
+    unsigned char ping[] = {0xc0, 0x00};
+    char big[300];
+    flb_ctx_t *ctx;
+
+    ctx = mqtt_start("off");
+    fd = mqtt_connect();
+    TEST_CHECK(fd != -1);
+
+    buf = malloc(MQTT_MESSAGES * 64 + 512);
+    for (i = 0; i < MQTT_MESSAGES; i++) {
+        len += mqtt_publish(buf + len, "sensors/a", 0, 0, MQTT_PAYLOAD);
+    }
+
+    /* Larger than the initial connection buffer */
+    memset(big, 'x', sizeof(big));
+    memcpy(big, "{\"k\": \"", 7);
+    memcpy(big + sizeof(big) - 3, "\"}", 3);
+    len += mqtt_publish(buf + len, "sensors/b", 0, 0, big);
+
+    /* Not a map, no record */
+    len += mqtt_publish(buf + len, "sensors/b", 0, 0, "[1, 2]");
+
+    for (off = 0; off < len; off += size) {
+        size = (len - off < 37) ? len - off : 37;
+        ret = write(fd, buf + off, size);
+        TEST_CHECK(ret == size);
+    }
+
+    /* QoS 1 */
+    len = mqtt_publish(buf, "sensors/a", 1, 0x0102, MQTT_PAYLOAD);
+    TEST_CHECK(write(fd, buf, len) == len);
+    ret = mqtt_read(fd, reply, 4);
+    TEST_CHECK(ret == 4 && reply[0] == 0x40 &&
+               reply[2] == 0x01 && reply[3] == 0x02);
+
+    /* QoS 2: PUBREC, then PUBREL is completed with PUBCOMP */
+    len = mqtt_publish(buf, "sensors/a", 2, 0x0102, MQTT_PAYLOAD);
+    TEST_CHECK(write(fd, buf, len) == len);
+    ret = mqtt_read(fd, reply, 4);
+    TEST_CHECK(ret == 4 && reply[0] == 0x50 &&
+               reply[2] == 0x01 && reply[3] == 0x02);
+    TEST_CHECK(write(fd, pubrel, sizeof(pubrel)) == sizeof(pubrel));
+    ret = mqtt_read(fd, reply, 4);
+    TEST_CHECK(ret == 4 && reply[0] == 0x70 &&
+               reply[2] == 0x01 && reply[3] == 0x02);
+
+    TEST_CHECK(write(fd, ping, sizeof(ping)) == sizeof(ping));
+    ret = mqtt_read(fd, reply, 2);
+    TEST_CHECK(ret == 2 && reply[0] == 0xd0 && reply[1] == 0x00);
+
+    free(buf);
+    close(fd);
+
+    mqtt_stop(ctx);
+    TEST_CHECK(result_records == MQTT_MESSAGES + 3);
+    TEST_CHECK(result_tagged == 0);
+}
+
+/* The topics are the tags, packets of both topics are interleaved */
+void flb_test_mqtt_topic_tag(void)
+{
+    int i;
+    int fd;
+    int len = 0;
+    unsigned char *buf;
+    flb_ctx_t *ctx;
+
+    ctx = mqtt_start("on");
+    fd = mqtt_connect();
+    TEST_CHECK(fd != -1);
+
+    buf = malloc(MQTT_MESSAGES * 64);
+    for (i = 0; i < MQTT_MESSAGES; i++) {
+        len += mqtt_publish(buf + len, (i % 3) ? "sensors/a" : "sensors/b",
+                            0, 0, MQTT_PAYLOAD);
+    }
+    TEST_CHECK(write(fd, buf, len) == len);
+    free(buf);
+    close(fd);
+
+    mqtt_stop(ctx);
+    TEST_CHECK(result_records == MQTT_MESSAGES);
+    TEST_CHECK(result_tagged == MQTT_MESSAGES - (MQTT_MESSAGES + 2) / 3);
+}
@@ -18,9 +18,12 @@
  */
 
 #include <fluent-bit.h>
+#include <fluent-bit/flb_lib.h>
 #include <pthread.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
 #include "flb_tests_runtime.h"
 
 /* Test data */
@@ -28,11 +31,13 @@
 /* Test functions */
 void flb_test_in_proc_selfcheck(void);
 void flb_test_in_proc_absent_process(void);
+void flb_test_in_proc_pattern(void);
 
 /* Test list */
 TEST_LIST = {
     {"selfcheck",       flb_test_in_proc_selfcheck      },
     {"absent_process",  flb_test_in_proc_absent_process },
+    {"pattern",         flb_test_in_proc_pattern        },
     {NULL, NULL}
 };
 
@@ -150,3 +155,78 @@ void flb_test_in_proc_absent_process(void)
     flb_stop(ctx);
     flb_destroy(ctx);
 }
+
+#define PROC_CHILDREN 3
+
+static int result_records;
+
+static int cb_count(void *record, size_t size, void *data)
+{
+    struct flb_lib_chunk *chunk = record;
+
+    pthread_mutex_lock(&result_mutex);
+    if (chunk->records > result_records) {
+        result_records = chunk->records;
+    }
+    pthread_mutex_unlock(&result_mutex);
+
+    flb_lib_free(chunk);
+    return 0;
+}
+
+/* Every process matching the pattern is reported on each interval */
+void flb_test_in_proc_pattern(void)
+{
+    int i;
+    int ret;
+    int in_ffd;
+    int out_ffd;
+    pid_t children[PROC_CHILDREN];
+    flb_ctx_t *ctx;
+    struct flb_lib_out_cb cb;
+
+    cb.cb   = cb_count;
+    cb.data = NULL;
+
+    for (i = 0; i < PROC_CHILDREN; i++) {
+        children[i] = fork();
+        if (children[i] == 0) {
+            execlp("sleep", "sleep", "30", NULL);
+            _exit(1);
+        }
+        TEST_CHECK(children[i] > 0);
+    }
+
+    pthread_mutex_init(&result_mutex, NULL);
+    result_records = 0;
+
+    ctx = flb_create();
+
+    in_ffd = flb_input(ctx, (char *) "proc", NULL);
+    TEST_CHECK(in_ffd >= 0);
+    flb_input_set(ctx, in_ffd, "tag", "test",
+                  "interval_sec", "1", "proc_name", "sl?ep",
+                  "mem", "on", "fd", "on", NULL);
+
+    out_ffd = flb_output(ctx, (char *) "lib", &cb);
+    TEST_CHECK(out_ffd >= 0);
+    flb_output_set(ctx, out_ffd, "match", "test", "format", "chunk", NULL);
+
+    flb_service_set(ctx, "Flush", "3", NULL);
+
+    ret = flb_start(ctx);
+    TEST_CHECK(ret == 0);
+
+    sleep(4);
+    flb_stop(ctx);
+    flb_destroy(ctx);
+
+    for (i = 0; i < PROC_CHILDREN; i++) {
+        kill(children[i], SIGKILL);
+        waitpid(children[i], NULL, 0);
+    }
+
+    /* One interval at least, every child has its own record */
+    TEST_CHECK(result_records >= PROC_CHILDREN);
+    pthread_mutex_destroy(&result_mutex);
+}
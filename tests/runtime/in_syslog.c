@@ -0,0 +1,277 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <fluent-bit.h>
+#include <fluent-bit/flb_lib.h>
+#include <fluent-bit/flb_parser.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "flb_tests_runtime.h"
+
+#define UDP_PORT      5182
+#define UDP_SENDERS   4
+#define UDP_MESSAGES  500
+#define TCP_PORT      5183
+#define TCP_MESSAGES  1000
+#define TCP_SD        "[id@1 k=\"v\\]\"]"
+
+/* Test functions */
+void flb_test_syslog_udp(void);
+void flb_test_syslog_udp_workers(void);
+void flb_test_syslog_tcp_framing(void);
+
+/* Test list */
+TEST_LIST = {
+    {"udp",         flb_test_syslog_udp         },
+    {"udp_workers", flb_test_syslog_udp_workers },
+    {"tcp_framing", flb_test_syslog_tcp_framing },
+    {NULL, NULL}
+};
+
+static pthread_mutex_t result_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int result_records;
+static int result_sd;
+
+static int has_sd(char *buf, size_t size)
+{
+    size_t i;
+    size_t len = sizeof(TCP_SD) - 1;
+
+    for (i = 0; i + len <= size; i++) {
+        if (memcmp(buf + i, TCP_SD, len) == 0) {
+            return FLB_TRUE;
+        }
+    }
+    return FLB_FALSE;
+}
+
+static int cb_count(void *record, size_t size, void *data)
+{
+    struct flb_lib_chunk *chunk = record;
+
+    pthread_mutex_lock(&result_mutex);
+    result_records += chunk->records;
+    if (has_sd(chunk->data, chunk->size)) {
+        result_sd++;
+    }
+    pthread_mutex_unlock(&result_mutex);
+
+    flb_lib_free(chunk);
+    return 0;
+}
+
+/* Send the messages from a few sockets, the kernel may spread them */
+static int udp_send(int messages)
+{
+    int i;
+    int len;
+    int ret;
+    int sent = 0;
+    int fd[UDP_SENDERS];
+    char buf[128];
+    struct sockaddr_in addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(UDP_PORT);
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+
+    for (i = 0; i < UDP_SENDERS; i++) {
+        fd[i] = socket(AF_INET, SOCK_DGRAM, 0);
+        if (fd[i] == -1) {
+            return -1;
+        }
+    }
+
+    for (i = 0; i < messages; i++) {
+        len = snprintf(buf, sizeof(buf), "<34>host app: message %d\n", i);
+        ret = sendto(fd[i % UDP_SENDERS], buf, len, 0,
+                     (struct sockaddr *) &addr, sizeof(addr));
+        if (ret != len) {
+            break;
+        }
+        sent++;
+
+        /* Stay below the socket receive buffer */
+        if (i % 100 == 99) {
+            usleep(10000);
+        }
+    }
+
+    for (i = 0; i < UDP_SENDERS; i++) {
+        close(fd[i]);
+    }
+
+    return (sent == messages) ? 0 : -1;
+}
+
+static void syslog_udp_run(char *workers)
+{
+    int ret;
+    int in_ffd;
+    int out_ffd;
+    char port[16];
+    flb_ctx_t *ctx;
+    struct flb_parser *parser;
+    struct flb_lib_out_cb cb_data;
+
+    cb_data.cb = cb_count;
+    cb_data.data = NULL;
+
+    pthread_mutex_lock(&result_mutex);
+    result_records = 0;
+    pthread_mutex_unlock(&result_mutex);
+
+    ctx = flb_create();
+
+    parser = flb_parser_create("syslog_test", "regex",
+                               "^<(?<pri>[0-9]+)>(?<host>[^ ]*) "
+                               "(?<ident>[^:]*): (?<message>.*)$",
+                               NULL, NULL, NULL, MK_FALSE, NULL, 0,
+                               NULL, ctx->config);
+    TEST_CHECK(parser != NULL);
+
+    snprintf(port, sizeof(port), "%d", UDP_PORT);
+    in_ffd = flb_input(ctx, (char *) "syslog", NULL);
+    TEST_CHECK(in_ffd >= 0);
+    flb_input_set(ctx, in_ffd, "tag", "test", "mode", "udp",
+                  "listen", "127.0.0.1", "port", port,
+                  "parser", "syslog_test", "workers", workers,
+                  "receive_buffer_size", "1M", NULL);
+
+    out_ffd = flb_output(ctx, (char *) "lib", &cb_data);
+    TEST_CHECK(out_ffd >= 0);
+    flb_output_set(ctx, out_ffd, "match", "test", "format", "chunk", NULL);
+
+    flb_service_set(ctx, "Flush", "1", NULL);
+
+    ret = flb_start(ctx);
+    TEST_CHECK(ret == 0);
+
+    ret = udp_send(UDP_MESSAGES);
+    TEST_CHECK(ret == 0);
+
+    sleep(3); /* waiting flush */
+
+    flb_stop(ctx);
+    flb_destroy(ctx);
+}
+
+void flb_test_syslog_udp(void)
+{
+    syslog_udp_run("0");
+    TEST_CHECK(result_records == UDP_MESSAGES);
+}
+
+void flb_test_syslog_udp_workers(void)
+{
+    syslog_udp_run("2");
+    TEST_CHECK(result_records == UDP_MESSAGES);
+}
+
+/*
+ * Send RFC5424 messages over TCP, one out of two prefixed by its length
+ * (octet counting) and the others terminated by a new line, in small
+ * writes that split the messages.
+ */
+static int tcp_send(int messages)
+{
+    int i;
+    int fd;
+    int len;
+    int ret;
+    int off;
+    char msg[256];
+    char buf[300];
+    struct sockaddr_in addr;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) {
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(TCP_PORT);
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    ret = connect(fd, (struct sockaddr *) &addr, sizeof(addr));
+    if (ret == -1) {
+        close(fd);
+        return -1;
+    }
+
+    for (i = 0; i < messages; i++) {
+        len = snprintf(msg, sizeof(msg),
+                       "<34>1 2026-10-11T22:14:15.003Z host app %d ID47 "
+                       TCP_SD " message %d", i, i);
+        if (i % 2) {
+            len = snprintf(buf, sizeof(buf), "%d %s", len, msg);
+        }
+        else {
+            len = snprintf(buf, sizeof(buf), "%s\n", msg);
+        }
+
+        for (off = 0; off < len; off += ret) {
+            ret = write(fd, buf + off, (len - off) < 37 ? (len - off) : 37);
+            if (ret <= 0) {
+                close(fd);
+                return -1;
+            }
+        }
+    }
+
+    close(fd);
+    return 0;
+}
+
+void flb_test_syslog_tcp_framing(void)
+{
+    int ret;
+    int in_ffd;
+    int out_ffd;
+    char port[16];
+    flb_ctx_t *ctx;
+    struct flb_lib_out_cb cb_data;
+
+    cb_data.cb = cb_count;
+    cb_data.data = NULL;
+
+    pthread_mutex_lock(&result_mutex);
+    result_records = 0;
+    result_sd = 0;
+    pthread_mutex_unlock(&result_mutex);
+
+    ctx = flb_create();
+
+    snprintf(port, sizeof(port), "%d", TCP_PORT);
+    in_ffd = flb_input(ctx, (char *) "syslog", NULL);
+    TEST_CHECK(in_ffd >= 0);
+    flb_input_set(ctx, in_ffd, "tag", "test", "mode", "tcp",
+                  "listen", "127.0.0.1", "port", port,
+                  "parser_format", "rfc5424", NULL);
+
+    out_ffd = flb_output(ctx, (char *) "lib", &cb_data);
+    TEST_CHECK(out_ffd >= 0);
+    flb_output_set(ctx, out_ffd, "match", "test", "format", "chunk", NULL);
+
+    flb_service_set(ctx, "Flush", "1", NULL);
+
+    ret = flb_start(ctx);
+    TEST_CHECK(ret == 0);
+
+    ret = tcp_send(TCP_MESSAGES);
+    TEST_CHECK(ret == 0);
+
+    sleep(3); /* waiting flush */
+
+    flb_stop(ctx);
+    flb_destroy(ctx);
+
+    /* the structured data is kept as a whole */
+    TEST_CHECK(result_records == TCP_MESSAGES);
+    TEST_CHECK(result_sd > 0);
+}
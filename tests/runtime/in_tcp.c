@@ -0,0 +1,165 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <fluent-bit.h>
+#include <fluent-bit/flb_lib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "flb_tests_runtime.h"
+
+#define TCP_PORT     5181
+#define TCP_CLIENTS  8
+#define TCP_RECORDS  500
+
+/* Test functions */
+void flb_test_tcp_workers(void);
+void flb_test_tcp_ndjson(void);
+void flb_test_tcp_none(void);
+void flb_test_tcp_pushdown(void);
+
+/* Test list */
+TEST_LIST = {
+    {"workers", flb_test_tcp_workers },
+    {"ndjson",  flb_test_tcp_ndjson  },
+    {"none",    flb_test_tcp_none    },
+    {"pushdown", flb_test_tcp_pushdown },
+    {NULL, NULL}
+};
+
+static pthread_mutex_t result_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int result_records;
+
+static int cb_count(void *record, size_t size, void *data)
+{
+    struct flb_lib_chunk *chunk = record;
+
+    pthread_mutex_lock(&result_mutex);
+    result_records += chunk->records;
+    pthread_mutex_unlock(&result_mutex);
+
+    flb_lib_free(chunk);
+    return 0;
+}
+
+static int tcp_send(int records)
+{
+    int i;
+    int fd;
+    int len;
+    int ret;
+    char buf[64];
+    struct sockaddr_in addr;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) {
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(TCP_PORT);
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    ret = connect(fd, (struct sockaddr *) &addr, sizeof(addr));
+    if (ret == -1) {
+        close(fd);
+        return -1;
+    }
+
+    for (i = 0; i < records; i++) {
+        len = snprintf(buf, sizeof(buf), "{\"n\": %d}\n", i);
+        if (write(fd, buf, len) != len) {
+            close(fd);
+            return -1;
+        }
+    }
+
+    close(fd);
+    return 0;
+}
+
+static void tcp_run(char *format, char *workers, char *exclude)
+{
+    int i;
+    int ret;
+    int in_ffd;
+    int out_ffd;
+    int filter_ffd;
+    char port[16];
+    flb_ctx_t *ctx;
+    struct flb_lib_out_cb cb_data;
+
+    cb_data.cb = cb_count;
+    cb_data.data = NULL;
+
+    pthread_mutex_lock(&result_mutex);
+    result_records = 0;
+    pthread_mutex_unlock(&result_mutex);
+
+    ctx = flb_create();
+
+    snprintf(port, sizeof(port), "%d", TCP_PORT);
+    in_ffd = flb_input(ctx, (char *) "tcp", NULL);
+    TEST_CHECK(in_ffd >= 0);
+    flb_input_set(ctx, in_ffd, "tag", "test", "port", port,
+                  "listen", "127.0.0.1", "format", format,
+                  "workers", workers, NULL);
+
+    out_ffd = flb_output(ctx, (char *) "lib", &cb_data);
+    TEST_CHECK(out_ffd >= 0);
+    flb_output_set(ctx, out_ffd, "match", "test", "format", "chunk", NULL);
+
+    if (exclude) {
+        filter_ffd = flb_filter(ctx, (char *) "grep", NULL);
+        TEST_CHECK(filter_ffd >= 0);
+        flb_filter_set(ctx, filter_ffd, "match", "test",
+                       "exclude", exclude, NULL);
+    }
+
+    flb_service_set(ctx, "Flush", "1", NULL);
+
+    ret = flb_start(ctx);
+    TEST_CHECK(ret == 0);
+
+    for (i = 0; i < TCP_CLIENTS; i++) {
+        ret = tcp_send(TCP_RECORDS);
+        TEST_CHECK(ret == 0);
+    }
+
+    sleep(3); /* waiting flush */
+
+    flb_stop(ctx);
+    flb_destroy(ctx);
+}
+
+void flb_test_tcp_workers(void)
+{
+    /* Connections are spread across the workers */
+    tcp_run("json", "4", NULL);
+    TEST_CHECK(result_records == TCP_CLIENTS * TCP_RECORDS);
+}
+
+void flb_test_tcp_ndjson(void)
+{
+    tcp_run("ndjson", "0", NULL);
+    TEST_CHECK(result_records == TCP_CLIENTS * TCP_RECORDS);
+
+    tcp_run("ndjson", "2", NULL);
+    TEST_CHECK(result_records == TCP_CLIENTS * TCP_RECORDS);
+}
+
+void flb_test_tcp_none(void)
+{
+    tcp_run("none", "0", NULL);
+    TEST_CHECK(result_records == TCP_CLIENTS * TCP_RECORDS);
+}
+
+/* Lines the grep filter excludes are discarded by the input */
+void flb_test_tcp_pushdown(void)
+{
+    tcp_run("none", "0", "log 5}$");
+    TEST_CHECK(result_records == TCP_CLIENTS * TCP_RECORDS * 9 / 10);
+}
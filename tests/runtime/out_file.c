@@ -1,8 +1,11 @@
 /* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
 
 #include <fluent-bit.h>
+#include <fluent-bit/flb_gzip.h>
 #include "flb_tests_runtime.h"
 
+#include <glob.h>
+
 /* Test data */
 #include "data/common/json_invalid.h" /* JSON_INVALID */
 #include "data/common/json_long.h"    /* JSON_LONG    */
@@ -15,6 +18,8 @@ void flb_test_file_json_small(void);
 void flb_test_file_format_csv(void);
 void flb_test_file_format_ltsv(void);
 void flb_test_file_format_invalid(void);
+void flb_test_file_rotate_size(void);
+void flb_test_file_format_parquet(void);
 
 /* Test list */
 TEST_LIST = {
@@ -24,6 +29,8 @@ TEST_LIST = {
     {"format_csv",      flb_test_file_format_csv     },
     {"format_ltsv",     flb_test_file_format_ltsv    },
     {"format_invalid",  flb_test_file_format_invalid },
+    {"rotate_size",     flb_test_file_rotate_size    },
+    {"format_parquet",  flb_test_file_format_parquet },
     {NULL, NULL}
 };
 
@@ -306,3 +313,534 @@ void flb_test_file_format_invalid(void)
         remove(TEST_LOGFILE);
     }
 }
+
+/* Every flush after the first one moves the file aside */
+void flb_test_file_rotate_size(void)
+{
+    int i;
+    int ret;
+    int bytes;
+    flb_ctx_t *ctx;
+    int in_ffd;
+    int out_ffd;
+    glob_t gl;
+
+    remove(TEST_LOGFILE);
+
+    ctx = flb_create();
+    flb_service_set(ctx, "Flush", "1", NULL);
+
+    in_ffd = flb_input(ctx, (char *) "lib", NULL);
+    TEST_CHECK(in_ffd >= 0);
+    flb_input_set(ctx, in_ffd, "tag", "test", NULL);
+
+    out_ffd = flb_output(ctx, (char *) "file", NULL);
+    TEST_CHECK(out_ffd >= 0);
+    flb_output_set(ctx, out_ffd, "match", "test", NULL);
+    flb_output_set(ctx, out_ffd, "Path", TEST_LOGFILE, NULL);
+    flb_output_set(ctx, out_ffd, "rotate_size", "16", NULL);
+
+    ret = flb_start(ctx);
+    TEST_CHECK(ret == 0);
+
+    for (i = 0; i < 2; i++) {
+        bytes = flb_lib_push(ctx, in_ffd, (char *) JSON_SMALL,
+                             sizeof(JSON_SMALL) - 1);
+        TEST_CHECK(bytes == sizeof(JSON_SMALL) - 1);
+        sleep(2); /* waiting flush */
+    }
+
+    flb_stop(ctx);
+    flb_destroy(ctx);
+
+    ret = glob(TEST_LOGFILE ".*", 0, NULL, &gl);
+    TEST_CHECK(ret == 0 && gl.gl_pathc == 1);
+    if (ret == 0) {
+        for (i = 0; i < gl.gl_pathc; i++) {
+            remove(gl.gl_pathv[i]);
+        }
+        globfree(&gl);
+    }
+    TEST_CHECK(access(TEST_LOGFILE, F_OK) == 0);
+    remove(TEST_LOGFILE);
+}
+
+/*
+ * Parquet reader for the test: the footer is Thrift compact protocol,
+ * only the fields checked below are decoded and the others are skipped.
+ */
+struct tc_reader {
+    unsigned char *p;
+    unsigned char *end;
+    int error;
+};
+
+#define PQ_NAMES     8
+#define PQ_NAME_LEN  32
+
+struct pq_meta {
+    int64_t rows;
+    int names_num;
+    char names[PQ_NAMES][PQ_NAME_LEN];     /* schema, the root first */
+    int chunks_num;
+    char paths[PQ_NAMES][PQ_NAME_LEN];     /* column of each chunk */
+    int codecs[PQ_NAMES];
+    int64_t offsets[PQ_NAMES];             /* its data page */
+};
+
+static uint64_t tc_varint(struct tc_reader *r)
+{
+    int shift = 0;
+    uint64_t v = 0;
+
+    while (r->p < r->end && shift < 64) {
+        v |= (uint64_t) (*r->p & 0x7f) << shift;
+        if ((*r->p++ & 0x80) == 0) {
+            return v;
+        }
+        shift += 7;
+    }
+    r->error = 1;
+    return 0;
+}
+
+static int64_t tc_int(struct tc_reader *r)
+{
+    uint64_t v = tc_varint(r);
+
+    return (int64_t) (v >> 1) ^ -(int64_t) (v & 1);
+}
+
+static int tc_binary(struct tc_reader *r, char *out, int size)
+{
+    uint64_t len = tc_varint(r);
+
+    if (len > r->end - r->p) {
+        r->error = 1;
+        return -1;
+    }
+    if (out) {
+        snprintf(out, size, "%.*s", (int) len, r->p);
+    }
+    r->p += len;
+    return len;
+}
+
+static int tc_list(struct tc_reader *r, int *type)
+{
+    int size;
+
+    if (r->p >= r->end) {
+        r->error = 1;
+        return 0;
+    }
+    size = *r->p >> 4;
+    *type = *r->p++ & 0x0f;
+    if (size == 15) {
+        size = tc_varint(r);
+    }
+    return size;
+}
+
+static void tc_skip(struct tc_reader *r, int type);
+
+/* Read a struct, 'cb' decodes a field or returns -1 to skip it */
+static void tc_struct(struct tc_reader *r,
+                      int (*cb)(struct tc_reader *, int, int, void *),
+                      void *data)
+{
+    int id = 0;
+    int type;
+    int delta;
+
+    while (!r->error && r->p < r->end) {
+        delta = *r->p >> 4;
+        type = *r->p++ & 0x0f;
+        if (type == 0) {
+            return;
+        }
+        id = delta ? id + delta : tc_int(r);
+        if (!cb || cb(r, id, type, data) == -1) {
+            tc_skip(r, type);
+        }
+    }
+    r->error = 1;
+}
+
+static void tc_skip(struct tc_reader *r, int type)
+{
+    int i;
+    int n;
+    int elem;
+
+    switch (type) {
+    case 1: /* bool true, bool false */
+    case 2:
+        break;
+    case 3:
+        r->p++;
+        break;
+    case 4: /* i16, i32, i64 */
+    case 5:
+    case 6:
+        tc_varint(r);
+        break;
+    case 7:
+        r->p += 8;
+        break;
+    case 8:
+        tc_binary(r, NULL, 0);
+        break;
+    case 9: /* list, set */
+    case 10:
+        n = tc_list(r, &elem);
+        for (i = 0; i < n && !r->error; i++) {
+            tc_skip(r, elem);
+        }
+        break;
+    case 12:
+        tc_struct(r, NULL, NULL);
+        break;
+    default:
+        r->error = 1;
+    }
+}
+
+static int pq_schema_element(struct tc_reader *r, int id, int type, void *data)
+{
+    struct pq_meta *m = data;
+
+    if (id != 4 || m->names_num == PQ_NAMES) {
+        return -1;
+    }
+    tc_binary(r, m->names[m->names_num], PQ_NAME_LEN);
+    return 0;
+}
+
+static int pq_column_meta(struct tc_reader *r, int id, int type, void *data)
+{
+    int n;
+    int elem;
+    struct pq_meta *m = data;
+
+    if (id == 3) {
+        n = tc_list(r, &elem);
+        if (n > 0) {
+            tc_binary(r, m->paths[m->chunks_num], PQ_NAME_LEN);
+            while (--n > 0) {
+                tc_skip(r, elem);
+            }
+        }
+        return 0;
+    }
+    else if (id == 4) {
+        m->codecs[m->chunks_num] = tc_int(r);
+        return 0;
+    }
+    else if (id == 9) {
+        m->offsets[m->chunks_num] = tc_int(r);
+        return 0;
+    }
+    return -1;
+}
+
+static int pq_column_chunk(struct tc_reader *r, int id, int type, void *data)
+{
+    if (id != 3) {
+        return -1;
+    }
+    tc_struct(r, pq_column_meta, data);
+    return 0;
+}
+
+static int pq_row_group(struct tc_reader *r, int id, int type, void *data)
+{
+    int i;
+    int n;
+    int elem;
+    struct pq_meta *m = data;
+
+    if (id != 1) {
+        return -1;
+    }
+    n = tc_list(r, &elem);
+    for (i = 0; i < n && m->chunks_num < PQ_NAMES; i++) {
+        tc_struct(r, pq_column_chunk, m);
+        m->chunks_num++;
+    }
+    return 0;
+}
+
+static int pq_file_meta(struct tc_reader *r, int id, int type, void *data)
+{
+    int i;
+    int n;
+    int elem;
+    struct pq_meta *m = data;
+
+    if (id == 2) {
+        n = tc_list(r, &elem);
+        for (i = 0; i < n; i++) {
+            tc_struct(r, pq_schema_element, m);
+            if (m->names_num < PQ_NAMES) {
+                m->names_num++;
+            }
+        }
+        return 0;
+    }
+    else if (id == 3) {
+        m->rows = tc_int(r);
+        return 0;
+    }
+    else if (id == 4) {
+        n = tc_list(r, &elem);
+        for (i = 0; i < n; i++) {
+            tc_struct(r, pq_row_group, m);
+        }
+        return 0;
+    }
+    return -1;
+}
+
+/* Parse the FileMetaData of the footer, returns the footer offset */
+static long pq_footer(char *buf, long size, struct pq_meta *m)
+{
+    uint32_t len;
+    unsigned char *p;
+    struct tc_reader r;
+
+    if (size < 12) {
+        return -1;
+    }
+    p = (unsigned char *) buf + size - 8;
+    len = p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+    if (len > size - 12) {
+        return -1;
+    }
+
+    memset(m, 0, sizeof(struct pq_meta));
+    r.p = p - len;
+    r.end = p;
+    r.error = 0;
+    tc_struct(&r, pq_file_meta, m);
+    if (r.error || r.p != r.end) {
+        return -1;
+    }
+
+    return size - 8 - len;
+}
+
+/* Sizes of a PageHeader */
+static int pq_page_header(struct tc_reader *r, int id, int type, void *data)
+{
+    int64_t *sizes = data;
+
+    if (id != 2 && id != 3) {
+        return -1;
+    }
+    sizes[id - 2] = tc_int(r);
+    return 0;
+}
+
+/* Uncompressed content of the gzip data page at 'offset' */
+static unsigned char *pq_page(char *buf, long size, int64_t offset,
+                              size_t *len)
+{
+    int ret;
+    int64_t sizes[2] = {0};
+    unsigned char *page;
+    struct tc_reader r;
+    struct flb_gunzip gz;
+
+    if (offset < 4 || offset >= size) {
+        return NULL;
+    }
+    r.p = (unsigned char *) buf + offset;
+    r.end = (unsigned char *) buf + size;
+    r.error = 0;
+    tc_struct(&r, pq_page_header, sizes);
+    if (r.error || sizes[0] <= 0 || sizes[1] <= 0 ||
+        sizes[1] > r.end - r.p) {
+        return NULL;
+    }
+
+    page = malloc(sizes[0]);
+    if (!page) {
+        return NULL;
+    }
+    ret = flb_gunzip_init(&gz, r.p, sizes[1]);
+    if (ret == 0) {
+        ret = flb_gunzip_read(&gz, page, sizes[0], len);
+        flb_gunzip_destroy(&gz);
+    }
+    if (ret != 0) {
+        free(page);
+        return NULL;
+    }
+
+    return page;
+}
+
+static int64_t pq_le64(unsigned char *p)
+{
+    int i;
+    uint64_t v = 0;
+
+    for (i = 7; i >= 0; i--) {
+        v = (v << 8) | p[i];
+    }
+    return (int64_t) v;
+}
+
+static uint32_t pq_le32(unsigned char *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+/* Buffered records are written as a Parquet file on exit */
+void flb_test_file_format_parquet(void)
+{
+    int i;
+    int ret;
+    int bytes;
+    int col;
+    long size;
+    size_t len;
+    long footer;
+    char *buf;
+    char name[16];
+    char record[128];
+    unsigned char *p;
+    unsigned char *page;
+    flb_ctx_t *ctx;
+    int in_ffd;
+    int out_ffd;
+    FILE *fp;
+    glob_t gl;
+    struct pq_meta m;
+    static const size_t page_len[] = {24, 6 + 3 * 11, 6 + 3 * 8};
+
+    ctx = flb_create();
+    flb_service_set(ctx, "Flush", "1", NULL);
+
+    in_ffd = flb_input(ctx, (char *) "lib", NULL);
+    TEST_CHECK(in_ffd >= 0);
+    flb_input_set(ctx, in_ffd, "tag", "test", NULL);
+
+    out_ffd = flb_output(ctx, (char *) "file", NULL);
+    TEST_CHECK(out_ffd >= 0);
+    flb_output_set(ctx, out_ffd, "match", "test", NULL);
+    flb_output_set(ctx, out_ffd, "Path", TEST_LOGFILE, NULL);
+    flb_output_set(ctx, out_ffd, "Format", "parquet", NULL);
+
+    ret = flb_start(ctx);
+    TEST_CHECK(ret == 0);
+
+    for (i = 0; i < 3; i++) {
+        snprintf(record, sizeof(record),
+                 "[%i, {\"msg\": \"hello %i\", \"n\": %i}]",
+                 1448403340 + i, i, (i + 1) * 10);
+        bytes = flb_lib_push(ctx, in_ffd, record, strlen(record));
+        TEST_CHECK(bytes == strlen(record));
+    }
+    sleep(2); /* waiting flush */
+
+    /* Nothing is written until the rotation */
+    TEST_CHECK(glob(TEST_LOGFILE ".*.parquet", 0, NULL, &gl) != 0);
+
+    flb_stop(ctx);
+    flb_destroy(ctx);
+
+    ret = glob(TEST_LOGFILE ".*.parquet", 0, NULL, &gl);
+    TEST_CHECK(ret == 0 && gl.gl_pathc == 1);
+    if (ret != 0) {
+        return;
+    }
+
+    buf = NULL;
+    size = 0;
+    fp = fopen(gl.gl_pathv[0], "r");
+    TEST_CHECK(fp != NULL);
+    if (fp != NULL) {
+        fseek(fp, 0, SEEK_END);
+        size = ftell(fp);
+        fseek(fp, 0, SEEK_SET);
+        buf = malloc(size);
+        TEST_CHECK(buf != NULL && fread(buf, size, 1, fp) == 1);
+        fclose(fp);
+    }
+    remove(gl.gl_pathv[0]);
+    globfree(&gl);
+    if (!buf) {
+        return;
+    }
+
+    TEST_CHECK(size > 12 && memcmp(buf, "PAR1", 4) == 0 &&
+               memcmp(buf + size - 4, "PAR1", 4) == 0);
+
+    footer = pq_footer(buf, size, &m);
+    TEST_CHECK(footer > 4);
+    TEST_MSG("invalid FileMetaData");
+    if (footer <= 4) {
+        free(buf);
+        return;
+    }
+
+    /* Schema: the root, the time and a column per key */
+    TEST_CHECK(m.rows == 3);
+    TEST_CHECK(m.names_num == 4);
+    TEST_CHECK(strcmp(m.names[0], "schema") == 0);
+    TEST_CHECK(strcmp(m.names[1], "time") == 0);
+    TEST_CHECK(strcmp(m.names[2], "msg") == 0);
+    TEST_CHECK(strcmp(m.names[3], "n") == 0);
+    TEST_CHECK(m.chunks_num == 3);
+
+    for (col = 0; col < m.chunks_num; col++) {
+        TEST_CHECK(strcmp(m.paths[col], m.names[col + 1]) == 0);
+        TEST_CHECK(m.codecs[col] == 2);
+        page = pq_page(buf, footer, m.offsets[col], &len);
+        TEST_CHECK(page != NULL);
+        if (!page) {
+            continue;
+        }
+        p = page;
+
+        /* Values of 8 bytes or "hello N" strings, 2 + 4 bytes of levels */
+        TEST_CHECK(len == page_len[col]);
+        if (len != page_len[col]) {
+            free(page);
+            continue;
+        }
+
+        /* Required: the values only */
+        if (col == 0) {
+            for (i = 0; i < 3; i++) {
+                TEST_CHECK(pq_le64(p + i * 8) ==
+                           (int64_t) (1448403340 + i) * 1000000);
+            }
+            free(page);
+            continue;
+        }
+
+        /* Optional: the definition levels, a single RLE run of 1s */
+        TEST_CHECK(pq_le32(p) == 2 && p[4] == 3 << 1 && p[5] == 1);
+        p += 4 + pq_le32(p);
+
+        for (i = 0; i < 3; i++) {
+            if (col == 1) {
+                snprintf(name, sizeof(name), "hello %i", i);
+                TEST_CHECK(pq_le32(p) == strlen(name) &&
+                           memcmp(p + 4, name, strlen(name)) == 0);
+                p += 4 + pq_le32(p);
+            }
+            else {
+                TEST_CHECK(pq_le64(p) == (i + 1) * 10);
+                p += 8;
+            }
+        }
+        TEST_CHECK(p == page + len);
+        free(page);
+    }
+
+    free(buf);
+}
@@ -1,6 +1,11 @@
 /* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
 
 #include <fluent-bit.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/mman.h>
 #include "flb_tests_runtime.h"
 
 /* Test data */
@@ -8,10 +13,12 @@
 
 /* Test functions */
 void flb_test_fluentd_json_long(void);
+void flb_test_forward_unix_memfd(void);
 
 /* Test list */
 TEST_LIST = {
     {"json_long",       flb_test_fluentd_json_long    },
+    {"unix_memfd",      flb_test_forward_unix_memfd   },
     {NULL, NULL}
 };
 
@@ -43,3 +50,112 @@ void flb_test_fluentd_json_long(void)
     flb_stop(ctx);
     flb_destroy(ctx);
 }
+
+#define TEST_UNIX_PATH "/tmp/flb_test_forward.sock"
+
+/* Accept one connection and read the memory file passed with the mark */
+static int unix_memfd_recv(int server, char *buf, size_t size)
+{
+    int fd = -1;
+    int conn;
+    char mark;
+    char *map;
+    ssize_t ret;
+    struct stat st;
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    char control[CMSG_SPACE(sizeof(int))];
+
+    conn = accept(server, NULL, NULL);
+    if (conn == -1) {
+        return -1;
+    }
+
+    iov.iov_base = &mark;
+    iov.iov_len = 1;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ret = recvmsg(conn, &msg, 0);
+    close(conn);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (ret != 1 || (unsigned char) mark != 0xc1 || !cmsg ||
+        cmsg->cmsg_type != SCM_RIGHTS) {
+        return -1;
+    }
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+
+    if (fstat(fd, &st) == -1 || st.st_size == 0 || st.st_size > size) {
+        close(fd);
+        return -1;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    memcpy(buf, map, st.st_size);
+    munmap(map, st.st_size);
+
+    return st.st_size;
+}
+
+/* The chunk is passed as a memory file over a unix socket */
+void flb_test_forward_unix_memfd(void)
+{
+    int ret;
+    int len;
+    int server;
+    int in_ffd;
+    int out_ffd;
+    char buf[4096];
+    char *record = "[1, {\"key\":\"value\"}]";
+    flb_ctx_t *ctx;
+    struct timeval tv = {5, 0};
+    struct sockaddr_un addr;
+
+    unlink(TEST_UNIX_PATH);
+    server = socket(AF_UNIX, SOCK_STREAM, 0);
+    TEST_CHECK(server != -1);
+    setsockopt(server, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, TEST_UNIX_PATH);
+    ret = bind(server, (struct sockaddr *) &addr, sizeof(addr));
+    TEST_CHECK(ret == 0);
+    listen(server, 1);
+
+    ctx = flb_create();
+    flb_service_set(ctx, "Flush", "1", NULL);
+
+    in_ffd = flb_input(ctx, (char *) "lib", NULL);
+    TEST_CHECK(in_ffd >= 0);
+    flb_input_set(ctx, in_ffd, "tag", "test", NULL);
+
+    out_ffd = flb_output(ctx, (char *) "forward", NULL);
+    TEST_CHECK(out_ffd >= 0);
+    flb_output_set(ctx, out_ffd, "match", "test",
+                   "unix_path", TEST_UNIX_PATH, "unix_memfd", "on", NULL);
+
+    ret = flb_start(ctx);
+    TEST_CHECK(ret == 0);
+
+    flb_lib_push(ctx, in_ffd, record, strlen(record));
+
+    /* Forward mode: [tag, entries], the tag is a fixstr */
+    len = unix_memfd_recv(server, buf, sizeof(buf));
+    TEST_CHECK(len > 6);
+    if (len > 6) {
+        TEST_CHECK(buf[0] == (char) 0x92 && buf[1] == (char) 0xa4);
+        TEST_CHECK(memcmp(buf + 2, "test", 4) == 0);
+    }
+
+    flb_stop(ctx);
+    flb_destroy(ctx);
+    close(server);
+    unlink(TEST_UNIX_PATH);
+}
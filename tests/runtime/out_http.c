@@ -0,0 +1,472 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#define _GNU_SOURCE
+
+#include <fluent-bit.h>
+#include <msgpack.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "flb_tests_runtime.h"
+
+/* Test functions */
+void flb_test_http_coalesce_window(void);
+void flb_test_http_coalesce_max_size(void);
+void flb_test_http_coalesce_mixed(void);
+void flb_test_http_coalesce_shutdown(void);
+
+/* Test list */
+TEST_LIST = {
+    {"coalesce_window",   flb_test_http_coalesce_window   },
+    {"coalesce_max_size", flb_test_http_coalesce_max_size },
+    {"coalesce_mixed",    flb_test_http_coalesce_mixed    },
+    {"coalesce_shutdown", flb_test_http_coalesce_shutdown },
+    {NULL, NULL}
+};
+
+#define TEST_HTTP_PORT     "28480"
+#define TEST_HTTP_MAX      64
+
+/* Request received by the test server */
+struct http_req {
+    char tag;                     /* first byte of the X-Tag header */
+    int records;
+    int status;
+    double ts;                    /* seconds since the server started */
+};
+
+/*
+ * Minimal HTTP server: it reads one request per connection, counts the
+ * msgpack records of the body and answers 500 to the first 'reject'
+ * requests of tag 'b', 200 otherwise.
+ */
+struct http_server {
+    int fd;
+    int stop;
+    int reject;
+    int count;
+    struct timeval start;
+    struct http_req reqs[TEST_HTTP_MAX];
+    pthread_mutex_t lock;
+    pthread_t tid;
+};
+
+static double elapsed(struct timeval *start)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - start->tv_sec) +
+           (now.tv_usec - start->tv_usec) / 1000000.0;
+}
+
+static int records_count(char *buf, size_t size)
+{
+    int n = 0;
+    size_t off = 0;
+    msgpack_unpacked result;
+
+    msgpack_unpacked_init(&result);
+    while (msgpack_unpack_next(&result, buf, size, &off) ==
+           MSGPACK_UNPACK_SUCCESS) {
+        n++;
+    }
+    msgpack_unpacked_destroy(&result);
+
+    return n;
+}
+
+static void request_serve(struct http_server *s, int conn)
+{
+    int len = 0;
+    int status;
+    int rejected = 0;
+    int i;
+    ssize_t ret;
+    size_t body_len;
+    char *p;
+    char *body;
+    char buf[65536];
+    char tag = 0;
+    char *ok = "HTTP/1.1 200 OK\r\n"
+               "Content-Length: 0\r\nConnection: close\r\n\r\n";
+    char *error = "HTTP/1.1 500 Internal Server Error\r\n"
+                  "Content-Length: 0\r\nConnection: close\r\n\r\n";
+
+    /* Headers */
+    while (1) {
+        ret = recv(conn, buf + len, sizeof(buf) - len - 1, 0);
+        if (ret <= 0) {
+            return;
+        }
+        len += ret;
+        buf[len] = '\0';
+        body = strstr(buf, "\r\n\r\n");
+        if (body) {
+            body += 4;
+            break;
+        }
+        if (len == sizeof(buf) - 1) {
+            return;
+        }
+    }
+
+    p = strcasestr(buf, "Content-Length:");
+    if (!p) {
+        return;
+    }
+    body_len = atol(p + 15);
+    if (body - buf + body_len > sizeof(buf)) {
+        return;
+    }
+
+    /* Body */
+    while (len < body - buf + body_len) {
+        ret = recv(conn, buf + len, sizeof(buf) - len, 0);
+        if (ret <= 0) {
+            return;
+        }
+        len += ret;
+    }
+
+    p = strcasestr(buf, "X-Tag:");
+    if (p) {
+        p += 6;
+        while (*p == ' ') {
+            p++;
+        }
+        tag = *p;
+    }
+
+    pthread_mutex_lock(&s->lock);
+    for (i = 0; i < s->count; i++) {
+        if (s->reqs[i].tag == 'b' && s->reqs[i].status == 500) {
+            rejected++;
+        }
+    }
+    status = (tag == 'b' && rejected < s->reject) ? 500 : 200;
+    if (s->count < TEST_HTTP_MAX) {
+        s->reqs[s->count].tag = tag;
+        s->reqs[s->count].records = records_count(body, body_len);
+        s->reqs[s->count].status = status;
+        s->reqs[s->count].ts = elapsed(&s->start);
+        s->count++;
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    p = (status == 200) ? ok : error;
+    send(conn, p, strlen(p), 0);
+}
+
+static void *server_worker(void *data)
+{
+    int conn;
+    struct pollfd pfd;
+    struct http_server *s = data;
+
+    pfd.fd = s->fd;
+    pfd.events = POLLIN;
+    while (!s->stop) {
+        if (poll(&pfd, 1, 100) <= 0) {
+            continue;
+        }
+        conn = accept(s->fd, NULL, NULL);
+        if (conn == -1) {
+            continue;
+        }
+        request_serve(s, conn);
+        close(conn);
+    }
+
+    return NULL;
+}
+
+static int server_start(struct http_server *s, int reject)
+{
+    int on = 1;
+    struct sockaddr_in addr;
+
+    memset(s, 0, sizeof(struct http_server));
+    s->reject = reject;
+    pthread_mutex_init(&s->lock, NULL);
+    gettimeofday(&s->start, NULL);
+
+    s->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (s->fd == -1) {
+        return -1;
+    }
+    setsockopt(s->fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(atoi(TEST_HTTP_PORT));
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    if (bind(s->fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+        listen(s->fd, 16) == -1) {
+        close(s->fd);
+        return -1;
+    }
+
+    return pthread_create(&s->tid, NULL, server_worker, s);
+}
+
+static void server_stop(struct http_server *s)
+{
+    s->stop = 1;
+    pthread_join(s->tid, NULL);
+    close(s->fd);
+    pthread_mutex_destroy(&s->lock);
+}
+
+/* Records accepted for the tag, 0 matches every request */
+static int server_records(struct http_server *s, char tag)
+{
+    int i;
+    int n = 0;
+
+    pthread_mutex_lock(&s->lock);
+    for (i = 0; i < s->count; i++) {
+        if (s->reqs[i].status == 200 && (tag == 0 || s->reqs[i].tag == tag)) {
+            n += s->reqs[i].records;
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    return n;
+}
+
+/* Wait until 'n' records were accepted or the seconds run out */
+static int server_wait(struct http_server *s, char tag, int n, int seconds)
+{
+    int i;
+
+    for (i = 0; i < seconds * 10; i++) {
+        if (server_records(s, tag) >= n) {
+            return 0;
+        }
+        usleep(100000);
+    }
+
+    return -1;
+}
+
+/* Engine with one lib input per tag, all routed to the coalescing output */
+static flb_ctx_t *coalesce_ctx(char *tags, int *in_ffd,
+                               char *window, char *max_size)
+{
+    int i;
+    int out_ffd;
+    char tag[2] = {0};
+    flb_ctx_t *ctx;
+
+    ctx = flb_create();
+    flb_service_set(ctx, "Flush", "1", "Grace", "5", NULL);
+
+    for (i = 0; tags[i]; i++) {
+        tag[0] = tags[i];
+        in_ffd[i] = flb_input(ctx, (char *) "lib", NULL);
+        TEST_CHECK(in_ffd[i] >= 0);
+        flb_input_set(ctx, in_ffd[i], "tag", tag, NULL);
+    }
+
+    out_ffd = flb_output(ctx, (char *) "http", NULL);
+    TEST_CHECK(out_ffd >= 0);
+    flb_output_set(ctx, out_ffd,
+                   "match", "*",
+                   "host", "127.0.0.1",
+                   "port", TEST_HTTP_PORT,
+                   "format", "msgpack",
+                   "header_tag", "X-Tag",
+                   "coalesce.window", window,
+                   "coalesce.max_size", max_size,
+                   NULL);
+
+    return ctx;
+}
+
+static void push(flb_ctx_t *ctx, int ffd, char *record)
+{
+    int bytes;
+
+    bytes = flb_lib_push(ctx, ffd, record, strlen(record));
+    TEST_CHECK(bytes == strlen(record));
+}
+
+/* Small chunks wait for the window and go out in one request */
+void flb_test_http_coalesce_window(void)
+{
+    int i;
+    int ret;
+    int in_ffd[3];
+    double pushed;
+    flb_ctx_t *ctx;
+    struct http_server s;
+
+    ret = server_start(&s, 0);
+    TEST_CHECK(ret == 0);
+    if (ret != 0) {
+        return;
+    }
+
+    ctx = coalesce_ctx("aaa", in_ffd, "1500", "1M");
+    ret = flb_start(ctx);
+    TEST_CHECK(ret == 0);
+
+    pushed = elapsed(&s.start);
+    for (i = 0; i < 3; i++) {
+        push(ctx, in_ffd[i], "[1, {\"key\":\"value\"}]");
+    }
+
+    ret = server_wait(&s, 0, 3, 10);
+    TEST_CHECK(ret == 0);
+
+    pthread_mutex_lock(&s.lock);
+    TEST_CHECK(s.count == 1);
+    if (s.count > 0) {
+        TEST_CHECK(s.reqs[0].records == 3);
+        TEST_CHECK(s.reqs[0].ts - pushed >= 1.4);
+        TEST_MSG("flushed after %.2f seconds", s.reqs[0].ts - pushed);
+    }
+    pthread_mutex_unlock(&s.lock);
+
+    flb_stop(ctx);
+    flb_destroy(ctx);
+    server_stop(&s);
+}
+
+/* Reaching the size flushes right away, way before the window ends */
+void flb_test_http_coalesce_max_size(void)
+{
+    int i;
+    int ret;
+    int in_ffd[3];
+    char record[700];
+    flb_ctx_t *ctx;
+    struct http_server s;
+
+    ret = server_start(&s, 0);
+    TEST_CHECK(ret == 0);
+    if (ret != 0) {
+        return;
+    }
+
+    /* Each chunk takes more than half the size */
+    ret = snprintf(record, sizeof(record), "[1, {\"key\":\"%0*d\"}]", 600, 0);
+    TEST_CHECK(ret < sizeof(record));
+
+    ctx = coalesce_ctx("aaa", in_ffd, "60000", "1024");
+    ret = flb_start(ctx);
+    TEST_CHECK(ret == 0);
+
+    for (i = 0; i < 3; i++) {
+        push(ctx, in_ffd[i], record);
+    }
+
+    ret = server_wait(&s, 0, 2, 10);
+    TEST_CHECK(ret == 0);
+
+    /* Two chunks reached the size, the third waits for the window */
+    pthread_mutex_lock(&s.lock);
+    TEST_CHECK(s.count == 1);
+    if (s.count > 0) {
+        TEST_CHECK(s.reqs[0].records == 2);
+    }
+    pthread_mutex_unlock(&s.lock);
+
+    /* The shutdown does not wait for it */
+    flb_stop(ctx);
+    flb_destroy(ctx);
+
+    TEST_CHECK(server_records(&s, 0) == 3);
+    server_stop(&s);
+}
+
+/*
+ * Each chunk of a coalesced flush takes its own result: the rejected tag
+ * is retried alone and the accepted one is not sent twice.
+ */
+void flb_test_http_coalesce_mixed(void)
+{
+    int i;
+    int ret;
+    int in_ffd[2];
+    int b_rejected = 0;
+    flb_ctx_t *ctx;
+    struct http_server s;
+
+    ret = server_start(&s, 1);
+    TEST_CHECK(ret == 0);
+    if (ret != 0) {
+        return;
+    }
+
+    ctx = coalesce_ctx("ba", in_ffd, "1500", "1M");
+    ret = flb_start(ctx);
+    TEST_CHECK(ret == 0);
+
+    push(ctx, in_ffd[0], "[1, {\"key\":\"b\"}]");
+    push(ctx, in_ffd[1], "[1, {\"key\":\"a\"}]");
+
+    /* The retry waits up to 10 seconds */
+    ret = server_wait(&s, 'b', 1, 20);
+    TEST_CHECK(ret == 0);
+
+    pthread_mutex_lock(&s.lock);
+    for (i = 0; i < s.count; i++) {
+        if (s.reqs[i].tag == 'b' && s.reqs[i].status == 500) {
+            b_rejected++;
+        }
+    }
+    TEST_CHECK(b_rejected == 1);
+    TEST_CHECK(s.count == 3);
+    pthread_mutex_unlock(&s.lock);
+
+    TEST_CHECK(server_records(&s, 'a') == 1);
+    TEST_CHECK(server_records(&s, 'b') == 1);
+
+    flb_stop(ctx);
+    flb_destroy(ctx);
+    server_stop(&s);
+}
+
+/* Routes waiting for the window are flushed by the shutdown */
+void flb_test_http_coalesce_shutdown(void)
+{
+    int ret;
+    int in_ffd[2];
+    flb_ctx_t *ctx;
+    struct http_server s;
+
+    ret = server_start(&s, 0);
+    TEST_CHECK(ret == 0);
+    if (ret != 0) {
+        return;
+    }
+
+    ctx = coalesce_ctx("aa", in_ffd, "60000", "1M");
+    ret = flb_start(ctx);
+    TEST_CHECK(ret == 0);
+
+    push(ctx, in_ffd[0], "[1, {\"key\":\"value\"}]");
+    push(ctx, in_ffd[1], "[1, {\"key\":\"value\"}]");
+
+    /* Past the flush interval, the tasks are waiting */
+    sleep(2);
+    TEST_CHECK(server_records(&s, 0) == 0);
+
+    flb_stop(ctx);
+    flb_destroy(ctx);
+
+    pthread_mutex_lock(&s.lock);
+    TEST_CHECK(s.count == 1);
+    if (s.count > 0) {
+        TEST_CHECK(s.reqs[0].records == 2);
+    }
+    pthread_mutex_unlock(&s.lock);
+
+    server_stop(&s);
+}
@@ -0,0 +1,227 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <fluent-bit.h>
+#include <fluent-bit/flb_lib.h>
+#include <msgpack.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "flb_tests_runtime.h"
+
+/* Test functions */
+void flb_test_lib_chunk(void);
+void flb_test_lib_msgpack(void);
+void flb_test_lib_push_msgpack(void);
+
+/* Test list */
+TEST_LIST = {
+    {"chunk",        flb_test_lib_chunk        },
+    {"msgpack",      flb_test_lib_msgpack      },
+    {"push_msgpack", flb_test_lib_push_msgpack },
+    {NULL, NULL}
+};
+
+static pthread_mutex_t result_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int result_calls;
+static int result_records;
+static int result_errors;
+
+static void result_reset()
+{
+    pthread_mutex_lock(&result_mutex);
+    result_calls = 0;
+    result_records = 0;
+    result_errors = 0;
+    pthread_mutex_unlock(&result_mutex);
+}
+
+/* Count the records found in a msgpack buffer */
+static int unpack_count(char *buf, size_t size)
+{
+    int n = 0;
+    size_t off = 0;
+    msgpack_unpacked result;
+
+    msgpack_unpacked_init(&result);
+    while (msgpack_unpack_next(&result, buf, size, &off)) {
+        if (result.data.type != MSGPACK_OBJECT_ARRAY ||
+            result.data.via.array.size != 2) {
+            n = -1;
+            break;
+        }
+        n++;
+    }
+    msgpack_unpacked_destroy(&result);
+
+    if (off != size) {
+        return -1;
+    }
+    return n;
+}
+
+static int cb_chunk(void *record, size_t size, void *data)
+{
+    struct flb_lib_chunk *chunk = record;
+
+    pthread_mutex_lock(&result_mutex);
+    result_calls++;
+    result_records += chunk->records;
+    if (size != chunk->size || strcmp(chunk->tag, "test") != 0 ||
+        chunk->tag_len != 4 ||
+        unpack_count(chunk->data, chunk->size) != chunk->records) {
+        result_errors++;
+    }
+    pthread_mutex_unlock(&result_mutex);
+
+    flb_lib_free(chunk);
+    return 0;
+}
+
+static int cb_msgpack(void *record, size_t size, void *data)
+{
+    pthread_mutex_lock(&result_mutex);
+    result_calls++;
+    if (unpack_count(record, size) == 1) {
+        result_records++;
+    }
+    else {
+        result_errors++;
+    }
+    pthread_mutex_unlock(&result_mutex);
+
+    flb_lib_free(record);
+    return 0;
+}
+
+static void lib_run(char *format, int (*cb)(void *, size_t, void *))
+{
+    int i;
+    int ret;
+    int in_ffd;
+    int out_ffd;
+    char p[100];
+    flb_ctx_t *ctx;
+    struct flb_lib_out_cb cb_data;
+
+    cb_data.cb = cb;
+    cb_data.data = NULL;
+
+    ctx = flb_create();
+
+    in_ffd = flb_input(ctx, (char *) "lib", NULL);
+    TEST_CHECK(in_ffd >= 0);
+    flb_input_set(ctx, in_ffd, "tag", "test", NULL);
+
+    out_ffd = flb_output(ctx, (char *) "lib", &cb_data);
+    TEST_CHECK(out_ffd >= 0);
+    flb_output_set(ctx, out_ffd, "match", "test", "format", format, NULL);
+
+    flb_service_set(ctx, "Flush", "1", NULL);
+
+    ret = flb_start(ctx);
+    TEST_CHECK(ret == 0);
+
+    for (i = 0; i < 100; i++) {
+        snprintf(p, sizeof(p), "[%d, {\"key\": \"val %d\"}]", i, i);
+        flb_lib_push(ctx, in_ffd, p, strlen(p));
+    }
+
+    sleep(2); /* waiting flush */
+
+    flb_stop(ctx);
+    flb_destroy(ctx);
+}
+
+void flb_test_lib_chunk(void)
+{
+    result_reset();
+    lib_run("chunk", cb_chunk);
+
+    /* all the records at once, in one or a few chunks */
+    TEST_CHECK(result_records == 100);
+    TEST_CHECK(result_calls >= 1 && result_calls < 100);
+    TEST_CHECK(result_errors == 0);
+}
+
+void flb_test_lib_msgpack(void)
+{
+    result_reset();
+    lib_run("msgpack", cb_msgpack);
+
+    /* one call per record */
+    TEST_CHECK(result_records == 100);
+    TEST_CHECK(result_calls == 100);
+    TEST_CHECK(result_errors == 0);
+}
+
+/* Records pushed as msgpack, copied or handed over as a batch */
+void flb_test_lib_push_msgpack(void)
+{
+    int i;
+    int ret;
+    int in_ffd;
+    int out_ffd;
+    char *buf;
+    flb_ctx_t *ctx;
+    msgpack_sbuffer sbuf;
+    msgpack_packer pck;
+    struct flb_lib_out_cb cb_data;
+
+    result_reset();
+    cb_data.cb = cb_chunk;
+    cb_data.data = NULL;
+
+    ctx = flb_create();
+
+    in_ffd = flb_input(ctx, (char *) "lib", NULL);
+    TEST_CHECK(in_ffd >= 0);
+    flb_input_set(ctx, in_ffd, "tag", "test", NULL);
+
+    out_ffd = flb_output(ctx, (char *) "lib", &cb_data);
+    TEST_CHECK(out_ffd >= 0);
+    flb_output_set(ctx, out_ffd, "match", "test", "format", "chunk", NULL);
+
+    flb_service_set(ctx, "Flush", "1", NULL);
+
+    ret = flb_start(ctx);
+    TEST_CHECK(ret == 0);
+
+    msgpack_sbuffer_init(&sbuf);
+    msgpack_packer_init(&pck, &sbuf, msgpack_sbuffer_write);
+    for (i = 0; i < 10; i++) {
+        msgpack_pack_array(&pck, 2);
+        msgpack_pack_uint32(&pck, 1500000000 + i);
+        msgpack_pack_map(&pck, 1);
+        msgpack_pack_str(&pck, 3);
+        msgpack_pack_str_body(&pck, "key", 3);
+        msgpack_pack_int(&pck, i);
+    }
+
+    /* 50 records copied */
+    for (i = 0; i < 5; i++) {
+        ret = flb_lib_push_msgpack(ctx, in_ffd, sbuf.data, sbuf.size);
+        TEST_CHECK(ret == sbuf.size);
+    }
+
+    /* 50 records given to the engine */
+    for (i = 0; i < 5; i++) {
+        buf = flb_lib_alloc(sbuf.size);
+        memcpy(buf, sbuf.data, sbuf.size);
+        ret = flb_lib_push_batch(ctx, in_ffd, buf, sbuf.size);
+        TEST_CHECK(ret == sbuf.size);
+    }
+
+    /* invalid records are refused */
+    ret = flb_lib_push_msgpack(ctx, in_ffd, sbuf.data, sbuf.size - 1);
+    TEST_CHECK(ret == -1);
+    msgpack_sbuffer_destroy(&sbuf);
+
+    sleep(2); /* waiting flush */
+
+    flb_stop(ctx);
+    flb_destroy(ctx);
+
+    TEST_CHECK(result_records == 100);
+    TEST_CHECK(result_errors == 0);
+}
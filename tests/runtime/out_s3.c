@@ -0,0 +1,83 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <fluent-bit.h>
+#include "flb_tests_runtime.h"
+
+#include <glob.h>
+
+/* Test data */
+#include "data/common/json_small.h"   /* JSON_SMALL   */
+
+/* Test functions */
+void flb_test_s3_store_unreachable(void);
+
+/* Test list */
+TEST_LIST = {
+    {"store_unreachable", flb_test_s3_store_unreachable },
+    {NULL, NULL}
+};
+
+
+#define TEST_STORE_DIR "flb_test_s3_store"
+
+/* The endpoint is down: on exit the buffered part goes to the store */
+void flb_test_s3_store_unreachable(void)
+{
+    int ret;
+    int bytes;
+    size_t i;
+    char line[256];
+    flb_ctx_t *ctx;
+    int in_ffd;
+    int out_ffd;
+    FILE *fp;
+    glob_t gl;
+
+    ctx = flb_create();
+    flb_service_set(ctx, "Flush", "1", NULL);
+
+    in_ffd = flb_input(ctx, (char *) "lib", NULL);
+    TEST_CHECK(in_ffd >= 0);
+    flb_input_set(ctx, in_ffd, "tag", "test", NULL);
+
+    out_ffd = flb_output(ctx, (char *) "s3", NULL);
+    TEST_CHECK(out_ffd >= 0);
+    flb_output_set(ctx, out_ffd, "match", "test", NULL);
+    flb_output_set(ctx, out_ffd, "bucket", "logs", NULL);
+    flb_output_set(ctx, out_ffd, "host", "127.0.0.1", NULL);
+    flb_output_set(ctx, out_ffd, "port", "1", NULL);
+    flb_output_set(ctx, out_ffd, "access_key_id", "AKID", NULL);
+    flb_output_set(ctx, out_ffd, "secret_access_key", "SECRET", NULL);
+    flb_output_set(ctx, out_ffd, "s3_key_format", "/$TAG/%Y/data.gz", NULL);
+    flb_output_set(ctx, out_ffd, "store_dir", TEST_STORE_DIR, NULL);
+
+    ret = flb_start(ctx);
+    TEST_CHECK(ret == 0);
+
+    bytes = flb_lib_push(ctx, in_ffd, (char *) JSON_SMALL,
+                         sizeof(JSON_SMALL) - 1);
+    TEST_CHECK(bytes == sizeof(JSON_SMALL) - 1);
+    sleep(2); /* waiting flush */
+
+    flb_stop(ctx);
+    flb_destroy(ctx);
+
+    ret = glob(TEST_STORE_DIR "/*.part", 0, NULL, &gl);
+    TEST_CHECK(ret == 0 && gl.gl_pathc == 1);
+    if (ret == 0) {
+        fp = fopen(gl.gl_pathv[0], "r");
+        TEST_CHECK(fp != NULL);
+        if (fp != NULL) {
+            TEST_CHECK(fgets(line, sizeof(line), fp) != NULL &&
+                       strncmp(line, "S3PART 1 /test/", 15) == 0);
+            /* gzip member */
+            TEST_CHECK(fgetc(fp) == 0x1f && fgetc(fp) == 0x8b);
+            fclose(fp);
+        }
+        for (i = 0; i < gl.gl_pathc; i++) {
+            remove(gl.gl_pathv[i]);
+        }
+        globfree(&gl);
+    }
+    rmdir(TEST_STORE_DIR);
+}